@@ -33,6 +33,7 @@
 #include <errno.h>
 #include <math.h>
 #include <cairo.h>
+#include <sys/epoll.h>
 #include <sys/wait.h>
 #include <linux/input.h>
 #include <libgen.h>
@@ -45,6 +46,7 @@
 #include "shared/cairo-util.h"
 #include <libweston/config-parser.h>
 #include "shared/helpers.h"
+#include "shared/image-loader.h"
 #include "shared/xalloc.h"
 #include <libweston/zalloc.h>
 #include "shared/file-util.h"
@@ -116,10 +118,16 @@ struct background {
 	struct window *window;
 	struct widget *widget;
 	int painted;
+	int32_t width, height; /**< as configured by the shell plugin */
 
 	char *image;
 	int type;
 	uint32_t color;
+
+	/* The image is decoded once, on a separate thread */
+	cairo_surface_t *image_surface;
+	struct image_load *image_load;
+	struct task image_task;
 };
 
 struct output {
@@ -763,15 +771,7 @@ background_draw(struct widget *widget, void *data)
 	cairo_paint(cr);
 
 	widget_get_allocation(widget, &allocation);
-	image = NULL;
-	if (background->image)
-		image = load_cairo_surface(background->image);
-	else if (background->color == 0) {
-		char *name = file_name_with_datadir("pattern.png");
-
-		image = load_cairo_surface(name);
-		free(name);
-	}
+	image = background->image_surface;
 
 	if (image && background->type != -1) {
 		im_w = cairo_image_surface_get_width(image);
@@ -817,17 +817,70 @@ background_draw(struct widget *widget, void *data)
 
 		cairo_set_source(cr, pattern);
 		cairo_pattern_destroy (pattern);
-		cairo_surface_destroy(image);
 		cairo_mask(cr, pattern);
 	}
 
 	cairo_destroy(cr);
 	cairo_surface_destroy(surface);
 
+	/* Not ready until the image is shown */
+	if (background->image_load)
+		return;
+
 	background->painted = 1;
 	check_desktop_ready(background->window);
 }
 
+/* Backgrounds of a single color are one pixel, and scaled images have the
+ * image size, both stretched to the output by wp_viewport. Saves a buffer
+ * of the output size in every other case. */
+static void
+background_resize(struct background *background)
+{
+	cairo_surface_t *image = background->image_surface;
+	int32_t width = background->width;
+	int32_t height = background->height;
+	int32_t scale = window_get_buffer_scale(background->window);
+	bool solid, stretch = false;
+
+	if (width < 1 || height < 1)
+		return;
+
+	solid = background->type == -1 ||
+		(!image && !background->image_load);
+
+	if (solid) {
+		width = 1;
+		height = 1;
+		stretch = true;
+	} else if (background->type == BACKGROUND_SCALE && !image) {
+		/* Only the color until the image is loaded */
+		width = 1;
+		height = 1;
+		stretch = true;
+	} else if (background->type == BACKGROUND_SCALE &&
+		   (int64_t)cairo_image_surface_get_width(image) *
+		   cairo_image_surface_get_height(image) <
+		   (int64_t)width * height * scale * scale) {
+		/* One image pixel per buffer pixel */
+		width = (cairo_image_surface_get_width(image) + scale - 1) /
+			scale;
+		height = (cairo_image_surface_get_height(image) + scale - 1) /
+			 scale;
+		stretch = true;
+	}
+
+	if (!stretch || widget_set_viewport_destination(background->widget,
+							background->width,
+							background->height) < 0) {
+		widget_set_viewport_destination(background->widget, -1, -1);
+		width = background->width;
+		height = background->height;
+	}
+
+	widget_schedule_resize(background->widget, width, height);
+}
+
 static void
 background_destroy(struct background *background);
 
@@ -849,13 +902,9 @@ background_configure(void *data,
 		return;
 	}
 
-	if (!background->image) {
-		widget_set_viewport_destination(background->widget, width, height);
-		width = 1;
-		height = 1;
-	}
-
-	widget_schedule_resize(background->widget, width, height);
+	background->width = width;
+	background->height = height;
+	background_resize(background);
 }
 
 static void
@@ -1117,9 +1166,60 @@ static const struct weston_desktop_shell_listener listener = {
 	desktop_shell_grab_cursor
 };
 
+static void
+background_image_loaded(struct task *task, uint32_t events)
+{
+	struct background *background =
+		container_of(task, struct background, image_task);
+	struct display *display = window_get_display(background->window);
+
+	display_unwatch_fd(display, image_load_get_fd(background->image_load));
+	background->image_surface =
+		load_cairo_surface_finish(background->image_load);
+	background->image_load = NULL;
+
+	background_resize(background);
+	widget_schedule_redraw(background->widget);
+}
+
+static void
+background_load_image(struct background *background,
+		      struct display *display)
+{
+	char *name;
+
+	if (background->image) {
+		name = xstrdup(background->image);
+	} else if (background->color == 0) {
+		name = file_name_with_datadir("pattern.png");
+	} else {
+		return;
+	}
+
+	background->image_load = load_image_async(name);
+	free(name);
+	if (!background->image_load)
+		return;
+
+	background->image_task.run = background_image_loaded;
+	display_watch_fd(display, image_load_get_fd(background->image_load),
+			 EPOLLIN, &background->image_task);
+}
+
 static void
 background_destroy(struct background *background)
 {
+	struct display *display = window_get_display(background->window);
+
+	if (background->image_load) {
+		display_unwatch_fd(display,
+				   image_load_get_fd(background->image_load));
+		background->image_surface =
+			load_cairo_surface_finish(background->image_load);
+	}
+	if (background->image_surface)
+		cairo_surface_destroy(background->image_surface);
+
 	widget_destroy(background->widget);
 	window_destroy(background->window);
 
@@ -1172,6 +1272,8 @@ background_create(struct desktop *desktop, struct output *output)
 
 	free(type);
 
+	background_load_image(background, desktop->display);
+
 	return background;
 }
 
@@ -1282,8 +1384,10 @@ output_handle_scale(void *data,
 
 	if (output->panel)
 		window_set_buffer_scale(output->panel->window, scale);
-	if (output->background)
+	if (output->background) {
 		window_set_buffer_scale(output->background->window, scale);
+		background_resize(output->background);
+	}
 }
 
 static const struct wl_output_listener output_listener = {
@@ -41,6 +41,7 @@
 #include "shared/cairo-util.h"
 #include <libweston/config-parser.h>
 #include "shared/helpers.h"
+#include "shared/image-loader.h"
 #include "shared/os-compatibility.h"
 #include "shared/xalloc.h"
 #include <libweston/zalloc.h>
@@ -167,6 +168,17 @@ hmi_homescreen_setting {
 	int32_t		screen_num;
 };
 
+/* Images decoded in parallel ahead of creating the surfaces, each file only
+ * once */
+struct image_prefetch {
+	char			*filename;
+	struct image_load	*load;
+	cairo_surface_t		*surface;
+	struct wl_list		link;
+};
+
+static struct wl_list image_prefetch_list;
+
 /*****************************************************************************
  *  Event Handler
  ****************************************************************************/
@@ -930,12 +942,78 @@ create_ivisurface(struct wlContextStruct *p_wlCtx,
 	drawImage(p_wlCtx);
 }
 
+static void
+prefetch_image(const char *filename)
+{
+	struct image_prefetch *prefetch;
+
+	if (!filename)
+		return;
+
+	wl_list_for_each(prefetch, &image_prefetch_list, link) {
+		if (strcmp(prefetch->filename, filename) == 0)
+			return;
+	}
+
+	prefetch = xzalloc(sizeof(*prefetch));
+	prefetch->load = load_image_async(filename);
+	if (!prefetch->load) {
+		free(prefetch);
+		return;
+	}
+	prefetch->filename = xstrdup(filename);
+	wl_list_insert(image_prefetch_list.prev, &prefetch->link);
+}
+
+static cairo_surface_t *
+load_prefetched_cairo_surface(const char *filename)
+{
+	struct image_prefetch *prefetch;
+
+	wl_list_for_each(prefetch, &image_prefetch_list, link) {
+		if (strcmp(prefetch->filename, filename) != 0)
+			continue;
+
+		if (prefetch->load) {
+			prefetch->surface =
+				load_cairo_surface_finish(prefetch->load);
+			prefetch->load = NULL;
+		}
+		if (!prefetch->surface)
+			return NULL;
+
+		return cairo_surface_reference(prefetch->surface);
+	}
+
+	return load_cairo_surface(filename);
+}
+
+static void
+release_prefetched_images(void)
+{
+	struct image_prefetch *prefetch, *tmp;
+
+	wl_list_for_each_safe(prefetch, tmp, &image_prefetch_list, link) {
+		if (prefetch->load)
+			prefetch->surface =
+				load_cairo_surface_finish(prefetch->load);
+		if (prefetch->surface)
+			cairo_surface_destroy(prefetch->surface);
+		wl_list_remove(&prefetch->link);
+		free(prefetch->filename);
+		free(prefetch);
+	}
+}
+
 static void
 create_ivisurfaceFromFile(struct wlContextStruct *p_wlCtx,
 			  uint32_t id_surface,
 			  const char *imageFile)
 {
-	cairo_surface_t *surface = load_cairo_surface(imageFile);
+	cairo_surface_t *surface = NULL;
+
+	if (imageFile)
+		surface = load_prefetched_cairo_surface(imageFile);
 
 	if (NULL == surface) {
 		fprintf(stderr, "Failed to load_cairo_surface %s\n", imageFile);
@@ -1225,10 +1303,23 @@ int main(int argc, char **argv)
 	int ret = 0;
 	struct hmi_homescreen_setting *hmi_setting;
 	struct wlContextStruct *pWlCtxSt = NULL;
+	struct hmi_homescreen_launcher *launcher;
 	int i = 0;
 
 	hmi_setting = hmi_homescreen_setting_create();
 
+	/* start decoding while connecting */
+	wl_list_init(&image_prefetch_list);
+	prefetch_image(hmi_setting->background.filePath);
+	prefetch_image(hmi_setting->panel.filePath);
+	prefetch_image(hmi_setting->tiling.filePath);
+	prefetch_image(hmi_setting->sidebyside.filePath);
+	prefetch_image(hmi_setting->fullscreen.filePath);
+	prefetch_image(hmi_setting->random.filePath);
+	prefetch_image(hmi_setting->home.filePath);
+	wl_list_for_each(launcher, &hmi_setting->launcher_list, link)
+		prefetch_image(launcher->icon);
+
 	memset(&wlCtxCommon, 0x00, sizeof(wlCtxCommon));
 	memset(&wlCtx_Button_1,   0x00, sizeof(wlCtx_Button_1));
 	memset(&wlCtx_Button_2,   0x00, sizeof(wlCtx_Button_2));
@@ -1320,6 +1411,8 @@ int main(int argc, char **argv)
 	create_home_button(&wlCtx_HomeButton, hmi_setting->home.id,
 			   hmi_setting->home.filePath);
 
+	release_prefetched_images();
+
 	UI_ready(wlCtxCommon.hmiCtrl);
 
 	while (ret != -1)
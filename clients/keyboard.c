@@ -268,6 +268,11 @@ struct keyboard {
 	struct widget *widget;
 
 	enum keyboard_state state;
+
+	/* The layout last drawn, and the index of the key held down in it
+	 * or -1 */
+	const struct layout *layout;
+	int pressed;
 };
 
 static void __attribute__ ((format (printf, 1, 2)))
@@ -306,7 +311,8 @@ draw_key(struct keyboard *keyboard,
 	 const struct key *key,
 	 cairo_t *cr,
 	 unsigned int row,
-	 unsigned int col)
+	 unsigned int col,
+	 bool pressed)
 {
 	const char *label;
 	cairo_text_extents_t extents;
@@ -317,6 +323,13 @@ draw_key(struct keyboard *keyboard,
 			key->width * key_width, key_height);
 	cairo_clip(cr);
 
+	if (pressed) {
+		cairo_save(cr);
+		cairo_set_source_rgba(cr, 0.4, 0.4, 0.4, 0.75);
+		cairo_paint(cr);
+		cairo_restore(cr);
+	}
+
 	/* Paint frame */
 	cairo_rectangle(cr,
 			col * key_width, row * key_height,
@@ -355,23 +368,81 @@ get_current_layout(struct virtual_keyboard *keyboard)
 	}
 }
 
+/* Finds the key at x, y relative to the widget, or -1 */
+static int
+key_at(const struct layout *layout, int32_t x, int32_t y)
+{
+	int row, col;
+	unsigned int i;
+
+	row = y / key_height;
+	col = x / key_width + row * layout->columns;
+	for (i = 0; i < layout->count; ++i) {
+		col -= layout->keys[i].width;
+		if (col < 0)
+			return i;
+	}
+
+	return -1;
+}
+
+static void
+key_get_rectangle(struct keyboard *keyboard, const struct layout *layout,
+		  int index, struct rectangle *rect)
+{
+	struct rectangle allocation;
+	unsigned int row = 0, col = 0;
+	int i;
+
+	for (i = 0; i < index; ++i) {
+		col += layout->keys[i].width;
+		if (col >= layout->columns) {
+			row += 1;
+			col = 0;
+		}
+	}
+
+	widget_get_allocation(keyboard->widget, &allocation);
+	rect->x = allocation.x + col * key_width;
+	rect->y = allocation.y + row * key_height;
+	rect->width = layout->keys[index].width * key_width;
+	rect->height = key_height;
+}
+
+static void
+schedule_key_redraw(struct keyboard *keyboard, int index)
+{
+	struct rectangle rect;
+
+	if (index < 0)
+		return;
+
+	key_get_rectangle(keyboard, keyboard->layout, index, &rect);
+	widget_schedule_redraw_rect(keyboard->widget, &rect);
+}
+
 static void
 redraw_handler(struct widget *widget, void *data)
 {
 	struct keyboard *keyboard = data;
-	cairo_surface_t *surface;
 	struct rectangle allocation;
 	cairo_t *cr;
 	unsigned int i;
 	unsigned int row = 0, col = 0;
 	const struct layout *layout;
+	double x1, y1, x2, y2;
 
 	layout = get_current_layout(keyboard->keyboard);
+	if (layout != keyboard->layout) {
+		keyboard->layout = layout;
+		keyboard->pressed = -1;
+	}
 
-	surface = window_get_surface(keyboard->window);
 	widget_get_allocation(keyboard->widget, &allocation);
 
-	cr = cairo_create(surface);
+	/* Clipped to what changed when the toolkit only redraws part of
+	 * the surface */
+	cr = widget_cairo_create(keyboard->widget);
 	cairo_rectangle(cr, allocation.x, allocation.y, allocation.width, allocation.height);
 	cairo_clip(cr);
 
@@ -386,10 +457,17 @@ redraw_handler(struct widget *widget, void *data)
 	cairo_paint(cr);
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+	cairo_clip_extents(cr, &x1, &y1, &x2, &y2);
 
 	for (i = 0; i < layout->count; ++i) {
-		cairo_set_source_rgb(cr, 0, 0, 0);
-		draw_key(keyboard, &layout->keys[i], cr, row, col);
+		/* Skip the text layout of keys outside the clip */
+		if (col * key_width < x2 &&
+		    (col + layout->keys[i].width) * key_width > x1 &&
+		    row * key_height < y2 && (row + 1) * key_height > y1) {
+			cairo_set_source_rgb(cr, 0, 0, 0);
+			draw_key(keyboard, &layout->keys[i], cr, row, col,
+				 (int)i == keyboard->pressed);
+		}
 		col += layout->keys[i].width;
 		if (col >= layout->columns) {
 			row += 1;
@@ -398,7 +476,6 @@ redraw_handler(struct widget *widget, void *data)
 	}
 
 	cairo_destroy(cr);
-	cairo_surface_destroy(surface);
 }
 
 static void
@@ -661,42 +738,64 @@ keyboard_handle_key(struct keyboard *keyboard, uint32_t time, const struct key *
 	}
 }
 
+/* Handles a press or release at x, y relative to the surface. Only the
+ * keys whose highlight changed are redrawn, unless the key switched the
+ * labels or the layout. */
 static void
-button_handler(struct widget *widget,
-	       struct input *input, uint32_t time,
-	       uint32_t button,
-	       enum wl_pointer_button_state state, void *data)
+keyboard_handle_press(struct keyboard *keyboard, struct input *input,
+		      uint32_t time, int32_t x, int32_t y,
+		      enum wl_pointer_button_state state)
 {
-	struct keyboard *keyboard = data;
 	struct rectangle allocation;
-	int32_t x, y;
-	int row, col;
-	unsigned int i;
 	const struct layout *layout;
+	enum keyboard_state old_state = keyboard->state;
+	uint32_t old_style = keyboard->keyboard->preedit_style;
+	int index, released;
 
 	layout = get_current_layout(keyboard->keyboard);
 
-	if (button != BTN_LEFT) {
+	widget_get_allocation(keyboard->widget, &allocation);
+	index = key_at(layout, x - allocation.x, y - allocation.y);
+	if (index >= 0)
+		keyboard_handle_key(keyboard, time, &layout->keys[index],
+				    input, state);
+
+	if (keyboard->state != old_state ||
+	    keyboard->keyboard->preedit_style != old_style ||
+	    layout != keyboard->layout ||
+	    get_current_layout(keyboard->keyboard) != layout) {
+		keyboard->pressed = -1;
+		widget_schedule_redraw(keyboard->widget);
 		return;
 	}
 
-	input_get_position(input, &x, &y);
+	released = keyboard->pressed;
+	if (state == WL_POINTER_BUTTON_STATE_PRESSED)
+		keyboard->pressed = index;
+	else
+		keyboard->pressed = -1;
 
-	widget_get_allocation(keyboard->widget, &allocation);
-	x -= allocation.x;
-	y -= allocation.y;
+	if (released != keyboard->pressed) {
+		schedule_key_redraw(keyboard, released);
+		schedule_key_redraw(keyboard, keyboard->pressed);
+	}
+}
 
-	row = y / key_height;
-	col = x / key_width + row * layout->columns;
-	for (i = 0; i < layout->count; ++i) {
-		col -= layout->keys[i].width;
-		if (col < 0) {
-			keyboard_handle_key(keyboard, time, &layout->keys[i], input, state);
-			break;
-		}
+static void
+button_handler(struct widget *widget,
+	       struct input *input, uint32_t time,
+	       uint32_t button,
+	       enum wl_pointer_button_state state, void *data)
+{
+	struct keyboard *keyboard = data;
+	int32_t x, y;
+
+	if (button != BTN_LEFT) {
+		return;
 	}
 
-	widget_schedule_redraw(widget);
+	input_get_position(input, &x, &y);
+	keyboard_handle_press(keyboard, input, time, x, y, state);
 }
 
 static void
@@ -704,30 +803,8 @@ touch_handler(struct input *input, uint32_t time,
 	      float x, float y, uint32_t state, void *data)
 {
 	struct keyboard *keyboard = data;
-	struct rectangle allocation;
-	int row, col;
-	unsigned int i;
-	const struct layout *layout;
 
-	layout = get_current_layout(keyboard->keyboard);
-
-	widget_get_allocation(keyboard->widget, &allocation);
-
-	x -= allocation.x;
-	y -= allocation.y;
-
-	row = (int)y / key_height;
-	col = (int)x / key_width + row * layout->columns;
-	for (i = 0; i < layout->count; ++i) {
-		col -= layout->keys[i].width;
-		if (col < 0) {
-			keyboard_handle_key(keyboard, time,
-					    &layout->keys[i], input, state);
-			break;
-		}
-	}
-
-	widget_schedule_redraw(keyboard->widget);
+	keyboard_handle_press(keyboard, input, time, x, y, state);
 }
 
 static void
@@ -822,9 +899,14 @@ handle_commit_state(void *data,
 	if (keyboard->surrounding_text)
 		dbg("Surrounding text updated: %s\n", keyboard->surrounding_text);
 
-	window_schedule_resize(keyboard->keyboard->window,
-			       layout->columns * key_width,
-			       layout->rows * key_height);
+	/* Typing commits the state after every key, which only needs the
+	 * redraw the key itself scheduled. */
+	if (layout != keyboard->keyboard->layout) {
+		window_schedule_resize(keyboard->keyboard->window,
+				       layout->columns * key_width,
+				       layout->rows * key_height);
+		widget_schedule_redraw(keyboard->keyboard->widget);
+	}
 
 	zwp_input_method_context_v1_language(context,
 					     keyboard->serial,
@@ -832,8 +914,6 @@ handle_commit_state(void *data,
 	zwp_input_method_context_v1_text_direction(context,
 						   keyboard->serial,
 						   layout->text_direction);
-
-	widget_schedule_redraw(keyboard->keyboard->widget);
 }
 
 static void
@@ -989,6 +1069,7 @@ keyboard_create(struct virtual_keyboard *virtual_keyboard)
 
 	keyboard = xzalloc(sizeof *keyboard);
 	keyboard->keyboard = virtual_keyboard;
+	keyboard->pressed = -1;
 	keyboard->window = window_create_custom(virtual_keyboard->display);
 	keyboard->widget = window_add_widget(keyboard->window, keyboard);
 
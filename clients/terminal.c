@@ -424,6 +424,35 @@ enum escape_state {
 #define ESC_FLAG_DQUOTE	0x20
 #define ESC_FLAG_SPACE	0x40
 
+/* What a cell of the grid looked like when it was last rasterized: the
+ * character and its decoded attributes (see terminal_update_rows()). */
+struct cell_key {
+	union utf8_char ch;
+	uint32_t key;
+};
+
+/* Marks the unfocused cursor outline in the cell key, so that moving it
+ * redraws both rows involved. */
+#define CELL_CURSOR_OUTLINE 0x02
+
+/* Rasterized glyphs, kept as an A8 mask per (character, font) and drawn
+ * with the cell foreground color. */
+#define GLYPH_ATLAS_COLUMNS	32
+#define GLYPH_ATLAS_ROWS	16
+#define GLYPH_ATLAS_HASH_SIZE	1024
+
+struct glyph_atlas {
+	cairo_surface_t *surface;
+	int scale;
+	int slot_width, slot_height;
+	int count;
+	struct {
+		uint32_t ch;
+		int bold;
+		int slot;	/* slot + 1, 0 means unused */
+	} table[GLYPH_ATLAS_HASH_SIZE];
+};
+
 enum {
 	SELECT_NONE,
 	SELECT_CHAR,
@@ -484,6 +513,15 @@ struct terminal {
 	int selection_end_row, selection_end_col;
 	struct wl_list link;
 	int pace_pipe;
+
+	/* The cell grid as last rasterized. Rows are drawn again only when
+	 * they differ from drawn[], and scrolling moves the pixels. */
+	cairo_surface_t *grid;
+	struct cell_key *drawn;
+	char *row_dirty;
+	int drawn_width, drawn_height;
+	int grid_scale, scroll_pending, grid_scroll;
+	struct glyph_atlas atlas;
 };
 
 /* Create default tab stops, every 8 characters */
@@ -637,6 +675,7 @@ terminal_scroll_buffer(struct terminal *terminal, int d)
 	int i;
 
 	terminal->start += d;
+	terminal->scroll_pending += d;
 	if (d < 0) {
 		d = 0 - d;
 		for (i = 0; i < d; i++) {
@@ -973,195 +1012,412 @@ terminal_send_selection(struct terminal *terminal, int fd)
 	fclose(fp);
 }
 
-struct glyph_run {
-	struct terminal *terminal;
-	cairo_t *cr;
-	unsigned int count;
-	union decoded_attr attr;
-	cairo_glyph_t glyphs[256], *g;
-};
+static void
+glyph_atlas_init(struct glyph_atlas *atlas, struct terminal *terminal,
+		 int scale)
+{
+	atlas->scale = scale;
+	atlas->slot_width = 2 * terminal->average_width;
+	atlas->slot_height = terminal->extents.height;
+	atlas->surface =
+		cairo_image_surface_create(CAIRO_FORMAT_A8,
+					   GLYPH_ATLAS_COLUMNS *
+					   atlas->slot_width * scale,
+					   GLYPH_ATLAS_ROWS *
+					   atlas->slot_height * scale);
+	cairo_surface_set_device_scale(atlas->surface, scale, scale);
+	memset(atlas->table, 0, sizeof atlas->table);
+	atlas->count = 0;
+}
 
 static void
-glyph_run_init(struct glyph_run *run, struct terminal *terminal, cairo_t *cr)
+glyph_atlas_release(struct glyph_atlas *atlas)
 {
-	run->terminal = terminal;
-	run->cr = cr;
-	run->g = run->glyphs;
-	run->count = 0;
-	run->attr.key = 0;
+	cairo_surface_destroy(atlas->surface);
 }
 
 static void
-glyph_run_flush(struct glyph_run *run, union decoded_attr attr)
+glyph_atlas_rasterize(struct glyph_atlas *atlas, struct terminal *terminal,
+		      int slot, union utf8_char *c, int bold)
 {
 	cairo_scaled_font_t *font;
+	cairo_glyph_t *glyphs = NULL;
+	cairo_t *cr;
+	int num_glyphs = 0, x, y;
 
-	if (run->count > ARRAY_LENGTH(run->glyphs) - 10 ||
-	    (attr.key != run->attr.key)) {
-		if (run->attr.attr.a & (ATTRMASK_BOLD | ATTRMASK_BLINK))
-			font = run->terminal->font_bold;
-		else
-			font = run->terminal->font_normal;
-		cairo_set_scaled_font(run->cr, font);
-		terminal_set_color(run->terminal, run->cr,
-				   run->attr.attr.fg);
+	font = bold ? terminal->font_bold : terminal->font_normal;
+	x = (slot % GLYPH_ATLAS_COLUMNS) * atlas->slot_width;
+	y = (slot / GLYPH_ATLAS_COLUMNS) * atlas->slot_height;
+
+	cr = cairo_create(atlas->surface);
+	cairo_rectangle(cr, x, y, atlas->slot_width, atlas->slot_height);
+	cairo_clip(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+	cairo_paint(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
 
-		if (!(run->attr.attr.a & ATTRMASK_CONCEALED))
-			cairo_show_glyphs (run->cr, run->glyphs, run->count);
-		run->g = run->glyphs;
-		run->count = 0;
+	cairo_set_scaled_font(cr, font);
+	if (cairo_scaled_font_text_to_glyphs(font, x,
+					     y + terminal->extents.ascent,
+					     (char *) c->byte,
+					     strnlen((char *) c->byte, 4),
+					     &glyphs, &num_glyphs,
+					     NULL, NULL, NULL) ==
+	    CAIRO_STATUS_SUCCESS) {
+		cairo_show_glyphs(cr, glyphs, num_glyphs);
+		cairo_glyph_free(glyphs);
 	}
-	run->attr = attr;
+	cairo_destroy(cr);
 }
 
-static void
-glyph_run_add(struct glyph_run *run, int x, int y, union utf8_char *c)
+/* Returns the atlas slot holding the glyph for c, rasterizing it first if
+ * needed. When the atlas is full, it is emptied and refilled with the
+ * glyphs in use from then on. */
+static int
+glyph_atlas_lookup(struct glyph_atlas *atlas, struct terminal *terminal,
+		   union utf8_char *c, int bold)
 {
-	int num_glyphs;
-	cairo_scaled_font_t *font;
+	uint32_t i;
 
-	num_glyphs = ARRAY_LENGTH(run->glyphs) - run->count;
+	i = (c->ch * 2654435761u + bold) & (GLYPH_ATLAS_HASH_SIZE - 1);
+	while (atlas->table[i].slot) {
+		if (atlas->table[i].ch == c->ch && atlas->table[i].bold == bold)
+			return atlas->table[i].slot - 1;
+		i = (i + 1) & (GLYPH_ATLAS_HASH_SIZE - 1);
+	}
 
-	if (run->attr.attr.a & (ATTRMASK_BOLD | ATTRMASK_BLINK))
-		font = run->terminal->font_bold;
-	else
-		font = run->terminal->font_normal;
+	if (atlas->count == GLYPH_ATLAS_COLUMNS * GLYPH_ATLAS_ROWS) {
+		memset(atlas->table, 0, sizeof atlas->table);
+		atlas->count = 0;
+		return glyph_atlas_lookup(atlas, terminal, c, bold);
+	}
 
-	cairo_move_to(run->cr, x, y);
-	cairo_scaled_font_text_to_glyphs (font, x, y,
-					  (char *) c->byte, 4,
-					  &run->g, &num_glyphs,
-					  NULL, NULL, NULL);
-	run->g += num_glyphs;
-	run->count += num_glyphs;
-}
+	atlas->table[i].ch = c->ch;
+	atlas->table[i].bold = bold;
+	atlas->table[i].slot = ++atlas->count;
+	glyph_atlas_rasterize(atlas, terminal, atlas->count - 1, c, bold);
 
+	return atlas->count - 1;
+}
 
+/* Moves drawn[] and the dirty flags along with a scroll of d rows,
+ * flagging the rows scrolled in. */
 static void
-redraw_handler(struct widget *widget, void *data)
+terminal_shift_drawn(struct terminal *terminal, int d)
 {
-	struct terminal *terminal = data;
-	struct rectangle allocation;
-	cairo_t *cr;
-	int top_margin, side_margin;
-	int row, col, cursor_x, cursor_y;
+	int width = terminal->drawn_width, height = terminal->drawn_height;
+	int n = height - abs(d);
+
+	if (d > 0) {
+		memmove(terminal->drawn, terminal->drawn + d * width,
+			n * width * sizeof *terminal->drawn);
+		memmove(terminal->row_dirty, terminal->row_dirty + d, n);
+		memset(terminal->row_dirty + n, 1, d);
+	} else {
+		memmove(terminal->drawn - d * width, terminal->drawn,
+			n * width * sizeof *terminal->drawn);
+		memmove(terminal->row_dirty - d, terminal->row_dirty, n);
+		memset(terminal->row_dirty, 1, -d);
+	}
+}
+
+/* Compares the grid against drawn[] and flags the rows that changed since
+ * they were last rasterized. Returns true if the grid was scrolled or
+ * resized, in which case every visible row moved. */
+static bool
+terminal_update_rows(struct terminal *terminal)
+{
+	struct cell_key *cells, key;
 	union utf8_char *p_row;
 	union decoded_attr attr;
-	int text_x, text_y;
-	cairo_surface_t *surface;
-	double d;
-	struct glyph_run run;
-	cairo_font_extents_t extents;
-	double average_width;
-	double unichar_width;
+	bool scrolled = false;
+	int row, col, d;
+
+	if (terminal->drawn_width != terminal->width ||
+	    terminal->drawn_height != terminal->height) {
+		free(terminal->drawn);
+		free(terminal->row_dirty);
+		terminal->drawn = xzalloc(terminal->width * terminal->height *
+					  sizeof *terminal->drawn);
+		terminal->row_dirty = xmalloc(terminal->height);
+		memset(terminal->row_dirty, 1, terminal->height);
+		terminal->drawn_width = terminal->width;
+		terminal->drawn_height = terminal->height;
+		terminal->scroll_pending = 0;
+		terminal->grid_scroll = 0;
+		scrolled = true;
+	}
+
+	d = terminal->scroll_pending;
+	terminal->scroll_pending = 0;
+	if (d >= terminal->height || d <= -terminal->height) {
+		memset(terminal->row_dirty, 1, terminal->height);
+		terminal->grid_scroll = terminal->height;
+		scrolled = true;
+	} else if (d != 0) {
+		terminal_shift_drawn(terminal, d);
+		terminal->grid_scroll += d;
+		scrolled = true;
+	}
+
+	for (row = 0; row < terminal->height; row++) {
+		p_row = terminal_get_row(terminal, row);
+		cells = &terminal->drawn[row * terminal->width];
+		for (col = 0; col < terminal->width; col++) {
+			terminal_decode_attr(terminal, row, col, &attr);
+			if ((terminal->mode & MODE_SHOW_CURSOR) &&
+			    !window_has_focus(terminal->window) &&
+			    terminal->row == row && terminal->column == col)
+				attr.attr.s |= CELL_CURSOR_OUTLINE;
+
+			key.ch = p_row[col];
+			key.key = attr.key;
+			if (cells[col].ch.ch != key.ch.ch ||
+			    cells[col].key != key.key) {
+				cells[col] = key;
+				terminal->row_dirty[row] = 1;
+			}
+		}
+	}
+
+	return scrolled;
+}
+
+/* Top-left corner of the cell grid, in the widget's coordinates. */
+static void
+terminal_get_grid_origin(struct terminal *terminal,
+			 const struct rectangle *allocation, int *x, int *y)
+{
+	*x = allocation->x +
+		(allocation->width - terminal->width *
+		 terminal->average_width) / 2;
+	*y = allocation->y +
+		(allocation->height - terminal->height *
+		 terminal->extents.height) / 2;
+}
+
+/* Schedules a redraw of the rows that changed, after terminal_data(). */
+static void
+terminal_schedule_rows(struct terminal *terminal)
+{
+	struct rectangle allocation, damage;
+	int row, first = -1, last = -1, x, y;
+
+	if (terminal_update_rows(terminal)) {
+		widget_schedule_redraw(terminal->widget);
+		return;
+	}
+
+	for (row = 0; row < terminal->height; row++) {
+		if (!terminal->row_dirty[row])
+			continue;
+		if (first < 0)
+			first = row;
+		last = row;
+	}
+	if (first < 0)
+		return;
 
-	surface = window_get_surface(terminal->window);
 	widget_get_allocation(terminal->widget, &allocation);
-	cr = widget_cairo_create(terminal->widget);
-	cairo_rectangle(cr, allocation.x, allocation.y,
-			allocation.width, allocation.height);
-	cairo_clip(cr);
-	cairo_push_group(cr);
+	terminal_get_grid_origin(terminal, &allocation, &x, &y);
+	damage.x = x;
+	damage.y = y + first * terminal->extents.height;
+	damage.width = terminal->width * terminal->average_width;
+	damage.height = (last - first + 1) * terminal->extents.height;
+	widget_schedule_redraw_rect(terminal->widget, &damage);
+}
 
-	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-	terminal_set_color(terminal, cr, terminal->color_scheme->border);
-	cairo_paint(cr);
+/* Moves the rasterized rows by d rows, the way the grid was scrolled. */
+static void
+terminal_blit_grid(struct terminal *terminal, int d)
+{
+	unsigned char *data;
+	int stride, row_size, n;
 
-	cairo_set_scaled_font(cr, terminal->font_normal);
+	cairo_surface_flush(terminal->grid);
+	data = cairo_image_surface_get_data(terminal->grid);
+	stride = cairo_image_surface_get_stride(terminal->grid);
+	row_size = stride * (int) terminal->extents.height *
+		terminal->grid_scale;
+	n = terminal->height - abs(d);
 
-	extents = terminal->extents;
-	average_width = terminal->average_width;
-	side_margin = (allocation.width - terminal->width * average_width) / 2;
-	top_margin = (allocation.height - terminal->height * extents.height) / 2;
+	if (d > 0)
+		memmove(data, data + d * row_size, n * row_size);
+	else
+		memmove(data - d * row_size, data, n * row_size);
+	cairo_surface_mark_dirty(terminal->grid);
+}
+
+static void
+terminal_draw_row(struct terminal *terminal, cairo_t *cr, int row)
+{
+	struct glyph_atlas *atlas = &terminal->atlas;
+	struct cell_key *cells;
+	union decoded_attr attr;
+	double average_width = terminal->average_width;
+	double cell_height = terminal->extents.height;
+	double unichar_width, y, d;
+	int col, text_x, text_y, slot;
+
+	cells = &terminal->drawn[row * terminal->width];
+	y = row * cell_height;
 
-	cairo_set_line_width(cr, 1.0);
-	cairo_translate(cr, allocation.x + side_margin,
-			allocation.y + top_margin);
 	/* paint the background */
-	for (row = 0; row < terminal->height; row++) {
-		p_row = terminal_get_row(terminal, row);
-		for (col = 0; col < terminal->width; col++) {
-			/* get the attributes for this character cell */
-			terminal_decode_attr(terminal, row, col, &attr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	terminal_set_color(terminal, cr, terminal->color_scheme->border);
+	cairo_rectangle(cr, 0, y, terminal->width * average_width,
+			cell_height);
+	cairo_fill(cr);
 
-			if (attr.attr.bg == terminal->color_scheme->border)
-				continue;
+	for (col = 0; col < terminal->width; col++) {
+		attr.key = cells[col].key;
+		if (attr.attr.bg == terminal->color_scheme->border)
+			continue;
 
-			if (is_wide(p_row[col]))
-				unichar_width = 2 * average_width;
-			else
-				unichar_width = average_width;
-
-			terminal_set_color(terminal, cr, attr.attr.bg);
-			cairo_move_to(cr, col * average_width,
-				      row * extents.height);
-			cairo_rel_line_to(cr, unichar_width, 0);
-			cairo_rel_line_to(cr, 0, extents.height);
-			cairo_rel_line_to(cr, -unichar_width, 0);
-			cairo_close_path(cr);
-			cairo_fill(cr);
-		}
+		if (is_wide(cells[col].ch))
+			unichar_width = 2 * average_width;
+		else
+			unichar_width = average_width;
+
+		terminal_set_color(terminal, cr, attr.attr.bg);
+		cairo_rectangle(cr, col * average_width, y,
+				unichar_width, cell_height);
+		cairo_fill(cr);
 	}
 
 	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
 
 	/* paint the foreground */
-	glyph_run_init(&run, terminal, cr);
-	for (row = 0; row < terminal->height; row++) {
-		p_row = terminal_get_row(terminal, row);
-		for (col = 0; col < terminal->width; col++) {
-			/* get the attributes for this character cell */
-			terminal_decode_attr(terminal, row, col, &attr);
+	for (col = 0; col < terminal->width; col++) {
+		attr.key = cells[col].key;
+
+		text_x = col * average_width;
+		text_y = terminal->extents.ascent + y;
+		if (attr.attr.a & ATTRMASK_UNDERLINE) {
+			terminal_set_color(terminal, cr, attr.attr.fg);
+			cairo_move_to(cr, text_x, (double)text_y + 1.5);
+			cairo_line_to(cr, text_x + average_width, (double) text_y + 1.5);
+			cairo_stroke(cr);
+		}
 
-			glyph_run_flush(&run, attr);
+		if (attr.attr.s & CELL_CURSOR_OUTLINE) {
+			d = 0.5;
 
-			text_x = col * average_width;
-			text_y = extents.ascent + row * extents.height;
-			if (attr.attr.a & ATTRMASK_UNDERLINE) {
-				terminal_set_color(terminal, cr, attr.attr.fg);
-				cairo_move_to(cr, text_x, (double)text_y + 1.5);
-				cairo_line_to(cr, text_x + average_width, (double) text_y + 1.5);
-				cairo_stroke(cr);
-			}
+			terminal_set_color(terminal, cr, attr.attr.fg);
+			cairo_move_to(cr, text_x + d, y + d);
+			cairo_rel_line_to(cr, average_width - 2 * d, 0);
+			cairo_rel_line_to(cr, 0, cell_height - 2 * d);
+			cairo_rel_line_to(cr, -average_width + 2 * d, 0);
+			cairo_close_path(cr);
+			cairo_stroke(cr);
+		}
 
-                        /* skip space glyph (RLE) we use as a placeholder of
-                           the right half of a double-width character,
-                           because RLE is not available in every font. */
-			if (p_row[col].ch == 0x200B)
-				continue;
+                /* skip space glyph (RLE) we use as a placeholder of
+                   the right half of a double-width character,
+                   because RLE is not available in every font. */
+		if (cells[col].ch.ch == 0x200B || cells[col].ch.ch == 0 ||
+		    (attr.attr.a & ATTRMASK_CONCEALED))
+			continue;
 
-			glyph_run_add(&run, text_x, text_y, &p_row[col]);
-		}
+		slot = glyph_atlas_lookup(atlas, terminal, &cells[col].ch,
+					  !!(attr.attr.a & (ATTRMASK_BOLD |
+							    ATTRMASK_BLINK)));
+
+		cairo_save(cr);
+		cairo_rectangle(cr, text_x, y, atlas->slot_width, cell_height);
+		cairo_clip(cr);
+		terminal_set_color(terminal, cr, attr.attr.fg);
+		cairo_mask_surface(cr, atlas->surface,
+				   text_x - (slot % GLYPH_ATLAS_COLUMNS) *
+				   atlas->slot_width,
+				   y - (slot / GLYPH_ATLAS_COLUMNS) *
+				   atlas->slot_height);
+		cairo_restore(cr);
 	}
+}
 
-	attr.key = ~0;
-	glyph_run_flush(&run, attr);
+/* Brings the rasterized grid up to date: moves it along with scrolling
+ * and draws the rows that changed. */
+static void
+terminal_update_grid(struct terminal *terminal)
+{
+	int width, height, row, scale;
+	cairo_t *cr;
 
-	if ((terminal->mode & MODE_SHOW_CURSOR) &&
-	    !window_has_focus(terminal->window)) {
-		d = 0.5;
+	terminal_update_rows(terminal);
 
-		cairo_set_line_width(cr, 1);
-		cairo_move_to(cr, terminal->column * average_width + d,
-			      terminal->row * extents.height + d);
-		cairo_rel_line_to(cr, average_width - 2 * d, 0);
-		cairo_rel_line_to(cr, 0, extents.height - 2 * d);
-		cairo_rel_line_to(cr, -average_width + 2 * d, 0);
-		cairo_close_path(cr);
+	/* Rasterize at the buffer scale, so text stays sharp on HiDPI */
+	scale = window_get_buffer_scale(terminal->window);
+	if (terminal->atlas.scale != scale) {
+		glyph_atlas_release(&terminal->atlas);
+		glyph_atlas_init(&terminal->atlas, terminal, scale);
+	}
 
-		cairo_stroke(cr);
+	width = terminal->width * terminal->average_width;
+	height = terminal->height * terminal->extents.height;
+	if (!terminal->grid || terminal->grid_scale != scale ||
+	    cairo_image_surface_get_width(terminal->grid) != width * scale ||
+	    cairo_image_surface_get_height(terminal->grid) != height * scale) {
+		if (terminal->grid)
+			cairo_surface_destroy(terminal->grid);
+		terminal->grid =
+			cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+						   width * scale,
+						   height * scale);
+		cairo_surface_set_device_scale(terminal->grid, scale, scale);
+		terminal->grid_scale = scale;
+		memset(terminal->row_dirty, 1, terminal->height);
+		terminal->grid_scroll = 0;
 	}
 
-	cairo_pop_group_to_source(cr);
+	if (terminal->grid_scroll != 0 &&
+	    abs(terminal->grid_scroll) < terminal->height)
+		terminal_blit_grid(terminal, terminal->grid_scroll);
+	terminal->grid_scroll = 0;
+
+	cr = cairo_create(terminal->grid);
+	cairo_set_line_width(cr, 1.0);
+	for (row = 0; row < terminal->height; row++) {
+		if (!terminal->row_dirty[row])
+			continue;
+		terminal_draw_row(terminal, cr, row);
+		terminal->row_dirty[row] = 0;
+	}
+	cairo_destroy(cr);
+}
+
+static void
+redraw_handler(struct widget *widget, void *data)
+{
+	struct terminal *terminal = data;
+	struct rectangle allocation;
+	cairo_t *cr;
+	int grid_x, grid_y, cursor_x, cursor_y;
+
+	terminal_update_grid(terminal);
+
+	widget_get_allocation(terminal->widget, &allocation);
+	terminal_get_grid_origin(terminal, &allocation, &grid_x, &grid_y);
+
+	cr = widget_cairo_create(terminal->widget);
+	cairo_rectangle(cr, allocation.x, allocation.y,
+			allocation.width, allocation.height);
+	cairo_clip(cr);
+
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	terminal_set_color(terminal, cr, terminal->color_scheme->border);
 	cairo_paint(cr);
+
+	cairo_set_source_surface(cr, terminal->grid, grid_x, grid_y);
+	cairo_rectangle(cr, grid_x, grid_y,
+			terminal->width * terminal->average_width,
+			terminal->height * terminal->extents.height);
+	cairo_fill(cr);
 	cairo_destroy(cr);
-	cairo_surface_destroy(surface);
 
 	if (terminal->send_cursor_position) {
-		cursor_x = side_margin + allocation.x +
-				terminal->column * average_width;
-		cursor_y = top_margin + allocation.y +
-				terminal->row * extents.height;
+		cursor_x = grid_x + terminal->column * terminal->average_width;
+		cursor_y = grid_y + terminal->row * terminal->extents.height;
 		window_set_text_cursor_position(terminal->window,
 						cursor_x, cursor_y);
 		terminal->send_cursor_position = 0;
@@ -2182,7 +2438,7 @@ terminal_data(struct terminal *terminal, const char *data, size_t length)
 		} /* if */
 	} /* for */
 
-	window_schedule_redraw(terminal->window);
+	terminal_schedule_rows(terminal);
 }
 
 static void
@@ -2341,6 +2597,7 @@ handle_bound_key(struct terminal *terminal,
 
 		terminal->scrolling = 1;
 		terminal->start--;
+		terminal->scroll_pending--;
 		terminal->row++;
 		terminal->selection_start_row++;
 		terminal->selection_end_row++;
@@ -2356,6 +2613,7 @@ handle_bound_key(struct terminal *terminal,
 
 		terminal->scrolling = 1;
 		terminal->start++;
+		terminal->scroll_pending++;
 		terminal->row--;
 		terminal->selection_start_row--;
 		terminal->selection_end_row--;
@@ -2585,6 +2843,7 @@ key_handler(struct window *window, struct input *input, uint32_t time,
 			terminal->selection_start_row -= d;
 			terminal->selection_end_row -= d;
 			terminal->start = terminal->saved_start;
+			terminal->scroll_pending += d;
 			terminal->scrolling = 0;
 			widget_schedule_redraw(terminal->widget);
 		}
@@ -2873,6 +3132,7 @@ axis_handler(struct widget *widget,
 		terminal->scrolling = 1;
 
 		terminal->start += lines;
+		terminal->scroll_pending += lines;
 		terminal->row -= lines;
 		terminal->selection_start_row -= lines;
 		terminal->selection_end_row -= lines;
@@ -2997,6 +3257,8 @@ terminal_create(struct display *display)
 	cairo_scaled_font_reference(terminal->font_normal);
 
 	cairo_font_extents(cr, &terminal->extents);
+	/* Whole pixel rows, so that scrolling can move them */
+	terminal->extents.height = ceil(terminal->extents.height);
 
 	/* Compute the average ascii glyph width */
 	cairo_text_extents(cr, TERMINAL_DRAW_SINGLE_WIDE_CHARACTERS,
@@ -3009,6 +3271,8 @@ terminal_create(struct display *display)
 	cairo_destroy(cr);
 	cairo_surface_destroy(surface);
 
+	glyph_atlas_init(&terminal->atlas, terminal, 1);
+
 	terminal_resize(terminal, 20, 5); /* Set minimum size first */
 	terminal_resize(terminal, 80, 25);
 
@@ -3028,6 +3292,11 @@ terminal_destroy(struct terminal *terminal)
 	if (wl_list_empty(&terminal_list))
 		display_exit(terminal->display);
 
+	glyph_atlas_release(&terminal->atlas);
+	if (terminal->grid)
+		cairo_surface_destroy(terminal->grid);
+	free(terminal->drawn);
+	free(terminal->row_dirty);
 	free(terminal->title);
 	free(terminal);
 }
@@ -0,0 +1,1361 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * weston-bench: a load generator for measuring compositor performance.
+ *
+ * It maps a number of windows, each with a number of synchronized
+ * sub-surfaces, and keeps updating them with a chosen damage pattern and
+ * pacing. Presentation feedback of every frame of the windows is collected,
+ * and when the run ends the achieved frame rate, the commit-to-present
+ * latency percentiles and how often the frames were presented with
+ * zero-copy, vsync and hardware completion are printed.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+
+#include <wayland-client.h>
+#include "shared/helpers.h"
+#include "shared/os-compatibility.h"
+#include "shared/timespec-util.h"
+#include <libweston/zalloc.h>
+#include "presentation-time-client-protocol.h"
+#include "viewporter-client-protocol.h"
+#include "xdg-shell-client-protocol.h"
+
+#ifdef HAVE_GBM
+#include <gbm.h>
+#include <drm_fourcc.h>
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
+#endif
+
+#define BUFFER_COUNT 3
+#define DAMAGE_RECT_COUNT 8
+#define SCROLL_STEP 8
+#define SUBSURFACE_COLUMNS 4
+
+enum damage_mode {
+	DAMAGE_FULL,
+	DAMAGE_RECTS,
+	DAMAGE_SCROLL,
+};
+
+static const char * const damage_mode_name[] = {
+	[DAMAGE_FULL] = "full",
+	[DAMAGE_RECTS] = "rects",
+	[DAMAGE_SCROLL] = "scroll",
+};
+
+enum pace_mode {
+	/* Draw the next frame when the frame callback of the last one is
+	 * done. */
+	PACE_FRAME,
+	/* Draw at a fixed rate, regardless of the frame callbacks. */
+	PACE_RATE,
+	/* Draw whenever a buffer is free. */
+	PACE_UNTHROTTLED,
+};
+
+enum buffer_type {
+	BUFFER_SHM,
+	BUFFER_DMABUF,
+};
+
+struct bench_options {
+	int surfaces;
+	int subsurfaces;
+	int width, height;
+	enum damage_mode damage;
+	enum pace_mode pace;
+	int rate;
+	double scale;
+	enum buffer_type buffer_type;
+	const char *render_node;
+	int duration;
+};
+
+struct bench_buffer {
+	struct bench_surface *surface;
+	struct wl_buffer *buffer;
+	void *data;
+	int stride;
+#ifdef HAVE_GBM
+	struct gbm_bo *bo;
+#endif
+	bool busy;
+};
+
+struct bench_surface {
+	struct bench *bench;
+	struct bench_surface *parent;	/* NULL for windows */
+	struct wl_surface *surface;
+	struct xdg_surface *xdg_surface;
+	struct xdg_toplevel *xdg_toplevel;
+	struct wl_subsurface *subsurface;
+	struct wp_viewport *viewport;
+	int width, height;
+
+	struct bench_buffer buffers[BUFFER_COUNT];
+	int next_buffer;
+	void *shm_data;
+	size_t shm_size;
+
+	uint32_t configure_serial;
+	struct wl_callback *frame;
+	bool redraw_pending;
+	unsigned int frame_no;
+	unsigned int seed;
+
+	struct wl_list children;	/* bench_surface::link */
+	struct wl_list link;		/* bench::window_list or children */
+};
+
+struct bench_feedback {
+	struct bench *bench;
+	struct wp_presentation_feedback *feedback;
+	struct timespec commit;
+	struct wl_list link;		/* bench::feedback_list */
+};
+
+struct bench {
+	struct bench_options opts;
+
+	struct wl_display *display;
+	struct wl_registry *registry;
+	struct wl_compositor *compositor;
+	struct wl_subcompositor *subcompositor;
+	struct xdg_wm_base *wm_base;
+	struct wl_shm *shm;
+	struct wp_viewporter *viewporter;
+	struct wp_presentation *presentation;
+	clockid_t clk_id;
+#ifdef HAVE_GBM
+	struct zwp_linux_dmabuf_v1 *dmabuf;
+	int drm_fd;
+	struct gbm_device *gbm;
+#endif
+
+	struct wl_list window_list;	/* bench_surface::link */
+	struct wl_list feedback_list;	/* bench_feedback::link */
+
+	struct timespec start;
+	uint64_t commits;
+	uint64_t missed_ticks;
+	uint64_t presented;
+	uint64_t discarded;
+	uint64_t zero_copy;
+	uint64_t vsync;
+	uint64_t hw_completion;
+
+	uint32_t *latencies;		/* usec, commit to presentation */
+	size_t latency_count;
+	size_t latency_alloc;
+};
+
+static volatile bool running = true;
+
+static void
+window_redraw(struct bench_surface *window);
+
+static bool
+window_ready(struct bench_surface *window);
+
+static void
+buffer_release(void *data, struct wl_buffer *wl_buffer)
+{
+	struct bench_buffer *buffer = data;
+	struct bench_surface *window = buffer->surface->parent ?
+				       buffer->surface->parent :
+				       buffer->surface;
+
+	buffer->busy = false;
+
+	if (window->redraw_pending && window_ready(window))
+		window_redraw(window);
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	buffer_release
+};
+
+static bool
+surface_create_shm_buffers(struct bench_surface *surface)
+{
+	struct bench *bench = surface->bench;
+	struct wl_shm_pool *pool;
+	int stride = surface->width * 4;
+	int size = stride * surface->height;
+	int fd, i;
+
+	surface->shm_size = (size_t)size * BUFFER_COUNT;
+	fd = os_create_anonymous_file(surface->shm_size);
+	if (fd < 0) {
+		fprintf(stderr, "creating a buffer file for %zu B failed: %s\n",
+			surface->shm_size, strerror(errno));
+		return false;
+	}
+
+	surface->shm_data = mmap(NULL, surface->shm_size,
+				 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (surface->shm_data == MAP_FAILED) {
+		fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+		surface->shm_data = NULL;
+		close(fd);
+		return false;
+	}
+
+	pool = wl_shm_create_pool(bench->shm, fd, surface->shm_size);
+	for (i = 0; i < BUFFER_COUNT; i++) {
+		struct bench_buffer *buffer = &surface->buffers[i];
+
+		buffer->buffer = wl_shm_pool_create_buffer(pool, i * size,
+							   surface->width,
+							   surface->height,
+							   stride,
+							   WL_SHM_FORMAT_XRGB8888);
+		buffer->data = (char *)surface->shm_data + i * size;
+		buffer->stride = stride;
+	}
+	wl_shm_pool_destroy(pool);
+	close(fd);
+
+	return true;
+}
+
+#ifdef HAVE_GBM
+struct dmabuf_params {
+	struct wl_buffer *buffer;
+	bool done;
+};
+
+static void
+dmabuf_params_created(void *data, struct zwp_linux_buffer_params_v1 *params,
+		      struct wl_buffer *buffer)
+{
+	struct dmabuf_params *result = data;
+
+	result->buffer = buffer;
+	result->done = true;
+}
+
+static void
+dmabuf_params_failed(void *data, struct zwp_linux_buffer_params_v1 *params)
+{
+	struct dmabuf_params *result = data;
+
+	result->done = true;
+}
+
+static const struct zwp_linux_buffer_params_v1_listener dmabuf_params_listener = {
+	dmabuf_params_created,
+	dmabuf_params_failed,
+};
+
+static bool
+surface_create_dmabuf_buffers(struct bench_surface *surface)
+{
+	struct bench *bench = surface->bench;
+	int i;
+
+	for (i = 0; i < BUFFER_COUNT; i++) {
+		struct bench_buffer *buffer = &surface->buffers[i];
+		struct dmabuf_params result = { NULL, false };
+		struct zwp_linux_buffer_params_v1 *params;
+		int fd;
+
+		buffer->bo = gbm_bo_create(bench->gbm, surface->width,
+					   surface->height, GBM_FORMAT_XRGB8888,
+					   GBM_BO_USE_RENDERING |
+					   GBM_BO_USE_LINEAR);
+		if (!buffer->bo) {
+			fprintf(stderr, "gbm_bo_create failed\n");
+			return false;
+		}
+
+		fd = gbm_bo_get_fd(buffer->bo);
+		if (fd < 0) {
+			fprintf(stderr, "gbm_bo_get_fd failed\n");
+			return false;
+		}
+
+		params = zwp_linux_dmabuf_v1_create_params(bench->dmabuf);
+		zwp_linux_buffer_params_v1_add(params, fd, 0, 0,
+					       gbm_bo_get_stride(buffer->bo),
+					       DRM_FORMAT_MOD_LINEAR >> 32,
+					       DRM_FORMAT_MOD_LINEAR & 0xffffffff);
+		zwp_linux_buffer_params_v1_add_listener(params,
+							&dmabuf_params_listener,
+							&result);
+		zwp_linux_buffer_params_v1_create(params, surface->width,
+						  surface->height,
+						  DRM_FORMAT_XRGB8888, 0);
+
+		while (!result.done)
+			if (wl_display_dispatch(bench->display) < 0)
+				break;
+
+		zwp_linux_buffer_params_v1_destroy(params);
+		close(fd);
+
+		if (!result.buffer) {
+			fprintf(stderr, "importing a dmabuf failed\n");
+			return false;
+		}
+
+		buffer->buffer = result.buffer;
+	}
+
+	return true;
+}
+#endif
+
+static bool
+surface_create_buffers(struct bench_surface *surface)
+{
+	bool ret = false;
+	int i;
+
+	switch (surface->bench->opts.buffer_type) {
+	case BUFFER_SHM:
+		ret = surface_create_shm_buffers(surface);
+		break;
+	case BUFFER_DMABUF:
+#ifdef HAVE_GBM
+		ret = surface_create_dmabuf_buffers(surface);
+#endif
+		break;
+	}
+
+	if (!ret)
+		return false;
+
+	for (i = 0; i < BUFFER_COUNT; i++) {
+		surface->buffers[i].surface = surface;
+		wl_buffer_add_listener(surface->buffers[i].buffer,
+				       &buffer_listener, &surface->buffers[i]);
+	}
+
+	return true;
+}
+
+static uint32_t *
+buffer_map(struct bench_buffer *buffer, int *stride, void **map_data)
+{
+#ifdef HAVE_GBM
+	if (buffer->bo) {
+		uint32_t bo_stride;
+		void *ptr;
+
+		ptr = gbm_bo_map(buffer->bo, 0, 0,
+				 gbm_bo_get_width(buffer->bo),
+				 gbm_bo_get_height(buffer->bo),
+				 GBM_BO_TRANSFER_WRITE, &bo_stride, map_data);
+		*stride = bo_stride;
+		return ptr;
+	}
+#endif
+
+	*stride = buffer->stride;
+	*map_data = NULL;
+
+	return buffer->data;
+}
+
+static void
+buffer_unmap(struct bench_buffer *buffer, void *map_data)
+{
+#ifdef HAVE_GBM
+	if (buffer->bo)
+		gbm_bo_unmap(buffer->bo, map_data);
+#endif
+}
+
+static void
+fill_rect(uint32_t *data, int stride, int x, int y, int width, int height,
+	  uint32_t color)
+{
+	int i, j;
+
+	for (j = y; j < y + height; j++) {
+		uint32_t *p = data + j * (stride / 4) + x;
+
+		for (i = 0; i < width; i++)
+			p[i] = color;
+	}
+}
+
+/* Horizontal stripes moving up by SCROLL_STEP rows each frame, as when
+ * scrolling a document. */
+static void
+paint_scroll(uint32_t *data, int stride, int width, int height,
+	     unsigned int frame_no)
+{
+	int y;
+
+	for (y = 0; y < height; y++) {
+		unsigned int row = y + frame_no * SCROLL_STEP;
+		uint32_t color = (row / 16) & 1 ? 0xff303030 : 0xffd0d0d0;
+
+		fill_rect(data, stride, 0, y, width, 1, color);
+	}
+}
+
+static struct bench_buffer *
+surface_free_buffer(struct bench_surface *surface)
+{
+	int i, n;
+
+	for (i = 0; i < BUFFER_COUNT; i++) {
+		n = (surface->next_buffer + i) % BUFFER_COUNT;
+		if (!surface->buffers[n].busy)
+			return &surface->buffers[n];
+	}
+
+	return NULL;
+}
+
+/* Paints the next frame into a free buffer and attaches it with its
+ * damage, leaving the commit to the caller. */
+static void
+surface_draw(struct bench_surface *surface)
+{
+	struct bench_buffer *buffer = surface_free_buffer(surface);
+	int width = surface->width;
+	int height = surface->height;
+	uint32_t color;
+	uint32_t *data;
+	void *map_data;
+	int stride, i;
+
+	assert(buffer);
+
+	color = 0xff000000 | (surface->frame_no * 0x0b0705 & 0x00ffffff);
+
+	data = buffer_map(buffer, &stride, &map_data);
+	if (!data) {
+		fprintf(stderr, "mapping a buffer failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	switch (surface->bench->opts.damage) {
+	case DAMAGE_FULL:
+		fill_rect(data, stride, 0, 0, width, height, color);
+		wl_surface_damage_buffer(surface->surface, 0, 0, width, height);
+		break;
+	case DAMAGE_RECTS:
+		for (i = 0; i < DAMAGE_RECT_COUNT; i++) {
+			int w = 1 + rand_r(&surface->seed) % MAX(width / 8, 1);
+			int h = 1 + rand_r(&surface->seed) % MAX(height / 8, 1);
+			int x = rand_r(&surface->seed) % (width - w + 1);
+			int y = rand_r(&surface->seed) % (height - h + 1);
+
+			fill_rect(data, stride, x, y, w, h, color);
+			wl_surface_damage_buffer(surface->surface, x, y, w, h);
+		}
+		break;
+	case DAMAGE_SCROLL:
+		paint_scroll(data, stride, width, height, surface->frame_no);
+		wl_surface_damage_buffer(surface->surface, 0, 0, width, height);
+		break;
+	}
+
+	buffer_unmap(buffer, map_data);
+
+	wl_surface_attach(surface->surface, buffer->buffer, 0, 0);
+	buffer->busy = true;
+	surface->next_buffer = (buffer - surface->buffers + 1) % BUFFER_COUNT;
+	surface->frame_no++;
+}
+
+static void
+feedback_destroy(struct bench_feedback *feedback)
+{
+	wp_presentation_feedback_destroy(feedback->feedback);
+	wl_list_remove(&feedback->link);
+	free(feedback);
+}
+
+static void
+feedback_sync_output(void *data,
+		     struct wp_presentation_feedback *presentation_feedback,
+		     struct wl_output *output)
+{
+}
+
+static void
+feedback_presented(void *data,
+		   struct wp_presentation_feedback *presentation_feedback,
+		   uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
+		   uint32_t refresh_nsec, uint32_t seq_hi, uint32_t seq_lo,
+		   uint32_t flags)
+{
+	struct bench_feedback *feedback = data;
+	struct bench *bench = feedback->bench;
+	struct timespec present;
+	int64_t latency;
+
+	timespec_from_proto(&present, tv_sec_hi, tv_sec_lo, tv_nsec);
+	latency = timespec_sub_to_nsec(&present, &feedback->commit) / 1000;
+
+	if (bench->latency_count == bench->latency_alloc) {
+		size_t alloc = MAX(bench->latency_alloc * 2, 1024);
+		uint32_t *latencies;
+
+		latencies = realloc(bench->latencies,
+				    alloc * sizeof(*latencies));
+		assert(latencies);
+		bench->latencies = latencies;
+		bench->latency_alloc = alloc;
+	}
+	bench->latencies[bench->latency_count++] = MAX(latency, 0);
+
+	bench->presented++;
+	if (flags & WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY)
+		bench->zero_copy++;
+	if (flags & WP_PRESENTATION_FEEDBACK_KIND_VSYNC)
+		bench->vsync++;
+	if (flags & WP_PRESENTATION_FEEDBACK_KIND_HW_COMPLETION)
+		bench->hw_completion++;
+
+	feedback_destroy(feedback);
+}
+
+static void
+feedback_discarded(void *data,
+		   struct wp_presentation_feedback *presentation_feedback)
+{
+	struct bench_feedback *feedback = data;
+
+	feedback->bench->discarded++;
+	feedback_destroy(feedback);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	feedback_sync_output,
+	feedback_presented,
+	feedback_discarded
+};
+
+static void
+window_create_feedback(struct bench_surface *window)
+{
+	struct bench *bench = window->bench;
+	struct bench_feedback *feedback;
+
+	if (!bench->presentation)
+		return;
+
+	feedback = zalloc(sizeof *feedback);
+	assert(feedback);
+
+	feedback->bench = bench;
+	feedback->feedback = wp_presentation_feedback(bench->presentation,
+						      window->surface);
+	wp_presentation_feedback_add_listener(feedback->feedback,
+					      &feedback_listener, feedback);
+	clock_gettime(bench->clk_id, &feedback->commit);
+	wl_list_insert(&bench->feedback_list, &feedback->link);
+}
+
+static const struct wl_callback_listener frame_listener;
+
+static bool
+window_ready(struct bench_surface *window)
+{
+	struct bench_surface *child;
+
+	if (!surface_free_buffer(window))
+		return false;
+
+	wl_list_for_each(child, &window->children, link)
+		if (!surface_free_buffer(child))
+			return false;
+
+	return true;
+}
+
+/* The sub-surfaces are synchronized, their new content shows up together
+ * with the window's in the commit of the window. */
+static void
+window_redraw(struct bench_surface *window)
+{
+	struct bench *bench = window->bench;
+	struct bench_surface *child;
+
+	wl_list_for_each(child, &window->children, link) {
+		surface_draw(child);
+		wl_surface_commit(child->surface);
+	}
+
+	surface_draw(window);
+
+	if (bench->opts.pace == PACE_FRAME) {
+		window->frame = wl_surface_frame(window->surface);
+		wl_callback_add_listener(window->frame, &frame_listener,
+					 window);
+	}
+
+	window_create_feedback(window);
+
+	if (window->configure_serial) {
+		xdg_surface_ack_configure(window->xdg_surface,
+					  window->configure_serial);
+		window->configure_serial = 0;
+	}
+
+	wl_surface_commit(window->surface);
+	window->redraw_pending = false;
+	bench->commits++;
+}
+
+static void
+frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	struct bench_surface *window = data;
+
+	wl_callback_destroy(callback);
+	window->frame = NULL;
+
+	if (window_ready(window))
+		window_redraw(window);
+	else
+		window->redraw_pending = true;
+}
+
+static const struct wl_callback_listener frame_listener = {
+	frame_done
+};
+
+static void
+bench_redraw_ready(struct bench *bench)
+{
+	struct bench_surface *window;
+
+	wl_list_for_each(window, &bench->window_list, link) {
+		if (window_ready(window))
+			window_redraw(window);
+		else if (bench->opts.pace == PACE_RATE)
+			bench->missed_ticks++;
+	}
+}
+
+static void
+xdg_wm_base_ping(void *data, struct xdg_wm_base *wm_base, uint32_t serial)
+{
+	xdg_wm_base_pong(wm_base, serial);
+}
+
+static const struct xdg_wm_base_listener wm_base_listener = {
+	xdg_wm_base_ping,
+};
+
+static void
+xdg_surface_configure(void *data, struct xdg_surface *xdg_surface,
+		      uint32_t serial)
+{
+	struct bench_surface *window = data;
+
+	window->configure_serial = serial;
+}
+
+static const struct xdg_surface_listener xdg_surface_listener = {
+	xdg_surface_configure,
+};
+
+static void
+xdg_toplevel_configure(void *data, struct xdg_toplevel *toplevel,
+		       int32_t width, int32_t height, struct wl_array *states)
+{
+	/* The size is fixed, it is part of the workload. */
+}
+
+static void
+xdg_toplevel_close(void *data, struct xdg_toplevel *toplevel)
+{
+	running = false;
+}
+
+static const struct xdg_toplevel_listener xdg_toplevel_listener = {
+	xdg_toplevel_configure,
+	xdg_toplevel_close,
+};
+
+static struct bench_surface *
+surface_create(struct bench *bench, struct bench_surface *parent,
+	       int width, int height)
+{
+	struct bench_surface *surface;
+
+	surface = zalloc(sizeof *surface);
+	assert(surface);
+
+	surface->bench = bench;
+	surface->parent = parent;
+	surface->width = width;
+	surface->height = height;
+	surface->seed = wl_list_length(&bench->window_list) + 1;
+	wl_list_init(&surface->children);
+	surface->surface = wl_compositor_create_surface(bench->compositor);
+
+	if (bench->opts.scale != 1.0) {
+		surface->viewport =
+			wp_viewporter_get_viewport(bench->viewporter,
+						   surface->surface);
+		wp_viewport_set_destination(surface->viewport,
+					    width * bench->opts.scale,
+					    height * bench->opts.scale);
+	}
+
+	if (!surface_create_buffers(surface)) {
+		fprintf(stderr, "failed to create buffers\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return surface;
+}
+
+static void
+surface_destroy(struct bench_surface *surface)
+{
+	struct bench_surface *child, *tmp;
+	int i;
+
+	wl_list_for_each_safe(child, tmp, &surface->children, link)
+		surface_destroy(child);
+
+	if (surface->frame)
+		wl_callback_destroy(surface->frame);
+	if (surface->viewport)
+		wp_viewport_destroy(surface->viewport);
+	if (surface->subsurface)
+		wl_subsurface_destroy(surface->subsurface);
+	if (surface->xdg_toplevel)
+		xdg_toplevel_destroy(surface->xdg_toplevel);
+	if (surface->xdg_surface)
+		xdg_surface_destroy(surface->xdg_surface);
+	wl_surface_destroy(surface->surface);
+
+	for (i = 0; i < BUFFER_COUNT; i++) {
+		if (surface->buffers[i].buffer)
+			wl_buffer_destroy(surface->buffers[i].buffer);
+#ifdef HAVE_GBM
+		if (surface->buffers[i].bo)
+			gbm_bo_destroy(surface->buffers[i].bo);
+#endif
+	}
+	if (surface->shm_data)
+		munmap(surface->shm_data, surface->shm_size);
+
+	wl_list_remove(&surface->link);
+	free(surface);
+}
+
+static void
+window_create(struct bench *bench)
+{
+	const struct bench_options *opts = &bench->opts;
+	struct bench_surface *window, *child;
+	int child_width = MAX(opts->width / SUBSURFACE_COLUMNS, 1);
+	int child_height = MAX(opts->height / SUBSURFACE_COLUMNS, 1);
+	int i, x, y;
+
+	window = surface_create(bench, NULL, opts->width, opts->height);
+	window->xdg_surface = xdg_wm_base_get_xdg_surface(bench->wm_base,
+							  window->surface);
+	xdg_surface_add_listener(window->xdg_surface, &xdg_surface_listener,
+				 window);
+	window->xdg_toplevel = xdg_surface_get_toplevel(window->xdg_surface);
+	xdg_toplevel_add_listener(window->xdg_toplevel,
+				  &xdg_toplevel_listener, window);
+	xdg_toplevel_set_title(window->xdg_toplevel, "weston-bench");
+	xdg_toplevel_set_app_id(window->xdg_toplevel, "weston-bench");
+
+	for (i = 0; i < opts->subsurfaces; i++) {
+		child = surface_create(bench, window, child_width,
+				       child_height);
+		child->subsurface =
+			wl_subcompositor_get_subsurface(bench->subcompositor,
+							child->surface,
+							window->surface);
+
+		/* A grid over the window, overlapping after one full
+		 * cover. */
+		x = (i % SUBSURFACE_COLUMNS) * child_width;
+		y = (i / SUBSURFACE_COLUMNS % SUBSURFACE_COLUMNS) *
+		    child_height;
+		wl_subsurface_set_position(child->subsurface,
+					   x * opts->scale, y * opts->scale);
+		wl_list_insert(window->children.prev, &child->link);
+	}
+
+	wl_surface_commit(window->surface);
+	wl_list_insert(bench->window_list.prev, &window->link);
+}
+
+static void
+presentation_clock_id(void *data, struct wp_presentation *presentation,
+		      uint32_t clk_id)
+{
+	struct bench *bench = data;
+
+	bench->clk_id = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	presentation_clock_id
+};
+
+static void
+registry_handle_global(void *data, struct wl_registry *registry,
+		       uint32_t name, const char *interface, uint32_t version)
+{
+	struct bench *bench = data;
+
+	if (strcmp(interface, wl_compositor_interface.name) == 0) {
+		if (version < 4)
+			return;
+		bench->compositor = wl_registry_bind(registry, name,
+						     &wl_compositor_interface,
+						     4);
+	} else if (strcmp(interface, wl_subcompositor_interface.name) == 0) {
+		bench->subcompositor =
+			wl_registry_bind(registry, name,
+					 &wl_subcompositor_interface, 1);
+	} else if (strcmp(interface, xdg_wm_base_interface.name) == 0) {
+		bench->wm_base = wl_registry_bind(registry, name,
+						  &xdg_wm_base_interface, 1);
+		xdg_wm_base_add_listener(bench->wm_base, &wm_base_listener,
+					 bench);
+	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
+		bench->shm = wl_registry_bind(registry, name,
+					      &wl_shm_interface, 1);
+	} else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+		bench->viewporter = wl_registry_bind(registry, name,
+						     &wp_viewporter_interface,
+						     1);
+	} else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+		bench->presentation =
+			wl_registry_bind(registry, name,
+					 &wp_presentation_interface, 1);
+		wp_presentation_add_listener(bench->presentation,
+					     &presentation_listener, bench);
+#ifdef HAVE_GBM
+	} else if (strcmp(interface, zwp_linux_dmabuf_v1_interface.name) == 0) {
+		bench->dmabuf = wl_registry_bind(registry, name,
+						 &zwp_linux_dmabuf_v1_interface,
+						 1);
+#endif
+	}
+}
+
+static void
+registry_handle_global_remove(void *data, struct wl_registry *registry,
+			      uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+	registry_handle_global,
+	registry_handle_global_remove
+};
+
+static bool
+bench_connect(struct bench *bench)
+{
+	const struct bench_options *opts = &bench->opts;
+
+	bench->display = wl_display_connect(NULL);
+	if (!bench->display) {
+		fprintf(stderr, "failed to connect to the compositor: %s\n",
+			strerror(errno));
+		return false;
+	}
+
+	bench->clk_id = CLOCK_MONOTONIC;
+	bench->registry = wl_display_get_registry(bench->display);
+	wl_registry_add_listener(bench->registry, &registry_listener, bench);
+	wl_display_roundtrip(bench->display);
+	wl_display_roundtrip(bench->display);
+
+	if (!bench->compositor || !bench->wm_base || !bench->shm ||
+	    (opts->subsurfaces > 0 && !bench->subcompositor)) {
+		fprintf(stderr, "wl_compositor version 4, xdg_wm_base, "
+			"wl_shm or wl_subcompositor is missing\n");
+		return false;
+	}
+
+	if (opts->scale != 1.0 && !bench->viewporter) {
+		fprintf(stderr, "scaling needs wp_viewporter\n");
+		return false;
+	}
+
+	if (!bench->presentation)
+		fprintf(stderr, "wp_presentation is missing, "
+			"only commits are counted\n");
+
+	if (opts->buffer_type == BUFFER_DMABUF) {
+#ifdef HAVE_GBM
+		if (!bench->dmabuf) {
+			fprintf(stderr, "zwp_linux_dmabuf_v1 is missing\n");
+			return false;
+		}
+
+		bench->drm_fd = open(opts->render_node, O_RDWR | O_CLOEXEC);
+		if (bench->drm_fd < 0) {
+			fprintf(stderr, "opening %s failed: %s\n",
+				opts->render_node, strerror(errno));
+			return false;
+		}
+
+		bench->gbm = gbm_create_device(bench->drm_fd);
+		if (!bench->gbm) {
+			fprintf(stderr, "gbm_create_device failed\n");
+			return false;
+		}
+#else
+		fprintf(stderr, "weston-bench was built without dmabuf "
+			"support\n");
+		return false;
+#endif
+	}
+
+	return true;
+}
+
+static void
+bench_disconnect(struct bench *bench)
+{
+	struct bench_feedback *feedback, *ftmp;
+	struct bench_surface *window, *wtmp;
+
+	wl_list_for_each_safe(feedback, ftmp, &bench->feedback_list, link)
+		feedback_destroy(feedback);
+
+	wl_list_for_each_safe(window, wtmp, &bench->window_list, link)
+		surface_destroy(window);
+
+#ifdef HAVE_GBM
+	if (bench->gbm)
+		gbm_device_destroy(bench->gbm);
+	if (bench->drm_fd >= 0)
+		close(bench->drm_fd);
+	if (bench->dmabuf)
+		zwp_linux_dmabuf_v1_destroy(bench->dmabuf);
+#endif
+	if (bench->presentation)
+		wp_presentation_destroy(bench->presentation);
+	if (bench->viewporter)
+		wp_viewporter_destroy(bench->viewporter);
+	if (bench->shm)
+		wl_shm_destroy(bench->shm);
+	if (bench->wm_base)
+		xdg_wm_base_destroy(bench->wm_base);
+	if (bench->subcompositor)
+		wl_subcompositor_destroy(bench->subcompositor);
+	if (bench->compositor)
+		wl_compositor_destroy(bench->compositor);
+
+	if (bench->registry)
+		wl_registry_destroy(bench->registry);
+	if (bench->display) {
+		wl_display_flush(bench->display);
+		wl_display_disconnect(bench->display);
+	}
+
+	free(bench->latencies);
+}
+
+static int
+timer_create_rate(int rate)
+{
+	struct itimerspec its;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (fd < 0)
+		return -1;
+
+	timespec_from_nsec(&its.it_interval, NSEC_PER_SEC / rate);
+	its.it_value = its.it_interval;
+	if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void
+bench_run(struct bench *bench)
+{
+	struct wl_display *display = bench->display;
+	int64_t duration_msec = (int64_t)bench->opts.duration * 1000;
+	int timer_fd = -1;
+	int i;
+
+	for (i = 0; i < bench->opts.surfaces; i++)
+		window_create(bench);
+
+	/* Wait for the initial configure events. */
+	wl_display_roundtrip(display);
+
+	if (bench->opts.pace == PACE_RATE) {
+		timer_fd = timer_create_rate(bench->opts.rate);
+		if (timer_fd < 0) {
+			fprintf(stderr, "creating a timer failed: %s\n",
+				strerror(errno));
+			return;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &bench->start);
+	bench_redraw_ready(bench);
+
+	while (running) {
+		struct pollfd pfd[2];
+		struct timespec now;
+		int64_t remaining;
+		int timeout, ret;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		remaining = duration_msec -
+			    timespec_sub_to_msec(&now, &bench->start);
+		if (remaining <= 0)
+			break;
+
+		if (bench->opts.pace == PACE_UNTHROTTLED)
+			bench_redraw_ready(bench);
+
+		while (wl_display_prepare_read(display) != 0)
+			if (wl_display_dispatch_pending(display) < 0)
+				goto out;
+
+		pfd[0].fd = wl_display_get_fd(display);
+		pfd[0].events = POLLIN;
+		if (wl_display_flush(display) < 0) {
+			if (errno != EAGAIN) {
+				wl_display_cancel_read(display);
+				break;
+			}
+			pfd[0].events |= POLLOUT;
+		}
+		pfd[1].fd = timer_fd;
+		pfd[1].events = POLLIN;
+
+		timeout = remaining;
+		ret = poll(pfd, timer_fd >= 0 ? 2 : 1, timeout);
+		if (ret < 0) {
+			wl_display_cancel_read(display);
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll failed: %s\n", strerror(errno));
+			break;
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			if (wl_display_read_events(display) < 0)
+				break;
+		} else {
+			wl_display_cancel_read(display);
+		}
+
+		if (wl_display_dispatch_pending(display) < 0)
+			break;
+
+		if (timer_fd >= 0 && (pfd[1].revents & POLLIN)) {
+			uint64_t expirations;
+
+			if (read(timer_fd, &expirations,
+				 sizeof expirations) == sizeof expirations) {
+				bench->missed_ticks += expirations - 1;
+				bench_redraw_ready(bench);
+			}
+		}
+	}
+
+out:
+	if (timer_fd >= 0)
+		close(timer_fd);
+}
+
+static int
+compare_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+latency_percentile(struct bench *bench, int percent)
+{
+	size_t i = (bench->latency_count - 1) * percent / 100;
+
+	return bench->latencies[i] / 1000.0;
+}
+
+static double
+ratio(uint64_t part, uint64_t whole)
+{
+	return whole ? 100.0 * part / whole : 0.0;
+}
+
+static void
+bench_report(struct bench *bench)
+{
+	const struct bench_options *opts = &bench->opts;
+	struct timespec now;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = timespec_sub_to_nsec(&now, &bench->start) / 1e9;
+
+	printf("%d surfaces with %d subsurfaces, %dx%d %s, damage %s, ",
+	       opts->surfaces, opts->subsurfaces, opts->width, opts->height,
+	       opts->buffer_type == BUFFER_SHM ? "shm" : "dmabuf",
+	       damage_mode_name[opts->damage]);
+	switch (opts->pace) {
+	case PACE_FRAME:
+		printf("frame callbacks");
+		break;
+	case PACE_RATE:
+		printf("%d fps", opts->rate);
+		break;
+	case PACE_UNTHROTTLED:
+		printf("unthrottled");
+		break;
+	}
+	if (opts->scale != 1.0)
+		printf(", scale %.2f", opts->scale);
+	printf("\n");
+
+	printf("%-20s %.2f s\n", "duration", secs);
+	printf("%-20s %" PRIu64 " (%.1f fps per surface)\n", "commits",
+	       bench->commits, bench->commits / secs / opts->surfaces);
+	if (opts->pace == PACE_RATE)
+		printf("%-20s %" PRIu64 "\n", "missed ticks",
+		       bench->missed_ticks);
+
+	if (!bench->presentation)
+		return;
+
+	printf("%-20s %" PRIu64 " (%.1f fps per surface)\n", "presented",
+	       bench->presented, bench->presented / secs / opts->surfaces);
+	printf("%-20s %" PRIu64 "\n", "discarded", bench->discarded);
+
+	if (bench->latency_count > 0) {
+		qsort(bench->latencies, bench->latency_count,
+		      sizeof(*bench->latencies), compare_uint32);
+		printf("%-20s p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, "
+		       "max %.2f ms\n", "commit to present",
+		       latency_percentile(bench, 50),
+		       latency_percentile(bench, 90),
+		       latency_percentile(bench, 99),
+		       latency_percentile(bench, 100));
+	}
+
+	printf("%-20s %.1f %%\n", "zero-copy",
+	       ratio(bench->zero_copy, bench->presented));
+	printf("%-20s %.1f %%\n", "vsync",
+	       ratio(bench->vsync, bench->presented));
+	printf("%-20s %.1f %%\n", "hw completion",
+	       ratio(bench->hw_completion, bench->presented));
+}
+
+static void
+signal_int(int signum)
+{
+	running = false;
+}
+
+static void
+usage(const char *prog, int exit_code)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+		"  -n, --surfaces=N\tnumber of windows (default 1)\n"
+		"  -s, --subsurfaces=M\tsub-surfaces in each window "
+		"(default 0)\n"
+		"  -S, --size=WxH\twindow size in pixels (default 256x256),\n"
+		"\t\t\tsub-surfaces are a quarter of it in each direction\n"
+		"  -d, --damage=MODE\tfull, rects or scroll (default full)\n"
+		"  -r, --rate=RATE\tframe: follow frame callbacks (default),\n"
+		"\t\t\tunthrottled: commit whenever a buffer is free,\n"
+		"\t\t\tor a number of commits per second\n"
+		"  -v, --scale=F\t\tscale the surfaces with wp_viewporter\n"
+		"  -b, --buffer=TYPE\tshm or dmabuf (default shm)\n"
+		"  -D, --drm-render-node=PATH\trender node for dmabuf buffers\n"
+		"\t\t\t(default /dev/dri/renderD128)\n"
+		"  -t, --time=SECS\tlength of the run (default 10)\n"
+		"  -h, --help\t\tshow this help\n",
+		prog);
+
+	exit(exit_code);
+}
+
+static void
+parse_options(struct bench_options *opts, int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{ "surfaces", required_argument, NULL, 'n' },
+		{ "subsurfaces", required_argument, NULL, 's' },
+		{ "size", required_argument, NULL, 'S' },
+		{ "damage", required_argument, NULL, 'd' },
+		{ "rate", required_argument, NULL, 'r' },
+		{ "scale", required_argument, NULL, 'v' },
+		{ "buffer", required_argument, NULL, 'b' },
+		{ "drm-render-node", required_argument, NULL, 'D' },
+		{ "time", required_argument, NULL, 't' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	unsigned int i;
+	int c;
+
+	opts->surfaces = 1;
+	opts->subsurfaces = 0;
+	opts->width = 256;
+	opts->height = 256;
+	opts->damage = DAMAGE_FULL;
+	opts->pace = PACE_FRAME;
+	opts->scale = 1.0;
+	opts->buffer_type = BUFFER_SHM;
+	opts->render_node = "/dev/dri/renderD128";
+	opts->duration = 10;
+
+	while ((c = getopt_long(argc, argv, "n:s:S:d:r:v:b:D:t:h",
+				long_options, NULL)) != -1) {
+		switch (c) {
+		case 'n':
+			opts->surfaces = atoi(optarg);
+			break;
+		case 's':
+			opts->subsurfaces = atoi(optarg);
+			break;
+		case 'S':
+			if (sscanf(optarg, "%dx%d", &opts->width,
+				   &opts->height) != 2)
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'd':
+			for (i = 0; i < ARRAY_LENGTH(damage_mode_name); i++)
+				if (strcmp(optarg, damage_mode_name[i]) == 0)
+					break;
+			if (i == ARRAY_LENGTH(damage_mode_name))
+				usage(argv[0], EXIT_FAILURE);
+			opts->damage = i;
+			break;
+		case 'r':
+			if (strcmp(optarg, "frame") == 0) {
+				opts->pace = PACE_FRAME;
+			} else if (strcmp(optarg, "unthrottled") == 0) {
+				opts->pace = PACE_UNTHROTTLED;
+			} else {
+				opts->pace = PACE_RATE;
+				opts->rate = atoi(optarg);
+				if (opts->rate <= 0)
+					usage(argv[0], EXIT_FAILURE);
+			}
+			break;
+		case 'v':
+			opts->scale = atof(optarg);
+			break;
+		case 'b':
+			if (strcmp(optarg, "shm") == 0)
+				opts->buffer_type = BUFFER_SHM;
+			else if (strcmp(optarg, "dmabuf") == 0)
+				opts->buffer_type = BUFFER_DMABUF;
+			else
+				usage(argv[0], EXIT_FAILURE);
+			break;
+		case 'D':
+			opts->render_node = optarg;
+			break;
+		case 't':
+			opts->duration = atoi(optarg);
+			break;
+		case 'h':
+			usage(argv[0], EXIT_SUCCESS);
+			break;
+		default:
+			usage(argv[0], EXIT_FAILURE);
+			break;
+		}
+	}
+
+	if (optind < argc || opts->surfaces <= 0 || opts->subsurfaces < 0 ||
+	    opts->width <= 0 || opts->height <= 0 || opts->scale <= 0.0 ||
+	    opts->duration <= 0)
+		usage(argv[0], EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sigaction sigint;
+	struct bench bench;
+	int ret = EXIT_FAILURE;
+
+	memset(&bench, 0, sizeof bench);
+#ifdef HAVE_GBM
+	bench.drm_fd = -1;
+#endif
+	wl_list_init(&bench.window_list);
+	wl_list_init(&bench.feedback_list);
+
+	parse_options(&bench.opts, argc, argv);
+
+	sigint.sa_handler = signal_int;
+	sigemptyset(&sigint.sa_mask);
+	sigint.sa_flags = SA_RESETHAND;
+	sigaction(SIGINT, &sigint, NULL);
+
+	if (bench_connect(&bench)) {
+		bench_run(&bench);
+		bench_report(&bench);
+		ret = EXIT_SUCCESS;
+	}
+
+	bench_disconnect(&bench);
+
+	return ret;
+}
@@ -38,23 +38,36 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 
 #include <wayland-client.h>
 
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 #include <libweston/zalloc.h>
 #include "weston-debug-client-protocol.h"
 
+struct latency_tracker {
+	int fd; /**< read end of the timeline stream */
+	char buf[4096];
+	size_t len;
+	struct wl_list surface_list; /**< latency_surface::link */
+};
+
 struct debug_app {
 	struct {
 		bool help;
 		bool list;
 		bool bind_all;
+		bool latency;
 		char *output;
 		char *outfd;
 	} opt;
 
 	int out_fd;
+	struct latency_tracker latency;
 	struct wl_display *dpy;
 	struct wl_registry *registry;
 	struct weston_debug_v1 *debug_iface;
@@ -222,7 +235,7 @@ static const struct weston_debug_stream_v1_listener stream_listener = {
 };
 
 static void
-start_streams(struct debug_app *app)
+start_streams(struct debug_app *app, int fd)
 {
 	struct debug_stream *stream;
 
@@ -231,8 +244,7 @@ start_streams(struct debug_app *app)
 			continue;
 
 		stream->obj = weston_debug_v1_subscribe(app->debug_iface,
-							stream->name,
-							app->out_fd);
+							stream->name, fd);
 		weston_debug_stream_v1_add_listener(stream->obj,
 						    &stream_listener, stream);
 	}
@@ -305,6 +317,411 @@ setup_out_fd(const char *output, const char *outfd)
 	return fd;
 }
 
+/*
+ * Input latency tracking for --latency.
+ *
+ * Follows the "timeline" stream and, for each surface, measures the time
+ * from the kernel timestamp of an input event (core_input_send) to the
+ * presentation of the first frame containing the client's response: the
+ * next damaging commit (core_commit_damage), its repaint
+ * (core_flush_damage) and the following page flip on that output
+ * (core_repaint_finished). Only one event per surface is in flight at a
+ * time; events arriving while one is being measured are not sampled.
+ */
+
+/* Histogram buckets are this many milliseconds wide; the last one also
+ * collects everything above it. */
+#define LATENCY_BUCKET_MS 2
+#define LATENCY_BUCKETS 32
+
+enum latency_state {
+	LATENCY_IDLE = 0,
+	LATENCY_SENT,		/* waiting for the client to commit */
+	LATENCY_COMMITTED,	/* waiting for the compositor to repaint */
+	LATENCY_REPAINTED,	/* waiting for the frame to be presented */
+};
+
+struct latency_surface {
+	struct wl_list link;
+	unsigned int id;
+	unsigned int main_id;
+	char *desc;
+
+	enum latency_state state;
+	unsigned int output_id;
+	struct timespec input;
+	struct timespec sent;
+	struct timespec commit;
+
+	unsigned int count;
+	uint64_t input_to_send_ns;
+	uint64_t send_to_commit_ns;
+	uint64_t commit_to_present_ns;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	unsigned int histogram[LATENCY_BUCKETS];
+};
+
+static volatile sig_atomic_t latency_running = 1;
+
+static void
+latency_signal_handler(int signum)
+{
+	latency_running = 0;
+}
+
+static bool
+json_get_uint(const char *line, const char *key, unsigned int *val)
+{
+	const char *p = strstr(line, key);
+	char *end;
+
+	if (!p)
+		return false;
+
+	p += strlen(key);
+	*val = strtoul(p, &end, 10);
+
+	return end != p;
+}
+
+static bool
+json_get_timespec(const char *line, const char *key, struct timespec *ts)
+{
+	const char *p = strstr(line, key);
+	long long sec;
+	long nsec;
+
+	if (!p)
+		return false;
+
+	if (sscanf(p + strlen(key), "[%lld, %ld]", &sec, &nsec) != 2)
+		return false;
+
+	ts->tv_sec = sec;
+	ts->tv_nsec = nsec;
+
+	return true;
+}
+
+static struct latency_surface *
+latency_surface_find(struct debug_app *app, unsigned int id)
+{
+	struct latency_surface *surf;
+
+	wl_list_for_each(surf, &app->latency.surface_list, link)
+		if (surf->id == id)
+			return surf;
+
+	return NULL;
+}
+
+static struct latency_surface *
+latency_surface_ensure(struct debug_app *app, unsigned int id)
+{
+	struct latency_surface *surf;
+
+	surf = latency_surface_find(app, id);
+	if (surf)
+		return surf;
+
+	surf = zalloc(sizeof *surf);
+	if (!surf)
+		return NULL;
+
+	surf->id = id;
+	wl_list_insert(app->latency.surface_list.prev, &surf->link);
+
+	return surf;
+}
+
+/** Sub-surfaces answer input on behalf of their main surface. */
+static struct latency_surface *
+latency_surface_find_main(struct debug_app *app, unsigned int id)
+{
+	struct latency_surface *surf = latency_surface_find(app, id);
+
+	if (surf && surf->main_id)
+		return latency_surface_find(app, surf->main_id);
+
+	return surf;
+}
+
+static void
+latency_describe_surface(struct debug_app *app, const char *line)
+{
+	struct latency_surface *surf;
+	const char *desc;
+	unsigned int id;
+	size_t len;
+
+	if (!json_get_uint(line, "\"id\":", &id))
+		return;
+
+	surf = latency_surface_ensure(app, id);
+	if (!surf)
+		return;
+
+	if (!json_get_uint(line, "\"main_surface\":", &surf->main_id))
+		surf->main_id = 0;
+
+	desc = strstr(line, "\"desc\":\"");
+	if (!desc)
+		return;
+
+	desc += strlen("\"desc\":\"");
+	len = strcspn(desc, "\"");
+	free(surf->desc);
+	surf->desc = strndup(desc, len);
+}
+
+static void
+latency_record(struct latency_surface *surf, const struct timespec *present)
+{
+	int64_t total = timespec_sub_to_nsec(present, &surf->input);
+	unsigned int bucket;
+
+	surf->state = LATENCY_IDLE;
+
+	/* Input timestamps come from the kernel and should never be newer
+	 * than the frame, but do not let a bogus one skew the averages. */
+	if (total < 0)
+		return;
+
+	surf->count++;
+	surf->input_to_send_ns += timespec_sub_to_nsec(&surf->sent,
+						       &surf->input);
+	surf->send_to_commit_ns += timespec_sub_to_nsec(&surf->commit,
+							&surf->sent);
+	surf->commit_to_present_ns += timespec_sub_to_nsec(present,
+							   &surf->commit);
+	surf->total_ns += total;
+	surf->max_ns = MAX(surf->max_ns, (uint64_t)total);
+
+	bucket = total / (LATENCY_BUCKET_MS * 1000000);
+	surf->histogram[MIN(bucket, LATENCY_BUCKETS - 1)]++;
+}
+
+static void
+latency_handle_line(struct debug_app *app, const char *line)
+{
+	struct latency_surface *surf;
+	struct timespec t, ts;
+	unsigned int id, output_id;
+	char name[64];
+	const char *p;
+
+	if (strstr(line, "\"type\":\"weston_surface\"")) {
+		latency_describe_surface(app, line);
+		return;
+	}
+
+	p = strstr(line, "\"N\":\"");
+	if (!p || sscanf(p + strlen("\"N\":\""), "%63[^\"]", name) != 1)
+		return;
+
+	if (!json_get_timespec(line, "\"T\":", &t))
+		return;
+
+	if (strcmp(name, "core_input_send") == 0) {
+		if (!json_get_uint(line, "\"ws\":", &id) ||
+		    !json_get_timespec(line, "\"input_monotonic\":", &ts))
+			return;
+
+		surf = latency_surface_ensure(app, id);
+		if (!surf || surf->state != LATENCY_IDLE)
+			return;
+
+		surf->state = LATENCY_SENT;
+		surf->input = ts;
+		surf->sent = t;
+	} else if (strcmp(name, "core_commit_damage") == 0) {
+		if (!json_get_uint(line, "\"ws\":", &id))
+			return;
+
+		surf = latency_surface_find_main(app, id);
+		if (!surf || surf->state != LATENCY_SENT)
+			return;
+
+		surf->state = LATENCY_COMMITTED;
+		surf->commit = t;
+	} else if (strcmp(name, "core_flush_damage") == 0) {
+		if (!json_get_uint(line, "\"ws\":", &id) ||
+		    !json_get_uint(line, "\"wo\":", &output_id))
+			return;
+
+		surf = latency_surface_find_main(app, id);
+		if (!surf || surf->state != LATENCY_COMMITTED)
+			return;
+
+		surf->state = LATENCY_REPAINTED;
+		surf->output_id = output_id;
+	} else if (strcmp(name, "core_repaint_finished") == 0) {
+		if (!json_get_uint(line, "\"wo\":", &output_id) ||
+		    !json_get_timespec(line, "\"vblank_monotonic\":", &ts))
+			return;
+
+		wl_list_for_each(surf, &app->latency.surface_list, link) {
+			if (surf->state == LATENCY_REPAINTED &&
+			    surf->output_id == output_id)
+				latency_record(surf, &ts);
+		}
+	}
+}
+
+/** Returns false once the stream has ended. */
+static bool
+latency_read(struct debug_app *app)
+{
+	struct latency_tracker *lt = &app->latency;
+	char *line, *nl;
+	ssize_t len;
+
+	len = read(lt->fd, lt->buf + lt->len, sizeof lt->buf - lt->len - 1);
+	if (len < 0)
+		return errno == EINTR || errno == EAGAIN;
+	if (len == 0)
+		return false;
+
+	lt->len += len;
+	lt->buf[lt->len] = '\0';
+
+	line = lt->buf;
+	while ((nl = strchr(line, '\n'))) {
+		*nl = '\0';
+		latency_handle_line(app, line);
+		line = nl + 1;
+	}
+
+	lt->len -= line - lt->buf;
+	memmove(lt->buf, line, lt->len);
+
+	/* No timeline entry is this long; drop it rather than stall. */
+	if (lt->len == sizeof lt->buf - 1)
+		lt->len = 0;
+
+	return true;
+}
+
+static void
+latency_report(struct debug_app *app)
+{
+	struct latency_surface *surf;
+	unsigned int i, first, last, peak;
+	int fd = app->out_fd;
+
+	wl_list_for_each(surf, &app->latency.surface_list, link) {
+		if (surf->count == 0)
+			continue;
+
+		dprintf(fd, "Surface %u (%s): %u samples\n", surf->id,
+			surf->desc ? surf->desc : "no description",
+			surf->count);
+		dprintf(fd, "  input to client  %8.3f ms\n",
+			surf->input_to_send_ns / 1e6 / surf->count);
+		dprintf(fd, "  client to commit %8.3f ms\n",
+			surf->send_to_commit_ns / 1e6 / surf->count);
+		dprintf(fd, "  commit to screen %8.3f ms\n",
+			surf->commit_to_present_ns / 1e6 / surf->count);
+		dprintf(fd, "  total            %8.3f ms average, "
+			"%.3f ms max\n",
+			surf->total_ns / 1e6 / surf->count,
+			surf->max_ns / 1e6);
+
+		first = LATENCY_BUCKETS;
+		last = 0;
+		peak = 0;
+		for (i = 0; i < LATENCY_BUCKETS; i++) {
+			if (!surf->histogram[i])
+				continue;
+			first = MIN(first, i);
+			last = i;
+			peak = MAX(peak, surf->histogram[i]);
+		}
+
+		for (i = first; i <= last; i++) {
+			if (i == LATENCY_BUCKETS - 1)
+				dprintf(fd, "  %3u+     ms %6u ",
+					i * LATENCY_BUCKET_MS,
+					surf->histogram[i]);
+			else
+				dprintf(fd, "  %3u - %3u ms %6u ",
+					i * LATENCY_BUCKET_MS,
+					(i + 1) * LATENCY_BUCKET_MS,
+					surf->histogram[i]);
+			dprintf(fd, "%.*s\n", (int)(surf->histogram[i] * 50 / peak),
+				"##################################################");
+		}
+	}
+}
+
+static int
+latency_run(struct debug_app *app)
+{
+	struct sigaction sigint = {};
+	struct pollfd pfd[2];
+	int ret = 0;
+
+	sigint.sa_handler = latency_signal_handler;
+	sigaction(SIGINT, &sigint, NULL);
+	sigaction(SIGTERM, &sigint, NULL);
+
+	pfd[0].fd = wl_display_get_fd(app->dpy);
+	pfd[0].events = POLLIN;
+	pfd[1].fd = app->latency.fd;
+	pfd[1].events = POLLIN;
+
+	fprintf(stderr, "Measuring input latency, press Ctrl-C to stop.\n");
+
+	while (latency_running) {
+		if (wl_display_flush(app->dpy) < 0) {
+			ret = 1;
+			break;
+		}
+
+		if (poll(pfd, ARRAY_LENGTH(pfd), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = 1;
+			break;
+		}
+
+		if ((pfd[0].revents & POLLIN) &&
+		    wl_display_dispatch(app->dpy) < 0) {
+			ret = 1;
+			break;
+		}
+
+		if (pfd[0].revents & (POLLERR | POLLHUP)) {
+			ret = 1;
+			break;
+		}
+
+		if ((pfd[1].revents & (POLLIN | POLLHUP)) &&
+		    !latency_read(app))
+			break;
+	}
+
+	latency_report(app);
+
+	return ret;
+}
+
+static void
+latency_destroy(struct debug_app *app)
+{
+	struct latency_surface *surf, *tmp;
+
+	wl_list_for_each_safe(surf, tmp, &app->latency.surface_list, link) {
+		wl_list_remove(&surf->link);
+		free(surf->desc);
+		free(surf);
+	}
+
+	if (app->latency.fd != -1)
+		close(app->latency.fd);
+}
+
 static void
 print_help(void)
 {
@@ -323,6 +740,9 @@ print_help(void)
 		"  -f FD, --outfd FD\n"
 		"     Direct output to the file descriptor FD.\n"
 		"     Stdout (1) is the default. Mutually exclusive with -o.\n"
+		"  -L, --latency\n"
+		"     Follow the timeline stream and, on exit, print per-surface\n"
+		"     histograms of the input to presentation latency.\n"
 		"Names are whatever debug stream names the compositor supports.\n"
 		);
 }
@@ -336,9 +756,10 @@ parse_cmdline(struct debug_app *app, int argc, char **argv)
 		{ "all-streams", no_argument, NULL, 'a' },
 		{ "output", required_argument, NULL, 'o' },
 		{ "outfd", required_argument, NULL, 'f' },
+		{ "latency", no_argument, NULL, 'L' },
 		{ 0 }
 	};
-	static const char optstr[] = "hlao:f:";
+	static const char optstr[] = "hlao:f:L";
 	int c;
 	bool failed = false;
 
@@ -357,6 +778,9 @@ parse_cmdline(struct debug_app *app, int argc, char **argv)
 		case 'a':
 			app->opt.bind_all = true;
 			break;
+		case 'L':
+			app->opt.latency = true;
+			break;
 		case 'o':
 			free(app->opt.output);
 			app->opt.output = strdup(optarg);
@@ -390,10 +814,13 @@ int
 main(int argc, char **argv)
 {
 	struct debug_app app = {};
+	int latency_pipe[2] = { -1, -1 };
 	int ret = 0;
 
 	wl_list_init(&app.stream_list);
+	wl_list_init(&app.latency.surface_list);
 	app.out_fd = -1;
+	app.latency.fd = -1;
 
 	if (parse_cmdline(&app, argc, argv) < 0) {
 		ret = 1;
@@ -405,7 +832,7 @@ main(int argc, char **argv)
 		goto out_parse;
 	}
 
-	if (!app.opt.list && !app.opt.bind_all &&
+	if (!app.opt.list && !app.opt.bind_all && !app.opt.latency &&
 	    wl_list_empty(&app.stream_list)) {
 		fprintf(stderr, "Error: no options given.\n\n");
 		ret = 1;
@@ -419,6 +846,13 @@ main(int argc, char **argv)
 		goto out_parse;
 	}
 
+	if (app.opt.latency &&
+	    (app.opt.bind_all || !wl_list_empty(&app.stream_list))) {
+		fprintf(stderr, "Error: --latency cannot be used with other streams.\n");
+		ret = 1;
+		goto out_parse;
+	}
+
 	if (app.opt.output && app.opt.outfd) {
 		fprintf(stderr, "Error: options --output and --outfd cannot be used simultaneously.\n");
 		ret = 1;
@@ -431,6 +865,22 @@ main(int argc, char **argv)
 		goto out_parse;
 	}
 
+	if (app.opt.latency) {
+		struct debug_stream *stream;
+
+		if (pipe2(latency_pipe, O_CLOEXEC) < 0) {
+			fprintf(stderr, "Error: creating a pipe failed: %s\n",
+				strerror(errno));
+			ret = 1;
+			goto out_parse;
+		}
+		app.latency.fd = latency_pipe[0];
+
+		stream = stream_alloc(&app, "timeline", NULL);
+		if (stream)
+			stream->should_bind = true;
+	}
+
 	app.dpy = wl_display_connect(NULL);
 	if (!app.dpy) {
 		fprintf(stderr, "Error: Could not connect to Wayland display: %s\n",
@@ -456,10 +906,23 @@ main(int argc, char **argv)
 	if (app.opt.list)
 		list_streams(&app);
 
-	start_streams(&app);
+	if (app.opt.latency) {
+		/* The request holds its own copy of the write end, so the
+		 * pipe sees EOF once the compositor ends the stream. */
+		start_streams(&app, latency_pipe[1]);
+		close(latency_pipe[1]);
+		latency_pipe[1] = -1;
+	} else {
+		start_streams(&app, app.out_fd);
+	}
 
 	weston_debug_v1_destroy(app.debug_iface);
 
+	if (app.opt.latency) {
+		ret = latency_run(&app);
+		goto out_conn;
+	}
+
 	while (1) {
 		struct debug_stream *stream;
 		bool empty = true;
@@ -492,7 +955,10 @@ out_conn:
 out_parse:
 	if (app.out_fd != -1)
 		close(app.out_fd);
+	if (latency_pipe[1] != -1)
+		close(latency_pipe[1]);
 
+	latency_destroy(&app);
 	destroy_streams(&app);
 	free(app.opt.output);
 	free(app.opt.outfd);
@@ -0,0 +1,857 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+
+#include "shared/helpers.h"
+#include "shared/string-helpers.h"
+#include "shared/timespec-util.h"
+#include <libweston/zalloc.h>
+#include "weston-debug-client-protocol.h"
+
+/*
+ * A live view of the compositor's performance, refreshed every interval.
+ *
+ * The one-shot 'frame-stats' and 'client-cpu' scopes are bound again on
+ * every refresh; the frame counts they report are turned into rates from
+ * the difference with the previous refresh. The 'drm-backend' scope, when
+ * the compositor offers it, is followed continuously to tell which views
+ * each output showed on planes in its last repaint, and why the others
+ * were composited.
+ */
+
+#define TOP_MAX_CLIENTS 10
+
+struct top_app;
+
+/** A debug scope whose text is read through a pipe */
+struct top_stream {
+	struct top_app *app;
+	const char *name;
+	struct weston_debug_stream_v1 *obj;
+	int fd;
+	char *buf;
+	size_t len;
+	size_t alloc;
+	bool reading;
+	void (*line)(struct top_app *app, char *line);
+};
+
+struct top_output {
+	struct wl_list link;
+	char *name;
+	bool seen;		/* in the last frame-stats */
+	uint64_t frames;
+	uint64_t missed;
+	uint64_t prev_frames;
+	uint64_t prev_missed;
+	bool has_prev;
+	double fps;
+	uint64_t new_missed;
+	uint32_t repaint_avg, repaint_p99;
+	uint32_t gpu_avg, gpu_p99;
+	bool has_gpu;
+	char composition[32];
+	unsigned int generation;	/* of the last drm-backend repaint */
+};
+
+struct top_view {
+	struct wl_list link;
+	char id[24];
+	struct top_output *output;
+	unsigned int generation;
+	bool on_plane;
+	char plane[48];
+	char reason[96];
+};
+
+struct top_app {
+	struct wl_display *dpy;
+	struct wl_registry *registry;
+	struct weston_debug_v1 *debug_iface;
+
+	int interval_msec;
+	int iterations;
+	bool has_drm_scope;
+
+	struct top_stream frame_stats;
+	struct top_stream client_cpu;
+	struct top_stream drm;
+
+	struct wl_list output_list;	/* top_output::link */
+	struct wl_list view_list;	/* top_view::link */
+	struct top_output *drm_output;	/* being repainted */
+
+	char *clients;			/* last client-cpu text */
+	size_t clients_len;
+	struct timespec last_refresh;
+	bool has_refresh;
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void
+signal_handler(int signum)
+{
+	running = 0;
+}
+
+static struct top_output *
+output_get(struct top_app *app, const char *name)
+{
+	struct top_output *output;
+
+	wl_list_for_each(output, &app->output_list, link)
+		if (strcmp(output->name, name) == 0)
+			return output;
+
+	output = zalloc(sizeof *output);
+	if (!output)
+		return NULL;
+
+	output->name = strdup(name);
+	if (!output->name) {
+		free(output);
+		return NULL;
+	}
+	wl_list_insert(app->output_list.prev, &output->link);
+
+	return output;
+}
+
+static struct top_view *
+view_get(struct top_app *app, const char *id)
+{
+	struct top_view *view;
+
+	wl_list_for_each(view, &app->view_list, link)
+		if (strcmp(view->id, id) == 0)
+			return view;
+
+	view = zalloc(sizeof *view);
+	if (!view)
+		return NULL;
+
+	snprintf(view->id, sizeof view->id, "%s", id);
+	wl_list_insert(app->view_list.prev, &view->link);
+
+	return view;
+}
+
+static void
+view_destroy(struct top_view *view)
+{
+	wl_list_remove(&view->link);
+	free(view);
+}
+
+/* Parses the statistics of a series, named at the start of the line. */
+static bool
+parse_series(const char *line, const char *name, uint32_t *avg,
+	     uint32_t *p99)
+{
+	uint32_t min, p50, p90, max;
+	size_t len = strlen(name);
+
+	if (strncmp(line, name, len) != 0)
+		return false;
+
+	return sscanf(line + len, " %" SCNu32 " %" SCNu32 " %" SCNu32
+		      " %" SCNu32 " %" SCNu32 " %" SCNu32,
+		      &min, avg, &p50, &p90, p99, &max) == 6;
+}
+
+static void
+frame_stats_line(struct top_app *app, char *line)
+{
+	static struct top_output *current;
+	struct top_output *output;
+	char name[64];
+	uint64_t frames, missed;
+
+	if (sscanf(line, "output %63[^:]: %" SCNu64 " frames, %" SCNu64,
+		   name, &frames, &missed) == 3) {
+		output = output_get(app, name);
+		if (!output)
+			return;
+		output->seen = true;
+		output->frames = frames;
+		output->missed = missed;
+		current = output;
+		return;
+	}
+
+	if (sscanf(line, "output %63[^:]:", name) == 1) {
+		current = output_get(app, name);
+		if (current)
+			current->seen = true;
+		return;
+	}
+
+	if (!current || line[0] != '\t')
+		return;
+
+	line++;
+	if (parse_series(line, "repaint cpu", &current->repaint_avg,
+			 &current->repaint_p99))
+		return;
+	if (parse_series(line, "render gpu", &current->gpu_avg,
+			 &current->gpu_p99))
+		current->has_gpu = true;
+}
+
+static void
+client_cpu_line(struct top_app *app, char *line)
+{
+	/* Printed as received, the scope sorts the clients itself. */
+}
+
+static char *
+parse_view_id(const char *str, const char *prefix, char *id, size_t len)
+{
+	const char *p = strstr(str, prefix);
+	size_t n;
+
+	if (!p)
+		return NULL;
+
+	p += strlen(prefix);
+	n = strcspn(p, " ");
+	if (n == 0 || n >= len)
+		return NULL;
+
+	memcpy(id, p, n);
+	id[n] = '\0';
+
+	return (char *)p + n;
+}
+
+static void
+drm_line(struct top_app *app, char *line)
+{
+	struct top_output *output = app->drm_output;
+	struct top_view *view, *tmp;
+	char id[24], name[64], *rest, *end;
+
+	line += strspn(line, "\t");
+
+	if (sscanf(line, "[repaint] preparing state for output %63s",
+		   name) == 1) {
+		output = output_get(app, name);
+		app->drm_output = output;
+		if (!output)
+			return;
+
+		output->generation++;
+		wl_list_for_each_safe(view, tmp, &app->view_list, link) {
+			if (view->output == output &&
+			    view->generation + 1 < output->generation)
+				view_destroy(view);
+		}
+		return;
+	}
+
+	if (!output)
+		return;
+
+	if (sscanf(line, "[repaint] Using %31s composition",
+		   output->composition) == 1)
+		return;
+
+	if ((rest = parse_view_id(line, "[view] evaluating view ", id,
+				  sizeof id))) {
+		view = view_get(app, id);
+		if (view)
+			view->reason[0] = '\0';
+		return;
+	}
+
+	/* Why a view did not go on a plane: the last reason given in the
+	 * repaint is the one that decided it. */
+	if ((rest = parse_view_id(line, "not assigning view ", id,
+				  sizeof id)) ||
+	    (rest = parse_view_id(line, "not placing view ", id,
+				  sizeof id))) {
+		view = view_get(app, id);
+		if (!view)
+			return;
+
+		/* "... to plane (reason)" or "... on plane: reason" */
+		if ((end = strchr(rest, '(')))
+			rest = end + 1;
+		else if ((end = strstr(rest, ": ")))
+			rest = end + 2;
+		end = rest + strcspn(rest, ")");
+		snprintf(view->reason, sizeof view->reason, "%.*s",
+			 (int)(end - rest), rest);
+		return;
+	}
+
+	if ((rest = parse_view_id(line, "[repaint] view ", id, sizeof id))) {
+		view = view_get(app, id);
+		if (!view)
+			return;
+
+		view->output = output;
+		view->generation = output->generation;
+		rest += strspn(rest, " ");
+		if (strncmp(rest, "on ", 3) == 0) {
+			view->on_plane = true;
+			snprintf(view->plane, sizeof view->plane, "%s",
+				 rest + 3);
+			view->reason[0] = '\0';
+		} else {
+			view->on_plane = false;
+			view->plane[0] = '\0';
+		}
+	}
+}
+
+static void
+stream_read_lines(struct top_stream *stream, bool eof)
+{
+	char *line, *nl;
+
+	stream->buf[stream->len] = '\0';
+
+	line = stream->buf;
+	while ((nl = strchr(line, '\n'))) {
+		*nl = '\0';
+		stream->line(stream->app, line);
+		line = nl + 1;
+	}
+
+	if (eof && *line)
+		stream->line(stream->app, line);
+
+	stream->len -= line - stream->buf;
+	memmove(stream->buf, line, stream->len);
+}
+
+/* Returns false once the stream has ended. */
+static bool
+stream_read(struct top_stream *stream)
+{
+	size_t alloc;
+	ssize_t len;
+	char *buf;
+
+	if (stream->alloc - stream->len < 1024) {
+		alloc = stream->alloc ? stream->alloc * 2 : 4096;
+		buf = realloc(stream->buf, alloc);
+		if (!buf)
+			return false;
+		stream->buf = buf;
+		stream->alloc = alloc;
+	}
+
+	len = read(stream->fd, stream->buf + stream->len,
+		   stream->alloc - stream->len - 1);
+	if (len < 0)
+		return errno == EINTR || errno == EAGAIN;
+
+	stream->len += len;
+
+	/* The client list is kept whole, the others are parsed as they
+	 * come. */
+	if (stream->line != client_cpu_line)
+		stream_read_lines(stream, len == 0);
+
+	return len > 0;
+}
+
+static void
+stream_close(struct top_stream *stream)
+{
+	if (stream->obj)
+		weston_debug_stream_v1_destroy(stream->obj);
+	stream->obj = NULL;
+
+	if (stream->fd >= 0)
+		close(stream->fd);
+	stream->fd = -1;
+	stream->reading = false;
+}
+
+static void
+handle_stream_complete(void *data, struct weston_debug_stream_v1 *obj)
+{
+	/* The data is complete once the pipe is at end of file. */
+}
+
+static void
+handle_stream_failure(void *data, struct weston_debug_stream_v1 *obj,
+		      const char *msg)
+{
+	struct top_stream *stream = data;
+
+	fprintf(stderr, "Debug stream '%s' aborted: %s\n", stream->name, msg);
+	stream_close(stream);
+}
+
+static const struct weston_debug_stream_v1_listener stream_listener = {
+	handle_stream_complete,
+	handle_stream_failure
+};
+
+static bool
+stream_start(struct top_app *app, struct top_stream *stream)
+{
+	int fds[2];
+
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		fprintf(stderr, "Error: creating a pipe failed: %s\n",
+			strerror(errno));
+		return false;
+	}
+
+	stream->fd = fds[0];
+	stream->len = 0;
+	stream->reading = true;
+	stream->obj = weston_debug_v1_subscribe(app->debug_iface,
+						stream->name, fds[1]);
+	weston_debug_stream_v1_add_listener(stream->obj, &stream_listener,
+					    stream);
+
+	/* The request holds its own copy of the write end, so the pipe
+	 * sees EOF once the compositor ends the stream. */
+	close(fds[1]);
+
+	return true;
+}
+
+static void
+outputs_update_rates(struct top_app *app, const struct timespec *now)
+{
+	struct top_output *output;
+	int64_t msec = 0;
+
+	if (app->has_refresh)
+		msec = timespec_sub_to_msec(now, &app->last_refresh);
+
+	wl_list_for_each(output, &app->output_list, link) {
+		if (!output->seen)
+			continue;
+
+		if (output->has_prev && msec > 0 &&
+		    output->frames >= output->prev_frames) {
+			output->fps = (output->frames - output->prev_frames) *
+				      1000.0 / msec;
+			output->new_missed = output->missed -
+					     output->prev_missed;
+		}
+		output->prev_frames = output->frames;
+		output->prev_missed = output->missed;
+		output->has_prev = true;
+	}
+
+	app->last_refresh = *now;
+	app->has_refresh = true;
+}
+
+static void
+print_screen(struct top_app *app)
+{
+	struct top_output *output;
+	struct top_view *view;
+	unsigned int planes, composited, clients = 0;
+	char *line, *nl;
+
+	if (isatty(STDOUT_FILENO))
+		printf("\033[H\033[2J");
+
+	printf("%-16s %8s %8s %10s %10s %10s %10s  %s\n", "OUTPUT", "FPS",
+	       "MISSED", "CPU us", "CPU p99", "GPU us", "GPU p99",
+	       app->has_drm_scope ? "COMPOSITION" : "");
+
+	wl_list_for_each(output, &app->output_list, link) {
+		if (!output->seen)
+			continue;
+
+		printf("%-16s %8.1f %8" PRIu64 " %10" PRIu32 " %10" PRIu32,
+		       output->name, output->fps, output->new_missed,
+		       output->repaint_avg, output->repaint_p99);
+		if (output->has_gpu)
+			printf(" %10" PRIu32 " %10" PRIu32, output->gpu_avg,
+			       output->gpu_p99);
+		else
+			printf(" %10s %10s", "-", "-");
+		printf("  %s\n", output->composition);
+	}
+
+	if (app->has_drm_scope) {
+		printf("\n%-18s %-16s %s\n", "VIEW", "OUTPUT",
+		       "PLANE OR REASON FOR COMPOSITING");
+
+		wl_list_for_each(output, &app->output_list, link) {
+			planes = 0;
+			composited = 0;
+
+			wl_list_for_each(view, &app->view_list, link) {
+				if (view->output != output ||
+				    view->generation != output->generation)
+					continue;
+
+				if (view->on_plane) {
+					planes++;
+					printf("%-18s %-16s %s\n", view->id,
+					       output->name, view->plane);
+				} else {
+					composited++;
+					printf("%-18s %-16s composited: %s\n",
+					       view->id, output->name,
+					       view->reason[0] ?
+					       view->reason : "(no reason given)");
+				}
+			}
+
+			if (planes + composited > 0)
+				printf("%-18s %-16s %u on planes, "
+				       "%u composited\n", "", output->name,
+				       planes, composited);
+		}
+	}
+
+	printf("\nBUSIEST CLIENTS\n");
+	for (line = app->clients; line && *line; line = nl + 1) {
+		nl = strchr(line, '\n');
+		if (!nl)
+			break;
+
+		if (line[0] != '\t' && ++clients > TOP_MAX_CLIENTS)
+			break;
+
+		printf("%.*s\n", (int)(nl - line), line);
+	}
+
+	fflush(stdout);
+}
+
+static void
+refresh_done(struct top_app *app)
+{
+	struct timespec now;
+	char *buf;
+
+	/* Keep the client list for printing. */
+	buf = malloc(app->client_cpu.len + 1);
+	if (buf) {
+		memcpy(buf, app->client_cpu.buf, app->client_cpu.len);
+		buf[app->client_cpu.len] = '\0';
+		free(app->clients);
+		app->clients = buf;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	outputs_update_rates(app, &now);
+	print_screen(app);
+
+	if (app->iterations > 0)
+		app->iterations--;
+	if (app->iterations == 0)
+		running = 0;
+}
+
+static bool
+refresh_start(struct top_app *app)
+{
+	struct top_output *output;
+
+	wl_list_for_each(output, &app->output_list, link)
+		output->seen = false;
+
+	return stream_start(app, &app->frame_stats) &&
+	       stream_start(app, &app->client_cpu);
+}
+
+static void
+debug_advertise(void *data, struct weston_debug_v1 *debug, const char *name,
+		const char *desc)
+{
+	struct top_app *app = data;
+
+	if (strcmp(name, "drm-backend") == 0)
+		app->has_drm_scope = true;
+}
+
+static const struct weston_debug_v1_listener debug_listener = {
+	debug_advertise,
+};
+
+static void
+global_handler(void *data, struct wl_registry *registry, uint32_t id,
+	       const char *interface, uint32_t version)
+{
+	struct top_app *app = data;
+
+	if (strcmp(interface, weston_debug_v1_interface.name) == 0 &&
+	    !app->debug_iface) {
+		app->debug_iface =
+			wl_registry_bind(registry, id,
+					 &weston_debug_v1_interface, 1);
+		weston_debug_v1_add_listener(app->debug_iface, &debug_listener,
+					     app);
+	}
+}
+
+static void
+global_remove_handler(void *data, struct wl_registry *registry, uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+	global_handler,
+	global_remove_handler
+};
+
+static int
+run(struct top_app *app)
+{
+	struct top_stream *streams[] = {
+		&app->frame_stats, &app->client_cpu, &app->drm,
+	};
+	struct pollfd pfd[1 + ARRAY_LENGTH(streams)];
+	struct timespec now, next;
+	int64_t timeout;
+	unsigned int i, n;
+	bool refreshing;
+
+	if (app->has_drm_scope && !stream_start(app, &app->drm))
+		return 1;
+
+	if (!refresh_start(app))
+		return 1;
+	refreshing = true;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (running) {
+		if (wl_display_flush(app->dpy) < 0)
+			return 1;
+
+		pfd[0].fd = wl_display_get_fd(app->dpy);
+		pfd[0].events = POLLIN;
+		n = 1;
+		for (i = 0; i < ARRAY_LENGTH(streams); i++) {
+			if (!streams[i]->reading)
+				continue;
+			pfd[n].fd = streams[i]->fd;
+			pfd[n].events = POLLIN;
+			n++;
+		}
+
+		timeout = -1;
+		if (!refreshing) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timeout = MAX(timespec_sub_to_msec(&next, &now), 0);
+		}
+
+		if (poll(pfd, n, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+
+		if (pfd[0].revents & (POLLERR | POLLHUP))
+			return 1;
+		if ((pfd[0].revents & POLLIN) &&
+		    wl_display_dispatch(app->dpy) < 0)
+			return 1;
+
+		for (i = 1; i < n; i++) {
+			struct top_stream *stream = NULL;
+			unsigned int j;
+
+			if (!(pfd[i].revents & (POLLIN | POLLHUP)))
+				continue;
+
+			for (j = 0; j < ARRAY_LENGTH(streams); j++)
+				if (streams[j]->reading &&
+				    streams[j]->fd == pfd[i].fd)
+					stream = streams[j];
+
+			if (stream && !stream_read(stream))
+				stream_close(stream);
+		}
+
+		if (refreshing && !app->frame_stats.reading &&
+		    !app->client_cpu.reading) {
+			refreshing = false;
+			refresh_done(app);
+			timespec_add_msec(&next, &next, app->interval_msec);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (running && !refreshing &&
+		    timespec_sub_to_nsec(&next, &now) <= 0) {
+			if (!refresh_start(app))
+				return 1;
+			refreshing = true;
+		}
+	}
+
+	return 0;
+}
+
+static void
+print_help(void)
+{
+	fprintf(stderr,
+		"Usage: weston-top [options]\n"
+		"Where options may be:\n"
+		"  -h, --help\n"
+		"     This help text, and exit with success.\n"
+		"  -d MSEC, --delay MSEC\n"
+		"     Refresh every MSEC milliseconds, 1000 by default.\n"
+		"  -n COUNT, --iterations COUNT\n"
+		"     Exit after COUNT refreshes.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	static const struct option opts[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "delay", required_argument, NULL, 'd' },
+		{ "iterations", required_argument, NULL, 'n' },
+		{ 0 }
+	};
+	struct top_app app = {
+		.interval_msec = 1000,
+		.iterations = -1,
+		.frame_stats = { .name = "frame-stats", .fd = -1,
+				 .line = frame_stats_line },
+		.client_cpu = { .name = "client-cpu", .fd = -1,
+				.line = client_cpu_line },
+		.drm = { .name = "drm-backend", .fd = -1,
+			 .line = drm_line },
+	};
+	struct sigaction sigint = {};
+	struct top_output *output, *otmp;
+	struct top_view *view, *vtmp;
+	int c, ret;
+
+	while ((c = getopt_long(argc, argv, "hd:n:", opts, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+			print_help();
+			return 0;
+		case 'd':
+			if (!safe_strtoint(optarg, &app.interval_msec) ||
+			    app.interval_msec <= 0) {
+				fprintf(stderr, "Error: bad delay '%s'\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			if (!safe_strtoint(optarg, &app.iterations) ||
+			    app.iterations <= 0) {
+				fprintf(stderr, "Error: bad count '%s'\n",
+					optarg);
+				return 1;
+			}
+			break;
+		default:
+			print_help();
+			return 1;
+		}
+	}
+
+	app.frame_stats.app = &app;
+	app.client_cpu.app = &app;
+	app.drm.app = &app;
+	wl_list_init(&app.output_list);
+	wl_list_init(&app.view_list);
+
+	sigint.sa_handler = signal_handler;
+	sigaction(SIGINT, &sigint, NULL);
+	sigaction(SIGTERM, &sigint, NULL);
+
+	app.dpy = wl_display_connect(NULL);
+	if (!app.dpy) {
+		fprintf(stderr, "Error: Could not connect to Wayland display: %s\n",
+			strerror(errno));
+		return 1;
+	}
+
+	app.registry = wl_display_get_registry(app.dpy);
+	wl_registry_add_listener(app.registry, &registry_listener, &app);
+	wl_display_roundtrip(app.dpy);
+
+	if (!app.debug_iface) {
+		fprintf(stderr,
+			"The Wayland server does not support %s interface.\n"
+			"Start weston with --debug to enable it.\n",
+			weston_debug_v1_interface.name);
+		ret = 1;
+		goto out;
+	}
+
+	wl_display_roundtrip(app.dpy); /* for weston_debug_v1::advertise */
+
+	ret = run(&app);
+
+	stream_close(&app.frame_stats);
+	stream_close(&app.client_cpu);
+	stream_close(&app.drm);
+	weston_debug_v1_destroy(app.debug_iface);
+
+	/* Wait for server to close all files */
+	wl_display_roundtrip(app.dpy);
+
+out:
+	wl_registry_destroy(app.registry);
+	wl_display_disconnect(app.dpy);
+
+	wl_list_for_each_safe(view, vtmp, &app.view_list, link)
+		view_destroy(view);
+	wl_list_for_each_safe(output, otmp, &app.output_list, link) {
+		wl_list_remove(&output->link);
+		free(output->name);
+		free(output);
+	}
+	free(app.frame_stats.buf);
+	free(app.client_cpu.buf);
+	free(app.drm.buf);
+	free(app.clients);
+
+	return ret;
+}
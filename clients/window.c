@@ -176,8 +176,19 @@ struct toysurface {
 	 */
 	void (*swap)(struct toysurface *base,
 		     enum wl_output_transform buffer_transform, int32_t buffer_scale,
+		     const struct rectangle *damage,
 		     struct rectangle *server_allocation);
 
+	/*
+	 * Get the area of the buffer returned by prepare() that does not
+	 * hold the last frame posted, in buffer coordinates. A swap() with
+	 * a damage rectangle must have had at least this area redrawn.
+	 * NULL if the buffer content is undefined after prepare(), swap()
+	 * then ignores the damage and the whole surface must be drawn.
+	 */
+	void (*get_buffer_damage)(struct toysurface *base,
+				  struct rectangle *damage);
+
 	/*
 	 * Make the toysurface current with the given EGL context.
 	 * Returns 0 on success, and negative on failure.
@@ -207,6 +218,12 @@ struct surface {
 	struct toysurface *toysurface;
 	struct widget *widget;
 	int redraw_needed;
+	/* Allocations of the widgets scheduled for redraw */
+	struct rectangle damage;
+	/* While redraw_partial, only widgets intersecting redraw_clip are
+	 * redrawn, and they are clipped to it. */
+	int redraw_partial;
+	struct rectangle redraw_clip;
 	struct wl_callback *frame_cb;
 	uint32_t last_time;
 
@@ -577,6 +594,7 @@ egl_window_surface_prepare(struct toysurface *base, int dx, int dy,
 static void
 egl_window_surface_swap(struct toysurface *base,
 			enum wl_output_transform buffer_transform, int32_t buffer_scale,
+			const struct rectangle *damage,
 			struct rectangle *server_allocation)
 {
 	struct egl_window_surface *surface = to_egl_window_surface(base);
@@ -753,6 +771,7 @@ make_shm_pool(struct display *display, int size, void **data)
 		close(fd);
 		return NULL;
 	}
+	os_advise_huge_pages(*data, size);
 
 	pool = wl_shm_create_pool(display->shm, fd, size);
 
@@ -802,13 +821,6 @@ shm_pool_destroy(struct shm_pool *pool)
 	free(pool);
 }
 
-/* Start allocating from the beginning of the pool again */
-static void
-shm_pool_reset(struct shm_pool *pool)
-{
-	pool->used = 0;
-}
-
 static int
 data_length_for_shm_surface(struct rectangle *rect)
 {
@@ -869,27 +881,12 @@ display_create_shm_surface_from_pool(struct display *display,
 
 static cairo_surface_t *
 display_create_shm_surface(struct display *display,
-			   struct rectangle *rectangle, uint32_t flags,
-			   struct shm_pool *alternate_pool,
-			   struct shm_surface_data **data_ret)
+			   struct rectangle *rectangle, uint32_t flags)
 {
 	struct shm_surface_data *data;
 	struct shm_pool *pool;
 	cairo_surface_t *surface;
 
-	if (alternate_pool) {
-		shm_pool_reset(alternate_pool);
-		surface = display_create_shm_surface_from_pool(display,
-							       rectangle,
-							       flags,
-							       alternate_pool);
-		if (surface) {
-			data = cairo_surface_get_user_data(surface,
-							   &shm_surface_data_key);
-			goto out;
-		}
-	}
-
 	pool = shm_pool_create(display, data_length_for_shm_surface(rectangle));
 	if (!pool)
 		return NULL;
@@ -907,10 +904,6 @@ display_create_shm_surface(struct display *display,
 	data = cairo_surface_get_user_data(surface, &shm_surface_data_key);
 	data->pool = pool;
 
-out:
-	if (data_ret)
-		*data_ret = data;
-
 	return surface;
 }
 
@@ -935,8 +928,143 @@ display_create_surface(struct display *display,
 		return NULL;
 
 	assert(flags & SURFACE_SHM);
-	return display_create_shm_surface(display, rectangle, flags,
-					  NULL, NULL);
+	return display_create_shm_surface(display, rectangle, flags);
+}
+
+static int
+rectangle_is_empty(const struct rectangle *r)
+{
+	return r->width <= 0 || r->height <= 0;
+}
+
+/* Grow r to the bounding box of r and add */
+static void
+rectangle_union(struct rectangle *r, const struct rectangle *add)
+{
+	int32_t x2, y2;
+
+	if (rectangle_is_empty(add))
+		return;
+
+	if (rectangle_is_empty(r)) {
+		*r = *add;
+		return;
+	}
+
+	x2 = MAX(r->x + r->width, add->x + add->width);
+	y2 = MAX(r->y + r->height, add->y + add->height);
+	r->x = MIN(r->x, add->x);
+	r->y = MIN(r->y, add->y);
+	r->width = x2 - r->x;
+	r->height = y2 - r->y;
+}
+
+static int
+rectangle_intersects(const struct rectangle *a, const struct rectangle *b)
+{
+	return !rectangle_is_empty(a) && !rectangle_is_empty(b) &&
+	       a->x < b->x + b->width && b->x < a->x + a->width &&
+	       a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+#define MAX_LEAVES 3
+
+/*
+ * The buffers of a shm_surface share one pool of MAX_LEAVES equally sized
+ * slots, one per leaf. The whole range is mapped up front, the file only
+ * grows when a leaf first needs its slot, so a surface that never has a
+ * third buffer in flight never pays for it. Buffers of a different size
+ * are created in the same slot without a new mmap, only outgrowing the
+ * slots, or shrinking well below them, makes a new pool.
+ */
+struct shm_buffer_pool {
+	struct wl_shm_pool *pool;
+	int fd;
+	void *data;
+	size_t slot_size;
+	int n_slots; /* slots backed by the file */
+	int refcount;
+};
+
+static struct shm_buffer_pool *
+shm_buffer_pool_create(struct display *display, size_t slot_size)
+{
+	struct shm_buffer_pool *pool;
+
+	pool = zalloc(sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pool->fd = os_create_anonymous_file(slot_size);
+	if (pool->fd < 0) {
+		fprintf(stderr, "creating a buffer file for %zu B failed: %s\n",
+			slot_size, strerror(errno));
+		free(pool);
+		return NULL;
+	}
+
+	/* Mapping past the end of the file is fine, as long as nothing
+	 * touches the slots not backed yet. */
+	pool->data = mmap(NULL, slot_size * MAX_LEAVES,
+			  PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, 0);
+	if (pool->data == MAP_FAILED) {
+		fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+		close(pool->fd);
+		free(pool);
+		return NULL;
+	}
+	os_advise_huge_pages(pool->data, slot_size * MAX_LEAVES);
+
+	pool->pool = wl_shm_create_pool(display->shm, pool->fd, slot_size);
+	pool->slot_size = slot_size;
+	pool->n_slots = 1;
+	pool->refcount = 1;
+
+	return pool;
+}
+
+static struct shm_buffer_pool *
+shm_buffer_pool_ref(struct shm_buffer_pool *pool)
+{
+	pool->refcount++;
+	return pool;
+}
+
+static void
+shm_buffer_pool_unref(struct shm_buffer_pool *pool)
+{
+	if (--pool->refcount > 0)
+		return;
+
+	munmap(pool->data, pool->slot_size * MAX_LEAVES);
+	wl_shm_pool_destroy(pool->pool);
+	close(pool->fd);
+	free(pool);
+}
+
+/* Back the slots up to and including 'slot' with the file. */
+static int
+shm_buffer_pool_ensure_slot(struct shm_buffer_pool *pool, int slot)
+{
+	size_t size = pool->slot_size * (slot + 1);
+	int ret;
+
+	if (slot < pool->n_slots)
+		return 0;
+
+	do {
+		ret = ftruncate(pool->fd, size);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		fprintf(stderr, "growing a buffer file to %zu B failed: %s\n",
+			size, strerror(errno));
+		return -1;
+	}
+
+	wl_shm_pool_resize(pool->pool, size);
+	pool->n_slots = slot + 1;
+
+	return 0;
 }
 
 struct shm_surface_leaf {
@@ -944,7 +1072,10 @@ struct shm_surface_leaf {
 	/* 'data' is automatically destroyed, when 'cairo_surface' is */
 	struct shm_surface_data *data;
 
-	struct shm_pool *resize_pool;
+	/* Holds the slot of the buffer, referenced while there is one */
+	struct shm_buffer_pool *pool;
+	/* Out of date since the buffer was last drawn, buffer coordinates */
+	struct rectangle damage;
 	int busy;
 };
 
@@ -955,14 +1086,12 @@ shm_surface_leaf_release(struct shm_surface_leaf *leaf)
 		cairo_surface_destroy(leaf->cairo_surface);
 	/* leaf->data already destroyed via cairo private */
 
-	if (leaf->resize_pool)
-		shm_pool_destroy(leaf->resize_pool);
+	if (leaf->pool)
+		shm_buffer_pool_unref(leaf->pool);
 
 	memset(leaf, 0, sizeof *leaf);
 }
 
-#define MAX_LEAVES 3
-
 struct shm_surface {
 	struct toysurface base;
 	struct display *display;
@@ -970,6 +1099,9 @@ struct shm_surface {
 	uint32_t flags;
 	int dx, dy;
 
+	/* The pool new buffers are created in */
+	struct shm_buffer_pool *pool;
+
 	struct shm_surface_leaf leaf[MAX_LEAVES];
 	struct shm_surface_leaf *current;
 };
@@ -1044,6 +1176,46 @@ static const struct wl_buffer_listener shm_surface_buffer_listener = {
 	shm_surface_buffer_release
 };
 
+static cairo_surface_t *
+shm_buffer_pool_create_surface(struct shm_buffer_pool *pool, int slot,
+			       int32_t width, int32_t height, uint32_t flags,
+			       struct shm_surface_data **data_ret)
+{
+	struct shm_surface_data *data;
+	cairo_surface_t *surface;
+	uint32_t format;
+	int stride, offset;
+
+	data = malloc(sizeof *data);
+	if (data == NULL)
+		return NULL;
+
+	stride = cairo_format_stride_for_width (CAIRO_FORMAT_ARGB32, width);
+	offset = slot * pool->slot_size;
+	data->pool = NULL;
+
+	surface = cairo_image_surface_create_for_data ((char *) pool->data +
+						       offset,
+						       CAIRO_FORMAT_ARGB32,
+						       width, height, stride);
+
+	cairo_surface_set_user_data(surface, &shm_surface_data_key,
+				    data, shm_surface_data_destroy);
+
+	if (flags & SURFACE_OPAQUE)
+		format = WL_SHM_FORMAT_XRGB8888;
+	else
+		format = WL_SHM_FORMAT_ARGB8888;
+
+	data->buffer = wl_shm_pool_create_buffer(pool->pool, offset,
+						 width, height,
+						 stride, format);
+
+	*data_ret = data;
+
+	return surface;
+}
+
 static cairo_surface_t *
 shm_surface_prepare(struct toysurface *base, int dx, int dy,
 		    int32_t width, int32_t height, uint32_t flags,
@@ -1053,6 +1225,8 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 	struct shm_surface *surface = to_shm_surface(base);
 	struct rectangle rect = { 0};
 	struct shm_surface_leaf *leaf = NULL;
+	struct shm_buffer_pool *pool;
+	size_t length, slot_size;
 	int i;
 
 	surface->dx = dx;
@@ -1076,13 +1250,6 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 		return NULL;
 	}
 
-	if (!resize_hint && leaf->resize_pool) {
-		cairo_surface_destroy(leaf->cairo_surface);
-		leaf->cairo_surface = NULL;
-		shm_pool_destroy(leaf->resize_pool);
-		leaf->resize_pool = NULL;
-	}
-
 	surface_to_buffer_size (buffer_transform, buffer_scale, &width, &height);
 
 	if (leaf->cairo_surface &&
@@ -1090,33 +1257,46 @@ shm_surface_prepare(struct toysurface *base, int dx, int dy,
 	    cairo_image_surface_get_height(leaf->cairo_surface) == height)
 		goto out;
 
-	if (leaf->cairo_surface)
-		cairo_surface_destroy(leaf->cairo_surface);
+	shm_surface_leaf_release(leaf);
+
+	rect.width = width;
+	rect.height = height;
+	length = data_length_for_shm_surface(&rect);
 
+	if (!surface->pool || length > surface->pool->slot_size ||
+	    (!resize_hint && length * 2 < surface->pool->slot_size)) {
+		slot_size = length;
 #ifdef USE_RESIZE_POOL
-	if (resize_hint && !leaf->resize_pool) {
-		/* Create a big pool to allocate from, while continuously
-		 * resizing. Mmapping a new pool in the server
-		 * is relatively expensive, so reusing a pool performs
-		 * better, but may temporarily reserve unneeded memory.
-		 */
-		/* We should probably base this number on the output size. */
-		leaf->resize_pool = shm_pool_create(surface->display,
-						    6 * 1024 * 1024);
-	}
+		/* Leave room to grow while continuously resizing, mmapping
+		 * a new pool in the server is relatively expensive. */
+		if (resize_hint)
+			slot_size += slot_size / 2;
 #endif
+		slot_size = (slot_size + 4095) & ~(size_t) 4095;
 
-	rect.width = width;
-	rect.height = height;
+		pool = shm_buffer_pool_create(surface->display, slot_size);
+		if (!pool)
+			return NULL;
+
+		if (surface->pool)
+			shm_buffer_pool_unref(surface->pool);
+		surface->pool = pool;
+	}
+
+	if (shm_buffer_pool_ensure_slot(surface->pool, leaf - surface->leaf) < 0)
+		return NULL;
 
 	leaf->cairo_surface =
-		display_create_shm_surface(surface->display, &rect,
-					   surface->flags,
-					   leaf->resize_pool,
-					   &leaf->data);
+		shm_buffer_pool_create_surface(surface->pool,
+					       leaf - surface->leaf,
+					       width, height, surface->flags,
+					       &leaf->data);
 	if (!leaf->cairo_surface)
 		return NULL;
 
+	leaf->pool = shm_buffer_pool_ref(surface->pool);
+	leaf->damage = rect;
+
 	wl_buffer_add_listener(leaf->data->buffer,
 			       &shm_surface_buffer_listener, surface);
 
@@ -1126,27 +1306,57 @@ out:
 	return cairo_surface_reference(leaf->cairo_surface);
 }
 
+static void
+shm_surface_get_buffer_damage(struct toysurface *base,
+			      struct rectangle *damage)
+{
+	struct shm_surface *surface = to_shm_surface(base);
+
+	*damage = surface->current->damage;
+}
+
 static void
 shm_surface_swap(struct toysurface *base,
 		 enum wl_output_transform buffer_transform, int32_t buffer_scale,
+		 const struct rectangle *damage,
 		 struct rectangle *server_allocation)
 {
 	struct shm_surface *surface = to_shm_surface(base);
 	struct shm_surface_leaf *leaf = surface->current;
+	struct rectangle full = { 0 };
+	int i;
+
+	full.width = cairo_image_surface_get_width(leaf->cairo_surface);
+	full.height = cairo_image_surface_get_height(leaf->cairo_surface);
+	if (!damage)
+		damage = &full;
 
-	server_allocation->width =
-		cairo_image_surface_get_width(leaf->cairo_surface);
-	server_allocation->height =
-		cairo_image_surface_get_height(leaf->cairo_surface);
+	server_allocation->width = full.width;
+	server_allocation->height = full.height;
 
 	buffer_to_surface_size (buffer_transform, buffer_scale,
 				&server_allocation->width,
 				&server_allocation->height);
 
+	/* The other buffers miss what changed in this one. */
+	for (i = 0; i < MAX_LEAVES; i++) {
+		if (&surface->leaf[i] != leaf && surface->leaf[i].cairo_surface)
+			rectangle_union(&surface->leaf[i].damage, damage);
+	}
+	leaf->damage.width = 0;
+	leaf->damage.height = 0;
+
 	wl_surface_attach(surface->surface, leaf->data->buffer,
 			  surface->dx, surface->dy);
-	wl_surface_damage(surface->surface, 0, 0,
-			  server_allocation->width, server_allocation->height);
+	if (wl_surface_get_version(surface->surface) >=
+	    WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION)
+		wl_surface_damage_buffer(surface->surface,
+					 damage->x, damage->y,
+					 damage->width, damage->height);
+	else
+		wl_surface_damage(surface->surface, 0, 0,
+				  server_allocation->width,
+				  server_allocation->height);
 	wl_surface_commit(surface->surface);
 
 	DBG_OBJ(surface->surface, "leaf %d busy\n",
@@ -1176,6 +1386,9 @@ shm_surface_destroy(struct toysurface *base)
 	for (i = 0; i < MAX_LEAVES; i++)
 		shm_surface_leaf_release(&surface->leaf[i]);
 
+	if (surface->pool)
+		shm_buffer_pool_unref(surface->pool);
+
 	free(surface);
 }
 
@@ -1189,6 +1402,7 @@ shm_surface_create(struct display *display, struct wl_surface *wl_surface,
 	surface = xzalloc(sizeof *surface);
 	surface->base.prepare = shm_surface_prepare;
 	surface->base.swap = shm_surface_swap;
+	surface->base.get_buffer_damage = shm_surface_get_buffer_damage;
 	surface->base.acquire = shm_surface_acquire;
 	surface->base.release = shm_surface_release;
 	surface->base.destroy = shm_surface_destroy;
@@ -1391,6 +1605,9 @@ static void
 surface_flush(struct surface *surface)
 {
 	struct widget *widget = surface->widget;
+	struct rectangle damage, *swap_damage = NULL;
+	int32_t scale;
+
 	if (!surface->cairo_surface)
 		return;
 
@@ -1414,9 +1631,21 @@ surface_flush(struct surface *surface)
 					    widget->viewport_dest_height);
 	}
 
+	if (surface->redraw_partial) {
+		scale = surface->buffer_scale;
+		damage.x = (surface->redraw_clip.x -
+			    surface->allocation.x) * scale;
+		damage.y = (surface->redraw_clip.y -
+			    surface->allocation.y) * scale;
+		damage.width = surface->redraw_clip.width * scale;
+		damage.height = surface->redraw_clip.height * scale;
+		swap_damage = &damage;
+		surface->redraw_partial = 0;
+	}
+
 	surface->toysurface->swap(surface->toysurface,
 				  surface->buffer_transform, surface->buffer_scale,
-				  &surface->server_allocation);
+				  swap_damage, &surface->server_allocation);
 
 	cairo_surface_destroy(surface->cairo_surface);
 	surface->cairo_surface = NULL;
@@ -1883,6 +2112,14 @@ widget_cairo_create(struct widget *widget)
 
 	cairo_translate(cr, -surface->allocation.x, -surface->allocation.y);
 
+	if (surface->redraw_partial) {
+		cairo_rectangle(cr, surface->redraw_clip.x,
+				surface->redraw_clip.y,
+				surface->redraw_clip.width,
+				surface->redraw_clip.height);
+		cairo_clip(cr);
+	}
+
 	return cr;
 }
 
@@ -2029,6 +2266,20 @@ widget_schedule_redraw(struct widget *widget)
 {
 	DBG_OBJ(widget->surface->surface, "widget %p\n", widget);
 	widget->surface->redraw_needed = 1;
+	rectangle_union(&widget->surface->damage, &widget->allocation);
+	window_schedule_redraw_task(widget->window);
+}
+
+/* Like widget_schedule_redraw(), but only rect (in the same coordinates as
+ * the widget allocation) has changed. */
+void
+widget_schedule_redraw_rect(struct widget *widget,
+			    const struct rectangle *rect)
+{
+	DBG_OBJ(widget->surface->surface, "widget %p %dx%d@%d,%d\n", widget,
+		rect->width, rect->height, rect->x, rect->y);
+	widget->surface->redraw_needed = 1;
+	rectangle_union(&widget->surface->damage, rect);
 	window_schedule_redraw_task(widget->window);
 }
 
@@ -4510,15 +4761,78 @@ window_get_allocation(struct window *window,
 	*allocation = window->main_surface->allocation;
 }
 
+/* A widget outside the redraw clip is skipped, unless its parent was
+ * redrawn: the parent may have painted over it without going through the
+ * clip of widget_cairo_create(). Children of skipped widgets are still
+ * visited, they may lie outside their parent. */
 static void
-widget_redraw(struct widget *widget)
+widget_redraw(struct widget *widget, int parent_redrawn)
 {
+	struct surface *surface = widget->surface;
 	struct widget *child;
+	int redrawn = parent_redrawn;
 
-	if (widget->redraw_handler)
+	if (widget->redraw_handler &&
+	    (parent_redrawn || !surface->redraw_partial ||
+	     rectangle_intersects(&widget->allocation, &surface->redraw_clip))) {
 		widget->redraw_handler(widget, widget->user_data);
+		redrawn = 1;
+	}
 	wl_list_for_each(child, &widget->child_list, link)
-		widget_redraw(child);
+		widget_redraw(child, redrawn);
+}
+
+/* Decide whether only part of the surface needs redrawing: the widgets
+ * scheduled for redraw, plus what the buffer from the toysurface missed of
+ * the previous frames. */
+static void
+surface_set_redraw_clip(struct surface *surface)
+{
+	struct toysurface *toysurface = surface->toysurface;
+	struct rectangle stale, *clip = &surface->redraw_clip;
+	int32_t scale = surface->buffer_scale;
+
+	surface->redraw_partial = 0;
+
+	if (surface->window->redraw_needed || !surface->widget->use_cairo ||
+	    !toysurface->get_buffer_damage ||
+	    surface->buffer_transform != WL_OUTPUT_TRANSFORM_NORMAL)
+		goto out;
+
+	toysurface->get_buffer_damage(toysurface, &stale);
+	if (!rectangle_is_empty(&stale)) {
+		/* Round out to whole surface pixels */
+		stale.width = (stale.x + stale.width + scale - 1) / scale;
+		stale.height = (stale.y + stale.height + scale - 1) / scale;
+		stale.x /= scale;
+		stale.y /= scale;
+		stale.width -= stale.x;
+		stale.height -= stale.y;
+		stale.x += surface->allocation.x;
+		stale.y += surface->allocation.y;
+	}
+
+	*clip = surface->damage;
+	rectangle_union(clip, &stale);
+
+	/* Keep the clip within the surface */
+	stale = *clip;
+	clip->x = MAX(stale.x, surface->allocation.x);
+	clip->y = MAX(stale.y, surface->allocation.y);
+	clip->width = MIN(stale.x + stale.width,
+			  surface->allocation.x +
+			  surface->allocation.width) - clip->x;
+	clip->height = MIN(stale.y + stale.height,
+			   surface->allocation.y +
+			   surface->allocation.height) - clip->y;
+	if (rectangle_is_empty(clip))
+		clip->width = clip->height = 0;
+
+	surface->redraw_partial = 1;
+
+out:
+	surface->damage.width = 0;
+	surface->damage.height = 0;
 }
 
 static void
@@ -4573,8 +4887,9 @@ surface_redraw(struct surface *surface)
 	DBG_OBJ(surface->frame_cb, "new\n");
 
 	surface->redraw_needed = 0;
+	surface_set_redraw_clip(surface);
 	DBG_OBJ(surface->surface, "-> widget_redraw\n");
-	widget_redraw(surface->widget);
+	widget_redraw(surface->widget, 0);
 	DBG_OBJ(surface->surface, "done\n");
 	return 0;
 }
@@ -4651,8 +4966,10 @@ window_schedule_redraw(struct window *window)
 
 	DBG_OBJ(window->main_surface->surface, "window %p\n", window);
 
-	wl_list_for_each(surface, &window->subsurface_list, link)
+	wl_list_for_each(surface, &window->subsurface_list, link) {
 		surface->redraw_needed = 1;
+		rectangle_union(&surface->damage, &surface->allocation);
+	}
 
 	window_schedule_redraw_task(window);
 }
@@ -6002,7 +6319,8 @@ registry_handle_global(void *data, struct wl_registry *registry, uint32_t id,
 
 	if (strcmp(interface, "wl_compositor") == 0) {
 		d->compositor = wl_registry_bind(registry, id,
-						 &wl_compositor_interface, 3);
+						 &wl_compositor_interface,
+						 MIN(version, 4));
 	} else if (strcmp(interface, "wl_output") == 0) {
 		display_add_output(d, id);
 	} else if (strcmp(interface, "wl_seat") == 0) {
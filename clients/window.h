@@ -600,6 +600,9 @@ window_uninhibit_redraw(struct window *window);
 void
 widget_schedule_redraw(struct widget *widget);
 void
+widget_schedule_redraw_rect(struct widget *widget,
+			    const struct rectangle *rect);
+void
 widget_set_use_cairo(struct widget *widget, int use_cairo);
 
 /*
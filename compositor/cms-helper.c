@@ -53,6 +53,194 @@ weston_cms_gamma_clear(struct weston_output *o)
 	o->set_gamma(o, o->gamma_size, red, red, red);
 	free(red);
 }
+
+/* Grid points along each axis of the 3D LUT; 33 is what ICC tools commonly
+ * use for device links. */
+#define CMS_LUT_SIZE 33
+#define CMS_CURVE_SIZE 1024
+
+static bool
+invert_3x3(float out[9], const double m[9])
+{
+	double det;
+
+	det = m[0] * (m[4] * m[8] - m[5] * m[7]) -
+	      m[1] * (m[3] * m[8] - m[5] * m[6]) +
+	      m[2] * (m[3] * m[7] - m[4] * m[6]);
+	if (det > -1e-12 && det < 1e-12)
+		return false;
+
+	out[0] = (m[4] * m[8] - m[5] * m[7]) / det;
+	out[1] = (m[2] * m[7] - m[1] * m[8]) / det;
+	out[2] = (m[1] * m[5] - m[2] * m[4]) / det;
+	out[3] = (m[5] * m[6] - m[3] * m[8]) / det;
+	out[4] = (m[0] * m[8] - m[2] * m[6]) / det;
+	out[5] = (m[2] * m[3] - m[0] * m[5]) / det;
+	out[6] = (m[3] * m[7] - m[4] * m[6]) / det;
+	out[7] = (m[1] * m[6] - m[0] * m[7]) / det;
+	out[8] = (m[0] * m[4] - m[1] * m[3]) / det;
+
+	return true;
+}
+
+/* The RGB to XYZ matrix of a matrix-shaper profile, colorants as columns */
+static bool
+profile_colorants(cmsHPROFILE profile, double m[9])
+{
+	static const cmsTagSignature tags[] = {
+		cmsSigRedColorantTag,
+		cmsSigGreenColorantTag,
+		cmsSigBlueColorantTag,
+	};
+	const cmsCIEXYZ *xyz;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		xyz = cmsReadTag(profile, tags[i]);
+		if (!xyz)
+			return false;
+		m[0 + i] = xyz->X;
+		m[3 + i] = xyz->Y;
+		m[6 + i] = xyz->Z;
+	}
+
+	return true;
+}
+
+static const cmsTagSignature trc_tags[] = {
+	cmsSigRedTRCTag,
+	cmsSigGreenTRCTag,
+	cmsSigBlueTRCTag,
+};
+
+/* Fill in the matrix-shaper form of the sRGB to display transform, with the
+ * calibration curves folded into the gamma curves, if the display profile
+ * has one. */
+static bool
+cms_build_matrix_shaper(struct weston_color_transform *xform,
+			float *degamma, float *gamma,
+			cmsHPROFILE srgb, cmsHPROFILE display,
+			const cmsToneCurve **vcgt)
+{
+	const cmsToneCurve *trc;
+	cmsToneCurve *inverse;
+	double src[9], dst[9];
+	float dst_inv[9];
+	float in, v;
+	int i, j, k;
+
+	if (!cmsIsMatrixShaper(display) ||
+	    !profile_colorants(srgb, src) ||
+	    !profile_colorants(display, dst) ||
+	    !invert_3x3(dst_inv, dst))
+		return false;
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			xform->matrix[i * 3 + j] = 0.0f;
+			for (k = 0; k < 3; k++)
+				xform->matrix[i * 3 + j] +=
+					dst_inv[i * 3 + k] * src[k * 3 + j];
+		}
+	}
+
+	for (i = 0; i < 3; i++) {
+		trc = cmsReadTag(srgb, trc_tags[i]);
+		if (!trc)
+			return false;
+		for (j = 0; j < CMS_CURVE_SIZE; j++) {
+			in = (float) j / (CMS_CURVE_SIZE - 1);
+			degamma[i * CMS_CURVE_SIZE + j] =
+				cmsEvalToneCurveFloat(trc, in);
+		}
+
+		trc = cmsReadTag(display, trc_tags[i]);
+		if (!trc)
+			return false;
+		inverse = cmsReverseToneCurve(trc);
+		if (!inverse)
+			return false;
+		for (j = 0; j < CMS_CURVE_SIZE; j++) {
+			in = (float) j / (CMS_CURVE_SIZE - 1);
+			v = cmsEvalToneCurveFloat(inverse, in);
+			if (vcgt)
+				v = cmsEvalToneCurveFloat(vcgt[i], v);
+			gamma[i * CMS_CURVE_SIZE + j] = v;
+		}
+		cmsFreeToneCurve(inverse);
+	}
+
+	xform->curve_size = CMS_CURVE_SIZE;
+	xform->degamma = degamma;
+	xform->gamma = gamma;
+
+	return true;
+}
+
+/* Build the transform from the sRGB compositing space to the display profile
+ * and hand it to libweston. Returns true if the display hardware applies it,
+ * calibration curves included. */
+static bool
+weston_cms_set_color_transform(struct weston_output *o, cmsHPROFILE display,
+			       const cmsToneCurve **vcgt)
+{
+	struct weston_color_transform xform = { 0 };
+	cmsHPROFILE srgb;
+	cmsHTRANSFORM transform;
+	float *grid, *lut, *degamma, *gamma;
+	unsigned int n = CMS_LUT_SIZE;
+	unsigned int r, g, b;
+	float *p;
+	bool ret = false;
+
+	srgb = cmsCreate_sRGBProfile();
+	if (!srgb)
+		return false;
+
+	transform = cmsCreateTransform(srgb, TYPE_RGB_FLT, display, TYPE_RGB_FLT,
+				       INTENT_PERCEPTUAL, 0);
+	grid = calloc(n * n * n * 3, sizeof *grid);
+	lut = calloc(n * n * n * 3, sizeof *lut);
+	degamma = calloc(CMS_CURVE_SIZE * 3, sizeof *degamma);
+	gamma = calloc(CMS_CURVE_SIZE * 3, sizeof *gamma);
+	if (!transform || !grid || !lut || !degamma || !gamma) {
+		weston_log("cms: failed to build the color transform for %s\n",
+			   o->name);
+		goto out;
+	}
+
+	p = grid;
+	for (b = 0; b < n; b++) {
+		for (g = 0; g < n; g++) {
+			for (r = 0; r < n; r++) {
+				*p++ = (float) r / (n - 1);
+				*p++ = (float) g / (n - 1);
+				*p++ = (float) b / (n - 1);
+			}
+		}
+	}
+	cmsDoTransform(transform, grid, lut, n * n * n);
+
+	xform.lut_size = n;
+	xform.lut = lut;
+	cms_build_matrix_shaper(&xform, degamma, gamma, srgb, display, vcgt);
+
+	if (weston_output_set_color_transform(o, &xform) < 0)
+		weston_log("cms: %s cannot apply the color transform\n",
+			   o->name);
+	ret = o->color_transform_in_hardware;
+
+out:
+	free(grid);
+	free(lut);
+	free(degamma);
+	free(gamma);
+	if (transform)
+		cmsDeleteTransform(transform);
+	cmsCloseProfile(srgb);
+
+	return ret;
+}
 #endif
 
 void
@@ -68,16 +256,25 @@ weston_cms_set_color_profile(struct weston_output *o,
 	uint16_t *green = NULL;
 	uint16_t *blue = NULL;
 
-	if (!o->set_gamma)
-		return;
 	if (!p) {
+		weston_output_set_color_transform(o, NULL);
 		weston_cms_gamma_clear(o);
 		return;
 	}
 
 	weston_log("Using ICC profile %s\n", p->filename);
 	vcgt = cmsReadTag (p->lcms_handle, cmsSigVcgtTag);
-	if (vcgt == NULL || vcgt[0] == NULL) {
+	if (vcgt && !vcgt[0])
+		vcgt = NULL;
+
+	/* The hardware gamma stage then already holds the calibration
+	 * curves, which the legacy gamma ramp would overwrite. */
+	if (weston_cms_set_color_transform(o, p->lcms_handle, vcgt))
+		return;
+
+	if (!o->set_gamma)
+		return;
+	if (vcgt == NULL) {
 		weston_cms_gamma_clear(o);
 		return;
 	}
@@ -35,11 +35,14 @@
 #include <errno.h>
 #include <dlfcn.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
+#include <sched.h>
 #include <sys/utsname.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/inotify.h>
 #include <libinput.h>
 #include <libevdev/libevdev.h>
 #include <linux/input.h>
@@ -51,6 +54,7 @@
 #include "shared/os-compatibility.h"
 #include "shared/helpers.h"
 #include "shared/string-helpers.h"
+#include "shared/timespec-util.h"
 #include "git-version.h"
 #include <libweston/version.h>
 #include "weston.h"
@@ -69,6 +73,8 @@
 #define WINDOW_TITLE "Weston Compositor"
 /* flight recorder size (in bytes) */
 #define DEFAULT_FLIGHT_REC_SIZE (5 * 1024 * 1024)
+/* ring buffer size of the asynchronous logger (in bytes) */
+#define DEFAULT_LOGGER_RING_SIZE (1024 * 1024)
 
 struct wet_output_config {
 	int width;
@@ -122,6 +128,10 @@ struct wet_compositor {
 	int (*simple_output_configure)(struct weston_output *output);
 	bool init_failed;
 	struct wl_list layoutput_list;	/**< wet_layoutput::compositor_link */
+	struct wl_listener first_frame_listener;
+	int config_fd;			/**< parsed config for clients, or -1 */
+	int config_watch_fd;		/**< inotify fd for watch-config */
+	struct wl_event_source *config_watch_source;
 };
 
 static FILE *weston_logfile = NULL;
@@ -347,6 +357,31 @@ protocol_log_fn(void *user_data,
 static struct wl_list child_process_list;
 static struct weston_compositor *segv_compositor;
 
+static struct timespec startup_begin;
+static struct timespec startup_last;
+
+/** Log how long start-up took to get past a phase, and the phase itself */
+static void
+wet_log_startup_phase(const char *phase)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	weston_log("startup: %s at %" PRId64 " ms (+%" PRId64 " ms)\n", phase,
+		   timespec_sub_to_msec(&now, &startup_begin),
+		   timespec_sub_to_msec(&now, &startup_last));
+	startup_last = now;
+}
+
+static void
+wet_first_frame(struct wl_listener *listener, void *data)
+{
+	wet_log_startup_phase("first frame");
+
+	wl_list_remove(&listener->link);
+	wl_list_init(&listener->link);
+}
+
 static int
 sigchld_handler(int signal_number, void *data)
 {
@@ -376,7 +411,7 @@ sigchld_handler(int signal_number, void *data)
 }
 
 static void
-child_client_exec(int sockfd, const char *path)
+child_client_exec(int sockfd, int config_fd, const char *path)
 {
 	int clientfd;
 	char s[32];
@@ -403,6 +438,15 @@ child_client_exec(int sockfd, const char *path)
 	snprintf(s, sizeof s, "%d", clientfd);
 	setenv("WAYLAND_SOCKET", s, 1);
 
+	/* Spare the client from parsing the config file again. */
+	if (config_fd >= 0) {
+		config_fd = dup(config_fd);
+		if (config_fd >= 0) {
+			snprintf(s, sizeof s, "%d", config_fd);
+			setenv(WESTON_CONFIG_FD_ENV_VAR, s, 1);
+		}
+	}
+
 	if (execl(path, path, NULL) < 0)
 		weston_log("compositor: executing '%s' failed: %s\n",
 			   path, strerror(errno));
@@ -414,6 +458,7 @@ weston_client_launch(struct weston_compositor *compositor,
 		     const char *path,
 		     weston_process_cleanup_func_t cleanup)
 {
+	struct wet_compositor *wet = weston_compositor_get_user_data(compositor);
 	int sv[2];
 	pid_t pid;
 	struct wl_client *client;
@@ -438,7 +483,7 @@ weston_client_launch(struct weston_compositor *compositor,
 	}
 
 	if (pid == 0) {
-		child_client_exec(sv[1], path);
+		child_client_exec(sv[1], wet->config_fd, path);
 		_exit(-1);
 	}
 
@@ -664,6 +709,8 @@ usage(int error_code)
 		"  -l, --logger-scopes=SCOPE\n\t\t\tSpecify log scopes to "
 			"subscribe to.\n\t\t\tCan specify multiple scopes, "
 			"each followed by comma\n"
+		"  --logger-async\tWrite the logger scopes from a separate "
+			"thread\n"
 		"  -f, --flight-rec-scopes=SCOPE\n\t\t\tSpecify log scopes to "
 			"subscribe to.\n\t\t\tCan specify multiple scopes, "
 			"each followed by comma\n"
@@ -675,6 +722,8 @@ usage(int error_code)
 		"  --seat=SEAT\t\tThe seat that weston should run on, instead of the seat defined in XDG_SEAT\n"
 		"  --tty=TTY\t\tThe tty to use\n"
 		"  --drm-device=CARD\tThe DRM device to use, e.g. \"card0\".\n"
+		"  --additional-devices=CARD[,CARD...]\n"
+		"\t\t\tFurther DRM devices to drive outputs of, e.g. \"card1\".\n"
 		"  --use-pixman\t\tUse the pixman (CPU) renderer\n"
 		"  --current-mode\tPrefer current KMS mode over EDID preferred mode\n"
 		"  --continue-without-input\tAllow the compositor to start without input devices\n\n");
@@ -686,6 +735,7 @@ usage(int error_code)
 		"  --tty=TTY\t\tThe tty to use\n"
 		"  --device=DEVICE\tThe framebuffer device to use\n"
 		"  --seat=SEAT\t\tThe seat that weston should run on, instead of the seat defined in XDG_SEAT\n"
+		"  --double-buffer\tFlip between two buffers, in sync with the display when possible\n"
 		"\n");
 #endif
 
@@ -699,6 +749,8 @@ usage(int error_code)
 		"\tnormal 90 180 270 flipped flipped-90 flipped-180 flipped-270\n"
 		"  --use-pixman\t\tUse the pixman (CPU) renderer (default: no rendering)\n"
 		"  --use-gl\t\tUse the GL renderer (default: no rendering)\n"
+		"  --refresh-rate=RATE\tThe output refresh rate in mHz (default: 60000)\n"
+		"  --unthrottled\t\tComplete frames as soon as they are rendered\n"
 		"  --no-outputs\t\tDo not create any virtual outputs\n"
 		"\n");
 #endif
@@ -715,6 +767,7 @@ usage(int error_code)
 		"  --rdp4-key=FILE\tThe file containing the key for RDP4 encryption\n"
 		"  --rdp-tls-cert=FILE\tThe file containing the certificate for TLS encryption\n"
 		"  --rdp-tls-key=FILE\tThe file containing the private key for TLS encryption\n"
+		"  --use-gl\t\tUse the GL renderer\n"
 		"\n");
 #endif
 
@@ -728,6 +781,7 @@ usage(int error_code)
 		"  --use-pixman\t\tUse the pixman (CPU) renderer\n"
 		"  --output-count=COUNT\tCreate multiple outputs\n"
 		"  --sprawl\t\tCreate one fullscreen output for every parent output\n"
+		"  --passthrough\t\tShow client dmabufs as subsurfaces of the parent\n"
 		"  --display=DISPLAY\tWayland display to connect to\n\n");
 #endif
 
@@ -1043,6 +1097,93 @@ out:
 	return ret;
 }
 
+/* Parses a list of CPUs like "0,2-3" into a bit mask. */
+static int
+parse_cpu_list(const char *list, uint64_t *cpus)
+{
+	const char *p = list;
+	unsigned long first, last;
+	char *end;
+
+	*cpus = 0;
+	while (*p) {
+		errno = 0;
+		first = strtoul(p, &end, 10);
+		if (errno || end == p || first >= 64)
+			return -1;
+
+		last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 10);
+			if (errno || end == p || last >= 64 || last < first)
+				return -1;
+		}
+
+		for (; first <= last; first++)
+			*cpus |= UINT64_C(1) << first;
+
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -1;
+		p = end;
+	}
+
+	return 0;
+}
+
+static void
+wet_init_thread_scheduling(struct weston_compositor *ec,
+			   struct weston_config_section *s)
+{
+	struct weston_thread_scheduling sched = { .policy = SCHED_OTHER };
+	char *policy, *cpus;
+	int priority;
+
+	weston_config_section_get_string(s, "scheduling-policy", &policy,
+					 "other");
+	weston_config_section_get_int(s, "scheduling-priority", &priority, 10);
+
+	if (strcmp(policy, "fifo") == 0) {
+		sched.policy = SCHED_FIFO;
+	} else if (strcmp(policy, "rr") == 0) {
+		sched.policy = SCHED_RR;
+	} else if (strcmp(policy, "other") != 0) {
+		weston_log("Invalid scheduling-policy value in config: %s\n",
+			   policy);
+	}
+	free(policy);
+
+	if (priority < 1 || priority > 99) {
+		weston_log("Invalid scheduling-priority value in config: %d\n",
+			   priority);
+		sched.policy = SCHED_OTHER;
+	}
+	sched.priority = priority;
+
+	weston_config_section_get_string(s, "cpu-affinity", &cpus, "");
+	if (parse_cpu_list(cpus, &sched.main_cpus) < 0) {
+		weston_log("Invalid cpu-affinity value in config: %s\n", cpus);
+		sched.main_cpus = 0;
+	}
+	free(cpus);
+
+	weston_config_section_get_string(s, "worker-cpu-affinity", &cpus, "");
+	if (parse_cpu_list(cpus, &sched.worker_cpus) < 0) {
+		weston_log("Invalid worker-cpu-affinity value in config: %s\n",
+			   cpus);
+		sched.worker_cpus = 0;
+	}
+	free(cpus);
+
+	if (sched.policy == SCHED_OTHER && sched.main_cpus == 0 &&
+	    sched.worker_cpus == 0)
+		return;
+
+	weston_compositor_set_thread_scheduling(ec, &sched);
+}
+
 static int
 weston_compositor_init_config(struct weston_compositor *ec,
 			      struct weston_config *config)
@@ -1050,6 +1191,9 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	struct xkb_rule_names xkb_names;
 	struct weston_config_section *s;
 	int repaint_msec;
+	int repaint_threads;
+	int stall_threshold, flight_recorder_seconds;
+	char *stall_dump_dir;
 	bool cal;
 
 	/* weston.ini [keyboard] */
@@ -1086,12 +1230,80 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	} else {
 		ec->repaint_msec = repaint_msec;
 	}
-	weston_log("Output repaint window is %d ms maximum.\n",
-		   ec->repaint_msec);
+	weston_config_section_get_int(s, "occluded-frame-interval",
+				      &ec->occluded_frame_interval_msec, 0);
+	weston_config_section_get_int(s, "damage-max-rects",
+				      &ec->damage_max_rects,
+				      ec->damage_max_rects);
+	weston_config_section_get_bool(s, "release-shm-after-upload",
+				       &ec->shm_release_after_upload, false);
+	weston_config_section_get_bool(s, "opaque-front-to-back",
+				       &ec->render_opaque_front_to_back, false);
+	weston_config_section_get_bool(s, "mipmap-minified-views",
+				       &ec->mipmap_minified_views, false);
+	weston_config_section_get_bool(s, "cache-surface-trees",
+				       &ec->cache_surface_trees, false);
+	weston_config_section_get_int(s, "texture-memory-budget",
+				      &ec->texture_memory_budget_mib, 0);
+	weston_config_section_get_int(s, "client-memory-limit",
+				      &ec->client_memory_limit_mib, 0);
+	weston_config_section_get_int(s, "client-request-budget",
+				      &ec->client_request_budget, 0);
+
+	weston_config_section_get_bool(s, "adaptive-repaint-window",
+				       &ec->adaptive_repaint_window, false);
+	if (ec->adaptive_repaint_window)
+		weston_log("Output repaint window is adaptive, starting "
+			   "at %d ms.\n", ec->repaint_msec);
+	else
+		weston_log("Output repaint window is %d ms maximum.\n",
+			   ec->repaint_msec);
+
+	weston_config_section_get_bool(s, "early-frame-callbacks",
+				       &ec->early_frame_callbacks, false);
+	weston_config_section_get_bool(s, "trim-memory-on-sleep",
+				       &ec->trim_memory_on_sleep, false);
+
+	wet_init_thread_scheduling(ec, s);
+
+	weston_config_section_get_int(s, "repaint-threads",
+				      &repaint_threads, 0);
+	if (repaint_threads < 0 || repaint_threads > 64) {
+		weston_log("Invalid repaint-threads value in config: %d\n",
+			   repaint_threads);
+	} else if (repaint_threads > 0) {
+		if (weston_compositor_set_repaint_threads(ec,
+							  repaint_threads) < 0)
+			weston_log("Failed to create %d repaint threads, "
+				   "repainting on the main thread.\n",
+				   repaint_threads);
+		else
+			weston_log("Using %d repaint threads.\n",
+				   repaint_threads);
+	}
+	weston_config_section_get_bool(s, "tiled-repaint",
+				       &ec->tiled_repaint, false);
+
+	weston_config_section_get_int(s, "stall-threshold",
+				      &stall_threshold, 0);
+	weston_config_section_get_int(s, "flight-recorder-seconds",
+				      &flight_recorder_seconds, 5);
+	weston_config_section_get_string(s, "stall-dump-dir", &stall_dump_dir,
+					 getenv("XDG_RUNTIME_DIR"));
+	if (stall_threshold > 0 && stall_dump_dir &&
+	    weston_compositor_enable_flight_recorder(ec, stall_threshold,
+						     flight_recorder_seconds,
+						     stall_dump_dir) < 0)
+		weston_log("Failed to enable the flight recorder.\n");
+	free(stall_dump_dir);
 
 	/* weston.ini [libinput] */
 	s = weston_config_get_section(config, "libinput", NULL, NULL);
 	weston_config_section_get_bool(s, "touchscreen_calibrator", &cal, 0);
+	weston_config_section_get_bool(s, "coalesce-motion",
+				       &ec->coalesce_pointer_motion, false);
+	weston_config_section_get_bool(s, "input-thread",
+				       &ec->input_thread, false);
 	if (cal)
 		weston_compositor_enable_touch_calibrator(ec,
 						save_touch_device_calibration);
@@ -1152,6 +1364,106 @@ weston_transform_to_string(uint32_t output_transform)
 	return "<illegal value>";
 }
 
+static void
+wet_update_config_fd(struct wet_compositor *wet, struct weston_config *config)
+{
+	int fd;
+
+	fd = weston_config_serialize(config);
+	if (fd < 0) {
+		weston_log("warning: failed to write the config for clients\n");
+		return;
+	}
+
+	if (wet->config_fd >= 0)
+		close(wet->config_fd);
+	wet->config_fd = fd;
+}
+
+static int
+config_watch_handler(int fd, uint32_t mask, void *data)
+{
+	struct wet_compositor *wet = data;
+	const char *full_path = weston_config_get_full_path(wet->config);
+	const char *base = strrchr(full_path, '/');
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	struct weston_config *config;
+	bool changed = false;
+	ssize_t len;
+	char *p;
+
+	base = base ? base + 1 : full_path;
+
+	while ((len = read(fd, buf, sizeof buf)) > 0) {
+		for (p = buf; p < buf + len; p += sizeof *event + event->len) {
+			event = (const struct inotify_event *) p;
+			if (event->len && strcmp(event->name, base) == 0)
+				changed = true;
+		}
+	}
+
+	if (!changed)
+		return 0;
+
+	/* The compositor and its modules keep using what they read at start
+	 * up, only clients launched from now on see the new file. */
+	config = weston_config_parse(full_path);
+	if (!config) {
+		weston_log("'%s' changed but could not be parsed, "
+			   "clients keep getting the previous config\n",
+			   full_path);
+		return 0;
+	}
+
+	weston_log("'%s' changed, clients launched from now on use it\n",
+		   full_path);
+	wet_update_config_fd(wet, config);
+	weston_config_destroy(config);
+
+	return 0;
+}
+
+static void
+wet_watch_config(struct wet_compositor *wet, struct wl_display *display)
+{
+	const char *full_path = weston_config_get_full_path(wet->config);
+	struct wl_event_loop *loop = wl_display_get_event_loop(display);
+	char *dir, *slash;
+
+	dir = strdup(full_path);
+	if (!dir)
+		return;
+
+	/* Watch the directory so that editors replacing the file by renaming
+	 * a new one over it are still seen. */
+	slash = strrchr(dir, '/');
+	if (slash)
+		*slash = '\0';
+
+	wet->config_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (wet->config_watch_fd < 0 ||
+	    inotify_add_watch(wet->config_watch_fd, slash ? dir : ".",
+			      IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		weston_log("warning: cannot watch '%s' for changes: %s\n",
+			   full_path, strerror(errno));
+		goto out;
+	}
+
+	wet->config_watch_source =
+		wl_event_loop_add_fd(loop, wet->config_watch_fd,
+				     WL_EVENT_READABLE,
+				     config_watch_handler, wet);
+
+out:
+	if (!wet->config_watch_source && wet->config_watch_fd >= 0) {
+		close(wet->config_watch_fd);
+		wet->config_watch_fd = -1;
+	}
+	free(dir);
+}
+
 static int
 load_configuration(struct weston_config **config, int32_t noconfig,
 		   const char *config_file)
@@ -1212,6 +1524,31 @@ wet_output_set_scale(struct weston_output *output,
 	weston_output_set_scale(output, scale);
 }
 
+/* For backends sizing outputs by their mode, where scale may also be a
+ * fraction like 1.5. */
+static void
+wet_output_set_fractional_scale(struct weston_output *output,
+				struct weston_config_section *section)
+{
+	double factor = 1.0;
+	long scale;
+
+	if (section)
+		weston_config_section_get_double(section, "scale", &factor, 1.0);
+
+	if (factor * 120.0 < 1.0) {
+		weston_log("Invalid scale %g for output %s, using 1\n",
+			   factor, output->name);
+		factor = 1.0;
+	}
+	scale = factor * 120.0 + 0.5;
+
+	if (scale % 120 == 0)
+		weston_output_set_scale(output, scale / 120);
+	else
+		weston_output_set_fractional_scale(output, scale);
+}
+
 /* UINT32_MAX is treated as invalid because 0 is a valid
  * enumeration value and the parameter is unsigned
  */
@@ -1712,6 +2049,12 @@ drm_backend_output_configure(struct weston_output *output,
 	char *modeline = NULL;
 	char *gbm_format = NULL;
 	char *seat = NULL;
+	char *mirror_of = NULL;
+	bool vrr;
+	bool fb_compression;
+	int dynamic_resolution;
+	int swapchain_depth;
+	int idle_refresh;
 
 	api = weston_drm_output_get_api(output->compositor);
 	if (!api) {
@@ -1744,7 +2087,7 @@ drm_backend_output_configure(struct weston_output *output,
 		transform = weston_head_get_transform(head);
 	}
 
-	wet_output_set_scale(output, section, 1, 0);
+	wet_output_set_fractional_scale(output, section);
 	if (wet_output_set_transform(output, section, transform,
 				     UINT32_MAX) < 0) {
 		return -1;
@@ -1761,6 +2104,30 @@ drm_backend_output_configure(struct weston_output *output,
 	api->set_seat(output, seat);
 	free(seat);
 
+	weston_config_section_get_bool(section, "vrr", &vrr, false);
+	api->set_vrr(output, vrr);
+
+	weston_config_section_get_bool(section, "framebuffer-compression",
+				       &fb_compression, true);
+	api->set_fb_compression(output, fb_compression);
+
+	weston_config_section_get_int(section, "dynamic-resolution",
+				      &dynamic_resolution, 0);
+	api->set_dynamic_resolution(output, dynamic_resolution);
+
+	weston_config_section_get_int(section, "swapchain-depth",
+				      &swapchain_depth, 0);
+	api->set_swapchain_depth(output, swapchain_depth);
+
+	weston_config_section_get_string(section, "mirror-of",
+					 &mirror_of, NULL);
+	api->set_mirror_source(output, mirror_of);
+	free(mirror_of);
+
+	weston_config_section_get_int(section, "idle-refresh",
+				      &idle_refresh, 0);
+	weston_output_set_idle_refresh(output, MAX(idle_refresh, 0));
+
 	allow_content_protection(output, section);
 
 	return 0;
@@ -2146,6 +2513,36 @@ drm_process_layoutput(struct wet_compositor *wet, struct wet_layoutput *lo)
 	return 0;
 }
 
+/* Lay mirrors over their source output, so that the scene and input see
+ * them where the source they show is. */
+static void
+drm_place_mirrors(struct wet_compositor *wet)
+{
+	struct wet_layoutput *lo;
+	struct wet_output *output;
+	struct weston_output *source;
+	char *mirror_of;
+
+	wl_list_for_each(lo, &wet->layoutput_list, compositor_link) {
+		weston_config_section_get_string(lo->section, "mirror-of",
+						 &mirror_of, NULL);
+		if (!mirror_of)
+			continue;
+
+		source = weston_compositor_find_output_by_name(wet->compositor,
+							       mirror_of);
+		free(mirror_of);
+		if (!source || !source->enabled)
+			continue;
+
+		wl_list_for_each(output, &lo->output_list, link) {
+			if (output->output && output->output->enabled)
+				weston_output_move(output->output,
+						   source->x, source->y);
+		}
+	}
+}
+
 static int
 drm_process_layoutputs(struct wet_compositor *wet)
 {
@@ -2162,6 +2559,8 @@ drm_process_layoutputs(struct wet_compositor *wet)
 		}
 	}
 
+	drm_place_mirrors(wet);
+
 	return ret;
 }
 
@@ -2222,6 +2621,41 @@ drm_heads_changed(struct wl_listener *listener, void *arg)
 		wet->init_failed = true;
 }
 
+/* A comma separated list of host:port */
+static void
+wet_remoted_output_add_receivers(struct weston_output *output,
+				 const char *receivers,
+				 const struct weston_remoting_api *api)
+{
+	char *list, *entry, *saveptr = NULL, *sep;
+	int32_t port;
+
+	list = strdup(receivers);
+	if (!list)
+		return;
+
+	for (entry = strtok_r(list, ",", &saveptr); entry;
+	     entry = strtok_r(NULL, ",", &saveptr)) {
+		entry += strspn(entry, " ");
+		sep = strrchr(entry, ':');
+		if (sep)
+			*sep = '\0';
+		if (!sep || !safe_strtoint(sep + 1, &port) ||
+		    port <= 0 || 65533 < port || *entry == '\0') {
+			weston_log("Invalid receiver \"%s\" for output \"%s\", "
+				   "need host:port (1-65533).\n",
+				   entry, output->name);
+			continue;
+		}
+
+		if (api->add_receiver(output, entry, port) < 0)
+			weston_log("Cannot add receiver %s:%d to output "
+				   "\"%s\".\n", entry, port, output->name);
+	}
+
+	free(list);
+}
+
 static int
 drm_backend_remoted_output_configure(struct weston_output *output,
 				     struct weston_config_section *section,
@@ -2232,7 +2666,9 @@ drm_backend_remoted_output_configure(struct weston_output *output,
 	char *seat = NULL;
 	char *host = NULL;
 	char *pipeline = NULL;
-	int port, ret;
+	char *encoder = NULL;
+	char *receivers = NULL;
+	int port, bitrate, gop, keep_alive, ret;
 
 	ret = api->set_mode(output, modeline);
 	if (ret < 0) {
@@ -2278,6 +2714,27 @@ drm_backend_remoted_output_configure(struct weston_output *output,
 	free(host);
 	api->set_port(output, port);
 
+	weston_config_section_get_string(section, "receivers", &receivers,
+					 NULL);
+	if (receivers) {
+		wet_remoted_output_add_receivers(output, receivers, api);
+		free(receivers);
+	}
+
+	weston_config_section_get_string(section, "encoder", &encoder, "jpeg");
+	ret = api->set_encoder(output, encoder);
+	if (ret < 0)
+		weston_log("Unknown encoder \"%s\" for output \"%s\", "
+			   "using jpeg.\n", encoder, output->name);
+	free(encoder);
+
+	weston_config_section_get_int(section, "bitrate", &bitrate, 0);
+	api->set_bitrate(output, bitrate);
+	weston_config_section_get_int(section, "gop", &gop, 0);
+	api->set_gop(output, gop);
+	weston_config_section_get_int(section, "keep-alive", &keep_alive, 1000);
+	api->set_keep_alive(output, keep_alive);
+
 	return 0;
 }
 
@@ -2383,6 +2840,9 @@ drm_backend_pipewire_output_configure(struct weston_output *output,
 				     const struct weston_pipewire_api *api)
 {
 	char *seat = NULL;
+	char *streams = NULL;
+	char *stream;
+	int keep_alive;
 	int ret;
 
 	ret = api->set_mode(output, modeline);
@@ -2405,6 +2865,25 @@ drm_backend_pipewire_output_configure(struct weston_output *output,
 	api->set_seat(output, seat);
 	free(seat);
 
+	weston_config_section_get_int(section, "keep-alive", &keep_alive, 0);
+	api->set_keep_alive(output, keep_alive);
+
+	/* a comma separated list of modelines, e.g. "640x360@15" */
+	weston_config_section_get_string(section, "streams", &streams, NULL);
+	if (streams) {
+		char *saveptr = NULL;
+
+		for (stream = strtok_r(streams, ",", &saveptr); stream;
+		     stream = strtok_r(NULL, ",", &saveptr)) {
+			stream += strspn(stream, " ");
+			if (api->add_stream(output, stream) < 0)
+				weston_log("Cannot add stream \"%s\" to "
+					   "pipewire output \"%s\".\n",
+					   stream, output->name);
+		}
+		free(streams);
+	}
+
 	return 0;
 }
 
@@ -2510,6 +2989,7 @@ load_drm_backend(struct weston_compositor *c,
 	struct weston_drm_backend_config config = {{ 0, }};
 	struct weston_config_section *section;
 	struct wet_compositor *wet = to_wet_compositor(c);
+	char *pixman_shadow = NULL;
 	int ret = 0;
 
 	wet->drm_use_current_mode = false;
@@ -2522,6 +3002,7 @@ load_drm_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_STRING, "seat", 0, &config.seat_id },
 		{ WESTON_OPTION_INTEGER, "tty", 0, &config.tty },
 		{ WESTON_OPTION_STRING, "drm-device", 0, &config.specific_device },
+		{ WESTON_OPTION_STRING, "additional-devices", 0, &config.additional_devices },
 		{ WESTON_OPTION_BOOLEAN, "current-mode", 0, &wet->drm_use_current_mode },
 		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &config.use_pixman },
 		{ WESTON_OPTION_BOOLEAN, "continue-without-input", 0, &config.continue_without_input },
@@ -2535,8 +3016,14 @@ load_drm_backend(struct weston_compositor *c,
 					 NULL);
 	weston_config_section_get_uint(section, "pageflip-timeout",
 	                               &config.pageflip_timeout, 0);
-	weston_config_section_get_bool(section, "pixman-shadow",
-				       &config.use_pixman_shadow, true);
+	weston_config_section_get_string(section, "pixman-shadow",
+					 &pixman_shadow, NULL);
+	if (pixman_shadow && strcmp(pixman_shadow, "on-readback") == 0)
+		config.pixman_shadow_on_readback = true;
+	else
+		weston_config_section_get_bool(section, "pixman-shadow",
+					       &config.use_pixman_shadow, true);
+	free(pixman_shadow);
 
 	config.base.struct_version = WESTON_DRM_BACKEND_CONFIG_VERSION;
 	config.base.struct_size = sizeof(struct weston_drm_backend_config);
@@ -2557,6 +3044,7 @@ load_drm_backend(struct weston_compositor *c,
 
 	free(config.gbm_format);
 	free(config.seat_id);
+	free(config.additional_devices);
 
 	return ret;
 }
@@ -2601,6 +3089,8 @@ load_headless_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_INTEGER, "scale", 0, &parsed_options->scale },
 		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &config.use_pixman },
 		{ WESTON_OPTION_BOOLEAN, "use-gl", 0, &config.use_gl },
+		{ WESTON_OPTION_INTEGER, "refresh-rate", 0, &config.refresh },
+		{ WESTON_OPTION_BOOLEAN, "unthrottled", 0, &config.unthrottled },
 		{ WESTON_OPTION_STRING, "transform", 0, &transform },
 		{ WESTON_OPTION_BOOLEAN, "no-outputs", 0, &no_outputs },
 	};
@@ -2690,6 +3180,7 @@ weston_rdp_backend_config_init(struct weston_rdp_backend_config *config)
 	config->env_socket = 0;
 	config->no_clients_resize = 0;
 	config->force_no_compression = 0;
+	config->use_gl = false;
 }
 
 static int
@@ -2716,6 +3207,7 @@ load_rdp_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_STRING,  "rdp-tls-cert", 0, &config.server_cert },
 		{ WESTON_OPTION_STRING,  "rdp-tls-key", 0, &config.server_key },
 		{ WESTON_OPTION_BOOLEAN, "force-no-compression", 0, &config.force_no_compression },
+		{ WESTON_OPTION_BOOLEAN, "use-gl", 0, &config.use_gl },
 	};
 
 	parse_options(rdp_options, ARRAY_LENGTH(rdp_options), argc, argv);
@@ -2763,6 +3255,7 @@ load_fbdev_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_INTEGER, "tty", 0, &config.tty },
 		{ WESTON_OPTION_STRING, "device", 0, &config.device },
 		{ WESTON_OPTION_STRING, "seat", 0, &config.seat_id },
+		{ WESTON_OPTION_BOOLEAN, "double-buffer", 0, &config.double_buffer },
 	};
 
 	parse_options(fbdev_options, ARRAY_LENGTH(fbdev_options), argc, argv);
@@ -2937,6 +3430,7 @@ load_wayland_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_INTEGER, "output-count", 0, &count },
 		{ WESTON_OPTION_BOOLEAN, "fullscreen", 0, &config.fullscreen },
 		{ WESTON_OPTION_BOOLEAN, "sprawl", 0, &config.sprawl },
+		{ WESTON_OPTION_BOOLEAN, "passthrough", 0, &config.passthrough },
 	};
 
 	parse_options(wayland_options, ARRAY_LENGTH(wayland_options), argc, argv);
@@ -3131,6 +3625,7 @@ wet_main(int argc, char *argv[])
 	char *log = NULL;
 	char *log_scopes = NULL;
 	char *flight_rec_scopes = NULL;
+	bool logger_async = false;
 	char *server_socket = NULL;
 	int32_t idle_time = -1;
 	int32_t help = 0;
@@ -3139,6 +3634,7 @@ wet_main(int argc, char *argv[])
 	int32_t noconfig = 0;
 	int32_t debug_protocol = 0;
 	bool numlock_on;
+	bool screencopy;
 	char *config_file = NULL;
 	struct weston_config *config = NULL;
 	struct weston_config_section *section;
@@ -3152,6 +3648,7 @@ wet_main(int argc, char *argv[])
 	sigset_t mask;
 
 	bool wait_for_debugger = false;
+	bool watch_config = false;
 	struct wl_protocol_logger *protologger = NULL;
 
 	const struct weston_option core_options[] = {
@@ -3171,10 +3668,16 @@ wet_main(int argc, char *argv[])
 		{ WESTON_OPTION_BOOLEAN, "wait-for-debugger", 0, &wait_for_debugger },
 		{ WESTON_OPTION_BOOLEAN, "debug", 0, &debug_protocol },
 		{ WESTON_OPTION_STRING, "logger-scopes", 'l', &log_scopes },
+		{ WESTON_OPTION_BOOLEAN, "logger-async", 0, &logger_async },
 		{ WESTON_OPTION_STRING, "flight-rec-scopes", 'f', &flight_rec_scopes },
 	};
 
+	clock_gettime(CLOCK_MONOTONIC, &startup_begin);
+	startup_last = startup_begin;
+
 	wl_list_init(&wet.layoutput_list);
+	wet.config_fd = -1;
+	wet.config_watch_fd = -1;
 
 	os_fd_set_cloexec(fileno(stdin));
 
@@ -3207,7 +3710,13 @@ wet_main(int argc, char *argv[])
 
 	weston_log_set_handler(vlog, vlog_continue);
 
-	logger = weston_log_subscriber_create_log(weston_logfile);
+	/* Writing to a file may block for a long time on slow storage, keep
+	 * that off the compositor thread. */
+	if (logger_async || log)
+		logger = weston_log_subscriber_create_ring(weston_logfile,
+							   DEFAULT_LOGGER_RING_SIZE);
+	if (!logger)
+		logger = weston_log_subscriber_create_log(weston_logfile);
 	flight_rec = weston_log_subscriber_create_flight_rec(DEFAULT_FLIGHT_REC_SIZE);
 
 	weston_log_subscribe_to_scopes(log_ctx, logger, flight_rec,
@@ -3258,9 +3767,19 @@ wet_main(int argc, char *argv[])
 		goto out_signals;
 	wet.config = config;
 	wet.parsed_options = NULL;
+	wet_log_startup_phase("configuration");
 
 	section = weston_config_get_section(config, "core", NULL, NULL);
 
+	if (config) {
+		wet_update_config_fd(&wet, config);
+
+		weston_config_section_get_bool(section, "watch-config",
+					       &watch_config, false);
+		if (watch_config)
+			wet_watch_config(&wet, display);
+	}
+
 	if (!wait_for_debugger) {
 		weston_config_section_get_bool(section, "wait-for-debugger",
 					       &wait_for_debugger, false);
@@ -3311,10 +3830,12 @@ wet_main(int argc, char *argv[])
 		weston_log("fatal: failed to create compositor backend\n");
 		goto out;
 	}
+	wet_log_startup_phase("backend");
 
 	weston_compositor_flush_heads_changed(wet.compositor);
 	if (wet.init_failed)
 		goto out;
+	wet_log_startup_phase("outputs");
 
 	if (idle_time < 0)
 		weston_config_section_get_int(section, "idle-time", &idle_time, -1);
@@ -3327,6 +3848,12 @@ wet_main(int argc, char *argv[])
 
 	weston_compositor_log_capabilities(wet.compositor);
 
+	weston_config_section_get_bool(section, "screencopy", &screencopy,
+				       false);
+	if (screencopy &&
+	    weston_compositor_enable_screencopy(wet.compositor) < 0)
+		goto out;
+
 	server_socket = getenv("WAYLAND_SERVER_SOCKET");
 	if (server_socket) {
 		weston_log("Running with single client\n");
@@ -3357,6 +3884,7 @@ wet_main(int argc, char *argv[])
 
 	if (wet_load_shell(wet.compositor, shell, &argc, argv) < 0)
 		goto out;
+	wet_log_startup_phase("shell");
 
 	weston_config_section_get_string(section, "modules", &modules, "");
 	if (load_modules(wet.compositor, modules, &argc, argv, &xwayland) < 0)
@@ -3364,6 +3892,7 @@ wet_main(int argc, char *argv[])
 
 	if (load_modules(wet.compositor, option_modules, &argc, argv, &xwayland) < 0)
 		goto out;
+	wet_log_startup_phase("modules");
 
 	if (!xwayland) {
 		weston_config_section_get_bool(section, "xwayland", &xwayland,
@@ -3395,6 +3924,18 @@ wet_main(int argc, char *argv[])
 
 	weston_compositor_wake(wet.compositor);
 
+	wet.first_frame_listener.notify = wet_first_frame;
+	wl_list_init(&wet.first_frame_listener.link);
+	if (!wl_list_empty(&wet.compositor->output_list)) {
+		struct weston_output *output =
+			container_of(wet.compositor->output_list.next,
+				     struct weston_output, link);
+
+		wl_signal_add(&output->frame_signal,
+			      &wet.first_frame_listener);
+	}
+	wet_log_startup_phase("ready");
+
 	wl_display_run(display);
 
 	/* Allow for setting return exit code after
@@ -3428,6 +3969,13 @@ out_signals:
 		if (signals[i])
 			wl_event_source_remove(signals[i]);
 
+	if (wet.config_watch_source)
+		wl_event_source_remove(wet.config_watch_source);
+	if (wet.config_watch_fd >= 0)
+		close(wet.config_watch_fd);
+	if (wet.config_fd >= 0)
+		close(wet.config_fd);
+
 	wl_display_destroy(display);
 
 out_display:
@@ -79,8 +79,17 @@ struct shared_output {
 
 	int cache_dirty;
 	pixman_image_t *cache_image;
-	uint32_t *tmp_data;
-	size_t tmp_data_size;
+	struct wl_list pending_reads;
+};
+
+/* A damage read-back in flight, see shared_output_repainted() */
+struct ss_pending_read {
+	struct shared_output *so; /* NULL once the output is gone */
+	struct wl_list link; /* shared_output::pending_reads */
+	pixman_region32_t damage; /* buffer coordinates */
+	pixman_box32_t extents;
+	int do_yflip;
+	uint32_t *pixels;
 };
 
 struct ss_seat {
@@ -428,6 +437,10 @@ static const struct wl_buffer_listener buffer_listener = {
 	buffer_release
 };
 
+/* The parent is typically a nested weston with the RDP backend and the
+ * Pixman renderer, which reads wl_shm buffers in place but cannot import
+ * dmabufs. Sharing memory with it is as cheap as it gets, so only wl_shm is
+ * used, and only the damage gets written to a buffer. */
 static struct ss_shm_buffer *
 shared_output_get_shm_buffer(struct shared_output *so)
 {
@@ -478,6 +491,7 @@ shared_output_get_shm_buffer(struct shared_output *so)
 		weston_log("mmap: %s\n", strerror(errno));
 		goto out_close;
 	}
+	os_advise_huge_pages(data, height * stride);
 
 	sb = zalloc(sizeof *sb);
 	if (!sb)
@@ -502,7 +516,8 @@ shared_output_get_shm_buffer(struct shared_output *so)
 	close(fd);
 	fd = -1;
 
-	memset(data, 0, sb->size);
+	/* No need to clear the buffer: a new anonymous file reads as zeros,
+	 * and the buffer is fully damaged anyway. */
 
 	sb->pm_image =
 		pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height,
@@ -574,42 +589,6 @@ output_compute_transform(struct weston_output *output,
 static void
 shared_output_destroy(struct shared_output *so);
 
-static int
-shared_output_ensure_tmp_data(struct shared_output *so,
-			      pixman_region32_t *region)
-{
-	pixman_box32_t *ext;
-	size_t size;
-
-	if (!pixman_region32_not_empty(region))
-		return 0;
-
-	ext = pixman_region32_extents(region);
-
-	/* Damage is in output coordinates.
-	 *
-	 * We are multiplying by 4 because the temporary data needs to be able
-	 * to store an 32 bit-per-pixel buffer.
-	 */
-	size = 4 * (ext->x2 - ext->x1) * (ext->y2 - ext->y1)
-		 * so->output->current_scale * so->output->current_scale;
-
-	if (so->tmp_data != NULL && size <= so->tmp_data_size)
-		return 0;
-
-	free(so->tmp_data);
-	so->tmp_data = malloc(size);
-	if (so->tmp_data == NULL) {
-		so->tmp_data_size = 0;
-		errno = ENOMEM;
-		return -1;
-	}
-
-	so->tmp_data_size = size;
-
-	return 0;
-}
-
 static void
 shared_output_update(struct shared_output *so);
 
@@ -813,6 +792,124 @@ struct zwp_fullscreen_shell_mode_feedback_v1_listener mode_feedback_listener = {
 	mode_feedback_ok,
 };
 
+static void
+ss_pending_read_destroy(struct ss_pending_read *read)
+{
+	wl_list_remove(&read->link);
+	pixman_region32_fini(&read->damage);
+	free(read->pixels);
+	free(read);
+}
+
+static void
+ss_pending_read_done(void *data, int status)
+{
+	struct ss_pending_read *read = data;
+	struct shared_output *so = read->so;
+	pixman_box32_t *ext = &read->extents;
+	int32_t width = ext->x2 - ext->x1;
+	int32_t height = ext->y2 - ext->y1;
+	pixman_image_t *damaged_image;
+	pixman_transform_t transform;
+	pixman_box32_t *r;
+	int i, nrects;
+
+	if (!so || status < 0 || !so->cache_image)
+		goto out;
+
+	damaged_image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+						 width, height,
+						 read->pixels,
+			(PIXMAN_FORMAT_BPP(PIXMAN_a8r8g8b8) / 8) * width);
+	if (!damaged_image)
+		goto out;
+
+	if (read->do_yflip) {
+		pixman_transform_init_scale(&transform,
+					    pixman_fixed_1,
+					    pixman_fixed_minus_1);
+
+		pixman_transform_translate(&transform, NULL,
+					   0,
+					   pixman_int_to_fixed(height));
+
+		pixman_image_set_transform(damaged_image, &transform);
+	}
+
+	/* Only the damaged rectangles are copied, the rest of the extents
+	 * may be stale if a newer read already landed there. */
+	r = pixman_region32_rectangles(&read->damage, &nrects);
+	for (i = 0; i < nrects; ++i) {
+		pixman_image_composite32(PIXMAN_OP_SRC,
+					 damaged_image,
+					 NULL,
+					 so->cache_image,
+					 r[i].x1 - ext->x1, r[i].y1 - ext->y1,
+					 0, 0,
+					 r[i].x1, r[i].y1,
+					 r[i].x2 - r[i].x1, r[i].y2 - r[i].y1);
+	}
+	pixman_image_unref(damaged_image);
+
+	so->cache_dirty = 1;
+	ss_pending_read_destroy(read);
+	shared_output_update(so);
+	return;
+
+out:
+	ss_pending_read_destroy(read);
+}
+
+static int
+shared_output_read_damage(struct shared_output *so, pixman_region32_t *damage)
+{
+	struct ss_pending_read *read;
+	pixman_box32_t *ext;
+	int32_t width, height, y_orig;
+
+	if (!pixman_region32_not_empty(damage))
+		return 0;
+
+	read = zalloc(sizeof *read);
+	if (!read)
+		return -1;
+
+	ext = pixman_region32_extents(damage);
+	read->extents = *ext;
+	width = ext->x2 - ext->x1;
+	height = ext->y2 - ext->y1;
+
+	/* We are multiplying by 4 because the read-back needs to store a
+	 * 32 bit-per-pixel buffer. */
+	read->pixels = malloc(4 * (size_t)width * height);
+	if (!read->pixels) {
+		free(read);
+		return -1;
+	}
+
+	read->so = so;
+	read->do_yflip = !!(so->output->compositor->capabilities &
+			    WESTON_CAP_CAPTURE_YFLIP);
+	pixman_region32_init(&read->damage);
+	pixman_region32_copy(&read->damage, damage);
+	wl_list_insert(so->pending_reads.prev, &read->link);
+
+	if (read->do_yflip)
+		y_orig = so->output->current_mode->height - ext->y2;
+	else
+		y_orig = ext->y1;
+
+	if (weston_output_read_pixels_async(so->output, PIXMAN_a8r8g8b8,
+					    read->pixels, ext->x1, y_orig,
+					    width, height,
+					    ss_pending_read_done, read) < 0) {
+		ss_pending_read_destroy(read);
+		return -1;
+	}
+
+	return 0;
+}
+
 static void
 shared_output_repainted(struct wl_listener *listener, void *data)
 {
@@ -821,11 +918,7 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 	pixman_region32_t damage;
 	pixman_region32_t *current_damage = data;
 	struct ss_shm_buffer *sb;
-	int32_t x, y, width, height, stride;
-	int i, nrects, do_yflip, y_orig;
-	pixman_box32_t *r;
-	pixman_image_t *damaged_image;
-	pixman_transform_t transform;
+	int32_t width, height, stride;
 
 	width = so->output->current_mode->width;
 	height = so->output->current_mode->height;
@@ -857,66 +950,15 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 		pixman_region32_union(&sb->damage, &sb->damage, &damage);
 
 	/* Transform to buffer coordinates */
-	weston_transformed_region(so->output->width, so->output->height,
-				  so->output->transform,
-				  so->output->current_scale,
-				  &damage, &damage);
+	weston_output_transformed_region(so->output, &damage, &damage);
 
-	if (shared_output_ensure_tmp_data(so, &damage) < 0)
+	/* The cache image is updated, and the parent surface repainted,
+	 * once the read-back completes. This keeps the GPU pipeline from
+	 * stalling on every frame. */
+	if (shared_output_read_damage(so, &damage) < 0)
 		goto err_pixman_init;
 
-	do_yflip = !!(so->output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-
-	r = pixman_region32_rectangles(&damage, &nrects);
-	for (i = 0; i < nrects; ++i) {
-		x = r[i].x1;
-		y = r[i].y1;
-		width = r[i].x2 - r[i].x1;
-		height = r[i].y2 - r[i].y1;
-
-		if (do_yflip)
-			y_orig = so->output->current_mode->height - r[i].y2;
-		else
-			y_orig = y;
-
-		so->output->compositor->renderer->read_pixels(
-			so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-			x, y_orig, width, height);
-
-		damaged_image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
-							 width, height,
-							 so->tmp_data,
-				(PIXMAN_FORMAT_BPP(PIXMAN_a8r8g8b8) / 8) * width);
-		if (!damaged_image)
-			goto err_pixman_init;
-
-		if (do_yflip) {
-			pixman_transform_init_scale(&transform,
-						    pixman_fixed_1,
-						    pixman_fixed_minus_1);
-
-			pixman_transform_translate(&transform, NULL,
-						   0,
-						   pixman_int_to_fixed(height));
-
-			pixman_image_set_transform(damaged_image, &transform);
-		}
-
-		pixman_image_composite32(PIXMAN_OP_SRC,
-					 damaged_image,
-					 NULL,
-					 so->cache_image,
-					 0, 0,
-					 0, 0,
-					 x, y,
-					 width, height);
-		pixman_image_unref(damaged_image);
-	}
-
-	so->cache_dirty = 1;
-
 	pixman_region32_fini(&damage);
-	shared_output_update(so);
 
 	return;
 
@@ -1006,6 +1048,7 @@ shared_output_create(struct weston_output *output, int parent_fd)
 	/* Ok, everything's created.  We should be good to go */
 	wl_list_init(&so->shm.buffers);
 	wl_list_init(&so->shm.free_buffers);
+	wl_list_init(&so->pending_reads);
 
 	so->output = output;
 	so->output_destroyed.notify = output_destroyed;
@@ -1013,7 +1056,7 @@ shared_output_create(struct weston_output *output, int parent_fd)
 
 	so->frame_listener.notify = shared_output_repainted;
 	wl_signal_add(&output->frame_signal, &so->frame_listener);
-	weston_output_disable_planes_incr(output);
+	weston_output_capture_incr(output);
 	weston_output_damage(output);
 
 	return so;
@@ -1033,8 +1076,13 @@ static void
 shared_output_destroy(struct shared_output *so)
 {
 	struct ss_shm_buffer *buffer, *bnext;
+	struct ss_pending_read *read;
+
+	weston_output_capture_decr(so->output);
 
-	weston_output_disable_planes_decr(so->output);
+	/* Reads in flight are freed by their completion callback. */
+	wl_list_for_each(read, &so->pending_reads, link)
+		read->so = NULL;
 
 	wl_list_for_each_safe(buffer, bnext, &so->shm.buffers, link)
 		ss_shm_buffer_destroy(buffer);
@@ -1048,7 +1096,6 @@ shared_output_destroy(struct shared_output *so)
 	wl_list_remove(&so->frame_listener.link);
 
 	pixman_image_unref(so->cache_image);
-	free(so->tmp_data);
 
 	free(so);
 }
@@ -25,6 +25,7 @@
 
 #include "config.h"
 
+#include <inttypes.h>
 #include <stdlib.h>
 #include <systemd/sd-daemon.h>
 #include <sys/socket.h>
@@ -40,6 +41,7 @@ struct systemd_notifier {
 	int watchdog_time;
 	struct wl_event_source *watchdog_source;
 	struct wl_listener compositor_destroy_listener;
+	struct wl_listener stall_listener;
 };
 
 static int
@@ -96,6 +98,20 @@ watchdog_handler(void *data)
 	return 1;
 }
 
+/* Show the last stall in the status of the unit, see
+ * weston_compositor_enable_flight_recorder(). */
+static void
+stall_handler(struct wl_listener *listener, void *data)
+{
+	struct weston_stall_info *info = data;
+
+	sd_notifyf(0, "STATUS=Last stall: %s, %" PRId64 " ms late, at "
+		   "%" PRId64 " s%s%s", info->reason, info->late_msec,
+		   (int64_t)info->time.tv_sec,
+		   info->dump_path ? ", recorded in " : "",
+		   info->dump_path ? info->dump_path : "");
+}
+
 static void
 weston_compositor_destroy_listener(struct wl_listener *listener, void *data)
 {
@@ -110,6 +126,7 @@ weston_compositor_destroy_listener(struct wl_listener *listener, void *data)
 	if (notifier->watchdog_source)
 		wl_event_source_remove(notifier->watchdog_source);
 
+	wl_list_remove(&notifier->stall_listener.link);
 	wl_list_remove(&notifier->compositor_destroy_listener.link);
 	free(notifier);
 }
@@ -134,6 +151,9 @@ wet_module_init(struct weston_compositor *compositor,
 		return 0;
 	}
 
+	notifier->stall_listener.notify = stall_handler;
+	wl_signal_add(&compositor->stall_signal, &notifier->stall_listener);
+
 	if (add_systemd_sockets(compositor) < 0)
 		return -1;
 
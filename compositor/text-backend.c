@@ -107,6 +107,10 @@ struct text_backend {
 
 		unsigned deathcount;
 		struct timespec deathstamp;
+
+		/* Restarts the input method after it crashed too often */
+		bool keep_warm;
+		struct wl_event_source *respawn_timer;
 	} input_method;
 
 	struct wl_listener client_listener;
@@ -122,6 +126,9 @@ input_method_context_end_keyboard_grab(struct input_method_context *context);
 static void
 input_method_init_seat(struct weston_seat *seat);
 
+static void
+text_backend_ensure_input_method(struct text_backend *text_backend);
+
 static void
 deactivate_input_method(struct input_method *input_method)
 {
@@ -204,6 +211,8 @@ text_input_activate(struct wl_client *client,
 	if (input_method->input == text_input)
 		return;
 
+	text_backend_ensure_input_method(input_method->text_backend);
+
 	if (input_method->input)
 		deactivate_input_method(input_method);
 
@@ -957,7 +966,15 @@ respawn_input_method_process(struct text_backend *text_backend)
 
 	text_backend->input_method.deathcount++;
 	if (text_backend->input_method.deathcount > 5) {
-		weston_log("input_method disconnected, giving up.\n");
+		if (!text_backend->input_method.keep_warm ||
+		    !text_backend->input_method.respawn_timer) {
+			weston_log("input_method disconnected, giving up.\n");
+			return;
+		}
+
+		weston_log("input_method disconnected, retrying in 10 s.\n");
+		wl_event_source_timer_update(text_backend->input_method.respawn_timer,
+					     10000);
 		return;
 	}
 
@@ -977,9 +994,38 @@ input_method_client_notifier(struct wl_listener *listener, void *data)
 	respawn_input_method_process(text_backend);
 }
 
+static int
+input_method_respawn_timer(void *data)
+{
+	struct text_backend *text_backend = data;
+
+	launch_input_method(text_backend);
+
+	return 0;
+}
+
+/* Starts the input method if it is not running, without waiting for the
+ * respawn timer, when a client needs it. */
+static void
+text_backend_ensure_input_method(struct text_backend *text_backend)
+{
+	if (text_backend->input_method.client ||
+	    !text_backend->input_method.keep_warm)
+		return;
+
+	if (text_backend->input_method.respawn_timer)
+		wl_event_source_timer_update(text_backend->input_method.respawn_timer,
+					     0);
+	text_backend->input_method.deathcount = 0;
+	launch_input_method(text_backend);
+}
+
 static void
 launch_input_method(struct text_backend *text_backend)
 {
+	if (text_backend->input_method.client)
+		return;
+
 	if (!text_backend->input_method.path)
 		return;
 
@@ -1054,6 +1100,10 @@ text_backend_configuration(struct text_backend *text_backend)
 					 &text_backend->input_method.path,
 					 client);
 	free(client);
+
+	weston_config_section_get_bool(section, "keep-warm",
+				       &text_backend->input_method.keep_warm,
+				       true);
 }
 
 WL_EXPORT void
@@ -1061,6 +1111,9 @@ text_backend_destroy(struct text_backend *text_backend)
 {
 	wl_list_remove(&text_backend->seat_created_listener.link);
 
+	if (text_backend->input_method.respawn_timer)
+		wl_event_source_remove(text_backend->input_method.respawn_timer);
+
 	if (text_backend->input_method.client) {
 		/* disable respawn */
 		wl_list_remove(&text_backend->client_listener.link);
@@ -1085,6 +1138,11 @@ text_backend_init(struct weston_compositor *ec)
 
 	text_backend_configuration(text_backend);
 
+	text_backend->input_method.respawn_timer =
+		wl_event_loop_add_timer(wl_display_get_event_loop(ec->wl_display),
+					input_method_respawn_timer,
+					text_backend);
+
 	wl_list_for_each(seat, &ec->seat_list, link)
 		text_backend_seat_created(text_backend, seat);
 	text_backend->seat_created_listener.notify = handle_seat_created;
@@ -26,6 +26,8 @@
 #include "config.h"
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <linux/input.h>
 
 #include <libweston/libweston.h>
@@ -41,6 +43,8 @@ struct screenshooter {
 	struct weston_process process;
 	struct wl_listener destroy_listener;
 	struct weston_recorder *recorder;
+	char *recorder_path;
+	enum weston_recorder_format recorder_format;
 };
 
 static void
@@ -79,8 +83,30 @@ screenshooter_shoot(struct wl_client *client,
 	weston_screenshooter_shoot(output, buffer, screenshooter_done, resource);
 }
 
+static void
+screenshooter_shoot_region(struct wl_client *client,
+			   struct wl_resource *resource,
+			   struct wl_resource *output_resource,
+			   struct wl_resource *buffer_resource,
+			   int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct weston_output *output =
+		weston_head_from_resource(output_resource)->output;
+	struct weston_buffer *buffer =
+		weston_buffer_from_resource(buffer_resource);
+
+	if (buffer == NULL) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	weston_screenshooter_shoot_region(output, buffer, x, y, width, height,
+					  screenshooter_done, resource);
+}
+
 struct weston_screenshooter_interface screenshooter_implementation = {
-	screenshooter_shoot
+	screenshooter_shoot,
+	screenshooter_shoot_region,
 };
 
 static void
@@ -93,7 +119,8 @@ bind_shooter(struct wl_client *client,
 		weston_compositor_is_debug_protocol_enabled(shooter->ec);
 
 	resource = wl_resource_create(client,
-				      &weston_screenshooter_interface, 1, id);
+				      &weston_screenshooter_interface,
+				      MIN(version, 2), id);
 
 	if (!debug_enabled && !shooter->client) {
 		wl_resource_post_error(resource, WL_DISPLAY_ERROR_INVALID_OBJECT,
@@ -147,8 +174,7 @@ recorder_binding(struct weston_keyboard *keyboard, const struct timespec *time,
 	struct weston_compositor *ec = keyboard->seat->compositor;
 	struct weston_output *output;
 	struct screenshooter *shooter = data;
-	struct weston_recorder *recorder = shooter->recorder;;
-	static const char filename[] = "capture.wcap";
+	struct weston_recorder *recorder = shooter->recorder;
 
 	if (recorder) {
 		weston_recorder_stop(recorder);
@@ -160,7 +186,10 @@ recorder_binding(struct weston_keyboard *keyboard, const struct timespec *time,
 			output = container_of(ec->output_list.next,
 					      struct weston_output, link);
 
-		shooter->recorder = weston_recorder_start(output, filename);
+		shooter->recorder =
+			weston_recorder_start_format(output,
+						     shooter->recorder_path,
+						     shooter->recorder_format);
 	}
 }
 
@@ -173,6 +202,7 @@ screenshooter_destroy(struct wl_listener *listener, void *data)
 	wl_list_remove(&shooter->destroy_listener.link);
 
 	wl_global_destroy(shooter->global);
+	free(shooter->recorder_path);
 	free(shooter);
 }
 
@@ -180,6 +210,8 @@ WL_EXPORT void
 screenshooter_create(struct weston_compositor *ec)
 {
 	struct screenshooter *shooter;
+	struct weston_config_section *section;
+	char *format;
 
 	shooter = zalloc(sizeof *shooter);
 	if (shooter == NULL)
@@ -187,8 +219,24 @@ screenshooter_create(struct weston_compositor *ec)
 
 	shooter->ec = ec;
 
+	section = weston_config_get_section(wet_get_config(ec),
+					    "recorder", NULL, NULL);
+	weston_config_section_get_string(section, "path",
+					 &shooter->recorder_path,
+					 "capture.wcap");
+	weston_config_section_get_string(section, "format", &format, "wcap");
+	if (strcmp(format, "nv12") == 0) {
+		shooter->recorder_format = WESTON_RECORDER_FORMAT_NV12;
+	} else {
+		if (strcmp(format, "wcap") != 0)
+			weston_log("unknown recorder format \"%s\", "
+				   "using wcap\n", format);
+		shooter->recorder_format = WESTON_RECORDER_FORMAT_WCAP;
+	}
+	free(format);
+
 	shooter->global = wl_global_create(ec->wl_display,
-					   &weston_screenshooter_interface, 1,
+					   &weston_screenshooter_interface, 2,
 					   shooter, bind_shooter);
 	weston_compositor_add_key_binding(ec, KEY_S, MODIFIER_SUPER,
 					  screenshooter_binding, shooter);
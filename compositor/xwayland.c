@@ -36,8 +36,15 @@
 #include <libweston/xwayland-api.h>
 #include "shared/helpers.h"
 
+enum wet_xwayland_start {
+	WET_XWAYLAND_START_ON_DEMAND = 0,
+	WET_XWAYLAND_START_IMMEDIATE,
+	WET_XWAYLAND_START_IDLE,
+};
+
 struct wet_xwayland {
 	struct weston_compositor *compositor;
+	enum wet_xwayland_start start;
 	const struct weston_xwayland_api *api;
 	struct weston_xwayland *xwayland;
 	struct wl_event_source *sigusr1_source;
@@ -68,6 +75,7 @@ spawn_xserver(void *user_data, const char *display, int abstract_fd, int unix_fd
 	char s[12], abstract_fd_str[12], unix_fd_str[12], wm_fd_str[12];
 	int sv[2], wm[2], fd;
 	char *xserver = NULL;
+	const char *terminate;
 	struct weston_config *config = wet_get_config(wxw->compositor);
 	struct weston_config_section *section;
 
@@ -119,6 +127,11 @@ spawn_xserver(void *user_data, const char *display, int abstract_fd, int unix_fd
 		 * it's done with that. */
 		signal(SIGUSR1, SIG_IGN);
 
+		/* A server started ahead of its clients keeps running,
+		 * so it is ready for the next one too. */
+		terminate = wxw->start == WET_XWAYLAND_START_ON_DEMAND ?
+			    "-terminate" : NULL;
+
 		if (execl(xserver,
 			  xserver,
 			  display,
@@ -126,13 +139,14 @@ spawn_xserver(void *user_data, const char *display, int abstract_fd, int unix_fd
 			  "-listen", abstract_fd_str,
 			  "-listen", unix_fd_str,
 			  "-wm", wm_fd_str,
-			  "-terminate",
+			  terminate,
 			  NULL) < 0)
 			weston_log("exec of '%s %s -rootless "
 				   "-listen %s -listen %s -wm %s "
-				   "-terminate' failed: %s\n",
+				   "%s' failed: %s\n",
 				   xserver, display,
 				   abstract_fd_str, unix_fd_str, wm_fd_str,
+				   terminate ? terminate : "",
 				   strerror(errno));
 	fail:
 		_exit(EXIT_FAILURE);
@@ -156,6 +170,15 @@ spawn_xserver(void *user_data, const char *display, int abstract_fd, int unix_fd
 	return pid;
 }
 
+static void
+start_xserver_idle(void *data)
+{
+	struct wet_xwayland *wxw = data;
+
+	if (wxw->api->start(wxw->xwayland) < 0)
+		weston_log("Failed to start Xwayland.\n");
+}
+
 static void
 xserver_cleanup(struct weston_process *process, int status)
 {
@@ -168,6 +191,35 @@ xserver_cleanup(struct weston_process *process, int status)
 	wxw->sigusr1_source = wl_event_loop_add_signal(loop, SIGUSR1,
                                                        handle_sigusr1, wxw);
 	wxw->client = NULL;
+
+	/* Have the next server ready again, unless the last one crashed
+	 * before it was even loaded and the module gave up on it. */
+	if (wxw->start != WET_XWAYLAND_START_ON_DEMAND)
+		wl_event_loop_add_idle(loop, start_xserver_idle, wxw);
+}
+
+static enum wet_xwayland_start
+get_start_mode(struct weston_compositor *comp)
+{
+	struct weston_config *config = wet_get_config(comp);
+	struct weston_config_section *section;
+	enum wet_xwayland_start start = WET_XWAYLAND_START_ON_DEMAND;
+	char *str;
+
+	section = weston_config_get_section(config, "xwayland", NULL, NULL);
+	weston_config_section_get_string(section, "start", &str, "on-demand");
+
+	if (strcmp(str, "immediate") == 0)
+		start = WET_XWAYLAND_START_IMMEDIATE;
+	else if (strcmp(str, "idle") == 0)
+		start = WET_XWAYLAND_START_IDLE;
+	else if (strcmp(str, "on-demand") != 0)
+		weston_log("Unknown Xwayland start mode '%s', "
+			   "starting it on demand.\n", str);
+
+	free(str);
+
+	return start;
 }
 
 int
@@ -200,6 +252,7 @@ wet_load_xwayland(struct weston_compositor *comp)
 	wxw->compositor = comp;
 	wxw->api = api;
 	wxw->xwayland = xwayland;
+	wxw->start = get_start_mode(comp);
 	wxw->process.cleanup = xserver_cleanup;
 	if (api->listen(xwayland, wxw, spawn_xserver) < 0)
 		return -1;
@@ -208,5 +261,18 @@ wet_load_xwayland(struct weston_compositor *comp)
 	wxw->sigusr1_source = wl_event_loop_add_signal(loop, SIGUSR1,
 						       handle_sigusr1, wxw);
 
+	switch (wxw->start) {
+	case WET_XWAYLAND_START_ON_DEMAND:
+		break;
+	case WET_XWAYLAND_START_IMMEDIATE:
+		if (api->start(xwayland) < 0)
+			weston_log("Failed to start Xwayland.\n");
+		break;
+	case WET_XWAYLAND_START_IDLE:
+		/* Once the compositor is done starting up. */
+		wl_event_loop_add_idle(loop, start_xserver_idle, wxw);
+		break;
+	}
+
 	return 0;
 }
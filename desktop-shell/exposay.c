@@ -71,6 +71,8 @@ exposay_surface_destroy(struct exposay_surface *esurface)
 	if (esurface->shell->exposay.focus_prev == esurface->view)
 		esurface->shell->exposay.focus_prev = NULL;
 
+	shell_surface_set_exposay_throttle(esurface->view->surface, false);
+
 	free(esurface);
 }
 
@@ -333,6 +335,9 @@ exposay_layout(struct desktop_shell *shell, struct shell_output *shell_output)
 		esurface->eoutput = eoutput;
 		esurface->view = view;
 
+		/* The thumbnails don't need to be updated at full rate. */
+		shell_surface_set_exposay_throttle(view->surface, true);
+
 		esurface->row = i / eoutput->grid_size;
 		esurface->column = i % eoutput->grid_size;
 
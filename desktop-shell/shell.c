@@ -95,6 +95,14 @@ struct focus_state {
  *     (shsurf->parent != NULL) ⇒ !wl_list_is_empty(shsurf->children_link)
  */
 
+/* An [app-policy] section of weston.ini */
+struct app_policy {
+	struct wl_list link; /* desktop_shell::app_policy_list */
+	char *app_id;
+	int32_t frame_interval; /* msec, 0 for no cap */
+	int32_t background_frame_interval; /* without the keyboard focus */
+};
+
 struct shell_surface {
 	struct wl_signal destroy_signal;
 
@@ -143,6 +151,12 @@ struct shell_surface {
 
 	int focus_count;
 
+	/* The [app-policy] section matching the app_id, which is kept to
+	 * look the policy up again only when it changes. */
+	struct app_policy *app_policy;
+	char *app_policy_id;
+	bool exposay_throttled;
+
 	bool destroying;
 };
 
@@ -462,6 +476,68 @@ get_animation_type(char *animation)
 		return ANIMATION_NONE;
 }
 
+static int32_t
+fps_to_frame_interval(int32_t fps)
+{
+	return fps > 0 ? 1000 / fps : 0;
+}
+
+/* Each [app-policy] section caps the rate of frame callbacks of the windows
+ * of one app_id, with a lower cap for when they do not have the keyboard
+ * focus. */
+static void
+app_policy_configuration(struct desktop_shell *shell)
+{
+	struct weston_config *config = wet_get_config(shell->compositor);
+	struct weston_config_section *section = NULL;
+	const char *section_name;
+	struct app_policy *policy;
+	int32_t fps, background_fps;
+	char *app_id;
+
+	while (weston_config_next_section(config, &section, &section_name)) {
+		if (strcmp(section_name, "app-policy"))
+			continue;
+
+		weston_config_section_get_string(section, "app-id",
+						 &app_id, NULL);
+		if (!app_id) {
+			weston_log("desktop-shell: [app-policy] without "
+				   "app-id, ignored\n");
+			continue;
+		}
+
+		weston_config_section_get_int(section, "max-fps", &fps, 0);
+		weston_config_section_get_int(section, "background-fps",
+					      &background_fps, fps);
+
+		policy = zalloc(sizeof *policy);
+		if (!policy) {
+			free(app_id);
+			continue;
+		}
+
+		policy->app_id = app_id;
+		policy->frame_interval = fps_to_frame_interval(fps);
+		policy->background_frame_interval =
+			MAX(fps_to_frame_interval(background_fps),
+			    policy->frame_interval);
+		wl_list_insert(shell->app_policy_list.prev, &policy->link);
+	}
+}
+
+static void
+app_policy_list_release(struct desktop_shell *shell)
+{
+	struct app_policy *policy, *next;
+
+	wl_list_for_each_safe(policy, next, &shell->app_policy_list, link) {
+		wl_list_remove(&policy->link);
+		free(policy->app_id);
+		free(policy);
+	}
+}
+
 static void
 shell_configuration(struct desktop_shell *shell)
 {
@@ -490,6 +566,9 @@ shell_configuration(struct desktop_shell *shell)
 	shell->exposay_modifier = get_modifier(s);
 	free(s);
 
+	weston_config_section_get_int(section, "exposay-frame-interval",
+				      &shell->exposay_frame_interval, 0);
+
 	weston_config_section_get_string(section, "animation", &s, "none");
 	shell->win_animation_type = get_animation_type(s);
 	free(s);
@@ -508,6 +587,8 @@ shell_configuration(struct desktop_shell *shell)
 	weston_config_section_get_uint(section, "num-workspaces",
 				       &shell->workspaces.num,
 				       DEFAULT_NUM_WORKSPACES);
+
+	app_policy_configuration(shell);
 }
 
 struct weston_output *
@@ -1139,6 +1220,8 @@ animate_workspace_change_frame(struct weston_animation *animation,
 	x = t * (1.0/DEFAULT_WORKSPACE_CHANGE_ANIMATION_LENGTH) * M_PI_2;
 	y = sin(x);
 
+	weston_compositor_begin_changes(shell->compositor);
+
 	if (t < DEFAULT_WORKSPACE_CHANGE_ANIMATION_LENGTH) {
 		weston_compositor_schedule_repaint(shell->compositor);
 
@@ -1150,6 +1233,8 @@ animate_workspace_change_frame(struct weston_animation *animation,
 	}
 	else
 		finish_workspace_change_animation(shell, from, to);
+
+	weston_compositor_commit_changes(shell->compositor);
 }
 
 static void
@@ -1216,11 +1301,14 @@ change_workspace(struct desktop_shell *shell, unsigned int index)
 	from = get_current_workspace(shell);
 	to = get_workspace(shell, index);
 
+	/* Both workspaces are restacked and their views moved at once. */
+	weston_compositor_begin_changes(shell->compositor);
+
 	if (shell->workspaces.anim_from == to &&
 	    shell->workspaces.anim_to == from) {
 		restore_focus_state(shell, to);
 		reverse_workspace_change_animation(shell, index, from, to);
-		return;
+		goto out;
 	}
 
 	if (shell->workspaces.anim_to != NULL)
@@ -1246,6 +1334,9 @@ change_workspace(struct desktop_shell *shell, unsigned int index)
 		update_workspace(shell, index, from, to);
 	else
 		animate_workspace_change(shell, index, from, to);
+
+out:
+	weston_compositor_commit_changes(shell->compositor);
 }
 
 static bool
@@ -1868,18 +1959,93 @@ handle_pointer_focus(struct wl_listener *listener, void *data)
 		weston_desktop_client_ping(client);
 }
 
+static void
+shell_surface_update_frame_interval(struct shell_surface *shsurf)
+{
+	struct app_policy *policy = shsurf->app_policy;
+	int32_t interval = 0;
+
+	if (policy && shsurf->focus_count > 0)
+		interval = policy->frame_interval;
+	else if (policy)
+		interval = policy->background_frame_interval;
+
+	if (shsurf->exposay_throttled)
+		interval = MAX(interval, shsurf->shell->exposay_frame_interval);
+
+	weston_surface_set_frame_interval(
+		weston_desktop_surface_get_surface(shsurf->desktop_surface),
+		interval);
+}
+
+/* Look the policy up again when the client set a different app_id. */
+static void
+shell_surface_update_app_policy(struct shell_surface *shsurf)
+{
+	const char *app_id =
+		weston_desktop_surface_get_app_id(shsurf->desktop_surface);
+	struct app_policy *policy;
+
+	if (wl_list_empty(&shsurf->shell->app_policy_list))
+		return;
+
+	if (!app_id && !shsurf->app_policy_id)
+		return;
+	if (app_id && shsurf->app_policy_id &&
+	    strcmp(app_id, shsurf->app_policy_id) == 0)
+		return;
+
+	free(shsurf->app_policy_id);
+	shsurf->app_policy_id = app_id ? strdup(app_id) : NULL;
+	shsurf->app_policy = NULL;
+
+	wl_list_for_each(policy, &shsurf->shell->app_policy_list, link) {
+		if (app_id && strcmp(policy->app_id, app_id) == 0) {
+			shsurf->app_policy = policy;
+			break;
+		}
+	}
+
+	shell_surface_update_frame_interval(shsurf);
+}
+
+/** Throttle the frame callbacks of a window shown by exposay
+ *
+ * Its exposay-frame-interval adds to the app policy of the window.
+ */
+void
+shell_surface_set_exposay_throttle(struct weston_surface *surface,
+				   bool throttle)
+{
+	struct shell_surface *shsurf = get_shell_surface(surface);
+
+	if (!shsurf) {
+		weston_surface_set_frame_interval(surface, 0);
+		return;
+	}
+
+	shsurf->exposay_throttled = throttle;
+	shell_surface_update_frame_interval(shsurf);
+}
+
 static void
 shell_surface_lose_keyboard_focus(struct shell_surface *shsurf)
 {
-	if (--shsurf->focus_count == 0)
+	if (--shsurf->focus_count == 0) {
 		weston_desktop_surface_set_activated(shsurf->desktop_surface, false);
+		if (shsurf->app_policy)
+			shell_surface_update_frame_interval(shsurf);
+	}
 }
 
 static void
 shell_surface_gain_keyboard_focus(struct shell_surface *shsurf)
 {
-	if (shsurf->focus_count++ == 0)
+	if (shsurf->focus_count++ == 0) {
 		weston_desktop_surface_set_activated(shsurf->desktop_surface, true);
+		if (shsurf->app_policy)
+			shell_surface_update_frame_interval(shsurf);
+	}
 }
 
 static void
@@ -2459,6 +2625,10 @@ desktop_surface_removed(struct weston_desktop_surface *desktop_surface,
 	weston_desktop_surface_set_user_data(shsurf->desktop_surface, NULL);
 	shsurf->desktop_surface = NULL;
 
+	free(shsurf->app_policy_id);
+	shsurf->app_policy_id = NULL;
+	shsurf->app_policy = NULL;
+
 	weston_desktop_surface_unlink_view(shsurf->view);
 	if (weston_surface_is_mapped(surface) &&
 	    shsurf->shell->win_close_animation_type == ANIMATION_FADE) {
@@ -2585,6 +2755,8 @@ desktop_surface_committed(struct weston_desktop_surface *desktop_surface,
 	if (surface->width == 0)
 		return;
 
+	shell_surface_update_app_policy(shsurf);
+
 	was_fullscreen = shsurf->state.fullscreen;
 	was_maximized = shsurf->state.maximized;
 
@@ -3282,7 +3454,6 @@ resume_desktop(struct desktop_shell *shell)
 
 	shell->locked = false;
 	shell_fade(shell, FADE_IN);
-	weston_compositor_damage_all(shell->compositor);
 }
 
 static void
@@ -4966,7 +5137,9 @@ handle_output_move(struct wl_listener *listener, void *data)
 	shell = container_of(listener, struct desktop_shell,
 			     output_move_listener);
 
+	weston_compositor_begin_changes(shell->compositor);
 	shell_for_each_layer(shell, handle_output_move_layer, data);
+	weston_compositor_commit_changes(shell->compositor);
 }
 
 static void
@@ -5026,6 +5199,7 @@ shell_destroy(struct wl_listener *listener, void *data)
 		workspace_destroy(*ws);
 	wl_array_release(&shell->workspaces.array);
 
+	app_policy_list_release(shell);
 	free(shell->client);
 	free(shell);
 }
@@ -5145,7 +5319,6 @@ wet_shell_init(struct weston_compositor *ec,
 	struct desktop_shell *shell;
 	struct workspace **pws;
 	unsigned int i;
-	struct wl_event_loop *loop;
 
 	shell = zalloc(sizeof *shell);
 	if (shell == NULL)
@@ -5190,6 +5363,7 @@ wet_shell_init(struct weston_compositor *ec,
 	if (!shell->text_backend)
 		return -1;
 
+	wl_list_init(&shell->app_policy_list);
 	shell_configuration(shell);
 
 	shell->exposay.state_cur = EXPOSAY_LAYOUT_INACTIVE;
@@ -5227,8 +5401,10 @@ wet_shell_init(struct weston_compositor *ec,
 
 	setup_output_destroy_handler(ec, shell);
 
-	loop = wl_display_get_event_loop(ec->wl_display);
-	wl_event_loop_add_idle(loop, launch_desktop_shell_process, shell);
+	/* Start the client now rather than from the main loop: it gets
+	 * going while the compositor loads its modules, and its requests
+	 * wait in the socket until the main loop runs. */
+	launch_desktop_shell_process(shell);
 
 	wl_list_for_each(seat, &ec->seat_list, link)
 		handle_seat_created(NULL, seat);
@@ -201,6 +201,8 @@ struct desktop_shell {
 	bool allow_zap;
 	uint32_t binding_modifier;
 	uint32_t exposay_modifier;
+	int32_t exposay_frame_interval;
+	struct wl_list app_policy_list; /* app_policy::link */
 	enum animation_type win_animation_type;
 	enum animation_type win_close_animation_type;
 	enum animation_type startup_animation_type;
@@ -229,6 +231,10 @@ get_default_view(struct weston_surface *surface);
 struct shell_surface *
 get_shell_surface(struct weston_surface *surface);
 
+void
+shell_surface_set_exposay_throttle(struct weston_surface *surface,
+				   bool throttle);
+
 struct workspace *
 get_current_workspace(struct desktop_shell *shell);
 
@@ -27,12 +27,30 @@
 
 # By using this script, client can receive remoted output via gstreamer.
 # Usage:
-#	remoting-client-receive.bash <PORT NUMBER>
+#	remoting-client-receive.bash <PORT NUMBER> [jpeg|h264|h265]
+#
+# The second argument matches the encoder of the remote-output section,
+# jpeg being the default.
+
+case "${2:-jpeg}" in
+h264)
+	caps="encoding-name=H264,payload=96"
+	decode="rtph264depay ! h264parse ! avdec_h264 ! videoconvert"
+	;;
+h265)
+	caps="encoding-name=H265,payload=96"
+	decode="rtph265depay ! h265parse ! avdec_h265 ! videoconvert"
+	;;
+*)
+	caps="encoding-name=JPEG,payload=26"
+	decode="rtpjpegdepay ! jpegdec"
+	;;
+esac
 
 gst-launch-1.0 rtpbin name=rtpbin \
-	       udpsrc caps="application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=JPEG,payload=26" port=$1 ! \
+	       udpsrc caps="application/x-rtp,media=(string)video,clock-rate=(int)90000,$caps" port=$1 ! \
 	       rtpbin.recv_rtp_sink_0 \
-	       rtpbin. ! rtpjpegdepay ! jpegdec ! autovideosink \
+	       rtpbin. ! $decode ! autovideosink \
 	       udpsrc port=$(($1 + 1)) ! rtpbin.recv_rtcp_sink_0 \
 	       rtpbin.send_rtcp_src_0 ! \
 	       udpsink port=$(($1 + 2)) sync=false async=false
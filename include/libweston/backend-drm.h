@@ -78,6 +78,42 @@ struct weston_drm_output_api {
 	 */
 	void (*set_seat)(struct weston_output *output,
 			 const char *seat);
+
+	/** Whether to enable variable refresh rate on the output. Only takes
+	 *  effect if all heads of the output are VRR capable.
+	 */
+	void (*set_vrr)(struct weston_output *output, bool enable);
+
+	/** Whether the renderer buffers of the output may use compressed
+	 *  layouts, when both the GPU and the display engine support one.
+	 *  Enabled by default. Takes effect when the output is enabled.
+	 */
+	void (*set_fb_compression)(struct weston_output *output, bool enable);
+
+	/** The lowest scale, in percent of the mode size, the renderer may
+	 *  draw the output at when it cannot keep up with the refresh rate.
+	 *  The primary plane scales the frame up to the mode. 0, the default,
+	 *  always renders at the mode size. Takes effect when the output is
+	 *  enabled, and needs the GL renderer and atomic modesetting.
+	 */
+	void (*set_dynamic_resolution)(struct weston_output *output,
+				       int min_percent);
+
+	/** The name of an output of the same KMS device whose frames this
+	 *  output scans out instead of compositing its own, NULL to
+	 *  composite. The frames are scaled to the mode of this output.
+	 *  Frames the planes of this output cannot show are composited.
+	 */
+	void (*set_mirror_source)(struct weston_output *output,
+				  const char *name);
+
+	/** The most renderer buffers the output may hold at once, queued
+	 *  or scanned out, 3 for triple buffering. When all are held, the
+	 *  repaint shows the previous frame again instead of waiting for
+	 *  the GPU. 0, the default, leaves the count to GBM. Only affects
+	 *  the GL renderer.
+	 */
+	void (*set_swapchain_depth)(struct weston_output *output, int depth);
 };
 
 static inline const struct weston_drm_output_api *
@@ -96,6 +132,27 @@ struct drm_fb;
 typedef int (*submit_frame_cb)(struct weston_output *output, int fd,
 			       int stride, struct drm_fb *buffer);
 
+/** A renderer buffer of a virtual output, as a dmabuf. */
+struct weston_drm_virtual_output_dmabuf {
+	int32_t width;
+	int32_t height;
+	uint32_t format;	/**< DRM fourcc */
+	uint64_t modifier;	/**< DRM_FORMAT_MOD_INVALID if unknown */
+	int n_planes;
+	int fd[4];		/**< owned by the DRM-backend */
+	uint32_t stride[4];
+	uint32_t offset[4];
+
+	/** What changed since the previously submitted frame, in buffer
+	 * coordinates. Only valid during the callback. */
+	int n_damage;
+	const pixman_box32_t *damage;
+};
+
+typedef int (*submit_dmabuf_cb)(struct weston_output *output,
+				const struct weston_drm_virtual_output_dmabuf *dmabuf,
+				struct drm_fb *buffer);
+
 struct weston_drm_virtual_output_api {
 	/** Create virtual output.
 	 * This is a low-level function, where the caller is expected to wrap
@@ -151,6 +208,32 @@ struct weston_drm_virtual_output_api {
 	void (*finish_frame)(struct weston_output *output,
 			     struct timespec *stamp,
 			     uint32_t presented_flags);
+
+	/** Set a callback to be called instead of the submit_frame_cb one,
+	 * delivering the buffer as a complete dmabuf description.
+	 *
+	 * The renderer draws into a small ring of buffers. Each buffer is
+	 * exported once and then submitted again with the very same drm_fb
+	 * and fds, so the owner can import every buffer of the ring once,
+	 * e.g. into GStreamer or PipeWire, and then only look up the import
+	 * by the drm_fb pointer. The fds stay owned by the DRM-backend and
+	 * remain valid until the output is disabled; they must not be closed.
+	 *
+	 * The contract regarding buffer_released() and finish_frame() is the
+	 * one of submit_frame_cb.
+	 */
+	void (*set_submit_dmabuf_cb)(struct weston_output *output,
+				     submit_dmabuf_cb cb);
+
+	/** Set how long the output may go without submitting a frame.
+	 *
+	 * Frames are only submitted when something changed on the output.
+	 * After msec milliseconds without any, the current picture is
+	 * submitted again, e.g. for receivers joining a stream late. 0, the
+	 * default, never repeats frames. Takes effect when the output is
+	 * enabled.
+	 */
+	void (*set_keep_alive)(struct weston_output *output, int msec);
 };
 
 static inline const struct weston_drm_virtual_output_api *
@@ -224,8 +307,22 @@ struct weston_drm_backend_config {
 	/** Use shadow buffer if using Pixman-renderer. */
 	bool use_pixman_shadow;
 
+	/** With the Pixman-renderer, render straight into the scanout
+	 * buffers and only use a shadow buffer while the output is being
+	 * read back, e.g. by a screenshot or the recorder. Takes precedence
+	 * over use_pixman_shadow. */
+	bool pixman_shadow_on_readback;
+
 	/** Allow compositor to start without input devices. */
 	bool continue_without_input;
+
+	/** Further DRM devices whose outputs to drive
+	 *
+	 * A comma-separated list of DRM device names, like "card1,card2",
+	 * or NULL. The devices only scan out what the renderer of the main
+	 * device produces.
+	 */
+	char *additional_devices;
 };
 
 #ifdef  __cplusplus
@@ -34,7 +34,7 @@ extern "C" {
 
 #include <libweston/libweston.h>
 
-#define WESTON_FBDEV_BACKEND_CONFIG_VERSION 2
+#define WESTON_FBDEV_BACKEND_CONFIG_VERSION 3
 
 struct libinput_device;
 
@@ -61,6 +61,13 @@ struct weston_fbdev_backend_config {
 	 * backend destruction.
 	 */
 	char *seat_id;
+
+	/** Whether to flip between two buffers of the virtual resolution,
+	 * synchronised to the vertical blank when the driver supports
+	 * FBIO_WAITFORVSYNC. Without panning support a single buffer is
+	 * used, as by default.
+	 */
+	bool double_buffer;
 };
 
 #ifdef  __cplusplus
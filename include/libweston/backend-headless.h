@@ -34,7 +34,7 @@ extern "C" {
 
 #include <libweston/libweston.h>
 
-#define WESTON_HEADLESS_BACKEND_CONFIG_VERSION 2
+#define WESTON_HEADLESS_BACKEND_CONFIG_VERSION 3
 
 struct weston_headless_backend_config {
 	struct weston_backend_config base;
@@ -44,6 +44,13 @@ struct weston_headless_backend_config {
 
 	/** Whether to use the GL renderer, conflicts with use_pixman */
 	bool use_gl;
+
+	/** Refresh rate of the outputs in mHz, 0 for the default of 60 Hz */
+	int refresh;
+
+	/** Complete each frame as soon as it has been rendered instead of
+	 *  waiting for the refresh period, to measure throughput */
+	bool unthrottled;
 };
 
 #ifdef  __cplusplus
@@ -34,6 +34,7 @@ extern "C" {
 #include <stdint.h>
 
 #define WESTON_CONFIG_FILE_ENV_VAR "WESTON_CONFIG_FILE"
+#define WESTON_CONFIG_FD_ENV_VAR "WESTON_CONFIG_FD"
 
 enum config_key_type {
 	CONFIG_KEY_INTEGER,		/* typeof data = int */
@@ -117,6 +118,9 @@ weston_config_get_full_path(struct weston_config *config);
 void
 weston_config_destroy(struct weston_config *config);
 
+int
+weston_config_serialize(struct weston_config *config);
+
 int weston_config_next_section(struct weston_config *config,
 			       struct weston_config_section **section,
 			       const char **name);
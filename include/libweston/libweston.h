@@ -76,6 +76,7 @@ struct weston_output;
 struct input_method;
 struct weston_pointer;
 struct linux_dmabuf_buffer;
+struct weston_dmabuf_feedback_main;
 struct weston_recorder;
 struct weston_pointer_constraint;
 struct ro_anonymous_file;
@@ -226,6 +227,9 @@ struct weston_head {
 	enum weston_hdcp_protection current_protection;
 };
 
+/** Frames remembered for the adaptive repaint window percentile */
+#define WESTON_REPAINT_WINDOW_SAMPLES 32
+
 /** Content producer for heads
  *
  * \rst
@@ -233,6 +237,46 @@ struct weston_head {
  *
  * \ingroup output
  */
+/** Completion callback of weston_output_read_pixels_async()
+ *
+ * \param data The user data given to weston_output_read_pixels_async().
+ * \param status 0 if the pixels were read, -1 on failure.
+ */
+typedef void (*weston_read_pixels_done_func_t)(void *data, int status);
+
+/** Argument of weston_output::presented_signal */
+struct weston_output_presentation {
+	/** When the frame was shown, NULL if unknown */
+	const struct timespec *stamp;
+	uint64_t msc;
+	uint32_t flags; /**< wp_presentation_feedback flags */
+};
+
+/** Color transform from the compositing space to the display
+ *
+ * The 3D LUT maps every color, the optional matrix-shaper form describes the
+ * same transform as degamma curves, a 3x3 matrix and gamma curves, which is
+ * what display hardware implements.
+ *
+ * \sa weston_output_set_color_transform
+ * \ingroup output
+ */
+struct weston_color_transform {
+	/** Number of grid points along each axis of the 3D LUT */
+	unsigned int lut_size;
+	/** lut_size^3 RGB triplets in [0, 1], red varying fastest */
+	const float *lut;
+
+	/** Number of points of each degamma and gamma curve, 0 if the
+	 * transform has no matrix-shaper form */
+	unsigned int curve_size;
+	/** curve_size red, then green, then blue values in [0, 1] */
+	const float *degamma;
+	const float *gamma;
+	/** Row-major matrix applied to linear RGB between the curves */
+	float matrix[9];
+};
+
 struct weston_output {
 	uint32_t id;
 	char *name;
@@ -256,13 +300,60 @@ struct weston_output {
 	/** Output area in global coordinates, simple rect */
 	pixman_region32_t region;
 
+	/** Views overlapping this output, as struct weston_view pointers in
+	 *  compositor view_list order, topmost first. Valid during repaint.
+	 */
+	struct wl_array view_array;
+	uint32_t view_array_serial;
+
+	/** Temporary regions of the repaint in progress, see
+	 *  weston_output_scratch_region(). */
+	struct {
+		struct wl_array regions; /**< pixman_region32_t pointers */
+		unsigned int used;
+	} scratch;
+
 	/** True if damage has occurred since the last repaint for this output;
 	 *  if set, a repaint will eventually occur. */
 	bool repaint_needed;
+	/** Repaint requested while changes were batched, see
+	 *  weston_compositor_begin_changes(). */
+	bool repaint_deferred;
 
 	/** Used only between repaint_begin and repaint_cancel. */
 	bool repainted;
 
+	/** True if only cursor_plane moved since the last repaint; handled
+	 *  by repaint_cursor instead of a full repaint when set alone. */
+	bool cursor_repaint_needed;
+
+	/** Set by the backend while the display runs with adaptive sync, in
+	 *  which case a fullscreen client commit is repainted right away
+	 *  rather than at the next fixed refresh slot. */
+	bool vrr_enabled;
+
+	/** See weston_output_set_idle_refresh(), 0 if disabled */
+	uint32_t idle_refresh_timeout_ms;
+	struct wl_event_source *idle_refresh_timer;
+	/** Last input or substantial damage */
+	struct timespec idle_refresh_activity;
+	/** The low refresh rate mode switched to while idle, or NULL */
+	struct weston_mode *idle_refresh_mode;
+	/** Idle with adaptive sync, repaints are limited instead */
+	bool idle_refresh_throttled;
+
+	/** Repaint as soon as the previous frame completed, for vrr_enabled,
+	 *  a fullscreen weston_surface::allow_tearing or a backend that does
+	 *  not throttle to a refresh rate */
+	bool repaint_immediate;
+
+	/** Frame callbacks to complete once the repaint in progress is done */
+	struct wl_list frame_callback_list;
+
+	/** The renderer deferred the repaint in progress to its repaint_flush
+	 *  hook, so completing it must wait until then. */
+	bool repaint_finish_pending;
+
 	/** State of the repaint loop */
 	enum {
 		REPAINT_NOT_SCHEDULED = 0, /**< idle; no repaint will occur */
@@ -274,6 +365,34 @@ struct weston_output {
 	/** If repaint_status is REPAINT_SCHEDULED, contains the time the
 	 *  next repaint should be run */
 	struct timespec next_repaint;
+	/** Fires at next_repaint, see output_repaint_timer_handler() */
+	int repaint_timer_fd;
+	struct wl_event_source *repaint_timer;
+	/** Set by the backend for outputs showing parts of one monitor, like
+	 *  the tiles of a tiled display. Scheduled outputs of the same
+	 *  non-zero group repaint together, so that their frames go to the
+	 *  display in one commit. */
+	uint32_t repaint_group;
+
+	/** Adaptive repaint window state, see weston_output_finish_frame() */
+	struct {
+		struct timespec begin;	/**< start of the last repaint */
+		int64_t pending_nsec;	/**< its duration, -1 if none */
+		int64_t samples_nsec[WESTON_REPAINT_WINDOW_SAMPLES];
+		unsigned int sample_count;
+		unsigned int next_sample;
+		int64_t window_nsec;	/**< currently applied window */
+	} repaint_window;
+
+	/** Rolling statistics for the 'frame-stats' debug scope */
+	struct weston_output_frame_stats *frame_stats;
+
+	/** Fraction of the mode size the renderer draws at, for the backend
+	 * to upscale; 1.0 unless dynamic resolution lowered it.
+	 * \sa weston_output_get_render_size() */
+	float render_scale;
+	/** Lowest render_scale dynamic resolution may pick, 0 if disabled */
+	float render_scale_min;
 
 	/** For cancelling the idle_repaint callback on output destruction. */
 	struct wl_event_source *idle_repaint_source;
@@ -281,11 +400,15 @@ struct weston_output {
 	struct weston_output_zoom zoom;
 	int dirty;
 	struct wl_signal frame_signal;
+	/** Emitted when the last repainted frame was shown, with a
+	 * struct weston_output_presentation */
+	struct wl_signal presented_signal;
 	struct wl_signal destroy_signal;	/**< sent when disabled */
 	int move_x, move_y;
 	struct timespec frame_time; /* presentation timestamp */
 	uint64_t msc;        /* media stream counter */
 	int disable_planes;
+	int capture_count; /**< see weston_output_capture_incr() */
 	int destroying;
 	struct wl_list feedback_list;
 
@@ -311,8 +434,31 @@ struct weston_output {
 			void *repaint_data);
 	void (*destroy)(struct weston_output *output);
 	void (*assign_planes)(struct weston_output *output, void *repaint_data);
+
+	/** Plane repositioned by repaint_cursor, or NULL */
+	struct weston_plane *cursor_plane;
+
+	/** Update the position of the view on cursor_plane without repainting
+	 *
+	 * Called instead of repaint when nothing but that view moved since
+	 * the last repaint. Returns 0 if the update was added to
+	 * repaint_data, -1 to fall back to a full repaint. May be NULL.
+	 */
+	int (*repaint_cursor)(struct weston_output *output, void *repaint_data);
 	int (*switch_mode)(struct weston_output *output, struct weston_mode *mode);
 
+	/** Read the output back from the display hardware, planes included
+	 *
+	 * Same contract as weston_output_read_pixels_async(), which falls
+	 * back to the renderer if this returns -1. May be NULL.
+	 */
+	int (*capture_pixels)(struct weston_output *output,
+			      pixman_format_code_t format, void *pixels,
+			      uint32_t x, uint32_t y,
+			      uint32_t width, uint32_t height,
+			      weston_read_pixels_done_func_t done,
+			      void *data);
+
 	/* backlight values are on 0-255 range, where higher is brighter */
 	int32_t backlight_current;
 	void (*set_backlight)(struct weston_output *output, uint32_t value);
@@ -325,8 +471,25 @@ struct weston_output {
 			  uint16_t *g,
 			  uint16_t *b);
 
+	/** Program the matrix-shaper form of a color transform into the
+	 * display hardware, or disable it if xform is NULL
+	 *
+	 * Returns -1 if the hardware cannot apply it. May be NULL.
+	 */
+	int (*set_color_transform)(struct weston_output *output,
+				   const struct weston_color_transform *xform);
+	/** The color transform is applied by set_color_transform() */
+	bool color_transform_in_hardware;
+	/** The color transform is applied by the renderer, so views
+	 * bypassing it on hardware planes would be shown untransformed */
+	bool color_transform_in_renderer;
+
 	bool enabled; /**< is in the output_list, not pending list */
 	int scale;
+	/** The scale in 1/120ths if it is fractional, 0 otherwise. scale and
+	 * current_scale are then rounded up from it, for the clients and
+	 * buffers that only know integer scales. */
+	int32_t fractional_scale;
 
 	int (*enable)(struct weston_output *output);
 	int (*disable)(struct weston_output *output);
@@ -374,6 +537,12 @@ struct weston_pointer_motion_event {
 	double dy;
 	double dx_unaccel;
 	double dy_unaccel;
+
+	/** When non-zero, this event is the sum of num_coalesced relative
+	 *  motion events, which are still sent one by one to
+	 *  zwp_relative_pointer_v1 clients. */
+	unsigned int num_coalesced;
+	struct weston_pointer_motion_event *coalesced;
 };
 
 struct weston_pointer_axis_event {
@@ -421,6 +590,14 @@ struct weston_keyboard_grab {
 };
 
 struct weston_touch_grab;
+/** A touch point that moved, passed with the others of its frame to
+ *  weston_touch_grab_interface::motion_frame */
+struct weston_touch_motion {
+	int touch_id;
+	wl_fixed_t x;	/**< global coordinates */
+	wl_fixed_t y;
+};
+
 struct weston_touch_grab_interface {
 	void (*down)(struct weston_touch_grab *grab,
 			const struct timespec *time,
@@ -437,6 +614,12 @@ struct weston_touch_grab_interface {
 			wl_fixed_t sy);
 	void (*frame)(struct weston_touch_grab *grab);
 	void (*cancel)(struct weston_touch_grab *grab);
+	/** Optional: the motion of all the points that moved in a frame,
+	 *  instead of a motion() call for each */
+	void (*motion_frame)(struct weston_touch_grab *grab,
+			     const struct timespec *time,
+			     const struct weston_touch_motion *motions,
+			     int count);
 };
 
 struct weston_touch_grab {
@@ -473,8 +656,12 @@ struct weston_data_source {
 	void (*cancel)(struct weston_data_source *source);
 };
 
+/** Number of hash buckets for the per-client lookup tables of the input
+ * devices. Must be a power of two. */
+#define WESTON_INPUT_CLIENT_BUCKETS 32
+
 struct weston_pointer_client {
-	struct wl_list link;
+	struct wl_list link;	/* weston_pointer::pointer_client_buckets */
 	struct wl_client *client;
 	struct wl_list pointer_resources;
 	struct wl_list relative_pointer_resources;
@@ -483,7 +670,8 @@ struct weston_pointer_client {
 struct weston_pointer {
 	struct weston_seat *seat;
 
-	struct wl_list pointer_clients;
+	/* struct weston_pointer_client::link, hashed by wl_client */
+	struct wl_list pointer_client_buckets[WESTON_INPUT_CLIENT_BUCKETS];
 
 	struct weston_view *focus;
 	struct weston_pointer_client *focus_client;
@@ -591,7 +779,8 @@ struct weston_touch {
 
 	struct wl_list device_list;	/* struct weston_touch_device::link */
 
-	struct wl_list resource_list;
+	/* unfocused resources, grouped per client and hashed by wl_client */
+	struct wl_list client_buckets[WESTON_INPUT_CLIENT_BUCKETS];
 	struct wl_list focus_resource_list;
 	struct weston_view *focus;
 	struct wl_listener focus_view_listener;
@@ -696,6 +885,11 @@ weston_touch_send_motion(struct weston_touch *touch,
 			 const struct timespec *time, int touch_id,
 			 wl_fixed_t x, wl_fixed_t y);
 void
+weston_touch_send_motion_frame(struct weston_touch *touch,
+			       const struct timespec *time,
+			       const struct weston_touch_motion *motions,
+			       int count);
+void
 weston_touch_send_frame(struct weston_touch *touch);
 
 
@@ -712,6 +906,7 @@ struct weston_xkb_info {
 	struct xkb_keymap *keymap;
 	struct ro_anonymous_file *keymap_rofile;
 	int32_t ref_count;
+	struct wl_list link; /**< weston_compositor::xkb_info_list */
 	xkb_mod_index_t shift_mod;
 	xkb_mod_index_t caps_mod;
 	xkb_mod_index_t ctrl_mod;
@@ -728,7 +923,8 @@ struct weston_xkb_info {
 struct weston_keyboard {
 	struct weston_seat *seat;
 
-	struct wl_list resource_list;
+	/* unfocused resources, grouped per client and hashed by wl_client */
+	struct wl_list client_buckets[WESTON_INPUT_CLIENT_BUCKETS];
 	struct wl_list focus_resource_list;
 	struct weston_surface *focus;
 	struct wl_listener focus_resource_listener;
@@ -882,11 +1078,28 @@ struct weston_plane {
 	struct wl_list link;
 };
 
+/** Completion callback of the renderer's import_dmabuf_async hook
+ *
+ * \param buffer The dmabuf given to the hook.
+ * \param success Whether the renderer can use the buffer, as
+ * weston_compositor_import_dmabuf() would have returned.
+ */
+typedef void (*weston_dmabuf_import_done_func_t)(struct linux_dmabuf_buffer *buffer,
+						 bool success);
+
 struct weston_renderer {
 	int (*read_pixels)(struct weston_output *output,
 			       pixman_format_code_t format, void *pixels,
 			       uint32_t x, uint32_t y,
 			       uint32_t width, uint32_t height);
+
+	/** See weston_output_read_pixels_async(). May be NULL. */
+	int (*read_pixels_async)(struct weston_output *output,
+				 pixman_format_code_t format, void *pixels,
+				 uint32_t x, uint32_t y,
+				 uint32_t width, uint32_t height,
+				 weston_read_pixels_done_func_t done,
+				 void *data);
 	void (*repaint_output)(struct weston_output *output,
 			       pixman_region32_t *output_damage);
 	void (*flush_damage)(struct weston_surface *surface);
@@ -911,6 +1124,11 @@ struct weston_renderer {
 	bool (*import_dmabuf)(struct weston_compositor *ec,
 			      struct linux_dmabuf_buffer *buffer);
 
+	/** See weston_compositor_import_dmabuf_async(). May be NULL. */
+	bool (*import_dmabuf_async)(struct weston_compositor *ec,
+				    struct linux_dmabuf_buffer *buffer,
+				    weston_dmabuf_import_done_func_t done);
+
 	/** On error sets num_formats to zero */
 	void (*query_dmabuf_formats)(struct weston_compositor *ec,
 				int **formats, int *num_formats);
@@ -919,6 +1137,44 @@ struct weston_renderer {
 	void (*query_dmabuf_modifiers)(struct weston_compositor *ec,
 				int format, uint64_t **modifiers,
 				int *num_modifiers);
+
+	/** Apply a color transform to everything composited on the output,
+	 * or stop doing so if xform is NULL
+	 *
+	 * Returns -1 if the renderer cannot. May be NULL.
+	 */
+	int (*output_set_color_transform)(struct weston_output *output,
+					  const struct weston_color_transform *xform);
+
+	/** Free what can be recreated when drawing again, while the
+	 * compositor is asleep
+	 *
+	 * Returns the number of bytes released. May be NULL.
+	 */
+	size_t (*trim_memory)(struct weston_compositor *ec);
+
+	/** Copy rectangles of the frame just composited into a dmabuf
+	 *
+	 * Only valid from the output's frame_signal. The rectangles are in
+	 * framebuffer coordinates with the origin at the top-left corner.
+	 * The copy is y-inverted if the renderer sets WESTON_CAP_CAPTURE_YFLIP.
+	 * Returns -1 if the buffer cannot be written. May be NULL.
+	 */
+	int (*output_copy_to_dmabuf)(struct weston_output *output,
+				     struct linux_dmabuf_buffer *dmabuf,
+				     const pixman_box32_t *rects, int n_rects);
+
+	/** Render the repaints deferred by repaint_output in this repaint
+	 * cycle, if any, and emit their frame signals
+	 *
+	 * Called once all outputs have gone through repaint_output and
+	 * before the backend's repaint_flush or repaint_cancel. May be NULL.
+	 */
+	void (*repaint_flush)(struct weston_compositor *ec);
+
+	/** Bytes the renderer keeps for the surface, like texture copies of
+	 *  wl_shm buffers, for the 'memory-stats' scope. May be NULL. */
+	size_t (*surface_get_memory)(struct weston_surface *surface);
 };
 
 enum weston_capability {
@@ -1001,11 +1257,28 @@ struct weston_touch_calibrator;
 struct weston_desktop_xwayland;
 struct weston_desktop_xwayland_interface;
 struct weston_debug_compositor;
+struct weston_view_grid;
 
 /** Main object, container-like structure which aggregates all other objects.
  *
  * \ingroup compositor
  */
+/** Scheduling of the compositor threads
+ *
+ * \sa weston_compositor_set_thread_scheduling
+ * \ingroup compositor
+ */
+struct weston_thread_scheduling {
+	/** SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+	int policy;
+	/** Real-time priority for SCHED_FIFO and SCHED_RR, 1 to 99 */
+	int priority;
+	/** CPUs the main thread may run on, bit N for CPU N, 0 for all */
+	uint64_t main_cpus;
+	/** CPUs the input, repaint and encoder threads may run on */
+	uint64_t worker_cpus;
+};
+
 struct weston_compositor {
 	struct wl_signal destroy_signal;
 
@@ -1049,6 +1322,13 @@ struct weston_compositor {
 	struct wl_list seat_list;
 	struct wl_list layer_list;	/* struct weston_layer::link */
 	struct wl_list view_list;	/* struct weston_view::link */
+	struct weston_view_grid *view_grid; /* pick index over view_list */
+	uint32_t view_transform_serial; /* last weston_view::transform.serial */
+	bool view_list_needs_rebuild;	/* stacking changed since last build */
+	int changes_depth;		/* see weston_compositor_begin_changes() */
+	bool repick_needed;		/* views moved since the last repick */
+	uint32_t view_list_serial;	/* bumped on view list or mask change */
+	uint32_t output_layout_serial;	/* bumped when output regions change */
 	struct wl_list plane_list;
 	struct wl_list key_binding_list;
 	struct wl_list modifier_binding_list;
@@ -1056,12 +1336,13 @@ struct weston_compositor {
 	struct wl_list touch_binding_list;
 	struct wl_list axis_binding_list;
 	struct wl_list debug_binding_list;
+	struct hash_table *binding_table; /* see bindings.c */
+	uint32_t modifier_binding_serial; /* bumped by other input events */
 
 	uint32_t state;
 	struct wl_event_source *idle_source;
 	uint32_t idle_inhibit;
 	int idle_time;			/* timeout, s */
-	struct wl_event_source *repaint_timer;
 
 	const struct weston_pointer_grab_interface *default_pointer_grab;
 
@@ -1084,6 +1365,10 @@ struct weston_compositor {
 	struct xkb_rule_names xkb_names;
 	struct xkb_context *xkb_context;
 	struct weston_xkb_info *xkb_info;
+	/* weston_xkb_info::link, one per keymap in use */
+	struct wl_list xkb_info_list;
+	/* Keymaps compiled by weston_compositor_keymap_from_names() */
+	struct wl_list keymap_cache;
 
 	int32_t kb_repeat_rate;
 	int32_t kb_repeat_delay;
@@ -1092,6 +1377,97 @@ struct weston_compositor {
 
 	clockid_t presentation_clock;
 	int32_t repaint_msec;
+	/** Derive each output's repaint window from its measured repaint
+	 *  times, with repaint_msec as the starting value. */
+	bool adaptive_repaint_window;
+	/** Send frame callbacks as soon as a repaint has taken the surface
+	 *  content, stamped with the predicted presentation time. */
+	bool early_frame_callbacks;
+	/** Release renderer and backend caches when going to sleep or
+	 *  offscreen, see weston_compositor_sleep(). */
+	bool trim_memory_on_sleep;
+	/** When the compositor woke up after trimming memory, zero once
+	 *  the first frame has been presented. */
+	struct timespec wake_time;
+
+	/** Minimum interval between frame callbacks for surfaces that are
+	 *  completely hidden behind opaque views, 0 to never throttle. */
+	int32_t occluded_frame_interval_msec;
+	struct wl_event_source *occluded_frame_timer;
+	bool occluded_frame_timer_armed;
+
+	/** Threads rendering the outputs of a repaint cycle in parallel,
+	 *  NULL to render on the main thread, see
+	 *  weston_compositor_set_repaint_threads(). */
+	struct weston_worker_pool *repaint_pool;
+	/** See weston_compositor_set_thread_scheduling() */
+	struct weston_thread_scheduling thread_scheduling;
+	/** Also split the damage of each output into horizontal bands
+	 *  painted in parallel on repaint_pool. Only the pixman renderer
+	 *  implements it. */
+	bool tiled_repaint;
+
+	/** Damage regions with more rectangles than this are coarsened
+	 *  before being handed to the renderer, 0 to keep them exact. */
+	int32_t damage_max_rects;
+
+	/** Upload SHM buffer contents at commit time and release the
+	 *  buffers immediately, rather than at the next repaint. Renderers
+	 *  that sample from client memory keep a copy instead. */
+	bool shm_release_after_upload;
+
+	/** Let the renderer draw opaque regions front to back with a depth
+	 *  test before blending the rest back to front, so that hidden
+	 *  fragments are rejected instead of shaded. Only the GL renderer
+	 *  implements it. */
+	bool render_opaque_front_to_back;
+
+	/** Let the renderer draw a view and its subsurfaces from a single
+	 *  texture while none of them changes, as when they are moved or
+	 *  animated. Only the GL renderer implements it. */
+	bool cache_surface_trees;
+
+	/** Let the renderer sample heavily scaled down views from mipmaps,
+	 *  regenerated only when their surface is damaged. Only the GL
+	 *  renderer implements it. */
+	bool mipmap_minified_views;
+
+	/** How much memory the renderer may use for the textures of wl_shm
+	 *  surfaces before evicting those of hidden surfaces, in MiB, or 0
+	 *  for no limit. Only the GL renderer implements it. */
+	int32_t texture_memory_budget_mib;
+
+	/** Free lists for the protocol objects clients create every frame */
+	struct weston_object_pool *frame_callback_pool;
+	struct weston_object_pool *feedback_pool;
+	struct weston_object_pool *region_pool;
+	struct weston_log_scope *debug_pools;
+	struct weston_log_scope *debug_frame_stats;
+	struct weston_log_scope *debug_surface_stats;
+	/** weston_surface_stats::link, for the 'surface-stats' scope */
+	struct wl_list surface_stats_list;
+	struct weston_log_scope *debug_memory_stats;
+	/** weston_client_memory::link, see weston_surface_memory_update() */
+	struct wl_list client_memory_list;
+
+	/** weston_surface::commit_queue_link of the surfaces with queued
+	 *  commits */
+	struct wl_list commit_queue_list;
+	/** Disconnect clients whose buffers take more memory, in MiB, or 0
+	 *  for no limit */
+	int32_t client_memory_limit_mib;
+
+	/** Hold back the frame callbacks of clients sending more requests
+	 *  between two repaints, or 0 for no budget */
+	int32_t client_request_budget;
+	struct wl_protocol_logger *client_budget_logger;
+	/** weston_client_budget::link */
+	struct wl_list client_budget_list;
+	struct weston_log_scope *debug_client_budget;
+
+	/** weston_client_cpu::link, for the 'client-cpu' scope */
+	struct wl_list client_cpu_list;
+	struct weston_log_scope *debug_client_cpu;
 
 	unsigned int activate_serial;
 
@@ -1105,6 +1481,15 @@ struct weston_compositor {
 	/* Whether to let the compositor run without any input device. */
 	bool require_input;
 
+	/** Deliver the relative pointer motion read in one libinput
+	 *  dispatch as a single motion event, see
+	 *  weston_pointer_motion_event::coalesced. */
+	bool coalesce_pointer_motion;
+
+	/** Read libinput on a dedicated thread, so input is timestamped
+	 *  and drained from the kernel while the main loop is busy. */
+	bool input_thread;
+
 	/* Signal for a backend to inform a frontend about possible changes
 	 * in head status.
 	 */
@@ -1121,8 +1506,17 @@ struct weston_compositor {
 	struct weston_log_context *weston_log_ctx;
 	struct weston_log_scope *debug_scene;
 	struct weston_log_scope *timeline;
+	struct weston_log_scope *timeline_trace;
+	/** See weston_compositor_enable_flight_recorder() */
+	struct weston_flight_recorder *flight_recorder;
+	/** Emitted with a weston_stall_info when the flight recorder
+	 *  detects a stall */
+	struct wl_signal stall_signal;
 
 	struct content_protection *content_protection;
+
+	/* See linux_dmabuf_set_main_device() */
+	struct weston_dmabuf_feedback_main *dmabuf_feedback_main;
 };
 
 struct weston_buffer {
@@ -1139,6 +1533,13 @@ struct weston_buffer {
 	int y_inverted;
 };
 
+/** Memory of the buffers a surface holds, in bytes */
+struct weston_surface_memory {
+	size_t shm;	/**< the attached wl_shm buffer */
+	size_t dmabuf;	/**< the attached dmabuf */
+	size_t cached;	/**< in the cache of a synchronized sub-surface */
+};
+
 struct weston_buffer_reference {
 	struct weston_buffer *buffer;
 	struct wl_listener destroy_listener;
@@ -1269,6 +1670,11 @@ struct weston_view {
 	struct {
 		int dirty;
 
+		/* Changes every time the transform is recomputed, and is
+		 * never reused by another view of the same compositor, so
+		 * renderers can use it to detect stale cached geometry. */
+		uint32_t serial;
+
 		/* Approximations in global coordinates:
 		 * - boundingbox is guaranteed to include the whole view in
 		 *   the smallest possible single rectangle.
@@ -1286,6 +1692,11 @@ struct weston_view {
 		struct weston_matrix inverse;
 
 		struct weston_transform position; /* matrix from x, y */
+
+		/* Where an untransformed view was last painted, when it
+		 * moved since; see view_add_move_damage(). */
+		bool move_damage_pending;
+		pixman_box32_t move_damage_from;
 	} transform;
 
 	/*
@@ -1302,12 +1713,50 @@ struct weston_view {
 	 */
 	uint32_t output_mask;
 
+	/* The output assignment above holds while the bounding box stays
+	 * inside output_box, unless output_layout_serial no longer matches
+	 * the compositor's. See weston_view_assign_output(). */
+	pixman_box32_t output_box;
+	uint32_t output_layout_serial;
+
 	/* Per-surface Presentation feedback flags, controlled by backend. */
 	uint32_t psf_flags;
 
+	/* Outputs on which the view is entirely covered by opaque views
+	 * above it, updated on each repaint of the respective output when
+	 * occluded surface throttling is enabled. */
+	uint32_t occluded_mask;
+
+	/* Hardware plane the shell wants the view on, identified the way
+	 * the backend names its planes (the KMS plane object ID for DRM),
+	 * or 0. Backends try it before their own plane choice, and fall back
+	 * to composition when the view does not fit it. */
+	uint32_t pinned_plane;
+
 	bool is_mapped;
 };
 
+/** Matrix coefficients of YUV content, how it converts to RGB */
+enum weston_yuv_coefficients {
+	WESTON_YUV_COEFFICIENTS_BT601 = 0, /**< the default */
+	WESTON_YUV_COEFFICIENTS_BT709,
+	WESTON_YUV_COEFFICIENTS_BT2020,
+};
+
+/** Quantization range of YUV content */
+enum weston_yuv_range {
+	WESTON_YUV_RANGE_LIMITED = 0, /**< the default */
+	WESTON_YUV_RANGE_FULL,
+};
+
+/** What a surface shows, see weston_content_type_v1 */
+enum weston_content_type {
+	WESTON_CONTENT_TYPE_NONE = 0, /**< the default */
+	WESTON_CONTENT_TYPE_PHOTO,
+	WESTON_CONTENT_TYPE_VIDEO,
+	WESTON_CONTENT_TYPE_GAME,
+};
+
 struct weston_surface_state {
 	/* wl_surface.attach */
 	int newly_attached;
@@ -1327,6 +1776,11 @@ struct weston_surface_state {
 	/* wl_surface.set_input_region */
 	pixman_region32_t input;
 
+	/* Set since the regions were last copied into a sub-surface cache,
+	 * which otherwise holds the same regions already. */
+	bool opaque_changed;
+	bool input_changed;
+
 	/* wl_surface.frame */
 	struct wl_list frame_callback_list;
 
@@ -1350,6 +1804,31 @@ struct weston_surface_state {
 
 	/* weston_protected_surface.enforced/relaxed */
 	enum weston_surface_protection_mode protection_mode;
+
+	/* weston_tearing_control_v1.set_presentation_hint */
+	bool allow_tearing;
+
+	/* weston_color_representation_v1.set_coefficients */
+	enum weston_yuv_coefficients yuv_coefficients;
+	/* weston_color_representation_v1.set_range */
+	enum weston_yuv_range yuv_range;
+
+	/* weston_content_type_v1.set_content_type */
+	enum weston_content_type content_type;
+
+	/* weston_commit_timer_v1.set_target_time */
+	bool has_target_time;
+	struct timespec target_time;
+};
+
+/** A stall seen by the flight recorder, see
+ *  weston_compositor_enable_flight_recorder() */
+struct weston_stall_info {
+	struct timespec time; /**< CLOCK_MONOTONIC */
+	const char *reason;
+	int64_t late_msec;
+	/** The dump of the flight recorder, or NULL if none was written */
+	const char *dump_path;
 };
 
 struct weston_surface_activation_data {
@@ -1423,6 +1902,26 @@ struct weston_surface {
 	struct wl_list frame_callback_list;
 	struct wl_list feedback_list;
 
+	/* When frame callbacks were last released while they were
+	 * throttled, see weston_compositor::occluded_frame_interval_msec
+	 * and weston_surface_set_frame_interval(). */
+	struct timespec throttled_frame_time;
+	int32_t frame_interval_msec;
+
+	/* When the last buffer was attached, and the smoothed interval
+	 * between buffers in milliseconds, so that backends can tell how
+	 * often the content changes. */
+	struct timespec buffer_time;
+	uint32_t buffer_interval_msec;
+
+	/** Latency statistics, while the 'surface-stats' scope is bound */
+	struct weston_surface_stats *stats;
+
+	/** Buffers held, for the 'memory-stats' scope and client limits */
+	struct weston_surface_memory memory;
+	struct weston_client_memory *client_memory;
+	struct wl_list memory_link; /* weston_client_memory::surface_list */
+
 	struct weston_buffer_reference buffer_ref;
 	struct weston_buffer_viewport buffer_viewport;
 	int32_t width_from_buffer; /* before applying viewport */
@@ -1470,6 +1969,11 @@ struct weston_surface {
 	bool is_mapped;
 	bool is_opaque;
 
+	/* The color given to weston_surface_set_color(), which buffer-less
+	 * surfaces are filled with, as red, green, blue and alpha. */
+	bool has_solid_color;
+	float solid_color[4];
+
 	/* An list of per seat pointer constraints. */
 	struct wl_list pointer_constraints;
 
@@ -1481,6 +1985,24 @@ struct weston_surface {
 	enum weston_hdcp_protection desired_protection;
 	enum weston_hdcp_protection current_protection;
 	enum weston_surface_protection_mode protection_mode;
+
+	/** The client accepts tearing for lower latency, see
+	 *  weston_output::repaint_immediate */
+	bool allow_tearing;
+
+	/** How YUV buffers convert to RGB, see weston_color_representation_v1 */
+	enum weston_yuv_coefficients yuv_coefficients;
+	enum weston_yuv_range yuv_range;
+
+	/** Hint for plane assignment and refresh policies */
+	enum weston_content_type content_type;
+
+	/** Committed states waiting for their target time, oldest first, see
+	 *  weston_commit_timer_v1 and weston_output_repaint() */
+	struct wl_list commit_queue;
+	/** weston_compositor::commit_queue_list, while commit_queue is not
+	 *  empty */
+	struct wl_list commit_queue_link;
 };
 
 struct weston_subsurface {
@@ -1606,6 +2128,10 @@ weston_output_schedule_repaint(struct weston_output *output);
 void
 weston_compositor_schedule_repaint(struct weston_compositor *compositor);
 void
+weston_compositor_begin_changes(struct weston_compositor *compositor);
+void
+weston_compositor_commit_changes(struct weston_compositor *compositor);
+void
 weston_compositor_damage_all(struct weston_compositor *compositor);
 void
 weston_compositor_wake(struct weston_compositor *compositor);
@@ -1715,6 +2241,9 @@ weston_view_is_mapped(struct weston_view *view);
 void
 weston_view_schedule_repaint(struct weston_view *view);
 
+void
+weston_view_schedule_cursor_repaint(struct weston_view *view);
+
 bool
 weston_surface_is_mapped(struct weston_surface *surface);
 
@@ -1745,6 +2274,10 @@ weston_surface_set_role(struct weston_surface *surface,
 const char *
 weston_surface_get_role(struct weston_surface *surface);
 
+void
+weston_surface_set_frame_interval(struct weston_surface *surface,
+				  int32_t msec);
+
 void
 weston_surface_set_label_func(struct weston_surface *surface,
 			      int (*desc)(struct weston_surface *,
@@ -1781,6 +2314,12 @@ weston_compositor_add_destroy_listener_once(struct weston_compositor *compositor
 					    struct wl_listener *listener,
 					    wl_notify_func_t destroy_handler);
 
+int
+weston_compositor_enable_flight_recorder(struct weston_compositor *compositor,
+					 int32_t threshold_msec,
+					 int32_t seconds,
+					 const char *dump_dir);
+
 enum weston_compositor_backend {
 	WESTON_BACKEND_DRM,
 	WESTON_BACKEND_FBDEV,
@@ -1801,6 +2340,12 @@ weston_compositor_get_user_data(struct weston_compositor *compositor);
 void
 weston_compositor_exit_with_code(struct weston_compositor *compositor,
 				 int exit_code);
+int
+weston_compositor_set_repaint_threads(struct weston_compositor *compositor,
+				      unsigned int n_threads);
+int
+weston_compositor_set_thread_scheduling(struct weston_compositor *compositor,
+					const struct weston_thread_scheduling *sched);
 void
 weston_output_update_zoom(struct weston_output *output);
 void
@@ -1813,9 +2358,20 @@ struct wl_listener *
 weston_output_get_destroy_listener(struct weston_output *output,
 				   wl_notify_func_t notify);
 int
+weston_output_read_pixels_async(struct weston_output *output,
+				pixman_format_code_t format, void *pixels,
+				uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height,
+				weston_read_pixels_done_func_t done,
+				void *data);
+int
 weston_compositor_set_xkb_rule_names(struct weston_compositor *ec,
 				     struct xkb_rule_names *names);
 
+struct xkb_keymap *
+weston_compositor_keymap_from_names(struct weston_compositor *ec,
+				    const struct xkb_rule_names *names);
+
 /* String literal of spaces, the same width as the timestamp. */
 #define STAMP_SPACE "               "
 
@@ -1843,8 +2399,30 @@ typedef void (*weston_screenshooter_done_func_t)(void *data,
 int
 weston_screenshooter_shoot(struct weston_output *output, struct weston_buffer *buffer,
 			   weston_screenshooter_done_func_t done, void *data);
+int
+weston_screenshooter_shoot_region(struct weston_output *output,
+				  struct weston_buffer *buffer,
+				  int32_t x, int32_t y,
+				  int32_t width, int32_t height,
+				  weston_screenshooter_done_func_t done,
+				  void *data);
+
+/** What a recorder writes */
+enum weston_recorder_format {
+	/** The wcap format, damaged rectangles encoded as deltas to the
+	 * previous frame, see wcap/README */
+	WESTON_RECORDER_FORMAT_WCAP,
+	/** Raw NV12 frames of the output size and nothing else, for piping
+	 * into an encoder */
+	WESTON_RECORDER_FORMAT_NV12,
+};
+
 struct weston_recorder *
 weston_recorder_start(struct weston_output *output, const char *filename);
+struct weston_recorder *
+weston_recorder_start_format(struct weston_output *output,
+			     const char *filename,
+			     enum weston_recorder_format format);
 void
 weston_recorder_stop(struct weston_recorder *recorder);
 
@@ -2011,6 +2589,32 @@ void
 weston_output_set_scale(struct weston_output *output,
 			int32_t scale);
 
+void
+weston_output_set_fractional_scale(struct weston_output *output,
+				   uint32_t scale);
+
+uint32_t
+weston_output_get_fractional_scale(struct weston_output *output);
+
+float
+weston_output_get_scale_factor(struct weston_output *output);
+
+int
+weston_output_set_color_transform(struct weston_output *output,
+				  const struct weston_color_transform *xform);
+
+void
+weston_output_set_dynamic_resolution(struct weston_output *output,
+				     float min_scale);
+
+void
+weston_output_get_render_size(struct weston_output *output,
+			      int32_t *width, int32_t *height);
+
+void
+weston_output_set_idle_refresh(struct weston_output *output,
+			       uint32_t timeout_ms);
+
 void
 weston_output_set_transform(struct weston_output *output,
 			    uint32_t transform);
@@ -2055,6 +2659,9 @@ weston_log_ctx_destroy(struct weston_log_context *log_ctx);
 int
 weston_compositor_enable_content_protection(struct weston_compositor *compositor);
 
+int
+weston_compositor_enable_screencopy(struct weston_compositor *compositor);
+
 void
 weston_timeline_refresh_subscription_objects(struct weston_compositor *wc,
 					     void *object);
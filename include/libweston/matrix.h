@@ -38,6 +38,13 @@ enum weston_matrix_transform_type {
 	WESTON_MATRIX_TRANSFORM_OTHER		= (1 << 3),
 };
 
+/** A 4x4 matrix in column-major order
+ *
+ * type is the set of weston_matrix_transform_type flags the matrix was
+ * built from, 0 for the identity. The matrix functions rely on it to pick
+ * faster special cases, so code filling in d directly must set type to
+ * match, WESTON_MATRIX_TRANSFORM_OTHER when in doubt.
+ */
 struct weston_matrix {
 	float d[16];
 	unsigned int type;
@@ -121,6 +121,9 @@ weston_log_subscribe(struct weston_log_context *log_ctx,
 struct weston_log_subscriber *
 weston_log_subscriber_create_log(FILE *dump_to);
 
+struct weston_log_subscriber *
+weston_log_subscriber_create_ring(FILE *dump_to, size_t size);
+
 struct weston_log_subscriber *
 weston_log_subscriber_create_flight_rec(size_t size);
 
@@ -109,6 +109,20 @@ struct weston_xwayland_api {
 	 */
 	void
 	(*xserver_exited)(struct weston_xwayland *xwayland, int exit_status);
+
+	/** Start the Xwayland server now.
+	 *
+	 * Instead of waiting for the first X client to connect, call the
+	 * \a spawn_func given to \a listen right away, so that the server and
+	 * the window manager are ready when the first X client comes. Does
+	 * nothing if the server is already running.
+	 *
+	 * \param xwayland The Xwayland context object.
+	 *
+	 * \return 0 on success, a negative number otherwise.
+	 */
+	int
+	(*start)(struct weston_xwayland *xwayland);
 };
 
 /** Retrieve the API object for the libweston Xwayland module.
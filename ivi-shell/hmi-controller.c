@@ -1979,7 +1979,6 @@ wet_module_init(struct weston_compositor *ec,
 		       int *argc, char *argv[])
 {
 	struct hmi_controller *hmi_ctrl = NULL;
-	struct wl_event_loop *loop = NULL;
 
 	/* ad hoc weston_compositor_add_destroy_listener_once() */
 	if (wl_signal_get(&ec->destroy_signal, hmi_controller_destroy))
@@ -1999,8 +1998,9 @@ wet_module_init(struct weston_compositor *ec,
 		return -1;
 	}
 
-	loop = wl_display_get_event_loop(ec->wl_display);
-	wl_event_loop_add_idle(loop, launch_hmi_client_process, hmi_ctrl);
+	/* Start the HMI client right away, so that it starts up while the
+	 * compositor is still being set up. */
+	launch_hmi_client_process(hmi_ctrl);
 
 	return 0;
 }
@@ -105,6 +105,7 @@ struct ivi_layout_layer_properties
 	int32_t dest_height;
 	enum wl_output_transform orientation;
 	bool visibility;
+	uint32_t plane_id;
 	int32_t transition_type;
 	uint32_t transition_duration;
 	double start_alpha;
@@ -591,6 +592,22 @@ struct ivi_layout_interface {
 	 */
 	int32_t (*screen_remove_layer)(struct weston_output *output,
 				       struct ivi_layout_layer *removelayer);
+
+	/**
+	 * \brief Pin the surfaces of an ivi_layer to a hardware plane
+	 *
+	 * The backend puts them on that plane ahead of its own choice, with
+	 * the layer opacity as plane alpha, unless a surface does not fit it.
+	 * The plane is named the way the backend does, the KMS plane object
+	 * ID for DRM. A plane_id of 0 removes the pin.
+	 *
+	 * The pin is applied by ivi_layout_commit_changes().
+	 *
+	 * \return IVI_SUCCEEDED if the method call was successful
+	 * \return IVI_FAILED if the method call was failed
+	 */
+	int32_t (*layer_set_plane)(struct ivi_layout_layer *ivilayer,
+				   uint32_t plane_id);
 };
 
 static inline const struct ivi_layout_interface *
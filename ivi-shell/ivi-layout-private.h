@@ -61,6 +61,8 @@ struct ivi_layout_surface {
 		struct ivi_layout_surface_properties prop;
 	} pending;
 
+	struct wl_list dirty_link;	/* ivi_layout::dirty_surface_list */
+
 	struct wl_list view_list;	/* ivi_layout_view::surf_link */
 };
 
@@ -86,6 +88,8 @@ struct ivi_layout_layer {
 		struct wl_list link;	/* ivi_layout_screen::order.layer_list */
 	} order;
 
+	struct wl_list dirty_link;	/* ivi_layout::dirty_layer_list */
+
 	int32_t ref_count;
 };
 
@@ -97,6 +101,15 @@ struct ivi_layout {
 	struct wl_list screen_list;	/* ivi_layout_screen::link */
 	struct wl_list view_list;	/* ivi_layout_view::link */
 
+	/* Lookup by id; surfaces without an id yet are not in the table. */
+	struct hash_table *surface_table;	/* id_surface -> ivi_layout_surface */
+	struct hash_table *layer_table;		/* id_layer -> ivi_layout_layer */
+
+	/* Objects with pending changes or notifications since the previous
+	 * commit; ivi_layout_commit_changes only visits these. */
+	struct wl_list dirty_surface_list; /* ivi_layout_surface::dirty_link */
+	struct wl_list dirty_layer_list;   /* ivi_layout_layer::dirty_link */
+
 	struct {
 		struct wl_signal created;
 		struct wl_signal removed;
@@ -120,8 +133,11 @@ struct ivi_layout *get_instance(void);
 struct ivi_layout_transition;
 
 struct ivi_layout_transition_set {
-	struct wl_event_source  *event_source;
+	struct weston_compositor *compositor;
 	struct wl_list          transition_list;
+	struct wl_list          output_list;	/* transition_output::link */
+	struct wl_listener      output_destroyed_listener;
+	struct wl_event_source  *finish_idle;
 };
 
 typedef void (*ivi_layout_transition_destroy_user_func)(void *user_data);
@@ -129,6 +145,9 @@ typedef void (*ivi_layout_transition_destroy_user_func)(void *user_data);
 struct ivi_layout_transition_set *
 ivi_layout_transition_set_create(struct weston_compositor *ec);
 
+void
+ivi_layout_transition_set_schedule(struct ivi_layout_transition_set *transitions);
+
 void
 ivi_layout_transition_move_resize_view(struct ivi_layout_surface *surface,
 				       int32_t dest_x, int32_t dest_y,
@@ -185,6 +204,8 @@ ivi_layout_surface_set_size(struct ivi_layout_surface *ivisurf,
 			    int32_t width, int32_t height);
 struct ivi_layout_surface *
 ivi_layout_get_surface_from_id(uint32_t id_surface);
+struct weston_output *
+ivi_layout_layer_get_output(struct ivi_layout_layer *ivilayer);
 int32_t
 ivi_layout_layer_set_opacity(struct ivi_layout_layer *ivilayer,
 			     wl_fixed_t opacity);
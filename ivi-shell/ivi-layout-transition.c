@@ -32,9 +32,12 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+#include <libweston/zalloc.h>
 #include "ivi-shell.h"
 #include "ivi-layout-export.h"
 #include "ivi-layout-private.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
 
 struct ivi_layout_transition;
 
@@ -67,6 +70,14 @@ struct transition_node {
 	struct wl_list link;
 };
 
+/* Runs the transitions shown on one output from its repaints. */
+struct transition_output {
+	struct weston_animation animation;
+	struct weston_output *output;
+	struct ivi_layout_transition_set *transitions;
+	struct wl_list link;	/* ivi_layout_transition_set::output_list */
+};
+
 static void layout_transition_destroy(struct ivi_layout_transition *transition);
 
 static struct ivi_layout_transition *
@@ -148,6 +159,9 @@ do_transition_frame(struct ivi_layout_transition *transition,
 {
 	if (0 == transition->time_start)
 		transition->time_start = timestamp;
+	else if ((int32_t)(timestamp - transition->time_start -
+			   transition->time_elapsed) < 0)
+		return;	/* already run for a later frame of another output */
 
 	tick_transition(transition, timestamp);
 	transition->frame_func(transition);
@@ -156,39 +170,218 @@ do_transition_frame(struct ivi_layout_transition *transition,
 		layout_transition_destroy(transition);
 }
 
-static int32_t
-layout_transition_frame(void *data)
+/*
+ * The outputs showing the surface or layer of a transition. Zero when it
+ * is on none, e.g. its layer is not on a screen yet.
+ */
+static uint32_t
+transition_output_mask(struct ivi_layout_transition *transition)
+{
+	struct ivi_layout *layout = get_instance();
+	struct ivi_layout_view *ivi_view;
+	struct weston_output *output;
+	uint32_t mask = 0;
+
+	wl_list_for_each(ivi_view, &layout->view_list, link) {
+		if (!ivi_view->on_layer)
+			continue;
+
+		if (!transition->is_transition_func(transition->private_data,
+						    ivi_view->ivisurf) &&
+		    !transition->is_transition_func(transition->private_data,
+						    ivi_view->on_layer))
+			continue;
+
+		output = ivi_layout_layer_get_output(ivi_view->on_layer);
+		if (output)
+			mask |= 1u << output->id;
+	}
+
+	return mask;
+}
+
+/* Without repaints the transitions would never advance, so they jump to
+ * their end state. Run from idle, outside of the commit that started
+ * them. */
+static void
+transition_set_finish(void *data)
 {
 	struct ivi_layout_transition_set *transitions = data;
-	uint32_t fps = 30;
-	struct timespec timestamp = {};
-	uint32_t msec = 0;
-	struct transition_node *node = NULL;
-	struct transition_node *next = NULL;
+	struct ivi_layout_transition *transition;
+	struct transition_node *node;
 
-	if (wl_list_empty(&transitions->transition_list)) {
-		wl_event_source_timer_update(transitions->event_source, 0);
-		return 1;
+	transitions->finish_idle = NULL;
+
+	while (!wl_list_empty(&transitions->transition_list)) {
+		node = wl_container_of(transitions->transition_list.next,
+				       node, link);
+		transition = node->transition;
+
+		if (transition->time_start == 0)
+			transition->time_start = 1;
+
+		do_transition_frame(transition, transition->time_start +
+					       transition->time_duration);
 	}
 
-	wl_event_source_timer_update(transitions->event_source, 1000 / fps);
+	ivi_layout_commit_changes();
+}
 
-	clock_gettime(CLOCK_MONOTONIC, &timestamp);/* FIXME */
-	msec = (1e+3 * timestamp.tv_sec + 1e-6 * timestamp.tv_nsec);
+static void
+transition_output_frame(struct weston_animation *animation,
+			struct weston_output *output,
+			const struct timespec *time)
+{
+	struct transition_output *tout =
+		container_of(animation, struct transition_output, animation);
+	struct ivi_layout_transition_set *transitions = tout->transitions;
+	uint32_t msec = timespec_to_msec(time);
+	struct transition_node *node, *next;
+	bool ticked = false;
+	uint32_t mask;
 
 	wl_list_for_each_safe(node, next, &transitions->transition_list, link) {
+		mask = transition_output_mask(node->transition);
+		if (mask && !(mask & (1u << output->id)))
+			continue;
+
 		do_transition_frame(node->transition, msec);
+		ticked = true;
 	}
 
-	ivi_layout_commit_changes();
-	return 1;
+	/* The dirty tracking of ivi-layout limits the commit to the
+	 * surfaces and layers the transitions changed. */
+	if (ticked)
+		ivi_layout_commit_changes();
+
+	ivi_layout_transition_set_schedule(transitions);
+}
+
+static struct transition_output *
+transition_output_get(struct ivi_layout_transition_set *transitions,
+		      struct weston_output *output)
+{
+	struct transition_output *tout;
+
+	wl_list_for_each(tout, &transitions->output_list, link)
+		if (tout->output == output)
+			return tout;
+
+	tout = zalloc(sizeof *tout);
+	if (!tout) {
+		weston_log("%s: memory allocation fails\n", __func__);
+		return NULL;
+	}
+
+	tout->animation.frame = transition_output_frame;
+	wl_list_init(&tout->animation.link);
+	tout->output = output;
+	tout->transitions = transitions;
+	wl_list_insert(&transitions->output_list, &tout->link);
+
+	return tout;
+}
+
+static void
+transition_output_destroy(struct transition_output *tout)
+{
+	wl_list_remove(&tout->animation.link);
+	wl_list_remove(&tout->link);
+	free(tout);
+}
+
+/*
+ * Hooks the transitions into the animation list of the outputs showing
+ * them, so they advance with the frame time of each repaint and other
+ * outputs are not woken up. Transitions not shown on any output yet are
+ * run by all outputs.
+ */
+void
+ivi_layout_transition_set_schedule(struct ivi_layout_transition_set *transitions)
+{
+	struct weston_compositor *ec = transitions->compositor;
+	struct transition_output *tout, *tmp;
+	struct transition_node *node;
+	struct weston_output *output;
+	struct wl_event_loop *loop;
+	bool anywhere = false;
+	uint32_t mask = 0;
+	uint32_t m;
+
+	if (wl_list_empty(&transitions->transition_list)) {
+		wl_list_for_each_safe(tout, tmp, &transitions->output_list, link)
+			transition_output_destroy(tout);
+		return;
+	}
+
+	if (ec->state == WESTON_COMPOSITOR_SLEEPING ||
+	    ec->state == WESTON_COMPOSITOR_OFFSCREEN ||
+	    wl_list_empty(&ec->output_list)) {
+		if (!transitions->finish_idle) {
+			loop = wl_display_get_event_loop(ec->wl_display);
+			transitions->finish_idle =
+				wl_event_loop_add_idle(loop,
+						       transition_set_finish,
+						       transitions);
+		}
+		return;
+	}
+
+	wl_list_for_each(node, &transitions->transition_list, link) {
+		m = transition_output_mask(node->transition);
+		if (m)
+			mask |= m;
+		else
+			anywhere = true;
+	}
+
+	wl_list_for_each(output, &ec->output_list, link) {
+		if (!anywhere && !(mask & (1u << output->id))) {
+			wl_list_for_each(tout, &transitions->output_list, link) {
+				if (tout->output != output)
+					continue;
+				wl_list_remove(&tout->animation.link);
+				wl_list_init(&tout->animation.link);
+				break;
+			}
+			continue;
+		}
+
+		tout = transition_output_get(transitions, output);
+		if (!tout)
+			continue;
+
+		if (wl_list_empty(&tout->animation.link)) {
+			tout->animation.frame_counter = 0;
+			wl_list_insert(&output->animation_list,
+				       &tout->animation.link);
+		}
+
+		weston_output_schedule_repaint(output);
+	}
+}
+
+static void
+transition_set_output_destroyed(struct wl_listener *listener, void *data)
+{
+	struct ivi_layout_transition_set *transitions =
+		container_of(listener, struct ivi_layout_transition_set,
+			     output_destroyed_listener);
+	struct weston_output *output = data;
+	struct transition_output *tout;
+
+	wl_list_for_each(tout, &transitions->output_list, link) {
+		if (tout->output == output) {
+			transition_output_destroy(tout);
+			break;
+		}
+	}
 }
 
 struct ivi_layout_transition_set *
 ivi_layout_transition_set_create(struct weston_compositor *ec)
 {
 	struct ivi_layout_transition_set *transitions;
-	struct wl_event_loop *loop;
 
 	transitions = malloc(sizeof(*transitions));
 	if (transitions == NULL) {
@@ -196,12 +389,15 @@ ivi_layout_transition_set_create(struct weston_compositor *ec)
 		return NULL;
 	}
 
+	transitions->compositor = ec;
+	transitions->finish_idle = NULL;
 	wl_list_init(&transitions->transition_list);
+	wl_list_init(&transitions->output_list);
 
-	loop = wl_display_get_event_loop(ec->wl_display);
-	transitions->event_source =
-		wl_event_loop_add_timer(loop, layout_transition_frame,
-					transitions);
+	transitions->output_destroyed_listener.notify =
+		transition_set_output_destroyed;
+	wl_signal_add(&ec->output_destroyed_signal,
+		      &transitions->output_destroyed_listener);
 
 	return transitions;
 }
@@ -49,7 +49,9 @@
  *    frame just before the cancellation.
  *
  * 4/ According properties, set transformation by using weston_matrix and
- *    weston_view per ivi_surfaces and ivi_layers in while loop.
+ *    weston_view per ivi_surfaces and ivi_layers in while loop. Only the
+ *    ivi_surfaces and ivi_layers changed since the previous commit, and
+ *    the views on them, are visited.
  * 5/ Set damage and trigger transform by using weston_view_geometry_dirty.
  * 6/ Schedule repaint for each view by using weston_view_schedule_repaint.
  * 7/ Notify update of properties.
@@ -68,6 +70,7 @@
 #include "ivi-layout-private.h"
 #include "ivi-layout-shell.h"
 
+#include "shared/hash.h"
 #include "shared/helpers.h"
 #include "shared/os-compatibility.h"
 
@@ -111,31 +114,34 @@ get_instance(void)
  * Internal API to add/remove an ivi_layer to/from ivi_screen.
  */
 static struct ivi_layout_surface *
-get_surface(struct wl_list *surf_list, uint32_t id_surface)
+get_surface(struct ivi_layout *layout, uint32_t id_surface)
 {
-	struct ivi_layout_surface *ivisurf;
-
-	wl_list_for_each(ivisurf, surf_list, link) {
-		if (ivisurf->id_surface == id_surface) {
-			return ivisurf;
-		}
-	}
+	if (id_surface == IVI_INVALID_ID)
+		return NULL;
 
-	return NULL;
+	return hash_table_lookup(layout->surface_table, id_surface);
 }
 
 static struct ivi_layout_layer *
-get_layer(struct wl_list *layer_list, uint32_t id_layer)
+get_layer(struct ivi_layout *layout, uint32_t id_layer)
 {
-	struct ivi_layout_layer *ivilayer;
+	return hash_table_lookup(layout->layer_table, id_layer);
+}
 
-	wl_list_for_each(ivilayer, layer_list, link) {
-		if (ivilayer->id_layer == id_layer) {
-			return ivilayer;
-		}
-	}
+static void
+surface_mark_dirty(struct ivi_layout_surface *ivisurf)
+{
+	if (wl_list_empty(&ivisurf->dirty_link))
+		wl_list_insert(ivisurf->layout->dirty_surface_list.prev,
+			       &ivisurf->dirty_link);
+}
 
-	return NULL;
+static void
+layer_mark_dirty(struct ivi_layout_layer *ivilayer)
+{
+	if (wl_list_empty(&ivilayer->dirty_link))
+		wl_list_insert(ivilayer->layout->dirty_layer_list.prev,
+			       &ivilayer->dirty_link);
 }
 
 static bool
@@ -246,6 +252,9 @@ ivi_layout_surface_destroy(struct ivi_layout_surface *ivisurf)
 	}
 
 	wl_list_remove(&ivisurf->link);
+	wl_list_remove(&ivisurf->dirty_link);
+	if (ivisurf->id_surface != IVI_INVALID_ID)
+		hash_table_remove(layout->surface_table, ivisurf->id_surface);
 
 	wl_list_for_each_safe(ivi_view, next, &ivisurf->view_list, surf_link) {
 		ivi_view_destroy(ivi_view);
@@ -607,20 +616,42 @@ ivi_view_is_mapped(struct ivi_layout_view *ivi_view)
 		ivi_view->ivisurf->prop.visibility);
 }
 
+/*
+ * Only views of changed layers and surfaces need their transformation
+ * recomputed. A view whose layer and surface both changed is updated once,
+ * through its layer.
+ */
 static void
 commit_changes(struct ivi_layout *layout)
 {
-	struct ivi_layout_view *ivi_view  = NULL;
+	struct ivi_layout_layer *ivilayer;
+	struct ivi_layout_surface *ivisurf;
+	struct ivi_layout_view *ivi_view;
 
-	wl_list_for_each(ivi_view, &layout->view_list, link) {
-		/*
-		 * If the view is not on the currently rendered scenegraph,
-		 * we do not need to update its properties.
-		 */
-		if (!ivi_view_is_mapped(ivi_view))
-			continue;
+	wl_list_for_each(ivilayer, &layout->dirty_layer_list, dirty_link) {
+		wl_list_for_each(ivi_view, &ivilayer->order.view_list,
+				 order_link) {
+			/*
+			 * If the view is not on the currently rendered
+			 * scenegraph, we do not need to update its properties.
+			 */
+			if (!ivi_view_is_mapped(ivi_view))
+				continue;
+
+			update_prop(ivi_view);
+		}
+	}
+
+	wl_list_for_each(ivisurf, &layout->dirty_surface_list, dirty_link) {
+		wl_list_for_each(ivi_view, &ivisurf->view_list, surf_link) {
+			if (!wl_list_empty(&ivi_view->on_layer->dirty_link))
+				continue;
 
-		update_prop(ivi_view);
+			if (!ivi_view_is_mapped(ivi_view))
+				continue;
+
+			update_prop(ivi_view);
+		}
 	}
 }
 
@@ -634,7 +665,7 @@ commit_surface_list(struct ivi_layout *layout)
 	int32_t dest_height = 0;
 	int32_t configured = 0;
 
-	wl_list_for_each(ivisurf, &layout->surface_list, link) {
+	wl_list_for_each(ivisurf, &layout->dirty_surface_list, dirty_link) {
 		if (ivisurf->pending.prop.transition_type == IVI_LAYOUT_TRANSITION_VIEW_DEFAULT) {
 			dest_x = ivisurf->prop.dest_x;
 			dest_y = ivisurf->prop.dest_y;
@@ -733,7 +764,7 @@ commit_layer_list(struct ivi_layout *layout)
 	struct ivi_layout_layer   *ivilayer = NULL;
 	struct ivi_layout_view *next     = NULL;
 
-	wl_list_for_each(ivilayer, &layout->layer_list, link) {
+	wl_list_for_each(ivilayer, &layout->dirty_layer_list, dirty_link) {
 		if (ivilayer->pending.prop.transition_type == IVI_LAYOUT_TRANSITION_LAYER_MOVE) {
 			ivi_layout_transition_move_layer(ivilayer, ivilayer->pending.prop.dest_x, ivilayer->pending.prop.dest_y, ivilayer->pending.prop.transition_duration);
 		} else if (ivilayer->pending.prop.transition_type == IVI_LAYOUT_TRANSITION_LAYER_FADE) {
@@ -755,6 +786,7 @@ commit_layer_list(struct ivi_layout *layout)
 			wl_list_remove(&ivi_view->order_link);
 			wl_list_init(&ivi_view->order_link);
 			ivi_view->ivisurf->prop.event_mask |= IVI_NOTIFICATION_REMOVE;
+			surface_mark_dirty(ivi_view->ivisurf);
 		}
 
 		assert(wl_list_empty(&ivilayer->order.view_list));
@@ -764,6 +796,7 @@ commit_layer_list(struct ivi_layout *layout)
 			wl_list_remove(&ivi_view->order_link);
 			wl_list_insert(&ivilayer->order.view_list, &ivi_view->order_link);
 			ivi_view->ivisurf->prop.event_mask |= IVI_NOTIFICATION_ADD;
+			surface_mark_dirty(ivi_view->ivisurf);
 		}
 
 		ivilayer->order.dirty = 0;
@@ -785,6 +818,7 @@ commit_screen_list(struct ivi_layout *layout)
 				wl_list_remove(&ivilayer->order.link);
 				wl_list_init(&ivilayer->order.link);
 				ivilayer->prop.event_mask |= IVI_NOTIFICATION_REMOVE;
+				layer_mark_dirty(ivilayer);
 			}
 
 			assert(wl_list_empty(&iviscrn->order.layer_list));
@@ -798,6 +832,7 @@ commit_screen_list(struct ivi_layout *layout)
 					       &ivilayer->order.link);
 				ivilayer->on_screen = iviscrn;
 				ivilayer->prop.event_mask |= IVI_NOTIFICATION_ADD;
+				layer_mark_dirty(ivilayer);
 			}
 
 			iviscrn->order.dirty = 0;
@@ -834,6 +869,8 @@ build_view_list(struct ivi_layout *layout)
 
 				weston_layer_entry_insert(&layout->layout_layer.view_list,
 							  &ivi_view->view->layer_link);
+				ivi_view->view->pinned_plane =
+					ivilayer->prop.plane_id;
 
 				ivi_view->ivisurf->surface->is_mapped = true;
 				ivi_view->view->is_mapped = true;
@@ -854,7 +891,7 @@ commit_transition(struct ivi_layout* layout)
 
 	wl_list_init(&layout->pending_transition_list);
 
-	wl_event_source_timer_update(layout->transitions->event_source, 1);
+	ivi_layout_transition_set_schedule(layout->transitions);
 }
 
 static void
@@ -862,6 +899,7 @@ send_surface_prop(struct ivi_layout_surface *ivisurf)
 {
 	wl_signal_emit(&ivisurf->property_changed, ivisurf);
 	ivisurf->pending.prop.event_mask = 0;
+	ivisurf->prop.event_mask = 0;
 }
 
 static void
@@ -869,20 +907,35 @@ send_layer_prop(struct ivi_layout_layer *ivilayer)
 {
 	wl_signal_emit(&ivilayer->property_changed, ivilayer);
 	ivilayer->pending.prop.event_mask = 0;
+	ivilayer->prop.event_mask = 0;
 }
 
+/*
+ * Empties the dirty lists. Each object is unlinked before its listeners
+ * run, so changes they make are picked up by the next commit.
+ */
 static void
 send_prop(struct ivi_layout *layout)
 {
 	struct ivi_layout_layer   *ivilayer = NULL;
 	struct ivi_layout_surface *ivisurf  = NULL;
 
-	wl_list_for_each_reverse(ivilayer, &layout->layer_list, link) {
+	while (!wl_list_empty(&layout->dirty_layer_list)) {
+		ivilayer = wl_container_of(layout->dirty_layer_list.next,
+					   ivilayer, dirty_link);
+		wl_list_remove(&ivilayer->dirty_link);
+		wl_list_init(&ivilayer->dirty_link);
+
 		if (ivilayer->prop.event_mask)
 			send_layer_prop(ivilayer);
 	}
 
-	wl_list_for_each_reverse(ivisurf, &layout->surface_list, link) {
+	while (!wl_list_empty(&layout->dirty_surface_list)) {
+		ivisurf = wl_container_of(layout->dirty_surface_list.next,
+					  ivisurf, dirty_link);
+		wl_list_remove(&ivisurf->dirty_link);
+		wl_list_init(&ivisurf->dirty_link);
+
 		if (ivisurf->prop.event_mask)
 			send_surface_prop(ivisurf);
 	}
@@ -1007,34 +1060,29 @@ ivi_layout_get_id_of_layer(struct ivi_layout_layer *ivilayer)
 	return ivilayer->id_layer;
 }
 
+struct weston_output *
+ivi_layout_layer_get_output(struct ivi_layout_layer *ivilayer)
+{
+	if (!ivilayer->on_screen)
+		return NULL;
+
+	return ivilayer->on_screen->output;
+}
+
 static struct ivi_layout_layer *
 ivi_layout_get_layer_from_id(uint32_t id_layer)
 {
 	struct ivi_layout *layout = get_instance();
-	struct ivi_layout_layer *ivilayer = NULL;
-
-	wl_list_for_each(ivilayer, &layout->layer_list, link) {
-		if (ivilayer->id_layer == id_layer) {
-			return ivilayer;
-		}
-	}
 
-	return NULL;
+	return get_layer(layout, id_layer);
 }
 
 struct ivi_layout_surface *
 ivi_layout_get_surface_from_id(uint32_t id_surface)
 {
 	struct ivi_layout *layout = get_instance();
-	struct ivi_layout_surface *ivisurf = NULL;
 
-	wl_list_for_each(ivisurf, &layout->surface_list, link) {
-		if (ivisurf->id_surface == id_surface) {
-			return ivisurf;
-		}
-	}
-
-	return NULL;
+	return get_surface(layout, id_surface);
 }
 
 static int32_t
@@ -1279,7 +1327,7 @@ ivi_layout_layer_create_with_dimension(uint32_t id_layer,
 	struct ivi_layout *layout = get_instance();
 	struct ivi_layout_layer *ivilayer = NULL;
 
-	ivilayer = get_layer(&layout->layer_list, id_layer);
+	ivilayer = get_layer(layout, id_layer);
 	if (ivilayer != NULL) {
 		weston_log("id_layer is already created\n");
 		++ivilayer->ref_count;
@@ -1292,6 +1340,12 @@ ivi_layout_layer_create_with_dimension(uint32_t id_layer,
 		return NULL;
 	}
 
+	if (hash_table_insert(layout->layer_table, id_layer, ivilayer) < 0) {
+		weston_log("fails to allocate memory\n");
+		free(ivilayer);
+		return NULL;
+	}
+
 	ivilayer->ref_count = 1;
 	wl_signal_init(&ivilayer->property_changed);
 	ivilayer->layout = layout;
@@ -1305,6 +1359,7 @@ ivi_layout_layer_create_with_dimension(uint32_t id_layer,
 
 	wl_list_init(&ivilayer->order.view_list);
 	wl_list_init(&ivilayer->order.link);
+	wl_list_init(&ivilayer->dirty_link);
 
 	wl_list_insert(&layout->layer_list, &ivilayer->link);
 
@@ -1337,7 +1392,9 @@ ivi_layout_layer_destroy(struct ivi_layout_layer *ivilayer)
 
 	wl_list_remove(&ivilayer->pending.link);
 	wl_list_remove(&ivilayer->order.link);
+	wl_list_remove(&ivilayer->dirty_link);
 	wl_list_remove(&ivilayer->link);
+	hash_table_remove(layout->layer_table, ivilayer->id_layer);
 
 	free(ivilayer);
 }
@@ -1361,6 +1418,8 @@ ivi_layout_layer_set_visibility(struct ivi_layout_layer *ivilayer,
 	else
 		prop->event_mask &= ~IVI_NOTIFICATION_VISIBILITY;
 
+	layer_mark_dirty(ivilayer);
+
 	return IVI_SUCCEEDED;
 }
 
@@ -1385,6 +1444,23 @@ ivi_layout_layer_set_opacity(struct ivi_layout_layer *ivilayer,
 	else
 		prop->event_mask &= ~IVI_NOTIFICATION_OPACITY;
 
+	layer_mark_dirty(ivilayer);
+
+	return IVI_SUCCEEDED;
+}
+
+static int32_t
+ivi_layout_layer_set_plane(struct ivi_layout_layer *ivilayer,
+			   uint32_t plane_id)
+{
+	if (ivilayer == NULL) {
+		weston_log("ivi_layout_layer_set_plane: invalid argument\n");
+		return IVI_FAILED;
+	}
+
+	ivilayer->pending.prop.plane_id = plane_id;
+	layer_mark_dirty(ivilayer);
+
 	return IVI_SUCCEEDED;
 }
 
@@ -1413,6 +1489,8 @@ ivi_layout_layer_set_source_rectangle(struct ivi_layout_layer *ivilayer,
 	else
 		prop->event_mask &= ~IVI_NOTIFICATION_SOURCE_RECT;
 
+	layer_mark_dirty(ivilayer);
+
 	return IVI_SUCCEEDED;
 }
 
@@ -1441,6 +1519,8 @@ ivi_layout_layer_set_destination_rectangle(struct ivi_layout_layer *ivilayer,
 	else
 		prop->event_mask &= ~IVI_NOTIFICATION_DEST_RECT;
 
+	layer_mark_dirty(ivilayer);
+
 	return IVI_SUCCEEDED;
 }
 
@@ -1471,6 +1551,7 @@ ivi_layout_layer_set_render_order(struct ivi_layout_layer *ivilayer,
 	}
 
 	ivilayer->order.dirty = 1;
+	layer_mark_dirty(ivilayer);
 
 	return IVI_SUCCEEDED;
 }
@@ -1494,6 +1575,8 @@ ivi_layout_surface_set_visibility(struct ivi_layout_surface *ivisurf,
 	else
 		prop->event_mask &= ~IVI_NOTIFICATION_VISIBILITY;
 
+	surface_mark_dirty(ivisurf);
+
 	return IVI_SUCCEEDED;
 }
 
@@ -1518,6 +1601,8 @@ ivi_layout_surface_set_opacity(struct ivi_layout_surface *ivisurf,
 	else
 		prop->event_mask &= ~IVI_NOTIFICATION_OPACITY;
 
+	surface_mark_dirty(ivisurf);
+
 	return IVI_SUCCEEDED;
 }
 
@@ -1550,6 +1635,8 @@ ivi_layout_surface_set_destination_rectangle(struct ivi_layout_surface *ivisurf,
 	else
 		prop->event_mask &= ~IVI_NOTIFICATION_DEST_RECT;
 
+	surface_mark_dirty(ivisurf);
+
 	return IVI_SUCCEEDED;
 }
 
@@ -1732,6 +1819,7 @@ ivi_layout_layer_add_surface(struct ivi_layout_layer *ivilayer,
 	wl_list_insert(&ivilayer->pending.view_list, &ivi_view->pending_link);
 
 	ivilayer->order.dirty = 1;
+	layer_mark_dirty(ivilayer);
 
 	return IVI_SUCCEEDED;
 }
@@ -1753,6 +1841,7 @@ ivi_layout_layer_remove_surface(struct ivi_layout_layer *ivilayer,
 		wl_list_init(&ivi_view->pending_link);
 
 		ivilayer->order.dirty = 1;
+		layer_mark_dirty(ivilayer);
 	}
 }
 
@@ -1781,6 +1870,8 @@ ivi_layout_surface_set_source_rectangle(struct ivi_layout_surface *ivisurf,
 	else
 		prop->event_mask &= ~IVI_NOTIFICATION_SOURCE_RECT;
 
+	surface_mark_dirty(ivisurf);
+
 	return IVI_SUCCEEDED;
 }
 
@@ -1789,6 +1880,8 @@ ivi_layout_commit_changes(void)
 {
 	struct ivi_layout *layout = get_instance();
 
+	weston_compositor_begin_changes(layout->compositor);
+
 	commit_surface_list(layout);
 	commit_layer_list(layout);
 	commit_screen_list(layout);
@@ -1799,6 +1892,8 @@ ivi_layout_commit_changes(void)
 	commit_changes(layout);
 	send_prop(layout);
 
+	weston_compositor_commit_changes(layout->compositor);
+
 	return IVI_SUCCEEDED;
 }
 
@@ -1814,6 +1909,7 @@ ivi_layout_layer_set_transition(struct ivi_layout_layer *ivilayer,
 
 	ivilayer->pending.prop.transition_type = type;
 	ivilayer->pending.prop.transition_duration = duration;
+	layer_mark_dirty(ivilayer);
 
 	return 0;
 }
@@ -1831,6 +1927,7 @@ ivi_layout_layer_set_fade_info(struct ivi_layout_layer* ivilayer,
 	ivilayer->pending.prop.is_fade_in = is_fade_in;
 	ivilayer->pending.prop.start_alpha = start_alpha;
 	ivilayer->pending.prop.end_alpha = end_alpha;
+	layer_mark_dirty(ivilayer);
 
 	return 0;
 }
@@ -1848,6 +1945,7 @@ ivi_layout_surface_set_transition_duration(struct ivi_layout_surface *ivisurf,
 
 	prop = &ivisurf->pending.prop;
 	prop->transition_duration = duration*10;
+	surface_mark_dirty(ivisurf);
 	return 0;
 }
 
@@ -1874,12 +1972,22 @@ ivi_layout_surface_set_id(struct ivi_layout_surface *ivisurf,
 		return IVI_FAILED;
 	}
 
-	search_ivisurf = get_surface(&layout->surface_list, id_surface);
+	if (id_surface == IVI_INVALID_ID) {
+		weston_log("%s: invalid surface id\n", __func__);
+		return IVI_FAILED;
+	}
+
+	search_ivisurf = get_surface(layout, id_surface);
 	if (search_ivisurf) {
 		weston_log("id_surface(%d) is already created\n", id_surface);
 		return IVI_FAILED;
 	}
 
+	if (hash_table_insert(layout->surface_table, id_surface, ivisurf) < 0) {
+		weston_log("fails to allocate memory\n");
+		return IVI_FAILED;
+	}
+
 	ivisurf->id_surface = id_surface;
 
 	wl_signal_emit(&layout->surface_notification.created, ivisurf);
@@ -1904,6 +2012,7 @@ ivi_layout_surface_set_transition(struct ivi_layout_surface *ivisurf,
 	prop = &ivisurf->pending.prop;
 	prop->transition_type = type;
 	prop->transition_duration = duration;
+	surface_mark_dirty(ivisurf);
 	return 0;
 }
 
@@ -1947,6 +2056,13 @@ surface_create(struct weston_surface *wl_surface, uint32_t id_surface)
 		return NULL;
 	}
 
+	if (id_surface != IVI_INVALID_ID &&
+	    hash_table_insert(layout->surface_table, id_surface, ivisurf) < 0) {
+		weston_log("fails to allocate memory\n");
+		free(ivisurf);
+		return NULL;
+	}
+
 	wl_signal_init(&ivisurf->property_changed);
 	ivisurf->id_surface = id_surface;
 	ivisurf->layout = layout;
@@ -1961,6 +2077,7 @@ surface_create(struct weston_surface *wl_surface, uint32_t id_surface)
 	ivisurf->pending.prop = ivisurf->prop;
 
 	wl_list_init(&ivisurf->view_list);
+	wl_list_init(&ivisurf->dirty_link);
 
 	wl_list_insert(&layout->surface_list, &ivisurf->link);
 
@@ -2002,7 +2119,7 @@ ivi_layout_surface_create(struct weston_surface *wl_surface,
 	struct ivi_layout *layout = get_instance();
 	struct ivi_layout_surface *ivisurf = NULL;
 
-	ivisurf = get_surface(&layout->surface_list, id_surface);
+	ivisurf = get_surface(layout, id_surface);
 	if (ivisurf) {
 		weston_log("id_surface(%d) is already created\n", id_surface);
 		return NULL;
@@ -2018,17 +2135,26 @@ ivi_layout_surface_create(struct weston_surface *wl_surface,
 
 static struct ivi_layout_interface ivi_layout_interface;
 
-void
+int
 ivi_layout_init_with_compositor(struct weston_compositor *ec)
 {
 	struct ivi_layout *layout = get_instance();
 
+	layout->surface_table = hash_table_create();
+	layout->layer_table = hash_table_create();
+	if (!layout->surface_table || !layout->layer_table) {
+		weston_log("fails to allocate memory\n");
+		goto err_table;
+	}
+
 	layout->compositor = ec;
 
 	wl_list_init(&layout->surface_list);
 	wl_list_init(&layout->layer_list);
 	wl_list_init(&layout->screen_list);
 	wl_list_init(&layout->view_list);
+	wl_list_init(&layout->dirty_surface_list);
+	wl_list_init(&layout->dirty_layer_list);
 
 	wl_signal_init(&layout->layer_notification.created);
 	wl_signal_init(&layout->layer_notification.removed);
@@ -2051,6 +2177,16 @@ ivi_layout_init_with_compositor(struct weston_compositor *ec)
 	weston_plugin_api_register(ec, IVI_LAYOUT_API_NAME,
 				   &ivi_layout_interface,
 				   sizeof(struct ivi_layout_interface));
+
+	return 0;
+
+err_table:
+	hash_table_destroy(layout->surface_table);
+	hash_table_destroy(layout->layer_table);
+	layout->surface_table = NULL;
+	layout->layer_table = NULL;
+
+	return -1;
 }
 
 static struct ivi_layout_interface ivi_layout_interface = {
@@ -2104,6 +2240,7 @@ static struct ivi_layout_interface ivi_layout_interface = {
 	.layer_set_render_order			= ivi_layout_layer_set_render_order,
 	.layer_add_listener			= ivi_layout_layer_add_listener,
 	.layer_set_transition			= ivi_layout_layer_set_transition,
+	.layer_set_plane			= ivi_layout_layer_set_plane,
 
 	/**
 	 * screen controller interfaces
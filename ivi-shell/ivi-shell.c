@@ -345,6 +345,8 @@ shell_destroy(struct wl_listener *listener, void *data)
 
 	wl_list_remove(&shell->destroy_listener.link);
 	wl_list_remove(&shell->wake_listener.link);
+	wl_list_remove(&shell->layer_create_listener.link);
+	wl_array_release(&shell->layer_planes);
 
 	wl_list_for_each_safe(ivisurf, next, &shell->ivi_surface_list, link) {
 		wl_list_remove(&ivisurf->link);
@@ -374,6 +376,62 @@ terminate_binding(struct weston_keyboard *keyboard, const struct timespec *time,
 	weston_compositor_exit(compositor);
 }
 
+struct ivi_layer_plane {
+	uint32_t id_layer;
+	uint32_t plane_id;
+};
+
+static void
+read_layer_planes(struct weston_config *config, struct ivi_shell *shell)
+{
+	struct weston_config_section *section = NULL;
+	struct ivi_layer_plane *pin;
+	const char *name;
+	uint32_t id_layer, plane_id;
+
+	while (weston_config_next_section(config, &section, &name)) {
+		if (strcmp(name, "ivi-layer-plane") != 0)
+			continue;
+
+		if (weston_config_section_get_uint(section, "id-layer",
+						   &id_layer, 0) < 0 ||
+		    weston_config_section_get_uint(section, "plane",
+						   &plane_id, 0) < 0 ||
+		    plane_id == 0) {
+			weston_log("ivi-shell: [ivi-layer-plane] needs "
+				   "id-layer and plane\n");
+			continue;
+		}
+
+		pin = wl_array_add(&shell->layer_planes, sizeof *pin);
+		if (!pin)
+			return;
+		pin->id_layer = id_layer;
+		pin->plane_id = plane_id;
+	}
+}
+
+/* Pin the layers named by [ivi-layer-plane] once the HMI creates them. */
+static void
+layer_created(struct wl_listener *listener, void *data)
+{
+	struct ivi_shell *shell =
+		container_of(listener, struct ivi_shell, layer_create_listener);
+	struct ivi_layout_layer *ivilayer = data;
+	const struct ivi_layout_interface *api =
+		ivi_layout_get_api(shell->compositor);
+	struct ivi_layer_plane *pin;
+
+	wl_array_for_each(pin, &shell->layer_planes) {
+		if (pin->id_layer != ivilayer->id_layer)
+			continue;
+
+		weston_log("ivi-shell: layer %u pinned to plane %u\n",
+			   pin->id_layer, pin->plane_id);
+		api->layer_set_plane(ivilayer, pin->plane_id);
+	}
+}
+
 static void
 init_ivi_shell(struct weston_compositor *compositor, struct ivi_shell *shell)
 {
@@ -384,6 +442,10 @@ init_ivi_shell(struct weston_compositor *compositor, struct ivi_shell *shell)
 	shell->compositor = compositor;
 
 	wl_list_init(&shell->ivi_surface_list);
+	wl_array_init(&shell->layer_planes);
+	wl_list_init(&shell->layer_create_listener.link);
+
+	read_layer_planes(config, shell);
 
 	section = weston_config_get_section(config, "ivi-shell", NULL, NULL);
 
@@ -639,12 +701,20 @@ wet_shell_init(struct weston_compositor *compositor,
 	if (!shell->desktop)
 		goto err_shell;
 
+	if (ivi_layout_init_with_compositor(compositor) < 0)
+		goto err_desktop;
+
+	if (shell->layer_planes.size > 0) {
+		shell->layer_create_listener.notify = layer_created;
+		ivi_layout_get_api(compositor)->add_listener_create_layer(
+			&shell->layer_create_listener);
+	}
+
 	if (wl_global_create(compositor->wl_display,
 			     &ivi_application_interface, 1,
 			     shell, bind_ivi_application) == NULL)
 		goto err_desktop;
 
-	ivi_layout_init_with_compositor(compositor);
 	shell_add_bindings(compositor, shell);
 
 	return IVI_SUCCEEDED;
@@ -654,6 +724,7 @@ err_desktop:
 
 err_shell:
 	wl_list_remove(&shell->destroy_listener.link);
+	wl_array_release(&shell->layer_planes);
 	free(shell);
 
 	return IVI_FAILED;
@@ -41,6 +41,10 @@ struct ivi_shell
 
 	struct weston_desktop *desktop;
 	struct wl_list ivi_surface_list; /* struct ivi_shell_surface::link */
+
+	/* [ivi-layer-plane] sections, applied to layers as they appear */
+	struct wl_array layer_planes; /* struct ivi_layer_plane */
+	struct wl_listener layer_create_listener;
 };
 
 void
@@ -445,6 +445,55 @@ kiosk_shell_output_recreate_background(struct kiosk_shell_output *shoutput)
 	weston_view_set_output(shoutput->background_view, output);
 }
 
+/* Keep the background out of the scene graph while an opaque app covers
+ * the whole output. It could not be seen anyway, and without it the app
+ * is the only view on the output, which is what scanning it out directly
+ * instead of compositing it needs. */
+static void
+kiosk_shell_output_update_background(struct kiosk_shell_output *shoutput)
+{
+	struct kiosk_shell *shell = shoutput->shell;
+	struct weston_output *output = shoutput->output;
+	struct weston_view *background = shoutput->background_view;
+	struct weston_view *view;
+	bool covered = false;
+
+	if (!output || !background)
+		return;
+
+	wl_list_for_each(view, &shell->normal_layer.view_list.link,
+			 layer_link.link) {
+		if (view->output != output || !view->is_mapped)
+			continue;
+
+		weston_view_update_transform(view);
+		if (pixman_region32_contains_rectangle(&view->transform.opaque,
+						       &output->region.extents) ==
+		    PIXMAN_REGION_IN) {
+			covered = true;
+			break;
+		}
+	}
+
+	if (covered && background->layer_link.layer) {
+		weston_layer_entry_remove(&background->layer_link);
+	} else if (!covered && !background->layer_link.layer) {
+		weston_layer_entry_insert(&shell->background_layer.view_list,
+					  &background->layer_link);
+		weston_view_geometry_dirty(background);
+		weston_surface_damage(background->surface);
+	}
+}
+
+static void
+kiosk_shell_update_backgrounds(struct kiosk_shell *shell)
+{
+	struct kiosk_shell_output *shoutput;
+
+	wl_list_for_each(shoutput, &shell->output_list, link)
+		kiosk_shell_output_update_background(shoutput);
+}
+
 static void
 kiosk_shell_output_destroy(struct kiosk_shell_output *shoutput)
 {
@@ -619,6 +668,7 @@ desktop_surface_removed(struct weston_desktop_surface *desktop_surface,
 	}
 
 	kiosk_shell_surface_destroy(shsurf);
+	kiosk_shell_update_backgrounds(shell);
 }
 
 static void
@@ -683,6 +733,8 @@ desktop_surface_committed(struct weston_desktop_surface *desktop_surface,
 
 	shsurf->last_width = surface->width;
 	shsurf->last_height = surface->height;
+
+	kiosk_shell_update_backgrounds(shsurf->shell);
 }
 
 static void
@@ -941,6 +993,8 @@ kiosk_shell_handle_output_resized(struct wl_listener *listener, void *data)
 		kiosk_shell_find_shell_output(shell, output);
 	struct weston_view *view;
 
+	weston_compositor_begin_changes(shell->compositor);
+
 	kiosk_shell_output_recreate_background(shoutput);
 
 	wl_list_for_each(view, &shell->normal_layer.view_list.link,
@@ -953,6 +1007,12 @@ kiosk_shell_handle_output_resized(struct wl_listener *listener, void *data)
 			continue;
 		kiosk_shell_surface_reconfigure_for_output(shsurf);
 	}
+
+	/* The apps only cover the output again once they have redrawn at
+	 * the new size. */
+	kiosk_shell_output_update_background(shoutput);
+
+	weston_compositor_commit_changes(shell->compositor);
 }
 
 static void
@@ -961,12 +1021,15 @@ kiosk_shell_handle_output_moved(struct wl_listener *listener, void *data)
 	struct kiosk_shell *shell =
 		container_of(listener, struct kiosk_shell, output_moved_listener);
 	struct weston_output *output = data;
+	struct kiosk_shell_output *shoutput =
+		kiosk_shell_find_shell_output(shell, output);
 	struct weston_view *view;
 
-	wl_list_for_each(view, &shell->background_layer.view_list.link,
-			 layer_link.link) {
-		if (view->output != output)
-			continue;
+	weston_compositor_begin_changes(shell->compositor);
+
+	/* The background may be out of its layer, under an app. */
+	if (shoutput && shoutput->background_view) {
+		view = shoutput->background_view;
 		weston_view_set_position(view,
 					 view->geometry.x + output->move_x,
 					 view->geometry.y + output->move_y);
@@ -980,6 +1043,8 @@ kiosk_shell_handle_output_moved(struct wl_listener *listener, void *data)
 					 view->geometry.x + output->move_x,
 					 view->geometry.y + output->move_y);
 	}
+
+	weston_compositor_commit_changes(shell->compositor);
 }
 
 static void
@@ -204,6 +204,15 @@ weston_desktop_seat_popup_grab_touch_motion(struct weston_touch_grab *grab,
 	weston_touch_send_motion(grab->touch, time, touch_id, sx, sy);
 }
 
+static void
+weston_desktop_seat_popup_grab_touch_motion_frame(struct weston_touch_grab *grab,
+						  const struct timespec *time,
+						  const struct weston_touch_motion *motions,
+						  int count)
+{
+	weston_touch_send_motion_frame(grab->touch, time, motions, count);
+}
+
 static void
 weston_desktop_seat_popup_grab_touch_frame(struct weston_touch_grab *grab)
 {
@@ -225,6 +234,7 @@ static const struct weston_touch_grab_interface weston_desktop_seat_touch_popup_
    .motion = weston_desktop_seat_popup_grab_touch_motion,
    .frame = weston_desktop_seat_popup_grab_touch_frame,
    .cancel = weston_desktop_seat_popup_grab_touch_cancel,
+   .motion_frame = weston_desktop_seat_popup_grab_touch_motion_frame,
 };
 
 static void
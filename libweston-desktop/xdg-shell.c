@@ -76,6 +76,10 @@ struct weston_desktop_xdg_surface {
 	bool configured;
 	struct wl_event_source *configure_idle;
 	struct wl_list configure_list; /* weston_desktop_xdg_surface_configure::link */
+	/* An ack_configure was received and not committed yet */
+	bool configure_acked;
+	/* A size change waits for the outstanding configure */
+	bool configure_deferred;
 
 	bool has_next_geometry;
 	struct weston_geometry next_geometry;
@@ -941,6 +945,7 @@ weston_desktop_xdg_surface_send_configure(void *user_data)
 	struct weston_desktop_xdg_surface_configure *configure;
 
 	surface->configure_idle = NULL;
+	surface->configure_deferred = false;
 
 	configure = zalloc(weston_desktop_surface_configure_biggest_size);
 	if (configure == NULL) {
@@ -971,6 +976,36 @@ weston_desktop_xdg_surface_send_configure(void *user_data)
 	xdg_surface_send_configure(surface->resource, configure->serial);
 }
 
+static void
+weston_desktop_xdg_toplevel_get_configured(struct weston_desktop_xdg_toplevel *toplevel,
+					   struct weston_desktop_xdg_toplevel_state *state,
+					   struct weston_size *size)
+{
+	if (wl_list_empty(&toplevel->base.configure_list)) {
+		/* Last configure is actually the current state, just use it */
+		*state = toplevel->current.state;
+		size->width = toplevel->base.surface->width;
+		size->height = toplevel->base.surface->height;
+	} else {
+		struct weston_desktop_xdg_toplevel_configure *configure =
+			wl_container_of(toplevel->base.configure_list.prev,
+					configure, base.link);
+
+		*state = configure->state;
+		*size = configure->size;
+	}
+}
+
+static bool
+weston_desktop_xdg_toplevel_state_equal(const struct weston_desktop_xdg_toplevel_state *a,
+					const struct weston_desktop_xdg_toplevel_state *b)
+{
+	return a->activated == b->activated &&
+	       a->fullscreen == b->fullscreen &&
+	       a->maximized == b->maximized &&
+	       a->resizing == b->resizing;
+}
+
 static bool
 weston_desktop_xdg_toplevel_state_compare(struct weston_desktop_xdg_toplevel *toplevel)
 {
@@ -982,27 +1017,11 @@ weston_desktop_xdg_toplevel_state_compare(struct weston_desktop_xdg_toplevel *to
 	if (!toplevel->base.configured)
 		return false;
 
-	if (wl_list_empty(&toplevel->base.configure_list)) {
-		/* Last configure is actually the current state, just use it */
-		configured.state = toplevel->current.state;
-		configured.size.width = toplevel->base.surface->width;
-		configured.size.height = toplevel->base.surface->height;
-	} else {
-		struct weston_desktop_xdg_toplevel_configure *configure =
-			wl_container_of(toplevel->base.configure_list.prev,
-					configure, base.link);
-
-		configured.state = configure->state;
-		configured.size = configure->size;
-	}
+	weston_desktop_xdg_toplevel_get_configured(toplevel, &configured.state,
+						   &configured.size);
 
-	if (toplevel->pending.state.activated != configured.state.activated)
-		return false;
-	if (toplevel->pending.state.fullscreen != configured.state.fullscreen)
-		return false;
-	if (toplevel->pending.state.maximized != configured.state.maximized)
-		return false;
-	if (toplevel->pending.state.resizing != configured.state.resizing)
+	if (!weston_desktop_xdg_toplevel_state_equal(&toplevel->pending.state,
+						     &configured.state))
 		return false;
 
 	if (toplevel->pending.size.width == configured.size.width &&
@@ -1016,12 +1035,38 @@ weston_desktop_xdg_toplevel_state_compare(struct weston_desktop_xdg_toplevel *to
 	return false;
 }
 
+/*
+ * Whether to hold back a configure until the client has acked and
+ * committed the last one. Only size changes are held back, so that a
+ * client slow to redraw gets the latest size once it is done instead of
+ * every size it was resized through.
+ */
+static bool
+weston_desktop_xdg_toplevel_throttle_configure(struct weston_desktop_xdg_toplevel *toplevel)
+{
+	struct weston_desktop_xdg_toplevel_state state;
+	struct weston_size size;
+
+	if (!toplevel->base.configured)
+		return false;
+
+	if (wl_list_empty(&toplevel->base.configure_list) &&
+	    !toplevel->base.configure_acked)
+		return false;
+
+	weston_desktop_xdg_toplevel_get_configured(toplevel, &state, &size);
+
+	return weston_desktop_xdg_toplevel_state_equal(&toplevel->pending.state,
+						       &state);
+}
+
 static void
 weston_desktop_xdg_surface_schedule_configure(struct weston_desktop_xdg_surface *surface)
 {
 	struct wl_display *display = weston_desktop_get_display(surface->desktop);
 	struct wl_event_loop *loop = wl_display_get_event_loop(display);
 	bool pending_same = false;
+	bool throttle = false;
 
 	switch (surface->role) {
 	case WESTON_DESKTOP_XDG_SURFACE_ROLE_NONE:
@@ -1029,11 +1074,14 @@ weston_desktop_xdg_surface_schedule_configure(struct weston_desktop_xdg_surface
 		break;
 	case WESTON_DESKTOP_XDG_SURFACE_ROLE_TOPLEVEL:
 		pending_same = weston_desktop_xdg_toplevel_state_compare((struct weston_desktop_xdg_toplevel *) surface);
+		throttle = weston_desktop_xdg_toplevel_throttle_configure((struct weston_desktop_xdg_toplevel *) surface);
 		break;
 	case WESTON_DESKTOP_XDG_SURFACE_ROLE_POPUP:
 		break;
 	}
 
+	surface->configure_deferred = false;
+
 	if (surface->configure_idle != NULL) {
 		if (!pending_same)
 			return;
@@ -1044,6 +1092,11 @@ weston_desktop_xdg_surface_schedule_configure(struct weston_desktop_xdg_surface
 		if (pending_same)
 			return;
 
+		if (throttle) {
+			surface->configure_deferred = true;
+			return;
+		}
+
 		surface->configure_idle =
 			wl_event_loop_add_idle(loop,
 					       weston_desktop_xdg_surface_send_configure,
@@ -1226,6 +1279,7 @@ weston_desktop_xdg_surface_protocol_ack_configure(struct wl_client *wl_client,
 	}
 
 	surface->configured = true;
+	surface->configure_acked = true;
 
 	switch (surface->role) {
 	case WESTON_DESKTOP_XDG_SURFACE_ROLE_NONE:
@@ -1288,6 +1342,10 @@ weston_desktop_xdg_surface_committed(struct weston_desktop_surface *dsurface,
 		weston_desktop_xdg_popup_committed((struct weston_desktop_xdg_popup *) surface);
 		break;
 	}
+
+	surface->configure_acked = false;
+	if (surface->configure_deferred)
+		weston_desktop_xdg_surface_schedule_configure(surface);
 }
 
 static void
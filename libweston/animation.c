@@ -180,6 +180,13 @@ weston_view_animation_frame(struct weston_animation *base,
 
 	weston_spring_update(&animation->spring, time);
 
+	/* Nobody would see the rest of it, so don't repaint for it. The
+	 * occlusion is only up to date when called from an output repaint. */
+	if (output && weston_view_is_occluded(animation->view)) {
+		animation->spring.current = animation->spring.target;
+		animation->spring.previous = animation->spring.target;
+	}
+
 	if (weston_spring_done(&animation->spring)) {
 		weston_view_schedule_repaint(animation->view);
 		weston_view_animation_destroy(animation);
@@ -245,7 +252,10 @@ weston_view_animation_create(struct weston_view *view,
 	animation->listener.notify = handle_animation_view_destroy;
 	wl_signal_add(&view->destroy_signal, &animation->listener);
 
-	if (view->output) {
+	/* Outputs that are not repainted would never run the animation. */
+	if (view->output &&
+	    ec->state != WESTON_COMPOSITOR_SLEEPING &&
+	    ec->state != WESTON_COMPOSITOR_OFFSCREEN) {
 		wl_list_insert(&view->output->animation_list,
 			       &animation->animation.link);
 	} else {
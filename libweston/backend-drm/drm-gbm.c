@@ -177,6 +177,217 @@ err:
 	return -1;
 }
 
+#ifdef HAVE_GBM_MODIFIERS
+/* Compressed layouts, which the display engine decompresses on the fly,
+ * see drm_fourcc.h for the modifier encodings. */
+static bool
+modifier_is_compressed(uint64_t modifier)
+{
+	uint64_t vendor = modifier >> 56;
+	uint64_t value = modifier & 0x00ffffffffffffffULL;
+
+	switch (vendor) {
+	case DRM_FORMAT_MOD_VENDOR_INTEL:
+		/* the CCS variants of the Y and 4 tilings */
+		return (value >= 4 && value <= 8) ||
+		       (value >= 10 && value <= 17);
+	case DRM_FORMAT_MOD_VENDOR_AMD:
+		/* AMD_FMT_MOD_DCC */
+		return (modifier >> 13) & 1;
+	case DRM_FORMAT_MOD_VENDOR_ARM:
+		/* AFBC is type 0 of the ARM modifiers */
+		return value != 0 && ((value >> 52) & 0xf) == 0;
+	default:
+		return false;
+	}
+}
+
+static bool
+modifier_in_list(uint64_t modifier, const uint64_t *list, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (list[i] == modifier)
+			return true;
+	}
+
+	return false;
+}
+
+/** Order the scanout modifiers for allocating renderer buffers
+ *
+ * @param output The output, with its scanout plane.
+ * @param fmt Index of the output format in the scanout plane formats.
+ * @param ranked Array of at least count_modifiers of that format, filled in.
+ * @param count_compressed Number of compressed modifiers leading ranked.
+ * @returns The number of modifiers in ranked.
+ *
+ * Only modifiers the renderer can use are kept, when it tells. Compressed
+ * modifiers come first as they save memory bandwidth on every scanout,
+ * unless framebuffer compression was turned off for the output.
+ */
+static unsigned int
+drm_output_rank_modifiers(struct drm_output *output, unsigned int fmt,
+			  uint64_t *ranked, unsigned int *count_compressed)
+{
+	struct weston_compositor *compositor = output->base.compositor;
+	struct drm_plane *plane = output->scanout_plane;
+	uint64_t *renderer_modifiers = NULL;
+	int count_renderer = 0;
+	unsigned int i, n = 0;
+	int pass;
+
+	if (compositor->renderer->query_dmabuf_modifiers)
+		compositor->renderer->query_dmabuf_modifiers(compositor,
+							     output->gbm_format,
+							     &renderer_modifiers,
+							     &count_renderer);
+
+	for (pass = 0; pass < 2; pass++) {
+		bool compressed = pass == 0;
+
+		for (i = 0; i < plane->formats[fmt].count_modifiers; i++) {
+			uint64_t modifier = plane->formats[fmt].modifiers[i];
+
+			if (modifier_is_compressed(modifier) != compressed)
+				continue;
+			if (compressed && !output->fb_compression)
+				continue;
+			if (count_renderer > 0 &&
+			    !modifier_in_list(modifier, renderer_modifiers,
+					      count_renderer))
+				continue;
+
+			ranked[n++] = modifier;
+		}
+
+		if (compressed)
+			*count_compressed = n;
+	}
+
+	if (count_renderer > 0)
+		free(renderer_modifiers);
+
+	return n;
+}
+
+/** Check the output can scan out buffers allocated with the modifiers
+ *
+ * The display engine may refuse a compressed layout for some modes or
+ * planes even though the plane lists it, so a buffer like the renderer ones
+ * is shown on the scanout plane in a TEST_ONLY commit.
+ */
+static bool
+drm_output_test_modifiers(struct drm_output *output, struct drm_backend *b,
+			  const uint64_t *modifiers, unsigned int count)
+{
+	struct weston_mode *mode = output->base.current_mode;
+	struct drm_pending_state *pending_state;
+	struct drm_output_state *state;
+	struct drm_plane_state *ps;
+	struct gbm_bo *bo;
+	struct drm_fb *fb;
+	uint64_t modifier;
+	int ret;
+
+	bo = gbm_bo_create_with_modifiers(b->gbm, mode->width, mode->height,
+					  output->gbm_format,
+					  modifiers, count);
+	if (!bo)
+		return false;
+
+	fb = drm_fb_get_from_bo(bo, b, true, BUFFER_CLIENT);
+	if (!fb) {
+		gbm_bo_destroy(bo);
+		return false;
+	}
+
+	pending_state = drm_pending_state_alloc(b);
+	state = drm_output_state_duplicate(output->state_cur, pending_state,
+					   DRM_OUTPUT_STATE_CLEAR_PLANES);
+	state->dpms = WESTON_DPMS_ON;
+
+	ps = drm_plane_state_alloc(state, output->scanout_plane);
+	ps->fb = fb;
+	ps->output = output;
+	ps->src_w = fb->width << 16;
+	ps->src_h = fb->height << 16;
+	ps->dest_w = mode->width;
+	ps->dest_h = mode->height;
+
+	modifier = fb->modifier;
+	ret = drm_pending_state_test(pending_state);
+	drm_pending_state_free(pending_state);
+
+	drm_debug(b, "\t[modifiers] output %s: %s scanout of modifier 0x%llx\n",
+		  output->base.name, ret == 0 ? "accepts" : "rejects",
+		  (unsigned long long) modifier);
+
+	return ret == 0;
+}
+
+/* Allocate the renderer buffers in the best ranked layouts, see
+ * drm_output_rank_modifiers(). */
+static struct gbm_surface *
+drm_output_create_gbm_surface_with_modifiers(struct drm_output *output,
+					     struct drm_backend *b,
+					     unsigned int fmt)
+{
+	struct weston_mode *mode = output->base.current_mode;
+	struct drm_plane *plane = output->scanout_plane;
+	struct gbm_surface *surface = NULL;
+	unsigned int count, count_compressed;
+	uint64_t *ranked;
+
+	ranked = calloc(plane->formats[fmt].count_modifiers, sizeof *ranked);
+	if (!ranked)
+		return NULL;
+
+	count = drm_output_rank_modifiers(output, fmt, ranked,
+					  &count_compressed);
+
+	if (count_compressed > 0) {
+		if (drm_output_test_modifiers(output, b, ranked,
+					      count_compressed))
+			surface = gbm_surface_create_with_modifiers(b->gbm,
+								    mode->width,
+								    mode->height,
+								    output->gbm_format,
+								    ranked,
+								    count_compressed);
+		if (surface)
+			weston_log("Output %s: using framebuffer compression\n",
+				   output->base.name);
+		else
+			weston_log("Output %s: compressed framebuffers "
+				   "unavailable, falling back\n",
+				   output->base.name);
+	}
+
+	if (!surface && count > count_compressed)
+		surface = gbm_surface_create_with_modifiers(b->gbm,
+							    mode->width,
+							    mode->height,
+							    output->gbm_format,
+							    ranked + count_compressed,
+							    count - count_compressed);
+
+	/* Nothing in common with the renderer; let GBM choose. */
+	if (!surface && count == 0)
+		surface = gbm_surface_create_with_modifiers(b->gbm,
+							    mode->width,
+							    mode->height,
+							    output->gbm_format,
+							    plane->formats[fmt].modifiers,
+							    plane->formats[fmt].count_modifiers);
+
+	free(ranked);
+
+	return surface;
+}
+#endif
+
 /* Init output state that depends on gl or gbm */
 int
 drm_output_init_egl(struct drm_output *output, struct drm_backend *b)
@@ -191,6 +402,7 @@ drm_output_init_egl(struct drm_output *output, struct drm_backend *b)
 	};
 	struct weston_mode *mode = output->base.current_mode;
 	struct drm_plane *plane = output->scanout_plane;
+	struct gbm_device *gbm = b->primary->gbm;
 	unsigned int i;
 
 	assert(output->gbm_surface == NULL);
@@ -206,15 +418,17 @@ drm_output_init_egl(struct drm_output *output, struct drm_backend *b)
 		return -1;
 	}
 
+	/* The primary device renders for additional devices; a linear
+	 * layout is the one both sides are bound to understand. */
+	if (drm_backend_is_secondary(b))
+		output->gbm_bo_flags = GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR;
+
 #ifdef HAVE_GBM_MODIFIERS
-	if (plane->formats[i].count_modifiers > 0) {
+	if (plane->formats[i].count_modifiers > 0 &&
+	    !drm_backend_is_secondary(b)) {
 		output->gbm_surface =
-			gbm_surface_create_with_modifiers(b->gbm,
-							  mode->width,
-							  mode->height,
-							  output->gbm_format,
-							  plane->formats[i].modifiers,
-							  plane->formats[i].count_modifiers);
+			drm_output_create_gbm_surface_with_modifiers(output,
+								     b, i);
 	}
 
 	/* If allocating with modifiers fails, try again without. This can
@@ -224,7 +438,7 @@ drm_output_init_egl(struct drm_output *output, struct drm_backend *b)
 #endif
 	{
 		output->gbm_surface =
-		    gbm_surface_create(b->gbm, mode->width, mode->height,
+		    gbm_surface_create(gbm, mode->width, mode->height,
 				       output->gbm_format,
 				       output->gbm_bo_flags);
 	}
@@ -253,7 +467,7 @@ drm_output_init_egl(struct drm_output *output, struct drm_backend *b)
 void
 drm_output_fini_egl(struct drm_output *output)
 {
-	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_backend *b = output->backend;
 
 	/* Destroying the GBM surface will destroy all our GBM buffers,
 	 * regardless of refcount. Ensure we destroy them here. */
@@ -273,7 +487,7 @@ struct drm_fb *
 drm_output_render_gl(struct drm_output_state *state, pixman_region32_t *damage)
 {
 	struct drm_output *output = state->output;
-	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_backend *b = output->backend;
 	struct gbm_bo *bo;
 	struct drm_fb *ret;
 
@@ -295,14 +509,36 @@ drm_output_render_gl(struct drm_output_state *state, pixman_region32_t *damage)
 		return NULL;
 	}
 	ret->gbm_surface = output->gbm_surface;
+	ret->gbm_surface_held = &output->gbm_surface_held;
+	output->gbm_surface_held++;
 
 	return ret;
 }
 
+/** Whether drm_output_render_gl() can get a buffer without waiting
+ *
+ * EGL blocks in eglSwapBuffers() until the GPU releases a buffer when all
+ * of them are queued or scanned out. The swapchain depth of the output
+ * caps the buffers held at once below what GBM would allow.
+ */
+bool
+drm_output_gbm_has_free_buffer(struct drm_output *output)
+{
+	if (!output->gbm_surface)
+		return true;
+
+	if (output->swapchain_depth > 0 &&
+	    output->gbm_surface_held >= output->swapchain_depth)
+		return false;
+
+	return gbm_surface_has_free_buffers(output->gbm_surface);
+}
+
 static void
 switch_to_gl_renderer(struct drm_backend *b)
 {
 	struct drm_output *output;
+	struct drm_backend *secondary;
 	bool dmabuf_support_inited;
 	bool linux_explicit_sync_inited;
 
@@ -335,11 +571,17 @@ switch_to_gl_renderer(struct drm_backend *b)
 	}
 
 	wl_list_for_each(output, &b->compositor->output_list, base.link)
-		drm_output_init_egl(output, b);
+		drm_output_init_egl(output, output->backend);
 
 	b->use_pixman = 0;
+	wl_list_for_each(secondary, &b->secondary_list, secondary_link)
+		secondary->use_pixman = 0;
 
 	if (!dmabuf_support_inited && b->compositor->renderer->import_dmabuf) {
+		if (linux_dmabuf_set_main_device(b->compositor,
+						 b->drm.devnum) < 0)
+			weston_log("Error: setting the main dmabuf device "
+				   "failed.\n");
 		if (linux_dmabuf_setup(b->compositor) < 0)
 			weston_log("Error: initializing dmabuf "
 				   "support failed.\n");
@@ -64,6 +64,10 @@
 #define DRM_CLIENT_CAP_ASPECT_RATIO	4
 #endif
 
+#ifndef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+#define DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP	0x15
+#endif
+
 #ifndef GBM_BO_USE_CURSOR
 #define GBM_BO_USE_CURSOR GBM_BO_USE_CURSOR_64X64
 #endif
@@ -76,6 +80,9 @@
 #define DRM_PLANE_ZPOS_INVALID_PLANE	0xffffffffffffffffULL
 #endif
 
+/* The range of the standard "alpha" plane property */
+#define DRM_PLANE_ALPHA_OPAQUE	0xffff
+
 /**
  * A small wrapper to print information into the 'drm-backend' debug scope.
  *
@@ -114,6 +121,14 @@
 
 #define MAX_CLONED_CONNECTORS 4
 
+/* Number of TEST_ONLY commit results remembered, see
+ * drm_pending_state_test_cached(). */
+#define DRM_TEST_CACHE_SIZE 8
+
+/* Number of unused objects of each state type kept for reuse, see
+ * struct drm_state_pool. */
+#define DRM_STATE_POOL_SIZE 32
+
 #ifndef DRM_MODE_PICTURE_ASPECT_64_27
 #define DRM_MODE_PICTURE_ASPECT_64_27		3
 #define  DRM_MODE_FLAG_PIC_AR_64_27 \
@@ -177,6 +192,10 @@ enum wdrm_plane_property {
 	WDRM_PLANE_IN_FENCE_FD,
 	WDRM_PLANE_FB_DAMAGE_CLIPS,
 	WDRM_PLANE_ZPOS,
+	WDRM_PLANE_COLOR_ENCODING,
+	WDRM_PLANE_COLOR_RANGE,
+	WDRM_PLANE_ROTATION,
+	WDRM_PLANE_ALPHA,
 	WDRM_PLANE__COUNT
 };
 
@@ -190,6 +209,38 @@ enum wdrm_plane_type {
 	WDRM_PLANE_TYPE__COUNT
 };
 
+/**
+ * Possible values for the WDRM_PLANE_COLOR_ENCODING property.
+ */
+enum wdrm_plane_color_encoding {
+	WDRM_PLANE_COLOR_ENCODING_BT601 = 0,
+	WDRM_PLANE_COLOR_ENCODING_BT709,
+	WDRM_PLANE_COLOR_ENCODING_BT2020,
+	WDRM_PLANE_COLOR_ENCODING__COUNT
+};
+
+/**
+ * Possible values for the WDRM_PLANE_COLOR_RANGE property.
+ */
+enum wdrm_plane_color_range {
+	WDRM_PLANE_COLOR_RANGE_LIMITED = 0,
+	WDRM_PLANE_COLOR_RANGE_FULL,
+	WDRM_PLANE_COLOR_RANGE__COUNT
+};
+
+/**
+ * Bits of the WDRM_PLANE_ROTATION bitmask property.
+ */
+enum wdrm_plane_rotation {
+	WDRM_PLANE_ROTATION_0 = 0,
+	WDRM_PLANE_ROTATION_90,
+	WDRM_PLANE_ROTATION_180,
+	WDRM_PLANE_ROTATION_270,
+	WDRM_PLANE_ROTATION_REFLECT_X,
+	WDRM_PLANE_ROTATION_REFLECT_Y,
+	WDRM_PLANE_ROTATION__COUNT
+};
+
 /**
  * List of properties attached to a DRM connector
  */
@@ -201,6 +252,11 @@ enum wdrm_connector_property {
 	WDRM_CONNECTOR_CONTENT_PROTECTION,
 	WDRM_CONNECTOR_HDCP_CONTENT_TYPE,
 	WDRM_CONNECTOR_PANEL_ORIENTATION,
+	WDRM_CONNECTOR_WRITEBACK_PIXEL_FORMATS,
+	WDRM_CONNECTOR_WRITEBACK_FB_ID,
+	WDRM_CONNECTOR_WRITEBACK_OUT_FENCE_PTR,
+	WDRM_CONNECTOR_VRR_CAPABLE,
+	WDRM_CONNECTOR_TILE,
 	WDRM_CONNECTOR__COUNT
 };
 
@@ -239,6 +295,13 @@ enum wdrm_panel_orientation {
 enum wdrm_crtc_property {
 	WDRM_CRTC_MODE_ID = 0,
 	WDRM_CRTC_ACTIVE,
+	WDRM_CRTC_VRR_ENABLED,
+	WDRM_CRTC_OUT_FENCE_PTR,
+	WDRM_CRTC_CTM,
+	WDRM_CRTC_DEGAMMA_LUT,
+	WDRM_CRTC_DEGAMMA_LUT_SIZE,
+	WDRM_CRTC_GAMMA_LUT,
+	WDRM_CRTC_GAMMA_LUT_SIZE,
 	WDRM_CRTC__COUNT
 };
 
@@ -258,6 +321,13 @@ struct drm_backend {
 		char *filename;
 		dev_t devnum;
 	} drm;
+
+	/* The backend of the device the renderer runs on: this one, unless
+	 * it only drives the displays of an additional KMS device. */
+	struct drm_backend *primary;
+	struct wl_list secondary_list; /* drm_backend::secondary_link */
+	struct wl_list secondary_link;
+
 	struct gbm_device *gbm;
 	struct wl_listener session_listener;
 	uint32_t gbm_format;
@@ -286,6 +356,7 @@ struct drm_backend {
 
 	bool use_pixman;
 	bool use_pixman_shadow;
+	bool pixman_shadow_on_readback;
 
 	struct udev_input input;
 
@@ -300,6 +371,43 @@ struct drm_backend {
 
 	bool fb_modifiers;
 
+	/* atomic commits may use DRM_MODE_PAGE_FLIP_ASYNC */
+	bool async_page_flip;
+
+	/* Results of recent TEST_ONLY commits, keyed by a signature of the
+	 * tested plane configuration */
+	struct {
+		uint64_t signature;
+		int result;
+		bool valid;
+	} test_cache[DRM_TEST_CACHE_SIZE];
+	unsigned int test_cache_next;
+
+	/* Unused state objects, reused by the next repaints */
+	struct drm_state_pool {
+		struct wl_list pending_states; /* drm_pending_state::link */
+		struct wl_list output_states; /* drm_output_state::link */
+		struct wl_list plane_states; /* drm_plane_state::link */
+		unsigned int pending_count;
+		unsigned int output_count;
+		unsigned int plane_count;
+	} state_pool;
+
+	/* Running totals, reported in the drm-backend scope */
+	struct {
+		uint64_t state_allocs;
+		uint64_t state_reused;
+		uint64_t test_only_commits;
+	} stats;
+
+	/* drm_dmabuf_fb_cache attached to client dmabufs */
+	struct wl_list dmabuf_fb_cache_list;
+
+	/* drm_shm_fb_ring of small wl_shm surfaces, see fb.c */
+	struct wl_list shm_fb_ring_list;
+
+	struct wl_list writeback_list; /* drm_writeback::link */
+
 	struct weston_log_scope *debug;
 };
 
@@ -332,15 +440,21 @@ struct drm_fb {
 	uint64_t modifier;
 	int width, height;
 	int fd;
-	struct weston_buffer_reference buffer_ref;
-	struct weston_buffer_release_reference buffer_release_ref;
 
 	/* Used by gbm fbs */
 	struct gbm_bo *bo;
 	struct gbm_surface *gbm_surface;
+	unsigned int *gbm_surface_held; /* drm_output::gbm_surface_held */
 
 	/* Used by dumb fbs */
 	void *map;
+
+	/* handles[0] was imported into fd from another device */
+	bool prime_import;
+
+	/* dmabufs of the planes, exported once for virtual output owners */
+	int export_fds[4];
+	bool exported;
 };
 
 struct drm_edid {
@@ -359,6 +473,7 @@ struct drm_edid {
 struct drm_pending_state {
 	struct drm_backend *backend;
 	struct wl_list output_list;
+	struct wl_list link; /* drm_state_pool::pending_states when unused */
 };
 
 /*
@@ -378,6 +493,11 @@ struct drm_output_state {
 	enum dpms_enum dpms;
 	enum weston_hdcp_protection protection;
 	struct wl_list plane_list;
+	/* flip without waiting for vblank, see drm_output_state_may_tear() */
+	bool tearing;
+	/* CRTC out-fence of the commit applying this state, filled in by
+	 * the kernel; see drm_output_state_release_fenced() */
+	int32_t out_fence_fd;
 };
 
 /**
@@ -404,6 +524,11 @@ struct drm_plane_state {
 
 	struct drm_fb *fb;
 
+	/* Client buffer shown through fb: client framebuffers are shared
+	 * between frames, so the plane state keeps the buffer busy. */
+	struct weston_buffer_reference buffer_ref;
+	struct weston_buffer_release_reference buffer_release_ref;
+
 	struct weston_view *ev; /**< maintained for drm_assign_planes only */
 
 	int32_t src_x, src_y;
@@ -418,6 +543,16 @@ struct drm_plane_state {
 	/* We don't own the fd, so we shouldn't close it */
 	int in_fence_fd;
 
+	/* only used for YUV framebuffers */
+	enum wdrm_plane_color_encoding color_encoding;
+	enum wdrm_plane_color_range color_range;
+
+	/* transform applied by the plane to the framebuffer */
+	enum wl_output_transform rotation;
+
+	/* plane alpha, DRM_PLANE_ALPHA_OPAQUE unless the view is translucent */
+	uint16_t alpha;
+
 	uint32_t damage_blob_id; /* damage to kernel */
 
 	struct wl_list link; /* drm_output_state::plane_list */
@@ -459,10 +594,15 @@ struct drm_plane {
 
 	struct wl_list link;
 
+	/* Hash of formats[] by fourcc, storing index + 1, or NULL to search
+	 * formats[] instead; see drm_plane_find_format(). */
+	uint16_t *format_index;
+	uint32_t format_index_mask;
+
 	struct {
 		uint32_t format;
 		uint32_t count_modifiers;
-		uint64_t *modifiers;
+		uint64_t *modifiers; /* sorted when from IN_FORMATS */
 	} formats[];
 };
 
@@ -481,6 +621,17 @@ struct drm_head {
 
 	drmModeModeInfo inherited_mode;	/**< Original mode on the connector */
 	uint32_t inherited_crtc_id;	/**< Original CRTC assignment */
+
+	bool vrr_capable;
+
+	/* position of the head in a tiled display, group_id is 0 if the
+	 * monitor is not tiled */
+	struct {
+		uint32_t group_id;
+		uint32_t num_h, num_v;
+		uint32_t loc_h, loc_v;
+		uint32_t width, height;
+	} tile;
 };
 
 struct drm_output {
@@ -499,6 +650,46 @@ struct drm_output {
 	bool disable_pending;
 	bool dpms_off_pending;
 
+	/* variable refresh rate asked for in the configuration; whether it
+	 * is in use is weston_output::vrr_enabled */
+	bool vrr_requested;
+
+	/* whether renderer buffers may use compressed modifiers */
+	bool fb_compression;
+
+	/* whether a client buffer is on the scanout plane, for the debug
+	 * scope to tell when that starts and stops */
+	bool direct_scanout;
+
+	/* name of the output whose frames this one scans out, see mirror.c */
+	char *mirror_source;
+
+	/* render buffers freed while the output is off, see drm_trim_memory */
+	bool render_trimmed;
+
+	/* lowest render scale asked for in the configuration, 0 if off;
+	 * the one in use is weston_output::render_scale_min */
+	float dynamic_resolution_min;
+
+	/* color transform in the CRTC color pipeline; the property blobs
+	 * are set on every commit once color_pipeline is set, all 0 until
+	 * a disabled pipeline has been reset */
+	uint32_t degamma_lut_size;
+	uint32_t gamma_lut_size;
+	uint32_t degamma_lut_blob;
+	uint32_t ctm_blob;
+	uint32_t gamma_lut_blob;
+	bool color_pipeline;
+
+	/* ramp of drm_output_set_gamma() as a GAMMA_LUT blob, set on every
+	 * atomic commit without a color pipeline */
+	uint32_t gamma_ramp_blob;
+
+	/* kernel mode blob of the CRTC as left by the previous DRM master,
+	 * when it is already running our mode; reusing it spares the modeset
+	 * of the first commit */
+	uint32_t inherited_mode_blob;
+
 	uint32_t gbm_cursor_handle[2];
 	struct drm_fb *gbm_cursor_fb[2];
 	struct drm_plane *cursor_plane;
@@ -508,6 +699,12 @@ struct drm_output {
 	struct gbm_surface *gbm_surface;
 	uint32_t gbm_format;
 	uint32_t gbm_bo_flags;
+	/* Buffers locked from gbm_surface, at most swapchain_depth of them
+	 * if that is set. Without a free one, the renderer is not called
+	 * and the damage waits for the repaint after the next page flip. */
+	unsigned int gbm_surface_held;
+	unsigned int swapchain_depth;
+	bool render_deferred;
 
 	/* Plane being displayed directly on the CRTC */
 	struct drm_plane *scanout_plane;
@@ -528,9 +725,20 @@ struct drm_output {
 
 	struct wl_event_source *pageflip_timer;
 
+	/* captures through a writeback connector, see writeback.c */
+	struct drm_writeback *writeback;
+	struct wl_list writeback_request_list;
+
 	bool virtual;
 
 	submit_frame_cb virtual_submit_frame;
+	submit_dmabuf_cb virtual_submit_dmabuf;
+	/* completes a frame that had nothing to submit */
+	struct wl_event_source *virtual_idle_finish;
+	/* resubmits the last frame after keep_alive msec without damage */
+	struct wl_event_source *virtual_keep_alive_timer;
+	int virtual_keep_alive;
+	bool virtual_keep_alive_due;
 };
 
 static inline struct drm_head *
@@ -551,6 +759,17 @@ to_drm_backend(struct weston_compositor *base)
 	return container_of(base->backend, struct drm_backend, base);
 }
 
+/** Whether the backend drives an additional KMS device
+ *
+ * Such devices scan out what the renderer on the primary device drew,
+ * either imported linear buffers or dumb buffers when using Pixman.
+ */
+static inline bool
+drm_backend_is_secondary(struct drm_backend *b)
+{
+	return b->primary != b;
+}
+
 static inline struct drm_mode *
 to_drm_mode(struct weston_mode *base)
 {
@@ -592,12 +811,29 @@ drm_view_transform_supported(struct weston_view *ev, struct weston_output *outpu
 	    ev->transform.matrix.type >= WESTON_MATRIX_TRANSFORM_ROTATE)
 		return false;
 
-	if (viewport->buffer.transform != output->transform)
+	/* Buffers not pre-rotated by the client may still go on a plane
+	 * able to rotate them, see drm_plane_state_coords_for_view(). */
+	if (viewport->buffer.transform != output->transform &&
+	    viewport->buffer.transform != WL_OUTPUT_TRANSFORM_NORMAL)
 		return false;
 
 	return true;
 }
 
+/* Whether the view is a buffer-less opaque black surface, such as the
+ * fullscreen shell places around a client it doesn't stretch. */
+static inline bool
+drm_view_is_black_backdrop(struct weston_view *ev)
+{
+	struct weston_surface *surface = ev->surface;
+
+	return !surface->buffer_ref.buffer && surface->has_solid_color &&
+	       surface->solid_color[0] == 0.0f &&
+	       surface->solid_color[1] == 0.0f &&
+	       surface->solid_color[2] == 0.0f &&
+	       surface->solid_color[3] == 1.0f && ev->alpha == 1.0f;
+}
+
 int
 drm_mode_ensure_blob(struct drm_backend *backend, struct drm_mode *mode);
 
@@ -636,6 +872,11 @@ int
 drm_plane_populate_formats(struct drm_plane *plane, const drmModePlane *kplane,
 			   const drmModeObjectProperties *props,
 			   const bool use_modifiers);
+int
+drm_plane_find_format(const struct drm_plane *plane, uint32_t format);
+bool
+drm_plane_supports_format(const struct drm_plane *plane, uint32_t format,
+			  uint64_t modifier);
 void
 drm_property_info_free(struct drm_property_info *info, int num_props);
 
@@ -650,9 +891,37 @@ extern const struct drm_property_info crtc_props[];
 int
 init_kms_caps(struct drm_backend *b);
 
+bool
+drm_backend_add_writeback(struct drm_backend *b, uint32_t connector_id);
+void
+drm_backend_destroy_writebacks(struct drm_backend *b);
+int
+drm_backend_reset_writebacks(struct drm_backend *b, drmModeAtomicReq *req);
+int
+drm_output_apply_writeback(struct drm_output_state *state,
+			   drmModeAtomicReq *req, uint32_t *flags);
+void
+drm_output_writeback_commit_done(struct drm_output *output, bool success);
+void
+drm_output_init_writeback(struct drm_output *output);
+void
+drm_output_fini_writeback(struct drm_output *output);
+
+bool
+drm_output_assign_mirror(struct drm_output *output,
+			 struct drm_pending_state *pending_state);
+void
+drm_output_schedule_mirrors(struct drm_output *source);
+void
+drm_output_release_mirrors(struct drm_output *source);
+
 int
 drm_pending_state_test(struct drm_pending_state *pending_state);
 int
+drm_pending_state_test_cached(struct drm_pending_state *pending_state);
+void
+drm_backend_test_cache_clear(struct drm_backend *b);
+int
 drm_pending_state_apply(struct drm_pending_state *pending_state);
 int
 drm_pending_state_apply_sync(struct drm_pending_state *pending_state);
@@ -660,6 +929,11 @@ drm_pending_state_apply_sync(struct drm_pending_state *pending_state);
 void
 drm_output_set_gamma(struct weston_output *output_base,
 		     uint16_t size, uint16_t *r, uint16_t *g, uint16_t *b);
+int
+drm_output_set_color_transform(struct weston_output *output_base,
+			       const struct weston_color_transform *xform);
+void
+drm_output_fini_color_transform(struct drm_output *output);
 
 void
 drm_output_update_msc(struct drm_output *output, unsigned int seq);
@@ -677,6 +951,16 @@ drm_fb_unref(struct drm_fb *fb);
 struct drm_fb *
 drm_fb_create_dumb(struct drm_backend *b, int width, int height,
 		   uint32_t format);
+
+/* wl_shm surfaces of up to this many pixels can be copied into dumb
+ * buffers for planes; each has up to DRM_SHM_FB_COUNT copies */
+#define DRM_SHM_FB_MAX_PIXELS (512 * 512)
+#define DRM_SHM_FB_COUNT 3
+
+struct drm_fb *
+drm_fb_get_from_shm_view(struct drm_backend *b, struct weston_view *ev);
+void
+drm_backend_shm_fb_ring_release(struct drm_backend *b);
 struct drm_fb *
 drm_fb_get_from_bo(struct gbm_bo *bo, struct drm_backend *backend,
 		   bool is_opaque, enum drm_fb_type type);
@@ -687,6 +971,8 @@ drm_fb_get_from_view(struct drm_output_state *state, struct weston_view *ev);
 extern bool
 drm_can_scanout_dmabuf(struct weston_compositor *ec,
 		       struct linux_dmabuf_buffer *dmabuf);
+extern void
+drm_backend_dmabuf_fb_cache_release(struct drm_backend *b);
 #else
 static inline struct drm_fb *
 drm_fb_get_from_view(struct drm_output_state *state, struct weston_view *ev)
@@ -699,8 +985,17 @@ drm_can_scanout_dmabuf(struct weston_compositor *ec,
 {
 	return false;
 }
+static inline void
+drm_backend_dmabuf_fb_cache_release(struct drm_backend *b)
+{
+}
 #endif
 
+void
+drm_backend_state_pool_init(struct drm_backend *b);
+void
+drm_backend_state_pool_fini(struct drm_backend *b);
+
 struct drm_pending_state *
 drm_pending_state_alloc(struct drm_backend *backend);
 void
@@ -745,10 +1040,17 @@ drm_plane_state_duplicate(struct drm_output_state *state_output,
 void
 drm_plane_state_free(struct drm_plane_state *state, bool force);
 void
+drm_plane_state_set_buffer(struct drm_plane_state *state,
+			   struct weston_view *ev);
+void
 drm_plane_state_put_back(struct drm_plane_state *state);
 bool
 drm_plane_state_coords_for_view(struct drm_plane_state *state,
 				struct weston_view *ev, uint64_t zpos);
+bool
+drm_plane_rotation_from_transform(struct drm_plane *plane,
+				  enum wl_output_transform transform,
+				  uint64_t *rotation);
 void
 drm_plane_reset_state(struct drm_plane *plane);
 
@@ -790,6 +1092,9 @@ drm_output_fini_egl(struct drm_output *output);
 struct drm_fb *
 drm_output_render_gl(struct drm_output_state *state, pixman_region32_t *damage);
 
+bool
+drm_output_gbm_has_free_buffer(struct drm_output *output);
+
 void
 renderer_switch_binding(struct weston_keyboard *keyboard,
 			const struct timespec *time, uint32_t key, void *data);
@@ -818,6 +1123,12 @@ drm_output_render_gl(struct drm_output_state *state, pixman_region32_t *damage)
 	return NULL;
 }
 
+inline static bool
+drm_output_gbm_has_free_buffer(struct drm_output *output)
+{
+	return true;
+}
+
 inline static void
 renderer_switch_binding(struct weston_keyboard *keyboard,
 			const struct timespec *time, uint32_t key, void *data)
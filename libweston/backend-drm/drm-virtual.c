@@ -36,6 +36,7 @@
 #include <string.h>
 
 #include "drm-internal.h"
+#include "pixel-formats.h"
 #include "renderer-gl/gl-renderer.h"
 
 /**
@@ -104,13 +105,72 @@ drm_virtual_output_start_repaint_loop(struct weston_output *output_base)
 	return 0;
 }
 
+static int
+drm_virtual_output_export_fb(struct drm_backend *b, struct drm_fb *fb)
+{
+	int i;
+
+	if (fb->exported)
+		return 0;
+
+	for (i = 0; i < fb->num_planes; i++) {
+		if (drmPrimeHandleToFD(b->drm.fd, fb->handles[i], DRM_CLOEXEC,
+				       &fb->export_fds[i]) != 0) {
+			weston_log("drmPrimeHandleFD failed, errno=%d\n",
+				   errno);
+			while (i-- > 0)
+				close(fb->export_fds[i]);
+			return -1;
+		}
+	}
+
+	fb->exported = true;
+
+	return 0;
+}
+
+static int
+drm_virtual_output_submit_dmabuf(struct drm_output *output,
+				 struct drm_fb *fb, pixman_region32_t *damage)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct weston_drm_virtual_output_dmabuf dmabuf = {
+		.width = fb->width,
+		.height = fb->height,
+		.format = fb->format->format,
+		.modifier = fb->modifier,
+		.n_planes = fb->num_planes,
+	};
+	int i, ret;
+
+	if (drm_virtual_output_export_fb(b, fb) < 0)
+		return -1;
+
+	dmabuf.damage = pixman_region32_rectangles(damage, &dmabuf.n_damage);
+
+	for (i = 0; i < fb->num_planes; i++) {
+		dmabuf.fd[i] = fb->export_fds[i];
+		dmabuf.stride[i] = fb->strides[i];
+		dmabuf.offset[i] = fb->offsets[i];
+	}
+
+	drm_fb_ref(fb);
+	ret = output->virtual_submit_dmabuf(&output->base, &dmabuf, fb);
+	if (ret < 0)
+		drm_fb_unref(fb);
+	return ret;
+}
+
 static int
 drm_virtual_output_submit_frame(struct drm_output *output,
-				struct drm_fb *fb)
+				struct drm_fb *fb, pixman_region32_t *damage)
 {
 	struct drm_backend *b = to_drm_backend(output->base.compositor);
 	int fd, ret;
 
+	if (output->virtual_submit_dmabuf)
+		return drm_virtual_output_submit_dmabuf(output, fb, damage);
+
 	assert(fb->num_planes == 1);
 	ret = drmPrimeHandleToFD(b->drm.fd, fb->handles[0], DRM_CLOEXEC, &fd);
 	if (ret) {
@@ -128,6 +188,49 @@ drm_virtual_output_submit_frame(struct drm_output *output,
 	return ret;
 }
 
+static void
+drm_virtual_output_idle_finish(void *data)
+{
+	struct drm_output *output = data;
+
+	output->virtual_idle_finish = NULL;
+	weston_output_finish_frame(&output->base, NULL,
+				   WP_PRESENTATION_FEEDBACK_INVALID);
+}
+
+static int
+drm_virtual_output_keep_alive(void *data)
+{
+	struct drm_output *output = data;
+
+	output->virtual_keep_alive_due = true;
+	weston_output_schedule_repaint(&output->base);
+
+	return 0;
+}
+
+/* Damage of the frame in buffer coordinates; zooming gets it all. */
+static void
+drm_virtual_output_buffer_damage(struct drm_output *output,
+				 pixman_region32_t *damage,
+				 pixman_region32_t *buffer_damage)
+{
+	struct weston_mode *mode = output->base.current_mode;
+
+	if (output->base.zoom.active || output->virtual_keep_alive_due) {
+		pixman_region32_init_rect(buffer_damage, 0, 0,
+					  mode->width, mode->height);
+		return;
+	}
+
+	pixman_region32_init(buffer_damage);
+	pixman_region32_copy(buffer_damage, damage);
+	pixman_region32_translate(buffer_damage,
+				  -output->base.x, -output->base.y);
+	weston_output_transformed_region(&output->base,
+					 buffer_damage, buffer_damage);
+}
+
 static int
 drm_virtual_output_repaint(struct weston_output *output_base,
 			   pixman_region32_t *damage,
@@ -138,12 +241,35 @@ drm_virtual_output_repaint(struct weston_output *output_base,
 	struct drm_output *output = to_drm_output(output_base);
 	struct drm_plane *scanout_plane = output->scanout_plane;
 	struct drm_plane_state *scanout_state;
+	pixman_region32_t buffer_damage;
+	int ret;
 
 	assert(output->virtual);
 
 	if (output->disable_pending || output->destroy_pending)
 		goto err;
 
+	/* The owner still has the last frame, which is up to date, so do not
+	 * make it encode the very same picture again. The frame completes
+	 * once the core is done with this repaint. */
+	if (!pixman_region32_not_empty(damage) &&
+	    !output->virtual_keep_alive_due &&
+	    scanout_plane->state_cur->fb && !output->virtual_idle_finish) {
+		struct wl_event_loop *loop =
+			wl_display_get_event_loop(output_base->compositor->wl_display);
+
+		output->virtual_idle_finish =
+			wl_event_loop_add_idle(loop,
+					       drm_virtual_output_idle_finish,
+					       output);
+		if (output->virtual_idle_finish) {
+			state = drm_pending_state_get_output(pending_state,
+							     output);
+			drm_output_state_free(state);
+			return 0;
+		}
+	}
+
 	/* Drop frame if there isn't free buffers */
 	if (!gbm_surface_has_free_buffers(output->gbm_surface)) {
 		weston_log("%s: Drop frame!!\n", __func__);
@@ -166,9 +292,18 @@ drm_virtual_output_repaint(struct weston_output *output_base,
 	if (!scanout_state || !scanout_state->fb)
 		goto err;
 
-	if (drm_virtual_output_submit_frame(output, scanout_state->fb) < 0)
+	drm_virtual_output_buffer_damage(output, damage, &buffer_damage);
+	ret = drm_virtual_output_submit_frame(output, scanout_state->fb,
+					      &buffer_damage);
+	pixman_region32_fini(&buffer_damage);
+	if (ret < 0)
 		goto err;
 
+	output->virtual_keep_alive_due = false;
+	if (output->virtual_keep_alive_timer)
+		wl_event_source_timer_update(output->virtual_keep_alive_timer,
+					     output->virtual_keep_alive);
+
 	return 0;
 
 err:
@@ -181,6 +316,16 @@ drm_virtual_output_deinit(struct weston_output *base)
 {
 	struct drm_output *output = to_drm_output(base);
 
+	if (output->virtual_idle_finish) {
+		wl_event_source_remove(output->virtual_idle_finish);
+		output->virtual_idle_finish = NULL;
+	}
+
+	if (output->virtual_keep_alive_timer) {
+		wl_event_source_remove(output->virtual_keep_alive_timer);
+		output->virtual_keep_alive_timer = NULL;
+	}
+
 	drm_output_fini_egl(output);
 
 	drm_virtual_plane_destroy(output->scanout_plane);
@@ -216,7 +361,7 @@ drm_virtual_output_enable(struct weston_output *output_base)
 		goto err;
 	}
 
-	if (!output->virtual_submit_frame) {
+	if (!output->virtual_submit_frame && !output->virtual_submit_dmabuf) {
 		weston_log("The virtual_submit_frame hook is not set\n");
 		goto err;
 	}
@@ -233,6 +378,16 @@ drm_virtual_output_enable(struct weston_output *output_base)
 		goto err;
 	}
 
+	if (output->virtual_keep_alive > 0) {
+		struct wl_event_loop *loop =
+			wl_display_get_event_loop(b->compositor->wl_display);
+
+		output->virtual_keep_alive_timer =
+			wl_event_loop_add_timer(loop,
+						drm_virtual_output_keep_alive,
+						output);
+	}
+
 	output->base.start_repaint_loop = drm_virtual_output_start_repaint_loop;
 	output->base.repaint = drm_virtual_output_repaint;
 	output->base.assign_planes = drm_assign_planes;
@@ -272,6 +427,7 @@ drm_virtual_output_create(struct weston_compositor *c, char *name)
 	if (!output)
 		return NULL;
 
+	output->backend = to_drm_backend(c);
 	output->virtual = true;
 	output->gbm_bo_flags = GBM_BO_USE_LINEAR | GBM_BO_USE_RENDERING;
 
@@ -311,6 +467,23 @@ drm_virtual_output_set_submit_frame_cb(struct weston_output *output_base,
 	output->virtual_submit_frame = cb;
 }
 
+static void
+drm_virtual_output_set_submit_dmabuf_cb(struct weston_output *output_base,
+					submit_dmabuf_cb cb)
+{
+	struct drm_output *output = to_drm_output(output_base);
+
+	output->virtual_submit_dmabuf = cb;
+}
+
+static void
+drm_virtual_output_set_keep_alive(struct weston_output *output_base, int msec)
+{
+	struct drm_output *output = to_drm_output(output_base);
+
+	output->virtual_keep_alive = MAX(msec, 0);
+}
+
 static int
 drm_virtual_output_get_fence_fd(struct weston_output *output_base)
 {
@@ -351,7 +524,9 @@ static const struct weston_drm_virtual_output_api virt_api = {
 	drm_virtual_output_set_submit_frame_cb,
 	drm_virtual_output_get_fence_fd,
 	drm_virtual_output_buffer_released,
-	drm_virtual_output_finish_frame
+	drm_virtual_output_finish_frame,
+	drm_virtual_output_set_submit_dmabuf_cb,
+	drm_virtual_output_set_keep_alive,
 };
 
 int drm_backend_init_virtual_output_api(struct weston_compositor *compositor)
@@ -186,6 +186,9 @@ drm_output_pageflip_timer_create(struct drm_output *output)
 static void
 drm_output_destroy(struct weston_output *output_base);
 
+static int
+drm_output_restore_render(struct drm_output *output);
+
 /**
  * Returns true if the plane can be used on the given output for its current
  * repaint cycle.
@@ -216,8 +219,9 @@ drm_output_find_by_crtc(struct drm_backend *b, uint32_t crtc_id)
 {
 	struct drm_output *output;
 
+	/* CRTC IDs are only unique within one KMS device. */
 	wl_list_for_each(output, &b->compositor->output_list, base.link) {
-		if (output->crtc_id == crtc_id)
+		if (output->backend == b && output->crtc_id == crtc_id)
 			return output;
 	}
 
@@ -233,7 +237,8 @@ drm_head_find_by_connector(struct drm_backend *backend, uint32_t connector_id)
 	wl_list_for_each(base,
 			 &backend->compositor->head_list, compositor_link) {
 		head = to_drm_head(base);
-		if (head->connector_id == connector_id)
+		if (head->backend == backend &&
+		    head->connector_id == connector_id)
 			return head;
 	}
 
@@ -276,7 +281,7 @@ void
 drm_output_update_complete(struct drm_output *output, uint32_t flags,
 			   unsigned int sec, unsigned int usec)
 {
-	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_backend *b = output->backend;
 	struct drm_plane_state *ps;
 	struct timespec ts;
 
@@ -323,8 +328,9 @@ drm_output_update_complete(struct drm_output *output, uint32_t flags,
 
 	/* We can't call this from frame_notify, because the output's
 	 * repaint needed flag is cleared just after that */
-	if (output->recorder)
+	if (output->recorder || output->render_deferred)
 		weston_output_schedule_repaint(&output->base);
+	output->render_deferred = false;
 }
 
 static struct drm_fb *
@@ -357,11 +363,13 @@ drm_output_render(struct drm_output_state *state, pixman_region32_t *damage)
 	struct drm_plane *scanout_plane = output->scanout_plane;
 	struct drm_property_info *damage_info =
 		&scanout_plane->props[WDRM_PLANE_FB_DAMAGE_CLIPS];
-	struct drm_backend *b = to_drm_backend(c);
+	struct drm_backend *b = output->backend;
 	struct drm_fb *fb;
 	pixman_region32_t scanout_damage;
 	pixman_box32_t *rects;
 	int n_rects;
+	int32_t render_width, render_height;
+	bool deferred = false;
 
 	/* If we already have a client buffer promoted to scanout, then we don't
 	 * want to render. */
@@ -381,9 +389,28 @@ drm_output_render(struct drm_output_state *state, pixman_region32_t *damage)
 	    (scanout_plane->state_cur->fb->type == BUFFER_GBM_SURFACE ||
 	     scanout_plane->state_cur->fb->type == BUFFER_PIXMAN_DUMB)) {
 		fb = drm_fb_ref(scanout_plane->state_cur->fb);
+		render_width = scanout_plane->state_cur->src_w >> 16;
+		render_height = scanout_plane->state_cur->src_h >> 16;
 	} else if (b->use_pixman) {
 		fb = drm_output_render_pixman(state, damage);
+		render_width = output->base.current_mode->width;
+		render_height = output->base.current_mode->height;
+	} else if (scanout_plane->state_cur->fb &&
+		   scanout_plane->state_cur->fb->type == BUFFER_GBM_SURFACE &&
+		   !drm_output_gbm_has_free_buffer(output)) {
+		/* Show the previous frame once more rather than stall the
+		 * event loop in EGL; the damage stays on the primary plane. */
+		drm_debug(b, "\t[repaint] no free buffer on output %s, "
+			  "deferring rendering\n", output->base.name);
+		fb = drm_fb_ref(scanout_plane->state_cur->fb);
+		render_width = scanout_plane->state_cur->src_w >> 16;
+		render_height = scanout_plane->state_cur->src_h >> 16;
+		output->render_deferred = true;
+		deferred = true;
 	} else {
+		/* Dynamic resolution draws into the top-left corner. */
+		weston_output_get_render_size(&output->base, &render_width,
+					      &render_height);
 		fb = drm_output_render_gl(state, damage);
 	}
 
@@ -395,21 +422,30 @@ drm_output_render(struct drm_output_state *state, pixman_region32_t *damage)
 	scanout_state->fb = fb;
 	scanout_state->output = output;
 
+	/* The renderer already applied the output transform. */
+	scanout_state->rotation = WL_OUTPUT_TRANSFORM_NORMAL;
+	scanout_state->alpha = DRM_PLANE_ALPHA_OPAQUE;
+
 	scanout_state->src_x = 0;
 	scanout_state->src_y = 0;
-	scanout_state->src_w = fb->width << 16;
-	scanout_state->src_h = fb->height << 16;
+	scanout_state->src_w = MIN(render_width, fb->width) << 16;
+	scanout_state->src_h = MIN(render_height, fb->height) << 16;
 
 	scanout_state->dest_x = 0;
 	scanout_state->dest_y = 0;
 	scanout_state->dest_w = output->base.current_mode->width;
 	scanout_state->dest_h = output->base.current_mode->height;
 
+	if (deferred)
+		return;
+
 	pixman_region32_subtract(&c->primary_plane.damage,
 				 &c->primary_plane.damage, damage);
 
-	/* Don't bother calculating plane damage if the plane doesn't support it */
-	if (damage_info->prop_id == 0)
+	/* Don't bother calculating plane damage if the plane doesn't support
+	 * it, or if it is not in the scale of the framebuffer */
+	if (damage_info->prop_id == 0 ||
+	    scanout_state->src_w >> 16 != scanout_state->dest_w)
 		return;
 
 	pixman_region32_init(&scanout_damage);
@@ -422,12 +458,9 @@ drm_output_render(struct drm_output_state *state, pixman_region32_t *damage)
 	} else {
 		pixman_region32_translate(&scanout_damage,
 					  -output->base.x, -output->base.y);
-		weston_transformed_region(output->base.width,
-					  output->base.height,
-					  output->base.transform,
-					  output->base.current_scale,
-					  &scanout_damage,
-					  &scanout_damage);
+		weston_output_transformed_region(&output->base,
+						 &scanout_damage,
+						 &scanout_damage);
 	}
 
 	assert(scanout_state->damage_blob_id == 0);
@@ -452,16 +485,26 @@ drm_output_repaint(struct weston_output *output_base,
 		   pixman_region32_t *damage,
 		   void *repaint_data)
 {
-	struct drm_pending_state *pending_state = repaint_data;
 	struct drm_output *output = to_drm_output(output_base);
+	struct drm_pending_state *pending_state = output->backend->repaint_data;
 	struct drm_output_state *state = NULL;
 	struct drm_plane_state *scanout_state;
+	int restored;
 
 	assert(!output->virtual);
 
 	if (output->disable_pending || output->destroy_pending)
 		goto err;
 
+	restored = drm_output_restore_render(output);
+	if (restored < 0)
+		goto err;
+
+	/* The new render buffers start out blank, only drawing all of the
+	 * output brings them back. */
+	if (restored)
+		pixman_region32_union(damage, damage, &output_base->region);
+
 	assert(!output->state_last);
 
 	/* If planes have been disabled in the core, we might not have
@@ -485,6 +528,8 @@ drm_output_repaint(struct weston_output *output_base,
 	if (!scanout_state || !scanout_state->fb)
 		goto err;
 
+	drm_output_schedule_mirrors(output);
+
 	return 0;
 
 err:
@@ -492,6 +537,80 @@ err:
 	return -1;
 }
 
+/**
+ * Move the cursor plane without a repaint
+ *
+ * Called by the core instead of drm_output_repaint() when only the view on
+ * the cursor plane moved. The current state is carried over as it is, bar
+ * the cursor plane position, so neither the renderer nor plane assignment
+ * run. Anything the cursor plane cannot show on its own, like the cursor
+ * being cropped by the output edge, falls back to a full repaint.
+ */
+static int
+drm_output_repaint_cursor(struct weston_output *output_base,
+			  void *repaint_data)
+{
+	struct drm_output *output = to_drm_output(output_base);
+	struct drm_backend *b = output->backend;
+	struct drm_pending_state *pending_state = b->repaint_data;
+	struct drm_plane *plane = output->cursor_plane;
+	struct weston_view *ev = output->cursor_view;
+	struct drm_output_state *state;
+	struct drm_plane_state *ps;
+
+	assert(!output->virtual);
+
+	if (b->state_invalid || output->disable_pending ||
+	    output->destroy_pending ||
+	    output->state_cur->dpms != WESTON_DPMS_ON)
+		return -1;
+
+	if (!plane || !ev || plane->state_cur->ev != ev ||
+	    !plane->state_cur->fb || plane->state_cur->output != output)
+		return -1;
+
+	assert(!output->state_last);
+	assert(!drm_pending_state_get_output(pending_state, output));
+
+	state = drm_output_state_duplicate(output->state_cur, pending_state,
+					   DRM_OUTPUT_STATE_PRESERVE_PLANES);
+
+	/* The fences of the buffers being kept have signalled already. */
+	wl_list_for_each(ps, &state->plane_list, link)
+		ps->in_fence_fd = -1;
+
+	ps = drm_output_state_get_existing_plane(state, plane);
+	assert(ps);
+
+	/* Same constraints as drm_output_prepare_cursor_view(). */
+	if (!drm_plane_state_coords_for_view(ps, ev, ps->zpos) ||
+	    ps->src_x != 0 || ps->src_y != 0 ||
+	    ps->src_w > (unsigned) b->cursor_width << 16 ||
+	    ps->src_h > (unsigned) b->cursor_height << 16 ||
+	    ps->src_w != ps->dest_w << 16 ||
+	    ps->src_h != ps->dest_h << 16)
+		goto err;
+
+	ps->src_w = b->cursor_width << 16;
+	ps->src_h = b->cursor_height << 16;
+	ps->dest_w = b->cursor_width;
+	ps->dest_h = b->cursor_height;
+
+	if (drm_pending_state_test_cached(pending_state) != 0)
+		goto err;
+
+	drm_debug(b, "\t[repaint] moving cursor of output %s to %d,%d\n",
+		  output->base.name, ps->dest_x, ps->dest_y);
+
+	return 0;
+
+err:
+	drm_debug(b, "\t[repaint] cannot move cursor of output %s on its own\n",
+		  output->base.name);
+	drm_output_state_free(state);
+	return -1;
+}
+
 /* Determine the type of vblank synchronization to use for the output.
  *
  * The pipe parameter indicates which CRTC is in use.  Knowing this, we
@@ -523,8 +642,7 @@ drm_output_start_repaint_loop(struct weston_output *output_base)
 	struct drm_output *output = to_drm_output(output_base);
 	struct drm_pending_state *pending_state;
 	struct drm_plane *scanout_plane = output->scanout_plane;
-	struct drm_backend *backend =
-		to_drm_backend(output_base->compositor);
+	struct drm_backend *backend = output->backend;
 	struct timespec ts, tnow;
 	struct timespec vbl2now;
 	int64_t refresh_nsec;
@@ -612,16 +730,24 @@ finish_frame:
  * Called by the core compositor at the beginning of a repaint cycle. Creates
  * a new pending_state structure to own any output state created by individual
  * output repaint functions until the repaint is flushed or cancelled.
+ *
+ * Every additional KMS device gets a pending state of its own, found by the
+ * outputs through drm_backend::repaint_data, as devices are committed
+ * separately.
  */
 static void *
 drm_repaint_begin(struct weston_compositor *compositor)
 {
 	struct drm_backend *b = to_drm_backend(compositor);
+	struct drm_backend *secondary;
 	struct drm_pending_state *ret;
 
 	ret = drm_pending_state_alloc(b);
 	b->repaint_data = ret;
 
+	wl_list_for_each(secondary, &b->secondary_list, secondary_link)
+		secondary->repaint_data = drm_pending_state_alloc(secondary);
+
 	if (weston_log_scope_is_enabled(b->debug)) {
 		char *dbg = weston_compositor_print_scene_graph(compositor);
 		drm_debug(b, "[repaint] Beginning repaint; pending_state %p\n",
@@ -633,6 +759,79 @@ drm_repaint_begin(struct weston_compositor *compositor)
 	return ret;
 }
 
+/* Moves the cursor plane of a pending output state to where the cursor view
+ * is now, which may differ from where it was when planes were assigned if
+ * motion was processed since. Only the position is latched: anything else,
+ * like the cursor getting cropped by the output edge, is left for the next
+ * repaint, which the move has scheduled already. */
+static void
+drm_output_state_latch_cursor(struct drm_output_state *state)
+{
+	struct drm_output *output = state->output;
+	struct drm_backend *b = output->backend;
+	struct weston_view *ev = output->cursor_view;
+	struct drm_plane_state *ps, latched;
+
+	if (!output->cursor_plane || !ev)
+		return;
+
+	ps = drm_output_state_get_existing_plane(state, output->cursor_plane);
+	if (!ps || ps->ev != ev || !ps->fb)
+		return;
+
+	weston_view_update_transform(ev);
+
+	/* Same constraints as drm_output_prepare_cursor_view(). */
+	latched = *ps;
+	if (!drm_plane_state_coords_for_view(&latched, ev, ps->zpos) ||
+	    latched.rotation != ps->rotation ||
+	    latched.dest_w == 0 || latched.dest_h == 0 ||
+	    latched.src_x != 0 || latched.src_y != 0 ||
+	    latched.src_w > (unsigned) b->cursor_width << 16 ||
+	    latched.src_h > (unsigned) b->cursor_height << 16 ||
+	    latched.src_w != latched.dest_w << 16 ||
+	    latched.src_h != latched.dest_h << 16)
+		return;
+
+	if (latched.dest_x == ps->dest_x && latched.dest_y == ps->dest_y)
+		return;
+
+	drm_debug(b, "\t[repaint] latching cursor of output %s at %d,%d "
+		     "instead of %d,%d\n", output->base.name,
+		  latched.dest_x, latched.dest_y, ps->dest_x, ps->dest_y);
+
+	ps->dest_x = latched.dest_x;
+	ps->dest_y = latched.dest_y;
+}
+
+/* Devices none of whose outputs repainted are left alone. */
+static int
+drm_backend_flush_pending_state(struct drm_backend *b,
+				struct drm_pending_state *pending_state)
+{
+	struct drm_output_state *output_state;
+	int ret;
+
+	b->repaint_data = NULL;
+
+	if (wl_list_empty(&pending_state->output_list)) {
+		drm_pending_state_free(pending_state);
+		return 0;
+	}
+
+	wl_list_for_each(output_state, &pending_state->output_list, link)
+		drm_output_state_latch_cursor(output_state);
+
+	ret = drm_pending_state_apply(pending_state);
+	if (ret != 0)
+		weston_log("repaint-flush failed on %s: %s\n",
+			   b->drm.filename, strerror(errno));
+
+	drm_debug(b, "[repaint] flushed pending_state %p\n", pending_state);
+
+	return ret;
+}
+
 /**
  * Flush a repaint set
  *
@@ -641,20 +840,25 @@ drm_repaint_begin(struct weston_compositor *compositor)
  * of the output state from the pending state, to the update itself. When
  * the update completes (see drm_output_update_complete), the output
  * state will be freed.
+ *
+ * Pointer motion which arrived while rendering is processed first, so the
+ * cursor planes show the latest position rather than the one from the start
+ * of the repaint.
  */
 static int
 drm_repaint_flush(struct weston_compositor *compositor, void *repaint_data)
 {
 	struct drm_backend *b = to_drm_backend(compositor);
-	struct drm_pending_state *pending_state = repaint_data;
+	struct drm_backend *secondary;
 	int ret;
 
-	ret = drm_pending_state_apply(pending_state);
-	if (ret != 0)
-		weston_log("repaint-flush failed: %s\n", strerror(errno));
+	udev_input_dispatch_motion(&b->input);
 
-	drm_debug(b, "[repaint] flushed pending_state %p\n", pending_state);
-	b->repaint_data = NULL;
+	wl_list_for_each(secondary, &b->secondary_list, secondary_link)
+		drm_backend_flush_pending_state(secondary,
+						secondary->repaint_data);
+
+	ret = drm_backend_flush_pending_state(b, repaint_data);
 
 	return (ret == -EACCES) ? -1 : 0;
 }
@@ -670,6 +874,12 @@ drm_repaint_cancel(struct weston_compositor *compositor, void *repaint_data)
 {
 	struct drm_backend *b = to_drm_backend(compositor);
 	struct drm_pending_state *pending_state = repaint_data;
+	struct drm_backend *secondary;
+
+	wl_list_for_each(secondary, &b->secondary_list, secondary_link) {
+		drm_pending_state_free(secondary->repaint_data);
+		secondary->repaint_data = NULL;
+	}
 
 	drm_pending_state_free(pending_state);
 	drm_debug(b, "[repaint] cancel pending_state %p\n", pending_state);
@@ -685,8 +895,9 @@ static int
 drm_output_switch_mode(struct weston_output *output_base, struct weston_mode *mode)
 {
 	struct drm_output *output = to_drm_output(output_base);
-	struct drm_backend *b = to_drm_backend(output_base->compositor);
+	struct drm_backend *b = output->backend;
 	struct drm_mode *drm_mode = drm_output_choose_mode(output, mode);
+	bool same_size;
 
 	if (!drm_mode) {
 		weston_log("%s: invalid resolution %dx%d\n",
@@ -697,7 +908,11 @@ drm_output_switch_mode(struct weston_output *output_base, struct weston_mode *mo
 	if (&drm_mode->base == output->base.current_mode)
 		return 0;
 
+	same_size = drm_mode->base.width == output->base.current_mode->width &&
+		    drm_mode->base.height == output->base.current_mode->height;
+
 	output->base.current_mode->flags = 0;
+	output->inherited_mode_blob = 0;
 
 	output->base.current_mode = &drm_mode->base;
 	output->base.current_mode->flags =
@@ -711,6 +926,11 @@ drm_output_switch_mode(struct weston_output *output_base, struct weston_mode *mo
 	 */
 	b->state_invalid = true;
 
+	/* Only the refresh rate changes, like for idle refresh; the buffers
+	 * still fit. */
+	if (same_size)
+		return 0;
+
 	if (b->use_pixman) {
 		drm_output_fini_pixman(output);
 		if (drm_output_init_pixman(output, b) < 0) {
@@ -954,6 +1174,7 @@ drm_plane_destroy(struct drm_plane *plane)
 	drm_property_info_free(plane->props, WDRM_PLANE__COUNT);
 	weston_plane_release(&plane->base);
 	wl_list_remove(&plane->link);
+	free(plane->format_index);
 	free(plane);
 }
 
@@ -1079,6 +1300,81 @@ drm_output_init_backlight(struct drm_output *output)
 	}
 }
 
+/* Recreate the render buffers freed by drm_trim_memory(). Returns 1 if
+ * they had to be recreated, in which case they hold nothing yet and the
+ * next repaint needs to cover the whole output. */
+static int
+drm_output_restore_render(struct drm_output *output)
+{
+	struct drm_backend *b = output->backend;
+	int ret;
+
+	if (!output->render_trimmed)
+		return 0;
+
+	if (b->use_pixman)
+		ret = drm_output_init_pixman(output, b);
+	else
+		ret = drm_output_init_egl(output, b);
+	if (ret < 0) {
+		weston_log("failed to restore render buffers of %s\n",
+			   output->base.name);
+		return -1;
+	}
+
+	output->render_trimmed = false;
+	b->state_invalid = true;
+
+	return 1;
+}
+
+/* Free the render buffers of an output which is off and has nothing in
+ * flight, they are recreated by drm_output_restore_render() when it is
+ * turned on again. */
+static void
+drm_output_trim_render(struct drm_output *output)
+{
+	struct drm_backend *b = output->backend;
+
+	if (output->virtual || output->render_trimmed ||
+	    output->state_cur->dpms != WESTON_DPMS_OFF ||
+	    output->state_last || output->page_flip_pending ||
+	    output->atomic_complete_pending)
+		return;
+
+	if (b->use_pixman) {
+		drm_output_fini_pixman(output);
+	} else {
+		drm_output_release_mirrors(output);
+		drm_output_fini_egl(output);
+	}
+
+	output->render_trimmed = true;
+}
+
+static void
+drm_trim_memory(struct weston_compositor *compositor)
+{
+	struct drm_backend *b = to_drm_backend(compositor);
+	struct drm_backend *device;
+	struct weston_output *base;
+
+	wl_list_for_each(base, &compositor->output_list, link)
+		drm_output_trim_render(to_drm_output(base));
+
+	drm_backend_dmabuf_fb_cache_release(b);
+	drm_backend_shm_fb_ring_release(b);
+	drm_backend_test_cache_clear(b);
+	drm_backend_state_pool_fini(b);
+
+	wl_list_for_each(device, &b->secondary_list, secondary_link) {
+		drm_backend_dmabuf_fb_cache_release(device);
+		drm_backend_shm_fb_ring_release(device);
+		drm_backend_test_cache_clear(device);
+		drm_backend_state_pool_fini(device);
+	}
+}
+
 /**
  * Power output on or off
  *
@@ -1095,7 +1391,7 @@ static void
 drm_set_dpms(struct weston_output *output_base, enum dpms_enum level)
 {
 	struct drm_output *output = to_drm_output(output_base);
-	struct drm_backend *b = to_drm_backend(output_base->compositor);
+	struct drm_backend *b = output->backend;
 	struct drm_pending_state *pending_state = b->repaint_data;
 	struct drm_output_state *state;
 	int ret;
@@ -1105,6 +1401,14 @@ drm_set_dpms(struct weston_output *output_base, enum dpms_enum level)
 	if (output->state_cur->dpms == level)
 		return;
 
+	if (level == WESTON_DPMS_ON) {
+		ret = drm_output_restore_render(output);
+		if (ret < 0)
+			return;
+		if (ret > 0)
+			weston_output_damage(&output->base);
+	}
+
 	/* If we're being called during the repaint loop, then this is
 	 * simple: discard any previously-generated state, and create a new
 	 * state where we disable everything. When we come to flush, this
@@ -1210,6 +1514,8 @@ drm_output_init_pixman(struct drm_output *output, struct drm_backend *b)
 	unsigned int i;
 	const struct pixman_renderer_output_options options = {
 		.use_shadow = b->use_pixman_shadow,
+		.shadow_on_readback = b->pixman_shadow_on_readback,
+		.threaded_repaint = true,
 	};
 
 	switch (format) {
@@ -1241,8 +1547,13 @@ drm_output_init_pixman(struct drm_output *output, struct drm_backend *b)
 	if (pixman_renderer_output_create(&output->base, &options) < 0)
  		goto err;
 
-	weston_log("DRM: output %s %s shadow framebuffer.\n", output->base.name,
-		   b->use_pixman_shadow ? "uses" : "does not use");
+	if (b->pixman_shadow_on_readback)
+		weston_log("DRM: output %s uses a shadow framebuffer "
+			   "only for read-backs.\n", output->base.name);
+	else
+		weston_log("DRM: output %s %s shadow framebuffer.\n",
+			   output->base.name,
+			   b->use_pixman_shadow ? "uses" : "does not use");
 
 	pixman_region32_init_rect(&output->previous_damage,
 				  output->base.x, output->base.y, output->base.width, output->base.height);
@@ -1266,7 +1577,7 @@ err:
 static void
 drm_output_fini_pixman(struct drm_output *output)
 {
-	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_backend *b = output->backend;
 	unsigned int i;
 
 	/* Destroying the Pixman surface will destroy all our buffers,
@@ -1315,11 +1626,22 @@ static int
 drm_output_attach_head(struct weston_output *output_base,
 		       struct weston_head *head_base)
 {
-	struct drm_backend *b = to_drm_backend(output_base->compositor);
+	struct drm_output *output = to_drm_output(output_base);
+	struct drm_head *head = to_drm_head(head_base);
+	struct drm_backend *b;
 
 	if (wl_list_length(&output_base->head_list) >= MAX_CLONED_CONNECTORS)
 		return -1;
 
+	/* The output is driven by the KMS device of its heads, so clones
+	 * have to be on the same device. */
+	if (wl_list_empty(&output_base->head_list) && !output_base->enabled)
+		output->backend = head->backend;
+	else if (head->backend != output->backend)
+		return -1;
+
+	b = output->backend;
+
 	if (!output_base->enabled)
 		return 0;
 
@@ -1343,7 +1665,7 @@ static void
 drm_output_detach_head(struct weston_output *output_base,
 		       struct weston_head *head_base)
 {
-	struct drm_backend *b = to_drm_backend(output_base->compositor);
+	struct drm_backend *b = to_drm_output(output_base)->backend;
 
 	if (!output_base->enabled)
 		return;
@@ -1428,10 +1750,138 @@ drm_output_set_seat(struct weston_output *base,
 				     seat ? seat : "");
 }
 
+/** Enable or disable variable refresh rate as configured and supported
+ *
+ * Adaptive sync needs the atomic API, and every head of the output to be
+ * capable of it, since they all follow the same CRTC timings.
+ */
+static void
+drm_output_update_vrr(struct drm_output *output)
+{
+	struct drm_backend *b = output->backend;
+	struct weston_head *head_base;
+	bool capable;
+
+	capable = b->atomic_modeset && output->crtc_id != 0 &&
+		  output->props_crtc[WDRM_CRTC_VRR_ENABLED].prop_id != 0 &&
+		  !wl_list_empty(&output->base.head_list);
+
+	wl_list_for_each(head_base, &output->base.head_list, output_link)
+		if (!to_drm_head(head_base)->vrr_capable)
+			capable = false;
+
+	if (output->base.vrr_enabled == (output->vrr_requested && capable))
+		return;
+
+	output->base.vrr_enabled = output->vrr_requested && capable;
+	weston_log("Output %s: variable refresh rate %s\n", output->base.name,
+		   output->base.vrr_enabled ? "enabled" : "disabled");
+}
+
+static void
+drm_output_set_vrr(struct weston_output *base, bool enable)
+{
+	struct drm_output *output = to_drm_output(base);
+
+	output->vrr_requested = enable;
+
+	if (output->base.enabled)
+		drm_output_update_vrr(output);
+}
+
+static void
+drm_output_set_fb_compression(struct weston_output *base, bool enable)
+{
+	struct drm_output *output = to_drm_output(base);
+
+	output->fb_compression = enable;
+}
+
+static void
+drm_output_set_swapchain_depth(struct weston_output *base, int depth)
+{
+	struct drm_output *output = to_drm_output(base);
+
+	/* Rendering needs a buffer besides the one scanned out. */
+	output->swapchain_depth = depth > 0 ? MAX(depth, 2) : 0;
+}
+
+static void
+drm_output_set_mirror_source(struct weston_output *base, const char *name)
+{
+	struct drm_output *output = to_drm_output(base);
+
+	free(output->mirror_source);
+	output->mirror_source = name ? strdup(name) : NULL;
+}
+
+static void
+drm_output_set_dynamic_resolution(struct weston_output *base, int min_percent)
+{
+	struct drm_output *output = to_drm_output(base);
+
+	output->dynamic_resolution_min = MIN(MAX(min_percent, 0), 100) / 100.0f;
+}
+
+/** Repaint the tiles of a tiled display together
+ *
+ * Each tile is a connector of its own, driven by its own CRTC and output.
+ * Putting the outputs in one repaint group has them repaint in the same
+ * cycle, so that their page flips go in one commit and the halves of the
+ * monitor do not tear against each other.
+ */
+static void
+drm_output_init_tile(struct drm_output *output)
+{
+	struct weston_head *head_base;
+	struct drm_head *head;
+	uint32_t group_id = 0;
+
+	wl_list_for_each(head_base, &output->base.head_list, output_link) {
+		head = to_drm_head(head_base);
+		if (head->tile.group_id == 0 ||
+		    (group_id != 0 && head->tile.group_id != group_id))
+			return;
+		group_id = head->tile.group_id;
+	}
+
+	if (group_id == 0)
+		return;
+
+	head = to_drm_head(weston_output_get_first_head(&output->base));
+	output->base.repaint_group = group_id;
+	weston_log("Output %s: tile %u,%u of %ux%u in group %u\n",
+		   output->base.name, head->tile.loc_h, head->tile.loc_v,
+		   head->tile.num_h, head->tile.num_v, group_id);
+}
+
+/* Only the primary plane of a GL rendered output can scale the frame up,
+ * and legacy page flips cannot change the source rectangle. */
+static void
+drm_output_init_dynamic_resolution(struct drm_output *output)
+{
+	struct drm_backend *b = output->backend;
+
+	if (output->dynamic_resolution_min <= 0.0f)
+		return;
+
+	if (b->use_pixman || !b->atomic_modeset) {
+		weston_log("Output %s: dynamic resolution needs the GL "
+			   "renderer and atomic modesetting\n",
+			   output->base.name);
+		return;
+	}
+
+	weston_output_set_dynamic_resolution(&output->base,
+					     output->dynamic_resolution_min);
+	weston_log("Output %s: dynamic resolution down to %.0f%%\n",
+		   output->base.name, output->dynamic_resolution_min * 100.0f);
+}
+
 static int
 drm_output_init_gamma_size(struct drm_output *output)
 {
-	struct drm_backend *backend = to_drm_backend(output->base.compositor);
+	struct drm_backend *backend = output->backend;
 	drmModeCrtc *crtc;
 
 	assert(output->base.compositor);
@@ -1502,7 +1952,7 @@ drm_output_pick_crtc(struct drm_output *output, drmModeRes *resources)
 	int i;
 	bool match;
 
-	backend = to_drm_backend(output->base.compositor);
+	backend = output->backend;
 
 	/* This algorithm ignores drmModeEncoder::possible_clones restriction,
 	 * because it is more often set wrong than not in the kernel. */
@@ -1549,7 +1999,8 @@ drm_output_pick_crtc(struct drm_output *output, drmModeRes *resources)
 				 compositor_link) {
 			head = to_drm_head(base);
 
-			if (head->base.output == &output->base)
+			if (head->backend != backend ||
+			    head->base.output == &output->base)
 				continue;
 
 			if (weston_head_is_enabled(&head->base))
@@ -1595,6 +2046,61 @@ drm_output_pick_crtc(struct drm_output *output, drmModeRes *resources)
 	return -1;
 }
 
+/** Take over the mode the CRTC is already running
+ *
+ * @param output The output, with its CRTC and current mode picked.
+ * @param props The current properties of the CRTC.
+ *
+ * The firmware or a boot splash may have lit up the CRTC with the very mode
+ * and connector routing the output is going to use. Remembering the mode
+ * blob of the CRTC lets the first atomic commit keep it, so the kernel only
+ * flips the primary plane instead of doing a full modeset.
+ */
+static void
+drm_output_inherit_mode(struct drm_output *output,
+			drmModeObjectProperties *props)
+{
+	struct drm_backend *b = output->backend;
+	struct drm_mode *mode = to_drm_mode(output->base.current_mode);
+	drmModePropertyBlobRes *blob;
+	struct drm_head *head;
+	uint64_t blob_id;
+
+	output->inherited_mode_blob = 0;
+
+	if (!b->atomic_modeset || !mode)
+		return;
+
+	wl_list_for_each(head, &output->base.head_list, base.output_link) {
+		if (head->inherited_crtc_id != output->crtc_id)
+			return;
+	}
+
+	if (drm_property_get_value(&output->props_crtc[WDRM_CRTC_ACTIVE],
+				   props, 0) == 0)
+		return;
+
+	blob_id = drm_property_get_value(&output->props_crtc[WDRM_CRTC_MODE_ID],
+					 props, 0);
+	if (blob_id == 0)
+		return;
+
+	blob = drmModeGetPropertyBlob(b->drm.fd, blob_id);
+	if (!blob)
+		return;
+
+	if (blob->length == sizeof mode->mode_info &&
+	    memcmp(blob->data, &mode->mode_info, sizeof mode->mode_info) == 0)
+		output->inherited_mode_blob = blob_id;
+
+	drmModeFreePropertyBlob(blob);
+
+	if (output->inherited_mode_blob)
+		weston_log("Output '%s': keeping mode %s set up by the previous "
+			   "DRM master\n", output->base.name,
+			   mode->mode_info.name);
+}
+
 /** Allocate a CRTC for the output
  *
  * @param output The output with no allocated CRTC.
@@ -1611,7 +2117,7 @@ drm_output_pick_crtc(struct drm_output *output, drmModeRes *resources)
 static int
 drm_output_init_crtc(struct drm_output *output, drmModeRes *resources)
 {
-	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_backend *b = output->backend;
 	drmModeObjectPropertiesPtr props;
 	int i;
 
@@ -1635,6 +2141,13 @@ drm_output_init_crtc(struct drm_output *output, drmModeRes *resources)
 	}
 	drm_property_info_populate(b, crtc_props, output->props_crtc,
 				   WDRM_CRTC__COUNT, props);
+	output->degamma_lut_size =
+		drm_property_get_value(&output->props_crtc[WDRM_CRTC_DEGAMMA_LUT_SIZE],
+				       props, 0);
+	output->gamma_lut_size =
+		drm_property_get_value(&output->props_crtc[WDRM_CRTC_GAMMA_LUT_SIZE],
+				       props, 0);
+	drm_output_inherit_mode(output, props);
 	drmModeFreeObjectProperties(props);
 
 	output->scanout_plane =
@@ -1653,10 +2166,12 @@ drm_output_init_crtc(struct drm_output *output, drmModeRes *resources)
 		output->scanout_plane->formats[0].format = output->gbm_format;
 
 	/* Failing to find a cursor plane is not fatal, as we'll fall back
-	 * to software cursor. */
-	output->cursor_plane =
-		drm_output_find_special_plane(b, output,
-					      WDRM_PLANE_TYPE_CURSOR);
+	 * to software cursor. Cursor buffers only exist on the primary
+	 * device. */
+	if (!drm_backend_is_secondary(b))
+		output->cursor_plane =
+			drm_output_find_special_plane(b, output,
+						      WDRM_PLANE_TYPE_CURSOR);
 
 	wl_array_remove_uint32(&b->unused_crtcs, output->crtc_id);
 
@@ -1678,7 +2193,7 @@ err_crtc:
 static void
 drm_output_fini_crtc(struct drm_output *output)
 {
-	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_backend *b = output->backend;
 	uint32_t *unused;
 
 	/* If the compositor is already shutting down, the planes have already
@@ -1707,6 +2222,7 @@ drm_output_fini_crtc(struct drm_output *output)
 	}
 
 	drm_property_info_free(output->props_crtc, WDRM_CRTC__COUNT);
+	output->base.vrr_enabled = false;
 
 	assert(output->crtc_id != 0);
 
@@ -1717,7 +2233,9 @@ drm_output_fini_crtc(struct drm_output *output)
 	b->state_invalid = true;
 
 	output->crtc_id = 0;
+	output->inherited_mode_blob = 0;
 	output->cursor_plane = NULL;
+	output->base.cursor_plane = NULL;
 	output->scanout_plane = NULL;
 }
 
@@ -1725,7 +2243,7 @@ static int
 drm_output_enable(struct weston_output *base)
 {
 	struct drm_output *output = to_drm_output(base);
-	struct drm_backend *b = to_drm_backend(base->compositor);
+	struct drm_backend *b = output->backend;
 	drmModeRes *resources;
 	int ret;
 
@@ -1758,20 +2276,28 @@ drm_output_enable(struct weston_output *base)
 	}
 
 	drm_output_init_backlight(output);
+	drm_output_init_writeback(output);
+	drm_output_update_vrr(output);
+	drm_output_init_dynamic_resolution(output);
+	drm_output_init_tile(output);
 
 	output->base.start_repaint_loop = drm_output_start_repaint_loop;
 	output->base.repaint = drm_output_repaint;
+	output->base.repaint_cursor = drm_output_repaint_cursor;
 	output->base.assign_planes = drm_assign_planes;
 	output->base.set_dpms = drm_set_dpms;
 	output->base.switch_mode = drm_output_switch_mode;
 	output->base.set_gamma = drm_output_set_gamma;
+	output->base.set_color_transform = drm_output_set_color_transform;
 
-	if (output->cursor_plane)
+	if (output->cursor_plane) {
 		weston_compositor_stack_plane(b->compositor,
 					      &output->cursor_plane->base,
 					      NULL);
-	else
+		output->base.cursor_plane = &output->cursor_plane->base;
+	} else {
 		b->cursors_are_broken = true;
+	}
 
 	weston_compositor_stack_plane(b->compositor,
 				      &output->scanout_plane->base,
@@ -1793,12 +2319,21 @@ static void
 drm_output_deinit(struct weston_output *base)
 {
 	struct drm_output *output = to_drm_output(base);
-	struct drm_backend *b = to_drm_backend(base->compositor);
+	struct drm_backend *b = output->backend;
 
-	if (b->use_pixman)
+	drm_output_fini_writeback(output);
+	drm_output_fini_color_transform(output);
+	weston_output_set_dynamic_resolution(base, 0.0f);
+	output->base.repaint_group = 0;
+
+	if (output->render_trimmed) {
+		output->render_trimmed = false;
+	} else if (b->use_pixman) {
 		drm_output_fini_pixman(output);
-	else
+	} else {
+		drm_output_release_mirrors(output);
 		drm_output_fini_egl(output);
+	}
 
 	/* Since our planes are no longer in use anywhere, remove their base
 	 * weston_plane's link from the plane stacking list, unless we're
@@ -1826,7 +2361,7 @@ static void
 drm_output_destroy(struct weston_output *base)
 {
 	struct drm_output *output = to_drm_output(base);
-	struct drm_backend *b = to_drm_backend(base->compositor);
+	struct drm_backend *b = output->backend;
 
 	assert(!output->virtual);
 
@@ -1849,6 +2384,7 @@ drm_output_destroy(struct weston_output *base)
 	assert(!output->state_last);
 	drm_output_state_free(output->state_cur);
 
+	free(output->mirror_source);
 	free(output);
 }
 
@@ -2045,18 +2581,34 @@ drm_head_log_info(struct drm_head *head, const char *msg)
 /** Update connector and monitor information
  *
  * @param head The head to update.
+ * @param probe Whether the connector is known to have changed.
  *
  * Re-reads the DRM property lists for the connector and updates monitor
  * information and connection status. This may schedule a heads changed call
  * to the user.
+ *
+ * Probing a connector reads the EDID and the mode list from the monitor,
+ * which can take a long time, e.g. over DP MST. Without @c probe, the state
+ * the kernel cached is read first, and the connector is only probed when
+ * its connection status differs from what the head has.
  */
 static void
-drm_head_update_info(struct drm_head *head)
+drm_head_update_info(struct drm_head *head, bool probe)
 {
-	drmModeConnector *connector;
+	int fd = head->backend->drm.fd;
+	drmModeConnector *connector = NULL;
 
-	connector = drmModeGetConnector(head->backend->drm.fd,
-					head->connector_id);
+	if (!probe) {
+		connector = drmModeGetConnectorCurrent(fd, head->connector_id);
+		if (connector &&
+		    connector->connection != head->connector->connection) {
+			drmModeFreeConnector(connector);
+			connector = NULL;
+		}
+	}
+
+	if (!connector)
+		connector = drmModeGetConnector(fd, head->connector_id);
 	if (!connector) {
 		weston_log("DRM: getting connector info for '%s' failed.\n",
 			   head->base.name);
@@ -2068,6 +2620,10 @@ drm_head_update_info(struct drm_head *head)
 
 	if (head->base.device_changed)
 		drm_head_log_info(head, "updated");
+
+	/* A different monitor may have been plugged in. */
+	if (head->base.output && head->base.output->enabled)
+		drm_output_update_vrr(to_drm_output(head->base.output));
 }
 
 /**
@@ -2101,6 +2657,19 @@ drm_head_create(struct drm_backend *backend, uint32_t connector_id,
 	if (!name)
 		goto err_alloc;
 
+	/* Connector names repeat between devices. */
+	if (drm_backend_is_secondary(backend)) {
+		char *device_name;
+		int ret;
+
+		ret = asprintf(&device_name, "%s-%s",
+			       udev_device_get_sysname(drm_device), name);
+		free(name);
+		if (ret < 0)
+			goto err_alloc;
+		name = device_name;
+	}
+
 	weston_head_init(&head->base, name);
 	free(name);
 
@@ -2177,6 +2746,7 @@ drm_output_create(struct weston_compositor *compositor, const char *name)
 		return NULL;
 
 	output->backend = b;
+	output->fb_compression = true;
 #ifdef BUILD_DRM_GBM
 	output->gbm_bo_flags = GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING;
 #endif
@@ -2220,6 +2790,9 @@ drm_backend_create_heads(struct drm_backend *b, struct udev_device *drm_device)
 	for (i = 0; i < resources->count_connectors; i++) {
 		uint32_t connector_id = resources->connectors[i];
 
+		if (drm_backend_add_writeback(b, connector_id))
+			continue;
+
 		head = drm_head_create(b, connector_id, drm_device);
 		if (!head) {
 			weston_log("DRM: failed to create head for connector %d.\n",
@@ -2254,8 +2827,8 @@ drm_backend_update_heads(struct drm_backend *b, struct udev_device *drm_device)
 
 		head = drm_head_find_by_connector(b, connector_id);
 		if (head) {
-			drm_head_update_info(head);
-		} else {
+			drm_head_update_info(head, false);
+		} else if (!drm_backend_add_writeback(b, connector_id)) {
 			head = drm_head_create(b, connector_id, drm_device);
 			if (!head)
 				weston_log("DRM: failed to create head for hot-added connector %d.\n",
@@ -2269,6 +2842,8 @@ drm_backend_update_heads(struct drm_backend *b, struct udev_device *drm_device)
 		bool removed = true;
 
 		head = to_drm_head(base);
+		if (head->backend != b)
+			continue;
 
 		for (i = 0; i < resources->count_connectors; i++) {
 			if (resources->connectors[i] == head->connector_id) {
@@ -2359,6 +2934,38 @@ udev_event_is_hotplug(struct drm_backend *b, struct udev_device *device)
 	return strcmp(val, "1") == 0;
 }
 
+/* The kernel names the connector of a hotplug event when it knows it. */
+static int
+udev_event_get_connector(struct udev_device *device, uint32_t *connector_id)
+{
+	const char *val;
+	int id;
+
+	val = udev_device_get_property_value(device, "CONNECTOR");
+	if (!val || !safe_strtoint(val, &id))
+		return 0;
+
+	*connector_id = id;
+
+	return 1;
+}
+
+static void
+drm_backend_update_connector(struct drm_backend *b, uint32_t connector_id,
+			     struct udev_device *drm_device)
+{
+	struct drm_head *head;
+
+	/* New connectors, e.g. MST, need the connector list. */
+	head = drm_head_find_by_connector(b, connector_id);
+	if (!head) {
+		drm_backend_update_heads(b, drm_device);
+		return;
+	}
+
+	drm_head_update_info(head, true);
+}
+
 static int
 udev_event_is_conn_prop_change(struct drm_backend *b,
 			       struct udev_device *device,
@@ -2388,16 +2995,28 @@ static int
 udev_drm_event(int fd, uint32_t mask, void *data)
 {
 	struct drm_backend *b = data;
+	struct drm_backend *device = NULL;
+	struct drm_backend *secondary;
 	struct udev_device *event;
 	uint32_t conn_id, prop_id;
 
 	event = udev_monitor_receive_device(b->udev_monitor);
 
-	if (udev_event_is_hotplug(b, event)) {
-		if (udev_event_is_conn_prop_change(b, event, &conn_id, &prop_id))
-			drm_backend_update_conn_props(b, conn_id, prop_id);
+	if (udev_event_is_hotplug(b, event))
+		device = b;
+
+	wl_list_for_each(secondary, &b->secondary_list, secondary_link)
+		if (udev_event_is_hotplug(secondary, event))
+			device = secondary;
+
+	if (device) {
+		if (udev_event_is_conn_prop_change(device, event,
+						   &conn_id, &prop_id))
+			drm_backend_update_conn_props(device, conn_id, prop_id);
+		else if (udev_event_get_connector(event, &conn_id))
+			drm_backend_update_connector(device, conn_id, event);
 		else
-			drm_backend_update_heads(b, event);
+			drm_backend_update_heads(device, event);
 	}
 
 	udev_device_unref(event);
@@ -2409,6 +3028,7 @@ static void
 drm_destroy(struct weston_compositor *ec)
 {
 	struct drm_backend *b = to_drm_backend(ec);
+	struct drm_backend *secondary, *tmp;
 	struct weston_head *base, *next;
 
 	udev_input_destroy(&b->input);
@@ -2420,6 +3040,13 @@ drm_destroy(struct weston_compositor *ec)
 
 	destroy_sprites(b);
 
+	wl_list_for_each(secondary, &b->secondary_list, secondary_link) {
+		wl_event_source_remove(secondary->drm_source);
+		secondary->shutting_down = true;
+		destroy_sprites(secondary);
+		secondary->debug = NULL;
+	}
+
 	weston_log_scope_destroy(b->debug);
 	b->debug = NULL;
 	weston_compositor_shutdown(ec);
@@ -2427,6 +3054,14 @@ drm_destroy(struct weston_compositor *ec)
 	wl_list_for_each_safe(base, next, &ec->head_list, compositor_link)
 		drm_head_destroy(to_drm_head(base));
 
+	drm_backend_dmabuf_fb_cache_release(b);
+	drm_backend_shm_fb_ring_release(b);
+	drm_backend_destroy_writebacks(b);
+
+	wl_list_for_each_safe(secondary, tmp, &b->secondary_list,
+			      secondary_link)
+		drm_backend_destroy_secondary(secondary);
+
 #ifdef BUILD_DRM_GBM
 	if (b->gbm)
 		gbm_device_destroy(b->gbm);
@@ -2441,6 +3076,7 @@ drm_destroy(struct weston_compositor *ec)
 
 	close(b->drm.fd);
 	free(b->drm.filename);
+	drm_backend_state_pool_fini(b);
 	free(b);
 }
 
@@ -2449,6 +3085,7 @@ session_notify(struct wl_listener *listener, void *data)
 {
 	struct weston_compositor *compositor = data;
 	struct drm_backend *b = to_drm_backend(compositor);
+	struct drm_backend *secondary;
 	struct drm_plane *plane;
 	struct drm_output *output;
 
@@ -2457,6 +3094,8 @@ session_notify(struct wl_listener *listener, void *data)
 		weston_compositor_wake(compositor);
 		weston_compositor_damage_all(compositor);
 		b->state_invalid = true;
+		wl_list_for_each(secondary, &b->secondary_list, secondary_link)
+			secondary->state_invalid = true;
 		udev_input_enable(&b->input);
 	} else {
 		weston_log("deactivating session\n");
@@ -2474,9 +3113,11 @@ session_notify(struct wl_listener *listener, void *data)
 
 		wl_list_for_each(output, &compositor->output_list, base.link) {
 			output->base.repaint_needed = false;
+			/* whoever takes over may replace the mode blob */
+			output->inherited_mode_blob = 0;
 			if (output->cursor_plane)
-				drmModeSetCursor(b->drm.fd, output->crtc_id,
-						 0, 0, 0);
+				drmModeSetCursor(output->backend->drm.fd,
+						 output->crtc_id, 0, 0, 0);
 		}
 
 		output = container_of(compositor->output_list.next,
@@ -2687,6 +3328,145 @@ open_specific_drm_device(struct drm_backend *b, const char *name)
 	return device;
 }
 
+static void
+drm_backend_destroy_secondary(struct drm_backend *secondary)
+{
+	struct weston_launcher *launcher = secondary->compositor->launcher;
+
+	drm_backend_destroy_writebacks(secondary);
+	wl_array_release(&secondary->unused_crtcs);
+
+	weston_launcher_close(launcher, secondary->drm.fd);
+	free(secondary->drm.filename);
+
+	wl_list_remove(&secondary->secondary_link);
+	drm_backend_state_pool_fini(secondary);
+	free(secondary);
+}
+
+/**
+ * Drive the displays of an additional KMS device
+ *
+ * The device gets a drm_backend of its own, for its planes, CRTCs, heads and
+ * page flip events. The renderer stays on the primary device though: GL
+ * renders into linear buffers the additional device imports, Pixman into
+ * dumb buffers of the additional device. Client buffers, which are imported
+ * on the primary device only, are never scanned out there.
+ *
+ * @param b The primary DRM backend
+ * @param name DRM device name, like "card1"
+ * @returns 0 on success, -1 on failure.
+ */
+static int
+drm_backend_add_secondary(struct drm_backend *b, const char *name)
+{
+	struct weston_compositor *compositor = b->compositor;
+	struct wl_event_loop *loop;
+	struct udev_device *drm_device;
+	struct drm_backend *secondary;
+	struct weston_head *base, *next;
+
+	secondary = zalloc(sizeof *secondary);
+	if (!secondary)
+		return -1;
+	drm_backend_state_pool_init(secondary);
+
+	secondary->compositor = compositor;
+	secondary->primary = b;
+	secondary->udev = b->udev;
+	secondary->debug = b->debug;
+	secondary->state_invalid = true;
+	secondary->drm.fd = -1;
+	secondary->gbm_format = b->gbm_format;
+	secondary->use_pixman = b->use_pixman;
+	secondary->use_pixman_shadow = b->use_pixman_shadow;
+	secondary->pixman_shadow_on_readback = b->pixman_shadow_on_readback;
+	secondary->pageflip_timeout = b->pageflip_timeout;
+	wl_array_init(&secondary->unused_crtcs);
+	wl_list_init(&secondary->plane_list);
+	wl_list_init(&secondary->dmabuf_fb_cache_list);
+	wl_list_init(&secondary->shm_fb_ring_list);
+	wl_list_init(&secondary->writeback_list);
+	wl_list_init(&secondary->secondary_list);
+	wl_list_init(&secondary->secondary_link);
+
+	drm_device = open_specific_drm_device(secondary, name);
+	if (!drm_device) {
+		free(secondary);
+		return -1;
+	}
+
+	if (secondary->drm.devnum == b->drm.devnum) {
+		weston_log("DRM: %s is the primary device already.\n", name);
+		goto err_device;
+	}
+
+	if (init_kms_caps(secondary) < 0)
+		goto err_device;
+
+	/* Only renderer buffers are shown on the device. */
+	secondary->sprites_are_broken = true;
+	secondary->cursors_are_broken = true;
+
+	create_sprites(secondary);
+
+	if (drm_backend_create_heads(secondary, drm_device) < 0) {
+		weston_log("Failed to create heads for %s\n",
+			   secondary->drm.filename);
+		goto err_sprites;
+	}
+
+	drm_backend_create_faked_zpos(secondary);
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	secondary->drm_source =
+		wl_event_loop_add_fd(loop, secondary->drm.fd,
+				     WL_EVENT_READABLE, on_drm_input,
+				     secondary);
+	if (!secondary->drm_source)
+		goto err_heads;
+
+	wl_list_insert(b->secondary_list.prev, &secondary->secondary_link);
+	udev_device_unref(drm_device);
+
+	weston_log("DRM: driving outputs of additional device %s\n",
+		   secondary->drm.filename);
+
+	return 0;
+
+err_heads:
+	wl_list_for_each_safe(base, next, &compositor->head_list,
+			      compositor_link) {
+		if (to_drm_head(base)->backend == secondary)
+			drm_head_destroy(to_drm_head(base));
+	}
+err_sprites:
+	destroy_sprites(secondary);
+err_device:
+	udev_device_unref(drm_device);
+	drm_backend_destroy_secondary(secondary);
+	return -1;
+}
+
+static void
+drm_backend_add_secondaries(struct drm_backend *b, const char *devices)
+{
+	char *names, *name, *saveptr;
+
+	names = strdup(devices);
+	if (!names)
+		return;
+
+	for (name = strtok_r(names, ",", &saveptr); name;
+	     name = strtok_r(NULL, ",", &saveptr)) {
+		if (drm_backend_add_secondary(b, name) < 0)
+			weston_log("DRM: not using additional device '%s'\n",
+				   name);
+	}
+
+	free(names);
+}
+
 static void
 planes_binding(struct weston_keyboard *keyboard, const struct timespec *time,
 	       uint32_t key, void *data)
@@ -2729,7 +3509,7 @@ recorder_frame_notify(struct wl_listener *listener, void *data)
 
 	output = container_of(listener, struct drm_output,
 			      recorder_frame_listener);
-	b = to_drm_backend(output->base.compositor);
+	b = output->backend;
 
 	if (!output->recorder)
 		return;
@@ -2823,6 +3603,11 @@ static const struct weston_drm_output_api api = {
 	drm_output_set_mode,
 	drm_output_set_gbm_format,
 	drm_output_set_seat,
+	drm_output_set_vrr,
+	drm_output_set_fb_compression,
+	drm_output_set_dynamic_resolution,
+	drm_output_set_mirror_source,
+	drm_output_set_swapchain_depth,
 };
 
 static struct drm_backend *
@@ -2848,15 +3633,20 @@ drm_backend_create(struct weston_compositor *compositor,
 	b = zalloc(sizeof *b);
 	if (b == NULL)
 		return NULL;
+	drm_backend_state_pool_init(b);
 
 	b->state_invalid = true;
 	b->drm.fd = -1;
+	b->primary = b;
+	wl_list_init(&b->secondary_list);
+	wl_list_init(&b->secondary_link);
 	wl_array_init(&b->unused_crtcs);
 
 	b->compositor = compositor;
 	b->use_pixman = config->use_pixman;
 	b->pageflip_timeout = config->pageflip_timeout;
 	b->use_pixman_shadow = config->use_pixman_shadow;
+	b->pixman_shadow_on_readback = config->pixman_shadow_on_readback;
 
 	b->debug = weston_compositor_add_log_scope(compositor, "drm-backend",
 						   "Debug messages from DRM/KMS backend\n",
@@ -2887,6 +3677,10 @@ drm_backend_create(struct weston_compositor *compositor,
 	b->session_listener.notify = session_notify;
 	wl_signal_add(&compositor->session_signal, &b->session_listener);
 
+	/* Let the launcher get the input devices while KMS and the renderer
+	 * are set up, instead of one by one in udev_input_init(). */
+	udev_input_prefetch_devices(compositor, b->udev, seat_id);
+
 	if (config->specific_device)
 		drm_device = open_specific_drm_device(b, config->specific_device);
 	else
@@ -2920,10 +3714,14 @@ drm_backend_create(struct weston_compositor *compositor,
 	b->base.create_output = drm_output_create;
 	b->base.device_changed = drm_device_changed;
 	b->base.can_scanout_dmabuf = drm_can_scanout_dmabuf;
+	b->base.trim_memory = drm_trim_memory;
 
 	weston_setup_vt_switch_bindings(compositor);
 
 	wl_list_init(&b->plane_list);
+	wl_list_init(&b->dmabuf_fb_cache_list);
+	wl_list_init(&b->shm_fb_ring_list);
+	wl_list_init(&b->writeback_list);
 	create_sprites(b);
 
 	if (udev_input_init(&b->input,
@@ -2941,6 +3739,9 @@ drm_backend_create(struct weston_compositor *compositor,
 	/* 'compute' faked zpos values in case HW doesn't expose any */
 	drm_backend_create_faked_zpos(b);
 
+	if (config->additional_devices)
+		drm_backend_add_secondaries(b, config->additional_devices);
+
 	/* A this point we have some idea of whether or not we have a working
 	 * cursor plane. */
 	if (!b->cursors_are_broken)
@@ -2982,6 +3783,10 @@ drm_backend_create(struct weston_compositor *compositor,
 					    renderer_switch_binding, b);
 
 	if (compositor->renderer->import_dmabuf) {
+		if (linux_dmabuf_set_main_device(compositor,
+						 b->drm.devnum) < 0)
+			weston_log("Error: setting the main dmabuf device "
+				   "failed.\n");
 		if (linux_dmabuf_setup(compositor) < 0)
 			weston_log("Error: initializing dmabuf "
 				   "support failed.\n");
@@ -2996,6 +3801,20 @@ drm_backend_create(struct weston_compositor *compositor,
 				   " synchronization support failed.\n");
 	}
 
+	if (b->async_page_flip) {
+		if (weston_tearing_control_setup(compositor) < 0)
+			weston_log("Error: initializing tearing control "
+				   "support failed.\n");
+	}
+
+	/* YUV buffers with other than BT.601 limited range content can only
+	 * be shown through planes with COLOR_ENCODING and COLOR_RANGE. */
+	if (b->atomic_modeset) {
+		if (weston_color_representation_setup(compositor) < 0)
+			weston_log("Error: initializing color representation "
+				   "support failed.\n");
+	}
+
 	if (b->atomic_modeset)
 		if (weston_compositor_enable_content_protection(compositor) < 0)
 			weston_log("Error: initializing content-protection "
@@ -3038,6 +3857,7 @@ err_launcher:
 	weston_launcher_destroy(compositor->launcher);
 err_compositor:
 	weston_compositor_shutdown(compositor);
+	drm_backend_state_pool_fini(b);
 	free(b);
 	return NULL;
 }
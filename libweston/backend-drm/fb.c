@@ -30,6 +30,7 @@
 #include "config.h"
 
 #include <stdint.h>
+#include <string.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -43,13 +44,44 @@
 #include "drm-internal.h"
 #include "linux-dmabuf.h"
 
+static void
+drm_fb_close_prime_import(struct drm_fb *fb)
+{
+	struct drm_gem_close gem_close = { 0 };
+	int i, j;
+
+	if (!fb->prime_import)
+		return;
+
+	for (i = 0; i < fb->num_planes; i++) {
+		if (fb->handles[i] == 0)
+			continue;
+
+		/* The planes of a dmabuf often share a GEM handle. */
+		for (j = 0; j < i; j++)
+			if (fb->handles[j] == fb->handles[i])
+				break;
+		if (j < i)
+			continue;
+
+		gem_close.handle = fb->handles[i];
+		drmIoctl(fb->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+	}
+	fb->prime_import = false;
+}
+
 static void
 drm_fb_destroy(struct drm_fb *fb)
 {
+	int i;
+
+	if (fb->exported) {
+		for (i = 0; i < fb->num_planes; i++)
+			close(fb->export_fds[i]);
+	}
 	if (fb->fb_id != 0)
 		drmModeRmFB(fb->fd, fb->fb_id);
-	weston_buffer_reference(&fb->buffer_ref, NULL);
-	weston_buffer_release_reference(&fb->buffer_release_ref, NULL);
+	drm_fb_close_prime_import(fb);
 	free(fb);
 }
 
@@ -172,7 +204,7 @@ drm_fb_create_dumb(struct drm_backend *b, int width, int height,
 	if (ret)
 		goto err_add_fb;
 
-	fb->map = mmap(NULL, fb->size, PROT_WRITE,
+	fb->map = mmap(NULL, fb->size, PROT_READ | PROT_WRITE,
 		       MAP_SHARED, b->drm.fd, map_arg.offset);
 	if (fb->map == MAP_FAILED)
 		goto err_add_fb;
@@ -211,13 +243,38 @@ drm_fb_destroy_gbm(struct gbm_bo *bo, void *data)
 static void
 drm_fb_destroy_dmabuf(struct drm_fb *fb)
 {
-	/* We deliberately do not close the GEM handles here; GBM manages
-	 * their lifetime through the BO. */
+	/* We deliberately do not close the GEM handles of a BO here; GBM
+	 * manages their lifetime. drm_fb_destroy() closes the ones of
+	 * drm_fb_import_dmabuf(). */
 	if (fb->bo)
 		gbm_bo_destroy(fb->bo);
 	drm_fb_destroy(fb);
 }
 
+/*
+ * The pixman renderer runs without a GBM device; the dmabuf planes are then
+ * imported straight into GEM handles, so they can still go on planes.
+ */
+static int
+drm_fb_import_dmabuf(struct drm_fb *fb, struct linux_dmabuf_buffer *dmabuf,
+		     struct drm_backend *backend)
+{
+	int i;
+
+	fb->num_planes = dmabuf->attributes.n_planes;
+	fb->prime_import = true;
+	for (i = 0; i < fb->num_planes; i++) {
+		if (drmPrimeFDToHandle(fb->fd, dmabuf->attributes.fd[i],
+				       &fb->handles[i]) != 0) {
+			drm_debug(backend, "\t\t\t[dmabuf] failed to import "
+				  "plane %d: %s\n", i, strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 static struct drm_fb *
 drm_fb_get_from_dmabuf(struct linux_dmabuf_buffer *dmabuf,
 		       struct drm_backend *backend, bool is_opaque)
@@ -290,7 +347,9 @@ drm_fb_get_from_dmabuf(struct linux_dmabuf_buffer *dmabuf,
 
 	/* The legacy FD-import path does not allow us to supply modifiers,
 	 * multiple planes, or buffer offsets. */
-	if (dmabuf->attributes.modifier[0] != DRM_FORMAT_MOD_INVALID ||
+	if (!backend->gbm) {
+		/* imported by drm_fb_import_dmabuf() below */
+	} else if (dmabuf->attributes.modifier[0] != DRM_FORMAT_MOD_INVALID ||
 	    dmabuf->attributes.n_planes > 1 ||
 	    dmabuf->attributes.offset[0] > 0) {
 #ifdef HAVE_GBM_FD_IMPORT
@@ -307,7 +366,7 @@ drm_fb_get_from_dmabuf(struct linux_dmabuf_buffer *dmabuf,
 				       GBM_BO_USE_SCANOUT);
 	}
 
-	if (!fb->bo)
+	if (backend->gbm && !fb->bo)
 		goto err_free;
 
 	fb->width = dmabuf->attributes.width;
@@ -347,29 +406,31 @@ drm_fb_get_from_dmabuf(struct linux_dmabuf_buffer *dmabuf,
 		goto err_free;
 	}
 
-#ifdef HAVE_GBM_MODIFIERS
-	fb->num_planes = dmabuf->attributes.n_planes;
-	for (i = 0; i < dmabuf->attributes.n_planes; i++) {
-		union gbm_bo_handle handle;
-
-	        handle = gbm_bo_get_handle_for_plane(fb->bo, i);
-		if (handle.s32 == -1)
+	if (!fb->bo) {
+		if (drm_fb_import_dmabuf(fb, dmabuf, backend) < 0)
 			goto err_free;
-		fb->handles[i] = handle.u32;
-	}
+	} else {
+#ifdef HAVE_GBM_MODIFIERS
+		fb->num_planes = dmabuf->attributes.n_planes;
+		for (i = 0; i < dmabuf->attributes.n_planes; i++) {
+			union gbm_bo_handle handle;
+
+			handle = gbm_bo_get_handle_for_plane(fb->bo, i);
+			if (handle.s32 == -1)
+				goto err_free;
+			fb->handles[i] = handle.u32;
+		}
 #else /* NOT HAVE_GBM_MODIFIERS */
-	{
 		union gbm_bo_handle handle;
 
 		fb->num_planes = 1;
 
-	        handle = gbm_bo_get_handle(fb->bo);
-
+		handle = gbm_bo_get_handle(fb->bo);
 		if (handle.s32 == -1)
 			goto err_free;
 		fb->handles[0] = handle.u32;
-	}
 #endif /* NOT HAVE_GBM_MODIFIERS */
+	}
 
 
 	if (drm_fb_addfb(backend, fb) != 0)
@@ -382,6 +443,37 @@ err_free:
 	return NULL;
 }
 
+/*
+ * Buffers rendered for an additional KMS device are allocated on the primary
+ * device; the device scanning them out needs a GEM handle of its own. Only
+ * single-plane linear buffers are shared like this.
+ */
+static int
+drm_fb_import_prime(struct drm_fb *fb, struct drm_backend *backend)
+{
+	int prime_fd;
+	int ret;
+
+	if (fb->num_planes != 1)
+		return -1;
+
+	prime_fd = gbm_bo_get_fd(fb->bo);
+	if (prime_fd < 0)
+		return -1;
+
+	ret = drmPrimeFDToHandle(backend->drm.fd, prime_fd, &fb->handles[0]);
+	close(prime_fd);
+	if (ret != 0) {
+		weston_log("failed to import buffer into %s: %s\n",
+			   backend->drm.filename, strerror(errno));
+		return -1;
+	}
+
+	fb->prime_import = true;
+
+	return 0;
+}
+
 struct drm_fb *
 drm_fb_get_from_bo(struct gbm_bo *bo, struct drm_backend *backend,
 		   bool is_opaque, enum drm_fb_type type)
@@ -431,6 +523,10 @@ drm_fb_get_from_bo(struct gbm_bo *bo, struct drm_backend *backend,
 		goto err_free;
 	}
 
+	if (drm_backend_is_secondary(backend) &&
+	    drm_fb_import_prime(fb, backend) < 0)
+		goto err_free;
+
 	/* We can scanout an ARGB buffer if the surface's opaque region covers
 	 * the whole output, but we have to use XRGB as the KMS format code. */
 	if (is_opaque)
@@ -456,22 +552,329 @@ drm_fb_get_from_bo(struct gbm_bo *bo, struct drm_backend *backend,
 	return fb;
 
 err_free:
+	drm_fb_close_prime_import(fb);
 	free(fb);
 	return NULL;
 }
 
+/*
+ * Framebuffers imported from a client dmabuf are kept until the dmabuf is
+ * destroyed, as clients cycle through a small set of buffers and importing
+ * them again for every frame costs a GEM import and an addfb/rmfb pair per
+ * plane. Failed imports are remembered too, since the dmabuf attributes
+ * never change.
+ */
+struct drm_dmabuf_fb_cache {
+	struct drm_backend *backend;
+	struct linux_dmabuf_buffer *dmabuf;
+	struct wl_list link; /* drm_backend::dmabuf_fb_cache_list */
+
+	/* indexed by is_opaque, which may change the KMS format */
+	struct drm_fb *fb[2];
+	bool failed[2];
+};
+
 static void
-drm_fb_set_buffer(struct drm_fb *fb, struct weston_buffer *buffer,
-		  struct weston_buffer_release *buffer_release)
+drm_dmabuf_fb_cache_destroy(struct drm_dmabuf_fb_cache *cache)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(cache->fb); i++)
+		drm_fb_unref(cache->fb[i]);
+
+	linux_dmabuf_buffer_set_backend_user_data(cache->dmabuf, NULL, NULL);
+	wl_list_remove(&cache->link);
+	free(cache);
+}
+
+static void
+drm_dmabuf_fb_cache_handle_destroy(struct linux_dmabuf_buffer *dmabuf)
+{
+	drm_dmabuf_fb_cache_destroy(
+		linux_dmabuf_buffer_get_backend_user_data(dmabuf));
+}
+
+static struct drm_fb *
+drm_fb_get_from_dmabuf_cached(struct linux_dmabuf_buffer *dmabuf,
+			      struct drm_backend *backend, bool is_opaque)
+{
+	struct drm_dmabuf_fb_cache *cache;
+
+	cache = linux_dmabuf_buffer_get_backend_user_data(dmabuf);
+	if (!cache) {
+		cache = zalloc(sizeof *cache);
+		if (!cache)
+			return drm_fb_get_from_dmabuf(dmabuf, backend,
+						      is_opaque);
+
+		cache->backend = backend;
+		cache->dmabuf = dmabuf;
+		wl_list_insert(&backend->dmabuf_fb_cache_list, &cache->link);
+		linux_dmabuf_buffer_set_backend_user_data(dmabuf, cache,
+				drm_dmabuf_fb_cache_handle_destroy);
+	}
+
+	if (cache->failed[is_opaque]) {
+		drm_debug(backend, "\t\t\t[dmabuf] dmabuf %p previously "
+			  "failed import\n", dmabuf);
+		return NULL;
+	}
+
+	if (!cache->fb[is_opaque]) {
+		cache->fb[is_opaque] = drm_fb_get_from_dmabuf(dmabuf, backend,
+							      is_opaque);
+		if (!cache->fb[is_opaque]) {
+			cache->failed[is_opaque] = true;
+			return NULL;
+		}
+	}
+
+	return drm_fb_ref(cache->fb[is_opaque]);
+}
+
+/** Drop all cached dmabuf framebuffers
+ *
+ * Must be called before the GBM device goes away.
+ */
+void
+drm_backend_dmabuf_fb_cache_release(struct drm_backend *b)
 {
-	assert(fb->buffer_ref.buffer == NULL);
-	assert(fb->type == BUFFER_CLIENT || fb->type == BUFFER_DMABUF);
-	weston_buffer_reference(&fb->buffer_ref, buffer);
-	weston_buffer_release_reference(&fb->buffer_release_ref,
-					buffer_release);
+	struct drm_dmabuf_fb_cache *cache, *tmp;
+
+	wl_list_for_each_safe(cache, tmp, &b->dmabuf_fb_cache_list, link)
+		drm_dmabuf_fb_cache_destroy(cache);
 }
 #endif
 
+/*
+ * Small wl_shm surfaces, like clocks or tickers, are copied into a ring of
+ * dumb buffers so that they can go on overlay planes, instead of making the
+ * renderer composite the output for each of their updates. Each buffer of
+ * the ring remembers the damage it has not received yet, so only what
+ * changed since a buffer was last written is copied into it. Buffers still
+ * referenced by a plane state, shown or about to be, are not written.
+ */
+struct drm_shm_fb_ring {
+	struct drm_backend *backend;
+	struct weston_surface *surface;
+	struct wl_listener surface_destroy_listener;
+	struct wl_listener surface_commit_listener;
+	struct wl_list link; /* drm_backend::shm_fb_ring_list */
+
+	uint32_t format;
+	int width, height;
+	struct drm_fb *fb[DRM_SHM_FB_COUNT];
+	/* damage in buffer coordinates not copied into fb[i] yet */
+	pixman_region32_t stale[DRM_SHM_FB_COUNT];
+	int current; /* fb with the latest content, or -1 */
+};
+
+static void
+drm_shm_fb_ring_reset(struct drm_shm_fb_ring *ring)
+{
+	unsigned int i;
+
+	for (i = 0; i < DRM_SHM_FB_COUNT; i++) {
+		drm_fb_unref(ring->fb[i]);
+		ring->fb[i] = NULL;
+		pixman_region32_clear(&ring->stale[i]);
+	}
+	ring->current = -1;
+}
+
+static void
+drm_shm_fb_ring_destroy(struct drm_shm_fb_ring *ring)
+{
+	unsigned int i;
+
+	drm_shm_fb_ring_reset(ring);
+	for (i = 0; i < DRM_SHM_FB_COUNT; i++)
+		pixman_region32_fini(&ring->stale[i]);
+
+	wl_list_remove(&ring->surface_destroy_listener.link);
+	wl_list_remove(&ring->surface_commit_listener.link);
+	wl_list_remove(&ring->link);
+	free(ring);
+}
+
+static void
+drm_shm_fb_ring_surface_destroyed(struct wl_listener *listener, void *data)
+{
+	struct drm_shm_fb_ring *ring =
+		container_of(listener, struct drm_shm_fb_ring,
+			     surface_destroy_listener);
+
+	drm_shm_fb_ring_destroy(ring);
+}
+
+static void
+drm_shm_fb_ring_surface_committed(struct wl_listener *listener, void *data)
+{
+	struct drm_shm_fb_ring *ring =
+		container_of(listener, struct drm_shm_fb_ring,
+			     surface_commit_listener);
+	struct weston_surface *surface = ring->surface;
+	pixman_region32_t damage;
+	unsigned int i;
+
+	if (!pixman_region32_not_empty(&surface->damage))
+		return;
+
+	pixman_region32_init(&damage);
+	weston_surface_to_buffer_region(surface, &surface->damage, &damage);
+	for (i = 0; i < DRM_SHM_FB_COUNT; i++)
+		pixman_region32_union(&ring->stale[i], &ring->stale[i],
+				      &damage);
+	pixman_region32_fini(&damage);
+}
+
+static struct drm_shm_fb_ring *
+drm_shm_fb_ring_get(struct drm_backend *b, struct weston_surface *surface)
+{
+	struct drm_shm_fb_ring *ring;
+	struct wl_listener *listener;
+	unsigned int i;
+
+	listener = wl_signal_get(&surface->destroy_signal,
+				 drm_shm_fb_ring_surface_destroyed);
+	if (listener)
+		return container_of(listener, struct drm_shm_fb_ring,
+				    surface_destroy_listener);
+
+	ring = zalloc(sizeof *ring);
+	if (!ring)
+		return NULL;
+
+	ring->backend = b;
+	ring->surface = surface;
+	ring->current = -1;
+	for (i = 0; i < DRM_SHM_FB_COUNT; i++)
+		pixman_region32_init(&ring->stale[i]);
+
+	ring->surface_destroy_listener.notify =
+		drm_shm_fb_ring_surface_destroyed;
+	wl_signal_add(&surface->destroy_signal,
+		      &ring->surface_destroy_listener);
+	ring->surface_commit_listener.notify =
+		drm_shm_fb_ring_surface_committed;
+	wl_signal_add(&surface->commit_signal,
+		      &ring->surface_commit_listener);
+	wl_list_insert(&b->shm_fb_ring_list, &ring->link);
+
+	return ring;
+}
+
+static void
+drm_shm_fb_copy(struct drm_fb *fb, struct wl_shm_buffer *shm,
+		pixman_region32_t *region)
+{
+	const uint8_t *src = wl_shm_buffer_get_data(shm);
+	int src_stride = wl_shm_buffer_get_stride(shm);
+	int bytes_pp = fb->format->bpp / 8;
+	pixman_box32_t *rects;
+	int i, n, y;
+
+	pixman_region32_intersect_rect(region, region, 0, 0,
+				       fb->width, fb->height);
+	rects = pixman_region32_rectangles(region, &n);
+
+	wl_shm_buffer_begin_access(shm);
+	for (i = 0; i < n; i++) {
+		size_t len = (size_t)(rects[i].x2 - rects[i].x1) * bytes_pp;
+
+		for (y = rects[i].y1; y < rects[i].y2; y++)
+			memcpy((uint8_t *)fb->map + y * fb->strides[0] +
+			       rects[i].x1 * bytes_pp,
+			       src + y * src_stride + rects[i].x1 * bytes_pp,
+			       len);
+	}
+	wl_shm_buffer_end_access(shm);
+
+	pixman_region32_clear(region);
+}
+
+/** Get a scanout framebuffer with the content of a small wl_shm surface
+ *
+ * Copies the damage the chosen buffer of the surface's ring misses. Returns
+ * a new reference, or NULL if the surface is too large, has no suitable
+ * format, or all buffers of its ring are busy.
+ */
+struct drm_fb *
+drm_fb_get_from_shm_view(struct drm_backend *b, struct weston_view *ev)
+{
+	struct weston_surface *surface = ev->surface;
+	struct weston_buffer *buffer = surface->buffer_ref.buffer;
+	const struct pixel_format_info *info;
+	struct drm_shm_fb_ring *ring;
+	struct wl_shm_buffer *shm;
+	int i, idx = -1;
+
+	if (drm_backend_is_secondary(b) || !buffer)
+		return NULL;
+
+	shm = wl_shm_buffer_get(buffer->resource);
+	if (!shm || (int64_t)buffer->width * buffer->height > DRM_SHM_FB_MAX_PIXELS)
+		return NULL;
+
+	info = pixel_format_get_info_shm(wl_shm_buffer_get_format(shm));
+	if (!info || info->num_planes != 0 || !info->bpp || info->bpp % 8)
+		return NULL;
+
+	ring = drm_shm_fb_ring_get(b, surface);
+	if (!ring || ring->backend != b)
+		return NULL;
+
+	if (ring->format != info->format || ring->width != buffer->width ||
+	    ring->height != buffer->height) {
+		drm_shm_fb_ring_reset(ring);
+		ring->format = info->format;
+		ring->width = buffer->width;
+		ring->height = buffer->height;
+	}
+
+	/* Nothing changed since the latest copy, e.g. when testing planes
+	 * again in another proposal mode. */
+	if (ring->current >= 0 &&
+	    !pixman_region32_not_empty(&ring->stale[ring->current]))
+		return drm_fb_ref(ring->fb[ring->current]);
+
+	for (i = 0; i < DRM_SHM_FB_COUNT; i++) {
+		if (!ring->fb[i] || ring->fb[i]->refcnt == 1) {
+			idx = i;
+			break;
+		}
+	}
+	if (idx < 0) {
+		drm_debug(b, "\t\t\t[view] view %p: all SHM copies busy\n", ev);
+		return NULL;
+	}
+
+	if (!ring->fb[idx]) {
+		ring->fb[idx] = drm_fb_create_dumb(b, ring->width, ring->height,
+						   ring->format);
+		if (!ring->fb[idx])
+			return NULL;
+		pixman_region32_fini(&ring->stale[idx]);
+		pixman_region32_init_rect(&ring->stale[idx], 0, 0,
+					  ring->width, ring->height);
+	}
+
+	drm_shm_fb_copy(ring->fb[idx], shm, &ring->stale[idx]);
+	ring->current = idx;
+
+	return drm_fb_ref(ring->fb[idx]);
+}
+
+/** Drop the SHM copies of all surfaces, before the DRM fd goes away */
+void
+drm_backend_shm_fb_ring_release(struct drm_backend *b)
+{
+	struct drm_shm_fb_ring *ring, *tmp;
+
+	wl_list_for_each_safe(ring, tmp, &b->shm_fb_ring_list, link)
+		drm_shm_fb_ring_destroy(ring);
+}
+
 void
 drm_fb_unref(struct drm_fb *fb)
 {
@@ -492,6 +895,8 @@ drm_fb_unref(struct drm_fb *fb)
 		gbm_bo_destroy(fb->bo);
 		break;
 	case BUFFER_GBM_SURFACE:
+		if (fb->gbm_surface_held)
+			(*fb->gbm_surface_held)--;
 		gbm_surface_release_buffer(fb->gbm_surface, fb->bo);
 		break;
 	case BUFFER_DMABUF:
@@ -513,7 +918,7 @@ drm_can_scanout_dmabuf(struct weston_compositor *ec,
 	struct drm_backend *b = to_drm_backend(ec);
 	bool ret = false;
 
-	fb = drm_fb_get_from_dmabuf(dmabuf, b, true);
+	fb = drm_fb_get_from_dmabuf_cached(dmabuf, b, true);
 	if (fb)
 		ret = true;
 
@@ -527,15 +932,12 @@ struct drm_fb *
 drm_fb_get_from_view(struct drm_output_state *state, struct weston_view *ev)
 {
 	struct drm_output *output = state->output;
-	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_backend *b = output->backend;
 	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
 	bool is_opaque = weston_view_is_opaque(ev, &ev->transform.boundingbox);
 	struct linux_dmabuf_buffer *dmabuf;
 	struct drm_fb *fb;
 
-	if (ev->alpha != 1.0f)
-		return NULL;
-
 	if (!drm_view_transform_supported(ev, &output->base))
 		return NULL;
 
@@ -547,20 +949,20 @@ drm_fb_get_from_view(struct drm_output_state *state, struct weston_view *ev)
 		return NULL;
 
 	if (wl_shm_buffer_get(buffer->resource))
-		return NULL;
-
-	/* GBM is used for dmabuf import as well as from client wl_buffer. */
-	if (!b->gbm)
-		return NULL;
+		return drm_fb_get_from_shm_view(b, ev);
 
 	dmabuf = linux_dmabuf_buffer_get(buffer->resource);
 	if (dmabuf) {
-		fb = drm_fb_get_from_dmabuf(dmabuf, b, is_opaque);
+		fb = drm_fb_get_from_dmabuf_cached(dmabuf, b, is_opaque);
 		if (!fb)
 			return NULL;
 	} else {
 		struct gbm_bo *bo;
 
+		/* Client wl_buffers are imported through GBM. */
+		if (!b->gbm)
+			return NULL;
+
 		bo = gbm_bo_import(b->gbm, GBM_BO_IMPORT_WL_BUFFER,
 				   buffer->resource, GBM_BO_USE_SCANOUT);
 		if (!bo)
@@ -575,8 +977,6 @@ drm_fb_get_from_view(struct drm_output_state *state, struct weston_view *ev)
 
 	drm_debug(b, "\t\t\t[view] view %p format: %s\n",
 		  ev, fb->format->drm_format_name);
-	drm_fb_set_buffer(fb, buffer,
-			  ev->surface->buffer_release_ref.buffer_release);
 	return fb;
 }
 #endif
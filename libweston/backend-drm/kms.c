@@ -30,6 +30,7 @@
 #include "config.h"
 
 #include <stdint.h>
+#include <unistd.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -41,6 +42,7 @@
 #include "drm-internal.h"
 #include "pixel-formats.h"
 #include "presentation-time-server-protocol.h"
+#include "weston-trace.h"
 
 #ifndef DRM_FORMAT_MOD_LINEAR
 #define DRM_FORMAT_MOD_LINEAR 0
@@ -58,6 +60,48 @@ struct drm_property_enum_info plane_type_enums[] = {
 	},
 };
 
+struct drm_property_enum_info plane_color_encoding_enums[] = {
+	[WDRM_PLANE_COLOR_ENCODING_BT601] = {
+		.name = "ITU-R BT.601 YCbCr",
+	},
+	[WDRM_PLANE_COLOR_ENCODING_BT709] = {
+		.name = "ITU-R BT.709 YCbCr",
+	},
+	[WDRM_PLANE_COLOR_ENCODING_BT2020] = {
+		.name = "ITU-R BT.2020 YCbCr",
+	},
+};
+
+struct drm_property_enum_info plane_color_range_enums[] = {
+	[WDRM_PLANE_COLOR_RANGE_LIMITED] = {
+		.name = "YCbCr limited range",
+	},
+	[WDRM_PLANE_COLOR_RANGE_FULL] = {
+		.name = "YCbCr full range",
+	},
+};
+
+struct drm_property_enum_info plane_rotation_enums[] = {
+	[WDRM_PLANE_ROTATION_0] = {
+		.name = "rotate-0",
+	},
+	[WDRM_PLANE_ROTATION_90] = {
+		.name = "rotate-90",
+	},
+	[WDRM_PLANE_ROTATION_180] = {
+		.name = "rotate-180",
+	},
+	[WDRM_PLANE_ROTATION_270] = {
+		.name = "rotate-270",
+	},
+	[WDRM_PLANE_ROTATION_REFLECT_X] = {
+		.name = "reflect-x",
+	},
+	[WDRM_PLANE_ROTATION_REFLECT_Y] = {
+		.name = "reflect-y",
+	},
+};
+
 const struct drm_property_info plane_props[] = {
 	[WDRM_PLANE_TYPE] = {
 		.name = "type",
@@ -78,6 +122,22 @@ const struct drm_property_info plane_props[] = {
 	[WDRM_PLANE_IN_FENCE_FD] = { .name = "IN_FENCE_FD" },
 	[WDRM_PLANE_FB_DAMAGE_CLIPS] = { .name = "FB_DAMAGE_CLIPS" },
 	[WDRM_PLANE_ZPOS] = { .name = "zpos" },
+	[WDRM_PLANE_COLOR_ENCODING] = {
+		.name = "COLOR_ENCODING",
+		.enum_values = plane_color_encoding_enums,
+		.num_enum_values = WDRM_PLANE_COLOR_ENCODING__COUNT,
+	},
+	[WDRM_PLANE_COLOR_RANGE] = {
+		.name = "COLOR_RANGE",
+		.enum_values = plane_color_range_enums,
+		.num_enum_values = WDRM_PLANE_COLOR_RANGE__COUNT,
+	},
+	[WDRM_PLANE_ROTATION] = {
+		.name = "rotation",
+		.enum_values = plane_rotation_enums,
+		.num_enum_values = WDRM_PLANE_ROTATION__COUNT,
+	},
+	[WDRM_PLANE_ALPHA] = { .name = "alpha" },
 };
 
 struct drm_property_enum_info dpms_state_enums[] = {
@@ -147,11 +207,27 @@ const struct drm_property_info connector_props[] = {
 		.enum_values = panel_orientation_enums,
 		.num_enum_values = WDRM_PANEL_ORIENTATION__COUNT,
 	},
+	[WDRM_CONNECTOR_WRITEBACK_PIXEL_FORMATS] = {
+		.name = "WRITEBACK_PIXEL_FORMATS",
+	},
+	[WDRM_CONNECTOR_WRITEBACK_FB_ID] = { .name = "WRITEBACK_FB_ID", },
+	[WDRM_CONNECTOR_WRITEBACK_OUT_FENCE_PTR] = {
+		.name = "WRITEBACK_OUT_FENCE_PTR",
+	},
+	[WDRM_CONNECTOR_VRR_CAPABLE] = { .name = "vrr_capable", },
+	[WDRM_CONNECTOR_TILE] = { .name = "TILE", },
 };
 
 const struct drm_property_info crtc_props[] = {
 	[WDRM_CRTC_MODE_ID] = { .name = "MODE_ID", },
 	[WDRM_CRTC_ACTIVE] = { .name = "ACTIVE", },
+	[WDRM_CRTC_VRR_ENABLED] = { .name = "VRR_ENABLED", },
+	[WDRM_CRTC_OUT_FENCE_PTR] = { .name = "OUT_FENCE_PTR", },
+	[WDRM_CRTC_CTM] = { .name = "CTM", },
+	[WDRM_CRTC_DEGAMMA_LUT] = { .name = "DEGAMMA_LUT", },
+	[WDRM_CRTC_DEGAMMA_LUT_SIZE] = { .name = "DEGAMMA_LUT_SIZE", },
+	[WDRM_CRTC_GAMMA_LUT] = { .name = "GAMMA_LUT", },
+	[WDRM_CRTC_GAMMA_LUT_SIZE] = { .name = "GAMMA_LUT_SIZE", },
 };
 
 
@@ -358,7 +434,8 @@ drm_property_info_populate(struct drm_backend *b,
 			continue;
 		}
 
-		if (!(prop->flags & DRM_MODE_PROP_ENUM)) {
+		if (!(prop->flags & (DRM_MODE_PROP_ENUM |
+				     DRM_MODE_PROP_BITMASK))) {
 			weston_log("DRM: expected property %s to be an enum,"
 				   " but it is not; ignoring\n", prop->name);
 			drmModeFreeProperty(prop);
@@ -428,9 +505,121 @@ modifiers_ptr(struct drm_format_modifier_blob *blob)
 		(((char *)blob) + blob->modifiers_offset);
 }
 
+static inline uint32_t
+format_hash(uint32_t format)
+{
+	return (format * 0x9e3779b1u) >> 16;
+}
+
+static int
+compare_modifier(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Builds plane->format_index from formats[]. Without it, lookups search
+ * formats[], which is what planes with a single format do. */
+static void
+drm_plane_index_formats(struct drm_plane *plane)
+{
+	uint32_t size = 4;
+	uint32_t i, slot;
+
+	if (plane->count_formats > UINT16_MAX - 1)
+		return;
+
+	while (size < plane->count_formats * 2)
+		size *= 2;
+
+	plane->format_index = calloc(size, sizeof(*plane->format_index));
+	if (!plane->format_index)
+		return;
+	plane->format_index_mask = size - 1;
+
+	for (i = 0; i < plane->count_formats; i++) {
+		slot = format_hash(plane->formats[i].format) &
+		       plane->format_index_mask;
+		while (plane->format_index[slot] != 0)
+			slot = (slot + 1) & plane->format_index_mask;
+		plane->format_index[slot] = i + 1;
+	}
+}
+
+/**
+ * Find a format in the plane's formats array
+ *
+ * @param plane The plane to search
+ * @param format The DRM fourcc
+ * @returns The index of the format in plane->formats, or -1 if the plane
+ * does not support it.
+ */
+int
+drm_plane_find_format(const struct drm_plane *plane, uint32_t format)
+{
+	uint32_t i, slot;
+
+	if (!plane->format_index) {
+		for (i = 0; i < plane->count_formats; i++) {
+			if (plane->formats[i].format == format)
+				return i;
+		}
+		return -1;
+	}
+
+	slot = format_hash(format) & plane->format_index_mask;
+	while ((i = plane->format_index[slot]) != 0) {
+		if (plane->formats[i - 1].format == format)
+			return i - 1;
+		slot = (slot + 1) & plane->format_index_mask;
+	}
+
+	return -1;
+}
+
+/**
+ * Whether the plane can scan out a format and modifier
+ *
+ * @param plane The plane to check
+ * @param format The DRM fourcc
+ * @param modifier The modifier, or DRM_FORMAT_MOD_INVALID to accept any
+ * @returns True if the plane supports the combination
+ */
+bool
+drm_plane_supports_format(const struct drm_plane *plane, uint32_t format,
+			  uint64_t modifier)
+{
+	int i = drm_plane_find_format(plane, format);
+	uint32_t j;
+
+	if (i < 0)
+		return false;
+
+	if (modifier == DRM_FORMAT_MOD_INVALID)
+		return true;
+
+	if (plane->format_index)
+		return bsearch(&modifier, plane->formats[i].modifiers,
+			       plane->formats[i].count_modifiers,
+			       sizeof(modifier), compare_modifier) != NULL;
+
+	for (j = 0; j < plane->formats[i].count_modifiers; j++) {
+		if (plane->formats[i].modifiers[j] == modifier)
+			return true;
+	}
+
+	return false;
+}
+
 /**
  * Populates the plane's formats array, using either the IN_FORMATS blob
  * property (if available), or the plane's format list if not.
+ *
+ * The modifiers of each format are sorted and the formats are indexed by
+ * fourcc, for drm_plane_supports_format() to check candidate views in
+ * constant time.
  */
 int
 drm_plane_populate_formats(struct drm_plane *plane, const drmModePlane *kplane,
@@ -497,12 +686,15 @@ drm_plane_populate_formats(struct drm_plane *plane, const drmModePlane *kplane,
 			count_modifiers = 1;
 		}
 
+		qsort(modifiers, count_modifiers, sizeof(modifiers[0]),
+		      compare_modifier);
 		plane->formats[i].format = blob_formats[i];
 		plane->formats[i].modifiers = modifiers;
 		plane->formats[i].count_modifiers = count_modifiers;
 	}
 
 	drmModeFreePropertyBlob(blob);
+	drm_plane_index_formats(plane);
 
 	return 0;
 
@@ -515,23 +707,86 @@ fallback:
 		plane->formats[i].modifiers[0] = DRM_FORMAT_MOD_LINEAR;
 		plane->formats[i].count_modifiers = 1;
 	}
+	drm_plane_index_formats(plane);
 
 	return 0;
 }
 
+/* Resample a legacy gamma ramp to the size of the GAMMA_LUT property */
+static int
+drm_gamma_ramp_blob_create(struct drm_output *output, uint16_t size,
+			   const uint16_t *r, const uint16_t *g,
+			   const uint16_t *b, uint32_t *blob_id)
+{
+	int fd = output->backend->drm.fd;
+	uint32_t lut_size = output->gamma_lut_size;
+	struct drm_color_lut *lut;
+	unsigned int i, i0;
+	uint32_t pos, frac;
+	int ret;
+
+	lut = calloc(lut_size, sizeof *lut);
+	if (!lut)
+		return -1;
+
+	/* 16.16 fixed point positions in the ramp */
+	for (i = 0; i < lut_size; i++) {
+		pos = (uint64_t) i * (size - 1) * 65536 / (lut_size - 1);
+		i0 = MIN(pos >> 16, (uint32_t) size - 2);
+		frac = pos - (i0 << 16);
+		lut[i].red = r[i0] + (((int32_t) r[i0 + 1] - r[i0]) *
+				      (int64_t) frac >> 16);
+		lut[i].green = g[i0] + (((int32_t) g[i0 + 1] - g[i0]) *
+					(int64_t) frac >> 16);
+		lut[i].blue = b[i0] + (((int32_t) b[i0 + 1] - b[i0]) *
+				       (int64_t) frac >> 16);
+	}
+
+	ret = drmModeCreatePropertyBlob(fd, lut, lut_size * sizeof *lut,
+					blob_id);
+	free(lut);
+
+	return ret;
+}
+
+/** Set the gamma ramp of the CRTC
+ *
+ * With atomic modesetting the ramp goes out as GAMMA_LUT with the next
+ * commit, latched with the page flip instead of blocking on an ioctl of its
+ * own, so that ramps can be animated frame by frame. The previous blob can
+ * be destroyed right away, the kernel keeps it alive while it is in use.
+ * A color pipeline owns the gamma LUT while it is set, the ramp is applied
+ * again once it is disabled.
+ */
 void
 drm_output_set_gamma(struct weston_output *output_base,
 		     uint16_t size, uint16_t *r, uint16_t *g, uint16_t *b)
 {
 	int rc;
 	struct drm_output *output = to_drm_output(output_base);
-	struct drm_backend *backend =
-		to_drm_backend(output->base.compositor);
+	struct drm_backend *backend = output->backend;
+	uint32_t blob_id;
 
 	/* check */
 	if (output_base->gamma_size != size)
 		return;
 
+	if (backend->atomic_modeset &&
+	    output->props_crtc[WDRM_CRTC_GAMMA_LUT].prop_id != 0 &&
+	    output->gamma_lut_size >= 2 && size >= 2) {
+		if (drm_gamma_ramp_blob_create(output, size, r, g, b,
+					       &blob_id) == 0) {
+			if (output->gamma_ramp_blob)
+				drmModeDestroyPropertyBlob(backend->drm.fd,
+							   output->gamma_ramp_blob);
+			output->gamma_ramp_blob = blob_id;
+			weston_output_schedule_repaint(output_base);
+			return;
+		}
+		weston_log("Output %s: failed to create the gamma LUT blob, "
+			   "using the legacy gamma ioctl\n", output_base->name);
+	}
+
 	rc = drmModeCrtcSetGamma(backend->drm.fd,
 				 output->crtc_id,
 				 size, r, g, b);
@@ -539,6 +794,140 @@ drm_output_set_gamma(struct weston_output *output_base,
 		weston_log("set gamma failed: %s\n", strerror(errno));
 }
 
+static void
+drm_output_destroy_color_blobs(struct drm_output *output)
+{
+	int fd = output->backend->drm.fd;
+
+	if (output->degamma_lut_blob)
+		drmModeDestroyPropertyBlob(fd, output->degamma_lut_blob);
+	if (output->ctm_blob)
+		drmModeDestroyPropertyBlob(fd, output->ctm_blob);
+	if (output->gamma_lut_blob)
+		drmModeDestroyPropertyBlob(fd, output->gamma_lut_blob);
+
+	output->degamma_lut_blob = 0;
+	output->ctm_blob = 0;
+	output->gamma_lut_blob = 0;
+}
+
+/* Resample one set of RGB curves to the size of a CRTC LUT property */
+static int
+drm_color_lut_blob_create(struct drm_backend *b, const float *curves,
+			  unsigned int curve_size, uint32_t lut_size,
+			  uint32_t *blob_id)
+{
+	struct drm_color_lut *lut;
+	unsigned int c, i, i0;
+	float pos, frac, v[3];
+	int ret;
+
+	lut = calloc(lut_size, sizeof *lut);
+	if (!lut)
+		return -1;
+
+	for (i = 0; i < lut_size; i++) {
+		pos = (float) i * (curve_size - 1) / (lut_size - 1);
+		i0 = MIN((unsigned int) pos, curve_size - 2);
+		frac = pos - i0;
+		for (c = 0; c < 3; c++) {
+			const float *curve = curves + c * curve_size;
+
+			v[c] = curve[i0] + (curve[i0 + 1] - curve[i0]) * frac;
+			if (v[c] < 0.0f)
+				v[c] = 0.0f;
+			else if (v[c] > 1.0f)
+				v[c] = 1.0f;
+		}
+		lut[i].red = v[0] * 0xffff + 0.5f;
+		lut[i].green = v[1] * 0xffff + 0.5f;
+		lut[i].blue = v[2] * 0xffff + 0.5f;
+	}
+
+	ret = drmModeCreatePropertyBlob(b->drm.fd, lut,
+					lut_size * sizeof *lut, blob_id);
+	free(lut);
+
+	return ret;
+}
+
+/* The CTM property holds S31.32 sign-magnitude fixed point values */
+static uint64_t
+drm_ctm_fixed(float v)
+{
+	double mag = v < 0.0f ? -v : v;
+	uint64_t fixed = (uint64_t) (mag * (double) (1ULL << 32));
+
+	return v < 0.0f ? fixed | (1ULL << 63) : fixed;
+}
+
+/** Program a color transform into the CTM and LUTs of the CRTC
+ *
+ * Needs the atomic API and the full CRTC color pipeline. The properties
+ * go out with the next commit; the old blobs can be destroyed right away,
+ * the kernel keeps them alive while they are in use. Disabling resets the
+ * degamma LUT and the CTM with the next commit, and leaves the gamma LUT to
+ * the legacy gamma ramp of the caller.
+ */
+int
+drm_output_set_color_transform(struct weston_output *output_base,
+			       const struct weston_color_transform *xform)
+{
+	struct drm_output *output = to_drm_output(output_base);
+	struct drm_backend *b = output->backend;
+	struct drm_color_ctm ctm;
+	int i;
+
+	drm_output_destroy_color_blobs(output);
+
+	if (!xform) {
+		weston_output_schedule_repaint(output_base);
+		return 0;
+	}
+
+	if (!b->atomic_modeset ||
+	    output->props_crtc[WDRM_CRTC_CTM].prop_id == 0 ||
+	    output->props_crtc[WDRM_CRTC_DEGAMMA_LUT].prop_id == 0 ||
+	    output->props_crtc[WDRM_CRTC_GAMMA_LUT].prop_id == 0 ||
+	    output->degamma_lut_size < 2 || output->gamma_lut_size < 2 ||
+	    xform->curve_size < 2)
+		return -1;
+
+	for (i = 0; i < 9; i++)
+		ctm.matrix[i] = drm_ctm_fixed(xform->matrix[i]);
+
+	if (drm_color_lut_blob_create(b, xform->degamma, xform->curve_size,
+				      output->degamma_lut_size,
+				      &output->degamma_lut_blob) != 0 ||
+	    drm_color_lut_blob_create(b, xform->gamma, xform->curve_size,
+				      output->gamma_lut_size,
+				      &output->gamma_lut_blob) != 0 ||
+	    drmModeCreatePropertyBlob(b->drm.fd, &ctm, sizeof ctm,
+				      &output->ctm_blob) != 0) {
+		weston_log("Output %s: failed to create color pipeline blobs\n",
+			   output_base->name);
+		drm_output_destroy_color_blobs(output);
+		return -1;
+	}
+
+	output->color_pipeline = true;
+	weston_output_schedule_repaint(output_base);
+
+	return 0;
+}
+
+void
+drm_output_fini_color_transform(struct drm_output *output)
+{
+	drm_output_destroy_color_blobs(output);
+	output->color_pipeline = false;
+
+	if (output->gamma_ramp_blob)
+		drmModeDestroyPropertyBlob(output->backend->drm.fd,
+					   output->gamma_ramp_blob);
+	output->gamma_ramp_blob = 0;
+}
+
 /**
  * Mark an output state as current on the output, i.e. it has been
  * submitted to the kernel. The mode argument determines whether this
@@ -550,7 +939,7 @@ drm_output_assign_state(struct drm_output_state *state,
 			enum drm_state_apply_mode mode)
 {
 	struct drm_output *output = state->output;
-	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_backend *b = output->backend;
 	struct drm_plane_state *plane_state;
 	struct drm_head *head;
 
@@ -567,6 +956,17 @@ drm_output_assign_state(struct drm_output_state *state,
 
 	output->state_cur = state;
 
+	/* The inherited mode blob may go away once the CRTC stops using it;
+	 * only a committed state turns it off, not a test. */
+	if (state->dpms == WESTON_DPMS_OFF)
+		output->inherited_mode_blob = 0;
+
+	/* The reset of a disabled color pipeline went out with this state,
+	 * see drm_output_apply_state_atomic(). */
+	if (b->atomic_modeset && state->dpms == WESTON_DPMS_ON &&
+	    output->color_pipeline && !output->ctm_blob)
+		output->color_pipeline = false;
+
 	if (b->atomic_modeset && mode == DRM_STATE_APPLY_ASYNC) {
 		drm_debug(b, "\t[CRTC:%u] setting pending flip\n", output->crtc_id);
 		output->atomic_complete_pending = true;
@@ -607,7 +1007,7 @@ static void
 drm_output_set_cursor(struct drm_output_state *output_state)
 {
 	struct drm_output *output = output_state->output;
-	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_backend *b = output->backend;
 	struct drm_plane *plane = output->cursor_plane;
 	struct drm_plane_state *state;
 	uint32_t handle;
@@ -659,7 +1059,7 @@ static int
 drm_output_apply_state_legacy(struct drm_output_state *state)
 {
 	struct drm_output *output = state->output;
-	struct drm_backend *backend = to_drm_backend(output->base.compositor);
+	struct drm_backend *backend = output->backend;
 	struct drm_plane *scanout_plane = output->scanout_plane;
 	struct drm_property_info *dpms_prop;
 	struct drm_plane_state *scanout_state;
@@ -932,13 +1332,60 @@ drm_head_set_hdcp_property(struct drm_head *head,
 	assert(ret == 0);
 }
 
+/**
+ * Release the client buffers a committed state stops scanning out
+ *
+ * The previous plane states keep their buffers until the flip has
+ * completed. Rather than sending their zwp_linux_buffer_release_v1 only
+ * then, send it right away with the CRTC out-fence, which signals once the
+ * new state is on screen. This lets clients queue their next frame into
+ * the buffer early.
+ *
+ * One fence describes the whole release, so this only applies to releases
+ * held by nothing else, such as the renderer. The others are kept until
+ * the plane state is freed, as before.
+ */
+static void
+drm_output_state_release_fenced(struct drm_output_state *state)
+{
+	struct drm_plane_state *ps, *prev;
+	struct weston_buffer_release *release;
+	int fd;
+
+	if (state->out_fence_fd < 0)
+		return;
+
+	wl_list_for_each(ps, &state->plane_list, link) {
+		prev = ps->plane->state_cur;
+		if (!prev || prev == ps)
+			continue;
+
+		release = prev->buffer_release_ref.buffer_release;
+		if (!release ||
+		    release == ps->buffer_release_ref.buffer_release ||
+		    release->ref_count > 1 || release->fence_fd >= 0)
+			continue;
+
+		fd = dup(state->out_fence_fd);
+		if (fd < 0)
+			continue;
+
+		release->fence_fd = fd;
+		weston_buffer_release_reference(&prev->buffer_release_ref,
+						NULL);
+	}
+
+	close(state->out_fence_fd);
+	state->out_fence_fd = -1;
+}
+
 static int
 drm_output_apply_state_atomic(struct drm_output_state *state,
 			      drmModeAtomicReq *req,
 			      uint32_t *flags)
 {
 	struct drm_output *output = state->output;
-	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_backend *b = output->backend;
 	struct drm_plane_state *plane_state;
 	struct drm_mode *current_mode = to_drm_mode(output->base.current_mode);
 	struct drm_head *head;
@@ -954,14 +1401,52 @@ drm_output_apply_state_atomic(struct drm_output_state *state,
 	}
 
 	if (state->dpms == WESTON_DPMS_ON) {
-		ret = drm_mode_ensure_blob(b, current_mode);
-		if (ret != 0)
-			return ret;
+		uint32_t mode_blob = output->inherited_mode_blob;
+
+		/* An unchanged MODE_ID does not make the kernel modeset. */
+		if (mode_blob == 0) {
+			ret = drm_mode_ensure_blob(b, current_mode);
+			if (ret != 0)
+				return ret;
+			mode_blob = current_mode->blob_id;
+		}
 
-		ret |= crtc_add_prop(req, output, WDRM_CRTC_MODE_ID,
-				     current_mode->blob_id);
+		ret |= crtc_add_prop(req, output, WDRM_CRTC_MODE_ID, mode_blob);
 		ret |= crtc_add_prop(req, output, WDRM_CRTC_ACTIVE, 1);
 
+		/* An async flip may change nothing but FB_ID, so a commit
+		 * that may tear goes without the out-fence, and buffers are
+		 * released on the flip event as without the property. */
+		state->out_fence_fd = -1;
+		if (!(*flags & DRM_MODE_ATOMIC_TEST_ONLY) && !state->tearing &&
+		    output->props_crtc[WDRM_CRTC_OUT_FENCE_PTR].prop_id != 0)
+			ret |= crtc_add_prop(req, output,
+					     WDRM_CRTC_OUT_FENCE_PTR,
+					     (uintptr_t) &state->out_fence_fd);
+
+		/* Toggling adaptive sync does not need a modeset. */
+		if (output->props_crtc[WDRM_CRTC_VRR_ENABLED].prop_id != 0)
+			ret |= crtc_add_prop(req, output, WDRM_CRTC_VRR_ENABLED,
+					     output->base.vrr_enabled);
+
+		/* A disabled pipeline is reset by writing its blobs as 0
+		 * once, the gamma LUT going back to the ramp of
+		 * drm_output_set_gamma(). drm_output_assign_state() drops
+		 * the pipeline after that. */
+		if (output->color_pipeline) {
+			ret |= crtc_add_prop(req, output, WDRM_CRTC_DEGAMMA_LUT,
+					     output->degamma_lut_blob);
+			ret |= crtc_add_prop(req, output, WDRM_CRTC_CTM,
+					     output->ctm_blob);
+			ret |= crtc_add_prop(req, output, WDRM_CRTC_GAMMA_LUT,
+					     output->gamma_lut_blob ?
+					     output->gamma_lut_blob :
+					     output->gamma_ramp_blob);
+		} else if (output->gamma_ramp_blob) {
+			ret |= crtc_add_prop(req, output, WDRM_CRTC_GAMMA_LUT,
+					     output->gamma_ramp_blob);
+		}
+
 		/* No need for the DPMS property, since it is implicit in
 		 * routing and CRTC activity. */
 		wl_list_for_each(head, &output->base.head_list, base.output_link) {
@@ -981,6 +1466,8 @@ drm_output_apply_state_atomic(struct drm_output_state *state,
 	wl_list_for_each(head, &output->base.head_list, base.output_link)
 		drm_head_set_hdcp_property(head, state->protection, req);
 
+	ret |= drm_output_apply_writeback(state, req, flags);
+
 	if (ret != 0) {
 		weston_log("couldn't set atomic CRTC/connector state\n");
 		return ret;
@@ -1034,6 +1521,40 @@ drm_output_apply_state_atomic(struct drm_output_state *state,
 					      WDRM_PLANE_ZPOS,
 					      plane_state->zpos);
 
+		if (plane->props[WDRM_PLANE_ROTATION].prop_id != 0) {
+			uint64_t rotation;
+
+			/* The state proposal made sure this is supported,
+			 * other than for the renderer's unrotated buffers. */
+			if (drm_plane_rotation_from_transform(plane,
+							      plane_state->rotation,
+							      &rotation))
+				ret |= plane_add_prop(req, plane,
+						      WDRM_PLANE_ROTATION,
+						      rotation);
+		}
+
+		if (plane->props[WDRM_PLANE_ALPHA].prop_id != 0)
+			ret |= plane_add_prop(req, plane, WDRM_PLANE_ALPHA,
+					      plane_state->alpha);
+
+		/* The state proposal made sure the values are supported. */
+		if (pinfo && pinfo->num_planes != 0) {
+			struct drm_property_info *info;
+
+			info = &plane->props[WDRM_PLANE_COLOR_ENCODING];
+			if (info->prop_id != 0)
+				ret |= plane_add_prop(req, plane,
+						      WDRM_PLANE_COLOR_ENCODING,
+						      info->enum_values[plane_state->color_encoding].value);
+
+			info = &plane->props[WDRM_PLANE_COLOR_RANGE];
+			if (info->prop_id != 0)
+				ret |= plane_add_prop(req, plane,
+						      WDRM_PLANE_COLOR_RANGE,
+						      info->enum_values[plane_state->color_range].value);
+		}
+
 		if (ret != 0) {
 			weston_log("couldn't set plane state\n");
 			return ret;
@@ -1043,6 +1564,53 @@ drm_output_apply_state_atomic(struct drm_output_state *state,
 	return 0;
 }
 
+/**
+ * Decide whether an atomic commit can flip without waiting for vblank
+ *
+ * That requires a single output, whose state asked for it, and the kernel
+ * accepting the commit as an async flip: in practice only the scanout
+ * buffer may change. On return, the tearing flag of every output state
+ * tells whether it is part of an async flip.
+ */
+static bool
+drm_pending_state_try_tearing(struct drm_pending_state *pending_state,
+			      drmModeAtomicReq *req, uint32_t flags)
+{
+	struct drm_backend *b = pending_state->backend;
+	struct drm_output_state *output_state;
+	uint32_t test_flags;
+	bool tear;
+
+	tear = b->async_page_flip && !b->state_invalid &&
+	       !(flags & DRM_MODE_ATOMIC_ALLOW_MODESET) &&
+	       wl_list_length(&pending_state->output_list) == 1;
+
+	wl_list_for_each(output_state, &pending_state->output_list, link) {
+		tear = tear && output_state->tearing;
+		output_state->tearing = false;
+	}
+
+	if (!tear)
+		return false;
+
+	/* The kernel refuses TEST_ONLY with a page flip event. */
+	test_flags = flags & ~(DRM_MODE_PAGE_FLIP_EVENT |
+			       DRM_MODE_ATOMIC_NONBLOCK);
+	test_flags |= DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_PAGE_FLIP_ASYNC;
+	b->stats.test_only_commits++;
+	if (drmModeAtomicCommit(b->drm.fd, req, test_flags, b) != 0) {
+		drm_debug(b, "\t\t[atomic] async flip refused, "
+			     "waiting for vblank\n");
+		return false;
+	}
+
+	output_state = container_of(pending_state->output_list.next,
+				    struct drm_output_state, link);
+	output_state->tearing = true;
+
+	return true;
+}
+
 /**
  * Helper function used only by drm_pending_state_apply, with the same
  * guarantees and constraints as that function.
@@ -1089,11 +1657,12 @@ drm_pending_state_apply_atomic(struct drm_pending_state *pending_state,
 				 &b->compositor->head_list, compositor_link) {
 			struct drm_property_info *info;
 
-			if (weston_head_is_enabled(head_base))
-				continue;
-
 			head = to_drm_head(head_base);
 
+			if (head->backend != b ||
+			    weston_head_is_enabled(head_base))
+				continue;
+
 			drm_debug(b, "\t\t[atomic] disabling inactive head %s\n",
 				  head_base->name);
 
@@ -1163,6 +1732,11 @@ drm_pending_state_apply_atomic(struct drm_pending_state *pending_state,
 			drm_property_info_free(infos, WDRM_CRTC__COUNT);
 		}
 
+		/* Writeback connectors in use are routed again by the
+		 * output-state application, like planes below. */
+		if (drm_backend_reset_writebacks(b, req) != 0)
+			ret = -1;
+
 		/* Disable all the planes; planes which are being used will
 		 * override this state in the output-state application. */
 		wl_list_for_each(plane, &b->plane_list, link) {
@@ -1188,6 +1762,14 @@ drm_pending_state_apply_atomic(struct drm_pending_state *pending_state,
 		goto out;
 	}
 
+	if (mode == DRM_STATE_APPLY_ASYNC &&
+	    drm_pending_state_try_tearing(pending_state, req, flags)) {
+		drm_debug(b, "\t\t[atomic] flipping without waiting for vblank\n");
+		flags |= DRM_MODE_PAGE_FLIP_ASYNC;
+	}
+
+	if (flags & DRM_MODE_ATOMIC_TEST_ONLY)
+		b->stats.test_only_commits++;
 	ret = drmModeAtomicCommit(b->drm.fd, req, flags, b);
 	drm_debug(b, "[atomic] drmModeAtomicCommit\n");
 
@@ -1198,15 +1780,35 @@ drm_pending_state_apply_atomic(struct drm_pending_state *pending_state,
 		return ret;
 	}
 
+	wl_list_for_each(output_state, &pending_state->output_list, link)
+		drm_output_writeback_commit_done(output_state->output,
+						 ret == 0);
+
 	if (ret != 0) {
 		weston_log("atomic: couldn't commit new state: %s\n",
 			   strerror(errno));
+		/* a configuration that passed the test may be at fault */
+		drm_backend_test_cache_clear(b);
+
+		/* so may a primary plane unable to scale */
+		wl_list_for_each(output_state, &pending_state->output_list,
+				 link) {
+			struct weston_output *base = &output_state->output->base;
+
+			if (base->render_scale >= 1.0f)
+				continue;
+			weston_log("Output %s: disabling dynamic resolution\n",
+				   base->name);
+			weston_output_set_dynamic_resolution(base, 0.0f);
+		}
 		goto out;
 	}
 
 	wl_list_for_each_safe(output_state, tmp, &pending_state->output_list,
-			      link)
+			      link) {
+		drm_output_state_release_fenced(output_state);
 		drm_output_assign_state(output_state, mode);
+	}
 
 	b->state_invalid = false;
 
@@ -1250,6 +1852,138 @@ drm_pending_state_test(struct drm_pending_state *pending_state)
 	return 0;
 }
 
+static inline uint64_t
+signature_add(uint64_t hash, uint64_t v)
+{
+	/* FNV-1a over the 8 bytes of v */
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		hash ^= (v >> (i * 8)) & 0xff;
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+/* Everything in the pending state that the kernel checks: the CRTC color
+ * blobs, which views go on which planes, through what buffer format,
+ * modifier and YUV encoding, at what position, scale, rotation, alpha and
+ * zpos. The buffers themselves are left out, so that a client flipping
+ * between equivalent buffers hits the cache. */
+static uint64_t
+drm_pending_state_signature(struct drm_pending_state *pending_state)
+{
+	struct drm_output_state *output_state;
+	struct drm_plane_state *ps;
+	uint64_t hash = 0xcbf29ce484222325ull;
+
+	wl_list_for_each(output_state, &pending_state->output_list, link) {
+		hash = signature_add(hash, output_state->output->crtc_id);
+		hash = signature_add(hash, output_state->dpms);
+		hash = signature_add(hash, output_state->protection);
+		/* VRR_ENABLED, added to every commit */
+		hash = signature_add(hash,
+				     output_state->output->base.vrr_enabled);
+		/* CRTC color blobs, replaced outside of the repaint by
+		 * drm_output_set_color_transform() and
+		 * drm_output_set_gamma() */
+		hash = signature_add(hash,
+				     output_state->output->color_pipeline);
+		hash = signature_add(hash,
+				     output_state->output->degamma_lut_blob);
+		hash = signature_add(hash, output_state->output->ctm_blob);
+		hash = signature_add(hash,
+				     output_state->output->gamma_lut_blob);
+		hash = signature_add(hash,
+				     output_state->output->gamma_ramp_blob);
+
+		wl_list_for_each(ps, &output_state->plane_list, link) {
+			struct drm_fb *fb = ps->fb;
+
+			hash = signature_add(hash, ps->plane->plane_id);
+			if (!fb)
+				continue;
+
+			hash = signature_add(hash, (uintptr_t)ps->ev);
+			hash = signature_add(hash, fb->type);
+			hash = signature_add(hash, fb->format->format);
+			hash = signature_add(hash, fb->modifier);
+			hash = signature_add(hash, ps->color_encoding);
+			hash = signature_add(hash, ps->color_range);
+			hash = signature_add(hash, ((uint64_t)fb->width << 32) |
+						   (uint32_t)fb->height);
+			hash = signature_add(hash, ((uint64_t)ps->src_x << 32) |
+						   (uint32_t)ps->src_y);
+			hash = signature_add(hash, ((uint64_t)ps->src_w << 32) |
+						   ps->src_h);
+			hash = signature_add(hash, ((uint64_t)ps->dest_x << 32) |
+						   (uint32_t)ps->dest_y);
+			hash = signature_add(hash, ((uint64_t)ps->dest_w << 32) |
+						   ps->dest_h);
+			hash = signature_add(hash, ps->zpos);
+			hash = signature_add(hash, ps->rotation);
+			hash = signature_add(hash, ps->alpha);
+			hash = signature_add(hash, ps->in_fence_fd >= 0);
+		}
+	}
+
+	return hash;
+}
+
+/**
+ * Tests a pending state like drm_pending_state_test(), reusing the result
+ * of an identical test done recently.
+ *
+ * Plane assignment tests the same configurations frame after frame while
+ * the scene is static, and the TEST_ONLY commits quickly add up. Successes
+ * and failures are both remembered, so a steady state neither retests the
+ * planes it uses nor the ones it was refused. A failed real commit and a
+ * full modeset drop everything that is remembered.
+ */
+int
+drm_pending_state_test_cached(struct drm_pending_state *pending_state)
+{
+	struct drm_backend *b = pending_state->backend;
+	uint64_t signature;
+	unsigned int i;
+	int ret;
+
+	/* the test includes a modeset, which is never repeated */
+	if (!b->atomic_modeset || b->state_invalid) {
+		drm_backend_test_cache_clear(b);
+		return drm_pending_state_test(pending_state);
+	}
+
+	signature = drm_pending_state_signature(pending_state);
+	for (i = 0; i < ARRAY_LENGTH(b->test_cache); i++) {
+		if (b->test_cache[i].valid &&
+		    b->test_cache[i].signature == signature) {
+			drm_debug(b, "\t\t\t[atomic] reusing test result %d\n",
+				  b->test_cache[i].result);
+			return b->test_cache[i].result;
+		}
+	}
+
+	ret = drm_pending_state_test(pending_state);
+
+	i = b->test_cache_next++ % ARRAY_LENGTH(b->test_cache);
+	b->test_cache[i].signature = signature;
+	b->test_cache[i].result = ret;
+	b->test_cache[i].valid = true;
+
+	return ret;
+}
+
+void
+drm_backend_test_cache_clear(struct drm_backend *b)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(b->test_cache); i++)
+		b->test_cache[i].valid = false;
+}
+
 /**
  * Applies all of a pending_state asynchronously: the primary entry point for
  * applying KMS state to a device. Updates the state for all outputs in the
@@ -1264,6 +1998,8 @@ drm_pending_state_apply(struct drm_pending_state *pending_state)
 	struct drm_output_state *output_state, *tmp;
 	uint32_t *unused;
 
+	WESTON_TRACE1(drm_pending_state_apply, b->atomic_modeset);
+
 	if (b->atomic_modeset)
 		return drm_pending_state_apply_atomic(pending_state,
 						      DRM_STATE_APPLY_ASYNC);
@@ -1372,12 +2108,14 @@ page_flip_handler(int fd, unsigned int frame,
 		  unsigned int sec, unsigned int usec, void *data)
 {
 	struct drm_output *output = data;
-	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_backend *b = output->backend;
 	uint32_t flags = WP_PRESENTATION_FEEDBACK_KIND_VSYNC |
 			 WP_PRESENTATION_FEEDBACK_KIND_HW_COMPLETION |
 			 WP_PRESENTATION_FEEDBACK_KIND_HW_CLOCK;
 
 	drm_output_update_msc(output, frame);
+	WESTON_TRACE3(drm_page_flip, output->crtc_id, frame,
+		      (uint64_t)sec * 1000000 + usec);
 
 	assert(!b->atomic_modeset);
 	assert(output->page_flip_pending);
@@ -1403,12 +2141,18 @@ atomic_flip_handler(int fd, unsigned int frame, unsigned int sec,
 		return;
 
 	drm_output_update_msc(output, frame);
+	WESTON_TRACE3(drm_page_flip, crtc_id, frame,
+		      (uint64_t)sec * 1000000 + usec);
 
 	drm_debug(b, "[atomic][CRTC:%u] flip processing started\n", crtc_id);
 	assert(b->atomic_modeset);
 	assert(output->atomic_complete_pending);
 	output->atomic_complete_pending = false;
 
+	/* The frame went to the screen mid-scanout. */
+	if (output->state_cur->tearing)
+		flags &= ~WP_PRESENTATION_FEEDBACK_KIND_VSYNC;
+
 	drm_output_update_complete(output, flags, sec, usec);
 	drm_debug(b, "[atomic][CRTC:%u] flip processing completed\n", crtc_id);
 }
@@ -1445,7 +2189,16 @@ init_kms_caps(struct drm_backend *b)
 	else
 		clk_id = CLOCK_REALTIME;
 
-	if (weston_compositor_set_presentation_clock(b->compositor, clk_id) < 0) {
+	/* Timestamps of all devices have to be on the same clock. */
+	if (drm_backend_is_secondary(b)) {
+		if (clk_id != b->compositor->presentation_clock) {
+			weston_log("Error: %s does not report timestamps on "
+				   "presentation clock %d.\n", b->drm.filename,
+				   b->compositor->presentation_clock);
+			return -1;
+		}
+	} else if (weston_compositor_set_presentation_clock(b->compositor,
+							     clk_id) < 0) {
 		weston_log("Error: failed to set presentation clock %d.\n",
 			   clk_id);
 		return -1;
@@ -1486,6 +2239,13 @@ init_kms_caps(struct drm_backend *b)
 	weston_log("DRM: %s GBM modifiers\n",
 		   b->fb_modifiers ? "supports" : "does not support");
 
+	if (b->atomic_modeset) {
+		ret = drmGetCap(b->drm.fd, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &cap);
+		b->async_page_flip = (ret == 0 && cap == 1);
+	}
+	weston_log("DRM: %s atomic async page flips\n",
+		   b->async_page_flip ? "supports" : "does not support");
+
 	/*
 	 * KMS support for hardware planes cannot properly synchronize
 	 * without nuclear page flip. Without nuclear/atomic, hw plane
@@ -1497,6 +2257,14 @@ init_kms_caps(struct drm_backend *b)
 	if (!b->atomic_modeset || getenv("WESTON_FORCE_RENDERER"))
 		b->sprites_are_broken = true;
 
+#ifdef DRM_CLIENT_CAP_WRITEBACK_CONNECTORS
+	/* Writeback connectors only show up in the resources once asked
+	 * for, and need atomic modesetting. */
+	if (b->atomic_modeset)
+		drmSetClientCap(b->drm.fd,
+				DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1);
+#endif
+
 	ret = drmSetClientCap(b->drm.fd, DRM_CLIENT_CAP_ASPECT_RATIO, 1);
 	b->aspect_ratio_supported = (ret == 0);
 	weston_log("DRM: %s picture aspect ratio\n",
@@ -0,0 +1,284 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libweston/libweston.h>
+#include "drm-internal.h"
+#include "shared/helpers.h"
+
+/*
+ * Outputs scanning out the frames of another output.
+ *
+ * A mirror is a weston_output on a CRTC of its own, configured with the
+ * name of its source output and laid out over it. Instead of compositing
+ * the scene again, its repaint puts the framebuffer the source shows on its
+ * scanout plane, scaled by the plane to its own mode when the sizes differ,
+ * and the source cursor on its cursor plane. The mirror keeps its own page
+ * flips and timings, and shows the latest frame of the source at each of
+ * its refreshes.
+ *
+ * Frames which need more than the scanout and cursor planes of the source,
+ * or which the mirror planes cannot show, are composited by the mirror as
+ * by any other output.
+ */
+
+static struct drm_output *
+drm_output_get_mirror_source(struct drm_output *output)
+{
+	struct weston_output *base;
+	struct drm_output *source;
+
+	if (!output->mirror_source)
+		return NULL;
+
+	base = weston_compositor_find_output_by_name(output->base.compositor,
+						     output->mirror_source);
+	if (!base || !base->enabled || base == &output->base)
+		return NULL;
+
+	source = to_drm_output(base);
+	if (source->virtual || source->mirror_source ||
+	    source->backend != output->backend)
+		return NULL;
+
+	return source;
+}
+
+static struct drm_plane_state *
+drm_output_mirror_plane(struct drm_output_state *state,
+			struct drm_plane *plane,
+			const struct drm_plane_state *src, bool src_pending,
+			int32_t dest_x, int32_t dest_y,
+			uint32_t dest_w, uint32_t dest_h)
+{
+	struct drm_plane_state *ps = drm_output_state_get_plane(state, plane);
+
+	ps->fb = drm_fb_ref(src->fb);
+	weston_buffer_reference(&ps->buffer_ref, src->buffer_ref.buffer);
+	weston_buffer_release_reference(&ps->buffer_release_ref,
+					src->buffer_release_ref.buffer_release);
+	ps->output = state->output;
+
+	ps->src_x = src->src_x;
+	ps->src_y = src->src_y;
+	ps->src_w = src->src_w;
+	ps->src_h = src->src_h;
+	ps->dest_x = dest_x;
+	ps->dest_y = dest_y;
+	ps->dest_w = dest_w;
+	ps->dest_h = dest_h;
+
+	ps->zpos = plane->zpos_min;
+	ps->rotation = src->rotation;
+	ps->alpha = src->alpha;
+	ps->color_encoding = src->color_encoding;
+	ps->color_range = src->color_range;
+	/* The fence belongs to the surface, both planes may wait on it. It
+	 * is only valid for the frame being repainted, a shown frame has
+	 * been waited on already. */
+	ps->in_fence_fd = src_pending ? src->in_fence_fd : -1;
+
+	return ps;
+}
+
+/**
+ * Build the state of a mirror from the frame of its source
+ *
+ * Takes the frame the source is about to flip to in this repaint, or the
+ * one it shows if it is not repainted. On success the output state is in
+ * the pending state and has a scanout framebuffer, so drm_output_render()
+ * leaves it alone.
+ *
+ * @return true if the output mirrors its source for this repaint, false if
+ * it has to be composited.
+ */
+bool
+drm_output_assign_mirror(struct drm_output *output,
+			 struct drm_pending_state *pending_state)
+{
+	struct drm_backend *b = output->backend;
+	struct drm_output *source = drm_output_get_mirror_source(output);
+	struct drm_output_state *src_state, *state;
+	struct drm_plane_state *src_scanout = NULL;
+	struct drm_plane_state *src_cursor = NULL;
+	struct drm_plane_state *ps;
+	int32_t width, height, src_width, src_height;
+	bool src_pending = true;
+
+	if (!source)
+		return false;
+
+	src_state = drm_pending_state_get_output(pending_state, source);
+	if (!src_state) {
+		src_state = source->state_cur;
+		src_pending = false;
+	}
+
+	wl_list_for_each(ps, &src_state->plane_list, link) {
+		if (!ps->fb)
+			continue;
+
+		if (ps->plane == source->scanout_plane) {
+			src_scanout = ps;
+		} else if (ps->plane == source->cursor_plane) {
+			src_cursor = ps;
+		} else {
+			drm_debug(b, "\t[mirror] %s uses overlay planes, "
+				     "compositing %s\n", source->base.name,
+				  output->base.name);
+			return false;
+		}
+	}
+
+	if (!src_scanout ||
+	    !drm_plane_supports_format(output->scanout_plane,
+				       src_scanout->fb->format->format,
+				       src_scanout->fb->modifier))
+		return false;
+
+	width = output->base.current_mode->width;
+	height = output->base.current_mode->height;
+	src_width = source->base.current_mode->width;
+	src_height = source->base.current_mode->height;
+
+	/* The legacy API can neither scale nor wait for fences. */
+	if (!b->atomic_modeset &&
+	    (src_scanout->src_x != 0 || src_scanout->src_y != 0 ||
+	     src_scanout->src_w != (uint32_t) width << 16 ||
+	     src_scanout->src_h != (uint32_t) height << 16 ||
+	     src_scanout->rotation != WL_OUTPUT_TRANSFORM_NORMAL ||
+	     (src_pending && src_scanout->in_fence_fd >= 0)))
+		return false;
+
+	state = drm_output_state_duplicate(output->state_cur, pending_state,
+					   DRM_OUTPUT_STATE_CLEAR_PLANES);
+
+	drm_output_mirror_plane(state, output->scanout_plane, src_scanout,
+				src_pending,
+				(int64_t) src_scanout->dest_x * width / src_width,
+				(int64_t) src_scanout->dest_y * height / src_height,
+				(uint64_t) src_scanout->dest_w * width / src_width,
+				(uint64_t) src_scanout->dest_h * height / src_height);
+
+	/* Cursor planes do not scale, only the position follows. */
+	if (src_cursor && output->cursor_plane &&
+	    drm_plane_supports_format(output->cursor_plane,
+				      src_cursor->fb->format->format,
+				      src_cursor->fb->modifier))
+		drm_output_mirror_plane(state, output->cursor_plane, src_cursor,
+					src_pending,
+					(int64_t) src_cursor->dest_x * width / src_width,
+					(int64_t) src_cursor->dest_y * height / src_height,
+					src_cursor->dest_w, src_cursor->dest_h);
+	output->cursor_view = NULL;
+
+	if (b->atomic_modeset &&
+	    drm_pending_state_test_cached(pending_state) != 0) {
+		drm_debug(b, "\t[mirror] %s cannot scan out the frame of %s, "
+			     "compositing\n", output->base.name,
+			  source->base.name);
+		drm_output_state_free(state);
+		return false;
+	}
+
+	drm_debug(b, "\t[mirror] %s shows fb %u of %s\n", output->base.name,
+		  src_scanout->fb->fb_id, source->base.name);
+
+	return true;
+}
+
+/**
+ * Have the mirrors of an output pick up its new frame
+ *
+ * Mirrors repainted earlier in the same repaint cycle took the previous
+ * frame, they show this one at their next refresh.
+ */
+void
+drm_output_schedule_mirrors(struct drm_output *source)
+{
+	struct weston_output *base;
+	struct drm_output *output;
+
+	wl_list_for_each(base, &source->base.compositor->output_list, link) {
+		output = to_drm_output(base);
+		if (drm_output_get_mirror_source(output) == source)
+			weston_output_schedule_repaint(base);
+	}
+}
+
+static void
+drm_plane_state_drop_source_fb(struct drm_plane_state *ps,
+			       struct drm_output *source)
+{
+	if (!ps->fb || ps->fb->type != BUFFER_GBM_SURFACE ||
+	    ps->fb->gbm_surface != source->gbm_surface)
+		return;
+
+	drm_fb_unref(ps->fb);
+	ps->fb = NULL;
+}
+
+/**
+ * Stop the mirrors of an output from using its renderer buffers
+ *
+ * Destroying the GBM surface of the source destroys its buffers regardless
+ * of the references the mirrors hold, see drm_output_fini_egl(). Mirrors
+ * showing one of them drop it, from the frame in flight as well, and
+ * composite their next frame themselves. Client and cursor framebuffers
+ * are reference counted and stay with the mirrors until they flip away.
+ */
+void
+drm_output_release_mirrors(struct drm_output *source)
+{
+	struct weston_output *base;
+	struct drm_output *output;
+	struct drm_plane_state *ps;
+
+	if (!source->gbm_surface || source->backend->shutting_down)
+		return;
+
+	wl_list_for_each(base, &source->base.compositor->output_list, link) {
+		output = to_drm_output(base);
+		if (output == source || output->virtual ||
+		    !output->mirror_source ||
+		    strcmp(output->mirror_source, source->base.name) != 0)
+			continue;
+
+		drm_plane_state_drop_source_fb(output->scanout_plane->state_cur,
+					       source);
+		if (output->state_last)
+			wl_list_for_each(ps, &output->state_last->plane_list,
+					 link)
+				drm_plane_state_drop_source_fb(ps, source);
+
+		weston_output_damage(base);
+	}
+}
@@ -470,7 +470,7 @@ drm_output_choose_mode(struct drm_output *output,
 	enum weston_mode_aspect_ratio target_aspect = WESTON_MODE_PIC_AR_NONE;
 	struct drm_backend *b;
 
-	b = to_drm_backend(output->base.compositor);
+	b = output->backend;
 	target_aspect = target_mode->aspect_ratio;
 	src_aspect = output->base.current_mode->aspect_ratio;
 	if (output->base.current_mode->width == target_mode->width &&
@@ -505,6 +505,41 @@ drm_output_choose_mode(struct drm_output *output,
 	return tmp_mode;
 }
 
+/* The TILE blob is a string of eight numbers: group id, whether the tiles
+ * form a single monitor, the number of tiles across and down, the location
+ * of this one, and the tile size in pixels. */
+static void
+update_head_tile(struct drm_head *head, drmModeObjectPropertiesPtr props)
+{
+	drmModePropertyBlobPtr blob;
+	uint32_t blob_id;
+	char buf[64];
+	unsigned int single, n;
+
+	memset(&head->tile, 0, sizeof head->tile);
+
+	blob_id = drm_property_get_value(&head->props_conn[WDRM_CONNECTOR_TILE],
+					 props, 0);
+	if (!blob_id)
+		return;
+
+	blob = drmModeGetPropertyBlob(head->backend->drm.fd, blob_id);
+	if (!blob)
+		return;
+
+	n = MIN(blob->length, sizeof(buf) - 1);
+	memcpy(buf, blob->data, n);
+	buf[n] = '\0';
+	drmModeFreePropertyBlob(blob);
+
+	if (sscanf(buf, "%u:%u:%u:%u:%u:%u:%u:%u", &head->tile.group_id,
+		   &single, &head->tile.num_h, &head->tile.num_v,
+		   &head->tile.loc_h, &head->tile.loc_v,
+		   &head->tile.width, &head->tile.height) != 8 ||
+	    head->tile.num_h * head->tile.num_v < 2)
+		memset(&head->tile, 0, sizeof head->tile);
+}
+
 void
 update_head_from_connector(struct drm_head *head,
 			   drmModeObjectProperties *props)
@@ -517,6 +552,9 @@ update_head_from_connector(struct drm_head *head,
 	weston_head_set_monitor_strings(&head->base, make, model, serial_number);
 	weston_head_set_non_desktop(&head->base,
 				    check_non_desktop(head, props));
+	head->vrr_capable = drm_property_get_value(
+		&head->props_conn[WDRM_CONNECTOR_VRR_CAPABLE], props, 0);
+	update_head_tile(head, props);
 	weston_head_set_subpixel(&head->base,
 		drm_subpixel_to_wayland(head->connector->subpixel));
 
@@ -726,7 +764,7 @@ drm_output_try_add_mode(struct drm_output *output, const drmModeModeInfo *info)
 
 	if (chosen == info) {
 		assert(mode);
-		backend = to_drm_backend(output->base.compositor);
+		backend = output->backend;
 		drm_output_destroy_mode(backend, mode);
 		chosen = NULL;
 	}
@@ -754,7 +792,7 @@ drm_output_try_add_mode(struct drm_output *output, const drmModeModeInfo *info)
 static int
 drm_output_update_modelist_from_heads(struct drm_output *output)
 {
-	struct drm_backend *backend = to_drm_backend(output->base.compositor);
+	struct drm_backend *backend = output->backend;
 	struct weston_head *head_base;
 	struct drm_head *head;
 	int i;
@@ -783,7 +821,7 @@ drm_output_set_mode(struct weston_output *base,
 		    const char *modeline)
 {
 	struct drm_output *output = to_drm_output(base);
-	struct drm_backend *b = to_drm_backend(base->compositor);
+	struct drm_backend *b = output->backend;
 	struct drm_head *head = to_drm_head(weston_output_get_first_head(base));
 
 	struct drm_mode *current;
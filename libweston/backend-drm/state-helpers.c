@@ -29,12 +29,123 @@
 
 #include "config.h"
 
+#include <stddef.h>
+#include <string.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <drm_fourcc.h>
 
 #include "drm-internal.h"
 
+/**
+ * Prepare the free lists of state objects
+ *
+ * Every repaint allocates a pending state, an output state per output and
+ * plane states for the planes in use, then frees most of them when the
+ * commit completes, or straight away when drm_output_propose_state()
+ * falls back to another mode. The freed objects are kept for the next
+ * repaint instead, up to DRM_STATE_POOL_SIZE of each type. Ownership does
+ * not change: an object is only put on a free list where it would
+ * otherwise have been freed.
+ *
+ * @param b DRM backend
+ */
+void
+drm_backend_state_pool_init(struct drm_backend *b)
+{
+	wl_list_init(&b->state_pool.pending_states);
+	wl_list_init(&b->state_pool.output_states);
+	wl_list_init(&b->state_pool.plane_states);
+}
+
+/**
+ * Free the state objects kept for reuse
+ *
+ * Called when the backend is destroyed, once the states of all outputs and
+ * planes have been freed.
+ *
+ * @param b DRM backend
+ */
+void
+drm_backend_state_pool_fini(struct drm_backend *b)
+{
+	struct drm_state_pool *pool = &b->state_pool;
+	struct drm_pending_state *pending_state, *pending_tmp;
+	struct drm_output_state *output_state, *output_tmp;
+	struct drm_plane_state *plane_state, *plane_tmp;
+
+	wl_list_for_each_safe(pending_state, pending_tmp,
+			      &pool->pending_states, link)
+		free(pending_state);
+	wl_list_for_each_safe(output_state, output_tmp,
+			      &pool->output_states, link)
+		free(output_state);
+	wl_list_for_each_safe(plane_state, plane_tmp,
+			      &pool->plane_states, link)
+		free(plane_state);
+
+	drm_backend_state_pool_init(b);
+	pool->pending_count = 0;
+	pool->output_count = 0;
+	pool->plane_count = 0;
+}
+
+/* Takes the first object off a free list, or allocates one. The object is
+ * zeroed either way. */
+static void *
+state_pool_get(struct drm_backend *b, struct wl_list *list,
+	       unsigned int *count, size_t link_offset, size_t size)
+{
+	void *obj;
+
+	b->stats.state_allocs++;
+
+	if (wl_list_empty(list))
+		return zalloc(size);
+
+	obj = (char *)list->next - link_offset;
+	wl_list_remove(list->next);
+	(*count)--;
+	b->stats.state_reused++;
+
+	memset(obj, 0, size);
+
+	return obj;
+}
+
+/* Puts an object whose link is in no list on a free list, or frees it if
+ * the list is full. */
+static void
+state_pool_put(struct wl_list *list, unsigned int *count,
+	       struct wl_list *link, void *obj)
+{
+	if (*count >= DRM_STATE_POOL_SIZE) {
+		free(obj);
+		return;
+	}
+
+	wl_list_insert(list, link);
+	(*count)++;
+}
+
+static struct drm_plane_state *
+plane_state_get(struct drm_backend *b)
+{
+	return state_pool_get(b, &b->state_pool.plane_states,
+			      &b->state_pool.plane_count,
+			      offsetof(struct drm_plane_state, link),
+			      sizeof(struct drm_plane_state));
+}
+
+static struct drm_output_state *
+output_state_get(struct drm_backend *b)
+{
+	return state_pool_get(b, &b->state_pool.output_states,
+			      &b->state_pool.output_count,
+			      offsetof(struct drm_output_state, link),
+			      sizeof(struct drm_output_state));
+}
+
 /**
  * Allocate a new, empty, plane state.
  */
@@ -42,13 +153,14 @@ struct drm_plane_state *
 drm_plane_state_alloc(struct drm_output_state *state_output,
 		      struct drm_plane *plane)
 {
-	struct drm_plane_state *state = zalloc(sizeof(*state));
+	struct drm_plane_state *state = plane_state_get(plane->backend);
 
 	assert(state);
 	state->output_state = state_output;
 	state->plane = plane;
 	state->in_fence_fd = -1;
 	state->zpos = DRM_PLANE_ZPOS_INVALID_PLANE;
+	state->alpha = DRM_PLANE_ALPHA_OPAQUE;
 
 	/* Here we only add the plane state to the desired link, and not
 	 * set the member. Having an output pointer set means that the
@@ -92,8 +204,14 @@ drm_plane_state_free(struct drm_plane_state *state, bool force)
 	}
 
 	if (force || state != state->plane->state_cur) {
+		struct drm_state_pool *pool = &state->plane->backend->state_pool;
+
 		drm_fb_unref(state->fb);
-		free(state);
+		weston_buffer_reference(&state->buffer_ref, NULL);
+		weston_buffer_release_reference(&state->buffer_release_ref,
+						NULL);
+		state_pool_put(&pool->plane_states, &pool->plane_count,
+			       &state->link, state);
 	}
 }
 
@@ -106,7 +224,7 @@ struct drm_plane_state *
 drm_plane_state_duplicate(struct drm_output_state *state_output,
 			  struct drm_plane_state *src)
 {
-	struct drm_plane_state *dst = zalloc(sizeof(*dst));
+	struct drm_plane_state *dst = plane_state_get(src->plane->backend);
 	struct drm_plane_state *old, *tmp;
 
 	assert(src);
@@ -130,12 +248,35 @@ drm_plane_state_duplicate(struct drm_output_state *state_output,
 	wl_list_insert(&state_output->plane_list, &dst->link);
 	if (src->fb)
 		dst->fb = drm_fb_ref(src->fb);
+
+	dst->buffer_ref.buffer = NULL;
+	weston_buffer_reference(&dst->buffer_ref, src->buffer_ref.buffer);
+	dst->buffer_release_ref.buffer_release = NULL;
+	weston_buffer_release_reference(&dst->buffer_release_ref,
+					src->buffer_release_ref.buffer_release);
+
 	dst->output_state = state_output;
 	dst->complete = false;
 
 	return dst;
 }
 
+/**
+ * Keep the buffer of a view busy while the plane state may scan it out,
+ * after the fb of the view has been placed in the state.
+ */
+void
+drm_plane_state_set_buffer(struct drm_plane_state *state,
+			   struct weston_view *ev)
+{
+	struct weston_surface *surface = ev->surface;
+
+	weston_buffer_reference(&state->buffer_ref,
+				surface->buffer_ref.buffer);
+	weston_buffer_release_reference(&state->buffer_release_ref,
+					surface->buffer_release_ref.buffer_release);
+}
+
 /**
  * Remove a plane state from an output state; if the plane was previously
  * enabled, then replace it with a disabling state. This ensures that the
@@ -169,6 +310,67 @@ drm_plane_state_put_back(struct drm_plane_state *state)
 	(void) drm_plane_state_alloc(state_output, plane);
 }
 
+/**
+ * Compute the value of the plane rotation property for a transform
+ *
+ * @param plane The plane to rotate the framebuffer on
+ * @param transform The transform to apply, in wl_output terms
+ * @param rotation Returns the bitmask for the plane rotation property
+ * @returns False if the plane cannot apply the transform
+ *
+ * Both wl_output and KMS count rotations counter-clockwise. Flipped
+ * transforms mirror around the vertical axis before rotating, which is
+ * reflect-x.
+ */
+bool
+drm_plane_rotation_from_transform(struct drm_plane *plane,
+				  enum wl_output_transform transform,
+				  uint64_t *rotation)
+{
+	const struct drm_property_info *info = &plane->props[WDRM_PLANE_ROTATION];
+	enum wdrm_plane_rotation rotate;
+	uint64_t value;
+
+	switch (transform) {
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+		rotate = WDRM_PLANE_ROTATION_0;
+		break;
+	case WL_OUTPUT_TRANSFORM_90:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+		rotate = WDRM_PLANE_ROTATION_90;
+		break;
+	case WL_OUTPUT_TRANSFORM_180:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+		rotate = WDRM_PLANE_ROTATION_180;
+		break;
+	case WL_OUTPUT_TRANSFORM_270:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		rotate = WDRM_PLANE_ROTATION_270;
+		break;
+	default:
+		return false;
+	}
+
+	if (info->prop_id == 0)
+		return rotate == WDRM_PLANE_ROTATION_0 &&
+		       transform == WL_OUTPUT_TRANSFORM_NORMAL;
+
+	if (!info->enum_values[rotate].valid)
+		return false;
+	value = 1ULL << info->enum_values[rotate].value;
+
+	if (transform >= WL_OUTPUT_TRANSFORM_FLIPPED) {
+		if (!info->enum_values[WDRM_PLANE_ROTATION_REFLECT_X].valid)
+			return false;
+		value |= 1ULL <<
+			info->enum_values[WDRM_PLANE_ROTATION_REFLECT_X].value;
+	}
+
+	*rotation = value;
+	return true;
+}
+
 /**
  * Given a weston_view, fill the drm_plane_state's co-ordinates to display on
  * a given plane.
@@ -186,6 +388,23 @@ drm_plane_state_coords_for_view(struct drm_plane_state *state,
 	if (!drm_view_transform_supported(ev, &output->base))
 		return false;
 
+	/* A buffer the client did not pre-rotate for the output needs the
+	 * plane to rotate it. The source rectangle below stays in buffer
+	 * co-ordinates, which is what KMS expects before rotation. */
+	state->rotation = WL_OUTPUT_TRANSFORM_NORMAL;
+	if (ev->surface->buffer_viewport.buffer.transform !=
+	    output->base.transform) {
+		uint64_t rotation;
+
+		if (!output->backend->atomic_modeset ||
+		    !drm_plane_rotation_from_transform(state->plane,
+						       output->base.transform,
+						       &rotation))
+			return false;
+
+		state->rotation = output->base.transform;
+	}
+
 	/* Update the base weston_plane co-ordinates. */
 	box = pixman_region32_extents(&ev->transform.boundingbox);
 	state->plane->base.x = box->x1;
@@ -199,11 +418,7 @@ drm_plane_state_coords_for_view(struct drm_plane_state *state,
 				  &output->base.region);
 	pixman_region32_translate(&dest_rect, -output->base.x, -output->base.y);
 	box = pixman_region32_extents(&dest_rect);
-	tbox = weston_transformed_rect(output->base.width,
-				       output->base.height,
-				       output->base.transform,
-				       output->base.current_scale,
-				       *box);
+	tbox = weston_output_transformed_rect(&output->base, *box);
 	state->dest_x = tbox.x1;
 	state->dest_y = tbox.y1;
 	state->dest_w = tbox.x2 - tbox.x1;
@@ -258,6 +473,9 @@ drm_plane_state_coords_for_view(struct drm_plane_state *state,
 	/* apply zpos if available */
 	state->zpos = zpos;
 
+	/* Only planes with the alpha property take translucent views. */
+	state->alpha = ev->alpha * DRM_PLANE_ALPHA_OPAQUE + 0.5f;
+
 	return true;
 }
 
@@ -318,12 +536,13 @@ struct drm_output_state *
 drm_output_state_alloc(struct drm_output *output,
 		       struct drm_pending_state *pending_state)
 {
-	struct drm_output_state *state = zalloc(sizeof(*state));
+	struct drm_output_state *state = output_state_get(output->backend);
 
 	assert(state);
 	state->output = output;
 	state->dpms = WESTON_DPMS_OFF;
 	state->protection = WESTON_HDCP_DISABLE;
+	state->out_fence_fd = -1;
 	state->pending_state = pending_state;
 	if (pending_state)
 		wl_list_insert(&pending_state->output_list, &state->link);
@@ -348,7 +567,7 @@ drm_output_state_duplicate(struct drm_output_state *src,
 			   struct drm_pending_state *pending_state,
 			   enum drm_output_state_duplicate_mode plane_mode)
 {
-	struct drm_output_state *dst = malloc(sizeof(*dst));
+	struct drm_output_state *dst = output_state_get(src->output->backend);
 	struct drm_plane_state *ps;
 
 	assert(dst);
@@ -359,6 +578,8 @@ drm_output_state_duplicate(struct drm_output_state *src,
 	*dst = *src;
 
 	dst->pending_state = pending_state;
+	dst->tearing = false;
+	dst->out_fence_fd = -1;
 	if (pending_state)
 		wl_list_insert(&pending_state->output_list, &dst->link);
 	else
@@ -387,6 +608,7 @@ drm_output_state_duplicate(struct drm_output_state *src,
 void
 drm_output_state_free(struct drm_output_state *state)
 {
+	struct drm_state_pool *pool;
 	struct drm_plane_state *ps, *next;
 
 	if (!state)
@@ -397,7 +619,9 @@ drm_output_state_free(struct drm_output_state *state)
 
 	wl_list_remove(&state->link);
 
-	free(state);
+	pool = &state->output->backend->state_pool;
+	state_pool_put(&pool->output_states, &pool->output_count,
+		       &state->link, state);
 }
 
 /**
@@ -414,7 +638,10 @@ drm_pending_state_alloc(struct drm_backend *backend)
 {
 	struct drm_pending_state *ret;
 
-	ret = calloc(1, sizeof(*ret));
+	ret = state_pool_get(backend, &backend->state_pool.pending_states,
+			     &backend->state_pool.pending_count,
+			     offsetof(struct drm_pending_state, link),
+			     sizeof(*ret));
 	if (!ret)
 		return NULL;
 
@@ -435,6 +662,7 @@ drm_pending_state_alloc(struct drm_backend *backend)
 void
 drm_pending_state_free(struct drm_pending_state *pending_state)
 {
+	struct drm_state_pool *pool;
 	struct drm_output_state *output_state, *tmp;
 
 	if (!pending_state)
@@ -445,7 +673,9 @@ drm_pending_state_free(struct drm_pending_state *pending_state)
 		drm_output_state_free(output_state);
 	}
 
-	free(pending_state);
+	pool = &pending_state->backend->state_pool;
+	state_pool_put(&pool->pending_states, &pool->pending_count,
+		       &pending_state->link, pending_state);
 }
 
 /**
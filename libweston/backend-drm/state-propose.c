@@ -29,6 +29,8 @@
 
 #include "config.h"
 
+#include <stdio.h>
+
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
@@ -37,6 +39,7 @@
 #include <libweston/pixel-formats.h>
 
 #include "drm-internal.h"
+#include "shared/timespec-util.h"
 
 #include "linux-dmabuf.h"
 #include "presentation-time-server-protocol.h"
@@ -129,26 +132,12 @@ drm_output_plane_has_valid_format(struct drm_plane *plane,
 				  struct drm_fb *fb)
 {
 	struct drm_backend *b = plane->backend;
-	unsigned int i;
 
 	if (!fb)
 		return false;
 
-	/* Check whether the format is supported */
-	for (i = 0; i < plane->count_formats; i++) {
-		unsigned int j;
-
-		if (plane->formats[i].format != fb->format->format)
-			continue;
-
-		if (fb->modifier == DRM_FORMAT_MOD_INVALID)
-			return true;
-
-		for (j = 0; j < plane->formats[i].count_modifiers; j++) {
-			if (plane->formats[i].modifiers[j] == fb->modifier)
-				return true;
-		}
-	}
+	if (drm_plane_supports_format(plane, fb->format->format, fb->modifier))
+		return true;
 
 	drm_debug(b, "\t\t\t\t[%s] not placing view on %s: "
 		  "no free %s planes matching format %s (0x%lx) "
@@ -175,6 +164,54 @@ drm_output_plane_cursor_has_valid_format(struct weston_view *ev)
 	return false;
 }
 
+static bool
+drm_plane_has_enum_value(struct drm_plane *plane,
+			 enum wdrm_plane_property prop, unsigned int value)
+{
+	const struct drm_property_info *info = &plane->props[prop];
+
+	/* Without the property, the hardware only does the defaults. */
+	if (info->prop_id == 0)
+		return value == 0;
+
+	return info->enum_values[value].valid;
+}
+
+/* Copies the YUV color representation of the client's surface to the
+ * plane state, failing if the plane cannot show it. */
+static bool
+drm_plane_state_set_color_representation(struct drm_plane_state *state,
+					 struct weston_view *ev)
+{
+	struct weston_surface *surface = ev->surface;
+	struct drm_plane *plane = state->plane;
+
+	if (!state->fb->format || state->fb->format->num_planes == 0)
+		return true;
+
+	switch (surface->yuv_coefficients) {
+	case WESTON_YUV_COEFFICIENTS_BT709:
+		state->color_encoding = WDRM_PLANE_COLOR_ENCODING_BT709;
+		break;
+	case WESTON_YUV_COEFFICIENTS_BT2020:
+		state->color_encoding = WDRM_PLANE_COLOR_ENCODING_BT2020;
+		break;
+	case WESTON_YUV_COEFFICIENTS_BT601:
+	default:
+		state->color_encoding = WDRM_PLANE_COLOR_ENCODING_BT601;
+		break;
+	}
+
+	state->color_range = surface->yuv_range == WESTON_YUV_RANGE_FULL ?
+			     WDRM_PLANE_COLOR_RANGE_FULL :
+			     WDRM_PLANE_COLOR_RANGE_LIMITED;
+
+	return drm_plane_has_enum_value(plane, WDRM_PLANE_COLOR_ENCODING,
+					state->color_encoding) &&
+	       drm_plane_has_enum_value(plane, WDRM_PLANE_COLOR_RANGE,
+					state->color_range);
+}
+
 static struct drm_plane_state *
 drm_output_prepare_overlay_view(struct drm_plane *plane,
 				struct drm_output_state *output_state,
@@ -183,8 +220,7 @@ drm_output_prepare_overlay_view(struct drm_plane *plane,
 				struct drm_fb *fb, uint64_t zpos)
 {
 	struct drm_output *output = output_state->output;
-	struct weston_compositor *ec = output->base.compositor;
-	struct drm_backend *b = to_drm_backend(ec);
+	struct drm_backend *b = output->backend;
 	struct drm_plane_state *state = NULL;
 	int ret;
 
@@ -228,6 +264,15 @@ drm_output_prepare_overlay_view(struct drm_plane *plane,
 	 * calling drm_fb_get_from_view() in drm_output_prepare_plane_view(),
 	 * so, we take another reference here to live within the state. */
 	state->fb = drm_fb_ref(fb);
+	drm_plane_state_set_buffer(state, ev);
+
+	if (!drm_plane_state_set_color_representation(state, ev)) {
+		drm_debug(b, "\t\t\t\t[overlay] not placing view %p on overlay: "
+			     "unsupported YUV color encoding or range\n", ev);
+		drm_plane_state_put_back(state);
+		state = NULL;
+		goto out;
+	}
 
 	state->in_fence_fd = ev->surface->acquire_fence_fd;
 
@@ -240,7 +285,7 @@ drm_output_prepare_overlay_view(struct drm_plane *plane,
 		goto out;
 	}
 
-	ret = drm_pending_state_test(output_state->pending_state);
+	ret = drm_pending_state_test_cached(output_state->pending_state);
 	if (ret == 0) {
 		drm_debug(b, "\t\t\t[overlay] provisionally placing "
 			     "view %p on overlay %d in mixed mode\n",
@@ -302,7 +347,7 @@ drm_output_prepare_cursor_view(struct drm_output_state *output_state,
 			       struct weston_view *ev, uint64_t zpos)
 {
 	struct drm_output *output = output_state->output;
-	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_backend *b = output->backend;
 	struct drm_plane *plane = output->cursor_plane;
 	struct drm_plane_state *plane_state;
 	bool needs_update = false;
@@ -338,6 +383,14 @@ drm_output_prepare_cursor_view(struct drm_output_state *output_state,
 		goto err;
 	}
 
+	/* cursor_bo_update() places the image in the top-left corner of the
+	 * cursor buffer, which a rotation would move. */
+	if (plane_state->rotation != WL_OUTPUT_TRANSFORM_NORMAL) {
+		drm_debug(b, "\t\t\t\t[%s] not placing view %p on %s: "
+			     "rotation needed\n", p_name, ev, p_name);
+		goto err;
+	}
+
 	if (plane_state->src_x != 0 || plane_state->src_y != 0 ||
 	    plane_state->src_w > (unsigned) b->cursor_width << 16 ||
 	    plane_state->src_h > (unsigned) b->cursor_height << 16 ||
@@ -409,7 +462,7 @@ drm_output_prepare_scanout_view(struct drm_output_state *output_state,
 				struct drm_fb *fb, uint64_t zpos)
 {
 	struct drm_output *output = output_state->output;
-	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_backend *b = output->backend;
 	struct drm_plane *scanout_plane = output->scanout_plane;
 	struct drm_plane_state *state;
 	const char *p_name = drm_output_get_plane_type_name(scanout_plane);
@@ -418,15 +471,6 @@ drm_output_prepare_scanout_view(struct drm_output_state *output_state,
 	assert(b->atomic_modeset);
 	assert(mode == DRM_OUTPUT_PROPOSE_STATE_PLANES_ONLY);
 
-	/* Check the view spans exactly the output size, calculated in the
-	 * logical co-ordinate space. */
-	if (!weston_view_matches_output_entirely(ev, &output->base)) {
-		drm_debug(b, "\t\t\t\t[%s] not placing view %p on %s: "
-			     " view does not match output entirely\n",
-			     p_name, ev, p_name);
-		return NULL;
-	}
-
 	/* If the surface buffer has an in-fence fd, but the plane doesn't
 	 * support fences, we can't place the buffer on this plane. */
 	if (ev->surface->acquire_fence_fd >= 0 &&
@@ -453,6 +497,7 @@ drm_output_prepare_scanout_view(struct drm_output_state *output_state,
 
 	/* take another reference here to live within the state */
 	state->fb = drm_fb_ref(fb);
+	drm_plane_state_set_buffer(state, ev);
 	state->ev = ev;
 	state->output = output;
 	if (!drm_plane_state_coords_for_view(state, ev, zpos)) {
@@ -461,14 +506,25 @@ drm_output_prepare_scanout_view(struct drm_output_state *output_state,
 		goto err;
 	}
 
-	if (state->dest_x != 0 || state->dest_y != 0 ||
-	    state->dest_w != (unsigned) output->base.current_mode->width ||
-	    state->dest_h != (unsigned) output->base.current_mode->height) {
+	/* A view not covering the whole output, e.g. one scaled or centered
+	 * by the fullscreen shell, can only be scanned out if what is around
+	 * it is black: the CRTC shows black where no plane covers it. Views
+	 * below it which are not black backdrops need the renderer, which
+	 * fails this planes-only state anyway. Whether the primary plane may
+	 * be smaller than the CRTC is up to the driver's atomic test. */
+	if (state->dest_w == 0 || state->dest_h == 0) {
 		drm_debug(b, "\t\t\t\t[%s] not placing view %p on %s: "
 			     " invalid plane state\n", p_name, ev, p_name);
 		goto err;
 	}
 
+	if (!drm_plane_state_set_color_representation(state, ev)) {
+		drm_debug(b, "\t\t\t\t[%s] not placing view %p on %s: "
+			     "unsupported YUV color encoding or range\n",
+			     p_name, ev, p_name);
+		goto err;
+	}
+
 	state->in_fence_fd = ev->surface->acquire_fence_fd;
 
 	/* In plane-only mode, we don't need to test the state now, as we
@@ -632,15 +688,52 @@ drm_output_check_zpos_plane_states(struct drm_output_state *state)
 	}
 }
 
+/* Whether any overlay or primary plane usable by the output can show the
+ * format, for the scanout tranche of the dmabuf feedback. */
+static bool
+drm_output_scanout_format_supported(void *data, uint32_t format,
+				    uint64_t modifier)
+{
+	struct drm_output *output = data;
+	struct drm_plane *plane;
+
+	wl_list_for_each(plane, &output->backend->plane_list, link) {
+		if (plane->type == WDRM_PLANE_TYPE_CURSOR ||
+		    !(plane->possible_crtcs & (1 << output->pipe)))
+			continue;
+
+		if (drm_plane_supports_format(plane, format, modifier))
+			return true;
+	}
+
+	return false;
+}
+
+/* Whether another view of the output is pinned to the plane by the shell. */
+static bool
+drm_plane_is_pinned(struct drm_plane *plane, struct drm_output *output,
+		    struct weston_view *ev)
+{
+	struct weston_view **evp;
+
+	wl_array_for_each(evp, &output->base.view_array) {
+		if (*evp != ev && (*evp)->pinned_plane == plane->plane_id)
+			return true;
+	}
+
+	return false;
+}
+
 static struct drm_plane_state *
 drm_output_prepare_plane_view(struct drm_output_state *state,
 			      struct weston_view *ev,
 			      enum drm_output_propose_state_mode mode,
 			      struct drm_plane_state *scanout_state,
-			      uint64_t current_lowest_zpos)
+			      uint64_t current_lowest_zpos,
+			      bool allow_overlay)
 {
 	struct drm_output *output = state->output;
-	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_backend *b = output->backend;
 
 	struct drm_plane_state *ps = NULL;
 	struct drm_plane *plane;
@@ -648,6 +741,7 @@ drm_output_prepare_plane_view(struct drm_output_state *state,
 	struct wl_list zpos_candidate_list;
 
 	struct drm_fb *fb;
+	bool format_rejected = false;
 
 	wl_list_init(&zpos_candidate_list);
 
@@ -662,6 +756,35 @@ drm_output_prepare_plane_view(struct drm_output_state *state,
 		if (!drm_plane_is_available(plane, output))
 			continue;
 
+		/* A view pinned by the shell only goes on its own plane,
+		 * which is kept free of the others. */
+		if (ev->pinned_plane != 0 && ev->pinned_plane != plane->plane_id &&
+		    plane->type != WDRM_PLANE_TYPE_CURSOR) {
+			drm_debug(b, "\t\t\t\t[plane] not adding plane %d to "
+				     "candidate list: view pinned to plane "
+				     "%u\n", plane->plane_id, ev->pinned_plane);
+			continue;
+		}
+
+		if (ev->pinned_plane == 0 &&
+		    drm_plane_is_pinned(plane, output, ev)) {
+			drm_debug(b, "\t\t\t\t[plane] not adding plane %d to "
+				     "candidate list: pinned to another view\n",
+				     plane->plane_id);
+			continue;
+		}
+
+		/* Translucent views need an overlay plane blending with
+		 * what is below it. */
+		if (ev->alpha != 1.0f && plane->type != WDRM_PLANE_TYPE_CURSOR &&
+		    (plane->type != WDRM_PLANE_TYPE_OVERLAY ||
+		     plane->props[WDRM_PLANE_ALPHA].prop_id == 0)) {
+			drm_debug(b, "\t\t\t\t[plane] not adding plane %d to "
+				     "candidate list: no plane alpha for view "
+				     "alpha %.2f\n", plane->plane_id, ev->alpha);
+			continue;
+		}
+
 		if (drm_output_check_plane_has_view_assigned(plane, state)) {
 			drm_debug(b, "\t\t\t\t[plane] not adding plane %d to"
 				     " candidate list: view already assigned "
@@ -691,6 +814,13 @@ drm_output_prepare_plane_view(struct drm_output_state *state,
 			}
 		}
 
+		if (!allow_overlay && plane->type == WDRM_PLANE_TYPE_OVERLAY) {
+			drm_debug(b, "\t\t\t\t[plane] not adding plane %d to "
+				     "candidate list: kept for a view saving "
+				     "more composition\n", plane->plane_id);
+			continue;
+		}
+
 		if (mode == DRM_OUTPUT_PROPOSE_STATE_RENDERER_ONLY &&
 		    (plane->type == WDRM_PLANE_TYPE_OVERLAY ||
 		     plane->type == WDRM_PLANE_TYPE_PRIMARY)) {
@@ -700,6 +830,16 @@ drm_output_prepare_plane_view(struct drm_output_state *state,
 			continue;
 		}
 
+		/* Only the renderer applies the color transform. */
+		if (mode != DRM_OUTPUT_PROPOSE_STATE_RENDERER_ONLY &&
+		    plane->type != WDRM_PLANE_TYPE_CURSOR &&
+		    output->base.color_transform_in_renderer) {
+			drm_debug(b, "\t\t\t\t[plane] not adding plane %d to "
+				     "candidate list: color transform in "
+				     "renderer\n", plane->plane_id);
+			continue;
+		}
+
 		if (plane->type != WDRM_PLANE_TYPE_CURSOR &&
 		    b->sprites_are_broken) {
 			drm_debug(b, "\t\t\t\t[plane] not adding plane %d, type %s to "
@@ -709,10 +849,22 @@ drm_output_prepare_plane_view(struct drm_output_state *state,
 			continue;
 		}
 
+		/* SHM copies go on overlay planes: the scanout plane takes
+		 * dumb buffers from the renderer only. */
+		if (plane->type == WDRM_PLANE_TYPE_PRIMARY && fb &&
+		    fb->type == BUFFER_PIXMAN_DUMB) {
+			drm_debug(b, "\t\t\t\t[plane] not adding plane %d to "
+				     "candidate list: SHM copy\n",
+				     plane->plane_id);
+			continue;
+		}
+
 		if (!drm_output_plane_view_has_valid_format(plane, state, ev, fb)) {
 			drm_debug(b, "\t\t\t\t[plane] not adding plane %d to "
 				     "candidate list: invalid pixel format\n",
 				     plane->plane_id);
+			if (fb && plane->type != WDRM_PLANE_TYPE_CURSOR)
+				format_rejected = true;
 			continue;
 		}
 
@@ -754,27 +906,241 @@ drm_output_prepare_plane_view(struct drm_output_state *state,
 	wl_list_for_each_safe(p_zpos, p_zpos_next, &zpos_candidate_list, link)
 		drm_output_destroy_zpos_plane(p_zpos);
 
+	/* Tell the client which formats the planes would have taken. */
+	if (!ps && format_rejected &&
+	    linux_dmabuf_buffer_get(ev->surface->buffer_ref.buffer->resource))
+		weston_surface_set_dmabuf_scanout_tranche(ev->surface,
+							  b->drm.devnum,
+							  drm_output_scanout_format_supported,
+							  output);
+
 	drm_fb_unref(fb);
 	return ps;
 }
 
+/* Whether a view could possibly go on an overlay plane, mirroring the
+ * checks of drm_output_propose_state() and drm_fb_get_from_view() that do
+ * not depend on the other views. */
+static bool
+drm_view_is_overlay_candidate(struct drm_output *output,
+			      struct weston_view *ev)
+{
+	struct weston_surface *surface = ev->surface;
+
+	if (ev->output_mask != (1u << output->base.id))
+		return false;
+
+	if (!weston_view_has_valid_buffer(ev))
+		return false;
+
+	if (wl_shm_buffer_get(surface->buffer_ref.buffer->resource) &&
+	    (int64_t)surface->width * surface->height > DRM_SHM_FB_MAX_PIXELS)
+		return false;
+
+	if (surface->protection_mode == WESTON_SURFACE_PROTECTION_MODE_ENFORCED &&
+	    surface->desired_protection > output->base.current_protection)
+		return false;
+
+	if (output->base.capture_count > 0 &&
+	    surface->desired_protection > WESTON_HDCP_DISABLE)
+		return false;
+
+	return true;
+}
+
+/** Estimate the composition work saved by putting a view on a plane
+ *
+ * The renderer repaints the visible area of the view every time its content
+ * changes, so the saving is the area times the update rate. Blending reads
+ * the destination as well and YUV content needs a conversion, which both
+ * make the renderer path more expensive. Surfaces hinted as video come
+ * first, see weston_content_type_v1.
+ */
+static uint64_t
+drm_view_plane_score(struct drm_output *output, struct weston_view *ev,
+		     const struct timespec *now)
+{
+	struct weston_surface *surface = ev->surface;
+	struct linux_dmabuf_buffer *dmabuf;
+	const struct pixel_format_info *info = NULL;
+	pixman_region32_t visible;
+	pixman_box32_t *box;
+	uint64_t area, score;
+	int64_t interval;
+
+	pixman_region32_init(&visible);
+	pixman_region32_intersect(&visible, &ev->transform.boundingbox,
+				  &output->base.region);
+	box = pixman_region32_extents(&visible);
+	area = (uint64_t)(box->x2 - box->x1) * (box->y2 - box->y1);
+	pixman_region32_fini(&visible);
+
+	/* a surface that stopped updating is static whatever its past */
+	interval = MAX((int64_t)surface->buffer_interval_msec,
+		       timespec_sub_to_msec(now, &surface->buffer_time));
+	interval = MAX(interval, 1);
+
+	/* area times updates per 1000 seconds */
+	score = area * 1000000 / interval;
+
+	dmabuf = linux_dmabuf_buffer_get(surface->buffer_ref.buffer->resource);
+	if (dmabuf)
+		info = pixel_format_get_info(dmabuf->attributes.format);
+	if (info && info->sampler_type != 0)
+		score *= 2;
+
+	/* Video keeps updating at its own pace, and is what dropped frames
+	 * are most noticeable in. */
+	if (surface->content_type == WESTON_CONTENT_TYPE_VIDEO)
+		score *= 4;
+
+	if (!weston_view_is_opaque(ev, &ev->transform.boundingbox))
+		score = score * 3 / 2;
+
+	return score;
+}
+
+static unsigned int
+drm_output_count_free_overlays(struct drm_output *output)
+{
+	struct drm_backend *b = output->backend;
+	struct drm_plane *plane;
+	unsigned int n = 0;
+
+	wl_list_for_each(plane, &b->plane_list, link)
+		if (plane->type == WDRM_PLANE_TYPE_OVERLAY &&
+		    drm_plane_is_available(plane, output))
+			n++;
+
+	return n;
+}
+
+/** Score the views of an output for overlay planes
+ *
+ * \param output The output.
+ * \param free_overlays The number of overlay planes usable by the output.
+ * \param scores Returns one score per view of output->base.view_array,
+ * 0 for views that cannot go on an overlay. Free with free().
+ * \return The number of overlay candidates, or 0 if the scores are not
+ * needed, in which case scores is not allocated.
+ *
+ * Views are offered overlays from the top of the stack, so without this a
+ * small tooltip above a video takes the only overlay, leaving the video
+ * in the renderer. With the scores, drm_view_may_use_overlay() only lets
+ * a view take an overlay if no more valuable view below could use it.
+ */
+static unsigned int
+drm_output_score_views(struct drm_output *output, unsigned int free_overlays,
+		       uint64_t **scores)
+{
+	struct drm_backend *b = output->backend;
+	struct weston_view **views = output->base.view_array.data;
+	size_t n = output->base.view_array.size / sizeof *views;
+	struct timespec now;
+	unsigned int candidates = 0;
+	size_t i;
+
+	*scores = NULL;
+	if (n == 0 || free_overlays == 0)
+		return 0;
+
+	*scores = calloc(n, sizeof **scores);
+	if (!*scores)
+		return 0;
+
+	weston_compositor_read_presentation_clock(b->compositor, &now);
+
+	for (i = 0; i < n; i++) {
+		if (!drm_view_is_overlay_candidate(output, views[i]))
+			continue;
+
+		(*scores)[i] = MAX(drm_view_plane_score(output, views[i],
+							&now), 1);
+		candidates++;
+
+		drm_debug(b, "\t\t\t[view] view %p overlay score %"PRIu64
+			     " (update interval %u ms)\n", views[i],
+			  (*scores)[i], views[i]->surface->buffer_interval_msec);
+	}
+
+	/* nothing to arbitrate */
+	if (candidates <= free_overlays) {
+		free(*scores);
+		*scores = NULL;
+		return 0;
+	}
+
+	return candidates;
+}
+
+/* Whether the view at index i, being evaluated top to bottom, ranks among
+ * the free_overlays best candidates not evaluated yet. Ties go to the view
+ * higher in the stack. */
+static bool
+drm_view_may_use_overlay(const uint64_t *scores, size_t n, size_t i,
+			 unsigned int free_overlays)
+{
+	unsigned int better = 0;
+	size_t j;
+
+	for (j = i + 1; j < n; j++)
+		if (scores[j] > scores[i])
+			better++;
+
+	return better < free_overlays;
+}
+
+/* Adds a region to an accumulated one. The result goes to the spare region,
+ * which then takes the place of the accumulated one: pixman never writes
+ * into an operand that way, and both keep their storage. */
+static void
+region_accumulate(pixman_region32_t **acc, pixman_region32_t **spare,
+		  pixman_region32_t *add)
+{
+	pixman_region32_t *tmp;
+
+	pixman_region32_union(*spare, *acc, add);
+	tmp = *acc;
+	*acc = *spare;
+	*spare = tmp;
+}
+
+/* Returns the visible-and-opaque part of a view: the clipped view itself if
+ * it is opaque all over, or else its opaque part, computed into scratch. */
+static pixman_region32_t *
+view_visible_opaque(struct weston_view *ev, pixman_region32_t *clipped_view,
+		    pixman_region32_t *scratch)
+{
+	if (weston_view_is_opaque(ev, clipped_view))
+		return clipped_view;
+
+	pixman_region32_intersect(scratch, clipped_view,
+				  &ev->transform.opaque);
+	return scratch;
+}
+
 static struct drm_output_state *
 drm_output_propose_state(struct weston_output *output_base,
 			 struct drm_pending_state *pending_state,
 			 enum drm_output_propose_state_mode mode)
 {
 	struct drm_output *output = to_drm_output(output_base);
-	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_backend *b = output->backend;
 	struct drm_output_state *state;
 	struct drm_plane_state *scanout_state = NULL;
-	struct weston_view *ev;
+	struct weston_view *ev, **evp;
 
-	pixman_region32_t surface_overlap, renderer_region, planes_region;
-	pixman_region32_t occluded_region;
+	pixman_region32_t *surface_overlap, *renderer_region, *planes_region;
+	pixman_region32_t *occluded_region, *clipped_view, *view_opaque;
+	pixman_region32_t *renderer_spare, *planes_spare, *occluded_spare;
+	unsigned int scratch_mark;
 
 	bool renderer_ok = (mode != DRM_OUTPUT_PROPOSE_STATE_PLANES_ONLY);
 	int ret;
 	uint64_t current_lowest_zpos = DRM_PLANE_ZPOS_INVALID_PLANE;
+	uint64_t *scores = NULL;
+	unsigned int free_overlays = 0;
+	size_t n_views = output_base->view_array.size / sizeof(ev);
 
 	assert(!output->state_last);
 	state = drm_output_state_duplicate(output->state_cur,
@@ -826,6 +1192,11 @@ drm_output_propose_state(struct weston_output *output_base,
 			  (unsigned long) output->base.id);
 		drm_debug(b, "\t\t[state] scanout will use for zpos %"PRIu64"\n",
 				scanout_state->zpos);
+
+		if (!b->sprites_are_broken) {
+			free_overlays = drm_output_count_free_overlays(output);
+			drm_output_score_views(output, free_overlays, &scores);
+		}
 	}
 
 	/* - renderer_region contains the total region which which will be
@@ -839,38 +1210,36 @@ drm_output_propose_state(struct weston_output *output_base,
 	 *   to skip the view, if it is completely occluded; includes the
 	 *   situation where occluded_region covers entire output's region.
 	 */
-	pixman_region32_init(&renderer_region);
-	pixman_region32_init(&planes_region);
-	pixman_region32_init(&occluded_region);
-
-	wl_list_for_each(ev, &output_base->compositor->view_list, link) {
+	scratch_mark = weston_output_scratch_mark(output_base);
+	renderer_region = weston_output_scratch_region(output_base);
+	renderer_spare = weston_output_scratch_region(output_base);
+	planes_region = weston_output_scratch_region(output_base);
+	planes_spare = weston_output_scratch_region(output_base);
+	occluded_region = weston_output_scratch_region(output_base);
+	occluded_spare = weston_output_scratch_region(output_base);
+	clipped_view = weston_output_scratch_region(output_base);
+	surface_overlap = weston_output_scratch_region(output_base);
+	view_opaque = weston_output_scratch_region(output_base);
+
+	wl_array_for_each(evp, &output_base->view_array) {
 		struct drm_plane_state *ps = NULL;
 		bool force_renderer = false;
-		pixman_region32_t clipped_view;
 		bool totally_occluded = false;
 
+		ev = *evp;
+
 		drm_debug(b, "\t\t\t[view] evaluating view %p for "
 		             "output %s (%lu)\n",
 		          ev, output->base.name,
 			  (unsigned long) output->base.id);
 
-		/* If this view doesn't touch our output at all, there's no
-		 * reason to do anything with it. */
-		if (!(ev->output_mask & (1u << output->base.id))) {
-			drm_debug(b, "\t\t\t\t[view] ignoring view %p "
-			             "(not on our output)\n", ev);
-			continue;
-		}
-
 		/* Ignore views we know to be totally occluded. */
-		pixman_region32_init(&clipped_view);
-		pixman_region32_intersect(&clipped_view,
+		pixman_region32_intersect(clipped_view,
 					  &ev->transform.boundingbox,
 					  &output->base.region);
 
-		pixman_region32_init(&surface_overlap);
-		pixman_region32_subtract(&surface_overlap, &clipped_view,
-					 &occluded_region);
+		pixman_region32_subtract(surface_overlap, clipped_view,
+					 occluded_region);
 		/* if the view is completely occluded then ignore that
 		 * view; includes the case where occluded_region covers
 		 * the entire output */
@@ -878,8 +1247,19 @@ drm_output_propose_state(struct weston_output *output_base,
 		if (totally_occluded) {
 			drm_debug(b, "\t\t\t\t[view] ignoring view %p "
 			             "(occluded on our output)\n", ev);
-			pixman_region32_fini(&surface_overlap);
-			pixman_region32_fini(&clipped_view);
+			continue;
+		}
+
+		/* Below a view scanned out by the primary plane, a solid black
+		 * backdrop is what the CRTC shows anyway. */
+		if (mode == DRM_OUTPUT_PROPOSE_STATE_PLANES_ONLY &&
+		    drm_view_is_black_backdrop(ev) &&
+		    drm_output_check_plane_has_view_assigned(output->scanout_plane,
+							     state)) {
+			drm_debug(b, "\t\t\t\t[view] ignoring view %p "
+			             "(black backdrop)\n", ev);
+			region_accumulate(&occluded_region, &occluded_spare,
+					  clipped_view);
 			continue;
 		}
 
@@ -900,14 +1280,13 @@ drm_output_propose_state(struct weston_output *output_base,
 		/* Since we process views from top to bottom, we know that if
 		 * the view intersects the calculated renderer region, it must
 		 * be part of, or occluded by, it, and cannot go on a plane. */
-		pixman_region32_intersect(&surface_overlap, &renderer_region,
-					  &clipped_view);
-		if (pixman_region32_not_empty(&surface_overlap)) {
+		pixman_region32_intersect(surface_overlap, renderer_region,
+					  clipped_view);
+		if (pixman_region32_not_empty(surface_overlap)) {
 			drm_debug(b, "\t\t\t\t[view] not assigning view %p to plane "
 			             "(occluded by renderer views)\n", ev);
 			force_renderer = true;
 		}
-		pixman_region32_fini(&surface_overlap);
 
 		/* In case of enforced mode of content-protection do not
 		 * assign planes for a protected surface on an unsecured output.
@@ -919,15 +1298,35 @@ drm_output_propose_state(struct weston_output *output_base,
 			force_renderer = true;
 		}
 
+		/* Planes show up in writeback captures as they are, while the
+		 * renderer censors protected content when recording. */
+		if (output_base->capture_count > 0 &&
+		    ev->surface->desired_protection > WESTON_HDCP_DISABLE) {
+			drm_debug(b, "\t\t\t\t[view] not assigning view %p to plane "
+				     "(protected content on captured output)\n", ev);
+			force_renderer = true;
+		}
+
 		if (!force_renderer) {
+			size_t i = evp - (struct weston_view **)
+					 output_base->view_array.data;
+			bool allow_overlay = !scores || ev->pinned_plane != 0 ||
+				drm_view_may_use_overlay(scores, n_views, i,
+							 free_overlays);
+
 			drm_debug(b, "\t\t\t[plane] started with zpos %"PRIu64"\n",
 				      current_lowest_zpos);
 			ps = drm_output_prepare_plane_view(state, ev, mode,
 							   scanout_state,
-							   current_lowest_zpos);
+							   current_lowest_zpos,
+							   allow_overlay);
 		}
 
 		if (ps) {
+			if (ps->plane->type == WDRM_PLANE_TYPE_OVERLAY &&
+			    free_overlays > 0)
+				free_overlays--;
+
 			current_lowest_zpos = ps->zpos;
 			drm_debug(b, "\t\t\t[plane] next zpos to use %"PRIu64"\n",
 				      current_lowest_zpos);
@@ -940,22 +1339,17 @@ drm_output_propose_state(struct weston_output *output_base,
 			 * be added to the renderer region nor the occluded
 			 * region. */
 			if (ps->plane->type != WDRM_PLANE_TYPE_CURSOR) {
-				pixman_region32_union(&planes_region,
-						      &planes_region,
-						      &clipped_view);
-
-				if (!weston_view_is_opaque(ev, &clipped_view))
-					pixman_region32_intersect(&clipped_view,
-								  &clipped_view,
-								  &ev->transform.opaque);
-				/* the visible-and-opaque region of this view
-				 * will occlude views underneath it */
-				pixman_region32_union(&occluded_region,
-						      &occluded_region,
-						      &clipped_view);
+				pixman_region32_t *opaque;
 
-				pixman_region32_fini(&clipped_view);
+				region_accumulate(&planes_region, &planes_spare,
+						  clipped_view);
 
+				/* the visible-and-opaque region of this view
+				 * will occlude views underneath it */
+				opaque = view_visible_opaque(ev, clipped_view,
+							     view_opaque);
+				region_accumulate(&occluded_region,
+						  &occluded_spare, opaque);
 			}
 			continue;
 		}
@@ -967,32 +1361,21 @@ drm_output_propose_state(struct weston_output *output_base,
 			drm_debug(b, "\t\t[view] failing state generation: "
 				      "placing view %p to renderer not allowed\n",
 				  ev);
-			pixman_region32_fini(&clipped_view);
 			goto err_region;
 		}
 
-		pixman_region32_union(&renderer_region,
-				      &renderer_region,
-				      &clipped_view);
-
-		if (!weston_view_is_opaque(ev, &clipped_view))
-			pixman_region32_intersect(&clipped_view,
-						  &clipped_view,
-						  &ev->transform.opaque);
-
-		pixman_region32_union(&occluded_region,
-				      &occluded_region,
-				      &clipped_view);
-
-		pixman_region32_fini(&clipped_view);
+		region_accumulate(&renderer_region, &renderer_spare,
+				  clipped_view);
+		region_accumulate(&occluded_region, &occluded_spare,
+				  view_visible_opaque(ev, clipped_view,
+						      view_opaque));
 
 		drm_debug(b, "\t\t\t\t[view] view %p will be placed "
 			     "on the renderer\n", ev);
 	}
 
-	pixman_region32_fini(&renderer_region);
-	pixman_region32_fini(&planes_region);
-	pixman_region32_fini(&occluded_region);
+	weston_output_scratch_release(output_base, scratch_mark);
+	free(scores);
 
 	/* In renderer-only mode, we can't test the state as we don't have a
 	 * renderer buffer yet. */
@@ -1003,7 +1386,7 @@ drm_output_propose_state(struct weston_output *output_base,
 	drm_output_check_zpos_plane_states(state);
 
 	/* Check to see if this state will actually work. */
-	ret = drm_pending_state_test(state->pending_state);
+	ret = drm_pending_state_test_cached(state->pending_state);
 	if (ret != 0) {
 		drm_debug(b, "\t\t[view] failing state generation: "
 			     "atomic test not OK\n");
@@ -1022,28 +1405,98 @@ drm_output_propose_state(struct weston_output *output_base,
 	return state;
 
 err_region:
-	pixman_region32_fini(&renderer_region);
-	pixman_region32_fini(&occluded_region);
+	weston_output_scratch_release(output_base, scratch_mark);
+	free(scores);
 err:
 	drm_output_state_free(state);
 	return NULL;
 }
 
+/**
+ * Whether the client content of the state may be flipped without vblank
+ *
+ * Only a single client buffer on the scanout plane, from a surface which
+ * accepts tearing, with no other plane in use.
+ */
+static bool
+drm_output_state_may_tear(struct drm_output_state *state)
+{
+	struct drm_output *output = state->output;
+	struct drm_plane_state *ps;
+	bool tear = false;
+
+	wl_list_for_each(ps, &state->plane_list, link) {
+		if (!ps->fb)
+			continue;
+
+		if (ps->plane != output->scanout_plane || !ps->ev)
+			return false;
+
+		tear = ps->ev->surface->allow_tearing;
+	}
+
+	return tear;
+}
+
+/* Tell the debug scope when a client buffer starts or stops being
+ * scanned out directly, naming the surface. */
+static void
+drm_output_report_scanout(struct drm_output *output,
+			  struct drm_output_state *state)
+{
+	struct drm_backend *b = output->backend;
+	struct weston_view *ev = NULL;
+	struct drm_plane_state *ps;
+	char desc[512] = "";
+
+	wl_list_for_each(ps, &state->plane_list, link) {
+		if (ps->plane == output->scanout_plane) {
+			ev = ps->ev;
+			break;
+		}
+	}
+
+	if (output->direct_scanout == (ev != NULL))
+		return;
+	output->direct_scanout = ev != NULL;
+
+	if (!ev) {
+		drm_debug(b, "\t[repaint] output %s leaves direct scanout\n",
+			  output->base.name);
+		return;
+	}
+
+	if (!ev->surface->get_label ||
+	    ev->surface->get_label(ev->surface, desc, sizeof desc) < 0)
+		snprintf(desc, sizeof desc, "unlabeled surface");
+
+	drm_debug(b, "\t[repaint] output %s scans out view %p directly "
+		     "(%s, %dx%d)\n", output->base.name, ev, desc,
+		  ev->surface->width, ev->surface->height);
+}
+
 void
 drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 {
-	struct drm_backend *b = to_drm_backend(output_base->compositor);
-	struct drm_pending_state *pending_state = repaint_data;
 	struct drm_output *output = to_drm_output(output_base);
+	struct drm_backend *b = output->backend;
+	struct drm_pending_state *pending_state = b->repaint_data;
 	struct drm_output_state *state = NULL;
 	struct drm_plane_state *plane_state;
-	struct weston_view *ev;
+	struct weston_view *ev, **evp;
 	struct weston_plane *primary = &output_base->compositor->primary_plane;
 	enum drm_output_propose_state_mode mode = DRM_OUTPUT_PROPOSE_STATE_PLANES_ONLY;
+	uint64_t test_only_commits = b->stats.test_only_commits;
+	uint64_t state_allocs = b->stats.state_allocs;
+	uint64_t state_reused = b->stats.state_reused;
 
 	drm_debug(b, "\t[repaint] preparing state for output %s (%lu)\n",
 		  output_base->name, (unsigned long) output_base->id);
 
+	/* The views stay on the planes the source gave them. */
+	if (drm_output_assign_mirror(output, pending_state))
+		return;
+
 	if (!b->sprites_are_broken && !output->virtual) {
 		drm_debug(b, "\t[repaint] trying planes-only build state\n");
 		state = drm_output_propose_state(output_base, pending_state, mode);
@@ -1072,28 +1525,45 @@ drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 	assert(state);
 	drm_debug(b, "\t[repaint] Using %s composition\n",
 		  drm_propose_state_mode_to_string(mode));
-
-	wl_list_for_each(ev, &output_base->compositor->view_list, link) {
+	drm_debug(b, "\t[repaint] %" PRIu64 " TEST_ONLY commits, "
+		  "%" PRIu64 " state allocations, %" PRIu64 " reused "
+		  "(totals %" PRIu64 ", %" PRIu64 ", %" PRIu64 ")\n",
+		  b->stats.test_only_commits - test_only_commits,
+		  b->stats.state_allocs - state_allocs,
+		  b->stats.state_reused - state_reused,
+		  b->stats.test_only_commits, b->stats.state_allocs,
+		  b->stats.state_reused);
+
+	state->tearing = mode == DRM_OUTPUT_PROPOSE_STATE_PLANES_ONLY &&
+			 drm_output_state_may_tear(state);
+	drm_output_report_scanout(output, state);
+
+	wl_array_for_each(evp, &output_base->view_array) {
 		struct drm_plane *target_plane = NULL;
 
-		/* If this view doesn't touch our output at all, there's no
-		 * reason to do anything with it. */
-		if (!(ev->output_mask & (1u << output->base.id)))
-			continue;
+		ev = *evp;
 
 		/* Test whether this buffer can ever go into a plane:
-		 * non-shm, or small enough to be a cursor.
+		 * non-shm, or small enough to be a cursor or to be copied
+		 * for an overlay plane. The size test does not need a
+		 * buffer, so that surfaces whose SHM buffer was released
+		 * right after upload keep their next one and remain eligible
+		 * for the cursor and overlay planes.
 		 *
 		 * Also, keep a reference when using the pixman renderer.
 		 * That makes it possible to do a seamless switch to the GL
 		 * renderer and since the pixman renderer keeps a reference
-		 * to the buffer anyway, there is no side effects.
+		 * to the buffer anyway, there is no side effects. This does
+		 * not hold when it copies SHM buffers to release them early.
 		 */
-		if (b->use_pixman ||
+		if ((b->use_pixman &&
+		     !b->compositor->shm_release_after_upload) ||
 		    (weston_view_has_valid_buffer(ev) &&
-		    (!wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource) ||
-		     (ev->surface->width <= b->cursor_width &&
-		      ev->surface->height <= b->cursor_height))))
+		     !wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource)) ||
+		    (ev->surface->width <= b->cursor_width &&
+		     ev->surface->height <= b->cursor_height) ||
+		    (int64_t)ev->surface->width * ev->surface->height <=
+		     DRM_SHM_FB_MAX_PIXELS)
 			ev->surface->keep_buffer = true;
 		else
 			ev->surface->keep_buffer = false;
@@ -70,6 +70,20 @@
 #define PROFILE_IDC_MAIN        77
 #define PROFILE_IDC_HIGH        100
 
+/* Frames waiting for the worker thread. The front buffers they come from are
+ * reused by the renderer soon, so this is kept short: the worker converts
+ * them to YUV surfaces of its own right away. */
+#define RECORDER_INPUT_QUEUE	4
+
+/* Frames the hardware may be encoding while their predecessors are written
+ * out. */
+#define RECORDER_MAX_IN_FLIGHT	3
+
+struct recorder_frame {
+	VASurfaceID surface;
+	VABufferID coded_buf;
+};
+
 struct vaapi_recorder {
 	int drm_fd, output_fd;
 	int width, height;
@@ -82,9 +96,10 @@ struct vaapi_recorder {
 	pthread_cond_t input_cond;
 
 	struct {
-		int valid;
 		int prime_fd, stride;
-	} input;
+	} input[RECORDER_INPUT_QUEUE];
+	int input_head, input_count;
+	int dropped;
 
 	VADisplay va_dpy;
 
@@ -93,9 +108,13 @@ struct vaapi_recorder {
 		VAConfigID cfg;
 		VAContextID ctx;
 		VABufferID pipeline_buf;
-		VASurfaceID output;
+		VASurfaceID output[RECORDER_MAX_IN_FLIGHT];
 	} vpp;
 
+	/* encoded in order, written out in order */
+	struct recorder_frame frames[RECORDER_MAX_IN_FLIGHT];
+	int frames_head, frames_count;
+
 	struct {
 		VAConfigID cfg;
 		VAContextID ctx;
@@ -722,11 +741,8 @@ encoder_render_picture(struct vaapi_recorder *r, VASurfaceID input,
 	if (status != VA_STATUS_SUCCESS)
 		return status;
 
-	status = vaEndPicture(r->va_dpy, r->encoder.ctx);
-	if (status != VA_STATUS_SUCCESS)
-		return status;
-
-	return vaSyncSurface(r->va_dpy, input);
+	/* Not waited for, mapping the coded buffer does that. */
+	return vaEndPicture(r->va_dpy, r->encoder.ctx);
 }
 
 static VABufferID
@@ -777,15 +793,17 @@ encoder_write_output(struct vaapi_recorder *r, VABufferID output_buf)
 	return OUTPUT_WRITE_SUCCESS;
 }
 
-static void
-encoder_encode(struct vaapi_recorder *r, VASurfaceID input)
+/* Queues the encoding of the surface of the frame into a new coded buffer of
+ * the frame. */
+static int
+encoder_submit(struct vaapi_recorder *r, struct recorder_frame *frame)
 {
-	VABufferID output_buf = VA_INVALID_ID;
-
 	VABufferID buffers[8];
 	int count = 0;
 	int i, slice_type;
-	enum output_write_status ret;
+	VAStatus status;
+
+	frame->coded_buf = VA_INVALID_ID;
 
 	if ((r->frame_count % r->encoder.intra_period) == 0)
 		slice_type = SLICE_TYPE_I;
@@ -803,46 +821,78 @@ encoder_encode(struct vaapi_recorder *r, VASurfaceID input)
 	if (r->frame_count == 0)
 		count += encoder_prepare_headers(r, buffers + count);
 
-	do {
-		output_buf = encoder_create_output_buffer(r);
-		if (output_buf == VA_INVALID_ID)
-			goto bail;
-
-		buffers[count++] =
-			encoder_update_pic_parameters(r, output_buf);
-		if (buffers[count - 1] == VA_INVALID_ID)
-			goto bail;
-
-		encoder_render_picture(r, input, buffers, count);
-		ret = encoder_write_output(r, output_buf);
+	frame->coded_buf = encoder_create_output_buffer(r);
+	if (frame->coded_buf == VA_INVALID_ID)
+		goto bail;
 
-		vaDestroyBuffer(r->va_dpy, output_buf);
-		output_buf = VA_INVALID_ID;
+	buffers[count++] = encoder_update_pic_parameters(r, frame->coded_buf);
+	if (buffers[count - 1] == VA_INVALID_ID)
+		goto bail;
 
-		vaDestroyBuffer(r->va_dpy, buffers[--count]);
-	} while (ret == OUTPUT_WRITE_OVERFLOW);
-
-	if (ret == OUTPUT_WRITE_FATAL)
-		r->error = errno;
+	status = encoder_render_picture(r, frame->surface, buffers, count);
+	if (status != VA_STATUS_SUCCESS)
+		goto bail;
 
 	for (i = 0; i < count; i++)
 		vaDestroyBuffer(r->va_dpy, buffers[i]);
 
 	r->frame_count++;
-	return;
+	return 0;
 
 bail:
 	for (i = 0; i < count; i++)
-		vaDestroyBuffer(r->va_dpy, buffers[i]);
-	if (output_buf != VA_INVALID_ID)
-		vaDestroyBuffer(r->va_dpy, output_buf);
+		if (buffers[i] != VA_INVALID_ID)
+			vaDestroyBuffer(r->va_dpy, buffers[i]);
+	if (frame->coded_buf != VA_INVALID_ID)
+		vaDestroyBuffer(r->va_dpy, frame->coded_buf);
+	frame->coded_buf = VA_INVALID_ID;
+
+	return -1;
+}
+
+static void
+recorder_drop_frame(struct vaapi_recorder *r)
+{
+	struct recorder_frame *frame = &r->frames[r->frames_head];
+
+	vaDestroyBuffer(r->va_dpy, frame->coded_buf);
+	frame->coded_buf = VA_INVALID_ID;
+
+	r->frames_head = (r->frames_head + 1) % RECORDER_MAX_IN_FLIGHT;
+	r->frames_count--;
 }
 
+/* Waits for the oldest frame in flight to be encoded and writes it out. */
+static void
+recorder_write_frame(struct vaapi_recorder *r)
+{
+	struct recorder_frame *frame = &r->frames[r->frames_head];
+	enum output_write_status ret;
+
+	ret = encoder_write_output(r, frame->coded_buf);
+	if (ret == OUTPUT_WRITE_FATAL) {
+		pthread_mutex_lock(&r->mutex);
+		r->error = errno;
+		pthread_mutex_unlock(&r->mutex);
+	}
+
+	recorder_drop_frame(r);
+
+	if (ret != OUTPUT_WRITE_OVERFLOW)
+		return;
+
+	/* The frame is lost and the ones in flight refer to it. Start over
+	 * from an IDR frame, with bigger coded buffers. */
+	while (r->frames_count > 0)
+		recorder_drop_frame(r);
+	r->frame_count = 0;
+}
 
 static int
 setup_vpp(struct vaapi_recorder *r)
 {
 	VAStatus status;
+	int i;
 
 	status = vaCreateConfig(r->va_dpy, VAProfileNone,
 				VAEntrypointVideoProc, NULL, 0,
@@ -869,13 +919,18 @@ setup_vpp(struct vaapi_recorder *r)
 	}
 
 	status = vaCreateSurfaces(r->va_dpy, VA_RT_FORMAT_YUV420,
-				  r->width, r->height, &r->vpp.output, 1,
-				  NULL, 0);
+				  r->width, r->height, r->vpp.output,
+				  RECORDER_MAX_IN_FLIGHT, NULL, 0);
 	if (status != VA_STATUS_SUCCESS) {
 		weston_log("vaapi: failed to create YUV surface\n");
 		goto err_buf;
 	}
 
+	for (i = 0; i < RECORDER_MAX_IN_FLIGHT; i++) {
+		r->frames[i].surface = r->vpp.output[i];
+		r->frames[i].coded_buf = VA_INVALID_ID;
+	}
+
 	return 0;
 
 err_buf:
@@ -891,7 +946,7 @@ err_cfg:
 static void
 vpp_destroy(struct vaapi_recorder *r)
 {
-	vaDestroySurfaces(r->va_dpy, &r->vpp.output, 1);
+	vaDestroySurfaces(r->va_dpy, r->vpp.output, RECORDER_MAX_IN_FLIGHT);
 	vaDestroyBuffer(r->va_dpy, r->vpp.pipeline_buf);
 	vaDestroyConfig(r->va_dpy, r->vpp.ctx);
 	vaDestroyConfig(r->va_dpy, r->vpp.cfg);
@@ -920,6 +975,12 @@ destroy_worker_thread(struct vaapi_recorder *r)
 
 	pthread_join(r->worker_thread, NULL);
 
+	while (r->input_count > 0) {
+		close(r->input[r->input_head].prime_fd);
+		r->input_head = (r->input_head + 1) % RECORDER_INPUT_QUEUE;
+		r->input_count--;
+	}
+
 	pthread_mutex_destroy(&r->mutex);
 	pthread_cond_destroy(&r->input_cond);
 }
@@ -1041,7 +1102,8 @@ create_surface_from_fd(struct vaapi_recorder *r, int prime_fd,
 }
 
 static VAStatus
-convert_rgb_to_yuv(struct vaapi_recorder *r, VASurfaceID rgb_surface)
+convert_rgb_to_yuv(struct vaapi_recorder *r, VASurfaceID rgb_surface,
+		   VASurfaceID yuv_surface)
 {
 	VAProcPipelineParameterBuffer *pipeline_param;
 	VAStatus status;
@@ -1063,7 +1125,7 @@ convert_rgb_to_yuv(struct vaapi_recorder *r, VASurfaceID rgb_surface)
 	if (status != VA_STATUS_SUCCESS)
 		return status;
 
-	status = vaBeginPicture(r->va_dpy, r->vpp.ctx, r->vpp.output);
+	status = vaBeginPicture(r->va_dpy, r->vpp.ctx, yuv_surface);
 	if (status != VA_STATUS_SUCCESS)
 		return status;
 
@@ -1076,59 +1138,83 @@ convert_rgb_to_yuv(struct vaapi_recorder *r, VASurfaceID rgb_surface)
 	if (status != VA_STATUS_SUCCESS)
 		return status;
 
-	return status;
+	/* The front buffer is free to be reused once this is done. */
+	return vaSyncSurface(r->va_dpy, yuv_surface);
 }
 
 static void
-recorder_frame(struct vaapi_recorder *r)
+recorder_frame(struct vaapi_recorder *r, int prime_fd, int stride)
 {
+	struct recorder_frame *frame;
 	VASurfaceID rgb_surface;
 	VAStatus status;
 
-	status = create_surface_from_fd(r, r->input.prime_fd,
-					r->input.stride, &rgb_surface);
+	status = create_surface_from_fd(r, prime_fd, stride, &rgb_surface);
+	close(prime_fd);
 	if (status != VA_STATUS_SUCCESS) {
 		weston_log("[libva recorder] "
 			   "failed to create surface from bo\n");
 		return;
 	}
 
-	close(r->input.prime_fd);
+	if (r->frames_count == RECORDER_MAX_IN_FLIGHT)
+		recorder_write_frame(r);
+
+	frame = &r->frames[(r->frames_head + r->frames_count) %
+			   RECORDER_MAX_IN_FLIGHT];
 
-	status = convert_rgb_to_yuv(r, rgb_surface);
+	status = convert_rgb_to_yuv(r, rgb_surface, frame->surface);
+	vaDestroySurfaces(r->va_dpy, &rgb_surface, 1);
 	if (status != VA_STATUS_SUCCESS) {
 		weston_log("[libva recorder] "
 			   "color space conversion failed\n");
 		return;
 	}
 
-	encoder_encode(r, r->vpp.output);
-
-	vaDestroySurfaces(r->va_dpy, &rgb_surface, 1);
+	if (encoder_submit(r, frame) == 0)
+		r->frames_count++;
 }
 
+/* Converts the frames as they come and keeps several encodes in flight; each
+ * coded frame is only waited for and written out when the thread would
+ * otherwise be idle, or another slot is needed. The mutex only protects the
+ * input queue, so the compositor never waits for the encoder. */
 static void *
 worker_thread_function(void *data)
 {
 	struct vaapi_recorder *r = data;
+	int prime_fd, stride;
 
 	pthread_mutex_lock(&r->mutex);
 
 	while (!r->destroying) {
-		if (!r->input.valid)
-			pthread_cond_wait(&r->input_cond, &r->mutex);
-
-		/* If the thread is awaken by destroy_worker_thread(),
-		 * there might not be valid input */
-		if (!r->input.valid)
+		if (r->input_count == 0) {
+			if (r->frames_count == 0) {
+				pthread_cond_wait(&r->input_cond, &r->mutex);
+				continue;
+			}
+
+			pthread_mutex_unlock(&r->mutex);
+			recorder_write_frame(r);
+			pthread_mutex_lock(&r->mutex);
 			continue;
+		}
+
+		prime_fd = r->input[r->input_head].prime_fd;
+		stride = r->input[r->input_head].stride;
+		r->input_head = (r->input_head + 1) % RECORDER_INPUT_QUEUE;
+		r->input_count--;
 
-		recorder_frame(r);
-		r->input.valid = 0;
+		pthread_mutex_unlock(&r->mutex);
+		recorder_frame(r, prime_fd, stride);
+		pthread_mutex_lock(&r->mutex);
 	}
 
 	pthread_mutex_unlock(&r->mutex);
 
+	while (r->frames_count > 0)
+		recorder_write_frame(r);
+
 	return NULL;
 }
 
@@ -1136,22 +1222,30 @@ int
 vaapi_recorder_frame(struct vaapi_recorder *r, int prime_fd, int stride)
 {
 	int ret = 0;
+	int tail;
 
 	pthread_mutex_lock(&r->mutex);
 
 	if (r->error) {
 		errno = r->error;
+		close(prime_fd);
 		ret = -1;
 		goto unlock;
 	}
 
-	/* The mutex is never released while encoding, so this point should
-	 * never be reached if input.valid is true. */
-	assert(!r->input.valid);
+	/* The encoder fell behind by more than the queue, the frame is not
+	 * recorded. */
+	if (r->input_count == RECORDER_INPUT_QUEUE) {
+		if (r->dropped++ == 0)
+			weston_log("[libva recorder] dropping frames\n");
+		close(prime_fd);
+		goto unlock;
+	}
 
-	r->input.prime_fd = prime_fd;
-	r->input.stride = stride;
-	r->input.valid = 1;
+	tail = (r->input_head + r->input_count) % RECORDER_INPUT_QUEUE;
+	r->input[tail].prime_fd = prime_fd;
+	r->input[tail].stride = stride;
+	r->input_count++;
 	pthread_cond_signal(&r->input_cond);
 
 unlock:
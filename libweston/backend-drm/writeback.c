@@ -0,0 +1,595 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include <libweston/libweston.h>
+#include "drm-internal.h"
+#include "shared/helpers.h"
+
+/*
+ * Output capture through KMS writeback connectors.
+ *
+ * A writeback connector attached to a CRTC makes the display engine write
+ * the composed CRTC output, planes included, into a framebuffer given with
+ * each commit. Captures requested with weston_output_read_pixels_async()
+ * from a frame_signal handler are queued on the output and attached to the
+ * commit that flushes the frame. The kernel returns an out-fence, which
+ * signals once the frame has been written; the pixels are then copied out
+ * of the writeback framebuffer into every request of that frame.
+ *
+ * Routing the connector to the CRTC is a modeset from the kernel's point
+ * of view, so it stays routed until the output is turned off or disabled
+ * rather than being detached after every capture.
+ */
+
+#define DRM_WRITEBACK_FORMAT DRM_FORMAT_XRGB8888
+/* frames in flight: one being written while the previous is copied out */
+#define DRM_WRITEBACK_RING_SIZE 2
+/* how long to wait for a capture in flight when the output goes away */
+#define DRM_WRITEBACK_FENCE_TIMEOUT_MSEC 1000
+
+struct drm_writeback_request {
+	struct wl_list link; /* drm_output::writeback_request_list or
+				drm_writeback_job::request_list */
+	pixman_format_code_t format;
+	void *pixels;
+	uint32_t x, y;
+	uint32_t width, height;
+	bool yflip;
+	weston_read_pixels_done_func_t done;
+	void *data;
+};
+
+struct drm_writeback_job {
+	struct drm_writeback *wb;
+	struct drm_fb *fb;
+	bool busy;
+	/* written by the kernel during the commit ioctl */
+	int32_t out_fence_fd;
+	struct wl_event_source *fence_source;
+	struct wl_list request_list;
+};
+
+struct drm_writeback {
+	struct drm_backend *backend;
+	struct wl_list link; /* drm_backend::writeback_list */
+
+	uint32_t connector_id;
+	uint32_t possible_crtcs;
+	struct drm_property_info props_conn[WDRM_CONNECTOR__COUNT];
+	bool usable;
+
+	struct drm_output *output; /**< output claiming the connector */
+	bool attached; /**< connector routed to the CRTC of output */
+	bool detach_pending;
+	bool broken;
+
+	struct drm_writeback_job jobs[DRM_WRITEBACK_RING_SIZE];
+	struct drm_writeback_job *pending_job;
+};
+
+static int
+writeback_add_prop(drmModeAtomicReq *req, struct drm_writeback *wb,
+		   enum wdrm_connector_property prop, uint64_t val)
+{
+	struct drm_property_info *info = &wb->props_conn[prop];
+	int ret;
+
+	if (info->prop_id == 0)
+		return -1;
+
+	ret = drmModeAtomicAddProperty(req, wb->connector_id, info->prop_id,
+				       val);
+	drm_debug(wb->backend, "\t\t\t[WB:%lu] %lu (%s) -> %llu (0x%llx)\n",
+		  (unsigned long) wb->connector_id,
+		  (unsigned long) info->prop_id, info->name,
+		  (unsigned long long) val, (unsigned long long) val);
+	return (ret <= 0) ? -1 : 0;
+}
+
+static bool
+writeback_has_format(struct drm_writeback *wb,
+		     drmModeObjectProperties *props, uint32_t format)
+{
+	struct drm_backend *b = wb->backend;
+	struct drm_property_info *info =
+		&wb->props_conn[WDRM_CONNECTOR_WRITEBACK_PIXEL_FORMATS];
+	drmModePropertyBlobRes *blob;
+	const uint32_t *formats;
+	bool found = false;
+	uint32_t blob_id;
+	unsigned int i;
+
+	blob_id = drm_property_get_value(info, props, 0);
+	if (blob_id == 0)
+		return false;
+
+	blob = drmModeGetPropertyBlob(b->drm.fd, blob_id);
+	if (!blob)
+		return false;
+
+	formats = blob->data;
+	for (i = 0; i < blob->length / sizeof(*formats); i++) {
+		if (formats[i] == format) {
+			found = true;
+			break;
+		}
+	}
+
+	drmModeFreePropertyBlob(blob);
+
+	return found;
+}
+
+/** Take note of a writeback connector
+ *
+ * \param b The backend.
+ * \param connector_id A connector from the DRM resources.
+ * \return true if the connector is a writeback connector, which must not
+ * be turned into a head.
+ */
+bool
+drm_backend_add_writeback(struct drm_backend *b, uint32_t connector_id)
+{
+#ifdef DRM_MODE_CONNECTOR_WRITEBACK
+	struct drm_writeback *wb;
+	drmModeConnector *conn;
+	drmModeEncoder *enc;
+	drmModeObjectProperties *props;
+
+	wl_list_for_each(wb, &b->writeback_list, link)
+		if (wb->connector_id == connector_id)
+			return true;
+
+	conn = drmModeGetConnectorCurrent(b->drm.fd, connector_id);
+	if (!conn)
+		return false;
+
+	if (conn->connector_type != DRM_MODE_CONNECTOR_WRITEBACK) {
+		drmModeFreeConnector(conn);
+		return false;
+	}
+
+	wb = zalloc(sizeof *wb);
+	if (!wb) {
+		drmModeFreeConnector(conn);
+		return true;
+	}
+
+	wb->backend = b;
+	wb->connector_id = connector_id;
+
+	if (conn->count_encoders > 0) {
+		enc = drmModeGetEncoder(b->drm.fd, conn->encoders[0]);
+		if (enc) {
+			wb->possible_crtcs = enc->possible_crtcs;
+			drmModeFreeEncoder(enc);
+		}
+	}
+	drmModeFreeConnector(conn);
+
+	props = drmModeObjectGetProperties(b->drm.fd, connector_id,
+					   DRM_MODE_OBJECT_CONNECTOR);
+	if (props) {
+		drm_property_info_populate(b, connector_props, wb->props_conn,
+					   WDRM_CONNECTOR__COUNT, props);
+		wb->usable =
+			wb->props_conn[WDRM_CONNECTOR_CRTC_ID].prop_id != 0 &&
+			wb->props_conn[WDRM_CONNECTOR_WRITEBACK_FB_ID].prop_id != 0 &&
+			wb->props_conn[WDRM_CONNECTOR_WRITEBACK_OUT_FENCE_PTR].prop_id != 0 &&
+			writeback_has_format(wb, props, DRM_WRITEBACK_FORMAT);
+		drmModeFreeObjectProperties(props);
+	}
+
+	wl_list_insert(b->writeback_list.prev, &wb->link);
+
+	weston_log("DRM: found writeback connector %u%s\n", connector_id,
+		   wb->usable ? "" : " (unusable: no XRGB8888 or properties)");
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+void
+drm_backend_destroy_writebacks(struct drm_backend *b)
+{
+	struct drm_writeback *wb, *tmp;
+
+	wl_list_for_each_safe(wb, tmp, &b->writeback_list, link) {
+		assert(!wb->output);
+		drm_property_info_free(wb->props_conn, WDRM_CONNECTOR__COUNT);
+		wl_list_remove(&wb->link);
+		free(wb);
+	}
+}
+
+/** Route every writeback connector away, on a commit resetting all state
+ *
+ * Connectors still in use are routed back by drm_output_apply_writeback()
+ * in the same commit.
+ */
+int
+drm_backend_reset_writebacks(struct drm_backend *b, drmModeAtomicReq *req)
+{
+	struct drm_writeback *wb;
+	int ret = 0;
+
+	wl_list_for_each(wb, &b->writeback_list, link) {
+		if (wb->props_conn[WDRM_CONNECTOR_CRTC_ID].prop_id == 0)
+			continue;
+
+		ret |= writeback_add_prop(req, wb, WDRM_CONNECTOR_CRTC_ID, 0);
+		wb->attached = false;
+	}
+
+	return ret;
+}
+
+static void
+writeback_request_complete(struct drm_writeback_request *req, int status)
+{
+	wl_list_remove(&req->link);
+	req->done(req->data, status);
+	free(req);
+}
+
+static void
+writeback_request_copy(struct drm_writeback_request *req, struct drm_fb *fb)
+{
+	pixman_image_t *src, *dst;
+	uint32_t stride = req->width * (PIXMAN_FORMAT_BPP(req->format) / 8);
+	uint32_t top, i;
+
+	src = pixman_image_create_bits(PIXMAN_x8r8g8b8, fb->width, fb->height,
+				       fb->map, fb->strides[0]);
+	dst = pixman_image_create_bits(req->format, req->width, req->height,
+				       req->pixels, stride);
+
+	if (req->yflip) {
+		/* y is the bottom edge, and rows go bottom up */
+		top = fb->height - req->y - req->height;
+		for (i = 0; i < req->height; i++)
+			pixman_image_composite32(PIXMAN_OP_SRC, src, NULL, dst,
+						 req->x,
+						 top + req->height - 1 - i,
+						 0, 0, 0, i, req->width, 1);
+	} else {
+		pixman_image_composite32(PIXMAN_OP_SRC, src, NULL, dst,
+					 req->x, req->y, 0, 0, 0, 0,
+					 req->width, req->height);
+	}
+
+	pixman_image_unref(dst);
+	pixman_image_unref(src);
+}
+
+static void
+writeback_job_finish(struct drm_writeback_job *job, int status)
+{
+	struct drm_writeback_request *req, *tmp;
+
+	if (job->fence_source) {
+		wl_event_source_remove(job->fence_source);
+		job->fence_source = NULL;
+	}
+	if (job->out_fence_fd >= 0) {
+		close(job->out_fence_fd);
+		job->out_fence_fd = -1;
+	}
+
+	wl_list_for_each_safe(req, tmp, &job->request_list, link) {
+		if (status == 0)
+			writeback_request_copy(req, job->fb);
+		writeback_request_complete(req, status);
+	}
+
+	job->busy = false;
+}
+
+static int
+writeback_fence_handler(int fd, uint32_t mask, void *data)
+{
+	struct drm_writeback_job *job = data;
+
+	writeback_job_finish(job, 0);
+
+	return 0;
+}
+
+static int
+drm_output_capture_pixels(struct weston_output *base,
+			  pixman_format_code_t format, void *pixels,
+			  uint32_t x, uint32_t y,
+			  uint32_t width, uint32_t height,
+			  weston_read_pixels_done_func_t done, void *data)
+{
+	struct drm_output *output = to_drm_output(base);
+	struct drm_writeback *wb = output->writeback;
+	struct weston_compositor *ec = base->compositor;
+	struct drm_writeback_request *req;
+
+	if (!wb || wb->broken)
+		return -1;
+
+	if (PIXMAN_FORMAT_BPP(format) != 32 ||
+	    !pixman_format_supported_destination(format))
+		return -1;
+
+	if (x + width > (uint32_t)base->current_mode->width ||
+	    y + height > (uint32_t)base->current_mode->height)
+		return -1;
+
+	req = zalloc(sizeof *req);
+	if (!req)
+		return -1;
+
+	req->format = format;
+	req->pixels = pixels;
+	req->x = x;
+	req->y = y;
+	req->width = width;
+	req->height = height;
+	req->yflip = !!(ec->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	req->done = done;
+	req->data = data;
+	wl_list_insert(output->writeback_request_list.prev, &req->link);
+
+	return 0;
+}
+
+static struct drm_writeback_job *
+writeback_get_job(struct drm_writeback *wb, struct drm_output *output)
+{
+	struct drm_writeback_job *job = NULL;
+	struct weston_mode *mode = output->base.current_mode;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(wb->jobs); i++) {
+		if (!wb->jobs[i].busy) {
+			job = &wb->jobs[i];
+			break;
+		}
+	}
+
+	if (!job)
+		return NULL;
+
+	if (job->fb && (job->fb->width != mode->width ||
+			job->fb->height != mode->height)) {
+		drm_fb_unref(job->fb);
+		job->fb = NULL;
+	}
+
+	if (!job->fb)
+		job->fb = drm_fb_create_dumb(wb->backend, mode->width,
+					     mode->height,
+					     DRM_WRITEBACK_FORMAT);
+
+	return job->fb ? job : NULL;
+}
+
+/** Add the writeback connector to the atomic state of an output
+ *
+ * Attaches the captures queued on the output, if any, unless this is a
+ * test commit. Routes the connector away when the output turns off.
+ */
+int
+drm_output_apply_writeback(struct drm_output_state *state,
+			   drmModeAtomicReq *req, uint32_t *flags)
+{
+	struct drm_output *output = state->output;
+	struct drm_writeback *wb = output->writeback;
+	struct drm_writeback_job *job;
+	int ret = 0;
+
+	if (!wb)
+		return 0;
+
+	if (state->dpms != WESTON_DPMS_ON) {
+		if (wb->attached) {
+			ret |= writeback_add_prop(req, wb,
+						  WDRM_CONNECTOR_CRTC_ID, 0);
+			*flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+			wb->detach_pending = !(*flags & DRM_MODE_ATOMIC_TEST_ONLY);
+		}
+		return ret;
+	}
+
+	if (*flags & DRM_MODE_ATOMIC_TEST_ONLY)
+		return 0;
+
+	if (wb->broken || wl_list_empty(&output->writeback_request_list))
+		return 0;
+
+	assert(!wb->pending_job);
+
+	job = writeback_get_job(wb, output);
+	if (!job) {
+		/* the requests wait for the next commit */
+		drm_debug(wb->backend, "\t\t\t[WB:%lu] no free buffer\n",
+			  (unsigned long) wb->connector_id);
+		return 0;
+	}
+
+	job->out_fence_fd = -1;
+	ret |= writeback_add_prop(req, wb, WDRM_CONNECTOR_CRTC_ID,
+				  output->crtc_id);
+	ret |= writeback_add_prop(req, wb, WDRM_CONNECTOR_WRITEBACK_FB_ID,
+				  job->fb->fb_id);
+	ret |= writeback_add_prop(req, wb,
+				  WDRM_CONNECTOR_WRITEBACK_OUT_FENCE_PTR,
+				  (uintptr_t) &job->out_fence_fd);
+	if (ret != 0)
+		return ret;
+
+	if (!wb->attached)
+		*flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+
+	job->busy = true;
+	wl_list_insert_list(&job->request_list,
+			    &output->writeback_request_list);
+	wl_list_init(&output->writeback_request_list);
+	wb->pending_job = job;
+
+	return 0;
+}
+
+/** Account for the result of a real commit including the output state */
+void
+drm_output_writeback_commit_done(struct drm_output *output, bool success)
+{
+	struct drm_writeback *wb = output->writeback;
+	struct weston_compositor *ec = output->base.compositor;
+	struct wl_event_loop *loop;
+	struct drm_writeback_job *job;
+
+	if (!wb)
+		return;
+
+	if (wb->detach_pending) {
+		if (success)
+			wb->attached = false;
+		wb->detach_pending = false;
+	}
+
+	job = wb->pending_job;
+	if (!job)
+		return;
+	wb->pending_job = NULL;
+
+	if (!success) {
+		weston_log("DRM: commit with writeback on output %s failed, "
+			   "capturing through the renderer from now on\n",
+			   output->base.name);
+		wb->broken = true;
+		writeback_job_finish(job, -1);
+		return;
+	}
+
+	wb->attached = true;
+
+	if (job->out_fence_fd < 0) {
+		writeback_job_finish(job, -1);
+		return;
+	}
+
+	loop = wl_display_get_event_loop(ec->wl_display);
+	job->fence_source = wl_event_loop_add_fd(loop, job->out_fence_fd,
+						 WL_EVENT_READABLE,
+						 writeback_fence_handler, job);
+	if (!job->fence_source)
+		writeback_job_finish(job, -1);
+}
+
+/** Claim a writeback connector able to capture the output */
+void
+drm_output_init_writeback(struct drm_output *output)
+{
+	struct drm_backend *b = output->backend;
+	struct drm_writeback *wb;
+	unsigned int i;
+
+	wl_list_init(&output->writeback_request_list);
+
+	if (!b->atomic_modeset)
+		return;
+
+	wl_list_for_each(wb, &b->writeback_list, link) {
+		if (!wb->usable || wb->output ||
+		    !(wb->possible_crtcs & (1u << output->pipe)))
+			continue;
+
+		wb->output = output;
+		wb->broken = false;
+		for (i = 0; i < ARRAY_LENGTH(wb->jobs); i++) {
+			wb->jobs[i].wb = wb;
+			wb->jobs[i].out_fence_fd = -1;
+			wl_list_init(&wb->jobs[i].request_list);
+		}
+
+		output->writeback = wb;
+		output->base.capture_pixels = drm_output_capture_pixels;
+
+		weston_log("Output %s captures through writeback connector "
+			   "%u\n", output->base.name, wb->connector_id);
+		return;
+	}
+}
+
+void
+drm_output_fini_writeback(struct drm_output *output)
+{
+	struct drm_writeback *wb = output->writeback;
+	struct drm_writeback_request *req, *tmp;
+	struct pollfd pfd;
+	unsigned int i;
+
+	wl_list_for_each_safe(req, tmp, &output->writeback_request_list, link)
+		writeback_request_complete(req, -1);
+
+	output->base.capture_pixels = NULL;
+
+	if (!wb)
+		return;
+
+	for (i = 0; i < ARRAY_LENGTH(wb->jobs); i++) {
+		struct drm_writeback_job *job = &wb->jobs[i];
+
+		if (job->busy) {
+			/* the hardware may still be writing */
+			pfd.fd = job->out_fence_fd;
+			pfd.events = POLLIN;
+			if (job->out_fence_fd >= 0 &&
+			    poll(&pfd, 1, DRM_WRITEBACK_FENCE_TIMEOUT_MSEC) == 1)
+				writeback_job_finish(job, 0);
+			else
+				writeback_job_finish(job, -1);
+		}
+
+		drm_fb_unref(job->fb);
+		job->fb = NULL;
+	}
+
+	/* The connector stays routed until the next commit resetting the
+	 * state, which fini_crtc requests. */
+	wb->pending_job = NULL;
+	wb->output = NULL;
+	output->writeback = NULL;
+}
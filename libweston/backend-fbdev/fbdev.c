@@ -33,10 +33,12 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <math.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <linux/fb.h>
 #include <linux/input.h>
@@ -61,6 +63,7 @@ struct fbdev_backend {
 	struct udev_input input;
 	uint32_t output_transform;
 	struct wl_listener session_listener;
+	bool double_buffer;
 };
 
 struct fbdev_screeninfo {
@@ -98,7 +101,29 @@ struct fbdev_output {
 	void *fb;
 
 	/* pixman details. */
-	pixman_image_t *hw_surface;
+	pixman_image_t *hw_surface[2];
+
+	/* Page flipping, with two buffers stacked in the virtual resolution.
+	 * The device stays open to pan. */
+	unsigned int n_buffers;
+	unsigned int current_buffer;
+	int fd;
+	pixman_region32_t previous_damage;
+
+	/* FBIO_WAITFORVSYNC blocks, so it is issued by a thread which
+	 * notifies the compositor through a pipe. */
+	struct {
+		bool running;
+		bool pending;
+		pthread_t thread;
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+		bool wait;
+		bool quit;
+		struct timespec stamp;
+		int notify_fd[2];
+		struct wl_event_source *notify_source;
+	} vsync;
 };
 
 static const char default_seat[] = "seat0";
@@ -142,25 +167,102 @@ fbdev_output_start_repaint_loop(struct weston_output *output)
 	return 0;
 }
 
+static int
+fbdev_output_pan(struct fbdev_output *output, unsigned int buffer)
+{
+	struct fb_var_screeninfo varinfo;
+
+	if (ioctl(output->fd, FBIOGET_VSCREENINFO, &varinfo) < 0)
+		return -1;
+
+	/* Panning takes effect at the next vertical blank. */
+	varinfo.xoffset = 0;
+	varinfo.yoffset = buffer * output->mode.height;
+	varinfo.activate = FB_ACTIVATE_VBL;
+
+	if (ioctl(output->fd, FBIOPAN_DISPLAY, &varinfo) < 0)
+		return -1;
+
+	output->current_buffer = buffer;
+
+	return 0;
+}
+
+static void fbdev_vsync_stop(struct fbdev_output *output);
+
+/* Keeps showing the current buffer, which becomes the only one. */
+static void
+fbdev_output_stop_flipping(struct fbdev_output *output)
+{
+	pixman_image_t *image;
+
+	fbdev_vsync_stop(output);
+	pixman_region32_fini(&output->previous_damage);
+
+	if (output->current_buffer != 0) {
+		image = output->hw_surface[0];
+		output->hw_surface[0] = output->hw_surface[1];
+		output->hw_surface[1] = image;
+		output->current_buffer = 0;
+	}
+
+	output->n_buffers = 1;
+	weston_output_damage(&output->base);
+}
+
+static void
+fbdev_vsync_request(struct fbdev_output *output)
+{
+	output->vsync.pending = true;
+
+	pthread_mutex_lock(&output->vsync.mutex);
+	output->vsync.wait = true;
+	pthread_cond_signal(&output->vsync.cond);
+	pthread_mutex_unlock(&output->vsync.mutex);
+}
+
 static int
 fbdev_output_repaint(struct weston_output *base, pixman_region32_t *damage,
 		     void *repaint_data)
 {
 	struct fbdev_output *output = to_fbdev_output(base);
 	struct weston_compositor *ec = output->base.compositor;
-
-	/* Repaint the damaged region onto the back buffer. */
-	pixman_renderer_output_set_buffer(base, output->hw_surface);
-	ec->renderer->repaint_output(base, damage);
+	unsigned int back = 0;
+
+	/* Repaint the damaged region onto the back buffer. With page
+	 * flipping, the back buffer has missed the damage of the frame on
+	 * screen too. */
+	if (output->n_buffers > 1) {
+		back = output->current_buffer ^ 1;
+		pixman_renderer_output_set_buffer(base,
+						  output->hw_surface[back]);
+		pixman_renderer_output_set_hw_extra_damage(base,
+							   &output->previous_damage);
+		ec->renderer->repaint_output(base, damage);
+		pixman_region32_copy(&output->previous_damage, damage);
+	} else {
+		pixman_renderer_output_set_buffer(base, output->hw_surface[0]);
+		ec->renderer->repaint_output(base, damage);
+	}
 
 	/* Update the damage region. */
 	pixman_region32_subtract(&ec->primary_plane.damage,
 	                         &ec->primary_plane.damage, damage);
 
-	/* Schedule the end of the frame. We do not sync this to the frame
-	 * buffer clock because users who want that should be using the DRM
-	 * compositor. FBIO_WAITFORVSYNC blocks and FB_ACTIVATE_VBL requires
-	 * panning, which is broken in most kernel drivers.
+	if (output->n_buffers > 1 && fbdev_output_pan(output, back) < 0) {
+		weston_log("Failed to pan frame buffer: %s, "
+			   "falling back to a single buffer.\n",
+			   strerror(errno));
+		fbdev_output_stop_flipping(output);
+	}
+
+	if (output->n_buffers > 1 && output->vsync.running) {
+		fbdev_vsync_request(output);
+		return 0;
+	}
+
+	/* Without FBIO_WAITFORVSYNC, users who want the frame buffer clock
+	 * should be using the DRM compositor.
 	 *
 	 * Finish the frame synchronised to the specified refresh rate. The
 	 * refresh rate is given in mHz and the interval in ms. */
@@ -182,6 +284,142 @@ finish_frame_handler(void *data)
 	return 1;
 }
 
+static void *
+fbdev_vsync_thread(void *data)
+{
+	struct fbdev_output *output = data;
+	clockid_t clock = output->base.compositor->presentation_clock;
+	struct timespec stamp;
+	uint32_t crtc = 0;
+	char byte = 0;
+
+	pthread_mutex_lock(&output->vsync.mutex);
+	while (!output->vsync.quit) {
+		if (!output->vsync.wait) {
+			pthread_cond_wait(&output->vsync.cond,
+					  &output->vsync.mutex);
+			continue;
+		}
+
+		pthread_mutex_unlock(&output->vsync.mutex);
+		ioctl(output->fd, FBIO_WAITFORVSYNC, &crtc);
+		clock_gettime(clock, &stamp);
+		pthread_mutex_lock(&output->vsync.mutex);
+
+		output->vsync.stamp = stamp;
+		output->vsync.wait = false;
+
+		if (write(output->vsync.notify_fd[1], &byte, 1) < 0 &&
+		    errno != EAGAIN)
+			weston_log("fbdev: failed to notify vsync: %s\n",
+				   strerror(errno));
+	}
+	pthread_mutex_unlock(&output->vsync.mutex);
+
+	return NULL;
+}
+
+static int
+fbdev_vsync_notify(int fd, uint32_t mask, void *data)
+{
+	struct fbdev_output *output = data;
+	struct timespec ts;
+	char buf[16];
+	bool done;
+
+	while (read(fd, buf, sizeof buf) > 0)
+		;
+
+	pthread_mutex_lock(&output->vsync.mutex);
+	done = !output->vsync.wait;
+	ts = output->vsync.stamp;
+	pthread_mutex_unlock(&output->vsync.mutex);
+
+	if (!done || !output->vsync.pending)
+		return 0;
+
+	output->vsync.pending = false;
+	output->base.msc++;
+	weston_output_finish_frame(&output->base, &ts,
+				   WP_PRESENTATION_FEEDBACK_KIND_VSYNC |
+				   WP_PRESENTATION_FEEDBACK_KIND_HW_COMPLETION);
+
+	return 0;
+}
+
+static void
+fbdev_vsync_start(struct fbdev_output *output)
+{
+	struct wl_event_loop *loop;
+	uint32_t crtc = 0;
+
+	if (ioctl(output->fd, FBIO_WAITFORVSYNC, &crtc) < 0) {
+		weston_log("Frame buffer cannot wait for vsync, "
+			   "frames are timed.\n");
+		return;
+	}
+
+	if (pipe2(output->vsync.notify_fd, O_CLOEXEC | O_NONBLOCK) < 0)
+		return;
+
+	loop = wl_display_get_event_loop(output->base.compositor->wl_display);
+	output->vsync.notify_source =
+		wl_event_loop_add_fd(loop, output->vsync.notify_fd[0],
+				     WL_EVENT_READABLE, fbdev_vsync_notify,
+				     output);
+	if (!output->vsync.notify_source)
+		goto err_pipe;
+
+	output->vsync.wait = false;
+	output->vsync.quit = false;
+	output->vsync.pending = false;
+	pthread_mutex_init(&output->vsync.mutex, NULL);
+	pthread_cond_init(&output->vsync.cond, NULL);
+
+	if (pthread_create(&output->vsync.thread, NULL,
+			   fbdev_vsync_thread, output) != 0) {
+		pthread_cond_destroy(&output->vsync.cond);
+		pthread_mutex_destroy(&output->vsync.mutex);
+		wl_event_source_remove(output->vsync.notify_source);
+		goto err_pipe;
+	}
+
+	output->vsync.running = true;
+	return;
+
+err_pipe:
+	output->vsync.notify_source = NULL;
+	close(output->vsync.notify_fd[0]);
+	close(output->vsync.notify_fd[1]);
+}
+
+static void
+fbdev_vsync_stop(struct fbdev_output *output)
+{
+	if (!output->vsync.running)
+		return;
+
+	pthread_mutex_lock(&output->vsync.mutex);
+	output->vsync.quit = true;
+	pthread_cond_signal(&output->vsync.cond);
+	pthread_mutex_unlock(&output->vsync.mutex);
+
+	pthread_join(output->vsync.thread, NULL);
+
+	wl_event_source_remove(output->vsync.notify_source);
+	output->vsync.notify_source = NULL;
+	close(output->vsync.notify_fd[0]);
+	close(output->vsync.notify_fd[1]);
+	pthread_cond_destroy(&output->vsync.cond);
+	pthread_mutex_destroy(&output->vsync.mutex);
+	output->vsync.running = false;
+
+	/* A frame waiting for the vertical blank still has to finish. */
+	if (output->vsync.pending && output->finish_frame_timer)
+		wl_event_source_timer_update(output->finish_frame_timer, 1);
+	output->vsync.pending = false;
+}
+
 static pixman_format_code_t
 calculate_pixman_format(struct fb_var_screeninfo *vinfo,
                         struct fb_fix_screeninfo *finfo)
@@ -422,15 +660,62 @@ fbdev_frame_buffer_open(const char *fb_dev,
 	return fd;
 }
 
-/* Closes the FD on success or failure. */
+/* Makes room for a second buffer below the visible area, if the driver
+ * can pan to it. */
+static bool
+fbdev_frame_buffer_enable_panning(int fd, struct fbdev_screeninfo *info)
+{
+	struct fb_var_screeninfo varinfo;
+	struct fb_fix_screeninfo fixinfo;
+
+	if (ioctl(fd, FBIOGET_VSCREENINFO, &varinfo) < 0)
+		return false;
+
+	if (varinfo.yres_virtual < 2 * info->y_resolution) {
+		varinfo.yres_virtual = 2 * info->y_resolution;
+		varinfo.activate = FB_ACTIVATE_NOW;
+
+		if (ioctl(fd, FBIOPUT_VSCREENINFO, &varinfo) < 0 ||
+		    ioctl(fd, FBIOGET_VSCREENINFO, &varinfo) < 0 ||
+		    varinfo.yres_virtual < 2 * info->y_resolution)
+			return false;
+	}
+
+	if (ioctl(fd, FBIOGET_FSCREENINFO, &fixinfo) < 0)
+		return false;
+
+	if (fixinfo.ypanstep == 0 ||
+	    info->y_resolution % fixinfo.ypanstep != 0 ||
+	    fixinfo.smem_len < 2 * fixinfo.line_length * info->y_resolution)
+		return false;
+
+	/* The new virtual resolution may come with a new layout. */
+	info->buffer_length = fixinfo.smem_len;
+	info->line_length = fixinfo.line_length;
+
+	return true;
+}
+
+/* Closes the FD on failure, and on success unless it is kept to pan. */
 static int
 fbdev_frame_buffer_map(struct fbdev_output *output, int fd)
 {
 	struct fbdev_head *head;
+	size_t buffer_size;
+	unsigned int i;
 	int retval = -1;
 
 	head = fbdev_output_get_head(output);
 
+	output->n_buffers = 1;
+	if (output->backend->double_buffer) {
+		if (fbdev_frame_buffer_enable_panning(fd, &head->fb_info))
+			output->n_buffers = 2;
+		else
+			weston_log("Frame buffer cannot pan, "
+				   "using a single buffer.\n");
+	}
+
 	weston_log("Mapping fbdev frame buffer.\n");
 
 	/* Map the frame buffer. Write-only mode, since we don't want to read
@@ -445,16 +730,41 @@ fbdev_frame_buffer_map(struct fbdev_output *output, int fd)
 		goto out_close;
 	}
 
-	/* Create a pixman image to wrap the memory mapped frame buffer. */
-	output->hw_surface =
-		pixman_image_create_bits(head->fb_info.pixel_format,
-		                         head->fb_info.x_resolution,
-		                         head->fb_info.y_resolution,
-		                         output->fb,
-		                         head->fb_info.line_length);
-	if (output->hw_surface == NULL) {
-		weston_log("Failed to create surface for frame buffer.\n");
-		goto out_unmap;
+	/* Create a pixman image to wrap each buffer of the memory mapped
+	 * frame buffer. */
+	buffer_size = head->fb_info.line_length * head->fb_info.y_resolution;
+	for (i = 0; i < output->n_buffers; i++) {
+		output->hw_surface[i] =
+			pixman_image_create_bits(head->fb_info.pixel_format,
+						 head->fb_info.x_resolution,
+						 head->fb_info.y_resolution,
+						 (void *)((char *)output->fb +
+							  i * buffer_size),
+						 head->fb_info.line_length);
+		if (output->hw_surface[i] == NULL) {
+			weston_log("Failed to create surface for frame buffer.\n");
+			goto out_unmap;
+		}
+	}
+
+	if (output->n_buffers > 1) {
+		output->fd = fd;
+		fd = -1;
+
+		if (fbdev_output_pan(output, 0) < 0) {
+			weston_log("Failed to pan frame buffer: %s, "
+				   "using a single buffer.\n",
+				   strerror(errno));
+			output->n_buffers = 1;
+			fd = output->fd;
+			output->fd = -1;
+		} else {
+			/* Both buffers need a full repaint. */
+			pixman_region32_init(&output->previous_damage);
+			pixman_region32_copy(&output->previous_damage,
+					     &output->base.region);
+			fbdev_vsync_start(output);
+		}
 	}
 
 	/* Success! */
@@ -462,6 +772,11 @@ fbdev_frame_buffer_map(struct fbdev_output *output, int fd)
 
 out_unmap:
 	if (retval != 0 && output->fb != NULL) {
+		for (i = 0; i < ARRAY_LENGTH(output->hw_surface); i++) {
+			if (output->hw_surface[i])
+				pixman_image_unref(output->hw_surface[i]);
+			output->hw_surface[i] = NULL;
+		}
 		munmap(output->fb, output->buffer_length);
 		output->fb = NULL;
 	}
@@ -476,16 +791,34 @@ out_close:
 static void
 fbdev_frame_buffer_unmap(struct fbdev_output *output)
 {
+	unsigned int i;
+
 	if (!output->fb) {
-		assert(!output->hw_surface);
+		assert(!output->hw_surface[0]);
 		return;
 	}
 
 	weston_log("Unmapping fbdev frame buffer.\n");
 
-	if (output->hw_surface)
-		pixman_image_unref(output->hw_surface);
-	output->hw_surface = NULL;
+	if (output->n_buffers > 1) {
+		fbdev_vsync_stop(output);
+
+		/* Leave the first buffer on screen for whoever is next. */
+		fbdev_output_pan(output, 0);
+		pixman_region32_fini(&output->previous_damage);
+	}
+
+	/* The device stays open for panning, even if that failed since. */
+	if (output->fd >= 0) {
+		close(output->fd);
+		output->fd = -1;
+	}
+
+	for (i = 0; i < ARRAY_LENGTH(output->hw_surface); i++) {
+		if (output->hw_surface[i])
+			pixman_image_unref(output->hw_surface[i]);
+		output->hw_surface[i] = NULL;
+	}
 
 	if (munmap(output->fb, output->buffer_length) < 0)
 		weston_log("Failed to munmap frame buffer: %s\n",
@@ -649,6 +982,7 @@ fbdev_output_create(struct weston_compositor *compositor,
 		return NULL;
 
 	output->backend = to_fbdev_backend(compositor);
+	output->fd = -1;
 
 	weston_output_init(&output->base, compositor, name);
 
@@ -934,6 +1268,7 @@ fbdev_backend_create(struct weston_compositor *compositor,
 	backend->base.create_output = fbdev_output_create;
 
 	backend->prev_state = WESTON_COMPOSITOR_ACTIVE;
+	backend->double_buffer = param->double_buffer;
 
 	weston_setup_vt_switch_bindings(compositor);
 
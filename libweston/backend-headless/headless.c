@@ -27,6 +27,7 @@
 #include "config.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,6 +38,7 @@
 #include <libweston/libweston.h>
 #include <libweston/backend-headless.h>
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 #include "linux-explicit-synchronization.h"
 #include "pixman-renderer.h"
 #include "renderer-gl/gl-renderer.h"
@@ -57,6 +59,8 @@ struct headless_backend {
 
 	struct weston_seat fake_seat;
 	enum headless_renderer_type renderer_type;
+	int refresh;
+	bool unthrottled;
 
 	struct gl_renderer_interface *glri;
 };
@@ -72,6 +76,10 @@ struct headless_output {
 	struct wl_event_source *finish_frame_timer;
 	uint32_t *image_buf;
 	pixman_image_t *image;
+
+	bool frame_pending;
+	uint64_t frame_count;
+	struct timespec enable_time;
 };
 
 static const uint32_t headless_formats[] = {
@@ -108,14 +116,25 @@ headless_output_start_repaint_loop(struct weston_output *output)
 	return 0;
 }
 
-static int
-finish_frame_handler(void *data)
+static void
+headless_output_finish_frame(struct headless_output *output)
 {
-	struct headless_output *output = data;
 	struct timespec ts;
 
+	output->frame_pending = false;
+	output->frame_count++;
+	output->base.msc++;
+
 	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
 	weston_output_finish_frame(&output->base, &ts, 0);
+}
+
+static int
+finish_frame_handler(void *data)
+{
+	struct headless_output *output = data;
+
+	headless_output_finish_frame(output);
 
 	return 1;
 }
@@ -127,13 +146,44 @@ headless_output_repaint(struct weston_output *output_base,
 {
 	struct headless_output *output = to_headless_output(output_base);
 	struct weston_compositor *ec = output->base.compositor;
+	struct headless_backend *b = to_headless_backend(ec);
+	int refresh_msec;
 
 	ec->renderer->repaint_output(&output->base, damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	/* Unthrottled frames complete in headless_repaint_flush(), once the
+	 * renderer is done with all outputs. */
+	if (b->unthrottled) {
+		output->frame_pending = true;
+		return 0;
+	}
+
+	refresh_msec = (millihz_to_nsec(output->mode.refresh) + 500000) / 1000000;
+	wl_event_source_timer_update(output->finish_frame_timer,
+				     MAX(refresh_msec, 1));
+
+	return 0;
+}
+
+static int
+headless_repaint_flush(struct weston_compositor *compositor,
+		       void *repaint_data)
+{
+	struct weston_output *base;
+
+	wl_list_for_each(base, &compositor->output_list, link) {
+		struct headless_output *output = to_headless_output(base);
+
+		if (!output->frame_pending)
+			continue;
+
+		/* Do not wait for the next refresh slot, there is none. */
+		output->base.repaint_immediate = true;
+		headless_output_finish_frame(output);
+	}
 
 	return 0;
 }
@@ -161,10 +211,22 @@ headless_output_disable(struct weston_output *base)
 	struct headless_output *output = to_headless_output(base);
 	struct headless_backend *b = to_headless_backend(base->compositor);
 
+	struct timespec now;
+	int64_t elapsed_msec;
+
 	if (!output->base.enabled)
 		return 0;
 
+	weston_compositor_read_presentation_clock(base->compositor, &now);
+	elapsed_msec = timespec_sub_to_msec(&now, &output->enable_time);
+	if (elapsed_msec > 0)
+		weston_log("Output %s: %" PRIu64 " frames in %.3f s, "
+			   "%.1f frames per second\n", output->base.name,
+			   output->frame_count, elapsed_msec / 1000.0,
+			   output->frame_count * 1000.0 / elapsed_msec);
+
 	wl_event_source_remove(output->finish_frame_timer);
+	output->frame_pending = false;
 
 	switch (b->renderer_type) {
 	case HEADLESS_GL:
@@ -216,6 +278,7 @@ headless_output_enable_pixman(struct headless_output *output)
 {
 	const struct pixman_renderer_output_options options = {
 		.use_shadow = true,
+		.threaded_repaint = true,
 	};
 
 	output->image_buf = malloc(output->base.current_mode->width *
@@ -271,6 +334,10 @@ headless_output_enable(struct weston_output *base)
 		return -1;
 	}
 
+	output->frame_count = 0;
+	weston_compositor_read_presentation_clock(b->compositor,
+						  &output->enable_time);
+
 	return 0;
 }
 
@@ -279,6 +346,7 @@ headless_output_set_size(struct weston_output *base,
 			 int width, int height)
 {
 	struct headless_output *output = to_headless_output(base);
+	struct headless_backend *b = to_headless_backend(base->compositor);
 	struct weston_head *head;
 	int output_width, output_height;
 
@@ -303,7 +371,7 @@ headless_output_set_size(struct weston_output *base,
 		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
 	output->mode.width = output_width;
 	output->mode.height = output_height;
-	output->mode.refresh = 60000;
+	output->mode.refresh = b->refresh;
 	wl_list_insert(&output->base.mode_list, &output->mode.link);
 
 	output->base.current_mode = &output->mode;
@@ -431,6 +499,18 @@ headless_backend_create(struct weston_compositor *compositor,
 
 	b->base.destroy = headless_destroy;
 	b->base.create_output = headless_output_create;
+	b->base.repaint_flush = headless_repaint_flush;
+
+	if (config->refresh < 0) {
+		weston_log("Error: invalid refresh rate %d mHz.\n",
+			   config->refresh);
+		goto err_free;
+	}
+
+	b->refresh = config->refresh ? config->refresh : 60000;
+	b->unthrottled = config->unthrottled;
+	if (b->unthrottled)
+		weston_log("Headless outputs are unthrottled.\n");
 
 	if (config->use_pixman && config->use_gl) {
 		weston_log("Error: cannot use both Pixman *and* GL renderers.\n");
@@ -26,11 +26,17 @@
 #include "config.h"
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <linux/input.h>
+#include <drm_fourcc.h>
 
 #if HAVE_FREERDP_VERSION_H
 #include <freerdp/version.h>
@@ -96,15 +102,34 @@
 #include <winpr/ssl.h>
 #endif
 
+#ifdef HAVE_FREERDP_GFX
+#include <freerdp/channels/wtsvc.h>
+#include <freerdp/codec/h264.h>
+#include <freerdp/server/rdpgfx.h>
+#include <winpr/synch.h>
+
+#define RDP_GFX_SURFACE_ID 1
+/* Frames sent and not acknowledged yet, before damage gets merged */
+#define RDP_GFX_MAX_FRAMES_IN_FLIGHT 2
+#define RDP_GFX_AVC420_BITRATE (10 * 1000 * 1000)
+#endif
+
 #include "shared/helpers.h"
 #include "shared/timespec-util.h"
 #include <libweston/libweston.h>
 #include <libweston/backend-rdp.h>
+#include "libweston-internal.h"
 #include "pixman-renderer.h"
+#include "renderer-gl/gl-renderer.h"
+#include "shared/weston-egl-ext.h"
 
 #define MAX_FREERDP_FDS 32
 #define DEFAULT_AXIS_STEP_DISTANCE 10
 #define RDP_MODE_FREQ 60 * 1000
+/* Frames sent to a peer without acknowledgement, before damage gets merged */
+#define RDP_MAX_FRAMES_IN_FLIGHT 2
+/* Frame interval while no peer shows the output */
+#define RDP_SUPPRESSED_FRAME_MSEC 1000
 
 #if FREERDP_VERSION_MAJOR >= 2 && defined(PIXEL_FORMAT_BGRA32) && !defined(PIXEL_FORMAT_B8G8R8A8)
 	/* The RDP API is truly wonderful: the pixel format definition changed
@@ -132,6 +157,9 @@ struct rdp_backend {
 	int tls_enabled;
 	int no_clients_resize;
 	int force_no_compression;
+
+	bool use_gl;
+	const struct gl_renderer_interface *glri;
 };
 
 enum peer_item_flags {
@@ -154,8 +182,20 @@ struct rdp_head {
 struct rdp_output {
 	struct weston_output base;
 	struct wl_event_source *finish_frame_timer;
+	bool frame_pending;
 	pixman_image_t *shadow_surface;
 
+	/* With the GL renderer, the damage is read back into shadow_surface
+	 * without waiting for the GPU, and sent to the peers once there. */
+	struct {
+		bool pending;
+		void *pixels;
+		size_t size;
+		pixman_box32_t box;
+		pixman_region32_t damage;	/* being read back */
+		pixman_region32_t deferred;	/* damaged during a read */
+	} readback;
+
 	struct wl_list peers;
 };
 
@@ -169,6 +209,60 @@ struct rdp_peer_context {
 	RFX_RECT *rfx_rects;
 	NSC_CONTEXT *nsc_context;
 
+	/* surface frame markers, and the last one the client acknowledged */
+	uint32_t frame_id;
+	uint32_t acked_frame_id;
+
+	/* RemoteFX encoding thread, see rdp_peer_encoder_kick() */
+	struct {
+		pthread_t thread;
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+		bool quit;	/* protected by mutex */
+		bool work;	/* protected by mutex */
+		bool gfx;	/* protected by mutex */
+
+		/* owned by the compositor thread */
+		bool busy;
+		bool discard;
+		int notify_fd[2];
+		struct wl_event_source *notify_source;
+		struct wl_event_source *writable_source;
+		pixman_region32_t pending;
+
+		/* owned by the encoding thread while busy */
+		pixman_image_t *image;
+		pixman_region32_t encoding;
+	} enc;
+
+#ifdef HAVE_FREERDP_GFX
+	HANDLE vcm;
+	struct wl_event_source *vcm_event_source;
+
+	/* graphics pipeline, see rdp_peer_gfx_setup() */
+	struct {
+		RdpgfxServerContext *context;
+		H264_CONTEXT *h264;
+
+		/* set by the channel thread, protected by enc.mutex */
+		bool caps_confirmed;
+		bool caps_avc420;
+		bool acks_suspended;
+		uint32_t acked_frame_id;
+
+		/* owned by the compositor thread */
+		bool opened;
+		bool ready;
+		bool avc420;
+		bool surface_created;
+		uint32_t frame_id;
+
+		/* AVC420 output of the encoding thread */
+		BYTE *data;
+		UINT32 size;
+	} gfx;
+#endif
+
 	struct rdp_peers_item item;
 };
 typedef struct rdp_peer_context RdpPeerContext;
@@ -191,16 +285,21 @@ to_rdp_backend(struct weston_compositor *base)
 	return container_of(base->backend, struct rdp_backend, base);
 }
 
+static const uint32_t rdp_formats[] = {
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_ARGB8888,
+};
+
+/* Runs on the encoding thread. */
 static void
-rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_peer_encode_rfx(RdpPeerContext *context)
 {
+	pixman_region32_t *damage = &context->enc.encoding;
+	pixman_image_t *image = context->enc.image;
 	int width, height, nrects, i;
 	pixman_box32_t *region, *rects;
 	uint32_t *ptr;
 	RFX_RECT *rfxRect;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND cmd;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
 	Stream_Clear(context->encode_stream);
 	Stream_SetPosition(context->encode_stream, 0);
@@ -208,23 +307,6 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	width = (damage->extents.x2 - damage->extents.x1);
 	height = (damage->extents.y2 - damage->extents.y1);
 
-#ifdef HAVE_SKIP_COMPRESSION
-	cmd.skipCompression = TRUE;
-#else
-	memset(&cmd, 0, sizeof(*cmd));
-#endif
-#ifdef HAVE_SURFCMD_CMDTYPE
-	cmd.cmdType = CMDTYPE_STREAM_SURFACE_BITS;
-#endif
-	cmd.destLeft = damage->extents.x1;
-	cmd.destTop = damage->extents.y1;
-	cmd.destRight = damage->extents.x2;
-	cmd.destBottom = damage->extents.y2;
-	SURFACE_BPP(cmd) = 32;
-	SURFACE_CODECID(cmd) = peer->settings->RemoteFxCodecId;
-	SURFACE_WIDTH(cmd) = width;
-	SURFACE_HEIGHT(cmd) = height;
-
 	ptr = pixman_image_get_data(image) + damage->extents.x1 +
 				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
 
@@ -245,13 +327,711 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 			(BYTE *)ptr, width, height,
 			pixman_image_get_stride(image)
 	);
+}
+
+static void
+rdp_peer_frame_marker(freerdp_peer *peer, UINT32 action)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	SURFACE_FRAME_MARKER marker;
+
+	if (action == SURFACECMD_FRAMEACTION_BEGIN)
+		context->frame_id++;
+
+	marker.frameAction = action;
+	marker.frameId = context->frame_id;
+	peer->update->SurfaceFrameMarker(peer->context, &marker);
+}
+
+/* Clients acknowledging frames advertise how many they accept in flight,
+ * the others 0. */
+static bool
+rdp_peer_frame_can_send(freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	UINT32 max = peer->settings->FrameAcknowledge;
+
+	if (!max)
+		return true;
+
+	max = MIN(max, RDP_MAX_FRAMES_IN_FLIGHT);
+
+	return context->frame_id - context->acked_frame_id < max;
+}
+
+static void
+rdp_peer_send_rfx(freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	pixman_region32_t *damage = &context->enc.encoding;
+	rdpUpdate *update = peer->update;
+	SURFACE_BITS_COMMAND cmd;
+
+#ifdef HAVE_SKIP_COMPRESSION
+	cmd.skipCompression = TRUE;
+#else
+	memset(&cmd, 0, sizeof(*cmd));
+#endif
+#ifdef HAVE_SURFCMD_CMDTYPE
+	cmd.cmdType = CMDTYPE_STREAM_SURFACE_BITS;
+#endif
+	cmd.destLeft = damage->extents.x1;
+	cmd.destTop = damage->extents.y1;
+	cmd.destRight = damage->extents.x2;
+	cmd.destBottom = damage->extents.y2;
+	SURFACE_BPP(cmd) = 32;
+	SURFACE_CODECID(cmd) = peer->settings->RemoteFxCodecId;
+	SURFACE_WIDTH(cmd) = damage->extents.x2 - damage->extents.x1;
+	SURFACE_HEIGHT(cmd) = damage->extents.y2 - damage->extents.y1;
 
 	SURFACE_BITMAP_DATA_LEN(cmd) = Stream_GetPosition(context->encode_stream);
 	SURFACE_BITMAP_DATA(cmd) = Stream_Buffer(context->encode_stream);
 
+	rdp_peer_frame_marker(peer, SURFACECMD_FRAMEACTION_BEGIN);
 	update->SurfaceBits(update->context, &cmd);
+	rdp_peer_frame_marker(peer, SURFACECMD_FRAMEACTION_END);
+}
+
+/* Wakes up rdp_peer_encoder_done() on the compositor thread. */
+static void
+rdp_peer_encoder_notify(RdpPeerContext *context)
+{
+	char byte = 0;
+
+	/* the pipe never fills up, there is about one byte per frame */
+	if (write(context->enc.notify_fd[1], &byte, 1) < 0 && errno != EAGAIN)
+		weston_log("RDP: failed to notify the compositor: %s\n",
+			   strerror(errno));
+}
+
+#ifdef HAVE_FREERDP_GFX
+static void
+rdp_peer_encode_gfx(RdpPeerContext *context);
+static void
+rdp_peer_send_gfx(freerdp_peer *peer);
+static bool
+rdp_peer_gfx_can_send(RdpPeerContext *context);
+static void
+rdp_peer_gfx_dispatch(freerdp_peer *peer);
+#endif
+
+static void *
+rdp_peer_encoder_thread(void *data)
+{
+	RdpPeerContext *context = data;
+	bool gfx;
+
+	weston_thread_scheduling_apply(
+		&context->rdpBackend->compositor->thread_scheduling);
+
+	pthread_mutex_lock(&context->enc.mutex);
+
+	for (;;) {
+		while (!context->enc.work && !context->enc.quit)
+			pthread_cond_wait(&context->enc.cond,
+					  &context->enc.mutex);
+		if (context->enc.quit)
+			break;
+
+		gfx = context->enc.gfx;
+		pthread_mutex_unlock(&context->enc.mutex);
+#ifdef HAVE_FREERDP_GFX
+		if (gfx)
+			rdp_peer_encode_gfx(context);
+		else
+#endif
+			rdp_peer_encode_rfx(context);
+		pthread_mutex_lock(&context->enc.mutex);
+
+		context->enc.work = false;
+		pthread_cond_broadcast(&context->enc.cond);
+		rdp_peer_encoder_notify(context);
+	}
+
+	pthread_mutex_unlock(&context->enc.mutex);
+
+	return NULL;
+}
+
+static bool
+rdp_peer_writable(freerdp_peer *peer)
+{
+	struct pollfd pfd = { .fd = peer->sockfd, .events = POLLOUT };
+
+	return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT);
+}
+
+static int
+rdp_peer_writable_handler(int fd, uint32_t mask, void *data);
+
+/* Hands the pending damage over to the encoding thread. While the thread is
+ * busy, or the peer is not reading fast enough to have room in its socket,
+ * damage of later repaints is merged into the pending one: such a peer only
+ * gets the latest picture instead of every intermediate frame, and does not
+ * slow down the other peers. */
+static void
+rdp_peer_encoder_kick(freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_output *output = context->rdpBackend->output;
+	pixman_image_t *shadow = output->shadow_surface;
+	struct wl_event_loop *loop;
+	pixman_box32_t *rects;
+	int width, height, nrects, i;
+
+	if (context->enc.busy ||
+	    !(context->item.flags & RDP_PEER_OUTPUT_ENABLED) ||
+	    !pixman_region32_not_empty(&context->enc.pending))
+		return;
+
+	/* kicked again by the frame acknowledgement */
+#ifdef HAVE_FREERDP_GFX
+	if (context->gfx.ready) {
+		if (!rdp_peer_gfx_can_send(context))
+			return;
+	} else
+#endif
+	if (!rdp_peer_frame_can_send(peer))
+		return;
+
+	if (!rdp_peer_writable(peer)) {
+		if (!context->enc.writable_source) {
+			loop = wl_display_get_event_loop(context->rdpBackend->compositor->wl_display);
+			context->enc.writable_source =
+				wl_event_loop_add_fd(loop, peer->sockfd,
+						     WL_EVENT_WRITABLE,
+						     rdp_peer_writable_handler,
+						     peer);
+		}
+		return;
+	}
+
+	width = pixman_image_get_width(shadow);
+	height = pixman_image_get_height(shadow);
+	if (!context->enc.image ||
+	    pixman_image_get_width(context->enc.image) != width ||
+	    pixman_image_get_height(context->enc.image) != height) {
+		if (context->enc.image)
+			pixman_image_unref(context->enc.image);
+		context->enc.image =
+			pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height,
+						 NULL, width * 4);
+		if (!context->enc.image)
+			return;
+		pixman_region32_union_rect(&context->enc.pending,
+					   &context->enc.pending,
+					   0, 0, width, height);
+	}
+
+	/* Only the damage gets copied, the encoding thread does the
+	 * expensive part. */
+	pixman_region32_intersect_rect(&context->enc.pending,
+				       &context->enc.pending,
+				       0, 0, width, height);
+	rects = pixman_region32_rectangles(&context->enc.pending, &nrects);
+	for (i = 0; i < nrects; i++)
+		pixman_image_composite32(PIXMAN_OP_SRC, shadow, NULL,
+					 context->enc.image,
+					 rects[i].x1, rects[i].y1, 0, 0,
+					 rects[i].x1, rects[i].y1,
+					 rects[i].x2 - rects[i].x1,
+					 rects[i].y2 - rects[i].y1);
+
+	pixman_region32_copy(&context->enc.encoding, &context->enc.pending);
+	pixman_region32_clear(&context->enc.pending);
+	context->enc.busy = true;
+
+	pthread_mutex_lock(&context->enc.mutex);
+	context->enc.work = true;
+#ifdef HAVE_FREERDP_GFX
+	context->enc.gfx = context->gfx.ready;
+#endif
+	pthread_cond_signal(&context->enc.cond);
+	pthread_mutex_unlock(&context->enc.mutex);
+}
+
+static int
+rdp_peer_writable_handler(int fd, uint32_t mask, void *data)
+{
+	freerdp_peer *peer = data;
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+
+	wl_event_source_remove(context->enc.writable_source);
+	context->enc.writable_source = NULL;
+
+	rdp_peer_encoder_kick(peer);
+
+	return 0;
+}
+
+static int
+rdp_peer_encoder_done(int fd, uint32_t mask, void *data)
+{
+	freerdp_peer *peer = data;
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	char buf[16];
+	bool finished;
+
+	while (read(fd, buf, sizeof buf) > 0)
+		;
+
+#ifdef HAVE_FREERDP_GFX
+	rdp_peer_gfx_dispatch(peer);
+#endif
+
+	if (!context->enc.busy) {
+		rdp_peer_encoder_kick(peer);
+		return 0;
+	}
+
+	pthread_mutex_lock(&context->enc.mutex);
+	finished = !context->enc.work;
+	pthread_mutex_unlock(&context->enc.mutex);
+	if (!finished)
+		return 0;
+
+	context->enc.busy = false;
+#ifdef HAVE_FREERDP_GFX
+	if (!context->enc.discard && context->enc.gfx)
+		rdp_peer_send_gfx(peer);
+	else
+#endif
+	if (!context->enc.discard)
+		rdp_peer_send_rfx(peer);
+	context->enc.discard = false;
+
+	rdp_peer_encoder_kick(peer);
+
+	return 0;
+}
+
+/* Waits for the encoding thread to be idle, before the RemoteFX context
+ * changes under it. A frame it encoded is not sent. */
+static void
+rdp_peer_encoder_wait(RdpPeerContext *context)
+{
+	pthread_mutex_lock(&context->enc.mutex);
+	while (context->enc.work)
+		pthread_cond_wait(&context->enc.cond, &context->enc.mutex);
+	pthread_mutex_unlock(&context->enc.mutex);
+
+	if (context->enc.busy) {
+		context->enc.discard = true;
+		pixman_region32_union(&context->enc.pending,
+				      &context->enc.pending,
+				      &context->enc.encoding);
+	}
+}
+
+static int
+rdp_peer_encoder_init(RdpPeerContext *context)
+{
+	if (pipe2(context->enc.notify_fd, O_CLOEXEC | O_NONBLOCK) < 0)
+		return -1;
+
+	pixman_region32_init(&context->enc.pending);
+	pixman_region32_init(&context->enc.encoding);
+	pthread_mutex_init(&context->enc.mutex, NULL);
+	pthread_cond_init(&context->enc.cond, NULL);
+
+	if (pthread_create(&context->enc.thread, NULL,
+			   rdp_peer_encoder_thread, context) != 0) {
+		pthread_cond_destroy(&context->enc.cond);
+		pthread_mutex_destroy(&context->enc.mutex);
+		pixman_region32_fini(&context->enc.encoding);
+		pixman_region32_fini(&context->enc.pending);
+		close(context->enc.notify_fd[0]);
+		close(context->enc.notify_fd[1]);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+rdp_peer_encoder_fini(RdpPeerContext *context)
+{
+	pthread_mutex_lock(&context->enc.mutex);
+	context->enc.quit = true;
+	pthread_cond_broadcast(&context->enc.cond);
+	pthread_mutex_unlock(&context->enc.mutex);
+
+	pthread_join(context->enc.thread, NULL);
+
+	if (context->enc.notify_source)
+		wl_event_source_remove(context->enc.notify_source);
+	if (context->enc.writable_source)
+		wl_event_source_remove(context->enc.writable_source);
+	close(context->enc.notify_fd[0]);
+	close(context->enc.notify_fd[1]);
+
+	if (context->enc.image)
+		pixman_image_unref(context->enc.image);
+	pixman_region32_fini(&context->enc.encoding);
+	pixman_region32_fini(&context->enc.pending);
+	pthread_cond_destroy(&context->enc.cond);
+	pthread_mutex_destroy(&context->enc.mutex);
+}
+
+#ifdef HAVE_FREERDP_GFX
+/* Runs on the encoding thread. AVC420 always encodes the whole surface, the
+ * damage only tells the client what changed. */
+static void
+rdp_peer_encode_gfx(RdpPeerContext *context)
+{
+	pixman_region32_t *damage = &context->enc.encoding;
+	pixman_image_t *image = context->enc.image;
+	int stride = pixman_image_get_stride(image);
+	int width, height, y;
+	BYTE *src;
+
+	if (context->gfx.avc420) {
+		if (avc420_compress(context->gfx.h264,
+				    (BYTE *)pixman_image_get_data(image),
+				    PIXEL_FORMAT_BGRX32, stride,
+				    pixman_image_get_width(image),
+				    pixman_image_get_height(image),
+				    &context->gfx.data,
+				    &context->gfx.size) < 0) {
+			context->gfx.data = NULL;
+			context->gfx.size = 0;
+		}
+		return;
+	}
+
+	/* the uncompressed codec takes the rows of the damaged extents */
+	width = damage->extents.x2 - damage->extents.x1;
+	height = damage->extents.y2 - damage->extents.y1;
+
+	Stream_SetPosition(context->encode_stream, 0);
+	if (!Stream_EnsureCapacity(context->encode_stream,
+				   (size_t)width * height * 4))
+		return;
+
+	src = (BYTE *)pixman_image_get_data(image) +
+		damage->extents.y1 * stride + damage->extents.x1 * 4;
+	for (y = 0; y < height; y++, src += stride)
+		Stream_Write(context->encode_stream, src, width * 4);
+}
+
+static void
+rdp_peer_send_gfx(freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	RdpgfxServerContext *gfx = context->gfx.context;
+	pixman_box32_t *ext = pixman_region32_extents(&context->enc.encoding);
+	RDPGFX_START_FRAME_PDU start = { 0 };
+	RDPGFX_END_FRAME_PDU end = { 0 };
+	RDPGFX_SURFACE_COMMAND cmd = { 0 };
+	RDPGFX_AVC420_BITMAP_STREAM avc420 = { 0 };
+	RDPGFX_H264_QUANT_QUALITY quality = { 0 };
+	RECTANGLE_16 region;
+
+	cmd.surfaceId = RDP_GFX_SURFACE_ID;
+	cmd.format = PIXEL_FORMAT_BGRX32;
+
+	if (context->gfx.avc420) {
+		if (!context->gfx.data)
+			return;
+
+		region.left = ext->x1;
+		region.top = ext->y1;
+		region.right = ext->x2;
+		region.bottom = ext->y2;
+
+		quality.qp = 22;
+		quality.qualityVal = 100;
+
+		avc420.meta.numRegionRects = 1;
+		avc420.meta.regionRects = &region;
+		avc420.meta.quantQualityVals = &quality;
+		avc420.data = context->gfx.data;
+		avc420.length = context->gfx.size;
+
+		cmd.codecId = RDPGFX_CODECID_AVC420;
+		cmd.left = 0;
+		cmd.top = 0;
+		cmd.right = pixman_image_get_width(context->enc.image);
+		cmd.bottom = pixman_image_get_height(context->enc.image);
+		cmd.extra = &avc420;
+	} else {
+		cmd.codecId = RDPGFX_CODECID_UNCOMPRESSED;
+		cmd.left = ext->x1;
+		cmd.top = ext->y1;
+		cmd.right = ext->x2;
+		cmd.bottom = ext->y2;
+		cmd.data = Stream_Buffer(context->encode_stream);
+		cmd.length = Stream_GetPosition(context->encode_stream);
+	}
+	cmd.width = cmd.right - cmd.left;
+	cmd.height = cmd.bottom - cmd.top;
+
+	start.frameId = end.frameId = ++context->gfx.frame_id;
+
+	gfx->StartFrame(gfx, &start);
+	gfx->SurfaceCommand(gfx, &cmd);
+	gfx->EndFrame(gfx, &end);
+}
+
+static bool
+rdp_peer_gfx_can_send(RdpPeerContext *context)
+{
+	bool ret;
+
+	pthread_mutex_lock(&context->enc.mutex);
+	ret = context->gfx.acks_suspended ||
+	      context->gfx.frame_id - context->gfx.acked_frame_id <
+			RDP_GFX_MAX_FRAMES_IN_FLIGHT;
+	pthread_mutex_unlock(&context->enc.mutex);
+
+	return ret;
+}
+
+/* (Re)creates the surface the output is shown in, for the current size of
+ * the output. */
+static void
+rdp_peer_gfx_setup(freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_output *output = context->rdpBackend->output;
+	RdpgfxServerContext *gfx = context->gfx.context;
+	int width = output->base.width;
+	int height = output->base.height;
+	RDPGFX_RESET_GRAPHICS_PDU reset = { 0 };
+	RDPGFX_CREATE_SURFACE_PDU create = { 0 };
+	RDPGFX_MAP_SURFACE_TO_OUTPUT_PDU map = { 0 };
+	RDPGFX_DELETE_SURFACE_PDU delete = { 0 };
+	MONITOR_DEF monitor = { 0 };
+
+	rdp_peer_encoder_wait(context);
+	context->gfx.ready = false;
+
+	if (context->gfx.surface_created) {
+		delete.surfaceId = RDP_GFX_SURFACE_ID;
+		gfx->DeleteSurface(gfx, &delete);
+		context->gfx.surface_created = false;
+	}
+
+	monitor.right = width - 1;
+	monitor.bottom = height - 1;
+	monitor.flags = MONITOR_PRIMARY;
+	reset.width = width;
+	reset.height = height;
+	reset.monitorCount = 1;
+	reset.monitorDefArray = &monitor;
+	if (gfx->ResetGraphics(gfx, &reset) != CHANNEL_RC_OK)
+		goto err;
+
+	create.surfaceId = RDP_GFX_SURFACE_ID;
+	create.width = width;
+	create.height = height;
+	create.pixelFormat = GFX_PIXEL_FORMAT_XRGB_8888;
+	if (gfx->CreateSurface(gfx, &create) != CHANNEL_RC_OK)
+		goto err;
+	context->gfx.surface_created = true;
+
+	map.surfaceId = RDP_GFX_SURFACE_ID;
+	if (gfx->MapSurfaceToOutput(gfx, &map) != CHANNEL_RC_OK)
+		goto err;
+
+	/* FreeRDP picks the H.264 implementation, hardware accelerated or
+	 * not, depending on how it was built. */
+	if (context->gfx.avc420) {
+		if (!context->gfx.h264)
+			context->gfx.h264 = h264_context_new(TRUE);
+		if (context->gfx.h264 &&
+		    h264_context_reset(context->gfx.h264, width, height)) {
+			context->gfx.h264->RateControlMode = H264_RATECONTROL_VBR;
+			context->gfx.h264->BitRate = RDP_GFX_AVC420_BITRATE;
+			context->gfx.h264->FrameRate = RDP_MODE_FREQ / 1000;
+		} else {
+			weston_log("RDP: no H.264 encoder, sending uncompressed "
+				   "graphics pipeline updates\n");
+			context->gfx.avc420 = false;
+		}
+	}
+
+	weston_log("RDP: using the graphics pipeline with %s\n",
+		   context->gfx.avc420 ? "AVC420" : "uncompressed updates");
+	context->gfx.ready = true;
+
+	pixman_region32_union_rect(&context->enc.pending, &context->enc.pending,
+				   0, 0, width, height);
+	rdp_peer_encoder_kick(peer);
+	return;
+
+err:
+	weston_log("RDP: failed to set up the graphics pipeline surface\n");
+}
+
+/* Runs on the compositor thread, for what the channel thread reported. */
+static void
+rdp_peer_gfx_dispatch(freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	bool confirmed;
+
+	if (context->gfx.ready || context->gfx.surface_created)
+		return;
+
+	pthread_mutex_lock(&context->enc.mutex);
+	confirmed = context->gfx.caps_confirmed;
+	context->gfx.avc420 = context->gfx.caps_avc420;
+	pthread_mutex_unlock(&context->enc.mutex);
+
+	if (confirmed)
+		rdp_peer_gfx_setup(peer);
+}
+
+/* Runs on the channel thread of FreeRDP. */
+static UINT
+rdp_gfx_caps_advertise(RdpgfxServerContext *gfx,
+		       const RDPGFX_CAPS_ADVERTISE_PDU *advertise)
+{
+	RdpPeerContext *context = gfx->custom;
+	RDPGFX_CAPS_CONFIRM_PDU confirm;
+	RDPGFX_CAPSET caps = { 0 };
+	bool found = false, avc420 = false, set_avc420;
+	UINT ret;
+	UINT16 i;
+
+	for (i = 0; i < advertise->capsSetCount; i++) {
+		const RDPGFX_CAPSET *set = &advertise->capsSets[i];
+
+		switch (set->version) {
+		case RDPGFX_CAPVERSION_10:
+			set_avc420 = !(set->flags & RDPGFX_CAPS_FLAG_AVC_DISABLED);
+			break;
+		case RDPGFX_CAPVERSION_81:
+			set_avc420 = set->flags & RDPGFX_CAPS_FLAG_AVC420_ENABLED;
+			break;
+		case RDPGFX_CAPVERSION_8:
+			set_avc420 = false;
+			break;
+		default:
+			continue;
+		}
+
+		/* AVC420 first, then the newest version */
+		if (!found || (set_avc420 && !avc420) ||
+		    (set_avc420 == avc420 && set->version > caps.version)) {
+			caps = *set;
+			avc420 = set_avc420;
+			found = true;
+		}
+	}
+
+	if (!found) {
+		weston_log("RDP: no supported graphics pipeline version\n");
+		return CHANNEL_RC_UNSUPPORTED_VERSION;
+	}
+
+	confirm.capsSet = &caps;
+	ret = gfx->CapsConfirm(gfx, &confirm);
+	if (ret != CHANNEL_RC_OK)
+		return ret;
+
+	pthread_mutex_lock(&context->enc.mutex);
+	context->gfx.caps_confirmed = true;
+	context->gfx.caps_avc420 = avc420;
+	rdp_peer_encoder_notify(context);
+	pthread_mutex_unlock(&context->enc.mutex);
+
+	return CHANNEL_RC_OK;
+}
+
+/* Runs on the channel thread of FreeRDP. */
+static UINT
+rdp_gfx_frame_acknowledge(RdpgfxServerContext *gfx,
+			  const RDPGFX_FRAME_ACKNOWLEDGE_PDU *ack)
+{
+	RdpPeerContext *context = gfx->custom;
+
+	pthread_mutex_lock(&context->enc.mutex);
+	/* SUSPEND_FRAME_ACKNOWLEDGEMENT */
+	context->gfx.acks_suspended = ack->queueDepth == 0xffffffff;
+	context->gfx.acked_frame_id = ack->frameId;
+	rdp_peer_encoder_notify(context);
+	pthread_mutex_unlock(&context->enc.mutex);
+
+	return CHANNEL_RC_OK;
 }
 
+/* The channel can only be opened once the client set up its dynamic virtual
+ * channels. */
+static void
+rdp_peer_gfx_open(RdpPeerContext *context)
+{
+	RdpgfxServerContext *gfx = context->gfx.context;
+
+	if (!gfx || context->gfx.opened ||
+	    !context->item.peer->settings->SupportGraphicsPipeline)
+		return;
+
+	if (!WTSVirtualChannelManagerIsChannelJoined(context->vcm, "drdynvc") ||
+	    WTSVirtualChannelManagerGetDrdynvcState(context->vcm) !=
+			DRDYNVC_STATE_READY)
+		return;
+
+	/* not retried if it fails, the legacy updates keep going */
+	context->gfx.opened = true;
+	if (!gfx->Open(gfx))
+		weston_log("RDP: failed to open the graphics pipeline\n");
+}
+
+static int
+rdp_peer_vcm_activity(int fd, uint32_t mask, void *data)
+{
+	freerdp_peer *client = data;
+	RdpPeerContext *context = (RdpPeerContext *)client->context;
+
+	if (!WTSVirtualChannelManagerCheckFileDescriptor(context->vcm)) {
+		weston_log("unable to check the virtual channels of %p\n",
+			   client);
+		return 0;
+	}
+
+	rdp_peer_gfx_open(context);
+
+	return 0;
+}
+
+static void
+rdp_peer_gfx_init(RdpPeerContext *context)
+{
+	context->vcm = WTSOpenServerA((LPSTR)&context->_p);
+	if (!context->vcm)
+		return;
+
+	context->gfx.context = rdpgfx_server_context_new(context->vcm);
+	if (!context->gfx.context)
+		return;
+
+	context->gfx.context->custom = context;
+	context->gfx.context->rdpcontext = &context->_p;
+	context->gfx.context->CapsAdvertise = rdp_gfx_caps_advertise;
+	context->gfx.context->FrameAcknowledge = rdp_gfx_frame_acknowledge;
+}
+
+static void
+rdp_peer_gfx_fini(RdpPeerContext *context)
+{
+	if (context->vcm_event_source)
+		wl_event_source_remove(context->vcm_event_source);
+
+	if (context->gfx.context) {
+		if (context->gfx.opened)
+			context->gfx.context->Close(context->gfx.context);
+		rdpgfx_server_context_free(context->gfx.context);
+	}
+
+	if (context->gfx.h264)
+		h264_context_free(context->gfx.h264);
+
+	if (context->vcm)
+		WTSCloseServer(context->vcm);
+}
+#endif
 
 static void
 rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
@@ -295,7 +1075,9 @@ rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	SURFACE_BITMAP_DATA_LEN(cmd) = Stream_GetPosition(context->encode_stream);
 	SURFACE_BITMAP_DATA(cmd) = Stream_Buffer(context->encode_stream);
 
+	rdp_peer_frame_marker(peer, SURFACECMD_FRAMEACTION_BEGIN);
 	update->SurfaceBits(update->context, &cmd);
+	rdp_peer_frame_marker(peer, SURFACECMD_FRAMEACTION_END);
 }
 
 static void
@@ -317,7 +1099,6 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 {
 	rdpUpdate *update = peer->update;
 	SURFACE_BITS_COMMAND cmd;
-	SURFACE_FRAME_MARKER marker;
 	pixman_box32_t *rect, subrect;
 	int nrects, i;
 	int heightIncrement, remainingHeight, top;
@@ -326,9 +1107,7 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 	if (!nrects)
 		return;
 
-	marker.frameId++;
-	marker.frameAction = SURFACECMD_FRAMEACTION_BEGIN;
-	update->SurfaceFrameMarker(peer->context, &marker);
+	rdp_peer_frame_marker(peer, SURFACECMD_FRAMEACTION_BEGIN);
 
 	memset(&cmd, 0, sizeof(cmd));
 #ifdef HAVE_SURFCMD_CMDTYPE
@@ -371,23 +1150,174 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 
 	free(SURFACE_BITMAP_DATA(cmd));
 
-	marker.frameAction = SURFACECMD_FRAMEACTION_END;
-	update->SurfaceFrameMarker(peer->context, &marker);
+	rdp_peer_frame_marker(peer, SURFACECMD_FRAMEACTION_END);
 }
 
+/* Sends what the peer misses of the output, unless it suppressed output or
+ * is behind on acknowledging frames. RemoteFX and the graphics pipeline get
+ * encoded on the peer's thread. */
 static void
-rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
+rdp_peer_flush(freerdp_peer *peer)
 {
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 	struct rdp_output *output = context->rdpBackend->output;
 	rdpSettings *settings = peer->settings;
+	pixman_region32_t *pending = &context->enc.pending;
+
+	if (!(context->item.flags & RDP_PEER_ACTIVATED) ||
+	    !(context->item.flags & RDP_PEER_OUTPUT_ENABLED))
+		return;
+
+#ifdef HAVE_FREERDP_GFX
+	if (context->gfx.ready) {
+		rdp_peer_encoder_kick(peer);
+		return;
+	}
+#endif
+	if (settings->RemoteFxCodec) {
+		rdp_peer_encoder_kick(peer);
+		return;
+	}
+
+	if (!pixman_region32_not_empty(pending) ||
+	    !rdp_peer_frame_can_send(peer))
+		return;
 
-	if (settings->RemoteFxCodec)
-		rdp_peer_refresh_rfx(region, output->shadow_surface, peer);
-	else if (settings->NSCodec)
-		rdp_peer_refresh_nsc(region, output->shadow_surface, peer);
+	if (settings->NSCodec)
+		rdp_peer_refresh_nsc(pending, output->shadow_surface, peer);
 	else
-		rdp_peer_refresh_raw(region, output->shadow_surface, peer);
+		rdp_peer_refresh_raw(pending, output->shadow_surface, peer);
+
+	pixman_region32_clear(pending);
+}
+
+static void
+rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+
+	pixman_region32_union(&context->enc.pending, &context->enc.pending,
+			      region);
+	rdp_peer_flush(peer);
+}
+
+static void
+rdp_output_refresh_peers(struct rdp_output *output, pixman_region32_t *damage)
+{
+	struct rdp_peers_item *outputPeer;
+
+	/* Peers suppressing output, or behind on acknowledgements, merge the
+	 * damage and get it later. */
+	wl_list_for_each(outputPeer, &output->peers, link) {
+		if (outputPeer->flags & RDP_PEER_ACTIVATED)
+			rdp_peer_refresh_region(damage, outputPeer->peer);
+	}
+}
+
+static int
+rdp_output_start_readback(struct rdp_output *output,
+			  pixman_region32_t *damage);
+
+static void
+rdp_output_readback_done(void *data, int status)
+{
+	struct rdp_output *output = data;
+	struct weston_compositor *ec = output->base.compositor;
+	pixman_box32_t *box = &output->readback.box;
+	int width = box->x2 - box->x1;
+	int height = box->y2 - box->y1;
+	pixman_image_t *image;
+	pixman_transform_t flip;
+
+	output->readback.pending = false;
+
+	if (status == 0) {
+		image = pixman_image_create_bits_no_clear(ec->read_format,
+							  width, height,
+							  output->readback.pixels,
+							  width * 4);
+		if (image) {
+			if (ec->capabilities & WESTON_CAP_CAPTURE_YFLIP) {
+				pixman_transform_init_scale(&flip,
+							    pixman_fixed_1,
+							    pixman_fixed_minus_1);
+				pixman_transform_translate(&flip, NULL, 0,
+							   pixman_int_to_fixed(height));
+				pixman_image_set_transform(image, &flip);
+			}
+			pixman_image_composite32(PIXMAN_OP_SRC, image, NULL,
+						 output->shadow_surface,
+						 0, 0, 0, 0, box->x1, box->y1,
+						 width, height);
+			pixman_image_unref(image);
+
+			rdp_output_refresh_peers(output,
+						 &output->readback.damage);
+		}
+	}
+
+	/* Frames repainted meanwhile only accumulated their damage. */
+	if (pixman_region32_not_empty(&output->readback.deferred)) {
+		pixman_region32_t damage;
+
+		pixman_region32_init(&damage);
+		pixman_region32_copy(&damage, &output->readback.deferred);
+		pixman_region32_clear(&output->readback.deferred);
+		rdp_output_start_readback(output, &damage);
+		pixman_region32_fini(&damage);
+	}
+}
+
+/* Reads the bounding box of the damage back from the GL output without
+ * stalling on the GPU; the peers are refreshed once the pixels arrive. */
+static int
+rdp_output_start_readback(struct rdp_output *output,
+			  pixman_region32_t *damage)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	pixman_box32_t *box = &output->readback.box;
+	uint32_t width, height, y;
+	size_t size;
+	void *pixels;
+
+	pixman_region32_intersect_rect(&output->readback.damage, damage,
+				       output->base.x, output->base.y,
+				       output->base.width, output->base.height);
+	pixman_region32_translate(&output->readback.damage,
+				  -output->base.x, -output->base.y);
+	if (!pixman_region32_not_empty(&output->readback.damage))
+		return 0;
+
+	*box = *pixman_region32_extents(&output->readback.damage);
+	width = box->x2 - box->x1;
+	height = box->y2 - box->y1;
+
+	size = (size_t)width * height * 4;
+	if (size > output->readback.size) {
+		pixels = realloc(output->readback.pixels, size);
+		if (!pixels)
+			return -1;
+		output->readback.pixels = pixels;
+		output->readback.size = size;
+	}
+
+	if (ec->capabilities & WESTON_CAP_CAPTURE_YFLIP)
+		y = output->base.current_mode->height - box->y2;
+	else
+		y = box->y1;
+
+	/* The callback may run before this returns. */
+	output->readback.pending = true;
+	if (weston_output_read_pixels_async(&output->base, ec->read_format,
+					    output->readback.pixels,
+					    box->x1, y, width, height,
+					    rdp_output_readback_done,
+					    output) < 0) {
+		output->readback.pending = false;
+		return -1;
+	}
+
+	return 0;
 }
 
 static int
@@ -407,19 +1337,42 @@ rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage,
 {
 	struct rdp_output *output = container_of(output_base, struct rdp_output, base);
 	struct weston_compositor *ec = output->base.compositor;
+	struct rdp_backend *b = to_rdp_backend(ec);
 	struct rdp_peers_item *outputPeer;
+	bool shown = false;
 
-	pixman_renderer_output_set_buffer(output_base, output->shadow_surface);
-	ec->renderer->repaint_output(&output->base, damage);
+	wl_list_for_each(outputPeer, &output->peers, link) {
+		if ((outputPeer->flags & RDP_PEER_ACTIVATED) &&
+		    (outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
+			shown = true;
+	}
 
-	if (pixman_region32_not_empty(damage)) {
-		wl_list_for_each(outputPeer, &output->peers, link) {
-			if ((outputPeer->flags & RDP_PEER_ACTIVATED) &&
-					(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
-			{
-				rdp_peer_refresh_region(damage, outputPeer->peer);
-			}
-		}
+	output->frame_pending = true;
+
+	/* Nobody looks at the output: nothing gets rendered, the damage stays
+	 * on the primary plane for later, and clients are throttled. */
+	if (!shown) {
+		wl_event_source_timer_update(output->finish_frame_timer,
+					     RDP_SUPPRESSED_FRAME_MSEC);
+		return 0;
+	}
+
+	if (b->use_gl) {
+		ec->renderer->repaint_output(&output->base, damage);
+
+		/* One read back in flight at a time; the next one covers
+		 * everything repainted until it ends. */
+		if (output->readback.pending)
+			pixman_region32_union(&output->readback.deferred,
+					      &output->readback.deferred,
+					      damage);
+		else
+			rdp_output_start_readback(output, damage);
+	} else {
+		pixman_renderer_output_set_buffer(output_base,
+						  output->shadow_surface);
+		ec->renderer->repaint_output(&output->base, damage);
+		rdp_output_refresh_peers(output, damage);
 	}
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
@@ -435,6 +1388,8 @@ finish_frame_handler(void *data)
 	struct rdp_output *output = data;
 	struct timespec ts;
 
+	output->frame_pending = false;
+
 	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
 	weston_output_finish_frame(&output->base, &ts, 0);
 
@@ -472,6 +1427,7 @@ static int
 rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode)
 {
 	struct rdp_output *rdpOutput = container_of(output, struct rdp_output, base);
+	struct rdp_backend *b = to_rdp_backend(output->compositor);
 	struct rdp_peers_item *rdpPeer;
 	rdpSettings *settings;
 	pixman_image_t *new_shadow_buffer;
@@ -492,8 +1448,23 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode)
 	output->current_mode = local_mode;
 	output->current_mode->flags |= WL_OUTPUT_MODE_CURRENT;
 
-	pixman_renderer_output_destroy(output);
-	pixman_renderer_output_create(output, &options);
+	if (b->use_gl) {
+		const struct gl_renderer_pbuffer_options pb_options = {
+			.width = target_mode->width,
+			.height = target_mode->height,
+			.drm_formats = rdp_formats,
+			.drm_formats_count = ARRAY_LENGTH(rdp_formats),
+		};
+
+		/* Completes a pending read back, before its box goes stale. */
+		pixman_region32_clear(&rdpOutput->readback.deferred);
+		b->glri->output_destroy(output);
+		if (b->glri->output_pbuffer_create(output, &pb_options) < 0)
+			weston_log("failed to recreate the GL output\n");
+	} else {
+		pixman_renderer_output_destroy(output);
+		pixman_renderer_output_create(output, &options);
+	}
 
 	new_shadow_buffer = pixman_image_create_bits(PIXMAN_x8r8g8b8, target_mode->width,
 			target_mode->height, 0, target_mode->width * 4);
@@ -583,7 +1554,22 @@ rdp_output_enable(struct weston_output *base)
 		return -1;
 	}
 
-	if (pixman_renderer_output_create(&output->base, &options) < 0) {
+	if (b->use_gl) {
+		const struct gl_renderer_pbuffer_options pb_options = {
+			.width = output->base.current_mode->width,
+			.height = output->base.current_mode->height,
+			.drm_formats = rdp_formats,
+			.drm_formats_count = ARRAY_LENGTH(rdp_formats),
+		};
+
+		if (b->glri->output_pbuffer_create(&output->base,
+						   &pb_options) < 0) {
+			pixman_image_unref(output->shadow_surface);
+			return -1;
+		}
+		pixman_region32_init(&output->readback.damage);
+		pixman_region32_init(&output->readback.deferred);
+	} else if (pixman_renderer_output_create(&output->base, &options) < 0) {
 		pixman_image_unref(output->shadow_surface);
 		return -1;
 	}
@@ -605,8 +1591,19 @@ rdp_output_disable(struct weston_output *base)
 	if (!output->base.enabled)
 		return 0;
 
+	if (b->use_gl) {
+		/* Completes a pending read back first. */
+		pixman_region32_clear(&output->readback.deferred);
+		b->glri->output_destroy(&output->base);
+		pixman_region32_fini(&output->readback.damage);
+		pixman_region32_fini(&output->readback.deferred);
+		free(output->readback.pixels);
+		output->readback.pixels = NULL;
+		output->readback.size = 0;
+	} else {
+		pixman_renderer_output_destroy(&output->base);
+	}
 	pixman_image_unref(output->shadow_surface);
-	pixman_renderer_output_destroy(&output->base);
 
 	wl_event_source_remove(output->finish_frame_timer);
 	b->output = NULL;
@@ -775,8 +1772,17 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 	if (!context->encode_stream)
 		goto out_error_stream;
 
+	if (rdp_peer_encoder_init(context) < 0)
+		goto out_error_encoder;
+
+#ifdef HAVE_FREERDP_GFX
+	rdp_peer_gfx_init(context);
+#endif
+
 	FREERDP_CB_RETURN(TRUE);
 
+out_error_encoder:
+	Stream_Free(context->encode_stream, TRUE);
 out_error_nsc:
 	rfx_context_free(context->rfx_context);
 out_error_stream:
@@ -804,6 +1810,10 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 		 * but it would crash on reconnect */
 	}
 
+	rdp_peer_encoder_fini(context);
+#ifdef HAVE_FREERDP_GFX
+	rdp_peer_gfx_fini(context);
+#endif
 	Stream_Free(context->encode_stream, TRUE);
 	nsc_context_free(context->nsc_context);
 	rfx_context_free(context->rfx_context);
@@ -831,6 +1841,13 @@ out_clean:
 static BOOL
 xf_peer_capabilities(freerdp_peer* client)
 {
+#ifdef HAVE_FREERDP_GFX
+	/* The graphics pipeline, with AVC420 if the client advertises it,
+	 * gets used once its dynamic channel is ready, see
+	 * rdp_peer_gfx_open(). Until then the legacy codecs are used. */
+	if (client->settings->SupportGraphicsPipeline)
+		weston_log("RDP: client supports the graphics pipeline\n");
+#endif
 	return TRUE;
 }
 
@@ -1034,8 +2051,13 @@ xf_peer_activate(freerdp_peer* client)
 	}
 
 	weston_output = &output->base;
+	rdp_peer_encoder_wait(peerCtx);
 	RFX_RESET(peerCtx->rfx_context, weston_output->width, weston_output->height);
 	NSC_RESET(peerCtx->nsc_context, weston_output->width, weston_output->height);
+#ifdef HAVE_FREERDP_GFX
+	if (peerCtx->gfx.surface_created)
+		rdp_peer_gfx_setup(client);
+#endif
 
 	if (peersItem->flags & RDP_PEER_ACTIVATED)
 		return TRUE;
@@ -1060,8 +2082,8 @@ xf_peer_activate(freerdp_peer* client)
 
 	keymap = NULL;
 	if (xkbRuleNames.layout) {
-		keymap = xkb_keymap_new_from_names(b->compositor->xkb_context,
-						   &xkbRuleNames, 0);
+		keymap = weston_compositor_keymap_from_names(b->compositor,
+							     &xkbRuleNames);
 	}
 
 	if (settings->ClientHostname)
@@ -1266,15 +2288,41 @@ static FREERDP_CB_RET_TYPE
 xf_suppress_output(rdpContext *context, BYTE allow, const RECTANGLE_16 *area)
 {
 	RdpPeerContext *peerContext = (RdpPeerContext *)context;
+	struct rdp_output *output = peerContext->rdpBackend->output;
 
-	if (allow)
-		peerContext->item.flags |= RDP_PEER_OUTPUT_ENABLED;
-	else
+	if (!allow) {
 		peerContext->item.flags &= (~RDP_PEER_OUTPUT_ENABLED);
+		FREERDP_CB_RETURN(TRUE);
+	}
+
+	if (peerContext->item.flags & RDP_PEER_OUTPUT_ENABLED)
+		FREERDP_CB_RETURN(TRUE);
+
+	peerContext->item.flags |= RDP_PEER_OUTPUT_ENABLED;
+
+	/* The client needs the whole picture again, once the output is
+	 * rendered. A throttled frame is cut short for that. */
+	pixman_region32_union_rect(&peerContext->enc.pending,
+				   &peerContext->enc.pending, 0, 0,
+				   output->base.width, output->base.height);
+	weston_output_schedule_repaint(&output->base);
+	if (output->frame_pending)
+		wl_event_source_timer_update(output->finish_frame_timer, 1);
 
 	FREERDP_CB_RETURN(TRUE);
 }
 
+static BOOL
+xf_surface_frame_acknowledge(rdpContext *context, UINT32 frameId)
+{
+	RdpPeerContext *peerContext = (RdpPeerContext *)context;
+
+	peerContext->acked_frame_id = frameId;
+	rdp_peer_flush(peerContext->item.peer);
+
+	return TRUE;
+}
+
 static int
 rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
 {
@@ -1325,6 +2373,7 @@ rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
 	client->Activate = xf_peer_activate;
 
 	client->update->SuppressOutput = (pSuppressOutput)xf_suppress_output;
+	client->update->SurfaceFrameAcknowledge = xf_surface_frame_acknowledge;
 
 	input = client->input;
 	input->SynchronizeEvent = xf_input_synchronize_event;
@@ -1348,6 +2397,24 @@ rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
 	for ( ; i < MAX_FREERDP_FDS; i++)
 		peerCtx->events[i] = 0;
 
+	peerCtx->enc.notify_source =
+		wl_event_loop_add_fd(loop, peerCtx->enc.notify_fd[0],
+				     WL_EVENT_READABLE, rdp_peer_encoder_done,
+				     client);
+
+#ifdef HAVE_FREERDP_GFX
+	if (peerCtx->vcm) {
+		HANDLE vcm_event =
+			WTSVirtualChannelManagerGetEventHandle(peerCtx->vcm);
+
+		peerCtx->vcm_event_source =
+			wl_event_loop_add_fd(loop,
+					     GetEventFileDescriptor(vcm_event),
+					     WL_EVENT_READABLE,
+					     rdp_peer_vcm_activity, client);
+	}
+#endif
+
 	wl_list_insert(&b->output->peers, &peerCtx->item.link);
 	return 0;
 
@@ -1373,6 +2440,24 @@ static const struct weston_rdp_output_api api = {
 	rdp_output_set_size,
 };
 
+static int
+rdp_gl_renderer_init(struct rdp_backend *b)
+{
+	const struct gl_renderer_display_options options = {
+		.egl_platform = EGL_PLATFORM_SURFACELESS_MESA,
+		.egl_native_display = EGL_DEFAULT_DISPLAY,
+		.egl_surface_type = EGL_PBUFFER_BIT,
+		.drm_formats = rdp_formats,
+		.drm_formats_count = ARRAY_LENGTH(rdp_formats),
+	};
+
+	b->glri = weston_load_module("gl-renderer.so", "gl_renderer_interface");
+	if (!b->glri)
+		return -1;
+
+	return b->glri->display_create(b->compositor, &options);
+}
+
 static struct rdp_backend *
 rdp_backend_create(struct weston_compositor *compositor,
 		   struct weston_rdp_backend_config *config)
@@ -1392,6 +2477,7 @@ rdp_backend_create(struct weston_compositor *compositor,
 	b->rdp_key = config->rdp_key ? strdup(config->rdp_key) : NULL;
 	b->no_clients_resize = config->no_clients_resize;
 	b->force_no_compression = config->force_no_compression;
+	b->use_gl = config->use_gl;
 
 	compositor->backend = &b->base;
 
@@ -1408,8 +2494,14 @@ rdp_backend_create(struct weston_compositor *compositor,
 	if (weston_compositor_set_presentation_clock_software(compositor) < 0)
 		goto err_compositor;
 
-	if (pixman_renderer_init(compositor) < 0)
+	if (b->use_gl) {
+		if (rdp_gl_renderer_init(b) < 0) {
+			weston_log("failed to initialize the GL renderer\n");
+			goto err_compositor;
+		}
+	} else if (pixman_renderer_init(compositor) < 0) {
 		goto err_compositor;
+	}
 
 	if (rdp_head_create(compositor, "rdp") < 0)
 		goto err_compositor;
@@ -1476,6 +2568,7 @@ config_init_to_defaults(struct weston_rdp_backend_config *config)
 	config->env_socket = 0;
 	config->no_clients_resize = 0;
 	config->force_no_compression = 0;
+	config->use_gl = false;
 }
 
 WL_EXPORT int
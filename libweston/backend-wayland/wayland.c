@@ -59,11 +59,18 @@
 #include "fullscreen-shell-unstable-v1-client-protocol.h"
 #include "xdg-shell-client-protocol.h"
 #include "presentation-time-server-protocol.h"
+#include "presentation-time-client-protocol.h"
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
+#include "viewporter-client-protocol.h"
 #include "linux-dmabuf.h"
+#include "libweston-internal.h"
 #include <libweston/windowed-output-api.h>
 
 #define WINDOW_TITLE "Weston Compositor"
 
+/* Subsurfaces per output used to show client buffers without compositing */
+#define WAYLAND_MAX_PLANES 4
+
 static const uint32_t wayland_formats[] = {
 	DRM_FORMAT_ARGB8888,
 };
@@ -80,6 +87,13 @@ struct wayland_backend {
 		struct xdg_wm_base *xdg_wm_base;
 		struct zwp_fullscreen_shell_v1 *fshell;
 		struct wl_shm *shm;
+		struct wl_subcompositor *subcompositor;
+		struct wp_presentation *presentation;
+		clockid_t presentation_clock;
+		bool presentation_clock_valid;
+		struct zwp_linux_dmabuf_v1 *dmabuf;
+		struct wl_array dmabuf_formats; /**< struct wayland_dmabuf_format */
+		struct wp_viewporter *viewporter;
 
 		struct wl_list output_list;
 
@@ -90,6 +104,10 @@ struct wayland_backend {
 	bool use_pixman;
 	bool sprawl_across_outputs;
 	bool fullscreen;
+	bool passthrough;
+
+	/* wayland_dmabuf_buffer attached to client dmabufs */
+	struct wl_list dmabuf_buffer_list;
 
 	struct theme *theme;
 	cairo_device_t *frame_device;
@@ -114,6 +132,11 @@ struct wayland_output {
 		struct xdg_toplevel *xdg_toplevel;
 		int configure_width, configure_height;
 		bool wait_for_configure;
+
+		/* Scales the frames of the current mode to the fullscreen
+		 * size of the parent, 0x0 when unscaled. */
+		struct wp_viewport *viewport;
+		int32_t scaled_width, scaled_height;
 	} parent;
 
 	int keyboard_count;
@@ -138,7 +161,53 @@ struct wayland_output {
 
 	struct weston_mode mode;
 
+	/* A frame finishes on the parent's presentation feedback if there
+	 * is one, otherwise on the frame callback. */
 	struct wl_callback *frame_cb;
+	struct wp_presentation_feedback *feedback;
+	bool frame_restart; /**< from start_repaint_loop, nothing drawn */
+
+	struct wl_list plane_list; /**< wayland_plane::link, top to bottom */
+};
+
+struct wayland_dmabuf_format {
+	uint32_t format;
+	uint64_t modifier;
+};
+
+/** A client dmabuf imported into the parent compositor
+ *
+ * The import happens once per client buffer, and is kept until the client
+ * destroys it. Failed imports are remembered too.
+ */
+struct wayland_dmabuf_buffer {
+	struct wayland_backend *backend;
+	struct linux_dmabuf_buffer *dmabuf;
+	struct wl_list link; /**< wayland_backend::dmabuf_buffer_list */
+
+	struct wl_buffer *parent_buffer;
+	bool failed;
+
+	/* Keeps the client buffer busy until the parent releases it */
+	struct weston_buffer_reference buffer_ref;
+
+	struct wayland_plane *plane; /**< showing the buffer, if any */
+};
+
+/** A subsurface of the output window, showing a client buffer as is */
+struct wayland_plane {
+	struct weston_plane base;
+	struct wayland_output *output;
+	struct wl_list link; /**< wayland_output::plane_list */
+
+	struct wl_surface *surface;
+	struct wl_subsurface *subsurface;
+
+	/* set by assign_planes for the next repaint */
+	struct weston_view *view;
+	struct wayland_dmabuf_buffer *next;
+
+	struct wayland_dmabuf_buffer *current;
 };
 
 struct wayland_parent_output {
@@ -322,6 +391,7 @@ wayland_output_get_shm_buffer(struct wayland_output *output)
 		close(fd);
 		return NULL;
 	}
+	os_advise_huge_pages(data, height * stride);
 
 	sb = zalloc(sizeof *sb);
 	if (sb == NULL) {
@@ -373,6 +443,350 @@ wayland_output_get_shm_buffer(struct wayland_output *output)
 	return sb;
 }
 
+static void
+wayland_dmabuf_buffer_release(void *data, struct wl_buffer *buffer)
+{
+	struct wayland_dmabuf_buffer *db = data;
+
+	weston_buffer_reference(&db->buffer_ref, NULL);
+}
+
+static const struct wl_buffer_listener dmabuf_buffer_listener = {
+	wayland_dmabuf_buffer_release
+};
+
+static void
+wayland_dmabuf_buffer_destroy(struct wayland_dmabuf_buffer *db)
+{
+	if (db->plane)
+		db->plane->current = NULL;
+
+	weston_buffer_reference(&db->buffer_ref, NULL);
+	if (db->parent_buffer)
+		wl_buffer_destroy(db->parent_buffer);
+
+	linux_dmabuf_buffer_set_backend_user_data(db->dmabuf, NULL, NULL);
+	wl_list_remove(&db->link);
+	free(db);
+}
+
+static void
+wayland_dmabuf_buffer_handle_destroy(struct linux_dmabuf_buffer *dmabuf)
+{
+	wayland_dmabuf_buffer_destroy(
+		linux_dmabuf_buffer_get_backend_user_data(dmabuf));
+}
+
+static bool
+wayland_backend_parent_supports_dmabuf(struct wayland_backend *b,
+				       const struct dmabuf_attributes *attr)
+{
+	struct wayland_dmabuf_format *fmt;
+
+	wl_array_for_each(fmt, &b->parent.dmabuf_formats) {
+		if (fmt->format == attr->format &&
+		    fmt->modifier == attr->modifier[0])
+			return true;
+	}
+
+	return false;
+}
+
+/** Get the parent compositor's wl_buffer for a client dmabuf
+ *
+ * Buffers the parent did not advertise support for are never sent, a
+ * failing create_immed would be a fatal protocol error.
+ */
+static struct wayland_dmabuf_buffer *
+wayland_dmabuf_buffer_get(struct wayland_backend *b,
+			  struct linux_dmabuf_buffer *dmabuf)
+{
+	const struct dmabuf_attributes *attr = &dmabuf->attributes;
+	struct zwp_linux_buffer_params_v1 *params;
+	struct wayland_dmabuf_buffer *db;
+	int i;
+
+	db = linux_dmabuf_buffer_get_backend_user_data(dmabuf);
+	if (db)
+		return db->failed ? NULL : db;
+
+	db = zalloc(sizeof *db);
+	if (!db)
+		return NULL;
+
+	db->backend = b;
+	db->dmabuf = dmabuf;
+	wl_list_insert(&b->dmabuf_buffer_list, &db->link);
+	linux_dmabuf_buffer_set_backend_user_data(dmabuf, db,
+			wayland_dmabuf_buffer_handle_destroy);
+
+	if (!wayland_backend_parent_supports_dmabuf(b, attr)) {
+		db->failed = true;
+		return NULL;
+	}
+
+	params = zwp_linux_dmabuf_v1_create_params(b->parent.dmabuf);
+	for (i = 0; i < attr->n_planes; i++)
+		zwp_linux_buffer_params_v1_add(params, attr->fd[i], i,
+					       attr->offset[i],
+					       attr->stride[i],
+					       attr->modifier[i] >> 32,
+					       attr->modifier[i] & 0xffffffff);
+
+	db->parent_buffer =
+		zwp_linux_buffer_params_v1_create_immed(params,
+							attr->width,
+							attr->height,
+							attr->format,
+							attr->flags);
+	zwp_linux_buffer_params_v1_destroy(params);
+	wl_buffer_add_listener(db->parent_buffer, &dmabuf_buffer_listener, db);
+
+	return db;
+}
+
+static void
+wayland_backend_dmabuf_buffer_release(struct wayland_backend *b)
+{
+	struct wayland_dmabuf_buffer *db, *tmp;
+
+	wl_list_for_each_safe(db, tmp, &b->dmabuf_buffer_list, link)
+		wayland_dmabuf_buffer_destroy(db);
+}
+
+static struct wayland_plane *
+wayland_plane_create(struct wayland_output *output)
+{
+	struct wayland_backend *b = to_wayland_backend(output->base.compositor);
+	struct weston_compositor *ec = b->compositor;
+	struct wayland_plane *plane;
+	struct wl_region *region;
+
+	plane = zalloc(sizeof *plane);
+	if (!plane)
+		return NULL;
+
+	plane->output = output;
+	plane->surface = wl_compositor_create_surface(b->parent.compositor);
+	plane->subsurface =
+		wl_subcompositor_get_subsurface(b->parent.subcompositor,
+						plane->surface,
+						output->parent.surface);
+
+	/* Input goes to the output surface underneath, as if the view was
+	 * composited. */
+	region = wl_compositor_create_region(b->parent.compositor);
+	wl_surface_set_input_region(plane->surface, region);
+	wl_region_destroy(region);
+
+	weston_plane_init(&plane->base, ec, 0, 0);
+	weston_compositor_stack_plane(ec, &plane->base, &ec->primary_plane);
+	wl_list_insert(output->plane_list.prev, &plane->link);
+
+	return plane;
+}
+
+static void
+wayland_plane_destroy(struct wayland_plane *plane)
+{
+	if (plane->current)
+		plane->current->plane = NULL;
+
+	weston_plane_release(&plane->base);
+	wl_subsurface_destroy(plane->subsurface);
+	wl_surface_destroy(plane->surface);
+	wl_list_remove(&plane->link);
+	free(plane);
+}
+
+static struct wayland_plane *
+wayland_output_get_free_plane(struct wayland_output *output)
+{
+	struct wayland_plane *plane;
+	int count = 0;
+
+	wl_list_for_each(plane, &output->plane_list, link) {
+		if (!plane->view)
+			return plane;
+		count++;
+	}
+
+	if (count >= WAYLAND_MAX_PLANES)
+		return NULL;
+
+	return wayland_plane_create(output);
+}
+
+/** Find the parent compositor's buffer for a view shown as is
+ *
+ * The view must map one buffer pixel to one output pixel, without
+ * translucency, and stay within the output.
+ */
+static struct wayland_dmabuf_buffer *
+wayland_output_get_view_buffer(struct wayland_output *output,
+			       struct weston_view *ev,
+			       struct linux_dmabuf_buffer *dmabuf)
+{
+	struct wayland_backend *b = to_wayland_backend(output->base.compositor);
+	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
+	pixman_box32_t *extents;
+
+	if (ev->output_mask != (1u << output->base.id))
+		return NULL;
+
+	if (ev->transform.enabled || ev->alpha != 1.0f)
+		return NULL;
+
+	/* Subsurfaces are not scaled along with their parent. */
+	if (output->parent.scaled_width > 0)
+		return NULL;
+
+	if (output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    vp->buffer.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    vp->buffer.scale != output->base.current_scale ||
+	    vp->buffer.src_width != wl_fixed_from_int(-1) ||
+	    vp->surface.width != -1)
+		return NULL;
+
+	extents = pixman_region32_extents(&ev->transform.boundingbox);
+	if (pixman_region32_contains_rectangle(&output->base.region,
+					       extents) != PIXMAN_REGION_IN)
+		return NULL;
+
+	return wayland_dmabuf_buffer_get(b, dmabuf);
+}
+
+static void
+wayland_output_assign_planes(struct weston_output *output_base,
+			     void *repaint_data)
+{
+	struct wayland_output *output = to_wayland_output(output_base);
+	struct weston_compositor *ec = output->base.compositor;
+	struct weston_plane *primary = &ec->primary_plane;
+	struct linux_dmabuf_buffer *dmabuf;
+	struct wayland_dmabuf_buffer *db;
+	struct wayland_plane *plane;
+	struct weston_view *ev, **evp;
+	pixman_region32_t renderer_region, overlap;
+
+	wl_list_for_each(plane, &output->plane_list, link) {
+		plane->view = NULL;
+		plane->next = NULL;
+	}
+
+	/* Views below something composited can only be composited too, the
+	 * subsurfaces are stacked above the output surface. */
+	pixman_region32_init(&renderer_region);
+
+	wl_array_for_each(evp, &output_base->view_array) {
+		ev = *evp;
+		plane = NULL;
+		db = NULL;
+
+		dmabuf = NULL;
+		if (weston_view_has_valid_buffer(ev))
+			dmabuf = linux_dmabuf_buffer_get(
+				ev->surface->buffer_ref.buffer->resource);
+
+		/* The buffer is needed when the view moves to a plane
+		 * later. */
+		ev->surface->keep_buffer = dmabuf != NULL;
+
+		if (dmabuf) {
+			pixman_region32_init(&overlap);
+			pixman_region32_intersect(&overlap, &renderer_region,
+						  &ev->transform.boundingbox);
+			if (!pixman_region32_not_empty(&overlap))
+				db = wayland_output_get_view_buffer(output, ev,
+								    dmabuf);
+			pixman_region32_fini(&overlap);
+		}
+
+		if (db)
+			plane = wayland_output_get_free_plane(output);
+
+		if (plane) {
+			plane->view = ev;
+			plane->next = db;
+			weston_view_move_to_plane(ev, &plane->base);
+			ev->psf_flags = WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY;
+		} else {
+			weston_view_move_to_plane(ev, primary);
+			ev->psf_flags = 0;
+			pixman_region32_union(&renderer_region,
+					      &renderer_region,
+					      &ev->transform.boundingbox);
+		}
+	}
+
+	pixman_region32_fini(&renderer_region);
+}
+
+/** Update the subsurfaces before the output surface gets committed
+ *
+ * Subsurfaces are synchronized, so their state applies together with the
+ * output's frame.
+ */
+static void
+wayland_output_update_planes(struct wayland_output *output)
+{
+	struct wayland_dmabuf_buffer *db;
+	struct wayland_plane *plane;
+	struct weston_view *ev;
+	pixman_box32_t *extents;
+	int32_t ix = 0, iy = 0, x, y;
+	int32_t scale = output->base.current_scale;
+
+	if (output->frame)
+		frame_interior(output->frame, &ix, &iy, NULL, NULL);
+
+	wl_list_for_each(plane, &output->plane_list, link) {
+		db = plane->next;
+
+		if (!plane->view) {
+			if (plane->current) {
+				plane->current->plane = NULL;
+				plane->current = NULL;
+				wl_surface_attach(plane->surface, NULL, 0, 0);
+				wl_surface_commit(plane->surface);
+			}
+			continue;
+		}
+
+		ev = plane->view;
+		extents = pixman_region32_extents(&ev->transform.boundingbox);
+		x = (extents->x1 - output->base.x) * scale + ix;
+		y = (extents->y1 - output->base.y) * scale + iy;
+		wl_subsurface_set_position(plane->subsurface, x, y);
+		/* walking top to bottom, the last one ends up lowest */
+		wl_subsurface_place_above(plane->subsurface,
+					  output->parent.surface);
+
+		/* New content shows up as damage on the plane */
+		if (plane->current != db ||
+		    pixman_region32_not_empty(&plane->base.damage)) {
+			if (plane->current)
+				plane->current->plane = NULL;
+			if (db->plane)
+				db->plane->current = NULL;
+			plane->current = db;
+			db->plane = plane;
+
+			weston_buffer_reference(&db->buffer_ref,
+						ev->surface->buffer_ref.buffer);
+			wl_surface_attach(plane->surface, db->parent_buffer,
+					  0, 0);
+			wl_surface_damage(plane->surface, 0, 0,
+					  INT32_MAX, INT32_MAX);
+			wl_surface_commit(plane->surface);
+		}
+
+		pixman_region32_clear(&plane->base.damage);
+		plane->view = NULL;
+		plane->next = NULL;
+	}
+}
+
 static void
 frame_done(void *data, struct wl_callback *callback, uint32_t time)
 {
@@ -383,7 +797,9 @@ frame_done(void *data, struct wl_callback *callback, uint32_t time)
 	wl_callback_destroy(callback);
 	output->frame_cb = NULL;
 
-	/* XXX: use the presentation extension for proper timings */
+	/* The presentation feedback has the precise time */
+	if (output->feedback)
+		return;
 
 	/*
 	 * This is the fallback case, where Presentation extension is not
@@ -400,6 +816,99 @@ static const struct wl_callback_listener frame_listener = {
 	frame_done
 };
 
+static void
+feedback_sync_output(void *data,
+		     struct wp_presentation_feedback *feedback,
+		     struct wl_output *output)
+{
+}
+
+static void
+feedback_presented(void *data,
+		   struct wp_presentation_feedback *feedback,
+		   uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
+		   uint32_t refresh, uint32_t seq_hi, uint32_t seq_lo,
+		   uint32_t flags)
+{
+	struct wayland_output *output = data;
+	struct timespec ts;
+
+	assert(feedback == output->feedback);
+	wp_presentation_feedback_destroy(feedback);
+	output->feedback = NULL;
+
+	if (output->frame_cb) {
+		wl_callback_destroy(output->frame_cb);
+		output->frame_cb = NULL;
+	}
+
+	timespec_from_proto(&ts, tv_sec_hi, tv_sec_lo, tv_nsec);
+	output->base.msc = ((uint64_t)seq_hi << 32) | seq_lo;
+
+	/* The parent knows the actual refresh rate of the monitor the
+	 * window is on, it drives the repaint deadline. */
+	if (refresh > 0)
+		output->base.current_mode->refresh =
+			millihz_from_nsec(refresh);
+
+	/* Everything was composited into the window, except for views on
+	 * planes which carry their own zero-copy flag. */
+	flags &= ~WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY;
+
+	if (output->frame_restart) {
+		output->frame_restart = false;
+		flags = WP_PRESENTATION_FEEDBACK_INVALID;
+	}
+
+	weston_output_finish_frame(&output->base, &ts, flags);
+}
+
+static void
+feedback_discarded(void *data,
+		   struct wp_presentation_feedback *feedback)
+{
+	struct wayland_output *output = data;
+	struct timespec ts;
+
+	assert(feedback == output->feedback);
+	wp_presentation_feedback_destroy(feedback);
+	output->feedback = NULL;
+
+	/* Paced by the frame callback then, if it is still to come */
+	if (output->frame_cb)
+		return;
+
+	output->frame_restart = false;
+	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
+	weston_output_finish_frame(&output->base, &ts, 0);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	feedback_sync_output,
+	feedback_presented,
+	feedback_discarded
+};
+
+/** Ask to be told when the next commit of the output surface is shown */
+static void
+wayland_output_request_frame(struct wayland_output *output, bool restart)
+{
+	struct wayland_backend *b = to_wayland_backend(output->base.compositor);
+
+	output->frame_cb = wl_surface_frame(output->parent.surface);
+	wl_callback_add_listener(output->frame_cb, &frame_listener, output);
+
+	output->frame_restart = restart;
+	if (b->parent.presentation) {
+		output->feedback =
+			wp_presentation_feedback(b->parent.presentation,
+						 output->parent.surface);
+		wp_presentation_feedback_add_listener(output->feedback,
+						      &feedback_listener,
+						      output);
+	}
+}
+
 static void
 draw_initial_frame(struct wayland_output *output)
 {
@@ -507,8 +1016,7 @@ wayland_output_start_repaint_loop(struct weston_output *output_base)
 		draw_initial_frame(output);
 	}
 
-	output->frame_cb = wl_surface_frame(output->parent.surface);
-	wl_callback_add_listener(output->frame_cb, &frame_listener, output);
+	wayland_output_request_frame(output, true);
 	wl_surface_commit(output->parent.surface);
 	wl_display_flush(wb->parent.wl_display);
 
@@ -524,10 +1032,10 @@ wayland_output_repaint_gl(struct weston_output *output_base,
 	struct wayland_output *output = to_wayland_output(output_base);
 	struct weston_compositor *ec = output->base.compositor;
 
-	output->frame_cb = wl_surface_frame(output->parent.surface);
-	wl_callback_add_listener(output->frame_cb, &frame_listener, output);
+	wayland_output_request_frame(output, false);
 
 	wayland_output_update_gl_border(output);
+	wayland_output_update_planes(output);
 
 	ec->renderer->repaint_output(&output->base, damage);
 
@@ -590,11 +1098,7 @@ wayland_shm_buffer_attach(struct wayland_shm_buffer *sb)
 	pixman_region32_translate(&damage, -sb->output->base.x,
 				  -sb->output->base.y);
 
-	weston_transformed_region(sb->output->base.width,
-				  sb->output->base.height,
-				  sb->output->base.transform,
-				  sb->output->base.current_scale,
-				  &damage, &damage);
+	weston_output_transformed_region(&sb->output->base, &damage, &damage);
 
 	if (sb->output->frame) {
 		frame_interior(sb->output->frame, &ix, &iy, &iwidth, &iheight);
@@ -654,9 +1158,9 @@ wayland_output_repaint_pixman(struct weston_output *output_base,
 	b->compositor->renderer->repaint_output(output_base, &sb->damage);
 
 	wayland_shm_buffer_attach(sb);
+	wayland_output_update_planes(output);
 
-	output->frame_cb = wl_surface_frame(output->parent.surface);
-	wl_callback_add_listener(output->frame_cb, &frame_listener, output);
+	wayland_output_request_frame(output, false);
 	wl_surface_commit(output->parent.surface);
 	wl_display_flush(b->parent.wl_display);
 
@@ -689,6 +1193,13 @@ wayland_backend_destroy_output_surface(struct wayland_output *output)
 		output->parent.shell_surface = NULL;
 	}
 
+	if (output->parent.viewport) {
+		wp_viewport_destroy(output->parent.viewport);
+		output->parent.viewport = NULL;
+		output->parent.scaled_width = 0;
+		output->parent.scaled_height = 0;
+	}
+
 	wl_surface_destroy(output->parent.surface);
 	output->parent.surface = NULL;
 }
@@ -711,6 +1222,7 @@ wayland_output_disable(struct weston_output *base)
 {
 	struct wayland_output *output = to_wayland_output(base);
 	struct wayland_backend *b = to_wayland_backend(base->compositor);
+	struct wayland_plane *plane, *next;
 
 	if (!output->base.enabled)
 		return 0;
@@ -726,6 +1238,9 @@ wayland_output_disable(struct weston_output *base)
 
 	wayland_output_destroy_shm_buffers(output);
 
+	wl_list_for_each_safe(plane, next, &output->plane_list, link)
+		wayland_plane_destroy(plane);
+
 	wayland_backend_destroy_output_surface(output);
 
 	if (output->frame)
@@ -750,6 +1265,8 @@ wayland_output_destroy(struct weston_output *base)
 
 	if (output->frame_cb)
 		wl_callback_destroy(output->frame_cb);
+	if (output->feedback)
+		wp_presentation_feedback_destroy(output->feedback);
 
 	free(output->title);
 	free(output);
@@ -812,11 +1329,20 @@ wayland_output_resize_surface(struct wayland_output *output)
 		to_wayland_backend(output->base.compositor);
 	int32_t ix, iy, iwidth, iheight;
 	int32_t width, height;
+	int32_t surface_width, surface_height;
 	struct wl_region *region;
 
 	width = output->base.current_mode->width;
 	height = output->base.current_mode->height;
 
+	if (output->parent.scaled_width > 0) {
+		surface_width = output->parent.scaled_width;
+		surface_height = output->parent.scaled_height;
+	} else {
+		surface_width = width;
+		surface_height = height;
+	}
+
 	if (output->frame) {
 		frame_resize_inside(output->frame, width, height);
 
@@ -844,12 +1370,12 @@ wayland_output_resize_surface(struct wayland_output *output)
 		height = frame_height(output->frame);
 	} else {
 		region = wl_compositor_create_region(b->parent.compositor);
-		wl_region_add(region, 0, 0, width, height);
+		wl_region_add(region, 0, 0, surface_width, surface_height);
 		wl_surface_set_input_region(output->parent.surface, region);
 		wl_region_destroy(region);
 
 		region = wl_compositor_create_region(b->parent.compositor);
-		wl_region_add(region, 0, 0, width, height);
+		wl_region_add(region, 0, 0, surface_width, surface_height);
 		wl_surface_set_opaque_region(output->parent.surface, region);
 		wl_region_destroy(region);
 
@@ -857,8 +1383,8 @@ wayland_output_resize_surface(struct wayland_output *output)
 			xdg_surface_set_window_geometry(output->parent.xdg_surface,
 							0,
 							0,
-							width,
-							height);
+							surface_width,
+							surface_height);
 		}
 	}
 
@@ -894,6 +1420,60 @@ wayland_output_resize_surface(struct wayland_output *output)
 	wayland_output_destroy_shm_buffers(output);
 }
 
+/** Let the parent scale the output surface to the given size
+ *
+ * The frames keep being rendered at the size of the current mode, the
+ * parent compositor scales them, possibly on a hardware plane. Only
+ * done for fullscreen outputs without decorations, a size of 0x0 or
+ * that of the mode stops the scaling.
+ *
+ * \return true if the scaling changed.
+ */
+static bool
+wayland_output_set_scaled_size(struct wayland_output *output,
+			       int32_t width, int32_t height)
+{
+	struct weston_mode *mode = output->base.current_mode;
+
+	if (!output->parent.viewport || !mode)
+		return false;
+
+	if (output->frame || width <= 0 || height <= 0 ||
+	    (width == mode->width && height == mode->height)) {
+		width = 0;
+		height = 0;
+	}
+
+	if (width == output->parent.scaled_width &&
+	    height == output->parent.scaled_height)
+		return false;
+
+	output->parent.scaled_width = width;
+	output->parent.scaled_height = height;
+
+	if (width > 0)
+		wp_viewport_set_destination(output->parent.viewport,
+					    width, height);
+	else
+		wp_viewport_set_destination(output->parent.viewport, -1, -1);
+
+	return true;
+}
+
+/* From output surface coordinates of the parent to those of the mode. */
+static void
+wayland_output_unscale_coordinate(struct wayland_output *output,
+				  double *x, double *y)
+{
+	if (output->parent.scaled_width <= 0)
+		return;
+
+	*x = *x * output->base.current_mode->width /
+	     output->parent.scaled_width;
+	*y = *y * output->base.current_mode->height /
+	     output->parent.scaled_height;
+}
+
 static int
 wayland_output_set_windowed(struct wayland_output *output)
 {
@@ -916,6 +1496,7 @@ wayland_output_set_windowed(struct wayland_output *output)
 	if (output->keyboard_count)
 		frame_set_flag(output->frame, FRAME_FLAG_ACTIVE);
 
+	wayland_output_set_scaled_size(output, 0, 0);
 	wayland_output_resize_surface(output);
 
 	if (output->parent.xdg_toplevel) {
@@ -1149,12 +1730,31 @@ handle_xdg_toplevel_configure(void *data, struct xdg_toplevel *toplevel,
 			  struct wl_array *states)
 {
 	struct wayland_output *output = data;
+	uint32_t *state;
+	bool fullscreen = false;
 
 	output->parent.configure_width = width;
 	output->parent.configure_height = height;
 
 	output->parent.wait_for_configure = false;
-	/* FIXME: implement resizing */
+
+	wl_array_for_each(state, states) {
+		if (*state == XDG_TOPLEVEL_STATE_FULLSCREEN)
+			fullscreen = true;
+	}
+
+	/* Fullscreen, the parent scales the frames of the current mode to
+	 * its size instead of centering them.
+	 * FIXME: implement resizing of windowed outputs */
+	if (!fullscreen) {
+		width = 0;
+		height = 0;
+	}
+	if (wayland_output_set_scaled_size(output, width, height)) {
+		wayland_output_resize_surface(output);
+		if (output->base.enabled)
+			weston_output_damage(&output->base);
+	}
 }
 
 static void
@@ -1190,6 +1790,11 @@ wayland_backend_create_output_surface(struct wayland_output *output)
 
 	output->parent.draw_initial_frame = true;
 
+	if (b->parent.viewporter && b->parent.xdg_wm_base)
+		output->parent.viewport =
+			wp_viewporter_get_viewport(b->parent.viewporter,
+						   output->parent.surface);
+
 	if (b->parent.xdg_wm_base) {
 		output->parent.xdg_surface =
 		xdg_wm_base_get_xdg_surface(b->parent.xdg_wm_base,
@@ -1252,6 +1857,7 @@ wayland_output_enable(struct weston_output *base)
 
 	wl_list_init(&output->shm.buffers);
 	wl_list_init(&output->shm.free_buffers);
+	wl_list_init(&output->plane_list);
 
 	if (b->use_pixman) {
 		if (wayland_output_init_pixman_renderer(output) < 0)
@@ -1268,7 +1874,10 @@ wayland_output_enable(struct weston_output *base)
 	}
 
 	output->base.start_repaint_loop = wayland_output_start_repaint_loop;
-	output->base.assign_planes = NULL;
+	if (b->passthrough)
+		output->base.assign_planes = wayland_output_assign_planes;
+	else
+		output->base.assign_planes = NULL;
 	output->base.set_backlight = NULL;
 	output->base.set_dpms = NULL;
 	output->base.switch_mode = wayland_output_switch_mode;
@@ -1682,6 +2291,7 @@ input_handle_pointer_enter(void *data, struct wl_pointer *pointer,
 		location = THEME_LOCATION_CLIENT_AREA;
 	}
 
+	wayland_output_unscale_coordinate(input->output, &x, &y);
 	weston_output_transform_coordinate(&input->output->base, x, y, &x, &y);
 
 	if (location == THEME_LOCATION_CLIENT_AREA) {
@@ -1747,6 +2357,7 @@ input_handle_motion(void *data, struct wl_pointer *pointer,
 		location = THEME_LOCATION_CLIENT_AREA;
 	}
 
+	wayland_output_unscale_coordinate(input->output, &x, &y);
 	weston_output_transform_coordinate(&input->output->base, x, y, &x, &y);
 
 	if (input->has_focus && location != THEME_LOCATION_CLIENT_AREA) {
@@ -2161,6 +2772,7 @@ input_handle_touch_down(void *data, struct wl_touch *wl_touch,
 			return;
 	}
 
+	wayland_output_unscale_coordinate(output, &x, &y);
 	weston_output_transform_coordinate(&output->base, x, y, &x, &y);
 
 	notify_touch(input->touch_device, &ts, id, x, y, WL_TOUCH_DOWN);
@@ -2231,6 +2843,7 @@ input_handle_touch_motion(void *data, struct wl_touch *wl_touch,
 		y -= fy;
 	}
 
+	wayland_output_unscale_coordinate(output, &x, &y);
 	weston_output_transform_coordinate(&output->base, x, y, &x, &y);
 
 	notify_touch(input->touch_device, &ts, id, x, y, WL_TOUCH_MOTION);
@@ -2554,6 +3167,55 @@ static const struct xdg_wm_base_listener wm_base_listener = {
 	xdg_wm_base_ping,
 };
 
+static void
+dmabuf_add_format(struct wayland_backend *b, uint32_t format,
+		  uint64_t modifier)
+{
+	struct wayland_dmabuf_format *fmt;
+
+	fmt = wl_array_add(&b->parent.dmabuf_formats, sizeof *fmt);
+	if (!fmt)
+		return;
+
+	fmt->format = format;
+	fmt->modifier = modifier;
+}
+
+static void
+dmabuf_format(void *data, struct zwp_linux_dmabuf_v1 *dmabuf,
+	      uint32_t format)
+{
+	/* Only sent before version 3, meaning an implicit modifier */
+	dmabuf_add_format(data, format, DRM_FORMAT_MOD_INVALID);
+}
+
+static void
+dmabuf_modifier(void *data, struct zwp_linux_dmabuf_v1 *dmabuf,
+		uint32_t format, uint32_t modifier_hi, uint32_t modifier_lo)
+{
+	dmabuf_add_format(data, format,
+			  ((uint64_t)modifier_hi << 32) | modifier_lo);
+}
+
+static const struct zwp_linux_dmabuf_v1_listener dmabuf_listener = {
+	dmabuf_format,
+	dmabuf_modifier
+};
+
+static void
+presentation_clock_id(void *data, struct wp_presentation *presentation,
+		      uint32_t clk_id)
+{
+	struct wayland_backend *b = data;
+
+	b->parent.presentation_clock = clk_id;
+	b->parent.presentation_clock_valid = true;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	presentation_clock_id
+};
+
 static void
 registry_handle_global(void *data, struct wl_registry *registry, uint32_t name,
 		       const char *interface, uint32_t version)
@@ -2586,6 +3248,29 @@ registry_handle_global(void *data, struct wl_registry *registry, uint32_t name,
 	} else if (strcmp(interface, "wl_shm") == 0) {
 		b->parent.shm =
 			wl_registry_bind(registry, name, &wl_shm_interface, 1);
+	} else if (strcmp(interface, "wp_presentation") == 0) {
+		b->parent.presentation =
+			wl_registry_bind(registry, name,
+					 &wp_presentation_interface, 1);
+		wp_presentation_add_listener(b->parent.presentation,
+					     &presentation_listener, b);
+	} else if (strcmp(interface, "wl_subcompositor") == 0) {
+		b->parent.subcompositor =
+			wl_registry_bind(registry, name,
+					 &wl_subcompositor_interface, 1);
+	} else if (strcmp(interface, "wp_viewporter") == 0) {
+		b->parent.viewporter =
+			wl_registry_bind(registry, name,
+					 &wp_viewporter_interface, 1);
+	} else if (strcmp(interface, "zwp_linux_dmabuf_v1") == 0 &&
+		   version >= ZWP_LINUX_BUFFER_PARAMS_V1_CREATE_IMMED_SINCE_VERSION) {
+		/* only create_immed is used */
+		b->parent.dmabuf =
+			wl_registry_bind(registry, name,
+					 &zwp_linux_dmabuf_v1_interface,
+					 MIN(version, 3));
+		zwp_linux_dmabuf_v1_add_listener(b->parent.dmabuf,
+						 &dmabuf_listener, b);
 	}
 }
 
@@ -2643,9 +3328,24 @@ wayland_destroy(struct weston_compositor *ec)
 	wl_list_for_each_safe(base, next, &ec->head_list, compositor_link)
 		wayland_head_destroy(to_wayland_head(base));
 
+	wayland_backend_dmabuf_buffer_release(b);
+
 	if (b->parent.shm)
 		wl_shm_destroy(b->parent.shm);
 
+	if (b->parent.dmabuf)
+		zwp_linux_dmabuf_v1_destroy(b->parent.dmabuf);
+	wl_array_release(&b->parent.dmabuf_formats);
+
+	if (b->parent.subcompositor)
+		wl_subcompositor_destroy(b->parent.subcompositor);
+
+	if (b->parent.viewporter)
+		wp_viewporter_destroy(b->parent.viewporter);
+
+	if (b->parent.presentation)
+		wp_presentation_destroy(b->parent.presentation);
+
 	if (b->parent.xdg_wm_base)
 		xdg_wm_base_destroy(b->parent.xdg_wm_base);
 
@@ -2756,10 +3456,28 @@ wayland_backend_create(struct weston_compositor *compositor,
 
 	wl_list_init(&b->parent.output_list);
 	wl_list_init(&b->input_list);
+	wl_list_init(&b->dmabuf_buffer_list);
+	wl_array_init(&b->parent.dmabuf_formats);
 	b->parent.registry = wl_display_get_registry(b->parent.wl_display);
 	wl_registry_add_listener(b->parent.registry, &registry_listener, b);
 	wl_display_roundtrip(b->parent.wl_display);
 
+	/* The presentation clock and the dmabuf formats arrive after the
+	 * binds. */
+	if (b->parent.presentation || b->parent.dmabuf)
+		wl_display_roundtrip(b->parent.wl_display);
+
+	/* Parent timestamps are only usable in the parent's clock domain */
+	if (b->parent.presentation &&
+	    (!b->parent.presentation_clock_valid ||
+	     weston_compositor_set_presentation_clock(compositor,
+		     b->parent.presentation_clock) < 0)) {
+		weston_log("Parent presentation clock unusable, falling back "
+			   "to frame callbacks.\n");
+		wp_presentation_destroy(b->parent.presentation);
+		b->parent.presentation = NULL;
+	}
+
 	create_cursor(b, new_config);
 
 #ifdef ENABLE_EGL
@@ -2818,6 +3536,18 @@ wayland_backend_create(struct weston_compositor *compositor,
 			           "support failed.\n");
 	}
 
+	if (new_config->passthrough) {
+		if (!compositor->renderer->import_dmabuf)
+			weston_log("Passthrough disabled, the renderer "
+				   "cannot import dmabufs.\n");
+		else if (!b->parent.subcompositor || !b->parent.dmabuf)
+			weston_log("Passthrough disabled, the parent "
+				   "compositor lacks wl_subcompositor or "
+				   "zwp_linux_dmabuf_v1 version 2.\n");
+		else
+			b->passthrough = true;
+	}
+
 	return b;
 err_display:
 	wl_display_disconnect(b->parent.wl_display);
@@ -45,6 +45,10 @@
 #ifdef HAVE_XCB_XKB
 #include <xcb/xkb.h>
 #endif
+#ifdef HAVE_XCB_PRESENT
+#include <xcb/present.h>
+#include <xcb/xfixes.h>
+#endif
 
 #include <X11/Xlib.h>
 #include <X11/Xlib-xcb.h>
@@ -96,6 +100,10 @@ struct x11_backend {
 
 	int			 has_net_wm_state_fullscreen;
 
+	/* the Present extension paces the outputs, if available */
+	bool			 has_present;
+	uint8_t			 present_opcode;
+
 	/* We could map multi-pointer X to multiple wayland seats, but
 	 * for now we only support core X input. */
 	struct weston_seat		 core_seat;
@@ -142,6 +150,17 @@ struct x11_output {
 	int32_t                 scale;
 	bool			resize_pending;
 	bool			window_resized;
+
+#ifdef HAVE_XCB_PRESENT
+	struct {
+		uint32_t		eid;
+		uint32_t		serial; /**< of the frame in flight */
+		uint64_t		msc;
+		bool			restart; /**< from start_repaint_loop */
+		xcb_pixmap_t		pixmap; /**< of the SHM segment */
+		xcb_xfixes_region_t	update;
+	} present;
+#endif
 };
 
 struct window_delete_data {
@@ -219,7 +238,7 @@ x11_backend_get_keymap(struct x11_backend *b)
 	copy_prop_value(options);
 #undef copy_prop_value
 
-	ret = xkb_keymap_new_from_names(b->compositor->xkb_context, &names, 0);
+	ret = weston_compositor_keymap_from_names(b->compositor, &names);
 
 	free(reply);
 	return ret;
@@ -404,13 +423,42 @@ x11_input_destroy(struct x11_backend *b)
 	weston_seat_release(&b->core_seat);
 }
 
+#ifdef HAVE_XCB_PRESENT
+/** Get told about the vblank at or after target_msc
+ *
+ * A target in the past completes right away, with the last vblank.
+ */
+static void
+x11_output_present_notify(struct x11_output *output, uint64_t target_msc,
+			  bool restart)
+{
+	struct x11_backend *b = to_x11_backend(output->base.compositor);
+
+	output->present.serial++;
+	output->present.restart = restart;
+	xcb_present_notify_msc(b->conn, output->window, output->present.serial,
+			       target_msc, 0, 0);
+	xcb_flush(b->conn);
+}
+#endif
+
 static int
-x11_output_start_repaint_loop(struct weston_output *output)
+x11_output_start_repaint_loop(struct weston_output *output_base)
 {
 	struct timespec ts;
+#ifdef HAVE_XCB_PRESENT
+	struct x11_output *output = to_x11_output(output_base);
+	struct x11_backend *b = to_x11_backend(output_base->compositor);
 
-	weston_compositor_read_presentation_clock(output->compositor, &ts);
-	weston_output_finish_frame(output, &ts, WP_PRESENTATION_FEEDBACK_INVALID);
+	if (b->has_present) {
+		x11_output_present_notify(output, 0, true);
+		return 0;
+	}
+#endif
+
+	weston_compositor_read_presentation_clock(output_base->compositor, &ts);
+	weston_output_finish_frame(output_base, &ts,
+				   WP_PRESENTATION_FEEDBACK_INVALID);
 
 	return 0;
 }
@@ -422,44 +470,52 @@ x11_output_repaint_gl(struct weston_output *output_base,
 {
 	struct x11_output *output = to_x11_output(output_base);
 	struct weston_compositor *ec = output->base.compositor;
+#ifdef HAVE_XCB_PRESENT
+	struct x11_backend *b = to_x11_backend(ec);
+#endif
 
 	ec->renderer->repaint_output(output_base, damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
+#ifdef HAVE_XCB_PRESENT
+	/* EGL presents through DRI3/Present itself, with a swap interval
+	 * of one that is the next vblank. */
+	if (b->has_present) {
+		x11_output_present_notify(output, output->present.msc + 1,
+					  false);
+		return 0;
+	}
+#endif
+
 	wl_event_source_timer_update(output->finish_frame_timer, 10);
 	return 0;
 }
 
-static void
-set_clip_for_output(struct weston_output *output_base, pixman_region32_t *region)
+/** Convert global damage to window coordinates, to be freed by the caller */
+static xcb_rectangle_t *
+output_damage_rects(struct weston_output *output_base,
+		    pixman_region32_t *region, int *n)
 {
-	struct x11_output *output = to_x11_output(output_base);
-	struct weston_compositor *ec = output->base.compositor;
-	struct x11_backend *b = to_x11_backend(ec);
 	pixman_region32_t transformed_region;
 	pixman_box32_t *rects;
 	xcb_rectangle_t *output_rects;
-	xcb_void_cookie_t cookie;
 	int nrects, i;
-	xcb_generic_error_t *err;
 
 	pixman_region32_init(&transformed_region);
 	pixman_region32_copy(&transformed_region, region);
 	pixman_region32_translate(&transformed_region,
 				  -output_base->x, -output_base->y);
-	weston_transformed_region(output_base->width, output_base->height,
-				  output_base->transform,
-				  output_base->current_scale,
-				  &transformed_region, &transformed_region);
+	weston_output_transformed_region(output_base, &transformed_region,
+					 &transformed_region);
 
 	rects = pixman_region32_rectangles(&transformed_region, &nrects);
 	output_rects = calloc(nrects, sizeof(xcb_rectangle_t));
 
 	if (output_rects == NULL) {
 		pixman_region32_fini(&transformed_region);
-		return;
+		return NULL;
 	}
 
 	for (i = 0; i < nrects; i++) {
@@ -471,6 +527,25 @@ set_clip_for_output(struct weston_output *output_base, pixman_region32_t *region
 
 	pixman_region32_fini(&transformed_region);
 
+	*n = nrects;
+	return output_rects;
+}
+
+static void
+set_clip_for_output(struct weston_output *output_base, pixman_region32_t *region)
+{
+	struct x11_output *output = to_x11_output(output_base);
+	struct weston_compositor *ec = output->base.compositor;
+	struct x11_backend *b = to_x11_backend(ec);
+	xcb_rectangle_t *output_rects;
+	xcb_void_cookie_t cookie;
+	int nrects;
+	xcb_generic_error_t *err;
+
+	output_rects = output_damage_rects(output_base, region, &nrects);
+	if (!output_rects)
+		return;
+
 	cookie = xcb_set_clip_rectangles_checked(b->conn, XCB_CLIP_ORDERING_UNSORTED,
 					output->gc,
 					0, 0, nrects,
@@ -484,6 +559,41 @@ set_clip_for_output(struct weston_output *output_base, pixman_region32_t *region
 }
 
 
+#ifdef HAVE_XCB_PRESENT
+/** Copy the damage to the window on the next vblank
+ *
+ * The SHM segment is only drawn to again after the completion, by which
+ * time the server has copied the pixmap.
+ */
+static void
+x11_output_present_shm(struct x11_output *output, pixman_region32_t *damage)
+{
+	struct x11_backend *b = to_x11_backend(output->base.compositor);
+	xcb_xfixes_region_t update = XCB_NONE;
+	xcb_rectangle_t *rects;
+	int nrects;
+
+	/* Without a region, the whole pixmap gets copied */
+	rects = output_damage_rects(&output->base, damage, &nrects);
+	if (rects) {
+		xcb_xfixes_set_region(b->conn, output->present.update,
+				      nrects, rects);
+		update = output->present.update;
+		free(rects);
+	}
+
+	output->present.serial++;
+	output->present.restart = false;
+	xcb_present_pixmap(b->conn, output->window, output->present.pixmap,
+			   output->present.serial,
+			   XCB_NONE, update,
+			   0, 0, XCB_NONE, XCB_NONE, XCB_NONE,
+			   XCB_PRESENT_OPTION_NONE,
+			   0, 0, 0, 0, NULL);
+	xcb_flush(b->conn);
+}
+#endif
+
 static int
 x11_output_repaint_shm(struct weston_output *output_base,
 		       pixman_region32_t *damage,
@@ -500,6 +610,14 @@ x11_output_repaint_shm(struct weston_output *output_base,
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
+
+#ifdef HAVE_XCB_PRESENT
+	if (b->has_present) {
+		x11_output_present_shm(output, damage);
+		return 0;
+	}
+#endif
+
 	set_clip_for_output(output_base, damage);
 	cookie = xcb_shm_put_image_checked(b->conn, output->window, output->gc,
 					pixman_image_get_width(output->hw_surface),
@@ -536,6 +654,14 @@ x11_output_deinit_shm(struct x11_backend *b, struct x11_output *output)
 {
 	xcb_void_cookie_t cookie;
 	xcb_generic_error_t *err;
+
+#ifdef HAVE_XCB_PRESENT
+	if (b->has_present) {
+		xcb_xfixes_destroy_region(b->conn, output->present.update);
+		xcb_free_pixmap(b->conn, output->present.pixmap);
+	}
+#endif
+
 	xcb_free_gc(b->conn, output->gc);
 
 	pixman_image_unref(output->hw_surface);
@@ -796,6 +922,19 @@ x11_output_init_shm(struct x11_backend *b, struct x11_output *output,
 	output->gc = xcb_generate_id(b->conn);
 	xcb_create_gc(b->conn, output->gc, output->window, 0, NULL);
 
+#ifdef HAVE_XCB_PRESENT
+	if (b->has_present) {
+		output->present.pixmap = xcb_generate_id(b->conn);
+		xcb_shm_create_pixmap(b->conn, output->present.pixmap,
+				      output->window, width, height,
+				      output->depth, output->segment, 0);
+
+		output->present.update = xcb_generate_id(b->conn);
+		xcb_xfixes_create_region(b->conn, output->present.update,
+					 0, NULL);
+	}
+#endif
+
 	return 0;
 }
 
@@ -961,6 +1100,15 @@ x11_output_enable(struct weston_output *base)
 			  screen->root_visual,
 			  mask, values);
 
+#ifdef HAVE_XCB_PRESENT
+	if (b->has_present) {
+		output->present.eid = xcb_generate_id(b->conn);
+		xcb_present_select_input(b->conn, output->present.eid,
+					 output->window,
+					 XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY);
+	}
+#endif
+
 	if (b->fullscreen) {
 		atom_list[0] = b->atom.net_wm_state_fullscreen;
 		xcb_change_property(b->conn, XCB_PROP_MODE_REPLACE,
@@ -1191,6 +1339,32 @@ x11_backend_find_output(struct x11_backend *b, xcb_window_t window)
 	return NULL;
 }
 
+/* The X server only lost the content of the exposed rectangle. It is
+ * widened by a pixel on each side to cover the rounding of scaled and
+ * transformed outputs. */
+static void
+x11_output_damage_exposed(struct x11_output *output,
+			  const xcb_expose_event_t *expose)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	double x1, y1, x2, y2;
+
+	weston_output_transform_coordinate(&output->base,
+					   expose->x, expose->y, &x1, &y1);
+	weston_output_transform_coordinate(&output->base,
+					   expose->x + expose->width,
+					   expose->y + expose->height,
+					   &x2, &y2);
+
+	pixman_region32_union_rect(&ec->primary_plane.damage,
+				   &ec->primary_plane.damage,
+				   (int32_t)MIN(x1, x2) - 1,
+				   (int32_t)MIN(y1, y2) - 1,
+				   (int32_t)(MAX(x1, x2) - MIN(x1, x2)) + 2,
+				   (int32_t)(MAX(y1, y2) - MIN(y1, y2)) + 2);
+	weston_output_schedule_repaint(&output->base);
+}
+
 static void
 x11_backend_delete_window(struct x11_backend *b, xcb_window_t window)
 {
@@ -1445,6 +1619,41 @@ x11_backend_next_event(struct x11_backend *b,
 	return *event != NULL;
 }
 
+#ifdef HAVE_XCB_PRESENT
+static void
+x11_output_present_complete(struct x11_backend *b,
+			    xcb_present_complete_notify_event_t *ev)
+{
+	struct x11_output *output;
+	struct timespec ts;
+	uint32_t flags;
+
+	output = x11_backend_find_output(b, ev->window);
+	if (!output || ev->event != output->present.eid ||
+	    ev->serial != output->present.serial ||
+	    output->base.repaint_status != REPAINT_AWAITING_COMPLETION)
+		return;
+
+	output->present.msc = ev->msc;
+	output->base.msc = ev->msc;
+	timespec_from_usec(&ts, ev->ust);
+
+	if (output->present.restart) {
+		output->present.restart = false;
+		flags = WP_PRESENTATION_FEEDBACK_INVALID;
+	} else if (ev->mode == XCB_PRESENT_COMPLETE_MODE_SKIP) {
+		flags = 0;
+	} else {
+		flags = WP_PRESENTATION_FEEDBACK_KIND_VSYNC |
+			WP_PRESENTATION_FEEDBACK_KIND_HW_CLOCK;
+		if (ev->kind == XCB_PRESENT_COMPLETE_KIND_PIXMAP)
+			flags |= WP_PRESENTATION_FEEDBACK_KIND_HW_COMPLETION;
+	}
+
+	weston_output_finish_frame(&output->base, &ts, flags);
+}
+#endif
+
 static int
 x11_backend_handle_event(int fd, uint32_t mask, void *data)
 {
@@ -1458,6 +1667,9 @@ x11_backend_handle_event(int fd, uint32_t mask, void *data)
 	xcb_focus_in_event_t *focus_in;
 	xcb_expose_event_t *expose;
 	xcb_configure_notify_event_t *configure;
+#ifdef HAVE_XCB_PRESENT
+	xcb_ge_generic_event_t *generic;
+#endif
 	xcb_atom_t atom;
 	xcb_window_t window;
 	uint32_t *k;
@@ -1573,8 +1785,7 @@ x11_backend_handle_event(int fd, uint32_t mask, void *data)
 			if (!output)
 				break;
 
-			weston_output_damage(&output->base);
-			weston_output_schedule_repaint(&output->base);
+			x11_output_damage_exposed(output, expose);
 			break;
 
 		case XCB_ENTER_NOTIFY:
@@ -1654,6 +1865,17 @@ x11_backend_handle_event(int fd, uint32_t mask, void *data)
 			notify_keyboard_focus_out(&b->core_seat);
 			break;
 
+#ifdef HAVE_XCB_PRESENT
+		case XCB_GE_GENERIC:
+			generic = (xcb_ge_generic_event_t *) event;
+			if (b->has_present &&
+			    generic->extension == b->present_opcode &&
+			    generic->event_type == XCB_PRESENT_EVENT_COMPLETE_NOTIFY)
+				x11_output_present_complete(b,
+					(xcb_present_complete_notify_event_t *) event);
+			break;
+#endif
+
 		default:
 			break;
 		}
@@ -1781,6 +2003,51 @@ x11_backend_get_wm_info(struct x11_backend *c)
 	free(reply);
 }
 
+#ifdef HAVE_XCB_PRESENT
+/** Pace the outputs by vblank, with Present events
+ *
+ * Present timestamps are CLOCK_MONOTONIC, which then also has to be the
+ * presentation clock. XFixes provides the update regions.
+ */
+static void
+x11_backend_init_present(struct x11_backend *b)
+{
+	const xcb_query_extension_reply_t *ext;
+	xcb_present_query_version_reply_t *present_reply;
+	xcb_xfixes_query_version_reply_t *xfixes_reply;
+
+	ext = xcb_get_extension_data(b->conn, &xcb_present_id);
+	if (!ext || !ext->present)
+		return;
+	b->present_opcode = ext->major_opcode;
+
+	ext = xcb_get_extension_data(b->conn, &xcb_xfixes_id);
+	if (!ext || !ext->present)
+		return;
+
+	present_reply = xcb_present_query_version_reply(b->conn,
+		xcb_present_query_version(b->conn,
+					  XCB_PRESENT_MAJOR_VERSION,
+					  XCB_PRESENT_MINOR_VERSION),
+		NULL);
+	xfixes_reply = xcb_xfixes_query_version_reply(b->conn,
+		xcb_xfixes_query_version(b->conn,
+					 XCB_XFIXES_MAJOR_VERSION,
+					 XCB_XFIXES_MINOR_VERSION),
+		NULL);
+
+	if (present_reply && xfixes_reply &&
+	    weston_compositor_set_presentation_clock(b->compositor,
+						     CLOCK_MONOTONIC) == 0) {
+		b->has_present = true;
+		weston_log("Using the Present extension for frame timing\n");
+	}
+
+	free(present_reply);
+	free(xfixes_reply);
+}
+#endif
+
 static void
 x11_destroy(struct weston_compositor *ec)
 {
@@ -1859,6 +2126,9 @@ x11_backend_create(struct weston_compositor *compositor,
 
 	x11_backend_get_resources(b);
 	x11_backend_get_wm_info(b);
+#ifdef HAVE_XCB_PRESENT
+	x11_backend_init_present(b);
+#endif
 
 	if (!b->has_net_wm_state_fullscreen && config->fullscreen) {
 		weston_log("Can not fullscreen without window manager support"
@@ -107,6 +107,17 @@ struct weston_backend {
 	 */
 	bool (*can_scanout_dmabuf)(struct weston_compositor *compositor,
 				   struct linux_dmabuf_buffer *buffer);
+
+	/** Free buffers and caches the outputs can do without while off
+	 *
+	 * @param compositor The compositor.
+	 *
+	 * Called when the compositor goes to sleep or offscreen with
+	 * weston_compositor::trim_memory_on_sleep set. Whatever is freed has
+	 * to be recreated by the backend when the outputs are turned on
+	 * again. May be NULL.
+	 */
+	void (*trim_memory)(struct weston_compositor *compositor);
 };
 
 /* weston_head */
@@ -229,6 +240,21 @@ notify_touch(struct weston_touch_device *device, const struct timespec *time,
 	notify_touch_normalized(device, time, touch_id, x, y, NULL, touch_type);
 }
 
+/** A touch point queued for notify_touch_motion_frame() */
+struct weston_touch_point_update {
+	int touch_id;
+	double x;	/**< global coordinates */
+	double y;
+	/** Only used if the device can calibrate */
+	struct weston_point2d_device_normalized norm;
+};
+
+void
+notify_touch_motion_frame(struct weston_touch_device *device,
+			  const struct timespec *time,
+			  const struct weston_touch_point_update *points,
+			  int count);
+
 void
 notify_touch_frame(struct weston_touch_device *device);
 
@@ -31,21 +31,136 @@
 
 #include <libweston/libweston.h>
 #include "libweston-internal.h"
+#include "shared/hash.h"
 #include "shared/helpers.h"
 #include "shared/timespec-util.h"
 
+/*
+ * Key, button, touch and axis bindings are also indexed in
+ * weston_compositor::binding_table by kind, code and modifier mask, so that
+ * an input event only visits the bindings it triggers. Bindings of one hash
+ * are chained through next_hash in the order they were added, which is the
+ * order they run in.
+ */
+enum binding_kind {
+	BINDING_KIND_NONE = 0, /* modifier and debug bindings, not indexed */
+	BINDING_KIND_KEY,
+	BINDING_KIND_BUTTON,
+	BINDING_KIND_TOUCH,
+	BINDING_KIND_AXIS,
+};
+
 struct weston_binding {
-	uint32_t key;
+	struct weston_compositor *compositor;
+	enum binding_kind kind;
+	uint32_t key; /* for modifier bindings, see modifier_binding_serial */
 	uint32_t button;
 	uint32_t axis;
 	uint32_t modifier;
 	void *handler;
 	void *data;
 	struct wl_list link;
+	struct weston_binding *next_hash;
 };
 
+static uint32_t
+binding_hash(enum binding_kind kind, uint32_t code, uint32_t modifier)
+{
+	return (((code << 8) ^ modifier) << 3) | kind;
+}
+
+static uint32_t
+binding_code(struct weston_binding *binding)
+{
+	switch (binding->kind) {
+	case BINDING_KIND_KEY:
+		return binding->key;
+	case BINDING_KIND_BUTTON:
+		return binding->button;
+	case BINDING_KIND_AXIS:
+		return binding->axis;
+	default:
+		return 0;
+	}
+}
+
+/* The first binding from b on that matches, b included */
+static struct weston_binding *
+binding_match(struct weston_binding *b, enum binding_kind kind,
+	      uint32_t code, uint32_t modifier)
+{
+	for (; b; b = b->next_hash)
+		if (b->kind == kind && binding_code(b) == code &&
+		    b->modifier == modifier)
+			return b;
+
+	return NULL;
+}
+
+static struct weston_binding *
+binding_lookup(struct weston_compositor *compositor, enum binding_kind kind,
+	       uint32_t code, uint32_t modifier)
+{
+	if (!compositor->binding_table)
+		return NULL;
+
+	return binding_match(hash_table_lookup(compositor->binding_table,
+					       binding_hash(kind, code,
+							    modifier)),
+			     kind, code, modifier);
+}
+
+static int
+binding_index(struct weston_binding *binding)
+{
+	struct weston_compositor *compositor = binding->compositor;
+	uint32_t hash = binding_hash(binding->kind, binding_code(binding),
+				     binding->modifier);
+	struct weston_binding *b;
+
+	if (!compositor->binding_table) {
+		compositor->binding_table = hash_table_create();
+		if (!compositor->binding_table)
+			return -1;
+	}
+
+	b = hash_table_lookup(compositor->binding_table, hash);
+	if (!b)
+		return hash_table_insert(compositor->binding_table, hash,
+					 binding);
+
+	while (b->next_hash)
+		b = b->next_hash;
+	b->next_hash = binding;
+
+	return 0;
+}
+
+static void
+binding_unindex(struct weston_binding *binding)
+{
+	struct weston_compositor *compositor = binding->compositor;
+	uint32_t hash = binding_hash(binding->kind, binding_code(binding),
+				     binding->modifier);
+	struct weston_binding *b;
+
+	b = hash_table_lookup(compositor->binding_table, hash);
+	if (b == binding) {
+		hash_table_remove(compositor->binding_table, hash);
+		if (binding->next_hash)
+			hash_table_insert(compositor->binding_table, hash,
+					  binding->next_hash);
+		return;
+	}
+
+	while (b->next_hash != binding)
+		b = b->next_hash;
+	b->next_hash = binding->next_hash;
+}
+
 static struct weston_binding *
 weston_compositor_add_binding(struct weston_compositor *compositor,
+			      enum binding_kind kind,
 			      uint32_t key, uint32_t button, uint32_t axis,
 			      uint32_t modifier, void *handler, void *data)
 {
@@ -55,12 +170,20 @@ weston_compositor_add_binding(struct weston_compositor *compositor,
 	if (binding == NULL)
 		return NULL;
 
+	binding->compositor = compositor;
+	binding->kind = kind;
 	binding->key = key;
 	binding->button = button;
 	binding->axis = axis;
 	binding->modifier = modifier;
 	binding->handler = handler;
 	binding->data = data;
+	binding->next_hash = NULL;
+
+	if (kind != BINDING_KIND_NONE && binding_index(binding) < 0) {
+		free(binding);
+		return NULL;
+	}
 
 	return binding;
 }
@@ -73,7 +196,8 @@ weston_compositor_add_key_binding(struct weston_compositor *compositor,
 {
 	struct weston_binding *binding;
 
-	binding = weston_compositor_add_binding(compositor, key, 0, 0,
+	binding = weston_compositor_add_binding(compositor, BINDING_KIND_KEY,
+						key, 0, 0,
 						modifier, handler, data);
 	if (binding == NULL)
 		return NULL;
@@ -91,8 +215,9 @@ weston_compositor_add_modifier_binding(struct weston_compositor *compositor,
 {
 	struct weston_binding *binding;
 
-	binding = weston_compositor_add_binding(compositor, 0, 0, 0,
-						modifier, handler, data);
+	binding = weston_compositor_add_binding(compositor, BINDING_KIND_NONE,
+						compositor->modifier_binding_serial,
+						0, 0, modifier, handler, data);
 	if (binding == NULL)
 		return NULL;
 
@@ -109,7 +234,8 @@ weston_compositor_add_button_binding(struct weston_compositor *compositor,
 {
 	struct weston_binding *binding;
 
-	binding = weston_compositor_add_binding(compositor, 0, button, 0,
+	binding = weston_compositor_add_binding(compositor, BINDING_KIND_BUTTON,
+						0, button, 0,
 						modifier, handler, data);
 	if (binding == NULL)
 		return NULL;
@@ -127,7 +253,8 @@ weston_compositor_add_touch_binding(struct weston_compositor *compositor,
 {
 	struct weston_binding *binding;
 
-	binding = weston_compositor_add_binding(compositor, 0, 0, 0,
+	binding = weston_compositor_add_binding(compositor, BINDING_KIND_TOUCH,
+						0, 0, 0,
 						modifier, handler, data);
 	if (binding == NULL)
 		return NULL;
@@ -145,7 +272,8 @@ weston_compositor_add_axis_binding(struct weston_compositor *compositor,
 {
 	struct weston_binding *binding;
 
-	binding = weston_compositor_add_binding(compositor, 0, 0, axis,
+	binding = weston_compositor_add_binding(compositor, BINDING_KIND_AXIS,
+						0, 0, axis,
 						modifier, handler, data);
 	if (binding == NULL)
 		return NULL;
@@ -163,7 +291,8 @@ weston_compositor_add_debug_binding(struct weston_compositor *compositor,
 {
 	struct weston_binding *binding;
 
-	binding = weston_compositor_add_binding(compositor, key, 0, 0, 0,
+	binding = weston_compositor_add_binding(compositor, BINDING_KIND_NONE,
+						key, 0, 0, 0,
 						handler, data);
 
 	wl_list_insert(compositor->debug_binding_list.prev, &binding->link);
@@ -174,6 +303,8 @@ weston_compositor_add_debug_binding(struct weston_compositor *compositor,
 WL_EXPORT void
 weston_binding_destroy(struct weston_binding *binding)
 {
+	if (binding->kind != BINDING_KIND_NONE)
+		binding_unindex(binding);
 	wl_list_remove(&binding->link);
 	free(binding);
 }
@@ -187,6 +318,27 @@ weston_binding_list_destroy_all(struct wl_list *list)
 		weston_binding_destroy(binding);
 }
 
+/* After all the bindings have been destroyed */
+void
+weston_compositor_bindings_release(struct weston_compositor *compositor)
+{
+	if (compositor->binding_table)
+		hash_table_destroy(compositor->binding_table);
+	compositor->binding_table = NULL;
+}
+
+/*
+ * A modifier binding runs on the release of its modifier only if no key,
+ * button or axis event came after the press. Pressing the modifier records
+ * the current modifier_binding_serial in the binding, and every other event
+ * bumps the serial instead of touching all the modifier bindings.
+ */
+static void
+invalidate_modifier_bindings(struct weston_compositor *compositor)
+{
+	compositor->modifier_binding_serial++;
+}
+
 struct binding_keyboard_grab {
 	uint32_t key;
 	struct weston_keyboard_grab grab;
@@ -293,30 +445,31 @@ weston_compositor_run_key_binding(struct weston_compositor *compositor,
 	struct weston_binding *b, *tmp;
 	struct weston_surface *focus;
 	struct weston_seat *seat = keyboard->seat;
+	uint32_t modifier = seat->modifier_state;
 
 	if (state == WL_KEYBOARD_KEY_STATE_RELEASED)
 		return;
 
-	/* Invalidate all active modifier bindings. */
-	wl_list_for_each(b, &compositor->modifier_binding_list, link)
-		b->key = key;
-
-	wl_list_for_each_safe(b, tmp, &compositor->key_binding_list, link) {
-		if (b->key == key && b->modifier == seat->modifier_state) {
-			weston_key_binding_handler_t handler = b->handler;
-			focus = keyboard->focus;
-			handler(keyboard, time, key, b->data);
-
-			/* If this was a key binding and it didn't
-			 * install a keyboard grab, install one now to
-			 * swallow the key press. */
-			if (keyboard->grab ==
-			    &keyboard->default_grab)
-				install_binding_grab(keyboard,
-						     time,
-						     key,
-						     focus);
-		}
+	invalidate_modifier_bindings(compositor);
+
+	b = binding_lookup(compositor, BINDING_KIND_KEY, key, modifier);
+	for (; b; b = tmp) {
+		weston_key_binding_handler_t handler = b->handler;
+
+		tmp = binding_match(b->next_hash, BINDING_KIND_KEY, key,
+				    modifier);
+		focus = keyboard->focus;
+		handler(keyboard, time, key, b->data);
+
+		/* If this was a key binding and it didn't
+		 * install a keyboard grab, install one now to
+		 * swallow the key press. */
+		if (keyboard->grab ==
+		    &keyboard->default_grab)
+			install_binding_grab(keyboard,
+					     time,
+					     key,
+					     focus);
 	}
 }
 
@@ -339,11 +492,11 @@ weston_compositor_run_modifier_binding(struct weston_compositor *compositor,
 
 		/* Prime the modifier binding. */
 		if (state == WL_KEYBOARD_KEY_STATE_PRESSED) {
-			b->key = 0;
+			b->key = compositor->modifier_binding_serial;
 			continue;
 		}
 		/* Ignore the binding if a key was pressed in between. */
-		else if (b->key != 0) {
+		else if (b->key != compositor->modifier_binding_serial) {
 			return;
 		}
 
@@ -359,20 +512,20 @@ weston_compositor_run_button_binding(struct weston_compositor *compositor,
 				     enum wl_pointer_button_state state)
 {
 	struct weston_binding *b, *tmp;
+	uint32_t modifier = pointer->seat->modifier_state;
 
 	if (state == WL_POINTER_BUTTON_STATE_RELEASED)
 		return;
 
-	/* Invalidate all active modifier bindings. */
-	wl_list_for_each(b, &compositor->modifier_binding_list, link)
-		b->key = button;
+	invalidate_modifier_bindings(compositor);
 
-	wl_list_for_each_safe(b, tmp, &compositor->button_binding_list, link) {
-		if (b->button == button &&
-		    b->modifier == pointer->seat->modifier_state) {
-			weston_button_binding_handler_t handler = b->handler;
-			handler(pointer, time, button, b->data);
-		}
+	b = binding_lookup(compositor, BINDING_KIND_BUTTON, button, modifier);
+	for (; b; b = tmp) {
+		weston_button_binding_handler_t handler = b->handler;
+
+		tmp = binding_match(b->next_hash, BINDING_KIND_BUTTON, button,
+				    modifier);
+		handler(pointer, time, button, b->data);
 	}
 }
 
@@ -383,15 +536,18 @@ weston_compositor_run_touch_binding(struct weston_compositor *compositor,
 				    int touch_type)
 {
 	struct weston_binding *b, *tmp;
+	uint32_t modifier = touch->seat->modifier_state;
 
 	if (touch->num_tp != 1 || touch_type != WL_TOUCH_DOWN)
 		return;
 
-	wl_list_for_each_safe(b, tmp, &compositor->touch_binding_list, link) {
-		if (b->modifier == touch->seat->modifier_state) {
-			weston_touch_binding_handler_t handler = b->handler;
-			handler(touch, time, b->data);
-		}
+	b = binding_lookup(compositor, BINDING_KIND_TOUCH, 0, modifier);
+	for (; b; b = tmp) {
+		weston_touch_binding_handler_t handler = b->handler;
+
+		tmp = binding_match(b->next_hash, BINDING_KIND_TOUCH, 0,
+				    modifier);
+		handler(touch, time, b->data);
 	}
 }
 
@@ -401,22 +557,20 @@ weston_compositor_run_axis_binding(struct weston_compositor *compositor,
 				   const struct timespec *time,
 				   struct weston_pointer_axis_event *event)
 {
-	struct weston_binding *b, *tmp;
+	struct weston_binding *b;
+	weston_axis_binding_handler_t handler;
 
-	/* Invalidate all active modifier bindings. */
-	wl_list_for_each(b, &compositor->modifier_binding_list, link)
-		b->key = event->axis;
+	invalidate_modifier_bindings(compositor);
 
-	wl_list_for_each_safe(b, tmp, &compositor->axis_binding_list, link) {
-		if (b->axis == event->axis &&
-		    b->modifier == pointer->seat->modifier_state) {
-			weston_axis_binding_handler_t handler = b->handler;
-			handler(pointer, time, event, b->data);
-			return 1;
-		}
-	}
+	b = binding_lookup(compositor, BINDING_KIND_AXIS, event->axis,
+			   pointer->seat->modifier_state);
+	if (!b)
+		return 0;
 
-	return 0;
+	handler = b->handler;
+	handler(pointer, time, event, b->data);
+
+	return 1;
 }
 
 int
@@ -0,0 +1,205 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include <libweston/libweston.h>
+#include <libweston/weston-log.h>
+#include <libweston/zalloc.h>
+#include "libweston-internal.h"
+#include "shared/helpers.h"
+
+/*
+ * Per-client request budget, see weston_compositor::client_request_budget.
+ *
+ * libwayland dispatches everything a client has sent before the event loop
+ * gets to the repaint timer, and gives the compositor no way to pause a
+ * client halfway. The requests of each client are therefore counted between
+ * repaints, and the frame callbacks of a client that went over the budget
+ * are held back for the next frame. Clients that pace themselves on frame
+ * callbacks, as most do, slow down to what the budget lets through instead
+ * of delaying the repaint of every output.
+ */
+
+struct weston_client_budget {
+	struct weston_compositor *compositor;
+	struct wl_client *client;
+	struct wl_listener destroy_listener;
+	struct wl_list link; /* weston_compositor::client_budget_list */
+
+	uint32_t requests; /* since the last repaint */
+	bool throttled;
+	uint32_t throttled_frames;
+};
+
+static void
+client_budget_free(struct weston_client_budget *cb)
+{
+	wl_list_remove(&cb->destroy_listener.link);
+	wl_list_remove(&cb->link);
+	free(cb);
+}
+
+static void
+client_budget_destroy(struct wl_listener *listener, void *data)
+{
+	struct weston_client_budget *cb =
+		container_of(listener, struct weston_client_budget,
+			     destroy_listener);
+
+	client_budget_free(cb);
+}
+
+static struct weston_client_budget *
+client_budget_find(struct wl_client *client)
+{
+	struct wl_listener *listener;
+
+	listener = wl_client_get_destroy_listener(client,
+						  client_budget_destroy);
+	if (!listener)
+		return NULL;
+
+	return container_of(listener, struct weston_client_budget,
+			    destroy_listener);
+}
+
+static struct weston_client_budget *
+client_budget_get(struct weston_compositor *compositor,
+		  struct wl_client *client)
+{
+	struct weston_client_budget *cb;
+
+	cb = client_budget_find(client);
+	if (cb)
+		return cb;
+
+	cb = zalloc(sizeof *cb);
+	if (!cb)
+		return NULL;
+
+	cb->compositor = compositor;
+	cb->client = client;
+	cb->destroy_listener.notify = client_budget_destroy;
+	wl_client_add_destroy_listener(client, &cb->destroy_listener);
+	wl_list_insert(&compositor->client_budget_list, &cb->link);
+
+	return cb;
+}
+
+static void
+client_budget_log_request(void *data, enum wl_protocol_logger_type type,
+			  const struct wl_protocol_logger_message *message)
+{
+	struct weston_compositor *compositor = data;
+	struct weston_client_budget *cb;
+
+	if (type != WL_PROTOCOL_LOGGER_REQUEST)
+		return;
+
+	cb = client_budget_get(compositor,
+			       wl_resource_get_client(message->resource));
+	if (cb)
+		cb->requests++;
+}
+
+/** Start a new budget period, on each repaint
+ *
+ * Clients that sent more requests than the budget since the last repaint
+ * get their frame callbacks held back in this one, see
+ * weston_surface_client_throttled().
+ */
+void
+weston_compositor_client_budget_repaint(struct weston_compositor *compositor)
+{
+	uint32_t budget = MAX(compositor->client_request_budget, 0);
+	struct weston_client_budget *cb;
+	pid_t pid;
+
+	if (budget == 0) {
+		weston_compositor_client_budget_fini(compositor);
+		return;
+	}
+
+	if (!compositor->client_budget_logger) {
+		compositor->client_budget_logger =
+			wl_display_add_protocol_logger(compositor->wl_display,
+						       client_budget_log_request,
+						       compositor);
+		return;
+	}
+
+	wl_list_for_each(cb, &compositor->client_budget_list, link) {
+		cb->throttled = cb->requests > budget;
+		if (cb->throttled) {
+			cb->throttled_frames++;
+			wl_client_get_credentials(cb->client, &pid, NULL, NULL);
+			weston_log_scope_printf(compositor->debug_client_budget,
+						"client %p (pid %d): %u requests "
+						"since the last repaint, over "
+						"the budget of %u, throttled "
+						"%u frames so far\n",
+						cb->client, pid, cb->requests,
+						budget, cb->throttled_frames);
+		}
+		cb->requests = 0;
+	}
+}
+
+/** Whether the client of a surface is over its request budget */
+bool
+weston_surface_client_throttled(struct weston_surface *surface)
+{
+	struct weston_client_budget *cb;
+
+	if (!surface->compositor->client_budget_logger || !surface->resource)
+		return false;
+
+	cb = client_budget_find(wl_resource_get_client(surface->resource));
+
+	return cb && cb->throttled;
+}
+
+/** Stop accounting, on compositor destruction
+ *
+ * The clients are only destroyed with the display, after the compositor.
+ */
+void
+weston_compositor_client_budget_fini(struct weston_compositor *compositor)
+{
+	struct weston_client_budget *cb, *tmp;
+
+	if (compositor->client_budget_logger) {
+		wl_protocol_logger_destroy(compositor->client_budget_logger);
+		compositor->client_budget_logger = NULL;
+	}
+
+	wl_list_for_each_safe(cb, tmp, &compositor->client_budget_list, link)
+		client_budget_free(cb);
+}
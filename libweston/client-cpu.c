@@ -0,0 +1,265 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <libweston/libweston.h>
+#include <libweston/weston-log.h>
+#include <libweston/zalloc.h>
+#include "libweston-internal.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+
+/*
+ * Per-client compositor time for the 'client-cpu' debug scope and the
+ * 'frame-stats' summary.
+ *
+ * The work libweston does on behalf of a surface is timed and charged to
+ * the client owning it: handling wl_surface.commit, including applying the
+ * state and its damage, applying queued commits at repaint, uploading shm
+ * damage to the renderer, and drawing the surface's views. Reading the
+ * monotonic clock costs no system call, so this is always collected.
+ *
+ * This is time spent on the compositor thread, which is CPU time except
+ * where the renderer blocks in the driver. Work on the repaint worker
+ * threads of the Pixman renderer is not included.
+ */
+
+static const char *const kind_names[] = {
+	[WESTON_CLIENT_CPU_COMMIT] = "commit",
+	[WESTON_CLIENT_CPU_UPLOAD] = "upload",
+	[WESTON_CLIENT_CPU_DRAW] = "draw",
+};
+
+struct weston_client_cpu {
+	struct weston_compositor *compositor;
+	struct wl_client *client;
+	struct wl_listener destroy_listener;
+	struct wl_list link; /* weston_compositor::client_cpu_list */
+
+	struct timespec since;
+	uint64_t nsec[WESTON_CLIENT_CPU_COUNT];
+	uint64_t count[WESTON_CLIENT_CPU_COUNT];
+	uint64_t total_nsec;
+};
+
+static void
+client_cpu_destroy(struct wl_listener *listener, void *data)
+{
+	struct weston_client_cpu *cc =
+		container_of(listener, struct weston_client_cpu,
+			     destroy_listener);
+
+	wl_list_remove(&cc->destroy_listener.link);
+	wl_list_remove(&cc->link);
+	free(cc);
+}
+
+static struct weston_client_cpu *
+client_cpu_get(struct weston_compositor *compositor, struct wl_client *client)
+{
+	struct weston_client_cpu *cc;
+	struct wl_listener *listener;
+
+	listener = wl_client_get_destroy_listener(client, client_cpu_destroy);
+	if (listener)
+		return container_of(listener, struct weston_client_cpu,
+				    destroy_listener);
+
+	cc = zalloc(sizeof *cc);
+	if (!cc)
+		return NULL;
+
+	cc->compositor = compositor;
+	cc->client = client;
+	clock_gettime(CLOCK_MONOTONIC, &cc->since);
+	cc->destroy_listener.notify = client_cpu_destroy;
+	wl_client_add_destroy_listener(client, &cc->destroy_listener);
+	wl_list_insert(&compositor->client_cpu_list, &cc->link);
+
+	return cc;
+}
+
+/** Start timing work done for a surface
+ *
+ * \param begin Filled in, to pass to weston_surface_cpu_end().
+ */
+void
+weston_surface_cpu_begin(struct timespec *begin)
+{
+	clock_gettime(CLOCK_MONOTONIC, begin);
+}
+
+/** Charge the time since weston_surface_cpu_begin() to a surface's client
+ *
+ * \param surface The surface the work was done for.
+ * \param kind What kind of work it was.
+ * \param begin As filled in by weston_surface_cpu_begin().
+ *
+ * Surfaces of libweston itself or of the shell, which have no client, are
+ * not accounted.
+ */
+void
+weston_surface_cpu_end(struct weston_surface *surface,
+		       enum weston_client_cpu_kind kind,
+		       const struct timespec *begin)
+{
+	struct weston_client_cpu *cc;
+	struct timespec end;
+	int64_t nsec;
+
+	if (!surface->resource)
+		return;
+
+	cc = client_cpu_get(surface->compositor,
+			    wl_resource_get_client(surface->resource));
+	if (!cc)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	nsec = timespec_sub_to_nsec(&end, begin);
+	if (nsec < 0)
+		return;
+
+	cc->nsec[kind] += nsec;
+	cc->count[kind]++;
+	cc->total_nsec += nsec;
+}
+
+static int
+compare_total(const void *a, const void *b)
+{
+	const struct weston_client_cpu *x = *(struct weston_client_cpu *const *)a;
+	const struct weston_client_cpu *y = *(struct weston_client_cpu *const *)b;
+
+	return x->total_nsec < y->total_nsec ? 1 :
+	       x->total_nsec > y->total_nsec ? -1 : 0;
+}
+
+static void
+print_client(struct weston_log_subscription *sub,
+	     struct weston_client_cpu *cc, const struct timespec *now,
+	     bool details)
+{
+	int64_t elapsed_msec = timespec_sub_to_msec(now, &cc->since);
+	pid_t pid;
+	int i;
+
+	wl_client_get_credentials(cc->client, &pid, NULL, NULL);
+	weston_log_subscription_printf(sub,
+		"client %p, pid %d: %" PRIu64 " us in %" PRId64 " s, "
+		"%.2f%% of the compositor thread\n", cc->client, (int)pid,
+		cc->total_nsec / 1000, elapsed_msec / 1000,
+		elapsed_msec > 0 ?
+			cc->total_nsec / (elapsed_msec * 10000.0) : 0.0);
+
+	if (!details)
+		return;
+
+	for (i = 0; i < WESTON_CLIENT_CPU_COUNT; i++) {
+		if (cc->count[i] == 0)
+			continue;
+		weston_log_subscription_printf(sub,
+			"\t%-8s %10" PRIu64 " us %10" PRIu64 " times, "
+			"%8.1f us each\n", kind_names[i], cc->nsec[i] / 1000,
+			cc->count[i], cc->nsec[i] / (cc->count[i] * 1000.0));
+	}
+}
+
+/** Print the clients costing the compositor the most time
+ *
+ * \param sub The subscription to print to.
+ * \param compositor The compositor.
+ * \param max How many clients to print at most, 0 for all of them.
+ * \param details Whether to break the time down by the kind of work.
+ */
+void
+weston_compositor_client_cpu_print(struct weston_log_subscription *sub,
+				   struct weston_compositor *compositor,
+				   unsigned int max, bool details)
+{
+	struct weston_client_cpu **sorted, *cc;
+	struct timespec now;
+	unsigned int n, i;
+
+	n = wl_list_length(&compositor->client_cpu_list);
+	if (n == 0) {
+		weston_log_subscription_printf(sub, "no client activity\n");
+		return;
+	}
+
+	sorted = calloc(n, sizeof *sorted);
+	if (!sorted)
+		return;
+
+	i = 0;
+	wl_list_for_each(cc, &compositor->client_cpu_list, link)
+		sorted[i++] = cc;
+	qsort(sorted, n, sizeof *sorted, compare_total);
+
+	if (max > 0 && max < n)
+		n = max;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < n; i++)
+		print_client(sub, sorted[i], &now, details);
+
+	free(sorted);
+}
+
+/**
+ * Called when the 'client-cpu' debug scope is bound by a client. This
+ * one-shot weston-debug scope prints the time spent for every client since
+ * it connected, broken down by the kind of work, and then terminates the
+ * stream.
+ */
+void
+weston_compositor_client_cpu_cb(struct weston_log_subscription *sub,
+				void *data)
+{
+	struct weston_compositor *compositor = data;
+
+	weston_compositor_client_cpu_print(sub, compositor, 0, true);
+	weston_log_subscription_complete(sub);
+}
+
+/** Stop accounting, on compositor destruction
+ *
+ * The clients are only destroyed with the display, after the compositor.
+ */
+void
+weston_compositor_client_cpu_fini(struct weston_compositor *compositor)
+{
+	struct weston_client_cpu *cc, *tmp;
+
+	wl_list_for_each_safe(cc, tmp, &compositor->client_cpu_list, link)
+		client_cpu_destroy(&cc->destroy_listener, NULL);
+}
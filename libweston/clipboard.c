@@ -28,6 +28,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <linux/input.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -36,10 +37,21 @@
 #include <libweston/libweston.h>
 #include "libweston-internal.h"
 #include "shared/helpers.h"
+#include "shared/os-compatibility.h"
 
+/* The most to move per fd callback, so a large transfer does not stall
+ * the compositor. */
+#define CLIPBOARD_CHUNK_SIZE (64 * 1024)
+
+/*
+ * The selection contents are kept in an anonymous file rather than in
+ * compositor memory, and moved between it and the client pipes with
+ * splice(), so they are never copied through user space.
+ */
 struct clipboard_source {
 	struct weston_data_source base;
-	struct wl_array contents;
+	int contents_fd;
+	off_t size;
 	struct clipboard *clipboard;
 	struct wl_event_source *event_source;
 	uint32_t serial;
@@ -56,6 +68,44 @@ struct clipboard {
 
 static void clipboard_client_create(struct clipboard_source *source, int fd);
 
+/* Move up to len bytes from fd_in to fd_out, one of which is a pipe. The
+ * offsets are updated like splice() does. */
+static ssize_t
+clipboard_splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out,
+		 size_t len)
+{
+	char buf[4096];
+	ssize_t ret;
+
+	ret = splice(fd_in, off_in, fd_out, off_out, len,
+		     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (ret >= 0 || errno != EINVAL)
+		return ret;
+
+	/* Not every file system can splice, copy through a buffer then. */
+	len = MIN(len, sizeof buf);
+	if (off_in)
+		ret = pread(fd_in, buf, len, *off_in);
+	else
+		ret = read(fd_in, buf, len);
+	if (ret <= 0)
+		return ret;
+
+	if (off_out)
+		ret = pwrite(fd_out, buf, ret, *off_out);
+	else
+		ret = write(fd_out, buf, ret);
+	if (ret <= 0)
+		return ret;
+
+	if (off_in)
+		*off_in += ret;
+	if (off_out)
+		*off_out += ret;
+
+	return ret;
+}
+
 static void
 clipboard_source_unref(struct clipboard_source *source)
 {
@@ -74,7 +124,7 @@ clipboard_source_unref(struct clipboard_source *source)
 	s = source->base.mime_types.data;
 	free(*s);
 	wl_array_release(&source->base.mime_types);
-	wl_array_release(&source->contents);
+	close(source->contents_fd);
 	free(source);
 }
 
@@ -83,26 +133,17 @@ clipboard_source_data(int fd, uint32_t mask, void *data)
 {
 	struct clipboard_source *source = data;
 	struct clipboard *clipboard = source->clipboard;
-	char *p;
-	int len, size;
+	ssize_t len;
 
-	if (source->contents.alloc - source->contents.size < 1024) {
-		wl_array_add(&source->contents, 1024);
-		source->contents.size -= 1024;
-	}
-
-	p = source->contents.data + source->contents.size;
-	size = source->contents.alloc - source->contents.size;
-	len = read(fd, p, size);
+	len = clipboard_splice(fd, NULL, source->contents_fd, &source->size,
+			       CLIPBOARD_CHUNK_SIZE);
 	if (len == 0) {
 		wl_event_source_remove(source->event_source);
 		close(fd);
 		source->event_source = NULL;
-	} else if (len < 0) {
+	} else if (len < 0 && errno != EAGAIN && errno != EINTR) {
 		clipboard_source_unref(source);
 		clipboard->source = NULL;
-	} else {
-		source->contents.size += len;
 	}
 
 	return 1;
@@ -147,7 +188,11 @@ clipboard_source_create(struct clipboard *clipboard,
 	if (source == NULL)
 		return NULL;
 
-	wl_array_init(&source->contents);
+	/* The file grows as needed, this is only its initial size. */
+	source->contents_fd = os_create_anonymous_file(CLIPBOARD_CHUNK_SIZE);
+	if (source->contents_fd < 0)
+		goto err_file;
+
 	wl_array_init(&source->base.mime_types);
 	source->base.resource = NULL;
 	source->base.accept = clipboard_source_accept;
@@ -178,6 +223,8 @@ clipboard_source_create(struct clipboard *clipboard,
  err_strdup:
 	wl_array_release(&source->base.mime_types);
  err_add:
+	close(source->contents_fd);
+ err_file:
 	free(source);
 
 	return NULL;
@@ -185,7 +232,7 @@ clipboard_source_create(struct clipboard *clipboard,
 
 struct clipboard_client {
 	struct wl_event_source *event_source;
-	size_t offset;
+	off_t offset;
 	struct clipboard_source *source;
 };
 
@@ -193,15 +240,18 @@ static int
 clipboard_client_data(int fd, uint32_t mask, void *data)
 {
 	struct clipboard_client *client = data;
-	char *p;
-	size_t size;
-	int len;
-
-	size = client->source->contents.size;
-	p = client->source->contents.data;
-	len = write(fd, p + client->offset, size - client->offset);
-	if (len > 0)
-		client->offset += len;
+	off_t size;
+	ssize_t len = 0;
+
+	size = client->source->size;
+	if (client->offset < size) {
+		len = clipboard_splice(client->source->contents_fd,
+				       &client->offset, fd, NULL,
+				       MIN(size - client->offset,
+					   CLIPBOARD_CHUNK_SIZE));
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			return 1;
+	}
 
 	if (client->offset == size || len <= 0) {
 		close(fd);
@@ -0,0 +1,223 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <libweston/libweston.h>
+#include <libweston/zalloc.h>
+#include "libweston-internal.h"
+#include "weston-color-representation-server-protocol.h"
+#include "shared/helpers.h"
+
+struct color_representation {
+	struct weston_surface *surface;
+	struct wl_resource *resource;
+	struct wl_listener surface_destroy_listener;
+};
+
+static void
+color_representation_free(struct color_representation *cr)
+{
+	wl_resource_set_user_data(cr->resource, NULL);
+	wl_list_remove(&cr->surface_destroy_listener.link);
+	free(cr);
+}
+
+static void
+color_representation_surface_destroyed(struct wl_listener *listener,
+				       void *data)
+{
+	struct color_representation *cr =
+		container_of(listener, struct color_representation,
+			     surface_destroy_listener);
+
+	color_representation_free(cr);
+}
+
+static void
+color_representation_destroy_resource(struct wl_resource *resource)
+{
+	struct color_representation *cr = wl_resource_get_user_data(resource);
+
+	if (!cr)
+		return;
+
+	cr->surface->pending.yuv_coefficients = WESTON_YUV_COEFFICIENTS_BT601;
+	cr->surface->pending.yuv_range = WESTON_YUV_RANGE_LIMITED;
+	color_representation_free(cr);
+}
+
+static void
+color_representation_set_coefficients(struct wl_client *client,
+				      struct wl_resource *resource,
+				      uint32_t coefficients)
+{
+	struct color_representation *cr = wl_resource_get_user_data(resource);
+	enum weston_yuv_coefficients value;
+
+	if (!cr)
+		return;
+
+	switch (coefficients) {
+	case WESTON_COLOR_REPRESENTATION_V1_COEFFICIENTS_BT709:
+		value = WESTON_YUV_COEFFICIENTS_BT709;
+		break;
+	case WESTON_COLOR_REPRESENTATION_V1_COEFFICIENTS_BT2020:
+		value = WESTON_YUV_COEFFICIENTS_BT2020;
+		break;
+	default:
+		value = WESTON_YUV_COEFFICIENTS_BT601;
+		break;
+	}
+
+	cr->surface->pending.yuv_coefficients = value;
+}
+
+static void
+color_representation_set_range(struct wl_client *client,
+			       struct wl_resource *resource,
+			       uint32_t range)
+{
+	struct color_representation *cr = wl_resource_get_user_data(resource);
+
+	if (!cr)
+		return;
+
+	cr->surface->pending.yuv_range =
+		range == WESTON_COLOR_REPRESENTATION_V1_RANGE_FULL ?
+		WESTON_YUV_RANGE_FULL : WESTON_YUV_RANGE_LIMITED;
+}
+
+static void
+color_representation_destroy(struct wl_client *client,
+			     struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct weston_color_representation_v1_interface
+	color_representation_implementation = {
+		color_representation_set_coefficients,
+		color_representation_set_range,
+		color_representation_destroy,
+};
+
+static void
+color_representation_manager_destroy(struct wl_client *client,
+				     struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+color_representation_manager_get_color_representation(struct wl_client *client,
+						       struct wl_resource *resource,
+						       uint32_t id,
+						       struct wl_resource *surface_resource)
+{
+	struct weston_surface *surface =
+		wl_resource_get_user_data(surface_resource);
+	struct color_representation *cr;
+
+	if (wl_resource_get_destroy_listener(surface_resource,
+					     color_representation_surface_destroyed)) {
+		wl_resource_post_error(resource,
+			WESTON_COLOR_REPRESENTATION_MANAGER_V1_ERROR_COLOR_REPRESENTATION_EXISTS,
+			"wl_surface@%"PRIu32" already has a color representation",
+			wl_resource_get_id(surface_resource));
+		return;
+	}
+
+	cr = zalloc(sizeof *cr);
+	if (!cr) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	cr->resource = wl_resource_create(client,
+					  &weston_color_representation_v1_interface,
+					  1, id);
+	if (!cr->resource) {
+		free(cr);
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	cr->surface = surface;
+	cr->surface_destroy_listener.notify =
+		color_representation_surface_destroyed;
+	wl_resource_add_destroy_listener(surface_resource,
+					 &cr->surface_destroy_listener);
+
+	wl_resource_set_implementation(cr->resource,
+				       &color_representation_implementation, cr,
+				       color_representation_destroy_resource);
+}
+
+static const struct weston_color_representation_manager_v1_interface
+	color_representation_manager_implementation = {
+		color_representation_manager_destroy,
+		color_representation_manager_get_color_representation,
+};
+
+static void
+bind_color_representation(struct wl_client *client, void *data,
+			  uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client,
+				      &weston_color_representation_manager_v1_interface,
+				      version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource,
+				       &color_representation_manager_implementation,
+				       data, NULL);
+}
+
+/** Advertise weston_color_representation_manager_v1
+ *
+ * Called by backends able to show YUV content with other coefficients and
+ * ranges than BT.601 limited range, which is what the renderers use.
+ */
+WL_EXPORT int
+weston_color_representation_setup(struct weston_compositor *compositor)
+{
+	if (!wl_global_create(compositor->wl_display,
+			      &weston_color_representation_manager_v1_interface,
+			      1, compositor, bind_color_representation))
+		return -1;
+
+	return 0;
+}
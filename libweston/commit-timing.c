@@ -0,0 +1,202 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <libweston/libweston.h>
+#include <libweston/zalloc.h>
+#include "libweston-internal.h"
+#include "weston-commit-timing-server-protocol.h"
+#include "shared/helpers.h"
+
+struct commit_timer {
+	struct weston_surface *surface;
+	struct wl_resource *resource;
+	struct wl_listener surface_destroy_listener;
+};
+
+static void
+commit_timer_free(struct commit_timer *ct)
+{
+	wl_resource_set_user_data(ct->resource, NULL);
+	wl_list_remove(&ct->surface_destroy_listener.link);
+	free(ct);
+}
+
+static void
+commit_timer_surface_destroyed(struct wl_listener *listener, void *data)
+{
+	struct commit_timer *ct =
+		container_of(listener, struct commit_timer,
+			     surface_destroy_listener);
+
+	commit_timer_free(ct);
+}
+
+static void
+commit_timer_destroy_resource(struct wl_resource *resource)
+{
+	struct commit_timer *ct = wl_resource_get_user_data(resource);
+
+	if (!ct)
+		return;
+
+	ct->surface->pending.has_target_time = false;
+	commit_timer_free(ct);
+}
+
+static void
+commit_timer_set_target_time(struct wl_client *client,
+			     struct wl_resource *resource,
+			     uint32_t tv_sec_hi, uint32_t tv_sec_lo,
+			     uint32_t tv_nsec)
+{
+	struct commit_timer *ct = wl_resource_get_user_data(resource);
+	struct weston_surface_state *pending;
+
+	if (!ct)
+		return;
+
+	if (tv_nsec >= 1000000000) {
+		wl_resource_post_error(resource,
+			WESTON_COMMIT_TIMER_V1_ERROR_INVALID_TIMESTAMP,
+			"tv_nsec %"PRIu32" is not below one second", tv_nsec);
+		return;
+	}
+
+	pending = &ct->surface->pending;
+	pending->has_target_time = true;
+	pending->target_time.tv_sec = ((uint64_t)tv_sec_hi << 32) + tv_sec_lo;
+	pending->target_time.tv_nsec = tv_nsec;
+}
+
+static void
+commit_timer_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct weston_commit_timer_v1_interface
+	commit_timer_implementation = {
+		commit_timer_set_target_time,
+		commit_timer_destroy,
+};
+
+static void
+commit_timing_manager_destroy(struct wl_client *client,
+			      struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+commit_timing_manager_get_timer(struct wl_client *client,
+				struct wl_resource *resource,
+				uint32_t id,
+				struct wl_resource *surface_resource)
+{
+	struct weston_surface *surface =
+		wl_resource_get_user_data(surface_resource);
+	struct commit_timer *ct;
+
+	if (wl_resource_get_destroy_listener(surface_resource,
+					     commit_timer_surface_destroyed)) {
+		wl_resource_post_error(resource,
+			WESTON_COMMIT_TIMING_MANAGER_V1_ERROR_TIMER_EXISTS,
+			"wl_surface@%"PRIu32" already has a commit timer",
+			wl_resource_get_id(surface_resource));
+		return;
+	}
+
+	ct = zalloc(sizeof *ct);
+	if (!ct) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	ct->resource = wl_resource_create(client,
+					  &weston_commit_timer_v1_interface,
+					  1, id);
+	if (!ct->resource) {
+		free(ct);
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	ct->surface = surface;
+	ct->surface_destroy_listener.notify = commit_timer_surface_destroyed;
+	wl_resource_add_destroy_listener(surface_resource,
+					 &ct->surface_destroy_listener);
+
+	wl_resource_set_implementation(ct->resource,
+				       &commit_timer_implementation, ct,
+				       commit_timer_destroy_resource);
+}
+
+static const struct weston_commit_timing_manager_v1_interface
+	commit_timing_manager_implementation = {
+		commit_timing_manager_destroy,
+		commit_timing_manager_get_timer,
+};
+
+static void
+bind_commit_timing(struct wl_client *client, void *data,
+		   uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client,
+				      &weston_commit_timing_manager_v1_interface,
+				      version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource,
+				       &commit_timing_manager_implementation,
+				       data, NULL);
+}
+
+/** Advertise weston_commit_timing_manager_v1
+ *
+ * The queued states are applied by weston_output_repaint(), so this works
+ * with any backend.
+ */
+int
+weston_commit_timing_setup(struct weston_compositor *compositor)
+{
+	if (!wl_global_create(compositor->wl_display,
+			      &weston_commit_timing_manager_v1_interface, 1,
+			      compositor, bind_commit_timing))
+		return -1;
+
+	return 0;
+}
@@ -49,11 +49,20 @@
 #include <signal.h>
 #include <setjmp.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <poll.h>
+#ifdef HAVE_MALLOC_TRIM
+#include <malloc.h>
+#endif
 
 #include "timeline.h"
+#include "weston-trace.h"
+#include "view-grid.h"
+#include "object-pool.h"
+#include "worker-pool.h"
 
 #include <libweston/libweston.h>
 #include <libweston/weston-log.h>
@@ -85,6 +94,24 @@
 
 #define DEFAULT_REPAINT_WINDOW 7 /* milliseconds */
 
+/* Adaptive repaint window: percentile of recent repaint durations to cover,
+ * safety margin added on top, and the smallest window ever used. */
+#define ADAPTIVE_REPAINT_WINDOW_PERCENTILE 95
+#define ADAPTIVE_REPAINT_WINDOW_MARGIN_NSEC 1000000
+#define ADAPTIVE_REPAINT_WINDOW_MIN_NSEC 1000000
+
+/* Damage simplification: default rectangle budget, the bounding box
+ * coverage above which a region is painted as a whole, and the smallest tile
+ * size used when coarsening a region to fit the budget. */
+#define DEFAULT_DAMAGE_MAX_RECTS 32
+#define DAMAGE_MERGE_COVERAGE_PERCENT 75
+#define DAMAGE_TILE_MIN_SIZE 16
+
+/* Freed protocol objects kept around for reuse, per type */
+#define FRAME_CALLBACK_POOL_CACHE 256
+#define FEEDBACK_POOL_CACHE 128
+#define REGION_POOL_CACHE 128
+
 static void
 weston_output_update_matrix(struct weston_output *output);
 
@@ -95,6 +122,9 @@ weston_output_transform_scale_init(struct weston_output *output,
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor);
 
+static void
+weston_compositor_view_list_changed(struct weston_compositor *compositor);
+
 static char *
 weston_output_create_heads_string(struct weston_output *output);
 
@@ -155,6 +185,7 @@ weston_mode_switch_finish(struct weston_output *output,
 
 	pixman_region32_init_rect(&output->region, output->x, output->y,
 				  output->width, output->height);
+	output->compositor->output_layout_serial++;
 
 	weston_output_update_matrix(output);
 
@@ -471,6 +502,8 @@ weston_surface_state_init(struct weston_surface_state *state)
 	pixman_region32_init(&state->damage_buffer);
 	pixman_region32_init(&state->opaque);
 	region_init_infinite(&state->input);
+	state->opaque_changed = false;
+	state->input_changed = false;
 
 	wl_list_init(&state->frame_callback_list);
 	wl_list_init(&state->feedback_list);
@@ -485,6 +518,11 @@ weston_surface_state_init(struct weston_surface_state *state)
 
 	state->desired_protection = WESTON_HDCP_DISABLE;
 	state->protection_mode = WESTON_SURFACE_PROTECTION_MODE_RELAXED;
+	state->allow_tearing = false;
+	state->yuv_coefficients = WESTON_YUV_COEFFICIENTS_BT601;
+	state->yuv_range = WESTON_YUV_RANGE_LIMITED;
+	state->content_type = WESTON_CONTENT_TYPE_NONE;
+	state->has_target_time = false;
 }
 
 static void
@@ -526,6 +564,36 @@ weston_surface_state_set_buffer(struct weston_surface_state *state,
 			      &state->buffer_destroy_listener);
 }
 
+/** A committed state waiting for its target time, see weston_commit_timer_v1
+ */
+struct weston_commit_queue_entry {
+	struct wl_list link; /* weston_surface::commit_queue */
+	struct weston_surface_state state;
+	/* keeps the client from reusing the buffer while it waits */
+	struct weston_buffer_reference buffer_ref;
+};
+
+static void
+weston_commit_queue_entry_destroy(struct weston_commit_queue_entry *entry)
+{
+	weston_surface_state_fini(&entry->state);
+	weston_buffer_reference(&entry->buffer_ref, NULL);
+	wl_list_remove(&entry->link);
+	free(entry);
+}
+
+static void
+weston_surface_commit_queue_release(struct weston_surface *surface)
+{
+	struct weston_commit_queue_entry *entry, *next;
+
+	wl_list_for_each_safe(entry, next, &surface->commit_queue, link)
+		weston_commit_queue_entry_destroy(entry);
+
+	wl_list_remove(&surface->commit_queue_link);
+	wl_list_init(&surface->commit_queue_link);
+}
+
 WL_EXPORT struct weston_surface *
 weston_surface_create(struct weston_compositor *compositor)
 {
@@ -564,6 +632,9 @@ weston_surface_create(struct weston_compositor *compositor)
 	weston_matrix_init(&surface->surface_to_buffer_matrix);
 
 	wl_list_init(&surface->pointer_constraints);
+	wl_list_init(&surface->memory_link);
+	wl_list_init(&surface->commit_queue);
+	wl_list_init(&surface->commit_queue_link);
 
 	surface->acquire_fence_fd = -1;
 
@@ -580,6 +651,12 @@ weston_surface_set_color(struct weston_surface *surface,
 {
 	surface->compositor->renderer->surface_set_color(surface, red, green, blue, alpha);
 	surface->is_opaque = !(alpha < 1.0);
+
+	surface->has_solid_color = true;
+	surface->solid_color[0] = red;
+	surface->solid_color[1] = green;
+	surface->solid_color[2] = blue;
+	surface->solid_color[3] = alpha;
 }
 
 WL_EXPORT void
@@ -723,11 +800,44 @@ weston_transformed_rect(int width, int height,
 	return ret;
 }
 
+/* Scale and translate boxes, as weston_matrix_transform() does for an
+ * axis-aligned matrix, rounding outwards. */
+static void
+transform_boxes_axis_aligned(pixman_box32_t *dest, const pixman_box32_t *src,
+			     int nrects, float sx, float sy, float tx, float ty)
+{
+	float x1, y1, x2, y2;
+	int i;
+
+	for (i = 0; i < nrects; i++) {
+		x1 = src[i].x1 * sx + tx;
+		x2 = src[i].x2 * sx + tx;
+		y1 = src[i].y1 * sy + ty;
+		y2 = src[i].y2 * sy + ty;
+
+		dest[i].x1 = floorf(MIN(x1, x2));
+		dest[i].x2 = ceilf(MAX(x1, x2));
+		dest[i].y1 = floorf(MIN(y1, y2));
+		dest[i].y2 = ceilf(MAX(y1, y2));
+	}
+}
+
+/* Whether f is an integer small enough to be exact in a float */
+static bool
+is_small_integer(float f)
+{
+	return f == floorf(f) && fabsf(f) < (float)(1 << 24);
+}
+
 /** Transform a region by a matrix, restricted to axis-aligned transformations
  *
  * Warning: This function does not work for projective, affine, or matrices
  * that encode arbitrary rotations. Only 90-degree step rotations are
  * supported.
+ *
+ * Identities and translations by whole pixels, most of the calls, only copy
+ * or translate the region. Other scales and translations are applied to all
+ * rectangles without going through the full matrix.
  */
 WL_EXPORT void
 weston_matrix_transform_region(pixman_region32_t *dest,
@@ -737,11 +847,34 @@ weston_matrix_transform_region(pixman_region32_t *dest,
 	pixman_box32_t *src_rects, *dest_rects;
 	int nrects, i;
 
+	if (matrix->type == 0) {
+		if (dest != src)
+			pixman_region32_copy(dest, src);
+		return;
+	}
+
+	if (matrix->type == WESTON_MATRIX_TRANSFORM_TRANSLATE &&
+	    is_small_integer(matrix->d[12]) &&
+	    is_small_integer(matrix->d[13])) {
+		if (dest != src)
+			pixman_region32_copy(dest, src);
+		pixman_region32_translate(dest, matrix->d[12], matrix->d[13]);
+		return;
+	}
+
 	src_rects = pixman_region32_rectangles(src, &nrects);
 	dest_rects = malloc(nrects * sizeof(*dest_rects));
 	if (!dest_rects)
 		return;
 
+	if (!(matrix->type & (WESTON_MATRIX_TRANSFORM_ROTATE |
+			      WESTON_MATRIX_TRANSFORM_OTHER))) {
+		transform_boxes_axis_aligned(dest_rects, src_rects, nrects,
+					     matrix->d[0], matrix->d[5],
+					     matrix->d[12], matrix->d[13]);
+		goto out;
+	}
+
 	for (i = 0; i < nrects; i++) {
 		struct weston_vector vec1 = {{
 			src_rects[i].x1, src_rects[i].y1, 0, 1
@@ -774,11 +907,206 @@ weston_matrix_transform_region(pixman_region32_t *dest,
 		}
 	}
 
+out:
 	pixman_region32_clear(dest);
 	pixman_region32_init_rects(dest, dest_rects, nrects);
 	free(dest_rects);
 }
 
+static void
+region_reset_to_extents(pixman_region32_t *region)
+{
+	pixman_box32_t extents = *pixman_region32_extents(region);
+
+	pixman_region32_fini(region);
+	pixman_region32_init_with_extents(region, &extents);
+}
+
+static inline int32_t
+align_down(int32_t v, int32_t size)
+{
+	return v & ~(size - 1);
+}
+
+static inline int32_t
+align_up(int32_t v, int32_t size)
+{
+	return (v + size - 1) & ~(size - 1);
+}
+
+/** Trade damage precision for fewer rectangles
+ *
+ * \param region The region to simplify in place.
+ * \param max_rects The rectangle budget, 0 or less to leave the region as is.
+ *
+ * Each damage rectangle has a fixed cost in the renderers (clip setup,
+ * texture coordinate generation, a composite call), so past some point
+ * repainting a few undamaged pixels is cheaper. A region covering most of its
+ * bounding box is replaced by that box. A region over the budget is snapped
+ * onto a grid of tiles, doubling the tile size until it fits.
+ *
+ * The result always contains the original region and never exceeds its
+ * extents.
+ */
+WL_EXPORT void
+weston_region_simplify(pixman_region32_t *region, int max_rects)
+{
+	pixman_box32_t *extents, *rects, *tiled;
+	int64_t area = 0, extents_area;
+	int32_t tile, size;
+	int n, i;
+
+	if (max_rects <= 0)
+		return;
+
+	rects = pixman_region32_rectangles(region, &n);
+	if (n <= 1)
+		return;
+
+	extents = pixman_region32_extents(region);
+	extents_area = (int64_t)(extents->x2 - extents->x1) *
+		       (extents->y2 - extents->y1);
+	for (i = 0; i < n; i++)
+		area += (int64_t)(rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+
+	if (area * 100 >= extents_area * DAMAGE_MERGE_COVERAGE_PERCENT) {
+		region_reset_to_extents(region);
+		return;
+	}
+
+	if (n <= max_rects)
+		return;
+
+	tiled = malloc(n * sizeof *tiled);
+	if (!tiled) {
+		region_reset_to_extents(region);
+		return;
+	}
+
+	size = MAX(extents->x2 - extents->x1, extents->y2 - extents->y1);
+	for (tile = DAMAGE_TILE_MIN_SIZE; tile < size; tile *= 2) {
+		pixman_region32_t coarse;
+
+		for (i = 0; i < n; i++) {
+			tiled[i].x1 = MAX(align_down(rects[i].x1, tile),
+					  extents->x1);
+			tiled[i].y1 = MAX(align_down(rects[i].y1, tile),
+					  extents->y1);
+			tiled[i].x2 = MIN(align_up(rects[i].x2, tile),
+					  extents->x2);
+			tiled[i].y2 = MIN(align_up(rects[i].y2, tile),
+					  extents->y2);
+		}
+
+		pixman_region32_init_rects(&coarse, tiled, n);
+		if (pixman_region32_n_rects(&coarse) <= max_rects) {
+			pixman_region32_copy(region, &coarse);
+			pixman_region32_fini(&coarse);
+			free(tiled);
+			return;
+		}
+		pixman_region32_fini(&coarse);
+	}
+
+	free(tiled);
+	region_reset_to_extents(region);
+}
+
+/* Empties a region, keeping the rectangle storage it may have. pixman
+ * allows that state: no rectangles, empty extents and a sized buffer. */
+static void
+region_clear_keep_storage(pixman_region32_t *region)
+{
+	if (region->data && region->data->size > 0) {
+		region->data->numRects = 0;
+		region->extents.x1 = region->extents.x2 = 0;
+		region->extents.y1 = region->extents.y2 = 0;
+		return;
+	}
+
+	pixman_region32_fini(region);
+	pixman_region32_init(region);
+}
+
+/** Borrow an empty region for the repaint in progress
+ *
+ * \param output The output being repainted.
+ * \return An empty region, owned by the output.
+ *
+ * The regions are kept across repaints along with their rectangle storage,
+ * so that the temporary regions of a repaint stop reallocating it once
+ * they have grown to the size the scene needs. pixman reuses the storage
+ * of the destination of an operation as long as the destination is not
+ * also an operand, and the result has more than one rectangle.
+ *
+ * The region stays valid until weston_output_scratch_release() is called
+ * with an earlier mark, or until the end of weston_output_repaint(). It
+ * must not be finalized by the caller.
+ */
+WL_EXPORT pixman_region32_t *
+weston_output_scratch_region(struct weston_output *output)
+{
+	pixman_region32_t **slot, *region;
+	unsigned int count = output->scratch.regions.size / sizeof(*slot);
+
+	if (output->scratch.used < count) {
+		slot = output->scratch.regions.data;
+		region = slot[output->scratch.used++];
+		region_clear_keep_storage(region);
+		return region;
+	}
+
+	region = malloc(sizeof(*region));
+	slot = wl_array_add(&output->scratch.regions, sizeof(*slot));
+	if (!region || !slot) {
+		weston_log("fatal: out of memory for temporary regions.\n");
+		abort();
+	}
+
+	pixman_region32_init(region);
+	*slot = region;
+	output->scratch.used++;
+
+	return region;
+}
+
+/** Remember how many scratch regions are in use
+ *
+ * \param output The output being repainted.
+ * \return A mark for weston_output_scratch_release().
+ */
+WL_EXPORT unsigned int
+weston_output_scratch_mark(struct weston_output *output)
+{
+	return output->scratch.used;
+}
+
+/** Give back the scratch regions borrowed since a mark
+ *
+ * \param output The output being repainted.
+ * \param mark A value returned by weston_output_scratch_mark().
+ */
+WL_EXPORT void
+weston_output_scratch_release(struct weston_output *output, unsigned int mark)
+{
+	assert(mark <= output->scratch.used);
+	output->scratch.used = mark;
+}
+
+static void
+weston_output_scratch_fini(struct weston_output *output)
+{
+	pixman_region32_t **region;
+
+	wl_array_for_each(region, &output->scratch.regions) {
+		pixman_region32_fini(*region);
+		free(*region);
+	}
+	wl_array_release(&output->scratch.regions);
+	output->scratch.used = 0;
+}
+
 /** Transform a region to buffer coordinates
  *
  * \param width Surface width.
@@ -889,6 +1217,115 @@ weston_transformed_region(int width, int height,
 	free(dest_rects);
 }
 
+static bool
+output_has_fractional_scale(struct weston_output *output)
+{
+	return output->fractional_scale &&
+	       output->current_scale == (output->fractional_scale + 119) / 120;
+}
+
+/* v * num / den, rounded towards minus or plus infinity. */
+static int32_t
+scale_floor(int32_t v, int32_t num, int32_t den)
+{
+	int64_t p = (int64_t)v * num;
+
+	return p >= 0 ? p / den : -((-p + den - 1) / den);
+}
+
+static int32_t
+scale_ceil(int32_t v, int32_t num, int32_t den)
+{
+	int64_t p = (int64_t)v * num;
+
+	return p >= 0 ? (p + den - 1) / den : -(-p / den);
+}
+
+static pixman_box32_t
+box_scale_out(pixman_box32_t box, int32_t num, int32_t den)
+{
+	pixman_box32_t ret = {
+		.x1 = scale_floor(box.x1, num, den),
+		.y1 = scale_floor(box.y1, num, den),
+		.x2 = scale_ceil(box.x2, num, den),
+		.y2 = scale_ceil(box.y2, num, den),
+	};
+
+	return ret;
+}
+
+/** Transform a region from output to device coordinates
+ *
+ * \param output The output.
+ * \param src Region in output-local logical coordinates.
+ * \param dest Resulting region in the pixels of the output's framebuffer.
+ *
+ * Like weston_transformed_region() with the output's size, transform and
+ * scale, but also handles a fractional output scale. Rectangles then grow
+ * to the device pixels they touch, so damage is never lost.
+ */
+WL_EXPORT void
+weston_output_transformed_region(struct weston_output *output,
+				 pixman_region32_t *src,
+				 pixman_region32_t *dest)
+{
+	pixman_box32_t *src_rects, *rects;
+	pixman_box32_t extents;
+	int nrects, i;
+
+	if (!output_has_fractional_scale(output)) {
+		weston_transformed_region(output->width, output->height,
+					  output->transform,
+					  output->current_scale, src, dest);
+		return;
+	}
+
+	weston_transformed_region(output->width, output->height,
+				  output->transform, 1, src, dest);
+
+	src_rects = pixman_region32_rectangles(dest, &nrects);
+	rects = malloc(nrects * sizeof(*rects));
+	if (!rects) {
+		extents = box_scale_out(*pixman_region32_extents(dest),
+					output->fractional_scale, 120);
+		pixman_region32_fini(dest);
+		pixman_region32_init_with_extents(dest, &extents);
+		return;
+	}
+
+	for (i = 0; i < nrects; i++)
+		rects[i] = box_scale_out(src_rects[i],
+					 output->fractional_scale, 120);
+
+	/* Grown rectangles may overlap, which init_rects sorts out. */
+	pixman_region32_fini(dest);
+	pixman_region32_init_rects(dest, rects, nrects);
+	free(rects);
+}
+
+/** Transform a rectangle from output to device coordinates
+ *
+ * \param output The output.
+ * \param rect Rectangle in output-local logical coordinates.
+ * \return The rectangle in the pixels of the output's framebuffer.
+ *
+ * See weston_output_transformed_region().
+ */
+WL_EXPORT pixman_box32_t
+weston_output_transformed_rect(struct weston_output *output,
+			       pixman_box32_t rect)
+{
+	if (!output_has_fractional_scale(output))
+		return weston_transformed_rect(output->width, output->height,
+					       output->transform,
+					       output->current_scale, rect);
+
+	rect = weston_transformed_rect(output->width, output->height,
+				       output->transform, 1, rect);
+
+	return box_scale_out(rect, output->fractional_scale, 120);
+}
+
 static void
 viewport_surface_to_buffer(struct weston_surface *surface,
 			   float sx, float sy, float *bx, float *by)
@@ -1024,6 +1461,49 @@ weston_view_move_to_plane(struct weston_view *view,
 	weston_surface_damage(view->surface);
 }
 
+/* A view that is moved around without being transformed, typically a window
+ * being dragged, damages the area it was last painted at and the area it is
+ * at now only once per repaint. Damaging every position it passes through
+ * would make the damage of a drag with a high rate pointer as large as the
+ * path swept, rather than as large as the ground covered in one frame. */
+static void
+view_add_move_damage(struct weston_view *view)
+{
+	pixman_region32_t damage;
+
+	if (!view->transform.move_damage_pending)
+		return;
+
+	view->transform.move_damage_pending = false;
+
+	if (!view->plane)
+		return;
+
+	pixman_region32_init_with_extents(&damage,
+					  &view->transform.move_damage_from);
+	pixman_region32_union(&damage, &damage, &view->transform.boundingbox);
+	pixman_region32_subtract(&damage, &damage, &view->clip);
+	pixman_region32_union(&view->plane->damage,
+			      &view->plane->damage, &damage);
+	pixman_region32_fini(&damage);
+}
+
+static void
+view_add_damage_below(struct weston_view *view)
+{
+	pixman_region32_t damage;
+
+	view_add_move_damage(view);
+
+	pixman_region32_init(&damage);
+	pixman_region32_subtract(&damage, &view->transform.boundingbox,
+				 &view->clip);
+	if (view->plane)
+		pixman_region32_union(&view->plane->damage,
+				      &view->plane->damage, &damage);
+	pixman_region32_fini(&damage);
+}
+
 /** Inflict damage on the plane where the view is visible.
  *
  * \param view The view that causes the damage.
@@ -1043,15 +1523,7 @@ weston_view_move_to_plane(struct weston_view *view,
 WL_EXPORT void
 weston_view_damage_below(struct weston_view *view)
 {
-	pixman_region32_t damage;
-
-	pixman_region32_init(&damage);
-	pixman_region32_subtract(&damage, &view->transform.boundingbox,
-				 &view->clip);
-	if (view->plane)
-		pixman_region32_union(&view->plane->damage,
-				      &view->plane->damage, &damage);
-	pixman_region32_fini(&damage);
+	view_add_damage_below(view);
 	weston_view_schedule_repaint(view);
 }
 
@@ -1111,7 +1583,7 @@ weston_surface_compute_protection(struct protected_surface *psurface)
 			 * content.
 			 */
 
-			if (output->disable_planes > 0 &&
+			if (weston_output_is_captured(output) &&
 			    surface->protection_mode == WESTON_SURFACE_PROTECTION_MODE_RELAXED) {
 				min_protection = WESTON_HDCP_DISABLE;
 				min_protection_valid = true;
@@ -1193,6 +1665,8 @@ weston_surface_update_output_mask(struct weston_surface *es, uint32_t mask)
 	if (different == 0)
 		return;
 
+	weston_surface_update_preferred_scale(es);
+
 	wl_list_for_each(output, &es->compositor->output_list, link) {
 		output_bit = 1u << output->id;
 		if (!(output_bit & different))
@@ -1237,6 +1711,9 @@ notify_view_output_destroy(struct wl_listener *listener, void *data)
 WL_EXPORT void
 weston_view_set_output(struct weston_view *view, struct weston_output *output)
 {
+	if (output != view->output)
+		view->output_layout_serial = 0;
+
 	if (view->output_destroy_listener.notify) {
 		wl_list_remove(&view->output_destroy_listener.link);
 		view->output_destroy_listener.notify = NULL;
@@ -1250,6 +1727,54 @@ weston_view_set_output(struct weston_view *view, struct weston_output *output)
 	}
 }
 
+/* The area of the view's bounding box on the output. Output regions are
+ * rectangles, so for the usual bounding box of a single rectangle this is
+ * plain box arithmetic. */
+static uint32_t
+view_output_area(struct weston_view *ev, struct weston_output *output)
+{
+	pixman_region32_t region;
+	pixman_box32_t *v, *o, *e;
+	int32_t x1, y1, x2, y2;
+	uint32_t area;
+
+	if (pixman_region32_n_rects(&ev->transform.boundingbox) > 1) {
+		pixman_region32_init(&region);
+		pixman_region32_intersect(&region, &ev->transform.boundingbox,
+					  &output->region);
+		e = pixman_region32_extents(&region);
+		area = (e->x2 - e->x1) * (e->y2 - e->y1);
+		pixman_region32_fini(&region);
+
+		return area;
+	}
+
+	v = pixman_region32_extents(&ev->transform.boundingbox);
+	o = pixman_region32_extents(&output->region);
+	x1 = MAX(v->x1, o->x1);
+	y1 = MAX(v->y1, o->y1);
+	x2 = MIN(v->x2, o->x2);
+	y2 = MIN(v->y2, o->y2);
+	if (x1 >= x2 || y1 >= y2)
+		return 0;
+
+	return (x2 - x1) * (y2 - y1);
+}
+
+static bool
+box_contains_box(const pixman_box32_t *outer, const pixman_box32_t *inner)
+{
+	return inner->x1 >= outer->x1 && inner->y1 >= outer->y1 &&
+	       inner->x2 <= outer->x2 && inner->y2 <= outer->y2;
+}
+
+static bool
+box_overlaps_box(const pixman_box32_t *a, const pixman_box32_t *b)
+{
+	return a->x1 < b->x2 && b->x1 < a->x2 &&
+	       a->y1 < b->y2 && b->y1 < a->y2;
+}
+
 /** Recalculate which output(s) the surface has views displayed on
  *
  * \param es  The surface to remap to outputs
@@ -1266,23 +1791,16 @@ weston_surface_assign_output(struct weston_surface *es)
 {
 	struct weston_output *new_output;
 	struct weston_view *view;
-	pixman_region32_t region;
 	uint32_t max, area, mask;
-	pixman_box32_t *e;
 
 	new_output = NULL;
 	max = 0;
 	mask = 0;
-	pixman_region32_init(&region);
 	wl_list_for_each(view, &es->views, surface_link) {
 		if (!view->output)
 			continue;
 
-		pixman_region32_intersect(&region, &view->transform.boundingbox,
-					  &view->output->region);
-
-		e = pixman_region32_extents(&region);
-		area = (e->x2 - e->x1) * (e->y2 - e->y1);
+		area = view_output_area(view, view->output);
 
 		mask |= view->output_mask;
 
@@ -1291,7 +1809,6 @@ weston_surface_assign_output(struct weston_surface *es)
 			max = area;
 		}
 	}
-	pixman_region32_fini(&region);
 
 	es->output = new_output;
 	weston_surface_update_output_mask(es, mask);
@@ -1307,29 +1824,40 @@ weston_surface_assign_output(struct weston_surface *es)
  *
  * Also does the same for the view's surface.  See
  * weston_surface_assign_output().
+ *
+ * A view entirely inside an output no other output overlaps keeps its
+ * assignment for as long as it stays inside, so moving it around within
+ * that output does not walk the outputs again.
  */
 static void
 weston_view_assign_output(struct weston_view *ev)
 {
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct weston_output *output, *new_output;
-	pixman_region32_t region;
+	pixman_box32_t *bbox, *obox, *other;
 	uint32_t max, area, mask;
-	pixman_box32_t *e;
+
+	bbox = pixman_region32_extents(&ev->transform.boundingbox);
+
+	if (ev->output_layout_serial == ec->output_layout_serial &&
+	    bbox->x1 < bbox->x2 && bbox->y1 < bbox->y2 &&
+	    box_contains_box(&ev->output_box, bbox)) {
+		/* Only the area of this view on its output changed, which
+		 * matters to the surface if it has other views. */
+		if (ev->surface->views.next != &ev->surface_link ||
+		    ev->surface->views.prev != &ev->surface_link)
+			weston_surface_assign_output(ev->surface);
+		return;
+	}
 
 	new_output = NULL;
 	max = 0;
 	mask = 0;
-	pixman_region32_init(&region);
 	wl_list_for_each(output, &ec->output_list, link) {
 		if (output->destroying)
 			continue;
 
-		pixman_region32_intersect(&region, &ev->transform.boundingbox,
-					  &output->region);
-
-		e = pixman_region32_extents(&region);
-		area = (e->x2 - e->x1) * (e->y2 - e->y1);
+		area = view_output_area(ev, output);
 
 		if (area > 0)
 			mask |= 1u << output->id;
@@ -1339,11 +1867,27 @@ weston_view_assign_output(struct weston_view *ev)
 			max = area;
 		}
 	}
-	pixman_region32_fini(&region);
 
 	weston_view_set_output(ev, new_output);
+	if (ev->output_mask != mask)
+		ec->view_list_serial++;
 	ev->output_mask = mask;
 
+	ev->output_layout_serial = 0;
+	if (new_output && mask == 1u << new_output->id) {
+		obox = pixman_region32_extents(&new_output->region);
+		if (box_contains_box(obox, bbox))
+			ev->output_layout_serial = ec->output_layout_serial;
+		wl_list_for_each(output, &ec->output_list, link) {
+			if (output == new_output || output->destroying)
+				continue;
+			other = pixman_region32_extents(&output->region);
+			if (box_overlaps_box(obox, other))
+				ev->output_layout_serial = 0;
+		}
+		ev->output_box = *obox;
+	}
+
 	weston_surface_assign_output(ev->surface);
 }
 
@@ -1456,6 +2000,22 @@ weston_view_update_transform_disable(struct weston_view *view)
 	}
 }
 
+/* Whether the view's own transformation is just its position, and its
+ * parent's total transformation a translation as well. */
+static bool
+view_is_translated_only_from(struct weston_view *view,
+			     struct weston_view *parent)
+{
+	if (view->geometry.transformation_list.next !=
+	    &view->transform.position.link ||
+	    view->geometry.transformation_list.prev !=
+	    &view->transform.position.link)
+		return false;
+
+	return (parent->transform.matrix.type &
+		~WESTON_MATRIX_TRANSFORM_TRANSLATE) == 0;
+}
+
 static int
 weston_view_update_transform_enable(struct weston_view *view)
 {
@@ -1473,18 +2033,34 @@ weston_view_update_transform_enable(struct weston_view *view)
 	view->transform.position.matrix.d[12] = view->geometry.x;
 	view->transform.position.matrix.d[13] = view->geometry.y;
 
-	weston_matrix_init(matrix);
-	wl_list_for_each(tform, &view->geometry.transformation_list, link)
-		weston_matrix_multiply(matrix, &tform->matrix);
-
-	if (parent)
-		weston_matrix_multiply(matrix, &parent->transform.matrix);
-
-	if (weston_matrix_invert(inverse, matrix) < 0) {
-		/* Oops, bad total transformation, not invertible */
-		weston_log("error: weston_view %p"
-			" transformation not invertible.\n", view);
-		return -1;
+	if (parent && view_is_translated_only_from(view, parent)) {
+		/* A sub-surface merely offset from its parent, the usual case
+		 * in deep sub-surface trees: reuse the parent's matrices
+		 * rather than multiplying and inverting them again. */
+		*matrix = parent->transform.matrix;
+		matrix->d[12] += view->geometry.x;
+		matrix->d[13] += view->geometry.y;
+		*inverse = parent->transform.inverse;
+		inverse->d[12] -= view->geometry.x;
+		inverse->d[13] -= view->geometry.y;
+		matrix->type |= WESTON_MATRIX_TRANSFORM_TRANSLATE;
+		inverse->type |= WESTON_MATRIX_TRANSFORM_TRANSLATE;
+	} else {
+		weston_matrix_init(matrix);
+		wl_list_for_each(tform, &view->geometry.transformation_list,
+				 link)
+			weston_matrix_multiply(matrix, &tform->matrix);
+
+		if (parent)
+			weston_matrix_multiply(matrix,
+					       &parent->transform.matrix);
+
+		if (weston_matrix_invert(inverse, matrix) < 0) {
+			/* Oops, bad total transformation, not invertible */
+			weston_log("error: weston_view %p"
+				" transformation not invertible.\n", view);
+			return -1;
+		}
 	}
 
 	if (view->alpha == 1.0 &&
@@ -1517,12 +2093,14 @@ get_view_layer(struct weston_view *view)
 	return view->layer_link.layer;
 }
 
-WL_EXPORT void
-weston_view_update_transform(struct weston_view *view)
+static void
+view_update_transform(struct weston_view *view, bool schedule_repaint)
 {
 	struct weston_view *parent = view->geometry.parent;
 	struct weston_layer *layer;
 	pixman_region32_t mask;
+	pixman_box32_t *from;
+	bool untransformed;
 
 	if (!view->transform.dirty)
 		return;
@@ -1531,19 +2109,39 @@ weston_view_update_transform(struct weston_view *view)
 		weston_view_update_transform(parent);
 
 	view->transform.dirty = 0;
+	view->transform.serial =
+		++view->surface->compositor->view_transform_serial;
 
-	weston_view_damage_below(view);
+	/* transform.position is always in transformation_list */
+	untransformed = view->geometry.transformation_list.next ==
+			&view->transform.position.link &&
+			view->geometry.transformation_list.prev ==
+			&view->transform.position.link &&
+			!parent;
+
+	/* Moves batched by a shell take the same path as plain moves, the
+	 * damage of both positions being added at the next repaint. */
+	if ((untransformed && !view->transform.enabled) ||
+	    view->surface->compositor->changes_depth > 0) {
+		if (!view->transform.move_damage_pending) {
+			from = pixman_region32_extents(
+				&view->transform.boundingbox);
+			view->transform.move_damage_from = *from;
+			view->transform.move_damage_pending = true;
+		}
+		if (schedule_repaint)
+			weston_view_schedule_repaint(view);
+	} else if (schedule_repaint) {
+		weston_view_damage_below(view);
+	} else {
+		view_add_damage_below(view);
+	}
 
 	pixman_region32_fini(&view->transform.boundingbox);
 	pixman_region32_fini(&view->transform.opaque);
 	pixman_region32_init(&view->transform.opaque);
 
-	/* transform.position is always in transformation_list */
-	if (view->geometry.transformation_list.next ==
-	    &view->transform.position.link &&
-	    view->geometry.transformation_list.prev ==
-	    &view->transform.position.link &&
-	    !parent) {
+	if (untransformed) {
 		weston_view_update_transform_disable(view);
 	} else {
 		if (weston_view_update_transform_enable(view) < 0)
@@ -1569,19 +2167,39 @@ weston_view_update_transform(struct weston_view *view)
 		}
 	}
 
-	weston_view_damage_below(view);
+	if (view->transform.move_damage_pending) {
+		weston_view_assign_output(view);
+		if (schedule_repaint)
+			weston_view_schedule_repaint(view);
+	} else {
+		if (schedule_repaint)
+			weston_view_damage_below(view);
+		else
+			view_add_damage_below(view);
 
-	weston_view_assign_output(view);
+		weston_view_assign_output(view);
+	}
+
+	weston_view_grid_mark_dirty(view->surface->compositor->view_grid);
 
 	wl_signal_emit(&view->surface->compositor->transform_signal,
 		       view->surface);
 }
 
+WL_EXPORT void
+weston_view_update_transform(struct weston_view *view)
+{
+	view_update_transform(view, true);
+}
+
 WL_EXPORT void
 weston_view_geometry_dirty(struct weston_view *view)
 {
 	struct weston_view *child;
 
+	/* Whatever is under a pointer may have moved */
+	view->surface->compositor->repick_needed = true;
+
 	/*
 	 * The invariant: if view->geometry.dirty, then all views
 	 * in view->geometry.child_list have geometry.dirty too.
@@ -1698,6 +2316,47 @@ weston_view_schedule_repaint(struct weston_view *view)
 			weston_output_schedule_repaint(output);
 }
 
+static void
+weston_output_schedule_cursor_repaint(struct weston_output *output);
+
+/**
+ * \param view  The view that moved, usually a pointer sprite
+ *
+ * Like weston_view_schedule_repaint(), but if the view sits on the
+ * weston_output::cursor_plane of the only output it is shown on, and stays
+ * there, the output only gets its cursor plane moved by
+ * weston_output::repaint_cursor rather than fully repainted.
+ */
+WL_EXPORT void
+weston_view_schedule_cursor_repaint(struct weston_view *view)
+{
+	struct weston_output *output = view->output;
+	struct weston_output *it;
+	uint32_t old_mask = view->output_mask;
+
+	if (!output || !output->repaint_cursor || !output->cursor_plane ||
+	    view->plane != output->cursor_plane ||
+	    old_mask != (1u << output->id) ||
+	    view->geometry.parent ||
+	    !wl_list_empty(&view->geometry.child_list)) {
+		weston_view_schedule_repaint(view);
+		return;
+	}
+
+	/* The damage lands on the cursor plane, which the primary plane
+	 * repaint does not care about. */
+	view_update_transform(view, false);
+
+	if (view->output == output && view->output_mask == old_mask) {
+		weston_output_schedule_cursor_repaint(output);
+		return;
+	}
+
+	wl_list_for_each(it, &view->surface->compositor->output_list, link)
+		if ((view->output_mask | old_mask) & (1u << it->id))
+			weston_output_schedule_repaint(it);
+}
+
 /**
  * XXX: This function does it the wrong way.
  * surface->damage is the damage from the client, and causes
@@ -2072,13 +2731,17 @@ weston_compositor_pick_view(struct weston_compositor *compositor,
 			    wl_fixed_t x, wl_fixed_t y,
 			    wl_fixed_t *vx, wl_fixed_t *vy)
 {
+	struct weston_view_grid_cursor cursor;
 	struct weston_view *view;
 	wl_fixed_t view_x, view_y;
 	int view_ix, view_iy;
 	int ix = wl_fixed_to_int(x);
 	int iy = wl_fixed_to_int(y);
 
-	wl_list_for_each(view, &compositor->view_list, link) {
+	weston_view_grid_lookup(compositor->view_grid, &compositor->view_list,
+				ix, iy, &cursor);
+
+	while ((view = weston_view_grid_cursor_next(&cursor))) {
 		if (!pixman_region32_contains_point(
 				&view->transform.boundingbox, ix, iy, NULL))
 			continue;
@@ -2106,14 +2769,20 @@ weston_compositor_pick_view(struct weston_compositor *compositor,
 	return NULL;
 }
 
+/* Update the pointer focus of all seats after views have moved, been
+ * restacked, mapped or unmapped, or changed their input region. Called at
+ * the end of every output repaint; only the first call after such a change
+ * picks, so static pointers are not picked again once per output and frame.
+ */
 static void
 weston_compositor_repick(struct weston_compositor *compositor)
 {
 	struct weston_seat *seat;
 
-	if (!compositor->session_active)
+	if (!compositor->session_active || !compositor->repick_needed)
 		return;
 
+	compositor->repick_needed = false;
 	wl_list_for_each(seat, &compositor->seat_list, link)
 		weston_seat_repick(seat);
 }
@@ -2133,6 +2802,7 @@ weston_view_unmap(struct weston_view *view)
 	weston_layer_entry_remove(&view->layer_link);
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
+	weston_compositor_view_list_changed(view->surface->compositor);
 	view->output_mask = 0;
 	weston_surface_assign_output(view->surface);
 
@@ -2189,6 +2859,7 @@ weston_view_destroy(struct weston_view *view)
 
 	wl_list_remove(&view->link);
 	weston_layer_entry_remove(&view->layer_link);
+	weston_compositor_view_list_changed(view->surface->compositor);
 
 	pixman_region32_fini(&view->clip);
 	pixman_region32_fini(&view->geometry.scissor);
@@ -2223,6 +2894,7 @@ weston_surface_destroy(struct weston_surface *surface)
 	wl_list_for_each_safe(ev, nv, &surface->views, surface_link)
 		weston_view_destroy(ev);
 
+	weston_surface_commit_queue_release(surface);
 	weston_surface_state_fini(&surface->pending);
 
 	weston_buffer_reference(&surface->buffer_ref, NULL);
@@ -2236,6 +2908,8 @@ weston_surface_destroy(struct weston_surface *surface)
 		wl_resource_destroy(cb->resource);
 
 	weston_presentation_feedback_discard_list(&surface->feedback_list);
+	weston_surface_stats_destroy(surface);
+	weston_surface_memory_destroy(surface);
 
 	wl_list_for_each_safe(constraint, next_constraint,
 			      &surface->pointer_constraints,
@@ -2446,12 +3120,147 @@ weston_output_damage(struct weston_output *output)
 	weston_output_schedule_repaint(output);
 }
 
+/* Whether every view of the surface that is on some output is completely
+ * covered by opaque views above it. Only meaningful when occluded surface
+ * throttling is enabled, otherwise occlusion is not computed.
+ */
+static bool
+weston_surface_is_occluded(struct weston_surface *surface)
+{
+	struct weston_view *view;
+	bool on_output = false;
+
+	if (surface->compositor->occluded_frame_interval_msec <= 0)
+		return false;
+
+	wl_list_for_each(view, &surface->views, surface_link) {
+		if (!view->output_mask)
+			continue;
+
+		on_output = true;
+		if ((view->occluded_mask & view->output_mask) !=
+		    view->output_mask)
+			return false;
+	}
+
+	return on_output;
+}
+
+/* Whether the view is on some output, and completely covered by opaque
+ * views above it on all of them. Only meaningful while the view's outputs
+ * run animations, or when occluded surface throttling is enabled.
+ */
+WL_EXPORT bool
+weston_view_is_occluded(struct weston_view *view)
+{
+	return view->output_mask &&
+	       (view->occluded_mask & view->output_mask) == view->output_mask;
+}
+
+/* Compute which views of the output are totally hidden by the opaque
+ * regions of the views above them, from any plane. Needed to throttle
+ * hidden surfaces, and to skip the animations of hidden views.
+ */
+static void
+weston_output_update_occlusion(struct weston_output *output)
+{
+	uint32_t output_bit = 1u << output->id;
+	struct weston_view *ev, **evp;
+	pixman_region32_t opaque, visible;
+
+	if (output->compositor->occluded_frame_interval_msec <= 0 &&
+	    wl_list_empty(&output->animation_list))
+		return;
+
+	pixman_region32_init(&opaque);
+	pixman_region32_init(&visible);
+
+	wl_array_for_each(evp, &output->view_array) {
+		ev = *evp;
+
+		pixman_region32_intersect(&visible, &ev->transform.boundingbox,
+					  &output->region);
+		pixman_region32_subtract(&visible, &visible, &opaque);
+
+		if (pixman_region32_not_empty(&visible))
+			ev->occluded_mask &= ~output_bit;
+		else
+			ev->occluded_mask |= output_bit;
+
+		pixman_region32_union(&opaque, &opaque, &ev->transform.opaque);
+	}
+
+	pixman_region32_fini(&visible);
+	pixman_region32_fini(&opaque);
+}
+
+/* Decide whether to hold back the frame callbacks of a hidden surface,
+ * or of one the shell asked to throttle. Such a surface still gets its
+ * callbacks once per throttling interval, so that clients do not stall
+ * completely.
+ */
+static bool
+weston_surface_throttle_frame(struct weston_surface *surface,
+			      const struct timespec *now)
+{
+	struct weston_compositor *ec = surface->compositor;
+	int32_t interval = surface->frame_interval_msec;
+
+	if (weston_surface_is_occluded(surface))
+		interval = MAX(interval, ec->occluded_frame_interval_msec);
+
+	/* A client over its request budget waits for the next frame. */
+	if (weston_surface_client_throttled(surface)) {
+		if (!ec->occluded_frame_timer_armed) {
+			wl_event_source_timer_update(ec->occluded_frame_timer,
+						     MAX(interval, 1));
+			ec->occluded_frame_timer_armed = true;
+		}
+		return true;
+	}
+
+	if (interval <= 0)
+		return false;
+
+	if (timespec_sub_to_msec(now, &surface->throttled_frame_time) >=
+	    interval) {
+		surface->throttled_frame_time = *now;
+		return false;
+	}
+
+	if (!ec->occluded_frame_timer_armed) {
+		wl_event_source_timer_update(ec->occluded_frame_timer,
+					     interval);
+		ec->occluded_frame_timer_armed = true;
+	}
+
+	return true;
+}
+
+static int
+occluded_frame_timer_handler(void *data)
+{
+	struct weston_compositor *ec = data;
+
+	/* Repaint so that the held back frame callbacks get released. */
+	ec->occluded_frame_timer_armed = false;
+	weston_compositor_schedule_repaint(ec);
+
+	return 0;
+}
+
 static void
 surface_flush_damage(struct weston_surface *surface)
 {
+	struct timespec begin;
+
 	if (surface->buffer_ref.buffer &&
-	    wl_shm_buffer_get(surface->buffer_ref.buffer->resource))
+	    wl_shm_buffer_get(surface->buffer_ref.buffer->resource)) {
+		weston_surface_cpu_begin(&begin);
 		surface->compositor->renderer->flush_damage(surface);
+		weston_surface_cpu_end(surface, WESTON_CLIENT_CPU_UPLOAD,
+				       &begin);
+	}
 
 	if (pixman_region32_not_empty(&surface->damage))
 		TL_POINT(surface->compositor, "core_flush_damage", TLP_SURFACE(surface),
@@ -2493,40 +3302,52 @@ output_accumulate_damage(struct weston_output *output)
 {
 	struct weston_compositor *ec = output->compositor;
 	struct weston_plane *plane;
-	struct weston_view *ev;
-	pixman_region32_t opaque, clip;
+	struct weston_view *ev, **evp;
+	pixman_region32_t *opaque, *clip, *next_clip, *tmp;
+	unsigned int mark = weston_output_scratch_mark(output);
 
-	pixman_region32_init(&clip);
+	/* The clip alternates between two regions, so that the union never
+	 * writes into one of its operands. */
+	clip = weston_output_scratch_region(output);
+	next_clip = weston_output_scratch_region(output);
+	opaque = weston_output_scratch_region(output);
 
 	wl_list_for_each(plane, &ec->plane_list, link) {
-		pixman_region32_copy(&plane->clip, &clip);
+		pixman_region32_copy(&plane->clip, clip);
 
-		pixman_region32_init(&opaque);
+		region_clear_keep_storage(opaque);
 
-		wl_list_for_each(ev, &ec->view_list, link) {
+		wl_array_for_each(evp, &output->view_array) {
+			ev = *evp;
 			if (ev->plane != plane)
 				continue;
 
-			view_accumulate_damage(ev, &opaque);
+			view_accumulate_damage(ev, opaque);
 		}
 
-		pixman_region32_union(&clip, &clip, &opaque);
-		pixman_region32_fini(&opaque);
+		pixman_region32_union(next_clip, clip, opaque);
+		tmp = clip;
+		clip = next_clip;
+		next_clip = tmp;
 	}
 
-	pixman_region32_fini(&clip);
+	weston_output_scratch_release(output, mark);
 
-	wl_list_for_each(ev, &ec->view_list, link)
-		ev->surface->touched = false;
+	wl_array_for_each(evp, &output->view_array)
+		(*evp)->surface->touched = false;
 
-	wl_list_for_each(ev, &ec->view_list, link) {
-		/* Ignore views not visible on the current output */
-		if (!(ev->output_mask & (1u << output->id)))
-			continue;
+	wl_array_for_each(evp, &output->view_array) {
+		ev = *evp;
 		if (ev->surface->touched)
 			continue;
 		ev->surface->touched = true;
 
+		/* Keep the damage and the buffer of hidden surfaces until
+		 * they become visible again, there is no point uploading
+		 * content nobody can see. */
+		if (weston_surface_is_occluded(ev->surface))
+			continue;
+
 		surface_flush_damage(ev->surface);
 
 		/* Both the renderer and the backend have seen the buffer
@@ -2654,6 +3475,20 @@ view_list_add(struct weston_compositor *compositor,
 	}
 }
 
+/* Record that the stacking order of the views may have changed: a view was
+ * mapped or unmapped, a layer entry was inserted or removed, a layer moved,
+ * or a sub-surface was added, removed or restacked. The view list will be
+ * rebuilt on the next weston_compositor_update_view_list().
+ */
+static void
+weston_compositor_view_list_changed(struct weston_compositor *compositor)
+{
+	compositor->view_list_needs_rebuild = true;
+	compositor->view_list_serial++;
+	compositor->repick_needed = true;
+	weston_view_grid_mark_dirty(compositor->view_grid);
+}
+
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor)
 {
@@ -2677,6 +3512,65 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_free_unused_subsurface_views(view->surface);
+
+	/* Freeing the unused sub-surface views unmaps them, which flags the
+	 * list again, so only clear the flag once everything is done. */
+	compositor->view_list_needs_rebuild = false;
+	weston_view_grid_mark_dirty(compositor->view_grid);
+}
+
+/* Make the view list and the view transforms current. The list itself is
+ * only rebuilt if the stacking changed since the last rebuild, so repainting
+ * several outputs in the same cycle walks the layers only once.
+ */
+static void
+weston_compositor_update_view_list(struct weston_compositor *compositor)
+{
+	struct weston_view *view;
+
+	if (compositor->view_list_needs_rebuild) {
+		weston_compositor_build_view_list(compositor);
+	} else {
+		wl_list_for_each(view, &compositor->view_list, link)
+			weston_view_update_transform(view);
+	}
+
+	/* Before planes are assigned and the clips recomputed, which both
+	 * the damage of moved views depends on. */
+	wl_list_for_each(view, &compositor->view_list, link)
+		view_add_move_damage(view);
+}
+
+/* Refresh the array of views overlapping an output, in view list order.
+ * This must be called after weston_compositor_update_view_list(), because
+ * updating the transforms also updates the view output masks. The global
+ * view list is only walked when a view was added, removed, restacked or
+ * moved to a different set of outputs since the last refresh.
+ */
+static void
+weston_output_update_view_array(struct weston_output *output)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct weston_view *ev, **p;
+
+	if (output->view_array_serial == ec->view_list_serial)
+		return;
+
+	output->view_array.size = 0;
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (!(ev->output_mask & (1u << output->id)))
+			continue;
+
+		p = wl_array_add(&output->view_array, sizeof *p);
+		if (!p) {
+			weston_log("Error: out of memory building the view "
+				   "list of output %s.\n", output->name);
+			return;
+		}
+		*p = ev;
+	}
+
+	output->view_array_serial = ec->view_list_serial;
 }
 
 static void
@@ -2704,128 +3598,462 @@ weston_output_take_feedback_list(struct weston_output *output,
 	wl_list_init(&surface->feedback_list);
 }
 
-static int
-weston_output_repaint(struct weston_output *output, void *repaint_data)
+static void
+weston_output_send_frame_callbacks(struct weston_output *output,
+				   const struct timespec *time)
 {
-	struct weston_compositor *ec = output->compositor;
-	struct weston_view *ev;
-	struct weston_animation *animation, *next;
 	struct weston_frame_callback *cb, *cnext;
-	struct wl_list frame_callback_list;
-	pixman_region32_t output_damage;
-	int r;
-	uint32_t frame_time_msec;
-	enum weston_hdcp_protection highest_requested = WESTON_HDCP_DISABLE;
+	uint32_t frame_time_msec = timespec_to_msec(time);
 
-	if (output->destroying)
-		return 0;
+	wl_list_for_each_safe(cb, cnext, &output->frame_callback_list, link) {
+		WESTON_TRACE2(frame_callback_done, output->id,
+			      frame_time_msec);
+		wl_callback_send_done(cb->resource, frame_time_msec);
+		wl_resource_destroy(cb->resource);
+	}
+}
 
-	TL_POINT(ec, "core_repaint_begin", TLP_OUTPUT(output), TLP_END);
+/* The vertical blank the frame being repainted will be shown at, going by
+ * the last presentation and the refresh rate. */
+static void
+weston_output_predict_presentation(struct weston_output *output,
+				   struct timespec *predicted)
+{
+	int64_t refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
+	int64_t elapsed;
 
-	/* Rebuild the surface list and update surface transforms up front. */
-	weston_compositor_build_view_list(ec);
+	*predicted = output->repaint_window.begin;
 
-	/* Find the highest protection desired for an output */
-	wl_list_for_each(ev, &ec->view_list, link) {
-		if (ev->surface->output_mask & (1u << output->id)) {
-			/*
-			 * The desired_protection of the output should be the
-			 * maximum of the desired_protection of the surfaces,
-			 * that are displayed on that output, to avoid
-			 * reducing the protection for existing surfaces.
-			 */
-			if (ev->surface->desired_protection > highest_requested)
-				highest_requested =
-						ev->surface->desired_protection;
-		}
-	}
+	elapsed = timespec_sub_to_nsec(&output->repaint_window.begin,
+				       &output->frame_time);
+	if (refresh_nsec > 0 && elapsed >= 0)
+		timespec_add_nsec(predicted, &output->frame_time,
+				  (elapsed / refresh_nsec + 1) * refresh_nsec);
+}
 
-	output->desired_protection = highest_requested;
+static void
+weston_output_repaint_finish(struct weston_output *output)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct weston_animation *animation, *next;
 
-	if (output->assign_planes && !output->disable_planes) {
-		output->assign_planes(output, repaint_data);
-	} else {
-		wl_list_for_each(ev, &ec->view_list, link) {
-			weston_view_move_to_plane(ev, &ec->primary_plane);
-			ev->psf_flags = 0;
-		}
+	output->repaint_finish_pending = false;
+
+	if (output->repaint_status == REPAINT_AWAITING_COMPLETION) {
+		struct timespec posted;
+
+		weston_compositor_read_presentation_clock(ec, &posted);
+		output->repaint_window.pending_nsec =
+			timespec_sub_to_nsec(&posted,
+					     &output->repaint_window.begin);
 	}
 
-	wl_list_init(&frame_callback_list);
-	wl_list_for_each(ev, &ec->view_list, link) {
-		/* Note: This operation is safe to do multiple times on the
-		 * same surface.
-		 */
-		if (ev->surface->output == output) {
-			wl_list_insert_list(&frame_callback_list,
-					    &ev->surface->frame_callback_list);
-			wl_list_init(&ev->surface->frame_callback_list);
+	weston_compositor_repick(ec);
 
-			weston_output_take_feedback_list(output, ev->surface);
-		}
+	weston_output_send_frame_callbacks(output, &output->frame_time);
+
+	wl_list_for_each_safe(animation, next, &output->animation_list, link) {
+		animation->frame_counter++;
+		animation->frame(animation, output, &output->frame_time);
 	}
 
-	output_accumulate_damage(output);
+	TL_POINT(ec, "core_repaint_posted", TLP_OUTPUT(output), TLP_END);
+}
 
-	pixman_region32_init(&output_damage);
-	pixman_region32_intersect(&output_damage,
-				  &ec->primary_plane.damage, &output->region);
-	pixman_region32_subtract(&output_damage,
-				 &output_damage, &ec->primary_plane.clip);
+/* Damage covering less than this fraction of an output, like a blinking
+ * cursor or a clock, does not keep it at the full refresh rate. */
+#define IDLE_REFRESH_DAMAGE_FRACTION 64
 
-	if (output->dirty)
-		weston_output_update_matrix(output);
+/* Repaint interval of an idle output running with adaptive sync */
+#define IDLE_REFRESH_VRR_NSEC (1000000000 / 30)
 
-	r = output->repaint(output, &output_damage, repaint_data);
+static bool
+weston_output_idle_refresh_is_idle(struct weston_output *output)
+{
+	return output->idle_refresh_mode || output->idle_refresh_throttled;
+}
 
-	pixman_region32_fini(&output_damage);
+/* The lowest refresh rate mode of the current size */
+static struct weston_mode *
+weston_output_find_idle_mode(struct weston_output *output)
+{
+	struct weston_mode *current = output->current_mode;
+	struct weston_mode *mode, *best = NULL;
 
-	output->repaint_needed = false;
-	if (r == 0)
-		output->repaint_status = REPAINT_AWAITING_COMPLETION;
+	wl_list_for_each(mode, &output->mode_list, link) {
+		if (mode->width != current->width ||
+		    mode->height != current->height ||
+		    mode->refresh >= current->refresh)
+			continue;
 
-	weston_compositor_repick(ec);
+		if (!best || mode->refresh < best->refresh)
+			best = mode;
+	}
 
-	frame_time_msec = timespec_to_msec(&output->frame_time);
+	return best;
+}
 
-	wl_list_for_each_safe(cb, cnext, &frame_callback_list, link) {
-		wl_callback_send_done(cb->resource, frame_time_msec);
-		wl_resource_destroy(cb->resource);
+/* Whether a view of the output shows this type of content */
+static bool
+weston_output_shows_content_type(struct weston_output *output,
+				 enum weston_content_type type)
+{
+	struct weston_view **evp;
+
+	wl_array_for_each(evp, &output->view_array) {
+		if ((*evp)->surface->content_type == type)
+			return true;
 	}
 
-	wl_list_for_each_safe(animation, next, &output->animation_list, link) {
-		animation->frame_counter++;
-		animation->frame(animation, output, &output->frame_time);
+	return false;
+}
+
+static void
+weston_output_idle_refresh_enter(struct weston_output *output)
+{
+	struct weston_mode *mode;
+
+	/* The panel already refreshes as slowly as it can when nothing is
+	 * presented, only the repaints need limiting. */
+	if (output->vrr_enabled) {
+		output->idle_refresh_throttled = true;
+		return;
 	}
 
-	TL_POINT(ec, "core_repaint_posted", TLP_OUTPUT(output), TLP_END);
+	/* Leave the modes of fullscreen clients alone. */
+	if (output->original_mode)
+		return;
 
-	return r;
+	mode = weston_output_find_idle_mode(output);
+	if (!mode ||
+	    weston_output_mode_switch_to_temporary(output, mode,
+						   output->current_scale) < 0)
+		return;
+
+	output->idle_refresh_mode = mode;
+	/* The size is the same, so the backend keeps its buffers and only
+	 * needs a frame to program the new timings with. */
+	weston_output_schedule_repaint(output);
 }
 
 static void
-weston_output_schedule_repaint_reset(struct weston_output *output)
+weston_output_idle_refresh_leave(struct weston_output *output)
 {
-	output->repaint_status = REPAINT_NOT_SCHEDULED;
-	TL_POINT(output->compositor, "core_repaint_exit_loop",
-		 TLP_OUTPUT(output), TLP_END);
+	struct weston_mode *mode = output->idle_refresh_mode;
+
+	output->idle_refresh_throttled = false;
+	if (!mode)
+		return;
+
+	output->idle_refresh_mode = NULL;
+
+	/* Someone else switched modes meanwhile. */
+	if (output->current_mode != mode || !output->original_mode)
+		return;
+
+	weston_output_mode_switch_to_native(output);
+	weston_output_schedule_repaint(output);
 }
 
 static int
-weston_output_maybe_repaint(struct weston_output *output, struct timespec *now,
-			    void *repaint_data)
+idle_refresh_handler(void *data)
+{
+	struct weston_output *output = data;
+	int timeout = output->idle_refresh_timeout_ms;
+	struct timespec now;
+	int64_t elapsed;
+
+	if (!output->enabled) {
+		wl_event_source_timer_update(output->idle_refresh_timer,
+					     timeout);
+		return 0;
+	}
+
+	weston_compositor_read_presentation_clock(output->compositor, &now);
+	elapsed = timespec_sub_to_msec(&now, &output->idle_refresh_activity);
+
+	if (elapsed < timeout) {
+		weston_output_idle_refresh_leave(output);
+		wl_event_source_timer_update(output->idle_refresh_timer,
+					     MAX(1, timeout - elapsed));
+	} else if (weston_output_shows_content_type(output,
+						    WESTON_CONTENT_TYPE_GAME)) {
+		/* A game may sit still on a menu, but would notice the
+		 * latency of a switch back on the next input. */
+		wl_event_source_timer_update(output->idle_refresh_timer,
+					     timeout);
+	} else if (!weston_output_idle_refresh_is_idle(output)) {
+		weston_output_idle_refresh_enter(output);
+	}
+
+	return 0;
+}
+
+/* Input or substantial damage: stay at, or go back to, the full refresh
+ * rate. Modes are switched from the timer, outside of the input and repaint
+ * paths that report activity. */
+static void
+weston_output_idle_refresh_activity(struct weston_output *output,
+				    const struct timespec *now)
+{
+	if (!output->idle_refresh_timer)
+		return;
+
+	output->idle_refresh_activity = *now;
+	if (weston_output_idle_refresh_is_idle(output))
+		wl_event_source_timer_update(output->idle_refresh_timer, 1);
+}
+
+/* Damage of all planes but the cursor one, by area rather than extents so
+ * that small updates far apart do not add up to the whole output. */
+static bool
+weston_output_damage_is_substantial(struct weston_output *output)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct weston_plane *plane;
+	pixman_region32_t damage;
+	pixman_box32_t *rects;
+	int64_t area = 0;
+	int i, n;
+
+	pixman_region32_init(&damage);
+	wl_list_for_each(plane, &ec->plane_list, link) {
+		if (plane == output->cursor_plane)
+			continue;
+
+		pixman_region32_intersect(&damage, &plane->damage,
+					  &output->region);
+		rects = pixman_region32_rectangles(&damage, &n);
+		for (i = 0; i < n; i++)
+			area += (int64_t)(rects[i].x2 - rects[i].x1) *
+				(rects[i].y2 - rects[i].y1);
+	}
+	pixman_region32_fini(&damage);
+
+	return area * IDLE_REFRESH_DAMAGE_FRACTION >=
+	       (int64_t)output->width * output->height;
+}
+
+static bool
+weston_output_latch_commit_queues(struct weston_output *output);
+
+static int
+weston_output_repaint(struct weston_output *output, void *repaint_data)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct weston_view *ev, **evp;
+	pixman_region32_t *output_damage, *plane_damage;
+	int r;
+	enum weston_hdcp_protection highest_requested = WESTON_HDCP_DISABLE;
+	unsigned int plane_views = 0;
+	bool video_playing = false;
+	bool commits_waiting;
+	bool full_repaint;
+
+	if (output->destroying)
+		return 0;
+
+	weston_compositor_read_presentation_clock(ec,
+						  &output->repaint_window.begin);
+
+	TL_POINT(ec, "core_repaint_begin", TLP_OUTPUT(output), TLP_END);
+	WESTON_TRACE2(repaint_begin, output->id, output->msc);
+	weston_output_frame_stats_repaint_begin(output,
+						&output->repaint_window.begin);
+
+	commits_waiting = weston_output_latch_commit_queues(output);
+
+	/* Rebuild the surface list and update surface transforms up front. */
+	weston_compositor_update_view_list(ec);
+	weston_output_update_view_array(output);
+	weston_output_update_occlusion(output);
+
+	/* Find the highest protection desired for an output */
+	wl_array_for_each(evp, &output->view_array) {
+		ev = *evp;
+		/*
+		 * The desired_protection of the output should be the
+		 * maximum of the desired_protection of the surfaces,
+		 * that are displayed on that output, to avoid
+		 * reducing the protection for existing surfaces.
+		 */
+		if (ev->surface->desired_protection > highest_requested)
+			highest_requested = ev->surface->desired_protection;
+	}
+
+	output->desired_protection = highest_requested;
+
+	TL_POINT(ec, "core_assign_planes_begin", TLP_OUTPUT(output), TLP_END);
+
+	if (output->assign_planes && !output->disable_planes) {
+		output->assign_planes(output, repaint_data);
+	} else {
+		wl_list_for_each(ev, &ec->view_list, link) {
+			weston_view_move_to_plane(ev, &ec->primary_plane);
+			ev->psf_flags = 0;
+		}
+	}
+
+	wl_array_for_each(evp, &output->view_array) {
+		if ((*evp)->plane != &ec->primary_plane)
+			plane_views++;
+	}
+	TL_POINT(ec, "core_assign_planes_end", TLP_OUTPUT(output),
+		 TLP_PLANE_VIEWS(&plane_views), TLP_END);
+
+	wl_array_for_each(evp, &output->view_array) {
+		ev = *evp;
+		/* Note: This operation is safe to do multiple times on the
+		 * same surface.
+		 */
+		if (ev->surface->output == output &&
+		    !weston_surface_throttle_frame(ev->surface,
+						   &output->repaint_window.begin)) {
+			/* A small video judders at a lower refresh rate just
+			 * as a large one. */
+			if (ev->surface->content_type ==
+			    WESTON_CONTENT_TYPE_VIDEO &&
+			    !wl_list_empty(&ev->surface->frame_callback_list))
+				video_playing = true;
+
+			wl_list_insert_list(&output->frame_callback_list,
+					    &ev->surface->frame_callback_list);
+			wl_list_init(&ev->surface->frame_callback_list);
+
+			weston_output_take_feedback_list(output, ev->surface);
+			weston_surface_stats_repaint(ev->surface, output,
+						     ev->plane != &ec->primary_plane);
+		}
+	}
+
+	/* The content of the frame is settled, let the clients start on
+	 * the next one while the renderer draws this one. */
+	if (ec->early_frame_callbacks &&
+	    !wl_list_empty(&output->frame_callback_list)) {
+		struct timespec predicted;
+
+		weston_output_predict_presentation(output, &predicted);
+		weston_output_send_frame_callbacks(output, &predicted);
+	}
+
+	output_accumulate_damage(output);
+
+	if (output->idle_refresh_timer &&
+	    (video_playing || weston_output_damage_is_substantial(output)))
+		weston_output_idle_refresh_activity(output,
+					&output->repaint_window.begin);
+
+	plane_damage = weston_output_scratch_region(output);
+	output_damage = weston_output_scratch_region(output);
+	pixman_region32_intersect(plane_damage,
+				  &ec->primary_plane.damage, &output->region);
+	pixman_region32_subtract(output_damage,
+				 plane_damage, &ec->primary_plane.clip);
+	weston_region_simplify(output_damage, ec->damage_max_rects);
+
+	/* Counted so that paths damaging everything show up, they are slow
+	 * on big outputs. */
+	full_repaint = pixman_region32_contains_rectangle(output_damage,
+				pixman_region32_extents(&output->region)) ==
+		       PIXMAN_REGION_IN;
+
+	if (output->dirty)
+		weston_output_update_matrix(output);
+
+	r = output->repaint(output, output_damage, repaint_data);
+	WESTON_TRACE2(repaint_end, output->id, r);
+
+	/* Whatever the backend and renderer borrowed is free again. */
+	weston_output_scratch_release(output, 0);
+
+	if (r == 0) {
+		weston_output_frame_stats_repaint_end(output, plane_views,
+			output->view_array.size / sizeof(evp) - plane_views,
+			full_repaint);
+		weston_flight_recorder_repaint_posted(ec->flight_recorder,
+						      output);
+	}
+
+	/* Keep repainting until the queued commits are due. */
+	output->repaint_needed = commits_waiting;
+	output->cursor_repaint_needed = false;
+	output->repaint_immediate = false;
+	if (r == 0)
+		output->repaint_status = REPAINT_AWAITING_COMPLETION;
+
+	/* With repaint threads, the renderer may only have recorded what to
+	 * draw. Views must not change until it has drawn them, so picking,
+	 * frame callbacks and animations wait for its repaint_flush. */
+	if (ec->repaint_pool)
+		output->repaint_finish_pending = true;
+	else
+		weston_output_repaint_finish(output);
+
+	return r;
+}
+
+static void
+weston_output_schedule_repaint_reset(struct weston_output *output)
+{
+	output->repaint_status = REPAINT_NOT_SCHEDULED;
+	output->repaint_immediate = false;
+	TL_POINT(output->compositor, "core_repaint_exit_loop",
+		 TLP_OUTPUT(output), TLP_END);
+}
+
+static int
+weston_output_repaint_cursor(struct weston_output *output, void *repaint_data)
+{
+	if (output->destroying)
+		return 0;
+
+	output->cursor_repaint_needed = false;
+
+	if (output->repaint_cursor(output, repaint_data) == 0) {
+		TL_POINT(output->compositor, "core_repaint_cursor",
+			 TLP_OUTPUT(output), TLP_END);
+		output->repaint_status = REPAINT_AWAITING_COMPLETION;
+		return 0;
+	}
+
+	return weston_output_repaint(output, repaint_data);
+}
+
+static void
+output_repaint_timer_disarm(struct weston_output *output)
+{
+	struct itimerspec its = {};
+
+	if (output->repaint_timer_fd >= 0)
+		timerfd_settime(output->repaint_timer_fd, 0, &its, NULL);
+}
+
+static int
+weston_output_maybe_repaint(struct weston_output *output, struct timespec *now,
+			    void *repaint_data, struct weston_output *fired)
 {
 	struct weston_compositor *compositor = output->compositor;
+	bool timer_fired = output == fired;
+	bool grouped = output->repaint_group != 0 &&
+		       output->repaint_group == fired->repaint_group;
 	int ret = 0;
-	int64_t msec_to_repaint;
 
 	/* We're not ready yet; come back to make a decision later. */
 	if (output->repaint_status != REPAINT_SCHEDULED)
 		return ret;
 
-	msec_to_repaint = timespec_sub_to_msec(&output->next_repaint, now);
-	if (msec_to_repaint > 1)
-		return ret;
+	/* Other outputs join the repaint of the output whose timer fired
+	 * only if their own deadline has passed too, so that outputs with
+	 * different refresh rates or vblank phases do not pull each other's
+	 * repaints forward. Their timers are then no longer needed. Outputs
+	 * of the same repaint group always join, since they show one
+	 * picture. */
+	if (!timer_fired) {
+		if (!grouped &&
+		    timespec_sub_to_nsec(&output->next_repaint, now) > 0)
+			return ret;
+		output_repaint_timer_disarm(output);
+	}
 
 	/* If we're sleeping, drop the repaint machinery entirely; we will
 	 * explicitly repaint all outputs when we come back. */
@@ -2835,7 +4063,7 @@ weston_output_maybe_repaint(struct weston_output *output, struct timespec *now,
 
 	/* We don't actually need to repaint this output; drop it from
 	 * repaint until something causes damage. */
-	if (!output->repaint_needed)
+	if (!output->repaint_needed && !output->cursor_repaint_needed)
 		goto err;
 
 	/* If repaint fails, we aren't going to get weston_output_finish_frame
@@ -2843,7 +4071,10 @@ weston_output_maybe_repaint(struct weston_output *output, struct timespec *now,
 	 * something schedules a successful repaint later. As repainting may
 	 * take some time, re-read our clock as a courtesy to the next
 	 * output. */
-	ret = weston_output_repaint(output, repaint_data);
+	if (output->repaint_needed)
+		ret = weston_output_repaint(output, repaint_data);
+	else
+		ret = weston_output_repaint_cursor(output, repaint_data);
 	weston_compositor_read_presentation_clock(compositor, now);
 	if (ret != 0)
 		goto err;
@@ -2856,65 +4087,87 @@ err:
 	return ret;
 }
 
+static struct timespec
+convert_presentation_time_now(struct weston_compositor *compositor,
+			      const struct timespec *presentation_stamp,
+			      const struct timespec *presentation_now,
+			      clockid_t target_clock);
+
+/* The repaint timer is a timerfd armed with the absolute deadline, which
+ * keeps the nanosecond precision of next_repaint instead of the
+ * millisecond timeouts of wl_event_loop timers. A deadline in the past
+ * fires from the next event loop dispatch, so repainting immediately
+ * needs no minimum delay, and does not recurse from
+ * weston_output_finish_frame() into the backend either. */
 static void
-output_repaint_timer_arm(struct weston_compositor *compositor)
+output_repaint_timer_arm(struct weston_output *output)
 {
-	struct weston_output *output;
-	bool any_should_repaint = false;
+	struct weston_compositor *compositor = output->compositor;
+	struct itimerspec its = {};
 	struct timespec now;
-	int64_t msec_to_next = INT64_MAX;
-
-	weston_compositor_read_presentation_clock(compositor, &now);
-
-	wl_list_for_each(output, &compositor->output_list, link) {
-		int64_t msec_to_this;
 
-		if (output->repaint_status != REPAINT_SCHEDULED)
-			continue;
-
-		msec_to_this = timespec_sub_to_msec(&output->next_repaint,
-						    &now);
-		if (!any_should_repaint || msec_to_this < msec_to_next)
-			msec_to_next = msec_to_this;
-
-		any_should_repaint = true;
-	}
-
-	if (!any_should_repaint)
+	if (output->repaint_status != REPAINT_SCHEDULED ||
+	    output->repaint_timer_fd < 0)
 		return;
 
-	/* Even if we should repaint immediately, add the minimum 1 ms delay.
-	 * This is a workaround to allow coalescing multiple output repaints
-	 * particularly from weston_output_finish_frame()
-	 * into the same call, which would not happen if we called
-	 * output_repaint_timer_handler() directly.
-	 */
-	if (msec_to_next < 1)
-		msec_to_next = 1;
+	/* timerfd does not support every presentation clock. */
+	weston_compositor_read_presentation_clock(compositor, &now);
+	its.it_value = convert_presentation_time_now(compositor,
+						     &output->next_repaint,
+						     &now, CLOCK_MONOTONIC);
+
+	/* An all-zero value would disarm the timer. */
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1;
 
-	wl_event_source_timer_update(compositor->repaint_timer, msec_to_next);
+	if (timerfd_settime(output->repaint_timer_fd, TFD_TIMER_ABSTIME,
+			    &its, NULL) < 0)
+		weston_log("Error: arming the repaint timer of output '%s' "
+			   "failed: %s\n", output->name, strerror(errno));
 }
 
+/* Each output has its own repaint timer, armed for its own deadline. */
 static int
-output_repaint_timer_handler(void *data)
+output_repaint_timer_handler(int fd, uint32_t mask, void *data)
 {
-	struct weston_compositor *compositor = data;
+	struct weston_output *fired = data;
+	struct weston_compositor *compositor = fired->compositor;
 	struct weston_output *output;
 	struct timespec now;
 	void *repaint_data = NULL;
+	uint64_t expirations;
 	int ret = 0;
 
+	if (read(fd, &expirations, sizeof expirations) < 0 &&
+	    errno != EAGAIN)
+		weston_log("Error: reading the repaint timer of output '%s' "
+			   "failed: %s\n", fired->name, strerror(errno));
+
+	if (fired->repaint_status != REPAINT_SCHEDULED)
+		return 0;
+
 	weston_compositor_read_presentation_clock(compositor, &now);
 
+	weston_compositor_client_budget_repaint(compositor);
+
 	if (compositor->backend->repaint_begin)
 		repaint_data = compositor->backend->repaint_begin(compositor);
 
 	wl_list_for_each(output, &compositor->output_list, link) {
-		ret = weston_output_maybe_repaint(output, &now, repaint_data);
+		ret = weston_output_maybe_repaint(output, &now, repaint_data,
+						  fired);
 		if (ret)
 			break;
 	}
 
+	if (compositor->renderer->repaint_flush)
+		compositor->renderer->repaint_flush(compositor);
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		if (output->repaint_finish_pending)
+			weston_output_repaint_finish(output);
+	}
+
 	if (ret == 0) {
 		if (compositor->backend->repaint_flush)
 			ret = compositor->backend->repaint_flush(compositor,
@@ -2935,8 +4188,6 @@ output_repaint_timer_handler(void *data)
 	wl_list_for_each(output, &compositor->output_list, link)
 		output->repainted = false;
 
-	output_repaint_timer_arm(compositor);
-
 	return 0;
 }
 
@@ -2973,6 +4224,73 @@ convert_presentation_time_now(struct weston_compositor *compositor,
 	return target_stamp;
 }
 
+static int
+compare_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Feed the last repaint into the adaptive repaint window estimate.
+ *
+ * The sample is the time from the start of the repaint until the backend
+ * had the frame posted. That does not include GPU work still in flight, so
+ * a repaint that missed its target vblank is counted as needing more than the
+ * window it was given instead. The new window covers a percentile of the
+ * recent samples plus a margin, bounded by the refresh period.
+ */
+static void
+weston_output_update_repaint_window(struct weston_output *output,
+				    const struct timespec *stamp,
+				    int32_t refresh_nsec)
+{
+	struct weston_compositor *compositor = output->compositor;
+	int64_t sorted[WESTON_REPAINT_WINDOW_SAMPLES];
+	int64_t sample = output->repaint_window.pending_nsec;
+	int64_t window, latency;
+	struct timespec ts;
+	unsigned int n;
+
+	if (sample < 0)
+		return;
+
+	output->repaint_window.pending_nsec = -1;
+
+	/* The repaint targeted the vblank one window after it started. A
+	 * presentation more than half a refresh later means it was late. */
+	latency = timespec_sub_to_nsec(stamp, &output->repaint_window.begin);
+	if (latency > output->repaint_window.window_nsec + refresh_nsec / 2)
+		sample = MAX(sample, output->repaint_window.window_nsec +
+				     ADAPTIVE_REPAINT_WINDOW_MARGIN_NSEC);
+
+	output->repaint_window.samples_nsec[output->repaint_window.next_sample] =
+		sample;
+	output->repaint_window.next_sample =
+		(output->repaint_window.next_sample + 1) %
+		WESTON_REPAINT_WINDOW_SAMPLES;
+	if (output->repaint_window.sample_count < WESTON_REPAINT_WINDOW_SAMPLES)
+		output->repaint_window.sample_count++;
+
+	n = output->repaint_window.sample_count;
+	memcpy(sorted, output->repaint_window.samples_nsec, n * sizeof sorted[0]);
+	qsort(sorted, n, sizeof sorted[0], compare_int64);
+
+	window = sorted[(n - 1) * ADAPTIVE_REPAINT_WINDOW_PERCENTILE / 100];
+	window += ADAPTIVE_REPAINT_WINDOW_MARGIN_NSEC;
+	if (window < ADAPTIVE_REPAINT_WINDOW_MIN_NSEC)
+		window = ADAPTIVE_REPAINT_WINDOW_MIN_NSEC;
+	if (window > refresh_nsec)
+		window = refresh_nsec;
+
+	output->repaint_window.window_nsec = window;
+
+	timespec_from_nsec(&ts, window);
+	TL_POINT(compositor, "core_repaint_window", TLP_OUTPUT(output),
+		 TLP_REPAINT_WINDOW(&ts), TLP_END);
+}
+
 /**
  * \ingroup output
  */
@@ -2982,6 +4300,7 @@ weston_output_finish_frame(struct weston_output *output,
 			   uint32_t presented_flags)
 {
 	struct weston_compositor *compositor = output->compositor;
+	struct weston_output_presentation presentation;
 	int32_t refresh_nsec;
 	struct timespec now;
 	struct timespec vblank_monotonic;
@@ -2992,10 +4311,28 @@ weston_output_finish_frame(struct weston_output *output,
 
 	weston_compositor_read_presentation_clock(compositor, &now);
 
+	weston_output_frame_stats_finish(output, &now, stamp,
+		millihz_to_nsec(output->current_mode->refresh));
+	weston_flight_recorder_frame_done(compositor->flight_recorder, output);
+
+	if (!timespec_is_zero(&compositor->wake_time)) {
+		weston_log("first frame after wake on %s after %.1f ms\n",
+			   output->name,
+			   timespec_sub_to_nsec(&now, &compositor->wake_time) /
+			   1000000.0);
+		compositor->wake_time = (struct timespec){ 0 };
+	}
+
+	presentation.stamp = stamp;
+	presentation.msc = output->msc;
+	presentation.flags = presented_flags;
+	wl_signal_emit(&output->presented_signal, &presentation);
+
 	/* If we haven't been supplied any timestamp at all, we don't have a
 	 * timebase to work against, so any delay just wastes time. Push a
 	 * repaint as soon as possible so we can get on with it. */
 	if (!stamp) {
+		weston_output_surface_stats_present(output, NULL, 0);
 		output->next_repaint = now;
 		goto out;
 	}
@@ -3011,12 +4348,24 @@ weston_output_finish_frame(struct weston_output *output,
 						  output, refresh_nsec, stamp,
 						  output->msc,
 						  presented_flags);
+	weston_output_surface_stats_present(output, stamp, refresh_nsec);
 
 	output->frame_time = *stamp;
 
-	timespec_add_nsec(&output->next_repaint, stamp, refresh_nsec);
-	timespec_add_msec(&output->next_repaint, &output->next_repaint,
-			  -compositor->repaint_msec);
+	timespec_add_nsec(&output->next_repaint, stamp,
+			  output->idle_refresh_throttled ?
+			  MAX(refresh_nsec, IDLE_REFRESH_VRR_NSEC) :
+			  refresh_nsec);
+	if (compositor->adaptive_repaint_window) {
+		if (presented_flags != WP_PRESENTATION_FEEDBACK_INVALID)
+			weston_output_update_repaint_window(output, stamp,
+							    refresh_nsec);
+		timespec_add_nsec(&output->next_repaint, &output->next_repaint,
+				  -output->repaint_window.window_nsec);
+	} else {
+		timespec_add_msec(&output->next_repaint, &output->next_repaint,
+				  -compositor->repaint_msec);
+	}
 	msec_rel = timespec_sub_to_msec(&output->next_repaint, &now);
 
 	if (msec_rel < -1000 || msec_rel > 1000) {
@@ -3043,9 +4392,35 @@ weston_output_finish_frame(struct weston_output *output,
 		}
 	}
 
+	/* With adaptive sync, the display waits for our next frame rather
+	 * than refreshing at a fixed rate, and a tearing client does not
+	 * wait for it at all, so there is no slot to aim at. */
+	if (output->repaint_immediate)
+		output->next_repaint = now;
+
 out:
 	output->repaint_status = REPAINT_SCHEDULED;
-	output_repaint_timer_arm(compositor);
+	output_repaint_timer_arm(output);
+}
+
+/** Repaint an output as soon as possible
+ *
+ * The repaint happens right away if the output is waiting for its repaint
+ * timer, or as soon as the frame in flight completes otherwise.
+ */
+static void
+weston_output_repaint_immediately(struct weston_output *output)
+{
+	struct weston_compositor *compositor = output->compositor;
+
+	output->repaint_immediate = true;
+
+	if (output->repaint_status != REPAINT_SCHEDULED)
+		return;
+
+	weston_compositor_read_presentation_clock(compositor,
+						  &output->next_repaint);
+	output_repaint_timer_arm(output);
 }
 
 static void
@@ -3068,11 +4443,15 @@ weston_layer_entry_insert(struct weston_layer_entry *list,
 {
 	wl_list_insert(&list->link, &entry->link);
 	entry->layer = list->layer;
+	if (entry->layer)
+		weston_compositor_view_list_changed(entry->layer->compositor);
 }
 
 WL_EXPORT void
 weston_layer_entry_remove(struct weston_layer_entry *entry)
 {
+	if (entry->layer)
+		weston_compositor_view_list_changed(entry->layer->compositor);
 	wl_list_remove(&entry->link);
 	wl_list_init(&entry->link);
 	entry->layer = NULL;
@@ -3095,6 +4474,33 @@ weston_layer_init(struct weston_layer *layer,
 	weston_layer_set_mask_infinite(layer);
 }
 
+static void
+weston_view_tree_add_bounding_box(struct weston_view *view,
+				  pixman_region32_t *region)
+{
+	struct weston_view *child;
+
+	pixman_region32_union(region, region, &view->transform.boundingbox);
+	wl_list_for_each(child, &view->geometry.child_list,
+			 geometry.parent_link)
+		weston_view_tree_add_bounding_box(child, region);
+}
+
+/* Showing, hiding or restacking a layer changes what is visible where its
+ * views and their sub-surfaces are, even though none of them changed. */
+static void
+weston_layer_damage(struct weston_layer *layer)
+{
+	struct weston_compositor *compositor = layer->compositor;
+	struct weston_view *view;
+
+	wl_list_for_each(view, &layer->view_list.link, layer_link.link) {
+		weston_view_tree_add_bounding_box(view,
+					&compositor->primary_plane.damage);
+		weston_view_schedule_repaint(view);
+	}
+}
+
 /** Sets the position of the layer in the layer list. The layer will be placed
  * below any layer with the same position value, if any.
  * This function is safe to call if the layer is already on the list, but the
@@ -3109,11 +4515,16 @@ weston_layer_set_position(struct weston_layer *layer,
 {
 	struct weston_layer *below;
 
+	if (wl_list_empty(&layer->link) || layer->position != position)
+		weston_layer_damage(layer);
+
 	wl_list_remove(&layer->link);
 
 	/* layer_list is ordered from top to bottom, the last layer being the
 	 * background with the smallest position value */
 
+	weston_compositor_view_list_changed(layer->compositor);
+
 	layer->position = position;
 	wl_list_for_each_reverse(below, &layer->compositor->layer_list, link) {
 		if (below->position >= layer->position) {
@@ -3132,6 +4543,10 @@ weston_layer_set_position(struct weston_layer *layer,
 WL_EXPORT void
 weston_layer_unset_position(struct weston_layer *layer)
 {
+	if (!wl_list_empty(&layer->link))
+		weston_layer_damage(layer);
+
+	weston_compositor_view_list_changed(layer->compositor);
 	wl_list_remove(&layer->link);
 	wl_list_init(&layer->link);
 }
@@ -3179,22 +4594,12 @@ weston_layer_mask_is_infinite(struct weston_layer *layer)
 /**
  * \ingroup output
  */
-WL_EXPORT void
-weston_output_schedule_repaint(struct weston_output *output)
+static void
+weston_output_start_repaint_loop(struct weston_output *output)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct wl_event_loop *loop;
 
-	if (compositor->state == WESTON_COMPOSITOR_SLEEPING ||
-	    compositor->state == WESTON_COMPOSITOR_OFFSCREEN)
-		return;
-
-	if (!output->repaint_needed)
-		TL_POINT(compositor, "core_repaint_req", TLP_OUTPUT(output), TLP_END);
-
-	loop = wl_display_get_event_loop(compositor->wl_display);
-	output->repaint_needed = true;
-
 	/* If we already have a repaint scheduled for our idle handler,
 	 * no need to set it again. If the repaint has been called but
 	 * not finished, then weston_output_finish_frame() will notice
@@ -3202,6 +4607,7 @@ weston_output_schedule_repaint(struct weston_output *output)
 	if (output->repaint_status != REPAINT_NOT_SCHEDULED)
 		return;
 
+	loop = wl_display_get_event_loop(compositor->wl_display);
 	output->repaint_status = REPAINT_BEGIN_FROM_IDLE;
 	assert(!output->idle_repaint_source);
 	output->idle_repaint_source = wl_event_loop_add_idle(loop, idle_repaint,
@@ -3209,6 +4615,49 @@ weston_output_schedule_repaint(struct weston_output *output)
 	TL_POINT(compositor, "core_repaint_enter_loop", TLP_OUTPUT(output), TLP_END);
 }
 
+WL_EXPORT void
+weston_output_schedule_repaint(struct weston_output *output)
+{
+	struct weston_compositor *compositor = output->compositor;
+
+	if (compositor->state == WESTON_COMPOSITOR_SLEEPING ||
+	    compositor->state == WESTON_COMPOSITOR_OFFSCREEN)
+		return;
+
+	if (compositor->changes_depth > 0) {
+		output->repaint_needed = true;
+		output->repaint_deferred = true;
+		return;
+	}
+
+	if (!output->repaint_needed)
+		TL_POINT(compositor, "core_repaint_req", TLP_OUTPUT(output), TLP_END);
+
+	output->repaint_needed = true;
+	weston_output_start_repaint_loop(output);
+}
+
+/** Schedule moving the cursor plane of an output
+ *
+ * A pending full repaint covers the cursor plane already, otherwise the next
+ * repaint cycle only calls weston_output::repaint_cursor.
+ */
+static void
+weston_output_schedule_cursor_repaint(struct weston_output *output)
+{
+	struct weston_compositor *compositor = output->compositor;
+
+	if (compositor->state == WESTON_COMPOSITOR_SLEEPING ||
+	    compositor->state == WESTON_COMPOSITOR_OFFSCREEN)
+		return;
+
+	if (output->repaint_needed)
+		return;
+
+	output->cursor_repaint_needed = true;
+	weston_output_start_repaint_loop(output);
+}
+
 /** weston_compositor_schedule_repaint
  *  \ingroup compositor
  */
@@ -3221,6 +4670,59 @@ weston_compositor_schedule_repaint(struct weston_compositor *compositor)
 		weston_output_schedule_repaint(output);
 }
 
+/** Start batching scene changes
+ *
+ * \param compositor The compositor.
+ *
+ * Until the matching weston_compositor_commit_changes(), repaints are only
+ * recorded, and views whose geometry is updated keep the damage of their
+ * previous position pending instead of adding it to their plane right away.
+ * A shell rearranging many views, for a workspace switch or a new output
+ * layout, then schedules each output once and each view is damaged once,
+ * from where it was last painted to where it ends up, whatever the number
+ * of intermediate moves.
+ *
+ * View geometry stays up to date: weston_view_update_transform() still
+ * computes transforms and output assignments on demand.
+ *
+ * Calls nest; only the outermost commit applies the changes.
+ *
+ * \ingroup compositor
+ */
+WL_EXPORT void
+weston_compositor_begin_changes(struct weston_compositor *compositor)
+{
+	compositor->changes_depth++;
+}
+
+/** Apply the scene changes batched since weston_compositor_begin_changes()
+ *
+ * \param compositor The compositor.
+ *
+ * Schedules a repaint of the outputs that asked for one in the meantime.
+ * The pending damage of moved views is added when the repaint builds the
+ * view list.
+ *
+ * \ingroup compositor
+ */
+WL_EXPORT void
+weston_compositor_commit_changes(struct weston_compositor *compositor)
+{
+	struct weston_output *output;
+
+	assert(compositor->changes_depth > 0);
+	if (--compositor->changes_depth > 0)
+		return;
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		if (!output->repaint_deferred)
+			continue;
+
+		output->repaint_deferred = false;
+		weston_output_schedule_repaint(output);
+	}
+}
+
 static void
 surface_destroy(struct wl_client *client, struct wl_resource *resource)
 {
@@ -3288,7 +4790,7 @@ destroy_frame_callback(struct wl_resource *resource)
 	struct weston_frame_callback *cb = wl_resource_get_user_data(resource);
 
 	wl_list_remove(&cb->link);
-	free(cb);
+	weston_object_pool_free(cb);
 }
 
 static void
@@ -3298,7 +4800,7 @@ surface_frame(struct wl_client *client,
 	struct weston_frame_callback *cb;
 	struct weston_surface *surface = wl_resource_get_user_data(resource);
 
-	cb = malloc(sizeof *cb);
+	cb = weston_object_pool_alloc(surface->compositor->frame_callback_pool);
 	if (cb == NULL) {
 		wl_resource_post_no_memory(resource);
 		return;
@@ -3307,7 +4809,7 @@ surface_frame(struct wl_client *client,
 	cb->resource = wl_resource_create(client, &wl_callback_interface, 1,
 					  callback);
 	if (cb->resource == NULL) {
-		free(cb);
+		weston_object_pool_free(cb);
 		wl_resource_post_no_memory(resource);
 		return;
 	}
@@ -3333,6 +4835,7 @@ surface_set_opaque_region(struct wl_client *client,
 	} else {
 		pixman_region32_clear(&surface->pending.opaque);
 	}
+	surface->pending.opaque_changed = true;
 }
 
 static void
@@ -3351,6 +4854,7 @@ surface_set_input_region(struct wl_client *client,
 		pixman_region32_fini(&surface->pending.input);
 		region_init_infinite(&surface->pending.input);
 	}
+	surface->pending.input_changed = true;
 }
 
 /* Cause damage to this sub-surface and all its children.
@@ -3371,11 +4875,30 @@ weston_surface_damage_subsurfaces(struct weston_subsurface *sub)
 			weston_surface_damage_subsurfaces(child);
 }
 
+static bool
+weston_surface_subsurface_order_changed(struct weston_surface *surface)
+{
+	struct wl_list *current = surface->subsurface_list.next;
+	struct weston_subsurface *sub;
+
+	wl_list_for_each(sub, &surface->subsurface_list_pending,
+			 parent_link_pending) {
+		if (current != &sub->parent_link)
+			return true;
+		current = current->next;
+	}
+
+	return current != &surface->subsurface_list;
+}
+
 static void
 weston_surface_commit_subsurface_order(struct weston_surface *surface)
 {
 	struct weston_subsurface *sub;
 
+	if (weston_surface_subsurface_order_changed(surface))
+		weston_compositor_view_list_changed(surface->compositor);
+
 	wl_list_for_each_reverse(sub, &surface->subsurface_list_pending,
 				 parent_link_pending) {
 		wl_list_remove(&sub->parent_link);
@@ -3581,6 +5104,8 @@ apply_damage_buffer(pixman_region32_t *dest,
 	}
 	/* We should clear this on commit even if there was no buffer */
 	pixman_region32_clear(&state->damage_buffer);
+
+	weston_region_simplify(dest, surface->compositor->damage_max_rects);
 }
 
 static void
@@ -3609,12 +5134,82 @@ weston_surface_set_protection_mode(struct weston_surface *surface,
 	}
 }
 
+/* Hand the new SHM content to the renderer right away and drop the core
+ * buffer reference, so that the client gets the buffer back without waiting
+ * for a repaint. Damage stays pending for the repaint itself. */
+static void
+weston_surface_release_shm_early(struct weston_surface *surface)
+{
+	struct weston_compositor *ec = surface->compositor;
+	struct weston_buffer *buffer = surface->buffer_ref.buffer;
+
+	if (!ec->shm_release_after_upload || surface->keep_buffer)
+		return;
+
+	if (!buffer || !wl_shm_buffer_get(buffer->resource))
+		return;
+
+	/* The content of unmapped and hidden surfaces will not be shown any
+	 * time soon, no need to copy it yet. */
+	if (!weston_surface_is_mapped(surface) ||
+	    weston_surface_is_occluded(surface))
+		return;
+
+	ec->renderer->flush_damage(surface);
+
+	weston_buffer_reference(&surface->buffer_ref, NULL);
+	weston_buffer_release_reference(&surface->buffer_release_ref, NULL);
+}
+
+/* Intervals longer than this all count as static content */
+#define SURFACE_BUFFER_INTERVAL_MAX_MSEC 1000
+
+static void
+weston_surface_track_buffer_interval(struct weston_surface *surface)
+{
+	struct timespec now;
+	int64_t msec;
+
+	weston_compositor_read_presentation_clock(surface->compositor, &now);
+
+	if (timespec_is_zero(&surface->buffer_time)) {
+		surface->buffer_interval_msec = SURFACE_BUFFER_INTERVAL_MAX_MSEC;
+	} else {
+		msec = timespec_sub_to_msec(&now, &surface->buffer_time);
+		msec = MAX(1, MIN(msec, SURFACE_BUFFER_INTERVAL_MAX_MSEC));
+		surface->buffer_interval_msec =
+			(3 * surface->buffer_interval_msec + msec) / 4;
+	}
+
+	surface->buffer_time = now;
+}
+
+/* Exchange two regions without copying their rectangles */
+static void
+region_swap(pixman_region32_t *a, pixman_region32_t *b)
+{
+	pixman_region32_t tmp = *a;
+
+	*a = *b;
+	*b = tmp;
+}
+
+static void
+weston_surface_update_memory(struct weston_surface *surface)
+{
+	struct weston_subsurface *sub = weston_surface_to_subsurface(surface);
+
+	weston_surface_memory_update(surface,
+				     sub ? sub->cached_buffer_ref.buffer : NULL);
+}
+
 static void
 weston_surface_commit_state(struct weston_surface *surface,
 			    struct weston_surface_state *state)
 {
 	struct weston_view *view;
 	pixman_region32_t opaque;
+	pixman_region32_t input;
 
 	/* wl_surface.set_buffer_transform */
 	/* wl_surface.set_buffer_scale */
@@ -3631,6 +5226,11 @@ weston_surface_commit_state(struct weston_surface *surface,
 		weston_buffer_release_move(&surface->buffer_release_ref,
 					   &state->buffer_release_ref);
 		weston_surface_attach(surface, state->buffer);
+		if (state->buffer) {
+			weston_surface_track_buffer_interval(surface);
+			weston_surface_stats_commit(surface);
+		}
+		weston_surface_update_memory(surface);
 	}
 	weston_surface_state_set_buffer(state, NULL);
 	assert(state->acquire_fence_fd == -1);
@@ -3657,8 +5257,11 @@ weston_surface_commit_state(struct weston_surface *surface,
 	     pixman_region32_not_empty(&state->damage_buffer))
 		TL_POINT(surface->compositor, "core_commit_damage", TLP_SURFACE(surface), TLP_END);
 
-	pixman_region32_union(&surface->damage, &surface->damage,
-			      &state->damage_surface);
+	if (pixman_region32_not_empty(&surface->damage))
+		pixman_region32_union(&surface->damage, &surface->damage,
+				      &state->damage_surface);
+	else
+		region_swap(&surface->damage, &state->damage_surface);
 
 	apply_damage_buffer(&surface->damage, surface, state);
 
@@ -3680,8 +5283,14 @@ weston_surface_commit_state(struct weston_surface *surface,
 	pixman_region32_fini(&opaque);
 
 	/* wl_surface.set_input_region */
-	pixman_region32_intersect_rect(&surface->input, &state->input,
+	pixman_region32_init(&input);
+	pixman_region32_intersect_rect(&input, &state->input,
 				       0, 0, surface->width, surface->height);
+	if (!pixman_region32_equal(&input, &surface->input)) {
+		pixman_region32_copy(&surface->input, &input);
+		surface->compositor->repick_needed = true;
+	}
+	pixman_region32_fini(&input);
 
 	/* wl_surface.frame */
 	wl_list_insert_list(&surface->frame_callback_list,
@@ -3706,7 +5315,38 @@ weston_surface_commit_state(struct weston_surface *surface,
 	/* weston_protected_surface.set_type */
 	weston_surface_set_desired_protection(surface, state->desired_protection);
 
+	/* weston_tearing_control_v1.set_presentation_hint */
+	surface->allow_tearing = state->allow_tearing;
+	surface->yuv_coefficients = state->yuv_coefficients;
+	surface->yuv_range = state->yuv_range;
+	/* weston_content_type_v1.set_content_type */
+	surface->content_type = state->content_type;
+
 	wl_signal_emit(&surface->commit_signal, surface);
+
+	weston_surface_release_shm_early(surface);
+}
+
+/* A fullscreen client on an adaptive sync output sets the refresh rate by the
+ * pace of its commits, and one accepting tearing wants them on screen as soon
+ * as possible. */
+static void
+weston_surface_repaint_outputs_immediately(struct weston_surface *surface)
+{
+	struct weston_view *view;
+
+	wl_list_for_each(view, &surface->views, surface_link) {
+		struct weston_output *output = view->output;
+
+		if (!output ||
+		    (!output->vrr_enabled && !surface->allow_tearing) ||
+		    !output->repaint_needed ||
+		    !weston_view_is_mapped(view) ||
+		    !weston_view_matches_output_entirely(view, output))
+			continue;
+
+		weston_output_repaint_immediately(output);
+	}
 }
 
 static void
@@ -3717,6 +5357,8 @@ weston_surface_commit(struct weston_surface *surface)
 	weston_surface_commit_subsurface_order(surface);
 
 	weston_surface_schedule_repaint(surface);
+
+	weston_surface_repaint_outputs_immediately(surface);
 }
 
 static void
@@ -3726,12 +5368,226 @@ static void
 weston_subsurface_parent_commit(struct weston_subsurface *sub,
 				int parent_is_synchronized);
 
+/* Move the pending state into a new entry at the end of the commit queue,
+ * much like weston_subsurface_commit_to_cache() does into an empty cache.
+ * Buffer damage stays in buffer coordinates, because the buffer transform
+ * may change before the entry is applied. */
+static bool
+weston_surface_queue_pending(struct weston_surface *surface)
+{
+	struct weston_surface_state *pending = &surface->pending;
+	struct weston_commit_queue_entry *entry;
+	struct weston_surface_state *state;
+
+	entry = zalloc(sizeof *entry);
+	if (!entry)
+		return false;
+
+	state = &entry->state;
+	weston_surface_state_init(state);
+
+	region_swap(&state->damage_surface, &pending->damage_surface);
+	region_swap(&state->damage_buffer, &pending->damage_buffer);
+
+	if (pending->newly_attached) {
+		state->newly_attached = 1;
+		weston_surface_state_set_buffer(state, pending->buffer);
+		weston_buffer_reference(&entry->buffer_ref, pending->buffer);
+		/* zwp_surface_synchronization_v1.set_acquire_fence */
+		fd_move(&state->acquire_fence_fd, &pending->acquire_fence_fd);
+		/* zwp_surface_synchronization_v1.get_release */
+		weston_buffer_release_move(&state->buffer_release_ref,
+					   &pending->buffer_release_ref);
+	}
+	state->sx = pending->sx;
+	state->sy = pending->sy;
+	state->buffer_viewport = pending->buffer_viewport;
+	weston_surface_reset_pending_buffer(surface);
+
+	/* Opaque and input regions stay set in the pending state. */
+	pixman_region32_copy(&state->opaque, &pending->opaque);
+	pixman_region32_copy(&state->input, &pending->input);
+
+	wl_list_insert_list(&state->frame_callback_list,
+			    &pending->frame_callback_list);
+	wl_list_init(&pending->frame_callback_list);
+
+	wl_list_insert_list(&state->feedback_list, &pending->feedback_list);
+	wl_list_init(&pending->feedback_list);
+
+	state->desired_protection = pending->desired_protection;
+	state->protection_mode = pending->protection_mode;
+	state->allow_tearing = pending->allow_tearing;
+	state->yuv_coefficients = pending->yuv_coefficients;
+	state->yuv_range = pending->yuv_range;
+	state->content_type = pending->content_type;
+
+	/* weston_commit_timer_v1.set_target_time is not sticky */
+	state->has_target_time = pending->has_target_time;
+	state->target_time = pending->target_time;
+	pending->has_target_time = false;
+
+	if (wl_list_empty(&surface->commit_queue))
+		wl_list_insert(surface->compositor->commit_queue_list.prev,
+			       &surface->commit_queue_link);
+	wl_list_insert(surface->commit_queue.prev, &entry->link);
+
+	return true;
+}
+
+/* Whether the GPU is done with a newly attached buffer: its explicit acquire
+ * fence, or else the implicit fences of its dmabuf, have signalled. Other
+ * buffers have nothing to wait for. */
+static bool
+weston_surface_state_buffer_ready(struct weston_surface_state *state)
+{
+	struct linux_dmabuf_buffer *dmabuf;
+	struct pollfd pfd[MAX_DMABUF_PLANES];
+	int i, n = 0;
+
+	if (!state->newly_attached || !state->buffer ||
+	    !state->buffer->resource)
+		return true;
+
+	if (state->acquire_fence_fd >= 0) {
+		pfd[n++].fd = state->acquire_fence_fd;
+	} else {
+		dmabuf = linux_dmabuf_buffer_get(state->buffer->resource);
+		if (!dmabuf)
+			return true;
+
+		/* A dmabuf polls readable once its writers are done. */
+		for (i = 0; i < dmabuf->attributes.n_planes; i++)
+			pfd[n++].fd = dmabuf->attributes.fd[i];
+	}
+
+	for (i = 0; i < n; i++)
+		pfd[i].events = POLLIN;
+
+	if (poll(pfd, n, 0) < 0)
+		return true;
+
+	for (i = 0; i < n; i++) {
+		if (!(pfd[i].revents & (POLLIN | POLLERR | POLLNVAL)))
+			return false;
+	}
+
+	return true;
+}
+
+/* Apply the queued states, in order, up to the last one whose target time
+ * is not after 'deadline', or all of them when it is NULL. With a deadline,
+ * states whose buffer the GPU is still rendering to wait for a later frame,
+ * unless a later state replaces the buffer with one that is ready: a slow
+ * client keeps showing its previous buffer rather than stalling the output.
+ * Returns whether states are left waiting. */
+static bool
+weston_surface_latch_commit_queue(struct weston_surface *surface,
+				  const struct timespec *deadline)
+{
+	struct weston_commit_queue_entry *entry, *next, *last = NULL;
+	struct weston_subsurface *sub;
+	bool ready = true;
+
+	wl_list_for_each(entry, &surface->commit_queue, link) {
+		if (deadline && entry->state.has_target_time &&
+		    timespec_sub_to_nsec(&entry->state.target_time,
+					 deadline) > 0)
+			break;
+
+		if (!deadline)
+			ready = true;
+		else if (entry->state.newly_attached)
+			ready = weston_surface_state_buffer_ready(&entry->state);
+
+		if (ready)
+			last = entry;
+	}
+
+	wl_list_for_each_safe(entry, next, &surface->commit_queue, link) {
+		if (!last)
+			break;
+
+		weston_surface_commit_state(surface, &entry->state);
+		weston_surface_commit_subsurface_order(surface);
+		weston_surface_schedule_repaint(surface);
+
+		wl_list_for_each(sub, &surface->subsurface_list, parent_link) {
+			if (sub->surface != surface)
+				weston_subsurface_parent_commit(sub, 0);
+		}
+
+		if (entry == last)
+			last = NULL;
+		weston_commit_queue_entry_destroy(entry);
+	}
+
+	if (!wl_list_empty(&surface->commit_queue))
+		return true;
+
+	wl_list_remove(&surface->commit_queue_link);
+	wl_list_init(&surface->commit_queue_link);
+
+	return false;
+}
+
+/** Apply the queued commits due for the frame being repainted
+ *
+ * The frame is shown at the first refresh of the output after the start of
+ * the repaint, and a target time is due when that refresh is the one closest
+ * to it. Returns whether commits are left waiting for later frames.
+ */
+static bool
+weston_output_latch_commit_queues(struct weston_output *output)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct weston_surface *surface, *next;
+	int64_t refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
+	int64_t elapsed;
+	struct timespec deadline = output->repaint_window.begin;
+	struct timespec begin;
+	bool waiting = false;
+
+	if (wl_list_empty(&ec->commit_queue_list))
+		return false;
+
+	elapsed = timespec_sub_to_nsec(&output->repaint_window.begin,
+				       &output->frame_time);
+	if (refresh_nsec > 0 && elapsed >= 0)
+		timespec_add_nsec(&deadline, &output->frame_time,
+				  (elapsed / refresh_nsec + 1) * refresh_nsec +
+				  refresh_nsec / 2);
+
+	wl_list_for_each_safe(surface, next, &ec->commit_queue_list,
+			      commit_queue_link) {
+		if (surface->output && surface->output != output)
+			continue;
+
+		weston_surface_cpu_begin(&begin);
+
+		/* Surfaces on no output have no refresh to wait for. */
+		if (!surface->output)
+			weston_surface_latch_commit_queue(surface, NULL);
+		else
+			waiting |= weston_surface_latch_commit_queue(surface,
+								     &deadline);
+
+		weston_surface_cpu_end(surface, WESTON_CLIENT_CPU_COMMIT,
+				       &begin);
+	}
+
+	return waiting;
+}
+
 static void
-surface_commit(struct wl_client *client, struct wl_resource *resource)
+surface_commit_request(struct weston_surface *surface,
+		       struct wl_resource *resource)
 {
-	struct weston_surface *surface = wl_resource_get_user_data(resource);
 	struct weston_subsurface *sub = weston_surface_to_subsurface(surface);
 
+	WESTON_TRACE2(surface_commit, wl_resource_get_id(resource),
+		      surface->pending.newly_attached);
+
 	if (!weston_surface_is_pending_viewport_source_valid(surface)) {
 		assert(surface->viewport_resource);
 
@@ -3793,10 +5649,26 @@ surface_commit(struct wl_client *client, struct wl_resource *resource)
 	}
 
 	if (sub) {
+		/* Commit timers have no effect on sub-surfaces. */
+		surface->pending.has_target_time = false;
 		weston_subsurface_commit(sub);
 		return;
 	}
 
+	/* Commits behind queued ones are queued too, to keep their order.
+	 * So are buffers still being rendered to, to be latched by the first
+	 * repaint that finds them ready. */
+	if (!surface->output)
+		weston_surface_latch_commit_queue(surface, NULL);
+	if ((surface->pending.has_target_time ||
+	     !wl_list_empty(&surface->commit_queue) ||
+	     !weston_surface_state_buffer_ready(&surface->pending)) &&
+	    surface->output && weston_surface_queue_pending(surface)) {
+		weston_surface_schedule_repaint(surface);
+		return;
+	}
+
+	surface->pending.has_target_time = false;
 	weston_surface_commit(surface);
 
 	wl_list_for_each(sub, &surface->subsurface_list, parent_link) {
@@ -3805,6 +5677,17 @@ surface_commit(struct wl_client *client, struct wl_resource *resource)
 	}
 }
 
+static void
+surface_commit(struct wl_client *client, struct wl_resource *resource)
+{
+	struct weston_surface *surface = wl_resource_get_user_data(resource);
+	struct timespec begin;
+
+	weston_surface_cpu_begin(&begin);
+	surface_commit_request(surface, resource);
+	weston_surface_cpu_end(surface, WESTON_CLIENT_CPU_COMMIT, &begin);
+}
+
 static void
 surface_set_buffer_transform(struct wl_client *client,
 			     struct wl_resource *resource, int transform)
@@ -3890,7 +5773,7 @@ destroy_region(struct wl_resource *resource)
 	struct weston_region *region = wl_resource_get_user_data(resource);
 
 	pixman_region32_fini(&region->region);
-	free(region);
+	weston_object_pool_free(region);
 }
 
 static void
@@ -3931,9 +5814,10 @@ static void
 compositor_create_region(struct wl_client *client,
 			 struct wl_resource *resource, uint32_t id)
 {
+	struct weston_compositor *ec = wl_resource_get_user_data(resource);
 	struct weston_region *region;
 
-	region = malloc(sizeof *region);
+	region = weston_object_pool_alloc(ec->region_pool);
 	if (region == NULL) {
 		wl_resource_post_no_memory(resource);
 		return;
@@ -3944,7 +5828,7 @@ compositor_create_region(struct wl_client *client,
 	region->resource =
 		wl_resource_create(client, &wl_region_interface, 1, id);
 	if (region->resource == NULL) {
-		free(region);
+		weston_object_pool_free(region);
 		wl_resource_post_no_memory(resource);
 		return;
 	}
@@ -3964,6 +5848,7 @@ weston_subsurface_commit_from_cache(struct weston_subsurface *sub)
 
 	weston_surface_commit_state(surface, &sub->cached);
 	weston_buffer_reference(&sub->cached_buffer_ref, NULL);
+	weston_surface_update_memory(surface);
 
 	weston_surface_commit_subsurface_order(surface);
 
@@ -3977,18 +5862,26 @@ weston_subsurface_commit_to_cache(struct weston_subsurface *sub)
 {
 	struct weston_surface *surface = sub->surface;
 
-	/*
-	 * If this commit would cause the surface to move by the
-	 * attach(dx, dy) parameters, the old damage region must be
-	 * translated to correspond to the new surface coordinate system
-	 * origin.
-	 */
-	pixman_region32_translate(&sub->cached.damage_surface,
-				  -surface->pending.sx, -surface->pending.sy);
-	pixman_region32_union(&sub->cached.damage_surface,
-			      &sub->cached.damage_surface,
-			      &surface->pending.damage_surface);
-	pixman_region32_clear(&surface->pending.damage_surface);
+	if (!sub->has_cached_data) {
+		/* The cached damage was cleared when the cache was last
+		 * committed, take over the pending damage as it is. */
+		region_swap(&sub->cached.damage_surface,
+			    &surface->pending.damage_surface);
+	} else {
+		/*
+		 * If this commit would cause the surface to move by the
+		 * attach(dx, dy) parameters, the old damage region must be
+		 * translated to correspond to the new surface coordinate
+		 * system origin.
+		 */
+		pixman_region32_translate(&sub->cached.damage_surface,
+					  -surface->pending.sx,
+					  -surface->pending.sy);
+		pixman_region32_union(&sub->cached.damage_surface,
+				      &sub->cached.damage_surface,
+				      &surface->pending.damage_surface);
+		pixman_region32_clear(&surface->pending.damage_surface);
+	}
 
 	if (surface->pending.newly_attached) {
 		sub->cached.newly_attached = 1;
@@ -3996,6 +5889,8 @@ weston_subsurface_commit_to_cache(struct weston_subsurface *sub)
 						surface->pending.buffer);
 		weston_buffer_reference(&sub->cached_buffer_ref,
 					surface->pending.buffer);
+		weston_surface_memory_update(surface,
+					     sub->cached_buffer_ref.buffer);
 		weston_presentation_feedback_discard_list(
 					&sub->cached.feedback_list);
 		/* zwp_surface_synchronization_v1.set_acquire_fence */
@@ -4007,6 +5902,10 @@ weston_subsurface_commit_to_cache(struct weston_subsurface *sub)
 	}
 	sub->cached.desired_protection = surface->pending.desired_protection;
 	sub->cached.protection_mode = surface->pending.protection_mode;
+	sub->cached.allow_tearing = surface->pending.allow_tearing;
+	sub->cached.yuv_coefficients = surface->pending.yuv_coefficients;
+	sub->cached.yuv_range = surface->pending.yuv_range;
+	sub->cached.content_type = surface->pending.content_type;
 	assert(surface->pending.acquire_fence_fd == -1);
 	assert(surface->pending.buffer_release_ref.buffer_release == NULL);
 	sub->cached.sx += surface->pending.sx;
@@ -4023,9 +5922,19 @@ weston_subsurface_commit_to_cache(struct weston_subsurface *sub)
 
 	weston_surface_reset_pending_buffer(surface);
 
-	pixman_region32_copy(&sub->cached.opaque, &surface->pending.opaque);
+	/* Opaque and input regions stay set in the pending state, so the
+	 * cache only needs them again after the client set new ones. */
+	if (surface->pending.opaque_changed) {
+		pixman_region32_copy(&sub->cached.opaque,
+				     &surface->pending.opaque);
+		surface->pending.opaque_changed = false;
+	}
 
-	pixman_region32_copy(&sub->cached.input, &surface->pending.input);
+	if (surface->pending.input_changed) {
+		pixman_region32_copy(&sub->cached.input,
+				     &surface->pending.input);
+		surface->pending.input_changed = false;
+	}
 
 	wl_list_insert_list(&sub->cached.frame_callback_list,
 			    &surface->pending.frame_callback_list);
@@ -4141,6 +6050,7 @@ subsurface_committed(struct weston_surface *surface, int32_t dx, int32_t dy)
 
 	if (!weston_surface_is_mapped(surface)) {
 		surface->is_mapped = true;
+		weston_compositor_view_list_changed(surface->compositor);
 
 		/* Cannot call weston_view_update_transform(),
 		 * because that would call it also for the parent surface,
@@ -4207,6 +6117,22 @@ weston_surface_get_role(struct weston_surface *surface)
 	return surface->role_name;
 }
 
+/** Limit the rate of frame callbacks of a surface
+ *
+ * \param surface The surface to throttle.
+ * \param msec The minimum interval between frame callbacks, or 0 to send
+ * them every time the surface is repainted.
+ *
+ * For shells to slow down clients whose content matters less for a while,
+ * like windows shown as small thumbnails.
+ */
+WL_EXPORT void
+weston_surface_set_frame_interval(struct weston_surface *surface,
+				  int32_t msec)
+{
+	surface->frame_interval_msec = MAX(msec, 0);
+}
+
 WL_EXPORT void
 weston_surface_set_label_func(struct weston_surface *surface,
 			      int (*desc)(struct weston_surface *,
@@ -4479,6 +6405,7 @@ subsurface_set_desync(struct wl_client *client, struct wl_resource *resource)
 static void
 weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 {
+	weston_compositor_view_list_changed(sub->surface->compositor);
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
@@ -4545,6 +6472,8 @@ weston_subsurface_link_parent(struct weston_subsurface *sub,
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
+
+	weston_compositor_view_list_changed(parent->compositor);
 }
 
 static void
@@ -4762,6 +6691,35 @@ weston_compositor_dpms(struct weston_compositor *compositor,
 			output->set_dpms(output, state);
 }
 
+/* Animations only advance when their output is repainted. Once outputs
+ * stop being repainted, run the animations to their end rather than leave
+ * them frozen half way, e.g. a window that was fading in half transparent.
+ */
+static void
+weston_compositor_finish_animations(struct weston_compositor *compositor)
+{
+	struct weston_animation *animation, *next;
+	struct weston_output *output;
+	struct timespec time;
+	int i;
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		time = output->frame_time;
+
+		/* Springs are limited to one second of progress per update,
+		 * give up on animations still running after a few. */
+		for (i = 0; i < 10 && !wl_list_empty(&output->animation_list);
+		     i++) {
+			timespec_add_msec(&time, &time, 990);
+			wl_list_for_each_safe(animation, next,
+					      &output->animation_list, link) {
+				animation->frame_counter++;
+				animation->frame(animation, output, &time);
+			}
+		}
+	}
+}
+
 /** Restores the compositor to active status
  *
  * \param compositor The compositor instance
@@ -4778,6 +6736,12 @@ WL_EXPORT void
 weston_compositor_wake(struct weston_compositor *compositor)
 {
 	uint32_t old_state = compositor->state;
+	struct weston_output *output;
+	struct timespec now;
+
+	weston_compositor_read_presentation_clock(compositor, &now);
+	wl_list_for_each(output, &compositor->output_list, link)
+		weston_output_idle_refresh_activity(output, &now);
 
 	/* The state needs to be changed before emitting the wake
 	 * signal because that may try to schedule a repaint which
@@ -4786,8 +6750,13 @@ weston_compositor_wake(struct weston_compositor *compositor)
 
 	switch (old_state) {
 	case WESTON_COMPOSITOR_SLEEPING:
-	case WESTON_COMPOSITOR_IDLE:
 	case WESTON_COMPOSITOR_OFFSCREEN:
+		/* Caches released on the way down are rebuilt by the
+		 * first repaint, report how long that takes. */
+		if (compositor->trim_memory_on_sleep)
+			compositor->wake_time = now;
+		/* fall through */
+	case WESTON_COMPOSITOR_IDLE:
 		weston_compositor_dpms(compositor, WESTON_DPMS_ON);
 		wl_signal_emit(&compositor->wake_signal, compositor);
 		/* fall through */
@@ -4797,6 +6766,31 @@ weston_compositor_wake(struct weston_compositor *compositor)
 	}
 }
 
+/* Gives back what the renderer, the backend and the C library keep
+ * around for drawing, after the outputs stopped. */
+static void
+weston_compositor_trim_memory(struct weston_compositor *compositor)
+{
+	struct weston_renderer *renderer = compositor->renderer;
+	size_t released = 0;
+
+	if (!compositor->trim_memory_on_sleep)
+		return;
+
+	if (renderer && renderer->trim_memory)
+		released = renderer->trim_memory(compositor);
+
+	if (compositor->backend->trim_memory)
+		compositor->backend->trim_memory(compositor);
+
+#ifdef HAVE_MALLOC_TRIM
+	malloc_trim(0);
+#endif
+
+	weston_log("trimmed memory for sleep, %zu KiB of textures released\n",
+		   released / 1024);
+}
+
 /** Turns off rendering and frame events for the compositor.
  *
  * \param compositor The compositor instance
@@ -4818,6 +6812,8 @@ weston_compositor_offscreen(struct weston_compositor *compositor)
 	default:
 		compositor->state = WESTON_COMPOSITOR_OFFSCREEN;
 		wl_event_source_timer_update(compositor->idle_source, 0);
+		weston_compositor_finish_animations(compositor);
+		weston_compositor_trim_memory(compositor);
 	}
 }
 
@@ -4829,7 +6825,8 @@ weston_compositor_offscreen(struct weston_compositor *compositor)
  * sent.  Only powers down the outputs if the compositor is not already
  * in sleep mode.
  *
- * Stops the idle timer.
+ * Stops the idle timer. With weston_compositor::trim_memory_on_sleep set,
+ * renderer and backend caches are released as well.
  *
  * \ingroup compositor
  */
@@ -4842,6 +6839,8 @@ weston_compositor_sleep(struct weston_compositor *compositor)
 	wl_event_source_timer_update(compositor->idle_source, 0);
 	compositor->state = WESTON_COMPOSITOR_SLEEPING;
 	weston_compositor_dpms(compositor, WESTON_DPMS_OFF);
+	weston_compositor_finish_animations(compositor);
+	weston_compositor_trim_memory(compositor);
 }
 
 /** Sets compositor to idle mode
@@ -5584,6 +7583,20 @@ weston_head_set_connection_status(struct weston_head *head, bool connected)
 	weston_head_set_device_changed(head);
 }
 
+/* Only views asking for protection are drawn differently when the
+ * protection of the output changes, see the censoring in the renderers. */
+static void
+weston_output_damage_protected_views(struct weston_output *output)
+{
+	struct weston_view *view;
+
+	wl_list_for_each(view, &output->compositor->view_list, link) {
+		if ((view->output_mask & (1u << output->id)) &&
+		    view->surface->desired_protection > WESTON_HDCP_DISABLE)
+			weston_view_damage_below(view);
+	}
+}
+
 static void
 weston_output_compute_protection(struct weston_output *output)
 {
@@ -5606,7 +7619,7 @@ weston_output_compute_protection(struct weston_output *output)
 
 	if (output->current_protection != op_protection) {
 		output->current_protection = op_protection;
-		weston_output_damage(output);
+		weston_output_damage_protected_views(output);
 		weston_schedule_surface_protection_update(wc);
 	}
 }
@@ -5834,6 +7847,7 @@ static void
 weston_output_update_matrix(struct weston_output *output)
 {
 	float magnification;
+	float scale;
 
 	weston_matrix_init(&output->matrix);
 	weston_matrix_translate(&output->matrix, -output->x, -output->y, 0);
@@ -5880,10 +7894,9 @@ weston_output_update_matrix(struct weston_output *output)
 		break;
 	}
 
-	if (output->current_scale != 1)
-		weston_matrix_scale(&output->matrix,
-				    output->current_scale,
-				    output->current_scale, 1);
+	scale = weston_output_get_scale_factor(output);
+	if (scale != 1.0f)
+		weston_matrix_scale(&output->matrix, scale, scale, 1);
 
 	output->dirty = 0;
 
@@ -5897,6 +7910,20 @@ weston_output_transform_scale_init(struct weston_output *output, uint32_t transf
 	output->native_scale = scale;
 	output->current_scale = scale;
 
+	if (output_has_fractional_scale(output)) {
+		convert_size_by_transform_scale(&output->width, &output->height,
+						output->current_mode->width,
+						output->current_mode->height,
+						transform, 1);
+		output->width = (output->width * 120 +
+				 output->fractional_scale / 2) /
+				output->fractional_scale;
+		output->height = (output->height * 120 +
+				  output->fractional_scale / 2) /
+				 output->fractional_scale;
+		return;
+	}
+
 	convert_size_by_transform_scale(&output->width, &output->height,
 					output->current_mode->width,
 					output->current_mode->height,
@@ -5913,6 +7940,7 @@ weston_output_init_geometry(struct weston_output *output, int x, int y)
 	pixman_region32_init_rect(&output->region, x, y,
 				  output->width,
 				  output->height);
+	output->compositor->output_layout_serial++;
 }
 
 /**
@@ -5998,15 +8026,23 @@ weston_compositor_add_output(struct weston_compositor *compositor,
 	output->id = ffs(~compositor->output_id_pool) - 1;
 	compositor->output_id_pool |= 1u << output->id;
 
+	memset(&output->repaint_window, 0, sizeof output->repaint_window);
+	output->repaint_window.pending_nsec = -1;
+	output->repaint_window.window_nsec =
+		MAX((int64_t)compositor->repaint_msec * 1000000,
+		    ADAPTIVE_REPAINT_WINDOW_MIN_NSEC);
+
 	wl_list_remove(&output->link);
 	wl_list_insert(compositor->output_list.prev, &output->link);
 	output->enabled = true;
+	compositor->output_layout_serial++;
 
 	wl_list_for_each(head, &output->head_list, output_link)
 		weston_head_add_global(head);
 
 	wl_signal_emit(&compositor->output_created_signal, output);
 
+	compositor->view_list_serial++;
 	wl_list_for_each_safe(view, next, &compositor->view_list, link)
 		weston_view_geometry_dirty(view);
 }
@@ -6080,6 +8116,8 @@ weston_compositor_remove_output(struct weston_output *output)
 	assert(output->destroying);
 	assert(output->enabled);
 
+	compositor->output_layout_serial++;
+
 	wl_list_for_each(view, &compositor->view_list, link) {
 		if (view->output_mask & (1u << output->id))
 			weston_view_assign_output(view);
@@ -6092,6 +8130,7 @@ weston_compositor_remove_output(struct weston_output *output)
 	wl_list_remove(&output->link);
 	wl_list_insert(compositor->pending_output_list.prev, &output->link);
 	output->enabled = false;
+	output_repaint_timer_disarm(output);
 
 	wl_signal_emit(&compositor->output_destroyed_signal, output);
 	wl_signal_emit(&output->destroy_signal, output);
@@ -6126,6 +8165,215 @@ weston_output_set_scale(struct weston_output *output,
 	output->scale = scale;
 }
 
+/** Sets a fractional scale for an output
+ *
+ * \param output The output to set the scale for.
+ * \param scale The scale in 1/120ths, e.g. 180 for 1.5.
+ *
+ * Instead of weston_output_set_scale(). The logical size of the output is
+ * its mode size divided by the scale. wl_output advertises the scale
+ * rounded up, clients of weston_fractional_scale_manager_v1 learn the
+ * exact one and can hand over buffers of the device pixel size through
+ * wp_viewport, which are then shown without resampling.
+ *
+ * \ingroup output
+ */
+WL_EXPORT void
+weston_output_set_fractional_scale(struct weston_output *output,
+				   uint32_t scale)
+{
+	assert(scale > 0);
+
+	weston_output_set_scale(output, (scale + 119) / 120);
+	output->fractional_scale = scale % 120 ? scale : 0;
+}
+
+/** The scale of an output in 1/120ths
+ *
+ * \param output The output.
+ * \return The fractional scale if one is in use, the integer scale times
+ * 120 otherwise.
+ *
+ * \ingroup output
+ */
+WL_EXPORT uint32_t
+weston_output_get_fractional_scale(struct weston_output *output)
+{
+	if (output_has_fractional_scale(output))
+		return output->fractional_scale;
+
+	return output->current_scale * 120;
+}
+
+/** The factor from logical to device pixels of an output
+ *
+ * \ingroup output
+ */
+WL_EXPORT float
+weston_output_get_scale_factor(struct weston_output *output)
+{
+	if (output_has_fractional_scale(output))
+		return output->fractional_scale / 120.0f;
+
+	return output->current_scale;
+}
+
+/** Whether a view shows its buffer pixels 1:1 on an output
+ *
+ * \param view The view.
+ * \param output The output the view is drawn on.
+ * \return True if the view is untransformed and its buffer, with the
+ * buffer scale and viewport applied, has the device pixel size of the
+ * view, so renderers need not filter.
+ *
+ * This lets clients drawing at a fractional scale through wp_viewport be
+ * shown without resampling.
+ */
+bool
+weston_view_matches_output_scale(struct weston_view *view,
+				 struct weston_output *output)
+{
+	struct weston_surface *surface = view->surface;
+	struct weston_buffer_viewport *vp = &surface->buffer_viewport;
+	float scale = weston_output_get_scale_factor(output);
+	float buffer_width, buffer_height;
+
+	if (view->transform.enabled || output->zoom.active)
+		return false;
+
+	if (vp->buffer.src_width != wl_fixed_from_int(-1)) {
+		buffer_width = wl_fixed_to_double(vp->buffer.src_width);
+		buffer_height = wl_fixed_to_double(vp->buffer.src_height);
+	} else {
+		buffer_width = surface->width_from_buffer;
+		buffer_height = surface->height_from_buffer;
+	}
+	buffer_width *= vp->buffer.scale;
+	buffer_height *= vp->buffer.scale;
+
+	/* Clients round the device size of odd logical sizes. */
+	return fabsf(buffer_width - surface->width * scale) <= 0.5f &&
+	       fabsf(buffer_height - surface->height * scale) <= 0.5f;
+}
+
+/** Sets the color transform applied to everything shown on an output
+ *
+ * \param output The output to set the color transform for.
+ * \param xform The color transform, or NULL to remove it. The data is copied.
+ * \return 0 on success, -1 if neither the backend nor the renderer can apply
+ * the transform.
+ *
+ * A transform with a matrix-shaper form is offered to the display hardware
+ * first, so that it costs no rendering. Otherwise the renderer applies the
+ * 3D LUT while compositing, and backends should keep views off overlay
+ * planes.
+ *
+ * \ingroup output
+ */
+WL_EXPORT int
+weston_output_set_color_transform(struct weston_output *output,
+				  const struct weston_color_transform *xform)
+{
+	struct weston_renderer *renderer = output->compositor->renderer;
+	int ret = 0;
+
+	if (xform && xform->curve_size > 0 && output->set_color_transform &&
+	    output->set_color_transform(output, xform) == 0) {
+		output->color_transform_in_hardware = true;
+		output->color_transform_in_renderer = false;
+		if (renderer->output_set_color_transform)
+			renderer->output_set_color_transform(output, NULL);
+		goto out;
+	}
+
+	if (output->color_transform_in_hardware) {
+		output->set_color_transform(output, NULL);
+		output->color_transform_in_hardware = false;
+	}
+
+	if (renderer->output_set_color_transform)
+		ret = renderer->output_set_color_transform(output, xform);
+	else if (xform)
+		ret = -1;
+	output->color_transform_in_renderer = xform && ret == 0;
+
+out:
+	weston_output_damage(output);
+
+	return ret;
+}
+
+/** Get the size the renderer draws the output at
+ *
+ * \param output The output.
+ * \param width Returns the width in buffer pixels.
+ * \param height Returns the height in buffer pixels.
+ *
+ * This is the current mode size, unless dynamic resolution lowered the
+ * render scale. The renderer then draws into the top-left corner of its
+ * buffer, and the backend scales that up to the whole mode.
+ *
+ * \ingroup output
+ */
+WL_EXPORT void
+weston_output_get_render_size(struct weston_output *output,
+			      int32_t *width, int32_t *height)
+{
+	int32_t w = output->current_mode->width;
+	int32_t h = output->current_mode->height;
+
+	if (output->render_scale < 1.0f) {
+		w = MAX(1, (int32_t) (w * output->render_scale + 0.5f));
+		h = MAX(1, (int32_t) (h * output->render_scale + 0.5f));
+	}
+
+	*width = w;
+	*height = h;
+}
+
+/** Lower the refresh rate of an output while nothing much happens on it
+ *
+ * \param output The weston_output object to configure.
+ * \param timeout_ms How long without input or substantial damage until
+ * the output switches to the lowest refresh rate mode of its size, 0 to
+ * disable.
+ *
+ * Outputs with adaptive sync keep their mode and only limit their repaints
+ * instead. Input or damage covering more than a small part of the output
+ * brings the full refresh rate back.
+ *
+ * \ingroup output
+ */
+WL_EXPORT void
+weston_output_set_idle_refresh(struct weston_output *output,
+			       uint32_t timeout_ms)
+{
+	struct wl_event_loop *loop;
+
+	output->idle_refresh_timeout_ms = timeout_ms;
+
+	if (timeout_ms == 0) {
+		if (output->idle_refresh_timer)
+			wl_event_source_remove(output->idle_refresh_timer);
+		output->idle_refresh_timer = NULL;
+		weston_output_idle_refresh_leave(output);
+		return;
+	}
+
+	if (!output->idle_refresh_timer) {
+		loop = wl_display_get_event_loop(output->compositor->wl_display);
+		output->idle_refresh_timer =
+			wl_event_loop_add_timer(loop, idle_refresh_handler,
+						output);
+		if (!output->idle_refresh_timer)
+			return;
+	}
+
+	weston_compositor_read_presentation_clock(output->compositor,
+					&output->idle_refresh_activity);
+	wl_event_source_timer_update(output->idle_refresh_timer, timeout_ms);
+}
+
 /** Sets the output transform for a given output.
  *
  * \param output    The weston_output object that the transform is set for.
@@ -6231,6 +8479,8 @@ weston_output_init(struct weston_output *output,
 		   struct weston_compositor *compositor,
 		   const char *name)
 {
+	struct wl_event_loop *loop;
+
 	output->compositor = compositor;
 	output->destroying = 0;
 	output->name = strdup(name);
@@ -6240,17 +8490,37 @@ weston_output_init(struct weston_output *output,
 	output->desired_protection = WESTON_HDCP_DISABLE;
 	output->allow_protection = true;
 
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	output->repaint_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+						  TFD_CLOEXEC | TFD_NONBLOCK);
+	if (output->repaint_timer_fd >= 0)
+		output->repaint_timer =
+			wl_event_loop_add_fd(loop, output->repaint_timer_fd,
+					     WL_EVENT_READABLE,
+					     output_repaint_timer_handler,
+					     output);
+	else
+		weston_log("Error: creating the repaint timer of output '%s' "
+			   "failed: %s\n", name, strerror(errno));
+
 	wl_list_init(&output->head_list);
 
 	/* Add some (in)sane defaults which can be used
 	 * for checking if an output was properly configured
 	 */
 	output->scale = 0;
+	output->fractional_scale = 0;
 	/* Can't use -1 on uint32_t and 0 is valid enum value */
 	output->transform = UINT32_MAX;
+	output->render_scale = 1.0f;
 
 	pixman_region32_init(&output->region);
 	wl_list_init(&output->mode_list);
+
+	wl_array_init(&output->view_array);
+	wl_array_init(&output->scratch.regions);
+	wl_list_init(&output->frame_callback_list);
+	output->view_array_serial = 0;
 }
 
 /** Adds weston_output object to pending output list.
@@ -6387,6 +8657,7 @@ weston_output_enable(struct weston_output *output)
 	output->original_scale = output->scale;
 
 	wl_signal_init(&output->frame_signal);
+	wl_signal_init(&output->presented_signal);
 	wl_signal_init(&output->destroy_signal);
 
 	weston_output_transform_scale_init(output, output->transform, output->scale);
@@ -6532,6 +8803,63 @@ weston_output_get_destroy_listener(struct weston_output *output,
 	return wl_signal_get(&output->user_destroy_signal, notify);
 }
 
+/** Read output pixels without waiting for the GPU
+ *
+ * \param output The output to read from.
+ * \param format The pixel format of the destination, usually
+ * weston_compositor::read_format.
+ * \param pixels The destination, width * height pixels with no row padding.
+ * It must stay valid until done is called.
+ * \param x The left edge of the area to read, in framebuffer coordinates.
+ * \param y The bottom or top edge, see WESTON_CAP_CAPTURE_YFLIP.
+ * \param width The width of the area to read.
+ * \param height The height of the area to read.
+ * \param done The completion callback.
+ * \param data User data for the callback.
+ * \return 0 if the read was started, -1 otherwise.
+ *
+ * Works like weston_renderer::read_pixels, but only queues the read. The
+ * pixels are in place when done is called, which happens exactly once if
+ * this returned 0, possibly before this returns when the renderer can only
+ * read synchronously. Reads complete in the order they were started, and
+ * reads still pending when the output is destroyed are completed then.
+ *
+ * Like read_pixels, this must be called from a frame_signal handler of the
+ * output to read the frame just rendered. If the backend implements
+ * weston_output::capture_pixels, the frame is read back from the display
+ * hardware instead, planes included.
+ *
+ * \memberof weston_output
+ */
+WL_EXPORT int
+weston_output_read_pixels_async(struct weston_output *output,
+				pixman_format_code_t format, void *pixels,
+				uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height,
+				weston_read_pixels_done_func_t done,
+				void *data)
+{
+	struct weston_renderer *renderer = output->compositor->renderer;
+
+	if (output->capture_pixels &&
+	    output->capture_pixels(output, format, pixels, x, y,
+				   width, height, done, data) == 0)
+		return 0;
+
+	if (renderer->read_pixels_async)
+		return renderer->read_pixels_async(output, format, pixels,
+						   x, y, width, height,
+						   done, data);
+
+	if (renderer->read_pixels(output, format, pixels,
+				  x, y, width, height) < 0)
+		return -1;
+
+	done(data, 0);
+
+	return 0;
+}
+
 /** Uninitialize an output
  *
  * Removes the output from the list of enabled outputs if necessary, but
@@ -6556,12 +8884,24 @@ weston_output_release(struct weston_output *output)
 	if (output->idle_repaint_source)
 		wl_event_source_remove(output->idle_repaint_source);
 
+	if (output->idle_refresh_timer)
+		wl_event_source_remove(output->idle_refresh_timer);
+
+	if (output->repaint_timer)
+		wl_event_source_remove(output->repaint_timer);
+	if (output->repaint_timer_fd >= 0)
+		close(output->repaint_timer_fd);
+
 	if (output->enabled)
 		weston_compositor_remove_output(output);
 
 	pixman_region32_fini(&output->region);
 	wl_list_remove(&output->link);
 
+	wl_array_release(&output->view_array);
+	weston_output_scratch_fini(output);
+	weston_output_frame_stats_destroy(output);
+
 	wl_list_for_each_safe(head, tmp, &output->head_list, output_link)
 		weston_head_detach(head);
 
@@ -6974,7 +9314,7 @@ destroy_presentation_feedback(struct wl_resource *feedback_resource)
 	feedback = wl_resource_get_user_data(feedback_resource);
 
 	wl_list_remove(&feedback->link);
-	free(feedback);
+	weston_object_pool_free(feedback);
 }
 
 static void
@@ -6994,7 +9334,7 @@ presentation_feedback(struct wl_client *client,
 
 	surface = wl_resource_get_user_data(surface_resource);
 
-	feedback = zalloc(sizeof *feedback);
+	feedback = weston_object_pool_alloc(surface->compositor->feedback_pool);
 	if (feedback == NULL)
 		goto err_calloc;
 
@@ -7012,7 +9352,7 @@ presentation_feedback(struct wl_client *client,
 	return;
 
 err_create:
-	free(feedback);
+	weston_object_pool_free(feedback);
 
 err_calloc:
 	wl_client_post_no_memory(client);
@@ -7313,6 +9653,36 @@ debug_scene_graph_cb(struct weston_log_subscription *sub, void *data)
 	weston_log_subscription_complete(sub);
 }
 
+static void
+debug_pools_print(struct weston_log_subscription *sub,
+		  struct weston_object_pool *pool)
+{
+	struct weston_object_pool_stats stats;
+
+	weston_object_pool_get_stats(pool, &stats);
+	weston_log_subscription_printf(sub,
+		"%s (%zu bytes): %u in use, %u cached, peak %u, "
+		"%" PRIu64 " allocations, %" PRIu64 " reused\n",
+		stats.name, stats.object_size, stats.in_use, stats.cached,
+		stats.peak, stats.allocs, stats.reuses);
+}
+
+/**
+ * Called when the 'object-pools' debug scope is bound by a client. This
+ * one-shot weston-debug scope prints the state of the protocol object pools
+ * when bound, and then terminates the stream.
+ */
+static void
+debug_pools_cb(struct weston_log_subscription *sub, void *data)
+{
+	struct weston_compositor *ec = data;
+
+	debug_pools_print(sub, ec->frame_callback_pool);
+	debug_pools_print(sub, ec->feedback_pool);
+	debug_pools_print(sub, ec->region_pool);
+	weston_log_subscription_complete(sub);
+}
+
 /** Create the compositor.
  *
  * This functions creates and initializes a compositor instance.
@@ -7361,10 +9731,13 @@ weston_compositor_create(struct wl_display *display,
 	wl_signal_init(&ec->heads_changed_signal);
 	wl_signal_init(&ec->output_heads_changed_signal);
 	wl_signal_init(&ec->session_signal);
+	wl_signal_init(&ec->stall_signal);
 	ec->session_active = true;
 
 	ec->output_id_pool = 0;
 	ec->repaint_msec = DEFAULT_REPAINT_WINDOW;
+	ec->damage_max_rects = DEFAULT_DAMAGE_MAX_RECTS;
+	ec->view_list_serial = 1;
 
 	ec->activate_serial = 1;
 
@@ -7392,13 +9765,47 @@ weston_compositor_create(struct wl_display *display,
 			      ec, bind_presentation))
 		goto fail;
 
+	if (weston_commit_timing_setup(ec) < 0)
+		goto fail;
+
+	if (weston_fractional_scale_setup(ec) < 0)
+		goto fail;
+
+	if (weston_content_type_setup(ec) < 0)
+		goto fail;
+
 	if (weston_input_init(ec) != 0)
 		goto fail;
 
+	ec->view_grid = weston_view_grid_create();
+	if (!ec->view_grid)
+		goto fail;
+
+	/* Views start out with a serial of zero, never a valid one. */
+	ec->output_layout_serial = 1;
+
+	ec->frame_callback_pool =
+		weston_object_pool_create("frame callbacks",
+					  sizeof(struct weston_frame_callback),
+					  FRAME_CALLBACK_POOL_CACHE);
+	ec->feedback_pool =
+		weston_object_pool_create("presentation feedback",
+					  sizeof(struct weston_presentation_feedback),
+					  FEEDBACK_POOL_CACHE);
+	ec->region_pool =
+		weston_object_pool_create("regions",
+					  sizeof(struct weston_region),
+					  REGION_POOL_CACHE);
+	if (!ec->frame_callback_pool || !ec->feedback_pool ||
+	    !ec->region_pool)
+		goto fail;
+
 	wl_list_init(&ec->view_list);
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
 	wl_list_init(&ec->seat_list);
+	wl_list_init(&ec->xkb_info_list);
+	wl_list_init(&ec->keymap_cache);
 	wl_list_init(&ec->pending_output_list);
 	wl_list_init(&ec->output_list);
 	wl_list_init(&ec->head_list);
@@ -7420,8 +9827,8 @@ weston_compositor_create(struct wl_display *display,
 
 	loop = wl_display_get_event_loop(ec->wl_display);
 	ec->idle_source = wl_event_loop_add_timer(loop, idle_handler, ec);
-	ec->repaint_timer =
-		wl_event_loop_add_timer(loop, output_repaint_timer_handler,
+	ec->occluded_frame_timer =
+		wl_event_loop_add_timer(loop, occluded_frame_timer_handler,
 					ec);
 
 	weston_layer_init(&ec->fade_layer, ec);
@@ -7443,9 +9850,65 @@ weston_compositor_create(struct wl_display *display,
 						weston_timeline_create_subscription,
 						weston_timeline_destroy_subscription,
 						ec);
+
+	ec->timeline_trace =
+		weston_compositor_add_log_scope(ec, "timeline-trace",
+						"Timeline event points in the "
+						"Chrome trace event format\n",
+						weston_timeline_trace_create_subscription,
+						weston_timeline_destroy_subscription,
+						ec);
+
+	ec->debug_pools =
+		weston_compositor_add_log_scope(ec, "object-pools",
+						"Occupancy of the protocol object pools\n",
+						debug_pools_cb, NULL, ec);
+
+	ec->debug_frame_stats =
+		weston_compositor_add_log_scope(ec, "frame-stats",
+						"Per-output repaint, render and "
+						"presentation statistics\n",
+						weston_compositor_frame_stats_cb,
+						NULL, ec);
+
+	wl_list_init(&ec->surface_stats_list);
+	ec->debug_surface_stats =
+		weston_compositor_add_log_scope(ec, "surface-stats",
+						"Per-surface commit to "
+						"presentation latency\n",
+						weston_compositor_surface_stats_cb,
+						NULL, ec);
+
+	wl_list_init(&ec->client_memory_list);
+	wl_list_init(&ec->commit_queue_list);
+	ec->debug_memory_stats =
+		weston_compositor_add_log_scope(ec, "memory-stats",
+						"Per-client and per-surface "
+						"buffer and renderer memory\n",
+						weston_compositor_memory_stats_cb,
+						NULL, ec);
+
+	wl_list_init(&ec->client_budget_list);
+	ec->debug_client_budget =
+		weston_compositor_add_log_scope(ec, "client-budget",
+						"Clients throttled for going "
+						"over the request budget\n",
+						NULL, NULL, ec);
+
+	wl_list_init(&ec->client_cpu_list);
+	ec->debug_client_cpu =
+		weston_compositor_add_log_scope(ec, "client-cpu",
+						"Compositor time spent for each "
+						"client\n",
+						weston_compositor_client_cpu_cb,
+						NULL, ec);
 	return ec;
 
 fail:
+	weston_object_pool_destroy(ec->region_pool);
+	weston_object_pool_destroy(ec->feedback_pool);
+	weston_object_pool_destroy(ec->frame_callback_pool);
+	weston_view_grid_destroy(ec->view_grid);
 	free(ec);
 	return NULL;
 }
@@ -7459,6 +9922,7 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 	struct weston_output *output, *next;
 
 	wl_event_source_remove(ec->idle_source);
+	wl_event_source_remove(ec->occluded_frame_timer);
 
 	/* Destroy all outputs associated with this compositor */
 	wl_list_for_each_safe(output, next, &ec->output_list, link)
@@ -7477,6 +9941,7 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 	weston_binding_list_destroy_all(&ec->touch_binding_list);
 	weston_binding_list_destroy_all(&ec->axis_binding_list);
 	weston_binding_list_destroy_all(&ec->debug_binding_list);
+	weston_compositor_bindings_release(ec);
 
 	weston_plane_release(&ec->primary_plane);
 }
@@ -7494,6 +9959,50 @@ weston_compositor_exit_with_code(struct weston_compositor *compositor,
 	weston_compositor_exit(compositor);
 }
 
+static void
+repaint_thread_init(void *data)
+{
+	weston_thread_scheduling_apply(data);
+}
+
+/** Render output repaints on worker threads
+ *
+ * \param compositor The compositor.
+ * \param n_threads The number of worker threads, 0 to render every output
+ * on the main thread.
+ * \return 0 on success, -1 if the threads could not be created.
+ *
+ * Renderers and backends that support it then only record what to draw on
+ * each output while the repaint loop walks the outputs, and render all of
+ * them in parallel once every output has been prepared, before the backend
+ * flushes the repaint. The main thread waits for the rendering to finish,
+ * so the scene graph is left untouched while the workers read it.
+ *
+ * Currently only the Pixman renderer on the DRM and headless backends takes
+ * advantage of this.
+ *
+ * \ingroup compositor
+ */
+WL_EXPORT int
+weston_compositor_set_repaint_threads(struct weston_compositor *compositor,
+				      unsigned int n_threads)
+{
+	struct weston_worker_pool *pool = NULL;
+
+	if (n_threads > 0) {
+		pool = weston_worker_pool_create(n_threads,
+						 repaint_thread_init,
+						 &compositor->thread_scheduling);
+		if (!pool)
+			return -1;
+	}
+
+	weston_worker_pool_destroy(compositor->repaint_pool);
+	compositor->repaint_pool = pool;
+
+	return 0;
+}
+
 /** weston_compositor_set_default_pointer_grab
  * \ingroup compositor
  */
@@ -7624,6 +10133,38 @@ weston_compositor_import_dmabuf(struct weston_compositor *compositor,
 	return renderer->import_dmabuf(compositor, buffer);
 }
 
+/** Import dmabuf buffer into current renderer without waiting for it
+ *
+ * \param compositor
+ * \param buffer the dmabuf buffer to import
+ * \param done called with the result once the import finished
+ * \return true if the import was started, false otherwise
+ *
+ * Same as weston_compositor_import_dmabuf(), but the renderer may do the
+ * slow part of the import on another thread. The buffer must stay alive
+ * until done has been called, which always happens from the compositor's
+ * event loop and never from within this function.
+ *
+ * Returns false if the renderer cannot import asynchronously, in which
+ * case weston_compositor_import_dmabuf() must be used instead.
+ *
+ * \ingroup compositor
+ */
+bool
+weston_compositor_import_dmabuf_async(struct weston_compositor *compositor,
+				      struct linux_dmabuf_buffer *buffer,
+				      weston_dmabuf_import_done_func_t done)
+{
+	struct weston_renderer *renderer;
+
+	renderer = compositor->renderer;
+
+	if (renderer->import_dmabuf_async == NULL)
+		return false;
+
+	return renderer->import_dmabuf_async(compositor, buffer, done);
+}
+
 WL_EXPORT bool
 weston_compositor_dmabuf_can_scanout(struct weston_compositor *compositor,
 		struct linux_dmabuf_buffer *buffer)
@@ -7813,6 +10354,37 @@ weston_compositor_destroy(struct weston_compositor *compositor)
 	weston_log_scope_destroy(compositor->timeline);
 	compositor->timeline = NULL;
 
+	weston_log_scope_destroy(compositor->timeline_trace);
+	compositor->timeline_trace = NULL;
+
+	weston_compositor_flight_recorder_destroy(compositor);
+
+	weston_log_scope_destroy(compositor->debug_pools);
+	compositor->debug_pools = NULL;
+
+	weston_log_scope_destroy(compositor->debug_frame_stats);
+	compositor->debug_frame_stats = NULL;
+	weston_log_scope_destroy(compositor->debug_surface_stats);
+	compositor->debug_surface_stats = NULL;
+	weston_log_scope_destroy(compositor->debug_memory_stats);
+	compositor->debug_memory_stats = NULL;
+	weston_compositor_memory_stats_fini(compositor);
+	weston_log_scope_destroy(compositor->debug_client_budget);
+	compositor->debug_client_budget = NULL;
+	weston_compositor_client_budget_fini(compositor);
+	weston_log_scope_destroy(compositor->debug_client_cpu);
+	compositor->debug_client_cpu = NULL;
+	weston_compositor_client_cpu_fini(compositor);
+
+	/* Client resources may still hold objects, they are released when
+	 * the display destroys the clients. */
+	weston_object_pool_destroy(compositor->frame_callback_pool);
+	weston_object_pool_destroy(compositor->feedback_pool);
+	weston_object_pool_destroy(compositor->region_pool);
+
+	weston_view_grid_destroy(compositor->view_grid);
+	weston_worker_pool_destroy(compositor->repaint_pool);
+
 	free(compositor);
 }
 
@@ -7974,3 +10546,46 @@ weston_output_disable_planes_decr(struct weston_output *output)
 		weston_schedule_surface_protection_update(output->compositor);
 
 }
+
+/** Start capturing an output's contents
+ *
+ * Captures done with weston_output_read_pixels_async() only see what the
+ * renderer composited, unless the backend can read the output back from
+ * the display hardware. In the first case this disables the planes like
+ * weston_output_disable_planes_incr(), in the second planes stay in use.
+ * Either way protected content is handled as when recording.
+ *
+ * Pair with weston_output_capture_decr().
+ */
+WL_EXPORT void
+weston_output_capture_incr(struct weston_output *output)
+{
+	if (!output->capture_pixels) {
+		weston_output_disable_planes_incr(output);
+		return;
+	}
+
+	output->capture_count++;
+	if (output->capture_count == 1)
+		weston_schedule_surface_protection_update(output->compositor);
+}
+
+WL_EXPORT void
+weston_output_capture_decr(struct weston_output *output)
+{
+	if (output->capture_count == 0) {
+		weston_output_disable_planes_decr(output);
+		return;
+	}
+
+	output->capture_count--;
+	if (output->capture_count == 0)
+		weston_schedule_surface_protection_update(output->compositor);
+}
+
+/** Whether the output contents may currently be recorded */
+WL_EXPORT bool
+weston_output_is_captured(struct weston_output *output)
+{
+	return output->disable_planes > 0 || output->capture_count > 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <libweston/libweston.h>
+#include <libweston/zalloc.h>
+#include "libweston-internal.h"
+#include "weston-content-type-server-protocol.h"
+#include "shared/helpers.h"
+
+struct content_type {
+	struct weston_surface *surface;
+	struct wl_resource *resource;
+	struct wl_listener surface_destroy_listener;
+};
+
+static void
+content_type_free(struct content_type *ct)
+{
+	wl_resource_set_user_data(ct->resource, NULL);
+	wl_list_remove(&ct->surface_destroy_listener.link);
+	free(ct);
+}
+
+static void
+content_type_surface_destroyed(struct wl_listener *listener, void *data)
+{
+	struct content_type *ct =
+		container_of(listener, struct content_type,
+			     surface_destroy_listener);
+
+	content_type_free(ct);
+}
+
+static void
+content_type_destroy_resource(struct wl_resource *resource)
+{
+	struct content_type *ct = wl_resource_get_user_data(resource);
+
+	if (!ct)
+		return;
+
+	ct->surface->pending.content_type = WESTON_CONTENT_TYPE_NONE;
+	content_type_free(ct);
+}
+
+static void
+content_type_set_content_type(struct wl_client *client,
+			      struct wl_resource *resource,
+			      uint32_t content_type)
+{
+	struct content_type *ct = wl_resource_get_user_data(resource);
+
+	if (!ct)
+		return;
+
+	switch (content_type) {
+	case WESTON_CONTENT_TYPE_V1_TYPE_PHOTO:
+		ct->surface->pending.content_type = WESTON_CONTENT_TYPE_PHOTO;
+		break;
+	case WESTON_CONTENT_TYPE_V1_TYPE_VIDEO:
+		ct->surface->pending.content_type = WESTON_CONTENT_TYPE_VIDEO;
+		break;
+	case WESTON_CONTENT_TYPE_V1_TYPE_GAME:
+		ct->surface->pending.content_type = WESTON_CONTENT_TYPE_GAME;
+		break;
+	default:
+		/* Unknown types get no special treatment. */
+		ct->surface->pending.content_type = WESTON_CONTENT_TYPE_NONE;
+		break;
+	}
+}
+
+static void
+content_type_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct weston_content_type_v1_interface
+	content_type_implementation = {
+		content_type_set_content_type,
+		content_type_destroy,
+};
+
+static void
+content_type_manager_destroy(struct wl_client *client,
+			     struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+content_type_manager_get_surface_content_type(struct wl_client *client,
+					      struct wl_resource *resource,
+					      uint32_t id,
+					      struct wl_resource *surface_resource)
+{
+	struct weston_surface *surface =
+		wl_resource_get_user_data(surface_resource);
+	struct content_type *ct;
+
+	if (wl_resource_get_destroy_listener(surface_resource,
+					     content_type_surface_destroyed)) {
+		wl_resource_post_error(resource,
+			WESTON_CONTENT_TYPE_MANAGER_V1_ERROR_CONTENT_TYPE_EXISTS,
+			"wl_surface@%"PRIu32" already has a content type object",
+			wl_resource_get_id(surface_resource));
+		return;
+	}
+
+	ct = zalloc(sizeof *ct);
+	if (!ct) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	ct->resource = wl_resource_create(client,
+					  &weston_content_type_v1_interface,
+					  1, id);
+	if (!ct->resource) {
+		free(ct);
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	ct->surface = surface;
+	ct->surface_destroy_listener.notify = content_type_surface_destroyed;
+	wl_resource_add_destroy_listener(surface_resource,
+					 &ct->surface_destroy_listener);
+
+	wl_resource_set_implementation(ct->resource,
+				       &content_type_implementation, ct,
+				       content_type_destroy_resource);
+}
+
+static const struct weston_content_type_manager_v1_interface
+	content_type_manager_implementation = {
+		content_type_manager_destroy,
+		content_type_manager_get_surface_content_type,
+};
+
+static void
+bind_content_type(struct wl_client *client, void *data,
+		  uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client,
+				      &weston_content_type_manager_v1_interface,
+				      version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource,
+				       &content_type_manager_implementation,
+				       data, NULL);
+}
+
+/** Advertise weston_content_type_manager_v1
+ *
+ * The hints are used by the core and the backends alike, so this is set up
+ * by the compositor for every backend.
+ */
+WL_EXPORT int
+weston_content_type_setup(struct weston_compositor *compositor)
+{
+	if (!wl_global_create(compositor->wl_display,
+			      &weston_content_type_manager_v1_interface, 1,
+			      compositor, bind_content_type))
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,386 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libweston/libweston.h>
+#include <libweston/zalloc.h>
+#include "libweston-internal.h"
+#include "timeline.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+
+/*
+ * Always-on flight recorder of the timeline points, and a stall detector
+ * dumping it to a file.
+ *
+ * Unlike the 'timeline' scope, which formats JSON for each point, a point
+ * only costs a clock read and a few stores into a ring here, so it can stay
+ * enabled for when a hitch happens in the field. The ring holds points for
+ * at least the configured number of seconds at a high rate of points, and
+ * a dump has the ones of that window.
+ *
+ * A stall is a frame completing, in weston_output_finish_frame(), more than
+ * the threshold after the vblank following its repaint, or the main loop
+ * not running a periodic timer for more than the threshold.
+ */
+
+/* Points per second the ring is sized for: many surfaces committing on a
+ * few outputs. */
+#define FLIGHT_RECORDER_RATE 4096
+#define FLIGHT_RECORDER_HEARTBEAT_MSEC 100
+/* Stalls closer to the last dump than this are not dumped again. */
+#define FLIGHT_RECORDER_DUMP_INTERVAL_SEC 10
+/* Output ids are below 32, see weston_output::id. */
+#define FLIGHT_RECORDER_MAX_OUTPUTS 32
+
+struct flight_record {
+	int64_t time_nsec; /* CLOCK_MONOTONIC */
+	const char *name; /* static string of the TL_POINT */
+	int64_t value_nsec; /* vblank or GPU timestamp if any, else 0 */
+	uint32_t output_id; /* UINT32_MAX for none */
+	uint32_t surface_id; /* wl_surface id, 0 for none */
+};
+
+struct weston_flight_recorder {
+	struct weston_compositor *compositor;
+
+	struct flight_record *records;
+	uint32_t mask; /* ring size minus one */
+	uint64_t head; /* number of points recorded */
+	int64_t window_nsec;
+
+	int64_t threshold_nsec;
+	char *dump_dir;
+	unsigned int dump_count;
+	struct timespec last_dump;
+
+	struct wl_event_source *heartbeat;
+	struct timespec heartbeat_due;
+
+	/* Repaints waiting for weston_output_finish_frame(), by output id */
+	uint32_t pending_mask;
+	struct timespec repaint_begin[FLIGHT_RECORDER_MAX_OUTPUTS];
+	int64_t refresh_nsec[FLIGHT_RECORDER_MAX_OUTPUTS];
+
+	struct weston_stall_info last_stall;
+	char last_stall_path[256];
+	char last_stall_reason[64];
+};
+
+/** Record a timeline point, see TL_POINT */
+WL_EXPORT void
+weston_flight_recorder_point(struct weston_flight_recorder *recorder,
+			     const char *name, ...)
+{
+	struct flight_record *rec;
+	struct timespec ts, *t;
+	enum timeline_type otype;
+	struct weston_output *output;
+	struct weston_surface *surface;
+	va_list argp;
+	void *obj;
+
+	if (!recorder)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	rec = &recorder->records[recorder->head++ & recorder->mask];
+	rec->time_nsec = timespec_to_nsec(&ts);
+	rec->name = name;
+	rec->value_nsec = 0;
+	rec->output_id = UINT32_MAX;
+	rec->surface_id = 0;
+
+	va_start(argp, name);
+	while ((otype = va_arg(argp, enum timeline_type)) != TLT_END) {
+		obj = va_arg(argp, void *);
+
+		switch (otype) {
+		case TLT_OUTPUT:
+			output = obj;
+			if (output)
+				rec->output_id = output->id;
+			break;
+		case TLT_SURFACE:
+			surface = obj;
+			if (surface && surface->resource)
+				rec->surface_id =
+					wl_resource_get_id(surface->resource);
+			break;
+		case TLT_VBLANK:
+		case TLT_GPU:
+			t = obj;
+			rec->value_nsec = timespec_to_nsec(t);
+			break;
+		default:
+			break;
+		}
+	}
+	va_end(argp);
+}
+
+static void
+flight_recorder_write(struct weston_flight_recorder *recorder, FILE *fp,
+		      int64_t now_nsec)
+{
+	uint64_t size = (uint64_t)recorder->mask + 1;
+	uint64_t first = recorder->head > size ? recorder->head - size : 0;
+	struct flight_record *rec;
+	uint64_t i;
+
+	for (i = first; i < recorder->head; i++) {
+		rec = &recorder->records[i & recorder->mask];
+		if (now_nsec - rec->time_nsec > recorder->window_nsec)
+			continue;
+
+		fprintf(fp, "%" PRId64 ".%06" PRId64 " %s",
+			rec->time_nsec / 1000000000,
+			(rec->time_nsec % 1000000000) / 1000, rec->name);
+		if (rec->output_id != UINT32_MAX)
+			fprintf(fp, " output=%u", rec->output_id);
+		if (rec->surface_id)
+			fprintf(fp, " surface=%u", rec->surface_id);
+		if (rec->value_nsec)
+			fprintf(fp, " t=%" PRId64 ".%06" PRId64,
+				rec->value_nsec / 1000000000,
+				(rec->value_nsec % 1000000000) / 1000);
+		fprintf(fp, "\n");
+	}
+}
+
+static void
+flight_recorder_stall(struct weston_flight_recorder *recorder,
+		      const char *reason, struct weston_output *output,
+		      int64_t late_nsec)
+{
+	struct weston_compositor *compositor = recorder->compositor;
+	struct weston_stall_info *info = &recorder->last_stall;
+	struct timespec now;
+	FILE *fp;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	info->time = now;
+	info->late_msec = late_nsec / 1000000;
+	snprintf(recorder->last_stall_reason,
+		 sizeof recorder->last_stall_reason, "%s%s%s", reason,
+		 output ? " on " : "", output ? output->name : "");
+	info->reason = recorder->last_stall_reason;
+
+	weston_log("Stall: %s, %" PRId64 " ms late.\n",
+		   info->reason, info->late_msec);
+
+	/* A slow disk must not turn one stall into many. */
+	if (recorder->dump_count > 0 &&
+	    timespec_sub_to_msec(&now, &recorder->last_dump) <
+	    FLIGHT_RECORDER_DUMP_INTERVAL_SEC * 1000) {
+		wl_signal_emit(&compositor->stall_signal, info);
+		return;
+	}
+
+	snprintf(recorder->last_stall_path, sizeof recorder->last_stall_path,
+		 "%s/weston-stall-%d-%u.log", recorder->dump_dir,
+		 (int)getpid(), recorder->dump_count);
+	fp = fopen(recorder->last_stall_path, "w");
+	if (fp) {
+		fprintf(fp, "# %s, %" PRId64 " ms late, at %" PRId64 ".%06ld\n",
+			info->reason, info->late_msec, (int64_t)now.tv_sec,
+			now.tv_nsec / 1000);
+		flight_recorder_write(recorder, fp, timespec_to_nsec(&now));
+		fclose(fp);
+		weston_log_continue(STAMP_SPACE "flight recorder written to "
+				    "%s\n", recorder->last_stall_path);
+		info->dump_path = recorder->last_stall_path;
+	} else {
+		weston_log_continue(STAMP_SPACE "cannot write %s: %s\n",
+				    recorder->last_stall_path,
+				    strerror(errno));
+		info->dump_path = NULL;
+	}
+
+	recorder->dump_count++;
+	recorder->last_dump = now;
+
+	wl_signal_emit(&compositor->stall_signal, info);
+}
+
+/** Note that the repaint of an output was posted, see weston_output_repaint()
+ */
+void
+weston_flight_recorder_repaint_posted(struct weston_flight_recorder *recorder,
+				      struct weston_output *output)
+{
+	if (!recorder || output->id >= FLIGHT_RECORDER_MAX_OUTPUTS)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &recorder->repaint_begin[output->id]);
+	recorder->refresh_nsec[output->id] =
+		millihz_to_nsec(output->current_mode->refresh);
+	recorder->pending_mask |= 1u << output->id;
+}
+
+/** Check how late a posted repaint finished, see weston_output_finish_frame()
+ */
+void
+weston_flight_recorder_frame_done(struct weston_flight_recorder *recorder,
+				  struct weston_output *output)
+{
+	uint32_t bit;
+	struct timespec now;
+	int64_t late;
+
+	if (!recorder || output->id >= FLIGHT_RECORDER_MAX_OUTPUTS)
+		return;
+
+	bit = 1u << output->id;
+	if (!(recorder->pending_mask & bit))
+		return;
+	recorder->pending_mask &= ~bit;
+
+	/* A frame is due by the vblank after the one it was repainted for. */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	late = timespec_sub_to_nsec(&now, &recorder->repaint_begin[output->id]) -
+	       2 * recorder->refresh_nsec[output->id];
+	if (late > recorder->threshold_nsec)
+		flight_recorder_stall(recorder, "frame late", output, late);
+}
+
+static int
+flight_recorder_heartbeat(void *data)
+{
+	struct weston_flight_recorder *recorder = data;
+	struct timespec now;
+	int64_t late;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	late = timespec_sub_to_nsec(&now, &recorder->heartbeat_due);
+	if (late > recorder->threshold_nsec)
+		flight_recorder_stall(recorder, "main loop blocked", NULL, late);
+
+	timespec_add_msec(&recorder->heartbeat_due, &now,
+			  FLIGHT_RECORDER_HEARTBEAT_MSEC);
+	wl_event_source_timer_update(recorder->heartbeat,
+				     FLIGHT_RECORDER_HEARTBEAT_MSEC);
+
+	return 0;
+}
+
+/** Enable the flight recorder and the stall detector
+ *
+ * \param compositor The compositor.
+ * \param threshold_msec How late a frame or the main loop may be before it
+ * counts as a stall.
+ * \param seconds How many seconds of timeline points a dump has.
+ * \param dump_dir The directory for the dumps, named
+ * weston-stall-<pid>-<n>.log.
+ * \return 0 on success, -1 on failure.
+ *
+ * Stalls are logged, and emitted through weston_compositor::stall_signal.
+ */
+WL_EXPORT int
+weston_compositor_enable_flight_recorder(struct weston_compositor *compositor,
+					 int32_t threshold_msec,
+					 int32_t seconds,
+					 const char *dump_dir)
+{
+	struct weston_flight_recorder *recorder;
+	struct wl_event_loop *loop;
+	uint32_t size = 1;
+
+	if (compositor->flight_recorder || threshold_msec <= 0 ||
+	    seconds <= 0)
+		return -1;
+
+	while (size < (uint64_t)seconds * FLIGHT_RECORDER_RATE &&
+	       size < (1u << 24))
+		size <<= 1;
+
+	recorder = zalloc(sizeof *recorder);
+	if (!recorder)
+		return -1;
+
+	recorder->records = calloc(size, sizeof *recorder->records);
+	recorder->dump_dir = strdup(dump_dir);
+	if (!recorder->records || !recorder->dump_dir)
+		goto fail;
+
+	recorder->compositor = compositor;
+	recorder->mask = size - 1;
+	recorder->window_nsec = (int64_t)seconds * 1000000000;
+	recorder->threshold_nsec = (int64_t)threshold_msec * 1000000;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	recorder->heartbeat = wl_event_loop_add_timer(loop,
+						      flight_recorder_heartbeat,
+						      recorder);
+	if (!recorder->heartbeat)
+		goto fail;
+
+	clock_gettime(CLOCK_MONOTONIC, &recorder->heartbeat_due);
+	timespec_add_msec(&recorder->heartbeat_due, &recorder->heartbeat_due,
+			  FLIGHT_RECORDER_HEARTBEAT_MSEC);
+	wl_event_source_timer_update(recorder->heartbeat,
+				     FLIGHT_RECORDER_HEARTBEAT_MSEC);
+
+	compositor->flight_recorder = recorder;
+
+	weston_log("Flight recorder: %u points, stalls over %d ms dumped "
+		   "to %s\n", size, threshold_msec, recorder->dump_dir);
+
+	return 0;
+
+fail:
+	free(recorder->dump_dir);
+	free(recorder->records);
+	free(recorder);
+	return -1;
+}
+
+void
+weston_compositor_flight_recorder_destroy(struct weston_compositor *compositor)
+{
+	struct weston_flight_recorder *recorder = compositor->flight_recorder;
+
+	if (!recorder)
+		return;
+
+	compositor->flight_recorder = NULL;
+	wl_event_source_remove(recorder->heartbeat);
+	free(recorder->dump_dir);
+	free(recorder->records);
+	free(recorder);
+}
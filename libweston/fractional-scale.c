@@ -0,0 +1,215 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <libweston/libweston.h>
+#include <libweston/zalloc.h>
+#include "libweston-internal.h"
+#include "weston-fractional-scale-server-protocol.h"
+#include "shared/helpers.h"
+
+struct fractional_scale {
+	struct weston_surface *surface;
+	struct wl_resource *resource;
+	struct wl_listener surface_destroy_listener;
+	uint32_t sent_scale; /**< 0 until the first preferred_scale */
+};
+
+static void
+fractional_scale_free(struct fractional_scale *fs)
+{
+	wl_resource_set_user_data(fs->resource, NULL);
+	wl_list_remove(&fs->surface_destroy_listener.link);
+	free(fs);
+}
+
+static void
+fractional_scale_surface_destroyed(struct wl_listener *listener, void *data)
+{
+	struct fractional_scale *fs =
+		container_of(listener, struct fractional_scale,
+			     surface_destroy_listener);
+
+	fractional_scale_free(fs);
+}
+
+static void
+fractional_scale_destroy_resource(struct wl_resource *resource)
+{
+	struct fractional_scale *fs = wl_resource_get_user_data(resource);
+
+	if (fs)
+		fractional_scale_free(fs);
+}
+
+static void
+fractional_scale_destroy(struct wl_client *client,
+			 struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct weston_fractional_scale_v1_interface
+	fractional_scale_implementation = {
+		fractional_scale_destroy,
+};
+
+static void
+fractional_scale_update(struct fractional_scale *fs)
+{
+	struct weston_surface *surface = fs->surface;
+	struct weston_output *output;
+	uint32_t scale = 0;
+
+	wl_list_for_each(output, &surface->compositor->output_list, link) {
+		if (!(surface->output_mask & (1u << output->id)))
+			continue;
+
+		scale = MAX(scale, weston_output_get_fractional_scale(output));
+	}
+
+	/* A surface shown nowhere keeps the scale it had. */
+	if (scale == 0 || scale == fs->sent_scale)
+		return;
+
+	weston_fractional_scale_v1_send_preferred_scale(fs->resource, scale);
+	fs->sent_scale = scale;
+}
+
+/** Send the preferred fractional scale to a surface if it changed
+ *
+ * Called when the outputs a surface is shown on change.
+ */
+void
+weston_surface_update_preferred_scale(struct weston_surface *surface)
+{
+	struct wl_listener *listener;
+
+	if (!surface->resource)
+		return;
+
+	listener = wl_resource_get_destroy_listener(surface->resource,
+					fractional_scale_surface_destroyed);
+	if (!listener)
+		return;
+
+	fractional_scale_update(container_of(listener, struct fractional_scale,
+					     surface_destroy_listener));
+}
+
+static void
+fractional_scale_manager_destroy(struct wl_client *client,
+				 struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+fractional_scale_manager_get_fractional_scale(struct wl_client *client,
+					      struct wl_resource *resource,
+					      uint32_t id,
+					      struct wl_resource *surface_resource)
+{
+	struct weston_surface *surface =
+		wl_resource_get_user_data(surface_resource);
+	struct fractional_scale *fs;
+
+	if (wl_resource_get_destroy_listener(surface_resource,
+					     fractional_scale_surface_destroyed)) {
+		wl_resource_post_error(resource,
+			WESTON_FRACTIONAL_SCALE_MANAGER_V1_ERROR_FRACTIONAL_SCALE_EXISTS,
+			"wl_surface@%"PRIu32" already has a fractional scale object",
+			wl_resource_get_id(surface_resource));
+		return;
+	}
+
+	fs = zalloc(sizeof *fs);
+	if (!fs) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	fs->resource = wl_resource_create(client,
+					  &weston_fractional_scale_v1_interface,
+					  1, id);
+	if (!fs->resource) {
+		free(fs);
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	fs->surface = surface;
+	fs->surface_destroy_listener.notify = fractional_scale_surface_destroyed;
+	wl_resource_add_destroy_listener(surface_resource,
+					 &fs->surface_destroy_listener);
+
+	wl_resource_set_implementation(fs->resource,
+				       &fractional_scale_implementation, fs,
+				       fractional_scale_destroy_resource);
+
+	fractional_scale_update(fs);
+}
+
+static const struct weston_fractional_scale_manager_v1_interface
+	fractional_scale_manager_implementation = {
+		fractional_scale_manager_destroy,
+		fractional_scale_manager_get_fractional_scale,
+};
+
+static void
+bind_fractional_scale(struct wl_client *client, void *data,
+		      uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client,
+				      &weston_fractional_scale_manager_v1_interface,
+				      version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource,
+				       &fractional_scale_manager_implementation,
+				       data, NULL);
+}
+
+/** Advertise weston_fractional_scale_manager_v1 */
+int
+weston_fractional_scale_setup(struct weston_compositor *compositor)
+{
+	if (!wl_global_create(compositor->wl_display,
+			      &weston_fractional_scale_manager_v1_interface, 1,
+			      compositor, bind_fractional_scale))
+		return -1;
+
+	return 0;
+}
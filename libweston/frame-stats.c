@@ -0,0 +1,662 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libweston/libweston.h>
+#include <libweston/weston-log.h>
+#include <libweston/zalloc.h>
+#include "libweston-internal.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+
+/*
+ * Per-output frame statistics for the 'frame-stats' debug scope.
+ *
+ * Recording a frame only stores a handful of numbers into fixed rings of
+ * the last FRAME_STATS_SAMPLES frames, so the statistics are always
+ * collected. Sorting and printing happens when the scope is bound.
+ *
+ * Per-surface latency statistics for the 'surface-stats' debug scope are
+ * only recorded while that scope is bound, as they cost an allocation per
+ * surface and a line of output per presented frame.
+ */
+
+#define FRAME_STATS_SAMPLES 512
+
+/* Dynamic resolution aims for GPU times of RENDER_LOAD_TARGET of the refresh
+ * period, lowering the render scale above RENDER_LOAD_HIGH and raising it
+ * again below RENDER_LOAD_LOW. The GPU time is taken to be proportional to
+ * the number of pixels drawn. */
+#define RENDER_LOAD_TARGET 0.7f
+#define RENDER_LOAD_HIGH 0.85f
+#define RENDER_LOAD_LOW 0.45f
+#define RENDER_SCALE_STEP 0.05f
+/* GPU times arrive a few frames late; ignore the ones from before a change */
+#define RENDER_SCALE_SETTLE_FRAMES 30
+
+enum frame_stats_series {
+	FRAME_STATS_REPAINT = 0,	/* CPU time of weston_output_repaint */
+	FRAME_STATS_GPU,		/* GPU time of the renderer */
+	FRAME_STATS_FLIP,		/* repaint done to frame finished */
+	FRAME_STATS_LATENESS,		/* repaint start past next_repaint */
+	FRAME_STATS_PLANE_VIEWS,	/* views outside the primary plane */
+	FRAME_STATS_RENDERER_VIEWS,	/* views composited by the renderer */
+	FRAME_STATS_COUNT
+};
+
+static const struct {
+	const char *name;
+	const char *unit;
+} series_desc[] = {
+	[FRAME_STATS_REPAINT] = { "repaint cpu", "us" },
+	[FRAME_STATS_GPU] = { "render gpu", "us" },
+	[FRAME_STATS_FLIP] = { "to flip done", "us" },
+	[FRAME_STATS_LATENESS] = { "repaint late", "us" },
+	[FRAME_STATS_PLANE_VIEWS] = { "plane views", "" },
+	[FRAME_STATS_RENDERER_VIEWS] = { "renderer views", "" },
+};
+
+struct frame_stats_ring {
+	uint32_t samples[FRAME_STATS_SAMPLES];
+	uint64_t count;
+};
+
+struct weston_output_frame_stats {
+	struct frame_stats_ring series[FRAME_STATS_COUNT];
+
+	uint64_t frames;
+	uint64_t missed;		/* presented after the aimed vblank */
+	uint64_t renderer_frames;	/* frames with views to composite */
+	uint64_t full_repaints;		/* frames with the whole output damaged */
+
+	struct timespec repaint_begin;
+	struct timespec repaint_end;
+	bool repaint_pending;		/* waiting for finish_frame */
+
+	struct timespec target_vblank;
+	bool has_target;
+
+	/* smoothed GPU time over the refresh period, for dynamic resolution */
+	float render_load;
+	bool has_render_load;
+	unsigned int render_scale_settle;
+	uint64_t render_scale_changes;
+
+	/* weston_surface_stats::queue_link, repainted and waiting for the
+	 * presentation */
+	struct wl_list surface_queue;
+};
+
+struct weston_surface_stats {
+	struct weston_surface *surface;
+	struct wl_list link;		/* weston_compositor::surface_stats_list */
+	struct wl_list queue_link;	/* weston_output_frame_stats::surface_queue */
+
+	struct frame_stats_ring latency; /* commit to presentation, us */
+	uint64_t presented;
+	uint64_t on_plane;		/* presented from a plane */
+	uint64_t late;			/* committed after the repaint, see
+					 * weston_surface_stats_commit() */
+	uint64_t dropped;		/* replaced before being repainted */
+
+	/* the content committed last and not repainted yet */
+	struct timespec commit_time;
+	bool commit_late;
+	bool pending;
+
+	/* the content in the frame being presented */
+	struct timespec queued_commit_time;
+	bool queued_late;
+	bool queued_on_plane;
+};
+
+static void
+ring_add(struct frame_stats_ring *ring, uint32_t value)
+{
+	ring->samples[ring->count++ % FRAME_STATS_SAMPLES] = value;
+}
+
+static uint32_t
+nsec_to_usec_clamped(int64_t nsec)
+{
+	if (nsec <= 0)
+		return 0;
+	if (nsec / 1000 > UINT32_MAX)
+		return UINT32_MAX;
+	return nsec / 1000;
+}
+
+static struct weston_output_frame_stats *
+frame_stats_get(struct weston_output *output)
+{
+	if (!output->frame_stats) {
+		output->frame_stats = zalloc(sizeof *output->frame_stats);
+		if (output->frame_stats)
+			wl_list_init(&output->frame_stats->surface_queue);
+	}
+
+	return output->frame_stats;
+}
+
+/** Record the start of weston_output_repaint()
+ *
+ * \param output The output being repainted.
+ * \param begin When the repaint started, on the presentation clock.
+ */
+void
+weston_output_frame_stats_repaint_begin(struct weston_output *output,
+					const struct timespec *begin)
+{
+	struct weston_output_frame_stats *stats = frame_stats_get(output);
+
+	if (!stats)
+		return;
+
+	stats->repaint_begin = *begin;
+	ring_add(&stats->series[FRAME_STATS_LATENESS],
+		 nsec_to_usec_clamped(timespec_sub_to_nsec(begin,
+							   &output->next_repaint)));
+}
+
+/** Record the end of weston_output_repaint()
+ *
+ * \param output The output being repainted.
+ * \param plane_views The number of views assigned outside the primary plane.
+ * \param renderer_views The number of views left to the renderer.
+ * \param full_repaint Whether the damage covered the whole output.
+ */
+void
+weston_output_frame_stats_repaint_end(struct weston_output *output,
+				      unsigned int plane_views,
+				      unsigned int renderer_views,
+				      bool full_repaint)
+{
+	struct weston_output_frame_stats *stats = output->frame_stats;
+	struct weston_compositor *compositor = output->compositor;
+
+	if (!stats)
+		return;
+
+	weston_compositor_read_presentation_clock(compositor,
+						  &stats->repaint_end);
+	ring_add(&stats->series[FRAME_STATS_REPAINT],
+		 nsec_to_usec_clamped(timespec_sub_to_nsec(&stats->repaint_end,
+							   &stats->repaint_begin)));
+	ring_add(&stats->series[FRAME_STATS_PLANE_VIEWS], plane_views);
+	ring_add(&stats->series[FRAME_STATS_RENDERER_VIEWS], renderer_views);
+
+	stats->frames++;
+	if (renderer_views > 0)
+		stats->renderer_frames++;
+	if (full_repaint)
+		stats->full_repaints++;
+	stats->repaint_pending = true;
+}
+
+/** Record the completion of a frame
+ *
+ * \param output The output whose frame finished.
+ * \param now The current time on the presentation clock.
+ * \param stamp The presentation timestamp, or NULL if unknown.
+ * \param refresh_nsec The refresh period of the output.
+ *
+ * A repainted frame presented half a refresh period or more after the
+ * vblank following the previous one missed its deadline.
+ */
+void
+weston_output_frame_stats_finish(struct weston_output *output,
+				 const struct timespec *now,
+				 const struct timespec *stamp,
+				 int32_t refresh_nsec)
+{
+	struct weston_output_frame_stats *stats = output->frame_stats;
+
+	if (!stats)
+		return;
+
+	if (stats->repaint_pending) {
+		ring_add(&stats->series[FRAME_STATS_FLIP],
+			 nsec_to_usec_clamped(timespec_sub_to_nsec(now,
+							&stats->repaint_end)));
+
+		if (stamp && stats->has_target &&
+		    timespec_sub_to_nsec(stamp, &stats->target_vblank) >=
+		    refresh_nsec / 2)
+			stats->missed++;
+	}
+	stats->repaint_pending = false;
+
+	stats->has_target = stamp != NULL;
+	if (stamp)
+		timespec_add_nsec(&stats->target_vblank, stamp, refresh_nsec);
+}
+
+static void
+frame_stats_adapt_render_scale(struct weston_output *output,
+			       struct weston_output_frame_stats *stats,
+			       int64_t nsec)
+{
+	float load, scale, target;
+
+	if (output->render_scale_min <= 0.0f || !output->current_mode ||
+	    output->current_mode->refresh <= 0)
+		return;
+
+	load = (float) nsec / millihz_to_nsec(output->current_mode->refresh);
+	if (stats->has_render_load)
+		stats->render_load += (load - stats->render_load) / 8.0f;
+	else
+		stats->render_load = load;
+	stats->has_render_load = true;
+
+	if (stats->render_scale_settle > 0) {
+		stats->render_scale_settle--;
+		return;
+	}
+
+	scale = output->render_scale;
+	if (stats->render_load > RENDER_LOAD_HIGH) {
+		target = scale * sqrtf(RENDER_LOAD_TARGET / stats->render_load);
+		target = MIN(target, scale - RENDER_SCALE_STEP);
+	} else if (stats->render_load < RENDER_LOAD_LOW && scale < 1.0f) {
+		/* Go up gently, a spike costs more than a blurry frame. */
+		target = scale * sqrtf(RENDER_LOAD_TARGET /
+				       MAX(stats->render_load, 0.01f));
+		target = MIN(target, scale + 2 * RENDER_SCALE_STEP);
+	} else {
+		return;
+	}
+
+	target = roundf(target / RENDER_SCALE_STEP) * RENDER_SCALE_STEP;
+	target = MAX(target, output->render_scale_min);
+	target = MIN(target, 1.0f);
+	if (fabsf(target - scale) < RENDER_SCALE_STEP / 2)
+		return;
+
+	stats->render_load *= (target * target) / (scale * scale);
+	stats->render_scale_settle = RENDER_SCALE_SETTLE_FRAMES;
+	stats->render_scale_changes++;
+
+	output->render_scale = target;
+	weston_output_damage(output);
+}
+
+/** Record the GPU time spent rendering a frame
+ *
+ * \param output The output the frame was rendered for.
+ * \param nsec The time between the start and the end of rendering on the GPU.
+ *
+ * Called by renderers able to measure it, possibly a few frames late. This
+ * also drives dynamic resolution.
+ */
+WL_EXPORT void
+weston_output_frame_stats_gpu(struct weston_output *output, int64_t nsec)
+{
+	struct weston_output_frame_stats *stats = output->frame_stats;
+
+	if (!stats || nsec < 0)
+		return;
+
+	ring_add(&stats->series[FRAME_STATS_GPU], nsec_to_usec_clamped(nsec));
+	frame_stats_adapt_render_scale(output, stats, nsec);
+}
+
+/** Let the render scale of an output follow the GPU load
+ *
+ * \param output The output.
+ * \param min_scale The lowest fraction of the mode size to render at, or 0
+ * to always render at the full size.
+ *
+ * Meant for backends able to scale the rendered frame up to the mode in
+ * the display hardware; see weston_output_get_render_size(). The render
+ * scale is adjusted from the GPU times reported by the renderer, so that
+ * frames keep being ready in time for the vblank.
+ *
+ * \ingroup output
+ */
+WL_EXPORT void
+weston_output_set_dynamic_resolution(struct weston_output *output,
+				     float min_scale)
+{
+	struct weston_output_frame_stats *stats = frame_stats_get(output);
+	float scale;
+
+	output->render_scale_min = MIN(MAX(min_scale, 0.0f), 1.0f);
+	if (stats) {
+		stats->has_render_load = false;
+		stats->render_scale_settle = 0;
+	}
+
+	scale = output->render_scale_min > 0.0f ?
+		MAX(output->render_scale, output->render_scale_min) : 1.0f;
+	if (scale != output->render_scale) {
+		output->render_scale = scale;
+		weston_output_damage(output);
+	}
+}
+
+void
+weston_output_frame_stats_destroy(struct weston_output *output)
+{
+	struct weston_surface_stats *sstats, *tmp;
+
+	if (output->frame_stats) {
+		wl_list_for_each_safe(sstats, tmp,
+				      &output->frame_stats->surface_queue,
+				      queue_link) {
+			wl_list_remove(&sstats->queue_link);
+			wl_list_init(&sstats->queue_link);
+		}
+	}
+
+	free(output->frame_stats);
+	output->frame_stats = NULL;
+}
+
+/** Record that new content was committed to a surface
+ *
+ * \param surface The surface a buffer was attached to.
+ *
+ * Content committed while its output has a frame on the way missed that
+ * frame's repaint, and is at best shown one frame later. Content replaced
+ * before any repaint picked it up was dropped.
+ */
+void
+weston_surface_stats_commit(struct weston_surface *surface)
+{
+	struct weston_compositor *compositor = surface->compositor;
+	struct weston_surface_stats *sstats = surface->stats;
+
+	if (!weston_log_scope_is_enabled(compositor->debug_surface_stats))
+		return;
+
+	if (!sstats) {
+		sstats = zalloc(sizeof *sstats);
+		if (!sstats)
+			return;
+		sstats->surface = surface;
+		wl_list_init(&sstats->queue_link);
+		wl_list_insert(compositor->surface_stats_list.prev,
+			       &sstats->link);
+		surface->stats = sstats;
+	}
+
+	if (sstats->pending)
+		sstats->dropped++;
+
+	weston_compositor_read_presentation_clock(compositor,
+						  &sstats->commit_time);
+	sstats->commit_late = surface->output &&
+		surface->output->repaint_status == REPAINT_AWAITING_COMPLETION;
+	sstats->pending = true;
+}
+
+/** Record that a surface was repainted on an output
+ *
+ * \param surface The surface.
+ * \param output The output being repainted, the main output of the surface.
+ * \param on_plane Whether the surface is shown from a plane rather than
+ * composited by the renderer.
+ */
+void
+weston_surface_stats_repaint(struct weston_surface *surface,
+			     struct weston_output *output, bool on_plane)
+{
+	struct weston_surface_stats *sstats = surface->stats;
+
+	if (!sstats || !sstats->pending || !output->frame_stats)
+		return;
+
+	sstats->queued_commit_time = sstats->commit_time;
+	sstats->queued_late = sstats->commit_late;
+	sstats->queued_on_plane = on_plane;
+	sstats->pending = false;
+
+	wl_list_remove(&sstats->queue_link);
+	wl_list_insert(&output->frame_stats->surface_queue,
+		       &sstats->queue_link);
+}
+
+static void
+surface_stats_describe(struct weston_surface *surface, char *buf, size_t len)
+{
+	char label[96];
+	uint32_t id = 0;
+
+	if (surface->resource)
+		id = wl_resource_get_id(surface->resource);
+
+	if (!surface->get_label ||
+	    surface->get_label(surface, label, sizeof label) < 0)
+		strcpy(label, "no description");
+
+	snprintf(buf, len, "surface %u (%s)", id, label);
+}
+
+/** Record the presentation of the frame of an output
+ *
+ * \param output The output.
+ * \param stamp The presentation timestamp, or NULL if the frame was not
+ * presented.
+ * \param refresh_nsec The refresh period of the output.
+ */
+void
+weston_output_surface_stats_present(struct weston_output *output,
+				    const struct timespec *stamp,
+				    int32_t refresh_nsec)
+{
+	struct weston_log_scope *scope = output->compositor->debug_surface_stats;
+	struct weston_surface_stats *sstats, *tmp;
+	char desc[128];
+	int64_t nsec;
+
+	if (!output->frame_stats)
+		return;
+
+	wl_list_for_each_safe(sstats, tmp, &output->frame_stats->surface_queue,
+			      queue_link) {
+		wl_list_remove(&sstats->queue_link);
+		wl_list_init(&sstats->queue_link);
+
+		if (!stamp)
+			continue;
+
+		nsec = timespec_sub_to_nsec(stamp, &sstats->queued_commit_time);
+		ring_add(&sstats->latency, nsec_to_usec_clamped(nsec));
+		sstats->presented++;
+		if (sstats->queued_on_plane)
+			sstats->on_plane++;
+		if (sstats->queued_late)
+			sstats->late++;
+
+		if (!weston_log_scope_is_enabled(scope))
+			continue;
+
+		surface_stats_describe(sstats->surface, desc, sizeof desc);
+		weston_log_scope_printf(scope,
+			"%s on %s: %" PRIu32 " us commit to present, "
+			"%.1f refresh periods, %s%s\n", desc, output->name,
+			nsec_to_usec_clamped(nsec),
+			refresh_nsec > 0 ? (double) nsec / refresh_nsec : 0.0,
+			sstats->queued_on_plane ? "plane" : "composited",
+			sstats->queued_late ? ", missed the repaint" : "");
+	}
+}
+
+void
+weston_surface_stats_destroy(struct weston_surface *surface)
+{
+	struct weston_surface_stats *sstats = surface->stats;
+
+	if (!sstats)
+		return;
+
+	wl_list_remove(&sstats->queue_link);
+	wl_list_remove(&sstats->link);
+	free(sstats);
+	surface->stats = NULL;
+}
+
+static int
+compare_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+print_series(struct weston_log_subscription *sub,
+	     const struct frame_stats_ring *ring, const char *name,
+	     const char *unit)
+{
+	uint32_t sorted[FRAME_STATS_SAMPLES];
+	size_t n = MIN(ring->count, (uint64_t)FRAME_STATS_SAMPLES);
+	uint64_t sum = 0;
+	size_t i;
+
+	if (n == 0) {
+		weston_log_subscription_printf(sub, "\t%-16s no data\n", name);
+		return;
+	}
+
+	memcpy(sorted, ring->samples, n * sizeof sorted[0]);
+	qsort(sorted, n, sizeof sorted[0], compare_uint32);
+	for (i = 0; i < n; i++)
+		sum += sorted[i];
+
+	weston_log_subscription_printf(sub,
+		"\t%-16s %8" PRIu32 " %8" PRIu64 " %8" PRIu32 " %8" PRIu32
+		" %8" PRIu32 " %8" PRIu32 " %s\n", name,
+		sorted[0], sum / n, sorted[n / 2], sorted[n * 9 / 10],
+		sorted[n * 99 / 100], sorted[n - 1], unit);
+}
+
+static void
+print_output_stats(struct weston_log_subscription *sub,
+		   struct weston_output *output)
+{
+	struct weston_output_frame_stats *stats = output->frame_stats;
+	int i;
+
+	weston_log_subscription_printf(sub, "output %s:", output->name);
+	if (!stats || stats->frames == 0) {
+		weston_log_subscription_printf(sub, " no frames\n");
+		return;
+	}
+
+	weston_log_subscription_printf(sub,
+		" %" PRIu64 " frames, %" PRIu64 " missed deadlines, "
+		"%" PRIu64 " composited by the renderer, "
+		"%" PRIu64 " on planes only, "
+		"%" PRIu64 " fully repainted\n",
+		stats->frames, stats->missed, stats->renderer_frames,
+		stats->frames - stats->renderer_frames, stats->full_repaints);
+	weston_log_subscription_printf(sub,
+		"\tlast %d frames:       min      avg      p50      p90"
+		"      p99      max\n", FRAME_STATS_SAMPLES);
+
+	for (i = 0; i < FRAME_STATS_COUNT; i++)
+		print_series(sub, &stats->series[i], series_desc[i].name,
+			     series_desc[i].unit);
+
+	if (output->render_scale_min > 0.0f)
+		weston_log_subscription_printf(sub,
+			"\tdynamic resolution: render scale %.2f (min %.2f), "
+			"GPU load %.0f%%, %" PRIu64 " changes\n",
+			output->render_scale, output->render_scale_min,
+			stats->render_load * 100.0f,
+			stats->render_scale_changes);
+}
+
+static void
+print_surface_stats(struct weston_log_subscription *sub,
+		    struct weston_surface_stats *sstats)
+{
+	char desc[128];
+
+	surface_stats_describe(sstats->surface, desc, sizeof desc);
+	weston_log_subscription_printf(sub,
+		"%s: %" PRIu64 " presented, %" PRIu64 " from a plane, "
+		"%" PRIu64 " composited, %" PRIu64 " missed the repaint, "
+		"%" PRIu64 " dropped\n", desc, sstats->presented,
+		sstats->on_plane, sstats->presented - sstats->on_plane,
+		sstats->late, sstats->dropped);
+	if (sstats->presented == 0)
+		return;
+
+	weston_log_subscription_printf(sub,
+		"\tlast %d frames:       min      avg      p50      p90"
+		"      p99      max\n", FRAME_STATS_SAMPLES);
+	print_series(sub, &sstats->latency, "commit->present", "us");
+}
+
+/**
+ * Called when the 'surface-stats' debug scope is bound by a client. Prints
+ * what was recorded for each surface while the scope was bound before, and
+ * then one line per surface and presented frame for as long as it stays
+ * bound.
+ */
+void
+weston_compositor_surface_stats_cb(struct weston_log_subscription *sub,
+				   void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct weston_surface_stats *sstats;
+
+	wl_list_for_each(sstats, &compositor->surface_stats_list, link)
+		print_surface_stats(sub, sstats);
+}
+
+/**
+ * Called when the 'frame-stats' debug scope is bound by a client. This
+ * one-shot weston-debug scope prints the frame statistics of every enabled
+ * output when bound, and then terminates the stream.
+ */
+void
+weston_compositor_frame_stats_cb(struct weston_log_subscription *sub,
+				 void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct weston_output *output;
+
+	wl_list_for_each(output, &compositor->output_list, link)
+		print_output_stats(sub, output);
+
+	weston_log_subscription_printf(sub, "busiest clients, see the "
+				       "'client-cpu' scope for details:\n");
+	weston_compositor_client_cpu_print(sub, compositor, 5, false);
+
+	weston_log_subscription_complete(sub);
+}
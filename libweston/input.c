@@ -45,6 +45,8 @@
 #include <libweston/libweston.h>
 #include "backend.h"
 #include "libweston-internal.h"
+#include "timeline.h"
+#include "weston-trace.h"
 #include "relative-pointer-unstable-v1-server-protocol.h"
 #include "pointer-constraints-unstable-v1-server-protocol.h"
 #include "input-timestamps-unstable-v1-server-protocol.h"
@@ -196,6 +198,120 @@ weston_touch_device_get_mode(struct weston_touch_device *device)
 	return device->aggregate->seat->compositor->touch_mode;
 }
 
+/** The wl_keyboard or wl_touch resources of one client
+ *
+ * Unfocused resources are kept in \c resources, so that giving focus to a
+ * client, or sending modifiers to it, does not need to walk the resources
+ * of every other client. The entry lives as long as the client has
+ * resources for the device, focused or not.
+ */
+struct weston_input_client {
+	struct wl_list link;		/* client_buckets of the device */
+	struct wl_client *client;
+	struct wl_list resources;	/* unfocused resources */
+	int resource_count;		/* focused and unfocused */
+};
+
+static unsigned int
+input_client_hash(struct wl_client *client)
+{
+	uintptr_t v = (uintptr_t)client;
+
+	v ^= v >> 12;
+	return (v >> 4) & (WESTON_INPUT_CLIENT_BUCKETS - 1);
+}
+
+static void
+input_client_buckets_init(struct wl_list *buckets)
+{
+	int i;
+
+	for (i = 0; i < WESTON_INPUT_CLIENT_BUCKETS; i++)
+		wl_list_init(&buckets[i]);
+}
+
+static struct weston_input_client *
+input_client_find(struct wl_list *buckets, struct wl_client *client)
+{
+	struct weston_input_client *ic;
+
+	wl_list_for_each(ic, &buckets[input_client_hash(client)], link) {
+		if (ic->client == client)
+			return ic;
+	}
+
+	return NULL;
+}
+
+static struct weston_input_client *
+input_client_find_for_surface(struct wl_list *buckets,
+			      struct weston_surface *surface)
+{
+	if (!surface)
+		return NULL;
+
+	if (!surface->resource)
+		return NULL;
+
+	return input_client_find(buckets,
+				 wl_resource_get_client(surface->resource));
+}
+
+static struct weston_input_client *
+input_client_ensure(struct wl_list *buckets, struct wl_client *client)
+{
+	struct weston_input_client *ic;
+
+	ic = input_client_find(buckets, client);
+	if (ic)
+		return ic;
+
+	ic = zalloc(sizeof *ic);
+	if (!ic)
+		return NULL;
+
+	ic->client = client;
+	wl_list_init(&ic->resources);
+	wl_list_insert(&buckets[input_client_hash(client)], &ic->link);
+
+	return ic;
+}
+
+/* Called when one of the client's resources is destroyed, after it has
+ * been unlinked. */
+static void
+input_client_unref(struct wl_list *buckets, struct wl_client *client)
+{
+	struct weston_input_client *ic;
+
+	ic = input_client_find(buckets, client);
+	if (!ic || --ic->resource_count > 0)
+		return;
+
+	assert(wl_list_empty(&ic->resources));
+	wl_list_remove(&ic->link);
+	free(ic);
+}
+
+/* Drops all entries, leaving the unfocused resources inert. */
+static void
+input_client_buckets_release(struct wl_list *buckets)
+{
+	struct weston_input_client *ic, *tmp;
+	struct wl_resource *resource;
+	int i;
+
+	for (i = 0; i < WESTON_INPUT_CLIENT_BUCKETS; i++) {
+		wl_list_for_each_safe(ic, tmp, &buckets[i], link) {
+			wl_resource_for_each(resource, &ic->resources)
+				wl_resource_set_user_data(resource, NULL);
+			wl_list_remove(&ic->resources);
+			wl_list_remove(&ic->link);
+			free(ic);
+		}
+	}
+}
+
 static struct weston_pointer_client *
 weston_pointer_client_create(struct wl_client *client)
 {
@@ -243,8 +359,10 @@ weston_pointer_get_pointer_client(struct weston_pointer *pointer,
 				  struct wl_client *client)
 {
 	struct weston_pointer_client *pointer_client;
+	struct wl_list *bucket;
 
-	wl_list_for_each(pointer_client, &pointer->pointer_clients, link) {
+	bucket = &pointer->pointer_client_buckets[input_client_hash(client)];
+	wl_list_for_each(pointer_client, bucket, link) {
 		if (pointer_client->client == client)
 			return pointer_client;
 	}
@@ -263,7 +381,8 @@ weston_pointer_ensure_pointer_client(struct weston_pointer *pointer,
 		return pointer_client;
 
 	pointer_client = weston_pointer_client_create(client);
-	wl_list_insert(&pointer->pointer_clients, &pointer_client->link);
+	wl_list_insert(&pointer->pointer_client_buckets[input_client_hash(client)],
+		       &pointer_client->link);
 
 	if (pointer->focus &&
 	    pointer->focus->surface->resource &&
@@ -435,19 +554,21 @@ move_resources(struct wl_list *destination, struct wl_list *source)
 	wl_list_init(source);
 }
 
+/* All focused resources belong to the same client, hand them back to its
+ * entry. */
 static void
-move_resources_for_client(struct wl_list *destination,
-			  struct wl_list *source,
-			  struct wl_client *client)
+unfocus_resources(struct wl_list *buckets, struct wl_list *focus_list)
 {
-	struct wl_resource *resource, *tmp;
-	wl_resource_for_each_safe(resource, tmp, source) {
-		if (wl_resource_get_client(resource) == client) {
-			wl_list_remove(wl_resource_get_link(resource));
-			wl_list_insert(destination,
-				       wl_resource_get_link(resource));
-		}
-	}
+	struct wl_resource *first;
+	struct weston_input_client *ic;
+
+	if (wl_list_empty(focus_list))
+		return;
+
+	first = wl_resource_from_link(focus_list->next);
+	ic = input_client_find(buckets, wl_resource_get_client(first));
+	assert(ic);
+	move_resources(&ic->resources, focus_list);
 }
 
 static void
@@ -478,10 +599,18 @@ pointer_send_relative_motion(struct weston_pointer *pointer,
 	wl_fixed_t dxf, dyf, dxf_unaccel, dyf_unaccel;
 	struct wl_list *resource_list;
 	struct wl_resource *resource;
+	unsigned int i;
 
 	if (!pointer->focus_client)
 		return;
 
+	if (event->num_coalesced > 0) {
+		for (i = 0; i < event->num_coalesced; i++)
+			pointer_send_relative_motion(pointer, time,
+						     &event->coalesced[i]);
+		return;
+	}
+
 	if (!weston_pointer_motion_to_rel(pointer, event,
 					  &dx, &dy,
 					  &dx_unaccel, &dy_unaccel))
@@ -519,6 +648,11 @@ pointer_send_motion(struct weston_pointer *pointer,
 	if (!pointer->focus_client)
 		return;
 
+	if (pointer->focus)
+		TL_POINT(pointer->seat->compositor, "core_input_send",
+			 TLP_SURFACE(pointer->focus->surface),
+			 TLP_INPUT(time), TLP_END);
+
 	resource_list = &pointer->focus_client->pointer_resources;
 	msecs = timespec_to_msec(time);
 	wl_resource_for_each(resource, resource_list) {
@@ -604,6 +738,11 @@ weston_pointer_send_button(struct weston_pointer *pointer,
 	if (!weston_pointer_has_focus_resource(pointer))
 		return;
 
+	if (pointer->focus)
+		TL_POINT(pointer->seat->compositor, "core_input_send",
+			 TLP_SURFACE(pointer->focus->surface),
+			 TLP_INPUT(time), TLP_END);
+
 	resource_list = &pointer->focus_client->pointer_resources;
 	serial = wl_display_next_serial(display);
 	msecs = timespec_to_msec(time);
@@ -827,6 +966,9 @@ weston_touch_send_down(struct weston_touch *touch, const struct timespec *time,
 
 	weston_view_from_global_fixed(touch->focus, x, y, &sx, &sy);
 
+	TL_POINT(touch->seat->compositor, "core_input_send",
+		 TLP_SURFACE(touch->focus->surface), TLP_INPUT(time), TLP_END);
+
 	resource_list = &touch->focus_resource_list;
 	serial = wl_display_next_serial(display);
 	msecs = timespec_to_msec(time);
@@ -935,6 +1077,55 @@ default_grab_touch_motion(struct weston_touch_grab *grab,
 	weston_touch_send_motion(grab->touch, time, touch_id, x, y);
 }
 
+/** Send wl_touch.motion events for several points to focused resources.
+ *
+ * \param touch The touch where the motion events originates from.
+ * \param time The timestamp of the events
+ * \param motions The points that moved, in global coordinates
+ * \param count The number of points
+ *
+ * Like weston_touch_send_motion() for each point, with the focus and the
+ * resources looked up once.
+ */
+WL_EXPORT void
+weston_touch_send_motion_frame(struct weston_touch *touch,
+			       const struct timespec *time,
+			       const struct weston_touch_motion *motions,
+			       int count)
+{
+	struct wl_resource *resource;
+	wl_fixed_t sx, sy;
+	uint32_t msecs;
+	int i;
+
+	if (!weston_touch_has_focus_resource(touch))
+		return;
+
+	msecs = timespec_to_msec(time);
+	for (i = 0; i < count; i++) {
+		weston_view_from_global_fixed(touch->focus,
+					      motions[i].x, motions[i].y,
+					      &sx, &sy);
+
+		wl_resource_for_each(resource, &touch->focus_resource_list) {
+			send_timestamps_for_input_resource(resource,
+							   &touch->timestamps_list,
+							   time);
+			wl_touch_send_motion(resource, msecs,
+					     motions[i].touch_id, sx, sy);
+		}
+	}
+}
+
+static void
+default_grab_touch_motion_frame(struct weston_touch_grab *grab,
+				const struct timespec *time,
+				const struct weston_touch_motion *motions,
+				int count)
+{
+	weston_touch_send_motion_frame(grab->touch, time, motions, count);
+}
+
 
 /** Send wl_touch.frame events to focused resources.
  *
@@ -973,6 +1164,7 @@ static const struct weston_touch_grab_interface default_touch_grab_interface = {
 	default_grab_touch_motion,
 	default_grab_touch_frame,
 	default_grab_touch_cancel,
+	default_grab_touch_motion_frame,
 };
 
 /** Check if the keyboard has focused resources.
@@ -1017,6 +1209,9 @@ weston_keyboard_send_key(struct weston_keyboard *keyboard,
 	if (!weston_keyboard_has_focus_resource(keyboard))
 		return;
 
+	TL_POINT(keyboard->seat->compositor, "core_input_send",
+		 TLP_SURFACE(keyboard->focus), TLP_INPUT(time), TLP_END);
+
 	resource_list = &keyboard->focus_resource_list;
 	serial = wl_display_next_serial(display);
 	msecs = timespec_to_msec(time);
@@ -1050,19 +1245,19 @@ send_modifiers_to_resource(struct weston_keyboard *keyboard,
 }
 
 static void
-send_modifiers_to_client_in_list(struct wl_client *client,
-				 struct wl_list *list,
-				 uint32_t serial,
-				 struct weston_keyboard *keyboard)
+send_modifiers_to_client(struct weston_keyboard *keyboard,
+			 struct wl_client *client,
+			 uint32_t serial)
 {
+	struct weston_input_client *ic;
 	struct wl_resource *resource;
 
-	wl_resource_for_each(resource, list) {
-		if (wl_resource_get_client(resource) == client)
-			send_modifiers_to_resource(keyboard,
-						   resource,
-						   serial);
-	}
+	ic = input_client_find(keyboard->client_buckets, client);
+	if (!ic)
+		return;
+
+	wl_resource_for_each(resource, &ic->resources)
+		send_modifiers_to_resource(keyboard, resource, serial);
 }
 
 static struct weston_pointer_client *
@@ -1090,18 +1285,6 @@ find_pointer_client_for_view(struct weston_pointer *pointer, struct weston_view
 	return find_pointer_client_for_surface(pointer, view->surface);
 }
 
-static struct wl_resource *
-find_resource_for_surface(struct wl_list *list, struct weston_surface *surface)
-{
-	if (!surface)
-		return NULL;
-
-	if (!surface->resource)
-		return NULL;
-
-	return wl_resource_find_for_client(list, wl_resource_get_client(surface->resource));
-}
-
 /** Send wl_keyboard.modifiers events to focused resources and pointer
  *  focused resources.
  *
@@ -1144,10 +1327,7 @@ weston_keyboard_send_modifiers(struct weston_keyboard *keyboard,
 		struct wl_client *pointer_client =
 			wl_resource_get_client(pointer->focus->surface->resource);
 
-		send_modifiers_to_client_in_list(pointer_client,
-						 &keyboard->resource_list,
-						 serial,
-						 keyboard);
+		send_modifiers_to_client(keyboard, pointer_client, serial);
 	}
 }
 
@@ -1217,7 +1397,7 @@ weston_pointer_create(struct weston_seat *seat)
 	if (pointer == NULL)
 		return NULL;
 
-	wl_list_init(&pointer->pointer_clients);
+	input_client_buckets_init(pointer->pointer_client_buckets);
 	weston_pointer_set_default_grab(pointer,
 					seat->compositor->default_pointer_grab);
 	wl_list_init(&pointer->focus_resource_listener.link);
@@ -1251,16 +1431,19 @@ static void
 weston_pointer_destroy(struct weston_pointer *pointer)
 {
 	struct weston_pointer_client *pointer_client, *tmp;
+	int i;
 
 	wl_signal_emit(&pointer->destroy_signal, pointer);
 
 	if (pointer->sprite)
 		pointer_unmap_sprite(pointer);
 
-	wl_list_for_each_safe(pointer_client, tmp, &pointer->pointer_clients,
-			      link) {
-		wl_list_remove(&pointer_client->link);
-		weston_pointer_client_destroy(pointer_client);
+	for (i = 0; i < WESTON_INPUT_CLIENT_BUCKETS; i++) {
+		wl_list_for_each_safe(pointer_client, tmp,
+				      &pointer->pointer_client_buckets[i], link) {
+			wl_list_remove(&pointer_client->link);
+			weston_pointer_client_destroy(pointer_client);
+		}
 	}
 
 	wl_list_remove(&pointer->focus_resource_listener.link);
@@ -1290,7 +1473,7 @@ weston_keyboard_create(void)
 	if (keyboard == NULL)
 	    return NULL;
 
-	wl_list_init(&keyboard->resource_list);
+	input_client_buckets_init(keyboard->client_buckets);
 	wl_list_init(&keyboard->focus_resource_list);
 	wl_list_init(&keyboard->focus_resource_listener.link);
 	keyboard->focus_resource_listener.notify = keyboard_focus_resource_destroyed;
@@ -1312,15 +1495,12 @@ weston_keyboard_destroy(struct weston_keyboard *keyboard)
 {
 	struct wl_resource *resource;
 
-	wl_resource_for_each(resource, &keyboard->resource_list) {
-		wl_resource_set_user_data(resource, NULL);
-	}
+	input_client_buckets_release(keyboard->client_buckets);
 
 	wl_resource_for_each(resource, &keyboard->focus_resource_list) {
 		wl_resource_set_user_data(resource, NULL);
 	}
 
-	wl_list_remove(&keyboard->resource_list);
 	wl_list_remove(&keyboard->focus_resource_list);
 
 	xkb_state_unref(keyboard->xkb_state.state);
@@ -1350,7 +1530,7 @@ weston_touch_create(void)
 		return NULL;
 
 	wl_list_init(&touch->device_list);
-	wl_list_init(&touch->resource_list);
+	input_client_buckets_init(touch->client_buckets);
 	wl_list_init(&touch->focus_resource_list);
 	wl_list_init(&touch->focus_view_listener.link);
 	touch->focus_view_listener.notify = touch_focus_view_destroyed;
@@ -1372,15 +1552,12 @@ weston_touch_destroy(struct weston_touch *touch)
 
 	assert(wl_list_empty(&touch->device_list));
 
-	wl_resource_for_each(resource, &touch->resource_list) {
-		wl_resource_set_user_data(resource, NULL);
-	}
+	input_client_buckets_release(touch->client_buckets);
 
 	wl_resource_for_each(resource, &touch->focus_resource_list) {
 		wl_resource_set_user_data(resource, NULL);
 	}
 
-	wl_list_remove(&touch->resource_list);
 	wl_list_remove(&touch->focus_resource_list);
 	wl_list_remove(&touch->focus_view_listener.link);
 	wl_list_remove(&touch->focus_resource_listener.link);
@@ -1469,10 +1646,7 @@ weston_pointer_set_focus(struct weston_pointer *pointer,
 		serial = wl_display_next_serial(display);
 
 		if (kbd && kbd->focus != view->surface)
-			send_modifiers_to_client_in_list(surface_client,
-							 &kbd->resource_list,
-							 serial,
-							 kbd);
+			send_modifiers_to_client(kbd, surface_client, serial);
 
 		pointer->focus_client = pointer_client;
 
@@ -1534,6 +1708,7 @@ weston_keyboard_set_focus(struct weston_keyboard *keyboard,
 	struct wl_display *display = keyboard->seat->compositor->wl_display;
 	uint32_t serial;
 	struct wl_list *focus_resource_list;
+	struct weston_input_client *ic;
 
 	/* Keyboard focus on a surface without a client is equivalent to NULL
 	 * focus as nothing would react to the keyboard events anyway.
@@ -1551,19 +1726,15 @@ weston_keyboard_set_focus(struct weston_keyboard *keyboard,
 			wl_keyboard_send_leave(resource, serial,
 					keyboard->focus->resource);
 		}
-		move_resources(&keyboard->resource_list, focus_resource_list);
+		unfocus_resources(keyboard->client_buckets, focus_resource_list);
 	}
 
-	if (find_resource_for_surface(&keyboard->resource_list, surface) &&
+	ic = input_client_find_for_surface(keyboard->client_buckets, surface);
+	if (ic && !wl_list_empty(&ic->resources) &&
 	    keyboard->focus != surface) {
-		struct wl_client *surface_client =
-			wl_resource_get_client(surface->resource);
-
 		serial = wl_display_next_serial(display);
 
-		move_resources_for_client(focus_resource_list,
-					  &keyboard->resource_list,
-					  surface_client);
+		move_resources(focus_resource_list, &ic->resources);
 		send_enter_to_resource_list(focus_resource_list,
 					    keyboard,
 					    surface,
@@ -1718,7 +1889,7 @@ weston_pointer_move_to(struct weston_pointer *pointer,
 		weston_view_set_position(pointer->sprite,
 					 ix - pointer->hotspot_x,
 					 iy - pointer->hotspot_y);
-		weston_view_schedule_repaint(pointer->sprite);
+		weston_view_schedule_cursor_repaint(pointer->sprite);
 	}
 
 	pointer->grab->interface->focus(pointer->grab);
@@ -1787,6 +1958,9 @@ notify_motion(struct weston_seat *seat,
 	struct weston_compositor *ec = seat->compositor;
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
+	TL_POINT(ec, "core_input", TLP_INPUT(time), TLP_END);
+	WESTON_TRACE(input_motion);
+
 	weston_compositor_wake(ec);
 	pointer->grab->interface->motion(pointer->grab, time, event);
 }
@@ -1835,6 +2009,9 @@ notify_motion_absolute(struct weston_seat *seat, const struct timespec *time,
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 	struct weston_pointer_motion_event event = { 0 };
 
+	TL_POINT(ec, "core_input", TLP_INPUT(time), TLP_END);
+	WESTON_TRACE(input_motion);
+
 	weston_compositor_wake(ec);
 
 	event = (struct weston_pointer_motion_event) {
@@ -1882,6 +2059,9 @@ notify_button(struct weston_seat *seat, const struct timespec *time,
 	struct weston_compositor *compositor = seat->compositor;
 	struct weston_pointer *pointer = weston_seat_get_pointer(seat);
 
+	TL_POINT(compositor, "core_input", TLP_INPUT(time), TLP_END);
+	WESTON_TRACE1(input_button, button);
+
 	if (state == WL_POINTER_BUTTON_STATE_PRESSED) {
 		weston_compositor_idle_inhibit(compositor);
 		if (pointer->button_count == 0) {
@@ -2123,19 +2303,22 @@ send_modifiers(struct wl_resource *resource, uint32_t serial, struct weston_keyb
 }
 
 static struct weston_xkb_info *
-weston_xkb_info_create(struct xkb_keymap *keymap);
+weston_xkb_info_get(struct weston_compositor *ec, struct xkb_keymap *keymap);
 
 static void
 update_keymap(struct weston_seat *seat)
 {
 	struct weston_keyboard *keyboard = weston_seat_get_keyboard(seat);
 	struct wl_resource *resource;
+	struct weston_input_client *ic;
 	struct weston_xkb_info *xkb_info;
 	struct xkb_state *state;
 	xkb_mod_mask_t latched_mods;
 	xkb_mod_mask_t locked_mods;
+	int i;
 
-	xkb_info = weston_xkb_info_create(keyboard->pending_keymap);
+	xkb_info = weston_xkb_info_get(seat->compositor,
+				       keyboard->pending_keymap);
 
 	xkb_keymap_unref(keyboard->pending_keymap);
 	keyboard->pending_keymap = NULL;
@@ -2168,8 +2351,10 @@ update_keymap(struct weston_seat *seat)
 	xkb_state_unref(keyboard->xkb_state.state);
 	keyboard->xkb_state.state = state;
 
-	wl_resource_for_each(resource, &keyboard->resource_list)
-		weston_keyboard_send_keymap(keyboard, resource);
+	for (i = 0; i < WESTON_INPUT_CLIENT_BUCKETS; i++)
+		wl_list_for_each(ic, &keyboard->client_buckets[i], link)
+			wl_resource_for_each(resource, &ic->resources)
+				weston_keyboard_send_keymap(keyboard, resource);
 	wl_resource_for_each(resource, &keyboard->focus_resource_list)
 		weston_keyboard_send_keymap(keyboard, resource);
 
@@ -2178,8 +2363,10 @@ update_keymap(struct weston_seat *seat)
 	if (!latched_mods && !locked_mods)
 		return;
 
-	wl_resource_for_each(resource, &keyboard->resource_list)
-		send_modifiers(resource, wl_display_get_serial(seat->compositor->wl_display), keyboard);
+	for (i = 0; i < WESTON_INPUT_CLIENT_BUCKETS; i++)
+		wl_list_for_each(ic, &keyboard->client_buckets[i], link)
+			wl_resource_for_each(resource, &ic->resources)
+				send_modifiers(resource, wl_display_get_serial(seat->compositor->wl_display), keyboard);
 	wl_resource_for_each(resource, &keyboard->focus_resource_list)
 		send_modifiers(resource, wl_display_get_serial(seat->compositor->wl_display), keyboard);
 }
@@ -2194,6 +2381,9 @@ notify_key(struct weston_seat *seat, const struct timespec *time, uint32_t key,
 	struct weston_keyboard_grab *grab = keyboard->grab;
 	uint32_t *k, *end;
 
+	TL_POINT(compositor, "core_input", TLP_INPUT(time), TLP_END);
+	WESTON_TRACE1(input_key, key);
+
 	if (state == WL_KEYBOARD_KEY_STATE_PRESSED) {
 		weston_compositor_idle_inhibit(compositor);
 	} else {
@@ -2343,23 +2533,20 @@ weston_touch_set_focus(struct weston_touch *touch, struct weston_view *view)
 	wl_list_remove(&touch->focus_view_listener.link);
 	wl_list_init(&touch->focus_view_listener.link);
 
-	if (!wl_list_empty(focus_resource_list)) {
-		move_resources(&touch->resource_list,
-			       focus_resource_list);
-	}
+	unfocus_resources(touch->client_buckets, focus_resource_list);
 
 	if (view) {
-		struct wl_client *surface_client;
+		struct weston_input_client *ic;
 
 		if (!view->surface->resource) {
 			touch->focus = NULL;
 			return;
 		}
 
-		surface_client = wl_resource_get_client(view->surface->resource);
-		move_resources_for_client(focus_resource_list,
-					  &touch->resource_list,
-					  surface_client);
+		ic = input_client_find_for_surface(touch->client_buckets,
+						   view->surface);
+		if (ic)
+			move_resources(focus_resource_list, &ic->resources);
 		wl_resource_add_destroy_listener(view->surface->resource,
 						 &touch->focus_resource_listener);
 		wl_signal_add(&view->destroy_signal, &touch->focus_view_listener);
@@ -2566,6 +2753,9 @@ notify_touch_normalized(struct weston_touch_device *device,
 	struct weston_seat *seat = device->aggregate->seat;
 	struct weston_touch *touch = device->aggregate;
 
+	TL_POINT(seat->compositor, "core_input", TLP_INPUT(time), TLP_END);
+	WESTON_TRACE1(input_touch, touch_id);
+
 	if (touch_type != WL_TOUCH_UP) {
 		if (weston_touch_device_can_calibrate(device))
 			assert(norm != NULL);
@@ -2612,6 +2802,77 @@ notify_touch_normalized(struct weston_touch_device *device,
 	}
 }
 
+/** Feed in the motion of the touch points of one frame
+ *
+ * \param device The physical device that generated the events.
+ * \param time The timestamp of the events.
+ * \param points The points that moved, each at most once.
+ * \param count The number of points.
+ *
+ * Like notify_touch_normalized() with WL_TOUCH_MOTION for every point,
+ * but a grab implementing motion_frame gets all of them in one call, so
+ * the focus and resources are looked up once per frame. Follow with
+ * notify_touch_frame().
+ */
+WL_EXPORT void
+notify_touch_motion_frame(struct weston_touch_device *device,
+			  const struct timespec *time,
+			  const struct weston_touch_point_update *points,
+			  int count)
+{
+	struct weston_touch *touch = device->aggregate;
+	struct weston_touch_grab *grab = touch->grab;
+	struct weston_touch_motion stack_motions[16];
+	struct weston_touch_motion *motions = stack_motions;
+	enum weston_touch_mode mode = weston_touch_device_get_mode(device);
+	bool can_calibrate = weston_touch_device_can_calibrate(device);
+	int i;
+
+	if ((mode != WESTON_TOUCH_MODE_NORMAL &&
+	     mode != WESTON_TOUCH_MODE_PREP_CALIB) ||
+	    !grab->interface->motion_frame || count < 2) {
+		for (i = 0; i < count; i++)
+			notify_touch_normalized(device, time,
+						points[i].touch_id,
+						points[i].x, points[i].y,
+						can_calibrate ?
+						&points[i].norm : NULL,
+						WL_TOUCH_MOTION);
+		return;
+	}
+
+	TL_POINT(touch->seat->compositor, "core_input", TLP_INPUT(time),
+		 TLP_END);
+
+	if (count > (int)ARRAY_LENGTH(stack_motions)) {
+		motions = malloc(count * sizeof(*motions));
+		if (!motions) {
+			weston_log("out of memory for %d touch points\n",
+				   count);
+			return;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		WESTON_TRACE1(input_touch, points[i].touch_id);
+
+		motions[i].touch_id = points[i].touch_id;
+		motions[i].x = wl_fixed_from_double(points[i].x);
+		motions[i].y = wl_fixed_from_double(points[i].y);
+
+		if (motions[i].touch_id == touch->grab_touch_id) {
+			touch->grab_x = motions[i].x;
+			touch->grab_y = motions[i].y;
+		}
+	}
+
+	if (touch->focus)
+		grab->interface->motion_frame(grab, time, motions, count);
+
+	if (motions != stack_motions)
+		free(motions);
+}
+
 WL_EXPORT void
 notify_touch_frame(struct weston_touch_device *device)
 {
@@ -2835,6 +3096,8 @@ destroy_keyboard_resource(struct wl_resource *resource)
 	if (keyboard) {
 		remove_input_resource_from_timestamps(resource,
 						      &keyboard->timestamps_list);
+		input_client_unref(keyboard->client_buckets,
+				   wl_resource_get_client(resource));
 	}
 }
 
@@ -2862,6 +3125,7 @@ seat_get_keyboard(struct wl_client *client, struct wl_resource *resource,
 	 * capabilities and the client trying to use the old ones.
 	 */
 	struct weston_keyboard *keyboard = seat ? seat->keyboard_state : NULL;
+	struct weston_input_client *ic;
 	struct wl_resource *cr;
 
         cr = wl_resource_create(client, &wl_keyboard_interface,
@@ -2880,10 +3144,18 @@ seat_get_keyboard(struct wl_client *client, struct wl_resource *resource,
 	if (!keyboard)
 		return;
 
+	ic = input_client_ensure(keyboard->client_buckets, client);
+	if (!ic) {
+		wl_resource_destroy(cr);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	ic->resource_count++;
+
 	/* May be moved to focused list later by either
 	 * weston_keyboard_set_focus or directly if this client is already
 	 * focused */
-	wl_list_insert(&keyboard->resource_list, wl_resource_get_link(cr));
+	wl_list_insert(&ic->resources, wl_resource_get_link(cr));
 
 	if (wl_resource_get_version(cr) >= WL_KEYBOARD_REPEAT_INFO_SINCE_VERSION) {
 		wl_keyboard_send_repeat_info(cr,
@@ -2928,6 +3200,8 @@ destroy_touch_resource(struct wl_resource *resource)
 	if (touch) {
 		remove_input_resource_from_timestamps(resource,
 						      &touch->timestamps_list);
+		input_client_unref(touch->client_buckets,
+				   wl_resource_get_client(resource));
 	}
 }
 
@@ -2955,6 +3229,7 @@ seat_get_touch(struct wl_client *client, struct wl_resource *resource,
 	 * capabilities and the client trying to use the old ones.
 	 */
 	struct weston_touch *touch = seat ? seat->touch_state : NULL;
+	struct weston_input_client *ic;
 	struct wl_resource *cr;
 
         cr = wl_resource_create(client, &wl_touch_interface,
@@ -2973,13 +3248,20 @@ seat_get_touch(struct wl_client *client, struct wl_resource *resource,
 	if (!touch)
 		return;
 
+	ic = input_client_ensure(touch->client_buckets, client);
+	if (!ic) {
+		wl_resource_destroy(cr);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	ic->resource_count++;
+
 	if (touch->focus &&
 	    wl_resource_get_client(touch->focus->surface->resource) == client) {
 		wl_list_insert(&touch->focus_resource_list,
 			       wl_resource_get_link(cr));
 	} else {
-		wl_list_insert(&touch->resource_list,
-			       wl_resource_get_link(cr));
+		wl_list_insert(&ic->resources, wl_resource_get_link(cr));
 	}
 }
 
@@ -3115,12 +3397,94 @@ weston_compositor_set_xkb_rule_names(struct weston_compositor *ec,
 	return 0;
 }
 
+struct weston_keymap_cache_entry {
+	struct wl_list link; /**< weston_compositor::keymap_cache */
+	struct xkb_rule_names names;
+	struct xkb_keymap *keymap;
+};
+
+static bool
+xkb_name_equal(const char *a, const char *b)
+{
+	return strcmp(a ?: "", b ?: "") == 0;
+}
+
+static bool
+xkb_name_dup(const char **dst, const char *src)
+{
+	*dst = src ? strdup(src) : NULL;
+
+	return !src || *dst;
+}
+
+static void
+weston_keymap_cache_entry_destroy(struct weston_keymap_cache_entry *entry)
+{
+	wl_list_remove(&entry->link);
+	xkb_keymap_unref(entry->keymap);
+	free((char *) entry->names.rules);
+	free((char *) entry->names.model);
+	free((char *) entry->names.layout);
+	free((char *) entry->names.variant);
+	free((char *) entry->names.options);
+	free(entry);
+}
+
+/** Compile a keymap from RMLVO names, or reuse an earlier one
+ *
+ * \param ec The compositor.
+ * \param names The rules, model, layout, variant and options names.
+ * \return A new reference to the keymap, or NULL on failure.
+ *
+ * Compiling a keymap takes tens of milliseconds and seats tend to use the
+ * same few layouts, so keymaps are kept for the lifetime of the compositor.
+ * Keyboards using the same cached keymap also share its weston_xkb_info and
+ * the keymap file sent to clients.
+ */
+WL_EXPORT struct xkb_keymap *
+weston_compositor_keymap_from_names(struct weston_compositor *ec,
+				    const struct xkb_rule_names *names)
+{
+	struct weston_keymap_cache_entry *entry;
+	struct xkb_keymap *keymap;
+
+	wl_list_for_each(entry, &ec->keymap_cache, link) {
+		if (xkb_name_equal(entry->names.rules, names->rules) &&
+		    xkb_name_equal(entry->names.model, names->model) &&
+		    xkb_name_equal(entry->names.layout, names->layout) &&
+		    xkb_name_equal(entry->names.variant, names->variant) &&
+		    xkb_name_equal(entry->names.options, names->options))
+			return xkb_keymap_ref(entry->keymap);
+	}
+
+	keymap = xkb_keymap_new_from_names(ec->xkb_context, names, 0);
+	if (!keymap)
+		return NULL;
+
+	entry = zalloc(sizeof *entry);
+	if (!entry)
+		return keymap;
+
+	entry->keymap = xkb_keymap_ref(keymap);
+	wl_list_insert(&ec->keymap_cache, &entry->link);
+
+	if (!xkb_name_dup(&entry->names.rules, names->rules) ||
+	    !xkb_name_dup(&entry->names.model, names->model) ||
+	    !xkb_name_dup(&entry->names.layout, names->layout) ||
+	    !xkb_name_dup(&entry->names.variant, names->variant) ||
+	    !xkb_name_dup(&entry->names.options, names->options))
+		weston_keymap_cache_entry_destroy(entry);
+
+	return keymap;
+}
+
 static void
 weston_xkb_info_destroy(struct weston_xkb_info *xkb_info)
 {
 	if (--xkb_info->ref_count > 0)
 		return;
 
+	wl_list_remove(&xkb_info->link);
 	xkb_keymap_unref(xkb_info->keymap);
 
 	os_ro_anonymous_file_destroy(xkb_info->keymap_rofile);
@@ -3130,6 +3494,11 @@ weston_xkb_info_destroy(struct weston_xkb_info *xkb_info)
 void
 weston_compositor_xkb_destroy(struct weston_compositor *ec)
 {
+	struct weston_keymap_cache_entry *entry, *tmp;
+
+	wl_list_for_each_safe(entry, tmp, &ec->keymap_cache, link)
+		weston_keymap_cache_entry_destroy(entry);
+
 	free((char *) ec->xkb_names.rules);
 	free((char *) ec->xkb_names.model);
 	free((char *) ec->xkb_names.layout);
@@ -3202,6 +3571,30 @@ err_keymap:
 	return NULL;
 }
 
+/** Find the weston_xkb_info of a keymap, creating it on first use
+ *
+ * Sharing it between keyboards with the same keymap keeps one sealed keymap
+ * file for all of their clients.
+ */
+static struct weston_xkb_info *
+weston_xkb_info_get(struct weston_compositor *ec, struct xkb_keymap *keymap)
+{
+	struct weston_xkb_info *xkb_info;
+
+	wl_list_for_each(xkb_info, &ec->xkb_info_list, link) {
+		if (xkb_info->keymap == keymap) {
+			xkb_info->ref_count++;
+			return xkb_info;
+		}
+	}
+
+	xkb_info = weston_xkb_info_create(keymap);
+	if (xkb_info)
+		wl_list_insert(&ec->xkb_info_list, &xkb_info->link);
+
+	return xkb_info;
+}
+
 static int
 weston_compositor_build_global_keymap(struct weston_compositor *ec)
 {
@@ -3210,9 +3603,7 @@ weston_compositor_build_global_keymap(struct weston_compositor *ec)
 	if (ec->xkb_info != NULL)
 		return 0;
 
-	keymap = xkb_keymap_new_from_names(ec->xkb_context,
-					   &ec->xkb_names,
-					   0);
+	keymap = weston_compositor_keymap_from_names(ec, &ec->xkb_names);
 	if (keymap == NULL) {
 		weston_log("failed to compile global XKB keymap\n");
 		weston_log("  tried rules %s, model %s, layout %s, variant %s, "
@@ -3223,7 +3614,7 @@ weston_compositor_build_global_keymap(struct weston_compositor *ec)
 		return -1;
 	}
 
-	ec->xkb_info = weston_xkb_info_create(keymap);
+	ec->xkb_info = weston_xkb_info_get(ec, keymap);
 	xkb_keymap_unref(keymap);
 	if (ec->xkb_info == NULL)
 		return -1;
@@ -3265,7 +3656,8 @@ weston_seat_init_keyboard(struct weston_seat *seat, struct xkb_keymap *keymap)
 	}
 
 	if (keymap != NULL) {
-		keyboard->xkb_info = weston_xkb_info_create(keymap);
+		keyboard->xkb_info = weston_xkb_info_get(seat->compositor,
+							 keymap);
 		if (keyboard->xkb_info == NULL)
 			goto err;
 	} else {
@@ -35,6 +35,11 @@ struct launcher_interface {
 	void (* destroy) (struct weston_launcher *launcher);
 	int (* open) (struct weston_launcher *launcher, const char *path, int flags);
 	void (* close) (struct weston_launcher *launcher, int fd);
+	/* Optional: start getting the device at path, so that a later open
+	 * of it returns quicker */
+	void (* prefetch) (struct weston_launcher *launcher, const char *path);
+	/* Optional: drop what was prefetched but not opened */
+	void (* prefetch_done) (struct weston_launcher *launcher);
 	int (* activate_vt) (struct weston_launcher *launcher, int vt);
 	/* Get the number of the VT weston is running in */
 	int (* get_vt) (struct weston_launcher *launcher);
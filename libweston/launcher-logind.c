@@ -67,35 +67,94 @@ struct launcher_logind {
 	struct wl_event_source *dbus_ctx;
 	char *spath;
 	DBusPendingCall *pending_active;
+
+	struct wl_list prefetch_list;	/**< launcher_logind_prefetch::link */
 };
 
-static int
-launcher_logind_take_device(struct launcher_logind *wl, uint32_t major,
-			  uint32_t minor, bool *paused_out)
+/** A TakeDevice call sent ahead of the open() that needs its reply */
+struct launcher_logind_prefetch {
+	struct wl_list link;
+	uint32_t major;
+	uint32_t minor;
+	DBusPendingCall *pending;
+};
+
+static DBusMessage *
+launcher_logind_new_take_device(struct launcher_logind *wl, uint32_t major,
+				uint32_t minor)
 {
-	DBusMessage *m, *reply;
+	DBusMessage *m;
 	bool b;
-	int r, fd;
-	dbus_bool_t paused;
 
 	m = dbus_message_new_method_call("org.freedesktop.login1",
 					 wl->spath,
 					 "org.freedesktop.login1.Session",
 					 "TakeDevice");
 	if (!m)
-		return -ENOMEM;
+		return NULL;
 
 	b = dbus_message_append_args(m,
 				     DBUS_TYPE_UINT32, &major,
 				     DBUS_TYPE_UINT32, &minor,
 				     DBUS_TYPE_INVALID);
 	if (!b) {
-		r = -ENOMEM;
-		goto err_unref;
+		dbus_message_unref(m);
+		return NULL;
 	}
 
-	reply = dbus_connection_send_with_reply_and_block(wl->dbus, m,
-							  -1, NULL);
+	return m;
+}
+
+static struct launcher_logind_prefetch *
+launcher_logind_find_prefetch(struct launcher_logind *wl, uint32_t major,
+			      uint32_t minor)
+{
+	struct launcher_logind_prefetch *prefetch;
+
+	wl_list_for_each(prefetch, &wl->prefetch_list, link)
+		if (prefetch->major == major && prefetch->minor == minor)
+			return prefetch;
+
+	return NULL;
+}
+
+static DBusMessage *
+launcher_logind_prefetch_reply(struct launcher_logind_prefetch *prefetch)
+{
+	DBusMessage *reply;
+
+	wl_list_remove(&prefetch->link);
+	dbus_pending_call_block(prefetch->pending);
+	reply = dbus_pending_call_steal_reply(prefetch->pending);
+	dbus_pending_call_unref(prefetch->pending);
+	free(prefetch);
+
+	return reply;
+}
+
+static int
+launcher_logind_take_device(struct launcher_logind *wl, uint32_t major,
+			  uint32_t minor, bool *paused_out)
+{
+	struct launcher_logind_prefetch *prefetch;
+	DBusMessage *m = NULL, *reply;
+	bool b;
+	int r, fd;
+	dbus_bool_t paused;
+
+	/* Waiting for a reply already on its way only costs the time the
+	 * requests sent after it have not yet used. */
+	prefetch = launcher_logind_find_prefetch(wl, major, minor);
+	if (prefetch) {
+		reply = launcher_logind_prefetch_reply(prefetch);
+	} else {
+		m = launcher_logind_new_take_device(wl, major, minor);
+		if (!m)
+			return -ENOMEM;
+
+		reply = dbus_connection_send_with_reply_and_block(wl->dbus, m,
+								  -1, NULL);
+	}
 	if (!reply) {
 		r = -ENODEV;
 		goto err_unref;
@@ -117,7 +176,8 @@ launcher_logind_take_device(struct launcher_logind *wl, uint32_t major,
 err_reply:
 	dbus_message_unref(reply);
 err_unref:
-	dbus_message_unref(m);
+	if (m)
+		dbus_message_unref(m);
 	return r;
 }
 
@@ -216,6 +276,69 @@ err_close:
 	return -1;
 }
 
+static void
+launcher_logind_prefetch(struct weston_launcher *launcher, const char *path)
+{
+	struct launcher_logind *wl = wl_container_of(launcher, wl, base);
+	struct launcher_logind_prefetch *prefetch;
+	struct stat st;
+	DBusMessage *m;
+
+	if (stat(path, &st) < 0 || !S_ISCHR(st.st_mode))
+		return;
+
+	if (launcher_logind_find_prefetch(wl, major(st.st_rdev),
+					  minor(st.st_rdev)))
+		return;
+
+	prefetch = zalloc(sizeof *prefetch);
+	if (!prefetch)
+		return;
+
+	prefetch->major = major(st.st_rdev);
+	prefetch->minor = minor(st.st_rdev);
+
+	m = launcher_logind_new_take_device(wl, prefetch->major,
+					    prefetch->minor);
+	if (!m || !dbus_connection_send_with_reply(wl->dbus, m,
+						   &prefetch->pending, -1) ||
+	    !prefetch->pending) {
+		if (m)
+			dbus_message_unref(m);
+		free(prefetch);
+		return;
+	}
+	dbus_message_unref(m);
+
+	wl_list_insert(wl->prefetch_list.prev, &prefetch->link);
+}
+
+static void
+launcher_logind_prefetch_done(struct weston_launcher *launcher)
+{
+	struct launcher_logind *wl = wl_container_of(launcher, wl, base);
+	struct launcher_logind_prefetch *prefetch, *tmp;
+	DBusMessage *reply;
+	int fd;
+
+	/* Give back the devices nobody ended up opening. */
+	wl_list_for_each_safe(prefetch, tmp, &wl->prefetch_list, link) {
+		uint32_t major = prefetch->major, minor = prefetch->minor;
+
+		reply = launcher_logind_prefetch_reply(prefetch);
+		if (!reply)
+			continue;
+
+		if (dbus_message_get_args(reply, NULL,
+					  DBUS_TYPE_UNIX_FD, &fd,
+					  DBUS_TYPE_INVALID)) {
+			close(fd);
+			launcher_logind_release_device(wl, major, minor);
+		}
+		dbus_message_unref(reply);
+	}
+}
+
 static void
 launcher_logind_close(struct weston_launcher *launcher, int fd)
 {
@@ -740,6 +863,7 @@ launcher_logind_connect(struct weston_launcher **out, struct weston_compositor *
 	wl->base.iface = &launcher_logind_iface;
 	wl->compositor = compositor;
 	wl->sync_drm = sync_drm;
+	wl_list_init(&wl->prefetch_list);
 
 	wl->seat = strdup(seat_id);
 	if (!wl->seat) {
@@ -825,12 +949,20 @@ static void
 launcher_logind_destroy(struct weston_launcher *launcher)
 {
 	struct launcher_logind *wl = wl_container_of(launcher, wl, base);
+	struct launcher_logind_prefetch *prefetch, *tmp;
 
 	if (wl->pending_active) {
 		dbus_pending_call_cancel(wl->pending_active);
 		dbus_pending_call_unref(wl->pending_active);
 	}
 
+	/* Releasing control gives back whatever these got. */
+	wl_list_for_each_safe(prefetch, tmp, &wl->prefetch_list, link) {
+		dbus_pending_call_cancel(prefetch->pending);
+		dbus_pending_call_unref(prefetch->pending);
+		free(prefetch);
+	}
+
 	launcher_logind_release_control(wl);
 	launcher_logind_destroy_dbus(wl);
 	weston_dbus_close(wl->dbus, wl->dbus_ctx);
@@ -851,6 +983,8 @@ const struct launcher_interface launcher_logind_iface = {
 	.destroy = launcher_logind_destroy,
 	.open = launcher_logind_open,
 	.close = launcher_logind_close,
+	.prefetch = launcher_logind_prefetch,
+	.prefetch_done = launcher_logind_prefetch_done,
 	.activate_vt = launcher_logind_activate_vt,
 	.get_vt = launcher_logind_get_vt,
 };
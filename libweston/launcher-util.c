@@ -80,6 +80,27 @@ weston_launcher_close(struct weston_launcher *launcher, int fd)
 	launcher->iface->close(launcher, fd);
 }
 
+/** Ask for a device ahead of opening it
+ *
+ * Launchers that have to ask another process for devices can then have
+ * the requests for many devices in flight at once. Every device
+ * prefetched and not opened by weston_launcher_prefetch_done() is given
+ * back then.
+ */
+WL_EXPORT void
+weston_launcher_prefetch(struct weston_launcher *launcher, const char *path)
+{
+	if (launcher->iface->prefetch)
+		launcher->iface->prefetch(launcher, path);
+}
+
+WL_EXPORT void
+weston_launcher_prefetch_done(struct weston_launcher *launcher)
+{
+	if (launcher->iface->prefetch_done)
+		launcher->iface->prefetch_done(launcher);
+}
+
 WL_EXPORT int
 weston_launcher_activate_vt(struct weston_launcher *launcher, int vt)
 {
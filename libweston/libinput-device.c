@@ -42,6 +42,7 @@
 #include "backend.h"
 #include "libweston-internal.h"
 #include "libinput-device.h"
+#include "libinput-seat.h"
 #include "shared/helpers.h"
 #include "shared/timespec-util.h"
 
@@ -57,7 +58,9 @@ evdev_led_update(struct evdev_device *device, enum weston_led weston_leds)
 	if (weston_leds & LED_SCROLL_LOCK)
 		leds |= LIBINPUT_LED_SCROLL_LOCK;
 
+	udev_input_lock(libinput_device_get_context(device->device));
 	libinput_device_led_update(device->device, leds);
+	udev_input_unlock(libinput_device_get_context(device->device));
 }
 
 static void
@@ -94,6 +97,7 @@ handle_pointer_motion(struct libinput_device *libinput_device,
 	struct evdev_device *device =
 		libinput_device_get_user_data(libinput_device);
 	struct weston_pointer_motion_event event = { 0 };
+	struct weston_pointer_motion_event *queued;
 	struct timespec time;
 	double dx_unaccel, dy_unaccel;
 
@@ -112,11 +116,55 @@ handle_pointer_motion(struct libinput_device *libinput_device,
 		.dy_unaccel = dy_unaccel,
 	};
 
+	if (device->seat->compositor->coalesce_pointer_motion) {
+		queued = wl_array_add(&device->pending_motion, sizeof *queued);
+		if (queued) {
+			*queued = event;
+			return false;
+		}
+	}
+
 	notify_motion(device->seat, &time, &event);
 
 	return true;
 }
 
+/** Deliver the queued relative motion as one event
+ *
+ * With weston_compositor::coalesce_pointer_motion, handle_pointer_motion()
+ * only queues the events. The udev input code flushes them at the end of
+ * each libinput_dispatch() batch and before any other event, so the pointer
+ * is moved and the focus repicked once per batch while relative pointer
+ * clients still see every event.
+ */
+void
+evdev_device_flush_motion(struct evdev_device *device)
+{
+	struct weston_pointer_motion_event *queued;
+	struct weston_pointer_motion_event event = {
+		.mask = WESTON_POINTER_MOTION_REL |
+			WESTON_POINTER_MOTION_REL_UNACCEL,
+	};
+
+	if (device->pending_motion.size == 0)
+		return;
+
+	wl_array_for_each(queued, &device->pending_motion) {
+		event.dx += queued->dx;
+		event.dy += queued->dy;
+		event.dx_unaccel += queued->dx_unaccel;
+		event.dy_unaccel += queued->dy_unaccel;
+		event.time = queued->time;
+		event.num_coalesced++;
+	}
+	event.coalesced = device->pending_motion.data;
+
+	notify_motion(device->seat, &event.time, &event);
+	notify_pointer_frame(device->seat);
+
+	device->pending_motion.size = 0;
+}
+
 static bool
 handle_pointer_motion_absolute(
 	struct libinput_device *libinput_device,
@@ -337,15 +385,21 @@ touch_get_calibration(struct weston_touch_device *device,
 		      struct weston_touch_device_matrix *cal)
 {
 	struct evdev_device *evdev_device = device->backend_data;
+	struct libinput *libinput =
+		libinput_device_get_context(evdev_device->device);
 
+	udev_input_lock(libinput);
 	libinput_device_config_calibration_get_matrix(evdev_device->device,
 						      cal->m);
+	udev_input_unlock(libinput);
 }
 
 static void
 do_set_calibration(struct evdev_device *evdev_device,
 		   const struct weston_touch_device_matrix *cal)
 {
+	struct libinput *libinput =
+		libinput_device_get_context(evdev_device->device);
 	enum libinput_config_status status;
 
 	weston_log("input device %s: applying calibration:\n",
@@ -355,8 +409,10 @@ do_set_calibration(struct evdev_device *evdev_device,
 	weston_log_continue(STAMP_SPACE "  %f %f %f\n",
 			    cal->m[3], cal->m[4], cal->m[5]);
 
+	udev_input_lock(libinput);
 	status = libinput_device_config_calibration_set_matrix(evdev_device->device,
 							       cal->m);
+	udev_input_unlock(libinput);
 	if (status != LIBINPUT_CONFIG_STATUS_SUCCESS)
 		weston_log("Error: Failed to apply calibration.\n");
 }
@@ -412,6 +468,49 @@ create_touch_device(struct evdev_device *device)
 	return touch_device;
 }
 
+/* Sends the touch motion queued since the last frame. Down and up events
+ * flush it first, so that the order of events for a slot is kept. */
+static void
+evdev_device_flush_touch(struct evdev_device *device)
+{
+	if (device->pending_touch.size == 0)
+		return;
+
+	notify_touch_motion_frame(device->touch_device,
+				  &device->pending_touch_time,
+				  device->pending_touch.data,
+				  device->pending_touch.size /
+				  sizeof(struct weston_touch_point_update));
+	device->pending_touch.size = 0;
+}
+
+static void
+queue_touch_motion(struct evdev_device *device, const struct timespec *time,
+		   const struct weston_touch_point_update *point)
+{
+	struct weston_touch_point_update *queued;
+
+	/* A slot moves at most once per frame, the latest position wins. */
+	wl_array_for_each(queued, &device->pending_touch) {
+		if (queued->touch_id == point->touch_id) {
+			*queued = *point;
+			device->pending_touch_time = *time;
+			return;
+		}
+	}
+
+	queued = wl_array_add(&device->pending_touch, sizeof *queued);
+	if (!queued) {
+		/* Out of memory, send what we have in its own frame. */
+		evdev_device_flush_touch(device);
+		notify_touch_motion_frame(device->touch_device, time, point, 1);
+		return;
+	}
+
+	*queued = *point;
+	device->pending_touch_time = *time;
+}
+
 static void
 handle_touch_with_coords(struct libinput_device *libinput_device,
 			 struct libinput_event_touch *touch_event,
@@ -419,36 +518,45 @@ handle_touch_with_coords(struct libinput_device *libinput_device,
 {
 	struct evdev_device *device =
 		libinput_device_get_user_data(libinput_device);
-	double x;
-	double y;
-	struct weston_point2d_device_normalized norm;
+	struct weston_touch_point_update point;
 	uint32_t width, height;
 	struct timespec time;
-	int32_t slot;
+	bool can_calibrate;
 
 	if (!device->output)
 		return;
 
 	timespec_from_usec(&time,
 			   libinput_event_touch_get_time_usec(touch_event));
-	slot = libinput_event_touch_get_seat_slot(touch_event);
+	point.touch_id = libinput_event_touch_get_seat_slot(touch_event);
 
 	width = device->output->current_mode->width;
 	height = device->output->current_mode->height;
-	x =  libinput_event_touch_get_x_transformed(touch_event, width);
-	y =  libinput_event_touch_get_y_transformed(touch_event, height);
+	point.x = libinput_event_touch_get_x_transformed(touch_event, width);
+	point.y = libinput_event_touch_get_y_transformed(touch_event, height);
 
 	weston_output_transform_coordinate(device->output,
-					   x, y, &x, &y);
-
-	if (weston_touch_device_can_calibrate(device->touch_device)) {
-		norm.x = libinput_event_touch_get_x_transformed(touch_event, 1);
-		norm.y = libinput_event_touch_get_y_transformed(touch_event, 1);
-		notify_touch_normalized(device->touch_device, &time, slot,
-					x, y, &norm, touch_type);
-	} else {
-		notify_touch(device->touch_device, &time, slot, x, y, touch_type);
+					   point.x, point.y,
+					   &point.x, &point.y);
+
+	can_calibrate = weston_touch_device_can_calibrate(device->touch_device);
+	if (can_calibrate) {
+		point.norm.x =
+			libinput_event_touch_get_x_transformed(touch_event, 1);
+		point.norm.y =
+			libinput_event_touch_get_y_transformed(touch_event, 1);
 	}
+
+	if (touch_type == WL_TOUCH_MOTION) {
+		queue_touch_motion(device, &time, &point);
+		return;
+	}
+
+	evdev_device_flush_touch(device);
+	notify_touch_normalized(device->touch_device, &time, point.touch_id,
+				point.x, point.y,
+				can_calibrate ? &point.norm : NULL,
+				touch_type);
 }
 
 static void
@@ -477,6 +585,7 @@ handle_touch_up(struct libinput_device *libinput_device,
 	timespec_from_usec(&time,
 			   libinput_event_touch_get_time_usec(touch_event));
 
+	evdev_device_flush_touch(device);
 	notify_touch(device->touch_device, &time, slot, 0, 0, WL_TOUCH_UP);
 }
 
@@ -487,6 +596,7 @@ handle_touch_frame(struct libinput_device *libinput_device,
 	struct evdev_device *device =
 		libinput_device_get_user_data(libinput_device);
 
+	evdev_device_flush_touch(device);
 	notify_touch_frame(device->touch_device);
 }
 
@@ -686,7 +796,10 @@ evdev_device_set_output(struct evdev_device *device,
 	device->output_destroy_listener.notify = notify_output_destroy;
 	wl_signal_add(&output->destroy_signal,
 		      &device->output_destroy_listener);
+
+	udev_input_lock(libinput_device_get_context(device->device));
 	evdev_device_set_calibration(device);
+	udev_input_unlock(libinput_device_get_context(device->device));
 }
 
 struct evdev_device *
@@ -701,6 +814,8 @@ evdev_device_create(struct libinput_device *libinput_device,
 
 	device->seat = seat;
 	wl_list_init(&device->link);
+	wl_array_init(&device->pending_motion);
+	wl_array_init(&device->pending_touch);
 	device->device = libinput_device;
 
 	if (libinput_device_has_capability(libinput_device,
@@ -742,6 +857,8 @@ evdev_device_destroy(struct evdev_device *device)
 		wl_list_remove(&device->output_destroy_listener.link);
 	wl_list_remove(&device->link);
 	libinput_device_unref(device->device);
+	wl_array_release(&device->pending_motion);
+	wl_array_release(&device->pending_touch);
 	free(device->output_name);
 	free(device);
 }
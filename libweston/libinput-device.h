@@ -52,6 +52,13 @@ struct evdev_device {
 	char *output_name;
 	int fd;
 	bool override_wl_calibration;
+	/* struct weston_pointer_motion_event queued until
+	 * evdev_device_flush_motion() */
+	struct wl_array pending_motion;
+	/* struct weston_touch_point_update, one per slot, queued until
+	 * the touch frame */
+	struct wl_array pending_touch;
+	struct timespec pending_touch_time;
 };
 
 void
@@ -64,6 +71,9 @@ evdev_device_create(struct libinput_device *libinput_device,
 int
 evdev_device_process_event(struct libinput_event *event);
 
+void
+evdev_device_flush_motion(struct evdev_device *device);
+
 void
 evdev_device_set_output(struct evdev_device *device,
 			struct weston_output *output);
@@ -26,11 +26,17 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/eventfd.h>
 #include <libinput.h>
 #include <libudev.h>
 
@@ -45,6 +51,8 @@
 
 static void
 process_events(struct udev_input *input);
+static void
+udev_input_remove_source(struct udev_input *input);
 static struct udev_seat *
 udev_seat_create(struct udev_input *input, const char *seat_name);
 static void
@@ -164,8 +172,7 @@ udev_input_disable(struct udev_input *input)
 	if (input->suspended)
 		return;
 
-	wl_event_source_remove(input->libinput_source);
-	input->libinput_source = NULL;
+	udev_input_remove_source(input);
 	libinput_suspend(input->libinput);
 	process_events(input);
 	input->suspended = 1;
@@ -180,6 +187,10 @@ udev_input_process_event(struct libinput_event *event)
 	struct udev_input *input = libinput_get_user_data(libinput);
 	int handled = 1;
 
+	/* Configuring and destroying devices must not race the input
+	 * thread. */
+	udev_input_lock(libinput);
+
 	switch (libinput_event_get_type(event)) {
 	case LIBINPUT_EVENT_DEVICE_ADDED:
 		device_added(input, libinput_device);
@@ -191,12 +202,32 @@ udev_input_process_event(struct libinput_event *event)
 		handled = 0;
 	}
 
+	udev_input_unlock(libinput);
+
 	return handled;
 }
 
 static void
-process_event(struct libinput_event *event)
+udev_input_flush_motion(struct udev_input *input)
+{
+	struct udev_seat *seat;
+	struct evdev_device *device;
+
+	if (!input->compositor->coalesce_pointer_motion)
+		return;
+
+	wl_list_for_each(seat, &input->compositor->seat_list, base.link)
+		wl_list_for_each(device, &seat->devices_list, link)
+			evdev_device_flush_motion(device);
+}
+
+static void
+process_event(struct udev_input *input, struct libinput_event *event)
 {
+	/* Keep coalesced motion in order with everything else. */
+	if (libinput_event_get_type(event) != LIBINPUT_EVENT_POINTER_MOTION)
+		udev_input_flush_motion(input);
+
 	if (udev_input_process_event(event))
 		return;
 	if (evdev_device_process_event(event))
@@ -209,9 +240,11 @@ process_events(struct udev_input *input)
 	struct libinput_event *event;
 
 	while ((event = libinput_get_event(input->libinput))) {
-		process_event(event);
+		process_event(input, event);
 		libinput_event_destroy(event);
 	}
+
+	udev_input_flush_motion(input);
 }
 
 static int
@@ -233,6 +266,392 @@ libinput_source_dispatch(int fd, uint32_t mask, void *data)
 	return udev_input_dispatch(input) != 0;
 }
 
+static bool
+ring_push(struct udev_input_ring *ring, struct libinput_event *event)
+{
+	unsigned int head = atomic_load_explicit(&ring->head,
+						 memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&ring->tail,
+						 memory_order_acquire);
+
+	if (head - tail == UDEV_INPUT_RING_SIZE)
+		return false;
+
+	ring->events[head % UDEV_INPUT_RING_SIZE] = event;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	return true;
+}
+
+static struct libinput_event *
+ring_pop(struct udev_input_ring *ring)
+{
+	unsigned int tail = atomic_load_explicit(&ring->tail,
+						 memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&ring->head,
+						 memory_order_acquire);
+	struct libinput_event *event;
+
+	if (head == tail)
+		return NULL;
+
+	event = ring->events[tail % UDEV_INPUT_RING_SIZE];
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+	return event;
+}
+
+static bool
+is_motion_event(enum libinput_event_type type)
+{
+	return type == LIBINPUT_EVENT_POINTER_MOTION ||
+	       type == LIBINPUT_EVENT_POINTER_MOTION_ABSOLUTE;
+}
+
+static struct libinput_event *
+ring_peek(struct udev_input_ring *ring)
+{
+	unsigned int tail = atomic_load_explicit(&ring->tail,
+						 memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&ring->head,
+						 memory_order_acquire);
+
+	if (head == tail)
+		return NULL;
+
+	return ring->events[tail % UDEV_INPUT_RING_SIZE];
+}
+
+static void
+udev_input_thread_vlog(struct udev_input *input, const char *format,
+		       va_list args)
+{
+	size_t space;
+	int len;
+
+	pthread_mutex_lock(&input->thread.log_lock);
+	space = sizeof input->thread.log - input->thread.log_len;
+	len = vsnprintf(input->thread.log + input->thread.log_len, space,
+			format, args);
+	if (len > 0)
+		input->thread.log_len += MIN((size_t)len, space - 1);
+	pthread_mutex_unlock(&input->thread.log_lock);
+}
+
+static void
+udev_input_thread_log(struct udev_input *input, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	udev_input_thread_vlog(input, format, args);
+	va_end(args);
+}
+
+static void
+udev_input_flush_thread_log(struct udev_input *input)
+{
+	char log[sizeof input->thread.log];
+
+	pthread_mutex_lock(&input->thread.log_lock);
+	memcpy(log, input->thread.log, input->thread.log_len);
+	log[input->thread.log_len] = '\0';
+	input->thread.log_len = 0;
+	pthread_mutex_unlock(&input->thread.log_lock);
+
+	if (log[0])
+		weston_log("%s", log);
+}
+
+static void
+udev_input_wake(int fd)
+{
+	uint64_t one = 1;
+
+	/* Only fails if the counter would overflow, in which case there
+	 * is a wakeup pending anyway. */
+	if (write(fd, &one, sizeof one) < 0)
+		return;
+}
+
+static void
+udev_input_clear_wake(int fd)
+{
+	uint64_t count;
+
+	/* EAGAIN just means there was nothing to clear. */
+	if (read(fd, &count, sizeof count) < 0)
+		return;
+}
+
+/** The main loop of the input thread
+ *
+ * Reads the devices as soon as they have data, so the kernel buffers do
+ * not overflow and input timestamps stay accurate no matter how long the
+ * main loop is busy repainting or serving clients. The events are handed
+ * over on the queued ring and come back on the done ring once processed,
+ * since destroying them touches libinput state. At most
+ * UDEV_INPUT_RING_SIZE events are in flight; the rest wait in libinput.
+ */
+static void *
+udev_input_thread(void *data)
+{
+	struct udev_input *input = data;
+	struct libinput_event *event;
+	struct pollfd pfd[2] = {
+		{ .fd = libinput_get_fd(input->libinput), .events = POLLIN },
+		{ .fd = input->thread.wake_fd, .events = POLLIN },
+	};
+	bool queued;
+
+	weston_thread_scheduling_apply(&input->compositor->thread_scheduling);
+
+	while (!atomic_load(&input->thread.quit)) {
+		if (poll(pfd, ARRAY_LENGTH(pfd), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			udev_input_thread_log(input, "libinput: poll failed: %s\n",
+					      strerror(errno));
+			break;
+		}
+
+		if (pfd[1].revents & POLLIN)
+			udev_input_clear_wake(input->thread.wake_fd);
+
+		pthread_mutex_lock(&input->thread.lock);
+
+		while ((event = ring_pop(&input->thread.done))) {
+			libinput_event_destroy(event);
+			input->thread.in_flight--;
+		}
+
+		if ((pfd[0].revents & POLLIN) &&
+		    libinput_dispatch(input->libinput) != 0)
+			udev_input_thread_log(input,
+				"libinput: Failed to dispatch libinput\n");
+
+		queued = false;
+		while (input->thread.in_flight < UDEV_INPUT_RING_SIZE &&
+		       (event = libinput_get_event(input->libinput))) {
+			ring_push(&input->thread.queued, event);
+			input->thread.in_flight++;
+			queued = true;
+		}
+
+		pthread_mutex_unlock(&input->thread.lock);
+
+		if (queued)
+			udev_input_wake(input->thread.notify_fd);
+	}
+
+	return NULL;
+}
+
+static int
+udev_input_thread_notify(int fd, uint32_t mask, void *data)
+{
+	struct udev_input *input = data;
+	struct libinput_event *event;
+	bool processed = false;
+
+	udev_input_clear_wake(fd);
+
+	udev_input_flush_thread_log(input);
+
+	while ((event = ring_pop(&input->thread.queued))) {
+		process_event(input, event);
+		ring_push(&input->thread.done, event);
+		processed = true;
+	}
+
+	udev_input_flush_motion(input);
+
+	/* Let the thread destroy the events and queue any left over. */
+	if (processed)
+		udev_input_wake(input->thread.wake_fd);
+
+	return 0;
+}
+
+/** Process the pointer motion queued so far, and nothing else
+ *
+ * Meant for backends about to commit a frame: the motion that arrived
+ * while the frame was being rendered can still be applied to the cursor
+ * plane. Only motion at the front of the queue is processed, the first
+ * event of any other kind stops it so that the order of events is kept.
+ *
+ * \return true if any motion was processed.
+ */
+bool
+udev_input_dispatch_motion(struct udev_input *input)
+{
+	struct libinput_event *event;
+	bool processed = false;
+
+	if (input->suspended)
+		return false;
+
+	if (input->thread.running) {
+		while ((event = ring_peek(&input->thread.queued)) &&
+		       is_motion_event(libinput_event_get_type(event))) {
+			ring_pop(&input->thread.queued);
+			process_event(input, event);
+			ring_push(&input->thread.done, event);
+			processed = true;
+		}
+
+		if (processed)
+			udev_input_wake(input->thread.wake_fd);
+	} else {
+		if (libinput_dispatch(input->libinput) != 0)
+			weston_log("libinput: Failed to dispatch libinput\n");
+
+		while (is_motion_event(
+				libinput_next_event_type(input->libinput))) {
+			event = libinput_get_event(input->libinput);
+			process_event(input, event);
+			libinput_event_destroy(event);
+			processed = true;
+		}
+	}
+
+	udev_input_flush_motion(input);
+
+	return processed;
+}
+
+static int
+udev_input_start_thread(struct udev_input *input)
+{
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(input->compositor->wl_display);
+	sigset_t mask, old_mask;
+	int ret;
+
+	input->thread.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	input->thread.notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (input->thread.wake_fd < 0 || input->thread.notify_fd < 0)
+		goto err;
+
+	input->thread.notify_source =
+		wl_event_loop_add_fd(loop, input->thread.notify_fd,
+				     WL_EVENT_READABLE,
+				     udev_input_thread_notify, input);
+	if (!input->thread.notify_source)
+		goto err;
+
+	atomic_store(&input->thread.quit, false);
+
+	sigfillset(&mask);
+	sigdelset(&mask, SIGBUS);
+	sigdelset(&mask, SIGSEGV);
+	sigdelset(&mask, SIGFPE);
+	sigdelset(&mask, SIGILL);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	ret = pthread_create(&input->thread.thread, NULL,
+			     udev_input_thread, input);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	if (ret != 0)
+		goto err;
+
+	input->thread.running = true;
+
+	return 0;
+
+err:
+	if (input->thread.notify_source)
+		wl_event_source_remove(input->thread.notify_source);
+	input->thread.notify_source = NULL;
+	if (input->thread.notify_fd >= 0)
+		close(input->thread.notify_fd);
+	if (input->thread.wake_fd >= 0)
+		close(input->thread.wake_fd);
+
+	return -1;
+}
+
+static void
+udev_input_stop_thread(struct udev_input *input)
+{
+	struct libinput_event *event;
+
+	if (!input->thread.running)
+		return;
+
+	atomic_store(&input->thread.quit, true);
+	udev_input_wake(input->thread.wake_fd);
+	pthread_join(input->thread.thread, NULL);
+	input->thread.running = false;
+
+	wl_event_source_remove(input->thread.notify_source);
+	input->thread.notify_source = NULL;
+	close(input->thread.notify_fd);
+	close(input->thread.wake_fd);
+
+	/* Everything the thread read is ours alone now. */
+	udev_input_flush_thread_log(input);
+
+	while ((event = ring_pop(&input->thread.queued))) {
+		process_event(input, event);
+		libinput_event_destroy(event);
+	}
+	while ((event = ring_pop(&input->thread.done)))
+		libinput_event_destroy(event);
+	input->thread.in_flight = 0;
+
+	udev_input_flush_motion(input);
+}
+
+static int
+udev_input_add_source(struct udev_input *input)
+{
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(input->compositor->wl_display);
+
+	if (input->compositor->input_thread) {
+		if (udev_input_start_thread(input) == 0)
+			return 0;
+
+		weston_log("libinput: failed to start the input thread, "
+			   "reading input on the main loop.\n");
+	}
+
+	input->libinput_source =
+		wl_event_loop_add_fd(loop, libinput_get_fd(input->libinput),
+				     WL_EVENT_READABLE,
+				     libinput_source_dispatch, input);
+	if (!input->libinput_source)
+		return -1;
+
+	return 0;
+}
+
+static void
+udev_input_remove_source(struct udev_input *input)
+{
+	udev_input_stop_thread(input);
+
+	if (input->libinput_source)
+		wl_event_source_remove(input->libinput_source);
+	input->libinput_source = NULL;
+}
+
+void
+udev_input_lock(struct libinput *libinput)
+{
+	struct udev_input *input = libinput_get_user_data(libinput);
+
+	pthread_mutex_lock(&input->thread.lock);
+}
+
+void
+udev_input_unlock(struct libinput *libinput)
+{
+	struct udev_input *input = libinput_get_user_data(libinput);
+
+	pthread_mutex_unlock(&input->thread.lock);
+}
+
 static int
 open_restricted(const char *path, int flags, void *user_data)
 {
@@ -259,31 +678,30 @@ const struct libinput_interface libinput_interface = {
 int
 udev_input_enable(struct udev_input *input)
 {
-	struct wl_event_loop *loop;
 	struct weston_compositor *c = input->compositor;
-	int fd;
 	struct udev_seat *seat;
 	int devices_found = 0;
+	bool resumed = false;
 
-	loop = wl_display_get_event_loop(c->wl_display);
-	fd = libinput_get_fd(input->libinput);
-	input->libinput_source =
-		wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
-				     libinput_source_dispatch, input);
-	if (!input->libinput_source) {
-		return -1;
-	}
-
+	/* Resume before the input thread starts, it owns the events after
+	 * that. */
 	if (input->suspended) {
-		if (libinput_resume(input->libinput) != 0) {
-			wl_event_source_remove(input->libinput_source);
-			input->libinput_source = NULL;
+		if (libinput_resume(input->libinput) != 0)
 			return -1;
-		}
 		input->suspended = 0;
+		resumed = true;
 		process_events(input);
 	}
 
+	if (udev_input_add_source(input) < 0) {
+		if (resumed) {
+			libinput_suspend(input->libinput);
+			process_events(input);
+			input->suspended = 1;
+		}
+		return -1;
+	}
+
 	wl_list_for_each(seat, &input->compositor->seat_list, base.link) {
 		evdev_notify_keyboard_focus(&seat->base, &seat->devices_list);
 
@@ -316,9 +734,60 @@ libinput_log_func(struct libinput *libinput,
 		  enum libinput_log_priority priority,
 		  const char *format, va_list args)
 {
+	struct udev_input *input = libinput_get_user_data(libinput);
+
+	if (!pthread_equal(pthread_self(), input->thread.main_thread)) {
+		udev_input_thread_vlog(input, format, args);
+		return;
+	}
+
 	weston_vlog(format, args);
 }
 
+/** Ask the launcher for the input devices of a seat
+ *
+ * libinput opens one device after another. Backends can call this early,
+ * so that the launcher gets the devices while they set up other things
+ * and udev_input_init() mostly finds them ready.
+ */
+void
+udev_input_prefetch_devices(struct weston_compositor *c, struct udev *udev,
+			    const char *seat_id)
+{
+	struct udev_enumerate *e;
+	struct udev_list_entry *entry;
+	struct udev_device *device;
+	const char *devnode, *device_seat;
+
+	e = udev_enumerate_new(udev);
+	if (!e)
+		return;
+
+	udev_enumerate_add_match_subsystem(e, "input");
+	udev_enumerate_add_match_sysname(e, "event[0-9]*");
+	udev_enumerate_scan_devices(e);
+
+	udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(e)) {
+		device = udev_device_new_from_syspath(udev,
+				udev_list_entry_get_name(entry));
+		if (!device)
+			continue;
+
+		/* The same seat assignment as libinput's */
+		device_seat = udev_device_get_property_value(device, "ID_SEAT");
+		if (!device_seat)
+			device_seat = "seat0";
+
+		devnode = udev_device_get_devnode(device);
+		if (devnode && strcmp(device_seat, seat_id) == 0)
+			weston_launcher_prefetch(c->launcher, devnode);
+
+		udev_device_unref(device);
+	}
+
+	udev_enumerate_unref(e);
+}
+
 int
 udev_input_init(struct udev_input *input, struct weston_compositor *c,
 		struct udev *udev, const char *seat_id,
@@ -326,6 +795,7 @@ udev_input_init(struct udev_input *input, struct weston_compositor *c,
 {
 	enum libinput_log_priority priority = LIBINPUT_LOG_PRIORITY_INFO;
 	const char *log_priority = NULL;
+	pthread_mutexattr_t attr;
 
 	memset(input, 0, sizeof *input);
 
@@ -340,6 +810,13 @@ udev_input_init(struct udev_input *input, struct weston_compositor *c,
 		return -1;
 	}
 
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&input->thread.lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_mutex_init(&input->thread.log_lock, NULL);
+	input->thread.main_thread = pthread_self();
+
 	libinput_log_set_handler(input->libinput, &libinput_log_func);
 
 	if (log_priority) {
@@ -354,10 +831,17 @@ udev_input_init(struct udev_input *input, struct weston_compositor *c,
 
 	libinput_log_set_priority(input->libinput, priority);
 
+	/* Nothing for what the backend prefetched already. */
+	udev_input_prefetch_devices(c, udev, seat_id);
+
 	if (libinput_udev_assign_seat(input->libinput, seat_id) != 0) {
+		weston_launcher_prefetch_done(c->launcher);
 		libinput_unref(input->libinput);
+		pthread_mutex_destroy(&input->thread.log_lock);
+		pthread_mutex_destroy(&input->thread.lock);
 		return -1;
 	}
+	weston_launcher_prefetch_done(c->launcher);
 
 	process_events(input);
 
@@ -369,11 +853,12 @@ udev_input_destroy(struct udev_input *input)
 {
 	struct udev_seat *seat, *next;
 
-	if (input->libinput_source)
-		wl_event_source_remove(input->libinput_source);
+	udev_input_remove_source(input);
 	wl_list_for_each_safe(seat, next, &input->compositor->seat_list, base.link)
 		udev_seat_destroy(seat);
 	libinput_unref(input->libinput);
+	pthread_mutex_destroy(&input->thread.log_lock);
+	pthread_mutex_destroy(&input->thread.lock);
 }
 
 static void
@@ -30,6 +30,8 @@
 #include "config.h"
 
 #include <libudev.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include <libweston/libweston.h>
 
@@ -45,18 +47,60 @@ struct udev_seat {
 typedef void (*udev_configure_device_t)(struct weston_compositor *compositor,
 					struct libinput_device *device);
 
+/* Must be a power of two. */
+#define UDEV_INPUT_RING_SIZE 256
+
+/** Single producer, single consumer queue of libinput events */
+struct udev_input_ring {
+	atomic_uint head; /**< only written by the producer */
+	atomic_uint tail; /**< only written by the consumer */
+	struct libinput_event *events[UDEV_INPUT_RING_SIZE];
+};
+
 struct udev_input {
 	struct libinput *libinput;
 	struct wl_event_source *libinput_source;
 	struct weston_compositor *compositor;
 	int suspended;
 	udev_configure_device_t configure_device;
+
+	/* Optional thread reading libinput, see
+	 * weston_compositor::input_thread */
+	struct {
+		bool running;
+		pthread_t thread;
+		pthread_t main_thread;
+		/* Serializes all libinput calls except the event accessors,
+		 * recursive. */
+		pthread_mutex_t lock;
+		atomic_bool quit;
+		int wake_fd;		/* main loop -> thread */
+		int notify_fd;		/* thread -> main loop */
+		struct wl_event_source *notify_source;
+		struct udev_input_ring queued;	/* events to process */
+		struct udev_input_ring done;	/* events to destroy */
+		unsigned int in_flight;	/* only used by the thread */
+
+		/* libinput messages logged on the thread, replayed on the
+		 * main loop since weston_log() is not thread-safe. */
+		pthread_mutex_t log_lock;
+		char log[1024];
+		size_t log_len;
+	} thread;
 };
 
+void
+udev_input_lock(struct libinput *libinput);
+void
+udev_input_unlock(struct libinput *libinput);
+
 int
 udev_input_enable(struct udev_input *input);
 void
 udev_input_disable(struct udev_input *input);
+void
+udev_input_prefetch_devices(struct weston_compositor *c, struct udev *udev,
+			    const char *seat_id);
 int
 udev_input_init(struct udev_input *input,
 		struct weston_compositor *c,
@@ -65,6 +109,8 @@ udev_input_init(struct udev_input *input,
 		udev_configure_device_t configure_device);
 void
 udev_input_destroy(struct udev_input *input);
+bool
+udev_input_dispatch_motion(struct udev_input *input);
 
 struct udev_seat *
 udev_seat_get_named(struct udev_input *u,
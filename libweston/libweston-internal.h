@@ -62,6 +62,9 @@ weston_buffer_release_reference(struct weston_buffer_release_reference *ref,
 void
 weston_binding_list_destroy_all(struct wl_list *list);
 
+void
+weston_compositor_bindings_release(struct weston_compositor *compositor);
+
 /* weston_compositor */
 
 void
@@ -70,6 +73,25 @@ touch_calibrator_mode_changed(struct weston_compositor *compositor);
 int
 noop_renderer_init(struct weston_compositor *ec);
 
+/** Work the no-op renderer would have done, for measuring the CPU cost of
+ *  the compositor core without a GPU in the way. */
+struct weston_noop_renderer_stats {
+	uint64_t repaints;
+	uint64_t views;		/**< views considered by repaints */
+	uint64_t damage_rects;	/**< output damage rectangles */
+	uint64_t damage_pixels;	/**< output damage area */
+	uint64_t draw_pixels;	/**< damaged and unoccluded view area */
+	uint64_t upload_bytes;	/**< damaged shm buffer bytes */
+	uint64_t attaches;	/**< buffers attached */
+};
+
+bool
+noop_renderer_get_stats(struct weston_compositor *ec,
+			struct weston_noop_renderer_stats *stats);
+
+void
+noop_renderer_reset_stats(struct weston_compositor *ec);
+
 void
 weston_compositor_add_head(struct weston_compositor *compositor,
 			   struct weston_head *head);
@@ -80,6 +102,10 @@ bool
 weston_compositor_import_dmabuf(struct weston_compositor *compositor,
 				struct linux_dmabuf_buffer *buffer);
 bool
+weston_compositor_import_dmabuf_async(struct weston_compositor *compositor,
+				      struct linux_dmabuf_buffer *buffer,
+				      weston_dmabuf_import_done_func_t done);
+bool
 weston_compositor_dmabuf_can_scanout(struct weston_compositor *compositor,
 					struct linux_dmabuf_buffer *buffer);
 void
@@ -159,6 +185,127 @@ weston_output_disable_planes_incr(struct weston_output *output);
 void
 weston_output_disable_planes_decr(struct weston_output *output);
 
+void
+weston_output_capture_incr(struct weston_output *output);
+
+void
+weston_output_capture_decr(struct weston_output *output);
+
+bool
+weston_output_is_captured(struct weston_output *output);
+
+/* frame statistics */
+
+void
+weston_output_frame_stats_repaint_begin(struct weston_output *output,
+					const struct timespec *begin);
+
+void
+weston_output_frame_stats_repaint_end(struct weston_output *output,
+				      unsigned int plane_views,
+				      unsigned int renderer_views,
+				      bool full_repaint);
+
+void
+weston_output_frame_stats_finish(struct weston_output *output,
+				 const struct timespec *now,
+				 const struct timespec *stamp,
+				 int32_t refresh_nsec);
+
+void
+weston_output_frame_stats_gpu(struct weston_output *output, int64_t nsec);
+
+void
+weston_output_frame_stats_destroy(struct weston_output *output);
+
+void
+weston_compositor_frame_stats_cb(struct weston_log_subscription *sub,
+				 void *data);
+
+void
+weston_surface_stats_commit(struct weston_surface *surface);
+
+void
+weston_surface_stats_repaint(struct weston_surface *surface,
+			     struct weston_output *output, bool on_plane);
+
+void
+weston_output_surface_stats_present(struct weston_output *output,
+				    const struct timespec *stamp,
+				    int32_t refresh_nsec);
+
+void
+weston_surface_stats_destroy(struct weston_surface *surface);
+
+void
+weston_compositor_surface_stats_cb(struct weston_log_subscription *sub,
+				   void *data);
+
+void
+weston_surface_memory_update(struct weston_surface *surface,
+			     struct weston_buffer *cached);
+
+void
+weston_surface_memory_destroy(struct weston_surface *surface);
+
+void
+weston_compositor_memory_stats_cb(struct weston_log_subscription *sub,
+				  void *data);
+
+void
+weston_compositor_memory_stats_fini(struct weston_compositor *compositor);
+
+void
+weston_compositor_client_budget_repaint(struct weston_compositor *compositor);
+
+bool
+weston_surface_client_throttled(struct weston_surface *surface);
+
+void
+weston_compositor_client_budget_fini(struct weston_compositor *compositor);
+
+/* client-cpu.c */
+
+enum weston_client_cpu_kind {
+	WESTON_CLIENT_CPU_COMMIT = 0,	/* wl_surface.commit, queued commits */
+	WESTON_CLIENT_CPU_UPLOAD,	/* renderer flush_damage */
+	WESTON_CLIENT_CPU_DRAW,		/* renderer drawing the views */
+	WESTON_CLIENT_CPU_COUNT
+};
+
+void
+weston_surface_cpu_begin(struct timespec *begin);
+
+void
+weston_surface_cpu_end(struct weston_surface *surface,
+		       enum weston_client_cpu_kind kind,
+		       const struct timespec *begin);
+
+void
+weston_compositor_client_cpu_print(struct weston_log_subscription *sub,
+				   struct weston_compositor *compositor,
+				   unsigned int max, bool details);
+
+void
+weston_compositor_client_cpu_cb(struct weston_log_subscription *sub,
+				void *data);
+
+void
+weston_compositor_client_cpu_fini(struct weston_compositor *compositor);
+
+/* flight recorder */
+
+void
+weston_flight_recorder_repaint_posted(struct weston_flight_recorder *recorder,
+				      struct weston_output *output);
+
+void
+weston_flight_recorder_frame_done(struct weston_flight_recorder *recorder,
+				  struct weston_output *output);
+
+void
+weston_compositor_flight_recorder_destroy(struct weston_compositor *compositor);
+
 /* weston_plane */
 
 void
@@ -290,6 +437,9 @@ weston_view_from_global_float(struct weston_view *view,
 bool
 weston_view_is_opaque(struct weston_view *ev, pixman_region32_t *region);
 
+bool
+weston_view_is_occluded(struct weston_view *view);
+
 bool
 weston_view_has_valid_buffer(struct weston_view *ev);
 
@@ -316,15 +466,64 @@ weston_transformed_region(int width, int height,
 			  int32_t scale,
 			  pixman_region32_t *src, pixman_region32_t *dest);
 void
+weston_output_transformed_region(struct weston_output *output,
+				 pixman_region32_t *src,
+				 pixman_region32_t *dest);
+pixman_box32_t
+weston_output_transformed_rect(struct weston_output *output,
+			       pixman_box32_t rect);
+bool
+weston_view_matches_output_scale(struct weston_view *view,
+				 struct weston_output *output);
+void
 weston_matrix_transform_region(pixman_region32_t *dest,
 			       struct weston_matrix *matrix,
 			       pixman_region32_t *src);
+void
+weston_region_simplify(pixman_region32_t *region, int max_rects);
+
+pixman_region32_t *
+weston_output_scratch_region(struct weston_output *output);
+unsigned int
+weston_output_scratch_mark(struct weston_output *output);
+void
+weston_output_scratch_release(struct weston_output *output, unsigned int mark);
+
+/* thread scheduling */
+
+void
+weston_thread_scheduling_apply(const struct weston_thread_scheduling *sched);
 
 /* protected_surface */
 void
 weston_protected_surface_send_event(struct protected_surface *psurface,
 				    enum weston_hdcp_protection protection);
 
+/* commit timing */
+
+int
+weston_commit_timing_setup(struct weston_compositor *compositor);
+
+/* color representation */
+
+int
+weston_color_representation_setup(struct weston_compositor *compositor);
+
+/* tearing control */
+int
+weston_tearing_control_setup(struct weston_compositor *compositor);
+
+/* fractional scale */
+int
+weston_fractional_scale_setup(struct weston_compositor *compositor);
+
+/* content type */
+int
+weston_content_type_setup(struct weston_compositor *compositor);
+
+void
+weston_surface_update_preferred_scale(struct weston_surface *surface);
+
 /* others */
 int
 wl_data_device_manager_init(struct wl_display *display);
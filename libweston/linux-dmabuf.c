@@ -27,6 +27,7 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 
@@ -34,6 +35,7 @@
 #include "linux-dmabuf.h"
 #include "linux-dmabuf-unstable-v1-server-protocol.h"
 #include "libweston-internal.h"
+#include "shared/os-compatibility.h"
 
 static void
 linux_dmabuf_buffer_destroy(struct linux_dmabuf_buffer *buffer)
@@ -144,6 +146,65 @@ destroy_linux_dmabuf_wl_buffer(struct wl_resource *resource)
 
 	if (buffer->user_data_destroy_func)
 		buffer->user_data_destroy_func(buffer);
+	if (buffer->backend_user_data_destroy_func)
+		buffer->backend_user_data_destroy_func(buffer);
+
+	linux_dmabuf_buffer_destroy(buffer);
+}
+
+static void
+import_params_destroyed(struct wl_listener *listener, void *data)
+{
+	struct linux_dmabuf_buffer *buffer =
+		wl_container_of(listener, buffer,
+				import_params_destroy_listener);
+
+	wl_list_remove(&buffer->import_params_destroy_listener.link);
+	buffer->import_params_resource = NULL;
+}
+
+static void
+import_dmabuf_done(struct linux_dmabuf_buffer *buffer, bool success)
+{
+	struct wl_resource *params_resource = buffer->import_params_resource;
+
+	if (!params_resource) {
+		/* Nobody left to tell. */
+		if (success && buffer->user_data_destroy_func)
+			buffer->user_data_destroy_func(buffer);
+		goto err_failed;
+	}
+
+	wl_list_remove(&buffer->import_params_destroy_listener.link);
+	buffer->import_params_resource = NULL;
+
+	if (!success) {
+		zwp_linux_buffer_params_v1_send_failed(params_resource);
+		goto err_failed;
+	}
+
+	buffer->buffer_resource =
+		wl_resource_create(wl_resource_get_client(params_resource),
+				   &wl_buffer_interface, 1, 0);
+	if (!buffer->buffer_resource) {
+		wl_resource_post_no_memory(params_resource);
+		if (buffer->user_data_destroy_func)
+			buffer->user_data_destroy_func(buffer);
+		goto err_failed;
+	}
+
+	wl_resource_set_implementation(buffer->buffer_resource,
+				       &linux_dmabuf_buffer_implementation,
+				       buffer, destroy_linux_dmabuf_wl_buffer);
+
+	zwp_linux_buffer_params_v1_send_created(params_resource,
+						buffer->buffer_resource);
+
+	return;
+
+err_failed:
+	if (buffer->backend_user_data_destroy_func)
+		buffer->backend_user_data_destroy_func(buffer);
 
 	linux_dmabuf_buffer_destroy(buffer);
 }
@@ -267,6 +328,24 @@ params_create_common(struct wl_client *client,
 		goto avoid_gpu_import;
 	}
 
+	/* Only create can wait for the renderer, create_immed has to hand
+	 * out a usable wl_buffer right away. */
+	if (buffer_id == 0) {
+		buffer->import_params_resource = params_resource;
+		buffer->import_params_destroy_listener.notify =
+			import_params_destroyed;
+		wl_resource_add_destroy_listener(params_resource,
+				&buffer->import_params_destroy_listener);
+
+		if (weston_compositor_import_dmabuf_async(buffer->compositor,
+							  buffer,
+							  import_dmabuf_done))
+			return;
+
+		wl_list_remove(&buffer->import_params_destroy_listener.link);
+		buffer->import_params_resource = NULL;
+	}
+
 	if (!weston_compositor_import_dmabuf(buffer->compositor, buffer))
 		goto err_failed;
 
@@ -296,6 +375,9 @@ err_buffer:
 		buffer->user_data_destroy_func(buffer);
 
 err_failed:
+	if (buffer->backend_user_data_destroy_func)
+		buffer->backend_user_data_destroy_func(buffer);
+
 	if (buffer_id == 0)
 		zwp_linux_buffer_params_v1_send_failed(params_resource);
 	else
@@ -466,9 +548,487 @@ linux_dmabuf_buffer_get_user_data(struct linux_dmabuf_buffer *buffer)
 	return buffer->user_data;
 }
 
+/** Set backend-private data
+ *
+ * The backend counterpart of linux_dmabuf_buffer_set_user_data(), so that
+ * a backend can keep its own imports of the buffer next to the renderer's.
+ * The same overwrite rule applies.
+ *
+ * \param buffer The linux_dmabuf_buffer object to set for.
+ * \param data The new backend-private data pointer.
+ * \param func Destructor function to be called for the backend-private
+ *             data when the linux_dmabuf_buffer gets destroyed.
+ */
+WL_EXPORT void
+linux_dmabuf_buffer_set_backend_user_data(struct linux_dmabuf_buffer *buffer,
+					  void *data,
+					  dmabuf_user_data_destroy_func func)
+{
+	assert(data == NULL || buffer->backend_user_data == NULL);
+
+	buffer->backend_user_data = data;
+	buffer->backend_user_data_destroy_func = func;
+}
+
+/** Get backend-private data
+ *
+ * \param buffer The linux_dmabuf_buffer to query.
+ * \return Backend-private data pointer.
+ *
+ * \sa linux_dmabuf_buffer_set_backend_user_data
+ */
+WL_EXPORT void *
+linux_dmabuf_buffer_get_backend_user_data(struct linux_dmabuf_buffer *buffer)
+{
+	return buffer->backend_user_data;
+}
+
+/* One entry of the format table shared with clients, as laid out by the
+ * zwp_linux_dmabuf_feedback_v1.format_table event. */
+struct weston_dmabuf_format_table_entry {
+	uint32_t format;
+	uint32_t pad;
+	uint64_t modifier;
+};
+
+struct weston_dmabuf_feedback_main {
+	struct weston_compositor *compositor;
+	struct wl_listener compositor_destroy_listener;
+
+	dev_t device;
+
+	/* Every format and modifier pair the renderer can import, built on
+	 * first use. The main tranche refers to all of them. */
+	struct weston_dmabuf_format_table_entry *entries;
+	unsigned int num_entries;
+	struct ro_anonymous_file *table_file;
+};
+
+/* Feedback of one surface, alive as long as the surface is. */
+struct weston_dmabuf_surface_feedback {
+	struct weston_surface *surface;
+	struct wl_listener surface_destroy_listener;
+	struct wl_list resource_list;
+
+	/* The scanout tranche: indices into the format table, or none. */
+	dev_t scanout_device;
+	struct wl_array scanout_indices;
+};
+
+static void
+feedback_main_destroy(struct wl_listener *listener, void *data)
+{
+	struct weston_dmabuf_feedback_main *feedback_main =
+		wl_container_of(listener, feedback_main,
+				compositor_destroy_listener);
+
+	feedback_main->compositor->dmabuf_feedback_main = NULL;
+	wl_list_remove(&feedback_main->compositor_destroy_listener.link);
+	if (feedback_main->table_file)
+		os_ro_anonymous_file_destroy(feedback_main->table_file);
+	free(feedback_main->entries);
+	free(feedback_main);
+}
+
+static int
+feedback_main_build_table(struct weston_dmabuf_feedback_main *feedback_main)
+{
+	struct weston_compositor *compositor = feedback_main->compositor;
+	struct weston_dmabuf_format_table_entry *entry;
+	struct wl_array table;
+	int *formats = NULL;
+	uint64_t *modifiers = NULL;
+	uint64_t modifier_invalid = DRM_FORMAT_MOD_INVALID;
+	int num_formats, num_modifiers;
+	int i, j;
+
+	if (feedback_main->table_file)
+		return 0;
+
+	wl_array_init(&table);
+
+	compositor->renderer->query_dmabuf_formats(compositor, &formats,
+						   &num_formats);
+	for (i = 0; i < num_formats; i++) {
+		compositor->renderer->query_dmabuf_modifiers(compositor,
+							     formats[i],
+							     &modifiers,
+							     &num_modifiers);
+		if (num_modifiers == 0) {
+			num_modifiers = 1;
+			modifiers = &modifier_invalid;
+		}
+		for (j = 0; j < num_modifiers; j++) {
+			/* Tranches index the table with 16 bits. */
+			if (table.size / sizeof *entry > UINT16_MAX)
+				break;
+			entry = wl_array_add(&table, sizeof *entry);
+			if (!entry)
+				break;
+			entry->format = formats[i];
+			entry->pad = 0;
+			entry->modifier = modifiers[j];
+		}
+		if (modifiers != &modifier_invalid)
+			free(modifiers);
+	}
+	free(formats);
+
+	feedback_main->table_file =
+		os_ro_anonymous_file_create(table.size, table.data);
+	if (!feedback_main->table_file) {
+		wl_array_release(&table);
+		return -1;
+	}
+	feedback_main->entries = table.data;
+	feedback_main->num_entries = table.size / sizeof *entry;
+
+	return 0;
+}
+
+/** Set the main device of the linux-dmabuf feedback
+ *
+ * \param compositor The compositor.
+ * \param device The device clients should allocate their buffers on, the
+ *               one the renderer uses.
+ * \return Zero on success, -1 on failure.
+ *
+ * Call this before linux_dmabuf_setup() to advertise version 4 of the
+ * protocol, with which clients can ask for the formats and modifiers
+ * preferred for each surface, see
+ * weston_surface_set_dmabuf_scanout_tranche().
+ */
+WL_EXPORT int
+linux_dmabuf_set_main_device(struct weston_compositor *compositor,
+			     dev_t device)
+{
+	struct weston_dmabuf_feedback_main *feedback_main;
+
+	feedback_main = compositor->dmabuf_feedback_main;
+	if (!feedback_main) {
+		feedback_main = zalloc(sizeof *feedback_main);
+		if (!feedback_main)
+			return -1;
+
+		feedback_main->compositor = compositor;
+		feedback_main->compositor_destroy_listener.notify =
+			feedback_main_destroy;
+		wl_signal_add(&compositor->destroy_signal,
+			      &feedback_main->compositor_destroy_listener);
+		compositor->dmabuf_feedback_main = feedback_main;
+	}
+
+	feedback_main->device = device;
+
+	return 0;
+}
+
+static void
+send_tranche(struct wl_resource *resource, dev_t device,
+	     struct wl_array *indices, uint32_t flags)
+{
+	struct wl_array device_array = {
+		.size = sizeof device,
+		.alloc = 0,
+		.data = &device,
+	};
+
+	zwp_linux_dmabuf_feedback_v1_send_tranche_target_device(resource,
+								&device_array);
+	zwp_linux_dmabuf_feedback_v1_send_tranche_formats(resource, indices);
+	zwp_linux_dmabuf_feedback_v1_send_tranche_flags(resource, flags);
+	zwp_linux_dmabuf_feedback_v1_send_tranche_done(resource);
+}
+
+/* Send the tranches in order of preference, the scanout one first if the
+ * surface has one, then the main device with every format. */
+static void
+send_feedback(struct wl_resource *resource,
+	      struct weston_dmabuf_feedback_main *feedback_main,
+	      struct weston_dmabuf_surface_feedback *feedback,
+	      bool send_table)
+{
+	struct wl_array device_array = {
+		.size = sizeof feedback_main->device,
+		.alloc = 0,
+		.data = &feedback_main->device,
+	};
+	struct wl_array all_indices;
+	uint16_t *index;
+	unsigned int i;
+	int fd;
+
+	if (send_table) {
+		fd = os_ro_anonymous_file_get_fd(feedback_main->table_file,
+						 RO_ANONYMOUS_FILE_MAPMODE_PRIVATE);
+		if (fd < 0) {
+			wl_resource_post_no_memory(resource);
+			return;
+		}
+		zwp_linux_dmabuf_feedback_v1_send_format_table(resource, fd,
+			os_ro_anonymous_file_size(feedback_main->table_file));
+		os_ro_anonymous_file_put_fd(fd);
+	}
+
+	zwp_linux_dmabuf_feedback_v1_send_main_device(resource, &device_array);
+
+	if (feedback && feedback->scanout_indices.size > 0)
+		send_tranche(resource, feedback->scanout_device,
+			     &feedback->scanout_indices,
+			     ZWP_LINUX_DMABUF_FEEDBACK_V1_TRANCHE_FLAGS_SCANOUT);
+
+	wl_array_init(&all_indices);
+	for (i = 0; i < feedback_main->num_entries; i++) {
+		index = wl_array_add(&all_indices, sizeof *index);
+		if (!index) {
+			wl_array_release(&all_indices);
+			wl_resource_post_no_memory(resource);
+			return;
+		}
+		*index = i;
+	}
+	send_tranche(resource, feedback_main->device, &all_indices, 0);
+	wl_array_release(&all_indices);
+
+	zwp_linux_dmabuf_feedback_v1_send_done(resource);
+}
+
+static void
+dmabuf_feedback_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct zwp_linux_dmabuf_feedback_v1_interface
+dmabuf_feedback_implementation = {
+	dmabuf_feedback_destroy
+};
+
+static void
+dmabuf_feedback_resource_destroy(struct wl_resource *resource)
+{
+	wl_list_remove(wl_resource_get_link(resource));
+}
+
+static struct wl_resource *
+create_feedback_resource(struct wl_client *client,
+			 struct wl_resource *dmabuf_resource, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client,
+				      &zwp_linux_dmabuf_feedback_v1_interface,
+				      wl_resource_get_version(dmabuf_resource),
+				      id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return NULL;
+	}
+
+	wl_list_init(wl_resource_get_link(resource));
+	wl_resource_set_implementation(resource,
+				       &dmabuf_feedback_implementation,
+				       NULL, dmabuf_feedback_resource_destroy);
+
+	return resource;
+}
+
+static void
+linux_dmabuf_get_default_feedback(struct wl_client *client,
+				  struct wl_resource *dmabuf_resource,
+				  uint32_t id)
+{
+	struct weston_compositor *compositor =
+		wl_resource_get_user_data(dmabuf_resource);
+	struct weston_dmabuf_feedback_main *feedback_main =
+		compositor->dmabuf_feedback_main;
+	struct wl_resource *resource;
+
+	resource = create_feedback_resource(client, dmabuf_resource, id);
+	if (!resource)
+		return;
+
+	if (feedback_main_build_table(feedback_main) < 0) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	send_feedback(resource, feedback_main, NULL, true);
+}
+
+static void
+surface_feedback_destroy(struct wl_listener *listener, void *data)
+{
+	struct weston_dmabuf_surface_feedback *feedback =
+		wl_container_of(listener, feedback, surface_destroy_listener);
+	struct wl_resource *resource, *tmp;
+
+	/* The resources stay around until the client destroys them, they
+	 * just won't get any more events. */
+	wl_resource_for_each_safe(resource, tmp, &feedback->resource_list) {
+		wl_list_remove(wl_resource_get_link(resource));
+		wl_list_init(wl_resource_get_link(resource));
+	}
+
+	wl_list_remove(&feedback->surface_destroy_listener.link);
+	wl_array_release(&feedback->scanout_indices);
+	free(feedback);
+}
+
+static struct weston_dmabuf_surface_feedback *
+surface_feedback_get(struct weston_surface *surface)
+{
+	struct wl_listener *listener;
+	struct weston_dmabuf_surface_feedback *feedback;
+
+	listener = wl_signal_get(&surface->destroy_signal,
+				 surface_feedback_destroy);
+	if (!listener)
+		return NULL;
+
+	return wl_container_of(listener, feedback, surface_destroy_listener);
+}
+
+static void
+linux_dmabuf_get_surface_feedback(struct wl_client *client,
+				  struct wl_resource *dmabuf_resource,
+				  uint32_t id,
+				  struct wl_resource *surface_resource)
+{
+	struct weston_compositor *compositor =
+		wl_resource_get_user_data(dmabuf_resource);
+	struct weston_dmabuf_feedback_main *feedback_main =
+		compositor->dmabuf_feedback_main;
+	struct weston_surface *surface =
+		wl_resource_get_user_data(surface_resource);
+	struct weston_dmabuf_surface_feedback *feedback;
+	struct wl_resource *resource;
+
+	resource = create_feedback_resource(client, dmabuf_resource, id);
+	if (!resource)
+		return;
+
+	if (feedback_main_build_table(feedback_main) < 0) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	feedback = surface_feedback_get(surface);
+	if (!feedback) {
+		feedback = zalloc(sizeof *feedback);
+		if (!feedback) {
+			wl_client_post_no_memory(client);
+			return;
+		}
+		feedback->surface = surface;
+		wl_list_init(&feedback->resource_list);
+		wl_array_init(&feedback->scanout_indices);
+		feedback->surface_destroy_listener.notify =
+			surface_feedback_destroy;
+		wl_signal_add(&surface->destroy_signal,
+			      &feedback->surface_destroy_listener);
+	}
+
+	wl_list_insert(&feedback->resource_list,
+		       wl_resource_get_link(resource));
+
+	send_feedback(resource, feedback_main, feedback, true);
+}
+
+static void
+surface_feedback_update(struct weston_dmabuf_surface_feedback *feedback,
+			dev_t device, struct wl_array *indices)
+{
+	struct weston_dmabuf_feedback_main *feedback_main =
+		feedback->surface->compositor->dmabuf_feedback_main;
+	struct wl_resource *resource;
+
+	if (feedback->scanout_device == device &&
+	    feedback->scanout_indices.size == indices->size &&
+	    memcmp(feedback->scanout_indices.data, indices->data,
+		   indices->size) == 0)
+		return;
+
+	wl_array_release(&feedback->scanout_indices);
+	feedback->scanout_indices = *indices;
+	feedback->scanout_device = device;
+	wl_array_init(indices);
+
+	wl_resource_for_each(resource, &feedback->resource_list)
+		send_feedback(resource, feedback_main, feedback, false);
+}
+
+/** Set the scanout tranche of a surface's dmabuf feedback
+ *
+ * \param surface The surface.
+ * \param device The device scanning out the surface.
+ * \param supported Tells which formats and modifiers could be scanned out.
+ * \param data Passed to \p supported.
+ *
+ * Tells the clients listening for the feedback of \p surface to prefer
+ * the formats and modifiers accepted by \p supported, out of those the
+ * renderer can import. For backends which failed to put a view of the
+ * surface on a plane because of its format. Nothing is sent when the
+ * tranche does not actually change, or if no client listens.
+ */
+WL_EXPORT void
+weston_surface_set_dmabuf_scanout_tranche(struct weston_surface *surface,
+					  dev_t device,
+					  weston_dmabuf_scanout_supported_func supported,
+					  void *data)
+{
+	struct weston_dmabuf_feedback_main *feedback_main =
+		surface->compositor->dmabuf_feedback_main;
+	struct weston_dmabuf_surface_feedback *feedback;
+	struct wl_array indices;
+	uint16_t *index;
+	unsigned int i;
+
+	feedback = surface_feedback_get(surface);
+	if (!feedback || !feedback_main)
+		return;
+
+	wl_array_init(&indices);
+	for (i = 0; i < feedback_main->num_entries; i++) {
+		if (!supported(data, feedback_main->entries[i].format,
+			       feedback_main->entries[i].modifier))
+			continue;
+
+		index = wl_array_add(&indices, sizeof *index);
+		if (!index)
+			break;
+		*index = i;
+	}
+
+	surface_feedback_update(feedback, device, &indices);
+	wl_array_release(&indices);
+}
+
+/** Remove the scanout tranche of a surface's dmabuf feedback
+ *
+ * \param surface The surface.
+ *
+ * \sa weston_surface_set_dmabuf_scanout_tranche
+ */
+WL_EXPORT void
+weston_surface_clear_dmabuf_scanout_tranche(struct weston_surface *surface)
+{
+	struct weston_dmabuf_surface_feedback *feedback;
+	struct wl_array none;
+
+	feedback = surface_feedback_get(surface);
+	if (!feedback)
+		return;
+
+	wl_array_init(&none);
+	surface_feedback_update(feedback, feedback->scanout_device, &none);
+}
+
 static const struct zwp_linux_dmabuf_v1_interface linux_dmabuf_implementation = {
 	linux_dmabuf_destroy,
-	linux_dmabuf_create_params
+	linux_dmabuf_create_params,
+	linux_dmabuf_get_default_feedback,
+	linux_dmabuf_get_surface_feedback
 };
 
 static void
@@ -493,6 +1053,10 @@ bind_linux_dmabuf(struct wl_client *client,
 	wl_resource_set_implementation(resource, &linux_dmabuf_implementation,
 				       compositor, NULL);
 
+	/* From version 4, clients get the formats from the feedback. */
+	if (version >= ZWP_LINUX_DMABUF_V1_GET_DEFAULT_FEEDBACK_SINCE_VERSION)
+		return;
+
 	/*
 	 * Use EGL_EXT_image_dma_buf_import_modifiers to query and advertise
 	 * format/modifier codes.
@@ -540,14 +1104,19 @@ bind_linux_dmabuf(struct wl_client *client,
  * lifetime. There is no way to deinit explicitly, globals will be reaped
  * when the wl_display gets destroyed.
  *
+ * Version 4, with the dmabuf feedback, is advertised only if the main
+ * device was set with linux_dmabuf_set_main_device().
+ *
  * \param compositor The compositor to init for.
  * \return Zero on success, -1 on failure.
  */
 WL_EXPORT int
 linux_dmabuf_setup(struct weston_compositor *compositor)
 {
+	int version = compositor->dmabuf_feedback_main ? 4 : 3;
+
 	if (!wl_global_create(compositor->wl_display,
-			      &zwp_linux_dmabuf_v1_interface, 3,
+			      &zwp_linux_dmabuf_v1_interface, version,
 			      compositor, bind_linux_dmabuf))
 		return -1;
 
@@ -26,7 +26,9 @@
 #ifndef WESTON_LINUX_DMABUF_H
 #define WESTON_LINUX_DMABUF_H
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #define MAX_DMABUF_PLANES 4
 #ifndef DRM_FORMAT_MOD_INVALID
@@ -61,6 +63,10 @@ struct linux_dmabuf_buffer {
 	void *user_data;
 	dmabuf_user_data_destroy_func user_data_destroy_func;
 
+	/* Backend-private data, set independently of the renderer's */
+	void *backend_user_data;
+	dmabuf_user_data_destroy_func backend_user_data_destroy_func;
+
 	/* XXX:
 	 *
 	 * Add backend private data. This would be for the backend
@@ -78,11 +84,41 @@ struct linux_dmabuf_buffer {
 
 	/**< marked as scan-out capable, avoids any composition */
 	bool direct_display;
+
+	/**< the params to answer once an asynchronous import finished,
+	 * NULL if the client destroyed them in the meantime */
+	struct wl_resource *import_params_resource;
+	struct wl_listener import_params_destroy_listener;
 };
 
 int
 linux_dmabuf_setup(struct weston_compositor *compositor);
 
+int
+linux_dmabuf_set_main_device(struct weston_compositor *compositor,
+			     dev_t device);
+
+/** Tells whether a format and modifier pair could be scanned out
+ *
+ * \param data The data passed to
+ *             weston_surface_set_dmabuf_scanout_tranche().
+ * \param format The DRM FourCC format code.
+ * \param modifier The format modifier, DRM_FORMAT_MOD_INVALID for the
+ *                 implicit one.
+ */
+typedef bool (*weston_dmabuf_scanout_supported_func)(void *data,
+						     uint32_t format,
+						     uint64_t modifier);
+
+void
+weston_surface_set_dmabuf_scanout_tranche(struct weston_surface *surface,
+					  dev_t device,
+					  weston_dmabuf_scanout_supported_func supported,
+					  void *data);
+
+void
+weston_surface_clear_dmabuf_scanout_tranche(struct weston_surface *surface);
+
 int
 weston_direct_display_setup(struct weston_compositor *compositor);
 
@@ -96,6 +132,13 @@ linux_dmabuf_buffer_set_user_data(struct linux_dmabuf_buffer *buffer,
 void *
 linux_dmabuf_buffer_get_user_data(struct linux_dmabuf_buffer *buffer);
 
+void
+linux_dmabuf_buffer_set_backend_user_data(struct linux_dmabuf_buffer *buffer,
+					  void *data,
+					  dmabuf_user_data_destroy_func func);
+void *
+linux_dmabuf_buffer_get_backend_user_data(struct linux_dmabuf_buffer *buffer);
+
 void
 linux_dmabuf_buffer_send_server_error(struct linux_dmabuf_buffer *buffer,
 				      const char *msg);
@@ -0,0 +1,318 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <libweston/libweston.h>
+#include <libweston/weston-log.h>
+#include <libweston/zalloc.h>
+#include "libweston-internal.h"
+#include "linux-dmabuf.h"
+#include "pixel-formats.h"
+#include "shared/helpers.h"
+
+/*
+ * Per-client memory accounting for the 'memory-stats' debug scope and
+ * weston_compositor::client_memory_limit_mib.
+ *
+ * The buffers a surface holds, attached or in the cache of a synchronized
+ * sub-surface, are counted whenever they change. That costs no system calls,
+ * so the limit can be checked on every commit. Renderer memory depends on
+ * when the renderer uploads, and is only queried when the scope is bound.
+ *
+ * Only what clients attach is seen: the size of wl_shm pools or dmabufs a
+ * client never attaches is not known to libweston.
+ */
+
+struct weston_client_memory {
+	struct weston_compositor *compositor;
+	struct wl_client *client;
+	struct wl_listener destroy_listener;
+	struct wl_list link; /* weston_compositor::client_memory_list */
+
+	struct wl_list surface_list; /* weston_surface::memory_link */
+	size_t shm; /* sum of weston_surface_memory::shm */
+	size_t dmabuf;
+	size_t cached;
+};
+
+static size_t
+buffer_memory_size(struct weston_buffer *buffer, bool *is_dmabuf)
+{
+	struct linux_dmabuf_buffer *dmabuf;
+	struct wl_shm_buffer *shm;
+	const struct dmabuf_attributes *attr;
+	const struct pixel_format_info *info;
+	size_t size = 0;
+	int i;
+
+	*is_dmabuf = false;
+
+	if (!buffer || !buffer->resource)
+		return 0;
+
+	shm = wl_shm_buffer_get(buffer->resource);
+	if (shm)
+		return (size_t)wl_shm_buffer_get_stride(shm) *
+		       wl_shm_buffer_get_height(shm);
+
+	dmabuf = linux_dmabuf_buffer_get(buffer->resource);
+	if (!dmabuf)
+		return 0;
+
+	*is_dmabuf = true;
+	attr = &dmabuf->attributes;
+	info = pixel_format_get_info(attr->format);
+	for (i = 0; i < attr->n_planes; i++) {
+		unsigned int height = attr->height;
+
+		if (info)
+			height = pixel_format_height_for_plane(info, i, height);
+		size += (size_t)attr->stride[i] * height;
+	}
+
+	return size;
+}
+
+static void
+client_memory_free(struct weston_client_memory *cm)
+{
+	struct weston_surface *surface, *tmp;
+
+	/* Surfaces may outlive their client, e.g. for a closing animation. */
+	wl_list_for_each_safe(surface, tmp, &cm->surface_list, memory_link) {
+		wl_list_remove(&surface->memory_link);
+		wl_list_init(&surface->memory_link);
+		surface->client_memory = NULL;
+	}
+
+	wl_list_remove(&cm->destroy_listener.link);
+	wl_list_remove(&cm->link);
+	free(cm);
+}
+
+static void
+client_memory_destroy(struct wl_listener *listener, void *data)
+{
+	struct weston_client_memory *cm =
+		container_of(listener, struct weston_client_memory,
+			     destroy_listener);
+
+	client_memory_free(cm);
+}
+
+/** Stop accounting, on compositor destruction
+ *
+ * The clients are only destroyed with the display, after the compositor.
+ */
+void
+weston_compositor_memory_stats_fini(struct weston_compositor *compositor)
+{
+	struct weston_client_memory *cm, *tmp;
+
+	wl_list_for_each_safe(cm, tmp, &compositor->client_memory_list, link)
+		client_memory_free(cm);
+}
+
+static struct weston_client_memory *
+client_memory_get(struct weston_compositor *compositor,
+		  struct wl_client *client)
+{
+	struct weston_client_memory *cm;
+	struct wl_listener *listener;
+
+	listener = wl_client_get_destroy_listener(client,
+						  client_memory_destroy);
+	if (listener)
+		return container_of(listener, struct weston_client_memory,
+				    destroy_listener);
+
+	cm = zalloc(sizeof *cm);
+	if (!cm)
+		return NULL;
+
+	cm->compositor = compositor;
+	cm->client = client;
+	wl_list_init(&cm->surface_list);
+	cm->destroy_listener.notify = client_memory_destroy;
+	wl_client_add_destroy_listener(client, &cm->destroy_listener);
+	wl_list_insert(&compositor->client_memory_list, &cm->link);
+
+	return cm;
+}
+
+static size_t
+client_memory_total(const struct weston_client_memory *cm)
+{
+	return cm->shm + cm->dmabuf + cm->cached;
+}
+
+/** Account the buffers of a surface again after they changed
+ *
+ * \param surface The surface.
+ * \param cached The buffer in the cache of a synchronized sub-surface, or
+ * NULL.
+ *
+ * Disconnects the client if it holds more than
+ * weston_compositor::client_memory_limit_mib.
+ */
+void
+weston_surface_memory_update(struct weston_surface *surface,
+			     struct weston_buffer *cached)
+{
+	struct weston_compositor *compositor = surface->compositor;
+	struct weston_client_memory *cm = surface->client_memory;
+	struct weston_surface_memory mem = {};
+	size_t size, limit;
+	bool is_dmabuf;
+
+	if (!cm) {
+		if (!surface->resource)
+			return;
+
+		cm = client_memory_get(compositor,
+				       wl_resource_get_client(surface->resource));
+		if (!cm)
+			return;
+
+		surface->client_memory = cm;
+		wl_list_insert(&cm->surface_list, &surface->memory_link);
+	}
+
+	size = buffer_memory_size(surface->buffer_ref.buffer, &is_dmabuf);
+	if (is_dmabuf)
+		mem.dmabuf = size;
+	else
+		mem.shm = size;
+
+	mem.cached = buffer_memory_size(cached, &is_dmabuf);
+
+	cm->shm = cm->shm - surface->memory.shm + mem.shm;
+	cm->dmabuf = cm->dmabuf - surface->memory.dmabuf + mem.dmabuf;
+	cm->cached = cm->cached - surface->memory.cached + mem.cached;
+	surface->memory = mem;
+
+	limit = (size_t)compositor->client_memory_limit_mib << 20;
+	if (limit == 0 || client_memory_total(cm) <= limit)
+		return;
+
+	weston_log("Client %p holds %zu KiB of buffers, more than the limit "
+		   "of %d MiB; disconnecting it.\n", cm->client,
+		   client_memory_total(cm) / 1024,
+		   compositor->client_memory_limit_mib);
+	wl_client_post_no_memory(cm->client);
+}
+
+void
+weston_surface_memory_destroy(struct weston_surface *surface)
+{
+	struct weston_client_memory *cm = surface->client_memory;
+
+	if (!cm)
+		return;
+
+	cm->shm -= surface->memory.shm;
+	cm->dmabuf -= surface->memory.dmabuf;
+	cm->cached -= surface->memory.cached;
+	wl_list_remove(&surface->memory_link);
+	surface->client_memory = NULL;
+}
+
+static void
+print_surface_memory(struct weston_log_subscription *sub,
+		     struct weston_surface *surface, size_t renderer)
+{
+	char label[96];
+	uint32_t id = 0;
+
+	if (surface->resource)
+		id = wl_resource_get_id(surface->resource);
+
+	if (!surface->get_label ||
+	    surface->get_label(surface, label, sizeof label) < 0)
+		strcpy(label, "no description");
+
+	weston_log_subscription_printf(sub,
+		"\tsurface %u (%s): shm %zu KiB, dmabuf %zu KiB, "
+		"cached %zu KiB, renderer %zu KiB\n", id, label,
+		surface->memory.shm / 1024, surface->memory.dmabuf / 1024,
+		surface->memory.cached / 1024, renderer / 1024);
+}
+
+/**
+ * Called when the 'memory-stats' debug scope is bound by a client. This
+ * one-shot weston-debug scope prints, for each client, the memory of the
+ * buffers it holds and what the renderer keeps for its surfaces, and then
+ * terminates the stream.
+ */
+void
+weston_compositor_memory_stats_cb(struct weston_log_subscription *sub,
+				  void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct weston_renderer *renderer = compositor->renderer;
+	struct weston_client_memory *cm;
+	struct weston_surface *surface;
+
+	if (compositor->client_memory_limit_mib > 0)
+		weston_log_subscription_printf(sub,
+			"limit per client: %d MiB\n",
+			compositor->client_memory_limit_mib);
+
+	wl_list_for_each(cm, &compositor->client_memory_list, link) {
+		size_t renderer_total = 0;
+		unsigned int count = 0;
+		pid_t pid;
+
+		wl_list_for_each(surface, &cm->surface_list, memory_link) {
+			if (renderer->surface_get_memory)
+				renderer_total +=
+					renderer->surface_get_memory(surface);
+			count++;
+		}
+
+		wl_client_get_credentials(cm->client, &pid, NULL, NULL);
+		weston_log_subscription_printf(sub,
+			"client %p, pid %d: %zu KiB of buffers in %u surfaces, "
+			"renderer %zu KiB\n", cm->client, (int)pid,
+			client_memory_total(cm) / 1024, count,
+			renderer_total / 1024);
+
+		wl_list_for_each(surface, &cm->surface_list, memory_link)
+			print_surface_memory(sub, surface,
+					     renderer->surface_get_memory ?
+					     renderer->surface_get_memory(surface) :
+					     0);
+	}
+
+	weston_log_subscription_complete(sub);
+}
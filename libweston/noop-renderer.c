@@ -25,11 +25,71 @@
 
 #include "config.h"
 
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <libweston/libweston.h>
 #include "libweston-internal.h"
+#include "shared/helpers.h"
+
+struct noop_renderer {
+	struct weston_renderer base;
+	struct weston_noop_renderer_stats stats;
+	/* The counters at the end of the previous repaint, for the debug
+	 * scope. */
+	struct weston_noop_renderer_stats last;
+	struct weston_log_scope *debug;
+};
+
+static void
+noop_renderer_destroy(struct weston_compositor *ec);
+
+static struct noop_renderer *
+get_renderer(struct weston_compositor *ec)
+{
+	if (!ec->renderer || ec->renderer->destroy != noop_renderer_destroy)
+		return NULL;
+
+	return container_of(ec->renderer, struct noop_renderer, base);
+}
+
+static uint64_t
+region_area(pixman_region32_t *region)
+{
+	pixman_box32_t *rects;
+	uint64_t area = 0;
+	int i, n;
+
+	rects = pixman_region32_rectangles(region, &n);
+	for (i = 0; i < n; i++)
+		area += (uint64_t)(rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+
+	return area;
+}
+
+static void
+stats_print(struct weston_log_subscription *sub, const char *what,
+	    const struct weston_noop_renderer_stats *stats)
+{
+	weston_log_subscription_printf(sub,
+		"%s: %" PRIu64 " repaints, %" PRIu64 " views, "
+		"%" PRIu64 " damage rects, %" PRIu64 " damage px, "
+		"%" PRIu64 " draw px, %" PRIu64 " upload bytes, "
+		"%" PRIu64 " attaches\n", what, stats->repaints, stats->views,
+		stats->damage_rects, stats->damage_pixels, stats->draw_pixels,
+		stats->upload_bytes, stats->attaches);
+}
+
+static void
+noop_renderer_debug_begin(struct weston_log_subscription *sub, void *data)
+{
+	struct noop_renderer *renderer = data;
+
+	stats_print(sub, "total", &renderer->stats);
+}
 
 static int
 noop_renderer_read_pixels(struct weston_output *output,
@@ -40,15 +100,81 @@ noop_renderer_read_pixels(struct weston_output *output,
 	return 0;
 }
 
+/* Counts what a renderer would draw: the damaged part of each view on the
+ * output that is not occluded by the views above it. */
 static void
 noop_renderer_repaint_output(struct weston_output *output,
 			     pixman_region32_t *output_damage)
 {
+	struct noop_renderer *renderer = get_renderer(output->compositor);
+	struct weston_noop_renderer_stats *stats = &renderer->stats;
+	struct weston_noop_renderer_stats *last = &renderer->last;
+	struct weston_view **evp;
+	pixman_region32_t draw;
+
+	stats->repaints++;
+	stats->damage_rects += pixman_region32_n_rects(output_damage);
+	stats->damage_pixels += region_area(output_damage);
+
+	pixman_region32_init(&draw);
+	wl_array_for_each(evp, &output->view_array) {
+		struct weston_view *ev = *evp;
+
+		stats->views++;
+
+		pixman_region32_intersect(&draw, &ev->transform.boundingbox,
+					  output_damage);
+		pixman_region32_subtract(&draw, &draw, &ev->clip);
+		stats->draw_pixels += region_area(&draw);
+	}
+	pixman_region32_fini(&draw);
+
+	if (weston_log_scope_is_enabled(renderer->debug)) {
+		struct weston_noop_renderer_stats delta = {
+			.repaints = 1,
+			.views = stats->views - last->views,
+			.damage_rects = stats->damage_rects - last->damage_rects,
+			.damage_pixels = stats->damage_pixels -
+					 last->damage_pixels,
+			.draw_pixels = stats->draw_pixels - last->draw_pixels,
+			.upload_bytes = stats->upload_bytes - last->upload_bytes,
+			.attaches = stats->attaches - last->attaches,
+		};
+
+		weston_log_scope_printf(renderer->debug,
+			"output %s: %" PRIu64 " views, %" PRIu64 " damage rects, "
+			"%" PRIu64 " damage px, %" PRIu64 " draw px; since the "
+			"last repaint %" PRIu64 " upload bytes, %" PRIu64
+			" attaches\n", output->name, delta.views,
+			delta.damage_rects, delta.damage_pixels,
+			delta.draw_pixels, delta.upload_bytes, delta.attaches);
+	}
+
+	*last = *stats;
 }
 
+/* The bytes a renderer would copy into its textures for the damage. The
+ * damage is in surface coordinates, buffer scale and transform are
+ * ignored. */
 static void
 noop_renderer_flush_damage(struct weston_surface *surface)
 {
+	struct noop_renderer *renderer = get_renderer(surface->compositor);
+	struct weston_buffer *buffer = surface->buffer_ref.buffer;
+	pixman_region32_t damage;
+	int32_t bytes_per_pixel;
+
+	if (!buffer || !buffer->shm_buffer || buffer->width <= 0)
+		return;
+
+	bytes_per_pixel = wl_shm_buffer_get_stride(buffer->shm_buffer) /
+			  buffer->width;
+
+	pixman_region32_init(&damage);
+	pixman_region32_intersect_rect(&damage, &surface->damage, 0, 0,
+				       buffer->width, buffer->height);
+	renderer->stats.upload_bytes += region_area(&damage) * bytes_per_pixel;
+	pixman_region32_fini(&damage);
 }
 
 static void
@@ -62,6 +188,8 @@ noop_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 	if (!buffer)
 		return;
 
+	get_renderer(es->compositor)->stats.attaches++;
+
 	shm_buffer = wl_shm_buffer_get(buffer->resource);
 
 	if (!shm_buffer) {
@@ -98,26 +226,72 @@ noop_renderer_surface_set_color(struct weston_surface *surface,
 static void
 noop_renderer_destroy(struct weston_compositor *ec)
 {
-	free(ec->renderer);
+	struct noop_renderer *renderer = get_renderer(ec);
+
+	weston_log_scope_destroy(renderer->debug);
+	free(renderer);
 	ec->renderer = NULL;
 }
 
+/** Copies the work counters of the no-op renderer
+ *
+ * \param ec The compositor.
+ * \param stats Filled with the counters since start-up or the last reset.
+ * \return false if the compositor does not use the no-op renderer.
+ */
+bool
+noop_renderer_get_stats(struct weston_compositor *ec,
+			struct weston_noop_renderer_stats *stats)
+{
+	struct noop_renderer *renderer = get_renderer(ec);
+
+	if (!renderer)
+		return false;
+
+	*stats = renderer->stats;
+
+	return true;
+}
+
+/** Zeroes the work counters of the no-op renderer, e.g. between the
+ *  scenarios of a load test.
+ *
+ * \param ec The compositor.
+ */
+void
+noop_renderer_reset_stats(struct weston_compositor *ec)
+{
+	struct noop_renderer *renderer = get_renderer(ec);
+
+	if (!renderer)
+		return;
+
+	memset(&renderer->stats, 0, sizeof renderer->stats);
+	memset(&renderer->last, 0, sizeof renderer->last);
+}
+
 WL_EXPORT int
 noop_renderer_init(struct weston_compositor *ec)
 {
-	struct weston_renderer *renderer;
+	struct noop_renderer *renderer;
 
 	renderer = zalloc(sizeof *renderer);
 	if (renderer == NULL)
 		return -1;
 
-	renderer->read_pixels = noop_renderer_read_pixels;
-	renderer->repaint_output = noop_renderer_repaint_output;
-	renderer->flush_damage = noop_renderer_flush_damage;
-	renderer->attach = noop_renderer_attach;
-	renderer->surface_set_color = noop_renderer_surface_set_color;
-	renderer->destroy = noop_renderer_destroy;
-	ec->renderer = renderer;
+	renderer->base.read_pixels = noop_renderer_read_pixels;
+	renderer->base.repaint_output = noop_renderer_repaint_output;
+	renderer->base.flush_damage = noop_renderer_flush_damage;
+	renderer->base.attach = noop_renderer_attach;
+	renderer->base.surface_set_color = noop_renderer_surface_set_color;
+	renderer->base.destroy = noop_renderer_destroy;
+	renderer->debug =
+		weston_compositor_add_log_scope(ec, "noop-renderer",
+						"Work the no-op renderer would "
+						"have done in each repaint\n",
+						noop_renderer_debug_begin,
+						NULL, renderer);
+	ec->renderer = &renderer->base;
 
 	return 0;
 }
@@ -0,0 +1,205 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libweston/zalloc.h>
+#include "object-pool.h"
+
+/*
+ * A free list of fixed size objects.
+ *
+ * Protocol objects like frame callbacks are created and destroyed at the
+ * client's frame rate. Instead of going back to malloc every time, freed
+ * objects are kept on a per-type list, up to a limit, and handed out again.
+ *
+ * Each object is preceded by a header pointing back to its pool, so that it
+ * can be released from a wl_resource destructor without any other context.
+ * Resources may outlive the compositor, as clients are only torn down with
+ * the display, so a destroyed pool stays around until its last object is
+ * freed.
+ */
+
+union pool_header {
+	struct {
+		struct weston_object_pool *pool;
+		union pool_header *next_free;
+	} h;
+	max_align_t align;
+};
+
+struct weston_object_pool {
+	const char *name;
+	size_t object_size;
+	unsigned int max_cached;
+
+	union pool_header *free_list;
+	unsigned int cached;
+	unsigned int in_use;
+	unsigned int peak;
+	uint64_t allocs;
+	uint64_t reuses;
+
+	bool destroyed;
+};
+
+static void
+object_pool_release(struct weston_object_pool *pool)
+{
+	union pool_header *hdr, *next;
+
+	for (hdr = pool->free_list; hdr; hdr = next) {
+		next = hdr->h.next_free;
+		free(hdr);
+	}
+
+	pool->free_list = NULL;
+	pool->cached = 0;
+}
+
+/** Create an object pool
+ *
+ * \param name Name shown in the statistics, must outlive the pool.
+ * \param object_size Size of the objects.
+ * \param max_cached How many freed objects to keep for reuse.
+ * \return The pool, or NULL if out of memory.
+ */
+struct weston_object_pool *
+weston_object_pool_create(const char *name, size_t object_size,
+			  unsigned int max_cached)
+{
+	struct weston_object_pool *pool;
+
+	pool = zalloc(sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pool->name = name;
+	pool->object_size = object_size;
+	pool->max_cached = max_cached;
+
+	return pool;
+}
+
+/** Destroy an object pool
+ *
+ * Objects still in use remain valid, and must still be released with
+ * weston_object_pool_free().
+ */
+void
+weston_object_pool_destroy(struct weston_object_pool *pool)
+{
+	if (!pool)
+		return;
+
+	object_pool_release(pool);
+
+	if (pool->in_use == 0)
+		free(pool);
+	else
+		pool->destroyed = true;
+}
+
+/** Allocate a zero-initialized object, NULL if out of memory */
+void *
+weston_object_pool_alloc(struct weston_object_pool *pool)
+{
+	union pool_header *hdr;
+
+	assert(!pool->destroyed);
+
+	hdr = pool->free_list;
+	if (hdr) {
+		pool->free_list = hdr->h.next_free;
+		pool->cached--;
+		pool->reuses++;
+	} else {
+		hdr = malloc(sizeof *hdr + pool->object_size);
+		if (!hdr)
+			return NULL;
+		hdr->h.pool = pool;
+	}
+
+	hdr->h.next_free = NULL;
+	pool->allocs++;
+	pool->in_use++;
+	if (pool->in_use > pool->peak)
+		pool->peak = pool->in_use;
+
+	return memset(hdr + 1, 0, pool->object_size);
+}
+
+/** Return an object to the pool it was allocated from */
+void
+weston_object_pool_free(void *object)
+{
+	union pool_header *hdr;
+	struct weston_object_pool *pool;
+
+	if (!object)
+		return;
+
+	hdr = (union pool_header *)object - 1;
+	pool = hdr->h.pool;
+
+	assert(pool->in_use > 0);
+	pool->in_use--;
+
+	if (pool->destroyed) {
+		free(hdr);
+		if (pool->in_use == 0)
+			free(pool);
+		return;
+	}
+
+	if (pool->cached >= pool->max_cached) {
+		free(hdr);
+		return;
+	}
+
+	hdr->h.next_free = pool->free_list;
+	pool->free_list = hdr;
+	pool->cached++;
+}
+
+void
+weston_object_pool_get_stats(struct weston_object_pool *pool,
+			     struct weston_object_pool_stats *stats)
+{
+	stats->name = pool->name;
+	stats->object_size = pool->object_size;
+	stats->in_use = pool->in_use;
+	stats->cached = pool->cached;
+	stats->peak = pool->peak;
+	stats->allocs = pool->allocs;
+	stats->reuses = pool->reuses;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef WESTON_OBJECT_POOL_H
+#define WESTON_OBJECT_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct weston_object_pool;
+
+struct weston_object_pool_stats {
+	const char *name;
+	size_t object_size;
+	unsigned int in_use;	/**< objects currently allocated */
+	unsigned int cached;	/**< freed objects kept for reuse */
+	unsigned int peak;	/**< highest in_use so far */
+	uint64_t allocs;	/**< allocations served */
+	uint64_t reuses;	/**< of which came from the cache */
+};
+
+struct weston_object_pool *
+weston_object_pool_create(const char *name, size_t object_size,
+			  unsigned int max_cached);
+
+void
+weston_object_pool_destroy(struct weston_object_pool *pool);
+
+void *
+weston_object_pool_alloc(struct weston_object_pool *pool);
+
+void
+weston_object_pool_free(void *object);
+
+void
+weston_object_pool_get_stats(struct weston_object_pool *pool,
+			     struct weston_object_pool_stats *stats);
+
+#endif /* WESTON_OBJECT_POOL_H */
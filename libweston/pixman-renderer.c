@@ -30,24 +30,68 @@
 #include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
+#include <drm_fourcc.h>
 
 #include "pixman-renderer.h"
+#include "linux-dmabuf.h"
 #include "shared/helpers.h"
+#include "worker-pool.h"
 
 #include <linux/input.h>
 
+/* Repaints without a read-back before an on-demand shadow is dropped */
+#define PIXMAN_SHADOW_IDLE_FRAMES 120
+
+#define PIXMAN_REPAINT_MAX_BANDS 16
+#define PIXMAN_REPAINT_MIN_BAND_HEIGHT 32
+
+/** A horizontal stripe of an output repaint, painted by one thread */
+struct pixman_repaint_band {
+	struct weston_output *output;
+	/* own image on the target pixels, for the clip region */
+	pixman_image_t *target;
+	pixman_region32_t damage; /* in global coordinates */
+};
+
 struct pixman_output_state {
 	void *shadow_buffer;
 	pixman_image_t *shadow_image;
 	pixman_image_t *hw_buffer;
 	pixman_region32_t *hw_extra_damage;
+	bool threaded_repaint;
+
+	/* See pixman_renderer_output_options::shadow_on_readback */
+	bool shadow_on_readback;
+	bool shadow_stale; /* allocated but not painted yet */
+	unsigned int shadow_idle_frames;
+
+	/* Bands of the tiled repaint in progress, see output_queue_bands() */
+	struct pixman_repaint_band bands[PIXMAN_REPAINT_MAX_BANDS];
+	int n_bands;
 };
 
 struct pixman_surface_state {
 	struct weston_surface *surface;
 
 	pixman_image_t *image;
+	pixman_color_t color; /* of a solid fill image */
+
+	/* With shm_release_after_upload, image is copy_image, and shm_image
+	 * wraps the client buffer until its content is copied over. */
+	pixman_image_t *shm_image;
+	pixman_image_t *copy_image;
+	bool copy_needs_full_update;
+
+	/* CPU mapping of the attached dmabuf, image wraps it */
+	void *dmabuf_map;
+	size_t dmabuf_map_size;
+	int dmabuf_fd; /* owned by the dmabuf */
+
 	struct weston_buffer_reference buffer_ref;
 	struct weston_buffer_release_reference buffer_release_ref;
 
@@ -56,6 +100,17 @@ struct pixman_surface_state {
 	struct wl_listener renderer_destroy_listener;
 };
 
+/* The dmabuf formats this renderer can read from a CPU mapping */
+static const struct {
+	uint32_t drm_format;
+	pixman_format_code_t pixman_format;
+	bool opaque;
+} pixman_dmabuf_formats[] = {
+	{ DRM_FORMAT_XRGB8888, PIXMAN_x8r8g8b8, true },
+	{ DRM_FORMAT_ARGB8888, PIXMAN_a8r8g8b8, false },
+	{ DRM_FORMAT_RGB565, PIXMAN_r5g6b5, true },
+};
+
 struct pixman_renderer {
 	struct weston_renderer base;
 
@@ -63,9 +118,24 @@ struct pixman_renderer {
 	pixman_image_t *debug_color;
 	struct weston_binding *debug_binding;
 
+	/* pixman_deferred_repaint::link */
+	struct wl_list deferred_list;
+
 	struct wl_signal destroy_signal;
 };
 
+/** An output repaint left to the repaint threads */
+struct pixman_deferred_repaint {
+	struct wl_list link;
+	struct weston_output *output;
+	pixman_region32_t output_damage;
+	pixman_region32_t hw_damage;
+};
+
+static const pixman_color_t repaint_debug_color = {
+	0x3fff, 0x0000, 0x0000, 0x3fff
+};
+
 static inline struct pixman_output_state *
 get_output_state(struct weston_output *output)
 {
@@ -75,6 +145,12 @@ get_output_state(struct weston_output *output)
 static int
 pixman_renderer_create_surface(struct weston_surface *surface);
 
+static int
+output_shadow_create(struct weston_output *output);
+
+static void
+output_shadow_destroy(struct pixman_output_state *po);
+
 static inline struct pixman_surface_state *
 get_surface_state(struct weston_surface *surface)
 {
@@ -90,6 +166,37 @@ get_renderer(struct weston_compositor *ec)
 	return (struct pixman_renderer *)ec->renderer;
 }
 
+static bool
+output_repaints_on_thread(struct weston_output *output)
+{
+	struct pixman_output_state *po = get_output_state(output);
+
+	return po->threaded_repaint && output->compositor->repaint_pool;
+}
+
+/* Pixman images carry their transform, filter and repeat mode, which
+ * composite_whole() sets on the source. A surface shown on several outputs
+ * may be painted by several threads at once, so each of them gets its own
+ * image sharing the pixels. */
+static pixman_image_t *
+source_image_get(struct pixman_surface_state *ps, bool threaded)
+{
+	uint32_t *data;
+
+	if (!threaded)
+		return pixman_image_ref(ps->image);
+
+	data = pixman_image_get_data(ps->image);
+	if (!data)
+		return pixman_image_create_solid_fill(&ps->color);
+
+	return pixman_image_create_bits_no_clear(
+			pixman_image_get_format(ps->image),
+			pixman_image_get_width(ps->image),
+			pixman_image_get_height(ps->image),
+			data, pixman_image_get_stride(ps->image));
+}
+
 static int
 pixman_renderer_read_pixels(struct weston_output *output,
 			       pixman_format_code_t format, void *pixels,
@@ -98,12 +205,25 @@ pixman_renderer_read_pixels(struct weston_output *output,
 {
 	struct pixman_output_state *po = get_output_state(output);
 	pixman_image_t *out_buf;
+	pixman_image_t *src;
 
 	if (!po->hw_buffer) {
 		errno = ENODEV;
 		return -1;
 	}
 
+	/* The shadow has the same content, in cached memory */
+	if (po->shadow_image && !po->shadow_stale)
+		src = po->shadow_image;
+	else
+		src = po->hw_buffer;
+
+	if (po->shadow_on_readback) {
+		po->shadow_idle_frames = 0;
+		if (!po->shadow_image)
+			output_shadow_create(output);
+	}
+
 	out_buf = pixman_image_create_bits(format,
 		width,
 		height,
@@ -111,7 +231,7 @@ pixman_renderer_read_pixels(struct weston_output *output,
 		(PIXMAN_FORMAT_BPP(format) / 8) * width);
 
 	pixman_image_composite32(PIXMAN_OP_SRC,
-				 po->hw_buffer, /* src */
+				 src, /* src */
 				 NULL /* mask */,
 				 out_buf, /* dest */
 				 x, y, /* src_x, src_y */
@@ -132,10 +252,7 @@ region_global_to_output(struct weston_output *output, pixman_region32_t *region)
 		weston_matrix_transform_region(region, &output->matrix, region);
 	} else {
 		pixman_region32_translate(region, -output->x, -output->y);
-		weston_transformed_region(output->width, output->height,
-					  output->transform,
-					  output->current_scale,
-					  region, region);
+		weston_output_transformed_region(output, region, region);
 	}
 }
 
@@ -332,6 +449,7 @@ composite_clipped(pixman_image_t *src,
  */
 static void
 repaint_region(struct weston_view *ev, struct weston_output *output,
+	       pixman_image_t *target_image,
 	       pixman_region32_t *repaint_output,
 	       pixman_region32_t *source_clip,
 	       pixman_op_t pixman_op)
@@ -340,27 +458,22 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 		(struct pixman_renderer *) output->compositor->renderer;
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
 	struct pixman_output_state *po = get_output_state(output);
-	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
-	pixman_image_t *target_image;
+	bool threaded = output_repaints_on_thread(output) || po->n_bands > 0;
+	pixman_image_t *source_image;
 	pixman_transform_t transform;
 	pixman_filter_t filter;
 	pixman_image_t *mask_image;
 	pixman_color_t mask = { 0, };
 
-	if (po->shadow_image)
-		target_image = po->shadow_image;
-	else
-		target_image = po->hw_buffer;
-
  	/* Clip rendering to the damaged output region */
 	pixman_image_set_clip_region32(target_image, repaint_output);
 
 	pixman_renderer_compute_transform(&transform, ev, output);
 
-	if (ev->transform.enabled || output->current_scale != vp->buffer.scale)
-		filter = PIXMAN_FILTER_BILINEAR;
-	else
+	if (weston_view_matches_output_scale(ev, output))
 		filter = PIXMAN_FILTER_NEAREST;
+	else
+		filter = PIXMAN_FILTER_BILINEAR;
 
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_begin_access(ps->buffer_ref.buffer->shm_buffer);
@@ -372,22 +485,35 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 		mask_image = NULL;
 	}
 
+	source_image = source_image_get(ps, threaded);
+
 	if (source_clip)
-		composite_clipped(ps->image, mask_image, target_image,
+		composite_clipped(source_image, mask_image, target_image,
 				  &transform, filter, source_clip);
 	else
-		composite_whole(pixman_op, ps->image, mask_image,
+		composite_whole(pixman_op, source_image, mask_image,
 				target_image, &transform, filter);
 
+	pixman_image_unref(source_image);
+
 	if (mask_image)
 		pixman_image_unref(mask_image);
 
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_end_access(ps->buffer_ref.buffer->shm_buffer);
 
-	if (pr->repaint_debug)
+	if (pr->repaint_debug) {
+		pixman_image_t *debug_image;
+
+		/* Pixman validates images lazily, even when only reading */
+		if (threaded)
+			debug_image =
+				pixman_image_create_solid_fill(&repaint_debug_color);
+		else
+			debug_image = pixman_image_ref(pr->debug_color);
+
 		pixman_image_composite32(PIXMAN_OP_OVER,
-					 pr->debug_color, /* src */
+					 debug_image, /* src */
 					 NULL /* mask */,
 					 target_image, /* dest */
 					 0, 0, /* src_x, src_y */
@@ -396,11 +522,15 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 					 pixman_image_get_width (target_image), /* width */
 					 pixman_image_get_height (target_image) /* height */);
 
+		pixman_image_unref(debug_image);
+	}
+
 	pixman_image_set_clip_region32(target_image, NULL);
 }
 
 static void
 draw_view_translated(struct weston_view *view, struct weston_output *output,
+		     pixman_image_t *target_image,
 		     pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -428,8 +558,8 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 							  view);
 			region_global_to_output(output, &repaint_output);
 
-			repaint_region(view, output, &repaint_output, NULL,
-				       PIXMAN_OP_SRC);
+			repaint_region(view, output, target_image,
+				       &repaint_output, NULL, PIXMAN_OP_SRC);
 		}
 	}
 
@@ -439,8 +569,8 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 						  &surface_blend, view);
 		region_global_to_output(output, &repaint_output);
 
-		repaint_region(view, output, &repaint_output, NULL,
-			       PIXMAN_OP_OVER);
+		repaint_region(view, output, target_image,
+			       &repaint_output, NULL, PIXMAN_OP_OVER);
 	}
 
 	pixman_region32_fini(&surface_blend);
@@ -450,6 +580,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 static void
 draw_view_source_clipped(struct weston_view *view,
 			 struct weston_output *output,
+			 pixman_image_t *target_image,
 			 pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -475,16 +606,45 @@ draw_view_source_clipped(struct weston_view *view,
 	pixman_region32_copy(&repaint_output, repaint_global);
 	region_global_to_output(output, &repaint_output);
 
-	repaint_region(view, output, &repaint_output, &buffer_region,
-		       PIXMAN_OP_OVER);
+	repaint_region(view, output, target_image, &repaint_output,
+		       &buffer_region, PIXMAN_OP_OVER);
 
 	pixman_region32_fini(&repaint_output);
 	pixman_region32_fini(&buffer_region);
 	pixman_region32_fini(&surf_region);
 }
 
+/* Opaque solid color views only need their visible damage filled. */
+static bool
+draw_view_solid_fill(struct weston_view *view, struct weston_output *output,
+		     pixman_image_t *target_image, pixman_region32_t *repaint)
+{
+	struct pixman_surface_state *ps = get_surface_state(view->surface);
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	pixman_region32_t region;
+	pixman_box32_t *boxes;
+	int n;
+
+	if (pixman_image_get_data(ps->image) || ps->color.alpha != 0xffff ||
+	    view->alpha < 1.0f || view->geometry.scissor_enabled ||
+	    pr->repaint_debug || output->zoom.active ||
+	    !view_transformation_is_translation(view))
+		return false;
+
+	pixman_region32_init(&region);
+	pixman_region32_copy(&region, repaint);
+	region_global_to_output(output, &region);
+	boxes = pixman_region32_rectangles(&region, &n);
+	pixman_image_fill_boxes(PIXMAN_OP_SRC, target_image, &ps->color,
+				n, boxes);
+	pixman_region32_fini(&region);
+
+	return true;
+}
+
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
+	  pixman_image_t *target_image,
 	  pixman_region32_t *damage) /* in global coordinates */
 {
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
@@ -503,6 +663,9 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	if (!pixman_region32_not_empty(&repaint))
 		goto out;
 
+	if (draw_view_solid_fill(ev, output, target_image, &repaint))
+		goto out;
+
 	if (view_transformation_is_translation(ev)) {
 		/* The simple case: The surface regions opaque, non-opaque,
 		 * etc. are convertible to global coordinate space.
@@ -511,7 +674,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * Also the boundingbox is accurate rather than an
 		 * approximation.
 		 */
-		draw_view_translated(ev, output, &repaint);
+		draw_view_translated(ev, output, target_image, &repaint);
 	} else {
 		/* The complex case: the view transformation does not allow
 		 * converting opaque etc. regions into global coordinate space.
@@ -520,21 +683,24 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * to be used whole. Source clipping does not work with
 		 * PIXMAN_OP_SRC.
 		 */
-		draw_view_source_clipped(ev, output, &repaint);
+		draw_view_source_clipped(ev, output, target_image, &repaint);
 	}
 
 out:
 	pixman_region32_fini(&repaint);
 }
 static void
-repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
+repaint_surfaces(struct weston_output *output, pixman_image_t *target_image,
+		 pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
-	struct weston_view *view;
+	struct weston_view **views = output->view_array.data;
+	size_t i = output->view_array.size / sizeof *views;
 
-	wl_list_for_each_reverse(view, &compositor->view_list, link)
-		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+	/* Back to front, using only the views overlapping this output */
+	while (i-- > 0)
+		if (views[i]->plane == &compositor->primary_plane)
+			draw_view(views[i], output, target_image, damage);
 }
 
 static void
@@ -564,6 +730,213 @@ copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
 	pixman_image_set_clip_region32 (po->hw_buffer, NULL);
 }
 
+/* CPU reads of dmabufs are bracketed for the exporter to flush or
+ * invalidate caches, see DMA_BUF_IOCTL_SYNC. */
+static void
+repaint_surfaces_sync_dmabufs(struct weston_output *output, uint64_t flags)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct weston_view **views = output->view_array.data;
+	size_t n = output->view_array.size / sizeof *views;
+	struct dma_buf_sync sync = { .flags = flags | DMA_BUF_SYNC_READ };
+	struct pixman_surface_state *ps;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (views[i]->plane != &compositor->primary_plane)
+			continue;
+
+		ps = views[i]->surface->renderer_state;
+		if (!ps || !ps->dmabuf_map)
+			continue;
+
+		while (ioctl(ps->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync) < 0 &&
+		       (errno == EINTR || errno == EAGAIN))
+			continue;
+	}
+}
+
+/* Surface states are created on demand and hook into the surface signals,
+ * which is only allowed on the main thread. */
+static void
+repaint_surfaces_prepare(struct weston_output *output)
+{
+	struct weston_view **views = output->view_array.data;
+	size_t n = output->view_array.size / sizeof *views;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		get_surface_state(views[i]->surface);
+}
+
+static pixman_image_t *
+output_target_image(struct pixman_output_state *po)
+{
+	return po->shadow_image ? po->shadow_image : po->hw_buffer;
+}
+
+static void
+draw_band(void *data)
+{
+	struct pixman_repaint_band *band = data;
+
+	repaint_surfaces(band->output, band->target, &band->damage);
+}
+
+/** Split the damage of an output into bands and queue them on the pool
+ *
+ * \return The number of bands queued, 0 if the repaint is not worth
+ * splitting and the caller is to paint it itself.
+ *
+ * Bands are cut along global coordinates, which are target image rows unless
+ * the output is rotated. Each band gets its own image on the target pixels,
+ * since repaint_region() sets the clip region of the target. The bands must
+ * be released with output_finish_bands() once the pool has run.
+ */
+static int
+output_queue_bands(struct weston_output *output, pixman_region32_t *damage)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct pixman_output_state *po = get_output_state(output);
+	pixman_image_t *target = output_target_image(po);
+	pixman_box32_t *ext = pixman_region32_extents(damage);
+	int32_t height = ext->y2 - ext->y1;
+	int n, i;
+
+	if (!ec->tiled_repaint || !ec->repaint_pool)
+		return 0;
+
+	n = weston_worker_pool_get_thread_count(ec->repaint_pool) + 1;
+	n = MIN(n, PIXMAN_REPAINT_MAX_BANDS);
+	n = MIN(n, height / PIXMAN_REPAINT_MIN_BAND_HEIGHT);
+	if (n < 2)
+		return 0;
+
+	repaint_surfaces_prepare(output);
+
+	for (i = 0; i < n; i++) {
+		struct pixman_repaint_band *band = &po->bands[po->n_bands];
+		int32_t y1 = ext->y1 + (int64_t)height * i / n;
+		int32_t y2 = ext->y1 + (int64_t)height * (i + 1) / n;
+
+		pixman_region32_init_rect(&band->damage, ext->x1, y1,
+					  ext->x2 - ext->x1, y2 - y1);
+		pixman_region32_intersect(&band->damage, &band->damage, damage);
+		if (!pixman_region32_not_empty(&band->damage)) {
+			pixman_region32_fini(&band->damage);
+			continue;
+		}
+
+		band->output = output;
+		band->target = pixman_image_create_bits_no_clear(
+				pixman_image_get_format(target),
+				pixman_image_get_width(target),
+				pixman_image_get_height(target),
+				pixman_image_get_data(target),
+				pixman_image_get_stride(target));
+		if (!band->target ||
+		    weston_worker_pool_add(ec->repaint_pool,
+					   draw_band, band) < 0) {
+			/* The bands already queued cannot be taken back, so
+			 * paint this one right away, before the pool runs. */
+			repaint_surfaces(output, band->target ?: target,
+					 &band->damage);
+			if (band->target)
+				pixman_image_unref(band->target);
+			pixman_region32_fini(&band->damage);
+			continue;
+		}
+
+		po->n_bands++;
+	}
+
+	return po->n_bands;
+}
+
+static void
+output_finish_bands(struct weston_output *output)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	int i;
+
+	for (i = 0; i < po->n_bands; i++) {
+		pixman_image_unref(po->bands[i].target);
+		pixman_region32_fini(&po->bands[i].damage);
+	}
+	po->n_bands = 0;
+}
+
+static void
+draw_output(struct weston_output *output, pixman_region32_t *output_damage,
+	    pixman_region32_t *hw_damage)
+{
+	struct pixman_output_state *po = get_output_state(output);
+
+	if (po->shadow_image) {
+		repaint_surfaces(output, po->shadow_image, output_damage);
+		copy_to_hw_buffer(output, hw_damage);
+	} else {
+		repaint_surfaces(output, po->hw_buffer, hw_damage);
+	}
+}
+
+/* Like draw_output(), with the bands painted on the repaint threads */
+static void
+draw_output_tiled(struct weston_output *output,
+		  pixman_region32_t *output_damage,
+		  pixman_region32_t *hw_damage)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	pixman_region32_t *damage;
+
+	damage = po->shadow_image ? output_damage : hw_damage;
+	if (!output_queue_bands(output, damage)) {
+		draw_output(output, output_damage, hw_damage);
+		return;
+	}
+
+	weston_worker_pool_run(output->compositor->repaint_pool);
+	output_finish_bands(output);
+
+	if (po->shadow_image)
+		copy_to_hw_buffer(output, hw_damage);
+}
+
+static void
+draw_deferred_repaint(void *data)
+{
+	struct pixman_deferred_repaint *job = data;
+
+	draw_output(job->output, &job->output_damage, &job->hw_damage);
+}
+
+static void
+defer_repaint(struct weston_output *output, pixman_region32_t *output_damage,
+	      pixman_region32_t *hw_damage)
+{
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct pixman_deferred_repaint *job;
+
+	repaint_surfaces_sync_dmabufs(output, DMA_BUF_SYNC_START);
+
+	job = zalloc(sizeof *job);
+	if (!job) {
+		draw_output_tiled(output, output_damage, hw_damage);
+		repaint_surfaces_sync_dmabufs(output, DMA_BUF_SYNC_END);
+		wl_signal_emit(&output->frame_signal, output_damage);
+		return;
+	}
+
+	repaint_surfaces_prepare(output);
+
+	job->output = output;
+	pixman_region32_init(&job->output_damage);
+	pixman_region32_copy(&job->output_damage, output_damage);
+	pixman_region32_init(&job->hw_damage);
+	pixman_region32_copy(&job->hw_damage, hw_damage);
+	wl_list_insert(pr->deferred_list.prev, &job->link);
+}
+
 static void
 pixman_renderer_repaint_output(struct weston_output *output,
 			       pixman_region32_t *output_damage)
@@ -576,6 +949,18 @@ pixman_renderer_repaint_output(struct weston_output *output,
  		return;
 	}
 
+	/* The hardware buffers are always complete, both with and without
+	 * a shadow, so the shadow can go at any repaint. A new one starts
+	 * out empty and needs a full repaint. */
+	if (po->shadow_on_readback && po->shadow_image &&
+	    ++po->shadow_idle_frames > PIXMAN_SHADOW_IDLE_FRAMES)
+		output_shadow_destroy(po);
+
+	if (po->shadow_stale) {
+		po->shadow_stale = false;
+		output_damage = &output->region;
+	}
+
 	pixman_region32_init(&hw_damage);
 	if (po->hw_extra_damage) {
 		pixman_region32_union(&hw_damage,
@@ -585,23 +970,130 @@ pixman_renderer_repaint_output(struct weston_output *output,
 		pixman_region32_copy(&hw_damage, output_damage);
 	}
 
-	if (po->shadow_image) {
-		repaint_surfaces(output, output_damage);
-		copy_to_hw_buffer(output, &hw_damage);
+	if (output_repaints_on_thread(output)) {
+		defer_repaint(output, output_damage, &hw_damage);
 	} else {
-		repaint_surfaces(output, &hw_damage);
+		repaint_surfaces_sync_dmabufs(output, DMA_BUF_SYNC_START);
+		draw_output_tiled(output, output_damage, &hw_damage);
+		repaint_surfaces_sync_dmabufs(output, DMA_BUF_SYNC_END);
+		wl_signal_emit(&output->frame_signal, output_damage);
 	}
 	pixman_region32_fini(&hw_damage);
 
-	wl_signal_emit(&output->frame_signal, output_damage);
-
 	/* Actual flip should be done by caller */
 }
 
+static void
+pixman_renderer_repaint_flush(struct weston_compositor *ec)
+{
+	struct pixman_renderer *pr = get_renderer(ec);
+	struct pixman_deferred_repaint *job, *tmp;
+
+	if (wl_list_empty(&pr->deferred_list))
+		return;
+
+	wl_list_for_each(job, &pr->deferred_list, link) {
+		struct pixman_output_state *po = get_output_state(job->output);
+		pixman_region32_t *damage;
+
+		damage = po->shadow_image ? &job->output_damage :
+					    &job->hw_damage;
+		if (output_queue_bands(job->output, damage))
+			continue;
+
+		if (!ec->repaint_pool ||
+		    weston_worker_pool_add(ec->repaint_pool,
+					   draw_deferred_repaint, job) < 0)
+			draw_deferred_repaint(job);
+	}
+
+	if (ec->repaint_pool)
+		weston_worker_pool_run(ec->repaint_pool);
+
+	wl_list_for_each_safe(job, tmp, &pr->deferred_list, link) {
+		struct pixman_output_state *po = get_output_state(job->output);
+
+		if (po->n_bands) {
+			output_finish_bands(job->output);
+			if (po->shadow_image)
+				copy_to_hw_buffer(job->output, &job->hw_damage);
+		}
+
+		repaint_surfaces_sync_dmabufs(job->output, DMA_BUF_SYNC_END);
+		wl_signal_emit(&job->output->frame_signal, &job->output_damage);
+
+		wl_list_remove(&job->link);
+		pixman_region32_fini(&job->output_damage);
+		pixman_region32_fini(&job->hw_damage);
+		free(job);
+	}
+}
+
 static void
 pixman_renderer_flush_damage(struct weston_surface *surface)
 {
-	/* No-op for pixman renderer */
+	struct pixman_surface_state *ps = get_surface_state(surface);
+	struct weston_buffer *buffer = ps->buffer_ref.buffer;
+	pixman_region32_t region;
+
+	/* Without a private copy, the client buffer is used directly */
+	if (!ps->shm_image)
+		return;
+
+	pixman_region32_init(&region);
+	if (ps->copy_needs_full_update)
+		pixman_region32_init_rect(&region, 0, 0,
+					  buffer->width, buffer->height);
+	else
+		weston_surface_to_buffer_region(surface, &surface->damage,
+						&region);
+
+	pixman_image_set_clip_region32(ps->copy_image, &region);
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	pixman_image_composite32(PIXMAN_OP_SRC,
+				 ps->shm_image, /* src */
+				 NULL, /* mask */
+				 ps->copy_image, /* dest */
+				 0, 0, /* src_x, src_y */
+				 0, 0, /* mask_x, mask_y */
+				 0, 0, /* dest_x, dest_y */
+				 buffer->width, buffer->height);
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+	pixman_image_set_clip_region32(ps->copy_image, NULL);
+	pixman_region32_fini(&region);
+
+	ps->copy_needs_full_update = false;
+	pixman_image_unref(ps->shm_image);
+	ps->shm_image = NULL;
+
+	/* Everything needed is in the copy, let the client have it back */
+	wl_list_remove(&ps->buffer_destroy_listener.link);
+	ps->buffer_destroy_listener.notify = NULL;
+	weston_buffer_reference(&ps->buffer_ref, NULL);
+	weston_buffer_release_reference(&ps->buffer_release_ref, NULL);
+}
+
+static int
+pixman_dmabuf_format_index(uint32_t drm_format)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(pixman_dmabuf_formats); i++)
+		if (pixman_dmabuf_formats[i].drm_format == drm_format)
+			return i;
+
+	return -1;
+}
+
+static void
+pixman_surface_state_unmap_dmabuf(struct pixman_surface_state *ps)
+{
+	if (!ps->dmabuf_map)
+		return;
+
+	munmap(ps->dmabuf_map, ps->dmabuf_map_size);
+	ps->dmabuf_map = NULL;
+	ps->dmabuf_map_size = 0;
 }
 
 static void
@@ -612,18 +1104,103 @@ buffer_state_handle_buffer_destroy(struct wl_listener *listener, void *data)
 	ps = container_of(listener, struct pixman_surface_state,
 			  buffer_destroy_listener);
 
-	if (ps->image) {
+	if (ps->shm_image) {
+		pixman_image_unref(ps->shm_image);
+		ps->shm_image = NULL;
+	}
+
+	/* A copy still holds the previous content, unless it was never
+	 * filled in. */
+	if (ps->image && (!ps->copy_image || ps->copy_needs_full_update)) {
 		pixman_image_unref(ps->image);
 		ps->image = NULL;
 	}
+	pixman_surface_state_unmap_dmabuf(ps);
 
 	ps->buffer_destroy_listener.notify = NULL;
 }
 
+/* Replace the client image by a private copy, to be filled in by
+ * pixman_renderer_flush_damage(). The copy is reused while the buffer size
+ * and format stay the same. */
+static void
+pixman_renderer_attach_copy(struct pixman_surface_state *ps,
+			    pixman_format_code_t format,
+			    int width, int height)
+{
+	if (ps->copy_image &&
+	    (pixman_image_get_format(ps->copy_image) != format ||
+	     pixman_image_get_width(ps->copy_image) != width ||
+	     pixman_image_get_height(ps->copy_image) != height)) {
+		pixman_image_unref(ps->copy_image);
+		ps->copy_image = NULL;
+	}
+
+	if (!ps->copy_image) {
+		ps->copy_image = pixman_image_create_bits(format, width, height,
+							  NULL, 0);
+		/* Out of memory: keep sampling the client buffer */
+		if (!ps->copy_image)
+			return;
+
+		ps->copy_needs_full_update = true;
+	}
+
+	ps->shm_image = ps->image;
+	ps->image = pixman_image_ref(ps->copy_image);
+}
+
+/* The mapping is made at every attach rather than kept with the dmabuf, so
+ * that nothing of this renderer outlives a switch to the GL-renderer. Pages
+ * are only faulted in when the view is composited, not when it is on a
+ * plane. */
+static void
+pixman_renderer_attach_dmabuf(struct weston_surface *es,
+			      struct weston_buffer *buffer,
+			      struct linux_dmabuf_buffer *dmabuf)
+{
+	struct pixman_surface_state *ps = get_surface_state(es);
+	const struct dmabuf_attributes *attr = &dmabuf->attributes;
+	int idx = pixman_dmabuf_format_index(attr->format);
+	size_t size;
+	void *map;
+
+	assert(idx >= 0);
+
+	buffer->width = attr->width;
+	buffer->height = attr->height;
+	es->is_opaque = pixman_dmabuf_formats[idx].opaque;
+
+	size = (size_t)attr->offset[0] + (size_t)attr->stride[0] * attr->height;
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, attr->fd[0], 0);
+	if (map == MAP_FAILED) {
+		weston_log("pixman: failed to map dmabuf: %s\n",
+			   strerror(errno));
+		weston_buffer_reference(&ps->buffer_ref, NULL);
+		weston_buffer_release_reference(&ps->buffer_release_ref, NULL);
+		return;
+	}
+	ps->dmabuf_map = map;
+	ps->dmabuf_map_size = size;
+	ps->dmabuf_fd = attr->fd[0];
+
+	ps->image = pixman_image_create_bits(
+		pixman_dmabuf_formats[idx].pixman_format,
+		buffer->width, buffer->height,
+		(uint32_t *)((uint8_t *)map + attr->offset[0]),
+		attr->stride[0]);
+
+	ps->buffer_destroy_listener.notify =
+		buffer_state_handle_buffer_destroy;
+	wl_signal_add(&buffer->destroy_signal,
+		      &ps->buffer_destroy_listener);
+}
+
 static void
 pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 {
 	struct pixman_surface_state *ps = get_surface_state(es);
+	struct linux_dmabuf_buffer *dmabuf;
 	struct wl_shm_buffer *shm_buffer;
 	pixman_format_code_t pixman_format;
 
@@ -641,13 +1218,32 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 		ps->image = NULL;
 	}
 
-	if (!buffer)
+	if (ps->shm_image) {
+		pixman_image_unref(ps->shm_image);
+		ps->shm_image = NULL;
+	}
+
+	pixman_surface_state_unmap_dmabuf(ps);
+
+	if (!buffer) {
+		if (ps->copy_image) {
+			pixman_image_unref(ps->copy_image);
+			ps->copy_image = NULL;
+		}
+		return;
+	}
+
+	dmabuf = linux_dmabuf_buffer_get(buffer->resource);
+	if (dmabuf) {
+		pixman_renderer_attach_dmabuf(es, buffer, dmabuf);
 		return;
+	}
 
 	shm_buffer = wl_shm_buffer_get(buffer->resource);
 
 	if (! shm_buffer) {
-		weston_log("Pixman renderer supports only SHM buffers\n");
+		weston_log("Pixman renderer supports only SHM and dmabuf "
+			   "buffers\n");
 		weston_buffer_reference(&ps->buffer_ref, NULL);
 		weston_buffer_release_reference(&ps->buffer_release_ref, NULL);
 		return;
@@ -686,6 +1282,10 @@ pixman_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 		wl_shm_buffer_get_data(shm_buffer),
 		wl_shm_buffer_get_stride(shm_buffer));
 
+	if (es->compositor->shm_release_after_upload && ps->image)
+		pixman_renderer_attach_copy(ps, pixman_format,
+					    buffer->width, buffer->height);
+
 	ps->buffer_destroy_listener.notify =
 		buffer_state_handle_buffer_destroy;
 	wl_signal_add(&buffer->destroy_signal,
@@ -708,6 +1308,11 @@ pixman_renderer_surface_state_destroy(struct pixman_surface_state *ps)
 		pixman_image_unref(ps->image);
 		ps->image = NULL;
 	}
+	if (ps->shm_image)
+		pixman_image_unref(ps->shm_image);
+	if (ps->copy_image)
+		pixman_image_unref(ps->copy_image);
+	pixman_surface_state_unmap_dmabuf(ps);
 	weston_buffer_reference(&ps->buffer_ref, NULL);
 	weston_buffer_release_reference(&ps->buffer_release_ref, NULL);
 	free(ps);
@@ -773,6 +1378,7 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 	color.green = green * 0xffff;
 	color.blue = blue * 0xffff;
 	color.alpha = alpha * 0xffff;
+	ps->color = color;
 
 	if (ps->image) {
 		pixman_image_unref(ps->image);
@@ -809,6 +1415,20 @@ pixman_renderer_surface_get_content_size(struct weston_surface *surface,
 	}
 }
 
+/* Only the copies of release-shm-after-upload are renderer memory, other
+ * images wrap the client buffers. */
+static size_t
+pixman_renderer_surface_get_memory(struct weston_surface *surface)
+{
+	struct pixman_surface_state *ps = surface->renderer_state;
+
+	if (!ps || !ps->copy_image)
+		return 0;
+
+	return (size_t)pixman_image_get_stride(ps->copy_image) *
+	       pixman_image_get_height(ps->copy_image);
+}
+
 static int
 pixman_renderer_surface_copy_content(struct weston_surface *surface,
 				     void *target, size_t size,
@@ -841,6 +1461,61 @@ pixman_renderer_surface_copy_content(struct weston_surface *surface,
 	return 0;
 }
 
+/*
+ * Linear single-plane RGB dmabufs are read from a CPU mapping, see
+ * pixman_renderer_attach_dmabuf(). Backends can still put them on planes.
+ */
+static bool
+pixman_renderer_import_dmabuf(struct weston_compositor *ec,
+			      struct linux_dmabuf_buffer *dmabuf)
+{
+	const struct dmabuf_attributes *attr = &dmabuf->attributes;
+
+	if (attr->n_planes != 1 || attr->flags ||
+	    (attr->modifier[0] != DRM_FORMAT_MOD_LINEAR &&
+	     attr->modifier[0] != DRM_FORMAT_MOD_INVALID))
+		return false;
+
+	if (pixman_dmabuf_format_index(attr->format) < 0)
+		return false;
+
+	/* pixman wants 32-bit aligned rows */
+	if (attr->stride[0] % 4 || attr->offset[0] % 4)
+		return false;
+
+	return true;
+}
+
+static void
+pixman_renderer_query_dmabuf_formats(struct weston_compositor *ec,
+				     int **formats, int *num_formats)
+{
+	unsigned int i;
+
+	*num_formats = 0;
+	*formats = calloc(ARRAY_LENGTH(pixman_dmabuf_formats), sizeof(int));
+	if (!*formats)
+		return;
+
+	for (i = 0; i < ARRAY_LENGTH(pixman_dmabuf_formats); i++)
+		(*formats)[i] = pixman_dmabuf_formats[i].drm_format;
+	*num_formats = ARRAY_LENGTH(pixman_dmabuf_formats);
+}
+
+static void
+pixman_renderer_query_dmabuf_modifiers(struct weston_compositor *ec,
+				       int format, uint64_t **modifiers,
+				       int *num_modifiers)
+{
+	*num_modifiers = 0;
+	*modifiers = malloc(sizeof **modifiers);
+	if (!*modifiers)
+		return;
+
+	(*modifiers)[0] = DRM_FORMAT_MOD_LINEAR;
+	*num_modifiers = 1;
+}
+
 static void
 debug_binding(struct weston_keyboard *keyboard, const struct timespec *time,
 	      uint32_t key, void *data)
@@ -851,11 +1526,8 @@ debug_binding(struct weston_keyboard *keyboard, const struct timespec *time,
 	pr->repaint_debug ^= 1;
 
 	if (pr->repaint_debug) {
-		pixman_color_t red = {
-			0x3fff, 0x0000, 0x0000, 0x3fff
-		};
-
-		pr->debug_color = pixman_image_create_solid_fill(&red);
+		pr->debug_color =
+			pixman_image_create_solid_fill(&repaint_debug_color);
 	} else {
 		pixman_image_unref(pr->debug_color);
 		weston_compositor_damage_all(ec);
@@ -883,6 +1555,13 @@ pixman_renderer_init(struct weston_compositor *ec)
 		pixman_renderer_surface_get_content_size;
 	renderer->base.surface_copy_content =
 		pixman_renderer_surface_copy_content;
+	renderer->base.repaint_flush = pixman_renderer_repaint_flush;
+	renderer->base.surface_get_memory = pixman_renderer_surface_get_memory;
+	renderer->base.import_dmabuf = pixman_renderer_import_dmabuf;
+	renderer->base.query_dmabuf_formats =
+		pixman_renderer_query_dmabuf_formats;
+	renderer->base.query_dmabuf_modifiers =
+		pixman_renderer_query_dmabuf_modifiers;
 	ec->renderer = &renderer->base;
 	ec->capabilities |= WESTON_CAP_ROTATION_ANY;
 	ec->capabilities |= WESTON_CAP_VIEW_CLIP_MASK;
@@ -893,11 +1572,49 @@ pixman_renderer_init(struct weston_compositor *ec)
 
 	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_RGB565);
 
+	wl_list_init(&renderer->deferred_list);
 	wl_signal_init(&renderer->destroy_signal);
 
 	return 0;
 }
 
+static int
+output_shadow_create(struct weston_output *output)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	int w = output->current_mode->width;
+	int h = output->current_mode->height;
+
+	po->shadow_buffer = malloc(w * h * 4);
+	if (!po->shadow_buffer)
+		return -1;
+
+	po->shadow_image = pixman_image_create_bits(PIXMAN_x8r8g8b8, w, h,
+						    po->shadow_buffer, w * 4);
+	if (!po->shadow_image) {
+		free(po->shadow_buffer);
+		po->shadow_buffer = NULL;
+		return -1;
+	}
+
+	po->shadow_stale = true;
+	po->shadow_idle_frames = 0;
+
+	return 0;
+}
+
+static void
+output_shadow_destroy(struct pixman_output_state *po)
+{
+	if (po->shadow_image)
+		pixman_image_unref(po->shadow_image);
+	free(po->shadow_buffer);
+
+	po->shadow_image = NULL;
+	po->shadow_buffer = NULL;
+	po->shadow_stale = false;
+}
+
 WL_EXPORT void
 pixman_renderer_output_set_buffer(struct weston_output *output,
 				  pixman_image_t *buffer)
@@ -928,37 +1645,24 @@ pixman_renderer_output_create(struct weston_output *output,
 			      const struct pixman_renderer_output_options *options)
 {
 	struct pixman_output_state *po;
-	int w, h;
 
 	po = zalloc(sizeof *po);
 	if (po == NULL)
 		return -1;
 
-	if (options->use_shadow) {
-		/* set shadow image transformation */
-		w = output->current_mode->width;
-		h = output->current_mode->height;
-
-		po->shadow_buffer = malloc(w * h * 4);
-
-		if (!po->shadow_buffer) {
-			free(po);
-			return -1;
-		}
-
-		po->shadow_image =
-			pixman_image_create_bits(PIXMAN_x8r8g8b8, w, h,
-						 po->shadow_buffer, w * 4);
+	po->threaded_repaint = options->threaded_repaint;
+	po->shadow_on_readback = options->shadow_on_readback;
+	output->renderer_state = po;
 
-		if (!po->shadow_image) {
-			free(po->shadow_buffer);
+	if (options->use_shadow && !options->shadow_on_readback) {
+		if (output_shadow_create(output) < 0) {
+			output->renderer_state = NULL;
 			free(po);
 			return -1;
 		}
+		po->shadow_stale = false;
 	}
 
-	output->renderer_state = po;
-
 	return 0;
 }
 
@@ -967,16 +1671,11 @@ pixman_renderer_output_destroy(struct weston_output *output)
 {
 	struct pixman_output_state *po = get_output_state(output);
 
-	if (po->shadow_image)
-		pixman_image_unref(po->shadow_image);
+	output_shadow_destroy(po);
 
 	if (po->hw_buffer)
 		pixman_image_unref(po->hw_buffer);
 
-	free(po->shadow_buffer);
-
-	po->shadow_buffer = NULL;
-	po->shadow_image = NULL;
 	po->hw_buffer = NULL;
 
 	free(po);
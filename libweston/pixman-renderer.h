@@ -35,6 +35,17 @@ pixman_renderer_init(struct weston_compositor *ec);
 struct pixman_renderer_output_options {
 	/** Composite into a shadow buffer, copying to the hardware buffer */
 	bool use_shadow;
+	/** Instead of use_shadow, composite straight into the hardware
+	 *  buffer and only keep a shadow buffer while the output is being
+	 *  read back, so that reads do not hit uncached memory. The backend
+	 *  must keep the hardware buffers up to date with
+	 *  pixman_renderer_output_set_hw_extra_damage(). */
+	bool shadow_on_readback;
+	/** Allow rendering on the compositor repaint threads. The backend
+	 *  must leave the hardware buffer alone until its repaint_flush, and
+	 *  cope with the frame signal being emitted after repaint_output
+	 *  returns. */
+	bool threaded_repaint;
 };
 
 int
@@ -399,12 +399,14 @@ gl_renderer_get_egl_config(struct gl_renderer *gr,
 	unsigned pinfo_count;
 	unsigned i;
 	char *what;
+	int ret;
 	EGLint config_attribs[] = {
 		EGL_SURFACE_TYPE,    egl_surface_type,
 		EGL_RED_SIZE,        1,
 		EGL_GREEN_SIZE,      1,
 		EGL_BLUE_SIZE,       1,
 		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+		EGL_DEPTH_SIZE,      gr->front_to_back ? 1 : 0,
 		EGL_NONE
 	};
 
@@ -425,8 +427,15 @@ gl_renderer_get_egl_config(struct gl_renderer *gr,
 				     pinfo, pinfo_count))
 		return gr->egl_config;
 
-	if (egl_choose_config(gr, config_attribs, pinfo, pinfo_count,
-			      &egl_config) < 0) {
+	ret = egl_choose_config(gr, config_attribs, pinfo, pinfo_count,
+				&egl_config);
+	if (ret < 0 && gr->front_to_back) {
+		/* The depth buffer is only an optimization, do without. */
+		config_attribs[ARRAY_LENGTH(config_attribs) - 2] = 0;
+		ret = egl_choose_config(gr, config_attribs, pinfo, pinfo_count,
+					&egl_config);
+	}
+	if (ret < 0) {
 		what = explain_egl_config_criteria(egl_surface_type,
 						   pinfo, pinfo_count);
 		weston_log("No EGLConfig matches %s.\n", what);
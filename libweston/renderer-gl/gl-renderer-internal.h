@@ -26,10 +26,65 @@
 #ifndef GL_RENDERER_INTERNAL_H
 #define GL_RENDERER_INTERNAL_H
 
+#include <stdint.h>
+#include <pthread.h>
+
 #include <GLES2/gl2.h>
 #include <GLES2/gl2ext.h>
 #include "shared/weston-egl-ext.h"  /* for PFN* stuff */
 
+/* Core in GLES 3.0, used through the extension prototypes of gl2ext.h */
+#ifndef GL_PIXEL_PACK_BUFFER
+#define GL_PIXEL_PACK_BUFFER 0x88EB
+#endif
+
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+
+#ifndef GL_STREAM_READ
+#define GL_STREAM_READ 0x88E1
+#endif
+
+#define GL_PBO_RING_SIZE 4
+#define GL_PBO_SEGMENT_SIZE (8 * 1024 * 1024)
+
+/** One buffer of the SHM upload ring
+ *
+ * Uploads are sub-allocated linearly from the buffer currently in use. When
+ * it is full, a fence is inserted and the next buffer of the ring is waited
+ * on before being reused, so the GPU can still be reading from the older
+ * buffers while the CPU fills the new one.
+ */
+struct gl_pbo {
+	GLuint name;
+	GLsizeiptr used;
+	uint8_t *map; /* persistent mapping, NULL without EXT_buffer_storage */
+	GLsync fence;
+};
+
+#define GL_ATLAS_SIZE 1024
+#define GL_ATLAS_MAX_SURFACE_SIZE 128
+#define GL_ATLAS_PADDING 1
+
+/** A texture shared by small SHM surfaces, see texture-atlas.c */
+struct gl_atlas_page {
+	struct wl_list link; /* gl_renderer::atlas_pages */
+	GLuint texture;
+	int cell_size; /* including the padding */
+	int cells_per_row;
+	int n_cells;
+	int n_used;
+	uint32_t used[32]; /* bitmap of the cells in use */
+};
+
+/** The place of one surface in an atlas page */
+struct gl_atlas_slot {
+	struct gl_atlas_page *page; /* NULL if not in the atlas */
+	int cell;
+	int x, y; /* of the content, in texels */
+};
+
 struct gl_shader {
 	GLuint program;
 	GLuint vertex_shader, fragment_shader;
@@ -37,13 +92,29 @@ struct gl_shader {
 	GLint tex_uniforms[3];
 	GLint alpha_uniform;
 	GLint color_uniform;
+	GLint lut_size_uniform;
 	const char *vertex_source, *fragment_source;
+	/* Compiled with alpha folded to 1.0, and the variant of this shader
+	 * to use for fully opaque views, if any. */
+	bool alpha_is_one;
+	struct gl_shader *opaque_variant;
+
+	/* Last values uploaded to the program, so that unchanged uniforms
+	 * are not sent again for every view. */
+	bool uniforms_valid;
+	GLfloat proj[16];
+	GLfloat color[4];
+	GLfloat alpha;
 };
 
 struct gl_renderer {
 	struct weston_renderer base;
 	bool fragment_shader_debug;
 	bool fan_debug;
+	/* draw opaque regions front to back with a depth test */
+	bool front_to_back;
+	/* draw unchanged subsurface trees from one texture */
+	bool tree_cache;
 	struct weston_binding *fragment_binding;
 	struct weston_binding *fan_binding;
 
@@ -58,6 +129,12 @@ struct gl_renderer {
 
 	struct wl_array vertices;
 	struct wl_array vtxcnt;
+	struct wl_array indices;
+
+	/* Streamed for each draw of repaint_region() */
+	GLuint vertex_buffer;
+	GLuint index_buffer;
+	unsigned int draw_calls; /* in the current output repaint */
 
 	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d;
 	PFNEGLCREATEIMAGEKHRPROC create_image;
@@ -91,8 +168,80 @@ struct gl_renderer {
 	struct wl_list dmabuf_images;
 	struct wl_list dmabuf_formats;
 
+	/* Creates the EGLImages of zwp_linux_buffer_params_v1.create
+	 * requests, started on the first one */
+	struct {
+		bool running;
+		bool quit;
+		pthread_t thread;
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		struct wl_list queued; /* dmabuf_import_job::link */
+		struct wl_list done; /* dmabuf_import_job::link */
+		int notify_fd;
+		struct wl_event_source *notify_source;
+	} import_thread;
+
+	/* EGLImages of wl_drm buffers, kept until the buffer is destroyed */
+	struct wl_list egl_buffer_images;
+
 	bool has_gl_texture_rg;
 
+	/* [core] mipmap-minified-views, with NPOT mipmap support */
+	bool has_mipmaps;
+
+	bool has_pbo_upload;
+	bool has_buffer_storage;
+	struct gl_pbo pbo_ring[GL_PBO_RING_SIZE];
+	unsigned int pbo_current;
+	PFNGLMAPBUFFERRANGEEXTPROC map_buffer_range;
+	PFNGLUNMAPBUFFEROESPROC unmap_buffer;
+	PFNGLBUFFERSTORAGEEXTPROC buffer_storage;
+	PFNGLFENCESYNCAPPLEPROC fence_sync;
+	PFNGLCLIENTWAITSYNCAPPLEPROC client_wait_sync;
+	PFNGLDELETESYNCAPPLEPROC delete_sync;
+
+	bool has_pbo_readback;
+	struct wl_list readback_list; /* gl_readback::link, oldest first */
+	struct wl_event_source *readback_timer;
+
+	bool has_timer_query;
+	struct wl_array free_timer_queries; /* GLuint */
+	PFNGLGENQUERIESEXTPROC gen_queries;
+	PFNGLDELETEQUERIESEXTPROC delete_queries;
+	PFNGLBEGINQUERYEXTPROC begin_query;
+	PFNGLENDQUERYEXTPROC end_query;
+	PFNGLGETQUERYOBJECTUIVEXTPROC get_query_objectuiv;
+	PFNGLGETQUERYOBJECTUI64VEXTPROC get_query_objectui64v;
+
+	/* [core] texture-memory-budget, 0 if unlimited */
+	size_t texture_budget;
+	size_t texture_memory; /* of SHM textures outside the atlas */
+	size_t evicted_memory; /* copies of evicted textures */
+	uint64_t texture_evictions;
+	struct wl_list texture_lru; /* gl_surface_state::texture_link */
+	struct weston_log_scope *texture_scope;
+
+	bool has_atlas;
+	struct wl_list atlas_pages; /* gl_atlas_page::link */
+	/* Fans of consecutive atlas views waiting to be drawn together */
+	struct {
+		struct weston_view *view; /* the first one, for the uniforms */
+		struct gl_shader *shader;
+		GLuint texture;
+		GLint filter;
+		bool blend;
+		struct wl_array vertices;
+		struct wl_array vtxcnt;
+		int nfans;
+	} atlas_batch;
+
+	bool has_shader_cache;
+	char *shader_cache_dir;
+	uint64_t shader_cache_seed; /* hash of the driver identification */
+	PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+	PFNGLPROGRAMBINARYOESPROC program_binary;
+
 	struct gl_shader texture_shader_rgba;
 	struct gl_shader texture_shader_rgbx;
 	struct gl_shader texture_shader_egl_external;
@@ -100,9 +249,16 @@ struct gl_renderer {
 	struct gl_shader texture_shader_y_u_v;
 	struct gl_shader texture_shader_y_xuxv;
 	struct gl_shader texture_shader_xyuv;
+	/* opaque_variant of each texture shader above */
+	struct gl_shader opaque_texture_shaders[7];
 	struct gl_shader invert_color_shader;
 	struct gl_shader solid_shader;
+	/* final pass of color transformed outputs */
+	struct gl_shader color_lut_shader;
 	struct gl_shader *current_shader;
+	/* Compiles the common shaders once start-up has handed off to the
+	 * main loop, rather than in the first repaint */
+	struct wl_event_source *shader_warmup_timer;
 
 	struct wl_signal destroy_signal;
 
@@ -130,6 +286,30 @@ get_renderer(struct weston_compositor *ec)
 void
 gl_renderer_print_egl_error_state(void);
 
+void
+gl_shader_cache_init(struct gl_renderer *gr, const char *extensions);
+
+void
+gl_shader_cache_fini(struct gl_renderer *gr);
+
+bool
+gl_shader_cache_load(struct gl_renderer *gr, GLuint program,
+		     const char *const *sources, int n_sources);
+
+void
+gl_shader_cache_store(struct gl_renderer *gr, GLuint program,
+		      const char *const *sources, int n_sources);
+
+bool
+gl_atlas_alloc(struct gl_renderer *gr, int width, int height,
+	       struct gl_atlas_slot *slot);
+
+void
+gl_atlas_free(struct gl_atlas_slot *slot);
+
+void
+gl_atlas_fini(struct gl_renderer *gr);
+
 void
 gl_renderer_log_extensions(const char *name, const char *extensions);
 
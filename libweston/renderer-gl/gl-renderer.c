@@ -36,13 +36,18 @@
 #include <string.h>
 #include <ctype.h>
 #include <float.h>
+#include <math.h>
 #include <assert.h>
+#include <inttypes.h>
 #include <linux/input.h>
 #include <drm_fourcc.h>
 #include <unistd.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 
 #include "linux-sync-file.h"
 #include "timeline.h"
+#include "weston-trace.h"
 
 #include "gl-renderer.h"
 #include "gl-renderer-internal.h"
@@ -50,6 +55,7 @@
 #include "linux-dmabuf.h"
 #include "linux-dmabuf-unstable-v1-server-protocol.h"
 #include "linux-explicit-synchronization.h"
+#include "libweston-internal.h"
 #include "pixel-formats.h"
 
 #include "shared/fd-util.h"
@@ -64,7 +70,10 @@
 #define GR_GL_VERSION_INVALID \
 	GR_GL_VERSION(0, 0)
 
-#define BUFFER_DAMAGE_COUNT 2
+/* Damage history for buffer ages up to BUFFER_DAMAGE_COUNT + 1. GBM surfaces
+ * have up to four buffers, and virtual outputs whose consumers hold on to
+ * frames do cycle through all of them. */
+#define BUFFER_DAMAGE_COUNT 3
 
 enum gl_border_status {
 	BORDER_STATUS_CLEAN = 0,
@@ -88,15 +97,50 @@ struct gl_output_state {
 	pixman_region32_t buffer_damage[BUFFER_DAMAGE_COUNT];
 	int buffer_damage_index;
 	enum gl_border_status border_damage[BUFFER_DAMAGE_COUNT];
+	/* A pbuffer: a single buffer that keeps its contents between frames,
+	 * so after the first frame only what changed needs repainting, buffer
+	 * age extension or not. */
+	bool preserves_contents;
+	bool contents_valid;
 	struct gl_border_image borders[4];
 	enum gl_border_status border_status;
 
 	struct weston_matrix output_matrix;
 
+	/* depth buffer size of the EGL surface, -1 until queried */
+	GLint depth_bits;
+	/* depth testing is in use for the current repaint */
+	bool depth_test;
+	/* clip space depth of the view being drawn */
+	GLfloat view_depth;
+
+	/* Color transform applied in a final pass: the views are composited
+	 * into lut_fbo, which is then drawn through the 3D LUT lut_tex. The
+	 * LUT is kept in texture layout until uploaded by the next repaint. */
+	uint8_t *lut;
+	unsigned int lut_size;
+	bool lut_dirty;
+	GLuint lut_tex;
+	GLuint lut_fbo, lut_fbo_tex;
+	int32_t lut_fbo_width, lut_fbo_height;
+	/* the content of lut_fbo is undefined and must be fully redrawn */
+	bool lut_fbo_fresh;
+	/* repaint_views() draws into lut_fbo, which has no depth buffer */
+	bool in_lut_fbo;
+	/* views are drawn into a gl_tree_cache, not in output coordinates */
+	bool in_tree_capture;
+
+	/* size drawn at, see weston_output_get_render_size() */
+	int32_t render_width, render_height;
+
 	EGLSyncKHR begin_render_sync, end_render_sync;
 
 	/* struct timeline_render_point::link */
 	struct wl_list timeline_render_point_list;
+
+	/* struct timeline_view_timer::link, oldest first */
+	struct wl_list view_timer_list;
+	unsigned int n_view_timers;
 };
 
 enum buffer_type {
@@ -131,6 +175,25 @@ struct dmabuf_image {
 	struct gl_shader *shader;
 };
 
+/* The images of a wl_drm buffer, found through the listener on the
+ * destroy signal of its weston_buffer. Clients cycle through a few
+ * buffers, so each attach after the first finds its images here. */
+struct egl_buffer_images {
+	struct wl_listener destroy_listener;
+	struct wl_list link; /* gl_renderer::egl_buffer_images */
+	int num_images;
+	struct egl_image *images[3];
+};
+
+/* A dmabuf waiting for, or done with, its EGLImage from the import
+ * thread. Only egl_image is written by the thread. */
+struct dmabuf_import_job {
+	struct linux_dmabuf_buffer *dmabuf;
+	weston_dmabuf_import_done_func_t done;
+	struct egl_image *egl_image;
+	struct wl_list link; /* gl_renderer::import_thread */
+};
+
 struct dmabuf_format {
 	uint32_t format;
 	struct wl_list link;
@@ -162,6 +225,55 @@ struct yuv_format_descriptor {
 	struct yuv_plane_descriptor plane[4];
 };
 
+#define GEOMETRY_CACHE_SIZE 4
+#define GEOMETRY_CACHE_MAX_VERTICES 16384
+
+/** Vertices computed by texture_region() for one view and pair of regions
+ *
+ * The vertices only depend on the view transform, the surface-to-buffer
+ * mapping, the texture size and the two regions, so they can be reused as
+ * long as none of those change, whatever happens to the pixels.
+ */
+struct gl_geometry_cache_entry {
+	bool valid;
+	uint32_t last_used;
+
+	/* Key; view is only compared, never dereferenced */
+	struct weston_view *view;
+	uint32_t transform_serial;
+	GLfloat surface_to_buffer[16];
+	int pitch;
+	int height;
+	bool y_inverted;
+	pixman_region32_t region; /* global */
+	pixman_region32_t surf_region; /* surface-local */
+
+	struct wl_array vertices;
+	struct wl_array vtxcnt;
+	int nfans;
+};
+
+/*
+ * With cache-surface-trees, a view with subsurfaces is drawn from a single
+ * texture of the whole tree while none of its surfaces changes, like when it
+ * is moved or animated. The texture is captured from an untransformed tree
+ * once its content has stayed the same for GL_TREE_CACHE_STABLE_FRAMES
+ * repaints, and belongs to the root surface.
+ */
+#define GL_TREE_CACHE_STABLE_FRAMES 2
+#define GL_TREE_CACHE_MAX_SIZE 4096
+
+struct gl_tree_cache {
+	GLuint fbo;
+	GLuint tex;
+	int tex_width, tex_height; /* in pixels */
+	/* the cached rectangle, in surface coordinates of the root */
+	float x, y, width, height;
+	uint64_t signature; /* of the tree content, see view_tree_scan() */
+	unsigned int stable_frames;
+	bool valid;
+};
+
 struct gl_surface_state {
 	GLfloat color[4];
 	struct gl_shader *shader;
@@ -200,10 +312,47 @@ struct gl_surface_state {
 	   Used only in the context of a gl_renderer_repaint_output call. */
 	bool used_in_output_repaint;
 
+	struct gl_geometry_cache_entry geometry_cache[GEOMETRY_CACHE_SIZE];
+	uint32_t geometry_cache_clock;
+
+	/* The textures have mipmaps matching their current content */
+	bool mipmaps_valid;
+	/* The driver cannot generate mipmaps for this format */
+	bool mipmaps_failed;
+
+	/* Bumped on any content change, for gl_tree_cache */
+	uint32_t content_serial;
+	struct gl_tree_cache *tree_cache;
+
+	/* Small single plane SHM surfaces live in a shared texture, then
+	 * textures[0] is the atlas page texture and not owned. */
+	struct gl_atlas_slot atlas_slot;
+
+	/* Accounting of SHM texture memory, see gl_renderer_evict_textures() */
+	struct wl_list texture_link; /* gl_renderer::texture_lru */
+	size_t texture_size;
+	bool evicted;
+	void *evicted_pixels; /* RGBA, NULL if uploaded again from the buffer */
+
 	struct wl_listener surface_destroy_listener;
 	struct wl_listener renderer_destroy_listener;
 };
 
+#define READBACK_POLL_MS 1
+#define READBACK_FINISH_TIMEOUT_NS 1000000000ull
+
+/** An asynchronous read of output pixels into a pixel pack buffer */
+struct gl_readback {
+	struct wl_list link; /* gl_renderer::readback_list */
+	struct weston_output *output;
+	GLuint pbo;
+	GLsync fence;
+	GLsizeiptr size;
+	void *pixels;
+	weston_read_pixels_done_func_t done;
+	void *data;
+};
+
 enum timeline_render_point_type {
 	TIMELINE_RENDER_POINT_TYPE_BEGIN,
 	TIMELINE_RENDER_POINT_TYPE_END
@@ -216,6 +365,23 @@ struct timeline_render_point {
 	int fd;
 	struct weston_output *output;
 	struct wl_event_source *event_source;
+
+	/* The other point of the same frame, until either is processed */
+	struct timeline_render_point *pair;
+	/* For the end point, set when the begin point was processed first */
+	struct timespec begin;
+	bool has_begin;
+};
+
+/* Bounds the queries in flight if the results are late */
+#define TIMELINE_VIEW_TIMERS_MAX 256
+
+/** A GPU timer query around the drawing of one view */
+struct timeline_view_timer {
+	struct wl_list link; /* gl_output_state::view_timer_list */
+	struct weston_surface *surface; /* NULL once destroyed */
+	struct wl_listener surface_destroy_listener;
+	GLuint query;
 };
 
 static inline const char *
@@ -249,12 +415,40 @@ get_surface_state(struct weston_surface *surface)
 static void
 timeline_render_point_destroy(struct timeline_render_point *trp)
 {
+	if (trp->pair)
+		trp->pair->pair = NULL;
 	wl_list_remove(&trp->link);
 	wl_event_source_remove(trp->event_source);
 	close(trp->fd);
 	free(trp);
 }
 
+/* Both sync files of a frame may become readable in the same dispatch, in
+ * any order. The end point reports the GPU time of the frame. */
+static void
+timeline_render_point_account(struct timeline_render_point *trp,
+			      const struct timespec *tspec)
+{
+	struct timespec begin;
+
+	if (trp->type == TIMELINE_RENDER_POINT_TYPE_BEGIN) {
+		if (trp->pair) {
+			trp->pair->begin = *tspec;
+			trp->pair->has_begin = true;
+		}
+		return;
+	}
+
+	if (trp->pair &&
+	    weston_linux_sync_file_read_timestamp(trp->pair->fd, &begin) == 0)
+		weston_output_frame_stats_gpu(trp->output,
+					      timespec_sub_to_nsec(tspec, &begin));
+	else if (trp->has_begin)
+		weston_output_frame_stats_gpu(trp->output,
+					      timespec_sub_to_nsec(tspec,
+								   &trp->begin));
+}
+
 static int
 timeline_render_point_handler(int fd, uint32_t mask, void *data)
 {
@@ -269,6 +463,7 @@ timeline_render_point_handler(int fd, uint32_t mask, void *data)
 							  &tspec) == 0) {
 			TL_POINT(trp->output->compositor, tp_name, TLP_GPU(&tspec),
 				 TLP_OUTPUT(trp->output), TLP_END);
+			timeline_render_point_account(trp, &tspec);
 		}
 	}
 
@@ -277,6 +472,119 @@ timeline_render_point_handler(int fd, uint32_t mask, void *data)
 	return 0;
 }
 
+static void
+timeline_view_timer_destroy(struct gl_renderer *gr,
+			    struct gl_output_state *go,
+			    struct timeline_view_timer *timer)
+{
+	GLuint *query;
+
+	/* Query names are recycled, and only deleted with the renderer. */
+	query = wl_array_add(&gr->free_timer_queries, sizeof *query);
+	if (query)
+		*query = timer->query;
+	else
+		gr->delete_queries(1, &timer->query);
+
+	wl_list_remove(&timer->surface_destroy_listener.link);
+	wl_list_remove(&timer->link);
+	go->n_view_timers--;
+	free(timer);
+}
+
+static void
+timeline_view_timer_handle_surface_destroy(struct wl_listener *listener,
+					   void *data)
+{
+	struct timeline_view_timer *timer =
+		container_of(listener, struct timeline_view_timer,
+			     surface_destroy_listener);
+
+	timer->surface = NULL;
+	wl_list_remove(&timer->surface_destroy_listener.link);
+	wl_list_init(&timer->surface_destroy_listener.link);
+}
+
+/* Start timing the GPU work of a view, NULL if not possible */
+static struct timeline_view_timer *
+timeline_view_timer_begin(struct gl_renderer *gr,
+			  struct weston_output *output,
+			  struct weston_surface *surface)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct timeline_view_timer *timer;
+	GLuint *free_queries = gr->free_timer_queries.data;
+	size_t n_free = gr->free_timer_queries.size / sizeof *free_queries;
+
+	if (go->n_view_timers >= TIMELINE_VIEW_TIMERS_MAX)
+		return NULL;
+
+	timer = zalloc(sizeof *timer);
+	if (!timer)
+		return NULL;
+
+	if (n_free > 0) {
+		timer->query = free_queries[n_free - 1];
+		gr->free_timer_queries.size -= sizeof *free_queries;
+	} else {
+		gr->gen_queries(1, &timer->query);
+	}
+
+	timer->surface = surface;
+	timer->surface_destroy_listener.notify =
+		timeline_view_timer_handle_surface_destroy;
+	wl_signal_add(&surface->destroy_signal,
+		      &timer->surface_destroy_listener);
+	wl_list_insert(go->view_timer_list.prev, &timer->link);
+	go->n_view_timers++;
+
+	gr->begin_query(GL_TIME_ELAPSED_EXT, timer->query);
+
+	return timer;
+}
+
+/* Report the views timed in previous repaints whose results arrived.
+ * Queries complete in order, so stop at the first pending one. */
+static void
+timeline_view_timers_poll(struct gl_renderer *gr, struct weston_output *output)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct weston_compositor *ec = output->compositor;
+	struct timeline_view_timer *timer, *tmp;
+	GLint disjoint = 0;
+	GLuint available;
+	GLuint64 elapsed;
+	uint64_t ns;
+
+	if (wl_list_empty(&go->view_timer_list))
+		return;
+
+	/* Reading the flag resets it. A disjoint operation such as a
+	 * frequency change makes the results in flight meaningless. */
+	glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+
+	wl_list_for_each_safe(timer, tmp, &go->view_timer_list, link) {
+		available = GL_FALSE;
+		gr->get_query_objectuiv(timer->query,
+					GL_QUERY_RESULT_AVAILABLE_EXT,
+					&available);
+		if (!available)
+			break;
+
+		gr->get_query_objectui64v(timer->query, GL_QUERY_RESULT_EXT,
+					  &elapsed);
+		ns = elapsed;
+
+		/* Views that ended up drawing nothing measure 0 */
+		if (!disjoint && timer->surface && ns > 0)
+			TL_POINT(ec, "renderer_gpu_view", TLP_OUTPUT(output),
+				 TLP_SURFACE(timer->surface),
+				 TLP_GPU_DURATION(&ns), TLP_END);
+
+		timeline_view_timer_destroy(gr, go, timer);
+	}
+}
+
 static EGLSyncKHR
 create_render_sync(struct gl_renderer *gr)
 {
@@ -289,7 +597,9 @@ create_render_sync(struct gl_renderer *gr)
 			       attribs);
 }
 
-static void
+/* The render points feed both the timeline and the GPU time of the
+ * 'frame-stats' scope, which is always collected. */
+static struct timeline_render_point *
 timeline_submit_render_sync(struct gl_renderer *gr,
 			    struct weston_compositor *ec,
 			    struct weston_output *output,
@@ -301,22 +611,21 @@ timeline_submit_render_sync(struct gl_renderer *gr,
 	int fd;
 	struct timeline_render_point *trp;
 
-	if (!weston_log_scope_is_enabled(ec->timeline) ||
-	    !gr->has_native_fence_sync ||
+	if (!gr->has_native_fence_sync ||
 	    sync == EGL_NO_SYNC_KHR)
-		return;
+		return NULL;
 
 	go = get_output_state(output);
 	loop = wl_display_get_event_loop(ec->wl_display);
 
 	fd = gr->dup_native_fence_fd(gr->egl_display, sync);
 	if (fd == EGL_NO_NATIVE_FENCE_FD_ANDROID)
-		return;
+		return NULL;
 
 	trp = zalloc(sizeof *trp);
 	if (trp == NULL) {
 		close(fd);
-		return;
+		return NULL;
 	}
 
 	trp->type = type;
@@ -328,6 +637,8 @@ timeline_submit_render_sync(struct gl_renderer *gr,
 						 trp);
 
 	wl_list_insert(&go->timeline_render_point_list, &trp->link);
+
+	return trp;
 }
 
 static struct egl_image*
@@ -401,60 +712,92 @@ dmabuf_image_destroy(struct dmabuf_image *image)
 	free(image);
 }
 
-#define max(a, b) (((a) > (b)) ? (a) : (b))
-#define min(a, b) (((a) > (b)) ? (b) : (a))
+static void
+egl_buffer_images_destroy(struct egl_buffer_images *cache)
+{
+	int i;
+
+	for (i = 0; i < cache->num_images; i++)
+		egl_image_unref(cache->images[i]);
+
+	wl_list_remove(&cache->destroy_listener.link);
+	wl_list_remove(&cache->link);
+	free(cache);
+}
+
+static void
+egl_buffer_images_buffer_destroyed(struct wl_listener *listener, void *data)
+{
+	struct egl_buffer_images *cache =
+		container_of(listener, struct egl_buffer_images,
+			     destroy_listener);
+
+	egl_buffer_images_destroy(cache);
+}
+
+static struct egl_buffer_images *
+egl_buffer_images_get(struct weston_buffer *buffer)
+{
+	struct wl_listener *listener;
+
+	listener = wl_signal_get(&buffer->destroy_signal,
+				 egl_buffer_images_buffer_destroyed);
+	if (!listener)
+		return NULL;
+
+	return container_of(listener, struct egl_buffer_images,
+			    destroy_listener);
+}
+
+/* Transform a surface rectangle to screen space */
+static void
+transform_surface_rect(struct weston_view *ev, pixman_box32_t *surf_rect,
+		       struct polygon8 *surf)
+{
+	int i;
+
+	surf->x[0] = surf_rect->x1; surf->y[0] = surf_rect->y1;
+	surf->x[1] = surf_rect->x2; surf->y[1] = surf_rect->y1;
+	surf->x[2] = surf_rect->x2; surf->y[2] = surf_rect->y2;
+	surf->x[3] = surf_rect->x1; surf->y[3] = surf_rect->y2;
+	surf->n = 4;
+
+	for (i = 0; i < surf->n; i++)
+		weston_view_to_global_float(ev, surf->x[i], surf->y[i],
+					    &surf->x[i], &surf->y[i]);
+}
 
 /*
  * Compute the boundary vertices of the intersection of the global coordinate
  * aligned rectangle 'rect', and an arbitrary quadrilateral produced from
- * 'surf_rect' when transformed from surface coordinates into global coordinates.
- * The vertices are written to 'ex' and 'ey', and the return value is the
+ * 'surf_rect' when transformed from surface coordinates into global coordinates,
+ * given as 'transformed', and the clip_classify_boxes() result 'class' for the
+ * pair. The vertices are written to 'ex' and 'ey', and the return value is the
  * number of vertices. Vertices are produced in clockwise winding order.
  * Guarantees to produce either zero vertices, or 3-8 vertices with non-zero
  * polygon area.
  */
 static int
 calculate_edges(struct weston_view *ev, pixman_box32_t *rect,
-		pixman_box32_t *surf_rect, GLfloat *ex, GLfloat *ey)
+		const struct polygon8 *transformed, uint8_t class,
+		GLfloat *ex, GLfloat *ey)
 {
 
 	struct clip_context ctx;
-	int i, n;
-	GLfloat min_x, max_x, min_y, max_y;
-	struct polygon8 surf = {
-		{ surf_rect->x1, surf_rect->x2, surf_rect->x2, surf_rect->x1 },
-		{ surf_rect->y1, surf_rect->y1, surf_rect->y2, surf_rect->y2 },
-		4
-	};
+	struct polygon8 surf = *transformed;
+	int n;
+
+	/* The bounding box of the transformed surface rect does not
+	 * intersect with the clip region, as found by
+	 * clip_classify_boxes(). */
+	if (class == CLIP_BOX_OUTSIDE)
+		return 0;
 
 	ctx.clip.x1 = rect->x1;
 	ctx.clip.y1 = rect->y1;
 	ctx.clip.x2 = rect->x2;
 	ctx.clip.y2 = rect->y2;
 
-	/* transform surface to screen space: */
-	for (i = 0; i < surf.n; i++)
-		weston_view_to_global_float(ev, surf.x[i], surf.y[i],
-					    &surf.x[i], &surf.y[i]);
-
-	/* find bounding box: */
-	min_x = max_x = surf.x[0];
-	min_y = max_y = surf.y[0];
-
-	for (i = 1; i < surf.n; i++) {
-		min_x = min(min_x, surf.x[i]);
-		max_x = max(max_x, surf.x[i]);
-		min_y = min(min_y, surf.y[i]);
-		max_y = max(max_y, surf.y[i]);
-	}
-
-	/* First, simple bounding box check to discard early transformed
-	 * surface rects that do not intersect with the clip region:
-	 */
-	if ((min_x >= ctx.clip.x2) || (max_x <= ctx.clip.x1) ||
-	    (min_y >= ctx.clip.y2) || (max_y <= ctx.clip.y1))
-		return 0;
-
 	/* Simple case, bounding box edges are parallel to surface edges,
 	 * there will be only four edges.  We just need to clip the surface
 	 * vertices to the clip rect bounds:
@@ -467,8 +810,19 @@ calculate_edges(struct weston_view *ev, pixman_box32_t *rect,
 	 * The algorithm is Sutherland-Hodgman, as explained in
 	 * http://www.codeguru.com/cpp/misc/misc/graphics/article.php/c8965/Polygon-Clipping.htm
 	 * but without looking at any of that code.
+	 *
+	 * It needs no intersections for a surface entirely inside of
+	 * 'rect', nor for one only translated and scaled, which stays a
+	 * rectangle parallel to the axes. Both give the same vertices.
 	 */
-	n = clip_transformed(&ctx, &surf, ex, ey);
+	if (class == CLIP_BOX_INSIDE)
+		n = clip_inside(&surf, ex, ey);
+	else if (!(ev->transform.matrix.type &
+		   (WESTON_MATRIX_TRANSFORM_ROTATE |
+		    WESTON_MATRIX_TRANSFORM_OTHER)))
+		n = clip_axis_aligned(&ctx, &surf, ex, ey);
+	else
+		n = clip_transformed(&ctx, &surf, ex, ey);
 
 	if (n < 3)
 		return 0;
@@ -476,55 +830,6 @@ calculate_edges(struct weston_view *ev, pixman_box32_t *rect,
 	return n;
 }
 
-static bool
-merge_down(pixman_box32_t *a, pixman_box32_t *b, pixman_box32_t *merge)
-{
-	if (a->x1 == b->x1 && a->x2 == b->x2 && a->y1 == b->y2) {
-		merge->x1 = a->x1;
-		merge->x2 = a->x2;
-		merge->y1 = b->y1;
-		merge->y2 = a->y2;
-		return true;
-	}
-	return false;
-}
-
-static int
-compress_bands(pixman_box32_t *inrects, int nrects,
-		   pixman_box32_t **outrects)
-{
-	bool merged = false;
-	pixman_box32_t *out, merge_rect;
-	int i, j, nout;
-
-	if (!nrects) {
-		*outrects = NULL;
-		return 0;
-	}
-
-	/* nrects is an upper bound - we're not too worried about
-	 * allocating a little extra
-	 */
-	out = malloc(sizeof(pixman_box32_t) * nrects);
-	out[0] = inrects[0];
-	nout = 1;
-	for (i = 1; i < nrects; i++) {
-		for (j = 0; j < nout; j++) {
-			merged = merge_down(&inrects[i], &out[j], &merge_rect);
-			if (merged) {
-				out[j] = merge_rect;
-				break;
-			}
-		}
-		if (!merged) {
-			out[nout] = inrects[i];
-			nout++;
-		}
-	}
-	*outrects = out;
-	return nout;
-}
-
 static int
 texture_region(struct weston_view *ev, pixman_region32_t *region,
 		pixman_region32_t *surf_region)
@@ -532,10 +837,12 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 	struct gl_surface_state *gs = get_surface_state(ev->surface);
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
-	GLfloat *v, inv_width, inv_height;
+	GLfloat *v, inv_width, inv_height, tex_x, tex_y;
 	unsigned int *vtxcnt, nvtx = 0;
 	pixman_box32_t *rects, *surf_rects;
 	pixman_box32_t *raw_rects;
+	struct polygon8 *transformed;
+	uint8_t *classes;
 	int i, j, k, nrects, nsurf, raw_nrects;
 	bool used_band_compression;
 	raw_rects = pixman_region32_rectangles(region, &raw_nrects);
@@ -555,13 +862,40 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 	v = wl_array_add(&gr->vertices, nrects * nsurf * 8 * 4 * sizeof *v);
 	vtxcnt = wl_array_add(&gr->vtxcnt, nrects * nsurf * sizeof *vtxcnt);
 
-	inv_width = 1.0 / gs->pitch;
-        inv_height = 1.0 / gs->height;
+	/* Each surface rect is transformed once, and checked against all
+	 * clip rects at once, before the per pair work below. */
+	transformed = malloc(nsurf * sizeof *transformed);
+	classes = malloc(nsurf * nrects * sizeof *classes);
+	if ((nsurf && !transformed) || (nsurf * nrects && !classes)) {
+		free(transformed);
+		free(classes);
+		if (used_band_compression)
+			free(rects);
+		return 0;
+	}
+
+	for (j = 0; j < nsurf; j++) {
+		transform_surface_rect(ev, &surf_rects[j], &transformed[j]);
+		clip_classify_boxes(&transformed[j], rects, nrects,
+				    &classes[j * nrects]);
+	}
+
+	if (gs->atlas_slot.page) {
+		/* texcoords inside the shared atlas texture */
+		tex_x = gs->atlas_slot.x;
+		tex_y = gs->atlas_slot.y;
+		inv_width = 1.0 / GL_ATLAS_SIZE;
+		inv_height = 1.0 / GL_ATLAS_SIZE;
+	} else {
+		tex_x = 0;
+		tex_y = 0;
+		inv_width = 1.0 / gs->pitch;
+		inv_height = 1.0 / gs->height;
+	}
 
 	for (i = 0; i < nrects; i++) {
 		pixman_box32_t *rect = &rects[i];
 		for (j = 0; j < nsurf; j++) {
-			pixman_box32_t *surf_rect = &surf_rects[j];
 			GLfloat sx, sy, bx, by;
 			GLfloat ex[8], ey[8];          /* edge points in screen space */
 			int n;
@@ -580,7 +914,8 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 			 * form the intersection of the clip rect and the transformed
 			 * surface.
 			 */
-			n = calculate_edges(ev, rect, surf_rect, ex, ey);
+			n = calculate_edges(ev, rect, &transformed[j],
+					    classes[j * nrects + i], ex, ey);
 			if (n < 3)
 				continue;
 
@@ -595,11 +930,12 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 				weston_surface_to_buffer_float(ev->surface,
 							       sx, sy,
 							       &bx, &by);
-				*(v++) = bx * inv_width;
+				*(v++) = (tex_x + bx) * inv_width;
 				if (gs->y_inverted) {
-					*(v++) = by * inv_height;
+					*(v++) = (tex_y + by) * inv_height;
 				} else {
-					*(v++) = (gs->height - by) * inv_height;
+					*(v++) = (tex_y + gs->height - by) *
+						 inv_height;
 				}
 			}
 
@@ -607,6 +943,8 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 		}
 	}
 
+	free(transformed);
+	free(classes);
 	if (used_band_compression)
 		free(rects);
 	return nvtx;
@@ -647,122 +985,415 @@ triangle_fan_debug(struct weston_view *view, int first, int count)
 	glUseProgram(gr->solid_shader.program);
 	glUniform4fv(gr->solid_shader.color_uniform, 1,
 			color[color_idx++ % ARRAY_LENGTH(color)]);
+	gr->solid_shader.uniforms_valid = false;
 	glDrawElements(GL_LINES, nelems, GL_UNSIGNED_SHORT, buffer);
 	glUseProgram(gr->current_shader->program);
 	free(buffer);
 }
 
-static void
-repaint_region(struct weston_view *ev, pixman_region32_t *region,
-		pixman_region32_t *surf_region)
+static bool
+geometry_cache_entry_matches(struct gl_geometry_cache_entry *entry,
+			     struct gl_surface_state *gs,
+			     struct weston_view *ev,
+			     pixman_region32_t *region,
+			     pixman_region32_t *surf_region)
 {
-	struct weston_compositor *ec = ev->surface->compositor;
-	struct gl_renderer *gr = get_renderer(ec);
-	GLfloat *v;
-	unsigned int *vtxcnt;
-	int i, first, nfans;
+	return entry->valid &&
+	       entry->view == ev &&
+	       entry->transform_serial == ev->transform.serial &&
+	       entry->pitch == gs->pitch &&
+	       entry->height == gs->height &&
+	       entry->y_inverted == gs->y_inverted &&
+	       memcmp(entry->surface_to_buffer,
+		      ev->surface->surface_to_buffer_matrix.d,
+		      sizeof entry->surface_to_buffer) == 0 &&
+	       pixman_region32_equal(&entry->region, region) &&
+	       pixman_region32_equal(&entry->surf_region, surf_region);
+}
 
-	/* The final region to be painted is the intersection of
-	 * 'region' and 'surf_region'. However, 'region' is in the global
-	 * coordinates, and 'surf_region' is in the surface-local
-	 * coordinates. texture_region() will iterate over all pairs of
-	 * rectangles from both regions, compute the intersection
-	 * polygon for each pair, and store it as a triangle fan if
-	 * it has a non-zero area (at least 3 vertices, actually).
-	 */
-	nfans = texture_region(ev, region, surf_region);
+static struct gl_geometry_cache_entry *
+geometry_cache_lookup(struct gl_surface_state *gs, struct weston_view *ev,
+		      pixman_region32_t *region, pixman_region32_t *surf_region)
+{
+	struct gl_geometry_cache_entry *entry;
+	int i;
 
-	v = gr->vertices.data;
-	vtxcnt = gr->vtxcnt.data;
+	for (i = 0; i < GEOMETRY_CACHE_SIZE; i++) {
+		entry = &gs->geometry_cache[i];
+		if (geometry_cache_entry_matches(entry, gs, ev,
+						 region, surf_region)) {
+			entry->last_used = ++gs->geometry_cache_clock;
+			return entry;
+		}
+	}
 
-	/* position: */
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[0]);
-	glEnableVertexAttribArray(0);
+	return NULL;
+}
 
-	/* texcoord: */
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[2]);
-	glEnableVertexAttribArray(1);
+/* Keep a copy of the vertices texture_region() just produced, replacing
+ * the least recently used entry. */
+static void
+geometry_cache_store(struct gl_surface_state *gs, struct weston_view *ev,
+		     pixman_region32_t *region, pixman_region32_t *surf_region,
+		     const GLfloat *v, const unsigned int *vtxcnt, int nfans)
+{
+	struct gl_geometry_cache_entry *entry = &gs->geometry_cache[0];
+	unsigned int nvtx = 0;
+	void *dst;
+	int i;
 
-	for (i = 0, first = 0; i < nfans; i++) {
-		glDrawArrays(GL_TRIANGLE_FAN, first, vtxcnt[i]);
-		if (gr->fan_debug)
-			triangle_fan_debug(ev, first, vtxcnt[i]);
-		first += vtxcnt[i];
+	for (i = 0; i < nfans; i++)
+		nvtx += vtxcnt[i];
+	if (nvtx > GEOMETRY_CACHE_MAX_VERTICES)
+		return;
+
+	for (i = 1; i < GEOMETRY_CACHE_SIZE && entry->valid; i++) {
+		struct gl_geometry_cache_entry *e = &gs->geometry_cache[i];
+
+		if (!e->valid || e->last_used < entry->last_used)
+			entry = e;
 	}
 
-	glDisableVertexAttribArray(1);
-	glDisableVertexAttribArray(0);
+	entry->valid = false;
 
-	gr->vertices.size = 0;
-	gr->vtxcnt.size = 0;
+	entry->vertices.size = 0;
+	entry->vtxcnt.size = 0;
+	dst = wl_array_add(&entry->vertices, nvtx * 4 * sizeof *v);
+	if (!dst)
+		return;
+	memcpy(dst, v, nvtx * 4 * sizeof *v);
+	dst = wl_array_add(&entry->vtxcnt, nfans * sizeof *vtxcnt);
+	if (!dst)
+		return;
+	memcpy(dst, vtxcnt, nfans * sizeof *vtxcnt);
+
+	if (!pixman_region32_copy(&entry->region, region) ||
+	    !pixman_region32_copy(&entry->surf_region, surf_region))
+		return;
+
+	entry->view = ev;
+	entry->transform_serial = ev->transform.serial;
+	memcpy(entry->surface_to_buffer,
+	       ev->surface->surface_to_buffer_matrix.d,
+	       sizeof entry->surface_to_buffer);
+	entry->pitch = gs->pitch;
+	entry->height = gs->height;
+	entry->y_inverted = gs->y_inverted;
+	entry->nfans = nfans;
+	entry->last_used = ++gs->geometry_cache_clock;
+	entry->valid = true;
 }
 
-static int
-use_output(struct weston_output *output)
+static void
+geometry_cache_init(struct gl_surface_state *gs)
 {
-	static int errored;
-	struct gl_output_state *go = get_output_state(output);
-	struct gl_renderer *gr = get_renderer(output->compositor);
-	EGLBoolean ret;
-
-	ret = eglMakeCurrent(gr->egl_display, go->egl_surface,
-			     go->egl_surface, gr->egl_context);
+	struct gl_geometry_cache_entry *entry;
+	int i;
 
-	if (ret == EGL_FALSE) {
-		if (errored)
-			return -1;
-		errored = 1;
-		weston_log("Failed to make EGL context current.\n");
-		gl_renderer_print_egl_error_state();
-		return -1;
+	for (i = 0; i < GEOMETRY_CACHE_SIZE; i++) {
+		entry = &gs->geometry_cache[i];
+		pixman_region32_init(&entry->region);
+		pixman_region32_init(&entry->surf_region);
+		wl_array_init(&entry->vertices);
+		wl_array_init(&entry->vtxcnt);
 	}
-
-	return 0;
 }
 
-static int
-shader_init(struct gl_shader *shader, struct gl_renderer *gr,
-		   const char *vertex_source, const char *fragment_source);
-
 static void
-use_shader(struct gl_renderer *gr, struct gl_shader *shader)
+geometry_cache_release(struct gl_surface_state *gs)
 {
-	if (!shader->program) {
-		int ret;
-
-		ret =  shader_init(shader, gr,
-				   shader->vertex_source,
-				   shader->fragment_source);
+	struct gl_geometry_cache_entry *entry;
+	int i;
 
-		if (ret < 0)
-			weston_log("warning: failed to compile shader\n");
+	for (i = 0; i < GEOMETRY_CACHE_SIZE; i++) {
+		entry = &gs->geometry_cache[i];
+		pixman_region32_fini(&entry->region);
+		pixman_region32_fini(&entry->surf_region);
+		wl_array_release(&entry->vertices);
+		wl_array_release(&entry->vtxcnt);
 	}
-
-	if (gr->current_shader == shader)
-		return;
-	glUseProgram(shader->program);
-	gr->current_shader = shader;
 }
 
 static void
-shader_uniforms(struct gl_shader *shader,
-		struct weston_view *view,
-		struct weston_output *output)
+geometry_cache_invalidate(struct gl_surface_state *gs)
 {
 	int i;
-	struct gl_surface_state *gs = get_surface_state(view->surface);
-	struct gl_output_state *go = get_output_state(output);
-
-	glUniformMatrix4fv(shader->proj_uniform,
-			   1, GL_FALSE, go->output_matrix.d);
-	glUniform4fv(shader->color_uniform, 1, gs->color);
-	glUniform1f(shader->alpha_uniform, view->alpha);
 
-	for (i = 0; i < gs->num_textures; i++)
-		glUniform1i(shader->tex_uniforms[i], i);
+	for (i = 0; i < GEOMETRY_CACHE_SIZE; i++)
+		gs->geometry_cache[i].valid = false;
 }
 
-static int
+/* Vertices of one draw must be addressable with GL_UNSIGNED_SHORT indices */
+#define MAX_BATCH_VERTICES 65536
+
+/* Draw the fans [first_fan, last_fan) as one indexed triangle list
+ * sourced from the streamed buffers. */
+static void
+draw_fan_batch(struct weston_view *ev, const GLfloat *v,
+	       const unsigned int *vtxcnt, int first_fan, int last_fan,
+	       unsigned int first_vertex)
+{
+	struct weston_compositor *ec = ev->surface->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	unsigned int nvtx = 0;
+	GLushort *index;
+	GLsizei nindices;
+	int i, k;
+
+	gr->indices.size = 0;
+	for (i = first_fan; i < last_fan; i++) {
+		index = wl_array_add(&gr->indices,
+				     (vtxcnt[i] - 2) * 3 * sizeof *index);
+		if (!index)
+			return;
+
+		/* fans are convex, so the triangulation is trivial */
+		for (k = 1; k + 1 < (int)vtxcnt[i]; k++) {
+			*index++ = nvtx;
+			*index++ = nvtx + k;
+			*index++ = nvtx + k + 1;
+		}
+		nvtx += vtxcnt[i];
+	}
+	nindices = gr->indices.size / sizeof *index;
+
+	/* Orphan the previous contents so that the upload does not wait for
+	 * the draws still using them. */
+	glBindBuffer(GL_ARRAY_BUFFER, gr->vertex_buffer);
+	glBufferData(GL_ARRAY_BUFFER, nvtx * 4 * sizeof *v,
+		     &v[first_vertex * 4], GL_STREAM_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gr->index_buffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, gr->indices.size,
+		     gr->indices.data, GL_STREAM_DRAW);
+
+	/* position: */
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v,
+			      (void *)0);
+	/* texcoord: */
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v,
+			      (void *)(2 * sizeof *v));
+
+	glDrawElements(GL_TRIANGLES, nindices, GL_UNSIGNED_SHORT, (void *)0);
+	gr->draw_calls++;
+
+	if (gr->fan_debug) {
+		/* triangle_fan_debug() passes client side indices */
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		for (i = first_fan, nvtx = 0; i < last_fan; i++) {
+			triangle_fan_debug(ev, nvtx, vtxcnt[i]);
+			nvtx += vtxcnt[i];
+		}
+	}
+}
+
+/* Draw the fans with as few draws as the 16-bit indices allow */
+static void
+draw_fans(struct weston_view *ev, const GLfloat *v,
+	  const unsigned int *vtxcnt, int nfans)
+{
+	unsigned int first, batch_first;
+	int i, batch_start;
+
+	if (nfans == 0)
+		return;
+
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+
+	batch_start = 0;
+	batch_first = 0;
+	for (i = 0, first = 0; i < nfans; i++) {
+		if (first + vtxcnt[i] - batch_first > MAX_BATCH_VERTICES) {
+			draw_fan_batch(ev, v, vtxcnt, batch_start, i,
+				       batch_first);
+			batch_start = i;
+			batch_first = first;
+		}
+		first += vtxcnt[i];
+	}
+	draw_fan_batch(ev, v, vtxcnt, batch_start, nfans, batch_first);
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+}
+
+/* Returns the fans covering the region, valid until the next call. */
+static int
+region_geometry(struct weston_view *ev, pixman_region32_t *region,
+		pixman_region32_t *surf_region,
+		GLfloat **v, unsigned int **vtxcnt)
+{
+	struct weston_compositor *ec = ev->surface->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_surface_state *gs = get_surface_state(ev->surface);
+	struct gl_geometry_cache_entry *cached;
+	int nfans;
+
+	/* The final region to be painted is the intersection of
+	 * 'region' and 'surf_region'. However, 'region' is in the global
+	 * coordinates, and 'surf_region' is in the surface-local
+	 * coordinates. texture_region() will iterate over all pairs of
+	 * rectangles from both regions, compute the intersection
+	 * polygon for each pair, and store it as a triangle fan if
+	 * it has a non-zero area (at least 3 vertices, actually).
+	 *
+	 * When only the content of a view changes, the regions and
+	 * transform are identical from one frame to the next, and the
+	 * vertices of the previous frame are reused as they are.
+	 */
+	gr->vertices.size = 0;
+	gr->vtxcnt.size = 0;
+
+	cached = geometry_cache_lookup(gs, ev, region, surf_region);
+	if (cached) {
+		*v = cached->vertices.data;
+		*vtxcnt = cached->vtxcnt.data;
+		return cached->nfans;
+	}
+
+	nfans = texture_region(ev, region, surf_region);
+	*v = gr->vertices.data;
+	*vtxcnt = gr->vtxcnt.data;
+	geometry_cache_store(gs, ev, region, surf_region,
+			     *v, *vtxcnt, nfans);
+
+	return nfans;
+}
+
+static void
+repaint_region(struct weston_view *ev, pixman_region32_t *region,
+		pixman_region32_t *surf_region)
+{
+	struct weston_compositor *ec = ev->surface->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	unsigned int *vtxcnt;
+	GLfloat *v;
+	int nfans;
+
+	nfans = region_geometry(ev, region, surf_region, &v, &vtxcnt);
+	draw_fans(ev, v, vtxcnt, nfans);
+
+	gr->vertices.size = 0;
+	gr->vtxcnt.size = 0;
+}
+
+static int
+use_output(struct weston_output *output)
+{
+	static int errored;
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	EGLBoolean ret;
+
+	ret = eglMakeCurrent(gr->egl_display, go->egl_surface,
+			     go->egl_surface, gr->egl_context);
+
+	if (ret == EGL_FALSE) {
+		if (errored)
+			return -1;
+		errored = 1;
+		weston_log("Failed to make EGL context current.\n");
+		gl_renderer_print_egl_error_state();
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+shader_init(struct gl_shader *shader, struct gl_renderer *gr,
+		   const char *vertex_source, const char *fragment_source);
+
+static void
+use_shader(struct gl_renderer *gr, struct gl_shader *shader)
+{
+	if (!shader->program) {
+		int ret;
+
+		ret =  shader_init(shader, gr,
+				   shader->vertex_source,
+				   shader->fragment_source);
+
+		if (ret < 0)
+			weston_log("warning: failed to compile shader\n");
+	}
+
+	if (gr->current_shader == shader)
+		return;
+	glUseProgram(shader->program);
+	gr->current_shader = shader;
+}
+
+/* The variant of the shader to draw the view with. */
+static struct gl_shader *
+view_shader(struct gl_shader *shader, struct weston_view *view)
+{
+	if (shader->opaque_variant && view->alpha == 1.0f)
+		return shader->opaque_variant;
+
+	return shader;
+}
+
+/* The shader_set_*() helpers must be called with the shader in use. */
+static void
+shader_set_proj(struct gl_shader *shader, const GLfloat *proj)
+{
+	if (shader->uniforms_valid &&
+	    memcmp(shader->proj, proj, sizeof shader->proj) == 0)
+		return;
+
+	memcpy(shader->proj, proj, sizeof shader->proj);
+	glUniformMatrix4fv(shader->proj_uniform, 1, GL_FALSE, proj);
+}
+
+static void
+shader_set_color(struct gl_shader *shader, const GLfloat *color)
+{
+	if (shader->uniforms_valid &&
+	    memcmp(shader->color, color, sizeof shader->color) == 0)
+		return;
+
+	memcpy(shader->color, color, sizeof shader->color);
+	glUniform4fv(shader->color_uniform, 1, color);
+}
+
+static void
+shader_set_alpha(struct gl_shader *shader, GLfloat alpha)
+{
+	if (shader->uniforms_valid && shader->alpha == alpha)
+		return;
+
+	shader->alpha = alpha;
+	glUniform1f(shader->alpha_uniform, alpha);
+}
+
+static void
+shader_uniforms(struct gl_shader *shader,
+		struct weston_view *view,
+		struct weston_output *output)
+{
+	struct gl_surface_state *gs = get_surface_state(view->surface);
+	struct gl_output_state *go = get_output_state(output);
+	struct weston_matrix proj;
+
+	if (go->depth_test) {
+		/* Vertices have z = 0 and w = 1, so the translation is
+		 * the resulting depth. */
+		proj = go->output_matrix;
+		proj.d[14] = go->view_depth;
+		shader_set_proj(shader, proj.d);
+	} else {
+		shader_set_proj(shader, go->output_matrix.d);
+	}
+	shader_set_color(shader, gs->color);
+	shader_set_alpha(shader, view->alpha);
+	shader->uniforms_valid = true;
+}
+
+static int
 ensure_surface_buffer_is_ready(struct gl_renderer *gr,
 			       struct gl_surface_state *gs)
 {
@@ -825,184 +1456,1164 @@ ensure_surface_buffer_is_ready(struct gl_renderer *gr,
 			"Failed to destroy on EGLSyncKHR object");
 	}
 
-	return (wait_ret == EGL_TRUE && destroy_ret == EGL_TRUE) ? 0 : -1;
-}
+	return (wait_ret == EGL_TRUE && destroy_ret == EGL_TRUE) ? 0 : -1;
+}
+
+
+ /* Checks if a view needs to be censored on an output
+  * Checks for 2 types of censor requirements
+  * - recording_censor: Censor protected view when a
+  *   protected view is captured.
+  * - unprotected_censor: Censor regions of protected views
+  *   when displayed on an output which has lower protection capability.
+  * Returns the originally stored gl_shader if content censoring is required,
+  * NULL otherwise.
+  */
+static struct gl_shader *
+setup_censor_overrides(struct weston_output *output,
+		       struct weston_view *ev)
+{
+	struct gl_shader *replaced_shader = NULL;
+	struct weston_compositor *ec = ev->surface->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_surface_state *gs = get_surface_state(ev->surface);
+	bool recording_censor =
+		weston_output_is_captured(output) &&
+		(ev->surface->desired_protection > WESTON_HDCP_DISABLE);
+
+	bool unprotected_censor =
+		(ev->surface->desired_protection > output->current_protection);
+
+	if (gs->direct_display) {
+		gs->color[0] = 0.40;
+		gs->color[1] = 0.0;
+		gs->color[2] = 0.0;
+		gs->color[3] = 1.0;
+		gs->shader = &gr->solid_shader;
+		return gs->shader;
+	}
+
+	/* When not in enforced mode, the client is notified of the protection */
+	/* change, so content censoring is not required */
+	if (ev->surface->protection_mode !=
+	    WESTON_SURFACE_PROTECTION_MODE_ENFORCED)
+		return NULL;
+
+	if (recording_censor || unprotected_censor) {
+		replaced_shader = gs->shader;
+		gs->color[0] = 0.40;
+		gs->color[1] = 0.0;
+		gs->color[2] = 0.0;
+		gs->color[3] = 1.0;
+		gs->shader = &gr->solid_shader;
+	}
+
+	return replaced_shader;
+}
+
+static void
+atlas_batch_flush(struct gl_renderer *gr, struct weston_output *output)
+{
+	struct weston_view *ev = gr->atlas_batch.view;
+
+	if (gr->atlas_batch.nfans == 0)
+		return;
+
+	use_shader(gr, gr->atlas_batch.shader);
+	shader_uniforms(gr->atlas_batch.shader, ev, output);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, gr->atlas_batch.texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+			gr->atlas_batch.filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
+			gr->atlas_batch.filter);
+
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	if (gr->atlas_batch.blend)
+		glEnable(GL_BLEND);
+	else
+		glDisable(GL_BLEND);
+
+	draw_fans(ev, gr->atlas_batch.vertices.data,
+		  gr->atlas_batch.vtxcnt.data, gr->atlas_batch.nfans);
+
+	gr->atlas_batch.vertices.size = 0;
+	gr->atlas_batch.vtxcnt.size = 0;
+	gr->atlas_batch.nfans = 0;
+	gr->atlas_batch.view = NULL;
+}
+
+/* Queue the region for a draw shared with the neighbouring views that
+ * sample the same atlas page with the same state.
+ *
+ * \return false if out of memory, nothing was queued then.
+ */
+static bool
+atlas_batch_add(struct weston_view *ev, struct weston_output *output,
+		struct gl_shader *shader, GLint filter, bool blend,
+		pixman_region32_t *region, pixman_region32_t *surf_region)
+{
+	struct weston_compositor *ec = ev->surface->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_surface_state *gs = get_surface_state(ev->surface);
+	size_t vertices_size = gr->atlas_batch.vertices.size;
+	unsigned int *vtxcnt, nvtx = 0;
+	GLfloat *v, *dst_v;
+	unsigned int *dst_vtxcnt;
+	int i, nfans;
+
+	if (gr->atlas_batch.nfans > 0 &&
+	    (gr->atlas_batch.texture != gs->textures[0] ||
+	     gr->atlas_batch.shader != shader ||
+	     gr->atlas_batch.filter != filter ||
+	     gr->atlas_batch.blend != blend ||
+	     gr->atlas_batch.view->alpha != ev->alpha))
+		atlas_batch_flush(gr, output);
+
+	nfans = region_geometry(ev, region, surf_region, &v, &vtxcnt);
+	if (nfans == 0)
+		return true;
+
+	for (i = 0; i < nfans; i++)
+		nvtx += vtxcnt[i];
+
+	dst_v = wl_array_add(&gr->atlas_batch.vertices,
+			     nvtx * 4 * sizeof *v);
+	dst_vtxcnt = wl_array_add(&gr->atlas_batch.vtxcnt,
+				  nfans * sizeof *vtxcnt);
+	if (!dst_v || !dst_vtxcnt) {
+		gr->atlas_batch.vertices.size = vertices_size;
+		gr->atlas_batch.vtxcnt.size =
+			gr->atlas_batch.nfans * sizeof *vtxcnt;
+		gr->vertices.size = 0;
+		gr->vtxcnt.size = 0;
+		return false;
+	}
+	memcpy(dst_v, v, nvtx * 4 * sizeof *v);
+	memcpy(dst_vtxcnt, vtxcnt, nfans * sizeof *vtxcnt);
+
+	if (gr->atlas_batch.nfans == 0) {
+		gr->atlas_batch.view = ev;
+		gr->atlas_batch.shader = shader;
+		gr->atlas_batch.texture = gs->textures[0];
+		gr->atlas_batch.filter = filter;
+		gr->atlas_batch.blend = blend;
+	}
+	gr->atlas_batch.nfans += nfans;
+
+	gr->vertices.size = 0;
+	gr->vtxcnt.size = 0;
+
+	return true;
+}
+
+/* Views drawn below this many output pixels per texel sample mipmaps */
+#define MIPMAP_SCALE_THRESHOLD 0.5f
+
+static bool
+view_is_minified(struct gl_renderer *gr, struct weston_output *output,
+		 struct weston_view *ev, struct gl_surface_state *gs)
+{
+	const float *d = ev->transform.matrix.d;
+	float scale, sx, sy;
+
+	/* Output zoom only magnifies, and is not accounted for below */
+	if (!gr->has_mipmaps || !ev->transform.enabled ||
+	    output->zoom.active || gs->buffer_type != BUFFER_TYPE_SHM ||
+	    gs->target != GL_TEXTURE_2D || gs->atlas_slot.page ||
+	    gs->mipmaps_failed ||
+	    ev->surface->width <= 0 || ev->surface->height <= 0)
+		return false;
+
+	/* Length of the surface axes in output pixels per surface unit,
+	 * divided by the texels per surface unit. */
+	scale = weston_output_get_scale_factor(output);
+	sx = sqrtf(d[0] * d[0] + d[1] * d[1]) * scale *
+	     ev->surface->width / gs->pitch;
+	sy = sqrtf(d[4] * d[4] + d[5] * d[5]) * scale *
+	     ev->surface->height / gs->height;
+
+	return sx < MIPMAP_SCALE_THRESHOLD || sy < MIPMAP_SCALE_THRESHOLD;
+}
+
+/* Formats that are not color-renderable, like BGRA_EXT on some GLES
+ * drivers, fail with GL_INVALID_OPERATION. Sampling the incomplete
+ * textures with a mipmap filter would then draw black. */
+static bool
+surface_generate_mipmaps(struct gl_surface_state *gs)
+{
+	static bool warned;
+	int i;
+
+	/* Only report our own errors */
+	while (glGetError() != GL_NO_ERROR)
+		;
+
+	for (i = 0; i < gs->num_textures; i++) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(gs->target, gs->textures[i]);
+		glGenerateMipmap(gs->target);
+	}
+
+	if (glGetError() == GL_NO_ERROR)
+		return true;
+
+	if (!warned)
+		weston_log("GL renderer: cannot generate mipmaps for format "
+			   "%#x, filtering minified views without them\n",
+			   gs->gl_format[0]);
+	warned = true;
+	gs->mipmaps_failed = true;
+
+	return false;
+}
+
+enum draw_pass {
+	DRAW_PASS_ALL,
+	/* opaque regions of fully opaque views, drawn front to back */
+	DRAW_PASS_OPAQUE,
+	/* everything DRAW_PASS_OPAQUE did not draw, back to front */
+	DRAW_PASS_BLEND,
+};
+
+static void
+surface_release_textures(struct gl_surface_state *gs);
+
+static void
+ensure_textures(struct gl_surface_state *gs, int num_textures);
+
+static int
+gl_format_bytes_per_pixel(GLenum format, GLenum type)
+{
+	if (type == GL_UNSIGNED_SHORT_5_6_5)
+		return 2;
+
+	switch (format) {
+	case GL_BGRA_EXT:
+	case GL_RGBA:
+		return 4;
+	case GL_RG8_EXT:
+	case GL_LUMINANCE_ALPHA:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+/* Update the texture memory of an SHM surface after its textures changed,
+ * and mark it as the most recently used. Atlas slots and the textures of
+ * EGL and dmabuf buffers are not counted. */
+static void
+surface_account_texture(struct gl_renderer *gr, struct gl_surface_state *gs)
+{
+	size_t size = 0;
+	int j;
+
+	if (gs->buffer_type == BUFFER_TYPE_SHM && !gs->atlas_slot.page) {
+		for (j = 0; j < gs->num_textures; j++)
+			size += (size_t)(gs->pitch / gs->hsub[j]) *
+				(gs->height / gs->vsub[j]) *
+				gl_format_bytes_per_pixel(gs->gl_format[j],
+							  gs->gl_pixel_type);
+	}
+
+	gr->texture_memory = gr->texture_memory - gs->texture_size + size;
+	gs->texture_size = size;
+
+	wl_list_remove(&gs->texture_link);
+	if (size > 0)
+		wl_list_insert(&gr->texture_lru, &gs->texture_link);
+	else
+		wl_list_init(&gs->texture_link);
+}
+
+static void
+surface_drop_evicted(struct gl_renderer *gr, struct gl_surface_state *gs)
+{
+	if (!gs->evicted)
+		return;
+
+	if (gs->evicted_pixels) {
+		gr->evicted_memory -= (size_t)gs->pitch * gs->height * 4;
+		free(gs->evicted_pixels);
+		gs->evicted_pixels = NULL;
+	}
+	gs->evicted = false;
+}
+
+/* Whether a view of the surface is in a shown layer, on an output and not
+ * hidden behind other views. */
+static bool
+surface_is_shown(struct weston_surface *surface)
+{
+	struct weston_view *view;
+
+	wl_list_for_each(view, &surface->views, surface_link) {
+		if (!view->layer_link.layer ||
+		    wl_list_empty(&view->layer_link.layer->link))
+			continue;
+
+		if (view->output_mask && !weston_view_is_occluded(view))
+			return true;
+	}
+
+	return false;
+}
+
+/* Copy the texture into system memory, as RGBA. */
+static void *
+surface_read_texture(struct gl_surface_state *gs)
+{
+	GLuint fbo;
+	void *pixels;
+	GLenum status;
+
+	pixels = malloc((size_t)gs->pitch * gs->height * 4);
+	if (!pixels)
+		return NULL;
+
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			       GL_TEXTURE_2D, gs->textures[0], 0);
+	status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	if (status == GL_FRAMEBUFFER_COMPLETE) {
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glReadPixels(0, 0, gs->pitch, gs->height, GL_RGBA,
+			     GL_UNSIGNED_BYTE, pixels);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &fbo);
+
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		free(pixels);
+		return NULL;
+	}
+
+	return pixels;
+}
+
+/* Free the texture of a surface not shown anywhere, or of any surface
+ * while nothing is drawn at all. When the renderer still holds the buffer,
+ * the texture is uploaded from it again, otherwise the content is kept in
+ * system memory in the meantime. */
+static bool
+surface_evict_texture(struct gl_renderer *gr, struct gl_surface_state *gs,
+		      bool asleep)
+{
+	void *pixels = NULL;
+
+	if (gs->num_textures != 1 || gs->target != GL_TEXTURE_2D)
+		return false;
+
+	if (!asleep && surface_is_shown(gs->surface))
+		return false;
+
+	if (!gs->buffer_ref.buffer) {
+		pixels = surface_read_texture(gs);
+		if (!pixels)
+			return false;
+		gr->evicted_memory += (size_t)gs->pitch * gs->height * 4;
+	}
+
+	surface_release_textures(gs);
+	gs->evicted = true;
+	gs->evicted_pixels = pixels;
+	gs->mipmaps_valid = false;
+	gr->texture_evictions++;
+
+	return true;
+}
+
+/* Bring back the texture of an evicted surface about to be drawn, or
+ * about to get new content from its buffer. */
+static void
+surface_restore_texture(struct gl_renderer *gr, struct gl_surface_state *gs)
+{
+	if (!gs->evicted)
+		return;
+
+	ensure_textures(gs, 1);
+
+	if (gs->evicted_pixels) {
+		/* The copy was read back as RGBA, and the next attach
+		 * notices the different format. */
+		gs->gl_format[0] = GL_RGBA;
+		gs->gl_pixel_type = GL_UNSIGNED_BYTE;
+		glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
+		if (gr->has_unpack_subimage) {
+			glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+			glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+			glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+		}
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, gs->pitch, gs->height,
+			     0, GL_RGBA, GL_UNSIGNED_BYTE, gs->evicted_pixels);
+	} else {
+		gs->needs_full_upload = true;
+	}
+
+	surface_drop_evicted(gr, gs);
+	surface_account_texture(gr, gs);
+}
+
+/* Evict the least recently drawn textures of hidden surfaces, until the
+ * [core] texture-memory-budget is met. */
+static void
+gl_renderer_evict_textures(struct gl_renderer *gr)
+{
+	struct gl_surface_state *gs, *prev;
+
+	if (gr->texture_budget == 0)
+		return;
+
+	wl_list_for_each_reverse_safe(gs, prev, &gr->texture_lru,
+				      texture_link) {
+		if (gr->texture_memory <= gr->texture_budget)
+			break;
+
+		surface_evict_texture(gr, gs, false);
+	}
+}
+
+/* Drop the SHM textures that can be uploaded from their buffer again,
+ * while the outputs are off. Read back copies would stay in the same
+ * memory on most hardware, so those textures are kept. */
+static size_t
+gl_renderer_trim_memory(struct weston_compositor *ec)
+{
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_surface_state *gs, *prev;
+	size_t before = gr->texture_memory;
+
+	if (wl_list_empty(&gr->texture_lru))
+		return 0;
+
+	if (eglMakeCurrent(gr->egl_display, gr->dummy_surface,
+			   gr->dummy_surface, gr->egl_context) == EGL_FALSE)
+		return 0;
+
+	wl_list_for_each_safe(gs, prev, &gr->texture_lru, texture_link) {
+		if (gs->buffer_ref.buffer)
+			surface_evict_texture(gr, gs, true);
+	}
+
+	return before - gr->texture_memory;
+}
+
+/**
+ * Called when the 'gl-textures' debug scope is bound by a client. This
+ * one-shot weston-debug scope prints the texture memory of the wl_shm
+ * surfaces, and terminates the stream.
+ */
+static void
+gl_renderer_texture_memory_cb(struct weston_log_subscription *sub,
+			      void *data)
+{
+	struct gl_renderer *gr = data;
+	struct gl_surface_state *gs;
+	unsigned int count = 0;
+
+	wl_list_for_each(gs, &gr->texture_lru, texture_link)
+		count++;
+
+	weston_log_subscription_printf(sub,
+		"budget: %zu KiB%s\n"
+		"SHM textures: %zu KiB in %u textures\n"
+		"evicted copies in system memory: %zu KiB\n"
+		"evictions: %" PRIu64 "\n",
+		gr->texture_budget / 1024,
+		gr->texture_budget ? "" : " (unlimited)",
+		gr->texture_memory / 1024, count,
+		gr->evicted_memory / 1024, gr->texture_evictions);
+
+	wl_list_for_each(gs, &gr->texture_lru, texture_link)
+		weston_log_subscription_printf(sub,
+			"\t%8zu KiB  %dx%d  %s\n", gs->texture_size / 1024,
+			gs->pitch, gs->height,
+			surface_is_shown(gs->surface) ? "shown" : "hidden");
+
+	weston_log_subscription_complete(sub);
+}
+
+static void
+pixman_region_to_egl_y_invert(struct weston_output *output,
+			      struct pixman_region32 *global_region,
+			      EGLint **rects,
+			      EGLint *nrects);
+
+static bool
+output_render_scaled(struct weston_output *output);
+
+static int
+output_has_borders(struct weston_output *output);
+
+static void
+output_set_render_viewport(struct weston_output *output);
+
+/*
+ * Opaque solid color views, like backgrounds, letterboxing and fade
+ * curtains, are cleared with a scissor for each damage rectangle instead of
+ * going through the geometry path. Only untransformed views qualify, when
+ * the repaint is in plain output coordinates.
+ */
+static bool
+draw_view_solid_clear(struct weston_view *ev, struct weston_output *output,
+		      pixman_region32_t *repaint)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_surface_state *gs = get_surface_state(ev->surface);
+	struct gl_output_state *go = get_output_state(output);
+	EGLint *rects;
+	EGLint n, i;
+
+	if (gs->buffer_type != BUFFER_TYPE_SOLID || gs->color[3] < 1.0f ||
+	    ev->alpha < 1.0f || ev->transform.enabled ||
+	    ev->geometry.scissor_enabled)
+		return false;
+
+	if (go->depth_test || go->in_lut_fbo || go->in_tree_capture ||
+	    output->zoom.active ||
+	    output_render_scaled(output) || output_has_borders(output) ||
+	    gr->fan_debug || gr->fragment_shader_debug)
+		return false;
+
+	/* Keep the order with views queued before. */
+	atlas_batch_flush(gr, output);
+
+	pixman_region_to_egl_y_invert(output, repaint, &rects, &n);
+	glClearColor(gs->color[0], gs->color[1], gs->color[2], 1.0f);
+	glEnable(GL_SCISSOR_TEST);
+	for (i = 0; i < n; i++) {
+		glScissor(rects[i * 4 + 0], rects[i * 4 + 1],
+			  rects[i * 4 + 2], rects[i * 4 + 3]);
+		glClear(GL_COLOR_BUFFER_BIT);
+	}
+	glDisable(GL_SCISSOR_TEST);
+	free(rects);
+
+	return true;
+}
+
+static void
+draw_view(struct weston_view *ev, struct weston_output *output,
+	  pixman_region32_t *damage, /* in global coordinates */
+	  enum draw_pass pass)
+{
+	struct weston_compositor *ec = ev->surface->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_surface_state *gs = get_surface_state(ev->surface);
+	unsigned int scratch_mark = weston_output_scratch_mark(output);
+	/* repaint bounding region in global coordinates: */
+	pixman_region32_t *repaint;
+	/* opaque region in surface coordinates: */
+	pixman_region32_t *surface_opaque;
+	/* non-opaque region in surface coordinates: */
+	pixman_region32_t *surface_blend;
+	pixman_region32_t surface_rect, *tmp;
+	bool draw_opaque, draw_blend;
+	bool minified;
+	GLint filter;
+	int i;
+	struct gl_shader *replaced_shader = NULL;
+	struct gl_shader *shader, *opaque_shader;
+
+	/* In case of a runtime switch of renderers, we may not have received
+	 * an attach for this surface since the switch. In that case we don't
+	 * have a valid buffer or a proper shader set up so skip rendering. */
+	if (!gs->shader && !gs->direct_display)
+		return;
+
+	if (pass == DRAW_PASS_OPAQUE &&
+	    (ev->alpha < 1.0 ||
+	     !pixman_region32_not_empty(&ev->surface->opaque)))
+		return;
+
+	/* The temporary regions are borrowed from the output, and no
+	 * operation writes into one of its operands, so that they keep their
+	 * storage from one repaint to the next. */
+	tmp = weston_output_scratch_region(output);
+	repaint = weston_output_scratch_region(output);
+	pixman_region32_intersect(tmp, &ev->transform.boundingbox, damage);
+	pixman_region32_subtract(repaint, tmp, &ev->clip);
+
+	if (!pixman_region32_not_empty(repaint))
+		goto out;
+
+	if (draw_view_solid_clear(ev, output, repaint))
+		goto out;
+
+	/* blended region is whole surface minus opaque region: */
+	surface_blend = weston_output_scratch_region(output);
+	pixman_region32_init_rect(&surface_rect, 0, 0,
+				  ev->surface->width, ev->surface->height);
+	if (ev->geometry.scissor_enabled) {
+		pixman_region32_intersect(tmp, &surface_rect,
+					  &ev->geometry.scissor);
+		pixman_region32_subtract(surface_blend, tmp,
+					 &ev->surface->opaque);
+	} else {
+		pixman_region32_subtract(surface_blend, &surface_rect,
+					 &ev->surface->opaque);
+	}
+	pixman_region32_fini(&surface_rect);
+
+	/* XXX: Should we be using ev->transform.opaque here? */
+	surface_opaque = weston_output_scratch_region(output);
+	if (ev->geometry.scissor_enabled)
+		pixman_region32_intersect(surface_opaque,
+					  &ev->surface->opaque,
+					  &ev->geometry.scissor);
+	else
+		pixman_region32_copy(surface_opaque, &ev->surface->opaque);
+
+	switch (pass) {
+	case DRAW_PASS_OPAQUE:
+		draw_opaque = true;
+		draw_blend = false;
+		break;
+	case DRAW_PASS_BLEND:
+		draw_opaque = ev->alpha < 1.0;
+		draw_blend = true;
+		break;
+	default:
+		draw_opaque = true;
+		draw_blend = true;
+		break;
+	}
+	draw_opaque = draw_opaque && pixman_region32_not_empty(surface_opaque);
+	draw_blend = draw_blend && pixman_region32_not_empty(surface_blend);
+
+	if (!draw_opaque && !draw_blend)
+		goto out;
+
+	if (ensure_surface_buffer_is_ready(gr, gs) < 0)
+		goto out;
+
+	surface_restore_texture(gr, gs);
+	if (gs->texture_size > 0) {
+		wl_list_remove(&gs->texture_link);
+		wl_list_insert(&gr->texture_lru, &gs->texture_link);
+	}
+
+	replaced_shader = setup_censor_overrides(output, ev);
+
+	shader = view_shader(gs->shader, ev);
+	/* Special case for RGBA textures with possibly bad data in the alpha
+	 * channel of the opaque region: use the shader that forces texture
+	 * alpha = 1.0. Xwayland surfaces need this. */
+	if (gs->shader == &gr->texture_shader_rgba)
+		opaque_shader = view_shader(&gr->texture_shader_rgbx, ev);
+	else
+		opaque_shader = shader;
+
+	if (weston_view_matches_output_scale(ev, output))
+		filter = GL_NEAREST;
+	else
+		filter = GL_LINEAR;
+
+	/* Views in the atlas are queued, and drawn together with the
+	 * following ones as long as they share the page and the state. */
+	if (gs->atlas_slot.page && !replaced_shader && !gr->fan_debug &&
+	    !get_output_state(output)->depth_test) {
+		if (draw_opaque &&
+		    atlas_batch_add(ev, output, opaque_shader, filter,
+				    ev->alpha < 1.0, repaint, surface_opaque))
+			draw_opaque = false;
+		if (draw_blend &&
+		    atlas_batch_add(ev, output, shader, filter, true,
+				    repaint, surface_blend))
+			draw_blend = false;
+
+		gs->used_in_output_repaint = true;
+		if (!draw_opaque && !draw_blend)
+			goto out;
+	}
+	atlas_batch_flush(gr, output);
+
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+	if (gr->fan_debug) {
+		use_shader(gr, &gr->solid_shader);
+		shader_uniforms(&gr->solid_shader, ev, output);
+	}
+
+	use_shader(gr, shader);
+	shader_uniforms(shader, ev, output);
+
+	minified = view_is_minified(gr, output, ev, gs);
+	if (minified && !gs->mipmaps_valid && !surface_generate_mipmaps(gs))
+		minified = false;
+
+	for (i = 0; i < gs->num_textures; i++) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(gs->target, gs->textures[i]);
+		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER,
+				minified ? GL_LINEAR_MIPMAP_LINEAR : filter);
+		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, filter);
+	}
+	if (minified)
+		gs->mipmaps_valid = true;
+
+	if (draw_opaque) {
+		if (opaque_shader != shader) {
+			use_shader(gr, opaque_shader);
+			shader_uniforms(opaque_shader, ev, output);
+		}
+
+		if (ev->alpha < 1.0)
+			glEnable(GL_BLEND);
+		else
+			glDisable(GL_BLEND);
+
+		repaint_region(ev, repaint, surface_opaque);
+		gs->used_in_output_repaint = true;
+	}
+
+	if (draw_blend) {
+		use_shader(gr, shader);
+		glEnable(GL_BLEND);
+		repaint_region(ev, repaint, surface_blend);
+		gs->used_in_output_repaint = true;
+	}
+
+out:
+	weston_output_scratch_release(output, scratch_mark);
+
+	if (replaced_shader)
+		gs->shader = replaced_shader;
+}
+
+static bool
+output_can_depth_test(struct weston_output *output)
+{
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+
+	if (!gr->front_to_back || gr->fan_debug || go->in_lut_fbo)
+		return false;
+
+	if (go->depth_bits < 0)
+		glGetIntegerv(GL_DEPTH_BITS, &go->depth_bits);
+
+	return go->depth_bits > 0;
+}
+
+/* Draw a view, with a GPU timer query around it for the timeline when
+ * timed is set. */
+static void
+draw_view_timed(struct weston_view *ev, struct weston_output *output,
+		pixman_region32_t *damage, enum draw_pass pass, bool timed)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct timeline_view_timer *timer = NULL;
+	struct timespec begin;
+
+	if (timed)
+		timer = timeline_view_timer_begin(gr, output, ev->surface);
+
+	weston_surface_cpu_begin(&begin);
+	draw_view(ev, output, damage, pass);
+	weston_surface_cpu_end(ev->surface, WESTON_CLIENT_CPU_DRAW, &begin);
+
+	if (timer) {
+		/* a queued atlas draw belongs to this view */
+		atlas_batch_flush(gr, output);
+		gr->end_query(GL_TIME_ELAPSED_EXT);
+	}
+}
+
+static void
+tree_cache_destroy(struct gl_tree_cache *cache)
+{
+	if (!cache)
+		return;
+
+	glDeleteFramebuffers(1, &cache->fbo);
+	glDeleteTextures(1, &cache->tex);
+	free(cache);
+}
+
+static struct weston_view *
+view_tree_root(struct weston_view *view)
+{
+	while (view->geometry.parent)
+		view = view->geometry.parent;
+
+	return view;
+}
+
+static uint64_t
+tree_hash(uint64_t hash, uint64_t value)
+{
+	return (hash ^ value) * 0x100000001b3ull;
+}
+
+static uint64_t
+tree_hash_float(uint64_t hash, float value)
+{
+	uint32_t bits;
+
+	memcpy(&bits, &value, sizeof bits);
+	return tree_hash(hash, bits);
+}
+
+/*
+ * The views of a tree follow each other in the view list, the ones of
+ * views[i] going from i towards the front. Returns how many there are, or 0
+ * when the tree cannot be cached, and sets the signature of its content and
+ * its bounding rectangle in root surface coordinates.
+ */
+static size_t
+view_tree_scan(struct weston_view **views, size_t i, struct weston_view *root,
+	       uint64_t *signature, float rect[4])
+{
+	struct weston_compositor *ec = root->surface->compositor;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	size_t count;
+
+	rect[0] = rect[1] = FLT_MAX;
+	rect[2] = rect[3] = -FLT_MAX;
+
+	for (count = 0; count <= i; count++) {
+		struct weston_view *v = views[i - count];
+		struct gl_surface_state *gs;
+		struct weston_view *p;
+		float x = 0.0f, y = 0.0f;
+
+		if (view_tree_root(v) != root)
+			break;
+
+		if (v->plane != &ec->primary_plane ||
+		    v->alpha != root->alpha || v->geometry.scissor_enabled ||
+		    v->surface->desired_protection != WESTON_HDCP_DISABLE)
+			return 0;
+
+		gs = get_surface_state(v->surface);
+		if (!gs->shader || gs->direct_display)
+			return 0;
+
+		for (p = v; p != root; p = p->geometry.parent) {
+			x += p->geometry.x;
+			y += p->geometry.y;
+		}
+
+		rect[0] = MIN(rect[0], x);
+		rect[1] = MIN(rect[1], y);
+		rect[2] = MAX(rect[2], x + v->surface->width);
+		rect[3] = MAX(rect[3], y + v->surface->height);
+
+		hash = tree_hash(hash, (uintptr_t)v->surface);
+		hash = tree_hash(hash, gs->content_serial);
+		hash = tree_hash_float(hash, x);
+		hash = tree_hash_float(hash, y);
+		hash = tree_hash(hash, v->surface->width);
+		hash = tree_hash(hash, v->surface->height);
+	}
+
+	/* a single view is drawn as well directly */
+	if (count < 2)
+		return 0;
 
+	*signature = hash;
+	return count;
+}
 
- /* Checks if a view needs to be censored on an output
-  * Checks for 2 types of censor requirements
-  * - recording_censor: Censor protected view when a
-  *   protected view is captured.
-  * - unprotected_censor: Censor regions of protected views
-  *   when displayed on an output which has lower protection capability.
-  * Returns the originally stored gl_shader if content censoring is required,
-  * NULL otherwise.
-  */
-static struct gl_shader *
-setup_censor_overrides(struct weston_output *output,
-		       struct weston_view *ev)
+/* Draw the views views[i] to views[i - count + 1] of an untransformed tree
+ * into its cache. */
+static bool
+tree_cache_capture(struct weston_output *output, struct gl_tree_cache *cache,
+		   struct weston_view *root, struct weston_view **views,
+		   size_t i, size_t count)
 {
-	struct gl_shader *replaced_shader = NULL;
-	struct weston_compositor *ec = ev->surface->compositor;
-	struct gl_renderer *gr = get_renderer(ec);
-	struct gl_surface_state *gs = get_surface_state(ev->surface);
-	bool recording_censor =
-		(output->disable_planes > 0) &&
-		(ev->surface->desired_protection > WESTON_HDCP_DISABLE);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_output_state *go = get_output_state(output);
+	struct weston_matrix saved_matrix = go->output_matrix;
+	pixman_region32_t region, saved_clip;
+	float scale = weston_output_get_scale_factor(output);
+	int width = ceilf(cache->width * scale);
+	int height = ceilf(cache->height * scale);
+	float gx, gy;
+	size_t k;
+
+	if (width > GL_TREE_CACHE_MAX_SIZE || height > GL_TREE_CACHE_MAX_SIZE)
+		return false;
 
-	bool unprotected_censor =
-		(ev->surface->desired_protection > output->current_protection);
+	if (!cache->tex)
+		glGenTextures(1, &cache->tex);
+	if (cache->tex_width != width || cache->tex_height != height) {
+		glBindTexture(GL_TEXTURE_2D, cache->tex);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
+				GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T,
+				GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0,
+			     GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		cache->tex_width = width;
+		cache->tex_height = height;
+	}
 
-	if (gs->direct_display) {
-		gs->color[0] = 0.40;
-		gs->color[1] = 0.0;
-		gs->color[2] = 0.0;
-		gs->color[3] = 1.0;
-		gs->shader = &gr->solid_shader;
-		return gs->shader;
+	if (!cache->fbo) {
+		glGenFramebuffers(1, &cache->fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, cache->fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+				       GL_TEXTURE_2D, cache->tex, 0);
+	} else {
+		glBindFramebuffer(GL_FRAMEBUFFER, cache->fbo);
+	}
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+	    GL_FRAMEBUFFER_COMPLETE) {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		return false;
 	}
 
-	/* When not in enforced mode, the client is notified of the protection */
-	/* change, so content censoring is not required */
-	if (ev->surface->protection_mode !=
-	    WESTON_SURFACE_PROTECTION_MODE_ENFORCED)
-		return NULL;
+	glViewport(0, 0, width, height);
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
 
-	if (recording_censor || unprotected_censor) {
-		replaced_shader = gs->shader;
-		gs->color[0] = 0.40;
-		gs->color[1] = 0.0;
-		gs->color[2] = 0.0;
-		gs->color[3] = 1.0;
-		gs->shader = &gr->solid_shader;
+	/* The top of the tree goes to the top of the texture. */
+	weston_view_to_global_float(root, cache->x, cache->y, &gx, &gy);
+	weston_matrix_init(&go->output_matrix);
+	weston_matrix_translate(&go->output_matrix, -gx, -gy, 0.0f);
+	weston_matrix_scale(&go->output_matrix,
+			    2.0f / cache->width, -2.0f / cache->height, 1.0f);
+	weston_matrix_translate(&go->output_matrix, -1.0f, 1.0f, 0.0f);
+
+	pixman_region32_init_rect(&region, floorf(gx), floorf(gy),
+				  ceilf(cache->width) + 1,
+				  ceilf(cache->height) + 1);
+	pixman_region32_init(&saved_clip);
+
+	/* Whatever covers the views on screen is not part of the tree. */
+	go->in_tree_capture = true;
+	for (k = 0; k < count; k++) {
+		struct weston_view *v = views[i - k];
+
+		pixman_region32_copy(&saved_clip, &v->clip);
+		pixman_region32_clear(&v->clip);
+		draw_view(v, output, &region, DRAW_PASS_ALL);
+		pixman_region32_copy(&v->clip, &saved_clip);
 	}
+	atlas_batch_flush(gr, output);
+	go->in_tree_capture = false;
 
-	return replaced_shader;
+	pixman_region32_fini(&saved_clip);
+	pixman_region32_fini(&region);
+
+	go->output_matrix = saved_matrix;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	output_set_render_viewport(output);
+
+	return true;
 }
 
 static void
-draw_view(struct weston_view *ev, struct weston_output *output,
-	  pixman_region32_t *damage) /* in global coordinates */
+tree_cache_draw(struct weston_output *output, struct gl_tree_cache *cache,
+		struct weston_view *root, pixman_region32_t *repaint)
 {
-	struct weston_compositor *ec = ev->surface->compositor;
-	struct gl_renderer *gr = get_renderer(ec);
-	struct gl_surface_state *gs = get_surface_state(ev->surface);
-	/* repaint bounding region in global coordinates: */
-	pixman_region32_t repaint;
-	/* opaque region in surface coordinates: */
-	pixman_region32_t surface_opaque;
-	/* non-opaque region in surface coordinates: */
-	pixman_region32_t surface_blend;
+	static const GLfloat texcoord[] = {
+		0.0f, 1.0f,
+		1.0f, 1.0f,
+		1.0f, 0.0f,
+		0.0f, 0.0f,
+	};
+	static const GLushort indices[] = { 0, 1, 3, 3, 1, 2 };
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_shader *shader = &gr->texture_shader_rgba;
+	GLfloat verts[8];
 	GLint filter;
-	int i;
-	struct gl_shader *replaced_shader = NULL;
-
-	/* In case of a runtime switch of renderers, we may not have received
-	 * an attach for this surface since the switch. In that case we don't
-	 * have a valid buffer or a proper shader set up so skip rendering. */
-	if (!gs->shader && !gs->direct_display)
-		return;
+	EGLint *rects;
+	EGLint n, j;
+
+	weston_view_to_global_float(root, cache->x, cache->y,
+				    &verts[0], &verts[1]);
+	weston_view_to_global_float(root, cache->x + cache->width, cache->y,
+				    &verts[2], &verts[3]);
+	weston_view_to_global_float(root, cache->x + cache->width,
+				    cache->y + cache->height,
+				    &verts[4], &verts[5]);
+	weston_view_to_global_float(root, cache->x, cache->y + cache->height,
+				    &verts[6], &verts[7]);
 
-	pixman_region32_init(&repaint);
-	pixman_region32_intersect(&repaint,
-				  &ev->transform.boundingbox, damage);
-	pixman_region32_subtract(&repaint, &repaint, &ev->clip);
-
-	if (!pixman_region32_not_empty(&repaint))
-		goto out;
+	use_shader(gr, shader);
+	shader_set_proj(shader, go->output_matrix.d);
+	shader_set_alpha(shader, root->alpha);
 
-	if (ensure_surface_buffer_is_ready(gr, gs) < 0)
-		goto out;
+	if (root->transform.enabled ||
+	    cache->tex_width !=
+	    (int)ceilf(cache->width * weston_output_get_scale_factor(output)))
+		filter = GL_LINEAR;
+	else
+		filter = GL_NEAREST;
 
-	replaced_shader = setup_censor_overrides(output, ev);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, cache->tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
 
+	glEnable(GL_BLEND);
 	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
 
-	if (gr->fan_debug) {
-		use_shader(gr, &gr->solid_shader);
-		shader_uniforms(&gr->solid_shader, ev, output);
-	}
-
-	use_shader(gr, gs->shader);
-	shader_uniforms(gs->shader, ev, output);
-
-	if (ev->transform.enabled || output->zoom.active ||
-	    output->current_scale != ev->surface->buffer_viewport.buffer.scale)
-		filter = GL_LINEAR;
-	else
-		filter = GL_NEAREST;
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, texcoord);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
 
-	for (i = 0; i < gs->num_textures; i++) {
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(gs->target, gs->textures[i]);
-		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, filter);
-		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, filter);
+	pixman_region_to_egl_y_invert(output, repaint, &rects, &n);
+	glEnable(GL_SCISSOR_TEST);
+	for (j = 0; j < n; j++) {
+		glScissor(rects[j * 4 + 0], rects[j * 4 + 1],
+			  rects[j * 4 + 2], rects[j * 4 + 3]);
+		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, indices);
 	}
+	glDisable(GL_SCISSOR_TEST);
+	free(rects);
 
-	/* blended region is whole surface minus opaque region: */
-	pixman_region32_init_rect(&surface_blend, 0, 0,
-				  ev->surface->width, ev->surface->height);
-	if (ev->geometry.scissor_enabled)
-		pixman_region32_intersect(&surface_blend, &surface_blend,
-					  &ev->geometry.scissor);
-	pixman_region32_subtract(&surface_blend, &surface_blend,
-				 &ev->surface->opaque);
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+}
 
-	/* XXX: Should we be using ev->transform.opaque here? */
-	pixman_region32_init(&surface_opaque);
-	if (ev->geometry.scissor_enabled)
-		pixman_region32_intersect(&surface_opaque,
-					  &ev->surface->opaque,
-					  &ev->geometry.scissor);
-	else
-		pixman_region32_copy(&surface_opaque, &ev->surface->opaque);
-
-	if (pixman_region32_not_empty(&surface_opaque)) {
-		if (gs->shader == &gr->texture_shader_rgba) {
-			/* Special case for RGBA textures with possibly
-			 * bad data in alpha channel: use the shader
-			 * that forces texture alpha = 1.0.
-			 * Xwayland surfaces need this.
-			 */
-			use_shader(gr, &gr->texture_shader_rgbx);
-			shader_uniforms(&gr->texture_shader_rgbx, ev, output);
-		}
+/* Draw the tree of views[i] from its cache, if it has one or it can be
+ * made now. Returns the number of views drawn, 0 to draw them one by one. */
+static size_t
+draw_view_tree_cached(struct weston_output *output, struct weston_view **views,
+		      size_t i, pixman_region32_t *damage)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct weston_view *root = view_tree_root(views[i]);
+	struct gl_surface_state *rs = get_surface_state(root->surface);
+	struct gl_tree_cache *cache = rs->tree_cache;
+	pixman_region32_t repaint;
+	uint64_t signature;
+	float rect[4];
+	size_t count, k;
 
-		if (ev->alpha < 1.0)
-			glEnable(GL_BLEND);
-		else
-			glDisable(GL_BLEND);
+	if (output->zoom.active || output_render_scaled(output) ||
+	    output_has_borders(output) || gr->fan_debug ||
+	    gr->fragment_shader_debug)
+		return 0;
 
-		repaint_region(ev, &repaint, &surface_opaque);
-		gs->used_in_output_repaint = true;
+	count = view_tree_scan(views, i, root, &signature, rect);
+	if (count == 0)
+		return 0;
+
+	if (!cache) {
+		cache = zalloc(sizeof *cache);
+		if (!cache)
+			return 0;
+		rs->tree_cache = cache;
 	}
 
-	if (pixman_region32_not_empty(&surface_blend)) {
-		use_shader(gr, gs->shader);
-		glEnable(GL_BLEND);
-		repaint_region(ev, &repaint, &surface_blend);
-		gs->used_in_output_repaint = true;
+	if (cache->signature != signature) {
+		cache->signature = signature;
+		cache->stable_frames = 0;
+		cache->valid = false;
+		return 0;
 	}
 
-	pixman_region32_fini(&surface_blend);
-	pixman_region32_fini(&surface_opaque);
+	if (!cache->valid) {
+		if (++cache->stable_frames < GL_TREE_CACHE_STABLE_FRAMES ||
+		    root->transform.enabled)
+			return 0;
+
+		cache->x = rect[0];
+		cache->y = rect[1];
+		cache->width = rect[2] - rect[0];
+		cache->height = rect[3] - rect[1];
+		if (!tree_cache_capture(output, cache, root, views, i, count))
+			return 0;
+		cache->valid = true;
+	}
 
-out:
+	/* The topmost view of the tree is clipped by what is above it. */
+	pixman_region32_init(&repaint);
+	for (k = 0; k < count; k++)
+		pixman_region32_union(&repaint, &repaint,
+				      &views[i - k]->transform.boundingbox);
+	pixman_region32_intersect(&repaint, &repaint, damage);
+	pixman_region32_subtract(&repaint, &repaint,
+				 &views[i - count + 1]->clip);
+
+	if (pixman_region32_not_empty(&repaint))
+		tree_cache_draw(output, cache, root, &repaint);
 	pixman_region32_fini(&repaint);
 
-	if (replaced_shader)
-		gs->shader = replaced_shader;
+	return count;
 }
 
 static void
 repaint_views(struct weston_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
-	struct weston_view *view;
+	struct gl_renderer *gr = get_renderer(compositor);
+	struct gl_output_state *go = get_output_state(output);
+	struct weston_view **views = output->view_array.data;
+	size_t n = output->view_array.size / sizeof *views;
+	size_t i = n;
+	bool timed;
+
+	timed = gr->has_timer_query && !gr->fan_debug &&
+		(weston_log_scope_is_enabled(compositor->timeline) ||
+		 weston_log_scope_is_enabled(compositor->timeline_trace));
+
+	if (!output_can_depth_test(output)) {
+		/* Back to front, using only the views overlapping this
+		 * output */
+		while (i-- > 0) {
+			size_t drawn = 0;
+
+			if (views[i]->plane != &compositor->primary_plane)
+				continue;
+
+			if (gr->tree_cache && !go->in_lut_fbo) {
+				atlas_batch_flush(gr, output);
+				drawn = draw_view_tree_cached(output, views, i,
+							      damage);
+			}
+			if (drawn > 0)
+				i -= drawn - 1;
+			else
+				draw_view_timed(views[i], output, damage,
+						DRAW_PASS_ALL, timed);
+		}
+		atlas_batch_flush(gr, output);
+		return;
+	}
+
+	/* Every view gets its own depth, decreasing towards the top of the
+	 * stack and always below the cleared value of 1.0. Opaque regions
+	 * are drawn front to back first, so that anything they hide fails
+	 * the depth test, then the rest is blended back to front, testing
+	 * against but not writing depth. */
+	go->depth_test = true;
+	glDepthMask(GL_TRUE);
+	glClearDepthf(1.0f);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glEnable(GL_DEPTH_TEST);
+	glDepthFunc(GL_LESS);
 
-	wl_list_for_each_reverse(view, &compositor->view_list, link)
-		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+	for (i = 0; i < n; i++) {
+		if (views[i]->plane != &compositor->primary_plane)
+			continue;
+		go->view_depth = 2.0f * (i + 1) / (n + 1) - 1.0f;
+		draw_view_timed(views[i], output, damage,
+				DRAW_PASS_OPAQUE, timed);
+	}
+
+	glDepthMask(GL_FALSE);
+	i = n;
+	while (i-- > 0) {
+		if (views[i]->plane != &compositor->primary_plane)
+			continue;
+		go->view_depth = 2.0f * (i + 1) / (n + 1) - 1.0f;
+		draw_view_timed(views[i], output, damage,
+				DRAW_PASS_BLEND, timed);
+	}
+
+	glDisable(GL_DEPTH_TEST);
+	glDepthMask(GL_TRUE);
+	go->depth_test = false;
 }
 
 static int
@@ -1016,13 +2627,15 @@ static void
 update_buffer_release_fences(struct weston_compositor *compositor,
 			     struct weston_output *output)
 {
-	struct weston_view *view;
+	struct weston_view *view, **evp;
 
-	wl_list_for_each_reverse(view, &compositor->view_list, link) {
+	wl_array_for_each(evp, &output->view_array) {
 		struct gl_surface_state *gs;
 		struct weston_buffer_release *buffer_release;
 		int fence_fd;
 
+		view = *evp;
+
 		if (view->plane != &compositor->primary_plane)
 			continue;
 
@@ -1182,9 +2795,8 @@ draw_output_borders(struct weston_output *output,
 	weston_matrix_translate(&matrix, -full_width/2.0, -full_height/2.0, 0);
 	weston_matrix_scale(&matrix, 2.0/full_width, -2.0/full_height, 1);
 	glUniformMatrix4fv(shader->proj_uniform, 1, GL_FALSE, matrix.d);
-
-	glUniform1i(shader->tex_uniforms[0], 0);
 	glUniform1f(shader->alpha_uniform, 1);
+	shader->uniforms_valid = false;
 	glActiveTexture(GL_TEXTURE0);
 
 	if (border_status & BORDER_TOP_DIRTY)
@@ -1252,7 +2864,9 @@ output_get_damage(struct weston_output *output,
 	EGLBoolean ret;
 	int i;
 
-	if (gr->has_egl_buffer_age) {
+	if (go->preserves_contents) {
+		buffer_age = go->contents_valid ? 1 : 0;
+	} else if (gr->has_egl_buffer_age) {
 		ret = eglQuerySurface(gr->egl_display, go->egl_surface,
 				      EGL_BUFFER_AGE_EXT, &buffer_age);
 		if (ret == EGL_FALSE) {
@@ -1290,6 +2904,13 @@ output_rotate_damage(struct weston_output *output,
 	struct gl_output_state *go = get_output_state(output);
 	struct gl_renderer *gr = get_renderer(output->compositor);
 
+	/* With only one buffer there is no history to keep, but a resize
+	 * has to repaint all of it once more. */
+	if (go->preserves_contents) {
+		go->contents_valid = !(border_status & BORDER_SIZE_CHANGED);
+		return;
+	}
+
 	if (!gr->has_egl_buffer_age)
 		return;
 
@@ -1333,10 +2954,7 @@ pixman_region_to_egl_y_invert(struct weston_output *output,
 	pixman_region32_init(&transformed);
 	pixman_region32_copy(&transformed, global_region);
 	pixman_region32_translate(&transformed, -output->x, -output->y);
-	weston_transformed_region(output->width, output->height,
-				  output->transform,
-				  output->current_scale,
-				  &transformed, &transformed);
+	weston_output_transformed_region(output, &transformed, &transformed);
 
 	/* If we have borders drawn around the output, shift our output damage
 	 * to account for borders being drawn around the outside, adding any
@@ -1369,6 +2987,229 @@ pixman_region_to_egl_y_invert(struct weston_output *output,
 	pixman_region32_fini(&transformed);
 }
 
+static void
+output_color_lut_release(struct gl_output_state *go)
+{
+	glDeleteTextures(1, &go->lut_tex);
+	glDeleteTextures(1, &go->lut_fbo_tex);
+	glDeleteFramebuffers(1, &go->lut_fbo);
+	go->lut_tex = 0;
+	go->lut_fbo_tex = 0;
+	go->lut_fbo = 0;
+}
+
+/* Whether the output is drawn below its mode size, for the backend to scale
+ * up. The damage then is in the wrong scale for the EGL damage hints. */
+static bool
+output_render_scaled(struct weston_output *output)
+{
+	struct gl_output_state *go = get_output_state(output);
+
+	return go->render_width != output->current_mode->width ||
+	       go->render_height != output->current_mode->height;
+}
+
+/* A scaled frame goes into the top-left corner of the buffer, which is the
+ * top of the GL window coordinates. */
+static void
+output_set_render_viewport(struct weston_output *output)
+{
+	struct gl_output_state *go = get_output_state(output);
+
+	glViewport(go->borders[GL_RENDERER_BORDER_LEFT].width,
+		   go->borders[GL_RENDERER_BORDER_BOTTOM].height +
+		   output->current_mode->height - go->render_height,
+		   go->render_width, go->render_height);
+}
+
+/* Upload a new LUT and size the intermediate framebuffer to the mode.
+ * Returns whether the color transform pass is to be used. */
+static bool
+output_color_lut_prepare(struct weston_output *output)
+{
+	struct gl_output_state *go = get_output_state(output);
+	int32_t width = output->current_mode->width;
+	int32_t height = output->current_mode->height;
+	unsigned int n = go->lut_size;
+
+	if (go->lut_dirty) {
+		go->lut_dirty = false;
+		if (!go->lut) {
+			output_color_lut_release(go);
+			return false;
+		}
+
+		if (!go->lut_tex)
+			glGenTextures(1, &go->lut_tex);
+		glBindTexture(GL_TEXTURE_2D, go->lut_tex);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, n * n, n, 0,
+			     GL_RGBA, GL_UNSIGNED_BYTE, go->lut);
+	}
+
+	if (!go->lut_tex)
+		return false;
+
+	if (go->lut_fbo &&
+	    go->lut_fbo_width == width && go->lut_fbo_height == height)
+		return true;
+
+	if (!go->lut_fbo_tex)
+		glGenTextures(1, &go->lut_fbo_tex);
+	glBindTexture(GL_TEXTURE_2D, go->lut_fbo_tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0,
+		     GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+	if (!go->lut_fbo)
+		glGenFramebuffers(1, &go->lut_fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, go->lut_fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			       GL_TEXTURE_2D, go->lut_fbo_tex, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+	    GL_FRAMEBUFFER_COMPLETE) {
+		weston_log("%s: cannot render for the color transform, "
+			   "disabling it\n", output->name);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		output_color_lut_release(go);
+		free(go->lut);
+		go->lut = NULL;
+		return false;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	go->lut_fbo_width = width;
+	go->lut_fbo_height = height;
+	go->lut_fbo_fresh = true;
+
+	return true;
+}
+
+/* Draw the damaged part of the composited output through the LUT */
+static void
+output_color_lut_draw(struct weston_output *output, pixman_region32_t *damage)
+{
+	static const GLfloat verts[] = {
+		-1.0f, -1.0f,
+		1.0f, -1.0f,
+		1.0f, 1.0f,
+		-1.0f, 1.0f,
+	};
+	static const GLushort indices[] = { 0, 1, 3, 3, 1, 2 };
+	struct gl_output_state *go = get_output_state(output);
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_shader *shader = &gr->color_lut_shader;
+	bool fragment_debug = gr->fragment_shader_debug;
+	bool scaled = output_render_scaled(output);
+	struct weston_matrix identity;
+	GLfloat s = (GLfloat) go->render_width / go->lut_fbo_width;
+	GLfloat t = (GLfloat) go->render_height / go->lut_fbo_height;
+	GLfloat texcoord[] = {
+		0.0f, 0.0f,
+		s, 0.0f,
+		s, t,
+		0.0f, t,
+	};
+	EGLint *rects;
+	EGLint n, i;
+
+	output_set_render_viewport(output);
+	glDisable(GL_BLEND);
+
+	/* The views already got the debug tint. */
+	gr->fragment_shader_debug = false;
+	use_shader(gr, shader);
+	gr->fragment_shader_debug = fragment_debug;
+
+	weston_matrix_init(&identity);
+	glUniformMatrix4fv(shader->proj_uniform, 1, GL_FALSE, identity.d);
+	glUniform1f(shader->lut_size_uniform, go->lut_size);
+	shader->uniforms_valid = false;
+
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, go->lut_tex);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, go->lut_fbo_tex);
+
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, texcoord);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+
+	/* Outside of the damage, the buffer may still hold older frames.
+	 * A scaled frame is always drawn whole. */
+	if (scaled) {
+		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, indices);
+	} else {
+		pixman_region_to_egl_y_invert(output, damage, &rects, &n);
+		glEnable(GL_SCISSOR_TEST);
+		for (i = 0; i < n; i++) {
+			glScissor(rects[i * 4 + 0], rects[i * 4 + 1],
+				  rects[i * 4 + 2], rects[i * 4 + 3]);
+			glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT,
+				       indices);
+		}
+		glDisable(GL_SCISSOR_TEST);
+		free(rects);
+	}
+
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+}
+
+static int
+gl_renderer_output_set_color_transform(struct weston_output *output,
+				       const struct weston_color_transform *xform)
+{
+	struct gl_output_state *go = get_output_state(output);
+	unsigned int n, r, g, b, c;
+	const float *src;
+	uint8_t *dst;
+
+	free(go->lut);
+	go->lut = NULL;
+	go->lut_size = 0;
+	go->lut_dirty = true;
+
+	if (!xform)
+		return 0;
+
+	n = xform->lut_size;
+	if (n < 2 || !xform->lut)
+		return -1;
+
+	go->lut = malloc(n * n * n * 4);
+	if (!go->lut)
+		return -1;
+
+	/* Blue slices side by side: texel (r + b * n, g) */
+	src = xform->lut;
+	for (b = 0; b < n; b++) {
+		for (g = 0; g < n; g++) {
+			for (r = 0; r < n; r++) {
+				dst = go->lut + ((g * n + b) * n + r) * 4;
+				for (c = 0; c < 3; c++, src++)
+					dst[c] = *src <= 0.0f ? 0 :
+						 *src >= 1.0f ? 255 :
+						 *src * 255.0f + 0.5f;
+				dst[3] = 255;
+			}
+		}
+	}
+	go->lut_size = n;
+
+	return 0;
+}
+
 /* NOTE: We now allow falling back to ARGB gl visuals when XRGB is
  * unavailable, so we're assuming the background has no transparency
  * and that everything with a blend, like drop shadows, will have something
@@ -1391,14 +3232,32 @@ gl_renderer_repaint_output(struct weston_output *output,
 	/* total area we need to repaint this time */
 	pixman_region32_t total_damage;
 	enum gl_border_status border_status = BORDER_STATUS_CLEAN;
-	struct weston_view *view;
+	struct weston_view *view, **evp;
+	struct timeline_render_point *begin_trp, *end_trp;
+	bool color_lut;
+	bool render_size_changed;
+	bool damage_hints;
+	int32_t render_width, render_height;
 
 	if (use_output(output) < 0)
 		return;
 
+	/* Buffers drawn at another size need a full repaint. */
+	weston_output_get_render_size(output, &render_width, &render_height);
+	render_size_changed = render_width != go->render_width ||
+			      render_height != go->render_height;
+	if (render_size_changed) {
+		go->render_width = render_width;
+		go->render_height = render_height;
+		go->border_status |= BORDER_SIZE_CHANGED;
+		go->lut_fbo_fresh = true;
+	}
+	damage_hints = !gr->fan_debug && !output_render_scaled(output);
+
 	/* Clear the used_in_output_repaint flag, so that we can properly track
 	 * which surfaces were used in this output repaint. */
-	wl_list_for_each_reverse(view, &compositor->view_list, link) {
+	wl_array_for_each(evp, &output->view_array) {
+		view = *evp;
 		if (view->plane == &compositor->primary_plane) {
 			struct gl_surface_state *gs =
 				get_surface_state(view->surface);
@@ -1412,12 +3271,21 @@ gl_renderer_repaint_output(struct weston_output *output,
 		gr->destroy_sync(gr->egl_display, go->end_render_sync);
 
 	go->begin_render_sync = create_render_sync(gr);
-
-	/* Calculate the viewport */
-	glViewport(go->borders[GL_RENDERER_BORDER_LEFT].width,
-		   go->borders[GL_RENDERER_BORDER_BOTTOM].height,
-		   output->current_mode->width,
-		   output->current_mode->height);
+	gr->draw_calls = 0;
+
+	if (gr->has_timer_query)
+		timeline_view_timers_poll(gr, output);
+
+	/* Calculate the viewport; the views of a color transformed output are
+	 * composited without borders into the intermediate framebuffer. */
+	color_lut = output_color_lut_prepare(output);
+	if (color_lut) {
+		glBindFramebuffer(GL_FRAMEBUFFER, go->lut_fbo);
+		glViewport(0, 0, go->render_width, go->render_height);
+		go->in_lut_fbo = true;
+	} else {
+		output_set_render_viewport(output);
+	}
 
 	/* Calculate the global GL matrix */
 	go->output_matrix = output->matrix;
@@ -1457,9 +3325,11 @@ gl_renderer_repaint_output(struct weston_output *output,
 	 * as well as the areas we now want to repaint, to make sure the
 	 * buffer is up to date. */
 	pixman_region32_union(&total_damage, &previous_damage, output_damage);
+	if (render_size_changed)
+		pixman_region32_copy(&total_damage, &output->region);
 	border_status |= go->border_status;
 
-	if (gr->has_egl_partial_update && !gr->fan_debug) {
+	if (gr->has_egl_partial_update && damage_hints) {
 		int n_egl_rects;
 		EGLint *egl_rects;
 
@@ -1473,18 +3343,39 @@ gl_renderer_repaint_output(struct weston_output *output,
 		free(egl_rects);
 	}
 
-	repaint_views(output, &total_damage);
+	if (color_lut) {
+		/* The intermediate framebuffer is not swapped, so only what
+		 * changed since the last repaint needs compositing, while the
+		 * whole buffer age damage is drawn through the LUT. */
+		pixman_region32_t fbo_damage;
+
+		pixman_region32_init(&fbo_damage);
+		pixman_region32_copy(&fbo_damage, go->lut_fbo_fresh ?
+				     &output->region : output_damage);
+		repaint_views(output, &fbo_damage);
+		pixman_region32_fini(&fbo_damage);
+		go->lut_fbo_fresh = false;
+
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		go->in_lut_fbo = false;
+		output_color_lut_draw(output, &total_damage);
+	} else {
+		repaint_views(output, &total_damage);
+	}
 
 	pixman_region32_fini(&total_damage);
 	pixman_region32_fini(&previous_damage);
 
 	draw_output_borders(output, border_status);
 
+	TL_POINT(compositor, "renderer_draw_calls", TLP_OUTPUT(output),
+		 TLP_DRAW_CALLS(&gr->draw_calls), TLP_END);
+
 	wl_signal_emit(&output->frame_signal, output_damage);
 
 	go->end_render_sync = create_render_sync(gr);
 
-	if (gr->swap_buffers_with_damage && !gr->fan_debug) {
+	if (gr->swap_buffers_with_damage && damage_hints) {
 		int n_egl_rects;
 		EGLint *egl_rects;
 
@@ -1512,13 +3403,33 @@ gl_renderer_repaint_output(struct weston_output *output,
 	/* We have to submit the render sync objects after swap buffers, since
 	 * the objects get assigned a valid sync file fd only after a gl flush.
 	 */
-	timeline_submit_render_sync(gr, compositor, output,
-				    go->begin_render_sync,
-				    TIMELINE_RENDER_POINT_TYPE_BEGIN);
-	timeline_submit_render_sync(gr, compositor, output, go->end_render_sync,
-				    TIMELINE_RENDER_POINT_TYPE_END);
+	begin_trp = timeline_submit_render_sync(gr, compositor, output,
+						go->begin_render_sync,
+						TIMELINE_RENDER_POINT_TYPE_BEGIN);
+	end_trp = timeline_submit_render_sync(gr, compositor, output,
+					      go->end_render_sync,
+					      TIMELINE_RENDER_POINT_TYPE_END);
+	if (begin_trp && end_trp) {
+		begin_trp->pair = end_trp;
+		end_trp->pair = begin_trp;
+	}
 
 	update_buffer_release_fences(compositor, output);
+
+	gl_renderer_evict_textures(gr);
+}
+
+static GLenum
+gl_read_format_from_pixman(pixman_format_code_t format)
+{
+	switch (format) {
+	case PIXMAN_a8r8g8b8:
+		return GL_BGRA_EXT;
+	case PIXMAN_a8b8g8r8:
+		return GL_RGBA;
+	default:
+		return GL_NONE;
+	}
 }
 
 static int
@@ -1533,16 +3444,9 @@ gl_renderer_read_pixels(struct weston_output *output,
 	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
 	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
 
-	switch (format) {
-	case PIXMAN_a8r8g8b8:
-		gl_format = GL_BGRA_EXT;
-		break;
-	case PIXMAN_a8b8g8r8:
-		gl_format = GL_RGBA;
-		break;
-	default:
+	gl_format = gl_read_format_from_pixman(format);
+	if (gl_format == GL_NONE)
 		return -1;
-	}
 
 	if (use_output(output) < 0)
 		return -1;
@@ -1554,6 +3458,219 @@ gl_renderer_read_pixels(struct weston_output *output,
 	return 0;
 }
 
+/* Copy the pixels out of the PBO and complete the read. Needs the context
+ * current and the fence signalled. */
+static void
+gl_readback_finish(struct gl_renderer *gr, struct gl_readback *rb,
+		   bool success)
+{
+	int status = -1;
+	void *map;
+
+	if (success) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+		map = gr->map_buffer_range(GL_PIXEL_PACK_BUFFER, 0, rb->size,
+					   GL_MAP_READ_BIT_EXT);
+		if (map) {
+			memcpy(rb->pixels, map, rb->size);
+			gr->unmap_buffer(GL_PIXEL_PACK_BUFFER);
+			status = 0;
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+
+	glDeleteBuffers(1, &rb->pbo);
+	gr->delete_sync(rb->fence);
+	wl_list_remove(&rb->link);
+
+	rb->done(rb->data, status);
+	free(rb);
+}
+
+static int
+gl_readback_timer_handler(void *data)
+{
+	struct gl_renderer *gr = data;
+	struct gl_readback *rb;
+	GLenum status;
+
+	/* Complete in submission order, so that consumers such as the
+	 * recorder see their frames in order. */
+	while (!wl_list_empty(&gr->readback_list)) {
+		rb = container_of(gr->readback_list.next,
+				  struct gl_readback, link);
+
+		if (use_output(rb->output) < 0) {
+			gl_readback_finish(gr, rb, false);
+			continue;
+		}
+
+		status = gr->client_wait_sync(rb->fence,
+					      GL_SYNC_FLUSH_COMMANDS_BIT_APPLE,
+					      0);
+		if (status == GL_TIMEOUT_EXPIRED_APPLE)
+			break;
+
+		gl_readback_finish(gr, rb, status != GL_WAIT_FAILED_APPLE);
+	}
+
+	if (!wl_list_empty(&gr->readback_list))
+		wl_event_source_timer_update(gr->readback_timer,
+					     READBACK_POLL_MS);
+
+	return 0;
+}
+
+/* Block until the pending reads of output are done, before its surface
+ * goes away. */
+static void
+gl_renderer_finish_readbacks(struct gl_renderer *gr,
+			     struct weston_output *output)
+{
+	struct gl_readback *rb;
+	GLenum status;
+	bool found;
+
+	do {
+		found = false;
+		wl_list_for_each(rb, &gr->readback_list, link) {
+			if (output && rb->output != output)
+				continue;
+
+			status = gr->client_wait_sync(rb->fence,
+						      GL_SYNC_FLUSH_COMMANDS_BIT_APPLE,
+						      READBACK_FINISH_TIMEOUT_NS);
+			gl_readback_finish(gr, rb,
+					   status == GL_ALREADY_SIGNALED_APPLE ||
+					   status == GL_CONDITION_SATISFIED_APPLE);
+			/* done may have changed the list, restart */
+			found = true;
+			break;
+		}
+	} while (found);
+}
+
+static int
+gl_renderer_read_pixels_async(struct weston_output *output,
+			      pixman_format_code_t format, void *pixels,
+			      uint32_t x, uint32_t y,
+			      uint32_t width, uint32_t height,
+			      weston_read_pixels_done_func_t done,
+			      void *data)
+{
+	struct weston_compositor *ec = output->compositor;
+	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_output_state *go = get_output_state(output);
+	struct wl_event_loop *loop;
+	struct gl_readback *rb;
+	GLenum gl_format;
+
+	if (!gr->has_pbo_readback) {
+		if (gl_renderer_read_pixels(output, format, pixels,
+					    x, y, width, height) < 0)
+			return -1;
+
+		done(data, 0);
+		return 0;
+	}
+
+	gl_format = gl_read_format_from_pixman(format);
+	if (gl_format == GL_NONE)
+		return -1;
+
+	if (!gr->readback_timer) {
+		loop = wl_display_get_event_loop(ec->wl_display);
+		gr->readback_timer =
+			wl_event_loop_add_timer(loop, gl_readback_timer_handler,
+						gr);
+		if (!gr->readback_timer)
+			return -1;
+	}
+
+	if (use_output(output) < 0)
+		return -1;
+
+	rb = zalloc(sizeof *rb);
+	if (!rb)
+		return -1;
+
+	rb->output = output;
+	rb->size = (GLsizeiptr)width * height * 4;
+	rb->pixels = pixels;
+	rb->done = done;
+	rb->data = data;
+
+	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
+	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+
+	glGenBuffers(1, &rb->pbo);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+	glBufferData(GL_PIXEL_PACK_BUFFER, rb->size, NULL, GL_STREAM_READ);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(x, y, width, height, gl_format, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	rb->fence = gr->fence_sync(GL_SYNC_GPU_COMMANDS_COMPLETE_APPLE, 0);
+	if (!rb->fence) {
+		glDeleteBuffers(1, &rb->pbo);
+		free(rb);
+		return -1;
+	}
+
+	wl_list_insert(gr->readback_list.prev, &rb->link);
+	wl_event_source_timer_update(gr->readback_timer, READBACK_POLL_MS);
+
+	return 0;
+}
+
+/* Copy from the framebuffer just composited, still bound, into a texture
+ * of the imported dmabuf. GL rows go bottom-up, so the dmabuf ends up
+ * y-inverted like the reads. */
+static int
+gl_renderer_output_copy_to_dmabuf(struct weston_output *output,
+				  struct linux_dmabuf_buffer *dmabuf,
+				  const pixman_box32_t *rects, int n_rects)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_output_state *go = get_output_state(output);
+	struct dmabuf_image *image = linux_dmabuf_buffer_get_user_data(dmabuf);
+	int height = output->current_mode->height;
+	GLuint tex;
+	int i;
+
+	/* A frame rendered at a reduced resolution is only upscaled by the
+	 * display. */
+	if (output_render_scaled(output))
+		return -1;
+
+	if (!image || image->import_type != IMPORT_TYPE_DIRECT ||
+	    image->target != GL_TEXTURE_2D || image->num_images != 1)
+		return -1;
+
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	gr->image_target_texture_2d(GL_TEXTURE_2D, image->images[0]->image);
+
+	for (i = 0; i < n_rects; i++) {
+		glCopyTexSubImage2D(GL_TEXTURE_2D, 0,
+				    rects[i].x1, height - rects[i].y2,
+				    rects[i].x1 +
+				    go->borders[GL_RENDERER_BORDER_LEFT].width,
+				    height - rects[i].y2 +
+				    go->borders[GL_RENDERER_BORDER_BOTTOM].height,
+				    rects[i].x2 - rects[i].x1,
+				    rects[i].y2 - rects[i].y1);
+	}
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glDeleteTextures(1, &tex);
+
+	/* Submit the copy; the client synchronizes with it implicitly. */
+	glFlush();
+
+	return 0;
+}
+
 static GLenum gl_format_from_internal(GLenum internal_format)
 {
 	switch (internal_format) {
@@ -1566,6 +3683,378 @@ static GLenum gl_format_from_internal(GLenum internal_format)
 	}
 }
 
+/* Upload offsets into the PBO are aligned to this many bytes */
+#define PBO_UPLOAD_ALIGN 16
+#define PBO_FENCE_TIMEOUT_NS 1000000000ull
+
+static int
+gl_format_bytes_per_pixel(GLenum internal_format, GLenum pixel_type)
+{
+	if (pixel_type == GL_UNSIGNED_SHORT_5_6_5)
+		return 2;
+
+	switch (internal_format) {
+	case GL_R8_EXT:
+	case GL_LUMINANCE:
+		return 1;
+	case GL_RG8_EXT:
+	case GL_LUMINANCE_ALPHA:
+		return 2;
+	default:
+		return 4;
+	}
+}
+
+/** One plane of one damage rectangle staged in a PBO */
+struct pbo_upload_rect {
+	int x, y, width, height;
+	int bpp;
+	GLsizeiptr src_stride;
+	GLsizeiptr dst_stride;
+	GLsizeiptr size;
+};
+
+/* Returns false if there is nothing to upload. */
+static bool
+pbo_upload_rect_init(struct pbo_upload_rect *rect,
+		     struct gl_surface_state *gs, pixman_box32_t box, int plane)
+{
+	rect->x = box.x1 / gs->hsub[plane];
+	rect->y = box.y1 / gs->vsub[plane];
+	rect->width = (box.x2 - box.x1) / gs->hsub[plane];
+	rect->height = (box.y2 - box.y1) / gs->vsub[plane];
+	if (rect->width <= 0 || rect->height <= 0)
+		return false;
+
+	rect->bpp = gl_format_bytes_per_pixel(gs->gl_format[plane],
+					      gs->gl_pixel_type);
+	rect->src_stride = (GLsizeiptr)(gs->pitch / gs->hsub[plane]) *
+			   rect->bpp;
+
+	/* Rows are padded as GL expects for a row length of width with the
+	 * default GL_UNPACK_ALIGNMENT of 4. */
+	rect->dst_stride = ((GLsizeiptr)rect->width * rect->bpp + 3) & ~3;
+	rect->size = (rect->dst_stride * rect->height + PBO_UPLOAD_ALIGN - 1) &
+		     ~(GLsizeiptr)(PBO_UPLOAD_ALIGN - 1);
+
+	return true;
+}
+
+static void
+gl_renderer_fini_pbo_ring(struct gl_renderer *gr)
+{
+	unsigned int i;
+
+	for (i = 0; i < GL_PBO_RING_SIZE; i++) {
+		struct gl_pbo *pbo = &gr->pbo_ring[i];
+
+		if (pbo->fence)
+			gr->delete_sync(pbo->fence);
+		if (pbo->map) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo->name);
+			gr->unmap_buffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+		if (pbo->name)
+			glDeleteBuffers(1, &pbo->name);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	memset(gr->pbo_ring, 0, sizeof gr->pbo_ring);
+}
+
+static bool
+gl_renderer_init_pbo_ring(struct gl_renderer *gr)
+{
+	const GLbitfield flags = GL_MAP_WRITE_BIT_EXT |
+				 GL_MAP_PERSISTENT_BIT_EXT |
+				 GL_MAP_COHERENT_BIT_EXT;
+	unsigned int i;
+
+	while (glGetError() != GL_NO_ERROR)
+		;
+
+	for (i = 0; i < GL_PBO_RING_SIZE; i++) {
+		struct gl_pbo *pbo = &gr->pbo_ring[i];
+
+		glGenBuffers(1, &pbo->name);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo->name);
+
+		if (!gr->has_buffer_storage) {
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, GL_PBO_SEGMENT_SIZE,
+				     NULL, GL_STREAM_DRAW);
+			continue;
+		}
+
+		gr->buffer_storage(GL_PIXEL_UNPACK_BUFFER, GL_PBO_SEGMENT_SIZE,
+				   NULL, flags);
+		pbo->map = gr->map_buffer_range(GL_PIXEL_UNPACK_BUFFER, 0,
+						GL_PBO_SEGMENT_SIZE, flags);
+		if (!pbo->map)
+			break;
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	if (i < GL_PBO_RING_SIZE || glGetError() != GL_NO_ERROR) {
+		weston_log("failed to set up the SHM upload buffers\n");
+		gl_renderer_fini_pbo_ring(gr);
+		return false;
+	}
+
+	gr->pbo_current = 0;
+
+	return true;
+}
+
+/* Find room for size bytes in the ring, moving on to the next buffer when
+ * the current one is full. */
+static struct gl_pbo *
+gl_renderer_get_pbo(struct gl_renderer *gr, GLsizeiptr size)
+{
+	struct gl_pbo *pbo = &gr->pbo_ring[gr->pbo_current];
+	struct gl_pbo *next;
+	unsigned int next_index;
+	GLenum status;
+
+	if (pbo->used + size <= GL_PBO_SEGMENT_SIZE)
+		return pbo;
+
+	next_index = (gr->pbo_current + 1) % GL_PBO_RING_SIZE;
+	next = &gr->pbo_ring[next_index];
+
+	if (next->fence) {
+		status = gr->client_wait_sync(next->fence,
+					      GL_SYNC_FLUSH_COMMANDS_BIT_APPLE,
+					      PBO_FENCE_TIMEOUT_NS);
+		if (status != GL_ALREADY_SIGNALED_APPLE &&
+		    status != GL_CONDITION_SATISFIED_APPLE)
+			return NULL;
+
+		gr->delete_sync(next->fence);
+		next->fence = NULL;
+	}
+
+	pbo->fence = gr->fence_sync(GL_SYNC_GPU_COMMANDS_COMPLETE_APPLE, 0);
+	if (!pbo->fence)
+		glFinish();
+
+	gr->pbo_current = next_index;
+	next->used = 0;
+
+	return next;
+}
+
+/** Upload the SHM texture damage through the PBO ring
+ *
+ * The damaged rectangles are copied from the client buffer into a PBO, and
+ * the texture updates are then sourced from the PBO. The client buffer is
+ * no longer needed once this returns, and the GPU performs the actual
+ * transfer asynchronously, overlapping with the rendering of other views.
+ *
+ * \return false if the upload could not be staged, in which case nothing
+ * was uploaded and the caller should fall back to a direct upload.
+ */
+static bool
+gl_renderer_upload_shm_pbo(struct gl_renderer *gr,
+			   struct weston_surface *surface,
+			   struct gl_surface_state *gs,
+			   struct weston_buffer *buffer)
+{
+	struct wl_shm_buffer *shm_buffer = buffer->shm_buffer;
+	struct pbo_upload_rect rect;
+	pixman_box32_t *rectangles, full;
+	struct gl_pbo *pbo;
+	GLsizeiptr size, offset;
+	uint8_t *data, *dst;
+	int i, j, n, row;
+
+	if (gs->needs_full_upload) {
+		full.x1 = 0;
+		full.y1 = 0;
+		full.x2 = gs->pitch;
+		full.y2 = buffer->height;
+		rectangles = &full;
+		n = 1;
+	} else {
+		rectangles = pixman_region32_rectangles(&gs->texture_damage,
+							&n);
+	}
+
+	size = 0;
+	for (i = 0; i < n; i++) {
+		pixman_box32_t r = gs->needs_full_upload ? rectangles[i] :
+			weston_surface_to_buffer_rect(surface, rectangles[i]);
+
+		for (j = 0; j < gs->num_textures; j++)
+			if (pbo_upload_rect_init(&rect, gs, r, j))
+				size += rect.size;
+	}
+
+	if (size == 0 || size > GL_PBO_SEGMENT_SIZE)
+		return false;
+
+	pbo = gl_renderer_get_pbo(gr, size);
+	if (!pbo)
+		return false;
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo->name);
+	if (pbo->map)
+		dst = pbo->map + pbo->used;
+	else
+		dst = gr->map_buffer_range(GL_PIXEL_UNPACK_BUFFER,
+					   pbo->used, size,
+					   GL_MAP_WRITE_BIT_EXT |
+					   GL_MAP_INVALIDATE_RANGE_BIT_EXT |
+					   GL_MAP_UNSYNCHRONIZED_BIT_EXT);
+	if (!dst) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return false;
+	}
+
+	data = wl_shm_buffer_get_data(shm_buffer);
+	wl_shm_buffer_begin_access(shm_buffer);
+	offset = 0;
+	for (i = 0; i < n; i++) {
+		pixman_box32_t r = gs->needs_full_upload ? rectangles[i] :
+			weston_surface_to_buffer_rect(surface, rectangles[i]);
+
+		for (j = 0; j < gs->num_textures; j++) {
+			const uint8_t *src;
+
+			if (!pbo_upload_rect_init(&rect, gs, r, j))
+				continue;
+
+			src = data + gs->offset[j] +
+			      rect.y * rect.src_stride + rect.x * rect.bpp;
+			if (rect.src_stride == rect.dst_stride) {
+				memcpy(dst + offset, src,
+				       rect.dst_stride * rect.height);
+			} else {
+				for (row = 0; row < rect.height; row++)
+					memcpy(dst + offset +
+					       row * rect.dst_stride,
+					       src + row * rect.src_stride,
+					       rect.width * rect.bpp);
+			}
+			offset += rect.size;
+		}
+	}
+	wl_shm_buffer_end_access(shm_buffer);
+
+	if (!pbo->map)
+		gr->unmap_buffer(GL_PIXEL_UNPACK_BUFFER);
+
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+	offset = pbo->used;
+	for (i = 0; i < n; i++) {
+		pixman_box32_t r = gs->needs_full_upload ? rectangles[i] :
+			weston_surface_to_buffer_rect(surface, rectangles[i]);
+
+		for (j = 0; j < gs->num_textures; j++) {
+			const void *pixels;
+
+			if (!pbo_upload_rect_init(&rect, gs, r, j))
+				continue;
+
+			pixels = (const void *)(uintptr_t)offset;
+			glBindTexture(GL_TEXTURE_2D, gs->textures[j]);
+			glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, rect.width);
+			if (gs->needs_full_upload)
+				glTexImage2D(GL_TEXTURE_2D, 0,
+					     gs->gl_format[j],
+					     rect.width, rect.height, 0,
+					     gl_format_from_internal(gs->gl_format[j]),
+					     gs->gl_pixel_type, pixels);
+			else
+				glTexSubImage2D(GL_TEXTURE_2D, 0,
+						rect.x, rect.y,
+						rect.width, rect.height,
+						gl_format_from_internal(gs->gl_format[j]),
+						gs->gl_pixel_type, pixels);
+			offset += rect.size;
+		}
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	pbo->used += size;
+
+	return true;
+}
+
+static void
+atlas_upload_rect(struct gl_surface_state *gs, const uint8_t *data,
+		  int x, int y, int width, int height, int dst_x, int dst_y)
+{
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, x);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, y);
+	glTexSubImage2D(GL_TEXTURE_2D, 0,
+			gs->atlas_slot.x + dst_x, gs->atlas_slot.y + dst_y,
+			width, height,
+			gl_format_from_internal(gs->gl_format[0]),
+			gs->gl_pixel_type, data);
+}
+
+/** Upload the SHM texture damage into the surface atlas slot
+ *
+ * Besides the damage, the content edges it touches are copied into the
+ * slot padding. Damage is clamped to the slot, so that a bogus region can
+ * never overwrite the neighbouring surfaces.
+ */
+static void
+gl_renderer_upload_shm_atlas(struct weston_surface *surface,
+			     struct gl_surface_state *gs,
+			     struct weston_buffer *buffer)
+{
+	pixman_box32_t *rectangles, full;
+	const uint8_t *data;
+	int i, n, w, h;
+
+	if (gs->needs_full_upload) {
+		full.x1 = 0;
+		full.y1 = 0;
+		full.x2 = gs->pitch;
+		full.y2 = gs->height;
+		rectangles = &full;
+		n = 1;
+	} else {
+		rectangles = pixman_region32_rectangles(&gs->texture_damage,
+							&n);
+	}
+
+	data = wl_shm_buffer_get_data(buffer->shm_buffer);
+
+	glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, gs->pitch);
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	for (i = 0; i < n; i++) {
+		pixman_box32_t r = gs->needs_full_upload ? rectangles[i] :
+			weston_surface_to_buffer_rect(surface, rectangles[i]);
+
+		r.x1 = MAX(r.x1, 0);
+		r.y1 = MAX(r.y1, 0);
+		r.x2 = MIN(r.x2, gs->pitch);
+		r.y2 = MIN(r.y2, gs->height);
+		if (r.x1 >= r.x2 || r.y1 >= r.y2)
+			continue;
+
+		w = r.x2 - r.x1;
+		h = r.y2 - r.y1;
+		atlas_upload_rect(gs, data, r.x1, r.y1, w, h, r.x1, r.y1);
+
+		if (r.x1 == 0)
+			atlas_upload_rect(gs, data, 0, r.y1, 1, h, -1, r.y1);
+		if (r.x2 == gs->pitch)
+			atlas_upload_rect(gs, data, gs->pitch - 1, r.y1, 1, h,
+					  gs->pitch, r.y1);
+		if (r.y1 == 0)
+			atlas_upload_rect(gs, data, r.x1, 0, w, 1, r.x1, -1);
+		if (r.y2 == gs->height)
+			atlas_upload_rect(gs, data, r.x1, gs->height - 1, w, 1,
+					  r.x1, gs->height);
+	}
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+}
+
 static void
 gl_renderer_flush_damage(struct weston_surface *surface)
 {
@@ -1578,8 +4067,13 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	uint8_t *data;
 	int i, j, n;
 
+	WESTON_TRACE2(gl_flush_damage, surface,
+		      pixman_region32_n_rects(&surface->damage));
+
 	pixman_region32_union(&gs->texture_damage,
 			      &gs->texture_damage, &surface->damage);
+	if (pixman_region32_not_empty(&surface->damage))
+		gs->content_serial++;
 
 	if (!buffer)
 		return;
@@ -1599,10 +4093,19 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	if (!texture_used)
 		return;
 
+	surface_restore_texture(gr, gs);
+
 	if (!pixman_region32_not_empty(&gs->texture_damage) &&
 	    !gs->needs_full_upload)
 		goto done;
 
+	gs->mipmaps_valid = false;
+
+	if (gs->atlas_slot.page) {
+		gl_renderer_upload_shm_atlas(surface, gs, buffer);
+		goto done;
+	}
+
 	data = wl_shm_buffer_get_data(buffer->shm_buffer);
 
 	if (!gr->has_unpack_subimage) {
@@ -1623,6 +4126,10 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 		goto done;
 	}
 
+	if (gr->has_pbo_upload &&
+	    gl_renderer_upload_shm_pbo(gr, surface, gs, buffer))
+		goto done;
+
 	if (gs->needs_full_upload) {
 		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
 		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
@@ -1675,11 +4182,54 @@ done:
 	pixman_region32_fini(&gs->texture_damage);
 	pixman_region32_init(&gs->texture_damage);
 	gs->needs_full_upload = false;
+	surface_account_texture(gr, gs);
 
 	weston_buffer_reference(&gs->buffer_ref, NULL);
 	weston_buffer_release_reference(&gs->buffer_release_ref, NULL);
 }
 
+static void
+surface_release_textures(struct gl_surface_state *gs)
+{
+	if (gs->atlas_slot.page) {
+		gl_atlas_free(&gs->atlas_slot);
+		geometry_cache_invalidate(gs);
+	} else {
+		glDeleteTextures(gs->num_textures, gs->textures);
+	}
+
+	memset(gs->textures, 0, sizeof gs->textures);
+	gs->num_textures = 0;
+	surface_account_texture(get_renderer(gs->surface->compositor), gs);
+}
+
+static bool
+surface_use_atlas(struct gl_renderer *gr, struct gl_surface_state *gs,
+		  int num_planes, int pitch, int height)
+{
+	struct gl_atlas_slot slot;
+
+	if (!gr->has_atlas || num_planes != 1 ||
+	    gs->gl_format[0] != GL_BGRA_EXT ||
+	    gs->gl_pixel_type != GL_UNSIGNED_BYTE ||
+	    pitch > GL_ATLAS_MAX_SURFACE_SIZE ||
+	    height > GL_ATLAS_MAX_SURFACE_SIZE)
+		return false;
+
+	if (!gl_atlas_alloc(gr, pitch, height, &slot))
+		return false;
+
+	/* textures of our own are not needed anymore */
+	surface_release_textures(gs);
+
+	gs->atlas_slot = slot;
+	gs->textures[0] = slot.page->texture;
+	gs->num_textures = 1;
+	geometry_cache_invalidate(gs);
+
+	return true;
+}
+
 static void
 ensure_textures(struct gl_surface_state *gs, int num_textures)
 {
@@ -1700,6 +4250,13 @@ ensure_textures(struct gl_surface_state *gs, int num_textures)
 	glBindTexture(gs->target, 0);
 }
 
+/* wl_shm content is always copied into textures. Sampling the client
+ * memory directly, by wrapping the pool into a dmabuf with udmabuf or
+ * importing it with GL_EXT_memory_object_fd, would need the file
+ * descriptor of the pool, which libwayland-server keeps to itself.
+ * Clients wanting to avoid the copy on unified memory GPUs can create a
+ * udmabuf from their memfd and attach it through zwp_linux_dmabuf_v1 as
+ * a linear buffer instead. */
 static void
 gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
 		       struct wl_shm_buffer *shm_buffer)
@@ -1826,12 +4383,20 @@ gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
 		gs->gl_pixel_type = gl_pixel_type;
 		gs->buffer_type = BUFFER_TYPE_SHM;
 		gs->needs_full_upload = true;
+		gs->mipmaps_valid = false;
+		gs->mipmaps_failed = false;
 		gs->y_inverted = true;
 		gs->direct_display = false;
 
 		gs->surface = es;
 
-		ensure_textures(gs, num_planes);
+		/* the atlas slot is sized for the old buffer */
+		if (gs->atlas_slot.page)
+			surface_release_textures(gs);
+
+		if (!surface_use_atlas(gr, gs, num_planes,
+				       pitch, buffer->height))
+			ensure_textures(gs, num_planes);
 	}
 }
 
@@ -1842,16 +4407,23 @@ gl_renderer_attach_egl(struct weston_surface *es, struct weston_buffer *buffer,
 	struct weston_compositor *ec = es->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
 	struct gl_surface_state *gs = get_surface_state(es);
+	struct egl_buffer_images *cache;
 	EGLint attribs[3];
 	int i, num_planes;
 
-	buffer->legacy_buffer = (struct wl_buffer *)buffer->resource;
-	gr->query_buffer(gr->egl_display, buffer->legacy_buffer,
-			 EGL_WIDTH, &buffer->width);
-	gr->query_buffer(gr->egl_display, buffer->legacy_buffer,
-			 EGL_HEIGHT, &buffer->height);
-	gr->query_buffer(gr->egl_display, buffer->legacy_buffer,
-			 EGL_WAYLAND_Y_INVERTED_WL, &buffer->y_inverted);
+	/* The size of a wl_drm buffer cannot change, it only needs to be
+	 * queried when the buffer is seen for the first time. */
+	cache = egl_buffer_images_get(buffer);
+	if (!cache) {
+		buffer->legacy_buffer = (struct wl_buffer *)buffer->resource;
+		gr->query_buffer(gr->egl_display, buffer->legacy_buffer,
+				 EGL_WIDTH, &buffer->width);
+		gr->query_buffer(gr->egl_display, buffer->legacy_buffer,
+				 EGL_HEIGHT, &buffer->height);
+		gr->query_buffer(gr->egl_display, buffer->legacy_buffer,
+				 EGL_WAYLAND_Y_INVERTED_WL,
+				 &buffer->y_inverted);
+	}
 
 	for (i = 0; i < gs->num_images; i++) {
 		egl_image_unref(gs->images[i]);
@@ -1891,19 +4463,43 @@ gl_renderer_attach_egl(struct weston_surface *es, struct weston_buffer *buffer,
 		break;
 	}
 
-	ensure_textures(gs, num_planes);
-	for (i = 0; i < num_planes; i++) {
-		attribs[0] = EGL_WAYLAND_PLANE_WL;
-		attribs[1] = i;
-		attribs[2] = EGL_NONE;
-		gs->images[i] = egl_image_create(gr,
-						 EGL_WAYLAND_BUFFER_WL,
-						 buffer->legacy_buffer,
-						 attribs);
-		if (!gs->images[i]) {
-			weston_log("failed to create img for plane %d\n", i);
-			continue;
+	if (!cache) {
+		cache = zalloc(sizeof *cache);
+		if (!cache)
+			return;
+
+		for (i = 0; i < num_planes; i++) {
+			attribs[0] = EGL_WAYLAND_PLANE_WL;
+			attribs[1] = i;
+			attribs[2] = EGL_NONE;
+			cache->images[i] = egl_image_create(gr,
+							    EGL_WAYLAND_BUFFER_WL,
+							    buffer->legacy_buffer,
+							    attribs);
+			if (!cache->images[i]) {
+				weston_log("failed to create img for plane %d\n",
+					   i);
+				break;
+			}
+			cache->num_images++;
+		}
+
+		/* Incomplete imports are tried again on the next attach. */
+		if (cache->num_images == num_planes) {
+			cache->destroy_listener.notify =
+				egl_buffer_images_buffer_destroyed;
+			wl_signal_add(&buffer->destroy_signal,
+				      &cache->destroy_listener);
+			wl_list_insert(&gr->egl_buffer_images, &cache->link);
+		} else {
+			wl_list_init(&cache->destroy_listener.link);
+			wl_list_init(&cache->link);
 		}
+	}
+
+	ensure_textures(gs, num_planes);
+	for (i = 0; i < cache->num_images; i++) {
+		gs->images[i] = egl_image_ref(cache->images[i]);
 		gs->num_images++;
 
 		glActiveTexture(GL_TEXTURE0 + i);
@@ -1912,6 +4508,9 @@ gl_renderer_attach_egl(struct weston_surface *es, struct weston_buffer *buffer,
 					    gs->images[i]->image);
 	}
 
+	if (wl_list_empty(&cache->link))
+		egl_buffer_images_destroy(cache);
+
 	gs->pitch = buffer->width;
 	gs->height = buffer->height;
 	gs->buffer_type = BUFFER_TYPE_EGL;
@@ -2313,17 +4912,18 @@ choose_texture_target(struct gl_renderer *gr,
 	}
 }
 
+/* Takes ownership of egl_image, the direct import of the dmabuf. If that
+ * failed and it is NULL, the planes are imported for GL conversion. */
 static struct dmabuf_image *
 import_dmabuf(struct gl_renderer *gr,
-	      struct linux_dmabuf_buffer *dmabuf)
+	      struct linux_dmabuf_buffer *dmabuf,
+	      struct egl_image *egl_image)
 {
-	struct egl_image *egl_image;
 	struct dmabuf_image *image;
 
 	image = dmabuf_image_create();
 	image->dmabuf = dmabuf;
 
-	egl_image = import_simple_dmabuf(gr, &dmabuf->attributes);
 	if (egl_image) {
 		image->num_images = 1;
 		image->images[0] = egl_image;
@@ -2451,15 +5051,11 @@ gl_renderer_query_dmabuf_modifiers(struct weston_compositor *wc, int format,
 }
 
 static bool
-gl_renderer_import_dmabuf(struct weston_compositor *ec,
-			  struct linux_dmabuf_buffer *dmabuf)
+dmabuf_is_importable(struct gl_renderer *gr,
+		     struct linux_dmabuf_buffer *dmabuf)
 {
-	struct gl_renderer *gr = get_renderer(ec);
-	struct dmabuf_image *image;
 	int i;
 
-	assert(gr->has_dmabuf_import);
-
 	for (i = 0; i < dmabuf->attributes.n_planes; i++) {
 		/* return if EGL doesn't support import modifiers */
 		if (dmabuf->attributes.modifier[i] != DRM_FORMAT_MOD_INVALID)
@@ -2476,7 +5072,17 @@ gl_renderer_import_dmabuf(struct weston_compositor *ec,
 	if (dmabuf->attributes.flags & ~ZWP_LINUX_BUFFER_PARAMS_V1_FLAGS_Y_INVERT)
 		return false;
 
-	image = import_dmabuf(gr, dmabuf);
+	return true;
+}
+
+static bool
+gl_renderer_add_dmabuf_image(struct gl_renderer *gr,
+			     struct linux_dmabuf_buffer *dmabuf,
+			     struct egl_image *egl_image)
+{
+	struct dmabuf_image *image;
+
+	image = import_dmabuf(gr, dmabuf, egl_image);
 	if (!image)
 		return false;
 
@@ -2487,6 +5093,226 @@ gl_renderer_import_dmabuf(struct weston_compositor *ec,
 	return true;
 }
 
+static bool
+gl_renderer_import_dmabuf(struct weston_compositor *ec,
+			  struct linux_dmabuf_buffer *dmabuf)
+{
+	struct gl_renderer *gr = get_renderer(ec);
+
+	assert(gr->has_dmabuf_import);
+
+	if (!dmabuf_is_importable(gr, dmabuf))
+		return false;
+
+	return gl_renderer_add_dmabuf_image(gr, dmabuf,
+		import_simple_dmabuf(gr, &dmabuf->attributes));
+}
+
+/** The main loop of the dmabuf import thread
+ *
+ * Creating an EGLImage from a dmabuf needs no context, so the thread only
+ * makes the eglCreateImageKHR() calls, which can take a while in the
+ * driver. The texture target query and the GL conversion fallback touch
+ * renderer state and stay on the compositor thread. Nothing here may log,
+ * weston_log() is not thread-safe.
+ */
+static void *
+dmabuf_import_thread(void *data)
+{
+	struct gl_renderer *gr = data;
+	struct dmabuf_import_job *job;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&gr->import_thread.lock);
+	for (;;) {
+		while (!gr->import_thread.quit &&
+		       wl_list_empty(&gr->import_thread.queued))
+			pthread_cond_wait(&gr->import_thread.cond,
+					  &gr->import_thread.lock);
+
+		if (gr->import_thread.quit)
+			break;
+
+		job = wl_container_of(gr->import_thread.queued.next, job, link);
+		wl_list_remove(&job->link);
+		pthread_mutex_unlock(&gr->import_thread.lock);
+
+		job->egl_image = import_simple_dmabuf(gr,
+						      &job->dmabuf->attributes);
+
+		pthread_mutex_lock(&gr->import_thread.lock);
+		wl_list_insert(gr->import_thread.done.prev, &job->link);
+
+		/* Only fails if the counter would overflow, in which case
+		 * there is a wakeup pending anyway. */
+		if (write(gr->import_thread.notify_fd, &one, sizeof one) < 0)
+			continue;
+	}
+	pthread_mutex_unlock(&gr->import_thread.lock);
+
+	eglReleaseThread();
+
+	return NULL;
+}
+
+static void
+dmabuf_import_job_finish(struct gl_renderer *gr,
+			 struct dmabuf_import_job *job, bool cancel)
+{
+	bool success = false;
+
+	wl_list_remove(&job->link);
+
+	if (!cancel)
+		success = gl_renderer_add_dmabuf_image(gr, job->dmabuf,
+						       job->egl_image);
+	else if (job->egl_image)
+		egl_image_unref(job->egl_image);
+
+	job->done(job->dmabuf, success);
+	free(job);
+}
+
+static int
+dmabuf_import_thread_notify(int fd, uint32_t mask, void *data)
+{
+	struct gl_renderer *gr = data;
+	struct dmabuf_import_job *job, *next;
+	struct wl_list done;
+	uint64_t count;
+
+	/* EAGAIN just means there was nothing to clear. */
+	if (read(fd, &count, sizeof count) < 0)
+		count = 0;
+
+	wl_list_init(&done);
+	pthread_mutex_lock(&gr->import_thread.lock);
+	wl_list_insert_list(&done, &gr->import_thread.done);
+	wl_list_init(&gr->import_thread.done);
+	pthread_mutex_unlock(&gr->import_thread.lock);
+
+	wl_list_for_each_safe(job, next, &done, link)
+		dmabuf_import_job_finish(gr, job, false);
+
+	return 0;
+}
+
+static bool
+dmabuf_import_thread_start(struct weston_compositor *ec)
+{
+	struct gl_renderer *gr = get_renderer(ec);
+	struct wl_event_loop *loop = wl_display_get_event_loop(ec->wl_display);
+	sigset_t mask, old_mask;
+	int ret;
+
+	gr->import_thread.notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (gr->import_thread.notify_fd < 0)
+		return false;
+
+	gr->import_thread.notify_source =
+		wl_event_loop_add_fd(loop, gr->import_thread.notify_fd,
+				     WL_EVENT_READABLE,
+				     dmabuf_import_thread_notify, gr);
+	if (!gr->import_thread.notify_source)
+		goto err_fd;
+
+	pthread_mutex_init(&gr->import_thread.lock, NULL);
+	pthread_cond_init(&gr->import_thread.cond, NULL);
+	wl_list_init(&gr->import_thread.queued);
+	wl_list_init(&gr->import_thread.done);
+	gr->import_thread.quit = false;
+
+	sigfillset(&mask);
+	sigdelset(&mask, SIGBUS);
+	sigdelset(&mask, SIGSEGV);
+	sigdelset(&mask, SIGFPE);
+	sigdelset(&mask, SIGILL);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	ret = pthread_create(&gr->import_thread.thread, NULL,
+			     dmabuf_import_thread, gr);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	if (ret != 0)
+		goto err_lock;
+
+	gr->import_thread.running = true;
+
+	return true;
+
+err_lock:
+	pthread_cond_destroy(&gr->import_thread.cond);
+	pthread_mutex_destroy(&gr->import_thread.lock);
+	wl_event_source_remove(gr->import_thread.notify_source);
+	gr->import_thread.notify_source = NULL;
+err_fd:
+	close(gr->import_thread.notify_fd);
+	gr->import_thread.notify_fd = -1;
+
+	return false;
+}
+
+/* Fails whatever is still queued, the clients get 'failed'. */
+static void
+dmabuf_import_thread_stop(struct gl_renderer *gr)
+{
+	struct dmabuf_import_job *job, *next;
+
+	if (!gr->import_thread.running)
+		return;
+
+	pthread_mutex_lock(&gr->import_thread.lock);
+	gr->import_thread.quit = true;
+	pthread_cond_signal(&gr->import_thread.cond);
+	pthread_mutex_unlock(&gr->import_thread.lock);
+	pthread_join(gr->import_thread.thread, NULL);
+	gr->import_thread.running = false;
+
+	wl_event_source_remove(gr->import_thread.notify_source);
+	gr->import_thread.notify_source = NULL;
+	close(gr->import_thread.notify_fd);
+	gr->import_thread.notify_fd = -1;
+
+	wl_list_for_each_safe(job, next, &gr->import_thread.done, link)
+		dmabuf_import_job_finish(gr, job, true);
+	wl_list_for_each_safe(job, next, &gr->import_thread.queued, link)
+		dmabuf_import_job_finish(gr, job, true);
+
+	pthread_cond_destroy(&gr->import_thread.cond);
+	pthread_mutex_destroy(&gr->import_thread.lock);
+}
+
+static bool
+gl_renderer_import_dmabuf_async(struct weston_compositor *ec,
+				struct linux_dmabuf_buffer *dmabuf,
+				weston_dmabuf_import_done_func_t done)
+{
+	struct gl_renderer *gr = get_renderer(ec);
+	struct dmabuf_import_job *job;
+
+	assert(gr->has_dmabuf_import);
+
+	/* The synchronous import rejects these without any work, and
+	 * takes over if the thread cannot be started. */
+	if (!dmabuf_is_importable(gr, dmabuf))
+		return false;
+
+	if (!gr->import_thread.running && !dmabuf_import_thread_start(ec))
+		return false;
+
+	job = zalloc(sizeof *job);
+	if (!job)
+		return false;
+
+	job->dmabuf = dmabuf;
+	job->done = done;
+
+	pthread_mutex_lock(&gr->import_thread.lock);
+	wl_list_insert(gr->import_thread.queued.prev, &job->link);
+	pthread_cond_signal(&gr->import_thread.cond);
+	pthread_mutex_unlock(&gr->import_thread.lock);
+
+	return true;
+}
+
 static bool
 import_known_dmabuf(struct gl_renderer *gr,
                     struct dmabuf_image *image)
@@ -2576,8 +5402,16 @@ gl_renderer_attach_dmabuf(struct weston_surface *surface,
 
 	image = linux_dmabuf_buffer_get_user_data(dmabuf);
 
-	/* The dmabuf_image should have been created during the import */
-	assert(image != NULL);
+	/* The dmabuf_image should have been created during the import,
+	 * unless the dmabuf was imported by the pixman renderer before a
+	 * renderer switch. */
+	if (!image && gl_renderer_import_dmabuf(surface->compositor, dmabuf))
+		image = linux_dmabuf_buffer_get_user_data(dmabuf);
+	if (!image) {
+		linux_dmabuf_buffer_send_server_error(dmabuf,
+				"EGL dmabuf import failed");
+		return;
+	}
 
 	for (i = 0; i < image->num_images; ++i)
 		egl_image_unref(image->images[i]);
@@ -2616,6 +5450,14 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 	weston_buffer_reference(&gs->buffer_ref, buffer);
 	weston_buffer_release_reference(&gs->buffer_release_ref,
 					es->buffer_release_ref.buffer_release);
+	gs->content_serial++;
+
+	/* New content replaces an evicted texture, which has to be
+	 * allocated again. */
+	if (gs->evicted) {
+		surface_drop_evicted(gr, gs);
+		gs->buffer_type = BUFFER_TYPE_NULL;
+	}
 
 	if (!buffer) {
 		for (i = 0; i < gs->num_images; i++) {
@@ -2623,8 +5465,7 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 			gs->images[i] = NULL;
 		}
 		gs->num_images = 0;
-		glDeleteTextures(gs->num_textures, gs->textures);
-		gs->num_textures = 0;
+		surface_release_textures(gs);
 		gs->buffer_type = BUFFER_TYPE_NULL;
 		gs->y_inverted = true;
 		gs->direct_display = false;
@@ -2634,6 +5475,10 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 
 	shm_buffer = wl_shm_buffer_get(buffer->resource);
 
+	/* EGL and dmabuf buffers need textures of their own */
+	if (!shm_buffer && gs->atlas_slot.page)
+		surface_release_textures(gs);
+
 	if (shm_buffer)
 		gl_renderer_attach_shm(es, buffer, shm_buffer);
 	else if (gr->has_bind_display &&
@@ -2656,6 +5501,8 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
                 weston_buffer_send_server_error(buffer,
 			"disconnecting due to unhandled buffer type");
 	}
+
+	surface_account_texture(gr, gs);
 }
 
 static void
@@ -2669,6 +5516,7 @@ gl_renderer_surface_set_color(struct weston_surface *surface,
 	gs->color[1] = green;
 	gs->color[2] = blue;
 	gs->color[3] = alpha;
+	gs->content_serial++;
 	gs->buffer_type = BUFFER_TYPE_SOLID;
 	gs->pitch = 1;
 	gs->height = 1;
@@ -2676,6 +5524,23 @@ gl_renderer_surface_set_color(struct weston_surface *surface,
 	gs->shader = &gr->solid_shader;
 }
 
+/* Atlas slots are shared and not counted. */
+static size_t
+gl_renderer_surface_get_memory(struct weston_surface *surface)
+{
+	struct gl_surface_state *gs = surface->renderer_state;
+	size_t size;
+
+	if (!gs)
+		return 0;
+
+	size = gs->texture_size;
+	if (gs->evicted_pixels)
+		size += (size_t)gs->pitch * gs->height * 4;
+
+	return size;
+}
+
 static void
 gl_renderer_surface_get_content_size(struct weston_surface *surface,
 				     int *width, int *height)
@@ -2742,6 +5607,7 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 	GLuint tex;
 	GLenum status;
 	const GLfloat *proj;
+	GLfloat texcoords[4 * 2];
 	int i;
 
 	gl_renderer_surface_get_content_size(surface, &cw, &ch);
@@ -2788,10 +5654,9 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 
 	glUniformMatrix4fv(gs->shader->proj_uniform, 1, GL_FALSE, proj);
 	glUniform1f(gs->shader->alpha_uniform, 1.0f);
+	gs->shader->uniforms_valid = false;
 
 	for (i = 0; i < gs->num_textures; i++) {
-		glUniform1i(gs->shader->tex_uniforms[i], i);
-
 		glActiveTexture(GL_TEXTURE0 + i);
 		glBindTexture(gs->target, gs->textures[i]);
 		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
@@ -2803,7 +5668,19 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 	glEnableVertexAttribArray(0);
 
 	/* texcoord: */
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, verts);
+	if (gs->atlas_slot.page) {
+		for (i = 0; i < 4; i++) {
+			texcoords[i * 2] = (gs->atlas_slot.x +
+					    verts[i * 2] * gs->pitch) /
+					   GL_ATLAS_SIZE;
+			texcoords[i * 2 + 1] = (gs->atlas_slot.y +
+						verts[i * 2 + 1] * gs->height) /
+					       GL_ATLAS_SIZE;
+		}
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, texcoords);
+	} else {
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, verts);
+	}
 	glEnableVertexAttribArray(1);
 
 	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
@@ -2831,7 +5708,9 @@ surface_state_destroy(struct gl_surface_state *gs, struct gl_renderer *gr)
 
 	gs->surface->renderer_state = NULL;
 
-	glDeleteTextures(gs->num_textures, gs->textures);
+	surface_release_textures(gs);
+	surface_drop_evicted(gr, gs);
+	tree_cache_destroy(gs->tree_cache);
 
 	for (i = 0; i < gs->num_images; i++)
 		egl_image_unref(gs->images[i]);
@@ -2839,6 +5718,7 @@ surface_state_destroy(struct gl_surface_state *gs, struct gl_renderer *gr)
 	weston_buffer_reference(&gs->buffer_ref, NULL);
 	weston_buffer_release_reference(&gs->buffer_release_ref, NULL);
 	pixman_region32_fini(&gs->texture_damage);
+	geometry_cache_release(gs);
 	free(gs);
 }
 
@@ -2890,7 +5770,9 @@ gl_renderer_create_surface(struct weston_surface *surface)
 
 	gs->surface = surface;
 
+	wl_list_init(&gs->texture_link);
 	pixman_region32_init(&gs->texture_damage);
+	geometry_cache_init(gs);
 	surface->renderer_state = gs;
 
 	gs->surface_destroy_listener.notify =
@@ -2932,6 +5814,18 @@ static const char vertex_shader[] =
 	"  gl_FragColor.b = y + 2.01723214 * u;\n"			\
 	"  gl_FragColor.a = alpha;\n"
 
+/* Views with alpha == 1.0 get variants with the multiplications folded
+ * away by the compiler, see gl_shader::alpha_is_one. */
+#define FRAGMENT_ALPHA							\
+	"#ifdef ALPHA_IS_ONE\n"						\
+	"#define alpha 1.0\n"						\
+	"#else\n"							\
+	"uniform float alpha;\n"					\
+	"#endif\n"
+
+static const char fragment_alpha_is_one[] =
+	"#define ALPHA_IS_ONE\n";
+
 static const char fragment_debug[] =
 	"  gl_FragColor = vec4(0.0, 0.3, 0.0, 0.2) + gl_FragColor * 0.8;\n";
 
@@ -2942,7 +5836,7 @@ static const char texture_fragment_shader_rgba[] =
 	"precision mediump float;\n"
 	"varying vec2 v_texcoord;\n"
 	"uniform sampler2D tex;\n"
-	"uniform float alpha;\n"
+	FRAGMENT_ALPHA
 	"void main()\n"
 	"{\n"
 	"   gl_FragColor = alpha * texture2D(tex, v_texcoord)\n;"
@@ -2952,7 +5846,7 @@ static const char texture_fragment_shader_rgbx[] =
 	"precision mediump float;\n"
 	"varying vec2 v_texcoord;\n"
 	"uniform sampler2D tex;\n"
-	"uniform float alpha;\n"
+	FRAGMENT_ALPHA
 	"void main()\n"
 	"{\n"
 	"   gl_FragColor.rgb = alpha * texture2D(tex, v_texcoord).rgb\n;"
@@ -2964,7 +5858,7 @@ static const char texture_fragment_shader_egl_external[] =
 	"precision mediump float;\n"
 	"varying vec2 v_texcoord;\n"
 	"uniform samplerExternalOES tex;\n"
-	"uniform float alpha;\n"
+	FRAGMENT_ALPHA
 	"void main()\n"
 	"{\n"
 	"   gl_FragColor = alpha * texture2D(tex, v_texcoord)\n;"
@@ -2975,7 +5869,7 @@ static const char texture_fragment_shader_y_uv[] =
 	"uniform sampler2D tex;\n"
 	"uniform sampler2D tex1;\n"
 	"varying vec2 v_texcoord;\n"
-	"uniform float alpha;\n"
+	FRAGMENT_ALPHA
 	"void main() {\n"
 	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
 	"  float u = texture2D(tex1, v_texcoord).r - 0.5;\n"
@@ -2989,7 +5883,7 @@ static const char texture_fragment_shader_y_u_v[] =
 	"uniform sampler2D tex1;\n"
 	"uniform sampler2D tex2;\n"
 	"varying vec2 v_texcoord;\n"
-	"uniform float alpha;\n"
+	FRAGMENT_ALPHA
 	"void main() {\n"
 	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
 	"  float u = texture2D(tex1, v_texcoord).x - 0.5;\n"
@@ -3002,7 +5896,7 @@ static const char texture_fragment_shader_y_xuxv[] =
 	"uniform sampler2D tex;\n"
 	"uniform sampler2D tex1;\n"
 	"varying vec2 v_texcoord;\n"
-	"uniform float alpha;\n"
+	FRAGMENT_ALPHA
 	"void main() {\n"
 	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
 	"  float u = texture2D(tex1, v_texcoord).g - 0.5;\n"
@@ -3014,7 +5908,7 @@ static const char texture_fragment_shader_xyuv[] =
 	"precision mediump float;\n"
 	"uniform sampler2D tex;\n"
 	"varying vec2 v_texcoord;\n"
-	"uniform float alpha;\n"
+	FRAGMENT_ALPHA
 	"void main() {\n"
 	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).b - 0.0625);\n"
 	"  float u = texture2D(tex, v_texcoord).g - 0.5;\n"
@@ -3022,6 +5916,31 @@ static const char texture_fragment_shader_xyuv[] =
 	FRAGMENT_CONVERT_YUV
 	;
 
+/* Nearest blue slices of the LUT texture, each bilinearly sampled for red
+ * and green, then interpolated in between. */
+static const char color_lut_fragment_shader[] =
+	"#ifdef GL_FRAGMENT_PRECISION_HIGH\n"
+	"precision highp float;\n"
+	"#else\n"
+	"precision mediump float;\n"
+	"#endif\n"
+	"varying vec2 v_texcoord;\n"
+	"uniform sampler2D tex;\n"
+	"uniform sampler2D tex1;\n"
+	"uniform float lut_size;\n"
+	"void main()\n"
+	"{\n"
+	"   float n = lut_size;\n"
+	"   vec3 c = texture2D(tex, v_texcoord).rgb;\n"
+	"   float b = c.b * (n - 1.0);\n"
+	"   float b0 = floor(b);\n"
+	"   float b1 = min(b0 + 1.0, n - 1.0);\n"
+	"   vec2 rg = (c.rg * (n - 1.0) + 0.5) / vec2(n * n, n);\n"
+	"   vec3 c0 = texture2D(tex1, rg + vec2(b0 / n, 0.0)).rgb;\n"
+	"   vec3 c1 = texture2D(tex1, rg + vec2(b1 / n, 0.0)).rgb;\n"
+	"   gl_FragColor = vec4(mix(c0, c1, b - b0), 1.0);\n"
+	;
+
 static const char solid_fragment_shader[] =
 	"precision mediump float;\n"
 	"uniform vec4 color;\n"
@@ -3057,31 +5976,33 @@ shader_init(struct gl_shader *shader, struct gl_renderer *renderer,
 {
 	char msg[512];
 	GLint status;
-	int count;
-	const char *sources[3];
+	int count = 0;
+	const char *sources[5];
+	unsigned int i;
+
+	sources[0] = vertex_source;
+	if (shader->alpha_is_one)
+		sources[++count] = fragment_alpha_is_one;
+	sources[++count] = fragment_source;
+	if (renderer->fragment_shader_debug)
+		sources[++count] = fragment_debug;
+	sources[++count] = fragment_brace;
+
+	shader->program = glCreateProgram();
+	if (gl_shader_cache_load(renderer, shader->program,
+				 sources, count + 1))
+		goto uniforms;
 
 	shader->vertex_shader =
 		compile_shader(GL_VERTEX_SHADER, 1, &vertex_source);
 	if (shader->vertex_shader == GL_NONE)
-		return -1;
-
-	if (renderer->fragment_shader_debug) {
-		sources[0] = fragment_source;
-		sources[1] = fragment_debug;
-		sources[2] = fragment_brace;
-		count = 3;
-	} else {
-		sources[0] = fragment_source;
-		sources[1] = fragment_brace;
-		count = 2;
-	}
+		goto err;
 
 	shader->fragment_shader =
-		compile_shader(GL_FRAGMENT_SHADER, count, sources);
+		compile_shader(GL_FRAGMENT_SHADER, count, &sources[1]);
 	if (shader->fragment_shader == GL_NONE)
-		return -1;
+		goto err;
 
-	shader->program = glCreateProgram();
 	glAttachShader(shader->program, shader->vertex_shader);
 	glAttachShader(shader->program, shader->fragment_shader);
 	glBindAttribLocation(shader->program, 0, "position");
@@ -3095,14 +6016,34 @@ shader_init(struct gl_shader *shader, struct gl_renderer *renderer,
 		return -1;
 	}
 
+	gl_shader_cache_store(renderer, shader->program, sources, count + 1);
+
+uniforms:
 	shader->proj_uniform = glGetUniformLocation(shader->program, "proj");
 	shader->tex_uniforms[0] = glGetUniformLocation(shader->program, "tex");
 	shader->tex_uniforms[1] = glGetUniformLocation(shader->program, "tex1");
 	shader->tex_uniforms[2] = glGetUniformLocation(shader->program, "tex2");
 	shader->alpha_uniform = glGetUniformLocation(shader->program, "alpha");
 	shader->color_uniform = glGetUniformLocation(shader->program, "color");
+	shader->lut_size_uniform = glGetUniformLocation(shader->program,
+							"lut_size");
+
+	/* Texture units never change, so the samplers are set only once.
+	 * Everything else is uploaded on first use. */
+	glUseProgram(shader->program);
+	for (i = 0; i < ARRAY_LENGTH(shader->tex_uniforms); i++)
+		glUniform1i(shader->tex_uniforms[i], i);
+	glUseProgram(renderer->current_shader ?
+		     renderer->current_shader->program : 0);
+	shader->uniforms_valid = false;
 
 	return 0;
+
+err:
+	/* leave program unset, so that compilation is retried on next use */
+	glDeleteProgram(shader->program);
+	shader->program = 0;
+	return -1;
 }
 
 static void
@@ -3255,9 +6196,11 @@ gl_renderer_output_create(struct weston_output *output,
 		pixman_region32_init(&go->buffer_damage[i]);
 
 	wl_list_init(&go->timeline_render_point_list);
+	wl_list_init(&go->view_timer_list);
 
 	go->begin_render_sync = EGL_NO_SYNC_KHR;
 	go->end_render_sync = EGL_NO_SYNC_KHR;
+	go->depth_bits = -1;
 
 	output->renderer_state = go;
 
@@ -3325,6 +6268,8 @@ gl_renderer_output_pbuffer_create(struct weston_output *output,
 	ret = gl_renderer_output_create(output, egl_surface);
 	if (ret < 0)
 		eglDestroySurface(gr->egl_display, egl_surface);
+	else
+		get_output_state(output)->preserves_contents = true;
 
 	return ret;
 }
@@ -3335,11 +6280,22 @@ gl_renderer_output_destroy(struct weston_output *output)
 	struct gl_renderer *gr = get_renderer(output->compositor);
 	struct gl_output_state *go = get_output_state(output);
 	struct timeline_render_point *trp, *tmp;
+	struct timeline_view_timer *timer, *timer_tmp;
 	int i;
 
-	for (i = 0; i < 2; i++)
+	for (i = 0; i < BUFFER_DAMAGE_COUNT; i++)
 		pixman_region32_fini(&go->buffer_damage[i]);
 
+	wl_list_for_each_safe(timer, timer_tmp, &go->view_timer_list, link)
+		timeline_view_timer_destroy(gr, go, timer);
+
+	if (gr->has_pbo_readback && use_output(output) == 0)
+		gl_renderer_finish_readbacks(gr, output);
+
+	if ((go->lut_tex || go->lut_fbo) && use_output(output) == 0)
+		output_color_lut_release(go);
+	free(go->lut);
+
 	eglMakeCurrent(gr->egl_display,
 		       EGL_NO_SURFACE, EGL_NO_SURFACE,
 		       EGL_NO_CONTEXT);
@@ -3384,12 +6340,39 @@ gl_renderer_destroy(struct weston_compositor *ec)
 	struct gl_renderer *gr = get_renderer(ec);
 	struct dmabuf_image *image, *next;
 	struct dmabuf_format *format, *next_format;
+	struct egl_buffer_images *cache, *next_cache;
 
 	wl_signal_emit(&gr->destroy_signal, gr);
 
+	dmabuf_import_thread_stop(gr);
+
+	weston_log_scope_destroy(gr->texture_scope);
+	gl_atlas_fini(gr);
+
+	if (gr->has_timer_query)
+		gr->delete_queries(gr->free_timer_queries.size /
+				   sizeof(GLuint),
+				   gr->free_timer_queries.data);
+
+	wl_list_for_each_safe(cache, next_cache, &gr->egl_buffer_images, link)
+		egl_buffer_images_destroy(cache);
+
 	if (gr->has_bind_display)
 		gr->unbind_display(gr->egl_display, ec->wl_display);
 
+	if (gr->has_pbo_upload)
+		gl_renderer_fini_pbo_ring(gr);
+
+	glDeleteBuffers(1, &gr->vertex_buffer);
+	glDeleteBuffers(1, &gr->index_buffer);
+
+	if (gr->has_pbo_readback)
+		gl_renderer_finish_readbacks(gr, NULL);
+	if (gr->readback_timer)
+		wl_event_source_remove(gr->readback_timer);
+	if (gr->shader_warmup_timer)
+		wl_event_source_remove(gr->shader_warmup_timer);
+
 	/* Work around crash in egl_dri2.c's dri2_make_current() - when does this apply? */
 	eglMakeCurrent(gr->egl_display,
 		       EGL_NO_SURFACE, EGL_NO_SURFACE,
@@ -3413,12 +6396,18 @@ gl_renderer_destroy(struct weston_compositor *ec)
 
 	wl_array_release(&gr->vertices);
 	wl_array_release(&gr->vtxcnt);
+	wl_array_release(&gr->indices);
+	wl_array_release(&gr->free_timer_queries);
+	wl_array_release(&gr->atlas_batch.vertices);
+	wl_array_release(&gr->atlas_batch.vtxcnt);
 
 	if (gr->fragment_binding)
 		weston_binding_destroy(gr->fragment_binding);
 	if (gr->fan_binding)
 		weston_binding_destroy(gr->fan_binding);
 
+	gl_shader_cache_fini(gr);
+
 	free(gr);
 }
 
@@ -3479,11 +6468,14 @@ gl_renderer_display_create(struct weston_compositor *ec,
 		return -1;
 
 	gr->platform = options->egl_platform;
+	gr->front_to_back = ec->render_opaque_front_to_back;
+	gr->tree_cache = ec->cache_surface_trees;
 
 	if (gl_renderer_setup_egl_client_extensions(gr) < 0)
 		goto fail;
 
 	gr->base.read_pixels = gl_renderer_read_pixels;
+	gr->base.read_pixels_async = gl_renderer_read_pixels_async;
 	gr->base.repaint_output = gl_renderer_repaint_output;
 	gr->base.flush_damage = gl_renderer_flush_damage;
 	gr->base.attach = gl_renderer_attach;
@@ -3492,6 +6484,10 @@ gl_renderer_display_create(struct weston_compositor *ec,
 	gr->base.surface_get_content_size =
 		gl_renderer_surface_get_content_size;
 	gr->base.surface_copy_content = gl_renderer_surface_copy_content;
+	gr->base.surface_get_memory = gl_renderer_surface_get_memory;
+	gr->base.output_set_color_transform =
+		gl_renderer_output_set_color_transform;
+	gr->base.trim_memory = gl_renderer_trim_memory;
 
 	if (gl_renderer_setup_egl_display(gr, options->egl_native_display) < 0)
 		goto fail;
@@ -3527,8 +6523,25 @@ gl_renderer_display_create(struct weston_compositor *ec,
 		ec->capabilities |= WESTON_CAP_EXPLICIT_SYNC;
 
 	wl_list_init(&gr->dmabuf_images);
+	wl_list_init(&gr->egl_buffer_images);
+	wl_list_init(&gr->readback_list);
+	wl_list_init(&gr->atlas_pages);
+	wl_list_init(&gr->texture_lru);
+	if (ec->texture_memory_budget_mib > 0)
+		gr->texture_budget =
+			(size_t)ec->texture_memory_budget_mib << 20;
+	gr->texture_scope =
+		weston_compositor_add_log_scope(ec, "gl-textures",
+						"GL renderer texture memory "
+						"of wl_shm surfaces\n",
+						gl_renderer_texture_memory_cb,
+						NULL, gr);
 	if (gr->has_dmabuf_import) {
 		gr->base.import_dmabuf = gl_renderer_import_dmabuf;
+		gr->base.import_dmabuf_async =
+			gl_renderer_import_dmabuf_async;
+		gr->base.output_copy_to_dmabuf =
+			gl_renderer_output_copy_to_dmabuf;
 		gr->base.query_dmabuf_formats =
 			gl_renderer_query_dmabuf_formats;
 		gr->base.query_dmabuf_modifiers =
@@ -3577,6 +6590,16 @@ static int
 compile_shaders(struct weston_compositor *ec)
 {
 	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_shader *texture_shaders[] = {
+		&gr->texture_shader_rgba,
+		&gr->texture_shader_rgbx,
+		&gr->texture_shader_egl_external,
+		&gr->texture_shader_y_uv,
+		&gr->texture_shader_y_u_v,
+		&gr->texture_shader_y_xuxv,
+		&gr->texture_shader_xyuv,
+	};
+	unsigned int i;
 
 	gr->texture_shader_rgba.vertex_source = vertex_shader;
 	gr->texture_shader_rgba.fragment_source = texture_fragment_shader_rgba;
@@ -3605,6 +6628,52 @@ compile_shaders(struct weston_compositor *ec)
 	gr->solid_shader.vertex_source = vertex_shader;
 	gr->solid_shader.fragment_source = solid_fragment_shader;
 
+	gr->color_lut_shader.vertex_source = vertex_shader;
+	gr->color_lut_shader.fragment_source = color_lut_fragment_shader;
+
+	assert(ARRAY_LENGTH(texture_shaders) ==
+	       ARRAY_LENGTH(gr->opaque_texture_shaders));
+	for (i = 0; i < ARRAY_LENGTH(texture_shaders); i++) {
+		struct gl_shader *variant = &gr->opaque_texture_shaders[i];
+
+		variant->vertex_source = texture_shaders[i]->vertex_source;
+		variant->fragment_source = texture_shaders[i]->fragment_source;
+		variant->alpha_is_one = true;
+		texture_shaders[i]->opaque_variant = variant;
+	}
+
+	return 0;
+}
+
+static int
+shader_warmup_handler(void *data)
+{
+	struct gl_renderer *gr = data;
+	struct gl_shader *shaders[] = {
+		gr->texture_shader_rgbx.opaque_variant,
+		gr->texture_shader_rgba.opaque_variant,
+		&gr->texture_shader_rgba,
+		&gr->solid_shader,
+	};
+	unsigned int i;
+
+	/* One shader at a time, so that client requests and the first
+	 * repaint get their turn in between. */
+	for (i = 0; eglGetCurrentContext() == gr->egl_context &&
+		    i < ARRAY_LENGTH(shaders); i++) {
+		if (shaders[i]->program)
+			continue;
+
+		if (shader_init(shaders[i], gr, shaders[i]->vertex_source,
+				shaders[i]->fragment_source) < 0)
+			weston_log("warning: failed to compile shader\n");
+		wl_event_source_timer_update(gr->shader_warmup_timer, 1);
+		return 0;
+	}
+
+	wl_event_source_remove(gr->shader_warmup_timer);
+	gr->shader_warmup_timer = NULL;
+
 	return 0;
 }
 
@@ -3616,6 +6685,7 @@ fragment_debug_binding(struct weston_keyboard *keyboard,
 	struct weston_compositor *ec = data;
 	struct gl_renderer *gr = get_renderer(ec);
 	struct weston_output *output;
+	unsigned int i;
 
 	gr->fragment_shader_debug = !gr->fragment_shader_debug;
 
@@ -3626,6 +6696,8 @@ fragment_debug_binding(struct weston_keyboard *keyboard,
 	shader_release(&gr->texture_shader_y_u_v);
 	shader_release(&gr->texture_shader_y_xuxv);
 	shader_release(&gr->texture_shader_xyuv);
+	for (i = 0; i < ARRAY_LENGTH(gr->opaque_texture_shaders); i++)
+		shader_release(&gr->opaque_texture_shaders[i]);
 	shader_release(&gr->solid_shader);
 
 	/* Force use_shader() to call glUseProgram(), since we need to use
@@ -3664,6 +6736,39 @@ get_gl_version(void)
 	return GR_GL_VERSION_INVALID;
 }
 
+static const char *
+egl_context_priority_to_str(EGLint priority)
+{
+	switch (priority) {
+	case EGL_CONTEXT_PRIORITY_HIGH_IMG:
+		return "high";
+	case EGL_CONTEXT_PRIORITY_MEDIUM_IMG:
+		return "medium";
+	case EGL_CONTEXT_PRIORITY_LOW_IMG:
+		return "low";
+	default:
+		return "unknown";
+	}
+}
+
+static EGLContext
+gl_renderer_create_context(struct gl_renderer *gr, EGLint *context_attribs)
+{
+	EGLContext context;
+
+	/* try to create an OpenGLES 3 context first */
+	context_attribs[1] = 3;
+	context = eglCreateContext(gr->egl_display, gr->egl_config,
+				   EGL_NO_CONTEXT, context_attribs);
+	if (context != EGL_NO_CONTEXT)
+		return context;
+
+	/* and then fallback to OpenGLES 2 */
+	context_attribs[1] = 2;
+	return eglCreateContext(gr->egl_display, gr->egl_config,
+				EGL_NO_CONTEXT, context_attribs);
+}
+
 static int
 gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 {
@@ -3697,22 +6802,22 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	assert(nattr < ARRAY_LENGTH(context_attribs));
 	context_attribs[nattr] = EGL_NONE;
 
-	/* try to create an OpenGLES 3 context first */
-	context_attribs[1] = 3;
-	gr->egl_context = eglCreateContext(gr->egl_display, gr->egl_config,
-					   EGL_NO_CONTEXT, context_attribs);
-	if (gr->egl_context == NULL) {
-		/* and then fallback to OpenGLES 2 */
-		context_attribs[1] = 2;
-		gr->egl_context = eglCreateContext(gr->egl_display,
-						   gr->egl_config,
-						   EGL_NO_CONTEXT,
-						   context_attribs);
-		if (gr->egl_context == NULL) {
-			weston_log("failed to create context\n");
-			gl_renderer_print_egl_error_state();
-			return -1;
-		}
+	gr->egl_context = gl_renderer_create_context(gr, context_attribs);
+	if (gr->egl_context == EGL_NO_CONTEXT && gr->has_context_priority) {
+		/* The extension lets drivers pick a lower priority than the
+		 * one asked for, but some refuse the context instead when the
+		 * process may not raise its priority. */
+		weston_log("failed to create a high priority context, "
+			   "retrying with the default priority\n");
+		context_attribs[2] = EGL_NONE;
+		gr->has_context_priority = false;
+		gr->egl_context = gl_renderer_create_context(gr,
+							     context_attribs);
+	}
+	if (gr->egl_context == EGL_NO_CONTEXT) {
+		weston_log("failed to create context\n");
+		gl_renderer_print_egl_error_state();
+		return -1;
 	}
 
 	if (gr->has_context_priority) {
@@ -3725,6 +6830,8 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 			weston_log("Failed to obtain a high priority context.\n");
 			/* Not an error, continue on as normal */
 		}
+		weston_log("EGL context priority: %s\n",
+			   egl_context_priority_to_str(value));
 	}
 
 	ret = eglMakeCurrent(gr->egl_display, egl_surface,
@@ -3767,6 +6874,38 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	    weston_check_egl_extension(extensions, "GL_EXT_unpack_subimage"))
 		gr->has_unpack_subimage = true;
 
+	if (weston_check_egl_extension(extensions,
+				       "GL_EXT_disjoint_timer_query")) {
+		gr->gen_queries =
+			(void *) eglGetProcAddress("glGenQueriesEXT");
+		gr->delete_queries =
+			(void *) eglGetProcAddress("glDeleteQueriesEXT");
+		gr->begin_query =
+			(void *) eglGetProcAddress("glBeginQueryEXT");
+		gr->end_query = (void *) eglGetProcAddress("glEndQueryEXT");
+		gr->get_query_objectuiv =
+			(void *) eglGetProcAddress("glGetQueryObjectuivEXT");
+		gr->get_query_objectui64v =
+			(void *) eglGetProcAddress("glGetQueryObjectui64vEXT");
+		gr->has_timer_query = gr->gen_queries && gr->delete_queries &&
+				      gr->begin_query && gr->end_query &&
+				      gr->get_query_objectuiv &&
+				      gr->get_query_objectui64v;
+	}
+
+	if (ec->mipmap_minified_views &&
+	    (gr->gl_version >= GR_GL_VERSION(3, 0) ||
+	     weston_check_egl_extension(extensions, "GL_OES_texture_npot")))
+		gr->has_mipmaps = true;
+
+	/* Atlas uploads address the slots with the unpack parameters */
+	if (gr->has_unpack_subimage) {
+		GLint max_texture_size = 0;
+
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+		gr->has_atlas = max_texture_size >= GL_ATLAS_SIZE;
+	}
+
 	if (gr->gl_version >= GR_GL_VERSION(3, 0) ||
 	    weston_check_egl_extension(extensions, "GL_EXT_texture_rg"))
 		gr->has_gl_texture_rg = true;
@@ -3774,11 +6913,48 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	if (weston_check_egl_extension(extensions, "GL_OES_EGL_image_external"))
 		gr->has_egl_image_external = true;
 
+	if (gr->gl_version >= GR_GL_VERSION(3, 0)) {
+		gr->map_buffer_range =
+			(void *) eglGetProcAddress("glMapBufferRange");
+		gr->unmap_buffer = (void *) eglGetProcAddress("glUnmapBuffer");
+		gr->fence_sync = (void *) eglGetProcAddress("glFenceSync");
+		gr->client_wait_sync =
+			(void *) eglGetProcAddress("glClientWaitSync");
+		gr->delete_sync = (void *) eglGetProcAddress("glDeleteSync");
+
+		if (weston_check_egl_extension(extensions,
+					       "GL_EXT_buffer_storage")) {
+			gr->buffer_storage =
+				(void *) eglGetProcAddress("glBufferStorageEXT");
+			gr->has_buffer_storage = gr->buffer_storage != NULL;
+		}
+
+		if (gr->map_buffer_range && gr->unmap_buffer &&
+		    gr->fence_sync && gr->client_wait_sync &&
+		    gr->delete_sync) {
+			gr->has_pbo_upload = gl_renderer_init_pbo_ring(gr);
+			gr->has_pbo_readback = true;
+		}
+	}
+
 	glActiveTexture(GL_TEXTURE0);
 
+	glGenBuffers(1, &gr->vertex_buffer);
+	glGenBuffers(1, &gr->index_buffer);
+
+	gl_shader_cache_init(gr, extensions);
+
 	if (compile_shaders(ec))
 		return -1;
 
+	/* A timer rather than an idle callback, so that it runs after the
+	 * idle callbacks queued during start-up. */
+	gr->shader_warmup_timer =
+		wl_event_loop_add_timer(wl_display_get_event_loop(ec->wl_display),
+					shader_warmup_handler, gr);
+	if (gr->shader_warmup_timer)
+		wl_event_source_timer_update(gr->shader_warmup_timer, 1);
+
 	gr->fragment_binding =
 		weston_compositor_add_debug_binding(ec, KEY_S,
 						    fragment_debug_binding,
@@ -3797,6 +6973,29 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 		ec->read_format == PIXMAN_a8r8g8b8 ? "BGRA" : "RGBA");
 	weston_log_continue(STAMP_SPACE "wl_shm sub-image to texture: %s\n",
 			    gr->has_unpack_subimage ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "wl_shm upload through PBO: %s\n",
+			    !gr->has_pbo_upload ? "no" :
+			    gr->has_buffer_storage ? "yes, persistent" : "yes");
+	weston_log_continue(STAMP_SPACE "asynchronous read-back: %s\n",
+			    gr->has_pbo_readback ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "per-view GPU timing: %s\n",
+			    gr->has_timer_query ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "mipmaps for minified views: %s\n",
+			    gr->has_mipmaps ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "small wl_shm surface atlas: %s\n",
+			    gr->has_atlas ? "yes" : "no");
+	if (gr->texture_budget)
+		weston_log_continue(STAMP_SPACE "texture memory budget: "
+				    "%zu MiB\n", gr->texture_budget >> 20);
+	else
+		weston_log_continue(STAMP_SPACE "texture memory budget: "
+				    "unlimited\n");
+	weston_log_continue(STAMP_SPACE "opaque front to back: %s\n",
+			    gr->front_to_back ? "yes, if depth buffer" : "no");
+	weston_log_continue(STAMP_SPACE "surface tree cache: %s\n",
+			    gr->tree_cache ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "shader program cache: %s\n",
+			    gr->has_shader_cache ? gr->shader_cache_dir : "no");
 	weston_log_continue(STAMP_SPACE "EGL Wayland extension: %s\n",
 			    gr->has_bind_display ? "yes" : "no");
 
@@ -0,0 +1,316 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libweston/libweston.h>
+#include "gl-renderer.h"
+#include "gl-renderer-internal.h"
+#include "shared/helpers.h"
+#include "shared/platform.h"
+
+/*
+ * Linked shader programs are kept in
+ * $XDG_CACHE_HOME/weston/shaders/<hash>.bin, as returned by
+ * glGetProgramBinaryOES(). The hash covers the GL vendor, renderer and
+ * version strings plus the shader sources, so a driver update or a shader
+ * change simply misses the cache. Stale files are not cleaned up, a driver
+ * rejecting a binary only costs a compilation from source.
+ */
+
+#define SHADER_CACHE_MAGIC 0x57534331 /* "WSC1" */
+#define SHADER_CACHE_MAX_SIZE (4 * 1024 * 1024)
+
+struct shader_cache_header {
+	uint32_t magic;
+	uint32_t format;
+	uint32_t length;
+	uint32_t reserved;
+	uint64_t hash;
+};
+
+static uint64_t
+fnv1a_64(uint64_t hash, const char *str)
+{
+	const unsigned char *p;
+
+	for (p = (const unsigned char *)str; *p; p++) {
+		hash ^= *p;
+		hash *= 0x100000001b3ull;
+	}
+
+	/* separate consecutive strings */
+	hash ^= 0xff;
+	hash *= 0x100000001b3ull;
+
+	return hash;
+}
+
+static uint64_t
+shader_cache_hash(struct gl_renderer *gr, const char *const *sources,
+		  int n_sources)
+{
+	uint64_t hash = gr->shader_cache_seed;
+	int i;
+
+	for (i = 0; i < n_sources; i++)
+		hash = fnv1a_64(hash, sources[i]);
+
+	return hash;
+}
+
+static int
+mkdir_p(char *path)
+{
+	char *p;
+
+	for (p = path + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+
+		*p = '\0';
+		if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+
+	if (mkdir(path, 0700) < 0 && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+static void
+shader_cache_path(struct gl_renderer *gr, uint64_t hash,
+		  char *path, size_t size)
+{
+	snprintf(path, size, "%s/%016" PRIx64 ".bin",
+		 gr->shader_cache_dir, hash);
+}
+
+/** Set up the program binary cache
+ *
+ * Must be called with the context current. Leaves the cache disabled if
+ * the driver cannot return program binaries or there is no usable cache
+ * directory.
+ */
+void
+gl_shader_cache_init(struct gl_renderer *gr, const char *extensions)
+{
+	const char *cache_home = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	const char *driver[3];
+	char dir[PATH_MAX];
+	GLint n_formats = 0;
+	unsigned int i;
+	int len;
+
+	if (getenv("WESTON_GL_NO_SHADER_CACHE"))
+		return;
+
+	if (!weston_check_egl_extension(extensions,
+					"GL_OES_get_program_binary"))
+		return;
+
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &n_formats);
+	if (n_formats <= 0)
+		return;
+
+	gr->get_program_binary =
+		(void *) eglGetProcAddress("glGetProgramBinaryOES");
+	gr->program_binary = (void *) eglGetProcAddress("glProgramBinaryOES");
+	if (!gr->get_program_binary || !gr->program_binary)
+		return;
+
+	if (cache_home && cache_home[0] == '/')
+		len = snprintf(dir, sizeof dir, "%s/weston/shaders",
+			       cache_home);
+	else if (home)
+		len = snprintf(dir, sizeof dir, "%s/.cache/weston/shaders",
+			       home);
+	else
+		return;
+
+	if (len < 0 || (size_t)len >= sizeof dir)
+		return;
+
+	if (mkdir_p(dir) < 0) {
+		weston_log("warning: cannot create shader cache directory "
+			   "%s: %s\n", dir, strerror(errno));
+		return;
+	}
+
+	gr->shader_cache_dir = strdup(dir);
+	if (!gr->shader_cache_dir)
+		return;
+
+	driver[0] = (const char *) glGetString(GL_VENDOR);
+	driver[1] = (const char *) glGetString(GL_RENDERER);
+	driver[2] = (const char *) glGetString(GL_VERSION);
+
+	gr->shader_cache_seed = 0xcbf29ce484222325ull;
+	for (i = 0; i < ARRAY_LENGTH(driver); i++)
+		gr->shader_cache_seed = fnv1a_64(gr->shader_cache_seed,
+						 driver[i] ? driver[i] : "");
+
+	gr->has_shader_cache = true;
+}
+
+void
+gl_shader_cache_fini(struct gl_renderer *gr)
+{
+	free(gr->shader_cache_dir);
+	gr->shader_cache_dir = NULL;
+	gr->has_shader_cache = false;
+}
+
+/** Try to load a linked program from the cache
+ *
+ * \param gr The renderer.
+ * \param program A freshly created program object.
+ * \param sources The vertex and fragment shader sources of the program.
+ * \param n_sources The number of strings in sources.
+ * \return true if program was successfully loaded and linked.
+ */
+bool
+gl_shader_cache_load(struct gl_renderer *gr, GLuint program,
+		     const char *const *sources, int n_sources)
+{
+	struct shader_cache_header header;
+	char path[PATH_MAX];
+	uint64_t hash;
+	GLint status = GL_FALSE;
+	void *binary;
+	int fd;
+
+	if (!gr->has_shader_cache)
+		return false;
+
+	hash = shader_cache_hash(gr, sources, n_sources);
+	shader_cache_path(gr, hash, path, sizeof path);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	if (read(fd, &header, sizeof header) != sizeof header ||
+	    header.magic != SHADER_CACHE_MAGIC || header.hash != hash ||
+	    header.length == 0 || header.length > SHADER_CACHE_MAX_SIZE) {
+		close(fd);
+		return false;
+	}
+
+	binary = malloc(header.length);
+	if (!binary) {
+		close(fd);
+		return false;
+	}
+
+	if (read(fd, binary, header.length) == (ssize_t)header.length) {
+		gr->program_binary(program, header.format,
+				   binary, header.length);
+		glGetProgramiv(program, GL_LINK_STATUS, &status);
+	}
+
+	free(binary);
+	close(fd);
+
+	return status == GL_TRUE;
+}
+
+/** Store a linked program in the cache
+ *
+ * Failures are not fatal and only logged.
+ */
+void
+gl_shader_cache_store(struct gl_renderer *gr, GLuint program,
+		      const char *const *sources, int n_sources)
+{
+	struct shader_cache_header header;
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX + 16];
+	GLint length = 0;
+	GLenum format;
+	void *binary;
+	bool ok;
+	int fd;
+
+	if (!gr->has_shader_cache)
+		return;
+
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0 || length > SHADER_CACHE_MAX_SIZE)
+		return;
+
+	binary = malloc(length);
+	if (!binary)
+		return;
+
+	gr->get_program_binary(program, length, &length, &format, binary);
+	if (length <= 0) {
+		free(binary);
+		return;
+	}
+
+	memset(&header, 0, sizeof header);
+	header.magic = SHADER_CACHE_MAGIC;
+	header.format = format;
+	header.length = length;
+	header.hash = shader_cache_hash(gr, sources, n_sources);
+
+	shader_cache_path(gr, header.hash, path, sizeof path);
+	snprintf(tmp_path, sizeof tmp_path, "%s.%d", path, (int)getpid());
+
+	/* Written to a temporary file first, so that a concurrent weston
+	 * instance never reads a partial binary. */
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		free(binary);
+		return;
+	}
+
+	ok = write(fd, &header, sizeof header) == sizeof header &&
+	     write(fd, binary, length) == (ssize_t)length;
+	ok = close(fd) == 0 && ok;
+	free(binary);
+
+	if (!ok || rename(tmp_path, path) < 0) {
+		weston_log("warning: failed to write shader cache file %s\n",
+			   path);
+		unlink(tmp_path);
+	}
+}
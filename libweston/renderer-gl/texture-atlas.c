@@ -0,0 +1,202 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libweston/libweston.h>
+#include <libweston/zalloc.h>
+#include "gl-renderer.h"
+#include "gl-renderer-internal.h"
+#include "shared/helpers.h"
+
+/*
+ * Small SHM surfaces (cursors, tooltips, decoration pieces, icons) share a
+ * few big textures instead of getting one each, so that views drawn one
+ * after the other can sample the same texture and be merged into a single
+ * draw, see draw_view().
+ *
+ * Every atlas page is split into square cells of a single size class, and a
+ * bitmap tracks the cells in use. This wastes some texture memory compared
+ * to a real rectangle packer, but allocation and release are trivial and
+ * the pages never fragment. Each cell has a border of GL_ATLAS_PADDING
+ * pixels around the surface content, filled with a copy of the content
+ * edges on upload, so that linear filtering never picks up texels from a
+ * neighbouring cell.
+ */
+
+static const int atlas_size_classes[] = { 32, 64, GL_ATLAS_MAX_SURFACE_SIZE };
+
+static int
+atlas_size_class(int width, int height)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(atlas_size_classes); i++)
+		if (width <= atlas_size_classes[i] &&
+		    height <= atlas_size_classes[i])
+			return atlas_size_classes[i];
+
+	return 0;
+}
+
+static struct gl_atlas_page *
+atlas_page_create(struct gl_renderer *gr, int size_class)
+{
+	struct gl_atlas_page *page;
+
+	page = zalloc(sizeof *page);
+	if (!page)
+		return NULL;
+
+	page->cell_size = size_class + 2 * GL_ATLAS_PADDING;
+	page->cells_per_row = GL_ATLAS_SIZE / page->cell_size;
+	page->n_cells = page->cells_per_row * page->cells_per_row;
+	if (page->n_cells > (int)sizeof page->used * 8)
+		page->n_cells = sizeof page->used * 8;
+
+	while (glGetError() != GL_NO_ERROR)
+		;
+
+	glGenTextures(1, &page->texture);
+	glBindTexture(GL_TEXTURE_2D, page->texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_BGRA_EXT,
+		     GL_ATLAS_SIZE, GL_ATLAS_SIZE, 0,
+		     GL_BGRA_EXT, GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	if (glGetError() != GL_NO_ERROR) {
+		glDeleteTextures(1, &page->texture);
+		free(page);
+		return NULL;
+	}
+
+	wl_list_insert(&gr->atlas_pages, &page->link);
+
+	return page;
+}
+
+static void
+atlas_page_destroy(struct gl_atlas_page *page)
+{
+	glDeleteTextures(1, &page->texture);
+	wl_list_remove(&page->link);
+	free(page);
+}
+
+static int
+atlas_page_find_free_cell(struct gl_atlas_page *page)
+{
+	int i;
+
+	if (page->n_used == page->n_cells)
+		return -1;
+
+	for (i = 0; i < page->n_cells; i++)
+		if (!(page->used[i / 32] & (1u << (i % 32))))
+			return i;
+
+	return -1;
+}
+
+/** Allocate room for a width x height texture in an atlas page
+ *
+ * \return true on success, with slot filled in. The content of the slot is
+ * undefined until uploaded.
+ */
+bool
+gl_atlas_alloc(struct gl_renderer *gr, int width, int height,
+	       struct gl_atlas_slot *slot)
+{
+	struct gl_atlas_page *page, *found = NULL;
+	int size_class, cell = -1;
+
+	size_class = atlas_size_class(width, height);
+	if (size_class == 0)
+		return false;
+
+	wl_list_for_each(page, &gr->atlas_pages, link) {
+		if (page->cell_size != size_class + 2 * GL_ATLAS_PADDING)
+			continue;
+
+		cell = atlas_page_find_free_cell(page);
+		if (cell >= 0) {
+			found = page;
+			break;
+		}
+	}
+
+	if (!found) {
+		found = atlas_page_create(gr, size_class);
+		if (!found)
+			return false;
+		cell = 0;
+	}
+
+	found->used[cell / 32] |= 1u << (cell % 32);
+	found->n_used++;
+
+	slot->page = found;
+	slot->cell = cell;
+	slot->x = (cell % found->cells_per_row) * found->cell_size +
+		  GL_ATLAS_PADDING;
+	slot->y = (cell / found->cells_per_row) * found->cell_size +
+		  GL_ATLAS_PADDING;
+
+	return true;
+}
+
+/** Release an atlas slot, destroying its page once empty */
+void
+gl_atlas_free(struct gl_atlas_slot *slot)
+{
+	struct gl_atlas_page *page = slot->page;
+
+	if (!page)
+		return;
+
+	page->used[slot->cell / 32] &= ~(1u << (slot->cell % 32));
+	if (--page->n_used == 0)
+		atlas_page_destroy(page);
+
+	memset(slot, 0, sizeof *slot);
+}
+
+/** Destroy the remaining atlas pages, must be called with the context
+ * current after all surface states are gone. */
+void
+gl_atlas_fini(struct gl_renderer *gr)
+{
+	struct gl_atlas_page *page, *tmp;
+
+	wl_list_for_each_safe(page, tmp, &gr->atlas_pages, link)
+		atlas_page_destroy(page);
+}
@@ -0,0 +1,674 @@
+/*
+ * Copyright © 2021 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <drm_fourcc.h>
+
+#include <libweston/libweston.h>
+#include <libweston/zalloc.h>
+#include "libweston-internal.h"
+#include "linux-dmabuf.h"
+#include "weston-screencopy-server-protocol.h"
+#include "shared/helpers.h"
+
+/*
+ * Incremental output capture for remote desktop gateways. A session keeps
+ * the planes of its output disabled, so everything shown is composited and
+ * the frame signal reports all of the damage. That damage is accumulated
+ * between copies; a copy into the buffer of the previous copy only
+ * transfers what changed. SHM buffers are read back asynchronously, which
+ * uses a writeback connector when the backend has one, dmabuf buffers are
+ * written by the renderer on the GPU.
+ */
+
+struct screencopy_frame {
+	struct wl_resource *resource; /* NULL once destroyed */
+	struct weston_output *output; /* NULL once the output is gone */
+	struct wl_listener output_destroy_listener;
+	struct wl_listener output_resized_listener;
+	struct wl_listener frame_listener;
+	struct wl_listener presented_listener;
+
+	/* Changed since the last successful copy, in global coordinates */
+	pixman_region32_t damage;
+	/* The next copy must write the whole output */
+	bool full;
+
+	/* Target of the last successful copy */
+	struct weston_buffer *last_buffer;
+	struct wl_listener last_buffer_destroy_listener;
+
+	/* The pending copy */
+	struct weston_buffer *buffer;
+	struct wl_listener buffer_destroy_listener;
+	bool copying; /* waiting for the read and the presentation */
+	bool read_pending;
+	bool present_pending;
+	bool failed;
+	pixman_region32_t copy_damage; /* framebuffer coordinates, y down */
+	pixman_box32_t extents; /* the area read into pixels */
+	uint32_t *pixels;
+	bool yflip;
+	struct timespec stamp;
+};
+
+static uint32_t
+shm_format_from_pixman(pixman_format_code_t format)
+{
+	switch (format) {
+	case PIXMAN_a8r8g8b8:
+	case PIXMAN_x8r8g8b8:
+		return WL_SHM_FORMAT_ARGB8888;
+	case PIXMAN_a8b8g8r8:
+	case PIXMAN_x8b8g8r8:
+		return WL_SHM_FORMAT_ABGR8888;
+	default:
+		return 0xffffffff;
+	}
+}
+
+/* The opaque formats are accepted too, alpha is undefined anyway. */
+static bool
+shm_format_matches(uint32_t format, uint32_t wanted)
+{
+	switch (wanted) {
+	case WL_SHM_FORMAT_ARGB8888:
+		return format == WL_SHM_FORMAT_ARGB8888 ||
+		       format == WL_SHM_FORMAT_XRGB8888;
+	case WL_SHM_FORMAT_ABGR8888:
+		return format == WL_SHM_FORMAT_ABGR8888 ||
+		       format == WL_SHM_FORMAT_XBGR8888;
+	default:
+		return false;
+	}
+}
+
+static void
+screencopy_frame_send_formats(struct screencopy_frame *frame)
+{
+	struct weston_output *output = frame->output;
+	struct weston_compositor *compositor = output->compositor;
+	uint32_t width = output->current_mode->width;
+	uint32_t height = output->current_mode->height;
+	uint32_t shm_format = shm_format_from_pixman(compositor->read_format);
+
+	if (shm_format != 0xffffffff)
+		weston_screencopy_frame_v1_send_shm_format(frame->resource,
+							   shm_format,
+							   width, height,
+							   width * 4);
+
+	if (compositor->renderer->output_copy_to_dmabuf) {
+		weston_screencopy_frame_v1_send_dmabuf_format(frame->resource,
+							      DRM_FORMAT_XRGB8888,
+							      width, height);
+		weston_screencopy_frame_v1_send_dmabuf_format(frame->resource,
+							      DRM_FORMAT_ARGB8888,
+							      width, height);
+	}
+
+	weston_screencopy_frame_v1_send_buffer_done(frame->resource);
+}
+
+static void
+screencopy_frame_set_last_buffer(struct screencopy_frame *frame,
+				 struct weston_buffer *buffer)
+{
+	if (frame->last_buffer)
+		wl_list_remove(&frame->last_buffer_destroy_listener.link);
+
+	frame->last_buffer = buffer;
+	if (buffer)
+		wl_signal_add(&buffer->destroy_signal,
+			      &frame->last_buffer_destroy_listener);
+}
+
+static void
+screencopy_frame_clear_buffer(struct screencopy_frame *frame)
+{
+	if (!frame->buffer)
+		return;
+
+	wl_list_remove(&frame->buffer_destroy_listener.link);
+	frame->buffer = NULL;
+}
+
+static void
+screencopy_frame_free(struct screencopy_frame *frame)
+{
+	screencopy_frame_clear_buffer(frame);
+	screencopy_frame_set_last_buffer(frame, NULL);
+	pixman_region32_fini(&frame->damage);
+	pixman_region32_fini(&frame->copy_damage);
+	free(frame->pixels);
+	free(frame);
+}
+
+/* Send the outcome of the copy once both the read and the presentation
+ * of the frame are done. */
+static void
+screencopy_frame_maybe_complete(struct screencopy_frame *frame)
+{
+	pixman_box32_t *rects;
+	uint64_t sec;
+	int i, n;
+
+	if (!frame->copying || frame->read_pending || frame->present_pending)
+		return;
+
+	frame->copying = false;
+	free(frame->pixels);
+	frame->pixels = NULL;
+
+	if (!frame->resource) {
+		screencopy_frame_free(frame);
+		return;
+	}
+
+	if (frame->failed || !frame->buffer) {
+		frame->full = true;
+		screencopy_frame_clear_buffer(frame);
+		weston_screencopy_frame_v1_send_failed(frame->resource);
+		return;
+	}
+
+	screencopy_frame_set_last_buffer(frame, frame->buffer);
+	screencopy_frame_clear_buffer(frame);
+
+	weston_screencopy_frame_v1_send_flags(frame->resource,
+		frame->yflip ? WESTON_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT : 0);
+
+	rects = pixman_region32_rectangles(&frame->copy_damage, &n);
+	for (i = 0; i < n; i++)
+		weston_screencopy_frame_v1_send_damage(frame->resource,
+						       rects[i].x1, rects[i].y1,
+						       rects[i].x2 - rects[i].x1,
+						       rects[i].y2 - rects[i].y1);
+
+	sec = frame->stamp.tv_sec;
+	weston_screencopy_frame_v1_send_ready(frame->resource,
+					      sec >> 32, sec & 0xffffffff,
+					      frame->stamp.tv_nsec);
+}
+
+/* Copy the damaged rectangles out of the read extents into the buffer,
+ * flipping the rows if the renderer reads them bottom-up. */
+static void
+screencopy_frame_write_shm(struct screencopy_frame *frame)
+{
+	struct wl_shm_buffer *shm = wl_shm_buffer_get(frame->buffer->resource);
+	pixman_box32_t *r, *ext = &frame->extents;
+	int ext_width = ext->x2 - ext->x1;
+	int32_t stride = wl_shm_buffer_get_stride(shm);
+	uint8_t *data = wl_shm_buffer_get_data(shm);
+	uint32_t *s;
+	int i, n, y, row;
+
+	r = pixman_region32_rectangles(&frame->copy_damage, &n);
+
+	wl_shm_buffer_begin_access(shm);
+	for (i = 0; i < n; i++) {
+		for (y = r[i].y1; y < r[i].y2; y++) {
+			if (frame->yflip)
+				row = ext->y2 - 1 - y;
+			else
+				row = y - ext->y1;
+			s = frame->pixels + ext_width * row +
+			    (r[i].x1 - ext->x1);
+			memcpy(data + stride * y + r[i].x1 * 4, s,
+			       (r[i].x2 - r[i].x1) * 4);
+		}
+	}
+	wl_shm_buffer_end_access(shm);
+}
+
+static void
+screencopy_frame_read_done(void *data, int status)
+{
+	struct screencopy_frame *frame = data;
+
+	frame->read_pending = false;
+
+	if (status < 0)
+		frame->failed = true;
+	else if (frame->buffer)
+		screencopy_frame_write_shm(frame);
+
+	screencopy_frame_maybe_complete(frame);
+}
+
+static void
+screencopy_frame_presented(struct wl_listener *listener, void *data)
+{
+	struct screencopy_frame *frame =
+		container_of(listener, struct screencopy_frame,
+			     presented_listener);
+	struct weston_output_presentation *presentation = data;
+
+	wl_list_remove(&frame->presented_listener.link);
+	wl_list_init(&frame->presented_listener.link);
+
+	if (presentation->stamp)
+		frame->stamp = *presentation->stamp;
+	else
+		frame->stamp = (struct timespec) { 0 };
+	frame->present_pending = false;
+
+	screencopy_frame_maybe_complete(frame);
+}
+
+static void
+screencopy_frame_copy_shm(struct screencopy_frame *frame)
+{
+	struct weston_output *output = frame->output;
+	struct weston_compositor *compositor = output->compositor;
+	pixman_box32_t *ext;
+	int y_orig;
+
+	/* Read the extents of the damage with a single read, the rectangles
+	 * are picked out of it once it arrives. */
+	ext = pixman_region32_extents(&frame->copy_damage);
+	frame->extents = *ext;
+	frame->pixels = malloc((ext->x2 - ext->x1) * (ext->y2 - ext->y1) *
+			       sizeof *frame->pixels);
+	if (!frame->pixels) {
+		frame->failed = true;
+		return;
+	}
+
+	if (frame->yflip)
+		y_orig = output->current_mode->height - ext->y2;
+	else
+		y_orig = ext->y1;
+
+	frame->read_pending = true;
+	if (weston_output_read_pixels_async(output, compositor->read_format,
+					    frame->pixels,
+					    ext->x1, y_orig,
+					    ext->x2 - ext->x1,
+					    ext->y2 - ext->y1,
+					    screencopy_frame_read_done,
+					    frame) < 0) {
+		frame->read_pending = false;
+		frame->failed = true;
+	}
+}
+
+static void
+screencopy_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct screencopy_frame *frame =
+		container_of(listener, struct screencopy_frame, frame_listener);
+	struct weston_output *output = frame->output;
+	struct weston_compositor *compositor = output->compositor;
+	struct linux_dmabuf_buffer *dmabuf;
+	pixman_region32_t damage;
+	pixman_box32_t *rects;
+	int n;
+
+	pixman_region32_union(&frame->damage, &frame->damage, data);
+
+	if (!frame->buffer || frame->copying)
+		return;
+
+	pixman_region32_init(&damage);
+	if (frame->full)
+		pixman_region32_copy(&damage, &output->region);
+	else
+		pixman_region32_intersect(&damage, &output->region,
+					  &frame->damage);
+	pixman_region32_translate(&damage, -output->x, -output->y);
+	pixman_region32_clear(&frame->copy_damage);
+	weston_output_transformed_region(output, &damage, &frame->copy_damage);
+	pixman_region32_fini(&damage);
+
+	/* Nothing changed yet, wait for a repaint that does. */
+	if (!pixman_region32_not_empty(&frame->copy_damage))
+		return;
+
+	pixman_region32_clear(&frame->damage);
+	frame->full = false;
+	frame->copying = true;
+	frame->failed = false;
+	frame->yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+
+	/* Before reading, which may complete right away. */
+	frame->present_pending = true;
+	wl_signal_add(&output->presented_signal, &frame->presented_listener);
+
+	dmabuf = linux_dmabuf_buffer_get(frame->buffer->resource);
+	if (dmabuf) {
+		rects = pixman_region32_rectangles(&frame->copy_damage, &n);
+		if (compositor->renderer->output_copy_to_dmabuf(output, dmabuf,
+								rects, n) < 0)
+			frame->failed = true;
+	} else {
+		screencopy_frame_copy_shm(frame);
+	}
+}
+
+/* Stop following the output; the session stays but fails every copy. */
+static void
+screencopy_frame_detach_output(struct screencopy_frame *frame)
+{
+	if (!frame->output)
+		return;
+
+	wl_list_remove(&frame->output_destroy_listener.link);
+	wl_list_remove(&frame->output_resized_listener.link);
+	wl_list_remove(&frame->frame_listener.link);
+	wl_list_remove(&frame->presented_listener.link);
+	wl_list_init(&frame->presented_listener.link);
+	weston_output_disable_planes_decr(frame->output);
+	frame->output = NULL;
+	frame->present_pending = false;
+}
+
+/* Fail a copy still waiting for a repaint, and make the next one full. */
+static void
+screencopy_frame_fail_pending(struct screencopy_frame *frame)
+{
+	frame->full = true;
+
+	if (!frame->buffer || frame->copying)
+		return;
+
+	screencopy_frame_clear_buffer(frame);
+	if (frame->resource)
+		weston_screencopy_frame_v1_send_failed(frame->resource);
+}
+
+static void
+screencopy_frame_output_destroyed(struct wl_listener *listener, void *data)
+{
+	struct screencopy_frame *frame =
+		container_of(listener, struct screencopy_frame,
+			     output_destroy_listener);
+
+	screencopy_frame_detach_output(frame);
+
+	if (frame->copying) {
+		frame->failed = true;
+		screencopy_frame_maybe_complete(frame);
+	} else {
+		screencopy_frame_fail_pending(frame);
+	}
+}
+
+static void
+screencopy_frame_output_resized(struct wl_listener *listener, void *data)
+{
+	struct screencopy_frame *frame =
+		container_of(listener, struct screencopy_frame,
+			     output_resized_listener);
+
+	if (data != frame->output)
+		return;
+
+	screencopy_frame_fail_pending(frame);
+	if (frame->resource)
+		screencopy_frame_send_formats(frame);
+}
+
+static void
+screencopy_frame_buffer_destroyed(struct wl_listener *listener, void *data)
+{
+	struct screencopy_frame *frame =
+		container_of(listener, struct screencopy_frame,
+			     buffer_destroy_listener);
+
+	wl_list_remove(&frame->buffer_destroy_listener.link);
+	frame->buffer = NULL;
+}
+
+static void
+screencopy_frame_last_buffer_destroyed(struct wl_listener *listener,
+				       void *data)
+{
+	struct screencopy_frame *frame =
+		container_of(listener, struct screencopy_frame,
+			     last_buffer_destroy_listener);
+
+	wl_list_remove(&frame->last_buffer_destroy_listener.link);
+	frame->last_buffer = NULL;
+}
+
+static bool
+screencopy_frame_buffer_fits(struct screencopy_frame *frame,
+			     struct wl_resource *buffer_resource)
+{
+	struct weston_output *output = frame->output;
+	struct weston_compositor *compositor = output->compositor;
+	int32_t width = output->current_mode->width;
+	int32_t height = output->current_mode->height;
+	struct linux_dmabuf_buffer *dmabuf;
+	struct wl_shm_buffer *shm;
+
+	shm = wl_shm_buffer_get(buffer_resource);
+	if (shm)
+		return shm_format_matches(wl_shm_buffer_get_format(shm),
+			shm_format_from_pixman(compositor->read_format)) &&
+		       wl_shm_buffer_get_width(shm) >= width &&
+		       wl_shm_buffer_get_height(shm) >= height &&
+		       wl_shm_buffer_get_stride(shm) >= width * 4;
+
+	dmabuf = linux_dmabuf_buffer_get(buffer_resource);
+	if (dmabuf)
+		return compositor->renderer->output_copy_to_dmabuf &&
+		       (dmabuf->attributes.format == DRM_FORMAT_XRGB8888 ||
+			dmabuf->attributes.format == DRM_FORMAT_ARGB8888) &&
+		       dmabuf->attributes.width == width &&
+		       dmabuf->attributes.height == height;
+
+	return false;
+}
+
+static void
+screencopy_frame_copy(struct wl_client *client,
+		      struct wl_resource *resource,
+		      struct wl_resource *buffer_resource)
+{
+	struct screencopy_frame *frame = wl_resource_get_user_data(resource);
+	struct weston_compositor *compositor;
+	struct weston_buffer *buffer;
+
+	if (frame->buffer || frame->copying) {
+		wl_resource_post_error(resource,
+			WESTON_SCREENCOPY_FRAME_V1_ERROR_ALREADY_PENDING,
+			"weston_screencopy_frame_v1@%"PRIu32" already has a "
+			"copy pending", wl_resource_get_id(resource));
+		return;
+	}
+
+	if (!frame->output ||
+	    !screencopy_frame_buffer_fits(frame, buffer_resource)) {
+		weston_screencopy_frame_v1_send_failed(resource);
+		return;
+	}
+
+	buffer = weston_buffer_from_resource(buffer_resource);
+	if (!buffer) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	frame->buffer = buffer;
+	wl_signal_add(&buffer->destroy_signal, &frame->buffer_destroy_listener);
+
+	if (buffer != frame->last_buffer)
+		frame->full = true;
+
+	/* Without new damage the copy waits for the next repaint that
+	 * changes something, there is no need to repaint now. */
+	compositor = frame->output->compositor;
+	if (frame->full) {
+		weston_output_damage(frame->output);
+	} else if (pixman_region32_not_empty(&frame->damage)) {
+		pixman_region32_union(&compositor->primary_plane.damage,
+				      &compositor->primary_plane.damage,
+				      &frame->damage);
+		weston_output_schedule_repaint(frame->output);
+	}
+}
+
+static void
+screencopy_frame_destroy(struct wl_client *client,
+			 struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct weston_screencopy_frame_v1_interface
+	screencopy_frame_implementation = {
+		screencopy_frame_copy,
+		screencopy_frame_destroy,
+};
+
+static void
+screencopy_frame_destroy_resource(struct wl_resource *resource)
+{
+	struct screencopy_frame *frame = wl_resource_get_user_data(resource);
+
+	frame->resource = NULL;
+	screencopy_frame_detach_output(frame);
+
+	/* A read in flight still writes into the frame. */
+	if (!frame->read_pending)
+		screencopy_frame_free(frame);
+}
+
+static void
+screencopy_manager_destroy(struct wl_client *client,
+			   struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+screencopy_manager_capture_output(struct wl_client *client,
+				  struct wl_resource *resource,
+				  uint32_t id,
+				  struct wl_resource *output_resource)
+{
+	struct weston_head *head = weston_head_from_resource(output_resource);
+	struct weston_output *output = head ? head->output : NULL;
+	struct screencopy_frame *frame;
+
+	frame = zalloc(sizeof *frame);
+	if (!frame) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	frame->resource = wl_resource_create(client,
+					     &weston_screencopy_frame_v1_interface,
+					     1, id);
+	if (!frame->resource) {
+		free(frame);
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	pixman_region32_init(&frame->damage);
+	pixman_region32_init(&frame->copy_damage);
+	frame->full = true;
+	frame->buffer_destroy_listener.notify =
+		screencopy_frame_buffer_destroyed;
+	frame->last_buffer_destroy_listener.notify =
+		screencopy_frame_last_buffer_destroyed;
+	frame->presented_listener.notify = screencopy_frame_presented;
+	wl_list_init(&frame->presented_listener.link);
+
+	wl_resource_set_implementation(frame->resource,
+				       &screencopy_frame_implementation, frame,
+				       screencopy_frame_destroy_resource);
+
+	/* An output that is gone only gets an empty format list. */
+	if (!output) {
+		weston_screencopy_frame_v1_send_buffer_done(frame->resource);
+		return;
+	}
+
+	frame->output = output;
+	frame->output_destroy_listener.notify =
+		screencopy_frame_output_destroyed;
+	wl_signal_add(&output->destroy_signal, &frame->output_destroy_listener);
+	frame->output_resized_listener.notify =
+		screencopy_frame_output_resized;
+	wl_signal_add(&output->compositor->output_resized_signal,
+		      &frame->output_resized_listener);
+	frame->frame_listener.notify = screencopy_frame_notify;
+	wl_signal_add(&output->frame_signal, &frame->frame_listener);
+	weston_output_disable_planes_incr(output);
+
+	screencopy_frame_send_formats(frame);
+}
+
+static const struct weston_screencopy_manager_v1_interface
+	screencopy_manager_implementation = {
+		screencopy_manager_destroy,
+		screencopy_manager_capture_output,
+};
+
+static void
+bind_screencopy(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client,
+				      &weston_screencopy_manager_v1_interface,
+				      version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource,
+				       &screencopy_manager_implementation,
+				       data, NULL);
+}
+
+/** Advertise weston_screencopy_manager_v1
+ *
+ * Lets any client read the contents of the outputs, so the frontend only
+ * calls this when configured to.
+ */
+WL_EXPORT int
+weston_compositor_enable_screencopy(struct weston_compositor *compositor)
+{
+	if (!wl_global_create(compositor->wl_display,
+			      &weston_screencopy_manager_v1_interface, 1,
+			      compositor, bind_screencopy))
+		return -1;
+
+	return 0;
+}
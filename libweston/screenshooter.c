@@ -33,10 +33,15 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
 
 #include <libweston/libweston.h>
 #include "shared/helpers.h"
+#include "shared/pixel-convert.h"
 #include "shared/timespec-util.h"
 #include "backend.h"
 #include "libweston-internal.h"
@@ -45,10 +50,21 @@
 
 struct screenshooter_frame_listener {
 	struct wl_listener listener;
-	struct weston_buffer *buffer;
+	struct wl_listener buffer_destroy_listener;
+	struct weston_buffer *buffer; /* NULL once destroyed */
 	struct weston_output *output;
 	weston_screenshooter_done_func_t done;
 	void *data;
+
+	/* Only this part of the output, in output-local coordinates */
+	bool region;
+	pixman_box32_t rect;
+
+	/* Frame being read back */
+	uint8_t *pixels;
+	pixman_format_code_t read_format;
+	bool yflip;
+	int32_t width, height;
 };
 
 static void
@@ -74,18 +90,7 @@ copy_bgra(uint8_t *dst, uint8_t *src, int height, int stride)
 static void
 copy_row_swap_RB(void *vdst, void *vsrc, int bytes)
 {
-	uint32_t *dst = vdst;
-	uint32_t *src = vsrc;
-	uint32_t *end = dst + bytes / 4;
-
-	while (dst < end) {
-		uint32_t v = *src++;
-		/*                    A R G B */
-		uint32_t tmp = v & 0xff00ff00;
-		tmp |= (v >> 16) & 0x000000ff;
-		tmp |= (v << 16) & 0x00ff0000;
-		*dst++ = tmp;
-	}
+	pixel_copy_swap_rb(vdst, vsrc, bytes / 4);
 }
 
 static void
@@ -115,53 +120,99 @@ copy_rgba(uint8_t *dst, uint8_t *src, int height, int stride)
 }
 
 static void
-screenshooter_frame_notify(struct wl_listener *listener, void *data)
+screenshooter_frame_listener_destroy(struct screenshooter_frame_listener *l)
+{
+	if (l->buffer)
+		wl_list_remove(&l->buffer_destroy_listener.link);
+	free(l->pixels);
+	free(l);
+}
+
+static void
+screenshooter_buffer_destroy_handler(struct wl_listener *listener,
+				     void *data)
 {
 	struct screenshooter_frame_listener *l =
-		container_of(listener,
-			     struct screenshooter_frame_listener, listener);
-	struct weston_output *output = l->output;
-	struct weston_compositor *compositor = output->compositor;
-	int32_t stride;
-	uint8_t *pixels, *d, *s;
+		container_of(listener, struct screenshooter_frame_listener,
+			     buffer_destroy_listener);
 
-	weston_output_disable_planes_decr(output);
-	wl_list_remove(&listener->link);
-	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
-	pixels = malloc(stride * l->buffer->height);
+	wl_list_remove(&l->buffer_destroy_listener.link);
+	l->buffer = NULL;
+}
 
-	if (pixels == NULL) {
-		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
-		free(l);
+/* The pixels of a region are packed, the rows of the buffer may be longer. */
+static void
+copy_region(struct screenshooter_frame_listener *l, uint8_t *dst,
+	    int32_t dst_stride)
+{
+	int32_t src_stride = l->width * 4;
+	uint8_t *src = l->pixels;
+	bool swap_rb;
+	int32_t i;
+
+	swap_rb = l->read_format == PIXMAN_x8b8g8r8 ||
+		  l->read_format == PIXMAN_a8b8g8r8;
+
+	if (l->yflip) {
+		src += src_stride * (l->height - 1);
+		src_stride = -src_stride;
+	}
+
+	for (i = 0; i < l->height; i++) {
+		if (swap_rb)
+			copy_row_swap_RB(dst, src, l->width * 4);
+		else
+			memcpy(dst, src, l->width * 4);
+		dst += dst_stride;
+		src += src_stride;
+	}
+}
+
+static void
+screenshooter_read_done(void *data, int status)
+{
+	struct screenshooter_frame_listener *l = data;
+	int32_t stride;
+	uint8_t *d, *s;
+
+	if (status < 0 || !l->buffer) {
+		l->done(l->data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+		screenshooter_frame_listener_destroy(l);
 		return;
 	}
 
-	compositor->renderer->read_pixels(output,
-			     compositor->read_format, pixels,
-			     0, 0, output->current_mode->width,
-			     output->current_mode->height);
+	if (l->region) {
+		wl_shm_buffer_begin_access(l->buffer->shm_buffer);
+		copy_region(l, wl_shm_buffer_get_data(l->buffer->shm_buffer),
+			    wl_shm_buffer_get_stride(l->buffer->shm_buffer));
+		wl_shm_buffer_end_access(l->buffer->shm_buffer);
+
+		l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
+		screenshooter_frame_listener_destroy(l);
+		return;
+	}
 
 	stride = wl_shm_buffer_get_stride(l->buffer->shm_buffer);
 
 	d = wl_shm_buffer_get_data(l->buffer->shm_buffer);
-	s = pixels + stride * (l->buffer->height - 1);
+	s = l->pixels + stride * (l->buffer->height - 1);
 
 	wl_shm_buffer_begin_access(l->buffer->shm_buffer);
 
-	switch (compositor->read_format) {
+	switch (l->read_format) {
 	case PIXMAN_a8r8g8b8:
 	case PIXMAN_x8r8g8b8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_bgra_yflip(d, s, output->current_mode->height, stride);
+		if (l->yflip)
+			copy_bgra_yflip(d, s, l->height, stride);
 		else
-			copy_bgra(d, pixels, output->current_mode->height, stride);
+			copy_bgra(d, l->pixels, l->height, stride);
 		break;
 	case PIXMAN_x8b8g8r8:
 	case PIXMAN_a8b8g8r8:
-		if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
-			copy_rgba_yflip(d, s, output->current_mode->height, stride);
+		if (l->yflip)
+			copy_rgba_yflip(d, s, l->height, stride);
 		else
-			copy_rgba(d, pixels, output->current_mode->height, stride);
+			copy_rgba(d, l->pixels, l->height, stride);
 		break;
 	default:
 		break;
@@ -170,8 +221,93 @@ screenshooter_frame_notify(struct wl_listener *listener, void *data)
 	wl_shm_buffer_end_access(l->buffer->shm_buffer);
 
 	l->done(l->data, WESTON_SCREENSHOOTER_SUCCESS);
-	free(pixels);
-	free(l);
+	screenshooter_frame_listener_destroy(l);
+}
+
+static void
+screenshooter_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct screenshooter_frame_listener *l =
+		container_of(listener,
+			     struct screenshooter_frame_listener, listener);
+	struct weston_output *output = l->output;
+	struct weston_compositor *compositor = output->compositor;
+	pixman_box32_t fb;
+	int32_t stride, y;
+
+	weston_output_capture_decr(output);
+	wl_list_remove(&listener->link);
+
+	if (!l->buffer) {
+		l->done(l->data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+		screenshooter_frame_listener_destroy(l);
+		return;
+	}
+
+	if (l->region) {
+		/* Read back the rectangle only, in framebuffer pixels. The
+		 * output transform or scale may have changed since the
+		 * request, so it is only converted now. */
+		fb = weston_output_transformed_rect(output, l->rect);
+		fb.x1 = MAX(fb.x1, 0);
+		fb.y1 = MAX(fb.y1, 0);
+		fb.x2 = MIN(fb.x2, output->current_mode->width);
+		fb.y2 = MIN(fb.y2, output->current_mode->height);
+
+		l->read_format = compositor->read_format;
+		l->yflip = !!(compositor->capabilities &
+			      WESTON_CAP_CAPTURE_YFLIP);
+		l->width = MIN(fb.x2 - fb.x1, l->buffer->width);
+		l->height = MIN(fb.y2 - fb.y1, l->buffer->height);
+		if (l->width <= 0 || l->height <= 0) {
+			l->done(l->data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+			screenshooter_frame_listener_destroy(l);
+			return;
+		}
+
+		l->pixels = malloc(l->width * l->height * 4);
+		if (l->pixels == NULL) {
+			l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
+			screenshooter_frame_listener_destroy(l);
+			return;
+		}
+
+		/* y-flipped framebuffers count rows from the bottom */
+		y = l->yflip ? output->current_mode->height - fb.y1 - l->height
+			     : fb.y1;
+		if (weston_output_read_pixels_async(output, l->read_format,
+						    l->pixels, fb.x1, y,
+						    l->width, l->height,
+						    screenshooter_read_done,
+						    l) < 0) {
+			l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
+			screenshooter_frame_listener_destroy(l);
+		}
+		return;
+	}
+
+	stride = l->buffer->width * (PIXMAN_FORMAT_BPP(compositor->read_format) / 8);
+	l->pixels = malloc(stride * l->buffer->height);
+
+	if (l->pixels == NULL) {
+		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
+		screenshooter_frame_listener_destroy(l);
+		return;
+	}
+
+	/* The read completes once the GPU is done with the frame, the
+	 * compositor keeps going meanwhile. */
+	l->read_format = compositor->read_format;
+	l->yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	l->width = output->current_mode->width;
+	l->height = output->current_mode->height;
+
+	if (weston_output_read_pixels_async(output, l->read_format, l->pixels,
+					    0, 0, l->width, l->height,
+					    screenshooter_read_done, l) < 0) {
+		l->done(l->data, WESTON_SCREENSHOOTER_NO_MEMORY);
+		screenshooter_frame_listener_destroy(l);
+	}
 }
 
 WL_EXPORT int
@@ -196,7 +332,7 @@ weston_screenshooter_shoot(struct weston_output *output,
 		return -1;
 	}
 
-	l = malloc(sizeof *l);
+	l = zalloc(sizeof *l);
 	if (l == NULL) {
 		done(data, WESTON_SCREENSHOOTER_NO_MEMORY);
 		return -1;
@@ -208,20 +344,137 @@ weston_screenshooter_shoot(struct weston_output *output,
 	l->data = data;
 	l->listener.notify = screenshooter_frame_notify;
 	wl_signal_add(&output->frame_signal, &l->listener);
-	weston_output_disable_planes_incr(output);
+	l->buffer_destroy_listener.notify = screenshooter_buffer_destroy_handler;
+	wl_signal_add(&buffer->destroy_signal, &l->buffer_destroy_listener);
+	weston_output_capture_incr(output);
 	weston_output_damage(output);
 
 	return 0;
 }
 
+/** Capture a rectangle of an output
+ *
+ * \param output The output to capture.
+ * \param buffer An SHM buffer of at least the size of the rectangle in
+ * output pixels, in the compositor's read format.
+ * \param x The left edge of the rectangle, in output-local coordinates.
+ * \param y The top edge of the rectangle.
+ * \param width The width of the rectangle.
+ * \param height The height of the rectangle.
+ * \param done Called once the rectangle is in the buffer, or on failure.
+ * \param data User data for \p done.
+ * \return 0 if the capture is underway, -1 if it failed right away.
+ *
+ * Unlike weston_screenshooter_shoot(), only the rectangle is damaged, so
+ * with renderers repairing the rest of the framebuffer from earlier frames
+ * the repaint for the capture is as small as the rectangle. Only the
+ * rectangle is read back as well.
+ */
+WL_EXPORT int
+weston_screenshooter_shoot_region(struct weston_output *output,
+				  struct weston_buffer *buffer,
+				  int32_t x, int32_t y,
+				  int32_t width, int32_t height,
+				  weston_screenshooter_done_func_t done,
+				  void *data)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct screenshooter_frame_listener *l;
+	pixman_box32_t rect, fb;
+
+	if (!wl_shm_buffer_get(buffer->resource) ||
+	    PIXMAN_FORMAT_BPP(compositor->read_format) != 32) {
+		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+		return -1;
+	}
+
+	buffer->shm_buffer = wl_shm_buffer_get(buffer->resource);
+	buffer->width = wl_shm_buffer_get_width(buffer->shm_buffer);
+	buffer->height = wl_shm_buffer_get_height(buffer->shm_buffer);
+
+	rect.x1 = MAX(x, 0);
+	rect.y1 = MAX(y, 0);
+	rect.x2 = MIN((int64_t)x + width, output->width);
+	rect.y2 = MIN((int64_t)y + height, output->height);
+	fb = weston_output_transformed_rect(output, rect);
+
+	if (rect.x1 >= rect.x2 || rect.y1 >= rect.y2 ||
+	    buffer->width < fb.x2 - fb.x1 ||
+	    buffer->height < fb.y2 - fb.y1) {
+		done(data, WESTON_SCREENSHOOTER_BAD_BUFFER);
+		return -1;
+	}
+
+	l = zalloc(sizeof *l);
+	if (l == NULL) {
+		done(data, WESTON_SCREENSHOOTER_NO_MEMORY);
+		return -1;
+	}
+
+	l->buffer = buffer;
+	l->output = output;
+	l->done = done;
+	l->data = data;
+	l->region = true;
+	l->rect = rect;
+	l->listener.notify = screenshooter_frame_notify;
+	wl_signal_add(&output->frame_signal, &l->listener);
+	l->buffer_destroy_listener.notify = screenshooter_buffer_destroy_handler;
+	wl_signal_add(&buffer->destroy_signal, &l->buffer_destroy_listener);
+	weston_output_capture_incr(output);
+
+	/* A repaint is still needed for the frame signal, but only of the
+	 * rectangle. */
+	pixman_region32_union_rect(&compositor->primary_plane.damage,
+				   &compositor->primary_plane.damage,
+				   output->x + rect.x1, output->y + rect.y1,
+				   rect.x2 - rect.x1, rect.y2 - rect.y1);
+	weston_output_schedule_repaint(output);
+
+	return 0;
+}
+
+/* Frames read back but not yet written. When the writer falls behind by
+ * this many, frames are left out and their damage is added to the next one,
+ * so the recording loses frames but never areas. */
+#define RECORDER_MAX_FRAMES 8
+
 struct weston_recorder {
 	struct weston_output *output;
+	enum weston_recorder_format format;
+	int width, height;
+	bool yflip;
+	uint32_t read_format;
 	uint32_t *frame, *rect;
-	uint32_t *tmpbuf;
-	uint32_t total;
+	uint32_t *delta; /* one row of component deltas */
+	uint8_t *nv12;
+	uint64_t total;
 	int fd;
 	struct wl_listener frame_listener;
+	struct wl_list pending_frames; /* recorder_frame::link, being read */
+	pixman_region32_t skipped_damage;
 	int count, destroying;
+	bool in_frame_notify; /* reads may complete right away */
+
+	/* Diffing, encoding and writing happen on this thread, in the order
+	 * the frames were read. Everything below the lock is shared with
+	 * it, the frame buffers above are its own once it runs. */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct wl_list queue; /* recorder_frame::link, read, oldest first */
+	int in_flight; /* pending and queued frames */
+	bool quit;
+};
+
+/** A frame whose pixels are being read back, encoded once they arrive */
+struct recorder_frame {
+	struct weston_recorder *recorder;
+	struct wl_list link; /* weston_recorder::pending_frames or queue */
+	uint32_t msecs;
+	pixman_region32_t damage; /* in framebuffer coordinates, y down */
+	pixman_box32_t extents; /* the area read into pixels */
+	uint32_t *pixels;
 };
 
 static uint32_t *
@@ -243,106 +496,129 @@ output_run(uint32_t *p, uint32_t delta, int run)
 	return p;
 }
 
-static uint32_t
-component_delta(uint32_t next, uint32_t prev)
+static void
+weston_recorder_destroy(struct weston_recorder *recorder);
+
+static void
+recorder_frame_destroy(struct recorder_frame *frame)
 {
-	unsigned char dr, dg, db;
+	wl_list_remove(&frame->link);
+	pixman_region32_fini(&frame->damage);
+	free(frame->pixels);
+	free(frame);
+}
 
-	dr = (next >> 16) - (prev >> 16);
-	dg = (next >>  8) - (prev >>  8);
-	db = (next >>  0) - (prev >>  0);
+/* A frame that is not encoded leaves its area stale in the following
+ * deltas, so that area is read again with the next frame. */
+static void
+recorder_frame_skip(struct recorder_frame *frame)
+{
+	struct weston_recorder *recorder = frame->recorder;
 
-	return (dr << 16) | (dg << 8) | (db << 0);
+	pixman_region32_union(&recorder->skipped_damage,
+			      &recorder->skipped_damage, &frame->damage);
+	recorder_frame_destroy(frame);
 }
 
+/* Destroy the recorder once it was stopped and the last pending frame has
+ * been read. The thread writes out what is queued before it exits.
+ * weston_recorder_frame_notify() checks itself once it is done with the
+ * recorder, for reads completing before it returns. */
 static void
-weston_recorder_destroy(struct weston_recorder *recorder);
+weston_recorder_maybe_destroy(struct weston_recorder *recorder)
+{
+	if (recorder->destroying && !recorder->in_frame_notify &&
+	    wl_list_empty(&recorder->pending_frames))
+		weston_recorder_destroy(recorder);
+}
+
+static ssize_t
+write_all(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	size_t done = 0;
+	ssize_t r;
+
+	while (done < len) {
+		r = write(fd, p + done, len - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		done += r;
+	}
+
+	return done;
+}
+
+/* The source row in frame->pixels of framebuffer row y */
+static uint32_t *
+recorder_frame_row(struct recorder_frame *frame, int y)
+{
+	struct weston_recorder *recorder = frame->recorder;
+	pixman_box32_t *ext = &frame->extents;
+	int row;
+
+	/* Rows are read bottom-up unless the renderer already flips them. */
+	if (recorder->yflip)
+		row = y - ext->y1;
+	else
+		row = ext->y2 - 1 - y;
+
+	return frame->pixels + (ext->x2 - ext->x1) * row;
+}
 
 static void
-weston_recorder_frame_notify(struct wl_listener *listener, void *data)
+recorder_frame_encode_wcap(struct recorder_frame *frame)
 {
-	struct weston_recorder *recorder =
-		container_of(listener, struct weston_recorder, frame_listener);
-	struct weston_output *output = recorder->output;
-	struct weston_compositor *compositor = output->compositor;
-	uint32_t msecs = timespec_to_msec(&output->frame_time);
-	pixman_box32_t *r;
-	pixman_region32_t damage, transformed_damage;
-	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
+	struct weston_recorder *recorder = frame->recorder;
+	pixman_box32_t *r, *ext = &frame->extents;
+	int i, j, k, n, width, height, run, span, stride;
+	uint32_t prev, *d, *s, *p, *delta = recorder->delta;
 	struct {
 		uint32_t msecs;
 		uint32_t nrects;
 	} header;
 	struct iovec v[2];
-	int do_yflip;
-	int y_orig;
-	uint32_t *outbuf;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-	if (do_yflip)
-		outbuf = recorder->rect;
-	else
-		outbuf = recorder->tmpbuf;
+	uint32_t *outbuf = recorder->rect;
 
-	pixman_region32_init(&damage);
-	pixman_region32_init(&transformed_damage);
-	pixman_region32_intersect(&damage, &output->region, data);
-	pixman_region32_translate(&damage, -output->x, -output->y);
-	weston_transformed_region(output->width, output->height,
-				 output->transform, output->current_scale,
-				 &damage, &transformed_damage);
-	pixman_region32_fini(&damage);
+	r = pixman_region32_rectangles(&frame->damage, &n);
 
-	r = pixman_region32_rectangles(&transformed_damage, &n);
-	if (n == 0) {
-		pixman_region32_fini(&transformed_damage);
-		return;
-	}
-
-	header.msecs = msecs;
+	header.msecs = frame->msecs;
 	header.nrects = n;
 	v[0].iov_base = &header;
 	v[0].iov_len = sizeof header;
 	v[1].iov_base = r;
 	v[1].iov_len = n * sizeof *r;
 	recorder->total += writev(recorder->fd, v, 2);
-	stride = output->current_mode->width;
+	stride = recorder->width;
 
 	for (i = 0; i < n; i++) {
 		width = r[i].x2 - r[i].x1;
 		height = r[i].y2 - r[i].y1;
 
-		if (do_yflip)
-			y_orig = output->current_mode->height - r[i].y2;
-		else
-			y_orig = r[i].y1;
-
-		compositor->renderer->read_pixels(output,
-				compositor->read_format, recorder->rect,
-				r[i].x1, y_orig, width, height);
-
 		p = outbuf;
 		run = prev = 0; /* quiet gcc */
 		for (j = 0; j < height; j++) {
-			if (do_yflip)
-				s = recorder->rect + width * j;
-			else
-				s = recorder->rect + width * (height - j - 1);
-			y_orig = r[i].y2 - j - 1;
-			d = recorder->frame + stride * y_orig + r[i].x1;
-
-			for (k = 0; k < width; k++) {
-				next = *s++;
-				delta = component_delta(next, *d);
-				*d++ = next;
-				if (run == 0 || delta == prev) {
-					run++;
-				} else {
+			s = recorder_frame_row(frame, r[i].y2 - j - 1) +
+			    (r[i].x1 - ext->x1);
+			d = recorder->frame + stride * (r[i].y2 - j - 1) +
+			    r[i].x1;
+
+			pixel_delta_rgb(delta, d, s, width);
+
+			/* Runs continue across rows */
+			for (k = 0; k < width; k += span) {
+				if (run > 0 && delta[k] != prev) {
 					p = output_run(p, prev, run);
-					run = 1;
+					run = 0;
 				}
-				prev = delta;
+				if (run == 0)
+					prev = delta[k];
+
+				span = pixel_span_equal(delta + k,
+							width - k, prev);
+				run += span;
 			}
 		}
 
@@ -357,15 +633,268 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 			width, height, r[i].x1, r[i].y1,
 			width * height * 4, (int) (p - outbuf) * 4,
 			(float) (p - outbuf) / (width * height),
-			recorder->total / 1024 / 1024);
+			(int) (recorder->total / 1024 / 1024));
 #endif
 	}
+}
 
-	pixman_region32_fini(&transformed_damage);
-	recorder->count++;
+static inline void
+recorder_pixel_rgb(const struct weston_recorder *recorder, uint32_t pixel,
+		   int *r, int *g, int *b)
+{
+	if (recorder->read_format == PIXMAN_a8b8g8r8) {
+		*r = pixel & 0xff;
+		*g = (pixel >> 8) & 0xff;
+		*b = (pixel >> 16) & 0xff;
+	} else {
+		*r = (pixel >> 16) & 0xff;
+		*g = (pixel >> 8) & 0xff;
+		*b = pixel & 0xff;
+	}
+}
 
-	if (recorder->destroying)
-		weston_recorder_destroy(recorder);
+/* BT.601, limited range, the default of most tools reading raw video */
+static void
+recorder_convert_nv12(struct weston_recorder *recorder)
+{
+	int width = recorder->width, height = recorder->height;
+	int cw = (width + 1) / 2, ch = (height + 1) / 2;
+	uint8_t *y_plane = recorder->nv12;
+	uint8_t *uv_plane = recorder->nv12 + width * height;
+	int x, y, dx, dy, r, g, b, sr, sg, sb, count;
+	const uint32_t *row;
+
+	for (y = 0; y < height; y++) {
+		row = recorder->frame + width * y;
+		for (x = 0; x < width; x++) {
+			recorder_pixel_rgb(recorder, row[x], &r, &g, &b);
+			y_plane[width * y + x] =
+				((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+		}
+	}
+
+	for (y = 0; y < ch; y++) {
+		for (x = 0; x < cw; x++) {
+			sr = sg = sb = count = 0;
+			for (dy = 0; dy < 2 && 2 * y + dy < height; dy++) {
+				row = recorder->frame + width * (2 * y + dy);
+				for (dx = 0; dx < 2 && 2 * x + dx < width; dx++) {
+					recorder_pixel_rgb(recorder,
+							   row[2 * x + dx],
+							   &r, &g, &b);
+					sr += r;
+					sg += g;
+					sb += b;
+					count++;
+				}
+			}
+			r = sr / count;
+			g = sg / count;
+			b = sb / count;
+			uv_plane[2 * (cw * y + x)] =
+				((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+			uv_plane[2 * (cw * y + x) + 1] =
+				((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+		}
+	}
+}
+
+/* Update the full frame with the damage and write all of it */
+static void
+recorder_frame_encode_nv12(struct recorder_frame *frame)
+{
+	struct weston_recorder *recorder = frame->recorder;
+	pixman_box32_t *r, *ext = &frame->extents;
+	size_t size;
+	int i, j, n;
+
+	r = pixman_region32_rectangles(&frame->damage, &n);
+	for (i = 0; i < n; i++) {
+		for (j = r[i].y1; j < r[i].y2; j++)
+			memcpy(recorder->frame + recorder->width * j + r[i].x1,
+			       recorder_frame_row(frame, j) + (r[i].x1 - ext->x1),
+			       (r[i].x2 - r[i].x1) * sizeof(uint32_t));
+	}
+
+	recorder_convert_nv12(recorder);
+
+	size = recorder->width * recorder->height +
+	       2 * ((recorder->width + 1) / 2) * ((recorder->height + 1) / 2);
+	if (write_all(recorder->fd, recorder->nv12, size) < 0) {
+		/* Most likely the reader of the pipe went away */
+		weston_log("recorder: write failed: %s\n", strerror(errno));
+		return;
+	}
+	recorder->total += size;
+}
+
+static void *
+recorder_thread(void *data)
+{
+	struct weston_recorder *recorder = data;
+	struct recorder_frame *frame;
+	sigset_t mask;
+
+	/* Let the compositor thread handle the signals */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	pthread_mutex_lock(&recorder->lock);
+	for (;;) {
+		while (wl_list_empty(&recorder->queue) && !recorder->quit)
+			pthread_cond_wait(&recorder->cond, &recorder->lock);
+		if (wl_list_empty(&recorder->queue))
+			break;
+
+		frame = container_of(recorder->queue.next,
+				     struct recorder_frame, link);
+		wl_list_remove(&frame->link);
+		wl_list_init(&frame->link);
+		pthread_mutex_unlock(&recorder->lock);
+
+		if (recorder->format == WESTON_RECORDER_FORMAT_NV12)
+			recorder_frame_encode_nv12(frame);
+		else
+			recorder_frame_encode_wcap(frame);
+		recorder_frame_destroy(frame);
+
+		pthread_mutex_lock(&recorder->lock);
+		recorder->count++;
+		recorder->in_flight--;
+	}
+	pthread_mutex_unlock(&recorder->lock);
+
+	return NULL;
+}
+
+static void
+recorder_frame_read_done(void *data, int status)
+{
+	struct recorder_frame *frame = data;
+	struct weston_recorder *recorder = frame->recorder;
+
+	if (status != 0) {
+		weston_log("recorder: failed to read frame, skipping\n");
+		recorder_frame_skip(frame);
+		pthread_mutex_lock(&recorder->lock);
+		recorder->in_flight--;
+		pthread_mutex_unlock(&recorder->lock);
+		weston_recorder_maybe_destroy(recorder);
+		return;
+	}
+
+	/* Reads complete in the order they were issued, so the queue stays
+	 * in frame order. */
+	wl_list_remove(&frame->link);
+	pthread_mutex_lock(&recorder->lock);
+	wl_list_insert(recorder->queue.prev, &frame->link);
+	pthread_cond_signal(&recorder->cond);
+	pthread_mutex_unlock(&recorder->lock);
+
+	weston_recorder_maybe_destroy(recorder);
+}
+
+static void
+weston_recorder_frame_notify(struct wl_listener *listener, void *data)
+{
+	struct weston_recorder *recorder =
+		container_of(listener, struct weston_recorder, frame_listener);
+	struct weston_output *output = recorder->output;
+	struct recorder_frame *frame;
+	pixman_region32_t damage, transformed;
+	pixman_box32_t *ext;
+	int y_orig;
+	bool full;
+	int ret;
+
+	pixman_region32_init(&damage);
+	pixman_region32_intersect(&damage, &output->region, data);
+	pixman_region32_translate(&damage, -output->x, -output->y);
+
+	pthread_mutex_lock(&recorder->lock);
+	full = recorder->in_flight >= RECORDER_MAX_FRAMES;
+	if (!full)
+		recorder->in_flight++;
+	pthread_mutex_unlock(&recorder->lock);
+
+	frame = full ? NULL : zalloc(sizeof *frame);
+	if (!frame) {
+		if (!full)
+			weston_log("%s: out of memory\n", __func__);
+
+		pixman_region32_init(&transformed);
+		weston_output_transformed_region(output, &damage,
+						 &transformed);
+		pixman_region32_union(&recorder->skipped_damage,
+				      &recorder->skipped_damage, &transformed);
+		pixman_region32_fini(&transformed);
+		pixman_region32_fini(&damage);
+		if (full)
+			goto out;
+		goto out_unqueue;
+	}
+
+	frame->recorder = recorder;
+	frame->msecs = timespec_to_msec(&output->frame_time);
+	wl_list_insert(recorder->pending_frames.prev, &frame->link);
+
+	pixman_region32_init(&frame->damage);
+	weston_output_transformed_region(output, &damage, &frame->damage);
+	pixman_region32_fini(&damage);
+	pixman_region32_union(&frame->damage, &frame->damage,
+			      &recorder->skipped_damage);
+	pixman_region32_clear(&recorder->skipped_damage);
+
+	if (!pixman_region32_not_empty(&frame->damage)) {
+		recorder_frame_destroy(frame);
+		goto out_unqueue;
+	}
+
+	/* Read the extents of the damage with a single read, the rectangles
+	 * are picked out of it when encoding. */
+	ext = pixman_region32_extents(&frame->damage);
+	frame->extents = *ext;
+	frame->pixels = malloc((ext->x2 - ext->x1) * (ext->y2 - ext->y1) *
+			       sizeof *frame->pixels);
+	if (!frame->pixels) {
+		weston_log("%s: out of memory\n", __func__);
+		recorder_frame_skip(frame);
+		goto out_unqueue;
+	}
+
+	if (recorder->yflip)
+		y_orig = recorder->height - ext->y2;
+	else
+		y_orig = ext->y1;
+
+	/* With the pixman renderer, or GL without PBO readback, the frame
+	 * is done before this returns. */
+	recorder->in_frame_notify = true;
+	ret = weston_output_read_pixels_async(output, recorder->read_format,
+					      frame->pixels,
+					      ext->x1, y_orig,
+					      ext->x2 - ext->x1,
+					      ext->y2 - ext->y1,
+					      recorder_frame_read_done,
+					      frame);
+	recorder->in_frame_notify = false;
+	if (ret < 0) {
+		weston_log("recorder: failed to read frame, skipping\n");
+		recorder_frame_skip(frame);
+		goto out_unqueue;
+	}
+	goto out;
+
+out_unqueue:
+	pthread_mutex_lock(&recorder->lock);
+	recorder->in_flight--;
+	pthread_mutex_unlock(&recorder->lock);
+out:
+	if (recorder->destroying) {
+		wl_list_remove(&recorder->frame_listener.link);
+		wl_list_init(&recorder->frame_listener.link);
+		weston_recorder_maybe_destroy(recorder);
+	}
 }
 
 static void
@@ -374,22 +903,47 @@ weston_recorder_free(struct weston_recorder *recorder)
 	if (recorder == NULL)
 		return;
 
-	free(recorder->tmpbuf);
+	pixman_region32_fini(&recorder->skipped_damage);
+	pthread_cond_destroy(&recorder->cond);
+	pthread_mutex_destroy(&recorder->lock);
+	free(recorder->nv12);
+	free(recorder->delta);
 	free(recorder->rect);
 	free(recorder->frame);
 	free(recorder);
 }
 
+static int
+recorder_open(const char *filename)
+{
+	struct stat st;
+	int fd, flags;
+
+	/* Opening a pipe nobody reads from would block the compositor;
+	 * fail instead. */
+	fd = open(filename, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd >= 0 && fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+		/* The writer thread is fine with waiting for the reader */
+		flags = fcntl(fd, F_GETFL);
+		fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+		return fd;
+	}
+	if (fd >= 0)
+		close(fd);
+	else if (errno == ENXIO)
+		return -1;
+
+	return open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
 static struct weston_recorder *
-weston_recorder_create(struct weston_output *output, const char *filename)
+weston_recorder_create(struct weston_output *output, const char *filename,
+		       enum weston_recorder_format format)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_recorder *recorder;
 	int stride, size;
 	struct { uint32_t magic, format, width, height; } header;
-	int do_yflip;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
 
 	recorder = zalloc(sizeof *recorder);
 	if (recorder == NULL) {
@@ -397,25 +951,39 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		return NULL;
 	}
 
-	stride = output->current_mode->width;
-	size = stride * 4 * output->current_mode->height;
+	pixman_region32_init(&recorder->skipped_damage);
+	pthread_mutex_init(&recorder->lock, NULL);
+	pthread_cond_init(&recorder->cond, NULL);
+	wl_list_init(&recorder->queue);
+	recorder->fd = -1;
+
+	recorder->format = format;
+	recorder->width = output->current_mode->width;
+	recorder->height = output->current_mode->height;
+	recorder->yflip =
+		!!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	recorder->read_format = compositor->read_format;
+
+	stride = recorder->width;
+	size = stride * 4 * recorder->height;
 	recorder->frame = zalloc(size);
-	recorder->rect = malloc(size);
+	if (format == WESTON_RECORDER_FORMAT_NV12) {
+		recorder->nv12 = malloc(size);
+	} else {
+		recorder->rect = malloc(size);
+		recorder->delta = malloc(stride * 4);
+	}
 	recorder->output = output;
+	wl_list_init(&recorder->pending_frames);
 
-	if ((recorder->frame == NULL) || (recorder->rect == NULL)) {
+	if ((recorder->frame == NULL) ||
+	    (format == WESTON_RECORDER_FORMAT_NV12 && recorder->nv12 == NULL) ||
+	    (format == WESTON_RECORDER_FORMAT_WCAP &&
+	     (recorder->rect == NULL || recorder->delta == NULL))) {
 		weston_log("%s: out of memory\n", __func__);
 		goto err_recorder;
 	}
 
-	if (!do_yflip) {
-		recorder->tmpbuf = malloc(size);
-		if (recorder->tmpbuf == NULL) {
-			weston_log("%s: out of memory\n", __func__);
-			goto err_recorder;
-		}
-	}
-
 	header.magic = WCAP_HEADER_MAGIC;
 
 	switch (compositor->read_format) {
@@ -431,26 +999,37 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		goto err_recorder;
 	}
 
-	recorder->fd = open(filename,
-			    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
-
+	recorder->fd = recorder_open(filename);
 	if (recorder->fd < 0) {
 		weston_log("problem opening output file %s: %s\n", filename,
 			   strerror(errno));
 		goto err_recorder;
 	}
 
-	header.width = output->current_mode->width;
-	header.height = output->current_mode->height;
-	recorder->total += write(recorder->fd, &header, sizeof header);
+	if (format == WESTON_RECORDER_FORMAT_WCAP) {
+		header.width = recorder->width;
+		header.height = recorder->height;
+		recorder->total += write(recorder->fd, &header, sizeof header);
+	} else {
+		weston_log("recorder: writing raw NV12 frames of %dx%d\n",
+			   recorder->width, recorder->height);
+	}
+
+	if (pthread_create(&recorder->thread, NULL,
+			   recorder_thread, recorder) != 0) {
+		weston_log("recorder: failed to start thread\n");
+		goto err_fd;
+	}
 
 	recorder->frame_listener.notify = weston_recorder_frame_notify;
 	wl_signal_add(&output->frame_signal, &recorder->frame_listener);
-	weston_output_disable_planes_incr(output);
+	weston_output_capture_incr(output);
 	weston_output_damage(output);
 
 	return recorder;
 
+err_fd:
+	close(recorder->fd);
 err_recorder:
 	weston_recorder_free(recorder);
 	return NULL;
@@ -460,13 +1039,36 @@ static void
 weston_recorder_destroy(struct weston_recorder *recorder)
 {
 	wl_list_remove(&recorder->frame_listener.link);
+
+	/* Written out by the thread before it exits */
+	pthread_mutex_lock(&recorder->lock);
+	recorder->quit = true;
+	pthread_cond_signal(&recorder->cond);
+	pthread_mutex_unlock(&recorder->lock);
+	pthread_join(recorder->thread, NULL);
+
+	weston_log("recorder stopped, total file size %dM, %d frames\n",
+		   (int) (recorder->total / (1024 * 1024)), recorder->count);
+
 	close(recorder->fd);
-	weston_output_disable_planes_decr(recorder->output);
+	weston_output_capture_decr(recorder->output);
 	weston_recorder_free(recorder);
 }
 
+/** Start recording an output
+ *
+ * \param output The output to record.
+ * \param filename The file to write to. It may be a named pipe that is
+ * already open for reading.
+ * \param format What to write, see enum weston_recorder_format.
+ *
+ * Reading back is done by the renderer as for screenshots; the frames are
+ * then encoded and written on a separate thread.
+ */
 WL_EXPORT struct weston_recorder *
-weston_recorder_start(struct weston_output *output, const char *filename)
+weston_recorder_start_format(struct weston_output *output,
+			     const char *filename,
+			     enum weston_recorder_format format)
 {
 	struct wl_listener *listener;
 
@@ -480,14 +1082,20 @@ weston_recorder_start(struct weston_output *output, const char *filename)
 
 	weston_log("starting recorder for output %s, file %s\n",
 		   output->name, filename);
-	return weston_recorder_create(output, filename);
+	return weston_recorder_create(output, filename, format);
+}
+
+WL_EXPORT struct weston_recorder *
+weston_recorder_start(struct weston_output *output, const char *filename)
+{
+	return weston_recorder_start_format(output, filename,
+					    WESTON_RECORDER_FORMAT_WCAP);
 }
 
 WL_EXPORT void
 weston_recorder_stop(struct weston_recorder *recorder)
 {
-	weston_log("stopping recorder, total file size %dM, %d frames\n",
-		   recorder->total / (1024 * 1024), recorder->count);
+	weston_log("stopping recorder\n");
 
 	recorder->destroying = 1;
 	weston_output_schedule_repaint(recorder->output);
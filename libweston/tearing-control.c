@@ -0,0 +1,193 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <libweston/libweston.h>
+#include <libweston/zalloc.h>
+#include "libweston-internal.h"
+#include "weston-tearing-control-server-protocol.h"
+#include "shared/helpers.h"
+
+struct tearing_control {
+	struct weston_surface *surface;
+	struct wl_resource *resource;
+	struct wl_listener surface_destroy_listener;
+};
+
+static void
+tearing_control_free(struct tearing_control *tc)
+{
+	wl_resource_set_user_data(tc->resource, NULL);
+	wl_list_remove(&tc->surface_destroy_listener.link);
+	free(tc);
+}
+
+static void
+tearing_control_surface_destroyed(struct wl_listener *listener, void *data)
+{
+	struct tearing_control *tc =
+		container_of(listener, struct tearing_control,
+			     surface_destroy_listener);
+
+	tearing_control_free(tc);
+}
+
+static void
+tearing_control_destroy_resource(struct wl_resource *resource)
+{
+	struct tearing_control *tc = wl_resource_get_user_data(resource);
+
+	if (!tc)
+		return;
+
+	tc->surface->pending.allow_tearing = false;
+	tearing_control_free(tc);
+}
+
+static void
+tearing_control_set_presentation_hint(struct wl_client *client,
+				      struct wl_resource *resource,
+				      uint32_t hint)
+{
+	struct tearing_control *tc = wl_resource_get_user_data(resource);
+
+	if (!tc)
+		return;
+
+	/* Unknown hints are treated as vsync, which is always safe. */
+	tc->surface->pending.allow_tearing =
+		hint == WESTON_TEARING_CONTROL_V1_PRESENTATION_HINT_ASYNC;
+}
+
+static void
+tearing_control_destroy(struct wl_client *client,
+			struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct weston_tearing_control_v1_interface
+	tearing_control_implementation = {
+		tearing_control_set_presentation_hint,
+		tearing_control_destroy,
+};
+
+static void
+tearing_control_manager_destroy(struct wl_client *client,
+				struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+tearing_control_manager_get_tearing_control(struct wl_client *client,
+					    struct wl_resource *resource,
+					    uint32_t id,
+					    struct wl_resource *surface_resource)
+{
+	struct weston_surface *surface =
+		wl_resource_get_user_data(surface_resource);
+	struct tearing_control *tc;
+
+	if (wl_resource_get_destroy_listener(surface_resource,
+					     tearing_control_surface_destroyed)) {
+		wl_resource_post_error(resource,
+			WESTON_TEARING_CONTROL_MANAGER_V1_ERROR_TEARING_CONTROL_EXISTS,
+			"wl_surface@%"PRIu32" already has a tearing object",
+			wl_resource_get_id(surface_resource));
+		return;
+	}
+
+	tc = zalloc(sizeof *tc);
+	if (!tc) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	tc->resource = wl_resource_create(client,
+					  &weston_tearing_control_v1_interface,
+					  1, id);
+	if (!tc->resource) {
+		free(tc);
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	tc->surface = surface;
+	tc->surface_destroy_listener.notify = tearing_control_surface_destroyed;
+	wl_resource_add_destroy_listener(surface_resource,
+					 &tc->surface_destroy_listener);
+
+	wl_resource_set_implementation(tc->resource,
+				       &tearing_control_implementation, tc,
+				       tearing_control_destroy_resource);
+}
+
+static const struct weston_tearing_control_manager_v1_interface
+	tearing_control_manager_implementation = {
+		tearing_control_manager_destroy,
+		tearing_control_manager_get_tearing_control,
+};
+
+static void
+bind_tearing_control(struct wl_client *client, void *data,
+		     uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client,
+				      &weston_tearing_control_manager_v1_interface,
+				      version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource,
+				       &tearing_control_manager_implementation,
+				       data, NULL);
+}
+
+/** Advertise weston_tearing_control_manager_v1
+ *
+ * Called by backends capable of presenting a frame without waiting for the
+ * vertical blank.
+ */
+WL_EXPORT int
+weston_tearing_control_setup(struct weston_compositor *compositor)
+{
+	if (!wl_global_create(compositor->wl_display,
+			      &weston_tearing_control_manager_v1_interface, 1,
+			      compositor, bind_tearing_control))
+		return -1;
+
+	return 0;
+}
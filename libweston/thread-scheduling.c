@@ -0,0 +1,285 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#ifdef HAVE_DBUS
+#include <dbus/dbus.h>
+#endif
+
+#include <libweston/libweston.h>
+#include "libweston-internal.h"
+#include "shared/helpers.h"
+
+/*
+ * Real-time scheduling and CPU affinity of the compositor threads.
+ *
+ * A compositor preempted by a busy system misses its repaint deadlines.
+ * With a real-time policy, the main thread and the threads working for it
+ * run ahead of normal processes whenever they have something to do. The
+ * policy is set with SCHED_RESET_ON_FORK, so that clients launched by the
+ * compositor are normal processes again.
+ *
+ * Without the privilege to set a real-time policy, RealtimeKit is asked
+ * for it over the system bus. RealtimeKit only grants SCHED_RR, up to its
+ * own priority limit, and requires RLIMIT_RTTIME to be set so that a
+ * runaway thread gets killed rather than locking the machine up.
+ */
+
+#define RTKIT_RTTIME_USEC 200000
+
+#ifdef HAVE_DBUS
+static int
+rtkit_make_thread_realtime(pid_t tid, int priority)
+{
+	DBusConnection *bus;
+	DBusMessage *msg, *reply;
+	DBusError err;
+	dbus_uint64_t thread = tid;
+	dbus_uint32_t prio = priority;
+	struct rlimit rl;
+	int ret = -1;
+
+	if (getrlimit(RLIMIT_RTTIME, &rl) == 0 &&
+	    (rl.rlim_max == RLIM_INFINITY || rl.rlim_max > RTKIT_RTTIME_USEC)) {
+		rl.rlim_cur = rl.rlim_max = RTKIT_RTTIME_USEC;
+		if (setrlimit(RLIMIT_RTTIME, &rl) < 0)
+			return -1;
+	}
+
+	dbus_error_init(&err);
+
+	bus = dbus_bus_get_private(DBUS_BUS_SYSTEM, &err);
+	if (!bus) {
+		dbus_error_free(&err);
+		return -1;
+	}
+	dbus_connection_set_exit_on_disconnect(bus, FALSE);
+
+	msg = dbus_message_new_method_call("org.freedesktop.RealtimeKit1",
+					   "/org/freedesktop/RealtimeKit1",
+					   "org.freedesktop.RealtimeKit1",
+					   "MakeThreadRealtime");
+	if (!msg)
+		goto out;
+
+	if (!dbus_message_append_args(msg, DBUS_TYPE_UINT64, &thread,
+				      DBUS_TYPE_UINT32, &prio,
+				      DBUS_TYPE_INVALID)) {
+		dbus_message_unref(msg);
+		goto out;
+	}
+
+	reply = dbus_connection_send_with_reply_and_block(bus, msg, -1, &err);
+	dbus_message_unref(msg);
+	if (reply) {
+		ret = 0;
+		dbus_message_unref(reply);
+	}
+	dbus_error_free(&err);
+
+out:
+	dbus_connection_close(bus);
+	dbus_connection_unref(bus);
+
+	return ret;
+}
+#endif
+
+static int
+thread_set_affinity(uint64_t cpus)
+{
+	cpu_set_t set;
+	unsigned int i;
+
+	if (cpus == 0)
+		return 0;
+
+	CPU_ZERO(&set);
+	for (i = 0; i < 64; i++)
+		if (cpus & (UINT64_C(1) << i))
+			CPU_SET(i, &set);
+
+	return sched_setaffinity(0, sizeof set, &set);
+}
+
+/* Returns how the real-time policy was set, NULL if it was not. */
+static const char *
+thread_set_realtime(const struct weston_thread_scheduling *sched)
+{
+	struct sched_param param = { .sched_priority = sched->priority };
+
+	if (sched_setscheduler(0, sched->policy | SCHED_RESET_ON_FORK,
+			       &param) == 0)
+		return "directly";
+
+#ifdef HAVE_DBUS
+	if (errno == EPERM &&
+	    rtkit_make_thread_realtime(syscall(SYS_gettid),
+				       sched->priority) == 0)
+		return "through RealtimeKit";
+#endif
+
+	return NULL;
+}
+
+/** Apply the compositor thread scheduling to the calling thread
+ *
+ * \param sched The scheduling, see weston_compositor::thread_scheduling.
+ *
+ * Threads started by libweston to work for the main thread call this
+ * first thing, so that they run with its policy, on the worker CPUs.
+ * Failures were reported for the main thread already and are ignored.
+ */
+void
+weston_thread_scheduling_apply(const struct weston_thread_scheduling *sched)
+{
+	thread_set_affinity(sched->worker_cpus);
+
+	if (sched->policy == SCHED_FIFO || sched->policy == SCHED_RR)
+		thread_set_realtime(sched);
+}
+
+static void
+format_cpus(char *buf, size_t size, uint64_t cpus)
+{
+	unsigned int i, first;
+	size_t len = 0;
+
+	if (cpus == 0) {
+		snprintf(buf, size, "all");
+		return;
+	}
+
+	buf[0] = '\0';
+	for (i = 0; i < 64 && len < size; i++) {
+		if (!(cpus & (UINT64_C(1) << i)))
+			continue;
+
+		first = i;
+		while (i + 1 < 64 && (cpus & (UINT64_C(1) << (i + 1))))
+			i++;
+
+		if (first == i)
+			len += snprintf(buf + len, size - len, "%s%u",
+					len ? "," : "", i);
+		else
+			len += snprintf(buf + len, size - len, "%s%u-%u",
+					len ? "," : "", first, i);
+	}
+}
+
+static const char *
+policy_name(int policy)
+{
+	switch (policy) {
+	case SCHED_FIFO:
+		return "SCHED_FIFO";
+	case SCHED_RR:
+		return "SCHED_RR";
+	default:
+		return "SCHED_OTHER";
+	}
+}
+
+/** Set the scheduling of the compositor threads
+ *
+ * \param compositor The compositor.
+ * \param sched The policy, priority and CPUs of the threads.
+ * \return 0 on success, -1 if the real-time policy or the CPU affinity
+ * could not be set on the calling thread.
+ *
+ * The scheduling applies right away to the calling thread, which is
+ * expected to be the one running the compositor event loop, and to the
+ * input, repaint and encoder threads libweston starts afterwards. The
+ * settings in effect are written to the log.
+ *
+ * \ingroup compositor
+ */
+WL_EXPORT int
+weston_compositor_set_thread_scheduling(struct weston_compositor *compositor,
+					const struct weston_thread_scheduling *sched)
+{
+	struct weston_thread_scheduling *cur = &compositor->thread_scheduling;
+	struct sched_param param;
+	char main_cpus[128], worker_cpus[128];
+	const char *how = NULL;
+	int policy;
+	int ret = 0;
+
+	*cur = *sched;
+	if (cur->policy != SCHED_FIFO && cur->policy != SCHED_RR)
+		cur->policy = SCHED_OTHER;
+
+	if (thread_set_affinity(cur->main_cpus) < 0) {
+		weston_log("Error: setting the CPU affinity failed: %s\n",
+			   strerror(errno));
+		ret = -1;
+	}
+
+	if (cur->policy != SCHED_OTHER) {
+		how = thread_set_realtime(cur);
+		if (!how) {
+			weston_log("Error: %s priority %d is not allowed, "
+				   "running with normal scheduling.\n",
+				   policy_name(cur->policy), cur->priority);
+			cur->policy = SCHED_OTHER;
+			ret = -1;
+		}
+	}
+
+	/* RealtimeKit grants SCHED_RR whatever was asked for. */
+	policy = sched_getscheduler(0) & ~SCHED_RESET_ON_FORK;
+	if (how && (policy == SCHED_FIFO || policy == SCHED_RR)) {
+		cur->policy = policy;
+		if (sched_getparam(0, &param) == 0)
+			cur->priority = param.sched_priority;
+	}
+
+	format_cpus(main_cpus, sizeof main_cpus, sched->main_cpus);
+	format_cpus(worker_cpus, sizeof worker_cpus, sched->worker_cpus);
+
+	if (cur->policy == SCHED_OTHER)
+		weston_log("Compositor threads use SCHED_OTHER, main thread "
+			   "on CPUs %s, workers on CPUs %s.\n",
+			   main_cpus, worker_cpus);
+	else
+		weston_log("Compositor threads use %s priority %d, set %s, "
+			   "main thread on CPUs %s, workers on CPUs %s.\n",
+			   policy_name(cur->policy), cur->priority, how,
+			   main_cpus, worker_cpus);
+
+	return ret;
+}
@@ -26,6 +26,7 @@
 
 #include "config.h"
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
@@ -36,6 +37,7 @@
 #include <libweston/weston-log.h>
 #include "timeline.h"
 #include "weston-log-internal.h"
+#include "shared/helpers.h"
 
 /**
  * Timeline itself is not a subscriber but a scope (a producer of data), and it
@@ -341,6 +343,58 @@ emit_gpu_timestamp(struct timeline_emit_context *ctx, void *obj)
 	return 1;
 }
 
+static int
+emit_repaint_window(struct timeline_emit_context *ctx, void *obj)
+{
+	struct timespec *ts = obj;
+
+	fprintf(ctx->cur, "\"repaint_window\":[%" PRId64 ", %ld]",
+		(int64_t)ts->tv_sec, ts->tv_nsec);
+
+	return 1;
+}
+
+static int
+emit_draw_calls(struct timeline_emit_context *ctx, void *obj)
+{
+	unsigned int *count = obj;
+
+	fprintf(ctx->cur, "\"draw_calls\":%u", *count);
+
+	return 1;
+}
+
+static int
+emit_gpu_duration(struct timeline_emit_context *ctx, void *obj)
+{
+	uint64_t *ns = obj;
+
+	fprintf(ctx->cur, "\"gpu_duration_ns\":%" PRIu64, *ns);
+
+	return 1;
+}
+
+static int
+emit_input_timestamp(struct timeline_emit_context *ctx, void *obj)
+{
+	struct timespec *ts = obj;
+
+	fprintf(ctx->cur, "\"input_monotonic\":[%" PRId64 ", %ld]",
+		(int64_t)ts->tv_sec, ts->tv_nsec);
+
+	return 1;
+}
+
+static int
+emit_plane_views(struct timeline_emit_context *ctx, void *obj)
+{
+	unsigned int *count = obj;
+
+	fprintf(ctx->cur, "\"plane_views\":%u", *count);
+
+	return 1;
+}
+
 static struct weston_timeline_subscription_object *
 weston_timeline_get_subscription_object(struct weston_log_subscription *sub,
 		void *object)
@@ -388,6 +442,11 @@ static const type_func type_dispatch[] = {
 	[TLT_SURFACE] = emit_weston_surface,
 	[TLT_VBLANK] = emit_vblank_timestamp,
 	[TLT_GPU] = emit_gpu_timestamp,
+	[TLT_REPAINT_WINDOW] = emit_repaint_window,
+	[TLT_DRAW_CALLS] = emit_draw_calls,
+	[TLT_GPU_DURATION] = emit_gpu_duration,
+	[TLT_INPUT] = emit_input_timestamp,
+	[TLT_PLANE_VIEWS] = emit_plane_views,
 };
 
 /** Disseminates the message to all subscriptions of the scope \c
@@ -459,3 +518,321 @@ weston_timeline_point(struct weston_log_scope *timeline_scope,
 
 	}
 }
+
+/*
+ * The 'timeline-trace' scope writes the same timeline points in the Trace
+ * Event Format of chrome://tracing, which Perfetto's UI and trace processor
+ * open directly, without going through wesgr.
+ *
+ * Every output is a process with one track (thread) each for repaint, plane
+ * assignment, GPU and vblank. Surfaces are the tracks of a separate process,
+ * where input and commits show up. Timestamps are CLOCK_MONOTONIC in
+ * microseconds.
+ *
+ * The output is a JSON array which is never closed; both viewers accept
+ * that, as they do the trailing comma.
+ */
+
+#define TRACE_PID_SURFACES 0
+#define TRACE_TID_INPUT 0
+
+enum trace_track {
+	TRACE_TRACK_REPAINT = 1,
+	TRACE_TRACK_PLANES,
+	TRACE_TRACK_GPU,
+	TRACE_TRACK_VBLANK,
+};
+
+static const char * const trace_track_names[] = {
+	[TRACE_TRACK_REPAINT] = "repaint",
+	[TRACE_TRACK_PLANES] = "planes",
+	[TRACE_TRACK_GPU] = "gpu",
+	[TRACE_TRACK_VBLANK] = "vblank",
+};
+
+struct trace_point {
+	const char *name;
+	struct timespec ts;
+	struct weston_output *output;
+	struct weston_surface *surface;
+	const struct timespec *vblank;
+	const struct timespec *gpu;
+	const struct timespec *repaint_window;
+	const struct timespec *input;
+	const unsigned int *draw_calls;
+	const unsigned int *plane_views;
+	const uint64_t *gpu_duration;
+};
+
+static void
+trace_print_ts(struct weston_log_subscription *sub, const struct timespec *ts)
+{
+	weston_log_subscription_printf(sub, "\"ts\":%" PRId64 ".%03ld",
+				       (int64_t)ts->tv_sec * 1000000 +
+				       ts->tv_nsec / 1000, ts->tv_nsec % 1000);
+}
+
+static void
+trace_print_metadata(struct weston_log_subscription *sub, const char *what,
+		     unsigned int pid, unsigned int tid, const char *name)
+{
+	weston_log_subscription_printf(sub, "{\"ph\":\"M\", \"name\":\"%s\", "
+				       "\"pid\":%u, \"tid\":%u, "
+				       "\"args\":{\"name\":", what, pid, tid);
+	fprint_quoted_string(sub, name);
+	weston_log_subscription_printf(sub, "}},\n");
+}
+
+static unsigned int
+trace_output_pid(struct weston_log_subscription *sub,
+		 struct weston_timeline_subscription *tl_sub,
+		 struct weston_output *output)
+{
+	struct weston_timeline_subscription_object *sub_obj;
+	char name[64];
+	unsigned int track;
+
+	sub_obj = weston_timeline_subscription_output_ensure(tl_sub, output);
+	if (weston_timeline_check_object_refresh(sub_obj)) {
+		snprintf(name, sizeof name, "output %s",
+			 output->name ? output->name : "");
+		trace_print_metadata(sub, "process_name", sub_obj->id, 0, name);
+		for (track = TRACE_TRACK_REPAINT;
+		     track < ARRAY_LENGTH(trace_track_names); track++)
+			trace_print_metadata(sub, "thread_name", sub_obj->id,
+					     track, trace_track_names[track]);
+	}
+
+	return sub_obj->id;
+}
+
+static unsigned int
+trace_surface_tid(struct weston_log_subscription *sub,
+		  struct weston_timeline_subscription *tl_sub,
+		  struct weston_surface *surface)
+{
+	struct weston_timeline_subscription_object *sub_obj;
+	struct weston_surface *mains;
+	char desc[512];
+
+	/* Sub-surfaces share the track of their main surface. */
+	mains = weston_surface_get_main_surface(surface);
+	sub_obj = weston_timeline_subscription_surface_ensure(tl_sub, mains);
+	if (weston_timeline_check_object_refresh(sub_obj)) {
+		if (!mains->get_label ||
+		    mains->get_label(mains, desc, sizeof desc) < 0)
+			snprintf(desc, sizeof desc, "surface %u", sub_obj->id);
+		trace_print_metadata(sub, "thread_name", TRACE_PID_SURFACES,
+				     sub_obj->id, desc);
+	}
+
+	return sub_obj->id;
+}
+
+static void
+trace_print_args(struct weston_log_subscription *sub,
+		 const struct trace_point *tp, unsigned int surface_tid)
+{
+	const char *sep = "";
+
+	weston_log_subscription_printf(sub, ", \"args\":{");
+	if (tp->surface && tp->output) {
+		weston_log_subscription_printf(sub, "%s\"surface\":%u",
+					       sep, surface_tid);
+		sep = ", ";
+	}
+	if (tp->repaint_window) {
+		weston_log_subscription_printf(sub, "%s\"repaint_window\":"
+					       "%" PRId64 ".%09ld", sep,
+					       (int64_t)tp->repaint_window->tv_sec,
+					       tp->repaint_window->tv_nsec);
+		sep = ", ";
+	}
+	if (tp->input) {
+		weston_log_subscription_printf(sub, "%s\"input\":"
+					       "%" PRId64 ".%09ld", sep,
+					       (int64_t)tp->input->tv_sec,
+					       tp->input->tv_nsec);
+		sep = ", ";
+	}
+	if (tp->gpu_duration) {
+		weston_log_subscription_printf(sub, "%s\"gpu_duration_ns\":"
+					       "%" PRIu64, sep,
+					       *tp->gpu_duration);
+		sep = ", ";
+	}
+	if (tp->plane_views)
+		weston_log_subscription_printf(sub, "%s\"plane_views\":%u",
+					       sep, *tp->plane_views);
+	weston_log_subscription_printf(sub, "}");
+}
+
+static void
+trace_emit(struct weston_log_subscription *sub, const struct trace_point *tp)
+{
+	struct weston_timeline_subscription *tl_sub;
+	const struct timespec *ts = &tp->ts;
+	const char *ph = "i";
+	const char *name = tp->name;
+	unsigned int pid, tid;
+	unsigned int surface_tid = 0;
+
+	tl_sub = weston_log_subscription_get_data(sub);
+	if (!tl_sub)
+		return;
+
+	if (tp->surface)
+		surface_tid = trace_surface_tid(sub, tl_sub, tp->surface);
+
+	if (tp->output) {
+		pid = trace_output_pid(sub, tl_sub, tp->output);
+		tid = TRACE_TRACK_REPAINT;
+	} else {
+		pid = TRACE_PID_SURFACES;
+		tid = tp->surface ? surface_tid : TRACE_TID_INPUT;
+	}
+
+	if (tp->output && tp->draw_calls) {
+		weston_log_subscription_printf(sub, "{\"ph\":\"C\", "
+					       "\"name\":\"draw_calls\", "
+					       "\"pid\":%u, ", pid);
+		trace_print_ts(sub, ts);
+		weston_log_subscription_printf(sub, ", \"args\":"
+					       "{\"draw_calls\":%u}},\n",
+					       *tp->draw_calls);
+		return;
+	}
+
+	if (strcmp(name, "core_repaint_begin") == 0) {
+		ph = "B";
+		name = "repaint";
+	} else if (strcmp(name, "core_repaint_posted") == 0) {
+		ph = "E";
+		name = "repaint";
+	} else if (strcmp(name, "core_assign_planes_begin") == 0) {
+		ph = "B";
+		name = "assign_planes";
+		tid = TRACE_TRACK_PLANES;
+	} else if (strcmp(name, "core_assign_planes_end") == 0) {
+		ph = "E";
+		name = "assign_planes";
+		tid = TRACE_TRACK_PLANES;
+	} else if (tp->gpu && strcmp(name, "renderer_gpu_begin") == 0) {
+		ph = "B";
+		name = "gpu";
+		tid = TRACE_TRACK_GPU;
+		ts = tp->gpu;
+	} else if (tp->gpu && strcmp(name, "renderer_gpu_end") == 0) {
+		ph = "E";
+		name = "gpu";
+		tid = TRACE_TRACK_GPU;
+		ts = tp->gpu;
+	} else if (tp->gpu_duration) {
+		tid = TRACE_TRACK_GPU;
+	} else if (tp->vblank) {
+		name = "vblank";
+		tid = TRACE_TRACK_VBLANK;
+		ts = tp->vblank;
+	} else if (tp->output && tp->surface) {
+		/* Damage flushed to an output belongs to the surface. */
+		pid = TRACE_PID_SURFACES;
+		tid = surface_tid;
+	}
+
+	weston_log_subscription_printf(sub, "{\"ph\":\"%s\", \"name\":\"%s\", "
+				       "\"pid\":%u, \"tid\":%u, ",
+				       ph, name, pid, tid);
+	trace_print_ts(sub, ts);
+	if (ph[0] == 'i')
+		weston_log_subscription_printf(sub, ", \"s\":\"t\"");
+	if (ph[0] != 'E')
+		trace_print_args(sub, tp, surface_tid);
+	weston_log_subscription_printf(sub, "},\n");
+}
+
+/** Create a timeline subscription for the 'timeline-trace' scope
+ *
+ * Like weston_timeline_create_subscription() but also opens the JSON array
+ * of trace events.
+ *
+ * @ingroup internal-log
+ */
+void
+weston_timeline_trace_create_subscription(struct weston_log_subscription *sub,
+					  void *user_data)
+{
+	weston_timeline_create_subscription(sub, user_data);
+	weston_log_subscription_printf(sub, "[\n");
+	trace_print_metadata(sub, "process_name", TRACE_PID_SURFACES, 0,
+			     "surfaces");
+	trace_print_metadata(sub, "thread_name", TRACE_PID_SURFACES,
+			     TRACE_TID_INPUT, "input");
+}
+
+/** Disseminates a timeline point to all subscriptions of the
+ * 'timeline-trace' scope
+ *
+ * The TL_POINT() macro calls this together with weston_timeline_point(),
+ * with the same arguments.
+ *
+ * @param trace_scope the timeline-trace scope
+ * @param name the name of the timeline point
+ *
+ * @ingroup log
+ */
+WL_EXPORT void
+weston_timeline_trace_point(struct weston_log_scope *trace_scope,
+			    const char *name, ...)
+{
+	struct trace_point tp = { .name = name };
+	struct weston_log_subscription *sub = NULL;
+	enum timeline_type otype;
+	va_list argp;
+	void *obj;
+
+	if (!weston_log_scope_is_enabled(trace_scope))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp.ts);
+
+	va_start(argp, name);
+	while ((otype = va_arg(argp, enum timeline_type)) != TLT_END) {
+		obj = va_arg(argp, void *);
+
+		switch (otype) {
+		case TLT_OUTPUT:
+			tp.output = obj;
+			break;
+		case TLT_SURFACE:
+			tp.surface = obj;
+			break;
+		case TLT_VBLANK:
+			tp.vblank = obj;
+			break;
+		case TLT_GPU:
+			tp.gpu = obj;
+			break;
+		case TLT_REPAINT_WINDOW:
+			tp.repaint_window = obj;
+			break;
+		case TLT_DRAW_CALLS:
+			tp.draw_calls = obj;
+			break;
+		case TLT_GPU_DURATION:
+			tp.gpu_duration = obj;
+			break;
+		case TLT_INPUT:
+			tp.input = obj;
+			break;
+		case TLT_PLANE_VIEWS:
+			tp.plane_views = obj;
+			break;
+		case TLT_END:
+			break;
+		}
+	}
+	va_end(argp);
+
+	while ((sub = weston_log_subscription_iterate(trace_scope, sub)))
+		trace_emit(sub, &tp);
+}
@@ -29,6 +29,7 @@
 
 #include <wayland-util.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <libweston/weston-log.h>
 #include <wayland-server-core.h>
@@ -39,6 +40,11 @@ enum timeline_type {
 	TLT_SURFACE,
 	TLT_VBLANK,
 	TLT_GPU,
+	TLT_REPAINT_WINDOW,
+	TLT_DRAW_CALLS,
+	TLT_GPU_DURATION,
+	TLT_INPUT,
+	TLT_PLANE_VIEWS,
 };
 
 /** Timeline subscription created for each subscription
@@ -83,10 +89,16 @@ struct weston_timeline_subscription_object {
 #define TLP_SURFACE(s) TLT_SURFACE, TYPEVERIFY(struct weston_surface *, (s))
 #define TLP_VBLANK(t) TLT_VBLANK, TYPEVERIFY(const struct timespec *, (t))
 #define TLP_GPU(t) TLT_GPU, TYPEVERIFY(const struct timespec *, (t))
+#define TLP_REPAINT_WINDOW(t) TLT_REPAINT_WINDOW, TYPEVERIFY(const struct timespec *, (t))
+#define TLP_DRAW_CALLS(n) TLT_DRAW_CALLS, TYPEVERIFY(const unsigned int *, (n))
+#define TLP_GPU_DURATION(ns) TLT_GPU_DURATION, TYPEVERIFY(const uint64_t *, (ns))
+#define TLP_INPUT(t) TLT_INPUT, TYPEVERIFY(const struct timespec *, (t))
+#define TLP_PLANE_VIEWS(n) TLT_PLANE_VIEWS, TYPEVERIFY(const unsigned int *, (n))
 
 /** This macro is used to add timeline points.
  *
- * Use TLP_END when done for the vargs.
+ * Use TLP_END when done for the vargs. The point goes to both the 'timeline'
+ * and the 'timeline-trace' scopes, and to the flight recorder if enabled.
  *
  * @param ec weston_compositor instance
  *
@@ -94,10 +106,22 @@ struct weston_timeline_subscription_object {
  */
 #define TL_POINT(ec, ...) do { \
 	weston_timeline_point(ec->timeline, __VA_ARGS__); \
+	weston_timeline_trace_point(ec->timeline_trace, __VA_ARGS__); \
+	weston_flight_recorder_point(ec->flight_recorder, __VA_ARGS__); \
 } while (0)
 
+struct weston_flight_recorder;
+
 void
 weston_timeline_point(struct weston_log_scope *timeline_scope,
 		      const char *name, ...);
 
+void
+weston_timeline_trace_point(struct weston_log_scope *trace_scope,
+			    const char *name, ...);
+
+void
+weston_flight_recorder_point(struct weston_flight_recorder *recorder,
+			     const char *name, ...);
+
 #endif /* WESTON_TIMELINE_H */
@@ -25,6 +25,17 @@
 #include <assert.h>
 #include <float.h>
 #include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define CLIP_USE_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CLIP_USE_NEON
+#endif
 
 #include "vertex-clipping.h"
 
@@ -296,21 +307,12 @@ clip_simple(struct clip_context *ctx,
 	return surf->n;
 }
 
-int
-clip_transformed(struct clip_context *ctx,
-		 struct polygon8 *surf,
-		 float *ex,
-		 float *ey)
+/* Get rid of duplicate vertices */
+static int
+clip_remove_duplicates(const struct polygon8 *surf, float *ex, float *ey)
 {
-	struct polygon8 polygon;
 	int i, n;
 
-	polygon.n = clip_polygon_left(ctx, surf, polygon.x, polygon.y);
-	surf->n = clip_polygon_right(ctx, &polygon, surf->x, surf->y);
-	polygon.n = clip_polygon_top(ctx, surf, polygon.x, polygon.y);
-	surf->n = clip_polygon_bottom(ctx, &polygon, surf->x, surf->y);
-
-	/* Get rid of duplicate vertices */
 	ex[0] = surf->x[0];
 	ey[0] = surf->y[0];
 	n = 1;
@@ -328,3 +330,286 @@ clip_transformed(struct clip_context *ctx,
 
 	return n;
 }
+
+int
+clip_transformed(struct clip_context *ctx,
+		 struct polygon8 *surf,
+		 float *ex,
+		 float *ey)
+{
+	struct polygon8 polygon;
+
+	polygon.n = clip_polygon_left(ctx, surf, polygon.x, polygon.y);
+	surf->n = clip_polygon_right(ctx, &polygon, surf->x, surf->y);
+	polygon.n = clip_polygon_top(ctx, surf, polygon.x, polygon.y);
+	surf->n = clip_polygon_bottom(ctx, &polygon, surf->x, surf->y);
+
+	return clip_remove_duplicates(surf, ex, ey);
+}
+
+/* One Sutherland-Hodgman pass over a rectangle with edges parallel to the
+ * axes. Its vertices outside of the clip line come in a pair that shares the
+ * coordinate being clipped, and the intersections are those vertices moved
+ * onto the line. clip_polygon_left() and its siblings emit them at the same
+ * places, except that they start with the last vertex when it and the one
+ * before it are out, so do the same.
+ */
+static void
+clip_rect_pass(float *c, float *other, bool out[4], float clip_c)
+{
+	float tc, to;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		if (out[i])
+			c[i] = clip_c;
+
+	if (out[2] && out[3]) {
+		tc = c[3];
+		to = other[3];
+		for (i = 3; i > 0; i--) {
+			c[i] = c[i - 1];
+			other[i] = other[i - 1];
+		}
+		c[0] = tc;
+		other[0] = to;
+	}
+}
+
+/** Clip a rectangle with edges parallel to the axes
+ *
+ * The result is the same as clip_transformed() for such a rectangle, vertex
+ * by vertex, but without computing any intersections. The rectangle must
+ * intersect the bounding box of the clip rectangle, as checked by
+ * clip_classify_boxes().
+ */
+int
+clip_axis_aligned(struct clip_context *ctx,
+		  struct polygon8 *surf,
+		  float *ex,
+		  float *ey)
+{
+	bool out[4];
+	int i;
+
+	assert(surf->n == 4);
+
+	for (i = 0; i < 4; i++)
+		out[i] = !(surf->x[i] >= ctx->clip.x1);
+	clip_rect_pass(surf->x, surf->y, out, ctx->clip.x1);
+
+	for (i = 0; i < 4; i++)
+		out[i] = !(surf->x[i] < ctx->clip.x2);
+	clip_rect_pass(surf->x, surf->y, out, ctx->clip.x2);
+
+	for (i = 0; i < 4; i++)
+		out[i] = !(surf->y[i] >= ctx->clip.y1);
+	clip_rect_pass(surf->y, surf->x, out, ctx->clip.y1);
+
+	for (i = 0; i < 4; i++)
+		out[i] = !(surf->y[i] < ctx->clip.y2);
+	clip_rect_pass(surf->y, surf->x, out, ctx->clip.y2);
+
+	return clip_remove_duplicates(surf, ex, ey);
+}
+
+/** Clip a polygon classified as CLIP_BOX_INSIDE
+ *
+ * Every vertex is inside, so clip_transformed() would return them all
+ * unchanged; only the duplicates are removed.
+ */
+int
+clip_inside(const struct polygon8 *surf, float *ex, float *ey)
+{
+	return clip_remove_duplicates(surf, ex, ey);
+}
+
+static enum clip_box_class
+classify_box(float min_x, float max_x, float min_y, float max_y,
+	     const pixman_box32_t *box)
+{
+	float x1 = box->x1, y1 = box->y1, x2 = box->x2, y2 = box->y2;
+
+	if (min_x >= x2 || max_x <= x1 || min_y >= y2 || max_y <= y1)
+		return CLIP_BOX_OUTSIDE;
+
+	/* The in tests of the clip_polygon_*() passes */
+	if (min_x >= x1 && max_x < x2 && min_y >= y1 && max_y < y2)
+		return CLIP_BOX_INSIDE;
+
+	return CLIP_BOX_PARTIAL;
+}
+
+/** Find out how a polygon is placed against several clip rectangles
+ *
+ * \param surf The polygon in the coordinate space of the boxes.
+ * \param boxes The clip rectangles.
+ * \param nboxes The number of boxes.
+ * \param classes Receives an enum clip_box_class for each box.
+ *
+ * CLIP_BOX_OUTSIDE is given when the bounding box of the polygon does not
+ * intersect the box, and CLIP_BOX_INSIDE when all vertices are inside of it,
+ * so that for most pairs of a damage rectangle and a view no clipping has
+ * to be done. The boxes are compared four at a time where SSE2 or NEON is
+ * available.
+ */
+void
+clip_classify_boxes(const struct polygon8 *surf,
+		    const pixman_box32_t *boxes, int nboxes,
+		    uint8_t *classes)
+{
+	float min_x, max_x, min_y, max_y;
+	int i = 0;
+
+	min_x = max_x = surf->x[0];
+	min_y = max_y = surf->y[0];
+	for (i = 1; i < surf->n; i++) {
+		min_x = min(min_x, surf->x[i]);
+		max_x = max(max_x, surf->x[i]);
+		min_y = min(min_y, surf->y[i]);
+		max_y = max(max_y, surf->y[i]);
+	}
+
+	i = 0;
+#if defined(CLIP_USE_SSE2)
+	{
+		const __m128 vmin_x = _mm_set1_ps(min_x);
+		const __m128 vmax_x = _mm_set1_ps(max_x);
+		const __m128 vmin_y = _mm_set1_ps(min_y);
+		const __m128 vmax_y = _mm_set1_ps(max_y);
+
+		for (; i + 4 <= nboxes; i += 4) {
+			const int32_t *b = (const int32_t *) &boxes[i];
+			__m128 r0, r1, r2, r3, out, in;
+			int mask_out, mask_in, k;
+
+			/* Rows of x1, y1, x2, y2, then one column each */
+			r0 = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *) b));
+			r1 = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *) (b + 4)));
+			r2 = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *) (b + 8)));
+			r3 = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *) (b + 12)));
+			_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+			out = _mm_or_ps(_mm_or_ps(_mm_cmpge_ps(vmin_x, r2),
+						  _mm_cmple_ps(vmax_x, r0)),
+					_mm_or_ps(_mm_cmpge_ps(vmin_y, r3),
+						  _mm_cmple_ps(vmax_y, r1)));
+			in = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(vmin_x, r0),
+						   _mm_cmplt_ps(vmax_x, r2)),
+					_mm_and_ps(_mm_cmpge_ps(vmin_y, r1),
+						   _mm_cmplt_ps(vmax_y, r3)));
+			mask_out = _mm_movemask_ps(out);
+			mask_in = _mm_movemask_ps(in);
+
+			for (k = 0; k < 4; k++) {
+				if (mask_out & (1 << k))
+					classes[i + k] = CLIP_BOX_OUTSIDE;
+				else if (mask_in & (1 << k))
+					classes[i + k] = CLIP_BOX_INSIDE;
+				else
+					classes[i + k] = CLIP_BOX_PARTIAL;
+			}
+		}
+	}
+#elif defined(CLIP_USE_NEON)
+	{
+		const float32x4_t vmin_x = vdupq_n_f32(min_x);
+		const float32x4_t vmax_x = vdupq_n_f32(max_x);
+		const float32x4_t vmin_y = vdupq_n_f32(min_y);
+		const float32x4_t vmax_y = vdupq_n_f32(max_y);
+
+		for (; i + 4 <= nboxes; i += 4) {
+			/* De-interleaves into x1, y1, x2, y2 */
+			int32x4x4_t b = vld4q_s32((const int32_t *) &boxes[i]);
+			float32x4_t x1 = vcvtq_f32_s32(b.val[0]);
+			float32x4_t y1 = vcvtq_f32_s32(b.val[1]);
+			float32x4_t x2 = vcvtq_f32_s32(b.val[2]);
+			float32x4_t y2 = vcvtq_f32_s32(b.val[3]);
+			uint32x4_t out, in;
+			uint32_t o[4], n[4];
+			int k;
+
+			out = vorrq_u32(vorrq_u32(vcgeq_f32(vmin_x, x2),
+						  vcleq_f32(vmax_x, x1)),
+					vorrq_u32(vcgeq_f32(vmin_y, y2),
+						  vcleq_f32(vmax_y, y1)));
+			in = vandq_u32(vandq_u32(vcgeq_f32(vmin_x, x1),
+						 vcltq_f32(vmax_x, x2)),
+				       vandq_u32(vcgeq_f32(vmin_y, y1),
+						 vcltq_f32(vmax_y, y2)));
+			vst1q_u32(o, out);
+			vst1q_u32(n, in);
+
+			for (k = 0; k < 4; k++) {
+				if (o[k])
+					classes[i + k] = CLIP_BOX_OUTSIDE;
+				else if (n[k])
+					classes[i + k] = CLIP_BOX_INSIDE;
+				else
+					classes[i + k] = CLIP_BOX_PARTIAL;
+			}
+		}
+	}
+#endif
+
+	for (; i < nboxes; i++)
+		classes[i] = classify_box(min_x, max_x, min_y, max_y,
+					  &boxes[i]);
+}
+
+static bool
+merge_down(pixman_box32_t *a, pixman_box32_t *b, pixman_box32_t *merge)
+{
+	if (a->x1 == b->x1 && a->x2 == b->x2 && a->y1 == b->y2) {
+		merge->x1 = a->x1;
+		merge->x2 = a->x2;
+		merge->y1 = b->y1;
+		merge->y2 = a->y2;
+		return true;
+	}
+	return false;
+}
+
+/** Merge vertically adjacent rectangles of the same width
+ *
+ * Pixman regions are made of horizontal bands, which cuts e.g. a window
+ * partially covered by another one into many thin rectangles. The result is
+ * allocated with malloc() and returned in outrects.
+ *
+ * \return The number of rectangles in outrects.
+ */
+int
+compress_bands(pixman_box32_t *inrects, int nrects,
+	       pixman_box32_t **outrects)
+{
+	bool merged = false;
+	pixman_box32_t *out, merge_rect;
+	int i, j, nout;
+
+	if (!nrects) {
+		*outrects = NULL;
+		return 0;
+	}
+
+	/* nrects is an upper bound - we're not too worried about
+	 * allocating a little extra
+	 */
+	out = malloc(sizeof(pixman_box32_t) * nrects);
+	out[0] = inrects[0];
+	nout = 1;
+	for (i = 1; i < nrects; i++) {
+		for (j = 0; j < nout; j++) {
+			merged = merge_down(&inrects[i], &out[j], &merge_rect);
+			if (merged) {
+				out[j] = merge_rect;
+				break;
+			}
+		}
+		if (!merged) {
+			out[nout] = inrects[i];
+			nout++;
+		}
+	}
+	*outrects = out;
+	return nout;
+}
@@ -25,6 +25,9 @@
 #ifndef _WESTON_VERTEX_CLIPPING_H
 #define _WESTON_VERTEX_CLIPPING_H
 
+#include <stdint.h>
+#include <pixman.h>
+
 struct polygon8 {
 	float x[8];
 	float y[8];
@@ -48,6 +51,12 @@ struct clip_context {
 	} vertices;
 };
 
+enum clip_box_class {
+	CLIP_BOX_OUTSIDE = 0,	/**< nothing of the polygon is drawn */
+	CLIP_BOX_INSIDE,	/**< all of the polygon is drawn */
+	CLIP_BOX_PARTIAL,	/**< the polygon needs clipping */
+};
+
 float
 float_difference(float a, float b);
 
@@ -61,6 +70,24 @@ int
 clip_transformed(struct clip_context *ctx,
 		 struct polygon8 *surf,
 		 float *ex,
-		 float *ey);\
+		 float *ey);
+
+int
+clip_axis_aligned(struct clip_context *ctx,
+		  struct polygon8 *surf,
+		  float *ex,
+		  float *ey);
+
+int
+clip_inside(const struct polygon8 *surf, float *ex, float *ey);
+
+void
+clip_classify_boxes(const struct polygon8 *surf,
+		    const pixman_box32_t *boxes, int nboxes,
+		    uint8_t *classes);
+
+int
+compress_bands(pixman_box32_t *inrects, int nrects,
+	       pixman_box32_t **outrects);
 
 #endif
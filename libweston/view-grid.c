@@ -0,0 +1,281 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <libweston/libweston.h>
+#include <libweston/zalloc.h>
+#include "view-grid.h"
+
+/*
+ * The view grid is a spatial hash over weston_view::transform.boundingbox,
+ * used to find pick candidates for a point without walking the whole
+ * compositor view list.
+ *
+ * Global coordinates are divided into square cells, and every cell is hashed
+ * into one of a fixed number of buckets. A bucket holds the views whose
+ * bounding box touches any cell mapping to it, in view list order. Hash
+ * collisions only cost a few extra bounding box tests, since the caller
+ * always checks the real bounding box.
+ *
+ * Views spanning a lot of cells (backgrounds, fullscreen windows, views with
+ * huge layer masks) go into a separate list that is consulted on every
+ * lookup, so that a single big view cannot blow up the bucket arrays.
+ *
+ * The grid is rebuilt lazily: anything that changes a bounding box or the
+ * view list order marks it dirty, and the next lookup walks the view list
+ * once. Picking happens at input rate while geometry changes at most once
+ * per repaint, so the rebuild cost is amortized over many lookups.
+ */
+
+#define VIEW_GRID_CELL_SHIFT 7 /* 128 pixel cells */
+#define VIEW_GRID_BUCKET_BITS 10
+#define VIEW_GRID_BUCKET_COUNT (1u << VIEW_GRID_BUCKET_BITS)
+#define VIEW_GRID_MAX_CELLS 256
+
+struct view_grid_bucket {
+	struct weston_view_grid_entry *entries;
+	unsigned int count;
+	unsigned int alloc;
+};
+
+struct weston_view_grid {
+	bool dirty;
+	struct view_grid_bucket buckets[VIEW_GRID_BUCKET_COUNT];
+	struct view_grid_bucket large;
+};
+
+static inline int32_t
+view_grid_cell(int32_t v)
+{
+	/* arithmetic shift, rounds towards negative infinity */
+	return v >> VIEW_GRID_CELL_SHIFT;
+}
+
+static inline unsigned int
+view_grid_hash(int32_t cx, int32_t cy)
+{
+	uint32_t h = (uint32_t)cx * 73856093u ^ (uint32_t)cy * 19349663u;
+
+	return h & (VIEW_GRID_BUCKET_COUNT - 1);
+}
+
+static bool
+view_grid_bucket_append(struct view_grid_bucket *bucket,
+			struct weston_view *view, uint32_t order)
+{
+	struct weston_view_grid_entry *entries;
+	unsigned int alloc;
+
+	/* Views are added in order, so a view covering several cells of
+	 * the same bucket would always be the last entry. */
+	if (bucket->count > 0 &&
+	    bucket->entries[bucket->count - 1].view == view)
+		return true;
+
+	if (bucket->count == bucket->alloc) {
+		alloc = bucket->alloc ? bucket->alloc * 2 : 4;
+		entries = realloc(bucket->entries, alloc * sizeof *entries);
+		if (!entries)
+			return false;
+
+		bucket->entries = entries;
+		bucket->alloc = alloc;
+	}
+
+	bucket->entries[bucket->count].view = view;
+	bucket->entries[bucket->count].order = order;
+	bucket->count++;
+
+	return true;
+}
+
+static bool
+view_grid_add_view(struct weston_view_grid *grid,
+		   struct weston_view *view, uint32_t order)
+{
+	pixman_box32_t *box = pixman_region32_extents(&view->transform.boundingbox);
+	int64_t cells;
+	int32_t cx1, cy1, cx2, cy2;
+	int32_t cx, cy;
+
+	if (box->x1 >= box->x2 || box->y1 >= box->y2)
+		return true;
+
+	cx1 = view_grid_cell(box->x1);
+	cy1 = view_grid_cell(box->y1);
+	cx2 = view_grid_cell(box->x2 - 1);
+	cy2 = view_grid_cell(box->y2 - 1);
+
+	cells = (int64_t)(cx2 - cx1 + 1) * (int64_t)(cy2 - cy1 + 1);
+	if (cells > VIEW_GRID_MAX_CELLS)
+		return view_grid_bucket_append(&grid->large, view, order);
+
+	for (cy = cy1; cy <= cy2; cy++) {
+		for (cx = cx1; cx <= cx2; cx++) {
+			struct view_grid_bucket *bucket;
+
+			bucket = &grid->buckets[view_grid_hash(cx, cy)];
+			if (!view_grid_bucket_append(bucket, view, order))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static void
+view_grid_clear(struct weston_view_grid *grid)
+{
+	unsigned int i;
+
+	for (i = 0; i < VIEW_GRID_BUCKET_COUNT; i++)
+		grid->buckets[i].count = 0;
+	grid->large.count = 0;
+}
+
+static void
+view_grid_rebuild(struct weston_view_grid *grid, struct wl_list *view_list)
+{
+	struct weston_view *view;
+	uint32_t order = 0;
+
+	view_grid_clear(grid);
+
+	wl_list_for_each(view, view_list, link) {
+		if (!view_grid_add_view(grid, view, order++)) {
+			/* Out of memory: stay dirty so that lookups fall
+			 * back to the large list containing everything. */
+			view_grid_clear(grid);
+			order = 0;
+			wl_list_for_each(view, view_list, link)
+				if (!view_grid_bucket_append(&grid->large,
+							     view, order++))
+					break;
+			return;
+		}
+	}
+
+	grid->dirty = false;
+}
+
+struct weston_view_grid *
+weston_view_grid_create(void)
+{
+	struct weston_view_grid *grid;
+
+	grid = zalloc(sizeof *grid);
+	if (!grid)
+		return NULL;
+
+	grid->dirty = true;
+
+	return grid;
+}
+
+void
+weston_view_grid_destroy(struct weston_view_grid *grid)
+{
+	unsigned int i;
+
+	if (!grid)
+		return;
+
+	for (i = 0; i < VIEW_GRID_BUCKET_COUNT; i++)
+		free(grid->buckets[i].entries);
+	free(grid->large.entries);
+	free(grid);
+}
+
+/** Invalidate the grid
+ *
+ * Must be called whenever a view bounding box changes, or a view is added to,
+ * removed from or moved in the compositor view list.
+ */
+void
+weston_view_grid_mark_dirty(struct weston_view_grid *grid)
+{
+	grid->dirty = true;
+}
+
+/** Find the pick candidates for a point in global coordinates
+ *
+ * \param grid The view grid.
+ * \param view_list The compositor view list, used if the grid needs to be
+ * rebuilt.
+ * \param x The X coordinate of the point.
+ * \param y The Y coordinate of the point.
+ * \param cursor Returns the candidate iterator.
+ *
+ * The candidates are a superset of the views whose bounding box contains the
+ * point. Iterate them with weston_view_grid_cursor_next(). The cursor is
+ * invalidated by anything that marks the grid dirty.
+ */
+void
+weston_view_grid_lookup(struct weston_view_grid *grid,
+			struct wl_list *view_list,
+			int32_t x, int32_t y,
+			struct weston_view_grid_cursor *cursor)
+{
+	struct view_grid_bucket *bucket;
+
+	if (grid->dirty)
+		view_grid_rebuild(grid, view_list);
+
+	bucket = &grid->buckets[view_grid_hash(view_grid_cell(x),
+					       view_grid_cell(y))];
+
+	cursor->cell = bucket->entries;
+	cursor->cell_end = bucket->entries + bucket->count;
+	cursor->large = grid->large.entries;
+	cursor->large_end = grid->large.entries + grid->large.count;
+}
+
+/** Return the next candidate in stacking order, or NULL when exhausted */
+struct weston_view *
+weston_view_grid_cursor_next(struct weston_view_grid_cursor *cursor)
+{
+	bool has_cell = cursor->cell < cursor->cell_end;
+	bool has_large = cursor->large < cursor->large_end;
+
+	if (has_cell && has_large) {
+		if (cursor->cell->order < cursor->large->order)
+			return (cursor->cell++)->view;
+		return (cursor->large++)->view;
+	}
+
+	if (has_cell)
+		return (cursor->cell++)->view;
+
+	if (has_large)
+		return (cursor->large++)->view;
+
+	return NULL;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_VIEW_GRID_H
+#define WESTON_VIEW_GRID_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-util.h>
+
+struct weston_view;
+struct weston_view_grid;
+
+/** One view registered in a grid bucket
+ *
+ * order is the position of the view in weston_compositor::view_list at the
+ * time the grid was built, topmost view first.
+ */
+struct weston_view_grid_entry {
+	struct weston_view *view;
+	uint32_t order;
+};
+
+/** Iterator over the views whose bounding box may contain a point
+ *
+ * Views are returned in stacking order, topmost first, so the first view
+ * that passes the precise input test is the one to pick.
+ */
+struct weston_view_grid_cursor {
+	const struct weston_view_grid_entry *cell, *cell_end;
+	const struct weston_view_grid_entry *large, *large_end;
+};
+
+struct weston_view_grid *
+weston_view_grid_create(void);
+
+void
+weston_view_grid_destroy(struct weston_view_grid *grid);
+
+void
+weston_view_grid_mark_dirty(struct weston_view_grid *grid);
+
+void
+weston_view_grid_lookup(struct weston_view_grid *grid,
+			struct wl_list *view_list,
+			int32_t x, int32_t y,
+			struct weston_view_grid_cursor *cursor);
+
+struct weston_view *
+weston_view_grid_cursor_next(struct weston_view_grid_cursor *cursor);
+
+#endif /* WESTON_VIEW_GRID_H */
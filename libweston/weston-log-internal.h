@@ -65,6 +65,33 @@ struct weston_log_subscriber {
 	struct wl_list subscription_list;       /**< weston_log_subscription::owner_link */
 };
 
+/** Where the writer thread of a weston_log_ring writes to
+ *
+ * @ingroup internal-log
+ */
+struct weston_log_ring_sink {
+	/** write \c len bytes, returns 0 or a negative errno value */
+	int (*write)(void *data, const char *buf, size_t len);
+	/** optional, called once the ring has been drained */
+	void (*flush)(void *data);
+};
+
+struct weston_log_ring;
+
+struct weston_log_ring *
+weston_log_ring_create(size_t size, const struct weston_log_ring_sink *sink,
+		       void *sink_data);
+
+void
+weston_log_ring_write(struct weston_log_ring *ring,
+		      const char *data, size_t len);
+
+int
+weston_log_ring_get_error(struct weston_log_ring *ring);
+
+void
+weston_log_ring_destroy(struct weston_log_ring *ring);
+
 void
 weston_log_subscription_create(struct weston_log_subscriber *owner,
 			       struct weston_log_scope *scope);
@@ -110,6 +137,10 @@ void
 weston_timeline_create_subscription(struct weston_log_subscription *sub,
 				    void *user_data);
 
+void
+weston_timeline_trace_create_subscription(struct weston_log_subscription *sub,
+					  void *user_data);
+
 void
 weston_timeline_destroy_subscription(struct weston_log_subscription *sub,
 				     void *user_data);
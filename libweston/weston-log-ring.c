@@ -0,0 +1,420 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <libweston/weston-log.h>
+#include "shared/helpers.h"
+#include <libweston/libweston.h>
+
+#include "weston-log-internal.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/*
+ * A bounded queue of log records drained by a writer thread, so that a slow
+ * file or pipe does not stall the thread writing the log.
+ *
+ * Every write copies one record, a length followed by the bytes, into a
+ * single-producer single-consumer ring, and the writer thread hands the
+ * records to a sink. The producer only touches memory, apart from waking up
+ * the writer when the ring was empty, so subscribing chatty scopes such as
+ * 'drm-backend' or 'timeline' costs about a memcpy per message.
+ *
+ * Writes happen on the thread owning the log context, like every other
+ * weston_log_subscriber. When the writer falls behind, records that do not
+ * fit are dropped and the number of dropped bytes is reported to the sink.
+ */
+
+struct log_record {
+	uint32_t len;
+	char data[];
+};
+
+struct weston_log_ring {
+	const struct weston_log_ring_sink *sink;
+	void *sink_data;
+
+	char *buf;
+	size_t size;			/**< power of two */
+	_Atomic size_t head;		/**< written by the producer */
+	_Atomic size_t tail;		/**< written by the writer thread */
+	_Atomic size_t dropped;		/**< bytes lost since last report */
+	atomic_int error;		/**< errno of the failed sink write */
+
+	pthread_t thread;
+	int wake_fd;
+	atomic_bool quit;
+};
+
+static size_t
+log_record_size(size_t len)
+{
+	return (sizeof(struct log_record) + len + 7) & ~(size_t)7;
+}
+
+/* Copy in or out of the ring, wrapping around its end. */
+static void
+log_ring_copy_in(struct weston_log_ring *ring, size_t pos,
+		 const void *data, size_t len)
+{
+	size_t off = pos & (ring->size - 1);
+	size_t first = MIN(len, ring->size - off);
+
+	memcpy(ring->buf + off, data, first);
+	memcpy(ring->buf, (const char *)data + first, len - first);
+}
+
+static void
+log_ring_copy_out(struct weston_log_ring *ring, size_t pos,
+		  void *data, size_t len)
+{
+	size_t off = pos & (ring->size - 1);
+	size_t first = MIN(len, ring->size - off);
+
+	memcpy(data, ring->buf + off, first);
+	memcpy((char *)data + first, ring->buf, len - first);
+}
+
+static void
+log_ring_wake(struct weston_log_ring *ring)
+{
+	uint64_t one = 1;
+
+	while (write(ring->wake_fd, &one, sizeof one) < 0 && errno == EINTR)
+		;
+}
+
+/** Queue a record for the writer thread
+ *
+ * \param ring The ring to write into.
+ * \param data The bytes to write.
+ * \param len The number of bytes.
+ *
+ * The record is dropped if the ring is full or the sink failed.
+ *
+ * @ingroup internal-log
+ */
+void
+weston_log_ring_write(struct weston_log_ring *ring,
+		      const char *data, size_t len)
+{
+	struct log_record rec = { .len = len };
+	size_t head, tail, need;
+
+	if (atomic_load_explicit(&ring->error, memory_order_relaxed))
+		return;
+
+	need = log_record_size(len);
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (len > UINT32_MAX || need > ring->size - (head - tail)) {
+		atomic_fetch_add_explicit(&ring->dropped, len,
+					  memory_order_relaxed);
+		return;
+	}
+
+	log_ring_copy_in(ring, head, &rec, sizeof rec);
+	log_ring_copy_in(ring, head + sizeof rec, data, len);
+	atomic_store_explicit(&ring->head, head + need, memory_order_release);
+
+	if (head == tail)
+		log_ring_wake(ring);
+}
+
+/** Get the error of the sink
+ *
+ * \return The errno value of the sink write that failed, 0 if none did.
+ *
+ * Once the sink failed, nothing more is written.
+ *
+ * @ingroup internal-log
+ */
+int
+weston_log_ring_get_error(struct weston_log_ring *ring)
+{
+	return atomic_load(&ring->error);
+}
+
+static int
+log_ring_sink_write(struct weston_log_ring *ring, const char *data,
+		    size_t len)
+{
+	int ret;
+
+	ret = ring->sink->write(ring->sink_data, data, len);
+	if (ret < 0)
+		atomic_store(&ring->error, -ret);
+
+	return ret;
+}
+
+static void
+log_ring_drain(struct weston_log_ring *ring, char *scratch)
+{
+	struct log_record rec;
+	size_t head, tail, dropped;
+	int len;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	while (tail != head) {
+		log_ring_copy_out(ring, tail, &rec, sizeof rec);
+		log_ring_copy_out(ring, tail + sizeof rec, scratch, rec.len);
+		if (!atomic_load(&ring->error))
+			log_ring_sink_write(ring, scratch, rec.len);
+
+		tail += log_record_size(rec.len);
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	}
+
+	dropped = atomic_exchange_explicit(&ring->dropped, 0,
+					   memory_order_relaxed);
+	if (dropped && !atomic_load(&ring->error)) {
+		len = snprintf(scratch, ring->size,
+			       "[log ring full, %zu bytes dropped]\n", dropped);
+		log_ring_sink_write(ring, scratch, len);
+	}
+
+	if (ring->sink->flush && !atomic_load(&ring->error))
+		ring->sink->flush(ring->sink_data);
+}
+
+static void *
+log_ring_thread(void *data)
+{
+	struct weston_log_ring *ring = data;
+	struct pollfd pfd = { .fd = ring->wake_fd, .events = POLLIN };
+	uint64_t count;
+	char *scratch;
+
+	/* A record is never larger than the ring. */
+	scratch = malloc(ring->size);
+	if (!scratch)
+		return NULL;
+
+	while (!atomic_load(&ring->quit)) {
+		log_ring_drain(ring, scratch);
+
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+		if (pfd.revents & POLLIN)
+			while (read(ring->wake_fd, &count, sizeof count) < 0 &&
+			       errno == EINTR)
+				;
+	}
+
+	log_ring_drain(ring, scratch);
+	free(scratch);
+
+	return NULL;
+}
+
+/** Create a ring and its writer thread
+ *
+ * \param size The size of the ring buffer, rounded up to a power of two.
+ * \param sink Where the writer thread writes the records to.
+ * \param sink_data Passed to the sink callbacks.
+ * \return The new ring, or NULL on failure.
+ *
+ * @ingroup internal-log
+ */
+struct weston_log_ring *
+weston_log_ring_create(size_t size, const struct weston_log_ring_sink *sink,
+		       void *sink_data)
+{
+	struct weston_log_ring *ring;
+	sigset_t mask, old_mask;
+	size_t ring_size = 4096;
+	int ret;
+
+	while (ring_size < size)
+		ring_size <<= 1;
+
+	ring = zalloc(sizeof *ring);
+	if (!ring)
+		return NULL;
+
+	ring->buf = malloc(ring_size);
+	if (!ring->buf)
+		goto err_ring;
+
+	ring->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ring->wake_fd < 0)
+		goto err_buf;
+
+	ring->size = ring_size;
+	ring->sink = sink;
+	ring->sink_data = sink_data;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->dropped, 0);
+	atomic_init(&ring->error, 0);
+	atomic_init(&ring->quit, false);
+
+	sigfillset(&mask);
+	sigdelset(&mask, SIGBUS);
+	sigdelset(&mask, SIGSEGV);
+	sigdelset(&mask, SIGFPE);
+	sigdelset(&mask, SIGILL);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	ret = pthread_create(&ring->thread, NULL, log_ring_thread, ring);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	if (ret != 0)
+		goto err_fd;
+
+	return ring;
+
+err_fd:
+	close(ring->wake_fd);
+err_buf:
+	free(ring->buf);
+err_ring:
+	free(ring);
+	return NULL;
+}
+
+/** Write out everything queued and destroy the ring
+ *
+ * Blocks until the writer thread has drained the ring.
+ *
+ * @ingroup internal-log
+ */
+void
+weston_log_ring_destroy(struct weston_log_ring *ring)
+{
+	atomic_store(&ring->quit, true);
+	log_ring_wake(ring);
+	pthread_join(ring->thread, NULL);
+
+	close(ring->wake_fd);
+	free(ring->buf);
+	free(ring);
+}
+
+/** File type of stream written from the ring's thread
+ */
+struct weston_debug_log_ring {
+	struct weston_log_subscriber base;
+	FILE *file;
+	struct weston_log_ring *ring;
+};
+
+static struct weston_debug_log_ring *
+to_weston_debug_log_ring(struct weston_log_subscriber *sub)
+{
+	return container_of(sub, struct weston_debug_log_ring, base);
+}
+
+static int
+log_ring_file_write(void *data, const char *buf, size_t len)
+{
+	struct weston_debug_log_ring *file = data;
+
+	fwrite(buf, len, 1, file->file);
+
+	return 0;
+}
+
+static void
+log_ring_file_flush(void *data)
+{
+	struct weston_debug_log_ring *file = data;
+
+	fflush(file->file);
+}
+
+static const struct weston_log_ring_sink log_ring_file_sink = {
+	.write = log_ring_file_write,
+	.flush = log_ring_file_flush,
+};
+
+static void
+weston_log_ring_subscriber_write(struct weston_log_subscriber *sub,
+				 const char *data, size_t len)
+{
+	struct weston_debug_log_ring *file = to_weston_debug_log_ring(sub);
+
+	weston_log_ring_write(file->ring, data, len);
+}
+
+static void
+weston_log_subscriber_destroy_ring(struct weston_log_subscriber *subscriber)
+{
+	struct weston_debug_log_ring *file =
+		to_weston_debug_log_ring(subscriber);
+
+	weston_log_subscriber_release(subscriber);
+	weston_log_ring_destroy(file->ring);
+	free(file);
+}
+
+/** Creates a file type of subscriber writing from a separate thread
+ *
+ * Should be destroyed using weston_log_subscriber_destroy(), which writes
+ * out everything still buffered.
+ *
+ * @param dump_to if specified, used for writing data to, otherwise stderr
+ * @param size the size of the ring buffer, rounded up to a power of two
+ * @returns a weston_log_subscriber object or NULL in case of failure
+ *
+ * @sa weston_log_subscriber_create_log
+ *
+ */
+WL_EXPORT struct weston_log_subscriber *
+weston_log_subscriber_create_ring(FILE *dump_to, size_t size)
+{
+	struct weston_debug_log_ring *file = zalloc(sizeof(*file));
+
+	if (!file)
+		return NULL;
+
+	file->file = dump_to ? dump_to : stderr;
+	file->ring = weston_log_ring_create(size, &log_ring_file_sink, file);
+	if (!file->ring) {
+		free(file);
+		return NULL;
+	}
+
+	file->base.write = weston_log_ring_subscriber_write;
+	file->base.destroy = weston_log_subscriber_destroy_ring;
+	file->base.destroy_subscription = NULL;
+	file->base.complete = NULL;
+
+	wl_list_init(&file->base.subscription_list);
+
+	return &file->base;
+}
@@ -54,8 +54,13 @@ struct weston_log_debug_wayland {
 	struct weston_log_subscriber base;
 	int fd;				/**< client provided fd */
 	struct wl_resource *resource;	/**< weston_debug_stream_v1 object */
+	struct weston_log_ring *ring;	/**< writes to fd, NULL if synchronous */
 };
 
+/* Size of the queue of each stream, a client reading slowly or a stream
+ * redirected to a slow file loses messages beyond this. */
+#define DEBUG_STREAM_RING_SIZE (256 * 1024)
+
 static struct weston_log_debug_wayland *
 to_weston_log_debug_wayland(struct weston_log_subscriber *sub)
 {
@@ -65,6 +70,10 @@ to_weston_log_debug_wayland(struct weston_log_subscriber *sub)
 static void
 stream_close_unlink(struct weston_log_debug_wayland *stream)
 {
+	if (stream->ring) {
+		weston_log_ring_destroy(stream->ring);
+		stream->ring = NULL;
+	}
 	if (stream->fd != -1)
 		close(stream->fd);
 	stream->fd = -1;
@@ -93,6 +102,40 @@ stream_close_on_failure(struct weston_log_debug_wayland *stream,
 	}
 }
 
+static int
+stream_write_fd(int fd, const char *data, size_t len)
+{
+	ssize_t len_ = len;
+	ssize_t ret;
+
+	while (len_ > 0) {
+		ret = write(fd, data, len_);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -errno;
+		}
+
+		len_ -= ret;
+		data += ret;
+	}
+
+	return 0;
+}
+
+static int
+stream_ring_write(void *data, const char *buf, size_t len)
+{
+	struct weston_log_debug_wayland *stream = data;
+
+	return stream_write_fd(stream->fd, buf, len);
+}
+
+static const struct weston_log_ring_sink stream_ring_sink = {
+	.write = stream_ring_write,
+};
+
 /** Write data into a specific debug stream
  *
  * \param sub The subscriber's stream to write into; must not be NULL.
@@ -102,10 +145,11 @@ stream_close_on_failure(struct weston_log_debug_wayland *stream,
  * Writes the given data (binary verbatim) into the debug stream.
  * If \c len is zero or negative, the write is silently dropped.
  *
- * Writing is continued until all data has been written or
- * a write fails. If the write fails due to a signal, it is re-tried.
- * Otherwise on failure, the stream is closed and
- * \c weston_debug_stream_v1.failure event is sent to the client.
+ * The data is queued for the writer thread of the stream, or written
+ * synchronously if the thread could not be created. Writing is continued
+ * until all data has been written or a write fails. If the write fails due
+ * to a signal, it is re-tried. Otherwise on failure, the stream is closed
+ * and \c weston_debug_stream_v1.failure event is sent to the client.
  *
  * \memberof weston_log_debug_wayland
  */
@@ -113,30 +157,27 @@ static void
 weston_log_debug_wayland_write(struct weston_log_subscriber *sub,
 			       const char *data, size_t len)
 {
-	ssize_t len_ = len;
-	ssize_t ret;
-	int e;
 	struct weston_log_debug_wayland *stream = to_weston_log_debug_wayland(sub);
+	int e;
 
 	if (stream->fd == -1)
 		return;
 
-	while (len_ > 0) {
-		ret = write(stream->fd, data, len_);
-		e = errno;
-		if (ret < 0) {
-			if (e == EINTR)
-				continue;
-
-			stream_close_on_failure(stream,
-					"Error writing %zd bytes: %s (%d)",
-					len_, strerror(e), e);
-			break;
+	if (stream->ring) {
+		/* Failures of the writer thread show up on the next write. */
+		e = weston_log_ring_get_error(stream->ring);
+		if (e == 0) {
+			weston_log_ring_write(stream->ring, data, len);
+			return;
 		}
-
-		len_ -= ret;
-		data += ret;
+	} else {
+		e = -stream_write_fd(stream->fd, data, len);
+		if (e == 0)
+			return;
 	}
+
+	stream_close_on_failure(stream, "Error writing to the stream: %s (%d)",
+				strerror(e), e);
 }
 
 /** Close the debug stream and send success event
@@ -181,6 +222,11 @@ stream_create(struct weston_log_context *log_ctx, const char *name,
 	stream->fd = streamfd;
 	stream->resource = stream_resource;
 
+	/* Writing synchronously is the fallback, which stalls the
+	 * compositor when the stream does. */
+	stream->ring = weston_log_ring_create(DEBUG_STREAM_RING_SIZE,
+					      &stream_ring_sink, stream);
+
 	stream->base.write = weston_log_debug_wayland_write;
 	stream->base.destroy = NULL;
 	stream->base.destroy_subscription = weston_log_debug_wayland_to_destroy;
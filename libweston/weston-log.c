@@ -807,12 +807,23 @@ weston_log_scope_vprintf(struct weston_log_scope *scope,
 			 const char *fmt, va_list ap)
 {
 	static const char oom[] = "Out of memory";
+	char buf[512];
 	char *str;
+	va_list ap_copy;
 	int len = 0;
 
 	if (!weston_log_scope_is_enabled(scope))
 		return len;
 
+	/* Most messages are short, avoid the allocation for them. */
+	va_copy(ap_copy, ap);
+	len = vsnprintf(buf, sizeof buf, fmt, ap_copy);
+	va_end(ap_copy);
+	if (len >= 0 && len < (int)sizeof buf) {
+		weston_log_scope_write(scope, buf, len);
+		return len;
+	}
+
 	len = vasprintf(&str, fmt, ap);
 	if (len >= 0) {
 		weston_log_scope_write(scope, str, len);
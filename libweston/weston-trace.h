@@ -0,0 +1,56 @@
+/*
+ * Copyright © 2014 Pekka Paalanen <pq@iki.fi>
+ * Copyright © 2014, 2019 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_TRACE_H
+#define WESTON_TRACE_H
+
+/*
+ * Static tracepoints at hot points of the compositor, for perf, bpftrace and
+ * LTTng to correlate them with kernel scheduling and DRM driver events, e.g.
+ *
+ *	bpftrace -e 'usdt:/usr/lib/libweston-N.so:weston:repaint_begin { ... }'
+ *
+ * With the 'tracepoints' build option they are USDT probes of provider
+ * "weston", a single nop instruction each until a tracer attaches. Without
+ * it they compile to nothing. Unlike TL_POINT, they do not depend on any
+ * weston_log subscription.
+ */
+
+#ifdef WESTON_TRACEPOINTS
+#include <sys/sdt.h>
+
+#define WESTON_TRACE(name) DTRACE_PROBE(weston, name)
+#define WESTON_TRACE1(name, a) DTRACE_PROBE1(weston, name, a)
+#define WESTON_TRACE2(name, a, b) DTRACE_PROBE2(weston, name, a, b)
+#define WESTON_TRACE3(name, a, b, c) DTRACE_PROBE3(weston, name, a, b, c)
+#else
+#define WESTON_TRACE(name) do { } while (0)
+#define WESTON_TRACE1(name, a) do { } while (0)
+#define WESTON_TRACE2(name, a, b) do { } while (0)
+#define WESTON_TRACE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif /* WESTON_TRACE_H */
@@ -0,0 +1,251 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <wayland-util.h>
+
+#include <libweston/zalloc.h>
+#include "worker-pool.h"
+
+/*
+ * A fixed set of threads executing batches of independent jobs.
+ *
+ * Jobs are queued on the main thread with weston_worker_pool_add(), and
+ * nothing runs until weston_worker_pool_run(), which hands the batch to the
+ * workers, helps executing it and returns once every job has finished. The
+ * caller therefore never observes a job running concurrently with its own
+ * code, which keeps the locking requirements of the jobs down to "do not
+ * touch what the other jobs of the batch touch".
+ */
+
+struct worker_job {
+	weston_worker_func_t func;
+	void *data;
+};
+
+struct weston_worker_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+
+	pthread_t *threads;
+	unsigned int n_threads;
+	weston_worker_func_t thread_init;
+	void *init_data;
+
+	struct wl_array jobs;
+	size_t n_jobs;
+	size_t next_job;
+	size_t n_done;
+	bool quit;
+};
+
+/* Called with the mutex held, returns with the mutex held. */
+static void
+worker_pool_run_next(struct weston_worker_pool *pool)
+{
+	struct worker_job *jobs = pool->jobs.data;
+	struct worker_job job = jobs[pool->next_job++];
+
+	pthread_mutex_unlock(&pool->mutex);
+	job.func(job.data);
+	pthread_mutex_lock(&pool->mutex);
+
+	if (++pool->n_done == pool->n_jobs)
+		pthread_cond_signal(&pool->done_cond);
+}
+
+static void *
+worker_thread(void *data)
+{
+	struct weston_worker_pool *pool = data;
+
+	if (pool->thread_init)
+		pool->thread_init(pool->init_data);
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->quit && pool->next_job >= pool->n_jobs)
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+
+		if (pool->quit)
+			break;
+
+		worker_pool_run_next(pool);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+/** Create a worker pool
+ *
+ * \param n_threads The number of threads to spawn, at least one.
+ * \param thread_init Called first thing in every thread, or NULL.
+ * \param init_data The argument of thread_init.
+ * \return The new pool, or NULL on failure.
+ *
+ * The threads block every asynchronous signal, so that signal delivery
+ * through the main loop keeps working. Faults such as SIGBUS raised by
+ * accessing a truncated client buffer are still delivered to the thread
+ * that caused them.
+ */
+struct weston_worker_pool *
+weston_worker_pool_create(unsigned int n_threads,
+			  weston_worker_func_t thread_init, void *init_data)
+{
+	struct weston_worker_pool *pool;
+	sigset_t mask, old_mask;
+	unsigned int i;
+
+	assert(n_threads > 0);
+
+	pool = zalloc(sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pool->threads = calloc(n_threads, sizeof *pool->threads);
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	wl_array_init(&pool->jobs);
+	pool->thread_init = thread_init;
+	pool->init_data = init_data;
+
+	sigfillset(&mask);
+	sigdelset(&mask, SIGBUS);
+	sigdelset(&mask, SIGSEGV);
+	sigdelset(&mask, SIGFPE);
+	sigdelset(&mask, SIGILL);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+	for (i = 0; i < n_threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL,
+				   worker_thread, pool) != 0)
+			break;
+		pool->n_threads++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (pool->n_threads == 0) {
+		weston_worker_pool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+void
+weston_worker_pool_destroy(struct weston_worker_pool *pool)
+{
+	unsigned int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->n_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	wl_array_release(&pool->jobs);
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+unsigned int
+weston_worker_pool_get_thread_count(struct weston_worker_pool *pool)
+{
+	return pool->n_threads;
+}
+
+/** Queue a job for the next weston_worker_pool_run()
+ *
+ * \return 0 on success, -1 if out of memory.
+ *
+ * Must not be called while the pool is running.
+ */
+int
+weston_worker_pool_add(struct weston_worker_pool *pool,
+		       weston_worker_func_t func, void *data)
+{
+	struct worker_job *job;
+
+	job = wl_array_add(&pool->jobs, sizeof *job);
+	if (!job)
+		return -1;
+
+	job->func = func;
+	job->data = data;
+
+	return 0;
+}
+
+/** Execute all queued jobs and wait for them to finish
+ *
+ * The calling thread takes part in executing the jobs. Jobs are started in
+ * the order they were queued, but may complete in any order.
+ */
+void
+weston_worker_pool_run(struct weston_worker_pool *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+
+	pool->n_jobs = pool->jobs.size / sizeof(struct worker_job);
+	pool->next_job = 0;
+	pool->n_done = 0;
+
+	if (pool->n_jobs > 1)
+		pthread_cond_broadcast(&pool->work_cond);
+
+	while (pool->next_job < pool->n_jobs)
+		worker_pool_run_next(pool);
+
+	while (pool->n_done < pool->n_jobs)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+
+	pool->jobs.size = 0;
+	pool->n_jobs = 0;
+	pool->next_job = 0;
+	pthread_mutex_unlock(&pool->mutex);
+}
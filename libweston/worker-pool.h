@@ -0,0 +1,50 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_WORKER_POOL_H
+#define WESTON_WORKER_POOL_H
+
+struct weston_worker_pool;
+
+typedef void (*weston_worker_func_t)(void *data);
+
+struct weston_worker_pool *
+weston_worker_pool_create(unsigned int n_threads,
+			  weston_worker_func_t thread_init, void *init_data);
+
+void
+weston_worker_pool_destroy(struct weston_worker_pool *pool);
+
+unsigned int
+weston_worker_pool_get_thread_count(struct weston_worker_pool *pool);
+
+int
+weston_worker_pool_add(struct weston_worker_pool *pool,
+		       weston_worker_func_t func, void *data);
+
+void
+weston_worker_pool_run(struct weston_worker_pool *pool);
+
+#endif /* WESTON_WORKER_POOL_H */
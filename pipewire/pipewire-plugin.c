@@ -26,6 +26,7 @@
 #include "pipewire-plugin.h"
 #include "backend.h"
 #include "libweston-internal.h"
+#include "shared/helpers.h"
 #include "shared/timespec-util.h"
 #include <libweston/backend-drm.h>
 #include <libweston/weston-log.h>
@@ -42,6 +43,12 @@
 
 #define PROP_RANGE(min, max) 2, (min), (max)
 
+/* The DRM-backend renders into a ring of this many buffers at most. */
+#define PIPEWIRE_MAX_MAPS 4
+
+/* Damage rectangles in the VideoDamage metadata of a buffer. */
+#define PIPEWIRE_MAX_DAMAGE_RECTS 16
+
 struct type {
 	struct spa_type_media_type media_type;
 	struct spa_type_media_subtype media_subtype;
@@ -68,6 +75,14 @@ struct weston_pipewire {
 	struct spa_hook remote_listener;
 };
 
+/* A renderer buffer, mapped for as long as the output is enabled. */
+struct pipewire_map {
+	struct drm_fb *drm_buffer;
+	void *ptr;
+	size_t size;
+	uint32_t offset;
+};
+
 struct pipewire_output {
 	struct weston_output *output;
 	void (*saved_destroy)(struct weston_output *output);
@@ -89,12 +104,44 @@ struct pipewire_output {
 	struct wl_list link;
 	bool submitted_frame;
 	enum dpms_enum dpms;
+
+	struct pipewire_map maps[PIPEWIRE_MAX_MAPS];
+	unsigned int next_map;
+
+	struct wl_list buffer_list;
+
+	struct wl_list variant_list;
+};
+
+/* An additional stream of the output, scaled down from its frames. */
+struct pipewire_variant {
+	struct pipewire_output *output;
+	struct wl_list link;
+
+	int width;
+	int height;
+	int framerate;
+
+	uint32_t seq;
+	struct pw_stream *stream;
+	struct spa_hook stream_listener;
+	struct spa_video_info_raw video_format;
+	pixman_format_code_t pixman_format;
+	struct timespec last_frame;
+};
+
+/* A buffer of the stream, with what changed on the output since it was last
+ * filled. */
+struct pipewire_buffer {
+	struct pw_buffer *buffer;
+	pixman_region32_t stale;
+	struct wl_list link;
 };
 
 struct pipewire_frame_data {
 	struct pipewire_output *output;
-	int fd;
-	int stride;
+	struct weston_drm_virtual_output_dmabuf dmabuf;
+	pixman_box32_t damage[PIPEWIRE_MAX_DAMAGE_RECTS];
 	struct drm_fb *drm_buffer;
 	int fence_sync_fd;
 	struct wl_event_source *fence_sync_event_source;
@@ -179,18 +226,298 @@ lookup_pipewire_output(struct weston_output *base_output)
 }
 
 static void
-pipewire_output_handle_frame(struct pipewire_output *output, int fd,
-			     int stride, struct drm_fb *drm_buffer)
+pipewire_output_unmap_buffers(struct pipewire_output *output)
+{
+	unsigned int i;
+
+	for (i = 0; i < PIPEWIRE_MAX_MAPS; i++) {
+		struct pipewire_map *map = &output->maps[i];
+
+		if (map->ptr)
+			munmap(map->ptr, map->size);
+		map->ptr = NULL;
+		map->drm_buffer = NULL;
+	}
+	output->next_map = 0;
+}
+
+/* The backend hands out the same buffers of its ring over and over, so each
+ * one only gets mapped on its first frame. */
+static void *
+pipewire_output_map_buffer(struct pipewire_output *output,
+			   const struct weston_drm_virtual_output_dmabuf *dmabuf,
+			   struct drm_fb *drm_buffer, size_t size)
+{
+	struct pipewire_map *map;
+	unsigned int i;
+	void *ptr;
+
+	for (i = 0; i < PIPEWIRE_MAX_MAPS; i++) {
+		map = &output->maps[i];
+		if (map->drm_buffer == drm_buffer)
+			return (uint8_t *)map->ptr + map->offset;
+	}
+
+	size += dmabuf->offset[0];
+	ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, dmabuf->fd[0], 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+
+	map = &output->maps[output->next_map];
+	output->next_map = (output->next_map + 1) % PIPEWIRE_MAX_MAPS;
+
+	if (map->ptr)
+		munmap(map->ptr, map->size);
+	map->drm_buffer = drm_buffer;
+	map->ptr = ptr;
+	map->size = size;
+	map->offset = dmabuf->offset[0];
+
+	return (uint8_t *)ptr + map->offset;
+}
+
+/* Fits the damage of a frame in PIPEWIRE_MAX_DAMAGE_RECTS, by falling back to
+ * its extents. */
+static int
+pipewire_reduce_damage(const struct weston_drm_virtual_output_dmabuf *dmabuf,
+		       pixman_box32_t *boxes)
+{
+	int i;
+
+	if (dmabuf->n_damage <= PIPEWIRE_MAX_DAMAGE_RECTS) {
+		memcpy(boxes, dmabuf->damage,
+		       dmabuf->n_damage * sizeof *boxes);
+		return dmabuf->n_damage;
+	}
+
+	boxes[0] = dmabuf->damage[0];
+	for (i = 1; i < dmabuf->n_damage; i++) {
+		boxes[0].x1 = MIN(boxes[0].x1, dmabuf->damage[i].x1);
+		boxes[0].y1 = MIN(boxes[0].y1, dmabuf->damage[i].y1);
+		boxes[0].x2 = MAX(boxes[0].x2, dmabuf->damage[i].x2);
+		boxes[0].y2 = MAX(boxes[0].y2, dmabuf->damage[i].y2);
+	}
+
+	return 1;
+}
+
+static void
+pipewire_output_set_damage(struct spa_meta_region *regions,
+			   const struct weston_drm_virtual_output_dmabuf *dmabuf)
+{
+	pixman_box32_t boxes[PIPEWIRE_MAX_DAMAGE_RECTS];
+	int i, n;
+
+	n = pipewire_reduce_damage(dmabuf, boxes);
+	for (i = 0; i < n; i++) {
+		regions[i].region.position.x = boxes[i].x1;
+		regions[i].region.position.y = boxes[i].y1;
+		regions[i].region.size.width = boxes[i].x2 - boxes[i].x1;
+		regions[i].region.size.height = boxes[i].y2 - boxes[i].y1;
+	}
+
+	/* an empty region ends the list */
+	if (n < PIPEWIRE_MAX_DAMAGE_RECTS) {
+		regions[n].region.size.width = 0;
+		regions[n].region.size.height = 0;
+	}
+}
+
+/* Every buffer of the stream misses the damage of the frame, until it gets
+ * refreshed with it. */
+static void
+pipewire_output_add_damage(struct pipewire_output *output,
+			   const struct weston_drm_virtual_output_dmabuf *dmabuf)
+{
+	struct pipewire_buffer *pb;
+	int i;
+
+	wl_list_for_each(pb, &output->buffer_list, link) {
+		for (i = 0; i < dmabuf->n_damage; i++) {
+			const pixman_box32_t *box = &dmabuf->damage[i];
+
+			pixman_region32_union_rect(&pb->stale, &pb->stale,
+						   box->x1, box->y1,
+						   box->x2 - box->x1,
+						   box->y2 - box->y1);
+		}
+	}
+}
+
+/* Only copies what the buffer misses, which is a lot less than a frame most
+ * of the time. */
+static void
+pipewire_output_copy_stale(struct pipewire_buffer *pb, uint8_t *dst,
+			   const uint8_t *src, int stride, int bpp)
+{
+	pixman_box32_t *boxes;
+	int n, i, y;
+
+	boxes = pixman_region32_rectangles(&pb->stale, &n);
+	for (i = 0; i < n; i++) {
+		size_t offset = boxes[i].x1 * bpp;
+		size_t len = (boxes[i].x2 - boxes[i].x1) * bpp;
+
+		for (y = boxes[i].y1; y < boxes[i].y2; y++)
+			memcpy(dst + y * stride + offset,
+			       src + y * stride + offset, len);
+	}
+
+	pixman_region32_clear(&pb->stale);
+}
+
+static bool
+pipewire_output_is_streaming(struct pipewire_output *output)
+{
+	struct pipewire_variant *variant;
+
+	if (pw_stream_get_state(output->stream, NULL) ==
+	    PW_STREAM_STATE_STREAMING)
+		return true;
+
+	wl_list_for_each(variant, &output->variant_list, link) {
+		if (pw_stream_get_state(variant->stream, NULL) ==
+		    PW_STREAM_STATE_STREAMING)
+			return true;
+	}
+
+	return false;
+}
+
+/* Whether the variant is due for a frame at its negotiated framerate. */
+static bool
+pipewire_variant_frame_due(struct pipewire_variant *variant,
+			   const struct timespec *now)
+{
+	struct spa_fraction rate = variant->video_format.framerate;
+	int64_t interval;
+
+	if (rate.num == 0)
+		rate = variant->video_format.max_framerate;
+	if (rate.num == 0 || rate.denom == 0)
+		return true;
+
+	if (variant->last_frame.tv_sec == 0 &&
+	    variant->last_frame.tv_nsec == 0)
+		return true;
+
+	/* a millisecond of slack for the jitter of the repaint loop */
+	interval = (int64_t)rate.denom * NSEC_PER_SEC / rate.num - 1000000;
+
+	return timespec_sub_to_nsec(now, &variant->last_frame) >= interval;
+}
+
+/* Scales the whole frame into a buffer of the variant. */
+static void
+pipewire_variant_push_frame(struct pipewire_variant *variant,
+			    const struct timespec *now,
+			    void *ptr, int stride)
+{
+	struct pipewire_output *output = variant->output;
+	struct pw_type *t = output->pipewire->t;
+	int width = variant->video_format.size.width;
+	int height = variant->video_format.size.height;
+	int dst_stride = SPA_ROUND_UP_N(width * 4, 4);
+	pixman_image_t *src, *dst;
+	pixman_transform_t transform;
+	struct pw_buffer *buffer;
+	struct spa_buffer *spa_buffer;
+	struct spa_meta_header *h;
+
+	if (pw_stream_get_state(variant->stream, NULL) !=
+	    PW_STREAM_STATE_STREAMING || width <= 0 || height <= 0)
+		return;
+
+	if (!pipewire_variant_frame_due(variant, now))
+		return;
+
+	buffer = pw_stream_dequeue_buffer(variant->stream);
+	if (!buffer)
+		return;
+
+	spa_buffer = buffer->buffer;
+
+	if ((h = spa_buffer_find_meta(spa_buffer, t->meta.Header))) {
+		h->pts = -1;
+		h->flags = 0;
+		h->seq = variant->seq++;
+		h->dts_offset = 0;
+	}
+
+	src = pixman_image_create_bits_no_clear(PIXMAN_x8r8g8b8,
+						output->output->width,
+						output->output->height,
+						ptr, stride);
+	dst = pixman_image_create_bits_no_clear(variant->pixman_format,
+						width, height,
+						spa_buffer->datas[0].data,
+						dst_stride);
+	if (src && dst) {
+		pixman_transform_init_scale(&transform,
+			pixman_double_to_fixed((double)output->output->width /
+					       width),
+			pixman_double_to_fixed((double)output->output->height /
+					       height));
+		pixman_image_set_transform(src, &transform);
+		/* GOOD takes all the source pixels into account when
+		 * scaling down, BILINEAR would alias. */
+		pixman_image_set_filter(src, PIXMAN_FILTER_GOOD, NULL, 0);
+		pixman_image_composite32(PIXMAN_OP_SRC, src, NULL, dst,
+					 0, 0, 0, 0, 0, 0, width, height);
+	}
+	if (src)
+		pixman_image_unref(src);
+	if (dst)
+		pixman_image_unref(dst);
+
+	spa_buffer->datas[0].chunk->offset = 0;
+	spa_buffer->datas[0].chunk->stride = dst_stride;
+	spa_buffer->datas[0].chunk->size = spa_buffer->datas[0].maxsize;
+
+	variant->last_frame = *now;
+	pw_stream_queue_buffer(variant->stream, buffer);
+}
+
+static void
+pipewire_output_handle_frame(struct pipewire_output *output,
+			     const struct weston_drm_virtual_output_dmabuf *dmabuf,
+			     struct drm_fb *drm_buffer)
 {
 	const struct weston_drm_virtual_output_api *api =
 		output->pipewire->virtual_output_api;
+	int stride = dmabuf->stride[0];
 	size_t size = output->output->height * stride;
 	struct pw_type *t = output->pipewire->t;
 	struct pw_buffer *buffer;
 	struct spa_buffer *spa_buffer;
 	struct spa_meta_header *h;
+	struct spa_meta_region *regions;
+	struct pipewire_buffer *pb;
+	struct pipewire_variant *variant;
+	struct timespec now;
 	void *ptr;
 
+	pipewire_output_add_damage(output, dmabuf);
+
+	if (!pipewire_output_is_streaming(output))
+		goto out;
+
+	/* libpipewire-0.2 streams only take buffers of their own, so the
+	 * frame is still copied; the mapping is kept though. */
+	ptr = pipewire_output_map_buffer(output, dmabuf, drm_buffer, size);
+	if (!ptr) {
+		weston_log("Failed to map the output buffer: %s\n",
+			   strerror(errno));
+		goto out;
+	}
+
+	/* The variants are scaled from the frame rendered for the output,
+	 * the scene is only composited once. */
+	weston_compositor_read_presentation_clock(output->pipewire->compositor,
+						  &now);
+	wl_list_for_each(variant, &output->variant_list, link)
+		pipewire_variant_push_frame(variant, &now, ptr, stride);
+
 	if (pw_stream_get_state(output->stream, NULL) !=
 	    PW_STREAM_STATE_STREAMING)
 		goto out;
@@ -210,9 +537,16 @@ pipewire_output_handle_frame(struct pipewire_output *output, int fd,
 		h->dts_offset = 0;
 	}
 
-	ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
-	memcpy(spa_buffer->datas[0].data, ptr, size);
-	munmap(ptr, size);
+	/* Downstream may encode only what changed since the previous frame. */
+	if ((regions = spa_buffer_find_meta(spa_buffer, t->meta.VideoDamage)))
+		pipewire_output_set_damage(regions, dmabuf);
+
+	pb = buffer->user_data;
+	if (pb)
+		pipewire_output_copy_stale(pb, spa_buffer->datas[0].data, ptr,
+					   stride, 4);
+	else
+		memcpy(spa_buffer->datas[0].data, ptr, size);
 
 	spa_buffer->datas[0].chunk->offset = 0;
 	spa_buffer->datas[0].chunk->stride = stride;
@@ -222,7 +556,6 @@ pipewire_output_handle_frame(struct pipewire_output *output, int fd,
 	pw_stream_queue_buffer(output->stream, buffer);
 
 out:
-	close(fd);
 	output->submitted_frame = true;
 	api->buffer_released(drm_buffer);
 }
@@ -233,7 +566,7 @@ pipewire_output_fence_sync_handler(int fd, uint32_t mask, void *data)
 	struct pipewire_frame_data *frame_data = data;
 	struct pipewire_output *output = frame_data->output;
 
-	pipewire_output_handle_frame(output, frame_data->fd, frame_data->stride,
+	pipewire_output_handle_frame(output, &frame_data->dmabuf,
 				     frame_data->drm_buffer);
 
 	wl_event_source_remove(frame_data->fence_sync_event_source);
@@ -244,8 +577,9 @@ pipewire_output_fence_sync_handler(int fd, uint32_t mask, void *data)
 }
 
 static int
-pipewire_output_submit_frame(struct weston_output *base_output, int fd,
-			     int stride, struct drm_fb *drm_buffer)
+pipewire_output_submit_frame(struct weston_output *base_output,
+			     const struct weston_drm_virtual_output_dmabuf *dmabuf,
+			     struct drm_fb *drm_buffer)
 {
 	struct pipewire_output *output = lookup_pipewire_output(base_output);
 	struct weston_pipewire *pipewire = output->pipewire;
@@ -256,26 +590,28 @@ pipewire_output_submit_frame(struct weston_output *base_output, int fd,
 	int fence_sync_fd;
 
 	pipewire_output_debug(output, "submit frame: fd = %d drm_fb = %p",
-			      fd, drm_buffer);
+			      dmabuf->fd[0], drm_buffer);
 
 	fence_sync_fd = api->get_fence_sync_fd(output->output);
 	if (fence_sync_fd == -1) {
-		pipewire_output_handle_frame(output, fd, stride, drm_buffer);
+		pipewire_output_handle_frame(output, dmabuf, drm_buffer);
 		return 0;
 	}
 
 	frame_data = zalloc(sizeof *frame_data);
 	if (!frame_data) {
 		close(fence_sync_fd);
-		pipewire_output_handle_frame(output, fd, stride, drm_buffer);
+		pipewire_output_handle_frame(output, dmabuf, drm_buffer);
 		return 0;
 	}
 
 	loop = wl_display_get_event_loop(pipewire->compositor->wl_display);
 
 	frame_data->output = output;
-	frame_data->fd = fd;
-	frame_data->stride = stride;
+	frame_data->dmabuf = *dmabuf;
+	frame_data->dmabuf.n_damage = pipewire_reduce_damage(dmabuf,
+							     frame_data->damage);
+	frame_data->dmabuf.damage = frame_data->damage;
 	frame_data->drm_buffer = drm_buffer;
 	frame_data->fence_sync_fd = fence_sync_fd;
 	frame_data->fence_sync_event_source =
@@ -293,8 +629,7 @@ pipewire_output_timer_update(struct pipewire_output *output)
 	int64_t msec;
 	int32_t refresh;
 
-	if (pw_stream_get_state(output->stream, NULL) ==
-	    PW_STREAM_STATE_STREAMING)
+	if (pipewire_output_is_streaming(output))
 		refresh = output->output->current_mode->refresh;
 	else
 		refresh = 1000;
@@ -330,6 +665,7 @@ static void
 pipewire_output_destroy(struct weston_output *base_output)
 {
 	struct pipewire_output *output = lookup_pipewire_output(base_output);
+	struct pipewire_variant *variant, *next_variant;
 	struct weston_mode *mode, *next;
 
 	wl_list_for_each_safe(mode, next, &base_output->mode_list, link) {
@@ -337,8 +673,15 @@ pipewire_output_destroy(struct weston_output *base_output)
 		free(mode);
 	}
 
+	pipewire_output_unmap_buffers(output);
 	output->saved_destroy(base_output);
 
+	wl_list_for_each_safe(variant, next_variant, &output->variant_list,
+			      link) {
+		pw_stream_destroy(variant->stream);
+		wl_list_remove(&variant->link);
+		free(variant);
+	}
 	pw_stream_destroy(output->stream);
 
 	wl_list_remove(&output->link);
@@ -415,6 +758,59 @@ pipewire_output_connect(struct pipewire_output *output)
 	return 0;
 }
 
+/* Offers the configured size as the default, anything up to the size of the
+ * output can be negotiated. */
+static int
+pipewire_variant_connect(struct pipewire_variant *variant)
+{
+	struct pipewire_output *output = variant->output;
+	struct weston_pipewire *pipewire = output->pipewire;
+	struct type *type = &pipewire->type;
+	uint8_t buffer[1024];
+	struct spa_pod_builder builder =
+		SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+	const struct spa_pod *params[1];
+	struct pw_type *t = pipewire->t;
+	int max_rate = output->output->current_mode->refresh / 1000;
+	int frame_rate = variant->framerate;
+	int width = MIN(variant->width, output->output->width);
+	int height = MIN(variant->height, output->output->height);
+	int ret;
+
+	if (frame_rate <= 0 || frame_rate > max_rate)
+		frame_rate = max_rate;
+
+	params[0] = spa_pod_builder_object(&builder,
+		t->param.idEnumFormat, t->spa_format,
+		"I", type->media_type.video,
+		"I", type->media_subtype.raw,
+		":", type->format_video.format,
+		"Ieu", type->video_format.BGRx,
+		       PROP_ENUM(2, type->video_format.BGRx,
+				    type->video_format.RGBx),
+		":", type->format_video.size,
+		"Rru", &SPA_RECTANGLE(width, height),
+		       PROP_RANGE(&SPA_RECTANGLE(1, 1),
+				  &SPA_RECTANGLE(output->output->width,
+						 output->output->height)),
+		":", type->format_video.framerate,
+		"F", &SPA_FRACTION(0, 1),
+		":", type->format_video.max_framerate,
+		"Fru", &SPA_FRACTION(frame_rate, 1),
+		       PROP_RANGE(&SPA_FRACTION(1, 1),
+				  &SPA_FRACTION(max_rate, 1)));
+
+	ret = pw_stream_connect(variant->stream, PW_DIRECTION_OUTPUT, NULL,
+				PW_STREAM_FLAG_MAP_BUFFERS, params, 1);
+	if (ret != 0) {
+		weston_log("Failed to connect pipewire stream: %s",
+			   spa_strerror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
 static int
 pipewire_output_enable(struct weston_output *base_output)
 {
@@ -422,15 +818,20 @@ pipewire_output_enable(struct weston_output *base_output)
 	struct weston_compositor *c = base_output->compositor;
 	const struct weston_drm_virtual_output_api *api
 		= output->pipewire->virtual_output_api;
+	struct pipewire_variant *variant;
 	struct wl_event_loop *loop;
 	int ret;
 
-	api->set_submit_frame_cb(base_output, pipewire_output_submit_frame);
+	api->set_submit_dmabuf_cb(base_output, pipewire_output_submit_frame);
 
 	ret = pipewire_output_connect(output);
 	if (ret < 0)
 		return ret;
 
+	/* a variant failing to connect leaves the others streaming */
+	wl_list_for_each(variant, &output->variant_list, link)
+		pipewire_variant_connect(variant);
+
 	ret = output->saved_enable(base_output);
 	if (ret < 0)
 		return ret;
@@ -453,11 +854,17 @@ static int
 pipewire_output_disable(struct weston_output *base_output)
 {
 	struct pipewire_output *output = lookup_pipewire_output(base_output);
+	struct pipewire_variant *variant;
 
 	wl_event_source_remove(output->finish_frame_timer);
 
+	wl_list_for_each(variant, &output->variant_list, link)
+		pw_stream_disconnect(variant->stream);
 	pw_stream_disconnect(output->stream);
 
+	/* the buffers go away with the renderer state */
+	pipewire_output_unmap_buffers(output);
+
 	return output->saved_disable(base_output);
 }
 
@@ -489,7 +896,7 @@ pipewire_output_stream_format_changed(void *data, const struct spa_pod *format)
 	uint8_t buffer[1024];
 	struct spa_pod_builder builder =
 		SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
-	const struct spa_pod *params[2];
+	const struct spa_pod *params[3];
 	struct pw_type *t = pipewire->t;
 	int32_t width, height, stride, size;
 	const int bpp = 4;
@@ -526,13 +933,134 @@ pipewire_output_stream_format_changed(void *data, const struct spa_pod *format)
 		":", t->param_meta.type, "I", t->meta.Header,
 		":", t->param_meta.size, "i", sizeof(struct spa_meta_header));
 
-	pw_stream_finish_format(output->stream, 0, params, 2);
+	params[2] = spa_pod_builder_object(&builder,
+		t->param.idMeta, t->param_meta.Meta,
+		":", t->param_meta.type, "I", t->meta.VideoDamage,
+		":", t->param_meta.size, "i",
+		sizeof(struct spa_meta_region) * PIPEWIRE_MAX_DAMAGE_RECTS);
+
+	pw_stream_finish_format(output->stream, 0, params, 3);
+}
+
+static void
+pipewire_output_stream_add_buffer(void *data, struct pw_buffer *buffer)
+{
+	struct pipewire_output *output = data;
+	struct pipewire_buffer *pb;
+
+	pb = zalloc(sizeof *pb);
+	if (!pb)
+		return;
+
+	/* nothing of the output is in the new buffer yet */
+	pixman_region32_init_rect(&pb->stale, 0, 0,
+				  output->video_format.size.width,
+				  output->video_format.size.height);
+	pb->buffer = buffer;
+	buffer->user_data = pb;
+	wl_list_insert(&output->buffer_list, &pb->link);
+}
+
+static void
+pipewire_output_stream_remove_buffer(void *data, struct pw_buffer *buffer)
+{
+	struct pipewire_buffer *pb = buffer->user_data;
+
+	if (!pb)
+		return;
+
+	buffer->user_data = NULL;
+	pixman_region32_fini(&pb->stale);
+	wl_list_remove(&pb->link);
+	free(pb);
 }
 
 static const struct pw_stream_events stream_events = {
 	PW_VERSION_STREAM_EVENTS,
 	.state_changed = pipewire_output_stream_state_changed,
 	.format_changed = pipewire_output_stream_format_changed,
+	.add_buffer = pipewire_output_stream_add_buffer,
+	.remove_buffer = pipewire_output_stream_remove_buffer,
+};
+
+static void
+pipewire_variant_stream_state_changed(void *data, enum pw_stream_state old,
+				      enum pw_stream_state state,
+				      const char *error_message)
+{
+	struct pipewire_variant *variant = data;
+
+	pipewire_output_debug(variant->output, "%dx%d: state changed %s -> %s",
+			      variant->width, variant->height,
+			      pw_stream_state_as_string(old),
+			      pw_stream_state_as_string(state));
+
+	if (state == PW_STREAM_STATE_STREAMING) {
+		variant->last_frame.tv_sec = 0;
+		variant->last_frame.tv_nsec = 0;
+		weston_output_schedule_repaint(variant->output->output);
+	}
+}
+
+static void
+pipewire_variant_stream_format_changed(void *data, const struct spa_pod *format)
+{
+	struct pipewire_variant *variant = data;
+	struct weston_pipewire *pipewire = variant->output->pipewire;
+	uint8_t buffer[1024];
+	struct spa_pod_builder builder =
+		SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+	const struct spa_pod *params[2];
+	struct pw_type *t = pipewire->t;
+	int32_t width, height, stride, size;
+	const int bpp = 4;
+
+	if (!format) {
+		pipewire_output_debug(variant->output, "%dx%d: format = None",
+				      variant->width, variant->height);
+		pw_stream_finish_format(variant->stream, 0, NULL, 0);
+		return;
+	}
+
+	spa_format_video_raw_parse(format, &variant->video_format,
+				   &pipewire->type.format_video);
+
+	if (variant->video_format.format == pipewire->type.video_format.RGBx)
+		variant->pixman_format = PIXMAN_x8b8g8r8;
+	else
+		variant->pixman_format = PIXMAN_x8r8g8b8;
+
+	width = variant->video_format.size.width;
+	height = variant->video_format.size.height;
+	stride = SPA_ROUND_UP_N(width * bpp, 4);
+	size = height * stride;
+
+	pipewire_output_debug(variant->output, "%dx%d: format = %dx%d",
+			      variant->width, variant->height, width, height);
+
+	params[0] = spa_pod_builder_object(&builder,
+		t->param.idBuffers, t->param_buffers.Buffers,
+		":", t->param_buffers.size,
+		"i", size,
+		":", t->param_buffers.stride,
+		"i", stride,
+		":", t->param_buffers.buffers,
+		"iru", 4, PROP_RANGE(2, 8),
+		":", t->param_buffers.align,
+		"i", 16);
+
+	params[1] = spa_pod_builder_object(&builder,
+		t->param.idMeta, t->param_meta.Meta,
+		":", t->param_meta.type, "I", t->meta.Header,
+		":", t->param_meta.size, "i", sizeof(struct spa_meta_header));
+
+	pw_stream_finish_format(variant->stream, 0, params, 2);
+}
+
+static const struct pw_stream_events variant_stream_events = {
+	PW_VERSION_STREAM_EVENTS,
+	.state_changed = pipewire_variant_stream_state_changed,
+	.format_changed = pipewire_variant_stream_format_changed,
 };
 
 static struct weston_output *
@@ -556,6 +1084,9 @@ pipewire_output_create(struct weston_compositor *c, char *name)
 	if (!output)
 		return NULL;
 
+	wl_list_init(&output->buffer_list);
+	wl_list_init(&output->variant_list);
+
 	head = zalloc(sizeof *head);
 	if (!head)
 		goto err;
@@ -661,6 +1192,66 @@ pipewire_output_set_seat(struct weston_output *output, const char *seat)
 {
 }
 
+static void
+pipewire_output_set_keep_alive(struct weston_output *base_output, int msec)
+{
+	struct pipewire_output *output = lookup_pipewire_output(base_output);
+	const struct weston_drm_virtual_output_api *api;
+
+	if (!output)
+		return;
+
+	api = output->pipewire->virtual_output_api;
+	api->set_keep_alive(base_output, msec);
+}
+
+static int
+pipewire_output_add_stream(struct weston_output *base_output,
+			   const char *modeline)
+{
+	struct pipewire_output *output = lookup_pipewire_output(base_output);
+	struct pipewire_variant *variant;
+	char name[256];
+	int n, width, height, framerate = 0;
+
+	if (!output || !modeline)
+		return -1;
+
+	n = sscanf(modeline, "%dx%d@%d", &width, &height, &framerate);
+	if ((n != 2 && n != 3) || width <= 0 || height <= 0)
+		return -1;
+
+	if (pw_stream_get_state(output->stream, NULL) !=
+	    PW_STREAM_STATE_UNCONNECTED)
+		return -1;
+
+	variant = zalloc(sizeof *variant);
+	if (!variant)
+		return -1;
+
+	snprintf(name, sizeof name, "%s-%dx%d", base_output->name,
+		 width, height);
+	variant->stream = pw_stream_new(output->pipewire->remote, name, NULL);
+	if (!variant->stream) {
+		weston_log("Cannot initialize pipewire stream\n");
+		free(variant);
+		return -1;
+	}
+
+	pw_stream_add_listener(variant->stream, &variant->stream_listener,
+			       &variant_stream_events, variant);
+
+	variant->output = output;
+	variant->width = width;
+	variant->height = height;
+	variant->framerate = framerate;
+	wl_list_insert(output->variant_list.prev, &variant->link);
+
+	pipewire_output_debug(output, "stream variant %s", modeline);
+
+	return 0;
+}
+
 static void
 weston_pipewire_destroy(struct wl_listener *l, void *data)
 {
@@ -799,6 +1390,8 @@ static const struct weston_pipewire_api pipewire_api = {
 	pipewire_output_is_pipewire,
 	pipewire_output_set_mode,
 	pipewire_output_set_seat,
+	pipewire_output_set_keep_alive,
+	pipewire_output_add_stream,
 };
 
 WL_EXPORT int
@@ -47,6 +47,21 @@ struct weston_pipewire_api {
 
 	/** Set seat */
 	void (*set_seat)(struct weston_output *output, const char *seat);
+
+	/** Set the interval in milliseconds after which a frame is sent even
+	 *  though nothing changed on the output. 0 only sends damaged frames.
+	 */
+	void (*set_keep_alive)(struct weston_output *output, int msec);
+
+	/** Add a stream of the output at a lower resolution, from a modeline
+	 *  "<width>x<height>[@<framerate>]". The frames rendered for the
+	 *  output are scaled down for it, and consumers may negotiate
+	 *  another size up to the one of the output, and a lower framerate.
+	 *
+	 * Must be called before the output is enabled.
+	 * Returns 0 on success, -1 on failure.
+	 */
+	int (*add_stream)(struct weston_output *output, const char *modeline);
 };
 
 static inline const struct weston_pipewire_api *
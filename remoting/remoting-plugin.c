@@ -32,6 +32,7 @@
 #include "config.h"
 
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -92,6 +93,59 @@ static const struct remoted_output_support_gbm_format supported_formats[] = {
 	}
 };
 
+/* built-in encoders, from the raw frames of appsrc to RTP packets */
+struct remoting_encoder {
+	const char *name;
+	/* takes the bitrate and the keyframe interval in frames */
+	const char *pipeline;
+	/* bitrate unit of the encoder, in kbit/s */
+	int bitrate_unit;
+};
+
+static const struct remoting_encoder encoders[] = {
+	{
+		.name = "jpeg",
+		.pipeline = "videoconvert ! video/x-raw,format=I420 ! "
+			    "jpegenc ! rtpjpegpay",
+	}, {
+		/* vaapipostproc imports the dmabufs of appsrc directly */
+		.name = "vaapi-h264",
+		.pipeline = "vaapipostproc ! "
+			    "vaapih264enc rate-control=cbr bitrate=%d "
+			    "keyframe-period=%d ! "
+			    "h264parse ! rtph264pay config-interval=-1 pt=96",
+		.bitrate_unit = 1,
+	}, {
+		.name = "vaapi-h265",
+		.pipeline = "vaapipostproc ! "
+			    "vaapih265enc rate-control=cbr bitrate=%d "
+			    "keyframe-period=%d ! "
+			    "h265parse ! rtph265pay config-interval=-1 pt=96",
+		.bitrate_unit = 1,
+	}, {
+		.name = "v4l2-h264",
+		.pipeline = "v4l2convert output-io-mode=dmabuf-import ! "
+			    "video/x-raw,format=NV12 ! "
+			    "v4l2h264enc extra-controls=\"controls,"
+			    "video_bitrate=%d,video_gop_size=%d\" ! "
+			    "video/x-h264,level=(string)4 ! "
+			    "h264parse ! rtph264pay config-interval=-1 pt=96",
+		.bitrate_unit = 1000,
+	}
+};
+
+#define REMOTING_DEFAULT_BITRATE 8000 /* kbit/s */
+
+/* RTP packets buffered per receiver before the oldest are dropped, so that
+ * a slow receiver does not hold up the others. */
+#define REMOTING_RECEIVER_QUEUE 256
+
+/* receivers in addition to host and port */
+struct remoting_receiver {
+	char *host;
+	int port;
+};
+
 struct remoted_output {
 	struct weston_output *output;
 	void (*saved_destroy)(struct weston_output *output);
@@ -101,8 +155,12 @@ struct remoted_output {
 
 	char *host;
 	int port;
+	struct wl_array receivers; /* struct remoting_receiver */
 	char *gst_pipeline;
 	const struct remoted_output_support_gbm_format *format;
+	const struct remoting_encoder *encoder;
+	int bitrate;
+	int gop;
 
 	struct weston_head *head;
 
@@ -183,6 +241,66 @@ remoting_gst_bus_sync_handler(GstBus *bus, GstMessage *message,
 	return GST_BUS_PASS;
 }
 
+/* One encode, sent to every receiver through a tee. Each branch has its own
+ * leaky queue, and the RTCP of all receivers goes through one session. */
+static char *
+remoting_gst_fanout_pipeline(struct remoted_output *output,
+			     const char *encoder_str)
+{
+	struct remoting_receiver *receiver, *other;
+	char *str = NULL;
+	size_t size;
+	FILE *fp;
+
+	fp = open_memstream(&str, &size);
+	if (!fp)
+		return NULL;
+
+	fprintf(fp, "rtpbin name=rtpbin "
+		"appsrc name=src ! %s ! "
+		"rtpbin.send_rtp_sink_0 "
+		"rtpbin.send_rtp_src_0 ! tee name=rtptee ", encoder_str);
+	fprintf(fp, "rtptee. ! queue leaky=downstream max-size-buffers=%d "
+		"max-size-bytes=0 max-size-time=0 ! "
+		"udpsink name=sink host=%s port=%d ",
+		REMOTING_RECEIVER_QUEUE, output->host, output->port);
+	wl_array_for_each(receiver, &output->receivers)
+		fprintf(fp, "rtptee. ! queue leaky=downstream "
+			"max-size-buffers=%d max-size-bytes=0 max-size-time=0 ! "
+			"udpsink host=%s port=%d ",
+			REMOTING_RECEIVER_QUEUE, receiver->host, receiver->port);
+
+	fprintf(fp, "rtpbin.send_rtcp_src_0 ! multiudpsink clients=%s:%d",
+		output->host, output->port + 1);
+	wl_array_for_each(receiver, &output->receivers)
+		fprintf(fp, ",%s:%d", receiver->host, receiver->port + 1);
+	fprintf(fp, " sync=false async=false ");
+
+	/* Receivers sharing a port send their RTCP to the same socket. */
+	fprintf(fp, "funnel name=rtcpin ! rtpbin.recv_rtcp_sink_0 "
+		"udpsrc port=%d ! rtcpin. ", output->port + 2);
+	wl_array_for_each(receiver, &output->receivers) {
+		bool seen = receiver->port == output->port;
+
+		wl_array_for_each(other, &output->receivers) {
+			if (other == receiver)
+				break;
+			if (other->port == receiver->port)
+				seen = true;
+		}
+		if (!seen)
+			fprintf(fp, "udpsrc port=%d ! rtcpin. ",
+				receiver->port + 2);
+	}
+
+	if (fclose(fp) != 0) {
+		free(str);
+		return NULL;
+	}
+
+	return str;
+}
+
 static int
 remoting_gst_pipeline_init(struct remoted_output *output)
 {
@@ -192,22 +310,43 @@ remoting_gst_pipeline_init(struct remoted_output *output)
 	struct weston_mode *mode = output->output->current_mode;
 
 	if (!output->gst_pipeline) {
+		char encoder_str[512];
 		char pipeline_str[1024];
-		/* TODO: use encodebin instead of jpegenc */
+		int gop = output->gop;
+
+		/* one keyframe per second by default */
+		if (gop <= 0)
+			gop = MAX(mode->refresh / 1000, 1);
+
+		snprintf(encoder_str, sizeof(encoder_str),
+			 output->encoder->pipeline,
+			 output->bitrate * output->encoder->bitrate_unit, gop);
+		if (output->receivers.size > 0) {
+			output->gst_pipeline =
+				remoting_gst_fanout_pipeline(output,
+							     encoder_str);
+			if (!output->gst_pipeline) {
+				weston_log("Could not build the gstreamer "
+					   "pipeline for %s\n",
+					   output->output->name);
+				return -1;
+			}
+			goto launch;
+		}
 		snprintf(pipeline_str, sizeof(pipeline_str),
 			 "rtpbin name=rtpbin "
-			 "appsrc name=src ! videoconvert ! "
-			 "video/x-raw,format=I420 ! jpegenc ! rtpjpegpay ! "
+			 "appsrc name=src ! %s ! "
 			 "rtpbin.send_rtp_sink_0 "
 			 "rtpbin.send_rtp_src_0 ! "
 			 "udpsink name=sink host=%s port=%d "
 			 "rtpbin.send_rtcp_src_0 ! "
 			 "udpsink host=%s port=%d sync=false async=false "
 			 "udpsrc port=%d ! rtpbin.recv_rtcp_sink_0",
-			 output->host, output->port, output->host,
+			 encoder_str, output->host, output->port, output->host,
 			 output->port + 1, output->port + 2);
 		output->gst_pipeline = strdup(pipeline_str);
 	}
+launch:
 	weston_log("GST pipeline: %s\n", output->gst_pipeline);
 
 	output->pipeline = gst_parse_launch(output->gst_pipeline, &err);
@@ -633,6 +772,7 @@ static void
 remoting_output_destroy(struct weston_output *output)
 {
 	struct remoted_output *remoted_output = lookup_remoted_output(output);
+	struct remoting_receiver *receiver;
 	struct weston_mode *mode, *next;
 
 	wl_list_for_each_safe(mode, next, &output->mode_list, link) {
@@ -647,6 +787,9 @@ remoting_output_destroy(struct weston_output *output)
 
 	if (remoted_output->host)
 		free(remoted_output->host);
+	wl_array_for_each(receiver, &remoted_output->receivers)
+		free(receiver->host);
+	wl_array_release(&remoted_output->receivers);
 	if (remoted_output->gst_pipeline)
 		free(remoted_output->gst_pipeline);
 
@@ -785,6 +928,9 @@ remoting_output_create(struct weston_compositor *c, char *name)
 
 	/* set XRGB8888 format */
 	output->format = &supported_formats[0];
+	output->encoder = &encoders[0];
+	output->bitrate = REMOTING_DEFAULT_BITRATE;
+	wl_array_init(&output->receivers);
 
 	return output->output;
 
@@ -892,6 +1038,30 @@ remoting_output_set_port(struct weston_output *output, int port)
 		remoted_output->port = port;
 }
 
+static int
+remoting_output_add_receiver(struct weston_output *output, const char *host,
+			     int port)
+{
+	struct remoted_output *remoted_output = lookup_remoted_output(output);
+	struct remoting_receiver *receiver;
+
+	if (!remoted_output || !host)
+		return -1;
+
+	receiver = wl_array_add(&remoted_output->receivers, sizeof *receiver);
+	if (!receiver)
+		return -1;
+
+	receiver->host = strdup(host);
+	receiver->port = port;
+	if (!receiver->host) {
+		remoted_output->receivers.size -= sizeof *receiver;
+		return -1;
+	}
+
+	return 0;
+}
+
 static void
 remoting_output_set_gst_pipeline(struct weston_output *output,
 				 char *gst_pipeline)
@@ -906,6 +1076,56 @@ remoting_output_set_gst_pipeline(struct weston_output *output,
 	remoted_output->gst_pipeline = strdup(gst_pipeline);
 }
 
+static int
+remoting_output_set_encoder(struct weston_output *output, const char *name)
+{
+	struct remoted_output *remoted_output = lookup_remoted_output(output);
+	unsigned int i;
+
+	if (!remoted_output)
+		return -1;
+
+	for (i = 0; i < ARRAY_LENGTH(encoders); i++) {
+		if (strcmp(name, encoders[i].name) == 0) {
+			remoted_output->encoder = &encoders[i];
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static void
+remoting_output_set_bitrate(struct weston_output *output, int bitrate)
+{
+	struct remoted_output *remoted_output = lookup_remoted_output(output);
+
+	if (remoted_output && bitrate > 0)
+		remoted_output->bitrate = bitrate;
+}
+
+static void
+remoting_output_set_gop(struct weston_output *output, int gop)
+{
+	struct remoted_output *remoted_output = lookup_remoted_output(output);
+
+	if (remoted_output)
+		remoted_output->gop = gop;
+}
+
+static void
+remoting_output_set_keep_alive(struct weston_output *output, int msec)
+{
+	struct remoted_output *remoted_output = lookup_remoted_output(output);
+	const struct weston_drm_virtual_output_api *api;
+
+	if (!remoted_output)
+		return;
+
+	api = remoted_output->remoting->virtual_output_api;
+	api->set_keep_alive(output, msec);
+}
+
 static const struct weston_remoting_api remoting_api = {
 	remoting_output_create,
 	remoting_output_is_remoted,
@@ -915,6 +1135,11 @@ static const struct weston_remoting_api remoting_api = {
 	remoting_output_set_host,
 	remoting_output_set_port,
 	remoting_output_set_gst_pipeline,
+	remoting_output_set_encoder,
+	remoting_output_set_bitrate,
+	remoting_output_set_gop,
+	remoting_output_set_keep_alive,
+	remoting_output_add_receiver,
 };
 
 WL_EXPORT int
@@ -63,6 +63,35 @@ struct weston_remoting_api {
 	/** Set the pipeline for gstreamer */
 	void (*set_gst_pipeline)(struct weston_output *output,
 				 char *gst_pipeline);
+
+	/** Set the encoder of the default pipeline: "jpeg", "vaapi-h264",
+	 *  "vaapi-h265" or "v4l2-h264"
+	 *
+	 * Returns 0 on success, -1 if the encoder is unknown.
+	 */
+	int (*set_encoder)(struct weston_output *output, const char *encoder);
+
+	/** Set the target bitrate of the video encoders, in kbit/s */
+	void (*set_bitrate)(struct weston_output *output, int bitrate);
+
+	/** Set the keyframe interval of the video encoders, in frames. 0
+	 *  sends a keyframe every second.
+	 */
+	void (*set_gop)(struct weston_output *output, int gop);
+
+	/** Set the interval in milliseconds after which a frame is sent even
+	 *  though nothing changed on the output. 0 only sends damaged frames.
+	 */
+	void (*set_keep_alive)(struct weston_output *output, int msec);
+
+	/** Send the stream to another host and port as well, in addition to
+	 *  the ones of set_host and set_port. The frames are encoded once
+	 *  for all the receivers.
+	 *
+	 * Returns 0 on success, -1 on failure.
+	 */
+	int (*add_receiver)(struct weston_output *output, const char *host,
+			    int port);
 };
 
 static inline const struct weston_remoting_api *
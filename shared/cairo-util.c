@@ -26,6 +26,7 @@
 
 #include "config.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -344,14 +345,21 @@ rounded_rect(cairo_t *cr, int x0, int y0, int x1, int y1, int radius)
 	cairo_close_path(cr);
 }
 
-cairo_surface_t *
-load_cairo_surface(const char *filename)
+static const cairo_user_data_key_t image_key;
+
+static void
+image_destroy(void *data)
 {
-	pixman_image_t *image;
+	pixman_image_unref(data);
+}
+
+static cairo_surface_t *
+cairo_surface_for_image(pixman_image_t *image)
+{
+	cairo_surface_t *surface;
 	int width, height, stride;
 	void *data;
 
-	image = load_image(filename);
 	if (image == NULL) {
 		return NULL;
 	}
@@ -361,8 +369,28 @@ load_cairo_surface(const char *filename)
 	height = pixman_image_get_height(image);
 	stride = pixman_image_get_stride(image);
 
-	return cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32,
-						   width, height, stride);
+	surface = cairo_image_surface_create_for_data(data, CAIRO_FORMAT_ARGB32,
+						      width, height, stride);
+
+	/* The pixels stay owned by the image */
+	if (cairo_surface_set_user_data(surface, &image_key, image,
+					image_destroy) != CAIRO_STATUS_SUCCESS)
+		pixman_image_unref(image);
+
+	return surface;
+}
+
+cairo_surface_t *
+load_cairo_surface(const char *filename)
+{
+	return cairo_surface_for_image(load_image(filename));
+}
+
+/** Wait for load_image_async() to finish and wrap the image for cairo */
+cairo_surface_t *
+load_cairo_surface_finish(struct image_load *load)
+{
+	return cairo_surface_for_image(image_load_finish(load));
 }
 
 void
@@ -387,7 +415,7 @@ theme_create(void)
 	struct theme *t;
 	cairo_t *cr;
 
-	t = malloc(sizeof *t);
+	t = calloc(1, sizeof *t);
 	if (t == NULL)
 		return NULL;
 
@@ -449,6 +477,13 @@ theme_create(void)
 void
 theme_destroy(struct theme *t)
 {
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(t->frame_cache); i++) {
+		if (t->frame_cache[i].surface)
+			cairo_surface_destroy(t->frame_cache[i].surface);
+	}
+
 	cairo_surface_destroy(t->active_frame);
 	cairo_surface_destroy(t->inactive_frame);
 	cairo_surface_destroy(t->shadow);
@@ -487,13 +522,203 @@ create_layout(cairo_t *cr, const char *title)
 	cairo_show_text(cr, title)
 #endif
 
+/* Placement of the shadow relative to the frame, see render_shadow() */
+#define THEME_SHADOW_OFFSET 2
+#define THEME_SHADOW_GROW 8
+#define THEME_SHADOW_MARGIN 64
+
+/* Shadow and border, without the title. */
+static void
+theme_render_border(struct theme *t, cairo_t *cr, int width, int height,
+		    int top_margin, uint32_t flags)
+{
+	cairo_surface_t *source;
+	int margin;
+
+	if (flags & THEME_FRAME_MAXIMIZED)
+		margin = 0;
+	else {
+		render_shadow(cr, t->shadow,
+			      THEME_SHADOW_OFFSET, THEME_SHADOW_OFFSET,
+			      width + THEME_SHADOW_GROW,
+			      height + THEME_SHADOW_GROW,
+			      THEME_SHADOW_MARGIN, THEME_SHADOW_MARGIN);
+		margin = t->margin;
+	}
+
+	if (flags & THEME_FRAME_ACTIVE)
+		source = t->active_frame;
+	else
+		source = t->inactive_frame;
+
+	tile_source(cr, source,
+		    margin, margin,
+		    width - margin * 2, height - margin * 2,
+		    t->width, top_margin);
+}
+
+/* The scale from user space to the pixels of the target, 0 if not uniform
+ * or rotated. */
+static double
+theme_get_target_scale(cairo_t *cr)
+{
+	cairo_matrix_t m;
+	double sx, sy;
+
+	cairo_get_matrix(cr, &m);
+	cairo_surface_get_device_scale(cairo_get_target(cr), &sx, &sy);
+
+	if (m.xy != 0.0 || m.yx != 0.0 || m.xx != m.yy || m.xx <= 0.0 ||
+	    sx != sy)
+		return 0.0;
+
+	return m.xx * sx;
+}
+
+static struct theme_frame_piece *
+theme_get_frame_piece(struct theme *t, int top_margin, uint32_t flags,
+		      double scale)
+{
+	struct theme_frame_piece *piece;
+	int margin, shadow_lead, shadow_trail, width, height;
+	unsigned int i;
+	cairo_t *cr;
+
+	flags &= THEME_FRAME_ACTIVE | THEME_FRAME_MAXIMIZED;
+
+	for (i = 0; i < ARRAY_LENGTH(t->frame_cache); i++) {
+		piece = &t->frame_cache[i];
+		if (piece->surface && piece->flags == flags &&
+		    piece->top_margin == top_margin && piece->scale == scale)
+			return piece;
+	}
+
+	piece = &t->frame_cache[t->frame_cache_next];
+	t->frame_cache_next = (t->frame_cache_next + 1) %
+			      ARRAY_LENGTH(t->frame_cache);
+	if (piece->surface) {
+		cairo_surface_destroy(piece->surface);
+		piece->surface = NULL;
+	}
+
+	/* The corners reach as far as the shadow corners and the border
+	 * corners do; both are uniform along the edges in between. */
+	if (flags & THEME_FRAME_MAXIMIZED) {
+		margin = 0;
+		shadow_lead = 0;
+		shadow_trail = 0;
+	} else {
+		margin = t->margin;
+		shadow_lead = THEME_SHADOW_OFFSET + THEME_SHADOW_MARGIN;
+		shadow_trail = THEME_SHADOW_MARGIN - THEME_SHADOW_OFFSET -
+			       THEME_SHADOW_GROW;
+	}
+	piece->left = MAX(shadow_lead, margin + t->width);
+	piece->right = MAX(shadow_trail, margin + t->width);
+	piece->top = MAX(shadow_lead, margin + top_margin);
+	piece->bottom = MAX(shadow_trail, margin + t->width);
+	width = piece->left + 1 + piece->right;
+	height = piece->top + 1 + piece->bottom;
+
+	piece->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+						    ceil(width * scale),
+						    ceil(height * scale));
+	if (cairo_surface_status(piece->surface) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(piece->surface);
+		piece->surface = NULL;
+		return NULL;
+	}
+	cairo_surface_set_device_scale(piece->surface, scale, scale);
+
+	cr = cairo_create(piece->surface);
+	theme_render_border(t, cr, width, height, top_margin, flags);
+	cairo_destroy(cr);
+
+	piece->flags = flags;
+	piece->top_margin = top_margin;
+	piece->scale = scale;
+
+	return piece;
+}
+
+/* One patch: the piece area at px, py stretched from a pw x ph area to
+ * w x h at x, y. */
+static void
+theme_draw_patch(cairo_t *cr, struct theme_frame_piece *piece,
+		 int x, int y, int w, int h, int px, int py, int pw, int ph)
+{
+	cairo_pattern_t *pattern;
+	cairo_matrix_t matrix;
+
+	if (w <= 0 || h <= 0)
+		return;
+
+	pattern = cairo_pattern_create_for_surface(piece->surface);
+	cairo_pattern_set_filter(pattern, CAIRO_FILTER_NEAREST);
+	cairo_matrix_init_translate(&matrix, px, py);
+	cairo_matrix_scale(&matrix, (double)pw / w, (double)ph / h);
+	cairo_matrix_translate(&matrix, -x, -y);
+	cairo_pattern_set_matrix(pattern, &matrix);
+	cairo_set_source(cr, pattern);
+	cairo_pattern_destroy(pattern);
+
+	cairo_rectangle(cr, x, y, w, h);
+	cairo_fill(cr);
+}
+
+/* Draws the border from the cache, false if it must be rendered. */
+static bool
+theme_draw_cached_border(struct theme *t, cairo_t *cr, int width, int height,
+			 int top_margin, uint32_t flags)
+{
+	struct theme_frame_piece *piece;
+	int l, r, tp, b, mw, mh;
+	double scale;
+
+	scale = theme_get_target_scale(cr);
+	if (scale == 0.0)
+		return false;
+
+	piece = theme_get_frame_piece(t, top_margin, flags, scale);
+	if (!piece)
+		return false;
+
+	l = piece->left;
+	r = piece->right;
+	tp = piece->top;
+	b = piece->bottom;
+	mw = width - l - r;
+	mh = height - tp - b;
+	if (mw < 1 || mh < 1)
+		return false;
+
+	cairo_save(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+
+	/* corners */
+	theme_draw_patch(cr, piece, 0, 0, l, tp, 0, 0, l, tp);
+	theme_draw_patch(cr, piece, l + mw, 0, r, tp, l + 1, 0, r, tp);
+	theme_draw_patch(cr, piece, 0, tp + mh, l, b, 0, tp + 1, l, b);
+	theme_draw_patch(cr, piece, l + mw, tp + mh, r, b,
+			 l + 1, tp + 1, r, b);
+
+	/* edges */
+	theme_draw_patch(cr, piece, l, 0, mw, tp, l, 0, 1, tp);
+	theme_draw_patch(cr, piece, l, tp + mh, mw, b, l, tp + 1, 1, b);
+	theme_draw_patch(cr, piece, 0, tp, l, mh, 0, tp, l, 1);
+	theme_draw_patch(cr, piece, l + mw, tp, r, mh, l + 1, tp, r, 1);
+
+	cairo_restore(cr);
+
+	return true;
+}
+
 void
 theme_render_frame(struct theme *t,
 		   cairo_t *cr, int width, int height,
 		   const char *title, cairo_rectangle_int_t *title_rect,
 		   struct wl_list *buttons, uint32_t flags)
 {
-	cairo_surface_t *source;
 	int x, y, margin, top_margin;
 	int text_width, text_height;
 
@@ -503,27 +728,18 @@ theme_render_frame(struct theme *t,
 
 	if (flags & THEME_FRAME_MAXIMIZED)
 		margin = 0;
-	else {
-		render_shadow(cr, t->shadow,
-			      2, 2, width + 8, height + 8,
-			      64, 64);
-		margin = t->margin;
-	}
-
-	if (flags & THEME_FRAME_ACTIVE)
-		source = t->active_frame;
 	else
-		source = t->inactive_frame;
+		margin = t->margin;
 
 	if (title || !wl_list_empty(buttons))
 		top_margin = t->titlebar_height;
 	else
 		top_margin = t->width;
 
-	tile_source(cr, source,
-		    margin, margin,
-		    width - margin * 2, height - margin * 2,
-		    t->width, top_margin);
+	/* Resizes and focus changes redraw the same border at other sizes,
+	 * copying it spares rendering the shadow every time. */
+	if (!theme_draw_cached_border(t, cr, width, height, top_margin, flags))
+		theme_render_border(t, cr, width, height, top_margin, flags);
 
 	if (title || !wl_list_empty(buttons)) {
 
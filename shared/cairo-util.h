@@ -49,6 +49,26 @@ rounded_rect(cairo_t *cr, int x0, int y0, int x1, int y1, int radius);
 cairo_surface_t *
 load_cairo_surface(const char *filename);
 
+struct image_load;
+
+cairo_surface_t *
+load_cairo_surface_finish(struct image_load *load);
+
+/** A decoration border rendered once, drawn to any size as a nine-patch
+ *
+ * The corners are copied as they are, the edges between them are the
+ * middle row or column of the piece stretched.
+ */
+struct theme_frame_piece {
+	cairo_surface_t *surface; /* NULL if the slot is unused */
+	uint32_t flags;
+	int top_margin;
+	double scale;
+	int left, right, top, bottom; /* sizes of the corners */
+};
+
+#define THEME_FRAME_CACHE_SIZE 8
+
 struct theme {
 	cairo_surface_t *active_frame;
 	cairo_surface_t *inactive_frame;
@@ -57,6 +77,9 @@ struct theme {
 	int margin;
 	int width;
 	int titlebar_height;
+
+	struct theme_frame_piece frame_cache[THEME_FRAME_CACHE_SIZE];
+	unsigned int frame_cache_next;
 };
 
 struct theme *
@@ -171,6 +194,14 @@ void
 frame_opaque_rect(struct frame *frame, int32_t *x, int32_t *y,
 		  int32_t *width, int32_t *height);
 
+/* The area holding the title and the buttons */
+void
+frame_titlebar_rect(struct frame *frame, int32_t *x, int32_t *y,
+		    int32_t *width, int32_t *height);
+
+uint32_t
+frame_get_flags(struct frame *frame);
+
 int
 frame_get_shadow_margin(struct frame *frame);
 
@@ -34,32 +34,72 @@
 #include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 
 #include <wayland-util.h>
 #include <libweston/config-parser.h>
+#include <libweston/zalloc.h>
+#include "hash.h"
 #include "helpers.h"
+#include "os-compatibility.h"
 #include "string-helpers.h"
 
 struct weston_config_entry {
 	char *key;
 	char *value;
 	struct wl_list link;
+	struct weston_config_section *section;
+	struct weston_config_entry *next_hash;	/* same entry_table slot */
 };
 
 struct weston_config_section {
 	char *name;
 	struct wl_list entry_list;
 	struct wl_list link;
+	struct weston_config *config;
+	uint32_t id;
+	struct weston_config_section *next_hash; /* same section_table slot */
 };
 
 struct weston_config {
 	struct wl_list section_list;
 	char path[PATH_MAX];
+
+	/* Chains of sections by name, and of entries by section and key,
+	 * both in file order */
+	struct hash_table *section_table;
+	struct hash_table *entry_table;
+	uint32_t section_count;
 };
 
+/* The beginning of a config passed through WESTON_CONFIG_FD, followed by the
+ * path, then 'S' and the name of each section and 'E', key and value of each
+ * entry, all NUL terminated. */
+#define CONFIG_BLOB_MAGIC "weston-config-v1"
+
+static uint32_t
+config_hash(const char *s, uint32_t seed)
+{
+	uint32_t hash = 2166136261u ^ seed;
+
+	/* FNV-1a */
+	for (; *s; s++) {
+		hash ^= (unsigned char) *s;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static uint32_t
+entry_hash(struct weston_config_section *section, const char *key)
+{
+	return config_hash(key, section->id * 0x9e3779b1u);
+}
+
 static int
 open_config_file(struct weston_config *c, const char *name)
 {
@@ -121,8 +161,11 @@ config_section_get_entry(struct weston_config_section *section,
 
 	if (section == NULL)
 		return NULL;
-	wl_list_for_each(e, &section->entry_list, link)
-		if (strcmp(e->key, key) == 0)
+
+	e = hash_table_lookup(section->config->entry_table,
+			      entry_hash(section, key));
+	for (; e; e = e->next_hash)
+		if (e->section == section && strcmp(e->key, key) == 0)
 			return e;
 
 	return NULL;
@@ -138,7 +181,9 @@ weston_config_get_section(struct weston_config *config, const char *section,
 
 	if (config == NULL)
 		return NULL;
-	wl_list_for_each(s, &config->section_list, link) {
+
+	s = hash_table_lookup(config->section_table, config_hash(section, 0));
+	for (; s; s = s->next_hash) {
 		if (strcmp(s->name, section) != 0)
 			continue;
 		if (key == NULL)
@@ -342,7 +387,8 @@ weston_config_get_name_from_env(void)
 static struct weston_config_section *
 config_add_section(struct weston_config *config, const char *name)
 {
-	struct weston_config_section *section;
+	struct weston_config_section *section, *s;
+	uint32_t hash;
 
 	section = malloc(sizeof *section);
 	if (section == NULL)
@@ -354,6 +400,24 @@ config_add_section(struct weston_config *config, const char *name)
 		return NULL;
 	}
 
+	section->config = config;
+	section->id = config->section_count;
+	section->next_hash = NULL;
+
+	hash = config_hash(name, 0);
+	s = hash_table_lookup(config->section_table, hash);
+	if (s) {
+		while (s->next_hash)
+			s = s->next_hash;
+		s->next_hash = section;
+	} else if (hash_table_insert(config->section_table,
+				     hash, section) < 0) {
+		free(section->name);
+		free(section);
+		return NULL;
+	}
+
+	config->section_count++;
 	wl_list_init(&section->entry_list);
 	wl_list_insert(config->section_list.prev, &section->link);
 
@@ -364,7 +428,9 @@ static struct weston_config_entry *
 section_add_entry(struct weston_config_section *section,
 		  const char *key, const char *value)
 {
-	struct weston_config_entry *entry;
+	struct hash_table *table = section->config->entry_table;
+	struct weston_config_entry *entry, *e;
+	uint32_t hash;
 
 	entry = malloc(sizeof *entry);
 	if (entry == NULL)
@@ -383,11 +449,153 @@ section_add_entry(struct weston_config_section *section,
 		return NULL;
 	}
 
+	entry->section = section;
+	entry->next_hash = NULL;
+
+	hash = entry_hash(section, key);
+	e = hash_table_lookup(table, hash);
+	if (e) {
+		while (e->next_hash)
+			e = e->next_hash;
+		e->next_hash = entry;
+	} else if (hash_table_insert(table, hash, entry) < 0) {
+		free(entry->value);
+		free(entry->key);
+		free(entry);
+		return NULL;
+	}
+
 	wl_list_insert(section->entry_list.prev, &entry->link);
 
 	return entry;
 }
 
+static struct weston_config *
+config_create(void)
+{
+	struct weston_config *config;
+
+	config = zalloc(sizeof *config);
+	if (config == NULL)
+		return NULL;
+
+	wl_list_init(&config->section_list);
+	config->section_table = hash_table_create();
+	config->entry_table = hash_table_create();
+	if (!config->section_table || !config->entry_table) {
+		weston_config_destroy(config);
+		return NULL;
+	}
+
+	return config;
+}
+
+static const char *
+blob_next_string(const char **p, const char *end)
+{
+	const char *s = *p;
+	const char *nul;
+
+	nul = memchr(s, '\0', end - s);
+	if (!nul)
+		return NULL;
+
+	*p = nul + 1;
+
+	return s;
+}
+
+static struct weston_config *
+config_from_blob(const char *blob, size_t size)
+{
+	const char *p = blob, *end = blob + size;
+	const char *magic, *path, *name, *key, *value;
+	struct weston_config_section *section = NULL;
+	struct weston_config *config;
+
+	magic = blob_next_string(&p, end);
+	if (!magic || strcmp(magic, CONFIG_BLOB_MAGIC) != 0)
+		return NULL;
+
+	config = config_create();
+	if (config == NULL)
+		return NULL;
+
+	path = blob_next_string(&p, end);
+	if (!path)
+		goto err;
+	snprintf(config->path, sizeof config->path, "%s", path);
+
+	while (p < end) {
+		switch (*p++) {
+		case 'S':
+			name = blob_next_string(&p, end);
+			if (!name)
+				goto err;
+			section = config_add_section(config, name);
+			break;
+		case 'E':
+			key = blob_next_string(&p, end);
+			value = key ? blob_next_string(&p, end) : NULL;
+			if (!value || !section)
+				goto err;
+			section_add_entry(section, key, value);
+			break;
+		default:
+			goto err;
+		}
+	}
+
+	return config;
+
+err:
+	weston_config_destroy(config);
+	return NULL;
+}
+
+/* The config the compositor passed to this process, if it was parsed from
+ * the file being asked for. The fd is used up either way, so that processes
+ * started from here do not inherit it. */
+static struct weston_config *
+config_from_inherited_fd(const char *name)
+{
+	struct weston_config *config = NULL;
+	const char *env;
+	struct stat st;
+	void *blob;
+	int fd;
+
+	env = getenv(WESTON_CONFIG_FD_ENV_VAR);
+	if (!env)
+		return NULL;
+
+	if (!safe_strtoint(env, &fd) || fd < 0) {
+		unsetenv(WESTON_CONFIG_FD_ENV_VAR);
+		return NULL;
+	}
+	unsetenv(WESTON_CONFIG_FD_ENV_VAR);
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	blob = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (blob == MAP_FAILED)
+		return NULL;
+
+	config = config_from_blob(blob, st.st_size);
+	munmap(blob, st.st_size);
+
+	if (config && strcmp(config->path, name) != 0) {
+		weston_config_destroy(config);
+		config = NULL;
+	}
+
+	return config;
+}
+
 WL_EXPORT
 struct weston_config *
 weston_config_parse(const char *name)
@@ -399,28 +607,31 @@ weston_config_parse(const char *name)
 	struct weston_config_section *section = NULL;
 	int i, fd;
 
-	config = malloc(sizeof *config);
+	config = config_from_inherited_fd(name);
+	if (config)
+		return config;
+
+	config = config_create();
 	if (config == NULL)
 		return NULL;
 
-	wl_list_init(&config->section_list);
-
 	fd = open_config_file(config, name);
 	if (fd == -1) {
-		free(config);
+		weston_config_destroy(config);
 		return NULL;
 	}
 
 	if (fstat(fd, &filestat) < 0 ||
 	    !S_ISREG(filestat.st_mode)) {
 		close(fd);
-		free(config);
+		weston_config_destroy(config);
 		return NULL;
 	}
 
 	fp = fdopen(fd, "r");
 	if (fp == NULL) {
-		free(config);
+		close(fd);
+		weston_config_destroy(config);
 		return NULL;
 	}
 
@@ -521,5 +732,67 @@ weston_config_destroy(struct weston_config *config)
 		free(s);
 	}
 
+	if (config->section_table)
+		hash_table_destroy(config->section_table);
+	if (config->entry_table)
+		hash_table_destroy(config->entry_table);
 	free(config);
 }
+
+/** Write a parsed config to an anonymous file
+ *
+ * \param config The config to write.
+ * \return A file descriptor, or -1 on failure.
+ *
+ * The compositor passes the file to the clients it starts in the
+ * WESTON_CONFIG_FD environment variable. weston_config_parse() of the same
+ * path then reads it from there instead of parsing the file again.
+ */
+WL_EXPORT int
+weston_config_serialize(struct weston_config *config)
+{
+	struct weston_config_section *s;
+	struct weston_config_entry *e;
+	size_t size;
+	char *blob, *p;
+	int fd;
+
+	size = sizeof CONFIG_BLOB_MAGIC + strlen(config->path) + 1;
+	wl_list_for_each(s, &config->section_list, link) {
+		size += 1 + strlen(s->name) + 1;
+		wl_list_for_each(e, &s->entry_list, link)
+			size += 1 + strlen(e->key) + 1 + strlen(e->value) + 1;
+	}
+
+	fd = os_create_anonymous_file(size);
+	if (fd < 0)
+		return -1;
+
+	blob = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (blob == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	p = stpcpy(blob, CONFIG_BLOB_MAGIC) + 1;
+	p = stpcpy(p, config->path) + 1;
+	wl_list_for_each(s, &config->section_list, link) {
+		*p++ = 'S';
+		p = stpcpy(p, s->name) + 1;
+		wl_list_for_each(e, &s->entry_list, link) {
+			*p++ = 'E';
+			p = stpcpy(p, e->key) + 1;
+			p = stpcpy(p, e->value) + 1;
+		}
+	}
+	assert(p == blob + size);
+
+	munmap(blob, size);
+
+#ifdef HAVE_MEMFD_CREATE
+	/* Clients get the same file, do not let one change it for others. */
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE);
+#endif
+
+	return fd;
+}
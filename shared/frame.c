@@ -433,6 +433,10 @@ frame_set_title(struct frame *frame, const char *title)
 {
 	char *dup = NULL;
 
+	if (title == frame->title ||
+	    (title && frame->title && strcmp(title, frame->title) == 0))
+		return 0;
+
 	if (title) {
 		dup = strdup(title);
 		if (!dup)
@@ -655,6 +659,28 @@ frame_opaque_rect(struct frame *frame, int32_t *x, int32_t *y,
 		*height = frame->height - frame->opaque_margin * 2;
 }
 
+void
+frame_titlebar_rect(struct frame *frame, int32_t *x, int32_t *y,
+		    int32_t *width, int32_t *height)
+{
+	frame_refresh_geometry(frame);
+
+	if (x)
+		*x = frame->shadow_margin;
+	if (y)
+		*y = frame->shadow_margin;
+	if (width)
+		*width = frame->width - frame->shadow_margin * 2;
+	if (height)
+		*height = frame->interior.y - frame->shadow_margin;
+}
+
+uint32_t
+frame_get_flags(struct frame *frame)
+{
+	return frame->flags;
+}
+
 int
 frame_get_shadow_margin(struct frame *frame)
 {
@@ -27,14 +27,18 @@
 #include "config.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <png.h>
 #include <pixman.h>
 
 #include "shared/helpers.h"
+#include "shared/pixel-convert.h"
 #include "image-loader.h"
 
 #ifdef HAVE_JPEG
@@ -59,6 +63,7 @@ pixman_image_destroy_func(pixman_image_t *image, void *data)
 
 #ifdef HAVE_JPEG
 
+#ifndef JCS_EXTENSIONS
 static void
 swizzle_row(JSAMPLE *row, JDIMENSION width)
 {
@@ -73,6 +78,7 @@ swizzle_row(JSAMPLE *row, JDIMENSION width)
 		d--;
 	}
 }
+#endif
 
 static void
 error_exit(j_common_ptr cinfo)
@@ -103,7 +109,16 @@ load_jpeg(FILE *fp)
 
 	jpeg_read_header(&cinfo, TRUE);
 
+#ifdef JCS_EXTENSIONS
+	/* libjpeg-turbo writes a8r8g8b8 directly */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	cinfo.out_color_space = JCS_EXT_BGRA;
+#else
+	cinfo.out_color_space = JCS_EXT_ARGB;
+#endif
+#else
 	cinfo.out_color_space = JCS_RGB;
+#endif
 	jpeg_start_decompress(&cinfo);
 
 	stride = cinfo.output_width * 4;
@@ -119,8 +134,10 @@ load_jpeg(FILE *fp)
 			rows[i] = data + (first + i) * stride;
 
 		jpeg_read_scanlines(&cinfo, rows, ARRAY_LENGTH(rows));
+#ifndef JCS_EXTENSIONS
 		for (i = 0; first + i < cinfo.output_scanline; i++)
 			swizzle_row(rows[i], cinfo.output_width);
+#endif
 	}
 
 	jpeg_finish_decompress(&cinfo);
@@ -149,43 +166,13 @@ load_jpeg(FILE *fp)
 
 #endif
 
-static inline int
-multiply_alpha(int alpha, int color)
-{
-    int temp = (alpha * color) + 0x80;
-
-    return ((temp + (temp >> 8)) >> 8);
-}
-
 static void
 premultiply_data(png_structp   png,
 		 png_row_infop row_info,
 		 png_bytep     data)
 {
-    unsigned int i;
-    png_bytep p;
-
-    for (i = 0, p = data; i < row_info->rowbytes; i += 4, p += 4) {
-	uint32_t alpha = p[3];
-	uint32_t w;
-
-	if (alpha == 0) {
-		w = 0;
-	} else {
-		uint32_t red   = p[0];
-		uint32_t green = p[1];
-		uint32_t blue  = p[2];
-
-		if (alpha != 0xff) {
-			red   = multiply_alpha(alpha, red);
-			green = multiply_alpha(alpha, green);
-			blue  = multiply_alpha(alpha, blue);
-		}
-		w = (alpha << 24) | (red << 16) | (green << 8) | (blue << 0);
-	}
-
-	* (uint32_t *) p = w;
-    }
+	pixel_premultiply_rgba((uint32_t *) data, data,
+			       row_info->rowbytes / 4);
 }
 
 static void
@@ -329,7 +316,12 @@ load_webp(FILE *fp)
 		return NULL;
 	}
 
-	config.output.colorspace = MODE_BGRA;
+	/* premultiplied, as pixman and cairo expect */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	config.output.colorspace = MODE_bgrA;
+#else
+	config.output.colorspace = MODE_Argb;
+#endif
 	config.output.u.RGBA.stride = stride_for_width(config.input.width);
 	config.output.u.RGBA.size =
 		config.output.u.RGBA.stride * config.input.height;
@@ -438,3 +430,85 @@ load_image(const char *filename)
 
 	return image;
 }
+
+struct image_load {
+	char *filename;
+	pixman_image_t *image;
+	pthread_t thread;
+	int thread_started;
+	int fd[2];
+};
+
+static void *
+image_load_thread(void *data)
+{
+	struct image_load *load = data;
+	char c = 0;
+
+	load->image = load_image(load->filename);
+	if (write(load->fd[1], &c, 1) < 0)
+		fprintf(stderr, "%s: %s\n", load->filename, strerror(errno));
+
+	return NULL;
+}
+
+/** Start decoding an image on a separate thread
+ *
+ * \param filename The file to load.
+ * \return The load in progress, or NULL on failure.
+ *
+ * The file descriptor from image_load_get_fd() becomes readable once
+ * decoding has finished. image_load_finish() returns the image. Several
+ * loads may run at the same time.
+ */
+struct image_load *
+load_image_async(const char *filename)
+{
+	struct image_load *load;
+
+	load = calloc(1, sizeof *load);
+	if (!load)
+		return NULL;
+
+	load->filename = strdup(filename ? filename : "");
+	if (!load->filename || pipe2(load->fd, O_CLOEXEC) < 0) {
+		free(load->filename);
+		free(load);
+		return NULL;
+	}
+
+	if (pthread_create(&load->thread, NULL, image_load_thread, load) == 0)
+		load->thread_started = 1;
+	else
+		image_load_thread(load);
+
+	return load;
+}
+
+/** The file descriptor that becomes readable when the load is done */
+int
+image_load_get_fd(struct image_load *load)
+{
+	return load->fd[0];
+}
+
+/** Wait for a load to finish and free it
+ *
+ * \return The decoded image, or NULL if it could not be loaded.
+ */
+pixman_image_t *
+image_load_finish(struct image_load *load)
+{
+	pixman_image_t *image;
+
+	if (load->thread_started)
+		pthread_join(load->thread, NULL);
+
+	image = load->image;
+	close(load->fd[0]);
+	close(load->fd[1]);
+	free(load->filename);
+	free(load);
+
+	return image;
+}
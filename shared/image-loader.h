@@ -31,4 +31,15 @@
 pixman_image_t *
 load_image(const char *filename);
 
+struct image_load;
+
+struct image_load *
+load_image_async(const char *filename);
+
+int
+image_load_get_fd(struct image_load *load);
+
+pixman_image_t *
+image_load_finish(struct image_load *load);
+
 #endif
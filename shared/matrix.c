@@ -39,6 +39,13 @@
 
 #include <libweston/matrix.h>
 
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#define MATRIX_USE_SSE 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MATRIX_USE_NEON 1
+#endif
 
 /*
  * Matrices are stored in column-major order, that is the array indices are:
@@ -59,23 +66,102 @@ weston_matrix_init(struct weston_matrix *matrix)
 	memcpy(matrix, &identity, sizeof identity);
 }
 
-/* m <- n * m, that is, m is multiplied on the LEFT. */
-WL_EXPORT void
-weston_matrix_multiply(struct weston_matrix *m, const struct weston_matrix *n)
+/*
+ * The type flags of a matrix tell which elementary transformations it was
+ * built from. A matrix made only of translations and scalings keeps the
+ * identity everywhere except on the diagonal and in the last column, which
+ * allows closed forms for its products and inverse. Everything else takes
+ * the general 4x4 path, vectorized where the target supports it.
+ */
+#define AXIS_ALIGNED_TYPES \
+	(WESTON_MATRIX_TRANSFORM_TRANSLATE | WESTON_MATRIX_TRANSFORM_SCALE)
+
+static inline int
+matrix_is_axis_aligned(const struct weston_matrix *m)
 {
-	struct weston_matrix tmp;
+	return (m->type & ~AXIS_ALIGNED_TYPES) == 0;
+}
+
+/* r <- n * m, r may not alias either operand */
+static inline void
+matrix_multiply_general(float *r, const float *m, const float *n)
+{
+#if defined(MATRIX_USE_SSE)
+	__m128 c0 = _mm_loadu_ps(n + 0);
+	__m128 c1 = _mm_loadu_ps(n + 4);
+	__m128 c2 = _mm_loadu_ps(n + 8);
+	__m128 c3 = _mm_loadu_ps(n + 12);
+	int i;
+
+	for (i = 0; i < 16; i += 4) {
+		__m128 col;
+
+		col = _mm_mul_ps(c0, _mm_set1_ps(m[i + 0]));
+		col = _mm_add_ps(col, _mm_mul_ps(c1, _mm_set1_ps(m[i + 1])));
+		col = _mm_add_ps(col, _mm_mul_ps(c2, _mm_set1_ps(m[i + 2])));
+		col = _mm_add_ps(col, _mm_mul_ps(c3, _mm_set1_ps(m[i + 3])));
+		_mm_storeu_ps(r + i, col);
+	}
+#elif defined(MATRIX_USE_NEON)
+	float32x4_t c0 = vld1q_f32(n + 0);
+	float32x4_t c1 = vld1q_f32(n + 4);
+	float32x4_t c2 = vld1q_f32(n + 8);
+	float32x4_t c3 = vld1q_f32(n + 12);
+	int i;
+
+	for (i = 0; i < 16; i += 4) {
+		float32x4_t col;
+
+		col = vmulq_n_f32(c0, m[i + 0]);
+		col = vaddq_f32(col, vmulq_n_f32(c1, m[i + 1]));
+		col = vaddq_f32(col, vmulq_n_f32(c2, m[i + 2]));
+		col = vaddq_f32(col, vmulq_n_f32(c3, m[i + 3]));
+		vst1q_f32(r + i, col);
+	}
+#else
 	const float *row, *column;
 	div_t d;
 	int i, j;
 
 	for (i = 0; i < 16; i++) {
-		tmp.d[i] = 0;
+		r[i] = 0;
 		d = div(i, 4);
-		row = m->d + d.quot * 4;
-		column = n->d + d.rem;
+		row = m + d.quot * 4;
+		column = n + d.rem;
 		for (j = 0; j < 4; j++)
-			tmp.d[i] += row[j] * column[j * 4];
+			r[i] += row[j] * column[j * 4];
 	}
+#endif
+}
+
+/* m <- n * m, that is, m is multiplied on the LEFT. */
+WL_EXPORT void
+weston_matrix_multiply(struct weston_matrix *m, const struct weston_matrix *n)
+{
+	struct weston_matrix tmp;
+
+	if (n->type == 0)
+		return;
+
+	if (m->type == 0) {
+		memcpy(m, n, sizeof *m);
+		return;
+	}
+
+	if (matrix_is_axis_aligned(m) && matrix_is_axis_aligned(n)) {
+		/* Diagonals multiply, m's translation is scaled by n's
+		 * diagonal and then offset by n's translation. */
+		m->d[12] = n->d[0] * m->d[12] + n->d[12];
+		m->d[13] = n->d[5] * m->d[13] + n->d[13];
+		m->d[14] = n->d[10] * m->d[14] + n->d[14];
+		m->d[0] *= n->d[0];
+		m->d[5] *= n->d[5];
+		m->d[10] *= n->d[10];
+		m->type |= n->type;
+		return;
+	}
+
+	matrix_multiply_general(tmp.d, m->d, n->d);
 	tmp.type = m->type | n->type;
 	memcpy(m, &tmp, sizeof tmp);
 }
@@ -117,16 +203,47 @@ weston_matrix_rotate_xy(struct weston_matrix *matrix, float cos, float sin)
 WL_EXPORT void
 weston_matrix_transform(struct weston_matrix *matrix, struct weston_vector *v)
 {
-	int i, j;
+	const float *d = matrix->d;
+#if defined(MATRIX_USE_SSE)
+	__m128 t;
+#elif defined(MATRIX_USE_NEON)
+	float32x4_t t;
+#else
 	struct weston_vector t;
+	int i, j;
+#endif
+
+	if (matrix->type == 0)
+		return;
+
+	if (matrix_is_axis_aligned(matrix)) {
+		v->f[0] = v->f[0] * d[0] + v->f[3] * d[12];
+		v->f[1] = v->f[1] * d[5] + v->f[3] * d[13];
+		v->f[2] = v->f[2] * d[10] + v->f[3] * d[14];
+		return;
+	}
 
+#if defined(MATRIX_USE_SSE)
+	t = _mm_mul_ps(_mm_loadu_ps(d + 0), _mm_set1_ps(v->f[0]));
+	t = _mm_add_ps(t, _mm_mul_ps(_mm_loadu_ps(d + 4), _mm_set1_ps(v->f[1])));
+	t = _mm_add_ps(t, _mm_mul_ps(_mm_loadu_ps(d + 8), _mm_set1_ps(v->f[2])));
+	t = _mm_add_ps(t, _mm_mul_ps(_mm_loadu_ps(d + 12), _mm_set1_ps(v->f[3])));
+	_mm_storeu_ps(v->f, t);
+#elif defined(MATRIX_USE_NEON)
+	t = vmulq_n_f32(vld1q_f32(d + 0), v->f[0]);
+	t = vaddq_f32(t, vmulq_n_f32(vld1q_f32(d + 4), v->f[1]));
+	t = vaddq_f32(t, vmulq_n_f32(vld1q_f32(d + 8), v->f[2]));
+	t = vaddq_f32(t, vmulq_n_f32(vld1q_f32(d + 12), v->f[3]));
+	vst1q_f32(v->f, t);
+#else
 	for (i = 0; i < 4; i++) {
 		t.f[i] = 0;
 		for (j = 0; j < 4; j++)
-			t.f[i] += v->f[j] * matrix->d[i + j * 4];
+			t.f[i] += v->f[j] * d[i + j * 4];
 	}
 
 	*v = t;
+#endif
 }
 
 static inline void
@@ -256,6 +373,35 @@ inverse_transform(const double *LU, const unsigned *p, float *v)
 		v[j] = b[j];
 }
 
+/* Inverse of a matrix made of translations and scalings only */
+static int
+matrix_invert_axis_aligned(struct weston_matrix *inverse,
+			   const struct weston_matrix *matrix)
+{
+	double sx = matrix->d[0];
+	double sy = matrix->d[5];
+	double sz = matrix->d[10];
+	double tx = matrix->d[12];
+	double ty = matrix->d[13];
+	double tz = matrix->d[14];
+	unsigned int type = matrix->type;
+
+	/* same tolerance as the pivots of the LU decomposition */
+	if (fabs(sx) < 1e-9 || fabs(sy) < 1e-9 || fabs(sz) < 1e-9)
+		return -1;
+
+	weston_matrix_init(inverse);
+	inverse->d[0] = 1.0 / sx;
+	inverse->d[5] = 1.0 / sy;
+	inverse->d[10] = 1.0 / sz;
+	inverse->d[12] = -tx / sx;
+	inverse->d[13] = -ty / sy;
+	inverse->d[14] = -tz / sz;
+	inverse->type = type;
+
+	return 0;
+}
+
 WL_EXPORT int
 weston_matrix_invert(struct weston_matrix *inverse,
 		     const struct weston_matrix *matrix)
@@ -264,6 +410,9 @@ weston_matrix_invert(struct weston_matrix *inverse,
 	unsigned perm[4];	/* permutation */
 	unsigned c;
 
+	if (matrix_is_axis_aligned(matrix))
+		return matrix_invert_axis_aligned(inverse, matrix);
+
 	if (matrix_invert(LU, perm, matrix) < 0)
 		return -1;
 
@@ -224,6 +224,37 @@ os_create_anonymous_file(off_t size)
 	return fd;
 }
 
+/* The PMD size on x86-64 and the most common one on aarch64. */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/** Ask for transparent huge pages on a mapping of an anonymous file
+ *
+ * \param map The mapping from mmap() of a file from
+ * os_create_anonymous_file().
+ * \param size The size of the mapping.
+ *
+ * Only worth it for mappings of several huge pages, e.g. the buffers of a
+ * whole output, so smaller ones are left alone. A 4K buffer is 8000 pages of
+ * 4 KiB, but only 16 huge ones, which makes copies of it a lot lighter on the
+ * TLB.
+ *
+ * The memfd is shmem, so this only has an effect if
+ * /sys/kernel/mm/transparent_hugepage/shmem_enabled is "advise" or
+ * "within_size". The pages are allocated huge in the file, so other
+ * processes mapping the same file get them too. Failure is silently
+ * ignored, this is only a hint.
+ */
+void
+os_advise_huge_pages(void *map, size_t size)
+{
+#ifdef MADV_HUGEPAGE
+	if (size < 2 * HUGE_PAGE_SIZE)
+		return;
+
+	madvise(map, size, MADV_HUGEPAGE);
+#endif
+}
+
 #ifndef HAVE_STRCHRNUL
 char *
 strchrnul(const char *s, int c)
@@ -0,0 +1,500 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+
+#include "shared/pixel-convert.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define PIXEL_USE_SSE2 1
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PIXEL_USE_AVX2 1
+#endif
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PIXEL_USE_NEON 1
+#endif
+
+/*
+ * SSE2 is part of the x86-64 baseline and NEON is chosen at build time like
+ * in matrix.c. AVX2 is not, so its variants are built with a target
+ * attribute and only used after checking the CPU. All kernels accept any
+ * alignment and finish the last pixels with the scalar code.
+ */
+
+static inline uint32_t
+swap_rb(uint32_t v)
+{
+	/*      A R G B */
+	return (v & 0xff00ff00) |
+	       ((v >> 16) & 0x000000ff) |
+	       ((v << 16) & 0x00ff0000);
+}
+
+/* Component-wise difference of the three color channels, each modulo 256 */
+static inline uint32_t
+delta_rgb(uint32_t next, uint32_t prev)
+{
+	unsigned char dr, dg, db;
+
+	dr = (next >> 16) - (prev >> 16);
+	dg = (next >>  8) - (prev >>  8);
+	db = (next >>  0) - (prev >>  0);
+
+	return (dr << 16) | (dg << 8) | (db << 0);
+}
+
+/* color * alpha / 255, rounded */
+static inline uint32_t
+multiply_alpha(uint32_t alpha, uint32_t color)
+{
+	uint32_t temp = (alpha * color) + 0x80;
+
+	return ((temp + (temp >> 8)) >> 8);
+}
+
+static inline uint32_t
+premultiply_rgba(const uint8_t *p)
+{
+	uint32_t alpha = p[3];
+
+	return (alpha << 24) |
+	       (multiply_alpha(alpha, p[0]) << 16) |
+	       (multiply_alpha(alpha, p[1]) << 8) |
+	       (multiply_alpha(alpha, p[2]) << 0);
+}
+
+#if defined(PIXEL_USE_AVX2)
+static inline int
+cpu_has_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2"))) static int
+copy_swap_rb_avx2(uint32_t *dst, const uint32_t *src, int n)
+{
+	const __m256i ag = _mm256_set1_epi32(0xff00ff00);
+	const __m256i b = _mm256_set1_epi32(0x000000ff);
+	const __m256i r = _mm256_set1_epi32(0x00ff0000);
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i s;
+
+		s = _mm256_and_si256(v, ag);
+		s = _mm256_or_si256(s, _mm256_and_si256(
+				_mm256_srli_epi32(v, 16), b));
+		s = _mm256_or_si256(s, _mm256_and_si256(
+				_mm256_slli_epi32(v, 16), r));
+		_mm256_storeu_si256((__m256i *)(dst + i), s);
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2"))) static int
+delta_rgb_avx2(uint32_t *delta, uint32_t *prev, const uint32_t *next, int n)
+{
+	const __m256i rgb = _mm256_set1_epi32(0x00ffffff);
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(next + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(prev + i));
+
+		_mm256_storeu_si256((__m256i *)(delta + i),
+				    _mm256_and_si256(_mm256_sub_epi8(a, b), rgb));
+		_mm256_storeu_si256((__m256i *)(prev + i), a);
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2"))) static int
+span_equal_avx2(const uint32_t *v, int n, uint32_t value)
+{
+	const __m256i ref = _mm256_set1_epi32(value);
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(v + i));
+		uint32_t mask;
+
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi32(a, ref));
+		if (mask != 0xffffffff)
+			return i + __builtin_ctz(~mask) / 4;
+	}
+
+	return i;
+}
+
+/* Two pixels unpacked to 16 bits per channel, R G B A each */
+__attribute__((target("avx2"))) static inline __m256i
+premultiply_epi16_avx2(__m256i c)
+{
+	const __m256i rgb = _mm256_set1_epi64x(0x0000ffffffffffffll);
+	const __m256i opaque = _mm256_set1_epi64x(0x00ff000000000000ll);
+	__m256i a, t;
+
+	a = _mm256_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm256_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm256_or_si256(_mm256_and_si256(a, rgb), opaque);
+	t = _mm256_add_epi16(_mm256_mullo_epi16(c, a),
+			     _mm256_set1_epi16(0x80));
+
+	return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)),
+				 8);
+}
+
+__attribute__((target("avx2"))) static int
+premultiply_rgba_avx2(uint32_t *dst, const uint8_t *src, int n)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ag = _mm256_set1_epi32(0xff00ff00);
+	const __m256i b = _mm256_set1_epi32(0x000000ff);
+	const __m256i r = _mm256_set1_epi32(0x00ff0000);
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+		__m256i lo, hi, s;
+
+		lo = premultiply_epi16_avx2(_mm256_unpacklo_epi8(v, zero));
+		hi = premultiply_epi16_avx2(_mm256_unpackhi_epi8(v, zero));
+		v = _mm256_packus_epi16(lo, hi);
+
+		s = _mm256_and_si256(v, ag);
+		s = _mm256_or_si256(s, _mm256_and_si256(
+				_mm256_srli_epi32(v, 16), b));
+		s = _mm256_or_si256(s, _mm256_and_si256(
+				_mm256_slli_epi32(v, 16), r));
+		_mm256_storeu_si256((__m256i *)(dst + i), s);
+	}
+
+	return i;
+}
+#endif
+
+#if defined(PIXEL_USE_SSE2)
+static int
+copy_swap_rb_sse2(uint32_t *dst, const uint32_t *src, int n)
+{
+	const __m128i ag = _mm_set1_epi32(0xff00ff00);
+	const __m128i b = _mm_set1_epi32(0x000000ff);
+	const __m128i r = _mm_set1_epi32(0x00ff0000);
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i s;
+
+		s = _mm_and_si128(v, ag);
+		s = _mm_or_si128(s, _mm_and_si128(_mm_srli_epi32(v, 16), b));
+		s = _mm_or_si128(s, _mm_and_si128(_mm_slli_epi32(v, 16), r));
+		_mm_storeu_si128((__m128i *)(dst + i), s);
+	}
+
+	return i;
+}
+
+static int
+delta_rgb_sse2(uint32_t *delta, uint32_t *prev, const uint32_t *next, int n)
+{
+	const __m128i rgb = _mm_set1_epi32(0x00ffffff);
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(next + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(prev + i));
+
+		_mm_storeu_si128((__m128i *)(delta + i),
+				 _mm_and_si128(_mm_sub_epi8(a, b), rgb));
+		_mm_storeu_si128((__m128i *)(prev + i), a);
+	}
+
+	return i;
+}
+
+static int
+span_equal_sse2(const uint32_t *v, int n, uint32_t value)
+{
+	const __m128i ref = _mm_set1_epi32(value);
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(v + i));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi32(a, ref));
+
+		if (mask != 0xffff)
+			return i + __builtin_ctz(~mask) / 4;
+	}
+
+	return i;
+}
+
+/* Two pixels unpacked to 16 bits per channel, R G B A each */
+static inline __m128i
+premultiply_epi16_sse2(__m128i c)
+{
+	const __m128i rgb = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+	const __m128i opaque = _mm_set_epi16(0xff, 0, 0, 0, 0xff, 0, 0, 0);
+	__m128i a, t;
+
+	a = _mm_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm_or_si128(_mm_and_si128(a, rgb), opaque);
+	t = _mm_add_epi16(_mm_mullo_epi16(c, a), _mm_set1_epi16(0x80));
+
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static int
+premultiply_rgba_sse2(uint32_t *dst, const uint8_t *src, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ag = _mm_set1_epi32(0xff00ff00);
+	const __m128i b = _mm_set1_epi32(0x000000ff);
+	const __m128i r = _mm_set1_epi32(0x00ff0000);
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		__m128i lo, hi, s;
+
+		lo = premultiply_epi16_sse2(_mm_unpacklo_epi8(v, zero));
+		hi = premultiply_epi16_sse2(_mm_unpackhi_epi8(v, zero));
+		v = _mm_packus_epi16(lo, hi);
+
+		s = _mm_and_si128(v, ag);
+		s = _mm_or_si128(s, _mm_and_si128(_mm_srli_epi32(v, 16), b));
+		s = _mm_or_si128(s, _mm_and_si128(_mm_slli_epi32(v, 16), r));
+		_mm_storeu_si128((__m128i *)(dst + i), s);
+	}
+
+	return i;
+}
+#elif defined(PIXEL_USE_NEON)
+static int
+copy_swap_rb_neon(uint32_t *dst, const uint32_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16x4_t v = vld4q_u8((const uint8_t *)(src + i));
+		uint8x16_t tmp = v.val[0];
+
+		v.val[0] = v.val[2];
+		v.val[2] = tmp;
+		vst4q_u8((uint8_t *)(dst + i), v);
+	}
+
+	return i;
+}
+
+static int
+delta_rgb_neon(uint32_t *delta, uint32_t *prev, const uint32_t *next, int n)
+{
+	const uint32x4_t rgb = vdupq_n_u32(0x00ffffff);
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		uint8x16_t a = vld1q_u8((const uint8_t *)(next + i));
+		uint8x16_t b = vld1q_u8((const uint8_t *)(prev + i));
+		uint32x4_t d = vreinterpretq_u32_u8(vsubq_u8(a, b));
+
+		vst1q_u32(delta + i, vandq_u32(d, rgb));
+		vst1q_u8((uint8_t *)(prev + i), a);
+	}
+
+	return i;
+}
+
+static int
+span_equal_neon(const uint32_t *v, int n, uint32_t value)
+{
+	const uint32x4_t ref = vdupq_n_u32(value);
+	int i;
+
+	/* the scalar tail finds the exact position */
+	for (i = 0; i + 4 <= n; i += 4) {
+		uint64x2_t eq = vreinterpretq_u64_u32(
+				vceqq_u32(vld1q_u32(v + i), ref));
+
+		if ((vgetq_lane_u64(eq, 0) & vgetq_lane_u64(eq, 1)) != ~0ull)
+			break;
+	}
+
+	return i;
+}
+
+static inline uint8x16_t
+multiply_alpha_neon(uint8x16_t c, uint8x16_t a)
+{
+	const uint16x8_t round = vdupq_n_u16(0x80);
+	uint16x8_t lo, hi;
+
+	lo = vaddq_u16(vmull_u8(vget_low_u8(c), vget_low_u8(a)), round);
+	hi = vaddq_u16(vmull_u8(vget_high_u8(c), vget_high_u8(a)), round);
+	lo = vaddq_u16(lo, vshrq_n_u16(lo, 8));
+	hi = vaddq_u16(hi, vshrq_n_u16(hi, 8));
+
+	return vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8));
+}
+
+static int
+premultiply_rgba_neon(uint32_t *dst, const uint8_t *src, int n)
+{
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16x4_t v = vld4q_u8(src + i * 4);
+		uint8x16x4_t d;
+
+		d.val[0] = multiply_alpha_neon(v.val[2], v.val[3]);
+		d.val[1] = multiply_alpha_neon(v.val[1], v.val[3]);
+		d.val[2] = multiply_alpha_neon(v.val[0], v.val[3]);
+		d.val[3] = v.val[3];
+		vst4q_u8((uint8_t *)(dst + i), d);
+	}
+
+	return i;
+}
+#endif
+
+/** Copy n pixels, swapping the first and third byte of each
+ *
+ * Converts between the ARGB and ABGR orders in either direction.
+ * dst and src may be the same, but may not overlap otherwise.
+ */
+void
+pixel_copy_swap_rb(uint32_t *dst, const uint32_t *src, int n)
+{
+	int i = 0;
+
+#if defined(PIXEL_USE_AVX2)
+	if (cpu_has_avx2())
+		i = copy_swap_rb_avx2(dst, src, n);
+#endif
+#if defined(PIXEL_USE_SSE2)
+	i += copy_swap_rb_sse2(dst + i, src + i, n - i);
+#elif defined(PIXEL_USE_NEON)
+	i = copy_swap_rb_neon(dst, src, n);
+#endif
+
+	for (; i < n; i++)
+		dst[i] = swap_rb(src[i]);
+}
+
+/** Compute the per-channel difference between two rows
+ *
+ * \param delta Returns next - prev per color channel, modulo 256, with the
+ * top byte cleared.
+ * \param prev The previous row, overwritten with next.
+ * \param next The new row.
+ * \param n The number of pixels.
+ *
+ * This is the difference the wcap recorder encodes.
+ */
+void
+pixel_delta_rgb(uint32_t *delta, uint32_t *prev, const uint32_t *next, int n)
+{
+	int i = 0;
+
+#if defined(PIXEL_USE_AVX2)
+	if (cpu_has_avx2())
+		i = delta_rgb_avx2(delta, prev, next, n);
+#endif
+#if defined(PIXEL_USE_SSE2)
+	i += delta_rgb_sse2(delta + i, prev + i, next + i, n - i);
+#elif defined(PIXEL_USE_NEON)
+	i = delta_rgb_neon(delta, prev, next, n);
+#endif
+
+	for (; i < n; i++) {
+		delta[i] = delta_rgb(next[i], prev[i]);
+		prev[i] = next[i];
+	}
+}
+
+/** Return how many of the first n values are equal to value */
+int
+pixel_span_equal(const uint32_t *v, int n, uint32_t value)
+{
+	int i = 0;
+
+#if defined(PIXEL_USE_AVX2)
+	if (cpu_has_avx2()) {
+		i = span_equal_avx2(v, n, value);
+		if (i + 8 <= n)
+			return i;
+	}
+#endif
+#if defined(PIXEL_USE_SSE2)
+	i += span_equal_sse2(v + i, n - i, value);
+	if (i + 4 <= n)
+		return i;
+#elif defined(PIXEL_USE_NEON)
+	i = span_equal_neon(v, n, value);
+#endif
+
+	for (; i < n; i++)
+		if (v[i] != value)
+			break;
+
+	return i;
+}
+
+/** Convert n pixels from R, G, B, A bytes to premultiplied ARGB
+ *
+ * \param dst Returns the pixels in the native a8r8g8b8 format.
+ * \param src The pixels as read from a PNG file.
+ * \param n The number of pixels.
+ *
+ * dst and src may be the same, but may not overlap otherwise.
+ */
+void
+pixel_premultiply_rgba(uint32_t *dst, const uint8_t *src, int n)
+{
+	int i = 0;
+
+#if defined(PIXEL_USE_AVX2)
+	if (cpu_has_avx2())
+		i = premultiply_rgba_avx2(dst, src, n);
+#endif
+#if defined(PIXEL_USE_SSE2)
+	i += premultiply_rgba_sse2(dst + i, src + i * 4, n - i);
+#elif defined(PIXEL_USE_NEON)
+	i = premultiply_rgba_neon(dst, src, n);
+#endif
+
+	for (; i < n; i++)
+		dst[i] = premultiply_rgba(src + i * 4);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_PIXEL_CONVERT_H
+#define WESTON_PIXEL_CONVERT_H
+
+#include <stdint.h>
+
+/* Row kernels for 32 bits per pixel formats, used on screenshot and recorder
+ * read-backs and when loading images. They are vectorized where the CPU
+ * supports it. */
+
+void
+pixel_copy_swap_rb(uint32_t *dst, const uint32_t *src, int n);
+
+void
+pixel_delta_rgb(uint32_t *delta, uint32_t *prev, const uint32_t *next, int n);
+
+int
+pixel_span_equal(const uint32_t *v, int n, uint32_t value);
+
+void
+pixel_premultiply_rgba(uint32_t *dst, const uint8_t *src, int n);
+
+#endif /* WESTON_PIXEL_CONVERT_H */
@@ -256,4 +256,16 @@ millihz_to_nsec(uint32_t mhz)
 	return 1000000000000LL / mhz;
 }
 
+/* Convert a period in nanoseconds to milli-Hertz
+ *
+ * \param nsec period in nanoseconds, not zero
+ * \return frequency in mHz
+ */
+static inline uint32_t
+millihz_from_nsec(uint32_t nsec)
+{
+	assert(nsec > 0);
+	return (1000000000000LL + nsec / 2) / nsec;
+}
+
 #endif /* TIMESPEC_UTIL_H */
@@ -0,0 +1,311 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <linux/input.h>
+
+#include <libweston/libweston.h>
+#include "shared/helpers.h"
+#include "weston-test-runner.h"
+#include "weston-test-fixture-compositor.h"
+
+static enum test_result_code
+fixture_setup(struct weston_test_harness *harness)
+{
+	struct compositor_setup setup;
+
+	compositor_setup_defaults(&setup);
+	setup.shell = SHELL_TEST_DESKTOP;
+
+	return weston_test_harness_execute_as_plugin(harness, &setup);
+}
+DECLARE_FIXTURE_SETUP(fixture_setup);
+
+#define FILLER_BINDINGS 100
+
+/* Which handlers ran, in order, each identified by its data */
+static struct {
+	intptr_t calls[8];
+	unsigned count;
+} binding_log;
+
+static void
+log_call(void *data)
+{
+	assert(binding_log.count < ARRAY_LENGTH(binding_log.calls));
+	binding_log.calls[binding_log.count++] = (intptr_t) data;
+}
+
+static void
+log_reset(void)
+{
+	binding_log.count = 0;
+}
+
+static void
+key_handler(struct weston_keyboard *keyboard, const struct timespec *time,
+	    uint32_t key, void *data)
+{
+	log_call(data);
+}
+
+static void
+modifier_handler(struct weston_keyboard *keyboard,
+		 enum weston_keyboard_modifier modifier, void *data)
+{
+	log_call(data);
+}
+
+static void
+button_handler(struct weston_pointer *pointer, const struct timespec *time,
+	       uint32_t button, void *data)
+{
+	log_call(data);
+}
+
+static void
+axis_handler(struct weston_pointer *pointer, const struct timespec *time,
+	     struct weston_pointer_axis_event *event, void *data)
+{
+	log_call(data);
+}
+
+static void
+filler_handler(struct weston_keyboard *keyboard, const struct timespec *time,
+	       uint32_t key, void *data)
+{
+	assert(0 && "filler binding ran");
+}
+
+static struct weston_seat *
+get_test_seat(struct weston_compositor *compositor)
+{
+	struct weston_seat *seat;
+
+	assert(!wl_list_empty(&compositor->seat_list));
+	seat = wl_container_of(compositor->seat_list.next, seat, link);
+
+	return seat;
+}
+
+static void
+send_key(struct weston_seat *seat, uint32_t key,
+	 enum wl_keyboard_key_state state)
+{
+	struct timespec time = { 0 };
+
+	notify_key(seat, &time, key, state, STATE_UPDATE_AUTOMATIC);
+}
+
+static void
+tap_key(struct weston_seat *seat, uint32_t key)
+{
+	send_key(seat, key, WL_KEYBOARD_KEY_STATE_PRESSED);
+	send_key(seat, key, WL_KEYBOARD_KEY_STATE_RELEASED);
+}
+
+static void
+click(struct weston_seat *seat, uint32_t button)
+{
+	struct timespec time = { 0 };
+
+	notify_button(seat, &time, button, WL_POINTER_BUTTON_STATE_PRESSED);
+	notify_button(seat, &time, button, WL_POINTER_BUTTON_STATE_RELEASED);
+}
+
+static void
+scroll(struct weston_seat *seat)
+{
+	struct timespec time = { 0 };
+	struct weston_pointer_axis_event event = {
+		.axis = WL_POINTER_AXIS_VERTICAL_SCROLL,
+		.value = 10.0,
+	};
+
+	notify_axis(seat, &time, &event);
+}
+
+static void
+add_filler_bindings(struct weston_compositor *compositor,
+		    struct weston_binding **fillers)
+{
+	static const uint32_t modifiers[] = {
+		0, MODIFIER_CTRL, MODIFIER_ALT, MODIFIER_SUPER,
+		MODIFIER_CTRL | MODIFIER_SHIFT,
+	};
+	int i;
+
+	/* Key codes from 200 on, away from the modifiers and the keys the
+	 * tests press */
+	for (i = 0; i < FILLER_BINDINGS; i++) {
+		fillers[i] = weston_compositor_add_key_binding(compositor,
+			KEY_PLAYCD + i, modifiers[i % ARRAY_LENGTH(modifiers)],
+			filler_handler, NULL);
+		assert(fillers[i]);
+	}
+}
+
+static void
+destroy_bindings(struct weston_binding **bindings, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		weston_binding_destroy(bindings[i]);
+}
+
+/* Only the bindings of the key and modifiers pressed run, in the order they
+ * were added, among many others. */
+PLUGIN_TEST(key_bindings)
+{
+	/* struct weston_compositor *compositor; */
+	struct weston_seat *seat = get_test_seat(compositor);
+	struct weston_binding *fillers[FILLER_BINDINGS];
+	struct weston_binding *b[4];
+
+	add_filler_bindings(compositor, fillers);
+	b[0] = weston_compositor_add_key_binding(compositor, KEY_F13, 0,
+						 key_handler, (void *) 1);
+	b[1] = weston_compositor_add_key_binding(compositor, KEY_F13,
+						 MODIFIER_CTRL,
+						 key_handler, (void *) 2);
+	b[2] = weston_compositor_add_key_binding(compositor, KEY_F13, 0,
+						 key_handler, (void *) 3);
+	b[3] = weston_compositor_add_key_binding(compositor, KEY_F14, 0,
+						 key_handler, (void *) 4);
+
+	log_reset();
+	tap_key(seat, KEY_F13);
+	assert(binding_log.count == 2);
+	assert(binding_log.calls[0] == 1 && binding_log.calls[1] == 3);
+
+	log_reset();
+	send_key(seat, KEY_LEFTCTRL, WL_KEYBOARD_KEY_STATE_PRESSED);
+	tap_key(seat, KEY_F13);
+	send_key(seat, KEY_LEFTCTRL, WL_KEYBOARD_KEY_STATE_RELEASED);
+	assert(binding_log.count == 1 && binding_log.calls[0] == 2);
+
+	/* Releases run nothing */
+	log_reset();
+	send_key(seat, KEY_F14, WL_KEYBOARD_KEY_STATE_PRESSED);
+	assert(binding_log.count == 1 && binding_log.calls[0] == 4);
+	send_key(seat, KEY_F14, WL_KEYBOARD_KEY_STATE_RELEASED);
+	assert(binding_log.count == 1);
+
+	/* A destroyed binding leaves the others of its key */
+	weston_binding_destroy(b[0]);
+	log_reset();
+	tap_key(seat, KEY_F13);
+	assert(binding_log.count == 1 && binding_log.calls[0] == 3);
+
+	destroy_bindings(&b[1], 3);
+	log_reset();
+	tap_key(seat, KEY_F13);
+	tap_key(seat, KEY_F14);
+	assert(binding_log.count == 0);
+
+	destroy_bindings(fillers, FILLER_BINDINGS);
+}
+
+/* A modifier binding runs when its modifier is released right after being
+ * pressed, not when any other input came in between. */
+PLUGIN_TEST(modifier_bindings)
+{
+	/* struct weston_compositor *compositor; */
+	struct weston_seat *seat = get_test_seat(compositor);
+	struct weston_binding *b;
+
+	b = weston_compositor_add_modifier_binding(compositor, MODIFIER_SUPER,
+						   modifier_handler,
+						   (void *) 1);
+	assert(b);
+
+	log_reset();
+	tap_key(seat, KEY_LEFTMETA);
+	assert(binding_log.count == 1 && binding_log.calls[0] == 1);
+
+	log_reset();
+	send_key(seat, KEY_LEFTMETA, WL_KEYBOARD_KEY_STATE_PRESSED);
+	tap_key(seat, KEY_F15);
+	send_key(seat, KEY_LEFTMETA, WL_KEYBOARD_KEY_STATE_RELEASED);
+	assert(binding_log.count == 0);
+
+	log_reset();
+	send_key(seat, KEY_LEFTMETA, WL_KEYBOARD_KEY_STATE_PRESSED);
+	click(seat, BTN_SIDE);
+	send_key(seat, KEY_LEFTMETA, WL_KEYBOARD_KEY_STATE_RELEASED);
+	assert(binding_log.count == 0);
+
+	log_reset();
+	send_key(seat, KEY_LEFTMETA, WL_KEYBOARD_KEY_STATE_PRESSED);
+	scroll(seat);
+	send_key(seat, KEY_LEFTMETA, WL_KEYBOARD_KEY_STATE_RELEASED);
+	assert(binding_log.count == 0);
+
+	/* primed again by the next press */
+	log_reset();
+	tap_key(seat, KEY_LEFTMETA);
+	assert(binding_log.count == 1);
+
+	weston_binding_destroy(b);
+}
+
+PLUGIN_TEST(button_and_axis_bindings)
+{
+	/* struct weston_compositor *compositor; */
+	struct weston_seat *seat = get_test_seat(compositor);
+	uint32_t vertical = WL_POINTER_AXIS_VERTICAL_SCROLL;
+	struct weston_binding *b[3];
+
+	b[0] = weston_compositor_add_button_binding(compositor, BTN_SIDE, 0,
+						    button_handler,
+						    (void *) 1);
+	b[1] = weston_compositor_add_button_binding(compositor, BTN_SIDE,
+						    MODIFIER_ALT,
+						    button_handler,
+						    (void *) 2);
+	b[2] = weston_compositor_add_axis_binding(compositor, vertical,
+						  MODIFIER_ALT,
+						  axis_handler, (void *) 3);
+
+	log_reset();
+	click(seat, BTN_SIDE);
+	click(seat, BTN_EXTRA);
+	scroll(seat);
+	assert(binding_log.count == 1 && binding_log.calls[0] == 1);
+
+	log_reset();
+	send_key(seat, KEY_LEFTALT, WL_KEYBOARD_KEY_STATE_PRESSED);
+	click(seat, BTN_SIDE);
+	scroll(seat);
+	send_key(seat, KEY_LEFTALT, WL_KEYBOARD_KEY_STATE_RELEASED);
+	assert(binding_log.count == 2);
+	assert(binding_log.calls[0] == 2 && binding_log.calls[1] == 3);
+
+	destroy_bindings(b, ARRAY_LENGTH(b));
+}
@@ -32,6 +32,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <libweston/config-parser.h>
 
@@ -630,3 +631,117 @@ ZUC_TEST(config_test, section_from_null)
 	section = weston_config_get_section(NULL, "bucket", NULL, NULL);
 	ZUC_ASSERT_NULL(section);
 }
+
+ZUC_TEST_F(config_test_t1, serialize_round_trip, data)
+{
+	struct weston_config *config = data;
+	struct weston_config *copy;
+	struct weston_config_section *section = NULL, *copy_section = NULL;
+	const char *name, *copy_name;
+	char buf[16];
+	char *s;
+	int fd, r;
+
+	fd = weston_config_serialize(config);
+	ZUC_ASSERT_TRUE(fd >= 0);
+
+	snprintf(buf, sizeof buf, "%d", fd);
+	setenv(WESTON_CONFIG_FD_ENV_VAR, buf, 1);
+
+	/* The file is gone, so this only works from the inherited fd. */
+	copy = weston_config_parse(weston_config_get_full_path(config));
+	ZUC_ASSERT_NOT_NULL(copy);
+	ZUC_ASSERT_NULL(getenv(WESTON_CONFIG_FD_ENV_VAR));
+	ZUC_ASSERT_EQ(-1, fcntl(fd, F_GETFD));
+
+	while (weston_config_next_section(config, &section, &name)) {
+		ZUC_ASSERT_TRUE(weston_config_next_section(copy, &copy_section,
+							   &copy_name));
+		ZUC_ASSERT_STREQ(name, copy_name);
+	}
+	ZUC_ASSERT_FALSE(weston_config_next_section(copy, &copy_section,
+						    &copy_name));
+
+	section = weston_config_get_section(copy, "bucket", "color", "red");
+	r = weston_config_section_get_string(section, "contents", &s, NULL);
+	ZUC_ASSERTG_EQ(0, r, out_free);
+	ZUC_ASSERTG_STREQ("sand", s, out_free);
+
+out_free:
+	free(s);
+	weston_config_destroy(copy);
+}
+
+ZUC_TEST_F(config_test_t1, serialize_other_path, data)
+{
+	struct weston_config *config = data;
+	char buf[16];
+	int fd;
+
+	fd = weston_config_serialize(config);
+	ZUC_ASSERT_TRUE(fd >= 0);
+
+	snprintf(buf, sizeof buf, "%d", fd);
+	setenv(WESTON_CONFIG_FD_ENV_VAR, buf, 1);
+
+	/* A config for another file must not be used. */
+	ZUC_ASSERT_NULL(weston_config_parse("/nonexistent/weston.ini"));
+	ZUC_ASSERT_NULL(getenv(WESTON_CONFIG_FD_ENV_VAR));
+}
+
+static struct zuc_fixture config_test_many = {
+	.data =
+	"[a]\n"
+	"key=1\n"
+	"key=2\n"
+	"[b]\n"
+	"key=3\n"
+	"[a]\n"
+	"key=4\n"
+	"other=5\n",
+	.set_up = setup_test_config,
+	.tear_down = cleanup_test_config
+};
+
+ZUC_TEST_F(config_test_many, duplicates_in_file_order, data)
+{
+	struct weston_config_section *section;
+	struct weston_config *config = data;
+	int32_t n;
+
+	/* The first of repeated sections and keys wins, as before. */
+	section = weston_config_get_section(config, "a", NULL, NULL);
+	weston_config_section_get_int(section, "key", &n, 0);
+	ZUC_ASSERT_EQ(1, n);
+	ZUC_ASSERT_EQ(-1, weston_config_section_get_int(section, "other",
+							&n, 0));
+
+	section = weston_config_get_section(config, "a", "key", "4");
+	ZUC_ASSERT_NOT_NULL(section);
+	weston_config_section_get_int(section, "other", &n, 0);
+	ZUC_ASSERT_EQ(5, n);
+
+	section = weston_config_get_section(config, "b", NULL, NULL);
+	weston_config_section_get_int(section, "key", &n, 0);
+	ZUC_ASSERT_EQ(3, n);
+}
+
+ZUC_BENCH(config_bench, section_get_int, bench)
+{
+	struct weston_config *config = load_config(config_test_t1.data);
+	struct weston_config_section *section;
+	int32_t n = 0;
+
+	ZUC_ASSERT_NOT_NULL(config);
+
+	while (zuc_bench_next(bench)) {
+		section = weston_config_get_section(config, "bar", NULL, NULL);
+		weston_config_section_get_int(section, "key", &n, 0);
+		zuc_bench_use(&n);
+	}
+
+	ZUC_ASSERTG_EQ(3, n, out);
+
+out:
+	weston_config_destroy(config);
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+
+#include <libweston/libweston.h>
+#include "weston-test-runner.h"
+#include "weston-test-fixture-compositor.h"
+
+static enum test_result_code
+fixture_setup(struct weston_test_harness *harness)
+{
+	struct compositor_setup setup;
+
+	compositor_setup_defaults(&setup);
+	setup.shell = SHELL_TEST_DESKTOP;
+	setup.backend = WESTON_BACKEND_DRM;
+	setup.renderer = RENDERER_PIXMAN;
+
+	return weston_test_harness_execute_as_plugin(harness, &setup);
+}
+DECLARE_FIXTURE_SETUP(fixture_setup);
+
+/* Going to sleep with trim-memory-on-sleep frees the render buffers of the
+ * outputs, waking up must redraw all of them rather than only what changed
+ * meanwhile. */
+PLUGIN_TEST(drm_sleep_trim_wake)
+{
+	/* struct weston_compositor *compositor; */
+	struct weston_output *output;
+
+	compositor->trim_memory_on_sleep = true;
+
+	weston_compositor_sleep(compositor);
+	assert(compositor->state == WESTON_COMPOSITOR_SLEEPING);
+
+	/* Drop the damage left from startup, the wake alone has to bring
+	 * it back. */
+	pixman_region32_clear(&compositor->primary_plane.damage);
+
+	weston_compositor_wake(compositor);
+	assert(compositor->state == WESTON_COMPOSITOR_ACTIVE);
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		pixman_box32_t box = {
+			output->x, output->y,
+			output->x + output->width, output->y + output->height
+		};
+
+		assert(pixman_region32_contains_rectangle(
+				&compositor->primary_plane.damage, &box) ==
+		       PIXMAN_REGION_IN);
+	}
+}
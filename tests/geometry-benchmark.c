@@ -0,0 +1,346 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <pixman.h>
+
+#include <libweston/matrix.h>
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "vertex-clipping.h"
+
+/*
+ * Microbenchmarks of the per-frame geometry kernels: pixman region
+ * operations on damage regions, compress_bands(), clip_classify_boxes(),
+ * clip_simple(), clip_axis_aligned() and clip_transformed() the way the
+ * GL-renderer uses them for each pair of damage and surface rectangles, and
+ * the weston_matrix operations.
+ *
+ * Run with 'meson test --benchmark' or directly. The inputs are generated
+ * from a fixed seed, so results are comparable between runs.
+ * WESTON_BENCH_SCALE multiplies the number of iterations.
+ */
+
+#define OUTPUT_WIDTH 1920
+#define OUTPUT_HEIGHT 1080
+
+/* Unions of this many random boxes make damage regions of thousands of
+ * rectangles. */
+#define DAMAGE_BOXES 1000
+
+static volatile float sink;
+static int scale = 1;
+
+struct timer {
+	struct timespec begin;
+};
+
+static void
+timer_start(struct timer *t)
+{
+	clock_gettime(CLOCK_MONOTONIC, &t->begin);
+}
+
+static void
+timer_report(struct timer *t, const char *name, long ops)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("%-36s %12.1f ns/op  (%ld ops)\n", name,
+	       (double)timespec_sub_to_nsec(&end, &t->begin) / ops, ops);
+}
+
+static void
+make_damage(pixman_region32_t *region, unsigned int seed, int size)
+{
+	int i, x, y, w, h;
+
+	pixman_region32_init(region);
+	for (i = 0; i < DAMAGE_BOXES; i++) {
+		w = 1 + rand_r(&seed) % size;
+		h = 1 + rand_r(&seed) % size;
+		x = rand_r(&seed) % (OUTPUT_WIDTH - w);
+		y = rand_r(&seed) % (OUTPUT_HEIGHT - h);
+		pixman_region32_union_rect(region, region, x, y, w, h);
+	}
+}
+
+static void
+bench_region_ops(pixman_region32_t *damage, pixman_region32_t *opaque)
+{
+	pixman_region32_t tmp;
+	struct timer t;
+	long i, n = 2000 * scale;
+
+	pixman_region32_init(&tmp);
+
+	timer_start(&t);
+	for (i = 0; i < n; i++) {
+		pixman_region32_union(&tmp, damage, opaque);
+		sink = tmp.extents.x1;
+	}
+	timer_report(&t, "region union", n);
+
+	timer_start(&t);
+	for (i = 0; i < n; i++) {
+		pixman_region32_subtract(&tmp, damage, opaque);
+		sink = tmp.extents.x1;
+	}
+	timer_report(&t, "region subtract", n);
+
+	timer_start(&t);
+	for (i = 0; i < n; i++) {
+		pixman_region32_intersect_rect(&tmp, damage, 200, 100,
+					       OUTPUT_WIDTH / 2,
+					       OUTPUT_HEIGHT / 2);
+		sink = tmp.extents.x1;
+	}
+	timer_report(&t, "region intersect rect", n);
+
+	timer_start(&t);
+	for (i = 0; i < n; i++) {
+		pixman_region32_translate(damage, 1, 1);
+		pixman_region32_translate(damage, -1, -1);
+	}
+	timer_report(&t, "region translate", n * 2);
+
+	pixman_region32_fini(&tmp);
+}
+
+static void
+bench_compress_bands(pixman_region32_t *damage)
+{
+	pixman_box32_t *rects, *out;
+	struct timer t;
+	long i, n = 200 * scale;
+	int nrects, nout = 0;
+
+	rects = pixman_region32_rectangles(damage, &nrects);
+
+	timer_start(&t);
+	for (i = 0; i < n; i++) {
+		nout = compress_bands(rects, nrects, &out);
+		free(out);
+	}
+	timer_report(&t, "compress_bands", n);
+	printf("%-36s %12d -> %d rects\n", "", nrects, nout);
+}
+
+/* The surface rectangle in global coordinates, as calculate_edges() in
+ * the GL-renderer builds it. */
+static void
+surface_polygon(struct polygon8 *surf, const pixman_box32_t *surf_rect,
+		struct weston_matrix *matrix)
+{
+	struct weston_vector v;
+	int i;
+
+	surf->x[0] = surf_rect->x1; surf->y[0] = surf_rect->y1;
+	surf->x[1] = surf_rect->x2; surf->y[1] = surf_rect->y1;
+	surf->x[2] = surf_rect->x2; surf->y[2] = surf_rect->y2;
+	surf->x[3] = surf_rect->x1; surf->y[3] = surf_rect->y2;
+	surf->n = 4;
+
+	if (!matrix)
+		return;
+
+	for (i = 0; i < surf->n; i++) {
+		v.f[0] = surf->x[i];
+		v.f[1] = surf->y[i];
+		v.f[2] = 0.0f;
+		v.f[3] = 1.0f;
+		weston_matrix_transform(matrix, &v);
+		surf->x[i] = v.f[0] / v.f[3];
+		surf->y[i] = v.f[1] / v.f[3];
+	}
+}
+
+typedef int (*clip_func_t)(struct clip_context *ctx, struct polygon8 *surf,
+			   float *ex, float *ey);
+
+static void
+bench_clip(pixman_region32_t *damage, const char *name,
+	   struct weston_matrix *matrix, clip_func_t clip_func)
+{
+	static const pixman_box32_t surf_rects[] = {
+		{ 0, 0, 800, 600 },
+		{ 100, 40, 700, 560 },
+		{ 0, 0, 800, 24 },
+	};
+	struct clip_context ctx;
+	struct polygon8 surf;
+	pixman_box32_t *rects;
+	float ex[8], ey[8];
+	struct timer t;
+	long ops = 0;
+	int i, j, k, nrects, n;
+
+	rects = pixman_region32_rectangles(damage, &nrects);
+
+	timer_start(&t);
+	for (k = 0; k < 20 * scale; k++) {
+		for (i = 0; i < nrects; i++) {
+			ctx.clip.x1 = rects[i].x1;
+			ctx.clip.y1 = rects[i].y1;
+			ctx.clip.x2 = rects[i].x2;
+			ctx.clip.y2 = rects[i].y2;
+
+			for (j = 0; j < (int)ARRAY_LENGTH(surf_rects); j++) {
+				surface_polygon(&surf, &surf_rects[j], matrix);
+				n = clip_func(&ctx, &surf, ex, ey);
+				sink = n > 0 ? ex[0] : 0.0f;
+				ops++;
+			}
+		}
+	}
+	timer_report(&t, name, ops);
+}
+
+static void
+bench_classify(pixman_region32_t *damage, struct weston_matrix *matrix)
+{
+	static const pixman_box32_t surf_rect = { 100, 40, 700, 560 };
+	struct polygon8 surf;
+	pixman_box32_t *rects;
+	uint8_t *classes;
+	struct timer t;
+	long i, n = 200 * scale;
+	int nrects;
+
+	rects = pixman_region32_rectangles(damage, &nrects);
+	classes = malloc(nrects);
+	surface_polygon(&surf, &surf_rect, matrix);
+
+	timer_start(&t);
+	for (i = 0; i < n; i++) {
+		clip_classify_boxes(&surf, rects, nrects, classes);
+		sink = classes[i % nrects];
+	}
+	timer_report(&t, "clip_classify_boxes per rect", n * nrects);
+
+	free(classes);
+}
+
+static void
+bench_matrix(void)
+{
+	struct weston_matrix a, b, inverse;
+	struct weston_vector v = { { 1.0f, 2.0f, 0.0f, 1.0f } };
+	struct timer t;
+	long i, n = 1000000 * scale;
+
+	weston_matrix_init(&a);
+	weston_matrix_translate(&a, -400.0f, -300.0f, 0.0f);
+	weston_matrix_rotate_xy(&a, cosf(0.5f), sinf(0.5f));
+	weston_matrix_scale(&a, 1.5f, 1.5f, 1.0f);
+	weston_matrix_translate(&a, 960.0f, 540.0f, 0.0f);
+
+	timer_start(&t);
+	for (i = 0; i < n; i++) {
+		b = a;
+		weston_matrix_multiply(&b, &a);
+		sink = b.d[0];
+	}
+	timer_report(&t, "weston_matrix_multiply", n);
+
+	timer_start(&t);
+	for (i = 0; i < n; i++) {
+		weston_matrix_invert(&inverse, &a);
+		sink = inverse.d[0];
+	}
+	timer_report(&t, "weston_matrix_invert", n);
+
+	timer_start(&t);
+	for (i = 0; i < n; i++) {
+		v.f[0] = i & 1023;
+		weston_matrix_transform(&a, &v);
+		sink = v.f[0];
+	}
+	timer_report(&t, "weston_matrix_transform", n);
+}
+
+int
+main(int argc, char *argv[])
+{
+	pixman_region32_t small_damage, large_damage, opaque;
+	struct weston_matrix rotation, scaling;
+	const char *str;
+	int nrects;
+
+	str = getenv("WESTON_BENCH_SCALE");
+	if (str && atoi(str) > 0)
+		scale = atoi(str);
+
+	/* Many small damaged areas, e.g. a terminal or a busy web page, and
+	 * a few large ones partly covering each other. */
+	make_damage(&small_damage, 1, 32);
+	make_damage(&large_damage, 2, 400);
+	make_damage(&opaque, 3, 200);
+
+	pixman_region32_rectangles(&small_damage, &nrects);
+	printf("small damage: %d rects\n", nrects);
+	pixman_region32_rectangles(&large_damage, &nrects);
+	printf("large damage: %d rects\n", nrects);
+
+	bench_region_ops(&small_damage, &opaque);
+	bench_compress_bands(&small_damage);
+	bench_compress_bands(&large_damage);
+
+	bench_clip(&small_damage, "clip_simple", NULL, clip_simple);
+
+	/* A view rotated by about 30 degrees around its center. */
+	weston_matrix_init(&rotation);
+	weston_matrix_translate(&rotation, -400.0f, -300.0f, 0.0f);
+	weston_matrix_rotate_xy(&rotation, cosf(M_PI / 6), sinf(M_PI / 6));
+	weston_matrix_translate(&rotation, 960.0f, 540.0f, 0.0f);
+	bench_clip(&small_damage, "clip_transformed", &rotation,
+		   clip_transformed);
+	bench_classify(&small_damage, &rotation);
+
+	/* A view scaled up by half around its center. */
+	weston_matrix_init(&scaling);
+	weston_matrix_translate(&scaling, -400.0f, -300.0f, 0.0f);
+	weston_matrix_scale(&scaling, 1.5f, 1.5f, 1.0f);
+	weston_matrix_translate(&scaling, 960.0f, 540.0f, 0.0f);
+	bench_clip(&small_damage, "clip_transformed, scaled", &scaling,
+		   clip_transformed);
+	bench_clip(&small_damage, "clip_axis_aligned, scaled", &scaling,
+		   clip_axis_aligned);
+
+	bench_matrix();
+
+	pixman_region32_fini(&small_damage);
+	pixman_region32_fini(&large_damage);
+	pixman_region32_fini(&opaque);
+
+	return 0;
+}
@@ -796,6 +796,61 @@ test_layer_properties_changed_notification(struct test_context *ctx)
 	lyt->layer_destroy(ivilayer);
 }
 
+static void
+test_layer_unchanged_notification_callback(struct wl_listener *listener,
+					   void *data)
+{
+	struct test_context *ctx =
+			container_of(listener, struct test_context,
+					layer_property_changed);
+
+	ctx->user_flags++;
+}
+
+static void
+test_layer_unchanged_notification(struct test_context *ctx)
+{
+#define LAYER_NUM (2)
+	const struct ivi_layout_interface *lyt = ctx->layout_interface;
+	static const uint32_t layers[LAYER_NUM] = {IVI_TEST_LAYER_ID(0), IVI_TEST_LAYER_ID(1)};
+	struct ivi_layout_layer *ivilayers[LAYER_NUM] = {};
+
+	ctx->user_flags = 0;
+
+	ivilayers[0] = lyt->layer_create_with_dimension(layers[0], 200, 300);
+	ivilayers[1] = lyt->layer_create_with_dimension(layers[1], 400, 500);
+
+	ctx->layer_property_changed.notify = test_layer_unchanged_notification_callback;
+
+	iassert(lyt->layer_add_listener(ivilayers[1], &ctx->layer_property_changed) == IVI_SUCCEEDED);
+
+	/* only the changed layer is notified */
+	iassert(lyt->layer_set_opacity(
+		ivilayers[0], wl_fixed_from_double(0.5)) == IVI_SUCCEEDED);
+
+	lyt->commit_changes();
+
+	iassert(ctx->user_flags == 0);
+
+	iassert(lyt->layer_set_opacity(
+		ivilayers[1], wl_fixed_from_double(0.5)) == IVI_SUCCEEDED);
+
+	lyt->commit_changes();
+
+	iassert(ctx->user_flags == 1);
+
+	/* and only once */
+	lyt->commit_changes();
+
+	iassert(ctx->user_flags == 1);
+
+	wl_list_remove(&ctx->layer_property_changed.link);
+
+	lyt->layer_destroy(ivilayers[0]);
+	lyt->layer_destroy(ivilayers[1]);
+#undef LAYER_NUM
+}
+
 static void
 test_layer_create_notification_callback(struct wl_listener *listener, void *data)
 {
@@ -991,6 +1046,7 @@ run_internal_tests(struct test_context *ctx)
 	test_commit_changes_after_render_order_set_layer_destroy(ctx);
 
 	test_layer_properties_changed_notification(ctx);
+	test_layer_unchanged_notification(ctx);
 	test_layer_create_notification(ctx);
 	test_layer_remove_notification(ctx);
 	test_layer_bad_properties_changed_notification(ctx);
@@ -27,6 +27,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <unistd.h>
 #include <signal.h>
@@ -182,6 +183,7 @@ randomize_matrix(struct weston_matrix *m)
 #else
 		m->d[i] = frand();
 #endif
+	m->type = WESTON_MATRIX_TRANSFORM_OTHER;
 }
 
 /* Take a matrix, compute inverse, multiply together
@@ -243,7 +245,7 @@ test(void)
 	return TEST_FAIL;
 }
 
-static int running;
+static volatile sig_atomic_t running;
 static void
 stopme(int n)
 {
@@ -371,7 +373,145 @@ test_loop_speed_invert_explicit(void)
 	       count, t, 1e9 * t / count);
 }
 
-int main(void)
+/* The straightforward versions of weston_matrix_multiply() and
+ * weston_matrix_transform(), for comparison with the special cases. */
+static void
+reference_multiply(struct weston_matrix *m, const struct weston_matrix *n)
+{
+	struct weston_matrix tmp;
+	int i, j;
+
+	for (i = 0; i < 16; i++) {
+		tmp.d[i] = 0;
+		for (j = 0; j < 4; j++)
+			tmp.d[i] += m->d[(i / 4) * 4 + j] * n->d[i % 4 + j * 4];
+	}
+	tmp.type = m->type | n->type;
+	*m = tmp;
+}
+
+static void
+reference_transform(const struct weston_matrix *m, struct weston_vector *v)
+{
+	struct weston_vector t;
+	int i, j;
+
+	for (i = 0; i < 4; i++) {
+		t.f[i] = 0;
+		for (j = 0; j < 4; j++)
+			t.f[i] += v->f[j] * m->d[i + j * 4];
+	}
+
+	*v = t;
+}
+
+static void
+make_bench_matrix(struct weston_matrix *m, unsigned int type)
+{
+	weston_matrix_init(m);
+
+	if (type & WESTON_MATRIX_TRANSFORM_SCALE)
+		weston_matrix_scale(m, 1.5f, 0.75f, 1.0f);
+	if (type & WESTON_MATRIX_TRANSFORM_ROTATE)
+		weston_matrix_rotate_xy(m, 0.8f, 0.6f);
+	if (type & WESTON_MATRIX_TRANSFORM_TRANSLATE)
+		weston_matrix_translate(m, 100.0f, -20.0f, 0.0f);
+	if (type & WESTON_MATRIX_TRANSFORM_OTHER) {
+		randomize_matrix(m);
+		m->d[3] = m->d[7] = m->d[11] = 0.0f;
+		m->d[15] = 1.0f;
+	}
+}
+
+static float
+matrix_max_diff(const struct weston_matrix *a, const struct weston_matrix *b)
+{
+	float diff = 0.0f;
+	unsigned i;
+
+	for (i = 0; i < 16; i++)
+		if (fabsf(a->d[i] - b->d[i]) > diff)
+			diff = fabsf(a->d[i] - b->d[i]);
+
+	return diff;
+}
+
+/* Time 'expr' for one second, returning nanoseconds per iteration */
+#define BENCH(expr) ({					\
+	unsigned long _count = 0;			\
+	running = 1;					\
+	alarm(1);					\
+	reset_timer();					\
+	while (running) {				\
+		expr;					\
+		_count++;				\
+	}						\
+	1e9 * read_timer() / _count;			\
+})
+
+static void __attribute__((noinline))
+benchmark_type(const char *name, unsigned int type)
+{
+	struct weston_matrix m, n, a, b, inv;
+	struct weston_vector v = { { 0.5, 0.5, 0.5, 1.0 } };
+	struct weston_vector w;
+	double t_ref, t_new;
+	float diff;
+
+	make_bench_matrix(&n, type);
+	make_bench_matrix(&m, type);
+
+	/* correctness against the reference first */
+	a = m;
+	weston_matrix_multiply(&a, &n);
+	b = m;
+	reference_multiply(&b, &n);
+	diff = matrix_max_diff(&a, &b);
+
+	w = v;
+	weston_matrix_transform(&n, &w);
+	reference_transform(&n, &v);
+	diff = fmaxf(diff, fabsf(w.f[0] - v.f[0]) + fabsf(w.f[1] - v.f[1]) +
+			   fabsf(w.f[2] - v.f[2]) + fabsf(w.f[3] - v.f[3]));
+
+	printf("\n%s matrices (max difference to reference %g):\n",
+	       name, diff);
+
+	t_ref = BENCH(a = m; reference_multiply(&a, &n));
+	t_new = BENCH(a = m; weston_matrix_multiply(&a, &n));
+	printf("  multiply:  %6.1f ns reference, %6.1f ns, %.1fx\n",
+	       t_ref, t_new, t_ref / t_new);
+
+	t_ref = BENCH(reference_transform(&n, &v));
+	t_new = BENCH(weston_matrix_transform(&n, &v));
+	printf("  transform: %6.1f ns reference, %6.1f ns, %.1fx\n",
+	       t_ref, t_new, t_ref / t_new);
+
+	/* Clearing the type forces the general LU inverse */
+	a = n;
+	a.type = WESTON_MATRIX_TRANSFORM_OTHER;
+	t_ref = BENCH(weston_matrix_invert(&inv, &a));
+	t_new = BENCH(weston_matrix_invert(&inv, &n));
+	printf("  invert:    %6.1f ns general, %6.1f ns, %.1fx\n",
+	       t_ref, t_new, t_ref / t_new);
+}
+
+static void
+benchmark(void)
+{
+	benchmark_type("Translation",
+		       WESTON_MATRIX_TRANSFORM_TRANSLATE);
+	benchmark_type("Scale and translation",
+		       WESTON_MATRIX_TRANSFORM_SCALE |
+		       WESTON_MATRIX_TRANSFORM_TRANSLATE);
+	benchmark_type("Rotation and translation",
+		       WESTON_MATRIX_TRANSFORM_ROTATE |
+		       WESTON_MATRIX_TRANSFORM_TRANSLATE);
+	benchmark_type("General",
+		       WESTON_MATRIX_TRANSFORM_OTHER);
+}
+
+int main(int argc, char *argv[])
 {
 	struct sigaction ding;
 	struct weston_matrix M;
@@ -387,10 +527,16 @@ int main(void)
 
 	srandom(13);
 
+	if (argc > 1 && strcmp(argv[1], "--benchmark") == 0) {
+		benchmark();
+		return 0;
+	}
+
 	M.d[0] = 3.0;	M.d[4] = 17.0;	M.d[8] = 10.0;	M.d[12] = 0.0;
 	M.d[1] = 2.0;	M.d[5] = 4.0;	M.d[9] = -2.0;	M.d[13] = 0.0;
 	M.d[2] = 6.0;	M.d[6] = 18.0;	M.d[10] = -12;	M.d[14] = 0.0;
 	M.d[3] = 0.0;	M.d[7] = 0.0;	M.d[11] = 0.0;	M.d[15] = 1.0;
+	M.type = WESTON_MATRIX_TRANSFORM_OTHER;
 
 	ret = matrix_invert(Q.LU, Q.perm, &M);
 	printf("ret = %d\n", ret);
@@ -0,0 +1,352 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shared/pixel-convert.h"
+
+/* 4K rows, plus an odd tail so that the scalar remainder runs too */
+#define ROW_PIXELS (3840 + 7)
+
+static uint32_t
+reference_swap_rb(uint32_t v)
+{
+	return (v & 0xff00ff00) | ((v >> 16) & 0xff) | ((v << 16) & 0xff0000);
+}
+
+static uint32_t
+reference_delta(uint32_t next, uint32_t prev)
+{
+	unsigned char dr, dg, db;
+
+	dr = (next >> 16) - (prev >> 16);
+	dg = (next >>  8) - (prev >>  8);
+	db = (next >>  0) - (prev >>  0);
+
+	return (dr << 16) | (dg << 8) | (db << 0);
+}
+
+/* premultiply_data() as image-loader.c had it */
+static uint32_t
+reference_premultiply(const uint8_t *p)
+{
+	uint32_t alpha = p[3];
+	uint32_t red = p[0], green = p[1], blue = p[2];
+	int temp;
+
+	if (alpha == 0)
+		return 0;
+
+	if (alpha != 0xff) {
+		temp = alpha * red + 0x80;
+		red = (temp + (temp >> 8)) >> 8;
+		temp = alpha * green + 0x80;
+		green = (temp + (temp >> 8)) >> 8;
+		temp = alpha * blue + 0x80;
+		blue = (temp + (temp >> 8)) >> 8;
+	}
+
+	return (alpha << 24) | (red << 16) | (green << 8) | (blue << 0);
+}
+
+static void
+fill_random(uint32_t *p, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		p[i] = (uint32_t)random() ^ ((uint32_t)random() << 16);
+}
+
+static int
+check_swap_rb(void)
+{
+	uint32_t src[ROW_PIXELS + 1], dst[ROW_PIXELS + 1];
+	int n, i;
+
+	fill_random(src, ROW_PIXELS + 1);
+
+	/* every length and an unaligned start */
+	for (n = 0; n <= 70; n++) {
+		pixel_copy_swap_rb(dst + 1, src + 1, n);
+		for (i = 0; i < n; i++) {
+			if (dst[i + 1] != reference_swap_rb(src[i + 1])) {
+				printf("swap_rb: length %d, pixel %d wrong\n",
+				       n, i);
+				return -1;
+			}
+		}
+	}
+
+	/* in place */
+	memcpy(dst, src, sizeof dst);
+	pixel_copy_swap_rb(dst, dst, ROW_PIXELS);
+	for (i = 0; i < ROW_PIXELS; i++) {
+		if (dst[i] != reference_swap_rb(src[i])) {
+			printf("swap_rb: in place, pixel %d wrong\n", i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+check_delta(void)
+{
+	uint32_t next[ROW_PIXELS], prev[ROW_PIXELS], orig[ROW_PIXELS];
+	uint32_t delta[ROW_PIXELS];
+	int n, i;
+
+	fill_random(next, ROW_PIXELS);
+	fill_random(orig, ROW_PIXELS);
+
+	for (n = 0; n <= 70; n++) {
+		memcpy(prev, orig, sizeof prev);
+		pixel_delta_rgb(delta, prev, next, n);
+		for (i = 0; i < n; i++) {
+			if (delta[i] != reference_delta(next[i], orig[i]) ||
+			    prev[i] != next[i]) {
+				printf("delta: length %d, pixel %d wrong\n",
+				       n, i);
+				return -1;
+			}
+		}
+		if (n < ROW_PIXELS && prev[n] != orig[n]) {
+			printf("delta: length %d, wrote past the end\n", n);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+check_span(void)
+{
+	uint32_t v[ROW_PIXELS];
+	int n, i;
+
+	for (i = 0; i < ROW_PIXELS; i++)
+		v[i] = 0x123456;
+
+	if (pixel_span_equal(v, ROW_PIXELS, 0x123456) != ROW_PIXELS) {
+		printf("span: full row not found equal\n");
+		return -1;
+	}
+
+	for (n = 1; n <= 70; n++) {
+		for (i = 0; i < n; i++) {
+			v[i] = 0xdead;
+			if (pixel_span_equal(v, n, 0x123456) != i) {
+				printf("span: length %d, mismatch at %d "
+				       "not found\n", n, i);
+				return -1;
+			}
+			v[i] = 0x123456;
+		}
+	}
+
+	return 0;
+}
+
+static int
+check_premultiply(void)
+{
+	uint32_t src[ROW_PIXELS + 1], dst[ROW_PIXELS + 1];
+	const uint8_t *s = (const uint8_t *) src;
+	int n, i;
+
+	fill_random(src, ROW_PIXELS + 1);
+	/* fully transparent and opaque pixels take shortcuts in the
+	 * reference */
+	for (i = 0; i < ROW_PIXELS; i += 5)
+		src[i] &= 0x00ffffff;
+	for (i = 1; i < ROW_PIXELS; i += 5)
+		src[i] |= 0xff000000;
+
+	for (n = 0; n <= 70; n++) {
+		pixel_premultiply_rgba(dst + 1, s + 4, n);
+		for (i = 0; i < n; i++) {
+			if (dst[i + 1] != reference_premultiply(s + 4 * (i + 1))) {
+				printf("premultiply: length %d, pixel %d wrong\n",
+				       n, i);
+				return -1;
+			}
+		}
+	}
+
+	/* every alpha and color combination */
+	for (i = 0; i < 256 * 256; i += 4) {
+		uint8_t rgba[16];
+		uint32_t out[4];
+		int j;
+
+		for (j = 0; j < 4; j++) {
+			rgba[j * 4 + 0] = (i + j) & 0xff;
+			rgba[j * 4 + 1] = 255 - ((i + j) & 0xff);
+			rgba[j * 4 + 2] = (i + j) & 0xff;
+			rgba[j * 4 + 3] = (i + j) >> 8;
+		}
+		pixel_premultiply_rgba(out, rgba, 4);
+		for (j = 0; j < 4; j++) {
+			if (out[j] != reference_premultiply(rgba + j * 4)) {
+				printf("premultiply: color 0x%02x alpha 0x%02x "
+				       "wrong\n", (i + j) & 0xff, (i + j) >> 8);
+				return -1;
+			}
+		}
+	}
+
+	/* in place */
+	memcpy(dst, src, sizeof dst);
+	pixel_premultiply_rgba(dst, (uint8_t *) dst, ROW_PIXELS);
+	for (i = 0; i < ROW_PIXELS; i++) {
+		if (dst[i] != reference_premultiply(s + 4 * i)) {
+			printf("premultiply: in place, pixel %d wrong\n", i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static volatile sig_atomic_t running;
+
+static void
+stopme(int n)
+{
+	running = 0;
+}
+
+static struct timespec begin_time;
+
+static void
+reset_timer(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &begin_time);
+}
+
+static double
+read_timer(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)(t.tv_sec - begin_time.tv_sec) +
+	       1e-9 * (t.tv_nsec - begin_time.tv_nsec);
+}
+
+/* Returns the throughput in megapixels per second */
+#define BENCH(expr) ({					\
+	unsigned long _count = 0;			\
+	running = 1;					\
+	alarm(1);					\
+	reset_timer();					\
+	while (running) {				\
+		expr;					\
+		_count++;				\
+	}						\
+	1e-6 * ROW_PIXELS * _count / read_timer();	\
+})
+
+static void
+benchmark(void)
+{
+	static uint32_t a[ROW_PIXELS], b[ROW_PIXELS], c[ROW_PIXELS];
+	uint32_t *pa = a, *pb = b, *pc = c;
+	double t_ref, t_new;
+	int i;
+
+	fill_random(a, ROW_PIXELS);
+	fill_random(b, ROW_PIXELS);
+
+	t_ref = BENCH(for (i = 0; i < ROW_PIXELS; i++)
+			      pb[i] = reference_swap_rb(pa[i]);
+		      __asm__ __volatile__("" : : "r"(pb) : "memory"));
+	t_new = BENCH(pixel_copy_swap_rb(pb, pa, ROW_PIXELS));
+	printf("swap R/B:    %7.0f Mpix/s reference, %7.0f Mpix/s, %.1fx\n",
+	       t_ref, t_new, t_new / t_ref);
+
+	t_ref = BENCH(for (i = 0; i < ROW_PIXELS; i++) {
+			      pc[i] = reference_delta(pa[i], pb[i]);
+			      pb[i] = pa[i];
+		      }
+		      __asm__ __volatile__("" : : "r"(pc) : "memory"));
+	t_new = BENCH(pixel_delta_rgb(pc, pb, pa, ROW_PIXELS));
+	printf("delta:       %7.0f Mpix/s reference, %7.0f Mpix/s, %.1fx\n",
+	       t_ref, t_new, t_new / t_ref);
+
+	/* an unchanged row, the common case while recording */
+	memset(c, 0, sizeof c);
+	t_ref = BENCH(for (i = 0; i < ROW_PIXELS; i++)
+			      if (pc[i] != 0)
+				      break;
+		      __asm__ __volatile__("" : : "r"(i) : "memory"));
+	t_new = BENCH(i = pixel_span_equal(pc, ROW_PIXELS, 0);
+		      __asm__ __volatile__("" : : "r"(i) : "memory"));
+	printf("equal span:  %7.0f Mpix/s reference, %7.0f Mpix/s, %.1fx\n",
+	       t_ref, t_new, t_new / t_ref);
+
+	t_ref = BENCH(for (i = 0; i < ROW_PIXELS; i++)
+			      pb[i] = reference_premultiply((uint8_t *)(pa + i));
+		      __asm__ __volatile__("" : : "r"(pb) : "memory"));
+	t_new = BENCH(pixel_premultiply_rgba(pb, (uint8_t *) pa, ROW_PIXELS));
+	printf("premultiply: %7.0f Mpix/s reference, %7.0f Mpix/s, %.1fx\n",
+	       t_ref, t_new, t_new / t_ref);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sigaction ding;
+
+	ding.sa_handler = stopme;
+	sigemptyset(&ding.sa_mask);
+	ding.sa_flags = 0;
+	sigaction(SIGALRM, &ding, NULL);
+
+	srandom(13);
+
+	if (argc > 1 && strcmp(argv[1], "--benchmark") == 0) {
+		benchmark();
+		return 0;
+	}
+
+	if (check_swap_rb() < 0 || check_delta() < 0 || check_span() < 0 ||
+	    check_premultiply() < 0)
+		return 1;
+
+	printf("pixel conversion kernels match the reference\n");
+
+	return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+
+#include <libweston/libweston.h>
+#include "libweston-internal.h"
+#include "weston-test-runner.h"
+#include "weston-test-fixture-compositor.h"
+
+static enum test_result_code
+fixture_setup(struct weston_test_harness *harness)
+{
+	struct compositor_setup setup;
+
+	compositor_setup_defaults(&setup);
+
+	return weston_test_harness_execute_as_plugin(harness, &setup);
+}
+DECLARE_FIXTURE_SETUP(fixture_setup);
+
+/* The simplified region must cover the original one without leaving its
+ * extents. */
+static void
+check_simplified(pixman_region32_t *simplified, pixman_region32_t *original)
+{
+	pixman_region32_t outside;
+	pixman_box32_t a = *pixman_region32_extents(simplified);
+	pixman_box32_t b = *pixman_region32_extents(original);
+
+	pixman_region32_init(&outside);
+	pixman_region32_subtract(&outside, original, simplified);
+	assert(!pixman_region32_not_empty(&outside));
+	pixman_region32_fini(&outside);
+
+	assert(a.x1 == b.x1 && a.y1 == b.y1 && a.x2 == b.x2 && a.y2 == b.y2);
+}
+
+/* A few rectangles far apart, like the cursor and a clock */
+static void
+init_sparse(pixman_region32_t *region)
+{
+	pixman_region32_init_rect(region, 10, 10, 20, 20);
+	pixman_region32_union_rect(region, region, 600, 400, 30, 10);
+	pixman_region32_union_rect(region, region, 300, 900, 5, 5);
+}
+
+/* A grid of glyph sized rectangles, like a terminal redrawing its text */
+static void
+init_glyphs(pixman_region32_t *region)
+{
+	int x, y;
+
+	pixman_region32_init(region);
+	for (y = 0; y < 40; y++)
+		for (x = 0; x < 80; x++)
+			pixman_region32_union_rect(region, region,
+						   x * 10, y * 20, 6, 14);
+}
+
+PLUGIN_TEST(region_simplify_disabled)
+{
+	/* struct weston_compositor *compositor; */
+	pixman_region32_t region, original;
+
+	init_glyphs(&region);
+	pixman_region32_init(&original);
+	pixman_region32_copy(&original, &region);
+
+	weston_region_simplify(&region, 0);
+	assert(pixman_region32_equal(&region, &original));
+
+	pixman_region32_fini(&original);
+	pixman_region32_fini(&region);
+}
+
+PLUGIN_TEST(region_simplify_within_budget)
+{
+	/* struct weston_compositor *compositor; */
+	pixman_region32_t region, original;
+
+	init_sparse(&region);
+	pixman_region32_init(&original);
+	pixman_region32_copy(&original, &region);
+
+	weston_region_simplify(&region, 32);
+	assert(pixman_region32_equal(&region, &original));
+
+	pixman_region32_fini(&original);
+	pixman_region32_fini(&region);
+}
+
+PLUGIN_TEST(region_simplify_covered_extents)
+{
+	/* struct weston_compositor *compositor; */
+	pixman_region32_t region, original;
+	pixman_box32_t *extents;
+
+	/* An L shape covering 90% of its extents */
+	pixman_region32_init_rect(&region, 0, 0, 100, 50);
+	pixman_region32_union_rect(&region, &region, 0, 50, 80, 50);
+	pixman_region32_init(&original);
+	pixman_region32_copy(&original, &region);
+
+	weston_region_simplify(&region, 32);
+	assert(pixman_region32_n_rects(&region) == 1);
+	extents = pixman_region32_extents(&region);
+	assert(extents->x1 == 0 && extents->y1 == 0 &&
+	       extents->x2 == 100 && extents->y2 == 100);
+	check_simplified(&region, &original);
+
+	pixman_region32_fini(&original);
+	pixman_region32_fini(&region);
+}
+
+PLUGIN_TEST(region_simplify_over_budget)
+{
+	/* struct weston_compositor *compositor; */
+	pixman_region32_t region, original;
+	int budget;
+
+	for (budget = 1; budget <= 64; budget *= 2) {
+		init_glyphs(&region);
+		pixman_region32_init(&original);
+		pixman_region32_copy(&original, &region);
+		assert(pixman_region32_n_rects(&region) > budget);
+
+		weston_region_simplify(&region, budget);
+		assert(pixman_region32_n_rects(&region) <= budget);
+		check_simplified(&region, &original);
+
+		pixman_region32_fini(&original);
+		pixman_region32_fini(&region);
+	}
+}
@@ -0,0 +1,681 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_GBM
+#include <gbm.h>
+#include <drm_fourcc.h>
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
+#endif
+
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "shared/xalloc.h"
+#include "weston-test-client-helper.h"
+#include "weston-test-fixture-compositor.h"
+
+/*
+ * Repaint throughput benchmarks, run with 'meson test --benchmark'.
+ *
+ * The headless outputs are unthrottled, so every scenario repaints as fast
+ * as the clients commit. Each one reports the frame rate, the CPU time the
+ * compositor spent per frame, excluding the client thread, and the 99th
+ * percentile of the time from a commit to its frame callback.
+ *
+ * WESTON_BENCH_FRAMES overrides the number of frames measured per scenario.
+ */
+
+#define BENCH_DEFAULT_FRAMES 500
+#define BENCH_CLIENTS 8
+#define BENCH_SUBSURFACE_DEPTH 32
+
+#define BENCH_WIDTH 1280
+#define BENCH_HEIGHT 720
+
+static const enum renderer_type renderers[] = {
+	RENDERER_PIXMAN,
+	RENDERER_GL,
+};
+
+static enum test_result_code
+fixture_setup(struct weston_test_harness *harness,
+	      const enum renderer_type *renderer)
+{
+	struct compositor_setup setup;
+
+	compositor_setup_defaults(&setup);
+	setup.renderer = *renderer;
+	setup.shell = SHELL_TEST_DESKTOP;
+	setup.width = BENCH_WIDTH;
+	setup.height = BENCH_HEIGHT;
+	setup.unthrottled = true;
+
+	return weston_test_harness_execute_as_client(harness, &setup);
+}
+DECLARE_FIXTURE_SETUP_WITH_ARG(fixture_setup, renderers);
+
+struct bench_surface {
+	struct bench *bench;
+	struct client *client;
+	struct wl_surface *wl_surface;
+	struct wl_buffer *wl_buffer;
+	/* NULL when the content is not updated, e.g. for dmabufs */
+	pixman_image_t *image;
+	int width;
+	int height;
+
+	struct wl_callback *frame;
+	struct timespec commit_time;
+};
+
+struct bench {
+	struct bench_surface *surfaces;
+	int n_surfaces;
+	int max_surfaces;
+
+	struct client **clients;
+	int n_clients;
+
+	unsigned int seed;
+	int frames;
+	int target_frames;
+
+	int64_t *latencies;
+	int n_latencies;
+	int max_latencies;
+};
+
+static int
+bench_target_frames(void)
+{
+	const char *str = getenv("WESTON_BENCH_FRAMES");
+	int frames;
+
+	if (!str)
+		return BENCH_DEFAULT_FRAMES;
+
+	frames = atoi(str);
+	return frames > 0 ? frames : BENCH_DEFAULT_FRAMES;
+}
+
+/* Surfaces and clients are both at most max_surfaces. */
+static void
+bench_init(struct bench *bench, int max_surfaces)
+{
+	memset(bench, 0, sizeof *bench);
+	bench->max_surfaces = max_surfaces;
+	bench->surfaces = xzalloc(max_surfaces * sizeof bench->surfaces[0]);
+	bench->clients = xzalloc(max_surfaces * sizeof bench->clients[0]);
+	bench->seed = 1;
+	bench->target_frames = bench_target_frames();
+
+	/* Surfaces other than the first may get a frame or two more. */
+	bench->max_latencies = max_surfaces * (bench->target_frames + 2);
+	bench->latencies = xzalloc(bench->max_latencies *
+				   sizeof bench->latencies[0]);
+}
+
+static void
+bench_add_client(struct bench *bench, struct client *client)
+{
+	assert(bench->n_clients < bench->max_surfaces);
+	bench->clients[bench->n_clients++] = client;
+}
+
+static struct bench_surface *
+bench_add_surface(struct bench *bench, struct client *client,
+		  struct wl_surface *wl_surface, struct wl_buffer *wl_buffer,
+		  pixman_image_t *image, int width, int height)
+{
+	struct bench_surface *surf;
+
+	assert(bench->n_surfaces < bench->max_surfaces);
+	surf = &bench->surfaces[bench->n_surfaces++];
+
+	surf->bench = bench;
+	surf->client = client;
+	surf->wl_surface = wl_surface;
+	surf->wl_buffer = wl_buffer;
+	surf->image = image;
+	surf->width = width;
+	surf->height = height;
+
+	return surf;
+}
+
+static void
+bench_release(struct bench *bench)
+{
+	int i;
+
+	for (i = 0; i < bench->n_clients; i++)
+		client_destroy(bench->clients[i]);
+
+	free(bench->latencies);
+	free(bench->clients);
+	free(bench->surfaces);
+}
+
+static void bench_surface_commit(struct bench_surface *surf);
+
+static void
+bench_frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	struct bench_surface *surf = data;
+	struct bench *bench = surf->bench;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	wl_callback_destroy(callback);
+	surf->frame = NULL;
+
+	if (bench->frames >= bench->target_frames)
+		return;
+
+	if (bench->n_latencies < bench->max_latencies)
+		bench->latencies[bench->n_latencies++] =
+			timespec_sub_to_nsec(&now, &surf->commit_time);
+
+	/* The first surface paces the frame count. */
+	if (surf == &bench->surfaces[0])
+		bench->frames++;
+
+	bench_surface_commit(surf);
+}
+
+static const struct wl_callback_listener bench_frame_listener = {
+	bench_frame_done
+};
+
+/* A new random rectangle of the buffer changes on every frame. */
+static void
+bench_surface_commit(struct bench_surface *surf)
+{
+	struct bench *bench = surf->bench;
+	pixman_color_t color;
+	pixman_box32_t box;
+	int w, h;
+
+	w = 1 + rand_r(&bench->seed) % surf->width;
+	h = 1 + rand_r(&bench->seed) % surf->height;
+	box.x1 = rand_r(&bench->seed) % (surf->width - w + 1);
+	box.y1 = rand_r(&bench->seed) % (surf->height - h + 1);
+	box.x2 = box.x1 + w;
+	box.y2 = box.y1 + h;
+
+	if (surf->image) {
+		color.red = rand_r(&bench->seed) & 0xffff;
+		color.green = rand_r(&bench->seed) & 0xffff;
+		color.blue = rand_r(&bench->seed) & 0xffff;
+		color.alpha = 0xffff;
+		pixman_image_fill_boxes(PIXMAN_OP_SRC, surf->image, &color,
+					1, &box);
+	}
+
+	wl_surface_attach(surf->wl_surface, surf->wl_buffer, 0, 0);
+	wl_surface_damage_buffer(surf->wl_surface, box.x1, box.y1, w, h);
+
+	surf->frame = wl_surface_frame(surf->wl_surface);
+	wl_callback_add_listener(surf->frame, &bench_frame_listener, surf);
+
+	clock_gettime(CLOCK_MONOTONIC, &surf->commit_time);
+	wl_surface_commit(surf->wl_surface);
+}
+
+/* Reads and dispatches the events of all clients, blocking until one of
+ * them has some. */
+static void
+bench_dispatch(struct bench *bench)
+{
+	struct pollfd *fds;
+	int i;
+
+	fds = xzalloc(bench->n_clients * sizeof fds[0]);
+
+	for (i = 0; i < bench->n_clients; i++) {
+		struct wl_display *display = bench->clients[i]->wl_display;
+
+		while (wl_display_prepare_read(display) != 0)
+			assert(wl_display_dispatch_pending(display) >= 0);
+		assert(wl_display_flush(display) >= 0);
+
+		fds[i].fd = wl_display_get_fd(display);
+		fds[i].events = POLLIN;
+	}
+
+	assert(poll(fds, bench->n_clients, -1) > 0);
+
+	for (i = 0; i < bench->n_clients; i++) {
+		struct wl_display *display = bench->clients[i]->wl_display;
+
+		if (fds[i].revents & POLLIN)
+			assert(wl_display_read_events(display) >= 0);
+		else
+			wl_display_cancel_read(display);
+
+		assert(wl_display_dispatch_pending(display) >= 0);
+	}
+
+	free(fds);
+}
+
+static uint64_t
+compositor_cpu_nsec(void)
+{
+	struct timespec process, thread;
+
+	/* The test runs on a thread of the compositor process. */
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &process);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &thread);
+
+	return timespec_to_nsec(&process) - timespec_to_nsec(&thread);
+}
+
+static int
+compare_int64(const void *a, const void *b)
+{
+	const int64_t *x = a;
+	const int64_t *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+static void
+bench_run(struct bench *bench, const char *scenario)
+{
+	static const char * const renderer_names[] = {
+		[RENDERER_NOOP] = "noop",
+		[RENDERER_PIXMAN] = "pixman",
+		[RENDERER_GL] = "gl",
+	};
+	const enum renderer_type *renderer =
+		&renderers[get_test_fixture_index()];
+	struct timespec start, end;
+	uint64_t cpu_start, cpu_nsec;
+	int64_t elapsed_nsec, p99;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	cpu_start = compositor_cpu_nsec();
+
+	for (i = 0; i < bench->n_surfaces; i++)
+		bench_surface_commit(&bench->surfaces[i]);
+
+	while (bench->frames < bench->target_frames)
+		bench_dispatch(bench);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	cpu_nsec = compositor_cpu_nsec() - cpu_start;
+	elapsed_nsec = timespec_sub_to_nsec(&end, &start);
+
+	/* Let the last frames complete, before destroying the clients. */
+	for (i = 0; i < bench->n_surfaces; i++) {
+		while (bench->surfaces[i].frame)
+			bench_dispatch(bench);
+	}
+
+	qsort(bench->latencies, bench->n_latencies,
+	      sizeof bench->latencies[0], compare_int64);
+	p99 = bench->latencies[(bench->n_latencies * 99 + 99) / 100 - 1];
+
+	testlog("bench %s %s: %d frames, %.1f frames/s, "
+		"%.3f ms CPU per frame, p99 latency %.3f ms\n",
+		renderer_names[*renderer], scenario, bench->frames,
+		bench->frames * 1e9 / elapsed_nsec,
+		cpu_nsec / 1e6 / bench->frames, p99 / 1e6);
+}
+
+static struct client *
+bench_create_client(struct bench *bench, int x, int y, int width, int height)
+{
+	struct client *client;
+
+	client = create_client_and_test_surface(x, y, width, height);
+	bench_add_client(bench, client);
+
+	return client;
+}
+
+static struct bench_surface *
+bench_add_client_surface(struct bench *bench, struct client *client)
+{
+	struct surface *surface = client->surface;
+
+	return bench_add_surface(bench, client, surface->wl_surface,
+				 surface->buffer->proxy,
+				 surface->buffer->image,
+				 surface->width, surface->height);
+}
+
+TEST(shm_clients_random_damage)
+{
+	struct bench bench;
+	struct client *client;
+	int i;
+
+	bench_init(&bench, BENCH_CLIENTS);
+
+	for (i = 0; i < BENCH_CLIENTS; i++) {
+		client = bench_create_client(&bench, i * 64, i * 32,
+					     BENCH_WIDTH / 2, BENCH_HEIGHT / 2);
+		bench_add_client_surface(&bench, client);
+	}
+
+	bench_run(&bench, "shm-clients");
+	bench_release(&bench);
+}
+
+#ifdef HAVE_GBM
+struct dmabuf_allocator {
+	int fd;
+	struct gbm_device *device;
+	struct zwp_linux_dmabuf_v1 *dmabuf;
+};
+
+struct dmabuf_params {
+	struct wl_buffer *buffer;
+	bool done;
+};
+
+static void
+dmabuf_params_created(void *data, struct zwp_linux_buffer_params_v1 *params,
+		      struct wl_buffer *buffer)
+{
+	struct dmabuf_params *result = data;
+
+	result->buffer = buffer;
+	result->done = true;
+}
+
+static void
+dmabuf_params_failed(void *data, struct zwp_linux_buffer_params_v1 *params)
+{
+	struct dmabuf_params *result = data;
+
+	result->done = true;
+}
+
+static const struct zwp_linux_buffer_params_v1_listener dmabuf_params_listener = {
+	dmabuf_params_created,
+	dmabuf_params_failed,
+};
+
+static bool
+dmabuf_allocator_init(struct dmabuf_allocator *alloc, struct client *client)
+{
+	const char *node = getenv("WESTON_BENCH_RENDER_NODE");
+	struct global *g;
+
+	memset(alloc, 0, sizeof *alloc);
+	alloc->fd = -1;
+
+	wl_list_for_each(g, &client->global_list, link) {
+		if (strcmp(g->interface, zwp_linux_dmabuf_v1_interface.name))
+			continue;
+
+		alloc->dmabuf = wl_registry_bind(client->wl_registry, g->name,
+						 &zwp_linux_dmabuf_v1_interface,
+						 1);
+	}
+
+	if (!alloc->dmabuf)
+		return false;
+
+	alloc->fd = open(node ? node : "/dev/dri/renderD128",
+			 O_RDWR | O_CLOEXEC);
+	if (alloc->fd < 0)
+		return false;
+
+	alloc->device = gbm_create_device(alloc->fd);
+
+	return alloc->device != NULL;
+}
+
+static void
+dmabuf_allocator_fini(struct dmabuf_allocator *alloc)
+{
+	if (alloc->device)
+		gbm_device_destroy(alloc->device);
+	if (alloc->fd >= 0)
+		close(alloc->fd);
+	if (alloc->dmabuf)
+		zwp_linux_dmabuf_v1_destroy(alloc->dmabuf);
+}
+
+/* The content of the buffer is never written, importing it is what costs. */
+static struct wl_buffer *
+dmabuf_create_buffer(struct dmabuf_allocator *alloc, struct client *client,
+		     int width, int height, struct gbm_bo **bo_out)
+{
+	struct zwp_linux_buffer_params_v1 *params;
+	struct dmabuf_params result = { NULL, false };
+	struct gbm_bo *bo;
+	int fd;
+
+	bo = gbm_bo_create(alloc->device, width, height, GBM_FORMAT_XRGB8888,
+			   GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR);
+	if (!bo)
+		return NULL;
+
+	fd = gbm_bo_get_fd(bo);
+	if (fd < 0) {
+		gbm_bo_destroy(bo);
+		return NULL;
+	}
+
+	params = zwp_linux_dmabuf_v1_create_params(alloc->dmabuf);
+	zwp_linux_buffer_params_v1_add(params, fd, 0, 0,
+				       gbm_bo_get_stride(bo),
+				       DRM_FORMAT_MOD_LINEAR >> 32,
+				       DRM_FORMAT_MOD_LINEAR & 0xffffffff);
+	zwp_linux_buffer_params_v1_add_listener(params,
+						&dmabuf_params_listener,
+						&result);
+	zwp_linux_buffer_params_v1_create(params, width, height,
+					  DRM_FORMAT_XRGB8888, 0);
+
+	while (!result.done)
+		assert(wl_display_dispatch(client->wl_display) >= 0);
+
+	zwp_linux_buffer_params_v1_destroy(params);
+	close(fd);
+
+	if (!result.buffer) {
+		gbm_bo_destroy(bo);
+		return NULL;
+	}
+
+	*bo_out = bo;
+
+	return result.buffer;
+}
+#endif
+
+TEST(dmabuf_clients)
+{
+#ifdef HAVE_GBM
+	struct dmabuf_allocator allocs[BENCH_CLIENTS];
+	struct wl_buffer *buffers[BENCH_CLIENTS] = { NULL };
+	struct gbm_bo *bos[BENCH_CLIENTS] = { NULL };
+	struct bench bench;
+	struct client *client;
+	bool ok = true;
+	int i;
+
+	bench_init(&bench, BENCH_CLIENTS);
+
+	for (i = 0; i < BENCH_CLIENTS; i++) {
+		memset(&allocs[i], 0, sizeof allocs[i]);
+		allocs[i].fd = -1;
+	}
+
+	for (i = 0; i < BENCH_CLIENTS; i++) {
+		client = bench_create_client(&bench, i * 64, i * 32,
+					     BENCH_WIDTH / 2, BENCH_HEIGHT / 2);
+
+		if (ok)
+			ok = dmabuf_allocator_init(&allocs[i], client);
+
+		if (ok)
+			buffers[i] = dmabuf_create_buffer(&allocs[i], client,
+							  BENCH_WIDTH / 2,
+							  BENCH_HEIGHT / 2,
+							  &bos[i]);
+		ok = ok && buffers[i];
+
+		bench_add_surface(&bench, client, client->surface->wl_surface,
+				  buffers[i], NULL,
+				  BENCH_WIDTH / 2, BENCH_HEIGHT / 2);
+	}
+
+	if (ok)
+		bench_run(&bench, "dmabuf-clients");
+	else
+		testlog("bench dmabuf-clients: no dmabuf import, skipped\n");
+
+	for (i = 0; i < BENCH_CLIENTS; i++) {
+		if (buffers[i])
+			wl_buffer_destroy(buffers[i]);
+		if (bos[i])
+			gbm_bo_destroy(bos[i]);
+		dmabuf_allocator_fini(&allocs[i]);
+	}
+	bench_release(&bench);
+#else
+	testlog("bench dmabuf-clients: built without gbm, skipped\n");
+#endif
+}
+
+/* Only the innermost subsurface is updated, the whole tree is walked on
+ * every repaint. */
+TEST(subsurface_tree)
+{
+	struct bench bench;
+	struct client *client;
+	struct wl_subcompositor *subco;
+	struct wl_surface *parent;
+	struct wl_surface *surfaces[BENCH_SUBSURFACE_DEPTH];
+	struct wl_subsurface *subsurfaces[BENCH_SUBSURFACE_DEPTH];
+	struct buffer *buffers[BENCH_SUBSURFACE_DEPTH];
+	int width = BENCH_WIDTH / 2;
+	int height = BENCH_HEIGHT / 2;
+	int i;
+
+	bench_init(&bench, 1);
+
+	client = bench_create_client(&bench, 0, 0, BENCH_WIDTH, BENCH_HEIGHT);
+	subco = bind_to_singleton_global(client, &wl_subcompositor_interface, 1);
+
+	parent = client->surface->wl_surface;
+	for (i = 0; i < BENCH_SUBSURFACE_DEPTH; i++) {
+		surfaces[i] = wl_compositor_create_surface(client->wl_compositor);
+		subsurfaces[i] = wl_subcompositor_get_subsurface(subco,
+								 surfaces[i],
+								 parent);
+		wl_subsurface_set_position(subsurfaces[i], 8, 8);
+		wl_subsurface_set_desync(subsurfaces[i]);
+
+		buffers[i] = create_shm_buffer_a8r8g8b8(client, width, height);
+		wl_surface_attach(surfaces[i], buffers[i]->proxy, 0, 0);
+		wl_surface_damage_buffer(surfaces[i], 0, 0, width, height);
+		wl_surface_commit(surfaces[i]);
+
+		parent = surfaces[i];
+	}
+	wl_surface_commit(client->surface->wl_surface);
+	client_roundtrip(client);
+
+	i = BENCH_SUBSURFACE_DEPTH - 1;
+	bench_add_surface(&bench, client, surfaces[i], buffers[i]->proxy,
+			  buffers[i]->image, width, height);
+
+	bench_run(&bench, "subsurface-tree");
+
+	for (i = BENCH_SUBSURFACE_DEPTH - 1; i >= 0; i--) {
+		wl_subsurface_destroy(subsurfaces[i]);
+		wl_surface_destroy(surfaces[i]);
+		buffer_destroy(buffers[i]);
+	}
+	wl_subcompositor_destroy(subco);
+	bench_release(&bench);
+}
+
+TEST(scaled_views)
+{
+	struct bench bench;
+	struct client *client;
+	struct wp_viewport *viewports[BENCH_CLIENTS];
+	int i;
+
+	bench_init(&bench, BENCH_CLIENTS);
+
+	for (i = 0; i < BENCH_CLIENTS; i++) {
+		client = bench_create_client(&bench, i * 64, i * 32,
+					     BENCH_WIDTH / 4, BENCH_HEIGHT / 4);
+		viewports[i] = client_create_viewport(client);
+		wp_viewport_set_destination(viewports[i],
+					    BENCH_WIDTH / 2 + 3,
+					    BENCH_HEIGHT / 2 + 3);
+		bench_add_client_surface(&bench, client);
+	}
+
+	bench_run(&bench, "scaled-views");
+
+	for (i = 0; i < BENCH_CLIENTS; i++)
+		wp_viewport_destroy(viewports[i]);
+	bench_release(&bench);
+}
+
+TEST(rotated_views)
+{
+	struct bench bench;
+	struct client *client;
+	int i;
+
+	bench_init(&bench, BENCH_CLIENTS);
+
+	for (i = 0; i < BENCH_CLIENTS; i++) {
+		/* The buffer is portrait, shown landscape. */
+		client = bench_create_client(&bench, i * 64, i * 32,
+					     BENCH_HEIGHT / 2, BENCH_WIDTH / 2);
+		wl_surface_set_buffer_transform(client->surface->wl_surface,
+						WL_OUTPUT_TRANSFORM_90);
+		bench_add_client_surface(&bench, client);
+	}
+
+	bench_run(&bench, "rotated-views");
+	bench_release(&bench);
+}
@@ -766,3 +766,103 @@ TEST(test_subsurface_destroy_permutations)
 	client_roundtrip(client);
 	testlog("tried %d destroy permutations\n", counter);
 }
+
+static void
+commit_and_wait_frame(struct client *client, struct wl_surface *surface)
+{
+	int frame;
+
+	frame_callback_set(surface, &frame);
+	wl_surface_commit(surface);
+	frame_callback_wait(client, &frame);
+}
+
+static struct surface *
+pointer_focus_at(struct client *client, int x, int y)
+{
+	weston_test_move_pointer(client->test->weston_test, 0, 1, 0, x, y);
+	client_roundtrip(client);
+
+	return client->input->pointer->focus;
+}
+
+static void
+set_input_rect(struct client *client, struct wl_surface *surface,
+	       int x, int y, int width, int height)
+{
+	struct wl_region *region;
+
+	region = wl_compositor_create_region(client->wl_compositor);
+	wl_region_add(region, x, y, width, height);
+	wl_surface_set_input_region(surface, region);
+	wl_region_destroy(region);
+}
+
+/* The regions of a synchronized sub-surface only take effect with the parent
+ * commit, from however many commits went into the cache in between. */
+TEST(test_subsurface_sync_cached_input_region)
+{
+	struct client *client;
+	struct wl_subcompositor *subco;
+	struct wl_subsurface *sub;
+	struct surface *parent, *child;
+	struct buffer *buffer;
+
+	/* the sub-surface covers its parent, at 100,50 */
+	client = create_client_and_test_surface(100, 50, 100, 100);
+	assert(client);
+	parent = client->surface;
+	subco = get_subcompositor(client);
+
+	child = create_test_surface(client);
+	sub = wl_subcompositor_get_subsurface(subco, child->wl_surface,
+					      parent->wl_surface);
+	buffer = create_shm_buffer_a8r8g8b8(client, 100, 100);
+
+	/* left half */
+	wl_surface_attach(child->wl_surface, buffer->proxy, 0, 0);
+	wl_surface_damage(child->wl_surface, 0, 0, 100, 100);
+	set_input_rect(client, child->wl_surface, 0, 0, 50, 100);
+	wl_surface_commit(child->wl_surface);
+	commit_and_wait_frame(client, parent->wl_surface);
+
+	assert(pointer_focus_at(client, 125, 100) == child);
+	assert(pointer_focus_at(client, 175, 100) == parent);
+
+	/* right half, cached over two commits */
+	set_input_rect(client, child->wl_surface, 50, 0, 50, 100);
+	wl_surface_commit(child->wl_surface);
+	wl_surface_damage(child->wl_surface, 0, 0, 10, 10);
+	wl_surface_commit(child->wl_surface);
+	client_roundtrip(client);
+
+	assert(pointer_focus_at(client, 125, 100) == child);
+	assert(pointer_focus_at(client, 175, 100) == parent);
+
+	commit_and_wait_frame(client, parent->wl_surface);
+
+	assert(pointer_focus_at(client, 125, 100) == parent);
+	assert(pointer_focus_at(client, 175, 100) == child);
+
+	/* a commit without a new region keeps the cached one */
+	wl_surface_damage(child->wl_surface, 0, 0, 10, 10);
+	wl_surface_commit(child->wl_surface);
+	commit_and_wait_frame(client, parent->wl_surface);
+
+	assert(pointer_focus_at(client, 125, 100) == parent);
+	assert(pointer_focus_at(client, 175, 100) == child);
+
+	/* back to all of the sub-surface */
+	wl_surface_set_input_region(child->wl_surface, NULL);
+	wl_surface_commit(child->wl_surface);
+	commit_and_wait_frame(client, parent->wl_surface);
+
+	assert(pointer_focus_at(client, 125, 100) == child);
+	assert(pointer_focus_at(client, 175, 100) == child);
+
+	wl_subsurface_destroy(sub);
+	surface_destroy(child);
+	buffer_destroy(buffer);
+	wl_subcompositor_destroy(subco);
+	client_destroy(client);
+}
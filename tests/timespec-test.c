@@ -113,6 +113,12 @@ ZUC_TEST(timespec_test, millihz_to_nsec)
 	ZUC_ASSERT_EQ(millihz_to_nsec(60000), 16666666);
 }
 
+ZUC_TEST(timespec_test, millihz_from_nsec)
+{
+	ZUC_ASSERT_EQ(millihz_from_nsec(16666666), 60000);
+	ZUC_ASSERT_EQ(millihz_from_nsec(16666667), 60000);
+}
+
 ZUC_TEST(timespec_test, timespec_add_nsec)
 {
 	struct timespec a, r;
@@ -0,0 +1,165 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include <libweston/libweston.h>
+#include "libweston-internal.h"
+#include "shared/helpers.h"
+#include "shared/xalloc.h"
+#include "weston-test-runner.h"
+#include "weston-test-fixture-compositor.h"
+
+static enum test_result_code
+fixture_setup(struct weston_test_harness *harness)
+{
+	struct compositor_setup setup;
+
+	compositor_setup_defaults(&setup);
+
+	return weston_test_harness_execute_as_plugin(harness, &setup);
+}
+DECLARE_FIXTURE_SETUP(fixture_setup);
+
+static const pixman_box32_t src_boxes[] = {
+	{ 0, 0, 10, 10 },
+	{ 20, 5, 35, 35 },
+	{ -8, -3, -4, 1 },
+	{ 100, 200, 101, 201 },
+};
+
+/* Transform every rectangle through the full matrix, what
+ * weston_matrix_transform_region() does for matrices without a fast path. */
+static void
+transform_region_reference(pixman_region32_t *dest,
+			   struct weston_matrix *matrix,
+			   pixman_region32_t *src)
+{
+	pixman_box32_t *rects, *out;
+	int n, i;
+
+	rects = pixman_region32_rectangles(src, &n);
+	out = xzalloc(n * sizeof *out);
+
+	for (i = 0; i < n; i++) {
+		struct weston_vector v1 = {{ rects[i].x1, rects[i].y1, 0, 1 }};
+		struct weston_vector v2 = {{ rects[i].x2, rects[i].y2, 0, 1 }};
+
+		weston_matrix_transform(matrix, &v1);
+		weston_matrix_transform(matrix, &v2);
+
+		out[i].x1 = floor(MIN(v1.f[0] / v1.f[3], v2.f[0] / v2.f[3]));
+		out[i].x2 = ceil(MAX(v1.f[0] / v1.f[3], v2.f[0] / v2.f[3]));
+		out[i].y1 = floor(MIN(v1.f[1] / v1.f[3], v2.f[1] / v2.f[3]));
+		out[i].y2 = ceil(MAX(v1.f[1] / v1.f[3], v2.f[1] / v2.f[3]));
+	}
+
+	pixman_region32_init_rects(dest, out, n);
+	free(out);
+}
+
+/* Check the result against the reference, both into another region and
+ * in place. */
+static void
+check_transform_region(struct weston_matrix *matrix)
+{
+	pixman_region32_t src, dest, expected;
+
+	pixman_region32_init_rects(&src, src_boxes, ARRAY_LENGTH(src_boxes));
+	pixman_region32_init(&dest);
+	transform_region_reference(&expected, matrix, &src);
+
+	weston_matrix_transform_region(&dest, matrix, &src);
+	assert(pixman_region32_equal(&dest, &expected));
+
+	weston_matrix_transform_region(&src, matrix, &src);
+	assert(pixman_region32_equal(&src, &expected));
+
+	pixman_region32_fini(&expected);
+	pixman_region32_fini(&dest);
+	pixman_region32_fini(&src);
+}
+
+struct transform_region_case {
+	float sx, sy;
+	float tx, ty;
+};
+
+static const struct transform_region_case transform_region_cases[] = {
+	/* identity */
+	{ 1.0f, 1.0f, 0.0f, 0.0f },
+	/* translations by whole pixels */
+	{ 1.0f, 1.0f, 10.0f, -7.0f },
+	{ 1.0f, 1.0f, -300.0f, 0.0f },
+	/* fractional translations */
+	{ 1.0f, 1.0f, 0.5f, -2.25f },
+	{ 1.0f, 1.0f, -0.75f, 3.0f },
+	/* scales */
+	{ 2.0f, 2.0f, 0.0f, 0.0f },
+	{ 0.5f, 1.5f, 0.0f, 0.0f },
+	{ 1.25f, 0.75f, 4.5f, -1.5f },
+	/* negative scales, flipping the boxes */
+	{ -1.0f, 1.0f, 0.0f, 0.0f },
+	{ 1.0f, -1.0f, 0.0f, 240.0f },
+	{ -2.0f, -0.5f, 320.5f, 0.25f },
+};
+
+PLUGIN_TEST(transform_region_fast_paths)
+{
+	/* struct weston_compositor *compositor; */
+	struct weston_matrix matrix;
+	unsigned i;
+
+	for (i = 0; i < ARRAY_LENGTH(transform_region_cases); i++) {
+		const struct transform_region_case *c =
+			&transform_region_cases[i];
+
+		weston_matrix_init(&matrix);
+		if (c->sx != 1.0f || c->sy != 1.0f)
+			weston_matrix_scale(&matrix, c->sx, c->sy, 1.0f);
+		if (c->tx != 0.0f || c->ty != 0.0f)
+			weston_matrix_translate(&matrix, c->tx, c->ty, 0.0f);
+
+		testlog("case %u: scale %f,%f translate %f,%f\n", i,
+			c->sx, c->sy, c->tx, c->ty);
+		check_transform_region(&matrix);
+	}
+}
+
+PLUGIN_TEST(transform_region_rotation)
+{
+	/* struct weston_compositor *compositor; */
+	struct weston_matrix matrix;
+
+	/* 90 degrees, through the full matrix */
+	weston_matrix_init(&matrix);
+	weston_matrix_rotate_xy(&matrix, 0.0f, 1.0f);
+	weston_matrix_translate(&matrix, 0.5f, 10.0f, 0.0f);
+	check_transform_region(&matrix);
+}
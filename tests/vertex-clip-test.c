@@ -26,6 +26,9 @@
 #include "config.h"
 
 #include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "weston-test-runner.h"
@@ -211,6 +214,151 @@ TEST_P(clip_polygon_expected_vertices, test_data)
 	}
 }
 
+static void
+make_rect(struct polygon8 *p, float x1, float y1, float x2, float y2,
+	  int start, bool reverse)
+{
+	const float x[4] = { x1, x2, x2, x1 };
+	const float y[4] = { y1, y1, y2, y2 };
+	int i, k;
+
+	for (i = 0; i < 4; i++) {
+		k = reverse ? (start + 4 - i) % 4 : (start + i) % 4;
+		p->x[i] = x[k];
+		p->y[i] = y[k];
+	}
+	p->n = 4;
+}
+
+static float
+grid_coord(unsigned int *seed)
+{
+	/* Small steps, so that edges often coincide with clip edges */
+	return (rand_r(seed) % 25) * 0.5f - 2.0f;
+}
+
+TEST(clip_axis_aligned_matches_transformed)
+{
+	unsigned int seed = 1;
+	int iter, i, n_ref, n;
+
+	for (iter = 0; iter < 100000; iter++) {
+		struct clip_context ctx;
+		struct polygon8 ref, rect;
+		float ref_x[8], ref_y[8], ex[8], ey[8];
+		float x1 = grid_coord(&seed), x2 = grid_coord(&seed);
+		float y1 = grid_coord(&seed), y2 = grid_coord(&seed);
+		pixman_box32_t box;
+		uint8_t class;
+
+		box.x1 = rand_r(&seed) % 6;
+		box.y1 = rand_r(&seed) % 6;
+		box.x2 = box.x1 + 1 + rand_r(&seed) % 6;
+		box.y2 = box.y1 + 1 + rand_r(&seed) % 6;
+		ctx.clip.x1 = box.x1;
+		ctx.clip.y1 = box.y1;
+		ctx.clip.x2 = box.x2;
+		ctx.clip.y2 = box.y2;
+
+		make_rect(&rect, x1, y1, x2, y2, rand_r(&seed) % 4,
+			  rand_r(&seed) % 2);
+		ref = rect;
+
+		clip_classify_boxes(&rect, &box, 1, &class);
+		if (class == CLIP_BOX_OUTSIDE)
+			continue;
+
+		n_ref = clip_transformed(&ctx, &ref, ref_x, ref_y);
+		n = clip_axis_aligned(&ctx, &rect, ex, ey);
+
+		assert(n == n_ref);
+		for (i = 0; i < n; i++) {
+			assert(ex[i] == ref_x[i]);
+			assert(ey[i] == ref_y[i]);
+		}
+	}
+}
+
+static enum clip_box_class
+reference_class(const struct polygon8 *p, const pixman_box32_t *box)
+{
+	bool all_in = true, any_x1 = false, any_x2 = false;
+	bool any_y1 = false, any_y2 = false;
+	int i;
+
+	for (i = 0; i < p->n; i++) {
+		all_in = all_in && p->x[i] >= box->x1 && p->x[i] < box->x2 &&
+			 p->y[i] >= box->y1 && p->y[i] < box->y2;
+		any_x1 = any_x1 || p->x[i] > box->x1;
+		any_x2 = any_x2 || p->x[i] < box->x2;
+		any_y1 = any_y1 || p->y[i] > box->y1;
+		any_y2 = any_y2 || p->y[i] < box->y2;
+	}
+
+	if (!any_x1 || !any_x2 || !any_y1 || !any_y2)
+		return CLIP_BOX_OUTSIDE;
+
+	return all_in ? CLIP_BOX_INSIDE : CLIP_BOX_PARTIAL;
+}
+
+TEST(clip_classify_boxes_matches_reference)
+{
+	unsigned int seed = 2;
+	pixman_box32_t boxes[13];
+	uint8_t classes[13];
+	int iter, i, j, k, nboxes, n_ref, n;
+
+	for (iter = 0; iter < 20000; iter++) {
+		struct polygon8 quad, ref;
+		float ref_x[8], ref_y[8], ex[8], ey[8];
+		float a = (rand_r(&seed) % 360) * M_PI / 180.0f;
+		float cx = rand_r(&seed) % 40, cy = rand_r(&seed) % 40;
+		float w = 1 + rand_r(&seed) % 20, h = 1 + rand_r(&seed) % 20;
+
+		/* A rectangle rotated around its center */
+		for (i = 0; i < 4; i++) {
+			float dx = (i == 1 || i == 2) ? w : -w;
+			float dy = (i >= 2) ? h : -h;
+
+			quad.x[i] = cx + dx * cosf(a) - dy * sinf(a);
+			quad.y[i] = cy + dx * sinf(a) + dy * cosf(a);
+		}
+		quad.n = 4;
+
+		nboxes = rand_r(&seed) % ARRAY_LENGTH(boxes);
+		for (j = 0; j < nboxes; j++) {
+			boxes[j].x1 = rand_r(&seed) % 50 - 5;
+			boxes[j].y1 = rand_r(&seed) % 50 - 5;
+			boxes[j].x2 = boxes[j].x1 + 1 + rand_r(&seed) % 40;
+			boxes[j].y2 = boxes[j].y1 + 1 + rand_r(&seed) % 40;
+		}
+
+		clip_classify_boxes(&quad, boxes, nboxes, classes);
+
+		for (j = 0; j < nboxes; j++) {
+			struct clip_context ctx;
+
+			assert(classes[j] == reference_class(&quad, &boxes[j]));
+			if (classes[j] != CLIP_BOX_INSIDE)
+				continue;
+
+			ctx.clip.x1 = boxes[j].x1;
+			ctx.clip.y1 = boxes[j].y1;
+			ctx.clip.x2 = boxes[j].x2;
+			ctx.clip.y2 = boxes[j].y2;
+			ref = quad;
+			n_ref = clip_transformed(&ctx, &ref, ref_x, ref_y);
+			n = clip_inside(&quad, ex, ey);
+
+			assert(n == n_ref);
+			for (k = 0; k < n; k++) {
+				assert(ex[k] == ref_x[k]);
+				assert(ey[k] == ref_y[k]);
+			}
+		}
+	}
+}
+
 TEST(float_difference_different)
 {
 	assert(float_difference(1.0f, 0.0f) == 1.0f);
@@ -0,0 +1,109 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+
+#include <libweston/libweston.h>
+#include "libweston-internal.h"
+#include "weston-test-runner.h"
+#include "weston-test-fixture-compositor.h"
+
+static enum test_result_code
+fixture_setup(struct weston_test_harness *harness)
+{
+	struct compositor_setup setup;
+
+	compositor_setup_defaults(&setup);
+
+	return weston_test_harness_execute_as_plugin(harness, &setup);
+}
+DECLARE_FIXTURE_SETUP(fixture_setup);
+
+static bool
+region_contains_box(pixman_region32_t *region,
+		    int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+	pixman_box32_t box = { x1, y1, x2, y2 };
+
+	return pixman_region32_contains_rectangle(region, &box) ==
+	       PIXMAN_REGION_IN;
+}
+
+static bool
+region_overlaps_box(pixman_region32_t *region,
+		    int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+	pixman_box32_t box = { x1, y1, x2, y2 };
+
+	return pixman_region32_contains_rectangle(region, &box) !=
+	       PIXMAN_REGION_OUT;
+}
+
+/* Moving a view damages where it was last painted and where it is now, once,
+ * but not the positions it went through in between. */
+PLUGIN_TEST(view_move_damage)
+{
+	/* struct weston_compositor *compositor; */
+	pixman_region32_t *damage = &compositor->primary_plane.damage;
+	struct weston_surface *surface;
+	struct weston_view *view;
+
+	surface = weston_surface_create(compositor);
+	assert(surface);
+	view = weston_view_create(surface);
+	assert(view);
+	surface->width = 50;
+	surface->height = 50;
+	weston_view_set_position(view, 0, 0);
+	weston_view_update_transform(view);
+	weston_view_move_to_plane(view, &compositor->primary_plane);
+
+	/* As if the view had just been painted */
+	pixman_region32_clear(damage);
+
+	weston_view_set_position(view, 400, 0);
+	weston_view_update_transform(view);
+	weston_view_set_position(view, 0, 300);
+	weston_view_update_transform(view);
+
+	/* Nothing is damaged until the next repaint collects it */
+	assert(!pixman_region32_not_empty(damage));
+
+	weston_view_damage_below(view);
+
+	assert(region_contains_box(damage, 0, 0, 50, 50));
+	assert(region_contains_box(damage, 0, 300, 50, 350));
+	assert(!region_overlaps_box(damage, 400, 0, 450, 50));
+
+	/* The move damage is only added once */
+	pixman_region32_clear(damage);
+	weston_view_damage_below(view);
+	assert(!region_overlaps_box(damage, 0, 0, 50, 50));
+	assert(region_contains_box(damage, 0, 300, 50, 350));
+
+	weston_surface_destroy(surface);
+}
@@ -0,0 +1,186 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <libweston/libweston.h>
+#include "weston-test-runner.h"
+
+#include "shared/xalloc.h"
+#include "view-grid.h"
+
+#define VIEW_COUNT 300
+
+struct grid_scene {
+	struct wl_list view_list;
+	struct weston_view views[VIEW_COUNT + 2];
+	struct weston_view_grid *grid;
+};
+
+static uint32_t
+next_random(uint32_t *seed)
+{
+	*seed = *seed * 1103515245u + 12345u;
+	return *seed >> 8;
+}
+
+static void
+scene_add_view(struct grid_scene *scene, struct weston_view *view,
+	       int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	pixman_region32_init_rect(&view->transform.boundingbox,
+				  x, y, width, height);
+	wl_list_insert(scene->view_list.prev, &view->link);
+}
+
+/* Mostly small views like sub-surfaces and tooltips, some of them at
+ * negative coordinates, under a view too large to be bucketed and an empty
+ * one. */
+static struct grid_scene *
+scene_create(void)
+{
+	struct grid_scene *scene = xzalloc(sizeof *scene);
+	uint32_t seed = 1;
+	int i;
+
+	wl_list_init(&scene->view_list);
+	for (i = 0; i < VIEW_COUNT; i++)
+		scene_add_view(scene, &scene->views[i],
+			       (int32_t)(next_random(&seed) % 4000) - 500,
+			       (int32_t)(next_random(&seed) % 3000) - 500,
+			       1 + next_random(&seed) % 300,
+			       1 + next_random(&seed) % 300);
+	scene_add_view(scene, &scene->views[VIEW_COUNT], 0, 0, 0, 0);
+	scene_add_view(scene, &scene->views[VIEW_COUNT + 1],
+		       -1000, -1000, 6000, 5000);
+
+	scene->grid = weston_view_grid_create();
+	assert(scene->grid);
+
+	return scene;
+}
+
+static void
+scene_destroy(struct grid_scene *scene)
+{
+	int i;
+
+	weston_view_grid_destroy(scene->grid);
+	for (i = 0; i < VIEW_COUNT + 2; i++)
+		pixman_region32_fini(&scene->views[i].transform.boundingbox);
+	free(scene);
+}
+
+/* The candidates that really contain the point must be exactly the views of
+ * the list containing it, in the same order, so that picking the first one
+ * is the same as walking the whole list. */
+static void
+check_point(struct grid_scene *scene, int32_t x, int32_t y)
+{
+	struct weston_view_grid_cursor cursor;
+	struct weston_view *view, *expected;
+
+	weston_view_grid_lookup(scene->grid, &scene->view_list, x, y, &cursor);
+
+	expected = wl_container_of(scene->view_list.next, expected, link);
+	while ((view = weston_view_grid_cursor_next(&cursor))) {
+		if (!pixman_region32_contains_point(
+				&view->transform.boundingbox, x, y, NULL))
+			continue;
+
+		while (&expected->link != &scene->view_list &&
+		       !pixman_region32_contains_point(
+				&expected->transform.boundingbox, x, y, NULL))
+			expected = wl_container_of(expected->link.next,
+						   expected, link);
+
+		assert(view == expected);
+		expected = wl_container_of(expected->link.next, expected, link);
+	}
+
+	while (&expected->link != &scene->view_list) {
+		assert(!pixman_region32_contains_point(
+				&expected->transform.boundingbox, x, y, NULL));
+		expected = wl_container_of(expected->link.next, expected, link);
+	}
+}
+
+static void
+check_scene(struct grid_scene *scene)
+{
+	int32_t x, y;
+
+	for (y = -1100; y < 4100; y += 37)
+		for (x = -1100; x < 5100; x += 41)
+			check_point(scene, x, y);
+
+	/* cell borders */
+	check_point(scene, -1, -1);
+	check_point(scene, 0, 0);
+	check_point(scene, 127, 128);
+	check_point(scene, -128, -129);
+}
+
+TEST(view_grid_matches_view_list)
+{
+	struct grid_scene *scene = scene_create();
+
+	check_scene(scene);
+
+	scene_destroy(scene);
+}
+
+TEST(view_grid_follows_changes)
+{
+	struct grid_scene *scene = scene_create();
+	struct weston_view *view = &scene->views[7];
+
+	check_scene(scene);
+
+	/* move a view */
+	pixman_region32_fini(&view->transform.boundingbox);
+	pixman_region32_init_rect(&view->transform.boundingbox,
+				  -700, 2000, 250, 40);
+	weston_view_grid_mark_dirty(scene->grid);
+	check_scene(scene);
+
+	/* restack it to the top */
+	wl_list_remove(&view->link);
+	wl_list_insert(&scene->view_list, &view->link);
+	weston_view_grid_mark_dirty(scene->grid);
+	check_scene(scene);
+
+	/* and remove it */
+	wl_list_remove(&view->link);
+	weston_view_grid_mark_dirty(scene->grid);
+	check_scene(scene);
+
+	scene_destroy(scene);
+}
@@ -178,6 +178,7 @@ compositor_setup_defaults_(struct compositor_setup *setup,
 		.height = 240,
 		.scale = 1,
 		.transform = WL_OUTPUT_TRANSFORM_NORMAL,
+		.unthrottled = false,
 		.config_file = NULL,
 		.extra_module = NULL,
 		.logging_scopes = NULL,
@@ -390,6 +391,9 @@ execute_compositor(const struct compositor_setup *setup,
 		prog_args_take(&args, tmp);
 	}
 
+	if (setup->unthrottled && setup->backend == WESTON_BACKEND_HEADLESS)
+		prog_args_take(&args, strdup("--unthrottled"));
+
 	if (setup->config_file) {
 		asprintf(&tmp, "--config=%s", setup->config_file);
 		prog_args_take(&args, tmp);
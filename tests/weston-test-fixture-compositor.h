@@ -87,6 +87,9 @@ struct compositor_setup {
 	int scale;
 	/** Default output transform, one of WL_OUTPUT_TRANSFORM_*. */
 	enum wl_output_transform transform;
+	/** Whether headless outputs complete frames as soon as they are
+	 * rendered, for benchmarks. */
+	bool unthrottled;
 	/** The absolute path to \c weston.ini to use,
 	 * or NULL for \c --no-config . */
 	const char *config_file;
@@ -116,6 +119,7 @@ compositor_setup_defaults_(struct compositor_setup *setup,
  * - height: 240
  * - scale: 1
  * - transform: WL_OUTPUT_TRANSFORM_NORMAL
+ * - unthrottled: no
  * - config_file: none
  * - extra_module: none
  * - logging_scopes: compositor defaults
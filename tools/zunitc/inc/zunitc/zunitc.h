@@ -308,6 +308,132 @@ zuc_set_output_junit(bool enable);
 	static void zuctest_##tcase##_##test(void *param)
 
 
+/**
+ * Opaque state of a running benchmark.
+ *
+ * @see ZUC_BENCH()
+ */
+struct zuc_bench;
+
+/**
+ * Defines a benchmark, a test whose body times a loop.
+ *
+ * The body must run the code to measure in a loop controlled by
+ * zuc_bench_next(). The framework decides how many iterations one sample
+ * takes and how many samples are taken.
+ *
+ * Without --zuc-bench a benchmark runs its loop once, so it still works
+ * as a quick test. With --zuc-bench it is warmed up, the iteration count
+ * is scaled until a sample lasts at least --zuc-bench-min-time
+ * milliseconds, and --zuc-bench-samples samples are timed. The median,
+ * median absolute deviation, 99th percentile, minimum and mean time per
+ * iteration are then reported.
+ *
+ * @code
+ * ZUC_BENCH(matrix, multiply, bench)
+ * {
+ *	struct weston_matrix a, b;
+ *
+ *	weston_matrix_init(&a);
+ *	while (zuc_bench_next(bench)) {
+ *		b = a;
+ *		weston_matrix_multiply(&b, &a);
+ *		zuc_bench_use(&b);
+ *	}
+ * }
+ * @endcode
+ *
+ * @param tcase name to use as the containing test case.
+ * @param test name used for the benchmark under a given test case.
+ * @param param name for the struct zuc_bench pointer.
+ */
+#define ZUC_BENCH(tcase, test, param) \
+	static void zucbench_##tcase##_##test(struct zuc_bench *param); \
+	\
+	ZUC_TEST(tcase, test) \
+	{ \
+		zucimpl_run_bench(#tcase, #test, \
+				  zucbench_##tcase##_##test); \
+	} \
+	\
+	static void zucbench_##tcase##_##test(struct zuc_bench *param)
+
+/**
+ * Advances the loop of a benchmark.
+ *
+ * The first call starts the clock and the call that returns false stops it.
+ *
+ * @param bench the benchmark state passed to the body.
+ * @return true while there are iterations left to run.
+ */
+bool
+zuc_bench_next(struct zuc_bench *bench);
+
+/**
+ * Stops the clock of a benchmark, e.g. to reset state between iterations
+ * without measuring it.
+ *
+ * @param bench the benchmark state passed to the body.
+ * @see zuc_bench_resume()
+ */
+void
+zuc_bench_pause(struct zuc_bench *bench);
+
+/**
+ * Restarts the clock of a benchmark stopped with zuc_bench_pause().
+ *
+ * @param bench the benchmark state passed to the body.
+ */
+void
+zuc_bench_resume(struct zuc_bench *bench);
+
+/**
+ * Keeps the compiler from optimizing away a result that is otherwise
+ * unused.
+ *
+ * @param ptr pointer to the result.
+ */
+void
+zuc_bench_use(const void *ptr);
+
+/**
+ * Enables measuring benchmarks instead of running each once.
+ * Defaults to false.
+ *
+ * @param enable true to time benchmarks.
+ */
+void
+zuc_set_bench(bool enable);
+
+/**
+ * Sets the number of timed samples of each benchmark.
+ * Defaults to 21.
+ *
+ * @param samples the number of samples, at least 1.
+ */
+void
+zuc_set_bench_samples(int samples);
+
+/**
+ * Sets the minimum duration of one benchmark sample, the iteration count
+ * is scaled up until it is reached.
+ * Defaults to 10 milliseconds.
+ *
+ * @param msec the minimum sample duration in milliseconds.
+ */
+void
+zuc_set_bench_min_time(int msec);
+
+/**
+ * Appends the results of each benchmark to a file as one JSON object per
+ * line, so results of separate runs can be compared by scripts.
+ * Defaults to NULL, no file.
+ *
+ * @param path the file to append to, or NULL.
+ */
+void
+zuc_set_bench_json(const char *path);
+
 /**
  * Returns true if the currently executing test has encountered any skips.
  *
@@ -66,6 +66,10 @@ typedef void (*zucimpl_test_fn)(void);
 
 typedef void (*zucimpl_test_fn_f)(void *);
 
+struct zuc_bench;
+
+typedef void (*zucimpl_bench_fn)(struct zuc_bench *);
+
 /**
  * Internal use structure for automatic test case registration.
  * Should not be used directly in code.
@@ -87,6 +91,9 @@ void
 zucimpl_terminate(char const *file, int line,
 		  bool fail, bool fatal, const char *msg);
 
+void
+zucimpl_run_bench(const char *tcase, const char *test, zucimpl_bench_fn fn);
+
 int
 zucimpl_tracepoint(char const *file, int line, const char *fmt, ...)
 	__attribute__ ((format (printf, 3, 4)));
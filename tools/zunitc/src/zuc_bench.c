@@ -0,0 +1,342 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shared/timespec-util.h"
+#include "zunitc/zunitc.h"
+
+/**
+ * @file
+ * Timing of ZUC_BENCH() benchmarks.
+ *
+ * The statistics are robust against the outliers scheduling and frequency
+ * scaling produce: the median and the median absolute deviation are what
+ * should be compared between runs, the mean is only given for reference.
+ */
+
+/* Upper bound on the growth of the iteration count between two
+ * calibration runs, in case a run was too short to measure. */
+#define BENCH_MAX_GROWTH 10
+#define BENCH_MAX_ITERATIONS (UINT64_C(1) << 32)
+
+struct zuc_bench {
+	uint64_t remaining;
+	bool running;
+	bool ran;
+	bool paused;
+	struct timespec begin;
+	struct timespec pause_begin;
+	int64_t elapsed_nsec;
+};
+
+struct bench_stats {
+	double median;
+	double mad;
+	double p99;
+	double min;
+	double mean;
+};
+
+static struct {
+	bool enabled;
+	int samples;
+	int min_time_msec;
+	char *json_path;
+} g_bench = {
+	.enabled = false,
+	.samples = 21,
+	.min_time_msec = 10,
+	.json_path = NULL,
+};
+
+void
+zuc_set_bench(bool enable)
+{
+	g_bench.enabled = enable;
+}
+
+void
+zuc_set_bench_samples(int samples)
+{
+	g_bench.samples = samples > 0 ? samples : 1;
+}
+
+void
+zuc_set_bench_min_time(int msec)
+{
+	g_bench.min_time_msec = msec > 0 ? msec : 1;
+}
+
+void
+zuc_set_bench_json(const char *path)
+{
+	free(g_bench.json_path);
+	g_bench.json_path = path ? strdup(path) : NULL;
+}
+
+bool
+zuc_bench_next(struct zuc_bench *bench)
+{
+	struct timespec now;
+
+	if (!bench->running) {
+		bench->running = true;
+		bench->ran = true;
+		bench->paused = false;
+		bench->elapsed_nsec = 0;
+		clock_gettime(CLOCK_MONOTONIC, &bench->begin);
+	}
+
+	if (bench->remaining > 0) {
+		bench->remaining--;
+		return true;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (bench->paused)
+		now = bench->pause_begin;
+	bench->elapsed_nsec += timespec_sub_to_nsec(&now, &bench->begin);
+	bench->running = false;
+
+	return false;
+}
+
+void
+zuc_bench_pause(struct zuc_bench *bench)
+{
+	if (!bench->running || bench->paused)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &bench->pause_begin);
+	bench->paused = true;
+}
+
+void
+zuc_bench_resume(struct zuc_bench *bench)
+{
+	struct timespec now;
+
+	if (!bench->running || !bench->paused)
+		return;
+
+	/* Move the start forward by the paused time. */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	bench->elapsed_nsec -= timespec_sub_to_nsec(&now, &bench->pause_begin);
+	bench->paused = false;
+}
+
+void
+zuc_bench_use(const void *ptr)
+{
+	__asm__ __volatile__("" : : "r"(ptr) : "memory");
+}
+
+/* Runs the body once with the given iteration count, returns the time it
+ * took in nanoseconds or -1 if the body never looped. */
+static int64_t
+run_sample(zucimpl_bench_fn fn, uint64_t iterations)
+{
+	struct zuc_bench bench = {
+		.remaining = iterations,
+	};
+
+	fn(&bench);
+
+	if (!bench.ran || bench.running)
+		return -1;
+
+	return bench.elapsed_nsec;
+}
+
+/* Finds the iteration count for samples of at least the minimum time.
+ * The runs doing so warm up caches and CPU clocks as well. */
+static uint64_t
+calibrate(zucimpl_bench_fn fn)
+{
+	int64_t min_nsec = (int64_t)g_bench.min_time_msec * 1000000;
+	uint64_t iterations = 1;
+	uint64_t next;
+	int64_t nsec;
+
+	for (;;) {
+		nsec = run_sample(fn, iterations);
+		if (nsec < 0)
+			return 0;
+
+		if (nsec >= min_nsec || iterations >= BENCH_MAX_ITERATIONS)
+			break;
+
+		if (nsec > 0)
+			next = iterations * 1.2 * min_nsec / nsec;
+		else
+			next = iterations * BENCH_MAX_GROWTH;
+
+		if (next > iterations * BENCH_MAX_GROWTH)
+			next = iterations * BENCH_MAX_GROWTH;
+		if (next <= iterations)
+			next = iterations + 1;
+
+		iterations = next;
+	}
+
+	return iterations;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+sorted_median(const double *values, int count)
+{
+	if (count % 2)
+		return values[count / 2];
+
+	return (values[count / 2 - 1] + values[count / 2]) / 2.0;
+}
+
+static void
+compute_stats(double *values, int count, struct bench_stats *stats)
+{
+	double *deviations;
+	double sum = 0.0;
+	int i;
+
+	qsort(values, count, sizeof(*values), compare_double);
+
+	for (i = 0; i < count; i++)
+		sum += values[i];
+
+	stats->median = sorted_median(values, count);
+	stats->min = values[0];
+	stats->mean = sum / count;
+	stats->p99 = values[(count * 99 + 99) / 100 - 1];
+
+	deviations = calloc(count, sizeof(*deviations));
+	if (!deviations) {
+		stats->mad = 0.0;
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		deviations[i] = values[i] - stats->median;
+		if (deviations[i] < 0.0)
+			deviations[i] = -deviations[i];
+	}
+	qsort(deviations, count, sizeof(*deviations), compare_double);
+	stats->mad = sorted_median(deviations, count);
+
+	free(deviations);
+}
+
+static void
+report_json(const char *tcase, const char *test, uint64_t iterations,
+	    int samples, const struct bench_stats *stats)
+{
+	FILE *fp;
+
+	/* Tests run in forked children by default, appending whole lines
+	 * keeps their results apart. */
+	fp = fopen(g_bench.json_path, "a");
+	if (!fp) {
+		printf("%s:%d: warning: cannot open %s\n",
+		       __FILE__, __LINE__, g_bench.json_path);
+		return;
+	}
+
+	fprintf(fp, "{\"case\":\"%s\",\"test\":\"%s\","
+		"\"iterations\":%" PRIu64 ",\"samples\":%d,"
+		"\"median_ns\":%.3f,\"mad_ns\":%.3f,\"p99_ns\":%.3f,"
+		"\"min_ns\":%.3f,\"mean_ns\":%.3f}\n",
+		tcase, test, iterations, samples, stats->median, stats->mad,
+		stats->p99, stats->min, stats->mean);
+	fclose(fp);
+}
+
+void
+zucimpl_run_bench(const char *tcase, const char *test, zucimpl_bench_fn fn)
+{
+	struct bench_stats stats;
+	uint64_t iterations;
+	double *values;
+	int64_t nsec;
+	int i;
+
+	if (!g_bench.enabled) {
+		if (run_sample(fn, 1) < 0 && !zuc_has_failure() &&
+		    !zuc_has_skip())
+			ZUC_FATAL("benchmark body does not call zuc_bench_next()");
+		return;
+	}
+
+	iterations = calibrate(fn);
+	if (iterations == 0) {
+		if (!zuc_has_failure() && !zuc_has_skip())
+			ZUC_FATAL("benchmark body does not call zuc_bench_next()");
+		return;
+	}
+
+	values = calloc(g_bench.samples, sizeof(*values));
+	ZUC_ASSERT_NOT_NULL(values);
+
+	for (i = 0; i < g_bench.samples; i++) {
+		nsec = run_sample(fn, iterations);
+		if (nsec < 0 || zuc_has_failure())
+			break;
+		values[i] = (double)nsec / iterations;
+	}
+
+	if (i == g_bench.samples) {
+		compute_stats(values, g_bench.samples, &stats);
+
+		/* A TAP diagnostic line, harmless to TAP consumers. */
+		printf("# bench %s.%s: median %.1f ns, mad %.1f ns, "
+		       "p99 %.1f ns, min %.1f ns, mean %.1f ns "
+		       "(%d x %" PRIu64 " iterations)\n",
+		       tcase, test, stats.median, stats.mad, stats.p99,
+		       stats.min, stats.mean, g_bench.samples, iterations);
+		fflush(stdout);
+
+		if (g_bench.json_path)
+			report_json(tcase, test, iterations, g_bench.samples,
+				    &stats);
+	}
+
+	free(values);
+}
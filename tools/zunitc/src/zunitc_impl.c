@@ -532,6 +532,10 @@ zuc_initialize(int *argc, char *argv[], bool *help_flagged)
 	bool opt_break_on_failure = false;
 	bool opt_junit = false;
 	char *opt_filter = NULL;
+	bool opt_bench = false;
+	int opt_bench_samples = 0;
+	int opt_bench_min_time = 0;
+	char *opt_bench_json = NULL;
 
 	char *help_param = NULL;
 	int argc_in = *argc;
@@ -547,6 +551,12 @@ zuc_initialize(int *argc, char *argv[], bool *help_flagged)
 		{ WESTON_OPTION_BOOLEAN, "zuc-output-xml", 0, &opt_junit },
 #endif
 		{ WESTON_OPTION_STRING, "zuc-filter", 0, &opt_filter },
+		{ WESTON_OPTION_BOOLEAN, "zuc-bench", 0, &opt_bench },
+		{ WESTON_OPTION_INTEGER, "zuc-bench-samples", 0,
+		  &opt_bench_samples },
+		{ WESTON_OPTION_INTEGER, "zuc-bench-min-time", 0,
+		  &opt_bench_min_time },
+		{ WESTON_OPTION_STRING, "zuc-bench-json", 0, &opt_bench_json },
 	};
 
 	/*
@@ -630,6 +640,10 @@ zuc_initialize(int *argc, char *argv[], bool *help_flagged)
 
 	if (opt_help) {
 		printf("Usage: %s [OPTIONS]\n"
+		       "  --zuc-bench\n"
+		       "  --zuc-bench-json=FILE\n"
+		       "  --zuc-bench-min-time=MSEC\n"
+		       "  --zuc-bench-samples=N\n"
 		       "  --zuc-break-on-failure\n"
 		       "  --zuc-filter=FILTER\n"
 		       "  --zuc-list-tests\n"
@@ -653,9 +667,17 @@ zuc_initialize(int *argc, char *argv[], bool *help_flagged)
 		zuc_set_spawn(!opt_nofork);
 		zuc_set_break_on_failure(opt_break_on_failure);
 		zuc_set_output_junit(opt_junit);
+		zuc_set_bench(opt_bench);
+		if (opt_bench_samples)
+			zuc_set_bench_samples(opt_bench_samples);
+		if (opt_bench_min_time)
+			zuc_set_bench_min_time(opt_bench_min_time);
+		zuc_set_bench_json(opt_bench_json);
 		rc = EXIT_SUCCESS;
 	}
 
+	free(opt_bench_json);
+
 	return rc;
 }
 
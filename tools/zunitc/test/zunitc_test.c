@@ -173,6 +173,19 @@ ZUC_TEST(infrastructure, skip_stops_test)
 }
 #endif
 
+ZUC_BENCH(infrastructure, bench_loop_runs, bench)
+{
+	int count = 0;
+
+	while (zuc_bench_next(bench))
+		count++;
+
+	ZUC_ASSERT_GE(count, 1);
+
+	zuc_bench_pause(bench);
+	zuc_bench_resume(bench);
+}
+
 struct fixture_data {
 	int case_counter;
 	int test_counter;
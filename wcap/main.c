@@ -36,6 +36,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <cairo.h>
 
@@ -99,23 +100,23 @@ int clamp_uv(int u)
 }
 
 static void
-convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
+convert_to_yv12(uint32_t format, int width, int height,
+		const uint32_t *frame, unsigned char *out)
 {
 	unsigned char *y1, *y2, *u, *v;
-	uint32_t *p1, *p2, *end;
+	const uint32_t *p1, *p2, *end;
 	int i, u_accum, v_accum, stride0, stride1;
-	uint32_t format = decoder->format;
 
-	stride0 = decoder->width;
-	stride1 = decoder->width / 2;
-	for (i = 0; i < decoder->height; i += 2) {
+	stride0 = width;
+	stride1 = width / 2;
+	for (i = 0; i < height; i += 2) {
 		y1 = out + stride0 * i;
 		y2 = y1 + stride0;
-		v = out + stride0 * decoder->height + stride1 * i / 2;
-		u = v + stride1 * decoder->height / 2;
-		p1 = decoder->frame + decoder->width * i;
-		p2 = p1 + decoder->width;
-		end = p1 + decoder->width;
+		v = out + stride0 * height + stride1 * i / 2;
+		u = v + stride1 * height / 2;
+		p1 = frame + width * i;
+		p2 = p1 + width;
+		end = p1 + width;
 
 		while (p1 < end) {
 			u_accum = 0;
@@ -138,23 +139,23 @@ convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
 }
 
 static void
-convert_to_yuv444(struct wcap_decoder *decoder, unsigned char *out)
+convert_to_yuv444(uint32_t format, int width, int height,
+		  const uint32_t *frame, unsigned char *out)
 {
 
 	unsigned char *yp, *up, *vp;
-	uint32_t *rp, *end;
+	const uint32_t *rp, *end;
 	int u, v;
 	int i, stride, psize;
-	uint32_t format = decoder->format;
 
-	stride = decoder->width;
-	psize = stride * decoder->height;
-	for (i = 0; i < decoder->height; i++) {
+	stride = width;
+	psize = stride * height;
+	for (i = 0; i < height; i++) {
 		yp = out + stride * i;
 		up = yp + (psize * 2);
 		vp = yp + (psize * 1);
-		rp = decoder->frame + decoder->width * i;
-		end = rp + decoder->width;
+		rp = frame + width * i;
+		end = rp + width;
 		while (rp < end) {
 			u = 0;
 			v = 0;
@@ -169,28 +170,232 @@ convert_to_yuv444(struct wcap_decoder *decoder, unsigned char *out)
 	}
 }
 
-static void
-output_yuv_frame(struct wcap_decoder *decoder, int depth)
+/*
+ * The yuv4mpeg2 output is a pipeline of three stages: the main thread
+ * decodes the frames, which can only be done in order, and copies each
+ * frame that is output into a free slot; a pool of threads converts the
+ * slots to YUV, several frames at a time; and a writer thread writes the
+ * converted slots to stdout in frame order.
+ */
+
+enum slot_state {
+	SLOT_FREE,
+	SLOT_DECODED,
+	SLOT_CONVERTED,
+};
+
+struct yuv_slot {
+	enum slot_state state;
+	uint32_t *frame;
+	unsigned char *out;
+};
+
+struct yuv_pipeline {
+	uint32_t format;
+	int width, height, depth;
+	size_t out_size;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct yuv_slot *slots;
+	int nslots;
+	unsigned int next_decode, next_convert, next_write;
+	int done;
+	int write_failed;
+
+	pthread_t writer;
+	pthread_t *converters;
+	int nconverters;
+};
+
+static void *
+yuv_converter_thread(void *data)
+{
+	struct yuv_pipeline *pl = data;
+	struct yuv_slot *slot;
+
+	pthread_mutex_lock(&pl->lock);
+	for (;;) {
+		while (pl->next_convert == pl->next_decode && !pl->done)
+			pthread_cond_wait(&pl->cond, &pl->lock);
+		if (pl->next_convert == pl->next_decode)
+			break;
+
+		slot = &pl->slots[pl->next_convert++ % pl->nslots];
+		pthread_mutex_unlock(&pl->lock);
+
+		if (pl->depth == 444)
+			convert_to_yuv444(pl->format, pl->width, pl->height,
+					  slot->frame, slot->out);
+		else
+			convert_to_yv12(pl->format, pl->width, pl->height,
+					slot->frame, slot->out);
+
+		pthread_mutex_lock(&pl->lock);
+		slot->state = SLOT_CONVERTED;
+		pthread_cond_broadcast(&pl->cond);
+	}
+	pthread_mutex_unlock(&pl->lock);
+
+	return NULL;
+}
+
+static void *
+yuv_writer_thread(void *data)
 {
-	static unsigned char *out;
-	int size;
+	struct yuv_pipeline *pl = data;
+	struct yuv_slot *slot;
+
+	pthread_mutex_lock(&pl->lock);
+	for (;;) {
+		slot = &pl->slots[pl->next_write % pl->nslots];
+		while (!(pl->next_write != pl->next_decode &&
+			 slot->state == SLOT_CONVERTED) &&
+		       !(pl->done && pl->next_write == pl->next_decode))
+			pthread_cond_wait(&pl->cond, &pl->lock);
+		if (pl->next_write == pl->next_decode)
+			break;
+		pthread_mutex_unlock(&pl->lock);
+
+		if (fputs("FRAME\n", stdout) < 0 ||
+		    fwrite(slot->out, 1, pl->out_size, stdout) != pl->out_size)
+			pl->write_failed = 1;
+
+		pthread_mutex_lock(&pl->lock);
+		slot->state = SLOT_FREE;
+		pl->next_write++;
+		pthread_cond_broadcast(&pl->cond);
+	}
+	pthread_mutex_unlock(&pl->lock);
+
+	return NULL;
+}
+
+static struct yuv_pipeline *
+yuv_pipeline_create(struct wcap_decoder *decoder, int depth, int nthreads)
+{
+	struct yuv_pipeline *pl;
+	size_t frame_size;
+	int i;
+
+	pl = calloc(1, sizeof *pl);
+	if (pl == NULL)
+		return NULL;
+
+	pl->format = decoder->format;
+	pl->width = decoder->width;
+	pl->height = decoder->height;
+	pl->depth = depth;
+	if (depth == 444)
+		pl->out_size = (size_t) pl->width * pl->height * 3;
+	else
+		pl->out_size = (size_t) pl->width * pl->height * 3 / 2;
+	frame_size = (size_t) pl->width * pl->height * 4;
+
+	/* One frame being decoded, one being written and one per converter,
+	 * plus one so that the decoder rarely has to wait. */
+	pl->nconverters = nthreads;
+	pl->nslots = nthreads + 3;
+	pl->slots = calloc(pl->nslots, sizeof *pl->slots);
+	pl->converters = calloc(pl->nconverters, sizeof *pl->converters);
+	if (pl->slots == NULL || pl->converters == NULL)
+		goto err;
+
+	for (i = 0; i < pl->nslots; i++) {
+		pl->slots[i].frame = malloc(frame_size);
+		pl->slots[i].out = malloc(pl->out_size);
+		if (pl->slots[i].frame == NULL || pl->slots[i].out == NULL)
+			goto err;
+	}
+
+	pthread_mutex_init(&pl->lock, NULL);
+	pthread_cond_init(&pl->cond, NULL);
 
-	if (depth == 444) {
-		size = decoder->width * decoder->height * 3;
-	} else {
-		size = decoder->width * decoder->height * 3 / 2;
+	/* stdout is only written by the writer thread from here on */
+	if (pthread_create(&pl->writer, NULL, yuv_writer_thread, pl) != 0)
+		goto err_lock;
+	for (i = 0; i < pl->nconverters; i++) {
+		if (pthread_create(&pl->converters[i], NULL,
+				   yuv_converter_thread, pl) != 0)
+			break;
 	}
-	if (out == NULL)
-		out = malloc(size);
+	/* Keep going with the threads that did start */
+	pl->nconverters = i;
+	if (pl->nconverters == 0) {
+		pthread_mutex_lock(&pl->lock);
+		pl->done = 1;
+		pthread_cond_broadcast(&pl->cond);
+		pthread_mutex_unlock(&pl->lock);
+		pthread_join(pl->writer, NULL);
+		goto err_lock;
+	}
+
+	return pl;
+
+err_lock:
+	pthread_cond_destroy(&pl->cond);
+	pthread_mutex_destroy(&pl->lock);
+err:
+	for (i = 0; pl->slots && i < pl->nslots; i++) {
+		free(pl->slots[i].frame);
+		free(pl->slots[i].out);
+	}
+	free(pl->slots);
+	free(pl->converters);
+	free(pl);
+	return NULL;
+}
+
+/* Queue the current frame of the decoder for conversion and output */
+static void
+yuv_pipeline_push(struct yuv_pipeline *pl, struct wcap_decoder *decoder)
+{
+	struct yuv_slot *slot;
+
+	pthread_mutex_lock(&pl->lock);
+	slot = &pl->slots[pl->next_decode % pl->nslots];
+	while (slot->state != SLOT_FREE)
+		pthread_cond_wait(&pl->cond, &pl->lock);
+	pthread_mutex_unlock(&pl->lock);
+
+	memcpy(slot->frame, decoder->frame,
+	       (size_t) pl->width * pl->height * 4);
+
+	pthread_mutex_lock(&pl->lock);
+	slot->state = SLOT_DECODED;
+	pl->next_decode++;
+	pthread_cond_broadcast(&pl->cond);
+	pthread_mutex_unlock(&pl->lock);
+}
+
+/* Wait for all queued frames to be written, returns -1 if writing failed */
+static int
+yuv_pipeline_finish(struct yuv_pipeline *pl)
+{
+	int i, ret;
+
+	pthread_mutex_lock(&pl->lock);
+	pl->done = 1;
+	pthread_cond_broadcast(&pl->cond);
+	pthread_mutex_unlock(&pl->lock);
+
+	for (i = 0; i < pl->nconverters; i++)
+		pthread_join(pl->converters[i], NULL);
+	pthread_join(pl->writer, NULL);
+
+	ret = pl->write_failed || fflush(stdout) != 0 ? -1 : 0;
 
-	if (depth == 444) {
-		convert_to_yuv444(decoder, out);
-	} else {
-		convert_to_yv12(decoder, out);
+	pthread_cond_destroy(&pl->cond);
+	pthread_mutex_destroy(&pl->lock);
+	for (i = 0; i < pl->nslots; i++) {
+		free(pl->slots[i].frame);
+		free(pl->slots[i].out);
 	}
+	free(pl->slots);
+	free(pl->converters);
+	free(pl);
 
-	printf("FRAME\n");
-	fwrite(out, 1, size, stdout);
+	return ret;
 }
 
 static void
@@ -198,14 +403,16 @@ usage(int exit_code)
 {
 	fprintf(stderr, "usage: wcap-decode "
 		"[--help] [--yuv4mpeg2] [--frame=<frame>] [--all] \n"
-		"\t[--rate=<num:denom>] <wcap file>\n\n"
+		"\t[--rate=<num:denom>] [--threads=<n>] <wcap file>\n\n"
 		"\t--help\t\t\tthis help text\n"
 		"\t--yuv4mpeg2\t\tdump wcap file to stdout in yuv4mpeg2 format\n"
 		"\t--yuv4mpeg2-444\t\tdump wcap file to stdout in yuv4mpeg2 444 format\n"
 		"\t--frame=<frame>\t\twrite out the given frame number as png\n"
 		"\t--all\t\t\twrite all frames as pngs\n"
 		"\t--rate=<num:denom>\treplay frame rate for yuv4mpeg2,\n"
-		"\t\t\t\tspecified as an integer fraction\n\n");
+		"\t\t\t\tspecified as an integer fraction\n"
+		"\t--threads=<n>\t\tnumber of yuv4mpeg2 conversion threads,\n"
+		"\t\t\t\tdefaults to the number of CPUs\n\n");
 
 	exit(exit_code);
 }
@@ -214,7 +421,9 @@ int main(int argc, char *argv[])
 {
 	struct wcap_decoder *decoder;
 	int i, j, output_frame = -1, yuv4mpeg2 = 0, all = 0, has_frame;
-	int num = 30, denom = 1;
+	int num = 30, denom = 1, nthreads = 0;
+	struct yuv_pipeline *pipeline = NULL;
+	int ret = EXIT_SUCCESS;
 	char filename[200];
 	char *mode;
 	uint32_t msecs, frame_time;
@@ -230,6 +439,8 @@ int main(int argc, char *argv[])
 			all = 1;
 		} else if (sscanf(argv[i], "--frame=%d", &output_frame) == 1) {
 			;
+		} else if (sscanf(argv[i], "--threads=%d", &nthreads) == 1) {
+			;
 		} else if (sscanf(argv[i], "--rate=%d", &num) == 1) {
 			;
 		} else if (sscanf(argv[i], "--rate=%d:%d", &num, &denom) == 2) {
@@ -277,6 +488,17 @@ int main(int argc, char *argv[])
 		printf("YUV4MPEG2 %s W%d H%d F%d:%d Ip A0:0\n",
 					 mode, decoder->width, decoder->height, num, denom);
 		fflush(stdout);
+
+		if (nthreads <= 0)
+			nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nthreads <= 0)
+			nthreads = 1;
+		pipeline = yuv_pipeline_create(decoder, yuv4mpeg2, nthreads);
+		if (pipeline == NULL) {
+			fprintf(stderr, "failed to set up yuv4mpeg2 output\n");
+			wcap_decoder_destroy(decoder);
+			exit(EXIT_FAILURE);
+		}
 	}
 
 	i = 0;
@@ -290,18 +512,23 @@ int main(int argc, char *argv[])
 			write_png(decoder, filename);
 			fprintf(stderr, "wrote %s\n", filename);
 		}
-		if (yuv4mpeg2)
-			output_yuv_frame(decoder, yuv4mpeg2);
+		if (pipeline)
+			yuv_pipeline_push(pipeline, decoder);
 		i++;
 		msecs += frame_time;
 		while (decoder->msecs < msecs && has_frame)
 			has_frame = wcap_decoder_get_frame(decoder);
 	}
 
+	if (pipeline && yuv_pipeline_finish(pipeline) < 0) {
+		fprintf(stderr, "writing yuv4mpeg2 data failed\n");
+		ret = EXIT_FAILURE;
+	}
+
 	fprintf(stderr, "wcap file: size %dx%d, %d frames\n",
 		decoder->width, decoder->height, i);
 
 	wcap_decoder_destroy(decoder);
 
-	return EXIT_SUCCESS;
+	return ret;
 }
@@ -136,6 +136,10 @@ wcap_decoder_create(const char *filename)
 		return NULL;
 	}
 
+	/* Frames are decoded front to back, have the kernel read ahead */
+	madvise(decoder->map, decoder->size,
+		MADV_SEQUENTIAL | MADV_WILLNEED);
+
 	header = decoder->map;
 	decoder->format = header->format;
 	decoder->count = 0;
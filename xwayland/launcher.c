@@ -42,9 +42,8 @@
 #include "shared/string-helpers.h"
 
 static int
-weston_xserver_handle_event(int listen_fd, uint32_t mask, void *data)
+weston_xserver_spawn(struct weston_xserver *wxs)
 {
-	struct weston_xserver *wxs = data;
 	char display[8];
 
 	snprintf(display, sizeof display, ":%d", wxs->display);
@@ -52,13 +51,24 @@ weston_xserver_handle_event(int listen_fd, uint32_t mask, void *data)
 	wxs->pid = wxs->spawn_func(wxs->user_data, display, wxs->abstract_fd, wxs->unix_fd);
 	if (wxs->pid == -1) {
 		weston_log("Failed to spawn the Xwayland server\n");
-		return 1;
+		wxs->pid = 0;
+		return -1;
 	}
 
 	weston_log("Spawned Xwayland server, pid %d\n", wxs->pid);
 	wl_event_source_remove(wxs->abstract_source);
 	wl_event_source_remove(wxs->unix_source);
 
+	return 0;
+}
+
+static int
+weston_xserver_handle_event(int listen_fd, uint32_t mask, void *data)
+{
+	struct weston_xserver *wxs = data;
+
+	weston_xserver_spawn(wxs);
+
 	return 1;
 }
 
@@ -345,11 +355,27 @@ weston_xwayland_xserver_exited(struct weston_xwayland *xwayland,
 	}
 }
 
+static int
+weston_xwayland_start(struct weston_xwayland *xwayland)
+{
+	struct weston_xserver *wxs = (struct weston_xserver *)xwayland;
+
+	/* Not listening, or shut down after the server crashed. */
+	if (!wxs->loop)
+		return -1;
+
+	if (wxs->pid != 0)
+		return 0;
+
+	return weston_xserver_spawn(wxs);
+}
+
 const struct weston_xwayland_api api = {
 	weston_xwayland_get,
 	weston_xwayland_listen,
 	weston_xwayland_xserver_loaded,
 	weston_xwayland_xserver_exited,
+	weston_xwayland_start,
 };
 extern const struct weston_xwayland_surface_api surface_api;
 
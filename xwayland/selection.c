@@ -42,10 +42,38 @@
 #define wm_log(...) do {} while (0)
 #endif
 
+static const size_t incr_chunk_size = 64 * 1024;
+
+/* Fetch the selection property a chunk at a time, so that only one chunk
+ * of a large property is held in memory while it is written out. The
+ * non-INCR property is deleted along with its last chunk. */
+static xcb_get_property_reply_t *
+weston_wm_get_property_chunk(struct weston_wm *wm)
+{
+	xcb_get_property_cookie_t cookie;
+	xcb_get_property_reply_t *reply;
+
+	cookie = xcb_get_property(wm->conn,
+				  !wm->incr, /* delete */
+				  wm->selection_window,
+				  wm->atom.wl_selection,
+				  XCB_GET_PROPERTY_TYPE_ANY,
+				  wm->property_offset,
+				  incr_chunk_size / 4);
+
+	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
+	if (reply)
+		wm->property_offset +=
+			xcb_get_property_value_length(reply) / 4;
+
+	return reply;
+}
+
 static int
 writable_callback(int fd, uint32_t mask, void *data)
 {
 	struct weston_wm *wm = data;
+	xcb_get_property_reply_t *reply;
 	unsigned char *property;
 	int len, remainder;
 
@@ -71,8 +99,19 @@ writable_callback(int fd, uint32_t mask, void *data)
 
 	wm->property_start += len;
 	if (len == remainder) {
+		reply = NULL;
+		if (wm->property_reply->bytes_after > 0)
+			reply = weston_wm_get_property_chunk(wm);
+
 		free(wm->property_reply);
 		wm->property_reply = NULL;
+		if (reply && xcb_get_property_value_length(reply) > 0) {
+			wm->property_reply = reply;
+			wm->property_start = 0;
+			return 1;
+		}
+		free(reply);
+
 		if (wm->property_source)
 			wl_event_source_remove(wm->property_source);
 		wm->property_source = NULL;
@@ -108,21 +147,13 @@ weston_wm_write_property(struct weston_wm *wm, xcb_get_property_reply_t *reply)
 static void
 weston_wm_get_incr_chunk(struct weston_wm *wm)
 {
-	xcb_get_property_cookie_t cookie;
 	xcb_get_property_reply_t *reply;
 	FILE *fp;
 	char *logstr;
 	size_t logsize;
 
-	cookie = xcb_get_property(wm->conn,
-				  0, /* delete */
-				  wm->selection_window,
-				  wm->atom.wl_selection,
-				  XCB_GET_PROPERTY_TYPE_ANY,
-				  0, /* offset */
-				  0x1fffffff /* length */);
-
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
+	wm->property_offset = 0;
+	reply = weston_wm_get_property_chunk(wm);
 	if (reply == NULL)
 		return;
 
@@ -256,21 +287,16 @@ weston_wm_get_selection_targets(struct weston_wm *wm)
 static void
 weston_wm_get_selection_data(struct weston_wm *wm)
 {
-	xcb_get_property_cookie_t cookie;
 	xcb_get_property_reply_t *reply;
 	FILE *fp;
 	char *logstr;
 	size_t logsize;
 
-	cookie = xcb_get_property(wm->conn,
-				  1, /* delete */
-				  wm->selection_window,
-				  wm->atom.wl_selection,
-				  XCB_GET_PROPERTY_TYPE_ANY,
-				  0, /* offset */
-				  0x1fffffff /* length */);
-
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
+	/* Whether this is an INCR transfer is only known from the reply,
+	 * which deletes the property if it is not. */
+	wm->incr = 0;
+	wm->property_offset = 0;
+	reply = weston_wm_get_property_chunk(wm);
 
 	fp = open_memstream(&logstr, &logsize);
 	if (fp) {
@@ -309,8 +335,6 @@ weston_wm_handle_selection_notify(struct weston_wm *wm,
 	}
 }
 
-static const size_t incr_chunk_size = 64 * 1024;
-
 static void
 weston_wm_send_selection_notify(struct weston_wm *wm, xcb_atom_t property)
 {
@@ -394,12 +418,15 @@ weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 	int len, current, available;
 	void *p;
 
+	/* Never buffer more than one chunk, reading stops until it has
+	 * been handed to the X client. */
 	current = wm->source_data.size;
-	if (wm->source_data.size < incr_chunk_size)
-		p = wl_array_add(&wm->source_data, incr_chunk_size);
-	else
-		p = (char *) wm->source_data.data + wm->source_data.size;
-	available = wm->source_data.alloc - current;
+	if (wm->source_data.alloc < incr_chunk_size) {
+		wl_array_add(&wm->source_data, incr_chunk_size - current);
+		wm->source_data.size = current;
+	}
+	p = (char *) wm->source_data.data + current;
+	available = incr_chunk_size - current;
 
 	len = read(fd, p, available);
 	if (len == -1) {
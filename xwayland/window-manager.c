@@ -38,7 +38,9 @@
 #include <signal.h>
 #include <limits.h>
 #include <assert.h>
+#include <time.h>
 #include <X11/Xcursor/Xcursor.h>
+#include <xcb/xcbext.h>
 #include <linux/input.h>
 
 #include <libweston/libweston.h>
@@ -46,8 +48,9 @@
 #include "xwayland-internal-interface.h"
 
 #include "shared/cairo-util.h"
-#include "hash.h"
+#include "shared/hash.h"
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 
 struct wm_size_hints {
 	uint32_t flags;
@@ -133,12 +136,29 @@ struct weston_output_weak_ref {
 	struct wl_listener destroy_listener;
 };
 
+enum wm_decoration_mode {
+	WM_DECORATION_NONE,	/* fullscreen */
+	WM_DECORATION_FRAME,
+	WM_DECORATION_SHADOW,
+};
+
+/* Number of entries in weston_wm_window_get_property_table() */
+#define WM_WINDOW_PROPERTY_COUNT 11
+
 struct weston_wm_window {
 	struct weston_wm *wm;
 	xcb_window_t id;
 	xcb_window_t frame_id;
 	struct frame *frame;
 	cairo_surface_t *cairo_surface;
+	/* What the frame window currently shows, to skip redrawing it */
+	struct {
+		bool valid;
+		enum wm_decoration_mode mode;
+		int width, height;
+		uint32_t flags;		/* enum frame_flag */
+		struct timespec resize_time;
+	} drawn;
 	uint32_t surface_id;
 	struct weston_surface *surface;
 	struct weston_desktop_xwayland_surface *shsurf;
@@ -146,6 +166,16 @@ struct weston_wm_window {
 	struct wl_event_source *repaint_source;
 	struct wl_event_source *configure_source;
 	int properties_dirty;
+	struct {
+		struct wl_list link;	/* weston_wm::property_fetch_list */
+		bool pending;
+		uint32_t received;
+		xcb_get_property_cookie_t cookie[WM_WINDOW_PROPERTY_COUNT];
+		xcb_get_property_reply_t *reply[WM_WINDOW_PROPERTY_COUNT];
+		bool geometry_pending;
+		xcb_get_geometry_cookie_t geometry_cookie;
+	} fetch;
+	bool repaint_after_fetch;
 	int pid;
 	char *machine;
 	char *class;
@@ -345,20 +375,11 @@ xcb_cursor_library_load_cursor(struct weston_wm *wm, const char *file)
 {
 	xcb_cursor_t cursor;
 	XcursorImages *images;
-	char *v = NULL;
-	int size = 0;
 
 	if (!file)
 		return 0;
 
-	v = getenv ("XCURSOR_SIZE");
-	if (v)
-		size = atoi(v);
-
-	if (!size)
-		size = 32;
-
-	images = XcursorLibraryLoadImages (file, NULL, size);
+	images = XcursorLibraryLoadImages (file, NULL, wm->cursor_size);
 	if (!images)
 		return -1;
 
@@ -500,17 +521,20 @@ read_and_dump_property(FILE *fp, struct weston_wm *wm,
 #define TYPE_NET_WM_STATE	XCB_ATOM_CUT_BUFFER2
 #define TYPE_WM_NORMAL_HINTS	XCB_ATOM_CUT_BUFFER3
 
+struct weston_wm_property {
+	xcb_atom_t atom;
+	xcb_atom_t type;
+	void *ptr;
+};
+
 static void
-weston_wm_window_read_properties(struct weston_wm_window *window)
+weston_wm_window_get_property_table(struct weston_wm_window *window,
+				    struct weston_wm_property *props)
 {
 	struct weston_wm *wm = window->wm;
 
 #define F(field) (&window->field)
-	const struct {
-		xcb_atom_t atom;
-		xcb_atom_t type;
-		void *ptr;
-	} props[] = {
+	const struct weston_wm_property table[] = {
 		{ XCB_ATOM_WM_CLASS,           XCB_ATOM_STRING,            F(class) },
 		{ XCB_ATOM_WM_NAME,            XCB_ATOM_STRING,            F(name) },
 		{ XCB_ATOM_WM_TRANSIENT_FOR,   XCB_ATOM_WINDOW,            F(transient_for) },
@@ -525,32 +549,101 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 	};
 #undef F
 
-	xcb_get_property_cookie_t cookie[ARRAY_LENGTH(props)];
+	static_assert(ARRAY_LENGTH(table) == WM_WINDOW_PROPERTY_COUNT,
+		      "WM_WINDOW_PROPERTY_COUNT does not match the table");
+
+	memcpy(props, table, sizeof table);
+}
+
+static void
+weston_wm_window_update_fetch_link(struct weston_wm_window *window)
+{
+	bool pending = window->fetch.pending || window->fetch.geometry_pending;
+
+	if (pending && wl_list_empty(&window->fetch.link))
+		wl_list_insert(&window->wm->property_fetch_list,
+			       &window->fetch.link);
+	else if (!pending && !wl_list_empty(&window->fetch.link)) {
+		wl_list_remove(&window->fetch.link);
+		wl_list_init(&window->fetch.link);
+	}
+}
+
+/* Sends the requests for all the properties the window manager uses
+ * without waiting for the replies. They are applied from
+ * weston_wm_window_poll_properties() once they have all arrived, or by
+ * weston_wm_window_read_properties() if they are needed right away.
+ */
+static void
+weston_wm_window_fetch_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	struct weston_wm_property props[WM_WINDOW_PROPERTY_COUNT];
+	uint32_t i;
+
+	assert(!window->fetch.pending);
+
+	weston_wm_window_get_property_table(window, props);
+
+	for (i = 0; i < WM_WINDOW_PROPERTY_COUNT; i++)
+		window->fetch.cookie[i] = xcb_get_property(wm->conn,
+							   0, /* delete */
+							   window->id,
+							   props[i].atom,
+							   XCB_ATOM_ANY, 0, 2048);
+
+	window->fetch.received = 0;
+	window->fetch.pending = true;
+	window->properties_dirty = 0;
+	weston_wm_window_update_fetch_link(window);
+}
+
+/* Drops an outstanding fetch, e.g. because its replies are already
+ * known to be out of date. */
+static void
+weston_wm_window_discard_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	uint32_t i;
+
+	if (!window->fetch.pending)
+		return;
+
+	for (i = 0; i < WM_WINDOW_PROPERTY_COUNT; i++) {
+		if (i < window->fetch.received)
+			free(window->fetch.reply[i]);
+		else
+			xcb_discard_reply(wm->conn,
+					  window->fetch.cookie[i].sequence);
+		window->fetch.reply[i] = NULL;
+	}
+
+	window->fetch.pending = false;
+	weston_wm_window_update_fetch_link(window);
+}
+
+static void
+weston_wm_window_apply_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	struct weston_wm_property props[WM_WINDOW_PROPERTY_COUNT];
 	xcb_get_property_reply_t *reply;
 	void *p;
 	uint32_t *xid;
 	xcb_atom_t *atom;
-	uint32_t i;
+	uint32_t i, j;
 	char name[1024];
 
-	if (!window->properties_dirty)
-		return;
-	window->properties_dirty = 0;
-
-	for (i = 0; i < ARRAY_LENGTH(props); i++)
-		cookie[i] = xcb_get_property(wm->conn,
-					     0, /* delete */
-					     window->id,
-					     props[i].atom,
-					     XCB_ATOM_ANY, 0, 2048);
+	weston_wm_window_get_property_table(window, props);
 
 	window->decorate = window->override_redirect ? 0 : MWM_DECOR_EVERYTHING;
 	window->size_hints.flags = 0;
 	window->motif_hints.flags = 0;
 	window->delete_window = 0;
 
-	for (i = 0; i < ARRAY_LENGTH(props); i++)  {
-		reply = xcb_get_property_reply(wm->conn, cookie[i], NULL);
+	for (i = 0; i < WM_WINDOW_PROPERTY_COUNT; i++)  {
+		reply = window->fetch.reply[i];
+		window->fetch.reply[i] = NULL;
 		if (!reply)
 			/* Bad window, typically */
 			continue;
@@ -587,8 +680,8 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 			break;
 		case TYPE_WM_PROTOCOLS:
 			atom = xcb_get_property_value(reply);
-			for (i = 0; i < reply->value_len; i++)
-				if (atom[i] == wm->atom.wm_delete_window) {
+			for (j = 0; j < reply->value_len; j++)
+				if (atom[j] == wm->atom.wm_delete_window) {
 					window->delete_window = 1;
 					break;
 				}
@@ -601,12 +694,12 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 		case TYPE_NET_WM_STATE:
 			window->fullscreen = 0;
 			atom = xcb_get_property_value(reply);
-			for (i = 0; i < reply->value_len; i++) {
-				if (atom[i] == wm->atom.net_wm_state_fullscreen)
+			for (j = 0; j < reply->value_len; j++) {
+				if (atom[j] == wm->atom.net_wm_state_fullscreen)
 					window->fullscreen = 1;
-				if (atom[i] == wm->atom.net_wm_state_maximized_vert)
+				if (atom[j] == wm->atom.net_wm_state_maximized_vert)
 					window->maximized_vert = 1;
-				if (atom[i] == wm->atom.net_wm_state_maximized_horz)
+				if (atom[j] == wm->atom.net_wm_state_maximized_horz)
 					window->maximized_horz = 1;
 			}
 			break;
@@ -630,6 +723,9 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 		free(reply);
 	}
 
+	window->fetch.pending = false;
+	weston_wm_window_update_fetch_link(window);
+
 	if (window->pid > 0) {
 		gethostname(name, sizeof(name));
 		for (i = 0; i < sizeof(name); i++) {
@@ -647,6 +743,124 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 	}
 }
 
+static void
+weston_wm_window_set_geometry(struct weston_wm_window *window,
+			      xcb_get_geometry_reply_t *geometry_reply)
+{
+	/* technically we should use XRender and check the visual format's
+	alpha_mask, but checking depth is simpler and works in all known cases */
+	if (geometry_reply != NULL)
+		window->has_alpha = geometry_reply->depth == 32;
+	free(geometry_reply);
+
+	window->fetch.geometry_pending = false;
+	weston_wm_window_update_fetch_link(window);
+}
+
+static void
+weston_wm_window_wait_geometry(struct weston_wm_window *window)
+{
+	xcb_get_geometry_reply_t *geometry_reply;
+
+	if (!window->fetch.geometry_pending)
+		return;
+
+	geometry_reply = xcb_get_geometry_reply(window->wm->conn,
+						window->fetch.geometry_cookie,
+						NULL);
+	weston_wm_window_set_geometry(window, geometry_reply);
+}
+
+/* Collects the replies that have already arrived, without blocking.
+ * Returns true once nothing is outstanding for the window anymore.
+ */
+static bool
+weston_wm_window_poll_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	xcb_generic_error_t *error;
+	void *reply;
+
+	if (window->fetch.geometry_pending) {
+		if (!xcb_poll_for_reply(wm->conn,
+					window->fetch.geometry_cookie.sequence,
+					&reply, &error))
+			return false;
+		free(error);
+		weston_wm_window_set_geometry(window, reply);
+	}
+
+	if (!window->fetch.pending)
+		return true;
+
+	while (window->fetch.received < WM_WINDOW_PROPERTY_COUNT) {
+		if (!xcb_poll_for_reply(wm->conn,
+					window->fetch.cookie[window->fetch.received].sequence,
+					&reply, &error))
+			return false;
+		free(error);
+		window->fetch.reply[window->fetch.received++] = reply;
+	}
+
+	weston_wm_window_apply_properties(window);
+
+	return true;
+}
+
+/* Brings the window properties up to date, waiting for the X server if
+ * the replies have not arrived yet.
+ */
+static void
+weston_wm_window_read_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	uint32_t i;
+
+	weston_wm_window_wait_geometry(window);
+
+	if (window->properties_dirty) {
+		weston_wm_window_discard_properties(window);
+		weston_wm_window_fetch_properties(window);
+	}
+
+	if (!window->fetch.pending)
+		return;
+
+	for (i = window->fetch.received; i < WM_WINDOW_PROPERTY_COUNT; i++)
+		window->fetch.reply[i] =
+			xcb_get_property_reply(wm->conn,
+					       window->fetch.cookie[i], NULL);
+	window->fetch.received = WM_WINDOW_PROPERTY_COUNT;
+
+	weston_wm_window_apply_properties(window);
+}
+
+/* Called from weston_wm_handle_event() to apply the fetches whose
+ * replies have arrived. Returns the number of fetches completed.
+ */
+static int
+weston_wm_poll_properties(struct weston_wm *wm)
+{
+	struct weston_wm_window *window, *next;
+	int count = 0;
+
+	wl_list_for_each_safe(window, next,
+			      &wm->property_fetch_list, fetch.link) {
+		if (!weston_wm_window_poll_properties(window))
+			continue;
+
+		count++;
+
+		/* Changed again while the replies were on their way. */
+		if (window->properties_dirty)
+			weston_wm_window_fetch_properties(window);
+		else if (window->repaint_after_fetch)
+			weston_wm_window_schedule_repaint(window);
+	}
+
+	return count;
+}
+
 #undef TYPE_WM_PROTOCOLS
 #undef TYPE_MOTIF_WM_HINTS
 #undef TYPE_NET_WM_STATE
@@ -1086,6 +1300,7 @@ weston_wm_window_create_frame(struct weston_wm_window *window)
 	if (!window->frame)
 		return;
 
+	weston_wm_window_invalidate_decoration(window);
 	frame_resize_inside(window->frame, window->width, window->height);
 
 	weston_wm_window_get_frame_size(window, &width, &height);
@@ -1273,6 +1488,7 @@ weston_wm_handle_unmap_notify(struct weston_wm *wm, xcb_generic_event_t *event)
 		wl_list_remove(&window->surface_destroy_listener.link);
 	window->surface = NULL;
 	window->shsurf = NULL;
+	weston_wm_window_invalidate_decoration(window);
 
 	weston_wm_window_set_wm_state(window, ICCCM_WITHDRAWN_STATE);
 	weston_wm_window_set_virtual_desktop(window, -1);
@@ -1280,24 +1496,72 @@ weston_wm_handle_unmap_notify(struct weston_wm *wm, xcb_generic_event_t *event)
 	xcb_unmap_window(wm->conn, window->frame_id);
 }
 
+static void
+weston_wm_window_invalidate_decoration(struct weston_wm_window *window)
+{
+	window->drawn.valid = false;
+}
+
+/*
+ * The frame window keeps its contents between repaints, so only what
+ * changed since the last draw is redrawn: everything when the size, the
+ * mode or the frame flags changed, only the title bar when the title or
+ * a button changed, and nothing otherwise.
+ */
 static void
 weston_wm_window_draw_decoration(struct weston_wm_window *window)
 {
 	cairo_t *cr;
 	int width, height;
+	int32_t x, y, w, h;
+	enum wm_decoration_mode mode;
+	uint32_t flags = 0;
+	bool full;
 	const char *how;
 
 	weston_wm_window_get_frame_size(window, &width, &height);
 
+	if (window->fullscreen)
+		mode = WM_DECORATION_NONE;
+	else if (window->decorate)
+		mode = WM_DECORATION_FRAME;
+	else
+		mode = WM_DECORATION_SHADOW;
+
+	if (mode == WM_DECORATION_FRAME) {
+		frame_set_title(window->frame, window->name);
+		flags = frame_get_flags(window->frame);
+	}
+
+	full = !window->drawn.valid ||
+	       window->drawn.mode != mode ||
+	       window->drawn.width != width ||
+	       window->drawn.height != height ||
+	       window->drawn.flags != flags;
+
+	if (!full && (mode != WM_DECORATION_FRAME ||
+		      !(frame_status(window->frame) & FRAME_STATUS_REPAINT))) {
+		wm_printf(window->wm, "XWM: decoration unchanged, win %d\n",
+			  window->id);
+		return;
+	}
+
+	if (window->drawn.width != width || window->drawn.height != height)
+		clock_gettime(CLOCK_MONOTONIC, &window->drawn.resize_time);
+
 	cairo_xcb_surface_set_size(window->cairo_surface, width, height);
 	cr = cairo_create(window->cairo_surface);
 
-	if (window->fullscreen) {
+	if (mode == WM_DECORATION_NONE) {
 		how = "fullscreen";
 		/* nothing */
-	} else if (window->decorate) {
-		how = "decorate";
-		frame_set_title(window->frame, window->name);
+	} else if (mode == WM_DECORATION_FRAME) {
+		how = full ? "decorate" : "titlebar";
+		if (!full) {
+			frame_titlebar_rect(window->frame, &x, &y, &w, &h);
+			cairo_rectangle(cr, x, y, w, h);
+			cairo_clip(cr);
+		}
 		frame_repaint(window->frame, cr);
 	} else {
 		how = "shadow";
@@ -1315,6 +1579,12 @@ weston_wm_window_draw_decoration(struct weston_wm_window *window)
 	cairo_destroy(cr);
 	cairo_surface_flush(window->cairo_surface);
 	xcb_flush(window->wm->conn);
+
+	window->drawn.valid = true;
+	window->drawn.mode = mode;
+	window->drawn.width = width;
+	window->drawn.height = height;
+	window->drawn.flags = flags;
 }
 
 static void
@@ -1332,7 +1602,13 @@ weston_wm_window_set_pending_state(struct weston_wm_window *window)
 	weston_wm_window_get_child_position(window, &x, &y);
 
 	pixman_region32_fini(&window->surface->pending.opaque);
-	if (window->has_alpha) {
+	if (window->fullscreen) {
+		/* Nothing shows through a fullscreen window, whatever its
+		 * visual, and there is no frame to filter against. Being
+		 * opaque all over lets its buffer be scanned out. */
+		pixman_region32_init_rect(&window->surface->pending.opaque,
+					  0, 0, width, height);
+	} else if (window->has_alpha) {
 		pixman_region32_init(&window->surface->pending.opaque);
 	} else {
 		/* We leave an extra pixel around the X window area to
@@ -1377,6 +1653,19 @@ weston_wm_window_do_repaint(void *data)
 
 	window->repaint_source = NULL;
 
+	/* Do not wait for the X server here; weston_wm_poll_properties()
+	 * schedules the repaint again once the replies are in. */
+	if (weston_wm_window_poll_properties(window) &&
+	    window->properties_dirty) {
+		weston_wm_window_fetch_properties(window);
+		xcb_flush(window->wm->conn);
+	}
+	if (window->fetch.pending || window->fetch.geometry_pending) {
+		window->repaint_after_fetch = true;
+		return;
+	}
+	window->repaint_after_fetch = false;
+
 	weston_wm_window_set_allow_commits(window, false);
 	weston_wm_window_read_properties(window);
 
@@ -1385,6 +1674,47 @@ weston_wm_window_do_repaint(void *data)
 	weston_wm_window_set_allow_commits(window, true);
 }
 
+static int
+weston_wm_window_repaint_timer(void *data)
+{
+	weston_wm_window_do_repaint(data);
+
+	return 0;
+}
+
+/* How long to wait before drawing the decorations for a new size, so an
+ * interactive resize redraws them at most once per output refresh. */
+static int
+weston_wm_window_resize_delay(struct weston_wm_window *window)
+{
+	struct weston_output *output = NULL;
+	struct timespec now;
+	int64_t period, elapsed;
+	int width, height;
+
+	if (!window->frame || !window->drawn.valid)
+		return 0;
+
+	weston_wm_window_get_frame_size(window, &width, &height);
+	if (width == window->drawn.width && height == window->drawn.height)
+		return 0;
+
+	if (window->surface)
+		output = window->surface->output;
+	if (output && output->current_mode && output->current_mode->refresh > 0)
+		period = millihz_to_nsec(output->current_mode->refresh);
+	else
+		period = millihz_to_nsec(60000);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = timespec_sub_to_nsec(&now, &window->drawn.resize_time);
+	if (elapsed < 0 || elapsed >= period)
+		return 0;
+
+	/* wl_event_source_timer_update() disarms the timer on 0 */
+	return MAX((period - elapsed) / 1000000, 1);
+}
+
 static void
 weston_wm_window_set_pending_state_OR(struct weston_wm_window *window)
 {
@@ -1396,6 +1726,8 @@ weston_wm_window_set_pending_state_OR(struct weston_wm_window *window)
 	if (!window->surface)
 		return;
 
+	weston_wm_window_wait_geometry(window);
+
 	weston_wm_window_get_frame_size(window, &width, &height);
 	pixman_region32_fini(&window->surface->pending.opaque);
 	if (window->has_alpha) {
@@ -1410,6 +1742,7 @@ static void
 weston_wm_window_schedule_repaint(struct weston_wm_window *window)
 {
 	struct weston_wm *wm = window->wm;
+	int delay;
 
 	if (window->frame_id == XCB_WINDOW_NONE) {
 		/* Override-redirect windows go through here, but we
@@ -1424,11 +1757,24 @@ weston_wm_window_schedule_repaint(struct weston_wm_window *window)
 	if (window->repaint_source)
 		return;
 
-	wm_printf(wm, "XWM: schedule repaint, win %d\n", window->id);
+	delay = weston_wm_window_resize_delay(window);
+
+	wm_printf(wm, "XWM: schedule repaint, win %d, delay %d ms\n",
+		  window->id, delay);
+
+	if (delay == 0) {
+		window->repaint_source =
+			wl_event_loop_add_idle(wm->server->loop,
+					       weston_wm_window_do_repaint,
+					       window);
+		return;
+	}
 
 	window->repaint_source =
-		wl_event_loop_add_idle(wm->server->loop,
-				       weston_wm_window_do_repaint, window);
+		wl_event_loop_add_timer(wm->server->loop,
+					weston_wm_window_repaint_timer, window);
+	if (window->repaint_source)
+		wl_event_source_timer_update(window->repaint_source, delay);
 }
 
 static void
@@ -1445,7 +1791,11 @@ weston_wm_handle_property_notify(struct weston_wm *wm, xcb_generic_event_t *even
 	if (!wm_lookup_window(wm, property_notify->window, &window))
 		return;
 
+	/* If a fetch is already on its way, its replies may predate this
+	 * change; it is sent again once they are in. */
 	window->properties_dirty = 1;
+	if (!window->fetch.pending)
+		weston_wm_window_fetch_properties(window);
 
 	if (wm_debug_is_enabled(wm))
 		fp = open_memstream(&logstr, &logsize);
@@ -1466,12 +1816,6 @@ weston_wm_handle_property_notify(struct weston_wm *wm, xcb_generic_event_t *even
 			weston_log_scope_write(wm->server->wm_debug,
 						 logstr, logsize);
 		free(logstr);
-	} else {
-		/* read_and_dump_property() is a X11 roundtrip.
-		 * Mimic it to maintain ordering semantics between debug
-		 * and non-debug paths.
-		 */
-		get_atom_name(wm->conn, property_notify->atom);
 	}
 
 	if (property_notify->atom == wm->atom.net_wm_name ||
@@ -1485,8 +1829,6 @@ weston_wm_window_create(struct weston_wm *wm,
 {
 	struct weston_wm_window *window;
 	uint32_t values[1];
-	xcb_get_geometry_cookie_t geometry_cookie;
-	xcb_get_geometry_reply_t *geometry_reply;
 
 	window = zalloc(sizeof *window);
 	if (window == NULL) {
@@ -1494,7 +1836,7 @@ weston_wm_window_create(struct weston_wm *wm,
 		return;
 	}
 
-	geometry_cookie = xcb_get_geometry(wm->conn, id);
+	window->fetch.geometry_cookie = xcb_get_geometry(wm->conn, id);
 
 	values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE |
                     XCB_EVENT_MASK_FOCUS_CHANGE;
@@ -1513,12 +1855,10 @@ weston_wm_window_create(struct weston_wm *wm,
 	window->map_request_y = INT_MIN; /* out of range for valid positions */
 	weston_output_weak_ref_init(&window->legacy_fullscreen_output);
 
-	geometry_reply = xcb_get_geometry_reply(wm->conn, geometry_cookie, NULL);
-	/* technically we should use XRender and check the visual format's
-	alpha_mask, but checking depth is simpler and works in all known cases */
-	if (geometry_reply != NULL)
-		window->has_alpha = geometry_reply->depth == 32;
-	free(geometry_reply);
+	/* The replies are usually in by the time MapRequest needs them. */
+	wl_list_init(&window->fetch.link);
+	window->fetch.geometry_pending = true;
+	weston_wm_window_fetch_properties(window);
 
 	hash_table_insert(wm->window_hash, id, window);
 }
@@ -1530,6 +1870,11 @@ weston_wm_window_destroy(struct weston_wm_window *window)
 
 	weston_output_weak_ref_clear(&window->legacy_fullscreen_output);
 
+	weston_wm_window_discard_properties(window);
+	if (window->fetch.geometry_pending)
+		xcb_discard_reply(wm->conn, window->fetch.geometry_cookie.sequence);
+	wl_list_remove(&window->fetch.link);
+
 	if (window->configure_source)
 		wl_event_source_remove(window->configure_source);
 	if (window->repaint_source)
@@ -1981,25 +2326,52 @@ static const struct cursor_alternatives cursors[] = {
 	{left_ptrs, ARRAY_LENGTH(left_ptrs)},
 };
 
+/* Cursors are only looked up in the theme the first time they are set on
+ * a window, most sessions never use most of the resize cursors. */
 static void
 weston_wm_create_cursors(struct weston_wm *wm)
 {
-	const char *name;
-	int i, count = ARRAY_LENGTH(cursors);
+	char *v;
+
+	static_assert(ARRAY_LENGTH(cursors) <= 32,
+		      "cursors_loaded is too small");
+
+	wm->cursors = calloc(ARRAY_LENGTH(cursors), sizeof(xcb_cursor_t));
+	wm->cursors_loaded = 0;
+
+	v = getenv("XCURSOR_SIZE");
+	wm->cursor_size = v ? atoi(v) : 0;
+	if (wm->cursor_size <= 0)
+		wm->cursor_size = 32;
+
+	wm->last_cursor = -1;
+}
+
+static xcb_cursor_t
+weston_wm_get_cursor(struct weston_wm *wm, int cursor)
+{
+	xcb_cursor_t xcursor = -1;
 	size_t j;
 
-	wm->cursors = malloc(count * sizeof(xcb_cursor_t));
-	for (i = 0; i < count; i++) {
-		for (j = 0; j < cursors[i].count; j++) {
-			name = cursors[i].names[j];
-			wm->cursors[i] =
-				xcb_cursor_library_load_cursor(wm, name);
-			if (wm->cursors[i] != (xcb_cursor_t)-1)
-				break;
-		}
+	if (wm->cursors_loaded & (1u << cursor))
+		return wm->cursors[cursor];
+
+	for (j = 0; j < cursors[cursor].count; j++) {
+		xcursor = xcb_cursor_library_load_cursor(wm,
+							 cursors[cursor].names[j]);
+		if (xcursor != (xcb_cursor_t)-1)
+			break;
 	}
 
-	wm->last_cursor = -1;
+	/* Remember failures too, so a missing theme is only searched
+	 * once; None makes the window use its parent's cursor. */
+	if (xcursor == (xcb_cursor_t)-1)
+		xcursor = XCB_CURSOR_NONE;
+
+	wm->cursors[cursor] = xcursor;
+	wm->cursors_loaded |= 1u << cursor;
+
+	return xcursor;
 }
 
 static void
@@ -2007,8 +2379,11 @@ weston_wm_destroy_cursors(struct weston_wm *wm)
 {
 	uint8_t i;
 
-	for (i = 0; i < ARRAY_LENGTH(cursors); i++)
-		xcb_free_cursor(wm->conn, wm->cursors[i]);
+	for (i = 0; i < ARRAY_LENGTH(cursors); i++) {
+		if ((wm->cursors_loaded & (1u << i)) &&
+		    wm->cursors[i] != XCB_CURSOR_NONE)
+			xcb_free_cursor(wm->conn, wm->cursors[i]);
+	}
 
 	free(wm->cursors);
 }
@@ -2051,7 +2426,7 @@ weston_wm_window_set_cursor(struct weston_wm *wm, xcb_window_t window_id,
 
 	wm->last_cursor = cursor;
 
-	cursor_value_list = wm->cursors[cursor];
+	cursor_value_list = weston_wm_get_cursor(wm, cursor);
 	xcb_change_window_attributes (wm->conn, window_id,
 				      XCB_CW_CURSOR, &cursor_value_list);
 	xcb_flush(wm->conn);
@@ -2325,6 +2700,8 @@ weston_wm_handle_event(int fd, uint32_t mask, void *data)
 		count++;
 	}
 
+	count += weston_wm_poll_properties(wm);
+
 	if (count != 0)
 		xcb_flush(wm->conn);
 
@@ -2464,6 +2841,12 @@ weston_wm_get_resources(struct weston_wm *wm)
 					      strlen(atoms[i].name),
 					      atoms[i].name);
 
+	/* Issued before collecting the atoms so that both round trips
+	 * overlap. */
+	xfixes_cookie = xcb_xfixes_query_version(wm->conn,
+						 XCB_XFIXES_MAJOR_VERSION,
+						 XCB_XFIXES_MINOR_VERSION);
+
 	for (i = 0; i < ARRAY_LENGTH(atoms); i++) {
 		reply = xcb_intern_atom_reply (wm->conn, cookies[i], NULL);
 		*(xcb_atom_t *) ((char *) wm + atoms[i].offset) = reply->atom;
@@ -2474,9 +2857,6 @@ weston_wm_get_resources(struct weston_wm *wm)
 	if (!wm->xfixes || !wm->xfixes->present)
 		weston_log("xfixes not available\n");
 
-	xfixes_cookie = xcb_xfixes_query_version(wm->conn,
-						 XCB_XFIXES_MAJOR_VERSION,
-						 XCB_XFIXES_MINOR_VERSION);
 	xfixes_reply = xcb_xfixes_query_version_reply(wm->conn,
 						      xfixes_cookie, NULL);
 
@@ -2581,6 +2961,7 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 		free(wm);
 		return NULL;
 	}
+	wl_list_init(&wm->property_fetch_list);
 
 	/* xcb_connect_to_fd takes ownership of the fd. */
 	wm->conn = xcb_connect_to_fd(fd, NULL);
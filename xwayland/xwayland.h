@@ -67,6 +67,8 @@ struct weston_wm {
 	struct weston_wm_window *focus_window;
 	struct theme *theme;
 	xcb_cursor_t *cursors;
+	uint32_t cursors_loaded;
+	int cursor_size;
 	int last_cursor;
 	xcb_render_pictforminfo_t format_rgb, format_rgba;
 	xcb_visualid_t visual_id;
@@ -75,6 +77,7 @@ struct weston_wm {
 	struct wl_listener activate_listener;
 	struct wl_listener kill_listener;
 	struct wl_list unpaired_window_list;
+	struct wl_list property_fetch_list;	/* weston_wm_window::fetch.link */
 
 	xcb_window_t selection_window;
 	xcb_window_t selection_owner;
@@ -83,6 +86,7 @@ struct weston_wm {
 	struct wl_event_source *property_source;
 	xcb_get_property_reply_t *property_reply;
 	int property_start;
+	uint32_t property_offset;	/* next slice, in 32-bit units */
 	struct wl_array source_data;
 	xcb_selection_request_event_t selection_request;
 	xcb_atom_t selection_target;